@@ -7,410 +7,2890 @@
  */
 
 #include "backup.h"
+#include "catalog.h"
 #include "filehelper.h"
 #include "crypt/crypt_easy.h"
 #include "crypt/crypt_getpassword.h"
+#include "crypt/crypt_session.h"
 #include "fileiterator.h"
+#include "exclude.h"
+#include "changejournal.h"
+#include "snapshot.h"
 #include "log.h"
 #include "checksum.h"
+#include "checksumsort.h"
 #include "options/options.h"
 #include "strings/stringhelper.h"
 #include "strings/stringarray.h"
 #include "compression/zip.h"
 #include "cloud/base.h"
+#include "cloudsync.h"
+#include "threadpool.h"
+#include "pipeline.h"
+#include "chunkstore.h"
+#include "pack.h"
+#include "progressbar.h"
+#include "stats.h"
+#include "trace.h"
+#include "treehash.h"
+#include "xattrcache.h"
+#include "zipauto.h"
+#include "membudget.h"
+#include "moveindex.h"
+#include "devsched.h"
+#include "policy.h"
+#include "pressure.h"
+#include "rdelta.h"
 #include "readline_include.h"
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <sys/stat.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #define UNUSED(x) ((void)x)
 
-static int make_internal_directory_paths(const char* dir, char** dir_files, char** dir_deltas){
-	int ret = 0;
-	if (dir_files){
-		*dir_files = sh_concat_path(sh_dup(dir), "/files");
-		if (!(*dir_files)){
-			log_error("Failed to create dir_files.");
-			ret = -1;
-			goto cleanup;
+/* how many finished files can wait for the uploader before the workers block */
+#define UPLOAD_QUEUE_LEN 64
+/* how many files can be queued for the workers, and so how far ahead of them the prefetcher can read */
+#define PREFETCH_AHEAD 32
+/* how often, in seconds, an interrupted backup can be resumed from */
+#define CHECKPOINT_INTERVAL 60
+/* how much of the small files a dictionary is trained from */
+#define DICT_SAMPLE_LEN ((size_t)ZIP_DICT_LEN * 100)
+/* how much of the files being backed up the compressor is picked from, and how much of that can come from one file
+ * and how much has to be compressed before the level is checked against the target again */
+#define ZIP_SAMPLE_LEN ((size_t)1 << 22)
+#define ZIP_SAMPLE_FILE_LEN ((size_t)1 << 18)
+#define RETUNE_LEN ((uint64_t)1 << 30)
+/* files shorter than this are never split over compression workers, however long the others take */
+#define STRAGGLER_MIN_LEN ((uint64_t)1 << 28)
+/* found_meta.res when the walk could not describe the file, so process_file() has to stat() it itself */
+#define META_UNKNOWN (-2)
+
+/* where a file's output goes under files/, where its old output goes under deltas/, and the directories they are in */
+struct file_paths{
+	struct path_builder files;
+	struct path_builder delta;
+	struct path_builder files_parent;
+	struct path_builder delta_parent;
+};
+
+/* every thread that backs up or uploads files reuses its own paths, so building them does not allocate once the buffers are big enough
+ * the cloud's are kept apart because an upload can run on the same thread while the output paths are still in use */
+struct thread_paths{
+	struct file_paths local;
+	struct file_paths cloud;
+};
+
+static pthread_key_t paths_key;
+static pthread_once_t paths_once = PTHREAD_ONCE_INIT;
+
+static void file_paths_free(struct file_paths* fp){
+	pb_free(&fp->files);
+	pb_free(&fp->delta);
+	pb_free(&fp->files_parent);
+	pb_free(&fp->delta_parent);
+}
+
+static void thread_paths_free(void* data){
+	struct thread_paths* tp = data;
+
+	file_paths_free(&tp->local);
+	file_paths_free(&tp->cloud);
+	free(tp);
+}
+
+static void make_paths_key(void){
+	pthread_key_create(&paths_key, thread_paths_free);
+}
+
+static struct thread_paths* get_thread_paths(void){
+	struct thread_paths* tp;
+
+	pthread_once(&paths_once, make_paths_key);
+	if ((tp = pthread_getspecific(paths_key)) != NULL){
+		return tp;
+	}
+	if (!(tp = calloc(1, sizeof(*tp)))){
+		log_enomem();
+		return NULL;
+	}
+	pthread_setspecific(paths_key, tp);
+	return tp;
+}
+
+/* fills out with base_directory/files/file and base_directory/deltas/file.delta_extension, and their parents */
+static int make_file_paths(const char* file, const char* base_directory, const char* delta_extension, struct file_paths* out){
+	if (!base_directory){
+		log_warning("output_directory is NULL when it is needed to determine out_file_path or out_delta_path.");
+		return -1;
+	}
+	if (!out){
+		log_enomem();
+		return -1;
+	}
+
+	if (pb_set(&out->files, base_directory) != 0 ||
+			pb_append_path(&out->files, "/files") != 0 ||
+			pb_append_path(&out->files, file) != 0){
+		log_error("Failed to create out_file_path.");
+		return -1;
+	}
+	if (pb_set(&out->delta, base_directory) != 0 ||
+			pb_append_path(&out->delta, "/deltas") != 0 ||
+			pb_append_path(&out->delta, file) != 0 ||
+			pb_append(&out->delta, ".") != 0 ||
+			pb_append(&out->delta, delta_extension) != 0){
+		log_error("Failed to create out_delta_path.");
+		return -1;
+	}
+	if (pb_set_parent(&out->files_parent, out->files.str) != 0 ||
+			pb_set_parent(&out->delta_parent, out->delta.str) != 0){
+		log_error("Failed to create parent directories.");
+		return -1;
+	}
+	return 0;
+}
+
+/* makes room for a file's new version in the cloud, moving the old one to its delta path
+ * in_cloud is whether the old version is there if the cloud is in sync with the output directory, or negative if the cloud has to be asked
+ * out_cloud_path is where the new version goes, which stays valid until the calling thread prepares another file */
+static int cloud_prepare_single_file(const char* file_orig_path, const char* cloud_directory, struct cloud_data* cd, const char* delta_extension, int in_cloud, const char** out_cloud_path){
+	struct thread_paths* tp = get_thread_paths();
+	struct file_paths* cloud;
+
+	if (!tp || make_file_paths(file_orig_path, cloud_directory, delta_extension, &tp->cloud) != 0){
+		log_error("Failed to create cloud paths.");
+		return -1;
+	}
+	cloud = &tp->cloud;
+
+	/* this also tells cloud_mkdir() and cloud_rename() that its parent directories are there */
+	if (in_cloud > 0 && cloud_assume_file(cloud->files.str, cd) != 0){
+		in_cloud = -1;
+	}
+
+	if (cloud_mkdir(cloud->files_parent.str, cd) < 0){
+		log_warning_ex("Failed to create file parent directory %s.", cloud->files_parent.str);
+		return -1;
+	}
+
+	if (in_cloud > 0 || (in_cloud < 0 && cloud_stat(cloud->files.str, NULL, cd) == 0)){
+		if (cloud_mkdir(cloud->delta_parent.str, cd) < 0){
+			log_warning_ex("Failed to create delta parent directory %s.", cloud->delta_parent.str);
+		}
+		else if (cloud_rename(cloud->files.str, cloud->delta.str, cd) != 0){
+			log_warning_ex("Failed to create delta for %s.", cloud->files.str);
 		}
 	}
-	if (dir_deltas){
-		*dir_deltas = sh_concat_path(sh_dup(dir), "/deltas");
-		if (!(*dir_deltas)){
-			log_error("Failed to create dir_deltas.");
-			ret = -1;
-			goto cleanup;
+
+	*out_cloud_path = cloud->files.str;
+	return 0;
+}
+
+/* a cloud the output files are uploaded to, with its own session and its own record of what it has
+ * the first one is --cloud, and the rest are --mirror */
+struct cloud_target{
+	struct cloud_options* co;
+	struct cloud_data* cd;
+	/* the uploads log of this cloud, since an upload can fail for one cloud and not another */
+	char* uploads_path;
+	/* the cloud was in sync with the output directory when the backup started, so a file's old output says whether it is in the cloud too
+	 * set by copy_files() to whether it still will be once the checksum file is finished */
+	int cloud_synced;
+	/* the manifest in the cloud matched the last backup's checksum file, so committing this one's only has to upload what changed */
+	int manifest_matched;
+	/* uploads to cd, or NULL to upload on the calling thread */
+	struct threadpool* upload_tp;
+	/* keeps several uploads to cd in flight, or NULL to upload one file at a time */
+	struct cloud_transfers* transfers;
+	/* the cloud session is not safe to share between threads */
+	pthread_mutex_t cloud_mutex;
+	/* something that went into the output directory did not make it to this cloud, guarded by the copy_context's upload_mutex */
+	int cloud_failed;
+	/* the uploads log, or NULL if it could not be opened, which is also written under upload_mutex */
+	FILE* fp_uploads;
+};
+
+/* state shared by every file copied during copy_files() */
+struct copy_context{
+	const struct options* opt;
+	const char* delta_extension;
+	/* NULL unless files are split into the chunk store */
+	const char* chunk_directory;
+	/* NULL unless small files are grouped into pack segments */
+	struct pack_writer* pw;
+	const char* password;
+	/* the journal of finished files, which becomes the next checksum file */
+	FILE* fp_checksum;
+	/* records how much of the journal can be trusted if the backup is interrupted */
+	const char* checkpoint_path;
+	time_t last_checkpoint;
+	long journal_len;
+	pthread_mutex_t checkpoint_mutex;
+	/* every output file is uploaded to each of these, and there are none without a cloud */
+	struct cloud_target* targets;
+	size_t n_targets;
+	/* guards the upload counters, and is never held while waiting on the cloud */
+	pthread_mutex_t upload_mutex;
+	unsigned long uploads_queued;
+	unsigned long uploads_done;
+	pthread_cond_t upload_cond;
+	/* progress bars from concurrent workers would overwrite each other */
+	int verbose;
+	/* the previous checksums were made with a different hash algorithm */
+	int rehash;
+	/* files are read from these snapshots instead of where they are named, or this is NULL */
+	const struct snapshot_set* ss;
+	/* starts reading queued files into the page cache before a worker gets to them, or NULL */
+	struct threadpool* prefetch_tp;
+	/* the level that keeps up with opt->c_target, which is adjusted as the real throughput becomes known
+	 * the compression totals it was last checked against, and how many files are compressed at once */
+	pthread_mutex_t level_mutex;
+	int c_level;
+	uint64_t retune_bytes;
+	double retune_wall;
+	size_t n_streams;
+	/* the outputs a new file can be linked to if it has the same contents, or NULL
+	 * only files at least move_min_size bytes are in it, since smaller ones are packed or are not worth hashing ahead of copying */
+	struct move_index* mi;
+	uint64_t move_min_size;
+	/* files at least this long would still be compressed after every other file is done, so they are split over compression workers, or 0 if none are
+	 * and the most workers one of them gets */
+	uint64_t straggler_len;
+	unsigned straggler_workers;
+	/* the workers the pressure governor holds back, which is NULL once they are being freed, under level_mutex */
+	struct dev_sched* governed;
+	/* the rules that back up some files with a different compressor or without encryption */
+	struct policy_set* policies;
+};
+
+/* a file's metadata from the lstat() the directory walk already did on it */
+struct found_meta{
+	struct file_meta meta;
+	/* what file_meta_from_stat() returned for it, or META_UNKNOWN */
+	int res;
+};
+
+/* the files found by the walk, which are sorted before they are matched against the previous checksum file */
+struct found_list{
+	struct found_file{
+		char* file;
+		struct found_meta found;
+	}* files;
+	size_t len;
+	size_t size;
+};
+
+/* a single file waiting to be checksummed and copied */
+struct copy_job{
+	char* file;
+	/* the file's entry in the previous checksum file, or NULL if it was not there */
+	struct element* prev;
+	struct found_meta found;
+	struct copy_context* ctx;
+};
+
+/* the directories on one device, which are walked and fed to the workers alongside every other device's */
+struct device_lane{
+	struct copy_context* ctx;
+	struct dev_sched* ds;
+	struct exclude_trie* ex;
+	/* the lane of each of the directories being backed up, and this one's */
+	const size_t* dir_lanes;
+	size_t lane;
+	/* the files its walk found, or NULL if they are submitted as soon as they are found */
+	struct found_list* pending;
+	/* the files that have to be read, which wait here until every one is known so the longest can start first */
+	struct copy_job** jobs;
+	size_t n_jobs;
+	size_t size_jobs;
+};
+
+/* an output file waiting for the uploader threads, which is shared by its jobs for each cloud */
+struct upload_item{
+	/* the original file, or NULL for a pack segment */
+	char* file;
+	/* the output file under files/, or the pack segment */
+	char* path;
+	/* the pack segment's index, or NULL */
+	char* index;
+	/* chunks that have to be uploaded before the manifest at path, or NULL */
+	struct string_array* chunks;
+	/* path replaced an older output file, which only says something if the cloud is synced, or negative if that is not known */
+	int replaced;
+	/* the jobs that have not finished, and whether any of them failed, which are guarded by ctx->upload_mutex
+	 * the item is freed along with the last job */
+	unsigned jobs;
+	int failed;
+};
+
+/* an output file going to one cloud */
+struct upload_job{
+	struct copy_context* ctx;
+	struct cloud_target* target;
+	struct upload_item* item;
+	/* the job's transfers still in flight, plus one held by upload_file() while it submits them
+	 * these and failed are guarded by ctx->upload_mutex */
+	unsigned pending;
+	int failed;
+	struct stats_time start;
+	uint64_t bytes;
+};
+
+static void upload_item_free(struct upload_item* item){
+	free(item->file);
+	free(item->path);
+	free(item->index);
+	item->chunks ? sa_free(item->chunks) : (void)0;
+	free(item);
+}
+
+/* the uploads log lists every output file queued for the cloud ('+') and every one that made it there ('-'),
+ * so the uploads a backup could not finish are queued again by the next one instead of being left out of the cloud for good
+ * a record is its tag followed by its fields, each ending in '\0', and then a '\n'
+ * a '+' has the output file, the original file, the pack index, and any chunks, while a '-' only has the output file
+ * must be called with upload_mutex held */
+static void log_upload(struct cloud_target* target, const struct upload_item* item, char tag){
+	size_t i;
+
+	if (!target->fp_uploads){
+		return;
+	}
+	fputc(tag, target->fp_uploads);
+	fprintf(target->fp_uploads, "%s%c", item->path, '\0');
+	if (tag == '+'){
+		fprintf(target->fp_uploads, "%s%c%s%c", item->file ? item->file : "", '\0', item->index ? item->index : "", '\0');
+		for (i = 0; item->chunks && i < item->chunks->len; ++i){
+			fprintf(target->fp_uploads, "%s%c", item->chunks->strings[i], '\0');
 		}
 	}
-cleanup:
-	if (ret != 0){
-		dir_files ? free(*dir_files) : (void)0;
-		dir_deltas ? free(*dir_deltas) : (void)0;
+	if (fputc('\n', target->fp_uploads) == EOF || fflush(target->fp_uploads) != 0){
+		log_warning_ex("Failed to write to the uploads log for %s. An upload that fails now is not retried by the next backup.", target->co->upload_directory);
+		fclose(target->fp_uploads);
+		target->fp_uploads = NULL;
+	}
+}
+
+/* called once for each of a job's transfers as it finishes, and once by upload_file() when it is done submitting them
+ * the job is finished and freed once all of them have been, and the item once every cloud's job has */
+static void upload_job_release(struct upload_job* job, int res){
+	struct copy_context* ctx = job->ctx;
+	struct upload_item* item = job->item;
+	int finished;
+	int last = 0;
+
+	pthread_mutex_lock(&ctx->upload_mutex);
+	if (res != 0){
+		job->failed = 1;
+	}
+	finished = --job->pending == 0;
+	if (finished){
+		stats_record(STAGE_UPLOAD, &job->start, job->bytes, job->bytes, 1);
+		trace_since(stats_stage_tostring(STAGE_UPLOAD), &job->start, item->file ? item->file : item->path);
+		ctx->uploads_done++;
+		/* warned about here, since another cloud's job can free the item as soon as this one lets go of it */
+		if (job->failed){
+			log_warning_ex2("Failed to upload %s to %s", item->file ? item->file : item->path, job->target->co->upload_directory);
+			job->target->cloud_failed = 1;
+			item->failed = 1;
+		}
+		/* a failed one stays in the log, so the next backup tries it again */
+		else{
+			log_upload(job->target, item, '-');
+		}
+		last = --item->jobs == 0;
+	}
+	pthread_cond_broadcast(&ctx->upload_cond);
+	pthread_mutex_unlock(&ctx->upload_mutex);
+
+	if (finished){
+		free(job);
+	}
+	if (last){
+		/* an output file only stays around until every cloud has it
+		 * the chunk store and pack segments are still needed to write the next ones */
+		if (!item->failed && ctx->opt->flags.bits.flag_cloud_only && item->file && !item->chunks && remove(item->path) != 0){
+			log_warning_ex2("Failed to remove %s (%s)", item->path, strerror(errno));
+		}
+		upload_item_free(item);
+	}
+}
+
+static void on_transfer_done(int res, void* data){
+	upload_job_release(data, res);
+}
+
+/* uploads one of a job's files, without waiting for it if the transfers allow */
+static int upload_job_submit(struct upload_job* job, const char* in_file, const char* cloud_path){
+	struct copy_context* ctx = job->ctx;
+	struct cloud_target* target = job->target;
+
+	pthread_mutex_lock(&ctx->upload_mutex);
+	job->pending++;
+	pthread_mutex_unlock(&ctx->upload_mutex);
+
+	if (!target->transfers){
+		int res = cloud_upload(in_file, cloud_path, target->cd);
+
+		upload_job_release(job, res);
+		return res;
+	}
+	if (cloud_upload_submit(target->transfers, in_file, cloud_path, on_transfer_done, job) != 0){
+		upload_job_release(job, -1);
+		return -1;
 	}
 	return 0;
 }
 
-static int make_file_paths(const char* file, const char* base_directory, const char* delta_extension, char** out_file_path, char** out_delta_path){
-	char* output_files = NULL;
-	char* output_deltas = NULL;
+/* waits until only upload_file()'s own hold on the job is left, returning negative if any of its transfers failed */
+static int upload_job_wait(struct upload_job* job){
+	struct copy_context* ctx = job->ctx;
+	int failed;
+
+	pthread_mutex_lock(&ctx->upload_mutex);
+	while (job->pending > 1){
+		pthread_cond_wait(&ctx->upload_cond, &ctx->upload_mutex);
+	}
+	failed = job->failed;
+	pthread_mutex_unlock(&ctx->upload_mutex);
+	return failed ? -1 : 0;
+}
+
+/* chunks keep the same path relative to the backup directory in the cloud */
+static int cloud_copy_chunks(struct upload_job* job){
+	struct copy_context* ctx = job->ctx;
+	struct cloud_target* target = job->target;
+	const struct string_array* chunks = job->item->chunks;
+	size_t base_len = strlen(ctx->opt->output_directory);
+	size_t i;
 	int ret = 0;
 
-	if (out_file_path || out_delta_path){
-		if (!base_directory){
-			log_warning("output_directory is NULL when it is needed to determine out_file_path or out_delta_path.");
+	for (i = 0; i < chunks->len; ++i){
+		const char* chunk = chunks->strings[i];
+		char* cloud_path = NULL;
+		char* cloud_parent = NULL;
+
+		if (!(cloud_path = sh_concat_path(sh_dup(target->co->upload_directory), chunk + base_len)) ||
+				!(cloud_parent = sh_parent_dir(cloud_path))){
+			log_warning("Failed to create cloud chunk path.");
 			ret = -1;
-			goto cleanup;
 		}
-		if (make_internal_directory_paths(base_directory, &output_files, &output_deltas) != 0){
-			log_error("Failed to determine internal directory paths.");
+		else if (cloud_mkdir(cloud_parent, target->cd) < 0){
+			log_warning_ex("Failed to create chunk directory %s.", cloud_parent);
 			ret = -1;
-			goto cleanup;
 		}
-	}
-
-	if (out_file_path){
-		*out_file_path = sh_concat_path(sh_dup(output_files), file);
-		if (!(*out_file_path)){
-			log_error("Failed to create out_file_path.");
+		else if (upload_job_submit(job, chunk, cloud_path) != 0){
+			log_error_ex("Failed to upload %s to the cloud.", chunk);
 			ret = -1;
-			goto cleanup;
 		}
+		free(cloud_path);
+		free(cloud_parent);
+	}
+	return ret;
+}
+
+/* pack segments are uploaded as a whole once they are closed */
+static int cloud_copy_pack_segment(struct upload_job* job){
+	struct cloud_target* target = job->target;
+	const char* paths[2];
+	char* cloud_parent = NULL;
+	size_t i;
+	int ret = 0;
+
+	paths[0] = job->item->path;
+	paths[1] = job->item->index;
+
+	if (!(cloud_parent = sh_concat_path(sh_dup(target->co->upload_directory), "/packs"))){
+		log_warning("Failed to create cloud pack directory path.");
+		ret = -1;
+		goto cleanup;
+	}
+	if (cloud_mkdir(cloud_parent, target->cd) < 0){
+		log_warning_ex("Failed to create pack directory %s.", cloud_parent);
+		ret = -1;
+		goto cleanup;
 	}
-	if (out_delta_path){
-		*out_delta_path = sh_concat_path(sh_dup(output_deltas), file);
-		*out_delta_path = sh_concat(*out_delta_path, ".");
-		*out_delta_path = sh_concat(*out_delta_path, delta_extension);
-		if (!(*out_delta_path)){
-			log_error("Failed to create out_delta_path.");
+	for (i = 0; i < sizeof(paths) / sizeof(paths[0]); ++i){
+		const char* base = strrchr(paths[i], '/');
+		char* cloud_path = sh_concat_path(sh_dup(cloud_parent), base ? base + 1 : paths[i]);
+
+		if (!cloud_path || upload_job_submit(job, paths[i], cloud_path) != 0){
+			log_error_ex("Failed to upload %s to the cloud.", paths[i]);
 			ret = -1;
-			goto cleanup;
 		}
+		free(cloud_path);
 	}
 
 cleanup:
-	if (ret != 0){
-		out_file_path ? free(*out_file_path) : (void)0;
-		out_delta_path ? free(*out_delta_path) : (void)0;
-	}
-	free(output_files);
-	free(output_deltas);
+	free(cloud_parent);
 	return ret;
 }
 
-static int cloud_copy_single_file(const char* file_orig_path, const char* file_final, const char* cloud_directory, struct cloud_data* cd, const char* delta_extension){
-	char* cloud_path_files = NULL;
-	char* cloud_path_delta = NULL;
-	char* cloud_parent_files = NULL;
-	char* cloud_parent_delta = NULL;
+/* runs on the cloud's uploader thread, so compression never waits on the network
+ * the uploads themselves are only started here, and the job finishes when the last of them does */
+static void upload_file(void* arg){
+	struct upload_job* job = arg;
+	struct cloud_target* target = job->target;
+	const struct upload_item* item = job->item;
+	const char* cloud_path = NULL;
+	int res = 0;
+	size_t i;
+
+	/* the chunks and the pack index go up with the file they belong to */
+	job->bytes = get_file_size(item->path);
+	if (item->index){
+		job->bytes += get_file_size(item->index);
+	}
+	for (i = 0; item->chunks && i < item->chunks->len; ++i){
+		job->bytes += get_file_size(item->chunks->strings[i]);
+	}
+	job->pending = 1;
+	stats_time_now(&job->start);
+
+	pthread_mutex_lock(&target->cloud_mutex);
+	if (item->index){
+		res = cloud_copy_pack_segment(job);
+	}
+	else{
+		/* the chunks have to be there before the manifest that refers to them */
+		if (item->chunks && (cloud_copy_chunks(job) != 0 || upload_job_wait(job) != 0)){
+			res = -1;
+		}
+		else if (cloud_prepare_single_file(item->file, target->co->upload_directory, target->cd, job->ctx->delta_extension, target->cloud_synced ? item->replaced : -1, &cloud_path) != 0 ||
+				upload_job_submit(job, item->path, cloud_path) != 0){
+			res = -1;
+		}
+	}
+	pthread_mutex_unlock(&target->cloud_mutex);
+
+	upload_job_release(job, res);
+}
+
+/* a cloud no longer has everything the checksum file says it does
+ * target is that cloud, or NULL if none of them do */
+static void mark_cloud_failed(struct copy_context* ctx, struct cloud_target* target){
+	size_t i;
+
+	pthread_mutex_lock(&ctx->upload_mutex);
+	for (i = 0; i < ctx->n_targets; ++i){
+		if (!target || target == &ctx->targets[i]){
+			ctx->targets[i].cloud_failed = 1;
+		}
+	}
+	pthread_mutex_unlock(&ctx->upload_mutex);
+}
+
+/* hands an output file to the uploader threads of the clouds from targets[0] to targets[n_targets - 1], blocking while a queue is full
+ * the file is only read from disk by the uploads, so compressing and encrypting it is paid for once no matter how many clouds there are
+ * replaced is whether path replaced an older output file
+ * takes ownership of chunks */
+static int queue_upload_to(struct copy_context* ctx, struct cloud_target* targets, size_t n_targets, const char* file, const char* path, const char* index, struct string_array* chunks, int replaced){
+	struct upload_item* item;
+	struct upload_job** jobs = NULL;
+	size_t i;
+
+	item = calloc(1, sizeof(*item));
+	if (!item){
+		log_enomem();
+		chunks ? sa_free(chunks) : (void)0;
+		mark_cloud_failed(ctx, n_targets == 1 ? targets : NULL);
+		return -1;
+	}
+	item->chunks = chunks;
+	item->replaced = replaced;
+	if ((file && !(item->file = sh_dup(file))) ||
+			!(item->path = sh_dup(path)) ||
+			(index && !(item->index = sh_dup(index))) ||
+			!(jobs = calloc(n_targets, sizeof(*jobs)))){
+		log_enomem();
+		upload_item_free(item);
+		mark_cloud_failed(ctx, n_targets == 1 ? targets : NULL);
+		return -1;
+	}
+	for (i = 0; i < n_targets; ++i){
+		if (!(jobs[i] = calloc(1, sizeof(*jobs[i])))){
+			log_enomem();
+			break;
+		}
+		jobs[i]->ctx = ctx;
+		jobs[i]->target = &targets[i];
+		jobs[i]->item = item;
+	}
+	if (i < n_targets){
+		for (i = 0; i < n_targets; ++i){
+			free(jobs[i]);
+		}
+		free(jobs);
+		upload_item_free(item);
+		mark_cloud_failed(ctx, n_targets == 1 ? targets : NULL);
+		return -1;
+	}
+
+	/* every job is counted before any of them can finish and free the item */
+	pthread_mutex_lock(&ctx->upload_mutex);
+	item->jobs = (unsigned)n_targets;
+	ctx->uploads_queued += n_targets;
+	for (i = 0; i < n_targets; ++i){
+		log_upload(&targets[i], item, '+');
+	}
+	pthread_mutex_unlock(&ctx->upload_mutex);
+
+	for (i = 0; i < n_targets; ++i){
+		if (!targets[i].upload_tp || tp_submit(targets[i].upload_tp, upload_file, jobs[i]) != 0){
+			upload_file(jobs[i]);
+		}
+	}
+	free(jobs);
+	return 0;
+}
+
+/* hands an output file to every cloud's uploader thread */
+static int queue_upload(struct copy_context* ctx, const char* file, const char* path, const char* index, struct string_array* chunks, int replaced){
+	return queue_upload_to(ctx, ctx->targets, ctx->n_targets, file, path, index, chunks, replaced);
+}
+
+static int on_pack_segment(const char* pack, const char* index, void* data){
+	return queue_upload(data, NULL, pack, index, NULL, 0);
+}
+
+/* a record read back from the uploads log */
+struct upload_record{
+	char* line;
+	size_t len;
+	/* where it was in the log, since only the last record for an output file counts */
+	size_t seq;
+};
+
+static int upload_record_cmp(const void* r1, const void* r2){
+	const struct upload_record* ur1 = r1;
+	const struct upload_record* ur2 = r2;
+	int res = strcmp(ur1->line + 1, ur2->line + 1);
+
+	if (res != 0){
+		return res;
+	}
+	return ur1->seq < ur2->seq ? -1 : ur1->seq > ur2->seq;
+}
+
+/* reads one record up to its '\n', which can have '\0's in it
+ * returns its length, or negative at the end of the log */
+static long read_upload_record(FILE* fp, char** out){
+	char* buf = NULL;
+	size_t len = 0;
+	size_t size = 0;
+	int c;
+
+	*out = NULL;
+	while ((c = fgetc(fp)) != EOF && c != '\n'){
+		if (len + 1 >= size){
+			char* tmp = realloc(buf, size ? size * 2 : 256);
+
+			if (!tmp){
+				log_enomem();
+				free(buf);
+				return -1;
+			}
+			buf = tmp;
+			size = size ? size * 2 : 256;
+		}
+		buf[len++] = c;
+	}
+	/* a record cut off by an interrupted backup has no '\n', and is as good as not being there */
+	if (c == EOF){
+		free(buf);
+		return -1;
+	}
+	if (!buf && !(buf = malloc(1))){
+		log_enomem();
+		return -1;
+	}
+	buf[len] = '\0';
+	*out = buf;
+	return (long)len;
+}
+
+/* queues the uploads a cloud's uploads log has no '-' for again, then starts a new log with them in it
+ * they only go to that cloud, since the others have their own logs
+ * returns how many were queued, or negative if the log could not be started */
+static long resume_uploads(struct copy_context* ctx, struct cloud_target* target){
+	const char* uploads_path = target->uploads_path;
+	struct upload_record* records = NULL;
+	size_t n_records = 0;
+	size_t size = 0;
+	FILE* fp = NULL;
+	long n_queued = 0;
+	long len;
+	char* line;
+	size_t i;
+
+	if (file_exists(uploads_path) && !(fp = fopen(uploads_path, "rb"))){
+		log_efopen(uploads_path);
+	}
+	while (fp && (len = read_upload_record(fp, &line)) >= 0){
+		/* the tag and a path are needed at the very least */
+		if (len < 3 || (line[0] != '+' && line[0] != '-')){
+			free(line);
+			continue;
+		}
+		if (n_records >= size){
+			struct upload_record* tmp = realloc(records, (size ? size * 2 : 64) * sizeof(*tmp));
+
+			if (!tmp){
+				log_enomem();
+				free(line);
+				break;
+			}
+			records = tmp;
+			size = size ? size * 2 : 64;
+		}
+		records[n_records].line = line;
+		records[n_records].len = (size_t)len;
+		records[n_records].seq = n_records;
+		n_records++;
+	}
+	fp ? fclose(fp) : 0;
+
+	pthread_mutex_lock(&ctx->upload_mutex);
+	if (!(target->fp_uploads = fopen(uploads_path, "wb"))){
+		log_efopen(uploads_path);
+	}
+	pthread_mutex_unlock(&ctx->upload_mutex);
+
+	qsort(records, n_records, sizeof(*records), upload_record_cmp);
+	for (i = 0; i < n_records; ++i){
+		const struct upload_record* r = &records[i];
+		const char* fields[3] = {NULL, NULL, NULL};
+		struct string_array* chunks = NULL;
+		const char* p = r->line + 1;
+		const char* end = r->line + r->len;
+		size_t n_fields;
+
+		/* only the last record for an output file says whether it is in the cloud */
+		if (r->line[0] != '+' || (i + 1 < n_records && strcmp(r->line + 1, records[i + 1].line + 1) == 0)){
+			continue;
+		}
+
+		for (n_fields = 0; p < end; p += strlen(p) + 1, n_fields++){
+			if (n_fields < 3){
+				fields[n_fields] = p;
+			}
+			else if ((chunks || (chunks = sa_new()) != NULL) && sa_add(chunks, p) != 0){
+				log_enomem();
+			}
+		}
+		/* a newer backup moved it to its delta, and queued what replaced it itself */
+		if (n_fields < 3 || !file_exists(fields[0])){
+			chunks ? sa_free(chunks) : (void)0;
+			continue;
+		}
+
+		log_info_ex("Uploading %s, which the last backup did not finish", fields[0]);
+		if (queue_upload_to(ctx, target, 1, fields[1][0] ? fields[1] : NULL, fields[0], fields[2][0] ? fields[2] : NULL, chunks, -1) == 0){
+			n_queued++;
+		}
+	}
+
+	for (i = 0; i < n_records; ++i){
+		free(records[i].line);
+	}
+	free(records);
+	return target->fp_uploads ? n_queued : -1;
+}
+
+/* flushes the journal to disk and remembers how long it was
+ * runs while no file can be added to a pack segment, so every packed file in the journal so far is in a closed segment */
+static int sync_journal(void* data){
+	struct copy_context* ctx = data;
+	long len;
+
+	/* a worker may be halfway through writing a record, which the checkpoint must not cut */
+	if ((len = sync_checksum_file(ctx->fp_checksum)) < 0){
+		log_error("Failed to sync the checksum journal");
+		return -1;
+	}
+	ctx->journal_len = len;
+	return 0;
+}
+
+/* makes everything recorded in the journal so far survive an interrupted backup */
+static int checkpoint(struct copy_context* ctx){
+	struct ATOMICFILE* af = NULL;
+	unsigned long uploads_queued;
 	int ret = 0;
 
-	if (make_file_paths(file_orig_path, cloud_directory, delta_extension, &cloud_path_files, &cloud_path_delta) != 0){
-		log_error("Failed to create cloud paths.");
+	if ((ctx->pw ? pack_writer_checkpoint(ctx->pw, sync_journal, ctx) : sync_journal(ctx)) != 0){
 		ret = -1;
 		goto cleanup;
 	}
-
-	cloud_parent_files = sh_parent_dir(cloud_path_files);
-	cloud_parent_delta = sh_parent_dir(cloud_path_delta);
-	if (!cloud_parent_files || !cloud_parent_delta){
-		log_warning("Failed to create parent directories.");
+	/* every file in the journal was written before it was recorded, so one sync now makes all of their outputs durable */
+	if (ctx->opt->flags.bits.flag_durable && sync_filesystem(ctx->opt->output_directory) != 0){
 		ret = -1;
 		goto cleanup;
 	}
 
-	if (cloud_mkdir(cloud_parent_files, cd) < 0){
-		log_warning_ex("Failed to create file parent directory %s.", cloud_parent_files);
+	/* every file in the journal has been queued by now, so waiting for those uploads covers all of them */
+	pthread_mutex_lock(&ctx->upload_mutex);
+	uploads_queued = ctx->uploads_queued;
+	while (ctx->uploads_done < uploads_queued){
+		pthread_cond_wait(&ctx->upload_cond, &ctx->upload_mutex);
+	}
+	pthread_mutex_unlock(&ctx->upload_mutex);
+
+	/* the checkpoint file is replaced in one step so it never holds half a number */
+	if (!(af = atomic_fopen(ctx->checkpoint_path))){
 		ret = -1;
 		goto cleanup;
 	}
-
-	if (cloud_stat(cloud_path_files, NULL, cd) == 0){
-		if (cloud_mkdir(cloud_parent_delta, cd) < 0){
-			log_warning_ex("Failed to create delta parent directory %s.", cloud_parent_delta);
-		}
-		else if (cloud_rename(cloud_path_files, cloud_path_delta, cd) != 0){
-			log_warning_ex("Failed to create delta for %s.", cloud_path_files);
-		}
+	if (fprintf(af->fp, "%ld\n", ctx->journal_len) < 0 || fflush(af->fp) != 0 || fsync(fileno(af->fp)) != 0){
+		log_efwrite(ctx->checkpoint_path);
+		ret = -1;
+		goto cleanup;
 	}
-
-	if (cloud_upload(file_final, cloud_path_files, cd) != 0){
-		log_error_ex("Failed to upload %s to the cloud.", file_final);
+	if (atomic_fcommit(af) != 0){
 		ret = -1;
 		goto cleanup;
 	}
 
 cleanup:
-	free(cloud_path_files);
-	free(cloud_path_delta);
-	free(cloud_parent_files);
-	free(cloud_parent_delta);
+	atomic_fclose(af);
 	return ret;
 }
 
-static int copy_single_file(const char* file, const struct options* opt, const char* delta_extension, struct cloud_data* cd, const char* cloud_directory, const char* password){
-	char* path_files = NULL;
-	char* path_delta = NULL;
-	char* file_parent = NULL;
-	char* delta_parent = NULL;
+/* only one thread checkpoints at a time; the others keep going */
+static void maybe_checkpoint(struct copy_context* ctx){
+	if (!ctx->checkpoint_path || pthread_mutex_trylock(&ctx->checkpoint_mutex) != 0){
+		return;
+	}
+	if (time(NULL) - ctx->last_checkpoint >= CHECKPOINT_INTERVAL){
+		if (checkpoint(ctx) != 0){
+			log_warning("Failed to checkpoint the backup. An interrupted backup may have to redo more files.");
+		}
+		ctx->last_checkpoint = time(NULL);
+	}
+	pthread_mutex_unlock(&ctx->checkpoint_mutex);
+}
+
+/* moves the level one step when the compression throughput since the last check is off from the target
+ * like checkpointing, only one thread does this at a time */
+static void maybe_retune(struct copy_context* ctx){
+	struct stats_entry se;
+	double rate;
+	int level;
+
+	if (ctx->opt->c_target == 0 || pthread_mutex_trylock(&ctx->level_mutex) != 0){
+		return;
+	}
+	stats_get(STAGE_COMPRESS, &se);
+	if (se.bytes_in - ctx->retune_bytes >= RETUNE_LEN && se.time.wall > ctx->retune_wall){
+		/* the time is summed over every worker, so this is what one of them gets through */
+		rate = (double)(se.bytes_in - ctx->retune_bytes) / (se.time.wall - ctx->retune_wall) * ctx->n_streams;
+		level = ctx->c_level;
+		if (rate < (double)ctx->opt->c_target){
+			level = zip_level_step(ctx->opt->c_type, level, 1);
+		}
+		/* the next level is usually about half as fast, so it is only tried with room to spare */
+		else if (rate > (double)ctx->opt->c_target * 2){
+			level = zip_level_step(ctx->opt->c_type, level, 0);
+			/* a slower level usually needs more memory too */
+			level = mem_budget_level_fits(ctx->opt, level) ? level : ctx->c_level;
+		}
+		if (level != ctx->c_level){
+			log_info_ex2("Compressing at %.1f MiB/s, so the level changes to %d", rate / (1 << 20), level);
+			ctx->c_level = level;
+		}
+		ctx->retune_bytes = se.bytes_in;
+		ctx->retune_wall = se.time.wall;
+	}
+	pthread_mutex_unlock(&ctx->level_mutex);
+}
+
+/* adds a small file to the current pack segment instead of giving it its own output file
+ * src is where to read it from, which is file unless it is in a snapshot
+ * out_segment is set to the segment it went to, which has to be closed before the file is recorded */
+static int pack_single_file(const char* file, const char* src, struct copy_context* ctx, char** out_hash, unsigned long* out_segment){
+	struct thread_paths* tp = get_thread_paths();
+	struct file_paths* local = tp ? &tp->local : NULL;
 	int ret = 0;
 
-	if (make_file_paths(file, opt->output_directory, delta_extension, &path_files, &path_delta) != 0){
+	if (make_file_paths(file, ctx->opt->output_directory, ctx->delta_extension, local) != 0){
 		log_error("Failed determining file path or delta path");
 		ret = -1;
 		goto cleanup;
 	}
 
-	file_parent = sh_parent_dir(path_files);
-	delta_parent = sh_parent_dir(path_delta);
-	if (mkdir_recursive(file_parent) < 0 || mkdir_recursive(delta_parent) < 0){
-		log_warning("Failed to make one or more parent directories.");
+	/* a file that was too big to pack last time still has its own output file */
+	if (file_exists(local->files.str)){
+		move_index_forget(ctx->mi, file);
+		if (mkdir_recursive(local->delta_parent.str) < 0){
+			log_warning("Failed to make delta parent directory.");
+		}
+		if (rename_file(local->files.str, local->delta.str) != 0){
+			log_warning_ex("Failed to create delta for %s", local->files.str);
+		}
+		/* the clouds still have that output file, so they are out of sync until it is looked up again */
+		if (ctx->n_targets > 0){
+			mark_cloud_failed(ctx, NULL);
+		}
 	}
 
-	if (file_exists(path_files) && rename_file(path_files, path_delta) != 0){
-		log_warning_ex("Failed to create delta for %s", path_files);
+	if (pack_add_file_ex(ctx->pw, src, file, out_hash, out_segment) != 0){
+		log_error_ex("Failed to add %s to a pack segment", file);
+		ret = -1;
+		goto cleanup;
+	}
+
+cleanup:
+	return ret;
+}
+
+/* writes what a file is compressed/encrypted to into every cloud's upload stream */
+static int stream_fanout_write(const void* data, size_t len, void* streams){
+	struct cloud_stream** cs = streams;
+	size_t i;
+
+	/* the array ends with a NULL */
+	for (i = 0; cs[i]; ++i){
+		if (cloud_upload_stream_write(data, len, cs[i]) != 0){
+			return -1;
+		}
 	}
+	return 0;
+}
 
-	if (zip_compress(file, path_files, opt->c_type, opt->c_level, opt->c_flags) != 0){
-		log_error("Failed to compress output file");
+/* compresses/encrypts a file straight into the cloud, for --cloud-only when every provider can stream
+ * the file is only read and compressed once, however many clouds it goes to
+ * a stream is only opened and closed with its session held, since writing to it does not use the session */
+static int stream_single_file(const char* file, const char* src, const struct options* opt, struct copy_context* ctx, char** out_hash, char** out_artifact){
+	struct cloud_stream** cs;
+	size_t i;
+	int ret = 0;
+
+	cs = calloc(ctx->n_targets + 1, sizeof(*cs));
+	if (!cs){
+		log_enomem();
 		ret = -1;
 		goto cleanup;
 	}
 
-	if (opt->enc_algorithm && easy_encrypt_inplace(path_files, EVP_CIPHER_name(opt->enc_algorithm), opt->flags.bits.flag_verbose, password) != 0){
-		log_error("Failed to encrypt file");
+	/* the local output directory no longer says what is in the cloud */
+	for (i = 0; i < ctx->n_targets; ++i){
+		struct cloud_target* target = &ctx->targets[i];
+		const char* cloud_path = NULL;
+
+		pthread_mutex_lock(&target->cloud_mutex);
+		if (cloud_prepare_single_file(file, target->co->upload_directory, target->cd, ctx->delta_extension, -1, &cloud_path) == 0){
+			cs[i] = cloud_upload_stream_open(cloud_path, target->cd);
+		}
+		pthread_mutex_unlock(&target->cloud_mutex);
+		if (!cs[i]){
+			log_error_ex2("Failed to start uploading %s to %s", file, target->co->upload_directory);
+			ret = -1;
+			goto cleanup;
+		}
+	}
+
+	if (pipeline_backup_stream_ex(src, stream_fanout_write, cs, opt, ctx->password, ctx->verbose, out_hash, out_artifact) != 0){
+		log_error("Failed to compress/encrypt output file");
 		ret = -1;
 		goto cleanup;
 	}
 
-	if (cd && cloud_copy_single_file(file, path_files, cloud_directory, cd, delta_extension) != 0){
-		log_warning_ex("Failed to upload %s to the cloud", path_files);
-		ret = -1;
+	for (i = 0; i < ctx->n_targets; ++i){
+		struct cloud_target* target = &ctx->targets[i];
+
+		pthread_mutex_lock(&target->cloud_mutex);
+		if (cloud_upload_stream_close(cs[i]) != 0){
+			ret = -1;
+		}
+		pthread_mutex_unlock(&target->cloud_mutex);
+		cs[i] = NULL;
 	}
 
 cleanup:
-	free(path_files);
-	free(path_delta);
-	free(file_parent);
-	free(delta_parent);
+	/* the streams that were never closed are thrown away */
+	for (i = 0; cs && i < ctx->n_targets; ++i){
+		if (cs[i]){
+			pthread_mutex_lock(&ctx->targets[i].cloud_mutex);
+			cloud_upload_stream_abort(cs[i]);
+			pthread_mutex_unlock(&ctx->targets[i].cloud_mutex);
+		}
+	}
+	free(cs);
+	if (ret != 0){
+		mark_cloud_failed(ctx, NULL);
+	}
 	return ret;
 }
 
-static int copy_files(const struct options* opt, const struct cloud_options* co, const char* delta_extension, FILE* fp_checksum, FILE* fp_checksum_prev){
-	char* password = NULL;
-	struct cloud_data* cd = NULL;
-	int ret = 0;
+/* every cloud can take a stream, so --cloud-only does not need an output file */
+static int cloud_targets_can_stream(const struct copy_context* ctx){
 	size_t i;
 
-	if (co->cp != CLOUD_NONE && cloud_login(co, &cd) != 0){
-		log_error("Could not connect to the cloud.");
-		ret = -1;
-		goto cleanup;
+	for (i = 0; i < ctx->n_targets; ++i){
+		if (!cloud_can_stream(ctx->targets[i].cd)){
+			return 0;
+		}
 	}
+	return ctx->n_targets > 0;
+}
 
-	if (opt->enc_algorithm && !opt->enc_password){
-		int res;
+/* swaps the version that was just moved to deltas/ for a delta against the output that replaced it, if that is smaller
+ * the delta is made against the output read back, not the source, since the source can change while it is backed up */
+static void store_binary_delta(const struct copy_context* ctx, const struct options* opt, const char* output, const char* delta){
+	struct TMPFILE* base;
+	int res;
 
-		while ((res = crypt_getpassword("Enter  encryption password:", "Verify encryption password:", &password)) > 0);
+	if (!(base = temp_fopen())){
+		log_warning_ex("Failed to make room to read back %s, so the version it replaced is kept whole", output);
+		return;
+	}
+	if (pipeline_restore_file(output, base->name, opt, ctx->password) != 0){
+		log_warning_ex("Failed to read back %s, so the version it replaced is kept whole", output);
+	}
+	else if ((res = rdelta_store(base->name, delta, opt, ctx->password)) < 0){
+		log_warning_ex("Failed to make a delta of %s, so it is kept whole", delta);
+	}
+	else if (res > 0){
+		log_debug_ex("A delta of %s would not be smaller, so it is kept whole", delta);
+	}
+	temp_fclose(base);
+}
 
-		if (res < 0){
-			log_error("Failed to read encryption password from terminal");
-			ret = -1;
-			goto cleanup;
-		}
+/* compresses/encrypts a file into output_directory and uploads it if needed
+ * src is where to read it from, which is file unless it is in a snapshot
+ * if out_hash is not NULL, the file's checksum is computed in the same pass
+ * if out_artifact is not NULL, it is set to the output's checksum, or NULL if the file has no output of its own
+ * out_segment is set to the pack segment the file went to, or 0 if it was not packed */
+static int copy_single_file(const char* file, const char* src, const struct file_meta* meta, struct copy_context* ctx, char** out_hash, char** out_artifact, unsigned long* out_segment){
+	const struct options* opt = ctx->opt;
+	const struct policy_rule* rule = policy_match(ctx->policies, file);
+	struct options opt_level;
+	struct thread_paths* tp;
+	const char* path_files;
+	struct string_array* new_chunks = NULL;
+	int replaced;
+	int delta_made = 0;
+	int ret = 0;
+
+	if (out_hash){
+		*out_hash = NULL;
 	}
+	if (out_artifact){
+		*out_artifact = NULL;
+	}
+	*out_segment = 0;
 
-	for (i = 0; i < opt->directories->len; ++i){
-		struct fi_stack* fis = NULL;
-		char* tmp;
-		int res;
+	/* a pack is compressed and encrypted as one, so a file with its own rule gets its own output */
+	if (ctx->pw && meta && meta->size < opt->pack_threshold && !rule){
+		return pack_single_file(file, src, ctx, out_hash, out_segment);
+	}
 
-		fis = fi_start(opt->directories->strings[i]);
-		if (!fis){
-			log_warning_ex("Failed to fi_start in directory %s", opt->directories->strings[i]);
-		}
-		while ((tmp = fi_next(fis)) != NULL){
-			size_t j;
-			for (j = 0; j < opt->exclude->len; ++j){
-				if (sh_starts_with(tmp, opt->exclude->strings[j])){
-					fi_skip_current_dir(fis);
-					break;
-				}
+	if (rule){
+		policy_apply(rule, opt, &opt_level);
+		opt = &opt_level;
+	}
+
+	/* the level can change while this file is compressed, so it keeps the one it started with */
+	if (opt->c_target > 0){
+		opt_level = *opt;
+		pthread_mutex_lock(&ctx->level_mutex);
+		opt_level.c_level = ctx->c_level;
+		pthread_mutex_unlock(&ctx->level_mutex);
+		opt = &opt_level;
+	}
+
+	/* a file this long would be the last one still running, so it uses the workers that would otherwise sit idle by then
+	 * this only changes how the blocks are compressed, and any number of workers can read the output */
+	if (ctx->straggler_len > 0 && meta && meta->size >= ctx->straggler_len){
+		uint64_t workers = (meta->size + ctx->straggler_len - 1) / ctx->straggler_len;
+
+		if (opt != &opt_level){
+			opt_level = *opt;
+			opt = &opt_level;
+		}
+		opt_level.c_flags = (opt_level.c_flags & ~ZIP_WORKERS(0xFF)) | ZIP_WORKERS(workers < ctx->straggler_workers ? workers : ctx->straggler_workers);
+		log_info_ex2("Compressing %s on %u workers", file, ZIP_GET_WORKERS(opt_level.c_flags));
+	}
+
+	if (opt->flags.bits.flag_cloud_only && !ctx->chunk_directory && cloud_targets_can_stream(ctx)){
+		return stream_single_file(file, src, opt, ctx, out_hash, out_artifact);
+	}
+
+	tp = get_thread_paths();
+	if (make_file_paths(file, opt->output_directory, ctx->delta_extension, tp ? &tp->local : NULL) != 0){
+		log_error("Failed determining file path or delta path");
+		ret = -1;
+		goto cleanup;
+	}
+	path_files = tp->local.files.str;
+
+	if (mkdir_recursive(tp->local.files_parent.str) < 0 || mkdir_recursive(tp->local.delta_parent.str) < 0){
+		log_warning("Failed to make one or more parent directories.");
+	}
+
+	replaced = file_exists(path_files);
+	if (replaced){
+		move_index_forget(ctx->mi, file);
+	}
+	/* the old output can be linked to other files' paths, so it is never written over in place */
+	if (replaced && rename_file(path_files, tp->local.delta.str) != 0){
+		log_warning_ex("Failed to create delta for %s", path_files);
+		remove(path_files);
+	}
+	else if (replaced){
+		delta_made = 1;
+	}
+
+	if (ctx->chunk_directory){
+		/* files/ and deltas/ only get a manifest; the data goes to the chunk store */
+		if (chunk_store_file(src, path_files, ctx->chunk_directory, opt, ctx->password, out_hash, ctx->n_targets > 0 ? &new_chunks : NULL) != 0){
+			log_error("Failed to split output file into chunks");
+			ret = -1;
+			goto cleanup;
+		}
+	}
+	/* reads the file once, and writes the output once */
+	else if (pipeline_backup_file_ex(src, path_files, opt, ctx->password, ctx->verbose, out_hash, out_artifact) != 0){
+		log_error("Failed to compress/encrypt output file");
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (ctx->n_targets > 0){
+		/* the old output was removed once it was uploaded, so it does not say whether the cloud has one */
+		if (opt->flags.bits.flag_cloud_only && !new_chunks){
+			replaced = -1;
+		}
+		if (queue_upload(ctx, file, path_files, NULL, new_chunks, replaced) != 0){
+			log_warning_ex("Failed to queue %s for upload", path_files);
+			ret = -1;
+		}
+		new_chunks = NULL;
+	}
+
+	/* the clouds already have the old output, which they only rename, so this saves local space
+	 * a chunk manifest is already small, and --cloud-only removes the output it would be made against */
+	if (delta_made && opt->flags.bits.flag_binary_deltas && !ctx->chunk_directory && !opt->flags.bits.flag_cloud_only &&
+			get_file_size(tp->local.delta.str) >= RDELTA_MIN_SIZE){
+		store_binary_delta(ctx, opt, path_files, tp->local.delta.str);
+	}
+
+cleanup:
+	/* the old output may already be a delta here but not in the cloud */
+	if (ret != 0 && ctx->n_targets > 0){
+		mark_cloud_failed(ctx, NULL);
+	}
+	new_chunks ? sa_free(new_chunks) : (void)0;
+	return ret;
+}
+
+struct link_move{
+	const struct copy_context* ctx;
+	const char* file;
+	/* where the new file's output goes */
+	const char* out;
+};
+
+/* links the output of a file with the same contents to a new file's output path, for move_index_use() */
+static int link_output(const char* old_file, void* data){
+	struct link_move* lm = data;
+	struct path_builder old_out = PB_INIT;
+	int ret = -1;
+
+	if (pb_set(&old_out, lm->ctx->opt->output_directory) != 0 ||
+			pb_append_path(&old_out, "/files") != 0 ||
+			pb_append_path(&old_out, old_file) != 0){
+		log_enomem();
+		pb_free(&old_out);
+		return -1;
+	}
+
+	/* an output is renamed to deltas/ before it is replaced, so the two paths never see each other's later versions
+	 * a filesystem without hard links gets a copy, which is still far cheaper than compressing and encrypting the file again */
+	if (link(old_out.str, lm->out) == 0 || (errno != ENOENT && copy_file(old_out.str, lm->out) == 0)){
+		log_info_ex2("%s has the same contents as %s, so its output was linked", lm->file, old_file);
+		ret = 0;
+	}
+	else{
+		remove(lm->out);
+	}
+	pb_free(&old_out);
+	return ret;
+}
+
+/* hashes a new file ahead of copying it, and links the output of a file with the same contents to its path if there is one
+ * returns 0 if it was linked, positive if it has to be copied, or negative if it could not be hashed */
+static int link_moved_file(const char* file, const char* src, struct file_meta* meta, struct copy_context* ctx, char** out_hash){
+	const struct options* opt = ctx->opt;
+	struct thread_paths* tp;
+	struct link_move lm;
+
+	*out_hash = NULL;
+	/* a moved file keeps its extended attributes, so the cache can often say what it holds without reading it */
+	if (xattr_cache_checksum(src, opt->hash_algorithm, opt->flags.bits.flag_tree_hash, opt->n_threads,
+				opt->flags.bits.flag_xattr_cache && !opt->flags.bits.flag_paranoid ? meta : NULL, out_hash) != 0){
+		log_error_ex("Failed to calculate checksum for %s", file);
+		return -1;
+	}
+
+	tp = get_thread_paths();
+	if (make_file_paths(file, opt->output_directory, ctx->delta_extension, tp ? &tp->local : NULL) != 0){
+		return 1;
+	}
+	/* an output left there by an earlier file of the same name needs its delta made, which copying does */
+	if (file_exists(tp->local.files.str)){
+		return 1;
+	}
+	if (mkdir_recursive(tp->local.files_parent.str) < 0){
+		log_warning("Failed to make one or more parent directories.");
+		return 1;
+	}
+
+	lm.ctx = ctx;
+	lm.file = file;
+	lm.out = tp->local.files.str;
+	if (move_index_use(ctx->mi, *out_hash, meta->size, link_output, &lm) != 0){
+		return 1;
+	}
+
+	/* the clouds do not have a copy of their own to rename, so they get the linked output like any other */
+	if (ctx->n_targets > 0 && queue_upload(ctx, file, tp->local.files.str, NULL, NULL, 0) != 0){
+		log_warning_ex("Failed to queue %s for upload", tp->local.files.str);
+		mark_cloud_failed(ctx, NULL);
+	}
+	return 0;
+}
+
+/* the size the progress board counts a file as, which has to be the same when it is found and when it is done */
+static uint64_t found_size(const struct found_meta* found){
+	return found->res >= 0 ? found->meta.size : 0;
+}
+
+/* checksums a file and copies it if it changed
+ * runs on a worker thread when more than one thread is used */
+/* a packed file's record, which waits until its segment is closed */
+struct pending_record{
+	char* file;
+	char* hash;
+	char* artifact;
+	struct file_meta meta;
+	int has_meta;
+	FILE* fp_checksum;
+};
+
+static int write_pending_record(void* data){
+	struct pending_record* pr = data;
+
+	if (add_hash_to_file_ex(pr->file, pr->hash, pr->artifact, pr->has_meta ? &pr->meta : NULL, pr->fp_checksum, NULL) < 0){
+		log_error_ex("Failed to write checksum for %s", pr->file);
+		return -1;
+	}
+	return 0;
+}
+
+static void free_pending_record(void* data){
+	struct pending_record* pr = data;
+
+	free(pr->file);
+	free(pr->hash);
+	free(pr->artifact);
+	free(pr);
+}
+
+/* adds a file to the journal once its output is safely on disk
+ * a file in a pack segment that is lost is never recorded, so the next backup copies it again */
+static void record_file(struct copy_context* ctx, unsigned long segment, const char* file, const char* hash, const char* artifact, const struct file_meta* meta){
+	struct pending_record* pr;
+
+	if (segment == 0){
+		if (add_hash_to_file_ex(file, hash, artifact, meta, ctx->fp_checksum, NULL) < 0){
+			log_error_ex("Failed to write checksum for %s", file);
+		}
+		return;
+	}
+
+	if (!(pr = calloc(1, sizeof(*pr))) || !(pr->file = sh_dup(file)) || !(pr->hash = sh_dup(hash)) || (artifact && !(pr->artifact = sh_dup(artifact)))){
+		log_enomem();
+		pr ? free_pending_record(pr) : (void)0;
+		return;
+	}
+	if (meta){
+		pr->meta = *meta;
+		pr->has_meta = 1;
+	}
+	pr->fp_checksum = ctx->fp_checksum;
+
+	/* a lost segment has already said so */
+	if (pack_writer_defer(ctx->pw, segment, write_pending_record, free_pending_record, pr) < 0){
+		log_error_ex("Failed to write checksum for %s", file);
+	}
+}
+
+static void process_file(void* arg){
+	struct copy_job* job = arg;
+	struct copy_context* ctx = job->ctx;
+	struct element* prev = job->prev;
+	struct file_meta meta;
+	const struct file_meta* meta_ptr;
+	/* still good for picking where the file goes when it is too new to record */
+	const struct file_meta* meta_size;
+	char* hash = NULL;
+	/* the checksum of the file's output, which verifying can check without restoring it */
+	char* artifact = NULL;
+	char* src_frozen = NULL;
+	const char* src = job->file;
+	struct stats_time start;
+	/* the pack segment the file went to, if it was packed */
+	unsigned long segment = 0;
+	int meta_unchanged;
+	int moved = 1;
+	int res;
+
+	stats_time_now(&start);
+	if (ctx->ss){
+		if (!(src_frozen = snapshot_path(ctx->ss, job->file))){
+			log_enomem();
+			goto cleanup;
+		}
+		src = src_frozen;
+	}
+
+	/* taken before reading the file so a write in the meantime is caught next time
+	 * the walk already did this for most files, so they are not looked up twice */
+	if (job->found.res != META_UNKNOWN){
+		meta = job->found.meta;
+		res = job->found.res;
+	}
+	else{
+		res = get_file_meta(src, &meta);
+	}
+	meta_ptr = res == 0 ? &meta : NULL;
+	meta_size = res >= 0 ? &meta : NULL;
+
+	meta_unchanged = !ctx->opt->flags.bits.flag_paranoid && meta_ptr && prev && prev->meta && file_meta_cmp(meta_ptr, prev->meta) == 0;
+
+	/* an old checksum from another algorithm cannot be compared, so only the metadata can say the file is unchanged */
+	if (ctx->rehash && !meta_unchanged){
+		free_element(prev);
+		prev = NULL;
+	}
+
+	/* a file that was not in the last backup has to be copied anyway,
+	 * so hash it while copying instead of reading it twice */
+	if (!prev){
+		progress_board_puts(job->file);
+		/* hashing first only pays off if there is an output of the same size to link to */
+		if (ctx->mi && meta_ptr && meta.size >= ctx->move_min_size && move_index_has_size(ctx->mi, meta.size)){
+			moved = link_moved_file(job->file, src, &meta, ctx, &hash);
+		}
+		if (moved > 0){
+			free(hash);
+			hash = NULL;
+			if (copy_single_file(job->file, src, meta_size, ctx, &hash, &artifact, &segment) != 0){
+				log_warning_ex("Failed to copy %s", job->file);
 			}
-			if (j != opt->exclude->len){
-				free(tmp);
-				continue;
+		}
+		stats_count(moved == 0 ? COUNTER_FILES_MOVED : hash ? COUNTER_FILES_CHANGED : COUNTER_FILES_FAILED, 1);
+		/* no checksum is recorded if the file could not be read, so it is retried next time */
+		if (hash){
+			record_file(ctx, segment, job->file, hash, artifact, meta_ptr);
+		}
+		/* so another link to the same inode later in this backup is stored once */
+		if (hash && ctx->mi && meta_size && meta.size >= ctx->move_min_size && move_index_add(ctx->mi, job->file, hash, meta.size) != 0){
+			log_warning_ex("Failed to remember the contents of %s", job->file);
+		}
+		goto cleanup;
+	}
+
+	/* same size, timestamps, and inode as last time, so don't bother reading it */
+	if (meta_unchanged && !ctx->rehash){
+		log_info_ex("File %s was unchanged", job->file);
+		stats_count(COUNTER_FILES_SKIPPED, 1);
+		if (add_hash_to_file_ex(job->file, prev->checksum, prev->artifact, meta_ptr, ctx->fp_checksum, NULL) < 0){
+			log_error_ex("Failed to write checksum for %s", job->file);
+		}
+		goto cleanup;
+	}
+
+	/* the cache can only be trusted when the metadata is old enough to catch every write, and never when paranoid */
+	if (xattr_cache_checksum(src, ctx->opt->hash_algorithm, ctx->opt->flags.bits.flag_tree_hash, ctx->opt->n_threads,
+				ctx->opt->flags.bits.flag_xattr_cache && !ctx->opt->flags.bits.flag_paranoid && meta_ptr ? &meta : NULL, &hash) != 0){
+		log_error_ex("Failed to calculate checksum for %s", job->file);
+		stats_count(COUNTER_FILES_FAILED, 1);
+		goto cleanup;
+	}
+
+	if (ctx->rehash || strcmp(hash, prev->checksum) == 0){
+		log_info_ex("File %s was unchanged", job->file);
+		stats_count(COUNTER_FILES_SKIPPED, 1);
+	}
+	else{
+		progress_board_puts(job->file);
+		/* the journal only lists files that are done, so a resumed backup does not skip this one */
+		if (copy_single_file(job->file, src, meta_size, ctx, NULL, &artifact, &segment) != 0){
+			log_warning_ex("Failed to copy %s", job->file);
+			stats_count(COUNTER_FILES_FAILED, 1);
+			goto cleanup;
+		}
+		stats_count(COUNTER_FILES_CHANGED, 1);
+		if (ctx->mi && meta_size && meta.size >= ctx->move_min_size && move_index_add(ctx->mi, job->file, hash, meta.size) != 0){
+			log_warning_ex("Failed to remember the contents of %s", job->file);
+		}
+	}
+	/* an unchanged file still has the output the last backup made, unless that was made with another algorithm */
+	record_file(ctx, segment, job->file, hash, artifact ? artifact : ctx->rehash ? NULL : prev->artifact, meta_ptr);
+
+cleanup:
+	trace_since("file", &start, job->file);
+	progress_board_done(found_size(&job->found));
+	maybe_checkpoint(ctx);
+	maybe_retune(ctx);
+	free_element(prev);
+	free(hash);
+	free(artifact);
+	free(src_frozen);
+	free(job->file);
+	free(job);
+}
+
+/* the same checks process_file() makes before reading a file, but only with what the walk already knows
+ * a file the walk could not stat() is left alone, since it is probably unchanged */
+static int will_be_read(const struct copy_context* ctx, const struct element* prev, const struct found_meta* found){
+	int meta_unchanged;
+
+	if (!prev){
+		return 1;
+	}
+	if (found->res == META_UNKNOWN || found->res < 0){
+		return 0;
+	}
+	meta_unchanged = !ctx->opt->flags.bits.flag_paranoid && found->res == 0 && prev->meta && file_meta_cmp(&found->meta, prev->meta) == 0;
+	return !meta_unchanged || ctx->rehash;
+}
+
+/* runs on the prefetch thread, and takes ownership of arg */
+static void prefetch_file(void* arg){
+	source_prefetch(arg);
+	free(arg);
+}
+
+/* queues a file that a worker is about to read so its first blocks are read in the meantime
+ * the kernel does the reading, so this only waits on the open(), which on a network filesystem is a round trip of its own */
+static void prefetch_submit(struct copy_context* ctx, const char* file){
+	char* path = ctx->ss ? snapshot_path(ctx->ss, file) : sh_dup(file);
+
+	/* if the prefetcher has fallen behind, the workers will get to this file first anyway */
+	if (path && tp_try_submit(ctx->prefetch_tp, prefetch_file, path) != 0){
+		free(path);
+	}
+}
+
+/* takes ownership of file and prev
+ * found is the file's metadata from the walk
+ * returns NULL if there is no memory for the job, in which case the file is skipped */
+static struct copy_job* new_job(struct copy_context* ctx, char* file, struct element* prev, const struct found_meta* found){
+	struct copy_job* job;
+
+	job = malloc(sizeof(*job));
+	if (!job){
+		log_enomem();
+		free(file);
+		free_element(prev);
+		return NULL;
+	}
+	job->file = file;
+	job->prev = prev;
+	job->found = *found;
+	job->ctx = ctx;
+	progress_board_found(found_size(found));
+	return job;
+}
+
+/* queues a job in the lane of the device its file is on, or runs it on this thread if ds is NULL */
+static void submit_job(struct dev_sched* ds, size_t lane, struct copy_job* job){
+	struct copy_context* ctx = job->ctx;
+
+	if (ds && ctx->prefetch_tp && will_be_read(ctx, job->prev, &job->found)){
+		prefetch_submit(ctx, job->file);
+	}
+
+	/* process_file() takes ownership of the job */
+	if (!ds || dev_sched_submit(ds, lane, process_file, job) != 0){
+		process_file(job);
+	}
+}
+
+/* takes ownership of file and prev */
+static void submit_file(struct dev_sched* ds, size_t lane, struct copy_context* ctx, char* file, struct element* prev, const struct found_meta* found){
+	struct copy_job* job = new_job(ctx, file, prev, found);
+
+	if (job){
+		submit_job(ds, lane, job);
+	}
+}
+
+/* only regular files can use the walk's lstat(), since a symlink is backed up as whatever it points to */
+static void found_meta_from_stat(const struct stat* st, struct found_meta* out){
+	out->res = S_ISREG(st->st_mode) ? file_meta_from_stat(st, &out->meta) : META_UNKNOWN;
+}
+
+/* takes ownership of file */
+static int found_list_add(struct found_list* list, char* file, const struct found_meta* found){
+	if (list->len >= list->size){
+		size_t new_size = list->size ? list->size * 2 : 1024;
+		struct found_file* tmp = realloc(list->files, new_size * sizeof(*list->files));
+
+		if (!tmp){
+			log_enomem();
+			free(file);
+			return -1;
+		}
+		list->files = tmp;
+		list->size = new_size;
+	}
+	list->files[list->len].file = file;
+	list->files[list->len].found = *found;
+	list->len++;
+	return 0;
+}
+
+/* moves every file in src to the end of dst, leaving src empty */
+static int found_list_take(struct found_list* dst, struct found_list* src){
+	size_t i;
+
+	for (i = 0; i < src->len; ++i){
+		char* file = src->files[i].file;
+
+		/* found_list_add() frees it if it fails, and found_list_free() frees the ones after it */
+		src->files[i].file = NULL;
+		if (found_list_add(dst, file, &src->files[i].found) != 0){
+			return -1;
+		}
+	}
+	src->len = 0;
+	return 0;
+}
+
+/* the same order as sa_sort(), which the checksum files are sorted in */
+static int found_file_cmp(const void* f1, const void* f2){
+	return strcmp(((const struct found_file*)f1)->file, ((const struct found_file*)f2)->file);
+}
+
+/* whether the list is already in found_file_cmp() order, which it is after a walk of one directory */
+static int found_list_sorted(const struct found_list* list){
+	size_t i;
+
+	for (i = 1; i < list->len; ++i){
+		if (found_file_cmp(&list->files[i - 1], &list->files[i]) > 0){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void found_list_free(struct found_list* list){
+	size_t i;
+
+	if (!list){
+		return;
+	}
+	for (i = 0; i < list->len; ++i){
+		free(list->files[i].file);
+	}
+	free(list->files);
+	free(list);
+}
+
+/* a read error ends the file early, which only means the rest of its files are treated as new */
+static void merge_advance(struct checksum_reader* cr, const struct element** cursor){
+	if (checksum_reader_next(cr, cursor) < 0){
+		log_warning("Failed to read the rest of a checksum file.");
+	}
+}
+
+/* advances through a sorted checksum file to the entry for file, or to its end if file is NULL
+ * *cursor holds the next unmatched entry between calls, and should start as the first one
+ * every entry skipped over was not found by this backup, so it is added to fp_removed if that is not NULL
+ * returns a copy of the entry for file, which the caller owns, or NULL if there is none */
+static struct element* merge_next(struct checksum_reader* cr, const struct element** cursor, const char* file, FILE* fp_removed){
+	struct element* ret;
+
+	while (*cursor && (!file || strcmp((*cursor)->file, file) < 0)){
+		if (fp_removed && add_removed_to_file(fp_removed, (*cursor)->file) != 0){
+			log_warning_ex("Failed to add %s to the removed file list", (*cursor)->file);
+		}
+		merge_advance(cr, cursor);
+	}
+	if (!*cursor || strcmp((*cursor)->file, file) != 0){
+		return NULL;
+	}
+	ret = copy_element(*cursor);
+	merge_advance(cr, cursor);
+	return ret;
+}
+
+/* starts reading a sorted checksum file from its first entry */
+static struct checksum_reader* merge_start(FILE* fp, const struct element** cursor){
+	struct checksum_reader* cr;
+
+	*cursor = NULL;
+	rewind(fp);
+	if (!(cr = checksum_reader_new(fp, 0))){
+		log_warning("Failed to start reading a checksum file.");
+		return NULL;
+	}
+	merge_advance(cr, cursor);
+	return cr;
+}
+
+/* starts walking one of the directories being backed up, leaving out the excluded paths without ever opening them
+ * returns NULL if the directory is excluded itself or cannot be read */
+static struct fi_stack* start_walk(const char* dir, struct exclude_trie* ex){
+	struct fi_stack* fis;
+
+	if (exclude_match(ex, dir)){
+		return NULL;
+	}
+	/* in the order the checksum files are sorted in, so the journal usually needs no sorting */
+	fis = fi_start_sorted(dir, exclude_skip, ex);
+	if (!fis){
+		log_warning_ex("Failed to fi_start in directory %s", dir);
+	}
+	return fis;
+}
+
+/* adds as much of a small file as still fits to the samples
+ * st is the file's lstat() from the walk
+ * returns 0 on success, positive if the file is not small, or negative on failure */
+static int add_dict_sample(const char* file, const struct stat* st, const struct options* opt, unsigned char* samples, size_t* samples_len, size_t** sample_lens, size_t* n_samples){
+	struct found_meta found;
+	struct file_meta meta;
+	FILE* fp;
+	size_t len;
+
+	found_meta_from_stat(st, &found);
+	meta = found.meta;
+	if ((found.res == META_UNKNOWN && get_file_meta(file, &meta) < 0) || meta.size == 0 || meta.size >= opt->dict_threshold){
+		return 1;
+	}
+	len = DICT_SAMPLE_LEN - *samples_len < meta.size ? DICT_SAMPLE_LEN - *samples_len : (size_t)meta.size;
+
+	/* the list starts with room for 64, and doubles every time it fills up */
+	if (*n_samples == 0 || (*n_samples >= 64 && (*n_samples & (*n_samples - 1)) == 0)){
+		size_t* tmp = realloc(*sample_lens, (*n_samples ? *n_samples * 2 : 64) * sizeof(**sample_lens));
+		if (!tmp){
+			log_enomem();
+			return -1;
+		}
+		*sample_lens = tmp;
+	}
+
+	fp = fopen(file, "rb");
+	if (!fp){
+		log_debug_ex("Failed to open %s for the dictionary", file);
+		return 1;
+	}
+	len = fread(samples + *samples_len, 1, len, fp);
+	fclose(fp);
+	if (len == 0){
+		return 1;
+	}
+
+	(*sample_lens)[*n_samples] = len;
+	(*n_samples)++;
+	*samples_len += len;
+	return 0;
+}
+
+/* samples the small files in the directories being backed up, the same way copy_files() walks them */
+static struct zip_dict* train_dictionary(const struct options* opt){
+	struct zip_dict* ret = NULL;
+	unsigned char* samples = NULL;
+	size_t* sample_lens = NULL;
+	size_t samples_len = 0;
+	size_t n_samples = 0;
+	struct exclude_trie* ex = NULL;
+	size_t i;
+
+	samples = malloc(DICT_SAMPLE_LEN);
+	if (!samples){
+		log_enomem();
+		return NULL;
+	}
+	if (!(ex = exclude_new(opt->exclude))){
+		goto cleanup;
+	}
+
+	for (i = 0; i < opt->directories->len && samples_len < DICT_SAMPLE_LEN; ++i){
+		struct fi_stack* fis;
+		const char* tmp;
+		struct stat st;
+
+		if (!(fis = start_walk(opt->directories->strings[i], ex))){
+			continue;
+		}
+		while (samples_len < DICT_SAMPLE_LEN && (tmp = fi_next_stat(fis, &st)) != NULL){
+			if (add_dict_sample(tmp, &st, opt, samples, &samples_len, &sample_lens, &n_samples) < 0){
+				fi_end(fis);
+				goto cleanup;
+			}
+		}
+		fi_end(fis);
+	}
+
+	printf("Training a compression dictionary from %lu small files\n", (unsigned long)n_samples);
+	ret = zip_dict_train(opt->c_type, opt->c_level, samples, sample_lens, n_samples);
+
+cleanup:
+	exclude_free(ex);
+	free(samples);
+	free(sample_lens);
+	return ret;
+}
+
+/* the dictionary is only trained once, since the files compressed with it need that same one to be restored */
+static struct zip_dict* open_dictionary(const char* dict_path, const struct options* opt, const char* password){
+	struct zip_dict* dict = NULL;
+	int res;
+
+	res = pipeline_load_dict(dict_path, opt, password, &dict);
+	if (res < 0){
+		log_warning("Failed to load the compression dictionary. Small files will be compressed without it.");
+	}
+	if (res <= 0){
+		return dict;
+	}
+
+	if (!(dict = train_dictionary(opt))){
+		log_warning("Failed to train a compression dictionary. Small files will be compressed without it.");
+		return NULL;
+	}
+	if (pipeline_save_dict(dict_path, dict, opt, password) != 0){
+		log_warning("Failed to store the compression dictionary. Small files will be compressed without it.");
+		zip_dict_free(dict);
+		return NULL;
+	}
+	return dict;
+}
+
+/* reads the start of the files being backed up, the same way copy_files() walks them, until the sample is full */
+static size_t read_zip_sample(const struct options* opt, unsigned char* sample){
+	struct exclude_trie* ex;
+	size_t sample_len = 0;
+	size_t i;
+
+	if (!(ex = exclude_new(opt->exclude))){
+		return 0;
+	}
+
+	for (i = 0; i < opt->directories->len && sample_len < ZIP_SAMPLE_LEN; ++i){
+		struct fi_stack* fis;
+		const char* tmp;
+
+		if (!(fis = start_walk(opt->directories->strings[i], ex))){
+			continue;
+		}
+		while (sample_len < ZIP_SAMPLE_LEN && (tmp = fi_next_path(fis)) != NULL){
+			size_t len = ZIP_SAMPLE_LEN - sample_len < ZIP_SAMPLE_FILE_LEN ? ZIP_SAMPLE_LEN - sample_len : ZIP_SAMPLE_FILE_LEN;
+			FILE* fp;
+
+			if ((fp = fopen(tmp, "rb")) != NULL){
+				sample_len += fread(sample + sample_len, 1, len, fp);
+				fclose(fp);
+			}
+		}
+		fi_end(fis);
+	}
+
+	exclude_free(ex);
+	return sample_len;
+}
+
+/* picks the level, and the compressor if it is not fixed yet, that keeps up with opt->c_target
+ * out is set to a copy of opt that uses them */
+static int choose_compressor(const struct options* opt, struct options* out){
+	unsigned char* sample = NULL;
+	size_t sample_len;
+	int res;
+	int ret = 0;
+
+	*out = *opt;
+	/* any compressor can be picked, unless one was given */
+	if (opt->flags.bits.flag_auto_compressor){
+		out->c_type = COMPRESSOR_INVALID;
+	}
+	/* every file in the directory has to be restored with the same compressor, so only the first backup gets to pick it */
+	res = zip_auto_load(opt->output_directory, &out->c_type);
+	if (res < 0){
+		log_error("Failed to read which compressor the last backup used.");
+		return -1;
+	}
+
+	sample = malloc(ZIP_SAMPLE_LEN);
+	if (!sample){
+		log_enomem();
+		return -1;
+	}
+	sample_len = read_zip_sample(opt, sample);
+
+	/* nothing to measure, so anything works */
+	if (sample_len == 0){
+		out->c_type = out->c_type != COMPRESSOR_INVALID ? out->c_type : COMPRESSOR_GZIP;
+		out->c_level = 0;
+	}
+	else if (zip_pick(sample, sample_len, opt->c_target ? opt->c_target : ZIP_AUTO_TARGET, opt->c_flags, opt->n_threads, &out->c_type, &out->c_level) != 0){
+		log_error("Failed to pick a compressor.");
+		ret = -1;
+		goto cleanup;
+	}
+	printf("Compressing with %s level %d\n", compressor_tostring(out->c_type), out->c_level);
+
+cleanup:
+	free(sample);
+	return ret;
+}
+
+/* restore() reads every file in the directory back with the compressor recorded for it, so a backup that names a different one is refused */
+static int check_compressor(const struct options* opt){
+	enum compressor c_recorded;
+	int res;
+
+	if (opt->flags.bits.flag_auto_compressor){
+		return 0;
+	}
+	res = zip_auto_load(opt->output_directory, &c_recorded);
+	if (res < 0){
+		log_error("Failed to read which compressor the last backup used.");
+		return -1;
+	}
+	if (res == 0 && c_recorded != opt->c_type){
+		log_error_ex2("The backups in %s were made with %s. Give that compressor, or back up to a new directory.", opt->output_directory, compressor_tostring(c_recorded));
+		return -1;
+	}
+	return 0;
+}
+
+/* whether file is one of the directories being backed up or under one of them */
+/* returns how much of file is dir, which is never 0, if file is dir or under it, or 0 if not */
+static size_t in_directory(const char* dir, const char* file){
+	size_t len = strlen(dir);
+
+	if (strncmp(file, dir, len) == 0 && (file[len] == '\0' || file[len] == '/' || (len > 0 && dir[len - 1] == '/'))){
+		return len > 0 ? len : 1;
+	}
+	return 0;
+}
+
+static int in_directories(const struct options* opt, const char* file){
+	size_t i;
+
+	for (i = 0; i < opt->directories->len; ++i){
+		if (in_directory(opt->directories->strings[i], file)){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* the lane of the innermost directory a file is under, since one directory being backed up can be mounted inside another */
+static size_t lane_of_file(const struct options* opt, const size_t* dir_lanes, const char* file){
+	size_t best_len = 0;
+	size_t lane = 0;
+	size_t i;
+
+	for (i = 0; i < opt->directories->len; ++i){
+		size_t len = in_directory(opt->directories->strings[i], file);
+
+		if (len > best_len){
+			best_len = len;
+			lane = dir_lanes[i];
+		}
+	}
+	return lane;
+}
+
+/* adds a file or everything under a directory that the change journal says changed
+ * the path is looked up in the snapshots if ss is not NULL, which ex has to exclude the same paths in
+ * returns the number of files added */
+static unsigned long add_journal_path(const char* path, const struct snapshot_set* ss, struct exclude_trie* ex, struct found_list* pending){
+	struct fi_stack* fis = NULL;
+	struct found_meta found;
+	struct stat st;
+	const char* tmp;
+	char* src = NULL;
+	char* file;
+	unsigned long n_found = 0;
+
+	if (ss && !(src = snapshot_path(ss, path))){
+		log_enomem();
+		return 0;
+	}
+	/* a path that is gone is left out, so the pass over the last checksum file counts it as removed */
+	if (exclude_match(ex, path) || lstat(src ? src : path, &st) != 0){
+		goto cleanup;
+	}
+	if (!S_ISDIR(st.st_mode)){
+		found_meta_from_stat(&st, &found);
+		if (!(file = sh_dup(path))){
+			log_enomem();
+		}
+		else if (found_list_add(pending, file, &found) == 0){
+			n_found++;
+		}
+		goto cleanup;
+	}
+
+	if (!(fis = start_walk(src ? src : path, ex))){
+		goto cleanup;
+	}
+	while ((tmp = fi_next_stat(fis, &st)) != NULL){
+		found_meta_from_stat(&st, &found);
+		if (!(file = ss ? snapshot_live_path(ss, tmp) : sh_dup(tmp))){
+			log_enomem();
+		}
+		else if (found_list_add(pending, file, &found) == 0){
+			n_found++;
+		}
+	}
+
+cleanup:
+	fis ? fi_end(fis) : (void)0;
+	free(src);
+	return n_found;
+}
+
+/* finds the files a full walk would find, using the last checksum file for everything the change journal says did not change
+ * an unchanged file keeps its old metadata, so process_file() never has to look at it */
+static int journal_files(const struct options* opt, const struct snapshot_set* ss, struct exclude_trie* ex, const struct change_journal* cj, FILE* fp_checksum_prev, struct found_list* pending){
+	struct checksum_reader* cr;
+	const struct element* e;
+	struct stats_time scan_time = { 0, 0 };
+	struct stats_time mark;
+	unsigned long n_found = 0;
+	size_t i;
+	size_t j;
+	int ret = 0;
+
+	stats_time_now(&mark);
+	if (!(cr = merge_start(fp_checksum_prev, &e))){
+		return -1;
+	}
+	for (; e; merge_advance(cr, &e)){
+		struct found_meta found;
+		char* file;
+
+		/* the options may have changed since the last backup */
+		if (!in_directories(opt, e->file) || exclude_match(ex, e->file)){
+			continue;
+		}
+		/* a changed file is added back by the loop below if it is still there */
+		if (cj_changed(cj, e->file)){
+			continue;
+		}
+		if (e->meta){
+			found.meta = *e->meta;
+			found.res = 0;
+		}
+		else{
+			found.res = META_UNKNOWN;
+		}
+		if (!(file = sh_dup(e->file)) || found_list_add(pending, file, &found) != 0){
+			log_enomem();
+			ret = -1;
+			break;
+		}
+		n_found++;
+	}
+	checksum_reader_free(cr);
+
+	for (i = 0; ret == 0 && i < cj->paths->len; ++i){
+		if (in_directories(opt, cj->paths->strings[i])){
+			n_found += add_journal_path(cj->paths->strings[i], ss, ex, pending);
+		}
+	}
+
+	/* a file is found once by its own path and once more for every changed directory above it */
+	qsort(pending->files, pending->len, sizeof(*pending->files), found_file_cmp);
+	for (i = 0, j = 0; i < pending->len; ++i){
+		if (j > 0 && strcmp(pending->files[j - 1].file, pending->files[i].file) == 0){
+			free(pending->files[i].file);
+			continue;
+		}
+		pending->files[j++] = pending->files[i];
+	}
+	pending->len = j;
+
+	stats_time_lap(&scan_time, &mark);
+	stats_add(STAGE_SCAN, &scan_time, 0, 0, n_found);
+	return ret;
+}
+
+/* the next file from whichever of fis or fw is walking the directory, and its lstat() in st
+ * a file from fw is kept in *walked, which is freed on the next call unless the caller takes it */
+static const char* next_path(struct fi_stack* fis, struct fi_walk* fw, char** walked, struct stat* st){
+	if (fis){
+		return fi_next_stat(fis, st);
+	}
+	if (fw){
+		free(*walked);
+		return (*walked = fi_walk_next_stat(fw, st));
+	}
+	return NULL;
+}
+
+/* walks every directory on a lane's device, and runs on a thread of its own if there are other devices */
+static void walk_lane(void* arg){
+	struct device_lane* dl = arg;
+	const struct options* opt = dl->ctx->opt;
+	const struct snapshot_set* ss = dl->ctx->ss;
+	size_t i;
+
+	for (i = 0; i < opt->directories->len; ++i){
+		struct fi_stack* fis = NULL;
+		struct fi_walk* fw = NULL;
+		char* walked = NULL;
+		char* dir_frozen = NULL;
+		const char* dir = opt->directories->strings[i];
+		const char* tmp;
+		struct stat st;
+
+		struct stats_time scan_time = { 0, 0 };
+		struct stats_time mark;
+		struct stats_time start;
+		unsigned long n_found = 0;
+
+		if (dl->dir_lanes[i] != dl->lane){
+			continue;
+		}
+
+		stats_time_now(&mark);
+		start = mark;
+		if (ss && !(dir = dir_frozen = snapshot_path(ss, dir))){
+			log_enomem();
+		}
+		else if (!opt->flags.bits.flag_parallel_walk){
+			fis = start_walk(dir, dl->ex);
+		}
+		else if (!exclude_match(dl->ex, dir) && !(fw = fi_walk_start(dir, 0, 0, exclude_skip, dl->ex))){
+			log_warning_ex("Failed to fi_start in directory %s", dir);
+		}
+		while ((tmp = next_path(fis, fw, &walked, &st)) != NULL){
+			struct found_meta found;
+			char* file;
+
+			stats_time_lap(&scan_time, &mark);
+			n_found++;
+
+			found_meta_from_stat(&st, &found);
+			/* the file is named as it is outside the snapshot, and only read from inside it */
+			if (ss){
+				file = snapshot_live_path(ss, tmp);
+			}
+			else{
+				file = walked ? walked : sh_dup(tmp);
+				walked = NULL;
+			}
+			if (!file){
+				log_enomem();
+			}
+			/* with nothing to compare against, the file can start right away */
+			else if (!dl->pending){
+				submit_file(dl->ds, dl->lane, dl->ctx, file, NULL, &found);
 			}
+			else if (found_list_add(dl->pending, file, &found) != 0){
+				log_warning_ex("Failed to add %s to the file list", tmp);
+			}
+			/* waiting for a free worker is not part of the scan */
+			stats_time_now(&mark);
+		}
+		fi_end(fis);
+		fi_walk_end(fw);
+		free(walked);
+		free(dir_frozen);
+		stats_time_lap(&scan_time, &mark);
+		stats_add(STAGE_SCAN, &scan_time, 0, 0, n_found);
+		/* includes waiting for free workers, which is where a stalled pipeline shows up */
+		trace_since(stats_stage_tostring(STAGE_SCAN), &start, opt->directories->strings[i]);
+	}
+}
+
+/* longest first */
+static int job_size_cmp(const void* j1, const void* j2){
+	uint64_t s1 = found_size(&(*(struct copy_job* const*)j1)->found);
+	uint64_t s2 = found_size(&(*(struct copy_job* const*)j2)->found);
 
-			res = add_checksum_to_file(tmp, opt->hash_algorithm, fp_checksum, fp_checksum_prev, NULL);
-			if (res > 0){
-				log_info_ex("File %s was unchanged", tmp);
+	return s1 < s2 ? 1 : s1 > s2 ? -1 : 0;
+}
+
+/* holds a job until every file has been matched against the previous checksum file
+ * a job with nowhere to wait is submitted right away, which only costs the other devices their turn while it waits for room */
+static void lane_add_job(struct device_lane* dl, struct copy_job* job){
+	if (!job){
+		return;
+	}
+	if (dl->n_jobs >= dl->size_jobs){
+		size_t new_size = dl->size_jobs ? dl->size_jobs * 2 : 1024;
+		struct copy_job** tmp = realloc(dl->jobs, new_size * sizeof(*dl->jobs));
+
+		if (!tmp){
+			log_enomem();
+			submit_job(dl->ds, dl->lane, job);
+			return;
+		}
+		dl->jobs = tmp;
+		dl->size_jobs = new_size;
+	}
+	dl->jobs[dl->n_jobs++] = job;
+}
+
+/* submits a lane's held files, and runs on a thread of its own if there are other devices
+ * each lane only ever waits for room in its own queue, so one busy device does not hold up the others' */
+static void feed_lane(void* arg){
+	struct device_lane* dl = arg;
+	size_t i;
+
+	/* the longest files start first, so they are not the ones left running once everything else is done
+	 * the short ones then fill in around them as workers come free */
+	qsort(dl->jobs, dl->n_jobs, sizeof(*dl->jobs), job_size_cmp);
+	for (i = 0; i < dl->n_jobs; ++i){
+		submit_job(dl->ds, dl->lane, dl->jobs[i]);
+	}
+	free(dl->jobs);
+	dl->jobs = NULL;
+	dl->n_jobs = 0;
+	dl->size_jobs = 0;
+}
+
+/* runs func on every lane at once, or one after another if there is only one or the threads cannot be started */
+/* called by the pressure governor as the host gets busier or quieter */
+static void set_governed_workers(size_t n_workers, void* data){
+	struct copy_context* ctx = data;
+
+	pthread_mutex_lock(&ctx->level_mutex);
+	dev_sched_set_limit(ctx->governed, n_workers);
+	pthread_mutex_unlock(&ctx->level_mutex);
+}
+
+static void run_lanes(struct device_lane* lanes, size_t n_lanes, void(*func)(void*)){
+	struct threadpool* feeders = NULL;
+	size_t i;
+
+	if (n_lanes > 1 && !(feeders = tp_new(n_lanes, n_lanes))){
+		log_warning("Failed to start a thread for each device. They will be read one after another instead.");
+	}
+	for (i = 0; i < n_lanes; ++i){
+		if (!feeders || tp_submit(feeders, func, &lanes[i]) != 0){
+			func(&lanes[i]);
+		}
+	}
+	tp_free(feeders);
+}
+
+static void lanes_free(struct device_lane* lanes, size_t n_lanes){
+	size_t i;
+	size_t j;
+
+	if (!lanes){
+		return;
+	}
+	for (i = 0; i < n_lanes; ++i){
+		for (j = 0; j < lanes[i].n_jobs; ++j){
+			free(lanes[i].jobs[j]->file);
+			free_element(lanes[i].jobs[j]->prev);
+			free(lanes[i].jobs[j]);
+		}
+		free(lanes[i].jobs);
+		/* the only lane shares the list of every file */
+		if (n_lanes > 1){
+			found_list_free(lanes[i].pending);
+		}
+	}
+	free(lanes);
+}
+
+/* every output file is uploaded to each of the clouds in targets, which are logged in already
+ * their cloud_synced is whether they matched the last backup's checksum file, and is set to whether they still will once this one's is finished */
+static int copy_files(const struct options* opt, struct cloud_target* targets, size_t n_targets, const char* password, const char* delta_extension, FILE* fp_checksum, FILE* fp_checksum_prev, FILE* fp_completed, FILE* fp_removed, const char* checkpoint_path, int rehash, const struct change_journal* cj, const struct snapshot_set* ss){
+	struct options opt_dict;
+	struct zip_dict* dict = NULL;
+	struct crypt_session* session = NULL;
+	char* dict_path = NULL;
+	char* chunk_directory = NULL;
+	char* pack_directory = NULL;
+	struct found_list* pending = NULL;
+	struct exclude_trie* ex = NULL;
+	struct string_array* exclude_frozen = NULL;
+	struct copy_context ctx;
+	struct dev_sched* ds = NULL;
+	struct pressure_governor* pg = NULL;
+	struct device_lane* lanes = NULL;
+	size_t* dir_lanes = NULL;
+	size_t n_lanes = 1;
+	int journaled = 0;
+	int ret = 0;
+	size_t i;
+
+	for (i = 0; i < n_targets; ++i){
+		pthread_mutex_init(&targets[i].cloud_mutex, NULL);
+		targets[i].upload_tp = NULL;
+		targets[i].transfers = NULL;
+		targets[i].cloud_failed = 0;
+		targets[i].fp_uploads = NULL;
+	}
+	pthread_mutex_init(&ctx.upload_mutex, NULL);
+	pthread_mutex_init(&ctx.checkpoint_mutex, NULL);
+	pthread_mutex_init(&ctx.level_mutex, NULL);
+	pthread_cond_init(&ctx.upload_cond, NULL);
+	ctx.pw = NULL;
+	ctx.targets = targets;
+	ctx.n_targets = n_targets;
+	ctx.uploads_queued = 0;
+	ctx.uploads_done = 0;
+	ctx.prefetch_tp = NULL;
+	ctx.mi = NULL;
+	ctx.straggler_len = 0;
+	ctx.straggler_workers = 0;
+	ctx.governed = NULL;
+	ctx.policies = NULL;
+
+	/* every worker reads the options, so the session and the dictionary go in a copy of them */
+	opt_dict = *opt;
+	ctx.opt = &opt_dict;
+	/* the password only goes through the key derivation once, instead of once per file */
+	if (opt->enc_algorithm && !(session = crypt_session_new(opt->enc_algorithm, password))){
+		log_error("Failed to start an encryption session.");
+		ret = -1;
+		goto cleanup;
+	}
+	opt_dict.enc_session = session;
+	if (opt->dict_threshold > 0 && zip_dict_supported(opt->c_type)){
+		if (!(dict_path = sh_concat_path(sh_dup(opt->output_directory), "dictionary"))){
+			log_error("Failed to create dictionary path.");
+			ret = -1;
+			goto cleanup;
+		}
+		if ((dict = open_dictionary(dict_path, &opt_dict, password)) != NULL){
+			opt_dict.c_dict = dict;
+		}
+	}
+	ctx.delta_extension = delta_extension;
+	ctx.chunk_directory = NULL;
+	if (opt->flags.bits.flag_dedup){
+		if (!(chunk_directory = sh_concat_path(sh_dup(opt->output_directory), "/chunks"))){
+			log_error("Failed to create chunk directory path.");
+			ret = -1;
+			goto cleanup;
+		}
+		ctx.chunk_directory = chunk_directory;
+	}
+	ctx.password = password;
+	ctx.fp_checksum = fp_checksum;
+	ctx.verbose = opt->flags.bits.flag_verbose;
+	ctx.rehash = rehash;
+	ctx.ss = ss;
+	if (opt->policies->len > 0 && !(ctx.policies = policy_set_new(opt->policies))){
+		log_error("Failed to read the policies.");
+		ret = -1;
+		goto cleanup;
+	}
+
+	/* chunks are already stored once however many files have them, and --cloud-only keeps no output to link to
+	 * checksums from another algorithm cannot be compared to new ones */
+	if (opt->flags.bits.flag_detect_moves && !opt->flags.bits.flag_dedup && !opt->flags.bits.flag_cloud_only && !rehash){
+		ctx.move_min_size = opt->pack_threshold > MOVE_INDEX_MIN_SIZE ? opt->pack_threshold : MOVE_INDEX_MIN_SIZE;
+		if (!(ctx.mi = move_index_new()) || (fp_checksum_prev && move_index_load(ctx.mi, fp_checksum_prev, ctx.move_min_size) != 0)){
+			log_warning("Failed to read the contents of the last backup. Moved files will be copied again.");
+			move_index_free(ctx.mi);
+			ctx.mi = NULL;
+		}
+	}
+
+	/* a session is shared, so a second uploader for the same cloud would only wait on its cloud_mutex
+	 * instead, each cloud's one uploader keeps several transfers in flight within its session, and the clouds upload alongside each other */
+	for (i = 0; i < n_targets; ++i){
+		struct cloud_target* target = &targets[i];
+		long n_resumed;
+
+		if (!(target->upload_tp = tp_new(1, UPLOAD_QUEUE_LEN))){
+			log_warning_ex("Failed to start the uploader thread for %s. Files will be uploaded as they are copied instead.", target->co->upload_directory);
+		}
+		if (!(target->transfers = cloud_transfers_new(target->cd, 0))){
+			log_warning_ex("Failed to start concurrent transfers to %s. Files will be uploaded one at a time instead.", target->co->upload_directory);
+		}
+
+		n_resumed = resume_uploads(&ctx, target);
+		if (n_resumed < 0){
+			log_warning_ex("Failed to start the uploads log for %s. An upload that fails now is not retried by the next backup.", target->co->upload_directory);
+		}
+		/* the cloud was missing these, whatever the manifest said */
+		else if (n_resumed > 0){
+			target->cloud_synced = 0;
+		}
+	}
+
+	if (opt->pack_threshold > 0){
+		if (!(pack_directory = sh_concat_path(sh_dup(opt->output_directory), "/packs"))){
+			log_error("Failed to create pack directory path.");
+			ret = -1;
+			goto cleanup;
+		}
+		if (!(ctx.pw = pack_writer_new(pack_directory, ctx.opt, ctx.password, n_targets > 0 ? on_pack_segment : NULL, &ctx))){
+			log_warning("Failed to start a pack segment. Small files will get their own output file instead.");
+		}
+	}
+
+	if (!(dir_lanes = calloc(opt->directories->len + 1, sizeof(*dir_lanes)))){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+	if (opt->n_threads != 1){
+		size_t n_threads = opt->n_threads ? opt->n_threads : tp_cpu_count();
+
+		/* the workers are shared by every device, and each device gets the next free one in turn, so they are all read at once instead of one after another */
+		n_lanes = dev_sched_group((const char* const*)opt->directories->strings, opt->directories->len, dir_lanes);
+		if (n_lanes > 1){
+			log_info_ex("Reading from %lu devices at once", (unsigned long)n_lanes);
+		}
+		/* a longer queue lets the prefetcher see further ahead than the workers */
+		ds = dev_sched_new(opt->n_threads, n_lanes, opt->device_threads, n_threads * 2 > PREFETCH_AHEAD ? 0 : PREFETCH_AHEAD);
+		if (!ds){
+			log_warning("Failed to start worker threads. Copying files on this thread instead.");
+			n_lanes = 1;
+			memset(dir_lanes, 0, opt->directories->len * sizeof(*dir_lanes));
+		}
+		else if (dev_sched_threads(ds) > 1){
+			ctx.verbose = 0;
+		}
+		/* each worker would otherwise wait on its own cold open() and first read, which adds up on a network filesystem */
+		if (ds && !(ctx.prefetch_tp = tp_new(1, PREFETCH_AHEAD))){
+			log_warning("Failed to start the prefetch thread. Files will only be read once a worker gets to them.");
+		}
+	}
+	/* every file is read after this, so they are all held to the governor's rate */
+	if (opt->flags.bits.flag_background){
+		ctx.governed = ds;
+		if (!(pg = pressure_governor_start(ds ? dev_sched_threads(ds) : 1, set_governed_workers, &ctx))){
+			log_warning("Failed to start watching the pressure on the host. The backup will only run at a lower priority.");
+		}
+	}
+
+	ctx.checkpoint_path = checkpoint_path;
+	ctx.last_checkpoint = time(NULL);
+	ctx.journal_len = 0;
+
+	if (opt->c_target > 0){
+		struct stats_entry se;
+
+		stats_get(STAGE_COMPRESS, &se);
+		ctx.c_level = opt->c_level;
+		ctx.retune_bytes = se.bytes_in;
+		ctx.retune_wall = se.time.wall;
+		ctx.n_streams = ds ? dev_sched_threads(ds) : 1;
+	}
+
+	/* the snapshots are walked instead of the directories, so they need the same paths excluded */
+	if (ss && !(exclude_frozen = snapshot_exclude(ss, opt->exclude))){
+		log_error("Failed to create the exclude list for the snapshots.");
+		ret = -1;
+		goto cleanup;
+	}
+	if (!(ex = exclude_new(exclude_frozen ? exclude_frozen : opt->exclude))){
+		log_error("Failed to compile the exclude list.");
+		ret = -1;
+		goto cleanup;
+	}
+
+	/* one line for every worker and upload at once, instead of a bar per file that the others would tear */
+	if (opt->flags.bits.flag_verbose && progress_board_start("Backing up files...") != 0){
+		log_warning("Failed to start the progress board.");
+	}
+
+	/* with workers to share out, every file is found before any is started, so the longest ones can go first */
+	if ((fp_checksum_prev || fp_completed || ds) && !(pending = calloc(1, sizeof(*pending)))){
+		log_error("Failed to create file list.");
+		ret = -1;
+		goto cleanup;
+	}
+	if (!(lanes = calloc(n_lanes, sizeof(*lanes)))){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+	for (i = 0; i < n_lanes; ++i){
+		lanes[i].ctx = &ctx;
+		lanes[i].ds = ds;
+		lanes[i].ex = ex;
+		lanes[i].dir_lanes = dir_lanes;
+		lanes[i].lane = i;
+		/* each device's walk has a list of its own, so the walks never wait on each other */
+		lanes[i].pending = n_lanes > 1 && pending ? calloc(1, sizeof(*lanes[i].pending)) : pending;
+		if (pending && !lanes[i].pending){
+			log_error("Failed to create file list.");
+			ret = -1;
+			goto cleanup;
+		}
+	}
+
+	/* a file the last backup checksummed with another algorithm has to be read again anyway, and a paranoid backup trusts nothing it did not look at */
+	if (cj && cj->paths && fp_checksum_prev && pending && !rehash && !opt->flags.bits.flag_paranoid){
+		printf("Only looking at the %lu paths that changed since the last backup\n", (unsigned long)cj->paths->len);
+		if (journal_files(opt, ss, ex, cj, fp_checksum_prev, pending) != 0){
+			log_error("Failed to read the file list from the last checksum file.");
+			ret = -1;
+			goto cleanup;
+		}
+		journaled = 1;
+	}
+
+	if (!journaled){
+		run_lanes(lanes, n_lanes, walk_lane);
+	}
+	for (i = 0; n_lanes > 1 && pending && i < n_lanes; ++i){
+		if (found_list_take(pending, lanes[i].pending) != 0){
+			log_warning("Failed to add a device's files to the file list");
+		}
+	}
+
+	if (pending){
+		struct checksum_reader* cr_prev = NULL;
+		struct checksum_reader* cr_completed = NULL;
+		const struct element* e_prev = NULL;
+		const struct element* e_completed = NULL;
+		struct stats_time start;
+		uint64_t read_bytes = 0;
+
+		stats_time_now(&start);
+
+		/* the previous checksum file and the journal are sorted the same way,
+		 * so a single sequential pass over each finds every file's old entry */
+		if (!found_list_sorted(pending)){
+			qsort(pending->files, pending->len, sizeof(*pending->files), found_file_cmp);
+		}
+
+		/* the previous checksum file may be front-coded, so it is read with a checksum_reader */
+		if (fp_checksum_prev){
+			cr_prev = merge_start(fp_checksum_prev, &e_prev);
+		}
+		if (fp_completed){
+			cr_completed = merge_start(fp_completed, &e_completed);
+		}
+		for (i = 0; i < pending->len; ++i){
+			struct found_file* f = &pending->files[i];
+			struct element* done;
+			struct copy_job* job;
+			size_t lane;
+
+			/* already finished by the backup that was interrupted */
+			if (cr_completed && (done = merge_next(cr_completed, &e_completed, f->file, NULL)) != NULL){
+				free_element(done);
+				cr_prev ? free_element(merge_next(cr_prev, &e_prev, f->file, fp_removed)) : (void)0;
+				continue;
+			}
+			job = new_job(&ctx, f->file, cr_prev ? merge_next(cr_prev, &e_prev, f->file, fp_removed) : NULL, &f->found);
+			f->file = NULL;
+			if (!job){
+				continue;
 			}
-			else if (res == 0){
-				printf("%s\n", tmp);
-				if (copy_single_file(tmp, opt, delta_extension, cd, co->upload_directory, password ? password : opt->enc_password) != 0){
-					log_warning_ex("Failed to copy %s", tmp);
-				}
+			lane = n_lanes > 1 ? lane_of_file(opt, dir_lanes, job->file) : 0;
+			/* an unchanged file only costs a look at its metadata, so it can go right away */
+			if (!ds || !will_be_read(&ctx, job->prev, &job->found)){
+				submit_job(ds, lane, job);
 			}
+			/* the rest wait in their device's lane, since in path order one device's files would all come before the next one's */
 			else{
-				log_error_ex("Failed to calculate checksum for %s", tmp);
+				read_bytes += found_size(&job->found);
+				lane_add_job(&lanes[lane], job);
 			}
-
-			free(tmp);
 		}
-		fi_end(fis);
+		/* everything after the last file found was removed too */
+		if (cr_prev){
+			merge_next(cr_prev, &e_prev, NULL, fp_removed);
+		}
+		checksum_reader_free(cr_prev);
+		checksum_reader_free(cr_completed);
+		trace_since("merge", &start, NULL);
+
+		/* a file longer than every worker's share of the rest would finish last however early it starts
+		 * the workers the compressor already has are left alone, and so are the ones a memory limit left it */
+		if (ds && dev_sched_threads(ds) > 1 && ZIP_GET_WORKERS(opt_dict.c_flags) == 0 && opt->memory_limit == 0){
+			ctx.straggler_workers = dev_sched_threads(ds) < 255 ? (unsigned)dev_sched_threads(ds) : 255;
+			ctx.straggler_len = read_bytes / dev_sched_threads(ds);
+			if (ctx.straggler_len < STRAGGLER_MIN_LEN){
+				ctx.straggler_len = STRAGGLER_MIN_LEN;
+			}
+		}
+		run_lanes(lanes, n_lanes, feed_lane);
 	}
 
 cleanup:
-	cloud_logout(cd);
-	free(password);
+	/* every job has to finish before the checksum files and cloud session go away */
+	pthread_mutex_lock(&ctx.level_mutex);
+	ctx.governed = NULL;
+	pthread_mutex_unlock(&ctx.level_mutex);
+	dev_sched_free(ds);
+	tp_free(ctx.prefetch_tp);
+	/* nothing is read anymore */
+	pressure_governor_stop(pg);
+	lanes_free(lanes, n_lanes);
+	free(dir_lanes);
+	found_list_free(pending);
+	exclude_free(ex);
+	exclude_frozen ? sa_free(exclude_frozen) : (void)0;
+	/* the last segment has to be closed and uploaded before logging out */
+	if (ctx.pw && pack_writer_close(ctx.pw) != 0){
+		log_error("Failed to finish the last pack segment.");
+		ret = -1;
+	}
+	/* drains each upload queue, then waits for the uploads they started */
+	for (i = 0; i < n_targets; ++i){
+		tp_free(targets[i].upload_tp);
+	}
+	for (i = 0; i < n_targets; ++i){
+		cloud_transfers_free(targets[i].transfers);
+	}
+	progress_board_finish();
+	for (i = 0; i < n_targets; ++i){
+		struct cloud_target* target = &targets[i];
+
+		target->cloud_synced = ret == 0 && !target->cloud_failed;
+		if (target->fp_uploads){
+			fclose(target->fp_uploads);
+			/* only what is still missing from the cloud has to be kept */
+			if (target->cloud_synced){
+				remove(target->uploads_path);
+			}
+		}
+		pthread_mutex_destroy(&target->cloud_mutex);
+	}
+	move_index_free(ctx.mi);
+	policy_set_free(ctx.policies);
+	free(chunk_directory);
+	free(pack_directory);
+	free(dict_path);
+	zip_dict_free(dict);
+	crypt_session_free(session);
+	pthread_mutex_destroy(&ctx.upload_mutex);
+	pthread_mutex_destroy(&ctx.checkpoint_mutex);
+	pthread_mutex_destroy(&ctx.level_mutex);
+	pthread_cond_destroy(&ctx.upload_cond);
 	return ret;
 }
 
-static int cloud_remove_deleted_files(const char* checksum_file, const char* delta_extension, const struct cloud_options* co){
-	struct TMPFILE* tfp_removed = NULL;
-	struct cloud_data* cd = NULL;
-	char* tmp;
-	int ret = 0;
+/* counts the moves to deltas/ as they finish on the cloud provider's threads */
+struct remove_counts{
+	pthread_mutex_t lock;
+	unsigned long n_removed;
+	unsigned long n_failed;
+};
 
-	if (!file_exists(checksum_file)){
-		log_info("Previous checksum file does not exist.");
-		return 0;
-	}
+static void on_removed(int res, void* data){
+	struct remove_counts* rc = data;
 
-	tfp_removed = temp_fopen();
-	if (!tfp_removed){
-		log_warning("Failed to create temporary file.");
-		ret = -1;
-		goto cleanup;
+	pthread_mutex_lock(&rc->lock);
+	if (res == 0){
+		rc->n_removed++;
 	}
-
-	if (create_removed_list(checksum_file, tfp_removed->name)){
-		log_warning("Failed to create removed list.");
-		ret = -1;
-		goto cleanup;
+	else{
+		rc->n_failed++;
 	}
+	pthread_mutex_unlock(&rc->lock);
+}
+
+/* tfp_removed is the list of files that copy_files() did not find again
+ * output_directory is given if the cloud is in sync with it, so a file with an output file there does not have to be looked up
+ * the moves to deltas/ are kept in flight together, and the list is sorted, so a directory's files come one after another and its delta directory is made once */
+static int cloud_remove_deleted_files(struct TMPFILE* tfp_removed, const char* delta_extension, const struct cloud_options* co, const char* output_directory, struct cloud_data* cd){
+	struct checksum_reader* cr = NULL;
+	struct cloud_transfers* ct = NULL;
+	struct remove_counts rc;
+	struct stats_time start;
+	struct file_paths cloud;
+	struct file_paths output;
+	struct path_builder last_parent = PB_INIT;
+	const struct element* e;
+	int ret = 0;
+
+	memset(&cloud, 0, sizeof(cloud));
+	memset(&output, 0, sizeof(output));
+	pthread_mutex_init(&rc.lock, NULL);
+	rc.n_removed = 0;
+	rc.n_failed = 0;
 
 	if (temp_fflush(tfp_removed) != 0){
 		log_warning("Failed to update temporary file pointer.");
 		ret = -1;
 		goto cleanup;
 	}
+	rewind(tfp_removed->fp);
 
-	if (cloud_login(co, &cd) != 0){
-		log_warning("Failed to log into cloud account.");
+	if (!(cr = checksum_reader_new(tfp_removed->fp, 0)) || !(ct = cloud_transfers_new(cd, 0))){
 		ret = -1;
 		goto cleanup;
 	}
 
-	while ((tmp = get_next_removed(tfp_removed->fp)) != NULL){
-		char* file_path = NULL;
-		char* delta_path = NULL;
-		char* delta_path_parent = NULL;
+	stats_time_now(&start);
+	while (checksum_reader_next(cr, &e) == 0){
+		const char* tmp = e->file;
+		int done = 0;
+		int res;
 
-		if (make_file_paths(tmp, co->upload_directory, delta_extension, &file_path, &delta_path) != 0){
+		if (make_file_paths(tmp, co->upload_directory, delta_extension, &cloud) != 0){
 			log_warning_ex("Failed to create file paths for %s", tmp);
 			goto cleanup_inner_loop;
 		}
 
-		if ((delta_path_parent = sh_parent_dir(delta_path)) == NULL){
-			log_warning_ex("Failed to determine parent dir for %s", delta_path);
-			goto cleanup_inner_loop;
+		if (output_directory){
+			if (make_file_paths(tmp, output_directory, delta_extension, &output) != 0){
+				log_warning_ex("Failed to create file paths for %s", tmp);
+				goto cleanup_inner_loop;
+			}
+			/* a packed file never had an output file of its own, in the cloud or here */
+			if (!file_exists(output.files.str)){
+				done = 1;
+				goto cleanup_inner_loop;
+			}
+			cloud_assume_file(cloud.files.str, cd);
 		}
-
-		if (cloud_mkdir(delta_path_parent, cd) < 0){
-			log_warning_ex("Failed to create directory %s", delta_path);
+		else if ((res = cloud_stat(cloud.files.str, NULL, cd)) != 0){
+			done = res > 0;
 			goto cleanup_inner_loop;
 		}
 
-		if (cloud_rename(file_path, delta_path, cd) != 0){
-			log_warning_ex2("Failed to rename %s to %s", file_path, delta_path);
-			goto cleanup_inner_loop;
+		if (last_parent.len == 0 || strcmp(last_parent.str, cloud.delta_parent.str) != 0){
+			last_parent.len = 0;
+			if (cloud_mkdir(cloud.delta_parent.str, cd) < 0){
+				log_warning_ex("Failed to create directory %s", cloud.delta.str);
+				goto cleanup_inner_loop;
+			}
+			if (pb_set(&last_parent, cloud.delta_parent.str) != 0){
+				last_parent.len = 0;
+			}
 		}
 
-		if (cloud_remove(file_path, cd) != 0){
-			log_warning_ex("Failed to remove %s", file_path);
+		/* moving it to its delta path already takes it out of files/, and on_removed() counts it once it is done */
+		if (cloud_rename_submit(ct, cloud.files.str, cloud.delta.str, on_removed, &rc) != 0){
+			log_warning_ex2("Failed to rename %s to %s", cloud.files.str, cloud.delta.str);
 			goto cleanup_inner_loop;
 		}
+		done = 1;
 
 cleanup_inner_loop:
-		free(file_path);
-		free(delta_path);
-		free(delta_path_parent);
-		free(tmp);
+		if (!done){
+			on_removed(-1, &rc);
+		}
+	}
+	cloud_transfers_wait(ct);
+	stats_record(STAGE_CLOUD_REMOVE, &start, 0, 0, rc.n_removed);
+	trace_since(stats_stage_tostring(STAGE_CLOUD_REMOVE), &start, NULL);
+	if (rc.n_failed > 0){
+		ret = -1;
 	}
 
 cleanup:
-	temp_fclose(tfp_removed);
-	cloud_logout(cd);
+	cloud_transfers_free(ct);
+	checksum_reader_free(cr);
+	pthread_mutex_destroy(&rc.lock);
+	file_paths_free(&cloud);
+	file_paths_free(&output);
+	pb_free(&last_parent);
 	return ret;
 }
 
-static int create_checksum_files(const char* checksum_file, const char* delta_extension, FILE** out_checksum, FILE** out_checksum_prev){
-	FILE* fp_checksum = NULL;
+static int timed_sort_checksum_file(const char* file, uint64_t sort_memory, int front_code){
+	struct stats_time start;
+	uint64_t size = get_file_size(file);
+	int ret;
+
+	stats_time_now(&start);
+	ret = sort_checksum_file(file, sort_memory, front_code);
+	stats_record(STAGE_SORT, &start, size, size, 1);
+	trace_since(stats_stage_tostring(STAGE_SORT), &start, file);
+	return ret;
+}
+
+/* the journal of the current backup is only trusted up to the length in the checkpoint file */
+static long read_checkpoint(const char* checkpoint_file){
+	FILE* fp;
+	long len;
+
+	fp = fopen(checkpoint_file, "rb");
+	if (!fp){
+		return 0;
+	}
+	if (fscanf(fp, "%ld", &len) != 1 || len < 0){
+		log_warning_ex("Checkpoint file %s is corrupt", checkpoint_file);
+		len = 0;
+	}
+	fclose(fp);
+	return len;
+}
+
+/* opens the journal for this backup, and the checksum file from the last one if it exists
+ * if a backup was interrupted, its journal is picked up where the last checkpoint left it,
+ * and out_completed is set to a sorted copy of it so those files can be skipped */
+static int open_checksum_files(const char* checksum_file, const char* journal_file, const char* checkpoint_file, uint64_t sort_memory, FILE** out_journal, FILE** out_checksum_prev, struct TMPFILE** out_completed){
+	FILE* fp_journal = NULL;
 	FILE* fp_checksum_prev = NULL;
-	char* checksum_file_prev = NULL;
+	struct TMPFILE* tfp_completed = NULL;
 	int ret = 0;
 
 	return_ifnull(checksum_file, -1);
-	return_ifnull(out_checksum, -1);
+	return_ifnull(journal_file, -1);
+	return_ifnull(checkpoint_file, -1);
+	return_ifnull(out_journal, -1);
 	return_ifnull(out_checksum_prev, -1);
+	return_ifnull(out_completed, -1);
+
+	/* the last checksum file is left alone until this backup finishes */
+	if (file_exists(checksum_file) && !(fp_checksum_prev = fopen(checksum_file, "rb"))){
+		log_efopen(checksum_file);
+		ret = -1;
+		goto cleanup;
+	}
 
-	if (!file_exists(checksum_file)){
-		fp_checksum = fopen(checksum_file, "wb");
-		if (!fp_checksum){
-			log_efopen(checksum_file);
+	if (file_exists(journal_file)){
+		long len = read_checkpoint(checkpoint_file);
+
+		/* anything after the checkpoint may refer to output that never made it to disk */
+		if (truncate(journal_file, len) != 0){
+			log_error_ex2("Failed to truncate %s (%s)", journal_file, strerror(errno));
 			ret = -1;
 			goto cleanup;
 		}
-		*out_checksum = fp_checksum;
-		*out_checksum_prev = NULL;
-		return 0;
-	}
 
-	checksum_file_prev = sh_sprintf("%s.%s", checksum_file, delta_extension);
-	if (!checksum_file_prev){
-		log_warning("Failed to determine checksum delta location.");
-		ret = -1;
-		goto cleanup;
-	}
+		if (len > 0){
+			printf("Resuming interrupted backup\n");
 
-	if (rename_file(checksum_file, checksum_file_prev) != 0){
-		log_warning("Failed to backup old checksum file.");
-		ret = -1;
-		goto cleanup;
-	}
+			if (!(tfp_completed = temp_fopen())){
+				log_error("Failed to create temporary file");
+				ret = -1;
+				goto cleanup;
+			}
+			/* only copy_files() reads the copy, so it can always be front-coded */
+			if (copy_file(journal_file, tfp_completed->name) != 0 ||
+					timed_sort_checksum_file(tfp_completed->name, sort_memory, 1) != 0 ||
+					temp_fflush(tfp_completed) != 0){
+				log_error("Failed to read the interrupted backup's journal");
+				ret = -1;
+				goto cleanup;
+			}
+		}
 
-	fp_checksum = fopen(checksum_file, "wb");
-	if (!fp_checksum){
-		log_efopen(checksum_file);
-		ret = -1;
-		goto cleanup;
+		fp_journal = fopen(journal_file, "ab");
 	}
-
-	fp_checksum_prev = fopen(checksum_file_prev, "rb");
-	if (!fp_checksum_prev){
-		log_efopen(checksum_file_prev);
+	else{
+		remove(checkpoint_file);
+		fp_journal = fopen(journal_file, "wb");
+	}
+	if (!fp_journal){
+		log_efopen(journal_file);
 		ret = -1;
 		goto cleanup;
 	}
 
 cleanup:
 	if (ret == 0){
-		*out_checksum = fp_checksum;
+		*out_journal = fp_journal;
 		*out_checksum_prev = fp_checksum_prev;
+		*out_completed = tfp_completed;
 	}
 	else{
-		*out_checksum = NULL;
+		*out_journal = NULL;
 		*out_checksum_prev = NULL;
-		fp_checksum ? fclose(fp_checksum) : 0;
+		*out_completed = NULL;
+		fp_journal ? fclose(fp_journal) : 0;
 		fp_checksum_prev ? fclose(fp_checksum_prev) : 0;
+		tfp_completed ? temp_fclose(tfp_completed) : (void)0;
+	}
+	return ret;
+}
+
+/* turns the finished journal into the new checksum file, keeping the old one as a delta */
+static int finish_checksum_files(const char* checksum_file, const char* journal_file, const char* checkpoint_file, const char* delta_extension, uint64_t sort_memory, int front_code){
+	char* checksum_file_prev = NULL;
+	int ret = 0;
+
+	if (timed_sort_checksum_file(journal_file, sort_memory, front_code) != 0){
+		log_error("Failed to sort checksum file");
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (file_exists(checksum_file)){
+		checksum_file_prev = sh_sprintf("%s.%s", checksum_file, delta_extension);
+		if (!checksum_file_prev){
+			log_warning("Failed to determine checksum delta location.");
+			ret = -1;
+			goto cleanup;
+		}
+		if (rename_file(checksum_file, checksum_file_prev) != 0){
+			log_warning("Failed to backup old checksum file.");
+			ret = -1;
+			goto cleanup;
+		}
+	}
+
+	if (rename_file(journal_file, checksum_file) != 0){
+		log_error("Failed to move the checksum journal into place.");
+		ret = -1;
+		goto cleanup;
 	}
+	remove(checkpoint_file);
+
+cleanup:
 	free(checksum_file_prev);
 	return ret;
 }
 
+/* the checksum file is named after every file it lists, so the algorithm that made it is kept next to it
+ * returns NULL if there is no record, which is the case for backups made before it was recorded */
+static char* read_hash_name(const char* hash_name_file){
+	FILE* fp;
+	char buf[64];
+	char* newline;
+
+	fp = fopen(hash_name_file, "rb");
+	if (!fp){
+		return NULL;
+	}
+	if (!fgets(buf, sizeof(buf), fp)){
+		log_warning_ex("%s is empty", hash_name_file);
+		fclose(fp);
+		return NULL;
+	}
+	fclose(fp);
+	if ((newline = strchr(buf, '\n')) != NULL){
+		*newline = '\0';
+	}
+	return sh_dup(buf);
+}
+
+static int write_hash_name(const char* hash_name_file, const char* hash_name){
+	FILE* fp;
+
+	fp = fopen(hash_name_file, "wb");
+	if (!fp){
+		log_efopen(hash_name_file);
+		return -1;
+	}
+	if (fprintf(fp, "%s\n", hash_name) < 0){
+		log_efwrite(hash_name_file);
+		fclose(fp);
+		return -1;
+	}
+	if (fclose(fp) != 0){
+		log_efclose(hash_name_file);
+		return -1;
+	}
+	return 0;
+}
+
 struct cloud_options* generate_filled_co(const struct cloud_options* co){
 	struct cloud_options* ret = co_new();
 	if (!ret){
@@ -484,21 +2964,157 @@ struct cloud_options* generate_filled_co(const struct cloud_options* co){
 	return ret;
 }
 
-int backup(const struct options* opt){
+static void cloud_targets_free(struct cloud_target* targets, size_t n_targets){
+	size_t i;
+
+	for (i = 0; i < n_targets; ++i){
+		cloud_logout(targets[i].cd);
+		co_free(targets[i].co);
+		free(targets[i].uploads_path);
+	}
+	free(targets);
+}
+
+/* adds a cloud to upload to, asking for whatever co leaves out
+ * a cloud that is left without a username or password is skipped */
+static int cloud_targets_add(struct cloud_target** targets, size_t* n_targets, const struct cloud_options* co, char* uploads_path){
+	struct cloud_target* tmp;
+	struct cloud_options* co_true;
+
+	if (!uploads_path){
+		log_enomem();
+		return -1;
+	}
+	if (!(co_true = generate_filled_co(co))){
+		log_error("Failed to generate cloud options structure.");
+		free(uploads_path);
+		return -1;
+	}
+	if (co_true->cp == CLOUD_NONE){
+		co_free(co_true);
+		free(uploads_path);
+		return 0;
+	}
+	if (!(tmp = realloc(*targets, (*n_targets + 1) * sizeof(**targets)))){
+		log_enomem();
+		co_free(co_true);
+		free(uploads_path);
+		return -1;
+	}
+	*targets = tmp;
+	memset(&tmp[*n_targets], 0, sizeof(*tmp));
+	tmp[*n_targets].co = co_true;
+	tmp[*n_targets].uploads_path = uploads_path;
+	(*n_targets)++;
+	return 0;
+}
+
+/* the clouds a backup uploads to, which are --cloud followed by every --mirror
+ * --cloud keeps the uploads log it always had, and the nth mirror's is checksums.txt.uploads.n, so mirrors keep their place in the list */
+static int cloud_targets_new(const struct options* opt, const char* checksum_path, struct cloud_target** out, size_t* out_len){
+	struct cloud_target* targets = NULL;
+	size_t n_targets = 0;
+	size_t i;
+	int ret = 0;
+
+	if (opt->cloud_options->cp != CLOUD_NONE &&
+			cloud_targets_add(&targets, &n_targets, opt->cloud_options, sh_concat(sh_dup(checksum_path), ".uploads")) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+	for (i = 0; i < opt->mirrors->len; ++i){
+		struct cloud_options* co;
+		char suffix[32];
+
+		if (co_from_string(opt->mirrors->strings[i], &co) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+		if (!co->username || !co->password){
+			printf("Mirror %s\n", opt->mirrors->strings[i]);
+		}
+		sprintf(suffix, ".uploads.%lu", (unsigned long)i + 1);
+		if (cloud_targets_add(&targets, &n_targets, co, sh_concat(sh_dup(checksum_path), suffix)) != 0){
+			co_free(co);
+			ret = -1;
+			goto cleanup;
+		}
+		co_free(co);
+	}
+
+cleanup:
+	if (ret != 0){
+		cloud_targets_free(targets, n_targets);
+		targets = NULL;
+		n_targets = 0;
+	}
+	*out = targets;
+	*out_len = n_targets;
+	return ret;
+}
+
+/* what a daemon keeps from one backup to the next */
+struct backup_session{
+	/* the clouds of the last backup, still logged in, or NULL before the first one or after one failed */
+	struct cloud_target* targets;
+	size_t n_targets;
+	/* the encryption password asked for by the first backup, or NULL if it was not asked for */
+	char* password;
+};
+
+struct backup_session* backup_session_new(void){
+	struct backup_session* bs = calloc(1, sizeof(*bs));
+
+	if (!bs){
+		log_enomem();
+		return NULL;
+	}
+	return bs;
+}
+
+void backup_session_free(struct backup_session* bs){
+	if (!bs){
+		return;
+	}
+	cloud_targets_free(bs->targets, bs->n_targets);
+	bs->password ? crypt_freepassword(bs->password) : (void)0;
+	free(bs);
+}
+
+int backup_session_run(const struct options* opt, struct backup_session* bs){
+	struct options opt_auto;
+	struct options opt_budget;
 	char* checksum_path = NULL;
+	char* journal_path = NULL;
+	char* checkpoint_path = NULL;
+	char* hash_name_path = NULL;
+	char* cj_state_path = NULL;
+	char* snapshot_state_path = NULL;
+	char* hash_prev = NULL;
+	struct change_journal* cj = NULL;
+	struct snapshot_set* ss = NULL;
+	const char* md_name = get_evp_md_name(opt->hash_algorithm ? opt->hash_algorithm : EVP_sha1());
+	char hash_name[64];
+	int rehash = 0;
 	FILE* fp_checksum = NULL;
 	FILE* fp_checksum_prev = NULL;
-	struct cloud_options* co_true = NULL;
+	struct TMPFILE* tfp_completed = NULL;
+	struct TMPFILE* tfp_removed = NULL;
+	struct cloud_target* targets = NULL;
+	size_t n_targets = 0;
+	char* password = NULL;
 	unsigned long backup_time = time(NULL);
 	char delta_extension[16];
+	int resuming;
+	size_t i;
 	int ret = 0;
 
 	sprintf(delta_extension, "%lu", backup_time);
-
-	if ((co_true = generate_filled_co(opt->cloud_options)) == NULL){
-		log_error("Failed to generate cloud options structure.");
-		ret = -1;
-		goto cleanup;
+	/* a huge file's tree hash never matches its plain digest, so switching modes has to hash everything again too */
+	sprintf(hash_name, "%.40s%s", md_name ? md_name : "unknown", opt->flags.bits.flag_tree_hash ? "/" TREE_HASH_PREFIX : "");
+	stats_reset();
+	if (opt->trace_file){
+		trace_start();
 	}
 
 	if (mkdir_recursive(opt->output_directory) < 0){
@@ -507,44 +3123,264 @@ int backup(const struct options* opt){
 		goto cleanup;
 	}
 	checksum_path = sh_concat_path(sh_dup(opt->output_directory), "checksums.txt");
-	if (!checksum_path){
+	journal_path = sh_concat(sh_dup(checksum_path), ".partial");
+	checkpoint_path = sh_concat(sh_dup(checksum_path), ".checkpoint");
+	hash_name_path = sh_concat(sh_dup(checksum_path), ".hash");
+	cj_state_path = sh_concat(sh_dup(checksum_path), ".changes");
+	snapshot_state_path = sh_concat(sh_dup(checksum_path), ".snapshots");
+	if (!checksum_path || !journal_path || !checkpoint_path || !hash_name_path || !cj_state_path || !snapshot_state_path){
 		log_error("Failed to determine location of checksum file.");
 		ret = -1;
 		goto cleanup;
 	}
-
-	if (cloud_remove_deleted_files(checksum_path, delta_extension, co_true) != 0){
-		log_warning("Failed to remove deleted files since last backup.");
+	/* before anything in the directory is written */
+	if (check_compressor(opt) != 0){
+		ret = -1;
+		goto cleanup;
 	}
 
-	if (create_checksum_files(checksum_path, delta_extension, &fp_checksum, &fp_checksum_prev) != 0){
-		log_warning("Failed to create checksum delta.");
+	/* the clouds are the same from one backup to the next, since the options are too */
+	if (bs && bs->targets){
+		targets = bs->targets;
+		n_targets = bs->n_targets;
+		bs->targets = NULL;
+		bs->n_targets = 0;
+		for (i = 0; i < n_targets; ++i){
+			targets[i].cloud_synced = 0;
+			targets[i].manifest_matched = 0;
+		}
+	}
+	else if (cloud_targets_new(opt, checksum_path, &targets, &n_targets) != 0){
+		log_error("Failed to generate cloud options structure.");
+		ret = -1;
+		goto cleanup;
 	}
-	if (!fp_checksum){
+
+	/* the cloud may have part of an interrupted backup that neither checksum file mentions */
+	resuming = file_exists(journal_path);
+	if (open_checksum_files(checksum_path, journal_path, checkpoint_path, mem_budget_sort(opt), &fp_checksum, &fp_checksum_prev, &tfp_completed) != 0){
 		log_error("Failed to create checksum file.");
 		ret = -1;
 		goto cleanup;
 	}
 
-	if (copy_files(opt, co_true, delta_extension, fp_checksum, fp_checksum_prev) != 0){
+	if (opt->c_target > 0 || opt->flags.bits.flag_auto_compressor){
+		if (choose_compressor(opt, &opt_auto) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+		opt = &opt_auto;
+	}
+	/* the settings that decide how much memory the backup uses are only lowered once the compressor is known */
+	if (opt->memory_limit > 0){
+		struct mem_budget mb;
+		int res = mem_budget_plan(opt, &opt_budget, &mb);
+
+		if (res < 0){
+			log_error("Failed to fit the backup in its memory limit.");
+			ret = -1;
+			goto cleanup;
+		}
+		mem_budget_print(&mb, stdout);
+		if (res > 0){
+			log_warning("The backup needs more memory than its limit, even with every setting lowered as far as it goes.");
+		}
+		opt = &opt_budget;
+	}
+	source_set_options((size_t)opt->read_size << 10, opt->flags.bits.flag_direct_io, opt->flags.bits.flag_io_uring ? SOURCE_URING_DEPTH : 0);
+	/* the worker threads inherit this thread's priorities, so they are lowered before any start */
+	if (opt->flags.bits.flag_background && background_enter() != 0){
+		log_warning("Failed to lower the backup's priority.");
+	}
+	/* restore() reads this back instead of trusting the options it is given, and it only ever changes from nothing */
+	if (zip_auto_save(opt->output_directory, opt->c_type) != 0){
+		log_warning("Failed to record the compressor. It has to be given again to restore this backup.");
+	}
+
+	if (fp_checksum_prev && (hash_prev = read_hash_name(hash_name_path)) != NULL && strcasecmp(hash_prev, hash_name) != 0){
+		printf("The last backup's checksums were made with %s, so every file is hashed again with %s\n", hash_prev, hash_name);
+		rehash = 1;
+	}
+
+	/* the files that are gone are the ones in the last checksum file that this backup does not find again,
+	 * so they fall out of the pass over it that copy_files() already makes */
+	if (fp_checksum_prev && n_targets > 0 && !(tfp_removed = temp_fopen())){
+		log_warning("Failed to create temporary file. Deleted files will not be removed from the cloud.");
+	}
+
+	/* the filesystem already knows what changed between two snapshots, so the change journal is not needed with them */
+	if (opt->snapshot != SNAPSHOT_NONE){
+		char snapshot_name[32];
+
+		sprintf(snapshot_name, "ezbackup-%s", delta_extension);
+		if (!(ss = snapshot_take(opt->snapshot, opt->directories, snapshot_name, snapshot_state_path))){
+			log_error_ex("Failed to take %s snapshots of the directories being backed up", snapshot_type_tostring(opt->snapshot));
+			ret = -1;
+			goto cleanup;
+		}
+	}
+	/* taken right before the walk, so anything that changes during the backup is in the next journal */
+	else if (opt->change_journal && cj_consume(opt->change_journal, cj_state_path, &cj) < 0){
+		log_warning("Failed to read the change journal. Every directory is walked instead.");
+	}
+
+	if (opt->enc_algorithm && !opt->enc_password && bs && bs->password){
+		password = bs->password;
+		bs->password = NULL;
+	}
+	else if (opt->enc_algorithm && !opt->enc_password){
+		int res;
+
+		while ((res = crypt_getpassword("Enter  encryption password:", "Verify encryption password:", &password)) > 0);
+
+		if (res < 0){
+			log_error("Failed to read encryption password from terminal");
+			ret = -1;
+			goto cleanup;
+		}
+	}
+
+	/* one session per cloud for the whole backup, since logging in and fetching the account's nodes is the slowest part of starting it
+	 * a daemon keeps them from one backup to the next, so only its first one logs in */
+	for (i = 0; i < n_targets; ++i){
+		if (!targets[i].cd && (cloud_login(targets[i].co, &targets[i].cd) != 0 || !targets[i].cd)){
+			log_error_ex("Could not connect to the cloud at %s.", targets[i].co->upload_directory);
+			ret = -1;
+			goto cleanup;
+		}
+	}
+
+	/* if a cloud has exactly what the output directory has, the output directory can say what is in it
+	 * each cloud has its own manifest, since one can fall behind while the others do not */
+	for (i = 0; i < n_targets && fp_checksum_prev && !resuming; ++i){
+		struct cloud_target* target = &targets[i];
+		int res = cloud_sync_check(checksum_path, target->co->upload_directory, opt, password ? password : opt->enc_password, target->cd);
+
+		if (res == 0){
+			target->cloud_synced = 1;
+			target->manifest_matched = 1;
+			/* until this backup commits its own, the manifest would be out of date if it was interrupted */
+			if (cloud_sync_invalidate(target->co->upload_directory, target->cd) != 0){
+				log_warning("Failed to mark the cloud manifest as out of date.");
+			}
+		}
+		else{
+			printf("The cloud at %s is not known to match the last backup, so every file is looked up in it\n", target->co->upload_directory);
+		}
+	}
+
+	/* an interrupted backup leaves the journal behind, so the next one can pick up where it stopped
+	 * the files are read, hashed, compressed and encrypted once, however many clouds they go to */
+	if (copy_files(opt, targets, n_targets, password ? password : opt->enc_password, delta_extension, fp_checksum, fp_checksum_prev, tfp_completed ? tfp_completed->fp : NULL, tfp_removed ? tfp_removed->fp : NULL, checkpoint_path, rehash, ss ? snapshot_changes(ss) : cj, ss) != 0){
 		log_error("Error copying files to their destinations");
 		ret = -1;
 		goto cleanup;
 	}
 
+	for (i = 0; i < n_targets; ++i){
+		struct cloud_target* target = &targets[i];
+
+		if (tfp_removed && cloud_remove_deleted_files(tfp_removed, delta_extension, target->co, target->cloud_synced && !opt->flags.bits.flag_cloud_only ? opt->output_directory : NULL, target->cd) != 0){
+			log_warning_ex("Failed to remove deleted files since last backup from %s.", target->co->upload_directory);
+			target->cloud_synced = 0;
+		}
+		/* the files that are gone could not be listed, so the cloud may still have them */
+		if (fp_checksum_prev && !tfp_removed){
+			target->cloud_synced = 0;
+		}
+	}
+
 	if (fclose(fp_checksum) != 0){
-		log_efclose(checksum_path);
+		log_efclose(journal_path);
+		fp_checksum = NULL;
+		ret = -1;
+		goto cleanup;
 	}
 	fp_checksum = NULL;
 
-	if (sort_checksum_file(checksum_path) != 0){
-		log_warning("Failed to sort checksum file");
+	/* the checksum file must not list an output that a power loss could still take back */
+	if (opt->flags.bits.flag_durable && sync_filesystem(opt->output_directory) != 0){
+		log_error("Failed to make the backed up files durable");
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (finish_checksum_files(checksum_path, journal_path, checkpoint_path, delta_extension, (uint64_t)opt->sort_memory << 20, opt->flags.bits.flag_front_code) != 0){
+		log_warning("Failed to finish checksum file");
+	}
+	else{
+		if (opt->flags.bits.flag_durable && sync_filesystem(opt->output_directory) != 0){
+			log_warning("Failed to make the finished checksum file durable. A power loss may bring back the last one.");
+		}
+		if (write_hash_name(hash_name_path, hash_name) != 0){
+			log_warning("Failed to record the checksum algorithm. The next backup will not notice if it changes.");
+		}
+		/* the next backup merges whatever this one could not */
+		if (catalog_update(opt->output_directory, backup_time) != 0){
+			log_warning("Failed to update the catalog of versions.");
+		}
+		/* only a checksum file with everything in it can be the base for the next journal */
+		if (cj && cj_commit(cj_state_path, cj) != 0){
+			log_warning("Failed to record the change journal. The next backup walks every directory.");
+		}
+		if (ss && snapshot_commit(ss, snapshot_state_path) != 0){
+			log_warning("Failed to record the snapshots. The next backup walks every directory.");
+		}
+		/* only now does a cloud have everything the checksum file says, which the next backup can trust */
+		for (i = 0; i < n_targets; ++i){
+			if (targets[i].cloud_synced && cloud_sync_commit(checksum_path, targets[i].manifest_matched ? fp_checksum_prev : NULL, targets[i].co->upload_directory, opt, password ? password : opt->enc_password, targets[i].cd) != 0){
+				log_warning_ex("Failed to upload the cloud manifest to %s. The next backup looks up every file in it.", targets[i].co->upload_directory);
+			}
+		}
+	}
+
+	stats_print(stdout);
+	/* the limit is what the settings were planned for, so going over it means the estimates missed something */
+	if (opt->memory_limit > 0 && stats_peak_memory() > (uint64_t)opt->memory_limit << 20){
+		log_warning_ex2("The backup used %lu MiB of memory, more than its limit of %lu MiB.", (unsigned long)(stats_peak_memory() >> 20), opt->memory_limit);
+	}
+	if (opt->stats_file && stats_write(opt->stats_file) != 0){
+		log_warning_ex("Failed to write backup statistics to %s", opt->stats_file);
 	}
 
 cleanup:
+	/* written whether or not the backup succeeded, since a failed run is what monitoring most needs to see */
+	if (opt->metrics_file && stats_write_prometheus(opt->metrics_file, ret == 0) != 0){
+		log_warning_ex("Failed to write backup metrics to %s", opt->metrics_file);
+	}
+	if (opt->trace_file && trace_stop(opt->trace_file) != 0){
+		log_warning_ex("Failed to write the backup trace to %s", opt->trace_file);
+	}
 	fp_checksum ? fclose(fp_checksum) : 0;
 	fp_checksum_prev ? fclose(fp_checksum_prev) : 0;
+	tfp_completed ? temp_fclose(tfp_completed) : (void)0;
+	tfp_removed ? temp_fclose(tfp_removed) : (void)0;
 	free(checksum_path);
-	co_free(co_true);
+	free(journal_path);
+	free(checkpoint_path);
+	free(hash_name_path);
+	free(cj_state_path);
+	free(snapshot_state_path);
+	free(hash_prev);
+	cj_free(cj);
+	/* destroys the snapshots unless they were recorded for the next backup */
+	snapshot_free(ss);
+	/* a session that was part of a failed backup may be why it failed, so the next one logs in again */
+	if (bs && ret == 0){
+		bs->targets = targets;
+		bs->n_targets = n_targets;
+		targets = NULL;
+		n_targets = 0;
+	}
+	cloud_targets_free(targets, n_targets);
+	if (bs && password){
+		bs->password = password;
+		password = NULL;
+	}
+	free(password);
 	return ret;
 }
+
+int backup(const struct options* opt){
+	return backup_session_run(opt, NULL);
+}
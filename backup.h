@@ -24,4 +24,50 @@
  */
 int backup(const struct options* opt);
 
+/**
+ * @brief What backup_session_run() keeps from one backup to the next, which are the logged in cloud sessions and the encryption password.
+ */
+struct backup_session;
+
+/**
+ * @brief Creates an empty backup session, which logs in and asks for the password during its first backup.
+ *
+ * @return A backup session, or NULL on failure.<br>
+ * This must be freed with backup_session_free() when no longer in use.
+ */
+struct backup_session* backup_session_new(void);
+
+/**
+ * @brief Performs a backup like backup(), reusing what the last backup in the session kept.<br>
+ * The cloud sessions are only kept after a backup that succeeded, so one that broke during a failed backup is replaced by the next one.
+ *
+ * @param opt The options structure to use, which has to be the same for every backup in the session.
+ *
+ * @param bs The session, or NULL to keep nothing, which is what backup() does.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int backup_session_run(const struct options* opt, struct backup_session* bs);
+
+/**
+ * @brief Frees a backup session, logging out of its clouds.
+ *
+ * @param bs The session.<br>
+ * This can be NULL, in which case this function does nothing.
+ *
+ * @return void
+ */
+void backup_session_free(struct backup_session* bs);
+
+/**
+ * @brief Copies a cloud options structure, asking the user for the username and password if they are missing.
+ *
+ * @param co The cloud options to copy.
+ *
+ * @return A filled cloud options structure, or NULL on failure.<br>
+ * If the user leaves the username or password blank, its provider is set to CLOUD_NONE.<br>
+ * This structure must be freed with co_free() when no longer in use.
+ */
+struct cloud_options* generate_filled_co(const struct cloud_options* co);
+
 #endif
@@ -0,0 +1,275 @@
+/** @file bench/backupbench.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ *
+ * Times backup() end to end over a generated tree, first in full and then after every run of mutations, at whatever scale the disk allows.<br>
+ * Run it with "make bench-backup", passing options through BACKUPBENCHFLAGS (e.g. make bench-backup BACKUPBENCHFLAGS="-n 2000000 -S 20G -r 3").
+ */
+
+#include "datagen.h"
+#include "../backup.h"
+#include "../options/options.h"
+#include "../strings/stringarray.h"
+#include "../strings/stringhelper.h"
+#include "../compression/zip.h"
+#include "../stats.h"
+#include "../log.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* the tree and the backups go under here, in the working directory unless -o says otherwise */
+#define BACKUPBENCH_DIR "BACKUPBENCH_DIR"
+
+static void print_usage(const char* progname){
+	struct datagen_options def;
+
+	datagen_defaults(&def);
+	printf("Usage: %s [options]\n", progname);
+	printf("Builds a reproducible tree, backs it up, then mutates it and backs it up again for every run.\n");
+	printf("The tree is left in place afterwards, so it can be inspected or removed with rm -rf.\n");
+	printf("Options:\n");
+	printf("\t-c <0-100>    percentage of each file that compresses well (default %u)\n", def.compressibility);
+	printf("\t-d <n>        maximum directory depth (default %u)\n", def.max_depth);
+	printf("\t-f <n>        subdirectories per directory (default %u)\n", def.fanout);
+	printf("\t-g            only generate the tree and its mutations, without backing it up\n");
+	printf("\t-h            show this help\n");
+	printf("\t-m <0-100>    percentage of files rewritten each run (default %u)\n", def.mutation);
+	printf("\t-n <n>        number of files (default %lu)\n", def.n_files);
+	printf("\t-o <dir>      where to put the tree and the backups (default %s)\n", BACKUPBENCH_DIR);
+	printf("\t-r <n>        incremental runs after the first full one (default 1)\n");
+	printf("\t-s <size>     smallest file, with an optional K, M, G or T suffix (default %lu)\n", (unsigned long)def.min_size);
+	printf("\t-S <size>     largest file (default %luK)\n", (unsigned long)(def.max_size >> 10));
+	printf("\t-t <n>        backup threads, 0 for one per processor (default 0)\n");
+	printf("\t-w <n>        average files per directory (default %lu)\n", def.files_per_dir);
+	printf("\t-x <n>        seed; the same seed and options always build the same tree (default %lu)\n", (unsigned long)def.seed);
+	printf("\t-z <name>     compressor to back up with (default the backup default)\n");
+}
+
+static int parse_ulong(const char* str, unsigned long max, unsigned long* out){
+	char* endptr;
+
+	*out = strtoul(str, &endptr, 10);
+	if (str[0] == '\0' || str[0] == '-' || *endptr != '\0' || *out > max){
+		fprintf(stderr, "Invalid number %s\n", str);
+		return -1;
+	}
+	return 0;
+}
+
+static int parse_size(const char* str, uint64_t* out){
+	const char* suffixes = "KMGT";
+	char* endptr;
+	double value;
+	const char* s;
+
+	value = strtod(str, &endptr);
+	if (str[0] == '\0' || str[0] == '-' || endptr == str || (*endptr != '\0' && endptr[1] != '\0')){
+		fprintf(stderr, "Invalid size %s\n", str);
+		return -1;
+	}
+	if (*endptr != '\0'){
+		if (!(s = strchr(suffixes, *endptr >= 'a' ? *endptr - 'a' + 'A' : *endptr))){
+			fprintf(stderr, "Invalid size suffix %c\n", *endptr);
+			return -1;
+		}
+		for (; s >= suffixes; --s){
+			value *= 1024;
+		}
+	}
+	*out = (uint64_t)value;
+	return 0;
+}
+
+/* one line per run: what the generator wrote, and how long backup() took over the whole tree */
+static void print_run(unsigned run, const struct datagen_result* gen, double gen_seconds, uint64_t tree_bytes, unsigned long tree_files, double backup_seconds){
+	printf("%-5u %12lu %12.1f %10.2f", run, gen->n_files, (double)gen->n_bytes / (1 << 20), gen_seconds);
+	if (backup_seconds < 0){
+		printf("\n");
+	}
+	else{
+		double seconds = backup_seconds > 0 ? backup_seconds : 1e-6;
+
+		printf(" %10.2f %12.1f %12.0f\n", backup_seconds, (double)tree_bytes / (1 << 20) / seconds, (double)tree_files / seconds);
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char** argv){
+	struct datagen_options dg;
+	struct datagen_result gen;
+	struct options* opt = NULL;
+	const char* base = BACKUPBENCH_DIR;
+	char* tree = NULL;
+	char* abs_base = NULL;
+	char* abs_tree = NULL;
+	unsigned long runs = 1;
+	unsigned long n_threads = 0;
+	const char* compressor = NULL;
+	int generate_only = 0;
+	uint64_t tree_bytes;
+	unsigned run;
+	int ret = 1;
+	int i;
+
+	datagen_defaults(&dg);
+	log_setlevel(LEVEL_ERROR);
+
+	for (i = 1; i < argc; ++i){
+		unsigned long n = 0;
+		const char* arg;
+
+		if (!strcmp(argv[i], "-h")){
+			print_usage(argv[0]);
+			return 0;
+		}
+		if (!strcmp(argv[i], "-g")){
+			generate_only = 1;
+			continue;
+		}
+		if (strlen(argv[i]) != 2 || argv[i][0] != '-' || i + 1 >= argc){
+			print_usage(argv[0]);
+			return 1;
+		}
+		arg = argv[++i];
+		switch (argv[i - 1][1]){
+		case 'c':
+			if (parse_ulong(arg, 100, &n) != 0){
+				return 1;
+			}
+			dg.compressibility = (unsigned)n;
+			break;
+		case 'd':
+			if (parse_ulong(arg, 64, &n) != 0){
+				return 1;
+			}
+			dg.max_depth = (unsigned)n;
+			break;
+		case 'f':
+			if (parse_ulong(arg, 1000000, &n) != 0){
+				return 1;
+			}
+			dg.fanout = (unsigned)n;
+			break;
+		case 'm':
+			if (parse_ulong(arg, 100, &n) != 0){
+				return 1;
+			}
+			dg.mutation = (unsigned)n;
+			break;
+		case 'n':
+			if (parse_ulong(arg, (unsigned long)-1, &dg.n_files) != 0){
+				return 1;
+			}
+			break;
+		case 'o':
+			base = arg;
+			break;
+		case 'r':
+			if (parse_ulong(arg, 100000, &runs) != 0){
+				return 1;
+			}
+			break;
+		case 's':
+			if (parse_size(arg, &dg.min_size) != 0){
+				return 1;
+			}
+			break;
+		case 'S':
+			if (parse_size(arg, &dg.max_size) != 0){
+				return 1;
+			}
+			break;
+		case 't':
+			if (parse_ulong(arg, 4096, &n_threads) != 0){
+				return 1;
+			}
+			break;
+		case 'w':
+			if (parse_ulong(arg, (unsigned long)-1 / 2, &dg.files_per_dir) != 0){
+				return 1;
+			}
+			break;
+		case 'x':
+			if (parse_ulong(arg, (unsigned long)-1, &n) != 0){
+				return 1;
+			}
+			dg.seed = n;
+			break;
+		case 'z':
+			compressor = arg;
+			break;
+		default:
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	tree_bytes = datagen_total_size(&dg);
+	if (!(tree = sh_concat_path(sh_dup(base), "tree"))){
+		goto cleanup;
+	}
+	printf("Tree: %lu files, %.1f MiB under %s\n", dg.n_files, (double)tree_bytes / (1 << 20), tree);
+
+	if (!generate_only){
+		opt = options_new();
+		if (!opt){
+			goto cleanup;
+		}
+		/* backup() stores the paths it is given, so they are made absolute like the command line's are */
+		if (!(abs_base = base[0] == '/' ? sh_dup(base) : sh_concat_path(sh_getcwd(), base)) ||
+				!(abs_tree = sh_concat_path(sh_dup(abs_base), "tree")) ||
+				sa_add(opt->directories, abs_tree) != 0){
+			goto cleanup;
+		}
+		free(opt->output_directory);
+		if (!(opt->output_directory = sh_concat_path(sh_dup(abs_base), "backup"))){
+			goto cleanup;
+		}
+		opt->n_threads = (unsigned)n_threads;
+		if (compressor && (opt->c_type = get_compressor_byname(compressor)) == COMPRESSOR_INVALID){
+			fprintf(stderr, "Unknown compressor %s\n", compressor);
+			goto cleanup;
+		}
+	}
+
+	printf("%-5s %12s %12s %10s %10s %12s %12s\n", "Run", "Written", "MiB written", "Gen(s)", "Backup(s)", "MiB/s", "Files/s");
+	for (run = 0; run <= runs; ++run){
+		struct stats_time start;
+		struct stats_time end;
+		double gen_seconds;
+		double backup_seconds = -1;
+
+		dg.run = run;
+		stats_time_now(&start);
+		if ((run == 0 ? datagen_build(tree, &dg, &gen) : datagen_mutate(tree, &dg, &gen)) != 0){
+			fprintf(stderr, "Failed to generate run %u\n", run);
+			goto cleanup;
+		}
+		stats_time_now(&end);
+		gen_seconds = end.wall - start.wall;
+
+		if (!generate_only){
+			stats_time_now(&start);
+			if (backup(opt) != 0){
+				fprintf(stderr, "Backup %u failed\n", run);
+				goto cleanup;
+			}
+			stats_time_now(&end);
+			backup_seconds = end.wall - start.wall;
+		}
+		print_run(run, &gen, gen_seconds, tree_bytes, dg.n_files, backup_seconds);
+	}
+	ret = 0;
+
+cleanup:
+	opt ? options_free(opt) : (void)0;
+	free(tree);
+	free(abs_base);
+	free(abs_tree);
+	return ret;
+}
@@ -0,0 +1,253 @@
+/** @file bench/baseline.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "baseline.h"
+#include "../filehelper.h"
+#include "../strings/stringhelper.h"
+#include "../log.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+/* scales a median absolute deviation to the standard deviation of normally distributed timings */
+#define MAD_TO_SIGMA 1.4826
+
+int bench_profile(char* out, size_t len){
+	struct utsname un;
+	long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	char* c;
+
+	return_ifnull(out, -1);
+
+	if (uname(&un) != 0){
+		log_error_ex("Failed to get the machine's name (%s)", strerror(errno));
+		return -1;
+	}
+	if ((size_t)snprintf(out, len, "%s-%ldcpu-%s", un.machine, n_cpus > 0 ? n_cpus : 1L, un.nodename) >= len){
+		log_error("The machine profile is too long");
+		return -1;
+	}
+	/* it becomes a file name */
+	for (c = out; *c; ++c){
+		if (*c == '/' || *c == ' '){
+			*c = '_';
+		}
+	}
+	return 0;
+}
+
+char* bench_baseline_path(const char* dir, const char* profile){
+	char* ret;
+
+	return_ifnull(dir, NULL);
+	return_ifnull(profile, NULL);
+
+	ret = malloc(strlen(dir) + strlen(profile) + sizeof("/.json"));
+	if (!ret){
+		log_enomem();
+		return NULL;
+	}
+	sprintf(ret, "%s/%s.json", dir, profile);
+	return ret;
+}
+
+static void write_json_string(FILE* fp, const char* str){
+	fputc('"', fp);
+	for (; *str; ++str){
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\'){
+			fputc('\\', fp);
+			fputc(c, fp);
+		}
+		else if (c < 0x20){
+			fprintf(fp, "\\u%04x", c);
+		}
+		else{
+			fputc(c, fp);
+		}
+	}
+	fputc('"', fp);
+}
+
+int bench_baseline_save(const char* path, const char* profile, const struct bench_result* results, size_t len){
+	char* dir;
+	char* slash;
+	FILE* fp;
+	size_t i;
+
+	return_ifnull(path, -1);
+	return_ifnull(profile, -1);
+	return_ifnull(results, -1);
+
+	if ((slash = strrchr(path, '/')) != NULL){
+		if (!(dir = sh_dup(path))){
+			return -1;
+		}
+		dir[slash - path] = '\0';
+		if (mkdir_recursive(dir) < 0){
+			log_error_ex("Failed to create %s", dir);
+			free(dir);
+			return -1;
+		}
+		free(dir);
+	}
+
+	fp = fopen(path, "w");
+	if (!fp){
+		log_efopen(path);
+		return -1;
+	}
+	/* one result per line, which is all bench_baseline_load() has to understand */
+	fprintf(fp, "{\n\t\"profile\": ");
+	write_json_string(fp, profile);
+	fprintf(fp, ",\n\t\"results\": [\n");
+	for (i = 0; i < len; ++i){
+		fprintf(fp, "\t\t{\"name\": ");
+		write_json_string(fp, results[i].name);
+		fprintf(fp, ", \"reps\": %u, \"p50\": %.9g, \"mad\": %.9g}%s\n", results[i].reps, results[i].p50, results[i].mad, i + 1 < len ? "," : "");
+	}
+	fprintf(fp, "\t]\n}\n");
+	if (ferror(fp)){
+		log_efwrite(path);
+		fclose(fp);
+		return -1;
+	}
+	if (fclose(fp) != 0){
+		log_efclose(path);
+		return -1;
+	}
+	return 0;
+}
+
+/* reads the string after "name": on a line, undoing write_json_string()'s escapes of quotes and backslashes */
+static int parse_name(const char* line, char* out){
+	const char* p = strstr(line, "\"name\":");
+	size_t len = 0;
+
+	if (!p || !(p = strchr(p + sizeof("\"name\":") - 1, '"'))){
+		return -1;
+	}
+	for (++p; *p && *p != '"'; ++p){
+		if (*p == '\\' && p[1]){
+			++p;
+		}
+		if (len + 1 >= BENCH_NAME_MAX){
+			return -1;
+		}
+		out[len++] = *p;
+	}
+	out[len] = '\0';
+	return *p == '"' ? 0 : -1;
+}
+
+static int parse_number(const char* line, const char* key, double* out){
+	const char* p = strstr(line, key);
+	char* endptr;
+
+	if (!p){
+		return -1;
+	}
+	p += strlen(key);
+	*out = strtod(p, &endptr);
+	return endptr == p ? -1 : 0;
+}
+
+int bench_baseline_load(const char* path, struct bench_result** out, size_t* out_len){
+	struct bench_result* results = NULL;
+	size_t len = 0;
+	size_t cap = 0;
+	char line[512];
+	FILE* fp;
+	int ret = 0;
+
+	return_ifnull(path, -1);
+	return_ifnull(out, -1);
+	return_ifnull(out_len, -1);
+
+	fp = fopen(path, "r");
+	if (!fp){
+		if (errno == ENOENT){
+			return 1;
+		}
+		log_efopen(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp)){
+		struct bench_result r;
+		double reps;
+
+		if (!strstr(line, "\"name\":")){
+			continue;
+		}
+		memset(&r, 0, sizeof(r));
+		if (parse_name(line, r.name) != 0 ||
+				parse_number(line, "\"reps\":", &reps) != 0 ||
+				parse_number(line, "\"p50\":", &r.p50) != 0 ||
+				parse_number(line, "\"mad\":", &r.mad) != 0){
+			log_error_ex("%s is not a baseline", path);
+			ret = -1;
+			goto cleanup;
+		}
+		r.reps = (unsigned)reps;
+
+		if (len >= cap){
+			struct bench_result* tmp;
+
+			cap = cap ? cap * 2 : 16;
+			if (!(tmp = realloc(results, cap * sizeof(*results)))){
+				log_enomem();
+				ret = -1;
+				goto cleanup;
+			}
+			results = tmp;
+		}
+		results[len++] = r;
+	}
+
+cleanup:
+	fclose(fp);
+	if (ret != 0){
+		free(results);
+		return ret;
+	}
+	*out = results;
+	*out_len = len;
+	return 0;
+}
+
+const struct bench_result* bench_baseline_find(const struct bench_result* results, size_t len, const char* name){
+	size_t i;
+
+	if (!results || !name){
+		return NULL;
+	}
+	for (i = 0; i < len; ++i){
+		if (!strcmp(results[i].name, name)){
+			return &results[i];
+		}
+	}
+	return NULL;
+}
+
+int bench_regressed(const struct bench_result* base, const struct bench_result* cur, double tolerance){
+	double slowdown;
+	double noise;
+
+	if (!base || !cur){
+		return 0;
+	}
+	slowdown = cur->p50 - base->p50;
+	/* adding the spreads instead of combining them in quadrature overstates the noise slightly, which errs toward not failing */
+	noise = BENCH_NOISE_SPREADS * MAD_TO_SIGMA * (base->mad + cur->mad);
+	return slowdown > base->p50 * tolerance / 100 && slowdown > noise;
+}
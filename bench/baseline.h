@@ -0,0 +1,127 @@
+/** @file bench/baseline.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ *
+ * Saves benchmark results as JSON baselines, one per machine profile, and decides whether a new run is slower than its baseline by more than noise.
+ */
+
+#ifndef __BASELINE_H
+#define __BASELINE_H
+
+#include <stddef.h>
+
+/**
+ * @brief Where baselines are kept by default, relative to the top of the source tree.
+ */
+#define BENCH_BASELINE_DIR "bench/baselines"
+
+/**
+ * @brief The longest benchmark name a baseline can hold, including the terminating '\0'.
+ */
+#define BENCH_NAME_MAX (64)
+
+/**
+ * @brief A benchmark is only a regression if its median moved by more than this many times the spread of its repetitions.
+ */
+#define BENCH_NOISE_SPREADS (3.0)
+
+/**
+ * @brief The default percentage a benchmark's median can slow down by before it is a regression.
+ */
+#define BENCH_DEFAULT_TOLERANCE (10.0)
+
+/**
+ * @brief One benchmark's timings, as saved in a baseline.
+ */
+struct bench_result{
+	char name[BENCH_NAME_MAX]; /**< @brief The benchmark's name. */
+	unsigned reps;             /**< @brief How many repetitions were timed. */
+	double p50;                /**< @brief The median repetition in seconds. */
+	double mad;                /**< @brief The median absolute deviation from p50 in seconds, which is how noisy the benchmark is without being thrown off by one outlier. */
+};
+
+/**
+ * @brief Describes this machine, so baselines from different machines are never compared.<br>
+ * It is made of the architecture, the number of online processors, and the host name, such as "x86_64-8cpu-buildbox".
+ *
+ * @param out The buffer to write the profile to.
+ *
+ * @param len The size of the buffer.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int bench_profile(char* out, size_t len);
+
+/**
+ * @brief Returns the path of a profile's baseline in a directory.
+ *
+ * @param dir The directory baselines are kept in, such as BENCH_BASELINE_DIR.
+ *
+ * @param profile The profile from bench_profile().
+ *
+ * @return The path, or NULL on failure.<br>
+ * This string must be free()'d when no longer in use.
+ */
+char* bench_baseline_path(const char* dir, const char* profile);
+
+/**
+ * @brief Writes results to a baseline, replacing it if it exists.<br>
+ * The directory it is in is created if needed.
+ *
+ * @param path Where to write the baseline.
+ *
+ * @param profile The profile the results were measured on.
+ *
+ * @param results The results.
+ *
+ * @param len How many results there are.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int bench_baseline_save(const char* path, const char* profile, const struct bench_result* results, size_t len);
+
+/**
+ * @brief Reads a baseline written by bench_baseline_save().
+ *
+ * @param path The baseline to read.
+ *
+ * @param out Set to the results it holds.<br>
+ * This must be free()'d when no longer in use.
+ *
+ * @param out_len Set to how many results it holds.
+ *
+ * @return 0 on success, positive if there is no baseline at path, or negative on failure.
+ */
+int bench_baseline_load(const char* path, struct bench_result** out, size_t* out_len);
+
+/**
+ * @brief Finds a benchmark's result by name.
+ *
+ * @param results The results to search.
+ *
+ * @param len How many results there are.
+ *
+ * @param name The benchmark's name.
+ *
+ * @return Its result, or NULL if it is not there.
+ */
+const struct bench_result* bench_baseline_find(const struct bench_result* results, size_t len, const char* name);
+
+/**
+ * @brief Decides whether a benchmark got slower than its baseline.<br>
+ * Its median has to be more than tolerance percent slower, and slower by more than BENCH_NOISE_SPREADS times the combined spread of both runs, so a noisy benchmark does not fail on noise alone.
+ *
+ * @param base The baseline's result.
+ *
+ * @param cur The new result.
+ *
+ * @param tolerance The percentage the median can slow down by.
+ *
+ * @return 1 if it regressed, or 0 if not.
+ */
+int bench_regressed(const struct bench_result* base, const struct bench_result* cur, double tolerance);
+
+#endif
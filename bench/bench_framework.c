@@ -0,0 +1,244 @@
+/** @file bench/bench_framework.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "bench_framework.h"
+#include "baseline.h"
+#include "../stats.h"
+#include "../log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int double_cmp(const void* d1, const void* d2){
+	double a = *(const double*)d1;
+	double b = *(const double*)d2;
+
+	return a < b ? -1 : a > b ? 1 : 0;
+}
+
+double bench_percentile(const double* sorted, size_t len, double percentile){
+	/* nearest rank, so every percentile is a repetition that actually happened */
+	size_t rank = (size_t)(percentile / 100 * len + 0.999999);
+
+	if (rank < 1){
+		rank = 1;
+	}
+	if (rank > len){
+		rank = len;
+	}
+	return sorted[rank - 1];
+}
+
+/* returns the seconds one repetition took, or negative if it failed */
+static double run_once(const struct bench_case* bc, void* state, uint64_t* work){
+	struct stats_time start;
+	struct stats_time end;
+
+	if (bc->reset && bc->reset(state) != 0){
+		log_error_ex("Failed to reset %s", bc->name);
+		return -1;
+	}
+	*work = 0;
+	stats_time_now(&start);
+	if (bc->run(state, work) != 0){
+		log_error_ex("%s failed", bc->name);
+		return -1;
+	}
+	stats_time_now(&end);
+	return end.wall - start.wall;
+}
+
+static void print_throughput(const struct bench_case* bc, uint64_t work, double seconds){
+	double per_second = stats_per_second((double)work, seconds);
+
+	if (bc->unit == BENCH_BYTES){
+		printf(" %12.1f MiB/s  ", per_second / (1 << 20));
+	}
+	else{
+		printf(" %12.1f Kitem/s", per_second / 1000);
+	}
+}
+
+/* the median distance from the median, which one slow repetition cannot skew */
+static double median_deviation(const double* sorted, size_t len, double p50){
+	double* dev;
+	double ret;
+	size_t i;
+
+	dev = malloc(len * sizeof(*dev));
+	if (!dev){
+		log_enomem();
+		return 0;
+	}
+	for (i = 0; i < len; ++i){
+		dev[i] = sorted[i] > p50 ? sorted[i] - p50 : p50 - sorted[i];
+	}
+	qsort(dev, len, sizeof(*dev), double_cmp);
+	ret = bench_percentile(dev, len, 50);
+	free(dev);
+	return ret;
+}
+
+/* returns 1 if the result regressed, or 0 if not or if there is nothing to compare it to */
+static int print_comparison(const struct bench_result* res, const struct bench_result* base, const struct bench_options* opt){
+	int regressed;
+
+	if (!opt->compare_baseline){
+		return 0;
+	}
+	if (!base || base->p50 <= 0){
+		printf(" %9s", "new");
+		return 0;
+	}
+	regressed = bench_regressed(base, res, opt->tolerance);
+	printf(" %+8.1f%%%s", (res->p50 - base->p50) / base->p50 * 100, regressed ? " REGRESSION" : "");
+	return regressed;
+}
+
+/* returns 0 on success, 1 if it regressed against the baseline, 2 if it was filtered out, or negative on failure */
+static int run_case(const struct bench_case* bc, const struct bench_options* opt, const struct bench_result* base, struct bench_result* res){
+	void* state = NULL;
+	double* times = NULL;
+	uint64_t work = 0;
+	unsigned i;
+	int ret = 0;
+
+	if (opt->filter && !strstr(bc->name, opt->filter)){
+		return 2;
+	}
+	times = malloc(opt->reps * sizeof(*times));
+	if (!times){
+		log_enomem();
+		return -1;
+	}
+	if (bc->setup(bc->arg, &state) != 0){
+		printf("%-28.28s %s\n", bc->name, "setup failed");
+		free(times);
+		return -1;
+	}
+
+	for (i = 0; i < opt->warmup; ++i){
+		if (run_once(bc, state, &work) < 0){
+			ret = -1;
+			goto cleanup;
+		}
+	}
+	for (i = 0; i < opt->reps; ++i){
+		if ((times[i] = run_once(bc, state, &work)) < 0){
+			ret = -1;
+			goto cleanup;
+		}
+	}
+
+	qsort(times, opt->reps, sizeof(*times), double_cmp);
+	printf("%-28.28s %5u %10.3f %10.3f %10.3f %10.3f %10.3f",
+			bc->name,
+			opt->reps,
+			times[0] * 1000,
+			bench_percentile(times, opt->reps, 50) * 1000,
+			bench_percentile(times, opt->reps, 90) * 1000,
+			bench_percentile(times, opt->reps, 99) * 1000,
+			times[opt->reps - 1] * 1000);
+	/* every repetition does the same work, and the median is the one least thrown off by noise */
+	print_throughput(bc, work, bench_percentile(times, opt->reps, 50));
+
+	memset(res, 0, sizeof(*res));
+	strncpy(res->name, bc->name, sizeof(res->name) - 1);
+	res->reps = opt->reps;
+	res->p50 = bench_percentile(times, opt->reps, 50);
+	res->mad = median_deviation(times, opt->reps, res->p50);
+	ret = print_comparison(res, base, opt);
+	printf("\n");
+
+cleanup:
+	if (ret < 0){
+		printf("%-28.28s %s\n", bc->name, "failed");
+	}
+	fflush(stdout);
+	bc->teardown(state);
+	free(times);
+	return ret;
+}
+
+int run_bench_pkgs(const struct bench_pkg* const* pkgs, size_t pkgs_len, const struct bench_options* opt){
+	struct bench_result* base = NULL;
+	size_t base_len = 0;
+	struct bench_result* results = NULL;
+	size_t results_len = 0;
+	size_t n_cases = 0;
+	size_t n_regressed = 0;
+	size_t i;
+	size_t j;
+	int ret = 0;
+
+	return_ifnull(pkgs, -1);
+	return_ifnull(opt, -1);
+
+	if (opt->reps == 0){
+		log_error("A benchmark needs at least one repetition");
+		return -1;
+	}
+	if (opt->save_baseline && !opt->profile){
+		log_error("A baseline cannot be saved without a machine profile");
+		return -1;
+	}
+	/* a missing baseline is found out before anything runs, instead of after */
+	if (opt->compare_baseline){
+		int res = bench_baseline_load(opt->compare_baseline, &base, &base_len);
+
+		if (res < 0){
+			return -1;
+		}
+		if (res > 0){
+			log_warning_ex("There is no baseline at %s yet, so nothing can regress", opt->compare_baseline);
+		}
+	}
+
+	for (i = 0; i < pkgs_len; ++i){
+		n_cases += pkgs[i]->cases_len;
+	}
+	results = malloc((n_cases ? n_cases : 1) * sizeof(*results));
+	if (!results){
+		log_enomem();
+		free(base);
+		return -1;
+	}
+
+	printf("%-28s %5s %10s %10s %10s %10s %10s %18s%s\n", "Benchmark", "Reps", "Min(ms)", "p50(ms)", "p90(ms)", "p99(ms)", "Max(ms)", "Throughput(p50)", opt->compare_baseline ? "  vs base" : "");
+	for (i = 0; i < pkgs_len; ++i){
+		for (j = 0; j < pkgs[i]->cases_len; ++j){
+			const struct bench_case* bc = &pkgs[i]->cases[j];
+			int res = run_case(bc, opt, bench_baseline_find(base, base_len, bc->name), &results[results_len]);
+
+			if (res < 0){
+				ret = -1;
+			}
+			else if (res < 2){
+				results_len++;
+				n_regressed += res;
+			}
+		}
+	}
+
+	if (opt->save_baseline){
+		if (bench_baseline_save(opt->save_baseline, opt->profile, results, results_len) != 0){
+			ret = -1;
+		}
+		else{
+			printf("Saved %lu results to %s\n", (unsigned long)results_len, opt->save_baseline);
+		}
+	}
+	if (n_regressed > 0){
+		printf("%lu benchmark(s) regressed against %s\n", (unsigned long)n_regressed, opt->compare_baseline);
+		ret = ret < 0 ? ret : 1;
+	}
+
+	free(results);
+	free(base);
+	return ret;
+}
@@ -0,0 +1,167 @@
+/** @file bench/bench_framework.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __BENCH_FRAMEWORK_H
+#define __BENCH_FRAMEWORK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief What a benchmark's throughput is counted in.
+ */
+enum bench_unit{
+	BENCH_BYTES, /**< @brief Reported in MiB/s. */
+	BENCH_ITEMS  /**< @brief Reported in thousands of items per second. */
+};
+
+/**
+ * @brief A single benchmark.<br>
+ * Do not initialize these directly. Use the MAKE_BENCH() or MAKE_BENCH_RESET() macros.
+ *
+ * @see MAKE_BENCH()
+ */
+struct bench_case{
+	const char* name; /**< @brief The name the benchmark is reported and filtered by. */
+
+	/**
+	 * @brief Creates whatever the benchmark works on. This is not timed.<br>
+	 * It must return 0 on success, or negative on failure, in which case the benchmark is skipped.<br>
+	 * state is passed to every other function.
+	 */
+	int(*setup)(const void* arg, void** state);
+
+	/**
+	 * @brief Undoes what the last repetition did, so the next one starts from the same place. This is not timed.<br>
+	 * This can be NULL if a repetition changes nothing.
+	 */
+	int(*reset)(void* state);
+
+	/**
+	 * @brief One timed repetition.<br>
+	 * It must return 0 on success, or negative on failure, and set work to how many bytes or items it went through.
+	 */
+	int(*run)(void* state, uint64_t* work);
+
+	/**
+	 * @brief Frees what setup() created.<br>
+	 * This is called even if a repetition failed.
+	 */
+	void(*teardown)(void* state);
+
+	const void* arg;       /**< @brief Passed to setup(), so one set of functions can be measured with several inputs. */
+	enum bench_unit unit;  /**< @brief What work is counted in. */
+};
+
+/**
+ * @brief Turns a set of functions named prefix_setup(), prefix_run() and prefix_teardown() into a struct bench_case.<br>
+ * This is designed to be used with a struct bench_case array like below:<br>
+ * ```C
+ * const struct bench_case benches[] = {
+ *     MAKE_BENCH("checksum/sha1", checksum_bench, &sha1, BENCH_BYTES),
+ *     MAKE_BENCH("fi_next", fi_next_bench, NULL, BENCH_ITEMS)
+ * };
+ * ```
+ *
+ * @param name The benchmark's name.
+ *
+ * @param prefix What the benchmark's functions are named after.
+ *
+ * @param arg The argument to pass to setup().
+ *
+ * @param unit What the benchmark's work is counted in.
+ */
+#define MAKE_BENCH(name, prefix, arg, unit) {name, prefix##_setup, NULL, prefix##_run, prefix##_teardown, arg, unit}
+
+/**
+ * @brief Identical to MAKE_BENCH(), except prefix_reset() is called before every repetition.
+ * @see MAKE_BENCH()
+ */
+#define MAKE_BENCH_RESET(name, prefix, arg, unit) {name, prefix##_setup, prefix##_reset, prefix##_run, prefix##_teardown, arg, unit}
+
+/**
+ * @brief A package containing multiple benchmarks.<br>
+ * Do not initialize these directly. Use the MAKE_BENCH_PKG() macro.
+ *
+ * @see MAKE_BENCH_PKG()
+ */
+struct bench_pkg{
+	const struct bench_case* cases; /**< @brief The array of benchmarks. */
+	const size_t cases_len;         /**< @brief The number of benchmarks in the array. */
+	const char* name;               /**< @brief The name of the benchmark package. */
+};
+
+/**
+ * @brief Converts a benchmark array into a benchmark package, like MAKE_PKG() does for tests.
+ *
+ * @param cases The array of benchmarks to convert.<br>
+ * This must be an array and not a pointer, otherwise the length determination will fail.
+ *
+ * @param pkg_name The name to create the package with.
+ */
+#define MAKE_BENCH_PKG(cases, pkg_name) const struct bench_pkg pkg_name = {cases, sizeof(cases) / sizeof(cases[0]), #cases}
+
+/**
+ * @brief Exports a package made with MAKE_BENCH_PKG() for use with other files.
+ *
+ * @param export_name The name of the package to export.
+ */
+#define EXPORT_BENCH_PKG(export_name) extern const struct bench_pkg export_name
+
+/**
+ * @brief How run_bench_pkgs() measures each benchmark.
+ */
+struct bench_options{
+	unsigned warmup;              /**< @brief How many repetitions to run and throw away first, so caches and the CPU's clock have settled. */
+	unsigned reps;                /**< @brief How many repetitions to time. This must be at least 1. */
+	const char* filter;           /**< @brief Only benchmarks whose name contains this are run, or NULL to run all of them. */
+	const char* profile;          /**< @brief The machine profile saved with the baseline. This can be NULL if save_baseline is. @see bench_profile() */
+	const char* save_baseline;    /**< @brief The results are written to this baseline afterwards, or NULL to not save them. @see bench_baseline_save() */
+	const char* compare_baseline; /**< @brief Every benchmark is compared against this baseline, or NULL to not compare them. A baseline that does not exist yet only prints a warning. */
+	double tolerance;             /**< @brief The percentage a benchmark's median can slow down by before it is a regression. @see bench_regressed() */
+};
+
+/**
+ * @brief The default number of warmup repetitions.
+ */
+#define BENCH_DEFAULT_WARMUP (2)
+
+/**
+ * @brief The default number of timed repetitions.
+ */
+#define BENCH_DEFAULT_REPS (10)
+
+/**
+ * @brief Runs the benchmarks in several packages, and prints a line for each one.<br>
+ * Each line has the fastest, median, 90th percentile, 99th percentile and slowest repetition, and the throughput of the median one.<br>
+ * If a baseline is being compared against, it also has how much the median changed, and REGRESSION if it got slower than bench_regressed() allows.
+ *
+ * @param pkgs The packages to run.
+ *
+ * @param pkgs_len The number of packages.
+ *
+ * @param opt How to measure each benchmark.
+ *
+ * @return 0 if every benchmark that was run succeeded and none regressed, positive if any regressed against opt->compare_baseline, or negative if any failed.
+ */
+int run_bench_pkgs(const struct bench_pkg* const* pkgs, size_t pkgs_len, const struct bench_options* opt);
+
+/**
+ * @brief Returns a percentile of a set of timings.
+ *
+ * @param sorted The timings, sorted from fastest to slowest.
+ *
+ * @param len How many timings there are. This must be at least 1.
+ *
+ * @param percentile The percentile, from 0 to 100.
+ *
+ * @return The smallest timing that at least percentile percent of them are no slower than.
+ */
+double bench_percentile(const double* sorted, size_t len, double percentile);
+
+#endif
@@ -0,0 +1,718 @@
+/** @file bench/corebench.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ *
+ * Times the operations every backup spends most of its time in: walking directories, hashing, sorting and searching the checksum file, compressing and encrypting.<br>
+ * Run it with "make bench", passing options through COREBENCHFLAGS (e.g. make bench COREBENCHFLAGS="-r 20 -f zip_compress").<br>
+ * "make bench-baseline" saves this machine's results with the regression gates included, and "make bench-gate" fails if a later run is slower than them.
+ */
+
+#include "bench_framework.h"
+#include "baseline.h"
+#include "datagen.h"
+#include "../backup.h"
+#include "../options/options.h"
+#include "../strings/stringarray.h"
+#include "../strings/stringhelper.h"
+#include "../checksum.h"
+#include "../checksumsort.h"
+#include "../fileiterator.h"
+#include "../filehelper.h"
+#include "../compression/zip.h"
+#include "../crypt/crypt.h"
+#include "../log.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* everything is created under here, in the working directory */
+#define BENCH_DIR "BENCH_DIR"
+/* the directory tree fi_next() walks */
+#define TREE_DIRS 64
+#define TREE_FILES_PER_DIR 256
+/* how many entries of the checksum file are looked up per repetition */
+#define SEARCH_LOOKUPS 10000
+/* the file that is hashed, compressed and encrypted */
+#define DATA_LEN ((size_t)64 << 20)
+
+static uint32_t rng_state = 2463534242U;
+
+/* xorshift32, so every run measures the same data */
+static uint32_t rng_next(void){
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static char* bench_path(const char* name){
+	char* ret = malloc(sizeof(BENCH_DIR) + 1 + strlen(name));
+
+	if (!ret){
+		log_enomem();
+		return NULL;
+	}
+	sprintf(ret, "%s/%s", BENCH_DIR, name);
+	return ret;
+}
+
+/* half text-like and half random, so the compressors have something to find but cannot find everything */
+static int write_data_file(const char* path, size_t len){
+	static const char* const words[] = { "the", "backup", "file", "checksum", "compress", "stream", "block", "directory", "of", "and" };
+	unsigned char buf[65536];
+	FILE* fp;
+	size_t done = 0;
+
+	fp = fopen(path, "wb");
+	if (!fp){
+		log_efopen(path);
+		return -1;
+	}
+	while (done < len){
+		size_t n = len - done < sizeof(buf) ? len - done : sizeof(buf);
+		size_t i = 0;
+
+		if ((done / sizeof(buf)) % 2 == 0){
+			while (i < n){
+				const char* word = words[rng_next() % (sizeof(words) / sizeof(words[0]))];
+				size_t word_len = strlen(word);
+
+				word_len = word_len < n - i ? word_len : n - i;
+				memcpy(buf + i, word, word_len);
+				i += word_len;
+				if (i < n){
+					buf[i++] = ' ';
+				}
+			}
+		}
+		else{
+			for (i = 0; i < n; ++i){
+				buf[i] = (unsigned char)rng_next();
+			}
+		}
+		if (fwrite(buf, 1, n, fp) != n){
+			log_efwrite(path);
+			fclose(fp);
+			return -1;
+		}
+		done += n;
+	}
+	if (fclose(fp) != 0){
+		log_efclose(path);
+		return -1;
+	}
+	return 0;
+}
+
+static int fi_next_bench_setup(const void* arg, void** state){
+	char path[64];
+	unsigned i;
+	unsigned j;
+
+	(void)arg;
+	*state = NULL;
+	for (i = 0; i < TREE_DIRS; ++i){
+		sprintf(path, "%s/tree/d%03u", BENCH_DIR, i);
+		if (mkdir_recursive(path) < 0){
+			return -1;
+		}
+		for (j = 0; j < TREE_FILES_PER_DIR; ++j){
+			FILE* fp;
+
+			sprintf(path, "%s/tree/d%03u/f%04u", BENCH_DIR, i, j);
+			if (!(fp = fopen(path, "wb"))){
+				log_efopen(path);
+				return -1;
+			}
+			fclose(fp);
+		}
+	}
+	return 0;
+}
+
+static int fi_next_bench_run(void* state, uint64_t* work){
+	struct fi_stack* fis;
+	char* file;
+
+	(void)state;
+	if (!(fis = fi_start(BENCH_DIR "/tree"))){
+		return -1;
+	}
+	while ((file = fi_next(fis)) != NULL){
+		free(file);
+		(*work)++;
+	}
+	fi_end(fis);
+	return *work == (uint64_t)TREE_DIRS * TREE_FILES_PER_DIR ? 0 : -1;
+}
+
+static void fi_next_bench_teardown(void* state){
+	char path[64];
+	unsigned i;
+	unsigned j;
+
+	(void)state;
+	for (i = 0; i < TREE_DIRS; ++i){
+		for (j = 0; j < TREE_FILES_PER_DIR; ++j){
+			sprintf(path, "%s/tree/d%03u/f%04u", BENCH_DIR, i, j);
+			remove(path);
+		}
+		sprintf(path, "%s/tree/d%03u", BENCH_DIR, i);
+		rmdir(path);
+	}
+	rmdir(BENCH_DIR "/tree");
+}
+
+/* a file that is hashed, compressed or encrypted, and where the output goes */
+struct data_state{
+	char* in;
+	char* out;
+	const void* arg;
+	struct crypt_keys* fk;
+};
+
+static void data_bench_teardown(void* state){
+	struct data_state* ds = state;
+
+	if (!ds){
+		return;
+	}
+	ds->in ? remove(ds->in) : 0;
+	ds->out ? remove(ds->out) : 0;
+	ds->fk ? crypt_free(ds->fk) : (void)0;
+	free(ds->in);
+	free(ds->out);
+	free(ds);
+}
+
+static int data_bench_setup(const void* arg, void** state){
+	struct data_state* ds;
+
+	*state = ds = calloc(1, sizeof(*ds));
+	if (!ds){
+		log_enomem();
+		return -1;
+	}
+	ds->arg = arg;
+	if (!(ds->in = bench_path("data")) || !(ds->out = bench_path("data.out")) || write_data_file(ds->in, DATA_LEN) != 0){
+		return -1;
+	}
+	return 0;
+}
+
+#define checksum_bench_setup data_bench_setup
+#define checksum_bench_teardown data_bench_teardown
+
+static int checksum_bench_run(void* state, uint64_t* work){
+	struct data_state* ds = state;
+	unsigned char* hash = NULL;
+	unsigned hash_len;
+	const EVP_MD* md = get_evp_md(ds->arg);
+
+	if (!md || checksum(ds->in, md, &hash, &hash_len) != 0){
+		return -1;
+	}
+	free(hash);
+	*work = DATA_LEN;
+	return 0;
+}
+
+#define zip_bench_setup data_bench_setup
+#define zip_bench_teardown data_bench_teardown
+
+static int zip_bench_run(void* state, uint64_t* work){
+	struct data_state* ds = state;
+
+	if (zip_compress(ds->in, ds->out, *(const enum compressor*)ds->arg, 0, 0) != 0){
+		return -1;
+	}
+	*work = DATA_LEN;
+	return 0;
+}
+
+#define crypt_bench_teardown data_bench_teardown
+
+static int crypt_bench_setup(const void* arg, void** state){
+	const unsigned char salt[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+	const char password[] = "corebench";
+	struct data_state* ds;
+
+	if (data_bench_setup(arg, state) != 0){
+		return -1;
+	}
+	ds = *state;
+	/* one iteration, since key derivation is not what is being measured */
+	if (!(ds->fk = crypt_new()) ||
+			crypt_set_encryption(crypt_get_cipher(arg), ds->fk) != 0 ||
+			crypt_set_salt(salt, ds->fk) != 0 ||
+			crypt_gen_keys(password, sizeof(password) - 1, NULL, 1, ds->fk) != 0){
+		return -1;
+	}
+	return 0;
+}
+
+static int crypt_bench_run(void* state, uint64_t* work){
+	struct data_state* ds = state;
+
+	if (crypt_encrypt_ex(ds->in, ds->fk, ds->out, 0, NULL) != 0){
+		return -1;
+	}
+	*work = DATA_LEN;
+	return 0;
+}
+
+/* an unsorted checksum file, a copy of it that is sorted in place, and a sorted one to search */
+struct checksum_file_state{
+	char* unsorted;
+	char* sorted;
+	unsigned long n_entries;
+	FILE* fp_sorted;
+};
+
+/* keys are made from their index instead of kept, so ten million entries cost no memory */
+static void checksum_key(unsigned long index, char* out){
+	sprintf(out, "/home/user/dir%04lu/file%09lu.txt", index % 1000, index);
+}
+
+static unsigned long gcd(unsigned long a, unsigned long b){
+	while (b != 0){
+		unsigned long tmp = a % b;
+
+		a = b;
+		b = tmp;
+	}
+	return a;
+}
+
+static void checksum_file_bench_teardown(void* state){
+	struct checksum_file_state* cs = state;
+
+	if (!cs){
+		return;
+	}
+	cs->fp_sorted ? fclose(cs->fp_sorted) : 0;
+	cs->unsorted ? remove(cs->unsorted) : 0;
+	cs->sorted ? remove(cs->sorted) : 0;
+	free(cs->unsorted);
+	free(cs->sorted);
+	free(cs);
+}
+
+/* writes *arg paths in a scattered order, like the workers finish them in */
+static int checksum_file_bench_setup(const void* arg, void** state){
+	struct checksum_file_state* cs;
+	unsigned long stride = 1000003;
+	FILE* fp = NULL;
+	unsigned long i;
+
+	*state = cs = calloc(1, sizeof(*cs));
+	if (!cs){
+		log_enomem();
+		return -1;
+	}
+	cs->n_entries = *(const unsigned long*)arg;
+	if (!(cs->unsorted = bench_path("checksums.unsorted")) || !(cs->sorted = bench_path("checksums"))){
+		return -1;
+	}
+
+	if (!(fp = fopen(cs->unsorted, "wb"))){
+		log_efopen(cs->unsorted);
+		return -1;
+	}
+	/* visiting index * stride mod n_entries hits every index once if the two share no factors */
+	while (gcd(stride, cs->n_entries) != 1){
+		stride += 2;
+	}
+	for (i = 0; i < cs->n_entries; ++i){
+		char key[64];
+		char hash[41];
+		unsigned k;
+
+		checksum_key((unsigned long)(((uint64_t)i * stride) % cs->n_entries), key);
+		for (k = 0; k < 40; ++k){
+			hash[k] = "0123456789abcdef"[rng_next() % 16];
+		}
+		hash[40] = '\0';
+		if (add_hash_to_file(key, hash, NULL, fp, NULL) != 0){
+			fclose(fp);
+			return -1;
+		}
+	}
+	if (fclose(fp) != 0){
+		log_efclose(cs->unsorted);
+		return -1;
+	}
+
+	/* the search benchmark needs a sorted copy that stays put */
+	if (copy_file(cs->unsorted, cs->sorted) != 0 || sort_checksum_file(cs->sorted, 0, 0) != 0){
+		return -1;
+	}
+	return 0;
+}
+
+#define sort_bench_setup checksum_file_bench_setup
+#define sort_bench_teardown checksum_file_bench_teardown
+
+static int sort_bench_reset(void* state){
+	struct checksum_file_state* cs = state;
+
+	return copy_file(cs->unsorted, cs->sorted);
+}
+
+static int sort_bench_run(void* state, uint64_t* work){
+	struct checksum_file_state* cs = state;
+
+	if (sort_checksum_file(cs->sorted, 0, 0) != 0){
+		return -1;
+	}
+	*work = cs->n_entries;
+	return 0;
+}
+
+#define search_bench_teardown checksum_file_bench_teardown
+
+static int search_bench_setup(const void* arg, void** state){
+	struct checksum_file_state* cs;
+
+	if (checksum_file_bench_setup(arg, state) != 0){
+		return -1;
+	}
+	cs = *state;
+	if (!(cs->fp_sorted = fopen(cs->sorted, "rb"))){
+		log_efopen(cs->sorted);
+		return -1;
+	}
+	return 0;
+}
+
+static int search_bench_run(void* state, uint64_t* work){
+	struct checksum_file_state* cs = state;
+	size_t i;
+
+	for (i = 0; i < SEARCH_LOOKUPS; ++i){
+		char key[64];
+		char* checksum = NULL;
+
+		checksum_key(rng_next() % cs->n_entries, key);
+		if (search_file(cs->fp_sorted, key, &checksum) != 0){
+			return -1;
+		}
+		free(checksum);
+	}
+	*work = SEARCH_LOOKUPS;
+	return 0;
+}
+
+/* a generated tree and where it is backed up to */
+struct backup_gate_arg{
+	unsigned long n_files;
+	uint64_t min_size;
+	uint64_t max_size;
+	int incremental;
+};
+
+struct backup_state{
+	struct options* opt;
+	char* tree;
+	char* out;
+	uint64_t work;
+	int incremental;
+};
+
+static int remove_entry(const char* path, const struct stat* st, int type, struct FTW* ftw){
+	(void)st;
+	(void)ftw;
+	return (type == FTW_DP ? rmdir(path) : remove(path)) == 0 ? 0 : -1;
+}
+
+/* removes a directory and everything under it, without following symlinks */
+static void remove_tree(const char* path){
+	if (file_exists(path)){
+		nftw(path, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+	}
+}
+
+static void backup_bench_teardown(void* state){
+	struct backup_state* bs = state;
+
+	if (!bs){
+		return;
+	}
+	bs->tree ? remove_tree(bs->tree) : (void)0;
+	bs->out ? remove_tree(bs->out) : (void)0;
+	bs->opt ? options_free(bs->opt) : (void)0;
+	free(bs->tree);
+	free(bs->out);
+	free(bs);
+}
+
+static int backup_bench_setup(const void* arg, void** state){
+	const struct backup_gate_arg* ga = arg;
+	struct datagen_options dg;
+	struct backup_state* bs;
+
+	*state = bs = calloc(1, sizeof(*bs));
+	if (!bs){
+		log_enomem();
+		return -1;
+	}
+	/* backup() keeps the paths it is given, so they are made absolute */
+	if (!(bs->tree = sh_concat_path(sh_getcwd(), BENCH_DIR "/tree")) ||
+			!(bs->out = sh_concat_path(sh_getcwd(), BENCH_DIR "/backup")) ||
+			!(bs->opt = options_new()) ||
+			sa_add(bs->opt->directories, bs->tree) != 0){
+		return -1;
+	}
+	free(bs->opt->output_directory);
+	if (!(bs->opt->output_directory = sh_dup(bs->out))){
+		return -1;
+	}
+
+	datagen_defaults(&dg);
+	dg.n_files = ga->n_files;
+	dg.min_size = ga->min_size;
+	dg.max_size = ga->max_size;
+	bs->incremental = ga->incremental;
+	/* an unchanged tree is about how many files can be checked, and a full backup about how many bytes can be written */
+	bs->work = ga->incremental ? dg.n_files : datagen_total_size(&dg);
+	if (datagen_build(bs->tree, &dg, NULL) != 0){
+		return -1;
+	}
+	/* an incremental backup is timed against one that already saw every file */
+	if (ga->incremental && backup(bs->opt) != 0){
+		return -1;
+	}
+	return 0;
+}
+
+static int backup_bench_reset(void* state){
+	struct backup_state* bs = state;
+
+	/* a full backup starts from an empty output directory every time */
+	if (!bs->incremental){
+		remove_tree(bs->out);
+	}
+	return 0;
+}
+
+static int backup_bench_run(void* state, uint64_t* work){
+	struct backup_state* bs = state;
+
+	if (backup(bs->opt) != 0){
+		return -1;
+	}
+	*work = bs->work;
+	return 0;
+}
+
+static const unsigned long checksum_entries = 200000;
+static const unsigned long gate_checksum_entries = 10000000;
+/* an unchanged tree of a million small files, and a full backup of a thousand files of up to 8 MiB */
+static const struct backup_gate_arg gate_incremental = { 1000000, 0, 4096, 1 };
+static const struct backup_gate_arg gate_full = { 1000, 4096, (uint64_t)8 << 20, 0 };
+
+static const enum compressor c_none = COMPRESSOR_NONE;
+#ifndef NO_LZ4_SUPPORT
+static const enum compressor c_lz4 = COMPRESSOR_LZ4;
+#endif
+#ifndef NO_ZSTD_SUPPORT
+static const enum compressor c_zstd = COMPRESSOR_ZSTD;
+#endif
+#ifndef NO_GZIP_SUPPORT
+static const enum compressor c_gzip = COMPRESSOR_GZIP;
+#endif
+#ifndef NO_BZIP2_SUPPORT
+static const enum compressor c_bzip2 = COMPRESSOR_BZIP2;
+#endif
+#ifndef NO_XZ_SUPPORT
+static const enum compressor c_xz = COMPRESSOR_XZ;
+#endif
+
+const struct bench_case fileiterator_benches[] = {
+	MAKE_BENCH("fi_next", fi_next_bench, NULL, BENCH_ITEMS)
+};
+MAKE_BENCH_PKG(fileiterator_benches, fileiterator_bench_pkg);
+
+const struct bench_case checksum_benches[] = {
+	MAKE_BENCH("checksum/sha1", checksum_bench, "sha1", BENCH_BYTES),
+	MAKE_BENCH("checksum/sha256", checksum_bench, "sha256", BENCH_BYTES),
+	MAKE_BENCH("checksum/xxh64", checksum_bench, "xxh64", BENCH_BYTES),
+	MAKE_BENCH_RESET("sort_checksum_file", sort_bench, &checksum_entries, BENCH_ITEMS),
+	MAKE_BENCH("search_file", search_bench, &checksum_entries, BENCH_ITEMS)
+};
+MAKE_BENCH_PKG(checksum_benches, checksum_bench_pkg);
+
+const struct bench_case zip_benches[] = {
+	MAKE_BENCH("zip_compress/none", zip_bench, &c_none, BENCH_BYTES),
+#ifndef NO_LZ4_SUPPORT
+	MAKE_BENCH("zip_compress/lz4", zip_bench, &c_lz4, BENCH_BYTES),
+#endif
+#ifndef NO_ZSTD_SUPPORT
+	MAKE_BENCH("zip_compress/zstd", zip_bench, &c_zstd, BENCH_BYTES),
+#endif
+#ifndef NO_GZIP_SUPPORT
+	MAKE_BENCH("zip_compress/gzip", zip_bench, &c_gzip, BENCH_BYTES),
+#endif
+#ifndef NO_BZIP2_SUPPORT
+	MAKE_BENCH("zip_compress/bzip2", zip_bench, &c_bzip2, BENCH_BYTES),
+#endif
+#ifndef NO_XZ_SUPPORT
+	MAKE_BENCH("zip_compress/xz", zip_bench, &c_xz, BENCH_BYTES),
+#endif
+};
+MAKE_BENCH_PKG(zip_benches, zip_bench_pkg);
+
+const struct bench_case crypt_benches[] = {
+	MAKE_BENCH("crypt_encrypt_ex/aes-256-cbc", crypt_bench, "aes-256-cbc", BENCH_BYTES),
+	MAKE_BENCH("crypt_encrypt_ex/aes-256-gcm", crypt_bench, "aes-256-gcm", BENCH_BYTES)
+};
+MAKE_BENCH_PKG(crypt_benches, crypt_bench_pkg);
+
+/* the paths every backup spends its time in, at the scale they break at */
+const struct bench_case gate_benches[] = {
+	MAKE_BENCH_RESET("gate/backup_incremental_1M", backup_bench, &gate_incremental, BENCH_ITEMS),
+	MAKE_BENCH_RESET("gate/backup_full", backup_bench, &gate_full, BENCH_BYTES),
+	MAKE_BENCH_RESET("gate/sort_checksum_file_10M", sort_bench, &gate_checksum_entries, BENCH_ITEMS)
+};
+MAKE_BENCH_PKG(gate_benches, gate_bench_pkg);
+
+static void print_usage(const char* progname){
+	printf("Usage: %s [options]\n", progname);
+	printf("Times walking directories, hashing, sorting and searching checksum files, compressing and encrypting.\n");
+	printf("Options:\n");
+	printf("\t-b           save the results as this machine's baseline\n");
+	printf("\t-c           compare against this machine's baseline, exiting with 2 if anything regressed\n");
+	printf("\t-d <dir>     where baselines are kept (default %s)\n", BENCH_BASELINE_DIR);
+	printf("\t-f <name>    only run benchmarks whose name contains this\n");
+	printf("\t-g           also run the regression gates: backups of large trees and a 10M entry sort\n");
+	printf("\t-h           show this help\n");
+	printf("\t-p <name>    the machine profile to save or compare under (default architecture-cpus-hostname)\n");
+	printf("\t-r <n>       timed repetitions of each benchmark (default %d)\n", BENCH_DEFAULT_REPS);
+	printf("\t-t <n>       percentage a median can slow down by before it regresses (default %.0f)\n", BENCH_DEFAULT_TOLERANCE);
+	printf("\t-w <n>       untimed warmup repetitions first (default %d)\n", BENCH_DEFAULT_WARMUP);
+}
+
+int main(int argc, char** argv){
+	const struct bench_pkg* pkgs[5];
+	size_t pkgs_len = 0;
+	struct bench_options opt;
+	char profile[256];
+	const char* profile_arg = NULL;
+	const char* baseline_dir = BENCH_BASELINE_DIR;
+	char* baseline = NULL;
+	int save = 0;
+	int compare = 0;
+	int gate = 0;
+	int ret;
+	int i;
+
+	memset(&opt, 0, sizeof(opt));
+	opt.warmup = BENCH_DEFAULT_WARMUP;
+	opt.reps = BENCH_DEFAULT_REPS;
+	opt.tolerance = BENCH_DEFAULT_TOLERANCE;
+	log_setlevel(LEVEL_ERROR);
+
+	for (i = 1; i < argc; ++i){
+		char* endptr;
+		unsigned long n;
+
+		if (strlen(argv[i]) != 2 || argv[i][0] != '-'){
+			print_usage(argv[0]);
+			return 1;
+		}
+		/* the options without an argument */
+		switch (argv[i][1]){
+		case 'h':
+			print_usage(argv[0]);
+			return 0;
+		case 'b':
+			save = 1;
+			continue;
+		case 'c':
+			compare = 1;
+			continue;
+		case 'g':
+			gate = 1;
+			continue;
+		}
+		if (i + 1 >= argc){
+			print_usage(argv[0]);
+			return 1;
+		}
+		switch (argv[i][1]){
+		case 'd':
+			baseline_dir = argv[++i];
+			continue;
+		case 'f':
+			opt.filter = argv[++i];
+			continue;
+		case 'p':
+			profile_arg = argv[++i];
+			continue;
+		}
+		n = strtoul(argv[i + 1], &endptr, 10);
+		if (argv[i + 1][0] == '\0' || *endptr != '\0' || n > 100000){
+			fprintf(stderr, "Invalid count %s\n", argv[i + 1]);
+			return 1;
+		}
+		switch (argv[i][1]){
+		case 'r':
+			opt.reps = (unsigned)n;
+			break;
+		case 't':
+			opt.tolerance = (double)n;
+			break;
+		case 'w':
+			opt.warmup = (unsigned)n;
+			break;
+		default:
+			print_usage(argv[0]);
+			return 1;
+		}
+		i++;
+	}
+
+	if (save || compare){
+		if (profile_arg){
+			strncpy(profile, profile_arg, sizeof(profile) - 1);
+			profile[sizeof(profile) - 1] = '\0';
+		}
+		else if (bench_profile(profile, sizeof(profile)) != 0){
+			return 1;
+		}
+		if (!(baseline = bench_baseline_path(baseline_dir, profile))){
+			return 1;
+		}
+		opt.profile = profile;
+		opt.save_baseline = save ? baseline : NULL;
+		opt.compare_baseline = compare ? baseline : NULL;
+		printf("Machine profile: %s\n", profile);
+	}
+
+	pkgs[pkgs_len++] = &fileiterator_bench_pkg;
+	pkgs[pkgs_len++] = &checksum_bench_pkg;
+	pkgs[pkgs_len++] = &zip_bench_pkg;
+	pkgs[pkgs_len++] = &crypt_bench_pkg;
+	if (gate){
+		pkgs[pkgs_len++] = &gate_bench_pkg;
+	}
+
+	if (mkdir_recursive(BENCH_DIR) < 0){
+		fprintf(stderr, "Failed to create %s\n", BENCH_DIR);
+		free(baseline);
+		return 1;
+	}
+	ret = run_bench_pkgs(pkgs, pkgs_len, &opt);
+	rmdir(BENCH_DIR);
+	free(baseline);
+	/* a regression exits differently from a benchmark that failed to run */
+	return ret == 0 ? 0 : ret > 0 ? 2 : 1;
+}
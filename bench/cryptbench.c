@@ -0,0 +1,359 @@
+/** @file bench/cryptbench.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ *
+ * Measures every cipher crypt_get_cipher() can load at several payload sizes and worker counts, and how long key derivation takes.<br>
+ * Run it with "make bench-crypt", passing options through CRYPTBENCHFLAGS (e.g. make bench-crypt CRYPTBENCHFLAGS="-e aes-256-cbc,aes-256-gcm -t 1,4").
+ */
+
+#include "../crypt/crypt.h"
+#include "../stats.h"
+#include "../log.h"
+#include "../threadpool.h"
+#include <openssl/evp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* a measurement is repeated until it has taken at least this many seconds, so fast ones are not lost in the clock's resolution */
+#define MIN_SECONDS 0.1
+/* one row per cipher, even with every alias OpenSSL knows about */
+#define MAX_CIPHERS 256
+
+static const char bench_password[] = "cryptbench";
+
+struct cipher_list{
+	const EVP_CIPHER* ciphers[MAX_CIPHERS];
+	size_t len;
+};
+
+/* modes that cannot encrypt a stream of any length, or need per-message lengths up front */
+static int streamable(const EVP_CIPHER* cipher){
+	switch (EVP_CIPHER_mode(cipher)){
+	case EVP_CIPH_ECB_MODE:
+	case EVP_CIPH_CBC_MODE:
+	case EVP_CIPH_CFB_MODE:
+	case EVP_CIPH_OFB_MODE:
+	case EVP_CIPH_CTR_MODE:
+	case EVP_CIPH_STREAM_CIPHER:
+		return !(EVP_CIPHER_flags(cipher) & EVP_CIPH_FLAG_AEAD_CIPHER) || crypt_is_aead(cipher);
+	default:
+		return crypt_is_aead(cipher);
+	}
+}
+
+static void add_cipher(const EVP_CIPHER* cipher, const char* from, const char* to, void* arg){
+	struct cipher_list* cl = arg;
+	size_t i;
+
+	(void)from;
+	(void)to;
+	/* aliases do not come with a cipher */
+	if (!cipher || EVP_CIPHER_nid(cipher) == EVP_CIPHER_nid(EVP_enc_null()) || !streamable(cipher) || cl->len >= MAX_CIPHERS){
+		return;
+	}
+	for (i = 0; i < cl->len; ++i){
+		if (EVP_CIPHER_nid(cl->ciphers[i]) == EVP_CIPHER_nid(cipher)){
+			return;
+		}
+	}
+	/* crypt_get_cipher() has to be able to load it by name, and some are only listed without a provider to back them */
+	if (!crypt_get_cipher(EVP_CIPHER_name(cipher))){
+		return;
+	}
+	cl->ciphers[cl->len++] = cipher;
+}
+
+static struct crypt_keys* bench_keys(const EVP_CIPHER* cipher, unsigned n_workers){
+	const unsigned char salt[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+	struct crypt_keys* fk;
+
+	if (!(fk = crypt_new()) ||
+			crypt_set_encryption(cipher, fk) != 0 ||
+			crypt_set_salt(salt, fk) != 0 ||
+			crypt_gen_keys((const unsigned char*)bench_password, sizeof(bench_password) - 1, NULL, 1, fk) != 0 ||
+			crypt_set_workers(fk, n_workers) != 0){
+		fk ? crypt_free(fk) : (void)0;
+		return NULL;
+	}
+	return fk;
+}
+
+/* encrypts and decrypts payloads of len bytes until total bytes have gone through each way
+ * every payload is its own message, like a file of that size would be */
+static int measure(const EVP_CIPHER* cipher, const unsigned char* data, size_t len, size_t total, unsigned n_workers, double* enc_mibs, double* dec_mibs){
+	struct crypt_keys* fk = NULL;
+	unsigned char* crypt_data = NULL;
+	unsigned char* plain = NULL;
+	size_t crypt_size;
+	size_t crypt_len = 0;
+	size_t plain_len;
+	size_t n_payloads = total / len > 0 ? total / len : 1;
+	struct stats_time start;
+	struct stats_time end;
+	size_t i;
+	int ret = 0;
+
+	if (!(fk = bench_keys(cipher, n_workers))){
+		return -1;
+	}
+	crypt_size = crypt_encrypted_len(fk, len);
+	crypt_data = malloc(crypt_size);
+	plain = malloc(len);
+	if (!crypt_data || !plain){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+
+	stats_time_now(&start);
+	for (i = 0; i < n_payloads; ++i){
+		if (crypt_encrypt_buf(data, len, fk, crypt_data, crypt_size, &crypt_len) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+	}
+	stats_time_now(&end);
+	*enc_mibs = stats_per_second((double)len * n_payloads / (1 << 20), end.wall - start.wall);
+
+	/* every payload has the same salt, since the keys only came from it once */
+	if (crypt_read_salt_buf(crypt_data, crypt_len, fk) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+	stats_time_now(&start);
+	for (i = 0; i < n_payloads; ++i){
+		if (crypt_decrypt_buf(crypt_data, crypt_len, fk, plain, len, &plain_len) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+	}
+	stats_time_now(&end);
+	/* counted in plaintext bytes like encryption, so the two columns line up */
+	*dec_mibs = stats_per_second((double)len * n_payloads / (1 << 20), end.wall - start.wall);
+
+	if (plain_len != len || memcmp(plain, data, len) != 0){
+		log_error_ex("%s did not decrypt to the original data", EVP_CIPHER_name(cipher));
+		ret = -1;
+	}
+
+cleanup:
+	crypt_free(fk);
+	free(crypt_data);
+	free(plain);
+	return ret;
+}
+
+/* how long one key derivation with this many iterations takes, in seconds */
+static double measure_kdf(int pbkdf2, int iterations){
+	const unsigned char salt[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+	unsigned char key[EVP_MAX_KEY_LENGTH];
+	unsigned char iv[EVP_MAX_IV_LENGTH];
+	struct stats_time start;
+	struct stats_time end;
+	unsigned long n = 0;
+
+	stats_time_now(&start);
+	do{
+		/* EVP_BytesToKey() is what crypt_gen_keys() uses, and PBKDF2-SHA256 is what a session key takes */
+		if (pbkdf2 ? PKCS5_PBKDF2_HMAC(bench_password, sizeof(bench_password) - 1, salt, sizeof(salt), iterations, EVP_sha256(), 32, key) != 1 :
+				!EVP_BytesToKey(EVP_aes_256_cbc(), EVP_sha256(), salt, (const unsigned char*)bench_password, sizeof(bench_password) - 1, iterations, key, iv)){
+			return -1.0;
+		}
+		n++;
+		stats_time_now(&end);
+	}while (end.wall - start.wall < MIN_SECONDS);
+
+	return (end.wall - start.wall) / n;
+}
+
+static void print_usage(const char* progname){
+	printf("Usage: %s [options]\n", progname);
+	printf("Measures encryption and decryption speed for every cipher, and key derivation time.\n");
+	printf("Options:\n");
+	printf("\t-s <MiB>              how much data goes through each cipher, size and worker count each way (default 64)\n");
+	printf("\t-e <aes-256-cbc,...>  ciphers to measure (default every one that can encrypt a stream)\n");
+	printf("\t-b <4096,65536,...>   payload sizes in bytes, each encrypted as its own message (default 4096,65536,1048576)\n");
+	printf("\t-t <1,2,4,...>        worker counts; only AEAD ciphers use more than one (default 1 and the processor count)\n");
+	printf("\t-i <1,1000,...>       key derivation iteration counts (default 1,1000,10000,100000)\n");
+	printf("\t-h                    show this help\n");
+}
+
+/* splits a comma separated list in place */
+static char* next_item(char** list){
+	char* item = *list;
+	char* comma;
+
+	if (!item || *item == '\0'){
+		return NULL;
+	}
+	comma = strchr(item, ',');
+	if (comma){
+		*comma = '\0';
+		*list = comma + 1;
+	}
+	else{
+		*list = NULL;
+	}
+	return item;
+}
+
+/* a comma separated list of positive numbers */
+static int parse_numbers(char* list, unsigned long* out, size_t max, size_t* out_len){
+	char* item;
+
+	*out_len = 0;
+	while ((item = next_item(&list)) != NULL){
+		char* endptr;
+		unsigned long n = strtoul(item, &endptr, 10);
+
+		if (*item == '\0' || *endptr != '\0' || n == 0 || *out_len >= max){
+			fprintf(stderr, "Invalid number %s\n", item);
+			return -1;
+		}
+		out[(*out_len)++] = n;
+	}
+	return 0;
+}
+
+int main(int argc, char** argv){
+	static struct cipher_list cl;
+	unsigned long sizes[16] = { 4096, 65536, 1048576 };
+	size_t n_sizes = 3;
+	unsigned long workers[16];
+	size_t n_workers = 0;
+	unsigned long iterations[16] = { 1, 1000, 10000, 100000 };
+	size_t n_iterations = 4;
+	unsigned long size_mib = 64;
+	unsigned char* data = NULL;
+	size_t max_size = 0;
+	int ret = 0;
+	int i;
+	size_t j;
+	size_t k;
+	size_t l;
+
+	log_setlevel(LEVEL_ERROR);
+
+	for (i = 1; i < argc; ++i){
+		char* list;
+		char* item;
+		char* endptr;
+
+		if (!strcmp(argv[i], "-h")){
+			print_usage(argv[0]);
+			return 0;
+		}
+		if (i + 1 >= argc || strlen(argv[i]) != 2 || argv[i][0] != '-'){
+			print_usage(argv[0]);
+			return 1;
+		}
+		list = argv[++i];
+
+		switch (argv[i - 1][1]){
+		case 's':
+			size_mib = strtoul(list, &endptr, 10);
+			if (*list == '\0' || *endptr != '\0' || size_mib == 0 || size_mib > 4096){
+				fprintf(stderr, "Invalid size %s\n", list);
+				return 1;
+			}
+			break;
+		case 'e':
+			while ((item = next_item(&list)) != NULL){
+				const EVP_CIPHER* cipher = crypt_get_cipher(item);
+
+				if (!cipher || cipher == EVP_enc_null() || cl.len >= MAX_CIPHERS){
+					fprintf(stderr, "Unknown cipher %s\n", item);
+					return 1;
+				}
+				cl.ciphers[cl.len++] = cipher;
+			}
+			break;
+		case 'b':
+			if (parse_numbers(list, sizes, sizeof(sizes) / sizeof(sizes[0]), &n_sizes) != 0){
+				return 1;
+			}
+			break;
+		case 't':
+			if (parse_numbers(list, workers, sizeof(workers) / sizeof(workers[0]), &n_workers) != 0){
+				return 1;
+			}
+			break;
+		case 'i':
+			if (parse_numbers(list, iterations, sizeof(iterations) / sizeof(iterations[0]), &n_iterations) != 0){
+				return 1;
+			}
+			break;
+		default:
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (cl.len == 0){
+		EVP_CIPHER_do_all_sorted(add_cipher, &cl);
+	}
+	if (n_workers == 0){
+		workers[n_workers++] = 1;
+		if (tp_cpu_count() > 1){
+			workers[n_workers++] = tp_cpu_count();
+		}
+	}
+
+	for (j = 0; j < n_sizes; ++j){
+		max_size = sizes[j] > max_size ? sizes[j] : max_size;
+	}
+	data = malloc(max_size);
+	if (!data){
+		log_enomem();
+		return 1;
+	}
+	/* the ciphers do not care what the data is */
+	for (j = 0; j < max_size; ++j){
+		data[j] = (unsigned char)(j * 2654435761U >> 24);
+	}
+
+	printf("%-24s %10s %7s %12s %12s\n", "Cipher", "Size", "Workers", "Enc(MiB/s)", "Dec(MiB/s)");
+	for (j = 0; j < cl.len; ++j){
+		for (k = 0; k < n_sizes; ++k){
+			for (l = 0; l < n_workers; ++l){
+				double enc_mibs;
+				double dec_mibs;
+
+				/* the others go through one chunk at a time however many workers there are */
+				if (workers[l] > 1 && !crypt_is_aead(cl.ciphers[j])){
+					continue;
+				}
+				if (measure(cl.ciphers[j], data, sizes[k], (size_t)(size_mib << 20), (unsigned)workers[l], &enc_mibs, &dec_mibs) != 0){
+					printf("%-24.24s %10lu %7lu %12s\n", EVP_CIPHER_name(cl.ciphers[j]), sizes[k], workers[l], "failed");
+					ret = 1;
+					continue;
+				}
+				printf("%-24.24s %10lu %7lu %12.1f %12.1f\n", EVP_CIPHER_name(cl.ciphers[j]), sizes[k], workers[l], enc_mibs, dec_mibs);
+				fflush(stdout);
+			}
+		}
+	}
+
+	printf("\n%-24s %10s %12s %12s\n", "KDF", "Iterations", "ms", "us/iter");
+	for (j = 0; j < 2; ++j){
+		for (k = 0; k < n_iterations; ++k){
+			double seconds = measure_kdf((int)j, (int)iterations[k]);
+
+			if (seconds < 0){
+				printf("%-24s %10lu %12s\n", j ? "pbkdf2-sha256" : "evp_bytestokey-sha256", iterations[k], "failed");
+				ret = 1;
+				continue;
+			}
+			printf("%-24s %10lu %12.3f %12.3f\n", j ? "pbkdf2-sha256" : "evp_bytestokey-sha256", iterations[k], seconds * 1e3, seconds * 1e6 / iterations[k]);
+			fflush(stdout);
+		}
+	}
+
+	free(data);
+	return ret;
+}
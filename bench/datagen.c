@@ -0,0 +1,325 @@
+/** @file bench/datagen.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "datagen.h"
+#include "../filehelper.h"
+#include "../log.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <utime.h>
+
+/* keep each decision about a file independent of the others made from the same index */
+#define SALT_DIR_LEN   0x1
+#define SALT_DIR_DEPTH 0x2
+#define SALT_SIZE      0x3
+#define SALT_MUTATE    0x4
+#define SALT_CONTENT   0x5
+/* the chunks that are text or random, so compressibility is spread through a file rather than split in two */
+#define CHUNK_LEN 4096
+#define BLOCK_LEN ((size_t)64 << 10)
+/* files get an mtime a day apart per run, so a backup sees them change even if they are rewritten within the same second */
+#define DATAGEN_EPOCH 1500000000L
+#define DATAGEN_RUN_SECONDS 86400L
+
+static const char* const words[] = {
+	"the", "of", "and", "backup", "file", "directory", "checksum", "compress", "stream", "block",
+	"level", "error", "return", "while", "because", "every", "should", "between", "through", "restore"
+};
+
+/* c89 has no 64-bit integer constants */
+#define U64(hi, lo) (((uint64_t)(hi) << 32) | (uint64_t)(lo))
+#define GOLDEN U64(0x9E3779B9, 0x7F4A7C15)
+#define MIX_1  U64(0xBF58476D, 0x1CE4E5B9)
+#define MIX_2  U64(0x94D049BB, 0x133111EB)
+
+/* splitmix64, so any decision can be made straight from the seed and an index without walking a sequence */
+static uint64_t mix(uint64_t seed, uint64_t a, uint64_t b){
+	uint64_t z = seed + a * GOLDEN + b * MIX_1 + MIX_2;
+
+	z = (z ^ (z >> 30)) * MIX_1;
+	z = (z ^ (z >> 27)) * MIX_2;
+	return z ^ (z >> 31);
+}
+
+static uint64_t xorshift64(uint64_t* state){
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+void datagen_defaults(struct datagen_options* opt){
+	memset(opt, 0, sizeof(*opt));
+	opt->seed = 1;
+	opt->n_files = 20000;
+	opt->files_per_dir = 50;
+	opt->fanout = 8;
+	opt->max_depth = 6;
+	opt->min_size = 0;
+	opt->max_size = (uint64_t)1 << 20;
+	opt->compressibility = 50;
+	opt->mutation = 5;
+	opt->run = 0;
+}
+
+static int check_options(const struct datagen_options* opt){
+	if (opt->files_per_dir < 1 || opt->fanout < 2 || opt->max_depth < 1){
+		log_error("A tree needs at least 1 file per directory, a fanout of 2, and a depth of 1");
+		return -1;
+	}
+	if (opt->min_size > opt->max_size || opt->compressibility > 100 || opt->mutation > 100){
+		log_error("The minimum size must not be larger than the maximum, and percentages must be from 0 to 100");
+		return -1;
+	}
+	return 0;
+}
+
+/* anywhere from 1 to twice the average, so some directories are crowded and some nearly empty */
+static unsigned long dir_len(const struct datagen_options* opt, unsigned long dir){
+	return 1 + (unsigned long)(mix(opt->seed, SALT_DIR_LEN, dir) % (2 * opt->files_per_dir - 1));
+}
+
+/* the directory's index in base fanout, one digit per level, padded with d0's to its depth */
+static char* dir_path(const char* root, const struct datagen_options* opt, unsigned long dir){
+	unsigned digits[64];
+	unsigned n_digits = 0;
+	unsigned depth = 1 + (unsigned)(mix(opt->seed, SALT_DIR_DEPTH, dir) % opt->max_depth);
+	unsigned long tmp = dir;
+	char* ret;
+	size_t pos;
+
+	do{
+		digits[n_digits++] = (unsigned)(tmp % opt->fanout);
+		tmp /= opt->fanout;
+	}while (tmp > 0);
+	while (n_digits < depth && n_digits < sizeof(digits) / sizeof(digits[0])){
+		digits[n_digits++] = 0;
+	}
+
+	ret = malloc(strlen(root) + n_digits * 12 + 1);
+	if (!ret){
+		log_enomem();
+		return NULL;
+	}
+	pos = (size_t)sprintf(ret, "%s", root);
+	while (n_digits > 0){
+		pos += (size_t)sprintf(ret + pos, "/d%u", digits[--n_digits]);
+	}
+	return ret;
+}
+
+/* a power of two is picked evenly between the smallest and largest, then a size within it, which is an even spread on a log scale without needing libm */
+static uint64_t file_size(const struct datagen_options* opt, unsigned long file){
+	uint64_t r = mix(opt->seed, SALT_SIZE, file);
+	unsigned lo = 0;
+	unsigned hi = 0;
+	unsigned bucket;
+	uint64_t size;
+
+	while (lo < 63 && ((uint64_t)2 << lo) <= opt->min_size){
+		lo++;
+	}
+	while (hi < 63 && ((uint64_t)2 << hi) <= opt->max_size){
+		hi++;
+	}
+	bucket = lo + (unsigned)((r & 0xFF) % (hi - lo + 1));
+	size = ((uint64_t)1 << bucket) + ((r >> 8) & (((uint64_t)1 << bucket) - 1));
+	if (bucket == 0){
+		/* the lowest bucket also has empty files */
+		size = (r >> 8) & 1;
+	}
+	return size < opt->min_size ? opt->min_size : size > opt->max_size ? opt->max_size : size;
+}
+
+static int mutated_on(const struct datagen_options* opt, unsigned long file, unsigned run){
+	return run > 0 && mix(opt->seed, SALT_MUTATE + ((uint64_t)run << 8), file) % 100 < opt->mutation;
+}
+
+static unsigned last_mutation(const struct datagen_options* opt, unsigned long file){
+	unsigned run;
+
+	for (run = opt->run; run > 0; --run){
+		if (mutated_on(opt, file, run)){
+			return run;
+		}
+	}
+	return 0;
+}
+
+static void fill_block(unsigned char* out, size_t len, uint64_t block_seed, unsigned compressibility){
+	uint64_t state = block_seed | 1;
+	size_t pos = 0;
+
+	while (pos < len){
+		size_t chunk = len - pos < CHUNK_LEN ? len - pos : CHUNK_LEN;
+		size_t end = pos + chunk;
+
+		if (xorshift64(&state) % 100 < compressibility){
+			while (pos < end){
+				const char* word = words[xorshift64(&state) % (sizeof(words) / sizeof(words[0]))];
+				size_t word_len = strlen(word);
+
+				word_len = word_len < end - pos ? word_len : end - pos;
+				memcpy(out + pos, word, word_len);
+				pos += word_len;
+				if (pos < end){
+					out[pos++] = ' ';
+				}
+			}
+		}
+		else{
+			while (pos < end){
+				uint64_t r = xorshift64(&state);
+				size_t n = end - pos < 8 ? end - pos : 8;
+
+				memcpy(out + pos, &r, n);
+				pos += n;
+			}
+		}
+	}
+}
+
+static int write_file(const char* path, const struct datagen_options* opt, unsigned long file, unsigned run, unsigned char* buf, struct datagen_result* res){
+	uint64_t size = file_size(opt, file);
+	uint64_t content_seed = mix(opt->seed ^ SALT_CONTENT, file, run);
+	uint64_t done = 0;
+	uint64_t block = 0;
+	struct utimbuf times;
+	FILE* fp;
+
+	fp = fopen(path, "wb");
+	if (!fp){
+		log_efopen(path);
+		return -1;
+	}
+	while (done < size){
+		size_t n = size - done < BLOCK_LEN ? (size_t)(size - done) : BLOCK_LEN;
+
+		fill_block(buf, n, mix(content_seed, block, 0), opt->compressibility);
+		if (fwrite(buf, 1, n, fp) != n){
+			log_efwrite(path);
+			fclose(fp);
+			return -1;
+		}
+		done += n;
+		block++;
+	}
+	if (fclose(fp) != 0){
+		log_efclose(path);
+		return -1;
+	}
+
+	times.actime = times.modtime = (time_t)(DATAGEN_EPOCH + DATAGEN_RUN_SECONDS * (long)run);
+	if (utime(path, &times) != 0){
+		log_warning_ex2("Failed to set the times of %s (%s)", path, strerror(errno));
+	}
+	res->n_files++;
+	res->n_bytes += size;
+	return 0;
+}
+
+/* visits every directory in order, writing the files that build or mutate need */
+static int generate(const char* root, const struct datagen_options* opt, int mutate_only, struct datagen_result* out){
+	struct datagen_result res;
+	unsigned char* buf = NULL;
+	unsigned long file = 0;
+	unsigned long dir;
+	int ret = 0;
+
+	memset(&res, 0, sizeof(res));
+	if (check_options(opt) != 0){
+		return -1;
+	}
+	buf = malloc(BLOCK_LEN);
+	if (!buf){
+		log_enomem();
+		return -1;
+	}
+
+	for (dir = 0; file < opt->n_files; ++dir){
+		unsigned long end = file + dir_len(opt, dir);
+		char* path = dir_path(root, opt, dir);
+		size_t path_len;
+
+		if (!path){
+			ret = -1;
+			goto cleanup;
+		}
+		if (!mutate_only && mkdir_recursive(path) < 0){
+			log_error_ex("Failed to create %s", path);
+			free(path);
+			ret = -1;
+			goto cleanup;
+		}
+		path_len = strlen(path);
+		end = end < opt->n_files ? end : opt->n_files;
+		for (; file < end; ++file){
+			char* file_path;
+
+			if (mutate_only && !mutated_on(opt, file, opt->run)){
+				continue;
+			}
+			if (!(file_path = malloc(path_len + 24))){
+				log_enomem();
+				free(path);
+				ret = -1;
+				goto cleanup;
+			}
+			sprintf(file_path, "%s/f%lu", path, file);
+			ret = write_file(file_path, opt, file, mutate_only ? opt->run : last_mutation(opt, file), buf, &res);
+			free(file_path);
+			if (ret != 0){
+				free(path);
+				goto cleanup;
+			}
+		}
+		free(path);
+	}
+	res.n_dirs = dir;
+
+cleanup:
+	free(buf);
+	if (out){
+		*out = res;
+	}
+	return ret;
+}
+
+int datagen_build(const char* root, const struct datagen_options* opt, struct datagen_result* out){
+	return_ifnull(root, -1);
+	return_ifnull(opt, -1);
+
+	return generate(root, opt, 0, out);
+}
+
+int datagen_mutate(const char* root, const struct datagen_options* opt, struct datagen_result* out){
+	return_ifnull(root, -1);
+	return_ifnull(opt, -1);
+
+	if (opt->run < 1){
+		log_error("Run 0 has nothing to mutate from");
+		return -1;
+	}
+	return generate(root, opt, 1, out);
+}
+
+uint64_t datagen_total_size(const struct datagen_options* opt){
+	uint64_t total = 0;
+	unsigned long file;
+
+	if (!opt || check_options(opt) != 0){
+		return 0;
+	}
+	for (file = 0; file < opt->n_files; ++file){
+		total += file_size(opt, file);
+	}
+	return total;
+}
@@ -0,0 +1,91 @@
+/** @file bench/datagen.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ *
+ * Builds reproducible directory trees of any size for benchmarking backups at scale.<br>
+ * Every file's path, size and contents are a function of the seed, its index and the run, so the same options always build the same tree, and a tree can be moved from one run to the next by rewriting only the files that changed.
+ */
+
+#ifndef __DATAGEN_H
+#define __DATAGEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief What tree to build.<br>
+ * Fill it in with datagen_defaults() and change what is needed.
+ */
+struct datagen_options{
+	uint64_t seed;              /**< @brief Different seeds build different trees with the same shape. */
+	unsigned long n_files;      /**< @brief How many files the tree has. */
+	unsigned long files_per_dir; /**< @brief How many files a directory has on average. Each one gets anywhere from 1 to twice this many. */
+	unsigned fanout;            /**< @brief How many subdirectories a directory can have. This must be at least 2. */
+	unsigned max_depth;         /**< @brief How deep a directory can be. Each one is anywhere from 1 to this many levels deep, so the tree is a mix of shallow, wide directories and deep ones. */
+	uint64_t min_size;          /**< @brief The smallest a file can be in bytes. */
+	uint64_t max_size;          /**< @brief The largest a file can be in bytes. Sizes are spread evenly on a log scale between this and min_size, so most files are small and a few are huge, like in a home directory. */
+	unsigned compressibility;   /**< @brief From 0 to 100, how much of each file is text that compresses well. The rest is random. */
+	unsigned mutation;          /**< @brief From 0 to 100, the percentage of files rewritten with new contents each run. */
+	unsigned run;               /**< @brief Which run to build. Run 0 is the original tree, and every run after it has mutation percent of the files changed from the run before. */
+};
+
+/**
+ * @brief How much a datagen_build() or datagen_mutate() wrote.
+ */
+struct datagen_result{
+	unsigned long n_files;  /**< @brief How many files were written. */
+	uint64_t n_bytes;       /**< @brief How many bytes were written. */
+	unsigned long n_dirs;   /**< @brief How many directories the tree has. */
+};
+
+/**
+ * @brief Fills in a moderate tree: 20000 files of up to 1 MiB in directories of about 50, at most 6 levels deep, half compressible, with 5 percent changed each run.
+ *
+ * @param opt The options to fill in.
+ *
+ * @return void
+ */
+void datagen_defaults(struct datagen_options* opt);
+
+/**
+ * @brief Builds the tree opt describes from scratch, as it is on run opt->run.<br>
+ * Files that are already there are overwritten. Anything else under root is left alone.
+ *
+ * @param root The directory to build the tree under. It is created if it does not exist.
+ *
+ * @param opt What to build.
+ *
+ * @param out Set to how much was written. This can be NULL.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int datagen_build(const char* root, const struct datagen_options* opt, struct datagen_result* out);
+
+/**
+ * @brief Moves a tree built for run opt->run - 1 to run opt->run, by only rewriting the files that changed.<br>
+ * The result is identical to datagen_build() with the same options.
+ *
+ * @param root The directory the tree is under.
+ *
+ * @param opt What the tree was built with, and the run to move it to. opt->run must be at least 1.
+ *
+ * @param out Set to how much was rewritten. This can be NULL.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int datagen_mutate(const char* root, const struct datagen_options* opt, struct datagen_result* out);
+
+/**
+ * @brief Returns how many bytes the tree takes up, without writing anything. Mutations keep every file's size, so this is the same on every run.<br>
+ * Use this to check a tree fits on the disk before building it.
+ *
+ * @param opt What would be built.
+ *
+ * @return The total size of every file.
+ */
+uint64_t datagen_total_size(const struct datagen_options* opt);
+
+#endif
@@ -0,0 +1,552 @@
+/** @file bench/zipbench.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ *
+ * Measures every compressor and level over a set of corpora.<br>
+ * Run it with "make bench", passing options through BENCHFLAGS (e.g. make bench BENCHFLAGS="-s 4 -c zstd,lz4").
+ */
+
+#include "../compression/zip.h"
+#include "../stats.h"
+#include "../log.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* the size of one file in the small corpus */
+#define SMALL_FILE_LEN 4096
+/* the large corpus is this many times bigger than the others */
+#define LARGE_MULTIPLIER 4
+
+enum corpus_kind{
+	CORPUS_TEXT,
+	CORPUS_BINARY,
+	CORPUS_SMALL,
+	CORPUS_LARGE,
+	CORPUS_FILE
+};
+
+struct corpus{
+	const char* name;
+	enum corpus_kind kind;
+	unsigned char* data;
+	size_t len;
+	/* every piece is compressed as its own stream, which matters for the small corpus */
+	size_t piece_len;
+};
+
+/* what a child measures for one compressor, level and corpus */
+struct result{
+	int ok;
+	size_t in_len;
+	size_t out_len;
+	double comp_seconds;
+	double decomp_seconds;
+	/* peak resident memory over the run, in KiB, or 0 if it could not be read */
+	long peak_kib;
+};
+
+static const enum compressor all_compressors[] = {
+	COMPRESSOR_NONE,
+#ifndef NO_LZ4_SUPPORT
+	COMPRESSOR_LZ4,
+#endif
+#ifndef NO_ZSTD_SUPPORT
+	COMPRESSOR_ZSTD,
+#endif
+#ifndef NO_GZIP_SUPPORT
+	COMPRESSOR_GZIP,
+#endif
+#ifndef NO_BZIP2_SUPPORT
+	COMPRESSOR_BZIP2,
+#endif
+#ifndef NO_XZ_SUPPORT
+	COMPRESSOR_XZ,
+#endif
+	COMPRESSOR_INVALID
+};
+
+static const char* const text_words[] = {
+	"the", "of", "and", "to", "a", "in", "is", "that", "for", "it",
+	"backup", "file", "directory", "checksum", "compress", "stream", "block", "level", "error", "return",
+	"while", "because", "every", "should", "would", "between", "through", "without", "another", "already",
+	"configuration", "performance", "interrupted", "incremental", "encryption", "dictionary", "throughput", "segment", "journal", "restore"
+};
+
+static uint32_t rng_state = 2463534242U;
+
+/* xorshift32, so every run measures the same data */
+static uint32_t rng_next(void){
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+/* common words come up far more often than rare ones, like in real text */
+static void fill_text(unsigned char* out, size_t len){
+	size_t n_words = sizeof(text_words) / sizeof(text_words[0]);
+	size_t pos = 0;
+	unsigned long words_on_line = 0;
+
+	while (pos < len){
+		uint32_t a = rng_next() % n_words;
+		uint32_t b = rng_next() % n_words;
+		const char* word = text_words[a < b ? a : b];
+		size_t word_len = strlen(word);
+		char sep = ++words_on_line % 12 == 0 ? '\n' : rng_next() % 16 == 0 ? ',' : ' ';
+
+		if (word_len > len - pos){
+			word_len = len - pos;
+		}
+		memcpy(out + pos, word, word_len);
+		pos += word_len;
+		if (pos < len){
+			out[pos++] = (unsigned char)sep;
+		}
+	}
+}
+
+/* fixed-size records with counters, timestamps and flags, and a stretch of random data every so often like an embedded image */
+static void fill_binary(unsigned char* out, size_t len){
+	uint32_t id = 0;
+	uint32_t timestamp = 1500000000U;
+	size_t pos = 0;
+
+	while (pos < len){
+		unsigned char record[32];
+		size_t n;
+		int i;
+
+		if (rng_next() % 1024 == 0){
+			n = 4096 < len - pos ? 4096 : len - pos;
+			for (i = 0; (size_t)i < n; ++i){
+				out[pos + i] = (unsigned char)rng_next();
+			}
+			pos += n;
+			continue;
+		}
+
+		timestamp += rng_next() % 5;
+		for (i = 0; i < 4; ++i){
+			record[i] = (unsigned char)(id >> (i * 8));
+			record[4 + i] = (unsigned char)(timestamp >> (i * 8));
+		}
+		for (i = 8; i < 16; ++i){
+			record[i] = (unsigned char)rng_next();
+		}
+		for (i = 16; i < 32; ++i){
+			record[i] = (unsigned char)("\0\0\1\2\xFF\x7F\0\x10"[rng_next() % 8]);
+		}
+		id++;
+
+		n = sizeof(record) < len - pos ? sizeof(record) : len - pos;
+		memcpy(out + pos, record, n);
+		pos += n;
+	}
+}
+
+static int make_corpus(struct corpus* c, const char* name, enum corpus_kind kind, size_t len){
+	c->name = name;
+	c->kind = kind;
+	c->len = len;
+	c->piece_len = kind == CORPUS_SMALL ? SMALL_FILE_LEN : len;
+	c->data = malloc(len > 0 ? len : 1);
+	if (!c->data){
+		log_enomem();
+		return -1;
+	}
+
+	switch (kind){
+	case CORPUS_TEXT:
+		fill_text(c->data, len);
+		break;
+	case CORPUS_BINARY:
+		fill_binary(c->data, len);
+		break;
+	default:
+		/* small files and large files are both half of each */
+		fill_text(c->data, len / 2);
+		fill_binary(c->data + len / 2, len - len / 2);
+		break;
+	}
+	return 0;
+}
+
+static int load_corpus(struct corpus* c, const char* path){
+	struct stat st;
+	FILE* fp;
+
+	if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)){
+		log_error_ex("%s is not a regular file", path);
+		return -1;
+	}
+	c->name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	c->kind = CORPUS_FILE;
+	c->len = (size_t)st.st_size;
+	c->piece_len = c->len;
+	c->data = malloc(c->len > 0 ? c->len : 1);
+	if (!c->data){
+		log_enomem();
+		return -1;
+	}
+
+	fp = fopen(path, "rb");
+	if (!fp){
+		log_efopen(path);
+		free(c->data);
+		return -1;
+	}
+	if (fread(c->data, 1, c->len, fp) != c->len){
+		log_efread(path);
+		fclose(fp);
+		free(c->data);
+		return -1;
+	}
+	fclose(fp);
+	return 0;
+}
+
+/* VmHWM is only reset when asked, and every child starts out with the parent's */
+static void reset_peak_rss(void){
+	FILE* fp = fopen("/proc/self/clear_refs", "w");
+
+	if (fp){
+		fputs("5", fp);
+		fclose(fp);
+	}
+}
+
+static long read_peak_rss(void){
+	FILE* fp = fopen("/proc/self/status", "r");
+	char line[256];
+	long ret = 0;
+
+	if (!fp){
+		return 0;
+	}
+	while (fgets(line, sizeof(line), fp)){
+		if (strncmp(line, "VmHWM:", 6) == 0){
+			ret = strtol(line + 6, NULL, 10);
+			break;
+		}
+	}
+	fclose(fp);
+	return ret;
+}
+
+struct check_sink{
+	const unsigned char* expected;
+	size_t len;
+	size_t pos;
+	int mismatch;
+};
+
+/* compares the decompressed output against the original as it comes in */
+static int check_sink(const void* data, size_t len, void* sink_data){
+	struct check_sink* cs = sink_data;
+
+	if (len > cs->len - cs->pos || memcmp(cs->expected + cs->pos, data, len) != 0){
+		cs->mismatch = 1;
+		return -1;
+	}
+	cs->pos += len;
+	return 0;
+}
+
+static void measure(const struct corpus* c, enum compressor c_type, int level, unsigned flags, struct result* out){
+	struct zip_buffer zb;
+	struct stats_time start;
+	struct stats_time end;
+	size_t offset;
+
+	memset(out, 0, sizeof(*out));
+	memset(&zb, 0, sizeof(zb));
+	reset_peak_rss();
+
+	for (offset = 0; offset < c->len || (offset == 0 && c->len == 0); offset += c->piece_len){
+		struct zip_buffer piece;
+		struct check_sink cs;
+
+		piece.data = c->data + offset;
+		piece.len = c->len - offset < c->piece_len ? c->len - offset : c->piece_len;
+		piece.size = piece.len;
+		piece.pos = 0;
+
+		zb.len = 0;
+		zb.pos = 0;
+		stats_time_now(&start);
+		if (zip_compress_stream(c_type, level, flags, zip_buffer_source, &piece, zip_buffer_sink, &zb) != 0){
+			log_error_ex("Failed to compress with %s", compressor_tostring(c_type));
+			free(zb.data);
+			return;
+		}
+		stats_time_now(&end);
+		out->comp_seconds += end.wall - start.wall;
+
+		cs.expected = piece.data;
+		cs.len = piece.len;
+		cs.pos = 0;
+		cs.mismatch = 0;
+		stats_time_now(&start);
+		if (zip_decompress_stream(c_type, flags, zip_buffer_source, &zb, check_sink, &cs) != 0 || cs.mismatch || cs.pos != cs.len){
+			log_error_ex("%s did not decompress to the original data", compressor_tostring(c_type));
+			free(zb.data);
+			return;
+		}
+		stats_time_now(&end);
+		out->decomp_seconds += end.wall - start.wall;
+
+		out->in_len += piece.len;
+		out->out_len += zb.len;
+		if (c->len == 0){
+			break;
+		}
+	}
+
+	free(zb.data);
+	out->peak_kib = read_peak_rss();
+	out->ok = 1;
+}
+
+/* every run gets its own process, so its peak memory is not hidden by an earlier one */
+static int run_isolated(const struct corpus* c, enum compressor c_type, int level, unsigned flags, struct result* out){
+	int fds[2];
+	pid_t pid;
+	int status;
+	ssize_t n;
+
+	memset(out, 0, sizeof(*out));
+	if (pipe(fds) != 0){
+		log_error_ex("Failed to create pipe (%s)", strerror(errno));
+		return -1;
+	}
+
+	pid = fork();
+	if (pid < 0){
+		log_error_ex("Failed to fork (%s)", strerror(errno));
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	if (pid == 0){
+		struct result res;
+
+		close(fds[0]);
+		measure(c, c_type, level, flags, &res);
+		_exit(write(fds[1], &res, sizeof(res)) == (ssize_t)sizeof(res) ? 0 : 1);
+	}
+
+	close(fds[1]);
+	while ((n = read(fds[0], out, sizeof(*out))) < 0 && errno == EINTR);
+	close(fds[0]);
+	while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+
+	if (n != (ssize_t)sizeof(*out) || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+		out->ok = 0;
+		return -1;
+	}
+	return out->ok ? 0 : -1;
+}
+
+static void print_usage(const char* progname){
+	printf("Usage: %s [options] [file1 file2 ...]\n", progname);
+	printf("Measures every compressor and level over each corpus, and over any files given.\n");
+	printf("Options:\n");
+	printf("\t-s <MiB>          size of the text, binary and small-file corpora (default 8; the large corpus is %d times that)\n", LARGE_MULTIPLIER);
+	printf("\t-k <text,binary,small,large,none>  corpora to generate (default all)\n");
+	printf("\t-c <gz,lz4,...>   compressors to measure (default all)\n");
+	printf("\t-l <1,6,9,...>    levels to measure (default 1 through 9)\n");
+	printf("\t-w <n>            compression workers (--compress-workers)\n");
+	printf("\t-h                show this help\n");
+}
+
+/* splits a comma separated list in place */
+static char* next_item(char** list){
+	char* item = *list;
+	char* comma;
+
+	if (!item || *item == '\0'){
+		return NULL;
+	}
+	comma = strchr(item, ',');
+	if (comma){
+		*comma = '\0';
+		*list = comma + 1;
+	}
+	else{
+		*list = NULL;
+	}
+	return item;
+}
+
+int main(int argc, char** argv){
+	static const struct{
+		const char* name;
+		enum corpus_kind kind;
+		size_t multiplier;
+	}generated[] = {
+		{ "text", CORPUS_TEXT, 1 },
+		{ "binary", CORPUS_BINARY, 1 },
+		{ "small", CORPUS_SMALL, 1 },
+		{ "large", CORPUS_LARGE, LARGE_MULTIPLIER }
+	};
+	struct corpus corpora[64];
+	size_t n_corpora = 0;
+	const char* paths[sizeof(corpora) / sizeof(corpora[0]) - sizeof(generated) / sizeof(generated[0])];
+	size_t n_paths = 0;
+	enum compressor compressors[sizeof(all_compressors) / sizeof(all_compressors[0])];
+	size_t n_compressors = 0;
+	int levels[32];
+	size_t n_levels = 0;
+	unsigned long size_mib = 8;
+	unsigned flags = 0;
+	const char* corpus_list = NULL;
+	int ret = 0;
+	int i;
+	size_t j;
+	size_t k;
+	size_t l;
+
+	log_setlevel(LEVEL_ERROR);
+
+	for (i = 1; i < argc; ++i){
+		char* list;
+		char* item;
+		char* endptr;
+
+		if (!strcmp(argv[i], "-h")){
+			print_usage(argv[0]);
+			return 0;
+		}
+		if (argv[i][0] != '-'){
+			if (n_paths >= sizeof(paths) / sizeof(paths[0])){
+				fprintf(stderr, "Too many files\n");
+				return 1;
+			}
+			paths[n_paths++] = argv[i];
+			continue;
+		}
+		if (i + 1 >= argc || strlen(argv[i]) != 2){
+			print_usage(argv[0]);
+			return 1;
+		}
+		list = argv[++i];
+
+		switch (argv[i - 1][1]){
+		case 's':
+			size_mib = strtoul(list, &endptr, 10);
+			if (*list == '\0' || *endptr != '\0' || size_mib == 0 || size_mib > 4096){
+				fprintf(stderr, "Invalid size %s\n", list);
+				return 1;
+			}
+			break;
+		case 'k':
+			corpus_list = list;
+			break;
+		case 'c':
+			while ((item = next_item(&list)) != NULL){
+				enum compressor c_type = get_compressor_byname(item);
+
+				if (c_type == COMPRESSOR_INVALID || n_compressors >= sizeof(compressors) / sizeof(compressors[0])){
+					fprintf(stderr, "Unknown compressor %s\n", item);
+					return 1;
+				}
+				compressors[n_compressors++] = c_type;
+			}
+			break;
+		case 'l':
+			while ((item = next_item(&list)) != NULL){
+				long level = strtol(item, &endptr, 10);
+
+				if (*item == '\0' || *endptr != '\0' || level < 0 || level > 9 || n_levels >= sizeof(levels) / sizeof(levels[0])){
+					fprintf(stderr, "Invalid level %s\n", item);
+					return 1;
+				}
+				levels[n_levels++] = (int)level;
+			}
+			break;
+		case 'w':
+			flags = ZIP_WORKERS(strtoul(list, NULL, 10));
+			break;
+		default:
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (n_compressors == 0){
+		for (j = 0; all_compressors[j] != COMPRESSOR_INVALID; ++j){
+			compressors[n_compressors++] = all_compressors[j];
+		}
+	}
+	if (n_levels == 0){
+		for (n_levels = 0; n_levels < 9; ++n_levels){
+			levels[n_levels] = (int)n_levels + 1;
+		}
+	}
+
+	for (j = 0; j < sizeof(generated) / sizeof(generated[0]); ++j){
+		/* -k only lists names, so finding one inside another is enough of a check */
+		if (corpus_list && !strstr(corpus_list, generated[j].name)){
+			continue;
+		}
+		if (make_corpus(&corpora[n_corpora], generated[j].name, generated[j].kind, (size_t)(size_mib << 20) * generated[j].multiplier) != 0){
+			ret = 1;
+			goto cleanup;
+		}
+		n_corpora++;
+	}
+	for (j = 0; j < n_paths; ++j){
+		if (load_corpus(&corpora[n_corpora], paths[j]) != 0){
+			ret = 1;
+			goto cleanup;
+		}
+		n_corpora++;
+	}
+
+	printf("%-12s %-6s %5s %10s %10s %12s %14s %13s\n", "Corpus", "Codec", "Level", "In(MiB)", "Ratio", "Comp(MiB/s)", "Decomp(MiB/s)", "PeakRSS(MiB)");
+	for (j = 0; j < n_corpora; ++j){
+		for (k = 0; k < n_compressors; ++k){
+			/* storing ignores the level, so once is enough */
+			size_t n = compressors[k] == COMPRESSOR_NONE ? 1 : n_levels;
+
+			for (l = 0; l < n; ++l){
+				int level = compressors[k] == COMPRESSOR_NONE ? 0 : levels[l];
+				struct result res;
+
+				if (run_isolated(&corpora[j], compressors[k], level, flags, &res) != 0){
+					printf("%-12.12s %-6s %5d %10s\n", corpora[j].name, compressor_tostring(compressors[k]), level, "failed");
+					ret = 1;
+					continue;
+				}
+				/* both speeds are over the uncompressed size, so levels with different ratios still compare */
+				printf("%-12.12s %-6s %5d %10.1f %10.3f %12.1f %14.1f %13.1f\n",
+						corpora[j].name,
+						compressor_tostring(compressors[k]),
+						level,
+						(double)res.in_len / (1 << 20),
+						res.out_len > 0 ? (double)res.in_len / res.out_len : 0.0,
+						stats_per_second((double)res.in_len / (1 << 20), res.comp_seconds),
+						stats_per_second((double)res.in_len / (1 << 20), res.decomp_seconds),
+						(double)res.peak_kib / 1024);
+				fflush(stdout);
+			}
+		}
+	}
+
+cleanup:
+	for (j = 0; j < n_corpora; ++j){
+		free(corpora[j].data);
+	}
+	return ret;
+}
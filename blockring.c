@@ -0,0 +1,66 @@
+/** @file blockring.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+/* prototypes */
+#include "blockring.h"
+/* error handling */
+#include "log.h"
+
+void br_init(struct block_ring* br, size_t n_workers, int(*flush)(size_t n_queued, void* flush_data), void* flush_data){
+	br->tp = NULL;
+	br->n_workers = n_workers;
+	/* two blocks per worker, so no worker runs out while the rest of its batch finishes
+	 * and never less than two, so the block being filled is never the one a worker still has */
+	br->n_blocks = n_workers > 1 ? n_workers * 2 : 2;
+	br->n_queued = 0;
+	br->submitted = 0;
+	br->flush = flush;
+	br->flush_data = flush_data;
+}
+
+int br_submit(struct block_ring* br, void(*func)(void*), void* block, int last){
+	/* a stream that fits in one block never pays for starting threads */
+	if (!br->tp && br->n_workers > 1 && (br->submitted || !last) && !(br->tp = tp_new(br->n_workers, br->n_blocks))){
+		log_warning("Failed to start worker threads. Working on this thread instead.");
+		br->n_workers = 1;
+	}
+	br->submitted = 1;
+
+	if (!br->tp || tp_submit(br->tp, func, block) != 0){
+		func(block);
+	}
+	br->n_queued++;
+
+	/* every slot is in use, so the oldest output has to go before anything can be reused */
+	if (br->n_queued == br->n_blocks){
+		return br_flush(br);
+	}
+	return 0;
+}
+
+int br_flush(struct block_ring* br){
+	if (br->tp && tp_wait(br->tp) != 0){
+		log_error("Failed to wait for worker threads");
+		return -1;
+	}
+	if (br->flush(br->n_queued, br->flush_data) != 0){
+		return -1;
+	}
+	br->n_queued = 0;
+	return 0;
+}
+
+void br_reset(struct block_ring* br){
+	br->n_queued = 0;
+	br->submitted = 0;
+}
+
+void br_free(struct block_ring* br){
+	tp_free(br->tp);
+	br->tp = NULL;
+}
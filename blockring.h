@@ -0,0 +1,97 @@
+/** @file blockring.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __BLOCKRING_H
+#define __BLOCKRING_H
+
+#include "threadpool.h"
+#include <stddef.h>
+
+/**
+ * @brief A ring of blocks that are worked on in parallel, but whose output has to be written in order.<br>
+ * The caller owns the blocks themselves, br->n_blocks of them, and fills the one at index br->n_queued.<br>
+ * Once it is full, br_submit() hands it to a worker, and once every block is in use, the flush callback writes them all out in order so they can be reused.
+ */
+struct block_ring{
+	struct threadpool* tp;    /**< @brief The workers, which are only started once a second block shows up. */
+	size_t n_workers;         /**< @brief How many workers to start. With 1 or less, every block is worked on in the calling thread. */
+	size_t n_blocks;          /**< @brief How many blocks the caller has to allocate. */
+	size_t n_queued;          /**< @brief Blocks submitted since the last flush, which is also the index of the block being filled. */
+	int submitted;            /**< @brief Whether a block was submitted since br_init() or br_reset(). */
+	int(*flush)(size_t n_queued, void* flush_data); /**< @brief Writes out the first n_queued blocks in order. */
+	void* flush_data;         /**< @brief The user-defined argument passed to flush. */
+};
+
+/**
+ * @brief Sets up a block ring.
+ *
+ * @param br The block ring to set up.
+ *
+ * @param n_workers The number of worker threads to use.<br>
+ * The ring is two blocks per worker, so no worker runs out while the rest of its batch finishes.
+ *
+ * @param flush Called with every queued block finished, to write their output in order.<br>
+ * This returns 0 on success, or negative on failure.
+ *
+ * @param flush_data The user-defined argument passed to flush.
+ *
+ * @return void<br>
+ * br must be freed with br_free() when no longer in use.
+ * @see br_free()
+ */
+void br_init(struct block_ring* br, size_t n_workers, int(*flush)(size_t n_queued, void* flush_data), void* flush_data);
+
+/**
+ * @brief Starts working on the block being filled, and flushes the ring once every block is in use.<br>
+ * Afterwards, br->n_queued is the index of the next block to fill.
+ *
+ * @param br The block ring.
+ *
+ * @param func The function that works on the block, which is called on a worker thread.
+ *
+ * @param block The block at index br->n_queued, passed to func.<br>
+ * It must not be touched until the flush callback gets to it.
+ *
+ * @param last Whether this is the last block of the stream.<br>
+ * A stream whose first block is also its last is worked on in the calling thread, so it never pays for starting threads.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int br_submit(struct block_ring* br, void(*func)(void*), void* block, int last);
+
+/**
+ * @brief Waits for every queued block, then calls the flush callback to write them out in order.<br>
+ * The callback is called even if nothing is queued.
+ *
+ * @param br The block ring.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int br_flush(struct block_ring* br);
+
+/**
+ * @brief Gets a flushed block ring ready for another stream.<br>
+ * The workers are kept.
+ *
+ * @param br The block ring.
+ *
+ * @return void
+ */
+void br_reset(struct block_ring* br);
+
+/**
+ * @brief Waits for anything still being worked on and stops the workers.<br>
+ * This has to be called before the blocks are freed.
+ *
+ * @param br The block ring.
+ *
+ * @return void
+ */
+void br_free(struct block_ring* br);
+
+#endif
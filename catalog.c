@@ -0,0 +1,900 @@
+/** @file catalog.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "catalog.h"
+#include "checksumsort.h"
+#include "filehelper.h"
+#include "log.h"
+#include "strings/stringhelper.h"
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHECKSUM_NAME "checksums.txt"
+
+static void put_u16(unsigned char* p, unsigned val){
+	p[0] = val & 0xFF;
+	p[1] = (val >> 8) & 0xFF;
+}
+
+static void put_u32(unsigned char* p, unsigned long val){
+	put_u16(p, val & 0xFFFF);
+	put_u16(p + 2, (val >> 16) & 0xFFFF);
+}
+
+static void put_u64(unsigned char* p, uint64_t val){
+	put_u32(p, (unsigned long)(val & 0xFFFFFFFFUL));
+	put_u32(p + 4, (unsigned long)(val >> 32));
+}
+
+static unsigned get_u16(const unsigned char* p){
+	return p[0] | (p[1] << 8);
+}
+
+static unsigned long get_u32(const unsigned char* p){
+	return get_u16(p) | ((unsigned long)get_u16(p + 2) << 16);
+}
+
+static uint64_t get_u64(const unsigned char* p){
+	return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+/* a path and every one of its versions, oldest first
+ * only the last version can still be current */
+struct record{
+	char* file;
+	size_t file_size;
+	struct catalog_version* versions;
+	size_t n_versions;
+	size_t versions_size;
+};
+
+static int record_reserve_file(struct record* r, size_t len){
+	char* tmp;
+
+	if (len + 1 <= r->file_size){
+		return 0;
+	}
+	if (!(tmp = realloc(r->file, len + 1))){
+		log_enomem();
+		return -1;
+	}
+	r->file = tmp;
+	r->file_size = len + 1;
+	return 0;
+}
+
+static int record_set_file(struct record* r, const char* file, size_t len){
+	if (record_reserve_file(r, len) != 0){
+		return -1;
+	}
+	memcpy(r->file, file, len);
+	r->file[len] = '\0';
+	return 0;
+}
+
+static int record_add(struct record* r, unsigned long start, unsigned long end){
+	if (r->n_versions == r->versions_size){
+		size_t size = r->versions_size ? r->versions_size * 2 : 8;
+		struct catalog_version* tmp = realloc(r->versions, size * sizeof(*tmp));
+
+		if (!tmp){
+			log_enomem();
+			return -1;
+		}
+		r->versions = tmp;
+		r->versions_size = size;
+	}
+	r->versions[r->n_versions].start = start;
+	r->versions[r->n_versions].end = end;
+	r->n_versions++;
+	return 0;
+}
+
+static int record_is_open(const struct record* r){
+	return r->n_versions > 0 && r->versions[r->n_versions - 1].end == 0;
+}
+
+/* ends the current version at a backup, dropping it if it was never current before that */
+static void record_close(struct record* r, unsigned long time){
+	struct catalog_version* v;
+
+	if (!record_is_open(r)){
+		return;
+	}
+	v = &r->versions[r->n_versions - 1];
+	if (v->start >= time){
+		r->n_versions--;
+	}
+	else{
+		v->end = time;
+	}
+}
+
+static void record_free(struct record* r){
+	free(r->file);
+	free(r->versions);
+}
+
+/* reads the record at *pos, which must be where fp is
+ * returns 0 on success, positive if the records end at *pos, or negative on error */
+static int read_record(FILE* fp, uint64_t* pos, uint64_t end, struct record* r){
+	unsigned char buf[16];
+	unsigned long n;
+	unsigned long i;
+	size_t len;
+
+	if (*pos >= end){
+		return 1;
+	}
+	if (fread(buf, 1, 2, fp) != 2){
+		goto truncated;
+	}
+	len = get_u16(buf);
+	if (record_reserve_file(r, len) != 0){
+		return -1;
+	}
+	if (fread(r->file, 1, len, fp) != len || fread(buf, 1, 4, fp) != 4){
+		goto truncated;
+	}
+	r->file[len] = '\0';
+	n = get_u32(buf);
+	if (n > (end - *pos) / 16){
+		goto truncated;
+	}
+	r->n_versions = 0;
+	for (i = 0; i < n; ++i){
+		if (fread(buf, 1, 16, fp) != 16){
+			goto truncated;
+		}
+		if (record_add(r, (unsigned long)get_u64(buf), (unsigned long)get_u64(buf + 8)) != 0){
+			return -1;
+		}
+	}
+	*pos += 2 + len + 4 + (uint64_t)n * 16;
+	if (*pos > end){
+		goto truncated;
+	}
+	return 0;
+
+truncated:
+	if (ferror(fp)){
+		log_efread("catalog");
+	}
+	else{
+		log_error("The catalog is corrupt");
+	}
+	return -1;
+}
+
+struct catalog_writer{
+	FILE* fp;
+	uint64_t pos;
+	uint64_t block_start;
+	/* the last path written, which the next one has to sort after */
+	char* prev;
+	uint64_t* offsets;
+	char** keys;
+	size_t len;
+	size_t size;
+};
+
+static int writer_begin(struct catalog_writer* cw, const char* file, unsigned long last){
+	unsigned char header[CATALOG_HEADER_LEN];
+
+	memset(cw, 0, sizeof(*cw));
+	if (!(cw->fp = fopen(file, "wb"))){
+		log_efopen(file);
+		return -1;
+	}
+	memset(header, 0, sizeof(header));
+	memcpy(header, CATALOG_MAGIC, 4);
+	header[4] = CATALOG_VERSION;
+	put_u64(header + 8, last);
+	if (fwrite(header, 1, sizeof(header), cw->fp) != sizeof(header)){
+		log_efwrite(file);
+		return -1;
+	}
+	cw->pos = CATALOG_HEADER_LEN;
+	return 0;
+}
+
+static int writer_add(struct catalog_writer* cw, const struct record* r){
+	unsigned char buf[16];
+	size_t len = strlen(r->file);
+	size_t i;
+
+	/* a file with no versions left is not there at any point in time */
+	if (r->n_versions == 0){
+		return 0;
+	}
+	if (len > 0xFFFF){
+		log_warning_ex("%s is too long for the catalog", r->file);
+		return 0;
+	}
+	if (cw->prev && strcmp(cw->prev, r->file) >= 0){
+		log_error("The checksum files are not sorted, so they cannot be cataloged");
+		return -1;
+	}
+	free(cw->prev);
+	if (!(cw->prev = sh_dup(r->file))){
+		return -1;
+	}
+
+	/* a new block starts at the first record past the end of the last one */
+	if (cw->len == 0 || cw->pos - cw->block_start >= CATALOG_BLOCK_LEN){
+		if (cw->len == cw->size){
+			size_t size = cw->size ? cw->size * 2 : 64;
+			uint64_t* tmp = realloc(cw->offsets, size * sizeof(*tmp));
+			char** tmp_keys;
+
+			if (!tmp){
+				log_enomem();
+				return -1;
+			}
+			cw->offsets = tmp;
+			if (!(tmp_keys = realloc(cw->keys, size * sizeof(*tmp_keys)))){
+				log_enomem();
+				return -1;
+			}
+			cw->keys = tmp_keys;
+			cw->size = size;
+		}
+		if (!(cw->keys[cw->len] = sh_dup(r->file))){
+			return -1;
+		}
+		cw->offsets[cw->len++] = cw->pos;
+		cw->block_start = cw->pos;
+	}
+
+	put_u16(buf, (unsigned)len);
+	if (fwrite(buf, 1, 2, cw->fp) != 2 || fwrite(r->file, 1, len, cw->fp) != len){
+		log_efwrite("catalog");
+		return -1;
+	}
+	put_u32(buf, (unsigned long)r->n_versions);
+	if (fwrite(buf, 1, 4, cw->fp) != 4){
+		log_efwrite("catalog");
+		return -1;
+	}
+	for (i = 0; i < r->n_versions; ++i){
+		put_u64(buf, r->versions[i].start);
+		put_u64(buf + 8, r->versions[i].end);
+		if (fwrite(buf, 1, 16, cw->fp) != 16){
+			log_efwrite("catalog");
+			return -1;
+		}
+	}
+	cw->pos += 2 + len + 4 + (uint64_t)r->n_versions * 16;
+	return 0;
+}
+
+/* writes the block index and the footer, and closes the file */
+static int writer_end(struct catalog_writer* cw){
+	unsigned char buf[CATALOG_FOOTER_LEN];
+	FILE* fp = cw->fp;
+	size_t i;
+
+	cw->fp = NULL;
+	put_u32(buf, (unsigned long)cw->len);
+	if (fwrite(buf, 1, 4, fp) != 4){
+		goto fail;
+	}
+	for (i = 0; i < cw->len; ++i){
+		size_t len = strlen(cw->keys[i]);
+
+		put_u64(buf, cw->offsets[i]);
+		put_u16(buf + 8, (unsigned)len);
+		if (fwrite(buf, 1, 10, fp) != 10 || fwrite(cw->keys[i], 1, len, fp) != len){
+			goto fail;
+		}
+	}
+	put_u64(buf, cw->pos);
+	memcpy(buf + 8, CATALOG_INDEX_MAGIC, 4);
+	if (fwrite(buf, 1, CATALOG_FOOTER_LEN, fp) != CATALOG_FOOTER_LEN){
+		goto fail;
+	}
+	if (fclose(fp) != 0){
+		log_efclose("catalog");
+		return -1;
+	}
+	return 0;
+
+fail:
+	log_efwrite("catalog");
+	fclose(fp);
+	return -1;
+}
+
+static void writer_free(struct catalog_writer* cw){
+	size_t i;
+
+	cw->fp ? fclose(cw->fp) : 0;
+	for (i = 0; i < cw->len; ++i){
+		free(cw->keys[i]);
+	}
+	free(cw->keys);
+	free(cw->offsets);
+	free(cw->prev);
+}
+
+struct catalog{
+	FILE* fp;
+	unsigned long last;
+	/* where the block index starts, which is where the last record ends */
+	uint64_t records_end;
+	uint64_t* offsets;
+	char** keys;
+	size_t n_blocks;
+	struct record r;
+};
+
+static char* catalog_file(const char* output_directory){
+	return sh_concat_path(sh_dup(output_directory), CATALOG_NAME);
+}
+
+/* opens a catalog file and loads its block index
+ * returns 0 on success, positive if it does not exist, or negative on error */
+static int open_file(const char* file, struct catalog** out){
+	struct catalog* c;
+	unsigned char buf[CATALOG_HEADER_LEN];
+	uint64_t size;
+	size_t i;
+	int ret = 0;
+
+	*out = NULL;
+	if (!file_exists(file)){
+		return 1;
+	}
+	if (!(c = calloc(1, sizeof(*c)))){
+		log_enomem();
+		return -1;
+	}
+	if (!(c->fp = fopen(file, "rb"))){
+		log_efopen(file);
+		ret = -1;
+		goto cleanup;
+	}
+	if (fread(buf, 1, CATALOG_HEADER_LEN, c->fp) != CATALOG_HEADER_LEN || memcmp(buf, CATALOG_MAGIC, 4) != 0){
+		log_error_ex("%s is not a catalog", file);
+		ret = -1;
+		goto cleanup;
+	}
+	if (buf[4] > CATALOG_VERSION){
+		log_error_ex("Catalog version %d is newer than this version of ezbackup supports", buf[4]);
+		ret = -1;
+		goto cleanup;
+	}
+	c->last = (unsigned long)get_u64(buf + 8);
+
+	if (checksum_read_footer(c->fp, CATALOG_INDEX_MAGIC, CATALOG_HEADER_LEN + 4 + CATALOG_FOOTER_LEN, buf, CATALOG_FOOTER_LEN, &size) != 0){
+		goto corrupt;
+	}
+	c->records_end = get_u64(buf);
+	if (c->records_end < CATALOG_HEADER_LEN || c->records_end + 4 + CATALOG_FOOTER_LEN > size ||
+			fseek(c->fp, c->records_end, SEEK_SET) != 0 || fread(buf, 1, 4, c->fp) != 4){
+		goto corrupt;
+	}
+	c->n_blocks = get_u32(buf);
+	/* every entry takes at least 10 bytes */
+	if (c->n_blocks > (size - c->records_end) / 10){
+		goto corrupt;
+	}
+	if (c->n_blocks > 0 && (!(c->offsets = malloc(c->n_blocks * sizeof(*c->offsets))) || !(c->keys = calloc(c->n_blocks, sizeof(*c->keys))))){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+	for (i = 0; i < c->n_blocks; ++i){
+		size_t len;
+
+		if (fread(buf, 1, 10, c->fp) != 10){
+			goto corrupt;
+		}
+		c->offsets[i] = get_u64(buf);
+		len = get_u16(buf + 8);
+		if (c->offsets[i] >= c->records_end || !(c->keys[i] = malloc(len + 1))){
+			if (c->offsets[i] < c->records_end){
+				log_enomem();
+				ret = -1;
+				goto cleanup;
+			}
+			goto corrupt;
+		}
+		if (fread(c->keys[i], 1, len, c->fp) != len){
+			goto corrupt;
+		}
+		c->keys[i][len] = '\0';
+	}
+	goto cleanup;
+
+corrupt:
+	log_error_ex("%s is corrupt", file);
+	ret = -1;
+
+cleanup:
+	if (ret != 0){
+		catalog_close(c);
+		return ret;
+	}
+	*out = c;
+	return 0;
+}
+
+int catalog_open(const char* output_directory, struct catalog** out){
+	char* file;
+	int ret;
+
+	return_ifnull(output_directory, -1);
+	return_ifnull(out, -1);
+
+	if (!(file = catalog_file(output_directory))){
+		return -1;
+	}
+	ret = open_file(file, out);
+	free(file);
+	return ret;
+}
+
+unsigned long catalog_last(const struct catalog* c){
+	return c ? c->last : 0;
+}
+
+/* the version that was current at a point in time, or NULL if there was none */
+static const struct catalog_version* find_version(const struct record* r, unsigned long time){
+	size_t i;
+
+	/* versions are oldest first, and a file rarely has many of them */
+	for (i = r->n_versions; i > 0; --i){
+		const struct catalog_version* v = &r->versions[i - 1];
+
+		if (v->start <= time){
+			return v->end == 0 || time < v->end ? v : NULL;
+		}
+	}
+	return NULL;
+}
+
+static const char* block_key(size_t i, const void* data){
+	return ((const struct catalog*)data)->keys[i];
+}
+
+int catalog_resolve(struct catalog* c, const char* file, unsigned long time, struct catalog_version* out){
+	const struct catalog_version* v;
+	uint64_t pos;
+	size_t block;
+	int res;
+
+	return_ifnull(c, -1);
+	return_ifnull(file, -1);
+	return_ifnull(out, -1);
+
+	if (checksum_find_block(file, c->n_blocks, block_key, c, &block) != 0){
+		return 1;
+	}
+
+	pos = c->offsets[block];
+	if (fseek(c->fp, pos, SEEK_SET) != 0){
+		log_error_ex("Failed to seek in catalog (%s)", strerror(errno));
+		return -1;
+	}
+	while ((res = read_record(c->fp, &pos, c->records_end, &c->r)) == 0){
+		int cmp = strcmp(file, c->r.file);
+
+		if (cmp < 0){
+			return 1;
+		}
+		if (cmp == 0){
+			if (!(v = find_version(&c->r, time))){
+				return 1;
+			}
+			*out = *v;
+			return 0;
+		}
+	}
+	return res;
+}
+
+int catalog_list(struct catalog* c, unsigned long time, catalog_list_func func, void* data){
+	uint64_t pos = CATALOG_HEADER_LEN;
+	int res;
+
+	return_ifnull(c, -1);
+	return_ifnull(func, -1);
+
+	if (fseek(c->fp, pos, SEEK_SET) != 0){
+		log_error_ex("Failed to seek in catalog (%s)", strerror(errno));
+		return -1;
+	}
+	while ((res = read_record(c->fp, &pos, c->records_end, &c->r)) == 0){
+		const struct catalog_version* v = find_version(&c->r, time);
+
+		if (v && func(c->r.file, v, data) != 0){
+			return 1;
+		}
+	}
+	return res < 0 ? -1 : 0;
+}
+
+void catalog_close(struct catalog* c){
+	size_t i;
+
+	if (!c){
+		return;
+	}
+	c->fp ? fclose(c->fp) : 0;
+	if (c->keys){
+		for (i = 0; i < c->n_blocks; ++i){
+			free(c->keys[i]);
+		}
+	}
+	free(c->keys);
+	free(c->offsets);
+	record_free(&c->r);
+	free(c);
+}
+
+/* the records of the catalog being updated, which may not exist yet */
+struct catalog_input{
+	struct catalog* c;
+	uint64_t pos;
+	int res;
+};
+
+static int input_next(struct catalog_input* in){
+	in->res = in->c ? read_record(in->c->fp, &in->pos, in->c->records_end, &in->c->r) : 1;
+	return in->res < 0 ? -1 : 0;
+}
+
+static int checksum_next(struct checksum_reader* cr, const struct element** e){
+	int res = cr ? checksum_reader_next(cr, e) : 1;
+
+	if (res != 0){
+		*e = NULL;
+	}
+	return res < 0 ? -1 : 0;
+}
+
+/* merges what changed between two checksum files into a catalog, writing the result to out_file
+ * prev_file is NULL for the first backup, and catalog is NULL if there is none yet */
+static int apply_backup(struct catalog* catalog, const char* out_file, const char* prev_file, const char* next_file, unsigned long time){
+	struct catalog_input in;
+	struct catalog_writer cw;
+	struct record r;
+	FILE* fp_prev = NULL;
+	FILE* fp_next = NULL;
+	struct checksum_reader* cr_prev = NULL;
+	struct checksum_reader* cr_next = NULL;
+	const struct element* e_prev = NULL;
+	const struct element* e_next = NULL;
+	unsigned long last = catalog ? catalog->last : 0;
+	int ret = 0;
+
+	memset(&r, 0, sizeof(r));
+	memset(&cw, 0, sizeof(cw));
+	in.c = catalog;
+	in.pos = CATALOG_HEADER_LEN;
+
+	if ((prev_file && (!(fp_prev = fopen(prev_file, "rb")) || !(cr_prev = checksum_reader_new(fp_prev, 0)))) ||
+			!(fp_next = fopen(next_file, "rb")) || !(cr_next = checksum_reader_new(fp_next, 0))){
+		log_error_ex2("Failed to read %s or %s", prev_file ? prev_file : next_file, next_file);
+		ret = -1;
+		goto cleanup;
+	}
+	if (catalog && fseek(catalog->fp, in.pos, SEEK_SET) != 0){
+		log_error_ex("Failed to seek in catalog (%s)", strerror(errno));
+		ret = -1;
+		goto cleanup;
+	}
+	if (writer_begin(&cw, out_file, time) != 0 ||
+			input_next(&in) != 0 || checksum_next(cr_prev, &e_prev) != 0 || checksum_next(cr_next, &e_next) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+
+	while (in.res == 0 || e_prev || e_next){
+		const char* key = NULL;
+		int in_catalog;
+		int in_prev;
+		int in_next;
+
+		/* the smallest path of the three comes next */
+		if (in.res == 0){
+			key = in.c->r.file;
+		}
+		if (e_prev && (!key || strcmp(e_prev->file, key) < 0)){
+			key = e_prev->file;
+		}
+		if (e_next && (!key || strcmp(e_next->file, key) < 0)){
+			key = e_next->file;
+		}
+		in_catalog = in.res == 0 && strcmp(in.c->r.file, key) == 0;
+		in_prev = e_prev && strcmp(e_prev->file, key) == 0;
+		in_next = e_next && strcmp(e_next->file, key) == 0;
+
+		if (record_set_file(&r, key, strlen(key)) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+		r.n_versions = 0;
+		if (in_catalog){
+			size_t i;
+
+			for (i = 0; i < in.c->r.n_versions; ++i){
+				if (record_add(&r, in.c->r.versions[i].start, in.c->r.versions[i].end) != 0){
+					ret = -1;
+					goto cleanup;
+				}
+			}
+		}
+
+		/* a file from before the catalog started has been there since then */
+		if (in_prev && !record_is_open(&r) && record_add(&r, last, 0) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+		if (!in_next){
+			record_close(&r, time);
+		}
+		else if (!in_prev || strcmp(e_prev->checksum, e_next->checksum) != 0){
+			record_close(&r, time);
+			if (record_add(&r, time, 0) != 0){
+				ret = -1;
+				goto cleanup;
+			}
+		}
+		if (writer_add(&cw, &r) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+
+		if ((in_catalog && input_next(&in) != 0) ||
+				(in_prev && checksum_next(cr_prev, &e_prev) != 0) ||
+				(in_next && checksum_next(cr_next, &e_next) != 0)){
+			ret = -1;
+			goto cleanup;
+		}
+	}
+	if (writer_end(&cw) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+
+cleanup:
+	writer_free(&cw);
+	record_free(&r);
+	checksum_reader_free(cr_prev);
+	checksum_reader_free(cr_next);
+	fp_prev ? fclose(fp_prev) : 0;
+	fp_next ? fclose(fp_next) : 0;
+	if (ret != 0){
+		remove(out_file);
+	}
+	return ret;
+}
+
+static int time_cmp(const void* a, const void* b){
+	unsigned long t1 = *(const unsigned long*)a;
+	unsigned long t2 = *(const unsigned long*)b;
+
+	return t1 < t2 ? -1 : t1 > t2;
+}
+
+/* finds every checksums.txt.TIME newer than a time, oldest first */
+static int list_checksum_files(const char* output_directory, unsigned long after, unsigned long** out, size_t* out_len){
+	const size_t prefix_len = strlen(CHECKSUM_NAME ".");
+	unsigned long* times = NULL;
+	size_t len = 0;
+	size_t size = 0;
+	struct dirent* dnt;
+	DIR* dp;
+
+	*out = NULL;
+	*out_len = 0;
+	if (!(dp = opendir(output_directory))){
+		log_error_ex2("Failed to open %s (%s)", output_directory, strerror(errno));
+		return -1;
+	}
+	while ((dnt = readdir(dp)) != NULL){
+		const char* suffix = dnt->d_name + prefix_len;
+		char* endptr;
+		unsigned long t;
+
+		if (strncmp(dnt->d_name, CHECKSUM_NAME ".", prefix_len) != 0 || *suffix < '0' || *suffix > '9'){
+			continue;
+		}
+		t = strtoul(suffix, &endptr, 10);
+		if (*endptr != '\0' || t <= after){
+			continue;
+		}
+		if (len == size){
+			unsigned long* tmp;
+
+			size = size ? size * 2 : 16;
+			if (!(tmp = realloc(times, size * sizeof(*times)))){
+				log_enomem();
+				free(times);
+				closedir(dp);
+				return -1;
+			}
+			times = tmp;
+		}
+		times[len++] = t;
+	}
+	closedir(dp);
+
+	if (len > 0){
+		qsort(times, len, sizeof(*times), time_cmp);
+	}
+	*out = times;
+	*out_len = len;
+	return 0;
+}
+
+/* writes a new catalog next to the old one and moves it into place */
+static int replace_catalog(const char* file, const char* tmp_file){
+	if (rename(tmp_file, file) != 0){
+		log_error_ex2("Failed to move %s into place (%s)", tmp_file, strerror(errno));
+		remove(tmp_file);
+		return -1;
+	}
+	return 0;
+}
+
+int catalog_update(const char* output_directory, unsigned long backup_time){
+	struct catalog* c = NULL;
+	char* file = NULL;
+	char* tmp_file = NULL;
+	char* checksum_file = NULL;
+	char* prev_file = NULL;
+	char* next_file = NULL;
+	unsigned long* times = NULL;
+	size_t n_times = 0;
+	size_t i;
+	int ret = 0;
+
+	return_ifnull(output_directory, -1);
+
+	if (!(file = catalog_file(output_directory)) || !(tmp_file = sh_concat(sh_dup(file), ".tmp")) ||
+			!(checksum_file = sh_concat_path(sh_dup(output_directory), CHECKSUM_NAME))){
+		ret = -1;
+		goto cleanup;
+	}
+	/* everything in it can be found again in the checksum files */
+	if (open_file(file, &c) < 0){
+		log_warning("Rebuilding the catalog");
+		remove(file);
+	}
+	if (list_checksum_files(output_directory, c ? c->last : 0, &times, &n_times) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (n_times == 0){
+		/* the first backup has nothing before it */
+		if (!c && file_exists(checksum_file)){
+			if (apply_backup(NULL, tmp_file, NULL, checksum_file, backup_time) != 0 || replace_catalog(file, tmp_file) != 0){
+				ret = -1;
+			}
+		}
+		goto cleanup;
+	}
+
+	/* checksums.txt.TIME is what the backup at TIME started from, and the next one is what it left */
+	for (i = 0; i < n_times; ++i){
+		free(prev_file);
+		free(next_file);
+		prev_file = sh_sprintf("%s.%lu", checksum_file, times[i]);
+		next_file = i + 1 < n_times ? sh_sprintf("%s.%lu", checksum_file, times[i + 1]) : sh_dup(checksum_file);
+		if (!prev_file || !next_file){
+			ret = -1;
+			goto cleanup;
+		}
+		if (apply_backup(c, tmp_file, prev_file, next_file, times[i]) != 0){
+			log_error_ex("Failed to add the backup at %lu to the catalog", times[i]);
+			ret = -1;
+			goto cleanup;
+		}
+		catalog_close(c);
+		c = NULL;
+		if (replace_catalog(file, tmp_file) != 0 || open_file(file, &c) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+	}
+
+cleanup:
+	catalog_close(c);
+	free(file);
+	free(tmp_file);
+	free(checksum_file);
+	free(prev_file);
+	free(next_file);
+	free(times);
+	return ret;
+}
+
+/* for bsearch() over the forgotten generations */
+static int time_find(const void* key, const void* elem){
+	return time_cmp(key, elem);
+}
+
+int catalog_forget(const char* output_directory, const unsigned long* times, size_t len){
+	struct catalog* c = NULL;
+	struct catalog_writer cw;
+	unsigned long* sorted = NULL;
+	char* file = NULL;
+	char* tmp_file = NULL;
+	uint64_t pos = CATALOG_HEADER_LEN;
+	int res;
+	int ret = 0;
+
+	return_ifnull(output_directory, -1);
+
+	memset(&cw, 0, sizeof(cw));
+	if (!(file = catalog_file(output_directory)) || !(tmp_file = sh_concat(sh_dup(file), ".tmp"))){
+		ret = -1;
+		goto cleanup;
+	}
+	if ((res = open_file(file, &c)) != 0){
+		ret = res;
+		goto cleanup;
+	}
+	if (len == 0){
+		goto cleanup;
+	}
+	if (!(sorted = malloc(len * sizeof(*sorted)))){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+	memcpy(sorted, times, len * sizeof(*sorted));
+	qsort(sorted, len, sizeof(*sorted), time_cmp);
+
+	if (writer_begin(&cw, tmp_file, c->last) != 0 || fseek(c->fp, pos, SEEK_SET) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+	while ((res = read_record(c->fp, &pos, c->records_end, &c->r)) == 0){
+		size_t i;
+		size_t n = 0;
+
+		/* the current version is never in a generation */
+		for (i = 0; i < c->r.n_versions; ++i){
+			if (c->r.versions[i].end == 0 || !bsearch(&c->r.versions[i].end, sorted, len, sizeof(*sorted), time_find)){
+				c->r.versions[n++] = c->r.versions[i];
+			}
+		}
+		c->r.n_versions = n;
+		if (writer_add(&cw, &c->r) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+	}
+	if (res < 0 || writer_end(&cw) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+	catalog_close(c);
+	c = NULL;
+	ret = replace_catalog(file, tmp_file);
+
+cleanup:
+	writer_free(&cw);
+	if (ret < 0 && tmp_file){
+		remove(tmp_file);
+	}
+	catalog_close(c);
+	free(sorted);
+	free(file);
+	free(tmp_file);
+	return ret;
+}
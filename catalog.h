@@ -0,0 +1,146 @@
+/** @file catalog.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ *
+ * Keeps a catalog of every version of every file in a backup directory, so the state of any point in time can be looked up without walking deltas/.<br>
+ * Each version is current from the backup that wrote it until the backup that replaced or removed it. Those are both backup times, and the version that was replaced at TIME is at deltas/path/to/file.TIME.<br>
+ * The catalog is sorted by path and has a block index like a sorted checksum file, so resolving a path costs a binary search and one block, and listing a point in time is one sequential read.
+ */
+
+#ifndef __CATALOG_H
+#define __CATALOG_H
+
+#include <stddef.h>
+
+/**
+ * @brief The name of the catalog within the output directory.
+ */
+#define CATALOG_NAME "checksums.txt.catalog"
+
+/**
+ * @brief The first 4 bytes of a catalog.
+ */
+#define CATALOG_MAGIC "\x89" "EZT"
+#define CATALOG_VERSION 1        /**< @brief The newest version of the catalog format, which this version reads and writes. */
+#define CATALOG_HEADER_LEN 16    /**< @brief The length of the header: CATALOG_MAGIC, the version, 3 reserved bytes, and the time of the last backup in the catalog. */
+#define CATALOG_INDEX_MAGIC "EZTI" /**< @brief Ends a catalog. */
+#define CATALOG_FOOTER_LEN 12    /**< @brief The length of the footer: the offset of the block index, then CATALOG_INDEX_MAGIC. */
+
+#define CATALOG_BLOCK_LEN 4096   /**< @brief The block index has an entry for the first record past every CATALOG_BLOCK_LEN bytes. */
+
+/**
+ * @brief When one version of a file was current.
+ */
+struct catalog_version{
+	unsigned long start; /**< @brief The backup that wrote it, or 0 if it was already there before the first backup the catalog knows of. */
+	unsigned long end;   /**< @brief The backup that replaced or removed it, which is the generation it is in under deltas/, or 0 if it is still in files/. @see retention_find() */
+};
+
+/**
+ * @brief An open catalog, with its block index in memory.
+ */
+struct catalog;
+
+/**
+ * @brief Called by catalog_list() for every file that existed at a point in time.
+ *
+ * @param file The file's path.
+ *
+ * @param version The version that was current.
+ *
+ * @param data The data passed to catalog_list().
+ *
+ * @return 0 to continue, or non-zero to stop listing.
+ */
+typedef int (*catalog_list_func)(const char* file, const struct catalog_version* version, void* data);
+
+/**
+ * @brief Brings the catalog of an output directory up to date with its checksum files.<br>
+ * Every backup keeps the checksum file it replaces as checksums.txt.TIME, so each one that is newer than the catalog is merged into it in order. The first time, this builds the catalog out of all of them.
+ *
+ * @param output_directory The backup directory.
+ *
+ * @param backup_time The time of the backup that just finished, which is only needed if it was the first backup.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int catalog_update(const char* output_directory, unsigned long backup_time);
+
+/**
+ * @brief Removes the versions that were in some generations from the catalog, such as after they were pruned.
+ *
+ * @param output_directory The backup directory.
+ *
+ * @param times The generations that are gone.
+ *
+ * @param len The number of generations.
+ *
+ * @return 0 on success, positive if there is no catalog, or negative on failure.
+ */
+int catalog_forget(const char* output_directory, const unsigned long* times, size_t len);
+
+/**
+ * @brief Opens the catalog of an output directory.
+ *
+ * @param output_directory The backup directory.
+ *
+ * @param out Set to the open catalog, or NULL on failure.<br>
+ * This must be freed with catalog_close() when no longer in use.
+ *
+ * @return 0 on success, positive if there is no catalog, or negative on failure.
+ */
+int catalog_open(const char* output_directory, struct catalog** out);
+
+/**
+ * @brief Gets the time of the last backup in a catalog.
+ *
+ * @param c The catalog.
+ *
+ * @return The time of the backup.
+ */
+unsigned long catalog_last(const struct catalog* c);
+
+/**
+ * @brief Finds the version of a file that was current at a point in time.
+ *
+ * @param c The catalog.
+ *
+ * @param file The file's path.
+ *
+ * @param time The point in time.
+ *
+ * @param out Set to the version.
+ *
+ * @return 0 on success, positive if the file did not exist then or that version was pruned, or negative on failure.
+ */
+int catalog_resolve(struct catalog* c, const char* file, unsigned long time, struct catalog_version* out);
+
+/**
+ * @brief Lists every file that existed at a point in time, in order, with the version that was current.
+ *
+ * @param c The catalog.
+ *
+ * @param time The point in time.
+ *
+ * @param func Called for every file.
+ *
+ * @param data Passed to func.
+ *
+ * @return 0 on success, positive if func stopped it early, or negative on failure.
+ */
+int catalog_list(struct catalog* c, unsigned long time, catalog_list_func func, void* data);
+
+/**
+ * @brief Closes a catalog.
+ *
+ * @param c The catalog.<br>
+ * This can be NULL, in which case this function does nothing.
+ *
+ * @return void
+ */
+void catalog_close(struct catalog* c);
+
+#endif
@@ -0,0 +1,933 @@
+/** @file changejournal.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+/* open_by_handle_at() and struct file_handle are Linux extensions */
+#undef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
+
+#include "changejournal.h"
+#include "exclude.h"
+#include "log.h"
+#include "strings/stringhelper.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/fanotify.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#endif
+
+/* fanotify_mark() takes a 64-bit mask, which only fits in one syscall() argument on 64-bit targets */
+#if defined(__linux__) && defined(__LP64__) && defined(FAN_REPORT_DFID_NAME) && defined(SYS_fanotify_init)
+#define CJ_FANOTIFY
+#endif
+
+/* every journal starts with this, then the watcher's pid and session, each terminated */
+#define CJ_MAGIC "EZCJ1"
+/* each record is one of these, followed by a terminated path */
+#define CJ_RECORD_PATH 'P'
+/* changes may have been missed, so the journal cannot be trusted */
+#define CJ_RECORD_OVERFLOW 'O'
+
+#define INOTIFY_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+static volatile sig_atomic_t cj_stop = 0;
+
+static void on_stop_signal(int sig){
+	(void)sig;
+	cj_stop = 1;
+}
+
+struct watcher{
+	const struct string_array* directories;
+	struct exclude_trie* ex;
+	const char* journal_file;
+	char header[96];
+	size_t header_len;
+
+	int fd;
+	int fanotify;
+	/* inotify: the path each watch descriptor was added for */
+	char** wd_paths;
+	size_t wd_paths_size;
+	/* fanotify: each directory without symlinks or relative components, which is how a resolved handle reads */
+	char** real_dirs;
+	/* fanotify: a descriptor on each filesystem being watched, to resolve handles against */
+	struct mount_ref{
+		int fd;
+		unsigned char fsid[8];
+	}* mounts;
+	size_t n_mounts;
+
+	/* records waiting for the next flush */
+	char* buf;
+	size_t buf_len;
+	size_t buf_size;
+	/* the last record, so a file being written to does not fill the buffer with itself */
+	size_t last_record;
+	/* an overflow has to be recorded in the next flush */
+	int overflow;
+	/* a directory could not be watched, so no journal can be trusted while this watcher runs */
+	int incomplete;
+};
+
+/* whether path is one of the directories being watched or under one of them, and not excluded */
+static int is_watched(const struct watcher* w, const char* path){
+	size_t i;
+
+	if (exclude_match(w->ex, path)){
+		return 0;
+	}
+	for (i = 0; i < w->directories->len; ++i){
+		const char* dir = w->directories->strings[i];
+		size_t len = strlen(dir);
+
+		while (len > 1 && dir[len - 1] == '/'){
+			len--;
+		}
+		if (strncmp(path, dir, len) == 0 && (path[len] == '\0' || path[len] == '/' || dir[len - 1] == '/')){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int buf_append(struct watcher* w, const void* data, size_t len){
+	if (w->buf_len + len > w->buf_size){
+		size_t new_size = w->buf_size ? w->buf_size : 4096;
+		char* tmp;
+
+		while (new_size < w->buf_len + len){
+			new_size *= 2;
+		}
+		if (!(tmp = realloc(w->buf, new_size))){
+			log_enomem();
+			return -1;
+		}
+		w->buf = tmp;
+		w->buf_size = new_size;
+	}
+	memcpy(w->buf + w->buf_len, data, len);
+	w->buf_len += len;
+	return 0;
+}
+
+static void record_path(struct watcher* w, const char* path){
+	char type = CJ_RECORD_PATH;
+	size_t start = w->buf_len;
+
+	if (!is_watched(w, path)){
+		return;
+	}
+	if (w->buf_len > 0 && strcmp(w->buf + w->last_record + 1, path) == 0){
+		return;
+	}
+	/* a change that cannot be recorded is a change that was missed */
+	if (buf_append(w, &type, 1) != 0 || buf_append(w, path, strlen(path) + 1) != 0){
+		w->buf_len = start;
+		w->overflow = 1;
+		return;
+	}
+	w->last_record = start;
+}
+
+static int write_all(int fd, const void* data, size_t len){
+	const char* ptr = data;
+
+	while (len > 0){
+		ssize_t res = write(fd, ptr, len);
+
+		if (res < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			return -1;
+		}
+		ptr += res;
+		len -= res;
+	}
+	return 0;
+}
+
+/* appends the buffered records to the journal, creating it if a backup took the last one */
+static int flush_journal(struct watcher* w){
+	static const char overflow[2] = { CJ_RECORD_OVERFLOW, '\0' };
+	struct stat st_fd;
+	struct stat st_path;
+	int fd;
+
+	if (w->buf_len == 0 && !w->overflow && stat(w->journal_file, &st_path) == 0){
+		return 0;
+	}
+
+	/* a backup can rename the journal between the open() and the flock(), in which case this has to start over on the new one */
+	for (;;){
+		fd = open(w->journal_file, O_WRONLY | O_APPEND | O_CREAT, 0600);
+		if (fd < 0){
+			log_error_ex2("Failed to open %s (%s)", w->journal_file, strerror(errno));
+			return -1;
+		}
+		if (flock(fd, LOCK_EX) != 0){
+			log_error_ex2("Failed to lock %s (%s)", w->journal_file, strerror(errno));
+			close(fd);
+			return -1;
+		}
+		if (fstat(fd, &st_fd) == 0 && stat(w->journal_file, &st_path) == 0 && st_fd.st_dev == st_path.st_dev && st_fd.st_ino == st_path.st_ino){
+			break;
+		}
+		close(fd);
+	}
+
+	if ((st_fd.st_size == 0 && write_all(fd, w->header, w->header_len) != 0) ||
+			((w->overflow || w->incomplete) && write_all(fd, overflow, sizeof(overflow)) != 0) ||
+			write_all(fd, w->buf, w->buf_len) != 0){
+		log_error_ex2("Failed to write to %s (%s)", w->journal_file, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	w->buf_len = 0;
+	w->overflow = 0;
+	return 0;
+}
+
+static int set_wd_path(struct watcher* w, int wd, const char* path){
+	char* dup;
+
+	if ((size_t)wd >= w->wd_paths_size){
+		size_t new_size = w->wd_paths_size ? w->wd_paths_size : 256;
+		char** tmp;
+
+		while (new_size <= (size_t)wd){
+			new_size *= 2;
+		}
+		if (!(tmp = realloc(w->wd_paths, new_size * sizeof(*w->wd_paths)))){
+			log_enomem();
+			return -1;
+		}
+		memset(tmp + w->wd_paths_size, 0, (new_size - w->wd_paths_size) * sizeof(*tmp));
+		w->wd_paths = tmp;
+		w->wd_paths_size = new_size;
+	}
+	if (!(dup = sh_dup(path))){
+		log_enomem();
+		return -1;
+	}
+	free(w->wd_paths[wd]);
+	w->wd_paths[wd] = dup;
+	return 0;
+}
+
+/* watches dir and every directory under it
+ * a directory that was already watched keeps its watch, but gets its new path if it was moved */
+static void watch_tree(struct watcher* w, const char* dir){
+	struct dirent* dnt;
+	DIR* dp;
+	int wd;
+
+	if (exclude_match(w->ex, dir)){
+		return;
+	}
+	wd = inotify_add_watch(w->fd, dir, INOTIFY_MASK);
+	if (wd < 0){
+		if (errno == ENOSPC && !w->incomplete){
+			log_warning("Ran out of inotify watches. Raise fs.inotify.max_user_watches; until then, every backup walks every directory.");
+		}
+		else if (errno != ENOENT && errno != ENOTDIR){
+			log_warning_ex2("Failed to watch %s (%s)", dir, strerror(errno));
+		}
+		if (errno != ENOENT && errno != ENOTDIR){
+			w->incomplete = 1;
+		}
+		return;
+	}
+	if (set_wd_path(w, wd, dir) != 0){
+		w->incomplete = 1;
+		return;
+	}
+
+	/* anything created before the watch was added is covered by the directory itself being recorded */
+	if (!(dp = opendir(dir))){
+		return;
+	}
+	while ((dnt = readdir(dp)) != NULL){
+		struct stat st;
+		char* path;
+		int is_dir;
+
+		if (!strcmp(dnt->d_name, ".") || !strcmp(dnt->d_name, "..")){
+			continue;
+		}
+		if (!(path = sh_concat_path(sh_dup(dir), dnt->d_name))){
+			log_enomem();
+			w->incomplete = 1;
+			break;
+		}
+#ifdef DT_DIR
+		if (dnt->d_type != DT_UNKNOWN){
+			is_dir = dnt->d_type == DT_DIR;
+		}
+		else
+#endif
+		{
+			is_dir = lstat(path, &st) == 0 && S_ISDIR(st.st_mode);
+		}
+		if (is_dir){
+			watch_tree(w, path);
+		}
+		free(path);
+	}
+	closedir(dp);
+}
+
+static int read_inotify(struct watcher* w){
+	union{
+		struct inotify_event ev;
+		char buf[65536];
+	}u;
+	ssize_t len;
+	char* ptr;
+
+	len = read(w->fd, u.buf, sizeof(u.buf));
+	if (len < 0){
+		if (errno == EINTR || errno == EAGAIN){
+			return 0;
+		}
+		log_error_ex("Failed to read inotify events (%s)", strerror(errno));
+		return -1;
+	}
+
+	for (ptr = u.buf; ptr < u.buf + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event*)ptr)->len){
+		const struct inotify_event* ev = (const struct inotify_event*)ptr;
+		const char* dir;
+		char* path;
+
+		if (ev->mask & IN_Q_OVERFLOW){
+			log_warning("The inotify queue overflowed. The next backup walks every directory.");
+			w->overflow = 1;
+			continue;
+		}
+		if (ev->wd < 0 || (size_t)ev->wd >= w->wd_paths_size || !(dir = w->wd_paths[ev->wd])){
+			continue;
+		}
+		if (ev->mask & IN_IGNORED){
+			free(w->wd_paths[ev->wd]);
+			w->wd_paths[ev->wd] = NULL;
+			continue;
+		}
+		if (ev->len == 0){
+			record_path(w, dir);
+			continue;
+		}
+
+		if (!(path = sh_concat_path(sh_dup(dir), ev->name))){
+			log_enomem();
+			w->overflow = 1;
+			continue;
+		}
+		record_path(w, path);
+		if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) && (ev->mask & IN_ISDIR)){
+			watch_tree(w, path);
+		}
+		free(path);
+	}
+	return 0;
+}
+
+#ifdef CJ_FANOTIFY
+/* fanotify can report every change on a filesystem with one mark, but only to a privileged process on a recent kernel */
+static int start_fanotify(struct watcher* w){
+	size_t i;
+
+	if (!(w->real_dirs = calloc(w->directories->len, sizeof(*w->real_dirs)))){
+		log_enomem();
+		return -1;
+	}
+	for (i = 0; i < w->directories->len; ++i){
+		w->real_dirs[i] = realpath(w->directories->strings[i], NULL);
+	}
+
+	w->fd = syscall(SYS_fanotify_init, FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME, O_RDONLY | O_LARGEFILE);
+	if (w->fd < 0){
+		log_info_ex("fanotify is not available (%s). Using inotify instead.", strerror(errno));
+		return -1;
+	}
+	if (!(w->mounts = calloc(w->directories->len, sizeof(*w->mounts)))){
+		log_enomem();
+		goto fail;
+	}
+
+	for (i = 0; i < w->directories->len; ++i){
+		const char* dir = w->directories->strings[i];
+		struct statfs sfs;
+		size_t j;
+		int fd;
+
+		if (syscall(SYS_fanotify_mark, w->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+					(unsigned long)(FAN_MODIFY | FAN_ATTRIB | FAN_CLOSE_WRITE | FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_DELETE_SELF | FAN_MOVE_SELF | FAN_ONDIR),
+					AT_FDCWD, dir) != 0){
+			log_info_ex2("Failed to add a fanotify mark for %s (%s). Using inotify instead.", dir, strerror(errno));
+			goto fail;
+		}
+		if ((fd = open(dir, O_RDONLY | O_DIRECTORY)) < 0 || fstatfs(fd, &sfs) != 0){
+			log_info_ex2("Failed to open %s (%s). Using inotify instead.", dir, strerror(errno));
+			fd >= 0 ? close(fd) : 0;
+			goto fail;
+		}
+		for (j = 0; j < w->n_mounts; ++j){
+			if (memcmp(w->mounts[j].fsid, &sfs.f_fsid, sizeof(w->mounts[j].fsid)) == 0){
+				break;
+			}
+		}
+		if (j < w->n_mounts){
+			close(fd);
+			continue;
+		}
+		w->mounts[w->n_mounts].fd = fd;
+		memcpy(w->mounts[w->n_mounts].fsid, &sfs.f_fsid, sizeof(w->mounts[w->n_mounts].fsid));
+		w->n_mounts++;
+	}
+
+	w->fanotify = 1;
+	return 0;
+
+fail:
+	for (i = 0; i < w->n_mounts; ++i){
+		close(w->mounts[i].fd);
+	}
+	free(w->mounts);
+	w->mounts = NULL;
+	w->n_mounts = 0;
+	close(w->fd);
+	w->fd = -1;
+	return -1;
+}
+
+/* the path of a directory handle joined with the name after it */
+static char* resolve_fid(struct watcher* w, const struct fanotify_event_info_fid* fid){
+	struct file_handle* handle = (struct file_handle*)fid->handle;
+	const char* name = NULL;
+	char proc_path[64];
+	char dir[4096];
+	ssize_t len;
+	size_t i;
+	int fd;
+
+	if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME){
+		name = (const char*)handle->f_handle + handle->handle_bytes;
+	}
+	for (i = 0; i < w->n_mounts; ++i){
+		if (memcmp(w->mounts[i].fsid, &fid->fsid, sizeof(w->mounts[i].fsid)) == 0){
+			break;
+		}
+	}
+	if (i == w->n_mounts){
+		return NULL;
+	}
+
+	/* a directory that is already gone was recorded itself when its parent saw it go */
+	if ((fd = open_by_handle_at(w->mounts[i].fd, handle, O_PATH)) < 0){
+		log_debug_ex("Failed to open a fanotify handle (%s)", strerror(errno));
+		return NULL;
+	}
+	sprintf(proc_path, "/proc/self/fd/%d", fd);
+	len = readlink(proc_path, dir, sizeof(dir) - 1);
+	close(fd);
+	if (len < 0){
+		return NULL;
+	}
+	dir[len] = '\0';
+
+	if (!name || !strcmp(name, ".")){
+		return sh_dup(dir);
+	}
+	return sh_concat_path(sh_dup(dir), name);
+}
+
+/* a resolved path with the directory it is under written the way the backup walks it, or NULL if it is not under one */
+static char* to_backup_path(const struct watcher* w, const char* path){
+	size_t i;
+
+	for (i = 0; i < w->directories->len; ++i){
+		const char* real = w->real_dirs[i];
+		size_t len;
+
+		if (!real){
+			continue;
+		}
+		len = strlen(real);
+		if (strncmp(path, real, len) != 0 || (path[len] != '\0' && path[len] != '/' && real[len - 1] != '/')){
+			continue;
+		}
+		path += len;
+		while (*path == '/'){
+			path++;
+		}
+		return *path ? sh_concat_path(sh_dup(w->directories->strings[i]), path) : sh_dup(w->directories->strings[i]);
+	}
+	return NULL;
+}
+
+static int read_fanotify(struct watcher* w){
+	union{
+		struct fanotify_event_metadata md;
+		char buf[65536];
+	}u;
+	const struct fanotify_event_metadata* md;
+	ssize_t len;
+
+	len = read(w->fd, u.buf, sizeof(u.buf));
+	if (len < 0){
+		if (errno == EINTR || errno == EAGAIN){
+			return 0;
+		}
+		log_error_ex("Failed to read fanotify events (%s)", strerror(errno));
+		return -1;
+	}
+
+	for (md = &u.md; FAN_EVENT_OK(md, len); md = FAN_EVENT_NEXT(md, len)){
+		const char* info = (const char*)md + md->metadata_len;
+
+		if (md->mask & FAN_Q_OVERFLOW){
+			log_warning("The fanotify queue overflowed. The next backup walks every directory.");
+			w->overflow = 1;
+			continue;
+		}
+		while (info < (const char*)md + md->event_len){
+			const struct fanotify_event_info_fid* fid = (const struct fanotify_event_info_fid*)info;
+
+			if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME || fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID){
+				char* real = resolve_fid(w, fid);
+				char* path = real ? to_backup_path(w, real) : NULL;
+
+				if (path){
+					record_path(w, path);
+				}
+				free(path);
+				free(real);
+			}
+			if (fid->hdr.len == 0){
+				break;
+			}
+			info += fid->hdr.len;
+		}
+	}
+	return 0;
+}
+#endif
+
+static void watcher_free(struct watcher* w){
+	size_t i;
+
+	for (i = 0; i < w->wd_paths_size; ++i){
+		free(w->wd_paths[i]);
+	}
+	free(w->wd_paths);
+	for (i = 0; i < w->n_mounts; ++i){
+		close(w->mounts[i].fd);
+	}
+	free(w->mounts);
+	for (i = 0; w->real_dirs && i < w->directories->len; ++i){
+		free(w->real_dirs[i]);
+	}
+	free(w->real_dirs);
+	free(w->buf);
+	exclude_free(w->ex);
+	w->fd >= 0 ? close(w->fd) : 0;
+}
+
+int cj_watch(const struct options* opt){
+	struct watcher w;
+	struct sigaction sa;
+	time_t last_flush;
+	size_t i;
+	int ret = 0;
+
+	return_ifnull(opt, -1);
+	if (!opt->change_journal){
+		log_error("No change journal was given to watch into (--change-journal)");
+		return -1;
+	}
+
+	memset(&w, 0, sizeof(w));
+	w.fd = -1;
+	w.directories = opt->directories;
+	w.journal_file = opt->change_journal;
+	/* the pid says if the watcher is still running, and the session tells it apart from one that was restarted with the same pid */
+	sprintf(w.header, "%s%c%lu%c%lx%lx", CJ_MAGIC, '\0', (unsigned long)getpid(), '\0', (unsigned long)time(NULL), (unsigned long)getpid());
+	w.header_len = strlen(w.header) + 1;
+	w.header_len += strlen(w.header + w.header_len) + 1;
+	w.header_len += strlen(w.header + w.header_len) + 1;
+	/* anything that changed before this watcher started was not seen by it */
+	w.overflow = 1;
+
+	if (!(w.ex = exclude_new(opt->exclude))){
+		ret = -1;
+		goto cleanup;
+	}
+
+#ifdef CJ_FANOTIFY
+	start_fanotify(&w);
+#endif
+	if (!w.fanotify){
+		if ((w.fd = inotify_init()) < 0){
+			log_error_ex("Failed to start inotify (%s)", strerror(errno));
+			ret = -1;
+			goto cleanup;
+		}
+		for (i = 0; i < opt->directories->len; ++i){
+			watch_tree(&w, opt->directories->strings[i]);
+		}
+	}
+	if (flush_journal(&w) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+	last_flush = time(NULL);
+
+	cj_stop = 0;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_stop_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	printf("Watching for changes with %s. Press Ctrl+C to stop.\n", w.fanotify ? "fanotify" : "inotify");
+	while (!cj_stop){
+		struct pollfd pfd;
+
+		pfd.fd = w.fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, CJ_FLUSH_INTERVAL * 1000) > 0){
+#ifdef CJ_FANOTIFY
+			if ((w.fanotify ? read_fanotify(&w) : read_inotify(&w)) != 0){
+#else
+			if (read_inotify(&w) != 0){
+#endif
+				ret = -1;
+				break;
+			}
+		}
+		/* also when nothing happened, so a backup that took the journal gets a new one to show the watcher is still here */
+		if (time(NULL) - last_flush >= CJ_FLUSH_INTERVAL || w.buf_len >= ((size_t)1 << 20)){
+			if (flush_journal(&w) != 0){
+				ret = -1;
+				break;
+			}
+			last_flush = time(NULL);
+		}
+	}
+	if (ret == 0 && flush_journal(&w) != 0){
+		ret = -1;
+	}
+
+	sa.sa_handler = SIG_DFL;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+cleanup:
+	watcher_free(&w);
+	return ret;
+}
+
+static int cmp_path(const void* p1, const void* p2){
+	return strcmp(*(const char* const*)p1, *(const char* const*)p2);
+}
+
+/* reads all of fp into a terminated buffer */
+static char* read_whole_file(FILE* fp, size_t* out_len){
+	char* buf = NULL;
+	size_t size = 0;
+	size_t len = 0;
+
+	for (;;){
+		size_t res;
+
+		if (len + 1 >= size){
+			size_t new_size = size ? size * 2 : 65536;
+			char* tmp = realloc(buf, new_size);
+
+			if (!tmp){
+				log_enomem();
+				free(buf);
+				return NULL;
+			}
+			buf = tmp;
+			size = new_size;
+		}
+		res = fread(buf + len, 1, size - len - 1, fp);
+		len += res;
+		if (res == 0){
+			break;
+		}
+	}
+	if (ferror(fp)){
+		free(buf);
+		return NULL;
+	}
+	buf[len] = '\0';
+	*out_len = len;
+	return buf;
+}
+
+/* the session and run count the last successful backup recorded, or NULL if there are none */
+static char* read_state(const char* state_file, unsigned long* runs){
+	FILE* fp;
+	char* buf;
+	char* session;
+	size_t len;
+
+	if (!(fp = fopen(state_file, "rb"))){
+		return NULL;
+	}
+	buf = read_whole_file(fp, &len);
+	fclose(fp);
+	if (!buf){
+		return NULL;
+	}
+	/* "session\0runs\0" */
+	if (strlen(buf) + 1 >= len || !(session = sh_dup(buf))){
+		free(buf);
+		return NULL;
+	}
+	*runs = strtoul(buf + strlen(buf) + 1, NULL, 10);
+	free(buf);
+	return session;
+}
+
+int cj_consume(const char* journal_file, const char* state_file, struct change_journal** out){
+	struct change_journal* cj = NULL;
+	char* consumed = NULL;
+	char* buf = NULL;
+	char* state_session = NULL;
+	unsigned long state_runs = 0;
+	const char* pid_str;
+	const char* ptr;
+	FILE* fp = NULL;
+	size_t len;
+	int overflow = 0;
+	int ret = 0;
+
+	return_ifnull(journal_file, -1);
+	return_ifnull(state_file, -1);
+	return_ifnull(out, -1);
+	*out = NULL;
+
+	state_session = read_state(state_file, &state_runs);
+	/* a backup that fails after this has to make the next one walk everything */
+	if (unlink(state_file) != 0 && errno != ENOENT){
+		log_warning_ex2("Failed to remove %s (%s)", state_file, strerror(errno));
+	}
+
+	/* the watcher starts a new journal once this one is gone, which is what the next backup reads */
+	if (!(consumed = sh_concat(sh_dup(journal_file), ".consumed"))){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+	if (rename(journal_file, consumed) != 0){
+		if (errno == ENOENT){
+			printf("There is no change journal at %s, so every directory is walked\n", journal_file);
+			ret = 1;
+			goto cleanup;
+		}
+		log_error_ex2("Failed to take the change journal %s (%s)", journal_file, strerror(errno));
+		ret = -1;
+		goto cleanup;
+	}
+	if (!(fp = fopen(consumed, "rb"))){
+		log_efopen(consumed);
+		ret = -1;
+		goto cleanup;
+	}
+	/* waits out a watcher that was in the middle of writing to it */
+	flock(fileno(fp), LOCK_EX);
+	buf = read_whole_file(fp, &len);
+	if (!buf){
+		log_error_ex("Failed to read %s", consumed);
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (!(cj = calloc(1, sizeof(*cj))) || !(cj->paths = sa_new())){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+
+	/* "EZCJ1\0pid\0session\0" */
+	ptr = buf;
+	if (strcmp(ptr, CJ_MAGIC) != 0 || (size_t)((ptr += strlen(ptr) + 1) - buf) >= len){
+		log_warning_ex("%s is not a change journal", consumed);
+		ret = 1;
+		goto cleanup;
+	}
+	pid_str = ptr;
+	ptr += strlen(ptr) + 1;
+	if ((size_t)(ptr - buf) >= len || !(cj->session = sh_dup(ptr))){
+		log_warning_ex("%s is not a change journal", consumed);
+		ret = 1;
+		goto cleanup;
+	}
+	ptr += strlen(ptr) + 1;
+
+	while ((size_t)(ptr - buf) < len){
+		char type = *ptr++;
+
+		if (type == CJ_RECORD_OVERFLOW){
+			overflow = 1;
+		}
+		else if (type == CJ_RECORD_PATH && sa_add(cj->paths, ptr) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+		ptr += strlen(ptr) + 1;
+	}
+
+	if (!state_session || strcmp(state_session, cj->session) != 0){
+		printf("The change journal was started after the last backup, so every directory is walked\n");
+		ret = 1;
+	}
+	else if (overflow){
+		printf("The change journal may have missed changes, so every directory is walked\n");
+		ret = 1;
+	}
+	/* a watcher that died after starting this journal could not have finished it */
+	else if (kill((pid_t)strtoul(pid_str, NULL, 10), 0) != 0 && errno == ESRCH){
+		printf("The watcher that wrote the change journal stopped, so every directory is walked\n");
+		ret = 1;
+	}
+	else if (state_runs + 1 >= CJ_FULL_WALK_RUNS){
+		printf("Walking every directory, since the change journal has been used %lu times in a row\n", state_runs + 1);
+		ret = 1;
+	}
+
+	if (ret == 0){
+		size_t i;
+		size_t j;
+
+		cj->runs = state_runs + 1;
+		qsort(cj->paths->strings, cj->paths->len, sizeof(*cj->paths->strings), cmp_path);
+		for (i = 0, j = 0; i < cj->paths->len; ++i){
+			if (j > 0 && strcmp(cj->paths->strings[j - 1], cj->paths->strings[i]) == 0){
+				free(cj->paths->strings[i]);
+				continue;
+			}
+			cj->paths->strings[j++] = cj->paths->strings[i];
+		}
+		cj->paths->len = j;
+	}
+	else{
+		sa_free(cj->paths);
+		cj->paths = NULL;
+		cj->runs = 0;
+	}
+
+cleanup:
+	fp ? fclose(fp) : 0;
+	if (consumed && ret >= 0){
+		remove(consumed);
+	}
+	if (ret < 0 || !cj || !cj->session){
+		cj_free(cj);
+		cj = NULL;
+	}
+	*out = cj;
+	free(consumed);
+	free(buf);
+	free(state_session);
+	return ret;
+}
+
+int cj_commit(const char* state_file, const struct change_journal* cj){
+	FILE* fp;
+	int ret = 0;
+
+	return_ifnull(state_file, -1);
+	return_ifnull(cj, -1);
+
+	if (!(fp = fopen(state_file, "wb"))){
+		log_efopen(state_file);
+		return -1;
+	}
+	if (fprintf(fp, "%s%c%lu%c", cj->session, '\0', cj->runs, '\0') < 0){
+		log_error_ex("Failed to write %s", state_file);
+		ret = -1;
+	}
+	if (fclose(fp) != 0){
+		log_efclose(state_file);
+		ret = -1;
+	}
+	if (ret != 0){
+		remove(state_file);
+	}
+	return ret;
+}
+
+/* whether the first len bytes of path are one of cj's paths */
+static int has_path(const struct change_journal* cj, const char* path, size_t len){
+	size_t lo = 0;
+	size_t hi = cj->paths->len;
+
+	while (lo < hi){
+		size_t mid = lo + (hi - lo) / 2;
+		const char* str = cj->paths->strings[mid];
+		int res = strncmp(str, path, len);
+
+		if (res == 0 && str[len] != '\0'){
+			res = 1;
+		}
+		if (res == 0){
+			return 1;
+		}
+		if (res < 0){
+			lo = mid + 1;
+		}
+		else{
+			hi = mid;
+		}
+	}
+	return 0;
+}
+
+int cj_changed(const struct change_journal* cj, const char* path){
+	size_t i;
+
+	return_ifnull(cj, 1);
+	return_ifnull(cj->paths, 1);
+	return_ifnull(path, 1);
+
+	for (i = 1; path[i] != '\0'; ++i){
+		if (path[i] == '/' && has_path(cj, path, i)){
+			return 1;
+		}
+	}
+	return has_path(cj, path, i);
+}
+
+void cj_free(struct change_journal* cj){
+	if (!cj){
+		return;
+	}
+	cj->paths ? sa_free(cj->paths) : (void)0;
+	free(cj->session);
+	free(cj);
+}
@@ -0,0 +1,102 @@
+/** @file changejournal.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __CHANGEJOURNAL_H
+#define __CHANGEJOURNAL_H
+
+#include "options/options.h"
+#include "strings/stringarray.h"
+
+#ifndef __GNUC__
+#define __attribute__(x)
+#endif
+
+/**
+ * @brief How many backups in a row can trust the change journal before one walks every directory anyway.<br>
+ * This is the safety net for changes the watcher could not have seen, such as ones made while the filesystem was mounted somewhere else.
+ */
+#define CJ_FULL_WALK_RUNS (30)
+
+/**
+ * @brief How often, in seconds, the watcher appends the changes it has seen to the change journal.
+ */
+#define CJ_FLUSH_INTERVAL (1)
+
+/**
+ * @brief What a backup read from the change journal.
+ */
+struct change_journal{
+	struct string_array* paths; /**< @brief The sorted paths that changed since the last backup. A changed directory means anything under it may have changed. This is NULL if the journal cannot be trusted, in which case every directory has to be walked. */
+	char* session;              /**< @brief The watcher that wrote the journal, which cj_commit() records so the next backup can tell if it kept running. */
+	unsigned long runs;         /**< @brief How many backups in a row have trusted the journal, counting this one. */
+};
+
+/**
+ * @brief Watches the directories being backed up and appends every path that changes in them to the change journal, until SIGINT or SIGTERM is received.<br>
+ * <br>
+ * fanotify with FAN_REPORT_DFID_NAME is used where the kernel has it and the process may use it, since one mark covers a whole filesystem.<br>
+ * Otherwise, every directory gets its own inotify watch.<br>
+ * If changes may have been missed, e.g. because the event queue overflowed or a directory could not be watched, the journal says so and the next backup walks every directory.
+ *
+ * @param opt The options to use.<br>
+ * opt->directories and opt->exclude say what to watch, and opt->change_journal is where the journal goes.
+ *
+ * @return 0 once interrupted, or negative on failure.
+ */
+int cj_watch(const struct options* opt);
+
+/**
+ * @brief Takes the change journal that the watcher has written so far, so it starts a new one for the next backup.<br>
+ * The journal can only be trusted if the same watcher wrote it since the backup that last called cj_commit() with that state file, and it did not miss anything.<br>
+ * The state file is removed until cj_commit() is called, so a backup that fails does not leave the next one trusting a journal that no longer has its changes.
+ *
+ * @param journal_file The change journal that cj_watch() writes.
+ *
+ * @param state_file Where cj_commit() records which watcher the last backup read.
+ *
+ * @param out A pointer to the change journal that was read.<br>
+ * This is set to NULL if there was no journal to read, and must be freed with cj_free() otherwise.
+ *
+ * @return 0 if the journal can be trusted, positive if every directory has to be walked, or negative on failure.
+ */
+int cj_consume(const char* journal_file, const char* state_file, struct change_journal** out);
+
+/**
+ * @brief Records that a backup finished with everything in a change journal, so the next one can trust the journal that follows it.
+ *
+ * @param state_file The state file given to cj_consume().
+ *
+ * @param cj The change journal returned by cj_consume().
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int cj_commit(const char* state_file, const struct change_journal* cj);
+
+/**
+ * @brief Checks if a path or any directory above it is in a change journal.
+ *
+ * @param cj The change journal returned by cj_consume().<br>
+ * Its paths cannot be NULL.
+ *
+ * @param path The path to check.
+ *
+ * @return Non-zero if the path may have changed, or 0 if it did not.
+ */
+int cj_changed(const struct change_journal* cj, const char* path);
+
+/**
+ * @brief Frees a change journal.
+ *
+ * @param cj The change journal to free.<br>
+ * This can be NULL, in which case this function does nothing.
+ *
+ * @return void
+ */
+void cj_free(struct change_journal* cj);
+
+#endif
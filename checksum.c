@@ -14,14 +14,50 @@
 #include "filehelper.h"
 #include "checksumsort.h"
 #include "strings/stringhelper.h"
+#include "stats.h"
+#include "trace.h"
+#include "fasthash.h"
+#include "hashbench.h"
+#include "statbatch.h"
 #include <stdio.h>
 #include <openssl/evp.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+/* serializes access to the shared checksum FILE*'s when backup workers run concurrently */
+static pthread_mutex_t checksum_file_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 const EVP_MD* get_evp_md(const char* hash_name){
-	return hash_name ? EVP_get_digestbyname(hash_name) : EVP_md_null();
+	const EVP_MD* md;
+
+	if (!hash_name){
+		return EVP_md_null();
+	}
+	if ((md = fasthash_get(hash_name)) != NULL){
+		return md;
+	}
+	if (strcmp(hash_name, HASH_AUTO_NAME) == 0){
+		return hash_fastest(1);
+	}
+	return EVP_get_digestbyname(hash_name);
+}
+
+const char* get_evp_md_name(const EVP_MD* md){
+	const char* name;
+
+	if (!md){
+		return NULL;
+	}
+	name = fasthash_name(md);
+	return name ? name : EVP_MD_name(md);
+}
+
+int evp_md_is_cryptographic(const EVP_MD* md){
+	return md && !fasthash_name(md) && md != EVP_md_null();
 }
 
 int bytes_to_hex(const unsigned char* bytes, unsigned len, char** out){
@@ -86,17 +122,41 @@ int bytes_to_hex(const unsigned char* bytes, unsigned len, char** out){
 
 /* computes a hash
  * returns 0 on success or err on failure */
+struct digest_state{
+	EVP_MD_CTX* ctx;
+	struct stats_time mark;
+	struct stats_time read_time;
+	struct stats_time hash_time;
+	uint64_t bytes;
+};
+
+/* a mapped file is only read when its pages are touched, so for those the hash time includes the disk */
+static int digest_block(const void* block, size_t len, void* data){
+	struct digest_state* ds = data;
+
+	/* everything since the last block was spent getting this one */
+	trace_lap(STAGE_READ, &ds->read_time, &ds->mark);
+	if (EVP_DigestUpdate(ds->ctx, block, len) != 1){
+		return -1;
+	}
+	trace_lap(STAGE_HASH, &ds->hash_time, &ds->mark);
+	ds->bytes += len;
+	return 0;
+}
+
 int checksum(const char* file, const EVP_MD* algorithm, unsigned char** out, unsigned* len){
 	FILE* fp = NULL;
 	EVP_MD_CTX* ctx = NULL;
-	unsigned char buffer[BUFFER_LEN];
-	int length;
+	struct digest_state ds;
 	int ret = 0;
 
 	return_ifnull(file, -1);
 	return_ifnull(out, -1);
 	return_ifnull(len, -1);
 
+	*out = NULL;
+	*len = 0;
+
 	fp = fopen(file, "rb");
 	if (!fp){
 		log_efopen(file);
@@ -128,20 +188,23 @@ int checksum(const char* file, const EVP_MD* algorithm, unsigned char** out, uns
 		goto cleanup;
 	}
 
-	while ((length = read_file(fp, buffer, sizeof(buffer))) > 0){
-		if (ferror(fp)){
-			log_efread(file);
-			goto cleanup;
-		}
-		if (EVP_DigestUpdate(ctx, buffer, length) != 1){
-			log_error("Failed to calculate checksum");
-			ERR_print_errors_fp(stderr);
-			goto cleanup;
-		}
+	memset(&ds, 0, sizeof(ds));
+	ds.ctx = ctx;
+	stats_time_now(&ds.mark);
+	/* large files are hashed straight out of a memory map */
+	if (read_file_blocks(fp, digest_block, &ds) != 0){
+		log_error_ex("Failed to calculate checksum for %s", file);
+		ERR_print_errors_fp(stderr);
+		ret = -1;
+		goto cleanup;
 	}
+	stats_time_lap(&ds.read_time, &ds.mark);
+	stats_add(STAGE_READ, &ds.read_time, ds.bytes, ds.bytes, 1);
+	stats_add(STAGE_HASH, &ds.hash_time, ds.bytes, 0, 1);
 
 	if (EVP_DigestFinal_ex(ctx, *out, len) != 1){
 		log_error("Failed to finalize checksum calculation");
+		ret = -1;
 		goto cleanup;
 	}
 
@@ -152,6 +215,11 @@ cleanup:
 	if (fp){
 		fclose(fp);
 	}
+	if (ret != 0){
+		free(*out);
+		*out = NULL;
+		*len = 0;
+	}
 	return ret;
 }
 
@@ -193,6 +261,8 @@ int file_to_element(const char* file, const EVP_MD* algorithm, struct element**
 	}
 	(*out)->file = malloc(strlen(file) + 1);
 	(*out)->checksum = NULL;
+	(*out)->meta = NULL;
+	(*out)->artifact = NULL;
 	if (!(*out)->file){
 		log_enomem();
 		ret = -1;
@@ -239,18 +309,63 @@ cleanup:
  * way to seperate the hash from its filename is to use a '\0'
  *
  * returns 0 on success or err on error */
-int add_checksum_to_file(const char* file, const EVP_MD* algorithm, FILE* out, FILE* prev_checksums, char** out_hash){
-	struct element* e;
-	char* checksum = NULL;
-	int ret;
+int get_file_meta(const char* file, struct file_meta* out){
+	struct stat st;
 
 	return_ifnull(file, -1);
 	return_ifnull(out, -1);
 
-	if (out_hash){
-		*out_hash = NULL;
+	if (stat(file, &st) != 0){
+		log_estat(file);
+		return -1;
 	}
 
+	return file_meta_from_stat(&st, out);
+}
+
+int file_meta_from_stat(const struct stat* st, struct file_meta* out){
+	time_t now;
+
+	return_ifnull(st, -1);
+	return_ifnull(out, -1);
+
+	out->size = st->st_size;
+	out->mtime = st->st_mtime;
+	out->ctime = st->st_ctime;
+	out->ino = st->st_ino;
+
+	/* timestamps only have 1 second of resolution,
+	 * so a file that was written this second could change again without its metadata changing */
+	now = time(NULL);
+	if (st->st_mtime >= now - 1 || st->st_ctime >= now - 1){
+		return 1;
+	}
+	return 0;
+}
+
+int file_meta_cmp(const struct file_meta* m1, const struct file_meta* m2){
+	return_ifnull(m1, -1);
+	return_ifnull(m2, -1);
+
+	return m1->size != m2->size ||
+		m1->mtime != m2->mtime ||
+		m1->ctime != m2->ctime ||
+		m1->ino != m2->ino;
+}
+
+int add_hash_to_file(const char* file, const char* hash, const struct file_meta* meta, FILE* out, FILE* prev_checksums){
+	return add_hash_to_file_ex(file, hash, NULL, meta, out, prev_checksums);
+}
+
+int add_hash_to_file_ex(const char* file, const char* hash, const char* artifact, const struct file_meta* meta, FILE* out, FILE* prev_checksums){
+	struct element e;
+	char* checksum = NULL;
+	int ret;
+
+	return_ifnull(file, -1);
+	return_ifnull(hash, -1);
+	return_ifnull(out, -1);
+
 	if (!file_opened_for_writing(out)){
 		log_emode();
 		return -1;
@@ -261,84 +376,189 @@ int add_checksum_to_file(const char* file, const EVP_MD* algorithm, FILE* out, F
 		return -1;
 	}
 
-	if (file_to_element(file, algorithm, &e) != 0){
-		log_debug("Could not create element from file");
-		return -1;
-	}
+	/* write_element_to_file() does not modify the element */
+	e.file = (char*)file;
+	e.checksum = (char*)hash;
+	e.meta = (struct file_meta*)meta;
+	e.artifact = (char*)artifact;
 
+	/* hashing is done in parallel by the callers, but the FILE*'s are shared */
+	pthread_mutex_lock(&checksum_file_mutex);
 	if (prev_checksums &&
-			search_for_checksum(prev_checksums, e->file, &checksum) == 0 &&
-			strcmp(checksum, e->checksum) == 0){
+			search_for_checksum(prev_checksums, file, &checksum) == 0 &&
+			strcmp(checksum, hash) == 0){
 		ret = 1;
 	}
 	else{
 		ret = 0;
 	}
 
-	if (write_element_to_file(out, e) != 0){
-		free_element(e);
+	if (write_element_to_file(out, &e) != 0){
+		pthread_mutex_unlock(&checksum_file_mutex);
 		free(checksum);
 		log_debug("Could not write element to file");
 		return -1;
 	}
+	pthread_mutex_unlock(&checksum_file_mutex);
+
+	free(checksum);
+	return ret;
+}
+
+long sync_checksum_file(FILE* out){
+	long len;
+
+	return_ifnull(out, -1);
+
+	/* a record is written with several calls, so the length is only whole between them */
+	pthread_mutex_lock(&checksum_file_mutex);
+	if (fflush(out) != 0){
+		pthread_mutex_unlock(&checksum_file_mutex);
+		log_error_ex("Failed to flush the checksum file (%s)", strerror(errno));
+		return -1;
+	}
+	len = ftell(out);
+	pthread_mutex_unlock(&checksum_file_mutex);
+	if (len < 0){
+		log_error_ex("Failed to get the length of the checksum file (%s)", strerror(errno));
+		return -1;
+	}
+
+	/* records added since are synced too, which does no harm, and the workers do not wait on the disk */
+	if (fsync(fileno(out)) != 0){
+		log_error_ex("Failed to sync the checksum file (%s)", strerror(errno));
+		return -1;
+	}
+	return len;
+}
+
+int add_checksum_to_file(const char* file, const EVP_MD* algorithm, FILE* out, FILE* prev_checksums, char** out_hash){
+	struct file_meta meta;
+	int meta_res;
+	char* hash = NULL;
+	int ret;
+
+	return_ifnull(file, -1);
+	return_ifnull(out, -1);
+
+	if (out_hash){
+		*out_hash = NULL;
+	}
+
+	/* taken before hashing so a write during hashing is caught next time */
+	meta_res = get_file_meta(file, &meta);
+
+	if (checksum_bytestring(file, algorithm, &hash) != 0){
+		log_debug("Could not compute checksum");
+		return -1;
+	}
+
+	ret = add_hash_to_file(file, hash, meta_res == 0 ? &meta : NULL, out, prev_checksums);
+	if (ret < 0){
+		free(hash);
+		return -1;
+	}
 
 	if (out_hash){
-		*out_hash = sh_dup(e->checksum);
-		if (!(*out_hash)){
-			log_warning("Failed to output hash.");
-		}
+		*out_hash = hash;
+	}
+	else{
+		free(hash);
 	}
-	free_element(e);
-	free(checksum);
 	return ret;
 }
 
-int sort_checksum_file(const char* in_out){
+int search_for_element(FILE* fp_checksums, const char* key, struct element** out){
+	int res;
+
+	return_ifnull(fp_checksums, -1);
+	return_ifnull(key, -1);
+	return_ifnull(out, -1);
+
+	if (!file_opened_for_reading(fp_checksums)){
+		log_emode();
+		*out = NULL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&checksum_file_mutex);
+	res = search_file_element(fp_checksums, key, out);
+	pthread_mutex_unlock(&checksum_file_mutex);
+	return res;
+}
+
+int sort_checksum_file(const char* in_out, uint64_t memory, int front_code){
 	struct TMPFILE** tmp_files = NULL;
-	struct TMPFILE* tmp_in = NULL;
+	FILE* fp_in = NULL;
+	struct ATOMICFILE* af_out = NULL;
 	size_t n_files = 0;
-	FILE* fp_out = NULL;
+	uint64_t size;
 	size_t i;
+	int res;
 	int ret = 0;
 
 	return_ifnull(in_out, -1);
 
-	tmp_in = temp_fopen();
-	if (rename_file(in_out, tmp_in->name) != 0){
-		log_error("Failed to move checksum file to temp location");
+	memory = checksum_sort_memory(memory);
+	size = get_file_size(in_out);
+
+	/* the sorted file is written next to the original and replaces it once it is done, so the original never has to move */
+	fp_in = fopen(in_out, "rb");
+	if (!fp_in){
+		log_efopen(in_out);
 		ret = -1;
 		goto cleanup;
 	}
-	temp_fflush(tmp_in);
 
-	fp_out = fopen(in_out, "wb");
-	if (!fp_out){
-		log_efopen(in_out);
+	af_out = atomic_fopen(in_out);
+	if (!af_out){
 		ret = -1;
 		goto cleanup;
 	}
 
-	if (create_initial_runs(tmp_in->fp, &tmp_files, &n_files) != 0){
-		log_debug("Error creating initial runs");
+	/* a list built from a sorted walk only has to be written out */
+	res = copy_sorted(fp_in, af_out->fp, front_code);
+	if (res < 0){
+		log_debug("Error copying sorted checksum file");
 		ret = -1;
 		goto cleanup;
 	}
-	if (merge_files(tmp_files, n_files, fp_out) != 0){
-		log_debug("Error merging files");
+	if (res == 0){
+		log_debug("Checksum file was already sorted");
+	}
+	/* no point in runs if they would all fit in memory at once */
+	else if (size != (uint64_t)-1 && size <= memory / CHECKSUM_SORT_OVERHEAD){
+		if (sort_in_memory(fp_in, af_out->fp, front_code) != 0){
+			log_debug("Error sorting checksum file in memory");
+			ret = -1;
+			goto cleanup;
+		}
+	}
+	else{
+		if (create_initial_runs(fp_in, memory, &tmp_files, &n_files) != 0){
+			log_debug("Error creating initial runs");
+			ret = -1;
+			goto cleanup;
+		}
+		if (merge_files(tmp_files, n_files, af_out->fp, front_code) != 0){
+			log_debug("Error merging files");
+			ret = -1;
+			goto cleanup;
+		}
+	}
+
+	if (atomic_fcommit(af_out) != 0){
 		ret = -1;
 		goto cleanup;
 	}
 
 cleanup:
-	if (ret != 0 && tmp_in){
-		rename_file(tmp_in->name, in_out);
-	}
-	tmp_in ? temp_fclose(tmp_in) : (void)0;
+	fp_in ? fclose(fp_in) : 0;
+	atomic_fclose(af_out);
 	for (i = 0; i < n_files; ++i){
 		temp_fclose(tmp_files[i]);
 	}
 	free(tmp_files);
-	fp_out ? fclose(fp_out) : 0;
 	return ret;
 }
 
@@ -373,10 +593,47 @@ int check_file_exists(const char* file){
 	}
 }
 
+/* writes the paths in a full stat batch that are gone to fp_out, and empties it
+ * names holds a copy of every path in the batch, which are freed */
+static int flush_removed(struct stat_batch* sb, char** names, FILE* fp_out){
+	size_t len = stat_batch_len(sb);
+	size_t i;
+	int ret = 0;
+
+	if (len > 0 && stat_batch_run(sb) != 0){
+		ret = -1;
+	}
+	for (i = 0; i < len; ++i){
+		int err = ret == 0 ? stat_batch_result(sb, i, NULL) : 0;
+
+		switch (err){
+		case 0:
+			break;
+		case ENOENT:
+		case ENOTDIR:
+			if (add_removed_to_file(fp_out, names[i]) != 0){
+				ret = -1;
+			}
+			break;
+		default:
+			errno = err;
+			log_estat(names[i]);
+			ret = -1;
+		}
+		free(names[i]);
+		names[i] = NULL;
+	}
+	stat_batch_reset(sb);
+	return ret;
+}
+
 int create_removed_list(const char* checksum_file, const char* out_file){
 	FILE* fp_checksum = NULL;
 	FILE* fp_out = NULL;
-	struct element* tmp;
+	struct checksum_reader* cr = NULL;
+	struct stat_batch* sb = NULL;
+	char** names = NULL;
+	const struct element* tmp;
 	int err;
 	int ret = 0;
 
@@ -395,32 +652,169 @@ int create_removed_list(const char* checksum_file, const char* out_file){
 		ret = -1;
 		goto cleanup;
 	}
+	if (!(cr = checksum_reader_new(fp_checksum, 0))){
+		ret = -1;
+		goto cleanup;
+	}
+	/* a whole batch of lstat()s is in flight at once, instead of waiting on each file in turn */
+	if (!(sb = stat_batch_new(0)) || !(names = calloc(stat_batch_depth(sb), sizeof(*names)))){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
 
-	while ((tmp = get_next_checksum_element(fp_checksum)) != NULL){
-		err = check_file_exists(tmp->file);
-		switch (err){
-		case 1:
-			break;
-		case 0:
-			fprintf(fp_out, "%s%c\n", tmp->file, '\0');
-			break;
-		default:
-			free_element(tmp);
-			return err;
+	while ((err = checksum_reader_next(cr, &tmp)) == 0){
+		size_t len = stat_batch_len(sb);
+
+		/* the reader's entry only lasts until the next one is read */
+		if (!(names[len] = sh_dup(tmp->file))){
+			log_enomem();
+			ret = -1;
+			goto cleanup;
 		}
-		free_element(tmp);
+		stat_batch_add(sb, STAT_BATCH_CWD, names[len]);
+		if (len + 1 >= stat_batch_depth(sb) && flush_removed(sb, names, fp_out) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+	}
+	if (err < 0){
+		ret = -1;
+	}
+	if (flush_removed(sb, names, fp_out) != 0){
+		ret = -1;
 	}
 
 cleanup:
+	if (names){
+		size_t i;
+
+		for (i = 0; i < stat_batch_depth(sb); ++i){
+			free(names[i]);
+		}
+		free(names);
+	}
+	stat_batch_free(sb);
+	checksum_reader_free(cr);
 	if (fp_checksum && fclose(fp_checksum) != 0){
 		log_efclose(checksum_file);
 	}
 	if (fp_out && fclose(fp_out) != 0){
-		log_efclose(fp_out);
+		log_efclose(out_file);
+		ret = -1;
 	}
 	return ret;
 }
 
+/* metadata and the artifact checksum count as well, since a delta has to give back next_file exactly */
+static int element_changed(const struct element* e1, const struct element* e2){
+	if (strcmp(e1->checksum, e2->checksum) != 0 || !e1->meta != !e2->meta || !e1->artifact != !e2->artifact){
+		return 1;
+	}
+	return (e1->meta && file_meta_cmp(e1->meta, e2->meta) != 0) ||
+		(e1->artifact && strcmp(e1->artifact, e2->artifact) != 0);
+}
+
+int create_checksum_delta(FILE* prev, const char* next_file, const char* out_file){
+	FILE* fp_next = NULL;
+	FILE* fp_out = NULL;
+	struct checksum_reader* cr_prev = NULL;
+	struct checksum_reader* cr_next = NULL;
+	const struct element* e_prev = NULL;
+	const struct element* e_next = NULL;
+	uint64_t n_changed = 0;
+	int res_prev;
+	int res_next;
+	int ret = 0;
+
+	return_ifnull(prev, -1);
+	return_ifnull(next_file, -1);
+	return_ifnull(out_file, -1);
+
+	if (fseek(prev, 0, SEEK_SET) != 0){
+		log_error_ex("Failed to seek in the previous checksum file (%s)", strerror(errno));
+		return -1;
+	}
+	if (!(fp_next = fopen(next_file, "rb"))){
+		log_efopen(next_file);
+		ret = -1;
+		goto cleanup;
+	}
+	if (!(fp_out = fopen(out_file, "wb"))){
+		log_efopen(out_file);
+		ret = -1;
+		goto cleanup;
+	}
+	if (!(cr_prev = checksum_reader_new(prev, 0)) || !(cr_next = checksum_reader_new(fp_next, 0))){
+		ret = -1;
+		goto cleanup;
+	}
+
+	res_prev = checksum_reader_next(cr_prev, &e_prev);
+	res_next = checksum_reader_next(cr_next, &e_next);
+	while ((res_prev == 0 || res_next == 0) && res_prev >= 0 && res_next >= 0){
+		int cmp = res_prev != 0 ? 1 : res_next != 0 ? -1 : strcmp(e_prev->file, e_next->file);
+		struct element e;
+
+		/* a removed path keeps its place in the order, with nothing where its checksum was */
+		if (cmp < 0){
+			memset(&e, 0, sizeof(e));
+			e.file = e_prev->file;
+			e.checksum = "";
+		}
+		else{
+			e = *e_next;
+		}
+		if (cmp != 0 || element_changed(e_prev, e_next)){
+			if (write_element_to_file(fp_out, &e) != 0){
+				ret = -1;
+				goto cleanup;
+			}
+			n_changed++;
+		}
+
+		if (cmp <= 0){
+			res_prev = checksum_reader_next(cr_prev, &e_prev);
+		}
+		if (cmp >= 0){
+			res_next = checksum_reader_next(cr_next, &e_next);
+		}
+	}
+	if (res_prev < 0 || res_next < 0){
+		ret = -1;
+		goto cleanup;
+	}
+
+cleanup:
+	checksum_reader_free(cr_prev);
+	checksum_reader_free(cr_next);
+	fp_next ? fclose(fp_next) : 0;
+	if (fp_out && fclose(fp_out) != 0){
+		log_efclose(out_file);
+		ret = -1;
+	}
+	/* the records are already in order, so this only adds the index that a sorted checksum file ends with */
+	if (ret == 0 && n_changed > 0 && sort_checksum_file(out_file, 0, 0) != 0){
+		ret = -1;
+	}
+	if (ret != 0){
+		remove(out_file);
+		return ret;
+	}
+	return n_changed > 0 ? 0 : 1;
+}
+
+int add_removed_to_file(FILE* fp, const char* file){
+	return_ifnull(fp, -1);
+	return_ifnull(file, -1);
+
+	if (fprintf(fp, "%s%c\n", file, '\0') < 0){
+		log_efwrite("removed file list");
+		return -1;
+	}
+	return 0;
+}
+
 char* get_next_removed(FILE* fp){
 	long pos_origin;
 	long pos_file;
@@ -9,6 +9,7 @@
 #ifndef __CHECKSUM_H
 #define __CHECKSUM_H
 
+#include <stdint.h>
 #include <stdio.h>
 #include <openssl/evp.h>
 
@@ -16,17 +17,45 @@
 #define __attribute__(x)
 #endif
 
+struct element;
+struct file_meta;
+struct stat;
+
 /**
- * @brief Returns an EVP_MD* object for a given string.
+ * @brief Returns an EVP_MD* object for a given string.<br>
+ * Built-in digests such as "xxh64" are found as well as OpenSSL's.<br>
+ * "auto" is the fastest cryptographic digest on this machine, which is measured the first time it is asked for.
  * @see checksum()
  * @see add_checksum_to_file()
+ * @see fasthash_get()
  *
  * @param hash_name Name of the digest algorithm (e.g. "SHA1").
  *
- * @return The corresponding EVP_MD*.
+ * @return The corresponding EVP_MD*, or NULL if there is no digest with that name.
  */
 const EVP_MD* get_evp_md(const char* hash_name);
 
+/**
+ * @brief Returns the name of a digest.<br>
+ * Unlike EVP_MD_name(), this also works for built-in digests.
+ * @see get_evp_md()
+ *
+ * @param md The digest.
+ *
+ * @return The digest's name, which can be passed to get_evp_md(), or NULL if md is NULL.
+ */
+const char* get_evp_md_name(const EVP_MD* md);
+
+/**
+ * @brief Checks if a digest resists deliberate collisions.<br>
+ * Digests that do not are still fine for detecting changes, but should not be used to identify data.
+ *
+ * @param md The digest.
+ *
+ * @return Non-zero if the digest is cryptographic, or 0 if it is not.
+ */
+int evp_md_is_cryptographic(const EVP_MD* md);
+
 /**
  * @brief Calculates the checksum for a given file.
  *
@@ -86,9 +115,9 @@ int bytes_to_hex(const unsigned char* bytes, unsigned len, char** out) __attribu
 /**
  * @brief Adds a file's checksum to a checksum list.<br>
  *
- * Said checksum will have the following format:<br>
- * `/path/to/file\0ABCDEF123456\0\n`<br>
- * This is necessary because any character besides '\0' is a valid character in a path.
+ * The checksum is recorded in the binary format described in write_element_to_file(). @see write_element_to_file()<br>
+ * The file's metadata is recorded as well. @see add_hash_to_file()<br>
+ * This function is thread-safe. Concurrent calls hash in parallel, but their accesses to out and prev_checksums are serialized.
  *
  * @param file The file to calculate a checksum for.
  *
@@ -112,15 +141,121 @@ int bytes_to_hex(const unsigned char* bytes, unsigned len, char** out) __attribu
 int add_checksum_to_file(const char* file, const EVP_MD* algorithm, FILE* out, FILE* prev_checksums, char** out_hash);
 
 /**
- * @brief Sorts a checksum list in strcmp() order by filename.
+ * @brief Adds an already computed checksum to a checksum list.<br>
+ * This is identical to add_checksum_to_file(), except the file is not read.<br>
+ * This function is thread-safe.
+ * @see add_checksum_to_file()
+ *
+ * @param file The file that the checksum belongs to.
+ *
+ * @param hash The file's hexadecimal checksum.
+ *
+ * @param meta The file's metadata, which lets the next backup skip hashing the file if it is unchanged.<br>
+ * This can be NULL, in which case the next backup will hash the file.
+ * @see get_file_meta()
+ *
+ * @param out The checksum list to add the file's checksum to.<br>
+ * This FILE* must be opened in writing binary ("wb") mode.
+ *
+ * @param prev_checksums An optional previous sorted checksum list to check if the file's contents were changed or not.<br>
+ * Set this parameter to NULL if there is no previous checksum list.<br>
+ * Otherwise, this FILE* must be opened in reading binary ("rb") mode.
+ *
+ * @return 0 on success, positive if the file was unchanged from prev_checksums, negative on failure.
+ */
+int add_hash_to_file(const char* file, const char* hash, const struct file_meta* meta, FILE* out, FILE* prev_checksums);
+
+/**
+ * @brief Adds an already computed checksum to a checksum list, along with the checksum of the file's output.<br>
+ * This is identical to add_hash_to_file(), except the output's checksum is recorded as well.<br>
+ * This function is thread-safe.
+ * @see add_hash_to_file()
+ *
+ * @param file The file that the checksum belongs to.
+ *
+ * @param hash The file's hexadecimal checksum.
+ *
+ * @param artifact The hexadecimal checksum of the file's output as it was stored, after compression and encryption.<br>
+ * This can be NULL, in which case none is recorded.
+ *
+ * @param meta The file's metadata.<br>
+ * This can be NULL.
+ *
+ * @param out The checksum list to add the file's checksum to.<br>
+ * This FILE* must be opened in writing binary ("wb") mode.
+ *
+ * @param prev_checksums An optional previous sorted checksum list to check if the file's contents were changed or not.<br>
+ * This can be NULL.
+ *
+ * @return 0 on success, positive if the file was unchanged from prev_checksums, negative on failure.
+ */
+int add_hash_to_file_ex(const char* file, const char* hash, const char* artifact, const struct file_meta* meta, FILE* out, FILE* prev_checksums);
+
+/**
+ * @brief Flushes a checksum list to disk and gets how long it is.<br>
+ * This function is thread-safe. The length is taken while no add_hash_to_file() call is writing to out, so it always ends on a whole record.
+ *
+ * @param out The checksum list that add_hash_to_file() writes to.
+ *
+ * @return The length of the checksum list in bytes, or negative on failure.
+ */
+long sync_checksum_file(FILE* out);
+
+/**
+ * @brief Reads the metadata that is recorded next to a file's checksum.
+ *
+ * @param file The file to stat.
+ *
+ * @param out The structure to fill.
+ *
+ * @return 0 on success, negative on failure.<br>
+ * Positive if the file was modified too recently for its metadata to be trusted. In this case out is still filled, but it should not be recorded.
+ */
+int get_file_meta(const char* file, struct file_meta* out);
+
+/**
+ * @brief Fills the metadata that is recorded next to a file's checksum from a stat() that was already done.<br>
+ * This is get_file_meta() without the stat(), for callers such as fi_next_stat() that already have one.
+ * @see get_file_meta()
+ *
+ * @param st The file's stat() metadata.
+ *
+ * @param out The structure to fill.
+ *
+ * @return 0 on success, negative on failure.<br>
+ * Positive if the file was modified too recently for its metadata to be trusted. In this case out is still filled, but it should not be recorded.
+ */
+int file_meta_from_stat(const struct stat* st, struct file_meta* out);
+
+/**
+ * @brief Compares two file metadata structures.
+ *
+ * @param m1 The first structure.
+ *
+ * @param m2 The second structure.
+ *
+ * @return 0 if they are the same, or non-zero if they are different.
+ */
+int file_meta_cmp(const struct file_meta* m1, const struct file_meta* m2);
+
+/**
+ * @brief Sorts a checksum list in strcmp() order by filename.<br>
+ * The sorted list is written next to in_out and replaces it in one step.<br>
+ * A list that is already in order, such as one built from a walk started with fi_start_sorted(), is written out without sorting. @see copy_sorted()
  *
  * @param in_out The checksum list to sort.
  * @see add_checksum_to_file()
  *
+ * @param memory How much memory the sort can use, in bytes, or 0 to pick it from the available memory. @see checksum_sort_memory()<br>
+ * A list that fits is sorted in memory. Otherwise, it is split into sorted runs on disk, which are merged afterwards.
+ *
+ * @param front_code Non-zero to front-code the sorted list, so that each path only stores what it does not share with the one before it.<br>
+ * This usually makes the list a fraction of its size, but versions before front-coding cannot read it, and neither can get_next_checksum_element(). @see CHECKSUM_PATH_SHARED
+ *
  * @return 0 on success, negative on failure.<br>
  * On failure, in_out will be unchanged.
  */
-int sort_checksum_file(const char* in_out);
+int sort_checksum_file(const char* in_out, uint64_t memory, int front_code);
 
 /**
  * @brief Searches a sorted checksum list for a filename, and returns its checksum if it exists.<br>
@@ -142,6 +277,25 @@ int sort_checksum_file(const char* in_out);
  */
 int search_for_checksum(FILE* fp, const char* key, char** checksum);
 
+/**
+ * @brief Searches a sorted checksum list for a filename, and returns its checksum and metadata if it exists.<br>
+ * This function is thread-safe.
+ * @see search_file_element()
+ *
+ * @param fp A sorted checksum list.<br>
+ * This FILE* must be opened in reading binary ("rb") mode.<br>
+ * Undefined behavior if this list is not sorted.
+ *
+ * @param key The filename to search for.
+ *
+ * @param out A pointer to the output element.<br>
+ * This will be set to NULL if the key could not be found or there was an error.<br>
+ * Otherwise, the element must be freed with free_element() when no longer in use.
+ *
+ * @return 0 on success, positive if the entry could not be found, negative on error.
+ */
+int search_for_element(FILE* fp, const char* key, struct element** out);
+
 /**
  * @brief Creates a list of removed files since the creation of a previous checksum file.
  *
@@ -152,13 +306,45 @@ int search_for_checksum(FILE* fp, const char* key, char** checksum);
  * Said file will contain a list of all files with entries in the checksum_file that no longer exist.<br>
  * The entries will be in the following format:
  *
- * /path/to/file1\n<br>
- * /path/to/file2\n
+ * /path/to/file1\0\n<br>
+ * /path/to/file2\0\n<br>
+ * This is a text checksum file with empty checksums, so a checksum_reader can read it. @see checksum_reader_new()
  *
  * @return 0 on success, negative on failure
  */
 int create_removed_list(const char* checksum_file, const char* out_file);
 
+/**
+ * @brief Writes what changed between two sorted checksum files as a sorted checksum file of its own.<br>
+ * Every record of next_file that is not in prev, or whose checksum, metadata or artifact checksum is different, is copied as-is.<br>
+ * Every path of prev that is not in next_file gets a record with an empty checksum.<br>
+ * Reading prev with the delta's records in place of the ones for the same paths, leaving out the ones with empty checksums, gives next_file back.
+ *
+ * @param prev The older checksum file.<br>
+ * This FILE* must be opened in reading binary ("rb") mode. It is read from the start, whatever its position.
+ *
+ * @param next_file The newer checksum file.
+ *
+ * @param out_file Where to write the delta. If it exists, it is overwritten.<br>
+ * If this function fails, it is removed.
+ *
+ * @return 0 on success, positive if nothing changed, in which case out_file is empty, or negative on failure.
+ */
+int create_checksum_delta(FILE* prev, const char* next_file, const char* out_file);
+
+/**
+ * @brief Adds an entry to a removed file list.
+ * @see create_removed_list()
+ *
+ * @param fp The removed file list.<br>
+ * This FILE* must be opened in writing mode.
+ *
+ * @param file The path of the removed file.
+ *
+ * @return 0 on success, negative on failure.
+ */
+int add_removed_to_file(FILE* fp, const char* file);
+
 /* TODO: return an integer since there's multiple reasons for NULL */
 
 /**
@@ -13,6 +13,10 @@
 #include <errno.h>
 /* reading them files */
 #include "filehelper.h"
+/* checksum strings */
+#include "crypt/base16.h"
+#include "strings/stringhelper.h"
+#include "treehash.h"
 /* strcmp */
 #include <string.h>
 /* malloc */
@@ -24,6 +28,13 @@
 /* increasing file limit */
 #include <sys/resource.h>
 #include <unistd.h>
+/* caching the last summary */
+#include <pthread.h>
+/* sorting runs in parallel */
+#include "threadpool.h"
+
+/* c89 has no 64-bit integer constants */
+#define U64(hi, lo) (((uint64_t)(hi) << 32) | (uint64_t)(lo))
 
 void free_element(struct element* e){
 	if (!e){
@@ -31,9 +42,58 @@ void free_element(struct element* e){
 	}
 	free(e->file);
 	free(e->checksum);
+	free(e->meta);
+	free(e->artifact);
 	free(e);
 }
 
+/* metadata in the text format is 64 hex digits */
+static int read_u64_hex(const char* str, uint64_t* out){
+	int i;
+
+	*out = 0;
+	for (i = 0; i < 16; ++i){
+		int c = str[i];
+		*out <<= 4;
+		if (c >= '0' && c <= '9'){
+			*out |= c - '0';
+		}
+		else if (c >= 'A' && c <= 'F'){
+			*out |= c - 'A' + 10;
+		}
+		else{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* parses the 64 hex digits after the checksum
+ * returns NULL if they are missing or malformed */
+static struct file_meta* parse_meta(const char* str, size_t len){
+	struct file_meta* meta;
+
+	if (len != 64){
+		return NULL;
+	}
+
+	meta = malloc(sizeof(*meta));
+	if (!meta){
+		log_enomem();
+		return NULL;
+	}
+
+	if (read_u64_hex(str, &meta->size) != 0 ||
+			read_u64_hex(str + 16, &meta->mtime) != 0 ||
+			read_u64_hex(str + 32, &meta->ctime) != 0 ||
+			read_u64_hex(str + 48, &meta->ino) != 0){
+		log_warning("Malformed metadata in checksum file");
+		free(meta);
+		return NULL;
+	}
+	return meta;
+}
+
 static int compare_elements(struct element* e1, struct element* e2){
 	/* send NULL's to bottom of heap */
 	if  (!e1){
@@ -46,7 +106,158 @@ static int compare_elements(struct element* e1, struct element* e2){
 	return strcmp(e1->file, e2->file);
 }
 
-/* format: <file>\0<checksum>\n */
+static void put_u16(unsigned char* p, unsigned val){
+	p[0] = val & 0xFF;
+	p[1] = (val >> 8) & 0xFF;
+}
+
+static void put_u32(unsigned char* p, unsigned long val){
+	put_u16(p, val & 0xFFFF);
+	put_u16(p + 2, (val >> 16) & 0xFFFF);
+}
+
+static void put_u64(unsigned char* p, uint64_t val){
+	put_u32(p, (unsigned long)(val & 0xFFFFFFFFUL));
+	put_u32(p + 4, (unsigned long)(val >> 32));
+}
+
+static unsigned get_u16(const unsigned char* p){
+	return p[0] | (p[1] << 8);
+}
+
+static unsigned long get_u32(const unsigned char* p){
+	return get_u16(p) | ((unsigned long)get_u16(p + 2) << 16);
+}
+
+static uint64_t get_u64(const unsigned char* p){
+	return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+/* only digests that to_base16() could have made are stored raw,
+ * so that reading them back gives exactly the same string */
+static int hex_to_raw(const char* hex, unsigned char* out, size_t* out_len){
+	size_t len = strlen(hex);
+	size_t i;
+
+	if (len == 0 || len % 2 != 0 || len / 2 > CHECKSUM_MAX_DIGEST_LEN){
+		return -1;
+	}
+	for (i = 0; i < len; ++i){
+		int c = hex[i];
+		int val;
+
+		if (c >= '0' && c <= '9'){
+			val = c - '0';
+		}
+		else if (c >= 'A' && c <= 'F'){
+			val = c - 'A' + 10;
+		}
+		else{
+			return -1;
+		}
+		if (i % 2 == 0){
+			out[i / 2] = val << 4;
+		}
+		else{
+			out[i / 2] |= val;
+		}
+	}
+	*out_len = len / 2;
+	return 0;
+}
+
+static int write_header(FILE* fp, int version){
+	unsigned char header[CHECKSUM_HEADER_LEN];
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, CHECKSUM_MAGIC, 4);
+	header[4] = version;
+	if (fwrite(header, 1, sizeof(header), fp) != sizeof(header)){
+		log_efwrite("checksum file");
+		return -1;
+	}
+	return 0;
+}
+
+/* writes a record whose path starts with the first shared bytes of the last record's path, which are left out
+ * format: see checksumsort.h */
+static int write_record(FILE* fp, const struct element* e, size_t shared){
+	unsigned char head[7];
+	unsigned char digest[CHECKSUM_MAX_DIGEST_LEN];
+	unsigned char meta[32];
+	unsigned char artifact[1 + CHECKSUM_MAX_DIGEST_LEN];
+	size_t artifact_len = 0;
+	const char* hex = NULL;
+	size_t digest_len = 0;
+	size_t head_len = 5;
+	size_t path_len;
+	int flags = 0;
+
+	path_len = strlen(e->file);
+	if (path_len > 0xFFFF){
+		log_error_ex("%s is too long for the checksum file", e->file);
+		return -1;
+	}
+
+	hex = e->checksum;
+	if (strncmp(hex, TREE_HASH_PREFIX, strlen(TREE_HASH_PREFIX)) == 0){
+		hex += strlen(TREE_HASH_PREFIX);
+		flags |= CHECKSUM_SUM_TREE;
+	}
+	if (hex_to_raw(hex, digest, &digest_len) != 0){
+		/* anything else is kept as-is */
+		flags = CHECKSUM_SUM_STRING;
+		digest_len = strlen(e->checksum);
+		if (digest_len > 0xFF){
+			log_error_ex("The checksum of %s is too long for the checksum file", e->file);
+			return -1;
+		}
+	}
+	if (e->meta){
+		flags |= CHECKSUM_HAS_META;
+		put_u64(meta, e->meta->size);
+		put_u64(meta + 8, e->meta->mtime);
+		put_u64(meta + 16, e->meta->ctime);
+		put_u64(meta + 24, e->meta->ino);
+	}
+	/* an artifact checksum is always a plain digest, so anything else is left out */
+	if (e->artifact && hex_to_raw(e->artifact, artifact + 1, &artifact_len) == 0){
+		flags |= CHECKSUM_HAS_ARTIFACT;
+		artifact[0] = artifact_len;
+	}
+
+	if (shared > 0){
+		flags |= CHECKSUM_PATH_SHARED;
+		put_u16(head + 5, shared);
+		head_len = 7;
+	}
+
+	head[0] = CHECKSUM_TAG_RECORD;
+	head[1] = flags;
+	put_u16(head + 2, path_len - shared);
+	head[4] = digest_len;
+
+	/* every checksum file starts with a header, so an empty one gets it before its first record */
+	if (ftell(fp) == 0 && write_header(fp, CHECKSUM_VERSION_PLAIN) != 0){
+		return -1;
+	}
+
+	fwrite(head, 1, head_len, fp);
+	fwrite(e->file + shared, 1, path_len - shared, fp);
+	fwrite((flags & CHECKSUM_SUM_STRING) ? (const void*)e->checksum : (const void*)digest, 1, digest_len, fp);
+	if (e->meta){
+		fwrite(meta, 1, sizeof(meta), fp);
+	}
+	if (flags & CHECKSUM_HAS_ARTIFACT){
+		fwrite(artifact, 1, artifact_len + 1, fp);
+	}
+	if (ferror(fp)){
+		log_efwrite("checksum file");
+		return -1;
+	}
+	return 0;
+}
+
 int write_element_to_file(FILE* fp, struct element* e){
 	return_ifnull(fp, -1);
 	return_ifnull(e, -1);
@@ -57,36 +268,28 @@ int write_element_to_file(FILE* fp, struct element* e){
 		log_emode();
 		return -1;
 	}
-
-	fprintf(fp, "%s%c%s\n", e->file, '\0', e->checksum);
-	if (ferror(fp)){
-		log_efwrite("checksum file");
-		return -1;
-	}
-	return 0;
+	return write_record(fp, e, 0);
 }
 
-struct element* get_next_checksum_element(FILE* fp){
+/* reads an element in the format used before the checksum file became binary:
+ * <file>\0<hex checksum>[\0<64 hex digits of metadata>]\n */
+static struct element* get_next_text_element(FILE* fp){
 	long pos_origin;
 	long pos_file;
 	long pos_checksum;
 	int c;
 	size_t len_file;
 	size_t len_checksum;
+	size_t len_hex;
 	struct element* e;
 
-	return_ifnull(fp, NULL);
-
-	if (!file_opened_for_reading(fp)){
-		log_emode();
-		return NULL;
-	}
-
 	e = malloc(sizeof(*e));
 	if (!e){
 		log_enomem();
 		return NULL;
 	}
+	e->meta = NULL;
+	e->artifact = NULL;
 
 	pos_origin = ftell(fp);
 	/* read an \0 */
@@ -129,7 +332,7 @@ struct element* get_next_checksum_element(FILE* fp){
 		return NULL;
 	}
 	e->checksum = malloc(len_checksum);
-	if (!e){
+	if (!e->checksum){
 		log_enomem();
 		free(e->file);
 		free(e);
@@ -153,6 +356,12 @@ struct element* get_next_checksum_element(FILE* fp){
 	}
 	e->checksum[len_checksum - 1] = '\0';
 
+	/* metadata follows a second '\0' if present */
+	len_hex = strlen(e->checksum);
+	if (len_hex < len_checksum - 1){
+		e->meta = parse_meta(e->checksum + len_hex + 1, len_checksum - len_hex - 2);
+	}
+
 	if (ferror(fp)){
 		log_efread("file");
 		free_element(e);
@@ -162,304 +371,2282 @@ struct element* get_next_checksum_element(FILE* fp){
 	return e;
 }
 
-static void swap(struct element** e1, struct element** e2){
-	struct element* buf = *e1;
-	*e1 = *e2;
-	*e2 = buf;
+/* reads the rest of a binary record after its tag */
+static struct element* get_next_binary_element(FILE* fp){
+	unsigned char head[4];
+	unsigned char digest[0x100];
+	unsigned char meta[32];
+	size_t path_len;
+	size_t digest_len;
+	int flags;
+	struct element* e;
+
+	if (fread(head, 1, sizeof(head), fp) != sizeof(head)){
+		log_error("Truncated record in checksum file");
+		return NULL;
+	}
+	flags = head[0];
+	path_len = get_u16(head + 1);
+	digest_len = head[3];
+
+	if (flags & CHECKSUM_PATH_SHARED){
+		log_error("Front-coded checksum records can only be read with a checksum_reader");
+		return NULL;
+	}
+
+	e = calloc(1, sizeof(*e));
+	if (!e || !(e->file = malloc(path_len + 1))){
+		log_enomem();
+		free(e);
+		return NULL;
+	}
+	if (fread(e->file, 1, path_len, fp) != path_len ||
+			fread(digest, 1, digest_len, fp) != digest_len ||
+			((flags & CHECKSUM_HAS_META) && fread(meta, 1, sizeof(meta), fp) != sizeof(meta))){
+		log_error("Truncated record in checksum file");
+		free_element(e);
+		return NULL;
+	}
+	e->file[path_len] = '\0';
+
+	if (flags & CHECKSUM_SUM_STRING){
+		if ((e->checksum = malloc(digest_len + 1)) != NULL){
+			memcpy(e->checksum, digest, digest_len);
+			e->checksum[digest_len] = '\0';
+		}
+	}
+	else if (to_base16(digest, digest_len, &e->checksum) == 0 && (flags & CHECKSUM_SUM_TREE)){
+		char* hex = e->checksum;
+
+		e->checksum = sh_concat(sh_dup(TREE_HASH_PREFIX), hex);
+		free(hex);
+	}
+	if (!e->checksum){
+		log_enomem();
+		free_element(e);
+		return NULL;
+	}
+
+	if (flags & CHECKSUM_HAS_META){
+		if (!(e->meta = malloc(sizeof(*e->meta)))){
+			log_enomem();
+			free_element(e);
+			return NULL;
+		}
+		e->meta->size = get_u64(meta);
+		e->meta->mtime = get_u64(meta + 8);
+		e->meta->ctime = get_u64(meta + 16);
+		e->meta->ino = get_u64(meta + 24);
+	}
+
+	if (flags & CHECKSUM_HAS_ARTIFACT){
+		int c = fgetc(fp);
+
+		if (c == EOF || fread(digest, 1, c, fp) != (size_t)c){
+			log_error("Truncated record in checksum file");
+			free_element(e);
+			return NULL;
+		}
+		if (to_base16(digest, c, &e->artifact) != 0){
+			log_enomem();
+			free_element(e);
+			return NULL;
+		}
+	}
+	return e;
 }
 
-static void swap_mhn(struct minheapnode* mhn1, struct minheapnode* mhn2){
-	struct minheapnode tmp = *mhn1;
-	*mhn1 = *mhn2;
-	*mhn2 = tmp;
+/* checks the header at the start of a binary checksum file, whose first byte was already read */
+static int read_header(FILE* fp){
+	unsigned char header[CHECKSUM_HEADER_LEN];
+
+	header[0] = CHECKSUM_MAGIC[0];
+	if (fread(header + 1, 1, sizeof(header) - 1, fp) != sizeof(header) - 1 || memcmp(header, CHECKSUM_MAGIC, 4) != 0){
+		log_error("Checksum file has a corrupt header");
+		return -1;
+	}
+	if (header[4] > CHECKSUM_VERSION){
+		log_error_ex("Checksum file version %d is newer than this version of ezbackup supports", header[4]);
+		return -1;
+	}
+	return 0;
 }
 
-/* chooses the median of the left element, the right element,
- * and the middle element.
- *
- * this makes choosing a bad pivot much less likely */
-int median_of_three(struct element** elements, int low, int high){
-	int left = low;
-	int mid = (high - low) / 2;
-	int right = high;
+struct element* get_next_checksum_element(FILE* fp){
+	int c;
 
-	if (high - low < 3){
-		return low;
+	return_ifnull(fp, NULL);
+
+	if (!file_opened_for_reading(fp)){
+		log_emode();
+		return NULL;
 	}
 
-	if (compare_elements(elements[left], elements[mid]) > 0){
-		if (compare_elements(elements[mid], elements[right]) > 0){
-			return mid;
-		}
-		else if (compare_elements(elements[right], elements[left]) > 0){
-			return left;
+	if (ftell(fp) == 0 && (c = fgetc(fp)) != EOF){
+		if (c == (unsigned char)CHECKSUM_MAGIC[0]){
+			if (read_header(fp) != 0){
+				return NULL;
+			}
 		}
 		else{
-			return right;
+			ungetc(c, fp);
 		}
 	}
-	else{
-		if (compare_elements(elements[mid], elements[right]) < 0){
-			return mid;
+
+	c = fgetc(fp);
+	switch (c){
+	case EOF:
+		if (ferror(fp)){
+			log_efread("checksum file");
 		}
-		else if (compare_elements(elements[right], elements[left]) < 0){
-			return left;
+		return NULL;
+	case CHECKSUM_TAG_RECORD:
+		return get_next_binary_element(fp);
+	case CHECKSUM_TAG_INDEX:
+		/* the records end where the block index starts */
+		ungetc(c, fp);
+		return NULL;
+	default:
+		/* text records always start with the first character of a path, which is never one of the tags */
+		ungetc(c, fp);
+		return get_next_text_element(fp);
+	}
+}
+
+struct checksum_reader{
+	FILE* fp;
+	unsigned char* buf;
+	size_t buf_size;
+	/* the next record starts at buf[cursor], and buf[0..buf_len) is valid */
+	size_t cursor;
+	size_t buf_len;
+	/* the position of buf[0] in the file */
+	uint64_t buf_pos;
+	int eof;
+	/* what checksum_reader_next() returns, which points into buf or the arenas below */
+	struct element e;
+	struct file_meta meta;
+	char* file_arena;
+	size_t file_arena_size;
+	/* the length of the path in file_arena, which the next record may start with, if has_path is set */
+	size_t path_len;
+	int has_path;
+	char* sum_arena;
+	size_t sum_arena_size;
+	char* artifact_arena;
+	size_t artifact_arena_size;
+};
+
+struct checksum_reader* checksum_reader_new(FILE* fp, size_t buffer_len){
+	struct checksum_reader* cr;
+	long pos;
+
+	return_ifnull(fp, NULL);
+
+	if (!file_opened_for_reading(fp)){
+		log_emode();
+		return NULL;
+	}
+	if ((pos = ftell(fp)) < 0){
+		log_error_ex("Failed to determine position in checksum file (%s)", strerror(errno));
+		return NULL;
+	}
+
+	cr = calloc(1, sizeof(*cr));
+	if (!cr){
+		log_enomem();
+		return NULL;
+	}
+	cr->fp = fp;
+	cr->buf_size = buffer_len ? buffer_len : CHECKSUM_READER_BUFFER_LEN;
+	cr->buf_pos = pos;
+	cr->buf = malloc(cr->buf_size);
+	if (!cr->buf){
+		log_enomem();
+		free(cr);
+		return NULL;
+	}
+	return cr;
+}
+
+struct checksum_reader* checksum_reader_new_buf(const void* data, size_t len, uint64_t pos){
+	struct checksum_reader* cr;
+
+	return_ifnull(data, NULL);
+
+	cr = calloc(1, sizeof(*cr));
+	if (!cr){
+		log_enomem();
+		return NULL;
+	}
+	/* text records are terminated in place, so the reader needs its own copy */
+	cr->buf_size = len ? len : 1;
+	cr->buf = malloc(cr->buf_size);
+	if (!cr->buf){
+		log_enomem();
+		free(cr);
+		return NULL;
+	}
+	memcpy(cr->buf, data, len);
+	cr->buf_len = len;
+	cr->buf_pos = pos;
+	cr->eof = 1;
+	return cr;
+}
+
+void checksum_reader_seek(struct checksum_reader* cr, uint64_t offset){
+	if (!cr){
+		return;
+	}
+	/* blocks that were already read are not read again */
+	if (offset >= cr->buf_pos && offset <= cr->buf_pos + cr->buf_len){
+		cr->cursor = offset - cr->buf_pos;
+		cr->has_path = 0;
+		return;
+	}
+	cr->has_path = 0;
+	cr->buf_pos = offset;
+	cr->cursor = 0;
+	cr->buf_len = 0;
+	/* there is nothing outside of a buffer's data */
+	cr->eof = cr->fp == NULL;
+}
+
+/* makes sure at least n bytes past the cursor are in the buffer
+ * returns 0 if they are, positive if the file ends first, or negative on error */
+static int reader_fill(struct checksum_reader* cr, size_t n){
+	uint64_t end;
+	size_t len;
+
+	while (cr->buf_len - cr->cursor < n){
+		if (cr->eof){
+			return 1;
 		}
-		else{
-			return right;
+
+		/* move what is left of the buffer to the front */
+		if (cr->cursor > 0){
+			memmove(cr->buf, cr->buf + cr->cursor, cr->buf_len - cr->cursor);
+			cr->buf_pos += cr->cursor;
+			cr->buf_len -= cr->cursor;
+			cr->cursor = 0;
+		}
+		if (n > cr->buf_size){
+			size_t size = cr->buf_size * 2 > n ? cr->buf_size * 2 : n;
+			unsigned char* tmp = realloc(cr->buf, size);
+
+			if (!tmp){
+				log_enomem();
+				return -1;
+			}
+			cr->buf = tmp;
+			cr->buf_size = size;
 		}
+
+		/* something else may have moved the FILE*'s position since the last read */
+		end = cr->buf_pos + cr->buf_len;
+		if ((uint64_t)ftell(cr->fp) != end && fseek(cr->fp, end, SEEK_SET) != 0){
+			log_error_ex("Failed to seek in checksum file (%s)", strerror(errno));
+			return -1;
+		}
+		len = fread(cr->buf + cr->buf_len, 1, cr->buf_size - cr->buf_len, cr->fp);
+		if (ferror(cr->fp)){
+			log_efread("checksum file");
+			return -1;
+		}
+		if (len == 0){
+			cr->eof = 1;
+		}
+		cr->buf_len += len;
 	}
+	return 0;
 }
 
-/* partitions the array by putting all the elements on the
- * correct side of the pivot
- *
- * pivot must be the high element */
-static int partition(struct element** elements, int low, int high){
-	struct element* pivot = elements[high];
-	int i;
-	int j;
+/* finds the first c at or after the cursor + offset
+ * returns 0 and sets *out to its offset from the cursor, positive if the file ends first, or negative on error */
+static int reader_find(struct checksum_reader* cr, size_t offset, int c, size_t* out){
+	for (;;){
+		const unsigned char* p;
+		int res;
 
-	for (i = low - 1, j = low; j <= high - 1; ++j){
-		if (compare_elements(elements[j], pivot) < 0){
-			i++;
-			swap(&elements[i], &elements[j]);
+		if (cr->cursor + offset < cr->buf_len &&
+				(p = memchr(cr->buf + cr->cursor + offset, c, cr->buf_len - cr->cursor - offset)) != NULL){
+			*out = p - (cr->buf + cr->cursor);
+			return 0;
+		}
+		offset = cr->buf_len - cr->cursor;
+		/* more than what is buffered, which grows the buffer if it is already full */
+		if ((res = reader_fill(cr, offset + 1)) != 0){
+			return res;
 		}
 	}
-	swap(&elements[i + 1], &elements[high]);
-	return i + 1;
 }
 
-/* swaps the median of three element with the top element,
- * so it works with the above function */
-static int partition_m3(struct element** elements, int low, int high){
-	int m3 = median_of_three(elements, low, high);
-	swap(&elements[m3], &elements[high]);
-	return partition(elements, low, high);
-}
+/* makes sure an arena can hold len bytes */
+static int arena_reserve(char** arena, size_t* size, size_t len){
+	char* tmp;
+
+	if (len <= *size){
+		return 0;
+	}
+	tmp = realloc(*arena, len);
+	if (!tmp){
+		log_enomem();
+		return -1;
+	}
+	*arena = tmp;
+	*size = len;
+	return 0;
+}
+
+static int reader_next_text(struct checksum_reader* cr){
+	size_t end_file;
+	size_t end_record;
+	size_t len_hex;
+	char* record;
+	int res;
+
+	if ((res = reader_find(cr, 0, '\0', &end_file)) != 0 ||
+			(res = reader_find(cr, end_file + 1, '\n', &end_record)) != 0){
+		if (res > 0){
+			log_warning("Checksum file ends in the middle of a record");
+		}
+		return -1;
+	}
+
+	/* the path is already terminated, and the checksum can be terminated in place */
+	record = (char*)cr->buf + cr->cursor;
+	record[end_record] = '\0';
+	cr->e.file = record;
+	cr->e.checksum = record + end_file + 1;
+	cr->e.meta = NULL;
+	cr->e.artifact = NULL;
+	cr->has_path = 0;
+
+	len_hex = strlen(cr->e.checksum);
+	if (end_file + 1 + len_hex < end_record){
+		const char* meta_hex = cr->e.checksum + len_hex + 1;
+
+		if (end_record - (end_file + len_hex + 2) == 64 &&
+				read_u64_hex(meta_hex, &cr->meta.size) == 0 &&
+				read_u64_hex(meta_hex + 16, &cr->meta.mtime) == 0 &&
+				read_u64_hex(meta_hex + 32, &cr->meta.ctime) == 0 &&
+				read_u64_hex(meta_hex + 48, &cr->meta.ino) == 0){
+			cr->e.meta = &cr->meta;
+		}
+		else{
+			log_warning("Malformed metadata in checksum file");
+		}
+	}
+
+	cr->cursor += end_record + 1;
+	return 0;
+}
+
+static int reader_next_binary(struct checksum_reader* cr){
+	static const char hexmap[] = "0123456789ABCDEF";
+	const unsigned char* p;
+	size_t path_len;
+	size_t digest_len;
+	size_t prefix_len = 0;
+	size_t head_len;
+	size_t shared = 0;
+	size_t record_len;
+	size_t artifact_len = 0;
+	size_t i;
+	int flags;
+
+	/* the tag has already been checked */
+	if (reader_fill(cr, 5) != 0){
+		log_error("Truncated record in checksum file");
+		return -1;
+	}
+	p = cr->buf + cr->cursor;
+	flags = p[1];
+	path_len = get_u16(p + 2);
+	digest_len = p[4];
+	head_len = (flags & CHECKSUM_PATH_SHARED) ? 7 : 5;
+	record_len = head_len + path_len + digest_len + ((flags & CHECKSUM_HAS_META) ? 32 : 0);
+
+	/* the artifact checksum's length is the byte after the rest of the record */
+	if (flags & CHECKSUM_HAS_ARTIFACT){
+		if (reader_fill(cr, record_len + 1) != 0){
+			log_error("Truncated record in checksum file");
+			return -1;
+		}
+		artifact_len = cr->buf[cr->cursor + record_len];
+		record_len += 1 + artifact_len;
+	}
+	if (reader_fill(cr, record_len) != 0){
+		log_error("Truncated record in checksum file");
+		return -1;
+	}
+	p = cr->buf + cr->cursor;
+
+	if (flags & CHECKSUM_PATH_SHARED){
+		shared = get_u16(p + 5);
+		if (!cr->has_path || shared > cr->path_len){
+			log_error("Front-coded record in checksum file does not follow a record it can share its path with");
+			return -1;
+		}
+	}
+	p += head_len;
+
+	if (flags & CHECKSUM_SUM_TREE){
+		prefix_len = strlen(TREE_HASH_PREFIX);
+	}
+	/* the last path is still at the front of the arena, so only the rest has to be copied */
+	if (arena_reserve(&cr->file_arena, &cr->file_arena_size, shared + path_len + 1) != 0 ||
+			arena_reserve(&cr->sum_arena, &cr->sum_arena_size, prefix_len + digest_len * 2 + 1) != 0 ||
+			arena_reserve(&cr->artifact_arena, &cr->artifact_arena_size, artifact_len * 2 + 1) != 0){
+		return -1;
+	}
+
+	memcpy(cr->file_arena + shared, p, path_len);
+	cr->file_arena[shared + path_len] = '\0';
+	cr->path_len = shared + path_len;
+	cr->has_path = 1;
+	p += path_len;
+
+	if (flags & CHECKSUM_SUM_STRING){
+		memcpy(cr->sum_arena, p, digest_len);
+		cr->sum_arena[digest_len] = '\0';
+	}
+	else{
+		memcpy(cr->sum_arena, TREE_HASH_PREFIX, prefix_len);
+		for (i = 0; i < digest_len; ++i){
+			cr->sum_arena[prefix_len + i * 2] = hexmap[p[i] >> 4];
+			cr->sum_arena[prefix_len + i * 2 + 1] = hexmap[p[i] & 0x0F];
+		}
+		cr->sum_arena[prefix_len + digest_len * 2] = '\0';
+	}
+	p += digest_len;
+
+	cr->e.file = cr->file_arena;
+	cr->e.checksum = cr->sum_arena;
+	cr->e.meta = NULL;
+	if (flags & CHECKSUM_HAS_META){
+		cr->meta.size = get_u64(p);
+		cr->meta.mtime = get_u64(p + 8);
+		cr->meta.ctime = get_u64(p + 16);
+		cr->meta.ino = get_u64(p + 24);
+		cr->e.meta = &cr->meta;
+		p += 32;
+	}
+	cr->e.artifact = NULL;
+	if (flags & CHECKSUM_HAS_ARTIFACT){
+		for (i = 0; i < artifact_len; ++i){
+			cr->artifact_arena[i * 2] = hexmap[p[1 + i] >> 4];
+			cr->artifact_arena[i * 2 + 1] = hexmap[p[1 + i] & 0x0F];
+		}
+		cr->artifact_arena[artifact_len * 2] = '\0';
+		cr->e.artifact = cr->artifact_arena;
+	}
+
+	cr->cursor += record_len;
+	return 0;
+}
+
+int checksum_reader_next(struct checksum_reader* cr, const struct element** out){
+	int res;
+
+	return_ifnull(cr, -1);
+	return_ifnull(out, -1);
+
+	*out = NULL;
+
+	if (cr->buf_pos + cr->cursor == 0){
+		if ((res = reader_fill(cr, 1)) != 0){
+			return res;
+		}
+		if (cr->buf[0] == (unsigned char)CHECKSUM_MAGIC[0]){
+			if (reader_fill(cr, CHECKSUM_HEADER_LEN) != 0 || memcmp(cr->buf, CHECKSUM_MAGIC, 4) != 0){
+				log_error("Checksum file has a corrupt header");
+				return -1;
+			}
+			if (cr->buf[4] > CHECKSUM_VERSION){
+				log_error_ex("Checksum file version %d is newer than this version of ezbackup supports", cr->buf[4]);
+				return -1;
+			}
+			cr->cursor = CHECKSUM_HEADER_LEN;
+		}
+	}
+
+	if ((res = reader_fill(cr, 1)) != 0){
+		return res;
+	}
+	switch (cr->buf[cr->cursor]){
+	case CHECKSUM_TAG_RECORD:
+		res = reader_next_binary(cr);
+		break;
+	case CHECKSUM_TAG_INDEX:
+		/* the records end where the block index starts */
+		return 1;
+	default:
+		res = reader_next_text(cr);
+		break;
+	}
+	if (res != 0){
+		return -1;
+	}
+	*out = &cr->e;
+	return 0;
+}
+
+void checksum_reader_free(struct checksum_reader* cr){
+	if (!cr){
+		return;
+	}
+	free(cr->buf);
+	free(cr->file_arena);
+	free(cr->sum_arena);
+	free(cr->artifact_arena);
+	free(cr);
+}
+
+struct element* copy_element(const struct element* e){
+	struct element* ret;
+
+	return_ifnull(e, NULL);
+
+	ret = calloc(1, sizeof(*ret));
+	if (!ret ||
+			!(ret->file = sh_dup(e->file)) ||
+			!(ret->checksum = sh_dup(e->checksum)) ||
+			(e->meta && !(ret->meta = malloc(sizeof(*ret->meta)))) ||
+			(e->artifact && !(ret->artifact = sh_dup(e->artifact)))){
+		log_enomem();
+		free_element(ret);
+		return NULL;
+	}
+	if (e->meta){
+		*ret->meta = *e->meta;
+	}
+	return ret;
+}
+
+static void swap(struct element** e1, struct element** e2){
+	struct element* buf = *e1;
+	*e1 = *e2;
+	*e2 = buf;
+}
+
+/* chooses the median of the left element, the right element,
+ * and the middle element.
+ *
+ * this makes choosing a bad pivot much less likely */
+int median_of_three(struct element** elements, int low, int high){
+	int left = low;
+	int mid = (high - low) / 2;
+	int right = high;
+
+	if (high - low < 3){
+		return low;
+	}
+
+	if (compare_elements(elements[left], elements[mid]) > 0){
+		if (compare_elements(elements[mid], elements[right]) > 0){
+			return mid;
+		}
+		else if (compare_elements(elements[right], elements[left]) > 0){
+			return left;
+		}
+		else{
+			return right;
+		}
+	}
+	else{
+		if (compare_elements(elements[mid], elements[right]) < 0){
+			return mid;
+		}
+		else if (compare_elements(elements[right], elements[left]) < 0){
+			return left;
+		}
+		else{
+			return right;
+		}
+	}
+}
+
+/* partitions the array by putting all the elements on the
+ * correct side of the pivot
+ *
+ * pivot must be the high element */
+static int partition(struct element** elements, int low, int high){
+	struct element* pivot = elements[high];
+	int i;
+	int j;
+
+	for (i = low - 1, j = low; j <= high - 1; ++j){
+		if (compare_elements(elements[j], pivot) < 0){
+			i++;
+			swap(&elements[i], &elements[j]);
+		}
+	}
+	swap(&elements[i + 1], &elements[high]);
+	return i + 1;
+}
+
+/* swaps the median of three element with the top element,
+ * so it works with the above function */
+static int partition_m3(struct element** elements, int low, int high){
+	int m3 = median_of_three(elements, low, high);
+	swap(&elements[m3], &elements[high]);
+	return partition(elements, low, high);
+}
+
+/* main quicksort function for sorting the elements */
+void quicksort_elements(struct element** elements, int low, int high){
+	if (low < high){
+		int pivot = partition_m3(elements, low, high);
+		quicksort_elements(elements, low, pivot - 1);
+		quicksort_elements(elements, pivot + 1, high);
+	}
+}
+
+/* the next 8 bytes of a path, kept next to the element so partitioning never has to leave the array */
+struct sort_key{
+	uint64_t key;
+	struct element* e;
+};
+
+/* big-endian, so comparing keys compares bytes in order
+ * the bytes past the terminator are 0, which sorts shorter paths first like strcmp() */
+static uint64_t load_key(const struct element* e, size_t depth){
+	const unsigned char* p = (const unsigned char*)e->file + depth;
+	uint64_t key = 0;
+	int i;
+
+	for (i = 0; i < 8; ++i){
+		key <<= 8;
+		if (*p){
+			key |= *p++;
+		}
+	}
+	return key;
+}
+
+/* the path ends in this key, so keys that are equal belong to equal paths */
+#define KEY_ENDS(key) (((key) & 0xFF) == 0)
+
+static int compare_keys(const struct sort_key* k1, const struct sort_key* k2, size_t depth){
+	if (k1->key != k2->key){
+		return k1->key < k2->key ? -1 : 1;
+	}
+	if (KEY_ENDS(k1->key)){
+		return 0;
+	}
+	return strcmp(k1->e->file + depth + 8, k2->e->file + depth + 8);
+}
+
+static void swap_keys(struct sort_key* k1, struct sort_key* k2){
+	struct sort_key tmp = *k1;
+	*k1 = *k2;
+	*k2 = tmp;
+}
+
+/* for the small partitions, where the overhead of partitioning is not worth it */
+static void insertion_sort_keys(struct sort_key* keys, size_t n, size_t depth){
+	size_t i;
+	size_t j;
+
+	for (i = 1; i < n; ++i){
+		struct sort_key k = keys[i];
+
+		for (j = i; j > 0 && compare_keys(&keys[j - 1], &k, depth) > 0; --j){
+			keys[j] = keys[j - 1];
+		}
+		keys[j] = k;
+	}
+}
+
+static size_t median_of_three_keys(const struct sort_key* keys, size_t n){
+	uint64_t a = keys[0].key;
+	uint64_t b = keys[n / 2].key;
+	uint64_t c = keys[n - 1].key;
+
+	if ((a <= b && b <= c) || (c <= b && b <= a)){
+		return n / 2;
+	}
+	if ((b <= a && a <= c) || (c <= a && a <= b)){
+		return 0;
+	}
+	return n - 1;
+}
+
+/* every path already shares its first depth bytes, and every key holds the 8 after that */
+static void multikey_sort(struct sort_key* keys, size_t n, size_t depth){
+	while (n > MULTIKEY_INSERTION_LEN){
+		size_t lt = 0;
+		size_t i = 0;
+		size_t gt = n;
+		uint64_t pivot;
+
+		swap_keys(&keys[0], &keys[median_of_three_keys(keys, n)]);
+		pivot = keys[0].key;
+
+		/* [0, lt) is below the pivot, [lt, i) equals it, and [gt, n) is above it */
+		while (i < gt){
+			if (keys[i].key < pivot){
+				swap_keys(&keys[lt++], &keys[i++]);
+			}
+			else if (keys[i].key > pivot){
+				swap_keys(&keys[i], &keys[--gt]);
+			}
+			else{
+				++i;
+			}
+		}
+
+		multikey_sort(keys, lt, depth);
+		multikey_sort(keys + gt, n - gt, depth);
+
+		if (KEY_ENDS(pivot)){
+			return;
+		}
+		/* the bytes that matched are never looked at again */
+		keys += lt;
+		n = gt - lt;
+		depth += 8;
+		for (i = 0; i < n; ++i){
+			keys[i].key = load_key(keys[i].e, depth);
+		}
+	}
+	insertion_sort_keys(keys, n, depth);
+}
+
+void multikey_sort_elements(struct element** elements, size_t n){
+	struct sort_key* keys;
+	size_t i;
+
+	if (!elements || n < 2){
+		return;
+	}
+
+	keys = malloc(n * sizeof(*keys));
+	if (!keys){
+		log_warning("Not enough memory for a multikey sort. Falling back to quicksort.");
+		quicksort_elements(elements, 0, (int)n - 1);
+		return;
+	}
+	for (i = 0; i < n; ++i){
+		keys[i].e = elements[i];
+		keys[i].key = load_key(elements[i], 0);
+	}
+	multikey_sort(keys, n, 0);
+	for (i = 0; i < n; ++i){
+		elements[i] = keys[i].e;
+	}
+	free(keys);
+}
+
+/* merges src[lo, mid) and src[mid, hi), which are each sorted, into dst[lo, hi) */
+static void merge_ascending(struct element* const* src, struct element** dst, size_t lo, size_t mid, size_t hi){
+	size_t i = lo;
+	size_t j = mid;
+	size_t k = lo;
+
+	/* runs that are already in order only cost one comparison */
+	if (strcmp(src[mid - 1]->file, src[mid]->file) <= 0){
+		memcpy(dst + lo, src + lo, (hi - lo) * sizeof(*dst));
+		return;
+	}
+	while (i < mid && j < hi){
+		/* ties go to the left run, so equal paths keep their order */
+		dst[k++] = strcmp(src[j]->file, src[i]->file) < 0 ? src[j++] : src[i++];
+	}
+	memcpy(dst + k, src + i, (mid - i) * sizeof(*dst));
+	k += mid - i;
+	memcpy(dst + k, src + j, (hi - j) * sizeof(*dst));
+}
+
+/* merges the ascending runs that start at every bounds[i] pairwise until one is left
+ * returns 0 on success, or negative if there is not enough memory */
+static int natural_merge(struct element** elements, size_t n, size_t* bounds, size_t n_runs){
+	struct element** buf;
+	struct element** src = elements;
+	struct element** dst;
+
+	buf = malloc(n * sizeof(*buf));
+	if (!buf){
+		return -1;
+	}
+	dst = buf;
+
+	bounds[n_runs] = n;
+	while (n_runs > 1){
+		size_t i;
+		size_t n_merged = 0;
+
+		for (i = 0; i + 1 < n_runs; i += 2){
+			merge_ascending(src, dst, bounds[i], bounds[i + 1], bounds[i + 2]);
+			bounds[n_merged++] = bounds[i];
+		}
+		/* an odd run out waits for the next pass */
+		if (i < n_runs){
+			memcpy(dst + bounds[i], src + bounds[i], (n - bounds[i]) * sizeof(*dst));
+			bounds[n_merged++] = bounds[i];
+		}
+		bounds[n_merged] = n;
+		n_runs = n_merged;
+
+		dst = src;
+		src = src == elements ? buf : elements;
+	}
+
+	if (src != elements){
+		memcpy(elements, src, n * sizeof(*elements));
+	}
+	free(buf);
+	return 0;
+}
+
+void adaptive_sort_elements(struct element** elements, size_t n){
+	size_t max_runs;
+	size_t* bounds = NULL;
+	size_t n_runs = 1;
+	size_t i;
+
+	if (!elements || n < 2){
+		return;
+	}
+
+	/* only worth it if the runs that are already there are long on average */
+	max_runs = n / CHECKSUM_NATURAL_RUN_LEN + 1;
+	bounds = malloc((max_runs + 1) * sizeof(*bounds));
+	if (!bounds){
+		multikey_sort_elements(elements, n);
+		return;
+	}
+	bounds[0] = 0;
+	for (i = 1; i < n && n_runs <= max_runs; ++i){
+		if (strcmp(elements[i - 1]->file, elements[i]->file) > 0){
+			if (n_runs == max_runs){
+				n_runs++;
+				break;
+			}
+			bounds[n_runs++] = i;
+		}
+	}
+
+	if (n_runs > max_runs || natural_merge(elements, n, bounds, n_runs) != 0){
+		multikey_sort_elements(elements, n);
+	}
+	free(bounds);
+}
+
+void free_element_array(struct element** elements, size_t size){
+	size_t i;
+	for (i = 0; i < size; ++i){
+		free_element(elements[i]);
+	}
+	free(elements);
+}
+
+void free_strarray(char** elements, size_t size){
+	size_t i;
+	for (i = 0; i < size; ++i){
+		free(elements[i]);
+	}
+	free(elements);
+}
+
+/* you know this is going to be good when there's a triple pointer */
+
+/* one run's records, parsed into a single block of memory that is reused for every run */
+struct run_arena{
+	/* every path, checksum and artifact checksum back to back */
+	char* data;
+	size_t data_len;
+	size_t data_size;
+	/* the records, whose strings are offsets into data until the run is complete */
+	struct run_record{
+		struct element e;
+		struct file_meta meta;
+		size_t file;
+		size_t checksum;
+		/* only used if e.artifact is not NULL */
+		size_t artifact;
+	}* records;
+	size_t n_records;
+	size_t records_size;
+	/* what gets sorted */
+	struct element** elems;
+	size_t elems_size;
+};
+
+/* makes sure a geometrically growing array can hold n elements of size len */
+static int arena_grow(void** arr, size_t* size, size_t n, size_t len){
+	size_t new_size = *size ? *size : 64;
+	void* tmp;
+
+	if (n <= *size){
+		return 0;
+	}
+	while (new_size < n){
+		new_size *= 2;
+	}
+	tmp = realloc(*arr, new_size * len);
+	if (!tmp){
+		log_enomem();
+		return -1;
+	}
+	*arr = tmp;
+	*size = new_size;
+	return 0;
+}
+
+static int run_arena_add(struct run_arena* ra, const struct element* e){
+	size_t len_file = strlen(e->file) + 1;
+	size_t len_checksum = strlen(e->checksum) + 1;
+	size_t len_artifact = e->artifact ? strlen(e->artifact) + 1 : 0;
+	struct run_record* rec;
+
+	if (arena_grow((void**)&ra->data, &ra->data_size, ra->data_len + len_file + len_checksum + len_artifact, 1) != 0 ||
+			arena_grow((void**)&ra->records, &ra->records_size, ra->n_records + 1, sizeof(*ra->records)) != 0){
+		return -1;
+	}
+
+	rec = &ra->records[ra->n_records++];
+	rec->file = ra->data_len;
+	memcpy(ra->data + ra->data_len, e->file, len_file);
+	ra->data_len += len_file;
+	rec->checksum = ra->data_len;
+	memcpy(ra->data + ra->data_len, e->checksum, len_checksum);
+	ra->data_len += len_checksum;
+	rec->e.meta = NULL;
+	if (e->meta){
+		rec->meta = *e->meta;
+		rec->e.meta = &rec->meta;
+	}
+	/* any non-NULL pointer, until run_arena_finish() points it at the string */
+	rec->e.artifact = NULL;
+	if (e->artifact){
+		rec->artifact = ra->data_len;
+		memcpy(ra->data + ra->data_len, e->artifact, len_artifact);
+		ra->data_len += len_artifact;
+		rec->e.artifact = ra->data;
+	}
+	return 0;
+}
+
+/* what a run takes up once it is sorted, counting the keys multikey_sort_elements() adds */
+static uint64_t run_arena_memory(const struct run_arena* ra){
+	return ra->data_len + (uint64_t)ra->n_records * (sizeof(*ra->records) + sizeof(*ra->elems) + sizeof(struct sort_key));
+}
+
+/* points every record into the arena, which no longer moves */
+static int run_arena_finish(struct run_arena* ra){
+	size_t i;
+
+	if (arena_grow((void**)&ra->elems, &ra->elems_size, ra->n_records, sizeof(*ra->elems)) != 0){
+		return -1;
+	}
+	for (i = 0; i < ra->n_records; ++i){
+		struct run_record* rec = &ra->records[i];
+
+		rec->e.file = ra->data + rec->file;
+		rec->e.checksum = ra->data + rec->checksum;
+		if (rec->e.meta){
+			rec->e.meta = &rec->meta;
+		}
+		if (rec->e.artifact){
+			rec->e.artifact = ra->data + rec->artifact;
+		}
+		ra->elems[i] = &rec->e;
+	}
+	return 0;
+}
+
+/* a run is closed once it is written, so thousands of them do not use up the file descriptors */
+static FILE* open_run(struct TMPFILE* tfp){
+	if (!tfp->fp && !(tfp->fp = fopen(tfp->name, "rb"))){
+		log_efopen(tfp->name);
+		return NULL;
+	}
+	rewind(tfp->fp);
+	return tfp->fp;
+}
+
+static int close_run(struct TMPFILE* tfp){
+	int ret = 0;
+
+	if (tfp->fp && fclose(tfp->fp) != 0){
+		log_efclose(tfp->name);
+		ret = -1;
+	}
+	tfp->fp = NULL;
+	return ret;
+}
+
+/* a loser tree picks the smallest of k elements with one comparison per level,
+ * against the element that lost there last time, instead of two per level like a heap
+ *
+ * tree[0] is the winner, and tree[1..k) hold the loser of each match
+ * leaf i plays its first match at node (i + k) / 2, and k stands for an element that beats everything while the tree is built */
+static int loser_tree_beats(const struct element* const* cur, size_t k, size_t a, size_t b){
+	int res;
+
+	if (a == k){
+		return 1;
+	}
+	if (b == k){
+		return 0;
+	}
+	res = compare_elements((struct element*)cur[a], (struct element*)cur[b]);
+	/* equal paths come out in the order of their runs */
+	return res < 0 || (res == 0 && a < b);
+}
+
+/* plays leaf i's element against every loser on the way to the root */
+static void loser_tree_replay(size_t* tree, const struct element* const* cur, size_t k, size_t i){
+	size_t winner = i;
+	size_t node;
+
+	for (node = (i + k) / 2; node > 0; node /= 2){
+		if (loser_tree_beats(cur, k, tree[node], winner)){
+			size_t tmp = tree[node];
+
+			tree[node] = winner;
+			winner = tmp;
+		}
+	}
+	tree[0] = winner;
+}
+
+/* 64-bit FNV-1a, which is all the Bloom filter needs */
+static uint64_t key_hash(const char* key){
+	uint64_t h = U64(0xcbf29ce4, 0x84222325);
+
+	for (; *key; ++key){
+		h ^= (unsigned char)*key;
+		h *= U64(0x00000100, 0x000001b3);
+	}
+	return h;
+}
+
+/* the bits are picked by double hashing, so the key is only hashed once */
+#define BLOOM_BIT(h, i, n_bits) ((((uint32_t)(h)) + (i) * (((uint32_t)((h) >> 32)) | 1)) % (n_bits))
+
+static size_t bloom_len(size_t n_keys){
+	size_t len = (n_keys * CHECKSUM_BLOOM_BITS_PER_KEY + 7) / 8;
+	return len ? len : 1;
+}
+
+/* writes the offset of the first record in every block, the first path in every block, a Bloom filter of every path, then the footer that points to them */
+static int write_index(FILE* fp, const uint64_t* offsets, char* const* keys, size_t n_offsets, const uint64_t* hashes, size_t n_hashes){
+	unsigned char buf[CHECKSUM_FOOTER_LEN];
+	unsigned char* bloom = NULL;
+	size_t n_bytes = bloom_len(n_hashes);
+	long index_pos = ftell(fp);
+	size_t i;
+
+	if (index_pos < 0){
+		log_error_ex("Failed to determine position in checksum file (%s)", strerror(errno));
+		return -1;
+	}
+
+	bloom = calloc(1, n_bytes);
+	if (!bloom){
+		log_enomem();
+		return -1;
+	}
+	for (i = 0; i < n_hashes; ++i){
+		uint32_t k;
+
+		for (k = 0; k < CHECKSUM_BLOOM_HASHES; ++k){
+			uint32_t bit = BLOOM_BIT(hashes[i], k, n_bytes * 8);
+			bloom[bit / 8] |= 1 << (bit % 8);
+		}
+	}
+
+	buf[0] = CHECKSUM_TAG_INDEX;
+	put_u32(buf + 1, n_offsets);
+	fwrite(buf, 1, 5, fp);
+	for (i = 0; i < n_offsets; ++i){
+		put_u64(buf, offsets[i]);
+		fwrite(buf, 1, 8, fp);
+	}
+
+	buf[0] = CHECKSUM_TAG_KEYS;
+	put_u32(buf + 1, n_offsets);
+	fwrite(buf, 1, 5, fp);
+	for (i = 0; i < n_offsets; ++i){
+		/* write_element_to_file() already refused anything longer */
+		size_t len = strlen(keys[i]);
+
+		put_u16(buf, len);
+		fwrite(buf, 1, 2, fp);
+		fwrite(keys[i], 1, len, fp);
+	}
+
+	buf[0] = CHECKSUM_TAG_BLOOM;
+	put_u32(buf + 1, n_bytes);
+	buf[5] = CHECKSUM_BLOOM_HASHES;
+	fwrite(buf, 1, 6, fp);
+	fwrite(bloom, 1, n_bytes, fp);
+	free(bloom);
+
+	put_u64(buf, index_pos);
+	memcpy(buf + 8, CHECKSUM_INDEX_MAGIC, 4);
+	fwrite(buf, 1, CHECKSUM_FOOTER_LEN, fp);
+
+	if (ferror(fp)){
+		log_efwrite("checksum file");
+		return -1;
+	}
+	return 0;
+}
+
+static size_t max_fan_in = CHECKSUM_MAX_FAN_IN;
+
+void checksum_set_max_fan_in(size_t fan_in){
+	if (fan_in == 0){
+		fan_in = CHECKSUM_MAX_FAN_IN;
+	}
+	max_fan_in = fan_in < 2 ? 2 : fan_in;
+}
+
+size_t checksum_merge_fan_in(void){
+	struct rlimit rl;
+	/* every run needs a file descriptor, and the rest of the backup needs some too */
+	size_t needed = max_fan_in + CHECKSUM_RESERVED_FDS;
+	size_t fan_in = max_fan_in;
+
+	/* every run needs at least the smallest read-ahead buffer */
+	if (fan_in > CHECKSUM_MERGE_MEMORY / CHECKSUM_READER_BUFFER_LEN){
+		fan_in = CHECKSUM_MERGE_MEMORY / CHECKSUM_READER_BUFFER_LEN;
+	}
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) != 0){
+		log_warning_ex("Failed to get the file descriptor limit (%s)", strerror(errno));
+		return fan_in;
+	}
+	/* raise the soft limit only as far as the merge needs */
+	if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < needed && rl.rlim_cur < rl.rlim_max){
+		struct rlimit raised = rl;
+
+		raised.rlim_cur = rl.rlim_max == RLIM_INFINITY || rl.rlim_max > needed ? needed : rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &raised) == 0){
+			rl = raised;
+		}
+		else{
+			log_debug_ex("Failed to raise the file descriptor limit (%s)", strerror(errno));
+		}
+	}
+	if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < needed){
+		fan_in = rl.rlim_cur > CHECKSUM_RESERVED_FDS + 2 ? rl.rlim_cur - CHECKSUM_RESERVED_FDS : 2;
+	}
+	return fan_in < 2 ? 2 : fan_in;
+}
+
+/* writes the records of a sorted checksum file, and keeps track of what its index needs
+ * intermediate runs skip the index, since they are only read back in order */
+struct sorted_writer{
+	FILE* fp;
+	int final;
+	int front_code;
+	/* where the header is, whose version goes up if any record has an artifact checksum */
+	long header_pos;
+	int artifacts;
+	/* the last path written, which the next one is front-coded against */
+	char* prev;
+	size_t prev_size;
+	size_t n_records;
+	uint64_t* offsets;
+	char** keys;
+	size_t offsets_len;
+	size_t offsets_size;
+	uint64_t* hashes;
+	size_t hashes_len;
+	size_t hashes_size;
+	long block_start;
+};
+
+static int sorted_writer_begin(struct sorted_writer* sw, FILE* fp, int final, int front_code){
+	memset(sw, 0, sizeof(*sw));
+	sw->fp = fp;
+	sw->final = final;
+	sw->front_code = front_code;
+	sw->header_pos = ftell(fp);
+	return write_header(fp, front_code ? CHECKSUM_VERSION_FRONT : CHECKSUM_VERSION_PLAIN);
+}
+
+/* how many bytes two paths start with in common */
+static size_t shared_prefix(const char* s1, const char* s2){
+	size_t i;
+
+	for (i = 0; s1[i] && s1[i] == s2[i]; ++i);
+	return i;
+}
+
+/* fills in the index for a record of the final file
+ * returns 1 if the record starts a block, 0 if not, or negative on error */
+static int sorted_writer_index(struct sorted_writer* sw, const struct element* e){
+	int ret = 0;
+	long pos;
+
+	/* a new block starts at the first record past the end of the last one */
+	pos = ftell(sw->fp);
+	if (sw->offsets_len == 0 || pos - sw->block_start >= CHECKSUM_BLOCK_LEN){
+		if (sw->offsets_len == sw->offsets_size){
+			uint64_t* tmp;
+			char** tmp_keys;
+
+			sw->offsets_size = sw->offsets_size ? sw->offsets_size * 2 : 64;
+			tmp = realloc(sw->offsets, sw->offsets_size * sizeof(*sw->offsets));
+			if (!tmp){
+				log_enomem();
+				return -1;
+			}
+			sw->offsets = tmp;
+			tmp_keys = realloc(sw->keys, sw->offsets_size * sizeof(*sw->keys));
+			if (!tmp_keys){
+				log_enomem();
+				return -1;
+			}
+			sw->keys = tmp_keys;
+		}
+		if (!(sw->keys[sw->offsets_len] = sh_dup(e->file))){
+			log_enomem();
+			return -1;
+		}
+		sw->offsets[sw->offsets_len++] = pos;
+		sw->block_start = pos;
+		ret = 1;
+	}
+	if (sw->hashes_len == sw->hashes_size){
+		uint64_t* tmp;
+
+		sw->hashes_size = sw->hashes_size ? sw->hashes_size * 2 : 1024;
+		tmp = realloc(sw->hashes, sw->hashes_size * sizeof(*sw->hashes));
+		if (!tmp){
+			log_enomem();
+			return -1;
+		}
+		sw->hashes = tmp;
+	}
+	sw->hashes[sw->hashes_len++] = key_hash(e->file);
+	return ret;
+}
+
+static int sorted_writer_add(struct sorted_writer* sw, const struct element* e){
+	/* every block starts with a whole path, so a lookup can start reading at any of them */
+	int restart = sw->n_records == 0;
+	size_t shared = 0;
+
+	if (sw->final){
+		int res = sorted_writer_index(sw, e);
+
+		if (res < 0){
+			return -1;
+		}
+		restart = restart || res > 0;
+	}
+
+	if (sw->front_code){
+		size_t len = strlen(e->file);
+
+		if (!restart){
+			shared = shared_prefix(sw->prev, e->file);
+			/* the length of the shared part takes 2 bytes of its own */
+			shared = shared > 2 ? shared : 0;
+		}
+		if (arena_reserve(&sw->prev, &sw->prev_size, len + 1) != 0){
+			return -1;
+		}
+		memcpy(sw->prev + shared, e->file + shared, len + 1 - shared);
+	}
+	sw->n_records++;
+	sw->artifacts = sw->artifacts || e->artifact;
+	return write_record(sw->fp, e, shared);
+}
+
+static int sorted_writer_end(struct sorted_writer* sw){
+	long end;
+
+	if (sw->final && write_index(sw->fp, sw->offsets, sw->keys, sw->offsets_len, sw->hashes, sw->hashes_len) != 0){
+		return -1;
+	}
+	/* whether there are any is only known now, and older versions that cannot read them have to refuse the file */
+	if (sw->artifacts){
+		if ((end = ftell(sw->fp)) < 0 || fseek(sw->fp, sw->header_pos + 4, SEEK_SET) != 0 ||
+				fputc(CHECKSUM_VERSION, sw->fp) == EOF || fseek(sw->fp, end, SEEK_SET) != 0){
+			log_efwrite("checksum file");
+			return -1;
+		}
+	}
+	if (fflush(sw->fp) != 0){
+		log_warning("Failed to flush checksum file buffer. Data corruption possible.");
+	}
+	return 0;
+}
+
+static void sorted_writer_free(struct sorted_writer* sw){
+	free(sw->prev);
+	free(sw->offsets);
+	free_strarray(sw->keys, sw->offsets_len);
+	free(sw->hashes);
+}
+
+/* a run that is sorted and written on a worker thread while the next one is read */
+struct run_job{
+	struct run_arena ra;
+	struct TMPFILE* tfp;
+	int ret;
+};
+
+static void sort_run(void* arg){
+	struct run_job* job = arg;
+	struct sorted_writer sw;
+	size_t i;
+
+	job->ret = -1;
+	memset(&sw, 0, sizeof(sw));
+	if (run_arena_finish(&job->ra) != 0){
+		goto cleanup;
+	}
+	/* sort elements */
+	adaptive_sort_elements(job->ra.elems, job->ra.n_records);
+	/* write them to the file, front-coded since only the merge reads them */
+	if (sorted_writer_begin(&sw, job->tfp->fp, 0, 1) != 0){
+		goto cleanup;
+	}
+	for (i = 0; i < job->ra.n_records; ++i){
+		if (sorted_writer_add(&sw, job->ra.elems[i]) != 0){
+			log_debug("Failed to write element to file");
+			goto cleanup;
+		}
+	}
+	/* the merge reopens it, so every run does not keep a file descriptor until then */
+	if (sorted_writer_end(&sw) != 0 || close_run(job->tfp) != 0){
+		goto cleanup;
+	}
+	job->ret = 0;
+
+cleanup:
+	sorted_writer_free(&sw);
+}
+
+/* reads as many elements into ram as the memory budget allows,
+ * sorts them, and writes them to one or more files */
+int create_initial_runs(FILE* fp_in, uint64_t memory, struct TMPFILE*** out, size_t* n_files){
+	struct run_job* jobs = NULL;
+	size_t n_jobs;
+	size_t job = 0;
+	struct threadpool* tp = NULL;
+	struct checksum_reader* cr = NULL;
+	const struct element* tmp = NULL;
+	uint64_t run_size;
+	int end_of_file = 0;
+	int res = 0;
+	int ret = 0;
+	size_t i;
+
+	/* check null arguments */
+	return_ifnull(fp_in, -1);
+	return_ifnull(out, -1);
+	return_ifnull(n_files, -1);
+
+	if (!file_opened_for_reading(fp_in)){
+		log_emode();
+		return -1;
+	}
+	rewind(fp_in);
+
+	*out = NULL;
+	*n_files = 0;
+
+	/* every job holds a whole run in memory, so there are only ever a few of them */
+	n_jobs = tp_cpu_count();
+	if (n_jobs > CHECKSUM_SORT_THREADS){
+		n_jobs = CHECKSUM_SORT_THREADS;
+	}
+	jobs = calloc(n_jobs, sizeof(*jobs));
+	if (!jobs){
+		log_enomem();
+		return -1;
+	}
+	/* every run in flight gets an equal share of the budget */
+	run_size = memory / n_jobs;
+	if (n_jobs > 1 && !(tp = tp_new(n_jobs, n_jobs))){
+		log_warning("Failed to start sorting threads. Sorting on this thread instead.");
+	}
+
+	if (!(cr = checksum_reader_new(fp_in, 0))){
+		log_error("Failed to start reading checksum file");
+		ret = -1;
+		goto cleanup;
+	}
+
+	while (!end_of_file){
+		struct TMPFILE* tfp;
+		struct run_arena* ra = &jobs[job].ra;
+
+		/* make a new temp file */
+		(*n_files)++;
+		/* make space for new string */
+		*out = realloc(*out, sizeof(**out) * *n_files);
+		if (!(*out)){
+			log_enomem();
+			ret = -1;
+			goto cleanup;
+		}
+		if ((tfp = temp_fopen()) == NULL){
+			log_error("Failed to create temporary merge file");
+			(*n_files)--;
+			*out = realloc(*out, *n_files * sizeof(**out));
+			ret = -1;
+			goto cleanup;
+		}
+		(*out)[*n_files - 1] = tfp;
+
+		/* the job's last run is already written, so its arena can be reused */
+		ra->data_len = 0;
+		ra->n_records = 0;
+		/* read enough elements to fill this run's share of the budget */
+		/* TODO: this reads one element above the budget
+		 * make it not do that */
+		while (run_arena_memory(ra) < run_size &&
+				(res = checksum_reader_next(cr, &tmp)) == 0){
+			if (run_arena_add(ra, tmp) != 0){
+				ret = -1;
+				goto cleanup;
+			}
+		}
+		if (res < 0){
+			log_error("Failed to read checksum file");
+			ret = -1;
+			goto cleanup;
+		}
+		/* if we didn't read any elements */
+		if (!ra->n_records){
+			/* we're at the end of the file */
+			temp_fclose(tfp);
+			(*n_files)--;
+			*out = realloc(*out, *n_files * sizeof(**out));
+			if ((*n_files) > 0 && !(*out)){
+				log_enomem();
+				ret = -1;
+				goto cleanup;
+			}
+			end_of_file = 1;
+			continue;
+		}
+
+		/* the next run is read while this one is sorted */
+		jobs[job].tfp = tfp;
+		if (!tp || tp_submit(tp, sort_run, &jobs[job]) != 0){
+			sort_run(&jobs[job]);
+		}
+		if (res > 0){
+			end_of_file = 1;
+		}
+
+		/* every job is busy, so wait for all of them before reusing one */
+		if (++job == n_jobs){
+			tp ? tp_wait(tp) : 0;
+			for (i = 0; i < n_jobs; ++i){
+				if (jobs[i].ret != 0){
+					ret = -1;
+					goto cleanup;
+				}
+			}
+			job = 0;
+		}
+	}
+
+cleanup:
+	/* waits for the jobs that are still running */
+	tp_free(tp);
+	for (i = 0; i < n_jobs; ++i){
+		if (jobs[i].ret != 0){
+			log_error("Failed to sort a checksum run");
+			ret = -1;
+		}
+		free(jobs[i].ra.data);
+		free(jobs[i].ra.records);
+		free(jobs[i].ra.elems);
+	}
+	free(jobs);
+	checksum_reader_free(cr);
+	return ret;
+}
+
+/* merges up to the fan-in's worth of runs into either another run, or the final sorted file with its header and index */
+static int merge_pass(struct TMPFILE** in, size_t n_files, FILE* fp_out, int final, int front_code){
+	struct checksum_reader** readers = NULL;
+	const struct element** cur = NULL;
+	size_t* tree = NULL;
+	struct sorted_writer sw;
+	size_t buffer_len;
+	size_t count = 0;
+	size_t i;
+	int ret = 0;
+
+	if (sorted_writer_begin(&sw, fp_out, final, front_code) != 0){
+		return -1;
+	}
+
+	/* make space for the readers and the loser tree */
+	readers = calloc(n_files, sizeof(*readers));
+	cur = calloc(n_files, sizeof(*cur));
+	tree = malloc((n_files + 1) * sizeof(*tree));
+	if (n_files > 0 && (!readers || !cur || !tree)){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+
+	/* every run is read from in turn, so each gets a big buffer to keep the disk reading long stretches */
+	buffer_len = n_files > 0 ? CHECKSUM_MERGE_MEMORY / n_files : 0;
+	buffer_len = buffer_len > CHECKSUM_MERGE_BUFFER_LEN ? CHECKSUM_MERGE_BUFFER_LEN : buffer_len;
+	buffer_len = buffer_len < CHECKSUM_READER_BUFFER_LEN ? CHECKSUM_READER_BUFFER_LEN : buffer_len;
+
+	/* get the first element from each file
+	 * the tree only holds each reader's current element, so nothing is copied */
+	for (i = 0; i < n_files; ++i){
+		if (!open_run(in[i]) || !(readers[i] = checksum_reader_new(in[i]->fp, buffer_len)) || checksum_reader_next(readers[i], &cur[i]) < 0){
+			ret = -1;
+			goto cleanup;
+		}
+		if (!cur[i]){
+			count++;
+		}
+	}
+	/* build the tree */
+	for (i = 1; i < n_files; ++i){
+		tree[i] = n_files;
+	}
+	for (i = n_files; i > 0; --i){
+		loser_tree_replay(tree, cur, n_files, i - 1);
+	}
+
+	/* while the counter is less than the number of files */
+	/* counter tracks which files are empty */
+	while (count < n_files){
+		/* write the winner (smallest) to file */
+		if (sorted_writer_add(&sw, cur[tree[0]]) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+
+		/* replace the winner with the next from that file */
+		if (checksum_reader_next(readers[tree[0]], &cur[tree[0]]) < 0){
+			ret = -1;
+			goto cleanup;
+		}
+		/* if file is empty */
+		if (!cur[tree[0]]){
+			/* raise the counter */
+			count++;
+		}
+		loser_tree_replay(tree, cur, n_files, tree[0]);
+	}
+
+	ret = sorted_writer_end(&sw);
+
+cleanup:
+	for (i = 0; readers && i < n_files; ++i){
+		checksum_reader_free(readers[i]);
+		close_run(in[i]);
+	}
+	free(readers);
+	free(cur);
+	free(tree);
+	sorted_writer_free(&sw);
+	return ret;
+}
+
+/* merges the initial runs into one big file */
+int merge_files(struct TMPFILE** in, size_t n_files, FILE* fp_out, int front_code){
+	struct TMPFILE** runs = in;
+	size_t n_runs = n_files;
+	struct TMPFILE** next = NULL;
+	size_t n_next = 0;
+	size_t fan_in;
+	size_t i;
+	size_t j;
+	int ret = 0;
+
+	/* verify that arguments are not null */
+	return_ifnull(in, -1);
+	return_ifnull(fp_out, -1);
+
+	if (!file_opened_for_writing(fp_out)){
+		log_emode();
+		return -1;
+	}
+	if (ftell(fp_out) != 0){
+		log_error("The sorted checksum file has to start out empty");
+		return -1;
+	}
+
+	/* too many runs to read at once are merged a group at a time into fewer, longer runs */
+	fan_in = checksum_merge_fan_in();
+	while (n_runs > fan_in){
+		n_next = (n_runs + fan_in - 1) / fan_in;
+		log_info_ex2("Merging %lu checksum runs into %lu", (unsigned long)n_runs, (unsigned long)n_next);
+
+		next = calloc(n_next, sizeof(*next));
+		if (!next){
+			log_enomem();
+			ret = -1;
+			goto cleanup;
+		}
+		for (i = 0; i < n_next; ++i){
+			size_t first = i * fan_in;
+			size_t n = n_runs - first < fan_in ? n_runs - first : fan_in;
+
+			if (!(next[i] = temp_fopen())){
+				log_error("Failed to create temporary merge file");
+				ret = -1;
+				goto cleanup;
+			}
+			if (merge_pass(runs + first, n, next[i]->fp, 0, 1) != 0 || close_run(next[i]) != 0){
+				ret = -1;
+				goto cleanup;
+			}
+			/* the runs of the last pass are not needed anymore, but the caller's runs are the caller's to free */
+			for (j = 0; runs != in && j < n; ++j){
+				temp_fclose(runs[first + j]);
+				runs[first + j] = NULL;
+			}
+		}
+
+		if (runs != in){
+			free(runs);
+		}
+		runs = next;
+		n_runs = n_next;
+		next = NULL;
+		n_next = 0;
+	}
+
+	ret = merge_pass(runs, n_runs, fp_out, 1, front_code);
+
+cleanup:
+	for (i = 0; next && i < n_next; ++i){
+		next[i] ? temp_fclose(next[i]) : (void)0;
+	}
+	free(next);
+	for (i = 0; runs != in && i < n_runs; ++i){
+		runs[i] ? temp_fclose(runs[i]) : (void)0;
+	}
+	if (runs != in){
+		free(runs);
+	}
+	return ret;
+}
+
+/* the memory limit of the cgroup this process is in, or 0 if it has none */
+static uint64_t cgroup_memory_limit(void){
+	/* cgroup v2, then v1 */
+	const char* const files[] = {
+		"/sys/fs/cgroup/memory.max",
+		"/sys/fs/cgroup/memory/memory.limit_in_bytes"
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof(files) / sizeof(files[0]); ++i){
+		unsigned long limit;
+		FILE* fp = fopen(files[i], "r");
+		int res;
+
+		if (!fp){
+			continue;
+		}
+		/* "max" means there is no limit */
+		res = fscanf(fp, "%lu", &limit);
+		fclose(fp);
+		if (res == 1){
+			return limit;
+		}
+	}
+	return 0;
+}
+
+uint64_t checksum_sort_memory(uint64_t requested){
+	long pages = sysconf(_SC_PHYS_PAGES);
+	long page_size = sysconf(_SC_PAGESIZE);
+	uint64_t limit = 0;
+	uint64_t cgroup_limit;
+	uint64_t ret;
+
+	if (requested > 0){
+		return requested;
+	}
+
+	if (pages > 0 && page_size > 0){
+		limit = (uint64_t)pages * page_size;
+	}
+	/* v1 reports no limit as a number bigger than the ram */
+	cgroup_limit = cgroup_memory_limit();
+	if (cgroup_limit > 0 && (limit == 0 || cgroup_limit < limit)){
+		limit = cgroup_limit;
+	}
+
+	ret = limit / CHECKSUM_SORT_MEMORY_FRACTION;
+	if (ret < CHECKSUM_SORT_MIN_MEMORY){
+		ret = CHECKSUM_SORT_MIN_MEMORY;
+	}
+	log_debug_ex("Sorting checksum files with %lu MiB of memory", (unsigned long)(ret >> 20));
+	return ret;
+}
+
+int sort_in_memory(FILE* fp_in, FILE* fp_out, int front_code){
+	struct run_arena ra;
+	struct checksum_reader* cr = NULL;
+	struct sorted_writer sw;
+	const struct element* e;
+	size_t i;
+	int res;
+	int ret = 0;
+
+	return_ifnull(fp_in, -1);
+	return_ifnull(fp_out, -1);
+
+	if (!file_opened_for_reading(fp_in) || !file_opened_for_writing(fp_out)){
+		log_emode();
+		return -1;
+	}
+	if (ftell(fp_out) != 0){
+		log_error("The sorted checksum file has to start out empty");
+		return -1;
+	}
+	rewind(fp_in);
+
+	memset(&ra, 0, sizeof(ra));
+	memset(&sw, 0, sizeof(sw));
+
+	if (!(cr = checksum_reader_new(fp_in, 0))){
+		log_error("Failed to start reading checksum file");
+		ret = -1;
+		goto cleanup;
+	}
+	while ((res = checksum_reader_next(cr, &e)) == 0){
+		if (run_arena_add(&ra, e) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+	}
+	if (res < 0){
+		log_error("Failed to read checksum file");
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (run_arena_finish(&ra) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+	adaptive_sort_elements(ra.elems, ra.n_records);
+
+	if (sorted_writer_begin(&sw, fp_out, 1, front_code) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+	for (i = 0; i < ra.n_records; ++i){
+		if (sorted_writer_add(&sw, ra.elems[i]) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+	}
+	ret = sorted_writer_end(&sw);
+
+cleanup:
+	sorted_writer_free(&sw);
+	checksum_reader_free(cr);
+	free(ra.data);
+	free(ra.records);
+	free(ra.elems);
+	return ret;
+}
+
+int copy_sorted(FILE* fp_in, FILE* fp_out, int front_code){
+	struct checksum_reader* cr = NULL;
+	struct sorted_writer sw;
+	const struct element* e;
+	char* prev = NULL;
+	size_t prev_size = 0;
+	int have_prev = 0;
+	int res;
+	int ret = 0;
+
+	return_ifnull(fp_in, -1);
+	return_ifnull(fp_out, -1);
+
+	if (!file_opened_for_reading(fp_in) || !file_opened_for_writing(fp_out)){
+		log_emode();
+		return -1;
+	}
+	if (ftell(fp_out) != 0){
+		log_error("The sorted checksum file has to start out empty");
+		return -1;
+	}
+	rewind(fp_in);
+
+	memset(&sw, 0, sizeof(sw));
+	if (!(cr = checksum_reader_new(fp_in, 0))){
+		log_error("Failed to start reading checksum file");
+		ret = -1;
+		goto cleanup;
+	}
+	if (sorted_writer_begin(&sw, fp_out, 1, front_code) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+	while ((res = checksum_reader_next(cr, &e)) == 0){
+		size_t len;
+
+		if (have_prev && strcmp(prev, e->file) > 0){
+			ret = 1;
+			goto cleanup;
+		}
+		len = strlen(e->file);
+		if (arena_reserve(&prev, &prev_size, len + 1) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+		memcpy(prev, e->file, len + 1);
+		have_prev = 1;
+
+		if (sorted_writer_add(&sw, e) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+	}
+	if (res < 0){
+		log_error("Failed to read checksum file");
+		ret = -1;
+		goto cleanup;
+	}
+	ret = sorted_writer_end(&sw);
+
+cleanup:
+	/* the caller sorts into the same file if this could not copy it */
+	if (ret != 0 && (fflush(fp_out) != 0 || ftruncate(fileno(fp_out), 0) != 0)){
+		log_error_ex("Failed to empty the checksum file again (%s)", strerror(errno));
+		ret = -1;
+	}
+	ret != 0 ? rewind(fp_out) : (void)0;
+	sorted_writer_free(&sw);
+	checksum_reader_free(cr);
+	free(prev);
+	return ret;
+}
+
+int checksum_read_footer(FILE* fp, const char* magic, uint64_t min_size, unsigned char* footer, size_t footer_len, uint64_t* out_size){
+	uint64_t size;
 
-/* main quicksort function for sorting the elements */
-void quicksort_elements(struct element** elements, int low, int high){
-	if (low < high){
-		int pivot = partition_m3(elements, low, high);
-		quicksort_elements(elements, low, pivot - 1);
-		quicksort_elements(elements, pivot + 1, high);
+	return_ifnull(fp, -1);
+	return_ifnull(magic, -1);
+	return_ifnull(footer, -1);
+
+	size = get_file_size_fp(fp);
+	if (size == (uint64_t)-1){
+		return -1;
+	}
+	if (out_size){
+		*out_size = size;
+	}
+	if (footer_len < 4 || size < min_size || size < footer_len){
+		return 1;
 	}
+	if (fseek(fp, size - footer_len, SEEK_SET) != 0 || fread(footer, 1, footer_len, fp) != footer_len){
+		log_efread("file footer");
+		return -1;
+	}
+	return memcmp(footer + footer_len - 4, magic, 4) == 0 ? 0 : 1;
 }
 
-void free_element_array(struct element** elements, size_t size){
-	size_t i;
-	for (i = 0; i < size; ++i){
-		free_element(elements[i]);
+/* reads the footer of a sorted checksum file
+ * returns 0 if it has a block index, positive if it does not, or negative on error
+ * the fp is left at the end of the block index */
+static int read_index(FILE* fp, uint64_t* out_pos, size_t* out_len){
+	unsigned char buf[CHECKSUM_FOOTER_LEN];
+	uint64_t size;
+	uint64_t pos;
+	int res;
+
+	/* an unsorted binary checksum file has no index */
+	res = checksum_read_footer(fp, CHECKSUM_INDEX_MAGIC, CHECKSUM_HEADER_LEN + 5 + CHECKSUM_FOOTER_LEN, buf, CHECKSUM_FOOTER_LEN, &size);
+	if (res != 0){
+		return res;
 	}
-	free(elements);
+	pos = get_u64(buf);
+	if (pos < CHECKSUM_HEADER_LEN || pos + 5 + CHECKSUM_FOOTER_LEN > size ||
+			fseek(fp, pos, SEEK_SET) != 0 || fread(buf, 1, 5, fp) != 5 || buf[0] != CHECKSUM_TAG_INDEX){
+		log_warning("Checksum file has a corrupt block index");
+		return 1;
+	}
+	*out_len = get_u32(buf + 1);
+	/* version 1 files end right after it, newer ones have the summary in between */
+	if (pos + 5 + (uint64_t)*out_len * 8 + CHECKSUM_FOOTER_LEN > size){
+		log_warning("Checksum file has a corrupt block index");
+		return 1;
+	}
+	*out_pos = pos + 5;
+	return fseek(fp, *out_pos + (uint64_t)*out_len * 8, SEEK_SET) == 0 ? 0 : -1;
 }
 
-static void free_minheapnodes(struct minheapnode* mhn, size_t size){
-	size_t i;
-	for (i = 0; i < size; ++i){
-		if (mhn[i].e){
-			free_element(mhn[i].e);
-		}
+static int read_index_entry(FILE* fp, uint64_t index_pos, size_t i, uint64_t* out){
+	unsigned char buf[8];
+
+	if (fseek(fp, index_pos + i * 8, SEEK_SET) != 0 || fread(buf, 1, sizeof(buf), fp) != sizeof(buf)){
+		log_efread("checksum file");
+		return -1;
 	}
-	free(mhn);
+	*out = get_u64(buf);
+	return 0;
 }
 
-void free_strarray(char** elements, size_t size){
-	size_t i;
-	for (i = 0; i < size; ++i){
-		free(elements[i]);
+/* searches the records from the reader's position until they pass the key */
+static int search_linear(struct checksum_reader* cr, const char* key, struct element** out){
+	const struct element* e;
+	int res;
+
+	while ((res = checksum_reader_next(cr, &e)) == 0){
+		int cmp = strcmp(key, e->file);
+
+		if (cmp == 0){
+			*out = copy_element(e);
+			return *out ? 0 : -1;
+		}
+		if (cmp < 0){
+			return 1;
+		}
 	}
-	free(elements);
+	return res;
 }
 
-/* you know this is going to be good when there's a triple pointer */
+struct checksum_index{
+	uint64_t* offsets;
+	/* where the block index starts, which is where the last block ends */
+	uint64_t records_end;
+	/* all of the keys back to back, each one terminated */
+	char* key_data;
+	char** keys;
+	size_t n_blocks;
+	unsigned char* bloom;
+	size_t bloom_len;
+	unsigned n_hashes;
+};
 
-/* reads MAX_RUN_SIZE bytes worth of elements into ram,
- * sorts them, and writes them to one or more files */
-int create_initial_runs(FILE* fp_in, struct TMPFILE*** out, size_t* n_files){
-	struct element** elems = NULL;
-	struct element* tmp = NULL;
-	int elems_len = 0;
-	int total_len = 0;
-	int end_of_file = 0;
+void checksum_index_free(struct checksum_index* ci){
+	if (!ci){
+		return;
+	}
+	free(ci->offsets);
+	free(ci->key_data);
+	free(ci->keys);
+	free(ci->bloom);
+	free(ci);
+}
 
-	/* check null arguments */
-	return_ifnull(fp_in, -1);
-	return_ifnull(out, -1);
-	return_ifnull(n_files, -1);
+/* reads a section header and checks its tag */
+static int read_section(FILE* fp, int tag, unsigned long* out_len){
+	unsigned char buf[5];
 
-	if (!file_opened_for_reading(fp_in)){
-		log_emode();
+	if (fread(buf, 1, sizeof(buf), fp) != sizeof(buf) || buf[0] != tag){
 		return -1;
 	}
-	rewind(fp_in);
+	*out_len = get_u32(buf + 1);
+	return 0;
+}
 
-	*out = NULL;
-	*n_files = 0;
+int checksum_index_load(FILE* fp, struct checksum_index** out){
+	struct checksum_index* ci = NULL;
+	unsigned char header[CHECKSUM_HEADER_LEN];
+	unsigned char buf[8];
+	uint64_t index_pos;
+	uint64_t size;
+	unsigned long len;
+	size_t key_data_len = 0;
+	size_t i;
+	int ret;
 
-	while (!end_of_file){
-		struct TMPFILE* tfp;
-		int i;
+	return_ifnull(fp, -1);
+	return_ifnull(out, -1);
+	*out = NULL;
 
-		/* make a new temp file */
-		(*n_files)++;
-		/* make space for new string */
-		*out = realloc(*out, sizeof(**out) * *n_files);
-		if (!(*out)){
-			log_enomem();
+	rewind(fp);
+	if (fread(header, 1, sizeof(header), fp) != sizeof(header) || memcmp(header, CHECKSUM_MAGIC, 4) != 0){
+		if (ferror(fp)){
+			log_efread("checksum file");
 			return -1;
 		}
-		if ((tfp = temp_fopen()) == NULL){
-			log_error("Failed to create temporary merge file");
-			(*n_files)--;
-			*out = realloc(*out, *n_files * sizeof(**out));
-			return -1;
+		return 1;
+	}
+	/* version 1 has no summary */
+	if (header[4] < 2){
+		return 1;
+	}
+	size = get_file_size_fp(fp);
+
+	ci = calloc(1, sizeof(*ci));
+	if (!ci){
+		log_enomem();
+		return -1;
+	}
+	ret = read_index(fp, &index_pos, &ci->n_blocks);
+	if (ret != 0){
+		goto cleanup;
+	}
+	/* from here on, anything odd means the summary is corrupt, so the caller falls back to the block index */
+	ret = 1;
+	ci->records_end = index_pos - 5;
+
+	/* the keys are at most 64KB each, so it is the file size that bounds them */
+	if (!(ci->offsets = malloc((ci->n_blocks + 1) * sizeof(*ci->offsets))) ||
+			!(ci->keys = malloc((ci->n_blocks + 1) * sizeof(*ci->keys)))){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+	if (fseek(fp, index_pos, SEEK_SET) != 0){
+		goto cleanup;
+	}
+	for (i = 0; i < ci->n_blocks; ++i){
+		if (fread(buf, 1, 8, fp) != 8){
+			goto cleanup;
 		}
-		(*out)[*n_files - 1] = tfp;
+		ci->offsets[i] = get_u64(buf);
+	}
 
-		/* read enough elements to fill MAX_RUN_SIZE */
-		/* TODO: this reads one element above MAX_RUN_SIZE
-		 * make it not do that */
-		while (total_len < MAX_RUN_SIZE &&
-				(tmp = get_next_checksum_element(fp_in)) != NULL){
-			elems_len++;
-			elems = realloc(elems, sizeof(*elems) * elems_len);
-			if (!elems){
-				log_enomem();
-				return -1;
-			}
-			/* +2 for the 2 \0's */
-			total_len += strlen(tmp->file) + strlen(tmp->checksum) + 2;
-			elems[elems_len - 1] = tmp;
+	if (read_section(fp, CHECKSUM_TAG_KEYS, &len) != 0 || len != ci->n_blocks){
+		goto cleanup;
+	}
+	/* one pass to size the keys, then one to read them */
+	index_pos = ftell(fp);
+	for (i = 0; i < ci->n_blocks; ++i){
+		unsigned key_len;
+
+		if (fread(buf, 1, 2, fp) != 2){
+			goto cleanup;
 		}
-		/* if we didn't read any elements */
-		if (!elems_len){
-			/* we're at the end of the file */
-			temp_fclose(tfp);
-			(*n_files)--;
-			*out = realloc(*out, *n_files * sizeof(**out));
-			if ((*n_files) > 0 && !(*out)){
-				log_enomem();
-				return -1;
-			}
-			end_of_file = 1;
-			continue;
+		key_len = get_u16(buf);
+		if ((uint64_t)ftell(fp) + key_len > size || fseek(fp, key_len, SEEK_CUR) != 0){
+			goto cleanup;
 		}
-		/* sort elements */
-		quicksort_elements(elems, 0, elems_len - 1);
-		/* write them to the file */
-		for (i = 0; i < elems_len; ++i){
-			if (write_element_to_file(tfp->fp, elems[i]) != 0){
-				log_debug("Failed to write element to file");
-			}
+		key_data_len += key_len + 1;
+	}
+	if (!(ci->key_data = malloc(key_data_len + 1))){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+	if (fseek(fp, index_pos, SEEK_SET) != 0){
+		goto cleanup;
+	}
+	key_data_len = 0;
+	for (i = 0; i < ci->n_blocks; ++i){
+		unsigned key_len;
+
+		if (fread(buf, 1, 2, fp) != 2){
+			goto cleanup;
 		}
-		if (fflush(tfp->fp) != 0){
-			log_warning("Failed to flush merge file");
+		key_len = get_u16(buf);
+		if (fread(ci->key_data + key_data_len, 1, key_len, fp) != key_len){
+			goto cleanup;
 		}
-		/* cleanup */
-		free_element_array(elems, elems_len);
-		elems = NULL;
-		elems_len = 0;
-		total_len = 0;
-		if (!tmp){
-			end_of_file = 1;
+		ci->keys[i] = ci->key_data + key_data_len;
+		ci->key_data[key_data_len + key_len] = '\0';
+		key_data_len += key_len + 1;
+	}
+
+	if (read_section(fp, CHECKSUM_TAG_BLOOM, &len) != 0 || len == 0 || (uint64_t)ftell(fp) + 1 + len > size){
+		goto cleanup;
+	}
+	ci->bloom_len = len;
+	if ((ci->n_hashes = fgetc(fp)) == 0 || ci->n_hashes > 0xFF){
+		goto cleanup;
+	}
+	if (!(ci->bloom = malloc(ci->bloom_len))){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+	if (fread(ci->bloom, 1, ci->bloom_len, fp) != ci->bloom_len){
+		goto cleanup;
+	}
+	ret = 0;
+
+cleanup:
+	if (ret != 0){
+		if (ret > 0 && ci && (ci->offsets || ci->keys)){
+			log_warning("Checksum file has a corrupt summary");
 		}
+		checksum_index_free(ci);
+		return ret;
 	}
+	*out = ci;
 	return 0;
 }
 
-/* creates a min heap based on the elements */
-/* this is used so we can merge the files in O(nlogn)
- * instead of O(n^2) by making a priority queue*/
-void minheapify(struct minheapnode* elements, int elements_len, int index){
-	int smallest = index;
-	int left = 2 * index + 1;
-	int right = 2 * index + 2;
+int checksum_index_may_contain(const struct checksum_index* ci, const char* key){
+	uint64_t h;
+	uint32_t k;
 
-	/* if left child is smaller than root */
-	if (left < elements_len && compare_elements(elements[left].e, elements[smallest].e) < 0){
-		smallest = left;
+	if (!ci || !key){
+		return 1;
 	}
+	h = key_hash(key);
+	for (k = 0; k < ci->n_hashes; ++k){
+		uint32_t bit = BLOOM_BIT(h, k, ci->bloom_len * 8);
 
-	/* if right child is smaller than smallest so far */
-	if (right < elements_len && compare_elements(elements[right].e, elements[smallest].e) < 0){
-		smallest = right;
+		if (!(ci->bloom[bit / 8] & (1 << (bit % 8)))){
+			return 0;
+		}
 	}
+	return 1;
+}
+
+int checksum_index_block(const struct checksum_index* ci, size_t i, uint64_t* offset, const char** key){
+	return_ifnull(ci, -1);
 
-	/* if smallest is not root */
-	if (smallest != index){
-		/* get the smallest to root */
-		swap_mhn(&elements[index], &elements[smallest]);
-		/* recursively balance the unbalanced heap */
-		minheapify(elements, elements_len, smallest);
+	if (i > ci->n_blocks){
+		return 1;
+	}
+	if (offset){
+		*offset = i < ci->n_blocks ? ci->offsets[i] : ci->records_end;
 	}
+	if (key){
+		*key = i < ci->n_blocks ? ci->keys[i] : NULL;
+	}
+	return 0;
 }
 
-/* merges the initial runs into one big file */
-int merge_files(struct TMPFILE** in, size_t n_files, FILE* fp_out){
-	struct minheapnode* mhn = NULL;
-	size_t count = 0;
-	size_t i;
-	int j;
+int checksum_find_block(const char* key, size_t n_blocks, const char*(*block_key)(size_t i, const void* data), const void* data, size_t* out){
+	size_t low;
+	size_t high;
 
-	/* verify that arguments are not null */
-	return_ifnull(in, -1);
-	return_ifnull(fp_out, -1);
+	return_ifnull(key, -1);
+	return_ifnull(block_key, -1);
+	return_ifnull(out, -1);
 
-	if (!file_opened_for_writing(fp_out)){
-		log_emode();
-		return -1;
+	if (n_blocks == 0 || strcmp(key, block_key(0, data)) < 0){
+		return 1;
 	}
 
-	/* rewind input files so they can be used for reading */
-	for (i = 0; i < n_files; ++i){
-		rewind(in[i]->fp);
+	/* the last block whose first key is not past this one */
+	low = 0;
+	high = n_blocks;
+	while (high - low > 1){
+		size_t mid = low + (high - low) / 2;
+
+		if (strcmp(key, block_key(mid, data)) < 0){
+			high = mid;
+		}
+		else{
+			low = mid;
+		}
 	}
+	*out = low;
+	return 0;
+}
 
-	/* make space for the min heap nodes */
-	mhn = malloc(n_files * sizeof(*mhn));
-	if (!mhn){
-		log_enomem();
+static const char* index_key(size_t i, const void* data){
+	return ((const struct checksum_index*)data)->keys[i];
+}
+
+int checksum_index_search(const struct checksum_index* ci, FILE* fp, const char* key, struct element** out){
+	struct checksum_reader* cr;
+	size_t block;
+	int res;
+
+	return_ifnull(ci, -1);
+	return_ifnull(fp, -1);
+	return_ifnull(key, -1);
+	return_ifnull(out, -1);
+	*out = NULL;
+
+	if (!checksum_index_may_contain(ci, key) || checksum_find_block(key, ci->n_blocks, index_key, ci, &block) != 0){
+		return 1;
+	}
+
+	if (!(cr = checksum_reader_new(fp, CHECKSUM_BLOCK_LEN * 2))){
 		return -1;
 	}
-	/* get the first element from each file */
-	for (i = 0; i < n_files; ++i){
-		mhn[i].e = get_next_checksum_element(in[i]->fp);
-		mhn[i].i = i;
+	checksum_reader_seek(cr, ci->offsets[block]);
+	res = search_linear(cr, key, out);
+	checksum_reader_free(cr);
+	return res;
+}
+
+/* binary searches the block index for the last block whose first record is not past the key,
+ * then searches that block */
+static int search_binary_file(FILE* fp, const char* key, struct element** out){
+	struct checksum_reader* cr = NULL;
+	const struct element* e;
+	uint64_t index_pos;
+	uint64_t offset;
+	size_t n_blocks;
+	size_t low;
+	size_t high;
+	int res;
+
+	res = read_index(fp, &index_pos, &n_blocks);
+	if (res < 0){
+		return -1;
+	}
+	/* enough for a block and the start of the next one, since that is all that gets read after each seek */
+	if (!(cr = checksum_reader_new(fp, CHECKSUM_BLOCK_LEN * 2))){
+		return -1;
 	}
-	/* balance our heap */
-	for (j = n_files / 2 - 1; j >= 0; --j){
-		minheapify(mhn, n_files, j);
+	/* no index, so the records have to be searched one by one */
+	if (res > 0){
+		checksum_reader_seek(cr, CHECKSUM_HEADER_LEN);
+		res = search_linear(cr, key, out);
+		goto cleanup;
+	}
+	if (n_blocks == 0){
+		res = 1;
+		goto cleanup;
 	}
 
-	/* while the counter is less than the number of files */
-	/* counter tracks which files are empty */
-	while (count < n_files){
-		/* write root element (smallest) to file */
-		write_element_to_file(fp_out, mhn[0].e);
-		free_element(mhn[0].e);
+	low = 0;
+	high = n_blocks;
+	while (high - low > 1){
+		size_t mid = low + (high - low) / 2;
 
-		/* replace root element with next from that file */
-		mhn[0].e = get_next_checksum_element(in[mhn[0].i]->fp);
-		/* if file is empty */
-		if (!mhn[0].e){
-			/* raise the counter */
-			count++;
+		if (read_index_entry(fp, index_pos, mid, &offset) != 0){
+			res = -1;
+			goto cleanup;
+		}
+		checksum_reader_seek(cr, offset);
+		if (checksum_reader_next(cr, &e) != 0){
+			log_error("Checksum file has a corrupt block index");
+			res = -1;
+			goto cleanup;
+		}
+		res = strcmp(key, e->file);
+		if (res == 0){
+			*out = copy_element(e);
+			res = *out ? 0 : -1;
+			goto cleanup;
+		}
+		if (res < 0){
+			high = mid;
+		}
+		else{
+			low = mid;
 		}
-		/* rebalance our heap */
-		minheapify(mhn, n_files, 0);
 	}
 
-	/* cleanup */
-	free_minheapnodes(mhn, n_files);
-	if (fflush(fp_out) != 0){
-		log_warning("Failed to flush checksum file buffer. Data corruption possible.");
+	if (read_index_entry(fp, index_pos, low, &offset) != 0){
+		res = -1;
+		goto cleanup;
 	}
-	return 0;
+	checksum_reader_seek(cr, offset);
+	res = search_linear(cr, key, out);
+
+cleanup:
+	checksum_reader_free(cr);
+	return res;
 }
 
-int search_file(FILE* fp, const char* key, char** checksum){
+/* searches a checksum file in the text format used by older versions */
+static int search_text_file(FILE* fp, const char* key, struct element** out){
 	struct element* tmp;
 	int c;
 	int res;
@@ -468,11 +2655,6 @@ int search_file(FILE* fp, const char* key, char** checksum){
 	off_t high;
 	const int end_bsearch_threshold = 128;
 
-	/* check null arguments */
-	return_ifnull(fp, -1);
-	return_ifnull(key, -1);
-	return_ifnull(checksum, -1);
-
 	/* start at half of file */
 	size = get_file_size_fp(fp);
 	low = 0;
@@ -517,13 +2699,7 @@ int search_file(FILE* fp, const char* key, char** checksum){
 		/* check if it matches our key */
 		res = strcmp(key, tmp->file);
 		if (res == 0){
-			*checksum = malloc(strlen(tmp->checksum) + 1);
-			if (!(*checksum)){
-				log_enomem();
-				return -1;
-			}
-			strcpy(*checksum, tmp->checksum);
-			free_element(tmp);
+			*out = tmp;
 			return 0;
 		}
 		/* if key is before tmp */
@@ -581,18 +2757,106 @@ int search_file(FILE* fp, const char* key, char** checksum){
 	/* if we found our target */
 	if (res == 0){
 		/* return it */
-		*checksum = malloc(strlen(tmp->checksum) + 1);
-		if (!(*checksum)){
-			log_enomem();
-			return -1;
-		}
-		strcpy(*checksum, tmp->checksum);
-		free_element(tmp);
+		*out = tmp;
 		return 0;
 	}
 	/* otherwise we failed */
+	return 1;
+}
+
+/* the summary of the last file searched
+ * a backup searches the same file once per file it backs up, so this saves loading it every time */
+static struct{
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	/* mtime only has a resolution of a second, so a file rewritten in place is also told apart by its footer */
+	unsigned char footer[CHECKSUM_FOOTER_LEN];
+	/* 0 if the summary is loaded, positive if the file has none */
+	int res;
+	struct checksum_index* ci;
+} last_index = { 0, 0, 0, 0, { 0 }, -1, NULL };
+static pthread_mutex_t last_index_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int search_indexed_file(FILE* fp, const char* key, struct element** out){
+	unsigned char footer[CHECKSUM_FOOTER_LEN];
+	struct stat st;
+	int res;
+
+	if (fstat(fileno(fp), &st) != 0){
+		log_estat("checksum file");
+		return -1;
+	}
+	memset(footer, 0, sizeof(footer));
+	if (st.st_size >= (off_t)sizeof(footer) &&
+			(fseek(fp, -(long)sizeof(footer), SEEK_END) != 0 || fread(footer, 1, sizeof(footer), fp) != sizeof(footer))){
+		log_efread("checksum file");
+		return -1;
+	}
+
+	pthread_mutex_lock(&last_index_mutex);
+	if (last_index.res < 0 || last_index.dev != st.st_dev || last_index.ino != st.st_ino ||
+			last_index.size != st.st_size || last_index.mtime != st.st_mtime ||
+			memcmp(last_index.footer, footer, sizeof(footer)) != 0){
+		checksum_index_free(last_index.ci);
+		last_index.ci = NULL;
+		last_index.res = checksum_index_load(fp, &last_index.ci);
+		last_index.dev = st.st_dev;
+		last_index.ino = st.st_ino;
+		last_index.size = st.st_size;
+		last_index.mtime = st.st_mtime;
+		memcpy(last_index.footer, footer, sizeof(footer));
+	}
+
+	if (last_index.res == 0){
+		res = checksum_index_search(last_index.ci, fp, key, out);
+	}
+	else if (last_index.res > 0){
+		res = search_binary_file(fp, key, out);
+	}
 	else{
-		*checksum = NULL;
-		return 1;
+		res = -1;
+	}
+	pthread_mutex_unlock(&last_index_mutex);
+	return res;
+}
+
+int search_file_element(FILE* fp, const char* key, struct element** out){
+	unsigned char magic[4];
+
+	/* check null arguments */
+	return_ifnull(fp, -1);
+	return_ifnull(key, -1);
+	return_ifnull(out, -1);
+
+	*out = NULL;
+
+	rewind(fp);
+	if (fread(magic, 1, sizeof(magic), fp) == sizeof(magic) && memcmp(magic, CHECKSUM_MAGIC, 4) == 0){
+		return search_indexed_file(fp, key, out);
+	}
+	if (ferror(fp)){
+		log_efread("checksum file");
+		return -1;
+	}
+	return search_text_file(fp, key, out);
+}
+
+int search_file(FILE* fp, const char* key, char** checksum){
+	struct element* e;
+	int res;
+
+	return_ifnull(checksum, -1);
+
+	*checksum = NULL;
+	res = search_file_element(fp, key, &e);
+	if (res != 0){
+		return res;
 	}
+
+	*checksum = e->checksum;
+	e->checksum = NULL;
+	free_element(e);
+	return 0;
 }
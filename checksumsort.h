@@ -10,34 +10,84 @@
 #define __CHECKSUMSORT_H
 
 #include <stdio.h>
+#include <stdint.h>
 #include "filehelper.h"
 
-#ifndef MAX_RUN_SIZE
-#define MAX_RUN_SIZE (1 << 24) /**< The maximum length of a checksum run (16MB). */
+#ifndef __GNUC__
+#define __attribute__(x)
 #endif
 
+#define CHECKSUM_SORT_MIN_MEMORY (1 << 24) /**< @brief The least memory checksum_sort_memory() picks on its own (16MB). */
+#define CHECKSUM_SORT_MEMORY_FRACTION 8 /**< @brief checksum_sort_memory() picks this fraction of the ram, or of the cgroup's memory limit if that is lower. */
+#define CHECKSUM_SORT_OVERHEAD 3 /**< @brief A checksum file takes up about this many times its size in memory once it is parsed. */
+
+#define CHECKSUM_SORT_THREADS 4 /**< @brief The most runs create_initial_runs() sorts at once. They share its memory budget. */
+#define CHECKSUM_MERGE_MEMORY (1 << 26) /**< @brief The read-ahead buffers of every run merge_files() reads from add up to at most this much (64MB). */
+#define CHECKSUM_MERGE_BUFFER_LEN (1 << 20) /**< @brief The largest read-ahead buffer merge_files() gives a single run (1MB). */
+#define CHECKSUM_MAX_FAN_IN 256 /**< @brief The most runs merge_files() reads at once, unless checksum_set_max_fan_in() says otherwise. More runs than this are merged over several passes. @see checksum_merge_fan_in() */
+#define CHECKSUM_RESERVED_FDS 64 /**< @brief File descriptors that merge_files() leaves for the rest of the program. */
+#define CHECKSUM_NATURAL_RUN_LEN 32 /**< @brief adaptive_sort_elements() merges the ascending runs already in a list if they are at least this long on average. */
+#define MULTIKEY_INSERTION_LEN 12 /**< @brief Partitions this small or smaller are finished with an insertion sort by multikey_sort_elements(). */
+
 /**
- * @brief Holds the data needed for a checksum entry.
+ * @brief The first 4 bytes of a binary checksum file.<br>
+ * The first byte can never start a path in the text format used by older versions, so either format can be told apart from its first byte.
  */
-struct element{
-	char* file;     /**< @brief The filename. */
-	char* checksum; /**< @brief The null-ternimated hexadecimal checksum string corresponding to the file's contents. */
+#define CHECKSUM_MAGIC "\x89" "EZC"
+#define CHECKSUM_VERSION 4       /**< @brief The newest version of the checksum file format, which this version reads and writes. Files with a newer version are refused. Version 1 files have no key summary or Bloom filter, only version 3 files and later have front-coded records, and only version 4 files have artifact checksums. */
+#define CHECKSUM_VERSION_FRONT 3 /**< @brief The version written for files with front-coded records but no artifact checksums, so older versions can still read them. */
+#define CHECKSUM_VERSION_PLAIN 2 /**< @brief The version written for files without front-coded records or artifact checksums, so older versions can still read them. */
+#define CHECKSUM_HEADER_LEN 8    /**< @brief The length of the header: CHECKSUM_MAGIC, the version, and 3 reserved bytes. */
+#define CHECKSUM_TAG_RECORD 0x01 /**< @brief Starts every binary record. */
+#define CHECKSUM_TAG_INDEX 0x02  /**< @brief Starts the block index of a sorted checksum file, which comes after the last record. */
+#define CHECKSUM_TAG_KEYS 0x03   /**< @brief Starts the first path of every block, which comes right after the block index. */
+#define CHECKSUM_TAG_BLOOM 0x04  /**< @brief Starts the Bloom filter of every path in the file, which comes right after the block keys. */
+#define CHECKSUM_INDEX_MAGIC "EZIX" /**< @brief Ends a sorted checksum file. */
+#define CHECKSUM_FOOTER_LEN 12   /**< @brief The length of the footer: the offset of the block index, then CHECKSUM_INDEX_MAGIC. */
+#define CHECKSUM_MAX_DIGEST_LEN 0xFF /**< @brief The longest checksum that can be recorded in bytes. */
+
+#define CHECKSUM_HAS_META 0x01   /**< @brief Record flag: The record ends with the file's metadata. */
+#define CHECKSUM_SUM_TREE 0x02   /**< @brief Record flag: The raw digest is a tree hash, and gets TREE_HASH_PREFIX in front of it when read. */
+#define CHECKSUM_SUM_STRING 0x04 /**< @brief Record flag: The checksum is not a hexadecimal digest, so it is stored as the original string. */
+#define CHECKSUM_PATH_SHARED 0x08 /**< @brief Record flag: The record is front-coded. Its path starts with as many bytes of the previous record's path as the 2 bytes after the record header say, and only the rest is stored. The first record of a block is never front-coded, so a sorted file can still be read from the start of any block. */
+#define CHECKSUM_HAS_ARTIFACT 0x10 /**< @brief Record flag: The record ends with the checksum of the file's output, as a length byte and then the raw digest. */
+
+#define CHECKSUM_BLOOM_BITS_PER_KEY 10 /**< @brief The size of the Bloom filter per path, which makes about 1% of lookups for missing paths read the file anyway. */
+#define CHECKSUM_BLOOM_HASHES 7  /**< @brief The number of bits set in the Bloom filter per path. */
+
+#define CHECKSUM_READER_BUFFER_LEN (1 << 16) /**< @brief The default size of a checksum_reader's buffer (64KB). It grows to fit longer records. */
+
+#define CHECKSUM_BLOCK_LEN 4096  /**< @brief A sorted checksum file's block index has an entry for the first record past every CHECKSUM_BLOCK_LEN bytes. */
+
+/**
+ * @brief File metadata recorded next to a checksum.<br>
+ * If none of these values changed since the last backup, the file's contents are assumed to be unchanged.
+ */
+struct file_meta{
+	uint64_t size;  /**< @brief The file's size in bytes. */
+	uint64_t mtime; /**< @brief The file's last modification time. */
+	uint64_t ctime; /**< @brief The file's last status change time. */
+	uint64_t ino;   /**< @brief The file's inode number. */
 };
 
 /**
- * @brief A node in the merging heap.<br>
- * The index of the file is necessary for merge_files() to draw the next element from the correct file.
- * @see merge_files()
+ * @brief Holds the data needed for a checksum entry.
  */
-struct minheapnode{
-	struct element* e; /**< @brief The element. @see struct element */
-	int i;             /**< @brief The index of the file it came from */
+struct element{
+	char* file;             /**< @brief The filename. */
+	char* checksum;         /**< @brief The null-ternimated hexadecimal checksum string corresponding to the file's contents. */
+	struct file_meta* meta; /**< @brief The file's metadata, or NULL if it was not recorded. */
+	char* artifact;         /**< @brief The hexadecimal checksum of the file's output as it was written to the backup, after compression and encryption, or NULL if it was not recorded. */
 };
 
 /**
  * @brief Writes an element to a checksum file.<br>
  *
- * Format: /path/to/file\0ABCDEF123456\\n
+ * Format: /path/to/file\0ABCDEF123456\\n<br>
+ * If the element has metadata, it is appended after another '\0' as 64 hex digits (size, mtime, ctime, inode):<br>
+ * /path/to/file\0ABCDEF123456\0<64 hex digits>\\n<br>
+ * Older versions ignore everything after the second '\0', so either format can be read by any version.<br>
+ * The artifact checksum is only kept in binary records.
  *
  * @param fp The output file.<br>
  * This FILE* must be opened in writing binary ("wb") mode.
@@ -51,7 +101,9 @@ int write_element_to_file(FILE* fp, struct element* e);
 /* TODO: return an integer since there's multiple reasons for NULL */
 
 /**
- * @brief Retrieves an element from a checksum file.
+ * @brief Retrieves an element from a checksum file.<br>
+ * Both binary records and the text records of older versions are read. The header is skipped when reading from the start of the file, and the block index counts as end-of-file.<br>
+ * Front-coded records cannot be read this way, since each one depends on the record before it. Use a checksum_reader for files that may have them.
  *
  * @param fp The input file.<br>
  * This FILE* must be opened in reading binary ("rb") mode.
@@ -62,6 +114,205 @@ int write_element_to_file(FILE* fp, struct element* e);
  */
 struct element* get_next_checksum_element(FILE* fp);
 
+/**
+ * @brief Reads the records of a checksum file through a large buffer, without allocating memory for each one.<br>
+ * Both binary records and the text records of older versions are read, as well as removed file lists. @see create_removed_list()<br>
+ * Unlike get_next_checksum_element(), every record is only read from the file once.
+ */
+struct checksum_reader;
+
+/**
+ * @brief Starts reading records at the current position of a file.
+ *
+ * @param fp The input file.<br>
+ * This FILE* must be opened in reading binary ("rb") mode, and must outlive the reader.<br>
+ * Its position is undefined while the reader is in use.
+ *
+ * @param buffer_len The initial size of the buffer, or 0 for CHECKSUM_READER_BUFFER_LEN.
+ *
+ * @return A new reader, or NULL on failure.<br>
+ * This must be freed with checksum_reader_free() when no longer in use.
+ */
+struct checksum_reader* checksum_reader_new(FILE* fp, size_t buffer_len) __attribute__((malloc));
+
+/**
+ * @brief Reads the records in a buffer instead of a file, such as part of a checksum file that was decrypted in memory.
+ *
+ * @param data The records.<br>
+ * These are copied, so they do not have to outlive the reader.
+ *
+ * @param len The length of the records in bytes.
+ *
+ * @param pos Where the records were in their checksum file.<br>
+ * If this is 0, they are expected to start with the checksum file's header. Otherwise, they must start at the beginning of a block, since the first record cannot be front-coded.
+ *
+ * @return A new reader, or NULL on failure.<br>
+ * This must be freed with checksum_reader_free() when no longer in use.
+ */
+struct checksum_reader* checksum_reader_new_buf(const void* data, size_t len, uint64_t pos) __attribute__((malloc));
+
+/**
+ * @brief Retrieves the next record.
+ *
+ * @param cr The reader.
+ *
+ * @param out A pointer to the element that will hold the record.<br>
+ * The element belongs to the reader, and is only valid until the next call to checksum_reader_next() or checksum_reader_seek(), or until the reader is freed.<br>
+ * Use copy_element() to keep it longer.
+ * @see copy_element()
+ *
+ * @return 0 on success, positive on end-of-file, or negative on error.
+ */
+int checksum_reader_next(struct checksum_reader* cr, const struct element** out);
+
+/**
+ * @brief Moves a reader to a record at a certain position in its file.<br>
+ * If that part of the file is still in the buffer, it is not read again.
+ *
+ * @param cr The reader.
+ *
+ * @param offset The position of a record in the file.
+ *
+ * @return void
+ */
+void checksum_reader_seek(struct checksum_reader* cr, uint64_t offset);
+
+/**
+ * @brief Frees a reader.
+ *
+ * @param cr The reader.<br>
+ * This can be NULL, in which case this function does nothing.
+ *
+ * @return void
+ */
+void checksum_reader_free(struct checksum_reader* cr);
+
+/**
+ * @brief Copies an element, such as one returned by checksum_reader_next().
+ *
+ * @param e The element to copy.
+ *
+ * @return A copy of the element, or NULL on failure.<br>
+ * This must be freed with free_element() when no longer in use.
+ */
+struct element* copy_element(const struct element* e) __attribute__((malloc));
+
+/**
+ * @brief The summary at the end of a sorted checksum file, loaded into memory.<br>
+ * It holds the first path and position of every block, and a Bloom filter of every path in the file.<br>
+ * Lookups for paths that are not in the file are almost always answered without reading the file, and the rest read a single block.
+ */
+struct checksum_index;
+
+/**
+ * @brief Loads the summary of a sorted checksum file.
+ *
+ * @param fp A sorted checksum file.<br>
+ * This FILE* must be opened in reading binary ("rb") mode. Its position is undefined after this function.
+ *
+ * @param out A pointer to the loaded summary.<br>
+ * This is set to NULL if the file has no summary or there was an error.<br>
+ * Otherwise, it must be freed with checksum_index_free() when no longer in use.
+ *
+ * @return 0 on success, positive if the file has no summary (it is unsorted, in the text format, or version 1), or negative on error.
+ */
+int checksum_index_load(FILE* fp, struct checksum_index** out);
+
+/**
+ * @brief Checks a path against the Bloom filter of a checksum file.
+ *
+ * @param ci The file's summary.
+ *
+ * @param key The path to look for.
+ *
+ * @return 0 if the path is definitely not in the file, or non-zero if it might be.
+ */
+int checksum_index_may_contain(const struct checksum_index* ci, const char* key);
+
+/**
+ * @brief Gets where a block of a sorted checksum file starts, and the path of its first record.<br>
+ * The records of a block are everything up to where the next one starts, and none of the blocks start front-coded, so a range of whole blocks can be read on its own with checksum_reader_new_buf().
+ *
+ * @param ci The file's summary.
+ *
+ * @param i The block.<br>
+ * One past the last block gives where the records end.
+ *
+ * @param offset Set to the position of the block's first record. This can be NULL.
+ *
+ * @param key Set to the path of the block's first record, or NULL one past the last block. This belongs to the summary. This can be NULL.
+ *
+ * @return 0 on success, positive if i is more than one past the last block, or negative on error.
+ */
+int checksum_index_block(const struct checksum_index* ci, size_t i, uint64_t* offset, const char** key);
+
+/**
+ * @brief Searches a sorted checksum file using its summary.
+ * @see search_file_element()
+ *
+ * @param ci The file's summary.
+ *
+ * @param fp The file it was loaded from.
+ *
+ * @param key The path to search for.
+ *
+ * @param out A pointer to the output element.<br>
+ * This will be set to NULL if the key could not be found or there was an error.<br>
+ * Otherwise, the element must be freed with free_element() when no longer in use.
+ *
+ * @return 0 on success, positive if the entry could not be found, negative on error.
+ */
+int checksum_index_search(const struct checksum_index* ci, FILE* fp, const char* key, struct element** out);
+
+/**
+ * @brief Finds the block a key would be in, given the first key of every block of a sorted file.<br>
+ * This is the lookup behind checksum_index_search(), for other files that are split into blocks the same way.
+ *
+ * @param key The key to search for.
+ *
+ * @param n_blocks The number of blocks.
+ *
+ * @param block_key Returns the first key of block i.<br>
+ * The blocks must be in order of their first keys, according to strcmp().
+ *
+ * @param data The user-defined argument passed to block_key.
+ *
+ * @param out Set to the last block whose first key is not past the key.
+ *
+ * @return 0 on success, or positive if there are no blocks or the key comes before the first one, in which case no block can have it.
+ */
+int checksum_find_block(const char* key, size_t n_blocks, const char*(*block_key)(size_t i, const void* data), const void* data, size_t* out);
+
+/**
+ * @brief Reads the footer of a file that ends with a 4-byte magic number, the way a sorted checksum file does.
+ *
+ * @param fp The file to read.<br>
+ * Afterwards, it is left at the end of the file.
+ *
+ * @param magic The 4 bytes the file has to end with.
+ *
+ * @param min_size The smallest size the file can be with a footer.
+ *
+ * @param footer Set to the last footer_len bytes of the file, which end with the magic number.
+ *
+ * @param footer_len The length of the footer, including the magic number.
+ *
+ * @param out_size Set to the size of the file. This can be NULL.
+ *
+ * @return 0 on success, positive if the file is too small or does not end with the magic number, or negative on error.
+ */
+int checksum_read_footer(FILE* fp, const char* magic, uint64_t min_size, unsigned char* footer, size_t footer_len, uint64_t* out_size);
+
+/**
+ * @brief Frees a checksum file's summary.
+ *
+ * @param ci The summary.<br>
+ * This can be NULL, in which case this function does nothing.
+ *
+ * @return void
+ */
+void checksum_index_free(struct checksum_index* ci);
+
 /* TODO: return an integer since there's multiple reasons for NULL */
 
 /**
@@ -100,8 +351,8 @@ int median_of_three(struct element** elements, int low, int high);
 /**
  * @brief Quicksorts a list of elements.<br>
  *
- * This sorts the initial runs for create_initial_runs().
- * @see create_initial_runs()
+ * This compares whole paths. multikey_sort_elements() is faster for paths that share long prefixes.
+ * @see multikey_sort_elements()
  *
  * @param elements The elements to sort.
  *
@@ -111,6 +362,38 @@ int median_of_three(struct element** elements, int low, int high);
  */
 void quicksort_elements(struct element** elements, int low, int high);
 
+/**
+ * @brief Sorts a list of elements by path with a multikey quicksort.<br>
+ * <br>
+ * Each partition is split on the next 8 bytes of the path instead of whole strings.<br>
+ * Elements that share those bytes go on to the next 8, so the prefix that paths in the same directory have in common is only compared once instead of on every comparison.
+ * @see adaptive_sort_elements()
+ *
+ * @param elements The elements to sort. None of them can be NULL.
+ *
+ * @param n The length of the elements array.
+ *
+ * @return void
+ */
+void multikey_sort_elements(struct element** elements, size_t n);
+
+/**
+ * @brief Sorts a list of elements by path, taking advantage of any order it is already in.<br>
+ * <br>
+ * The ascending runs that are already in the list are found first.<br>
+ * If they are CHECKSUM_NATURAL_RUN_LEN elements long or more on average, they are merged pairwise, which takes linear time for a list that is already sorted or made of a few sorted pieces.<br>
+ * Otherwise, the list is sorted with multikey_sort_elements().<br>
+ * This sorts the initial runs for create_initial_runs(), and lists that are sorted in memory.
+ * @see create_initial_runs()
+ *
+ * @param elements The elements to sort. None of them can be NULL.
+ *
+ * @param n The length of the elements array.
+ *
+ * @return void
+ */
+void adaptive_sort_elements(struct element** elements, size_t n);
+
 /**
  * @brief Frees all memory associated with an element.
  *
@@ -133,19 +416,66 @@ void free_element(struct element* e);
  */
 void free_element_array(struct element** elements, size_t size);
 
+/**
+ * @brief Picks how much memory sorting a checksum file can use.
+ *
+ * @param requested The budget in bytes, or 0 to pick one.<br>
+ * A picked budget is 1/CHECKSUM_SORT_MEMORY_FRACTION of the ram, or of the cgroup's memory limit if it is lower, and at least CHECKSUM_SORT_MIN_MEMORY.
+ *
+ * @return The budget in bytes.
+ */
+uint64_t checksum_sort_memory(uint64_t requested);
+
+/**
+ * @brief Sorts a checksum list that fits in memory, without any temporary files.<br>
+ * The output is the same as create_initial_runs() followed by merge_files().
+ *
+ * @param in_file The unsorted checksum file.<br>
+ * This FILE* must be opened in reading binary ("rb") mode.
+ *
+ * @param out_file The output file.
+ * This FILE* must be opened in writing binary ("wb") mode, and must be empty.
+ *
+ * @param front_code Non-zero to front-code the output. @see CHECKSUM_PATH_SHARED
+ *
+ * @return 0 on success, or negative on error.
+ */
+int sort_in_memory(FILE* in_file, FILE* out_file, int front_code);
+
+/**
+ * @brief Writes a checksum list that is already in order straight to the output, without sorting anything.<br>
+ * The output is the same as sort_in_memory() would write, but it is streamed, so this takes the same memory however large the list is.<br>
+ * This stops at the first record that is out of order, so an unsorted list costs little more than reading up to it.
+ *
+ * @param in_file The checksum file, which is usually in order if it was built from a walk started with fi_start_sorted().<br>
+ * This FILE* must be opened in reading binary ("rb") mode.
+ *
+ * @param out_file The output file.
+ * This FILE* must be opened in writing binary ("wb") mode, and must be empty.
+ *
+ * @param front_code Non-zero to front-code the output. @see CHECKSUM_PATH_SHARED
+ *
+ * @return 0 on success, positive if in_file is not in order, or negative on error.<br>
+ * If this does not return 0, out_file is emptied again.
+ */
+int copy_sorted(FILE* in_file, FILE* out_file, int front_code);
+
 /**
  * @brief Creates an array of individually sorted checksum lists from a single unsorted checksum list.<br>
  *
  * This is necessary to allow us to sort a checksum file larger than the available RAM on the system.<br>
  * Each of the files are sorted individually, but the files are not sorted relative to one another.<br>
- * The maximum length of a file is controlled with MAX_RUN_LEN
- * @see MAX_RUN_LEN
+ * Each run is sorted and written on a worker thread while the next one is read, with up to CHECKSUM_SORT_THREADS at once.<br>
+ * The runs are always front-coded, since only a checksum_reader ever reads them. @see CHECKSUM_PATH_SHARED<br>
  * @see merge_files()
  *
  * @param in_file The unsorted checksum file.<br>
  * This FILE* must be opened in reading binary ("rb") mode.
  *
+ * @param memory How much memory the runs that are sorted at once can take up together, in bytes. @see checksum_sort_memory()
+ *
  * @param out A pointer to an output array of temporary files.<br>
+ * Each file is closed once it is written, so its fp is NULL, and merge_files() reopens it by name.<br>
  * This will be set to NULL on error.
  * @see struct TMPFILE
  *
@@ -154,10 +484,13 @@ void free_element_array(struct element** elements, size_t size);
  *
  * @return 0 on success, or negative on error.
  */
-int create_initial_runs(FILE* in_file, struct TMPFILE*** out, size_t* n_files);
+int create_initial_runs(FILE* in_file, uint64_t memory, struct TMPFILE*** out, size_t* n_files);
 
 /**
  * @brief Merges the files created by create_initial_runs() into a single sorted checksum list.<br>
+ * The list ends with a block index and a summary of its paths, so search_file() can find a path without reading every record. @see struct checksum_index<br>
+ * The smallest record of every file is picked with a loser tree, which takes one comparison per level of the tree.<br>
+ * No more than checksum_merge_fan_in() files are read at once. If there are more, groups of that many are merged into longer temporary runs first, as many times as it takes.<br>
  *
  * This function does not free the temporary files. That must be done by the caller.
  * @see create_initial_runs()
@@ -168,11 +501,33 @@ int create_initial_runs(FILE* in_file, struct TMPFILE*** out, size_t* n_files);
  * @param n_files The number of files to merge.
  *
  * @param out_file The output file.
- * This FILE* must be opened in writing binary ("wb") mode.
+ * This FILE* must be opened in writing binary ("wb") mode, and must be empty.
+ *
+ * @param front_code Non-zero to front-code the output. @see CHECKSUM_PATH_SHARED
  *
  * @return 0 on success, or negative on error.
  */
-int merge_files(struct TMPFILE** in, size_t n_files, FILE* out_file);
+int merge_files(struct TMPFILE** in, size_t n_files, FILE* out_file, int front_code);
+
+/**
+ * @brief Sets the most files merge_files() reads at once from now on.<br>
+ * This is not thread-safe, so it should be called before any checksum file is sorted.
+ *
+ * @param max_fan_in The most files to read at once, which is raised to 2 if it is less.<br>
+ * 0 goes back to CHECKSUM_MAX_FAN_IN.
+ *
+ * @return void
+ */
+void checksum_set_max_fan_in(size_t max_fan_in);
+
+/**
+ * @brief Returns the most files merge_files() reads at once.<br>
+ * This is CHECKSUM_MAX_FAN_IN or what checksum_set_max_fan_in() set, unless the file descriptor limit or CHECKSUM_MERGE_MEMORY allow fewer.<br>
+ * The soft file descriptor limit is raised if it is too low and the hard limit allows it.
+ *
+ * @return The fan-in, which is at least 2.
+ */
+size_t checksum_merge_fan_in(void);
 
 /**
  * @brief Searches a sorted checksum list for a filename, and returns its checksum if it exists.
@@ -191,4 +546,24 @@ int merge_files(struct TMPFILE** in, size_t n_files, FILE* out_file);
  */
 int search_file(FILE* fp, const char* key, char** checksum);
 
+/**
+ * @brief Searches a sorted checksum list for a filename, and returns its whole entry if it exists.<br>
+ * This is identical to search_file(), except the element's metadata is also returned.<br>
+ * The summary of the last file searched is kept in memory, so searching the same file again does not load it again. @see struct checksum_index
+ * @see search_file()
+ *
+ * @param fp A sorted checksum list.<br>
+ * This FILE* must be opened in reading binary ("rb") mode.<br>
+ * Undefined behavior if this list is not sorted.
+ *
+ * @param key The filename to search for.
+ *
+ * @param out A pointer to the output element.<br>
+ * This will be set to NULL if the key could not be found or there was an error.<br>
+ * Otherwise, the element must be freed with free_element() when no longer in use.
+ *
+ * @return 0 on success, positive if the entry could not be found, negative on error.
+ */
+int search_file_element(FILE* fp, const char* key, struct element** out);
+
 #endif
@@ -0,0 +1,477 @@
+/** @file chunkstore.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "chunkstore.h"
+#include "pipeline.h"
+#include "checksum.h"
+#include "crypt/base16.h"
+#include "filehelper.h"
+#include "strings/stringhelper.h"
+#include "treehash.h"
+#include "log.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+
+/* boundaries are harder to hit before CHUNK_AVG_SIZE and easier after it,
+ * which keeps most chunks close to the average (FastCDC's normalized chunking)
+ * the top bits are used since they depend on the most bytes of the rolling window */
+#define CHUNK_MASK_SMALL (0xFFFFC000UL)
+#define CHUNK_MASK_LARGE (0xFFFC0000UL)
+
+static uint32_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+/* the table only has to be random-looking and the same on every run,
+ * otherwise chunks from a previous backup would never match */
+static void gear_init(void){
+	uint32_t x = 0x2545F491UL;
+	size_t i;
+
+	for (i = 0; i < sizeof(gear) / sizeof(gear[0]); ++i){
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		gear[i] = x;
+	}
+}
+
+size_t chunk_boundary(const unsigned char* data, size_t len){
+	uint32_t hash = 0;
+	size_t normal;
+	size_t i;
+
+	if (len <= CHUNK_MIN_SIZE){
+		return len;
+	}
+	if (len > CHUNK_MAX_SIZE){
+		len = CHUNK_MAX_SIZE;
+	}
+	normal = len < CHUNK_AVG_SIZE ? len : CHUNK_AVG_SIZE;
+
+	pthread_once(&gear_once, gear_init);
+
+	for (i = CHUNK_MIN_SIZE; i < normal; ++i){
+		hash = (hash << 1) + gear[data[i]];
+		if (!(hash & CHUNK_MASK_SMALL)){
+			return i + 1;
+		}
+	}
+	for (; i < len; ++i){
+		hash = (hash << 1) + gear[data[i]];
+		if (!(hash & CHUNK_MASK_LARGE)){
+			return i + 1;
+		}
+	}
+	return len;
+}
+
+static char* make_chunk_path(const char* chunk_dir, const char* hex){
+	char prefix[3];
+
+	prefix[0] = hex[0];
+	prefix[1] = hex[1];
+	prefix[2] = '\0';
+	return sh_concat_path(sh_concat_path(sh_dup(chunk_dir), prefix), hex);
+}
+
+static int digest_bytes(const EVP_MD* md, const void* data, size_t len, char** out){
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned digest_len;
+
+	if (EVP_Digest(data, len, digest, &digest_len, md, NULL) != 1){
+		log_error("Failed to calculate chunk checksum");
+		ERR_print_errors_fp(stderr);
+		return -1;
+	}
+	if (to_base16(digest, digest_len, out) != 0){
+		log_error("Failed to convert checksum bytes to string");
+		return -1;
+	}
+	return 0;
+}
+
+/* gives every in-progress chunk its own temporary name,
+ * since two threads can be writing the same new chunk at once */
+static unsigned long next_temp_id(void){
+	static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+	static unsigned long counter = 0;
+	unsigned long ret;
+
+	pthread_mutex_lock(&mutex);
+	ret = counter++;
+	pthread_mutex_unlock(&mutex);
+	return ret;
+}
+
+/* returns 1 if the chunk was added, 0 if it was already there, or negative on failure */
+static int store_chunk(const unsigned char* data, size_t len, const char* path, const struct options* opt, const char* password){
+	struct pipeline* pl = NULL;
+	char* parent = NULL;
+	char* path_tmp = NULL;
+	int ret = 1;
+
+	if (file_exists(path)){
+		return 0;
+	}
+
+	parent = sh_parent_dir(path);
+	if (!parent || mkdir_recursive(parent) < 0){
+		log_error_ex("Failed to create chunk directory for %s", path);
+		ret = -1;
+		goto cleanup;
+	}
+
+	path_tmp = sh_sprintf("%s.%lu.%lu.tmp", path, (unsigned long)getpid(), next_temp_id());
+	if (!path_tmp){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (!(pl = pipeline_open(path_tmp, opt, password))){
+		ret = -1;
+		goto cleanup;
+	}
+	if (pipeline_write(pl, data, len) != 0){
+		pipeline_abort(pl);
+		ret = -1;
+		goto cleanup;
+	}
+	if (pipeline_close(pl) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+
+	/* the chunk only appears under its real name once it is complete,
+	 * so an interrupted backup never leaves a truncated chunk behind */
+	if (rename(path_tmp, path) != 0){
+		log_error_ex2("Failed to rename %s to %s", path_tmp, path);
+		remove(path_tmp);
+		ret = -1;
+		goto cleanup;
+	}
+
+cleanup:
+	free(parent);
+	free(path_tmp);
+	return ret;
+}
+
+int chunk_store_file(const char* in, const char* manifest, const char* chunk_dir, const struct options* opt, const char* password, char** out_hash, struct string_array** out_new_chunks){
+	const EVP_MD* md;
+	const EVP_MD* chunk_md;
+	unsigned char* buffer = NULL;
+	size_t buffer_fill = 0;
+	int eof = 0;
+	struct tree_hash* th = NULL;
+	struct source_file* sf_in = NULL;
+	FILE* fp_manifest = NULL;
+	struct string_array* new_chunks = NULL;
+	int ret = 0;
+
+	return_ifnull(in, -1);
+	return_ifnull(manifest, -1);
+	return_ifnull(chunk_dir, -1);
+	return_ifnull(opt, -1);
+
+	md = opt->hash_algorithm ? opt->hash_algorithm : EVP_sha1();
+	/* two different chunks with the same name would silently corrupt every file that uses either one */
+	chunk_md = evp_md_is_cryptographic(md) ? md : EVP_sha256();
+	if (out_hash){
+		*out_hash = NULL;
+	}
+	if (out_new_chunks){
+		*out_new_chunks = NULL;
+	}
+
+	buffer = malloc(CHUNK_MAX_SIZE);
+	if (!buffer){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (out_new_chunks && !(new_chunks = sa_new())){
+		log_error("Failed to create new chunk list");
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (out_hash && !(th = tree_hash_new(md, opt->flags.bits.flag_tree_hash ? TREE_HASH_SEGMENT_LEN : 0))){
+		ret = -1;
+		goto cleanup;
+	}
+
+	sf_in = source_open(in, 0);
+	if (!sf_in){
+		ret = -1;
+		goto cleanup;
+	}
+
+	fp_manifest = fopen(manifest, "wb");
+	if (!fp_manifest){
+		log_efopen(manifest);
+		ret = -1;
+		goto cleanup;
+	}
+	fprintf(fp_manifest, "%s\n", CHUNK_MANIFEST_HEADER);
+
+	for (;;){
+		char* hex = NULL;
+		char* chunk_path = NULL;
+		size_t len;
+		int res;
+
+		/* the buffer has to be full for the boundary to be where it would be in the middle of any other file */
+		while (!eof && buffer_fill < CHUNK_MAX_SIZE){
+			int n = source_read(sf_in, buffer + buffer_fill, CHUNK_MAX_SIZE - buffer_fill);
+			if (n < 0){
+				ret = -1;
+				goto cleanup;
+			}
+			if (n <= 0){
+				eof = 1;
+				break;
+			}
+			if (th && tree_hash_update(th, buffer + buffer_fill, n) != 0){
+				ret = -1;
+				goto cleanup;
+			}
+			buffer_fill += n;
+		}
+		if (buffer_fill == 0){
+			break;
+		}
+
+		len = chunk_boundary(buffer, buffer_fill);
+
+		if (digest_bytes(chunk_md, buffer, len, &hex) != 0 || !(chunk_path = make_chunk_path(chunk_dir, hex))){
+			log_error_ex("Failed to name a chunk of %s", in);
+			free(hex);
+			ret = -1;
+			goto cleanup;
+		}
+
+		res = store_chunk(buffer, len, chunk_path, opt, password);
+		if (res < 0){
+			log_error_ex("Failed to store a chunk of %s", in);
+		}
+		else if (res > 0 && new_chunks && sa_add(new_chunks, chunk_path) != 0){
+			log_error("Failed to add chunk to new chunk list");
+			res = -1;
+		}
+		if (res >= 0 && fprintf(fp_manifest, "%s %lu\n", hex, (unsigned long)len) < 0){
+			log_efwrite(manifest);
+			res = -1;
+		}
+		free(hex);
+		free(chunk_path);
+		if (res < 0){
+			ret = -1;
+			goto cleanup;
+		}
+
+		memmove(buffer, buffer + len, buffer_fill - len);
+		buffer_fill -= len;
+	}
+
+	if (th && tree_hash_final(th, out_hash) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+
+cleanup:
+	free(buffer);
+	tree_hash_free(th);
+	source_close(sf_in);
+	if (fp_manifest && fclose(fp_manifest) != 0){
+		log_efclose(manifest);
+		ret = -1;
+	}
+	if (ret != 0){
+		/* chunks that were already stored are left alone, since another file may be using them by now */
+		fp_manifest ? remove(manifest) : 0;
+		if (out_hash){
+			free(*out_hash);
+			*out_hash = NULL;
+		}
+		new_chunks ? sa_free(new_chunks) : (void)0;
+		new_chunks = NULL;
+	}
+	if (out_new_chunks){
+		*out_new_chunks = new_chunks;
+	}
+	return ret;
+}
+
+int is_chunk_manifest(const char* file){
+	char line[sizeof(CHUNK_MANIFEST_HEADER) + 1];
+	FILE* fp;
+	int ret;
+
+	fp = fopen(file, "rb");
+	if (!fp){
+		return 0;
+	}
+	ret = fgets(line, sizeof(line), fp) && strcmp(line, CHUNK_MANIFEST_HEADER"\n") == 0;
+	fclose(fp);
+	return ret;
+}
+
+struct chunk_out{
+	int(*sink)(const void* data, size_t len, void* sink_data);
+	void* sink_data;
+	size_t total;
+};
+
+static int chunk_sink(const void* data, size_t len, void* sink_data){
+	struct chunk_out* co = sink_data;
+
+	co->total += len;
+	return co->sink(data, len, co->sink_data);
+}
+
+/* decrypts and decompresses a single chunk and hands it to the sink */
+static int restore_chunk(const char* path, size_t len, struct chunk_out* co, const struct options* opt, const char* password){
+	co->total = 0;
+
+	if (pipeline_restore_stream(path, opt, password, chunk_sink, co) != 0){
+		log_error_ex("Failed to restore chunk %s", path);
+		return -1;
+	}
+
+	if (co->total != len){
+		log_error_ex("Chunk %s does not have the length listed in the manifest", path);
+		return -1;
+	}
+	return 0;
+}
+
+int chunk_restore_stream(const char* manifest, const char* chunk_dir, const struct options* opt, const char* password, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	/* two digits per byte, a space, a length, and a newline */
+	char line[EVP_MAX_MD_SIZE * 2 + 32];
+	FILE* fp_manifest = NULL;
+	struct chunk_out co;
+	int ret = 0;
+
+	return_ifnull(manifest, -1);
+	return_ifnull(chunk_dir, -1);
+	return_ifnull(opt, -1);
+	return_ifnull(sink, -1);
+
+	co.sink = sink;
+	co.sink_data = sink_data;
+
+	fp_manifest = fopen(manifest, "rb");
+	if (!fp_manifest){
+		log_efopen(manifest);
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (!fgets(line, sizeof(line), fp_manifest) || strcmp(line, CHUNK_MANIFEST_HEADER"\n") != 0){
+		log_error_ex("%s is not a chunk manifest", manifest);
+		ret = -1;
+		goto cleanup;
+	}
+
+	while (fgets(line, sizeof(line), fp_manifest)){
+		char* chunk_path;
+		char* endptr;
+		char* space;
+		unsigned long len;
+		int res;
+
+		space = strchr(line, ' ');
+		if (!space || space - line < 2){
+			log_error_ex("%s is corrupt", manifest);
+			ret = -1;
+			goto cleanup;
+		}
+		*space = '\0';
+		len = strtoul(space + 1, &endptr, 10);
+		if (*endptr != '\n'){
+			log_error_ex("%s is corrupt", manifest);
+			ret = -1;
+			goto cleanup;
+		}
+
+		if (!(chunk_path = make_chunk_path(chunk_dir, line))){
+			log_enomem();
+			ret = -1;
+			goto cleanup;
+		}
+		res = restore_chunk(chunk_path, len, &co, opt, password);
+		free(chunk_path);
+		if (res != 0){
+			ret = -1;
+			goto cleanup;
+		}
+	}
+	if (ferror(fp_manifest)){
+		log_efread(manifest);
+		ret = -1;
+		goto cleanup;
+	}
+
+cleanup:
+	fp_manifest ? fclose(fp_manifest) : 0;
+	return ret;
+}
+
+static int file_sink(const void* data, size_t len, void* sink_data){
+	FILE* fp = sink_data;
+
+	if (write_sparse(fp, data, len) != 0){
+		log_efwrite("output file");
+		return -1;
+	}
+	return 0;
+}
+
+int chunk_restore_file(const char* manifest, const char* chunk_dir, const char* out, const struct options* opt, const char* password){
+	FILE* fp_out = NULL;
+	int ret = 0;
+
+	return_ifnull(manifest, -1);
+	return_ifnull(out, -1);
+
+	/* not a manifest, so the output file is not touched */
+	if (!is_chunk_manifest(manifest)){
+		log_error_ex("%s is not a chunk manifest", manifest);
+		return -1;
+	}
+
+	fp_out = fopen(out, "wb");
+	if (!fp_out){
+		log_efopen(out);
+		return -1;
+	}
+
+	ret = chunk_restore_stream(manifest, chunk_dir, opt, password, file_sink, fp_out);
+	if (ret == 0 && finish_sparse(fp_out) != 0){
+		log_efwrite(out);
+		ret = -1;
+	}
+
+	if (fclose(fp_out) != 0){
+		log_efclose(out);
+		ret = -1;
+	}
+	if (ret != 0){
+		remove(out);
+	}
+	return ret;
+}
@@ -0,0 +1,137 @@
+/** @file chunkstore.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __CHUNKSTORE_H
+#define __CHUNKSTORE_H
+
+#include "options/options.h"
+#include "strings/stringarray.h"
+#include <stddef.h>
+
+/**
+ * @brief A chunk is never cut before this many bytes, unless the file ends first.
+ */
+#define CHUNK_MIN_SIZE (16 * 1024)
+/**
+ * @brief The size that chunk boundaries are tuned to land around.
+ */
+#define CHUNK_AVG_SIZE (64 * 1024)
+/**
+ * @brief A chunk is always cut after this many bytes.
+ */
+#define CHUNK_MAX_SIZE (256 * 1024)
+
+/**
+ * @brief The first line of every chunk manifest.
+ */
+#define CHUNK_MANIFEST_HEADER "EZBACKUP-CHUNKS 1"
+
+/**
+ * @brief Finds where the next chunk ends using content-defined chunking (FastCDC).<br>
+ * The boundary depends only on the bytes around it, so an insertion or deletion only changes the chunks next to it.
+ *
+ * @param data The data to split.
+ *
+ * @param len The length of the data in bytes.<br>
+ * Unless the data is the end of a file, this should be at least CHUNK_MAX_SIZE, or the boundary will be cut short.
+ *
+ * @return The length of the first chunk in bytes. This is never more than len or CHUNK_MAX_SIZE.
+ */
+size_t chunk_boundary(const unsigned char* data, size_t len);
+
+/**
+ * @brief Splits a file into chunks, adds the ones not already in the chunk store, and writes a manifest describing the file.<br>
+ * Each chunk is named after the hex digest of its plaintext and stored in chunk_dir/XX/DIGEST, where XX is the first two digits of the digest.<br>
+ * Chunks are named with opt->hash_algorithm, or with SHA-256 if it is not cryptographic.<br>
+ * A stored chunk has the same format as a file written by pipeline_backup_file().<br>
+ * <br>
+ * The manifest is a text file that starts with CHUNK_MANIFEST_HEADER.<br>
+ * Each line after it has the following format:<br>
+ * DIGEST LENGTH<br>
+ * where LENGTH is the plaintext length of the chunk in decimal.
+ * @see chunk_restore_file()
+ *
+ * @param in Path to the file to back up.
+ *
+ * @param manifest Path to write the manifest to.<br>
+ * If this file already exists, it will be overwritten.<br>
+ * If this function fails, the manifest is removed.
+ *
+ * @param chunk_dir The root of the chunk store.
+ *
+ * @param opt The options to use. The hash algorithm, compressor, compression level/flags, and encryption algorithm are read from this structure.
+ *
+ * @param password The encryption password to use.<br>
+ * If this is NULL and the chunks are encrypted, the user is asked for a password for every new chunk.
+ *
+ * @param out_hash A pointer to a string that will contain the hexadecimal digest of the whole file, computed with opt->hash_algorithm.<br>
+ * This can be NULL if the digest is not needed.<br>
+ * Otherwise, the string must be free()'d when no longer in use. It is set to NULL on failure.
+ *
+ * @param out_new_chunks A pointer to a string array that will contain the paths of the chunks this call added to the store.<br>
+ * This can be NULL if the paths are not needed.<br>
+ * Otherwise, the array must be free()'d with sa_free() when no longer in use. It is set to NULL on failure.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int chunk_store_file(const char* in, const char* manifest, const char* chunk_dir, const struct options* opt, const char* password, char** out_hash, struct string_array** out_new_chunks);
+
+/**
+ * @brief Checks if a file is a chunk manifest written by chunk_store_file().
+ *
+ * @param file Path to the file to check.
+ *
+ * @return 1 if the file is a chunk manifest, or 0 if it is not or could not be read.
+ */
+int is_chunk_manifest(const char* file);
+
+/**
+ * @brief Rebuilds a file from its manifest and the chunk store.
+ * @see chunk_store_file()
+ *
+ * @param manifest Path to a manifest written by chunk_store_file().
+ *
+ * @param chunk_dir The root of the chunk store.
+ *
+ * @param out Path to write the original file to.<br>
+ * If this file already exists, it will be overwritten.<br>
+ * If this function fails, the output file is removed.
+ *
+ * @param opt The options the chunks were stored with.
+ *
+ * @param password The decryption password to use.<br>
+ * If this is NULL and the chunks are encrypted, the user is asked for a password for every chunk.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int chunk_restore_file(const char* manifest, const char* chunk_dir, const char* out, const struct options* opt, const char* password);
+
+/**
+ * @brief Rebuilds a file from its manifest and the chunk store, handing its data to a callback instead of writing it to disk.
+ * @see chunk_restore_file()
+ *
+ * @param manifest Path to a manifest written by chunk_store_file().
+ *
+ * @param chunk_dir The root of the chunk store.
+ *
+ * @param opt The options the chunks were stored with.
+ *
+ * @param password The decryption password to use.<br>
+ * If this is NULL and the chunks are encrypted, the user is asked for a password for every chunk.
+ *
+ * @param sink A function that receives each block of the original file, in order.<br>
+ * It must return 0 on success or non-zero to abort.
+ *
+ * @param sink_data An argument to pass to sink.
+ *
+ * @return 0 on success, or negative on failure.<br>
+ * On failure, the sink may already have received part of the data.
+ */
+int chunk_restore_stream(const char* manifest, const char* chunk_dir, const struct options* opt, const char* password, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data);
+
+#endif
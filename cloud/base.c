@@ -8,13 +8,21 @@
 
 #include "base.h"
 #include "../cli.h"
+#include "../filehelper.h"
 #include "../crypt/crypt_getpassword.h"
 #include "../readline_include.h"
 #include "../options/options.h"
 #include "../log.h"
+#include "../stats.h"
 #include "../strings/stringhelper.h"
 #include "mega.h"
+#include "pathcache.h"
+#include "ratelimit.h"
+#include "s3.h"
 #include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,19 +30,41 @@
 struct cloud_functions{
 	int (*login)   (const char* username, const char* password, void** out_handle);
 	int (*mkdir)   (const char* directory, void* handle);
-	int (*readdir) (const char* directory, char*** output, size_t* output_len, void* handle);
+	/* output_st can be NULL, otherwise it gets every entry's metadata from the same listing */
+	int (*readdir) (const char* directory, char*** output, struct stat** output_st, size_t* output_len, void* handle);
 	int (*stat)    (const char* file_path, struct stat* out, void* handle);
 	int (*rename)  (const char* old_path, const char* new_path, void* handle);
 	int (*download)(const char* download_path, const char* out_path, const char* progress_msg, void* handle);
 	int (*upload)  (const char* in_file, const char* upload_path, const char* progress_msg, void* handle);
 	int (*remove)  (const char* file_path, void* handle);
 	int (*logout)  (void* handle);
+	/* start a transfer and return without waiting for it, calling done once it finishes
+	 * NULL if the provider can only transfer one file at a time */
+	int (*upload_start)  (const char* in_file, const char* upload_path, void (*done)(int res, void* data), void* data, void* handle);
+	int (*download_start)(const char* download_path, const char* out_path, void (*done)(int res, void* data), void* data, void* handle);
+	int (*rename_start)  (const char* old_path, const char* new_path, void (*done)(int res, void* data), void* data, void* handle);
+	/* upload data as it is written instead of from a file
+	 * NULL if the provider can only upload files */
+	int (*upload_stream_open) (const char* upload_path, void** out_stream, void* handle);
+	int (*upload_stream_write)(void* stream, const void* data, size_t len);
+	int (*upload_stream_close)(void* stream, int discard);
+	/* limit every upload to a rate in bytes per second, or 0 for unlimited
+	 * NULL if the provider cannot limit its uploads */
+	void (*set_upload_limit)(uint64_t bytes_per_sec, void* handle);
+	/* hand a download to a sink in order as it arrives instead of writing it to a file
+	 * NULL if the provider can only download to files, in which case streamed downloads go through a temporary file */
+	int (*download_stream)      (const char* download_path, int (*sink)(const void* data, size_t len, void* sink_data), void* sink_data, void* handle);
+	int (*download_stream_start)(const char* download_path, int (*sink)(const void* data, size_t len, void* sink_data), void* sink_data, void (*done)(int res, void* data), void* data, void* handle);
 };
 
 struct cloud_data{
 	void* handle;
 	const struct cloud_functions* cf;
 	const char* name;
+	/* the remote paths looked up or created so far, which everything that changes a path has to invalidate */
+	struct path_cache* pc;
+	/* the upload rate at each time of day, or NULL if uploads are not limited */
+	struct rate_schedule* rs;
 };
 
 static int login_null(const char* username, const char* password, void** out_handle){
@@ -48,9 +78,12 @@ static int mkdir_null(const char* directory, void* handle) {
 	(void)handle;
 	return 0;
 }
-static int readdir_null(const char* directory, char*** output, size_t* output_len, void* handle){
+static int readdir_null(const char* directory, char*** output, struct stat** output_st, size_t* output_len, void* handle){
 	(void)directory;
 	*output = NULL;
+	if (output_st){
+		*output_st = NULL;
+	}
 	*output_len = 0;
 	(void)handle;
 	return 0;
@@ -99,7 +132,16 @@ static const struct cloud_functions CF_NULL = {
 	download_null,
 	upload_null,
 	remove_null,
-	logout_null
+	logout_null,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL
 };
 static const struct cloud_functions CF_MEGA = {
 	MEGAlogin,
@@ -110,7 +152,36 @@ static const struct cloud_functions CF_MEGA = {
 	MEGAdownload,
 	MEGAupload,
 	MEGArm,
-	MEGAlogout
+	MEGAlogout,
+	MEGAupload_start,
+	MEGAdownload_start,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	MEGAset_upload_limit,
+	NULL,
+	NULL
+};
+static const struct cloud_functions CF_S3 = {
+	S3login,
+	S3mkdir,
+	S3readdir,
+	S3stat,
+	S3rename,
+	S3download,
+	S3upload,
+	S3rm,
+	S3logout,
+	S3upload_start,
+	S3download_start,
+	S3rename_start,
+	S3upload_stream_open,
+	S3upload_stream_write,
+	S3upload_stream_close,
+	S3set_upload_limit,
+	S3download_stream,
+	S3download_stream_start
 };
 static const struct cloud_functions* cloud_provider_to_cloud_functions(enum cloud_provider cp){
 	switch (cp){
@@ -118,6 +189,8 @@ static const struct cloud_functions* cloud_provider_to_cloud_functions(enum clou
 		return &CF_NULL;
 	case CLOUD_MEGA:
 		return &CF_MEGA;
+	case CLOUD_S3:
+		return &CF_S3;
 	default:
 		log_error("Invalid CLOUD_PROVIDER specified");
 		return NULL;
@@ -183,7 +256,7 @@ static char* size_tostring(uint64_t size){
 	return sh_sprintf(specifier_ptr == 0 ? "%.0f %s" : "%.2f %s", d_size, specifiers[specifier_ptr]);
 }
 
-static int confirm_dialog(char* file, int directory, uint64_t size, void* handle, const struct cloud_functions* cf){
+static int confirm_dialog(char* file, int directory, uint64_t size, struct cloud_data* cd){
 	const char* dialog_buttons[] = {
 		"Yes",
 		"No"
@@ -198,8 +271,8 @@ static int confirm_dialog(char* file, int directory, uint64_t size, void* handle
 		return 1;
 	}
 
-	if (cf->stat(file, &st, handle) != 0){
-		log_warning_ex("%s: Failed to stat %s", file);
+	if (cloud_stat(file, &st, cd) != 0){
+		log_warning_ex2("%s: Failed to stat %s", cd->name, file);
 	}
 	else{
 		char* size_str = size_tostring(size);
@@ -221,6 +294,58 @@ static int confirm_dialog(char* file, int directory, uint64_t size, void* handle
 	return res == 0;
 }
 
+/* the listing that filled the cache already said what each entry is */
+static int entry_is_dir(const char* entry, struct cloud_data* cd){
+	struct stat st;
+
+	switch (pc_lookup(cd->pc, entry, NULL)){
+	case PC_DIR:
+		return 1;
+	case PC_FILE:
+	case PC_ABSENT:
+		return 0;
+	default:
+		break;
+	}
+	if (cloud_stat(entry, &st, cd) != 0){
+		log_warning_ex("Failed to stat %s", entry);
+		return 0;
+	}
+	return S_ISDIR(st.st_mode);
+}
+
+/* lists a directory from the path cache, only asking the cloud the first time it is browsed in a session
+ * the listing comes with what each entry is, which is cached so the menu does not look them up one by one */
+static int cloud_readdir(const char* dir, char*** entries, size_t* entries_len, struct cloud_data* cd){
+	struct stat* st = NULL;
+	size_t i;
+	int res;
+
+	if ((res = pc_list(cd->pc, dir, entries, entries_len)) <= 0){
+		return res;
+	}
+
+	if (cd->cf->readdir(dir, entries, &st, entries_len, cd->handle) != 0){
+		log_error_ex2("%s: Failed to read directory %s", cd->name, dir);
+		return -1;
+	}
+	if (pc_set_dir(cd->pc, dir) != 0){
+		free(st);
+		return 0;
+	}
+	for (i = 0; i < *entries_len; ++i){
+		if (!st || pc_set_stat(cd->pc, (*entries)[i], &st[i]) != 0){
+			break;
+		}
+	}
+	/* only a listing that made it into the cache in full says what is not there */
+	if (i == *entries_len){
+		pc_set_listed(cd->pc, dir);
+	}
+	free(st);
+	return 0;
+}
+
 /* if (directories_only){
  *     [Select current directory]
  *     [Parent directory]
@@ -237,7 +362,7 @@ static int confirm_dialog(char* file, int directory, uint64_t size, void* handle
  *     file2.txt
  * }
  */
-static struct string_array* create_menu_entries(const char* base_dir, char*** entries, size_t* entries_len, void* handle, const struct cloud_functions* cf, int directories_only){
+static struct string_array* create_menu_entries(const char* base_dir, char*** entries, size_t* entries_len, struct cloud_data* cd, int directories_only){
 	/* final menu entries output */
 	struct string_array* sa_final = sa_new();
 	/* final actual directory entries output */
@@ -276,12 +401,7 @@ static struct string_array* create_menu_entries(const char* base_dir, char*** en
 
 	/* add directories to sa_dir and if (!directories_only){files to sa_file} */
 	for (i = 0; i < *entries_len; ++i){
-		struct stat st;
-		if (cf->stat((*entries)[i], &st, handle) != 0){
-			log_warning_ex("Failed to stat %s", (*entries)[i]);
-		}
-
-		if (S_ISDIR(st.st_mode)){
+		if (entry_is_dir((*entries)[i], cd)){
 			sa_add(sa_dir, (*entries)[i]);
 		}
 		else if (!directories_only){
@@ -319,27 +439,73 @@ static struct string_array* create_menu_entries(const char* base_dir, char*** en
 	return sa_final;
 }
 
+/* forgets what was known about a path that was just uploaded to, which can be a directory the file went into */
+static void forget_upload(const char* in_file, const char* upload_path, int res, struct cloud_data* cd){
+	if (pc_lookup(cd->pc, upload_path, NULL) == PC_DIR){
+		char* path = sh_concat_path(sh_dup(upload_path), sh_filename(in_file));
+
+		/* without the file's own path, all of the directory has to go */
+		if (!path || res != 0 || pc_set_file(cd->pc, path) != 0){
+			pc_invalidate(cd->pc, path ? path : upload_path);
+		}
+		free(path);
+		return;
+	}
+	/* a finished upload is known to be there, which keeps its directory listed */
+	if (res != 0 || pc_set_file(cd->pc, upload_path) != 0){
+		pc_invalidate(cd->pc, upload_path);
+	}
+}
+
+/* forgets what was known about both ends of a rename */
+static void forget_rename(const char* _old, const char* _new, int was_file, int res, struct cloud_data* cd){
+	/* even a failed rename may have done part of the job */
+	pc_invalidate(cd->pc, _old);
+	pc_invalidate(cd->pc, _new);
+	/* a file has nothing under it, so where it went is all there is to know */
+	if (res == 0 && was_file){
+		pc_set_file(cd->pc, _new);
+		pc_set_absent(cd->pc, _old);
+	}
+}
+
 int cloud_mkdir(const char* dir, struct cloud_data* cd){
-	struct string_array* parent_dirs = sa_get_parent_dirs(dir);
+	struct string_array* parent_dirs = NULL;
 	long i;
 	int ret = 0;
 
+	/* the directories a backup uploads to are asked for again with every file */
+	if (pc_lookup(cd->pc, dir, NULL) == PC_DIR){
+		return 0;
+	}
+
+	parent_dirs = sa_get_parent_dirs(dir);
 	if (!parent_dirs){
 		log_error("Failed to create parent directories");
 		return -1;
 	}
 
 	for (i = (long)(parent_dirs->len - 1); i >= 0; --i){
-		if (cd->cf->stat(parent_dirs->strings[i], NULL, cd->handle) == 0){
+		if (cloud_stat(parent_dirs->strings[i], NULL, cd) == 0){
 			break;
 		}
 	}
 	++i;
 	for (; i < (long)parent_dirs->len; ++i){
-		if (cd->cf->mkdir(parent_dirs->strings[i], cd->handle) != 0){
+		int res = cd->cf->mkdir(parent_dirs->strings[i], cd->handle);
+
+		if (res < 0 || (res > 0 && cloud_stat(parent_dirs->strings[i], NULL, cd) != 0)){
 			log_warning_ex2("%s: Failed to create directory %s", cd->name, parent_dirs->strings[i]);
+			pc_invalidate(cd->pc, parent_dirs->strings[i]);
 			ret = -1;
 		}
+		else{
+			pc_set_dir(cd->pc, parent_dirs->strings[i]);
+			/* a directory that was just made is empty, so nothing in it has to be looked up */
+			if (res == 0){
+				pc_set_listed(cd->pc, parent_dirs->strings[i]);
+			}
+		}
 	}
 	sa_free(parent_dirs);
 	return ret;
@@ -379,8 +545,12 @@ int cloud_mkdir_ui(const char* base_dir, char** chosen_dir, struct cloud_data* c
 	for (i = 0; i < parent_dirs->len; ++i){
 		if (cd->cf->mkdir(parent_dirs->strings[i], cd->handle) < 0){
 			log_warning_ex2("%s: Failed to make parent directory %s", cd->name, parent_dirs->strings[i]);
+			pc_invalidate(cd->pc, parent_dirs->strings[i]);
 			ret = -1;
 		}
+		else{
+			pc_set_dir(cd->pc, parent_dirs->strings[i]);
+		}
 	}
 
 cleanup:
@@ -404,23 +574,52 @@ cleanup:
 int cloud_stat(const char* dir_or_file, struct stat* out, struct cloud_data* cd){
 	struct stat st;
 	int res;
+
+	switch (pc_lookup(cd->pc, dir_or_file, out)){
+	case PC_FILE:
+	case PC_DIR:
+		return 0;
+	case PC_ABSENT:
+		return 1;
+	default:
+		break;
+	}
+
 	if ((res = cd->cf->stat(dir_or_file, out ? out : &st, cd->handle)) < 0){
 		log_debug_ex2("%s: Failed to stat %s", cd->name, dir_or_file);
 	}
+	else if (res == 0){
+		pc_set_stat(cd->pc, dir_or_file, out ? out : &st);
+	}
+	else{
+		pc_set_absent(cd->pc, dir_or_file);
+	}
 	return res;
 }
 
+int cloud_assume_file(const char* file, struct cloud_data* cd){
+	return_ifnull(file, -1);
+	return_ifnull(cd, -1);
+	return pc_set_file(cd->pc, file);
+}
+
 int cloud_rename(const char* _old, const char* _new, struct cloud_data* cd){
-	if (cd->cf->stat(_old, NULL, cd->handle) != 0){
+	int was_file;
+	int res;
+
+	if (cloud_stat(_old, NULL, cd) != 0){
 		log_debug_ex2("%s: File to be renamed (%s) does not exist.", cd->name, _old);
 		return -1;
 	}
-	if (cd->cf->stat(_new, NULL, cd->handle) == 0){
+	if (cloud_stat(_new, NULL, cd) == 0){
 		log_debug_ex2("%s: Destination of rename (%s) already exists.", cd->name, _new);
 		return -1;
 	}
 
-	if (cd->cf->rename(_old, _new, cd->handle) != 0){
+	was_file = pc_lookup(cd->pc, _old, NULL) == PC_FILE;
+	res = cd->cf->rename(_old, _new, cd->handle);
+	forget_rename(_old, _new, was_file, res, cd);
+	if (res != 0){
 		log_warning_ex("%s: Failed to rename file", cd->name);
 		return -1;
 	}
@@ -449,13 +648,13 @@ static int cloud_readdir_choosedir(const char* base_dir, char** output, struct c
 		entries = NULL;
 		entries_len = 0;
 
-		if (cd->cf->readdir(current_directory, &entries, &entries_len, cd->handle) != 0){
+		if (cloud_readdir(current_directory, &entries, &entries_len, cd) != 0){
 			log_error("Failed to read directory");
 			ret = -1;
 			goto cleanup;
 		}
 
-		if ((menu_entries = create_menu_entries(current_directory, &entries, &entries_len, cd->handle, cd->cf, 1)) == NULL){
+		if ((menu_entries = create_menu_entries(current_directory, &entries, &entries_len, cd, 1)) == NULL){
 			log_error("Failed to create menu entries");
 			ret = -1;
 			goto cleanup;
@@ -488,7 +687,7 @@ static int cloud_readdir_choosedir(const char* base_dir, char** output, struct c
 		else{
 			*output = sh_dup(entries[res]);
 		}
-	}while (do_continue || !confirm_dialog(*output, 1, 0, cd->handle, cd->cf));
+	}while (do_continue || !confirm_dialog(*output, 1, 0, cd));
 cleanup:
 	if (ret != 0){
 		free(*output);
@@ -499,7 +698,7 @@ cleanup:
 	return ret;
 }
 
-static int cloud_readdir_choosefile(const char* base_dir, char** output, void* handle, const struct cloud_functions* cf){
+static int cloud_readdir_choosefile(const char* base_dir, char** output, struct cloud_data* cd){
 	char** entries = NULL;
 	size_t entries_len = 0;
 	uint64_t out_file_size = 0;
@@ -524,13 +723,13 @@ static int cloud_readdir_choosefile(const char* base_dir, char** output, void* h
 		sa_free(menu_entries);
 		menu_entries = NULL;
 
-		if (cf->readdir(current_directory, &entries, &entries_len, handle) != 0){
+		if (cloud_readdir(current_directory, &entries, &entries_len, cd) != 0){
 			log_error("Failed to read directory");
 			ret = -1;
 			goto cleanup;
 		}
 
-		if ((menu_entries = create_menu_entries(current_directory, &entries, &entries_len, handle, cf, 0)) == NULL){
+		if ((menu_entries = create_menu_entries(current_directory, &entries, &entries_len, cd, 0)) == NULL){
 			log_error("Failed to create menu entries");
 			ret = -1;
 			goto cleanup;
@@ -545,8 +744,9 @@ static int cloud_readdir_choosefile(const char* base_dir, char** output, void* h
 			break;
 		}
 
-		if (cf->stat(entries[res], &st, handle) != 0){
+		if (cloud_stat(entries[res], &st, cd) != 0){
 			log_warning_ex("Failed to stat %s", entries[res]);
+			memset(&st, 0, sizeof(st));
 		}
 		out_file_size = st.st_size;
 
@@ -559,7 +759,7 @@ static int cloud_readdir_choosefile(const char* base_dir, char** output, void* h
 		else{
 			*output = sh_dup(entries[res]);
 		}
-	}while (do_continue || !confirm_dialog(*output, 0, out_file_size, handle, cf));
+	}while (do_continue || !confirm_dialog(*output, 0, out_file_size, cd));
 cleanup:
 	if (ret != 0){
 		free(*output);
@@ -590,7 +790,7 @@ int cloud_login(const struct cloud_options* co, struct cloud_data** out_cd){
 		goto cleanup;
 	}
 
-	cd = malloc(sizeof(*cd));
+	cd = calloc(1, sizeof(*cd));
 	if (!cd){
 		log_enomem();
 		ret = -1;
@@ -598,6 +798,11 @@ int cloud_login(const struct cloud_options* co, struct cloud_data** out_cd){
 	}
 
 	cd->name = cloud_provider_to_string(co->cp);
+	cd->pc = pc_new();
+	if (!cd->pc){
+		ret = -1;
+		goto cleanup;
+	}
 
 	cd->cf = cloud_provider_to_cloud_functions(co->cp);
 	if (!cd->cf){
@@ -614,6 +819,16 @@ int cloud_login(const struct cloud_options* co, struct cloud_data** out_cd){
 		goto cleanup;
 	}
 
+	if (co->upload_limit){
+		if (!cd->cf->set_upload_limit){
+			log_warning_ex("%s: Uploads cannot be limited", cd->name);
+		}
+		else if (rs_parse(co->upload_limit, &cd->rs) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+	}
+
 cleanup:
 	if (ret == 0){
 		*out_cd = cd;
@@ -627,10 +842,30 @@ cleanup:
 	return ret;
 }
 
+/* limits uploads to whatever the schedule allows right now, so a backup that runs past the end of a window speeds up (or slows down) with its next upload */
+static void apply_upload_limit(struct cloud_data* cd){
+	if (!cd->rs || !cd->cf->set_upload_limit){
+		return;
+	}
+	cd->cf->set_upload_limit(rs_rate_at(cd->rs, time(NULL)), cd->handle);
+}
+
+/* how many seconds to wait before trying a failed transfer again, given how many times it has been retried already */
+static unsigned retry_delay(unsigned retries){
+	unsigned delay = CLOUD_RETRY_DELAY;
+
+	while (retries-- > 0 && delay < CLOUD_RETRY_DELAY_MAX){
+		delay *= 2;
+	}
+	return delay < CLOUD_RETRY_DELAY_MAX ? delay : CLOUD_RETRY_DELAY_MAX;
+}
+
 int cloud_upload(const char* in_file, const char* upload_dir, struct cloud_data* cd){
 	struct string_array* parent_dirs = sa_get_parent_dirs(upload_dir);
 	char* progress_msg = sh_sprintf("%s: Uploading %s to %s...", cd->name, in_file, upload_dir);
+	unsigned retries = 0;
 	int ret = 0;
+	int res;
 
 	if (!parent_dirs){
 		log_error("Failed to create parent dir string_array");
@@ -642,7 +877,17 @@ int cloud_upload(const char* in_file, const char* upload_dir, struct cloud_data*
 		log_warning("Failed to make progress message");
 	}
 
-	if (cd->cf->upload(in_file, upload_dir, progress_msg ? progress_msg : "Uploading file...", cd->handle) != 0){
+	apply_upload_limit(cd);
+	/* the provider resumes an upload of the same file where the last try stopped */
+	while ((res = cd->cf->upload(in_file, upload_dir, progress_msg ? progress_msg : "Uploading file...", cd->handle)) != 0 && retries < CLOUD_TRANSFER_RETRIES){
+		unsigned delay = retry_delay(retries++);
+
+		log_warning_ex2("Failed to upload %s, trying again in %u seconds", in_file, delay);
+		stats_count(COUNTER_CLOUD_RETRIES, 1);
+		sleep(delay);
+	}
+	forget_upload(in_file, upload_dir, res, cd);
+	if (res != 0){
 		log_error_ex2("%s: Failed to upload %s", cd->name, in_file);
 		ret = -1;
 		goto cleanup;
@@ -683,7 +928,10 @@ int cloud_upload_ui(const char* in_file, const char* base_path, char** chosen_pa
 		goto cleanup;
 	}
 
-	if (cd->cf->upload(in_file, upload_dir, progress_msg ? progress_msg : "Uploading file...", cd->handle) != 0){
+	apply_upload_limit(cd);
+	res = cd->cf->upload(in_file, upload_dir, progress_msg ? progress_msg : "Uploading file...", cd->handle);
+	forget_upload(in_file, upload_dir, res, cd);
+	if (res != 0){
 		log_error_ex2("%s: Failed to upload %s", cd->name, in_file);
 		ret = -1;
 		goto cleanup;
@@ -741,7 +989,7 @@ int cloud_download_ui(const char* base_dir, char** out_file, struct cloud_data*
 	int res;
 	int ret = 0;
 
-	res = cloud_readdir_choosefile(base_dir, &download_file, cd->handle, cd->cf);
+	res = cloud_readdir_choosefile(base_dir, &download_file, cd);
 	if (res < 0){
 		log_error("Failed to choose a download file");
 		ret = -1;
@@ -779,8 +1027,479 @@ cleanup:
 	return ret;
 }
 
+struct cloud_transfers{
+	struct cloud_data* cd;
+	size_t max_in_flight;
+	/* guards everything below, and cond is signaled whenever a transfer finishes */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	size_t in_flight;
+	/* how many failed since the last cloud_transfers_wait() */
+	size_t failed;
+	/* failed transfers waiting to be tried again, which still count as in flight
+	 * the provider's thread cannot start them, so whoever waits on cond next does */
+	struct cloud_transfer* retries;
+};
+
+enum transfer_kind{
+	TRANSFER_DOWNLOAD = 0,
+	TRANSFER_UPLOAD = 1,
+	TRANSFER_RENAME = 2,
+	TRANSFER_REMOVE = 3,
+	TRANSFER_STREAM = 4
+};
+
+/* a single transfer in flight */
+struct cloud_transfer{
+	struct cloud_transfers* ct;
+	enum transfer_kind kind;
+	/* the file being transferred or moved, which is also named in the log */
+	char* name;
+	/* where an upload or a move is going, which is forgotten by the path cache once it is done
+	 * or where a download goes, or the same as name for a removal */
+	char* dst;
+	/* a moved path was known to be a file, which the path cache can keep knowing */
+	int was_file;
+	cloud_transfer_done done;
+	void* data;
+	/* where a streamed download goes, and the temporary file it goes through first if the provider cannot stream it */
+	int (*sink)(const void* data, size_t len, void* sink_data);
+	void* sink_data;
+	struct TMPFILE* tmp;
+	unsigned retries;
+	time_t retry_at;
+	struct cloud_transfer* next;
+};
+
+struct cloud_transfers* cloud_transfers_new(struct cloud_data* cd, size_t max_in_flight){
+	struct cloud_transfers* ct;
+
+	return_ifnull(cd, NULL);
+
+	ct = calloc(1, sizeof(*ct));
+	if (!ct){
+		log_enomem();
+		return NULL;
+	}
+	ct->cd = cd;
+	ct->max_in_flight = max_in_flight ? max_in_flight : CLOUD_TRANSFERS_DEFAULT;
+	pthread_mutex_init(&ct->lock, NULL);
+	pthread_cond_init(&ct->cond, NULL);
+	return ct;
+}
+
+static void transfer_free(struct cloud_transfer* t){
+	t->tmp ? temp_fclose(t->tmp) : (void)0;
+	free(t->name);
+	free(t->dst);
+	free(t);
+}
+
+/* hands a streamed download that went through a temporary file to its sink */
+static int transfer_stream_tmp(struct cloud_transfer* t){
+	unsigned char buffer[BUFFER_LEN];
+	FILE* fp;
+	size_t len;
+	int ret = 0;
+
+	fp = fopen(t->dst, "rb");
+	if (!fp){
+		log_efopen(t->dst);
+		return -1;
+	}
+	while ((len = fread(buffer, 1, sizeof(buffer), fp)) > 0){
+		if (t->sink(buffer, len, t->sink_data) != 0){
+			log_error_ex("Failed to hand off %s as it was downloaded", t->name);
+			ret = -1;
+			break;
+		}
+	}
+	if (ret == 0 && ferror(fp)){
+		log_efread(t->dst);
+		ret = -1;
+	}
+	fclose(fp);
+	return ret;
+}
+
+static void transfer_finished(int res, void* data){
+	struct cloud_transfer* t = data;
+	struct cloud_transfers* ct = t->ct;
+
+	/* the sink has part of it now, so it cannot be tried again */
+	if (t->kind == TRANSFER_STREAM && t->tmp && res == 0 && transfer_stream_tmp(t) != 0){
+		res = -1;
+		t->retries = CLOUD_TRANSFER_RETRIES;
+	}
+
+	/* a lookup made while the upload or move was in flight would be out of date now */
+	if (t->kind == TRANSFER_UPLOAD){
+		forget_upload(t->name, t->dst, res, ct->cd);
+	}
+	else if (t->kind == TRANSFER_RENAME){
+		forget_rename(t->name, t->dst, t->was_file, res, ct->cd);
+	}
+	else if (t->kind == TRANSFER_REMOVE){
+		pc_invalidate(ct->cd->pc, t->name);
+		if (res == 0){
+			pc_set_absent(ct->cd->pc, t->name);
+		}
+	}
+
+	/* the slot is kept until the last try, so a retry never waits behind new transfers */
+	if (res != 0 && t->retries < CLOUD_TRANSFER_RETRIES){
+		unsigned delay = retry_delay(t->retries++);
+
+		log_warning_ex2("Failed to transfer %s, trying again in %u seconds", t->name, delay);
+		stats_count(COUNTER_CLOUD_RETRIES, 1);
+		t->retry_at = time(NULL) + delay;
+		pthread_mutex_lock(&ct->lock);
+		t->next = ct->retries;
+		ct->retries = t;
+		pthread_cond_broadcast(&ct->cond);
+		pthread_mutex_unlock(&ct->lock);
+		return;
+	}
+
+	if (res != 0){
+		log_error_ex2("%s: Failed to transfer %s", ct->cd->name, t->name);
+	}
+	/* before the slot is given back, so cloud_transfers_wait() returning means every done has run */
+	if (t->done){
+		t->done(res, t->data);
+	}
+
+	pthread_mutex_lock(&ct->lock);
+	ct->in_flight--;
+	if (res != 0){
+		ct->failed++;
+	}
+	pthread_cond_broadcast(&ct->cond);
+	pthread_mutex_unlock(&ct->lock);
+
+	transfer_free(t);
+}
+
+/* starts a transfer that already has a slot, which finishes (or is retried) through transfer_finished() either way */
+static void transfer_start(struct cloud_transfer* t){
+	const struct cloud_functions* cf = t->ct->cd->cf;
+	void* handle = t->ct->cd->handle;
+	int res;
+
+	int (*start)(const char*, const char*, void (*)(int, void*), void*, void*);
+
+	if (t->kind == TRANSFER_UPLOAD){
+		apply_upload_limit(t->ct->cd);
+	}
+	/* without a stream, it is downloaded to its temporary file like any other download */
+	if (t->kind == TRANSFER_STREAM && cf->download_stream){
+		res = cf->download_stream_start ? cf->download_stream_start(t->name, t->sink, t->sink_data, transfer_finished, t, handle) : 1;
+		if (res > 0){
+			res = cf->download_stream(t->name, t->sink, t->sink_data, handle);
+			transfer_finished(res == 0 ? 0 : -1, t);
+		}
+		else if (res < 0){
+			log_debug_ex2("%s: Failed to start transferring %s", t->ct->cd->name, t->name);
+			transfer_finished(-1, t);
+		}
+		return;
+	}
+	start = t->kind == TRANSFER_UPLOAD ? cf->upload_start : t->kind == TRANSFER_RENAME ? cf->rename_start : t->kind == TRANSFER_REMOVE ? NULL : cf->download_start;
+	/* without a way to start one, the transfer finishes here
+	 * no provider can start a removal yet, but it still only holds up the thread that submitted it */
+	if (!start){
+		switch (t->kind){
+		case TRANSFER_UPLOAD:
+			res = cf->upload(t->name, t->dst, NULL, handle);
+			break;
+		case TRANSFER_RENAME:
+			res = cf->rename(t->name, t->dst, handle);
+			break;
+		case TRANSFER_REMOVE:
+			res = cf->remove(t->name, handle);
+			break;
+		default:
+			res = cf->download(t->name, t->dst, NULL, handle);
+			break;
+		}
+		transfer_finished(res == 0 ? 0 : -1, t);
+		return;
+	}
+
+	res = start(t->name, t->dst, transfer_finished, t, handle);
+	if (res != 0){
+		log_debug_ex2("%s: Failed to start transferring %s", t->ct->cd->name, t->name);
+		transfer_finished(-1, t);
+	}
+}
+
+/* waits with ct->lock held until fewer than limit transfers are in flight, starting retries as they come due */
+static void wait_in_flight(struct cloud_transfers* ct, size_t limit){
+	while (ct->in_flight >= limit){
+		struct cloud_transfer** prev;
+		struct cloud_transfer* due = NULL;
+		time_t next_due = 0;
+		time_t now = time(NULL);
+
+		for (prev = &ct->retries; *prev; ){
+			struct cloud_transfer* t = *prev;
+
+			if (t->retry_at <= now){
+				*prev = t->next;
+				t->next = due;
+				due = t;
+			}
+			else{
+				next_due = next_due == 0 || t->retry_at < next_due ? t->retry_at : next_due;
+				prev = &t->next;
+			}
+		}
+
+		if (due){
+			/* a transfer that fails right away comes back through transfer_finished(), which takes the lock */
+			pthread_mutex_unlock(&ct->lock);
+			while (due){
+				struct cloud_transfer* next = due->next;
+
+				due->next = NULL;
+				transfer_start(due);
+				due = next;
+			}
+			pthread_mutex_lock(&ct->lock);
+		}
+		else if (next_due != 0){
+			struct timespec ts;
+
+			ts.tv_sec = next_due;
+			ts.tv_nsec = 0;
+			pthread_cond_timedwait(&ct->cond, &ct->lock, &ts);
+		}
+		else{
+			pthread_cond_wait(&ct->cond, &ct->lock);
+		}
+	}
+}
+
+static struct cloud_transfer* transfer_new(struct cloud_transfers* ct, enum transfer_kind kind, const char* src, const char* dst, int was_file, cloud_transfer_done done, void* data){
+	struct cloud_transfer* t;
+
+	t = calloc(1, sizeof(*t));
+	if (!t || !(t->name = sh_dup(src)) || !(t->dst = sh_dup(dst))){
+		log_enomem();
+		t ? free(t->name) : (void)0;
+		free(t);
+		return NULL;
+	}
+	t->ct = ct;
+	t->kind = kind;
+	t->was_file = was_file;
+	t->done = done;
+	t->data = data;
+	return t;
+}
+
+/* takes ownership of t, which is started once there is a slot for it */
+static void transfer_enqueue(struct cloud_transfer* t){
+	struct cloud_transfers* ct = t->ct;
+
+	pthread_mutex_lock(&ct->lock);
+	wait_in_flight(ct, ct->max_in_flight);
+	ct->in_flight++;
+	pthread_mutex_unlock(&ct->lock);
+
+	transfer_start(t);
+}
+
+static int transfer_submit(struct cloud_transfers* ct, enum transfer_kind kind, const char* src, const char* dst, int was_file, cloud_transfer_done done, void* data){
+	struct cloud_transfer* t;
+
+	if (!(t = transfer_new(ct, kind, src, dst, was_file, done, data))){
+		return -1;
+	}
+	transfer_enqueue(t);
+	return 0;
+}
+
+int cloud_upload_submit(struct cloud_transfers* ct, const char* in_file, const char* upload_path, cloud_transfer_done done, void* data){
+	return_ifnull(ct, -1);
+	return_ifnull(in_file, -1);
+	return_ifnull(upload_path, -1);
+
+	return transfer_submit(ct, TRANSFER_UPLOAD, in_file, upload_path, 0, done, data);
+}
+
+int cloud_download_submit(struct cloud_transfers* ct, const char* download_path, const char* out_file, cloud_transfer_done done, void* data){
+	return_ifnull(ct, -1);
+	return_ifnull(download_path, -1);
+	return_ifnull(out_file, -1);
+
+	return transfer_submit(ct, TRANSFER_DOWNLOAD, download_path, out_file, 0, done, data);
+}
+
+int cloud_download_stream_submit(struct cloud_transfers* ct, const char* download_path, int (*sink)(const void* data, size_t len, void* sink_data), void* sink_data, cloud_transfer_done done, void* data){
+	struct cloud_transfer* t;
+	struct TMPFILE* tmp = NULL;
+
+	return_ifnull(ct, -1);
+	return_ifnull(download_path, -1);
+	return_ifnull(sink, -1);
+
+	if (!ct->cd->cf->download_stream && !(tmp = temp_fopen())){
+		log_error_ex("Failed to make a temporary file to download %s to", download_path);
+		return -1;
+	}
+	if (!(t = transfer_new(ct, TRANSFER_STREAM, download_path, tmp ? tmp->name : download_path, 0, done, data))){
+		tmp ? temp_fclose(tmp) : (void)0;
+		return -1;
+	}
+	t->sink = sink;
+	t->sink_data = sink_data;
+	t->tmp = tmp;
+	/* the provider picks a dropped stream up where it stopped, and starting over would hand the sink the same data twice */
+	if (!tmp){
+		t->retries = CLOUD_TRANSFER_RETRIES;
+	}
+	transfer_enqueue(t);
+	return 0;
+}
+
+int cloud_rename_submit(struct cloud_transfers* ct, const char* _old, const char* _new, cloud_transfer_done done, void* data){
+	struct cloud_data* cd;
+
+	return_ifnull(ct, -1);
+	return_ifnull(_old, -1);
+	return_ifnull(_new, -1);
+	cd = ct->cd;
+
+	if (cloud_stat(_old, NULL, cd) != 0){
+		log_debug_ex2("%s: File to be renamed (%s) does not exist.", cd->name, _old);
+		return -1;
+	}
+	return transfer_submit(ct, TRANSFER_RENAME, _old, _new, pc_lookup(cd->pc, _old, NULL) == PC_FILE, done, data);
+}
+
+int cloud_remove_submit(struct cloud_transfers* ct, const char* dir_or_file, cloud_transfer_done done, void* data){
+	return_ifnull(ct, -1);
+	return_ifnull(dir_or_file, -1);
+
+	return transfer_submit(ct, TRANSFER_REMOVE, dir_or_file, dir_or_file, 0, done, data);
+}
+
+int cloud_transfers_wait(struct cloud_transfers* ct){
+	int ret;
+
+	return_ifnull(ct, -1);
+
+	pthread_mutex_lock(&ct->lock);
+	wait_in_flight(ct, 1);
+	ret = ct->failed > 0 ? -1 : 0;
+	ct->failed = 0;
+	pthread_mutex_unlock(&ct->lock);
+	return ret;
+}
+
+void cloud_transfers_free(struct cloud_transfers* ct){
+	if (!ct){
+		return;
+	}
+	cloud_transfers_wait(ct);
+	pthread_mutex_destroy(&ct->lock);
+	pthread_cond_destroy(&ct->cond);
+	free(ct);
+}
+
+struct cloud_stream{
+	struct cloud_data* cd;
+	char* path;
+	void* stream;
+};
+
+int cloud_can_stream(const struct cloud_data* cd){
+	return cd && cd->cf->upload_stream_open ? 1 : 0;
+}
+
+uint64_t cloud_stream_memory(enum cloud_provider cp){
+	/* only S3 streams, and it keeps the part being filled plus the ones still being sent, until a huge stream makes its parts bigger */
+	return cp == CLOUD_S3 ? (uint64_t)S3_STREAM_BUFFERS * S3_STREAM_PART_SIZE : 0;
+}
+
+struct cloud_stream* cloud_upload_stream_open(const char* upload_path, struct cloud_data* cd){
+	struct cloud_stream* cs;
+
+	return_ifnull(upload_path, NULL);
+	return_ifnull(cd, NULL);
+
+	if (!cloud_can_stream(cd)){
+		log_error_ex("%s: Uploading without a file is not supported", cd->name);
+		return NULL;
+	}
+
+	cs = calloc(1, sizeof(*cs));
+	if (!cs){
+		log_enomem();
+		return NULL;
+	}
+	cs->cd = cd;
+	if (!(cs->path = sh_dup(upload_path))){
+		free(cs);
+		return NULL;
+	}
+	/* whatever was at the path is being replaced */
+	pc_invalidate(cd->pc, upload_path);
+	apply_upload_limit(cd);
+	if (cd->cf->upload_stream_open(upload_path, &cs->stream, cd->handle) != 0){
+		log_error_ex2("%s: Failed to start uploading %s", cd->name, upload_path);
+		free(cs->path);
+		free(cs);
+		return NULL;
+	}
+	return cs;
+}
+
+int cloud_upload_stream_write(const void* data, size_t len, void* cs){
+	struct cloud_stream* stream = cs;
+
+	return_ifnull(cs, -1);
+
+	return stream->cd->cf->upload_stream_write(stream->stream, data, len);
+}
+
+static int stream_close(struct cloud_stream* cs, int discard){
+	int res;
+
+	res = cs->cd->cf->upload_stream_close(cs->stream, discard);
+	if (res != 0 || pc_set_file(cs->cd->pc, cs->path) != 0){
+		pc_invalidate(cs->cd->pc, cs->path);
+	}
+	if (res != 0 && !discard){
+		log_error_ex2("%s: Failed to upload %s", cs->cd->name, cs->path);
+	}
+	free(cs->path);
+	free(cs);
+	return res != 0 ? -1 : 0;
+}
+
+int cloud_upload_stream_close(struct cloud_stream* cs){
+	return_ifnull(cs, -1);
+
+	return stream_close(cs, 0);
+}
+
+void cloud_upload_stream_abort(struct cloud_stream* cs){
+	if (!cs){
+		return;
+	}
+	stream_close(cs, 1);
+}
+
 int cloud_remove(const char* dir_or_file, struct cloud_data* cd){
-	if (cd->cf->remove(dir_or_file, cd->handle) != 0){
+	int res = cd->cf->remove(dir_or_file, cd->handle);
+
+	pc_invalidate(cd->pc, dir_or_file);
+	if (res == 0){
+		pc_set_absent(cd->pc, dir_or_file);
+	}
+	if (res != 0){
 		log_warning_ex2("%s: Failed to remove %s", cd->name, dir_or_file);
 		return -1;
 	}
@@ -792,7 +1511,7 @@ int cloud_remove_ui(const char* base_dir, char** chosen_file, struct cloud_data*
 	int res;
 	int ret = 0;
 
-	res = cloud_readdir_choosefile(base_dir, &remove_file, cd->handle, cd->cf);
+	res = cloud_readdir_choosefile(base_dir, &remove_file, cd);
 
 	if (res < 0){
 		log_error("Failed to choose a file to remove");
@@ -805,7 +1524,9 @@ int cloud_remove_ui(const char* base_dir, char** chosen_file, struct cloud_data*
 		goto cleanup;
 	}
 
-	if (cd->cf->remove(remove_file, cd->handle) != 0){
+	res = cd->cf->remove(remove_file, cd->handle);
+	pc_invalidate(cd->pc, remove_file);
+	if (res != 0){
 		log_error_ex2("%s: Failed to remove %s", cd->name, remove_file);
 		ret = -1;
 		goto cleanup;
@@ -830,7 +1551,9 @@ int cloud_logout(struct cloud_data* cd){
 	if (!cd){
 		return 0;
 	}
-	if (cd->cf->logout(cd->handle) != 0){
+	pc_free(cd->pc);
+	rs_free(cd->rs);
+	if (cd->cf && cd->cf->logout(cd->handle) != 0){
 		log_warning_ex("%s: Failed to logout", cd->name);
 		free(cd);
 		return -1;
@@ -10,6 +10,8 @@
 #define __CLOUD_BASE_H
 
 #include "cloud_options.h"
+#include <stddef.h>
+#include <stdint.h>
 #include <sys/stat.h>
 
 #ifndef __GNUC__
@@ -86,6 +88,19 @@ int cloud_mkdir_ui(const char* base_dir, char** chosen_dir, struct cloud_data* c
  */
 int cloud_stat(const char* dir_or_file, struct stat* out, struct cloud_data* cd);
 
+/**
+ * @brief Records that a file is in a cloud account without asking the cloud, e.g. because a manifest uploaded along with it says so.<br>
+ * cloud_stat() (without metadata), cloud_mkdir() on its parent directories, and cloud_rename() trust this instead of looking the file up.
+ *
+ * @param file The file that is known to exist.
+ *
+ * @param cd A cloud data structure returned by cloud_login().
+ * @see cloud_login()
+ *
+ * @return 0 on success, or negative on failure, in which case the file is looked up as usual.
+ */
+int cloud_assume_file(const char* file, struct cloud_data* cd);
+
 /**
  * @brief Renames a file in a cloud account.
  *
@@ -115,7 +130,8 @@ int cloud_rename(const char* _old, const char* _new, struct cloud_data* cd);
  * @param cd A cloud data structure returned by cloud_login().
  * @see cloud_login()
  *
- * @return 0 on success, negative on failure.
+ * @return 0 on success, negative on failure.<br>
+ * A failed upload is tried again up to CLOUD_TRANSFER_RETRIES times, waiting longer each time, before this fails.
  */
 int cloud_upload(const char* in_file, const char* upload_dir, struct cloud_data* cd);
 
@@ -183,6 +199,257 @@ int cloud_download(const char* download_path, char** out_file, struct cloud_data
  */
 int cloud_download_ui(const char* base_dir, char** out_file, struct cloud_data* cd);
 
+/**
+ * @brief How many transfers cloud_transfers_new() keeps in flight when it is given 0.
+ */
+#define CLOUD_TRANSFERS_DEFAULT (8)
+
+#ifndef CLOUD_TRANSFER_RETRIES
+/**
+ * @brief How many more times a failed upload or transfer is tried before it is given up on.
+ */
+#define CLOUD_TRANSFER_RETRIES (5)
+#endif
+
+#ifndef CLOUD_RETRY_DELAY
+/**
+ * @brief How many seconds to wait before the first retry of a failed upload or transfer.<br>
+ * This doubles with every retry, up to CLOUD_RETRY_DELAY_MAX, so a link that is down for a while is not hammered.
+ */
+#define CLOUD_RETRY_DELAY (2)
+#endif
+
+#ifndef CLOUD_RETRY_DELAY_MAX
+/**
+ * @brief The longest wait between two tries of a failed upload or transfer, in seconds.
+ */
+#define CLOUD_RETRY_DELAY_MAX (120)
+#endif
+
+/**
+ * @brief Called once a transfer given to cloud_upload_submit() or cloud_download_submit() finishes.<br>
+ * This can run on the cloud provider's own thread, so it must not use the cloud session, or wait on anything held by a thread submitting transfers.
+ *
+ * @param res 0 if the transfer succeeded, or negative if it failed.
+ *
+ * @param data The data the transfer was submitted with.
+ */
+typedef void (*cloud_transfer_done)(int res, void* data);
+
+/**
+ * @brief Keeps several transfers of one cloud session in flight at once, so uploading many files is not paid for in one round trip per file.
+ */
+struct cloud_transfers;
+
+/**
+ * @brief Creates a new set of concurrent transfers.
+ *
+ * @param cd A cloud data structure returned by cloud_login().<br>
+ * This must not be logged out of until cloud_transfers_free() returns.
+ * @see cloud_login()
+ *
+ * @param max_in_flight The most transfers that can be running at once. 0 uses CLOUD_TRANSFERS_DEFAULT.
+ *
+ * @return A new set of transfers, or NULL on failure.<br>
+ * This must be freed with cloud_transfers_free() when no longer in use.
+ */
+struct cloud_transfers* cloud_transfers_new(struct cloud_data* cd, size_t max_in_flight) __attribute__((malloc));
+
+/**
+ * @brief Starts uploading a file without waiting for it to finish.<br>
+ * This only blocks while the most transfers allowed are already in flight.<br>
+ * A provider that cannot run transfers concurrently uploads the file before this returns.<br>
+ * No progress bar is shown, since the progress of concurrent transfers would overwrite each other.
+ *
+ * @param ct The transfers returned by cloud_transfers_new().
+ *
+ * @param in_file Path to a file on disk to upload to the cloud.<br>
+ * If the file already exists, it will be overwritten.
+ *
+ * @param upload_path The directory to upload the file to, or the path it should have.<br>
+ * Like cloud_upload(), the directory must already exist.
+ *
+ * @param done Called once the upload finishes. This can be NULL.
+ *
+ * @param data Given to done.
+ *
+ * @return 0 if the upload was started, in which case done will be called exactly once, or negative if it could not be, in which case done is not called.<br>
+ * An upload that fails is tried again up to CLOUD_TRANSFER_RETRIES times before done is told it failed.<br>
+ * The retries are started by whichever thread next submits a transfer or waits for them, so cloud_transfers_wait() must be called eventually.
+ */
+int cloud_upload_submit(struct cloud_transfers* ct, const char* in_file, const char* upload_path, cloud_transfer_done done, void* data);
+
+/**
+ * @brief Starts downloading a file without waiting for it to finish.<br>
+ * This works like cloud_upload_submit().
+ *
+ * @param ct The transfers returned by cloud_transfers_new().
+ *
+ * @param download_path Path to a file within the cloud to download.
+ *
+ * @param out_file The path on disk to download the file to.
+ *
+ * @param done Called once the download finishes. This can be NULL.
+ *
+ * @param data Given to done.
+ *
+ * @return 0 if the download was started, in which case done will be called exactly once, or negative if it could not be, in which case done is not called.
+ */
+int cloud_download_submit(struct cloud_transfers* ct, const char* download_path, const char* out_file, cloud_transfer_done done, void* data);
+
+/**
+ * @brief Starts downloading a file without waiting for it to finish, handing it to a callback in order instead of writing it to disk.<br>
+ * A provider that cannot stream downloads writes the file to a temporary file first, which is handed off and removed once it is whole.
+ *
+ * @param ct The transfers returned by cloud_transfers_new().
+ *
+ * @param download_path Path to a file within the cloud to download.
+ *
+ * @param sink A function that receives each block of the file, possibly from another thread.<br>
+ * It must return 0 on success or non-zero to abort. The arguments are in the same order as pipeline_restore_write(), so it can be the sink.
+ *
+ * @param sink_data An argument to pass to sink.
+ *
+ * @param done Called once the download finishes. This can be NULL.
+ *
+ * @param data Given to done.
+ *
+ * @return 0 if the download was started, in which case done will be called exactly once, or negative if it could not be, in which case done is not called.<br>
+ * Once the sink has been given part of the file, a failed download is not tried again, so done can be told it failed after the sink got some of the data.
+ */
+int cloud_download_stream_submit(struct cloud_transfers* ct, const char* download_path, int (*sink)(const void* data, size_t len, void* sink_data), void* sink_data, cloud_transfer_done done, void* data);
+
+/**
+ * @brief Starts moving a file or directory without waiting for it to finish.<br>
+ * This works like cloud_upload_submit(), and the move is done like cloud_rename(), except the destination is not looked up first.<br>
+ * A provider that cannot replace an existing destination fails the move instead.
+ *
+ * @param ct The transfers returned by cloud_transfers_new().
+ *
+ * @param _old The path to move, which must exist.
+ *
+ * @param _new Its new path. Like cloud_rename(), its parent directory must already exist.
+ *
+ * @param done Called once the move finishes. This can be NULL.
+ *
+ * @param data Given to done.
+ *
+ * @return 0 if the move was started, in which case done will be called exactly once, or negative if it could not be, in which case done is not called.
+ */
+int cloud_rename_submit(struct cloud_transfers* ct, const char* _old, const char* _new, cloud_transfer_done done, void* data);
+
+/**
+ * @brief Starts removing a file or directory without waiting for it to finish.<br>
+ * This works like cloud_upload_submit(), and the removal is done like cloud_remove().<br>
+ * A removal is retried like any other transfer, so a path that is already gone fails after every retry.
+ *
+ * @param ct The transfers returned by cloud_transfers_new().
+ *
+ * @param dir_or_file The path to remove.
+ *
+ * @param done Called once the removal finishes. This can be NULL.
+ *
+ * @param data Given to done.
+ *
+ * @return 0 if the removal was started, in which case done will be called exactly once, or negative if it could not be, in which case done is not called.
+ */
+int cloud_remove_submit(struct cloud_transfers* ct, const char* dir_or_file, cloud_transfer_done done, void* data);
+
+/**
+ * @brief Waits for every transfer in flight to finish, including the retries of any that failed.
+ *
+ * @param ct The transfers returned by cloud_transfers_new().
+ *
+ * @return 0 if every transfer since the last cloud_transfers_wait() succeeded, or negative if any failed.
+ */
+int cloud_transfers_wait(struct cloud_transfers* ct);
+
+/**
+ * @brief Waits for every transfer in flight to finish, then frees the set of transfers.<br>
+ * This does not log out of the cloud session.
+ *
+ * @param ct The transfers to free.<br>
+ * This can be NULL, in which case this function does nothing.
+ *
+ * @return void
+ */
+void cloud_transfers_free(struct cloud_transfers* ct);
+
+/**
+ * @brief Uploads data as it is written instead of from a file on disk.
+ */
+struct cloud_stream;
+
+/**
+ * @brief Checks if a cloud provider can upload with cloud_upload_stream_open().
+ *
+ * @param cd A cloud data structure returned by cloud_login()
+ * @see cloud_login()
+ *
+ * @return Non-zero if it can, 0 if files have to be uploaded with cloud_upload().
+ */
+int cloud_can_stream(const struct cloud_data* cd);
+
+/**
+ * @brief Gets how much memory one of a cloud provider's upload streams holds in its buffers.<br>
+ * This does not need a session, so it can be planned for before logging in.
+ *
+ * @param cp The cloud provider.
+ *
+ * @return The memory in bytes, or 0 if the provider cannot stream.
+ * @see cloud_upload_stream_open()
+ */
+uint64_t cloud_stream_memory(enum cloud_provider cp);
+
+/**
+ * @brief Starts uploading to a path without the data being in a file first.<br>
+ * Nothing else may use the cloud session until the stream is closed.
+ *
+ * @param upload_path The path the data should have.<br>
+ * Its directory must already exist. If the file already exists, it will be overwritten.
+ *
+ * @param cd A cloud data structure returned by cloud_login()
+ * @see cloud_login()
+ *
+ * @return A new stream, or NULL on failure or if the provider cannot stream.<br>
+ * This must be finished with cloud_upload_stream_close() or cloud_upload_stream_abort().
+ * @see cloud_can_stream()
+ */
+struct cloud_stream* cloud_upload_stream_open(const char* upload_path, struct cloud_data* cd);
+
+/**
+ * @brief Writes to a stream returned by cloud_upload_stream_open().<br>
+ * The arguments are in this order so it can be the sink of pipeline_backup_stream().
+ *
+ * @param data The data to write.
+ *
+ * @param len The length of the data.
+ *
+ * @param cs The stream to write to.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int cloud_upload_stream_write(const void* data, size_t len, void* cs);
+
+/**
+ * @brief Finishes an upload started by cloud_upload_stream_open() and frees the stream.
+ *
+ * @param cs The stream to finish.
+ *
+ * @return 0 if the file was uploaded, or negative on failure, in which case nothing is left at its path.
+ */
+int cloud_upload_stream_close(struct cloud_stream* cs);
+
+/**
+ * @brief Throws away an upload started by cloud_upload_stream_open() and frees the stream.
+ *
+ * @param cs The stream to throw away.<br>
+ * This can be NULL, in which case this function does nothing.
+ *
+ * @return void
+ */
+void cloud_upload_stream_abort(struct cloud_stream* cs);
+
 /**
  * @brief Removes a file or directory from a cloud account.
  *
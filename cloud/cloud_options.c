@@ -6,6 +6,7 @@
  * of the MIT license.  See the LICENSE file for details.
  */
 #include "cloud_options.h"
+#include "ratelimit.h"
 #include "../crypt/crypt_getpassword.h"
 #include "../log.h"
 #include "../readline_include.h"
@@ -108,6 +109,28 @@ int co_set_default_upload_directory(struct cloud_options* co){
 	return co_set_upload_directory(co, "/Backups");
 }
 
+int co_set_upload_limit(struct cloud_options* co, const char* upload_limit){
+	struct rate_schedule* rs;
+
+	free(co->upload_limit);
+	co->upload_limit = NULL;
+
+	if (!upload_limit){
+		return 0;
+	}
+	if (rs_parse(upload_limit, &rs) != 0){
+		return -1;
+	}
+	rs_free(rs);
+
+	co->upload_limit = sh_dup(upload_limit);
+	if (!co->upload_limit){
+		log_enomem();
+		return -1;
+	}
+	return 0;
+}
+
 int co_set_cp(struct cloud_options* co, enum cloud_provider cp){
 	co->cp = cp;
 	return 0;
@@ -121,6 +144,11 @@ enum cloud_provider cloud_provider_from_string(const char* str){
 			!strcmp(str, "mega.co.nz")){
 		ret = CLOUD_MEGA;
 	}
+	else if (!strcmp(str, "s3") ||
+			!strcmp(str, "S3") ||
+			!strcmp(str, "aws")){
+		ret = CLOUD_S3;
+	}
 	else if (!strcmp(str, "none") ||
 			!strcmp(str, "off")){
 		ret = CLOUD_NONE;
@@ -132,12 +160,67 @@ enum cloud_provider cloud_provider_from_string(const char* str){
 	return ret;
 }
 
+int co_from_string(const char* str, struct cloud_options** out){
+	const char* first = strchr(str, ':');
+	const char* last = strrchr(str, ':');
+	char* provider = NULL;
+	char* username = NULL;
+	int ret = 0;
+
+	*out = NULL;
+	/* the directory is whatever comes after the last ':', so it can not have one of its own */
+	if (!first || first == str || last[1] == '\0'){
+		log_warning_ex("Invalid cloud destination (%s). It has to look like PROVIDER:DIRECTORY or PROVIDER:USERNAME:DIRECTORY", str);
+		ret = -1;
+		goto cleanup;
+	}
+	if (!(provider = malloc(first - str + 1)) ||
+			(last != first && !(username = malloc(last - first)))){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+	memcpy(provider, str, first - str);
+	provider[first - str] = '\0';
+	if (username){
+		memcpy(username, first + 1, last - first - 1);
+		username[last - first - 1] = '\0';
+	}
+
+	if (!(*out = co_new())){
+		ret = -1;
+		goto cleanup;
+	}
+	(*out)->cp = cloud_provider_from_string(provider);
+	if ((*out)->cp == CLOUD_INVALID || (*out)->cp == CLOUD_NONE){
+		log_warning_ex("Invalid cloud destination provider (%s)", provider);
+		ret = -1;
+		goto cleanup;
+	}
+	if (co_set_username(*out, username) != 0 ||
+			co_set_upload_directory(*out, last + 1) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+
+cleanup:
+	if (ret != 0 && *out){
+		co_free(*out);
+		*out = NULL;
+	}
+	free(provider);
+	free(username);
+	return ret;
+}
+
 const char* cloud_provider_to_string(enum cloud_provider cp){
 	switch (cp){
 	case CLOUD_NONE:
 		return "None";
 	case CLOUD_MEGA:
 		return "mega.nz";
+	case CLOUD_S3:
+		return "S3";
 	default:
 		log_einval_u(cp);
 		return NULL;
@@ -148,6 +231,7 @@ void co_free(struct cloud_options* co){
 	free(co->password);
 	free(co->username);
 	free(co->upload_directory);
+	free(co->upload_limit);
 	free(co);
 }
 
@@ -164,6 +248,9 @@ int co_cmp(const struct cloud_options* co1, const struct cloud_options* co2){
 	if (sh_cmp_nullsafe(co1->upload_directory, co2->upload_directory) != 0){
 		return sh_cmp_nullsafe(co1->upload_directory, co2->upload_directory);
 	}
+	if (sh_cmp_nullsafe(co1->upload_limit, co2->upload_limit) != 0){
+		return sh_cmp_nullsafe(co1->upload_limit, co2->upload_limit);
+	}
 	return 0;
 }
 
@@ -19,7 +19,8 @@
 enum cloud_provider{
 	CLOUD_INVALID = 0,/**< Invalid cloud provider */
 	CLOUD_MEGA = 1,   /**< mega.nz */
-	CLOUD_NONE = 2    /**< No cloud provider */
+	CLOUD_NONE = 2,   /**< No cloud provider */
+	CLOUD_S3 = 3      /**< Amazon S3 or an S3-compatible service */
 };
 
 /**
@@ -46,6 +47,12 @@ struct cloud_options{
 	 * @see co_set_password()
 	 */
 	char* upload_directory;
+	/** @brief How fast to upload at each time of day, as parsed by rs_parse() (optional).
+	 * If this string is NULL, uploads are not limited.<br>
+	 * This string must be dynamically allocated or set through co_set_upload_limit().
+	 * @see co_set_upload_limit()
+	 */
+	char* upload_limit;
 };
 
 /**
@@ -56,6 +63,7 @@ struct cloud_options{
  * Member cp will be set to CLOUD_NONE.<br>
  * Members username and password will be set to NULL.<br>
  * Member upload_directory will be set to "/Backups"<br>
+ * Member upload_limit will be set to NULL.<br>
  * <br>
  * This structure must be freed with co_free() when no longer in use.
  * @see co_free()
@@ -107,6 +115,20 @@ int co_set_upload_directory(struct cloud_options* co, const char* upload_directo
  */
 int co_set_default_upload_directory(struct cloud_options* co);
 
+/**
+ * @brief Sets the upload_limit field of a cloud options structure to a value, freeing the old one if it exists.
+ *
+ * @param co The cloud options structure to update.
+ *
+ * @param upload_limit The upload rate schedule to set, e.g. "08:00-18:00=512K,0".<br>
+ * This parameter can be NULL, in which case uploads are not limited.
+ *
+ * @return 0 on success, or negative on failure.<br>
+ * This function fails if the schedule is not valid.
+ * @see rs_parse()
+ */
+int co_set_upload_limit(struct cloud_options* co, const char* upload_limit);
+
 /**
  * @brief Sets the cp field of a cloud_options structure.<br>
  * `co_set_cp(co, val)` is identical to `co->cp = val`<br>
@@ -130,6 +152,19 @@ int co_set_cp(struct cloud_options* co, enum cloud_provider cp);
  */
 enum cloud_provider cloud_provider_from_string(const char* str);
 
+/**
+ * @brief Parses a cloud destination written as "PROVIDER:DIRECTORY" or "PROVIDER:USERNAME:DIRECTORY", such as "s3:AKIAEXAMPLE:/bucket/Backups".<br>
+ * The password is never part of the string, so it is asked for upon login.
+ *
+ * @param str The string to parse.
+ *
+ * @param out Set to new cloud options for the destination, or NULL on failure.<br>
+ * This must be freed with co_free() when no longer in use.
+ *
+ * @return 0 on success, or negative if the string is not a valid destination.
+ */
+int co_from_string(const char* str, struct cloud_options** out);
+
 /**
  * @brief Converts a CLOUD_PROVIDER to its string equivalent<br>
  * Example: CLOUD_MEGA -> "mega.nz"
@@ -10,10 +10,12 @@
 extern "C"{
 #include "keys.h"
 #include "../log.h"
+#include "../filehelper.h"
 #include "../progressbar.h"
 }
 #include "mega_sdk/include/megaapi.h"
 #include <iostream>
+#include <fstream>
 #include <vector>
 #include <cstring>
 #include <cerrno>
@@ -22,6 +24,7 @@ extern "C"{
 #include <sys/stat.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <pwd.h>
 
 class ProgressBarTransferListener : public mega::MegaTransferListener{
 public:
@@ -82,6 +85,9 @@ public:
 		if (p){
 			set_progress(p, transfer->getTransferredBytes());
 		}
+		if (transfer->getType() == mega::MegaTransfer::TYPE_UPLOAD){
+			progress_board_add(STAGE_UPLOAD, transfer->getDeltaSize());
+		}
 	}
 
 	void onTransferTemporaryError(mega::MegaApi* mega_api, mega::MegaTransfer* transfer, mega::MegaError* error){
@@ -143,6 +149,43 @@ private:
 	const char* msg;
 };
 
+/* one of these is made for each transfer started without waiting, and deletes itself once that finishes */
+class AsyncTransferListener : public mega::MegaTransferListener{
+public:
+	AsyncTransferListener(MEGAtransfer_done done, void* data){
+		this->done = done;
+		this->data = data;
+	}
+
+	void onTransferUpdate(mega::MegaApi* mega_api, mega::MegaTransfer* transfer){
+		(void)mega_api;
+
+		if (transfer->getType() == mega::MegaTransfer::TYPE_UPLOAD){
+			progress_board_add(STAGE_UPLOAD, transfer->getDeltaSize());
+		}
+	}
+
+	void onTransferTemporaryError(mega::MegaApi* mega_api, mega::MegaTransfer* transfer, mega::MegaError* error){
+		(void)mega_api;
+		log_debug_ex2("MEGA: Temporary error transferring %s (%s)", transfer->getFileName(), error->toString());
+	}
+
+	void onTransferFinish(mega::MegaApi* mega_api, mega::MegaTransfer* transfer, mega::MegaError* error){
+		(void)mega_api;
+
+		if (error->getErrorCode() != mega::MegaError::API_OK){
+			log_warning_ex2("MEGA: Failed to transfer %s (%s)", transfer->getFileName(), error->toString());
+		}
+		done(error->getErrorCode() == mega::MegaError::API_OK ? 0 : -1, data);
+		/* the SDK does not call a listener again after its transfer finishes */
+		delete this;
+	}
+
+private:
+	MEGAtransfer_done done;
+	void* data;
+};
+
 static std::string string_parent_dir(const char* in){
 	std::string ret = in;
 	size_t index;
@@ -165,22 +208,155 @@ static std::string string_filename(const char* in){
 	return ret;
 }
 
+/* returns the folder an upload goes into and sets the name it gets there, removing a file already at upload_path
+ * the name is given with the upload, so nothing has to be looked up and renamed once it finishes */
+static mega::MegaNode* upload_target(mega::MegaApi* mega_api, const char* in_file, const char* upload_path, std::string& filename){
+	mega::MegaNode* node;
+
+	/* get folder node */
+	node = mega_api->getNodeByPath(upload_path);
+	if (node && node->isFile()){
+		mega::SynchronousRequestListener srl;
+		log_info_ex("MEGA: File %s already exists; removing it.", upload_path);
+		mega_api->remove(node, &srl);
+		srl.wait();
+		if (srl.getError()->getErrorCode() != mega::MegaError::API_OK){
+			log_error_ex("MEGA: Failed to remove file %s.", upload_path);
+			delete node;
+			return NULL;
+		}
+		delete node;
+		node = nullptr;
+	}
+	if (node){
+		/* uploading into a directory keeps the name the file has on disk */
+		filename = string_filename(in_file);
+		if (filename.empty()){
+			filename = in_file;
+		}
+		return node;
+	}
+
+	/* if the path does not specify a valid directory, it is the parent directory plus the file's name */
+	std::string parent_dir = string_parent_dir(upload_path);
+	filename = string_filename(upload_path);
+	if (parent_dir.empty() || filename.empty() || (node = mega_api->getNodeByPath(parent_dir.c_str())) == NULL){
+		log_error("MEGA: Folder not found");
+		return NULL;
+	}
+	return node;
+}
+
+/* $XDG_CACHE_HOME/ezbackup/mega, or ~/.cache/ezbackup/mega. this is empty if it could not be made */
+static std::string cache_dir(void){
+	const char* base;
+	std::string dir;
+
+	if ((base = getenv("XDG_CACHE_HOME")) != NULL && base[0] == '/'){
+		dir = base;
+	}
+	else{
+		struct passwd* pw;
+
+		if (!(base = getenv("HOME"))){
+			pw = getpwuid(getuid());
+			if (!pw){
+				log_warning("MEGA: Failed to get home directory, so nothing will be cached.");
+				return "";
+			}
+			base = pw->pw_dir;
+		}
+		dir = std::string(base) + "/.cache";
+	}
+	dir += "/ezbackup/mega";
+
+	/* the session file in here is as good as the password */
+	if (mkdir_recursive(dir.c_str()) < 0 || chmod(dir.c_str(), 0700) != 0){
+		log_warning_ex("MEGA: Failed to make cache directory %s, so nothing will be cached.", dir.c_str());
+		return "";
+	}
+	return dir + "/";
+}
+
+/* the session saved for this email, which is empty if there is none */
+static std::string read_session(const std::string& dir, const char* email){
+	std::ifstream ifs;
+	std::string saved_email;
+	std::string session;
+
+	if (dir.empty()){
+		return "";
+	}
+	ifs.open((dir + "session").c_str());
+	if (!ifs || !std::getline(ifs, saved_email) || !std::getline(ifs, session)){
+		return "";
+	}
+	return email && saved_email == email ? session : "";
+}
+
+static int write_session(const std::string& dir, const char* email, const char* session){
+	std::string path;
+	std::ofstream ofs;
+	mode_t old_umask;
+
+	if (dir.empty() || !session){
+		return -1;
+	}
+	path = dir + "session";
+
+	old_umask = umask(077);
+	ofs.open(path.c_str(), std::ios::out | std::ios::trunc);
+	umask(old_umask);
+	if (!ofs){
+		log_warning_ex("MEGA: Failed to save session to %s", path.c_str());
+		return -1;
+	}
+	ofs << email << '\n' << session << '\n';
+	ofs.close();
+	return ofs ? 0 : -1;
+}
+
 int MEGAlogin(const char* email, const char* password, MEGAhandle** out){
 	std::string prompt;
+	std::string dir;
+	std::string session;
 	mega::MegaApi* mega_api;
 	mega::SynchronousRequestListener listener;
 
-	mega_api = new mega::MegaApi(MEGA_API_KEY, (const char*)NULL, "ezbackup");
-	mega_api->login(email, password, &listener);
+	dir = cache_dir();
+	/* with a base path, the SDK keeps the account's node tree there, so fetchNodes() only has to get what changed since last time */
+	mega_api = new mega::MegaApi(MEGA_API_KEY, dir.empty() ? (const char*)NULL : dir.c_str(), "ezbackup");
 
-	if (listener.trywait(MEGA_WAIT_MS) != 0){
-		std::cerr << "Connection timed out" << std::endl;
-		return 1;
+	session = read_session(dir, email);
+	if (!session.empty()){
+		mega_api->fastLogin(session.c_str(), &listener);
+		if (listener.trywait(MEGA_WAIT_MS) != 0){
+			std::cerr << "Connection timed out" << std::endl;
+			return 1;
+		}
+		if (listener.getError()->getErrorCode() != mega::MegaError::API_OK){
+			log_info_ex("MEGA: Saved session is no longer valid (%s), logging in again.", listener.getError()->toString());
+			session.clear();
+		}
 	}
-	if (listener.getError()->getErrorCode() != mega::MegaError::API_OK){
-		std::cerr << "Failed to login (" << listener.getError()->toString() << ")." << std::endl;
-		delete mega_api;
-		return 1;
+
+	if (session.empty()){
+		char* new_session;
+
+		mega_api->login(email, password, &listener);
+		if (listener.trywait(MEGA_WAIT_MS) != 0){
+			std::cerr << "Connection timed out" << std::endl;
+			return 1;
+		}
+		if (listener.getError()->getErrorCode() != mega::MegaError::API_OK){
+			std::cerr << "Failed to login (" << listener.getError()->toString() << ")." << std::endl;
+			delete mega_api;
+			return 1;
+		}
+
+		new_session = mega_api->dumpSession();
+		write_session(dir, email, new_session);
+		delete[] new_session;
 	}
 
 	mega_api->fetchNodes(&listener);
@@ -251,12 +427,25 @@ int MEGAmkdir(const char* dir, MEGAhandle* mh){
 	return 0;
 }
 
-int MEGAreaddir(const char* dir, char*** out, size_t* out_len, MEGAhandle* mh){
+static void node_stat(mega::MegaNode* node, struct stat* out){
+	memset(out, 0, sizeof(*out));
+	out->st_uid = getuid();
+	out->st_gid = getgid();
+	/* DO NOT USE node->isFile(). it always returns false for some reason */
+	out->st_mode = node->getType() == 0 ? S_IFREG | 0444 : S_IFDIR | 0755;
+	out->st_nlink = 1;
+	out->st_size = node->getType() == 0 ? node->getSize() : 4096;
+	out->st_mtime = node->getType() == 0 ? node->getModificationTime() : node->getCreationTime();
+	out->st_ctime = node->getCreationTime();
+}
+
+int MEGAreaddir(const char* dir, char*** out, struct stat** out_st, size_t* out_len, MEGAhandle* mh){
 	std::string path;
 	mega::MegaNode* node;
 	mega::MegaNodeList* children;
 	mega::MegaApi* mega_api;
 	char** arr = NULL;
+	struct stat* st = NULL;
 	size_t arr_len = 0;
 	int ret = 0;
 
@@ -279,7 +468,9 @@ int MEGAreaddir(const char* dir, char*** out, size_t* out_len, MEGAhandle* mh){
 
 	children = mega_api->getChildren(node);
 	arr = (char**)malloc(sizeof(*arr) * children->size());
-	if (!arr){
+	/* the nodes are already in memory, so their metadata costs nothing to hand back with them */
+	st = (struct stat*)malloc(sizeof(*st) * children->size());
+	if (!arr || !st){
 		log_enomem();
 		ret = -1;
 		goto cleanup_freeout;
@@ -303,10 +494,17 @@ int MEGAreaddir(const char* dir, char*** out, size_t* out_len, MEGAhandle* mh){
 			strcat(arr[arr_len - 1], "/");
 		}
 		strcat(arr[arr_len - 1], n->getName());
+		node_stat(n, &st[arr_len - 1]);
 	}
 
 	*out = arr;
 	*out_len = arr_len;
+	if (out_st){
+		*out_st = st;
+	}
+	else{
+		free(st);
+	}
 	delete children;
 	delete node;
 	return ret;
@@ -317,6 +515,8 @@ cleanup_freeout:
 			free(arr[i]);
 		}
 	}
+	free(arr);
+	free(st);
 	delete children;
 	delete node;
 	return ret;
@@ -339,14 +539,7 @@ int MEGAstat(const char* file_path, struct stat* out, MEGAhandle* mh){
 		return 0;
 	}
 
-	out->st_uid = getuid();
-	out->st_gid = getgid();
-	/* DO NOT USE node->isFile(). it always returns false for some reason */
-	out->st_mode = node->getType() == 0 ? S_IFREG | 0444 : S_IFDIR | 0755;
-	out->st_nlink = 1;
-	out->st_size = node->getType() == 0 ? node->getSize() : 4096;
-	out->st_mtime = node->getType() == 0 ? node->getModificationTime() : node->getCreationTime();
-	out->st_ctime = node->getCreationTime();
+	node_stat(node, out);
 
 	delete node;
 	return 0;
@@ -507,38 +700,18 @@ int MEGAupload(const char* in_file, const char* upload_dir, const char* msg, MEG
 	mega::MegaNode* node;
 	mega::MegaApi* mega_api;
 	ProgressBarTransferListener listener;
-	std::string parent_dir = "";
+	std::string filename;
 
 	mega_api = static_cast<mega::MegaApi*>(mh);
 
-	/* get folder node */
-	node = mega_api->getNodeByPath(upload_dir);
-	if (node && node->isFile()){
-		mega::SynchronousRequestListener srl;
-		log_info_ex("MEGA: File %s already exists; removing it.", upload_dir);
-		mega_api->remove(node, &srl);
-		srl.wait();
-		if (srl.getError()->getErrorCode() != mega::MegaError::API_OK){
-			log_error_ex("MEGA: Failed to remove file %s.", upload_dir);
-			delete node;
-			return -1;
-		}
-		delete node;
-		node = nullptr;
-	}
-	/* if the path does not specify a valid directory */
+	node = upload_target(mega_api, in_file, upload_dir, filename);
 	if (!node){
-		/* attempt to get the node of the parent directory */
-		parent_dir = string_parent_dir(upload_dir);
-		if (parent_dir.empty() || (node = mega_api->getNodeByPath(parent_dir.c_str())) == NULL){
-			log_error("MEGA: Folder not found");
-			return -1;
-		}
+		return -1;
 	}
 
 	/* upload the file */
 	listener.setMsg(msg);
-	mega_api->startUpload(in_file, node, &listener);
+	mega_api->startUpload(in_file, node, filename.c_str(), &listener);
 	log_info("Uploading file...");
 	listener.wait();
 	if (listener.getError()->getErrorCode() != mega::MegaError::API_OK){
@@ -548,44 +721,61 @@ int MEGAupload(const char* in_file, const char* upload_dir, const char* msg, MEG
 	}
 
 	delete node;
-	/* if upload_dir is not a directory */
-	if (!parent_dir.empty()){
-		/* rename the file from in_file to upload_dir */
-		mega::MegaNode* node_uploaded;
-		mega::SynchronousRequestListener srl;
+	return 0;
+}
 
-		std::string filename_old = parent_dir;
-		std::string filename_new;
-		if (filename_old[filename_old.length() - 1] != '/'){
-			filename_old += '/';
-		}
-		filename_new = filename_old;
-		filename_old += string_filename(in_file);
-		filename_new = string_filename(upload_dir);
-
-		node_uploaded = mega_api->getNodeByPath(filename_old.c_str());
-		if (!node_uploaded){
-			log_warning_ex("MEGA: Failed to fetch uploaded path %s.", filename_old.c_str());
-			return 0;
-		}
+int MEGAdownload_start(const char* download_path, const char* out_file, MEGAtransfer_done done, void* data, MEGAhandle* mh){
+	mega::MegaNode* node;
+	mega::MegaApi* mega_api;
 
-		mega_api->renameNode(node_uploaded, filename_new.c_str(), &srl);
-		if (srl.trywait(MEGA_WAIT_MS) != 0){
-			log_warning("MEGA: Connection timed out while renaming file.");
-			delete node_uploaded;
-			return 0;
-		}
-		if (srl.getError()->getErrorCode() != mega::MegaError::API_OK){
-			log_warning_ex2("MEGA: Failed to rename %s to %s while uploading.", filename_old.c_str(), filename_new.c_str());
-			delete node_uploaded;
-			return 0;
-		}
-		delete node_uploaded;
+	mega_api = static_cast<mega::MegaApi*>(mh);
+
+	node = mega_api->getNodeByPath(download_path);
+	if (!node){
+		log_warning_ex("MEGA: File %s not found", download_path);
+		return -1;
+	}
+	if (!node->isFile()){
+		log_warning_ex("MEGA: %s is a directory, not a file.", download_path);
+		delete node;
+		return -1;
 	}
 
+	mega_api->startDownload(node, out_file, new AsyncTransferListener(done, data));
+	log_info_ex("Started downloading %s", download_path);
+	delete node;
 	return 0;
 }
 
+int MEGAupload_start(const char* in_file, const char* upload_path, MEGAtransfer_done done, void* data, MEGAhandle* mh){
+	mega::MegaNode* node;
+	mega::MegaApi* mega_api;
+	std::string filename;
+
+	mega_api = static_cast<mega::MegaApi*>(mh);
+
+	node = upload_target(mega_api, in_file, upload_path, filename);
+	if (!node){
+		return -1;
+	}
+
+	mega_api->startUpload(in_file, node, filename.c_str(), new AsyncTransferListener(done, data));
+	log_info_ex("Started uploading %s", in_file);
+	delete node;
+	return 0;
+}
+
+void MEGAset_upload_limit(uint64_t bytes_per_sec, MEGAhandle* mh){
+	mega::MegaApi* mega_api;
+
+	mega_api = static_cast<mega::MegaApi*>(mh);
+
+	/* the SDK takes 0 to mean unlimited too */
+	if (!mega_api->setMaxUploadSpeed(static_cast<long long>(bytes_per_sec))){
+		log_warning("MEGA: Failed to limit the upload speed");
+	}
+}
+
 int MEGArm(const char* file, MEGAhandle* mh){
 	std::string path;
 	mega::MegaNode* node;
@@ -616,13 +806,42 @@ int MEGArm(const char* file, MEGAhandle* mh){
 	return 0;
 }
 
+/* whether this client's session is the one saved in the cache directory */
+static bool session_saved(mega::MegaApi* mega_api){
+	std::string dir;
+	std::ifstream ifs;
+	std::string line;
+	char* session;
+	bool ret = false;
+
+	dir = cache_dir();
+	if (dir.empty()){
+		return false;
+	}
+	ifs.open((dir + "session").c_str());
+	if (!ifs || !std::getline(ifs, line) || !std::getline(ifs, line)){
+		return false;
+	}
+
+	session = mega_api->dumpSession();
+	ret = session && line == session;
+	delete[] session;
+	return ret;
+}
+
 int MEGAlogout(MEGAhandle* mh){
 	mega::MegaApi* mega_api;
 	mega::SynchronousRequestListener listener;
 
 	mega_api = static_cast<mega::MegaApi*>(mh);
 
-	mega_api->logout(&listener);
+	/* a session saved for the next login has to stay valid, so only this client forgets it */
+	if (session_saved(mega_api)){
+		mega_api->localLogout(&listener);
+	}
+	else{
+		mega_api->logout(&listener);
+	}
 	if (listener.trywait(MEGA_WAIT_MS) != 0){
 		std::cerr << "Connection timed out" << std::endl;
 		delete mega_api;
@@ -11,8 +11,10 @@
 
 #ifdef __cplusplus
 #include <cstddef>
+#include <cstdint>
 #else
 #include <stddef.h>
+#include <stdint.h>
 #endif
 #include <sys/stat.h>
 
@@ -23,12 +25,16 @@
 /**< A mega::MegaApi class that's been typecasted to void for compatibillity with C */
 typedef void MEGAhandle;
 
+/**< Called when a transfer started by MEGAupload_start() or MEGAdownload_start() finishes, with 0 on success or negative on failure */
+typedef void (*MEGAtransfer_done)(int res, void* data);
+
 #ifdef __cplusplus
 extern "C"{
 #endif
 
 /**
- * @brief Logs into a MEGA account.
+ * @brief Logs into a MEGA account.<br>
+ * The session is saved in $XDG_CACHE_HOME/ezbackup/mega (or ~/.cache/ezbackup/mega), along with the account's node tree, so the next login for the same account resumes it and only fetches what changed.
  *
  * @param username The email to log into.<br>
  * This cannot be NULL.
@@ -66,7 +72,11 @@ int MEGAmkdir(const char* dir, MEGAhandle* mh);
  * @param out A pointer to a string array that will contain the entries in the directory.<br>
  * This string array will be set to NULL if the function fails.
  *
- * @param out_len A pointer to an integer that will contain the length of the output array.<br>
+ * @param out_st A pointer to an array that will contain the metadata of each entry, like MEGAstat() would return.<br>
+ * This array will be set to NULL if the function fails, and must be freed when no longer in use.<br>
+ * This can be NULL, in which case it is not returned.
+ *
+ * @param out_len A pointer to an integer that will contain the length of the output arrays.<br>
  * This will be set to 0 if this function fails.
  *
  * @param mh A handle returned by MEGAlogin().
@@ -74,7 +84,7 @@ int MEGAmkdir(const char* dir, MEGAhandle* mh);
  *
  * @return 0 on success, or negative on failure.
  */
-int MEGAreaddir(const char* dir, char*** out, size_t* out_len, MEGAhandle* mh);
+int MEGAreaddir(const char* dir, char*** out, struct stat** out_st, size_t* out_len, MEGAhandle* mh);
 
 /**
  * @brief Stats a file or directory within a MEGA account.
@@ -144,6 +154,60 @@ int MEGAdownload(const char* download_path, const char* out_file, const char* ms
  */
 int MEGAupload(const char* in_file, const char* upload_path, const char* msg, MEGAhandle* mh);
 
+/**
+ * @brief Starts downloading a file stored within a MEGA account, without waiting for it to finish.<br>
+ * Many of these can be in flight within one session.
+ *
+ * @param download_path The file to download.
+ *
+ * @param out_file The path on disk to download the file to.
+ *
+ * @param done Called on the SDK's thread once the download finishes.<br>
+ * This must not make requests through the same handle.
+ *
+ * @param data Given to done.
+ *
+ * @param mh A handle returned by MEGAlogin()
+ * @see MEGAlogin()
+ *
+ * @return 0 if the download was started, in which case done is called exactly once, or negative on failure, in which case it is not.
+ */
+int MEGAdownload_start(const char* download_path, const char* out_file, MEGAtransfer_done done, void* data, MEGAhandle* mh);
+
+/**
+ * @brief Starts uploading a file to a MEGA account, without waiting for it to finish.<br>
+ * Many of these can be in flight within one session.
+ *
+ * @param in_file The file on disk to upload.
+ *
+ * @param upload_path The directory to upload the file to, which can have the filename appended to it like MEGAupload().<br>
+ * If the file already exists, it is removed before this returns.
+ *
+ * @param done Called on the SDK's thread once the upload finishes.<br>
+ * This must not make requests through the same handle.
+ *
+ * @param data Given to done.
+ *
+ * @param mh A handle returned by MEGAlogin()
+ * @see MEGAlogin()
+ *
+ * @return 0 if the upload was started, in which case done is called exactly once, or negative on failure, in which case it is not.
+ */
+int MEGAupload_start(const char* in_file, const char* upload_path, MEGAtransfer_done done, void* data, MEGAhandle* mh);
+
+/**
+ * @brief Limits how fast MEGA uploads, using the SDK's own limiter.<br>
+ * The limit is shared by every upload, but unlike S3 it does not let small uploads go first.
+ *
+ * @param bytes_per_sec The most bytes to upload per second, or 0 for unlimited.
+ *
+ * @param mh A handle returned by MEGAlogin()<br>
+ * @see MEGAlogin()
+ *
+ * @return void
+ */
+void MEGAset_upload_limit(uint64_t bytes_per_sec, MEGAhandle* mh);
+
 /**
  * @brief Removes a file or directory stored within a MEGA account.
  *
@@ -158,7 +222,8 @@ int MEGAupload(const char* in_file, const char* upload_path, const char* msg, ME
 int MEGArm(const char* file, MEGAhandle* mh);
 
 /**
- * @brief Logs out of MEGA and frees all memory associated with its handle.
+ * @brief Logs out of MEGA and frees all memory associated with its handle.<br>
+ * If the session was saved by MEGAlogin(), it is only forgotten locally so the next login can resume it.
  *
  * @param mh A handle returned by MEGAlogin()
  * @see MEGAlogin()
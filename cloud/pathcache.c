@@ -0,0 +1,460 @@
+/** @file cloud/pathcache.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "pathcache.h"
+#include "../log.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PC_INITIAL_BUCKETS (256)
+
+struct path_cache{
+	struct pc_entry{
+		char* path;
+		unsigned long hash;
+		enum pc_state state;
+		/* st is only valid if this is set */
+		int has_st;
+		struct stat st;
+		/* a directory whose every entry is known, so anything else in it does not exist */
+		int listed;
+		struct pc_entry* next;
+	}** buckets;
+	size_t n_buckets;
+	size_t len;
+	pthread_mutex_t lock;
+};
+
+/* FNV-1a over the first len bytes */
+static unsigned long hash_path(const char* path, size_t len){
+	unsigned long hash = 2166136261UL;
+	size_t i;
+
+	for (i = 0; i < len; ++i){
+		hash ^= (unsigned char)path[i];
+		hash = (hash * 16777619UL) & 0xFFFFFFFFUL;
+	}
+	return hash;
+}
+
+/* the length of a path without its trailing '/'s, keeping "/" itself */
+static size_t path_len(const char* path){
+	size_t len = strlen(path);
+
+	while (len > 1 && path[len - 1] == '/'){
+		len--;
+	}
+	return len;
+}
+
+/* the length of a path's parent directory, which is 0 if it has none */
+static size_t parent_len(const char* path, size_t len){
+	if (len == 1 && path[0] == '/'){
+		return 0;
+	}
+	while (len > 0 && path[len - 1] != '/'){
+		len--;
+	}
+	if (len == 0){
+		return 0;
+	}
+	/* "/file" is in "/" */
+	return len > 1 ? len - 1 : 1;
+}
+
+static struct pc_entry* find(struct path_cache* pc, const char* path, size_t len, unsigned long hash){
+	struct pc_entry* e;
+
+	for (e = pc->buckets[hash % pc->n_buckets]; e; e = e->next){
+		if (e->hash == hash && strlen(e->path) == len && memcmp(e->path, path, len) == 0){
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static int grow(struct path_cache* pc){
+	size_t n_buckets = pc->n_buckets * 2;
+	struct pc_entry** buckets;
+	size_t i;
+
+	buckets = calloc(n_buckets, sizeof(*buckets));
+	if (!buckets){
+		log_enomem();
+		return -1;
+	}
+	for (i = 0; i < pc->n_buckets; ++i){
+		struct pc_entry* e = pc->buckets[i];
+
+		while (e){
+			struct pc_entry* next = e->next;
+
+			e->next = buckets[e->hash % n_buckets];
+			buckets[e->hash % n_buckets] = e;
+			e = next;
+		}
+	}
+	free(pc->buckets);
+	pc->buckets = buckets;
+	pc->n_buckets = n_buckets;
+	return 0;
+}
+
+/* returns the entry for the first len bytes of path, adding it if there is none */
+static struct pc_entry* find_or_add(struct path_cache* pc, const char* path, size_t len){
+	unsigned long hash = hash_path(path, len);
+	struct pc_entry* e;
+
+	if ((e = find(pc, path, len, hash)) != NULL){
+		return e;
+	}
+	if (pc->len >= pc->n_buckets && grow(pc) != 0){
+		return NULL;
+	}
+
+	e = calloc(1, sizeof(*e));
+	if (!e || !(e->path = malloc(len + 1))){
+		log_enomem();
+		free(e);
+		return NULL;
+	}
+	memcpy(e->path, path, len);
+	e->path[len] = '\0';
+	e->hash = hash;
+	e->state = PC_UNKNOWN;
+	e->next = pc->buckets[hash % pc->n_buckets];
+	pc->buckets[hash % pc->n_buckets] = e;
+	pc->len++;
+	return e;
+}
+
+static void entry_free(struct pc_entry* e){
+	free(e->path);
+	free(e);
+}
+
+/* every parent of the first len bytes of path is a directory */
+static int add_parents(struct path_cache* pc, const char* path, size_t len){
+	while ((len = parent_len(path, len)) > 0){
+		struct pc_entry* e = find_or_add(pc, path, len);
+
+		if (!e){
+			return -1;
+		}
+		/* the rest of the chain was recorded along with this one */
+		if (e->state == PC_DIR){
+			return 0;
+		}
+		e->state = PC_DIR;
+		e->has_st = 0;
+	}
+	return 0;
+}
+
+struct path_cache* pc_new(void){
+	struct path_cache* pc;
+
+	pc = calloc(1, sizeof(*pc));
+	if (!pc || !(pc->buckets = calloc(PC_INITIAL_BUCKETS, sizeof(*pc->buckets)))){
+		log_enomem();
+		free(pc);
+		return NULL;
+	}
+	pc->n_buckets = PC_INITIAL_BUCKETS;
+	pthread_mutex_init(&pc->lock, NULL);
+	return pc;
+}
+
+enum pc_state pc_lookup(struct path_cache* pc, const char* path, struct stat* st){
+	enum pc_state ret = PC_UNKNOWN;
+	struct pc_entry* e;
+	size_t len;
+
+	if (!pc || !path){
+		return PC_UNKNOWN;
+	}
+	len = path_len(path);
+
+	pthread_mutex_lock(&pc->lock);
+	e = find(pc, path, len, hash_path(path, len));
+	if (!e){
+		size_t p_len = parent_len(path, len);
+		struct pc_entry* parent = p_len > 0 ? find(pc, path, p_len, hash_path(path, p_len)) : NULL;
+
+		if (parent && parent->state == PC_DIR && parent->listed){
+			ret = PC_ABSENT;
+		}
+	}
+	else{
+		ret = e->state;
+		if (st && (ret == PC_FILE || ret == PC_DIR)){
+			if (e->has_st){
+				*st = e->st;
+			}
+			else{
+				ret = PC_UNKNOWN;
+			}
+		}
+	}
+	pthread_mutex_unlock(&pc->lock);
+	return ret;
+}
+
+int pc_set_stat(struct path_cache* pc, const char* path, const struct stat* st){
+	struct pc_entry* e;
+	size_t len;
+	int ret = 0;
+
+	return_ifnull(pc, -1);
+	return_ifnull(path, -1);
+	return_ifnull(st, -1);
+	len = path_len(path);
+
+	pthread_mutex_lock(&pc->lock);
+	if (add_parents(pc, path, len) != 0 || !(e = find_or_add(pc, path, len))){
+		ret = -1;
+	}
+	else{
+		if (!S_ISDIR(st->st_mode) || e->state != PC_DIR){
+			e->listed = 0;
+		}
+		e->state = S_ISDIR(st->st_mode) ? PC_DIR : PC_FILE;
+		e->st = *st;
+		e->has_st = 1;
+	}
+	pthread_mutex_unlock(&pc->lock);
+	return ret;
+}
+
+int pc_set_dir(struct path_cache* pc, const char* path){
+	struct pc_entry* e;
+	size_t len;
+	int ret = 0;
+
+	return_ifnull(pc, -1);
+	return_ifnull(path, -1);
+	len = path_len(path);
+
+	pthread_mutex_lock(&pc->lock);
+	if (add_parents(pc, path, len) != 0 || !(e = find_or_add(pc, path, len))){
+		ret = -1;
+	}
+	else if (e->state != PC_DIR){
+		e->state = PC_DIR;
+		e->has_st = 0;
+		e->listed = 0;
+	}
+	pthread_mutex_unlock(&pc->lock);
+	return ret;
+}
+
+int pc_set_file(struct path_cache* pc, const char* path){
+	struct pc_entry* e;
+	size_t len;
+	int ret = 0;
+
+	return_ifnull(pc, -1);
+	return_ifnull(path, -1);
+	len = path_len(path);
+
+	pthread_mutex_lock(&pc->lock);
+	if (add_parents(pc, path, len) != 0 || !(e = find_or_add(pc, path, len))){
+		ret = -1;
+	}
+	else{
+		/* whatever was known about it before may be out of date */
+		e->state = PC_FILE;
+		e->has_st = 0;
+		e->listed = 0;
+	}
+	pthread_mutex_unlock(&pc->lock);
+	return ret;
+}
+
+int pc_set_listed(struct path_cache* pc, const char* dir){
+	struct pc_entry* e;
+	size_t len;
+	int ret = 0;
+
+	return_ifnull(pc, -1);
+	return_ifnull(dir, -1);
+	len = path_len(dir);
+
+	pthread_mutex_lock(&pc->lock);
+	e = find(pc, dir, len, hash_path(dir, len));
+	if (!e || e->state != PC_DIR){
+		ret = -1;
+	}
+	else{
+		e->listed = 1;
+	}
+	pthread_mutex_unlock(&pc->lock);
+	return ret;
+}
+
+int pc_list(struct path_cache* pc, const char* dir, char*** out, size_t* out_len){
+	struct pc_entry* e;
+	char** arr = NULL;
+	size_t arr_len = 0;
+	size_t len;
+	size_t i;
+	int ret = 0;
+
+	return_ifnull(pc, -1);
+	return_ifnull(dir, -1);
+	return_ifnull(out, -1);
+	return_ifnull(out_len, -1);
+	*out = NULL;
+	*out_len = 0;
+	len = path_len(dir);
+
+	pthread_mutex_lock(&pc->lock);
+	e = find(pc, dir, len, hash_path(dir, len));
+	if (!e || e->state != PC_DIR || !e->listed){
+		ret = 1;
+		goto cleanup;
+	}
+
+	/* everything in a listed directory was recorded, so its entries are the paths whose parent it is */
+	for (i = 0; i < pc->n_buckets; ++i){
+		for (e = pc->buckets[i]; e; e = e->next){
+			char** tmp;
+			size_t e_len = strlen(e->path);
+
+			if ((e->state != PC_FILE && e->state != PC_DIR) || parent_len(e->path, e_len) != len || memcmp(e->path, dir, len) != 0){
+				continue;
+			}
+			tmp = realloc(arr, sizeof(*arr) * (arr_len + 1));
+			if (!tmp || !(tmp[arr_len] = malloc(e_len + 1))){
+				log_enomem();
+				arr = tmp ? tmp : arr;
+				ret = -1;
+				goto cleanup;
+			}
+			arr = tmp;
+			memcpy(arr[arr_len], e->path, e_len + 1);
+			arr_len++;
+		}
+	}
+
+cleanup:
+	pthread_mutex_unlock(&pc->lock);
+	if (ret == 0){
+		*out = arr;
+		*out_len = arr_len;
+	}
+	else{
+		for (i = 0; i < arr_len; ++i){
+			free(arr[i]);
+		}
+		free(arr);
+	}
+	return ret;
+}
+
+int pc_set_absent(struct path_cache* pc, const char* path){
+	struct pc_entry* parent;
+	struct pc_entry* e;
+	size_t len;
+	size_t p_len;
+	int ret = 0;
+
+	return_ifnull(pc, -1);
+	return_ifnull(path, -1);
+	len = path_len(path);
+	p_len = parent_len(path, len);
+
+	pthread_mutex_lock(&pc->lock);
+	/* otherwise a removal of the parent would have to look for it */
+	parent = p_len > 0 ? find(pc, path, p_len, hash_path(path, p_len)) : NULL;
+	if (parent && parent->state == PC_DIR){
+		if (!(e = find_or_add(pc, path, len))){
+			ret = -1;
+		}
+		else{
+			e->state = PC_ABSENT;
+			e->has_st = 0;
+		}
+	}
+	pthread_mutex_unlock(&pc->lock);
+	return ret;
+}
+
+void pc_invalidate(struct path_cache* pc, const char* path){
+	struct pc_entry** prev;
+	struct pc_entry* parent;
+	struct pc_entry* e;
+	unsigned long hash;
+	size_t len;
+	size_t p_len;
+	int is_dir;
+	size_t i;
+
+	if (!pc || !path){
+		return;
+	}
+	len = path_len(path);
+	hash = hash_path(path, len);
+
+	p_len = parent_len(path, len);
+
+	pthread_mutex_lock(&pc->lock);
+	/* the path is unknown now, so its parent no longer knows everything in it */
+	parent = p_len > 0 ? find(pc, path, p_len, hash_path(path, p_len)) : NULL;
+	if (parent){
+		parent->listed = 0;
+	}
+	e = find(pc, path, len, hash);
+	is_dir = e && e->state == PC_DIR;
+	for (prev = &pc->buckets[hash % pc->n_buckets]; e && *prev; prev = &(*prev)->next){
+		if (*prev == e){
+			*prev = e->next;
+			entry_free(e);
+			pc->len--;
+			break;
+		}
+	}
+
+	/* only a directory can have anything under it */
+	for (i = 0; is_dir && i < pc->n_buckets; ++i){
+		prev = &pc->buckets[i];
+		while (*prev){
+			e = *prev;
+			if (strncmp(e->path, path, len) == 0 && (e->path[len] == '/' || (len == 1 && path[0] == '/'))){
+				*prev = e->next;
+				entry_free(e);
+				pc->len--;
+			}
+			else{
+				prev = &e->next;
+			}
+		}
+	}
+	pthread_mutex_unlock(&pc->lock);
+}
+
+void pc_free(struct path_cache* pc){
+	size_t i;
+
+	if (!pc){
+		return;
+	}
+	for (i = 0; i < pc->n_buckets; ++i){
+		struct pc_entry* e = pc->buckets[i];
+
+		while (e){
+			struct pc_entry* next = e->next;
+			entry_free(e);
+			e = next;
+		}
+	}
+	free(pc->buckets);
+	pthread_mutex_destroy(&pc->lock);
+	free(pc);
+}
@@ -0,0 +1,161 @@
+/** @file cloud/pathcache.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __CLOUD_PATHCACHE_H
+#define __CLOUD_PATHCACHE_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+#ifndef __GNUC__
+#define __attribute__(x)
+#endif
+
+/**
+ * @brief What a path cache knows about a path.
+ */
+enum pc_state{
+	PC_UNKNOWN = 0, /**< @brief The path has to be looked up. */
+	PC_ABSENT = 1,  /**< @brief The path does not exist. */
+	PC_FILE = 2,    /**< @brief The path is a file. */
+	PC_DIR = 3      /**< @brief The path is a directory. */
+};
+
+/**
+ * @brief Remembers which remote paths exist, so the same path is not looked up in the cloud over and over.<br>
+ * Every path that is known about has its parent directories known to exist, so forgetting a path that is not a directory never has to look at anything else.<br>
+ * A path cache is safe to share between threads.
+ */
+struct path_cache;
+
+/**
+ * @brief Creates a new, empty path cache.
+ *
+ * @return A new path cache, or NULL on failure.<br>
+ * This must be freed with pc_free() when no longer in use.
+ */
+struct path_cache* pc_new(void) __attribute__((malloc));
+
+/**
+ * @brief Looks up a path.
+ *
+ * @param pc The path cache.
+ *
+ * @param path The remote path, with or without a trailing '/'.
+ *
+ * @param st Where to put the path's metadata if it exists.<br>
+ * This can be NULL, in which case it does not matter whether it is known.
+ *
+ * @return What is known about the path.<br>
+ * A path that was never recorded is PC_ABSENT if its parent was given to pc_set_listed().<br>
+ * If st is not NULL and the path's metadata is not known, this is PC_UNKNOWN even if the path is known to exist.
+ */
+enum pc_state pc_lookup(struct path_cache* pc, const char* path, struct stat* st);
+
+/**
+ * @brief Records a path's metadata, along with its parent directories existing.
+ *
+ * @param pc The path cache.
+ *
+ * @param path The remote path.
+ *
+ * @param st Its metadata.
+ *
+ * @return 0 on success, or negative on failure, in which case the path is not known.
+ */
+int pc_set_stat(struct path_cache* pc, const char* path, const struct stat* st);
+
+/**
+ * @brief Records that a directory exists, along with its parent directories.
+ *
+ * @param pc The path cache.
+ *
+ * @param path The remote directory.
+ *
+ * @return 0 on success, or negative on failure, in which case the directory is not known.
+ */
+int pc_set_dir(struct path_cache* pc, const char* path);
+
+/**
+ * @brief Records that a file exists without its metadata, along with its parent directories.<br>
+ * Any metadata recorded for it before is forgotten, e.g. because it was just uploaded again.
+ *
+ * @param pc The path cache.
+ *
+ * @param path The remote file.
+ *
+ * @return 0 on success, or negative on failure, in which case the file is not known.
+ */
+int pc_set_file(struct path_cache* pc, const char* path);
+
+/**
+ * @brief Records that every entry of a known directory is known, so any other path in it does not exist.<br>
+ * This is true of a directory that was just created, since it is empty.<br>
+ * It stops being true once anything in the directory is forgotten with pc_invalidate().
+ *
+ * @param pc The path cache.
+ *
+ * @param dir The remote directory.<br>
+ * This must already be known to be a directory.
+ *
+ * @return 0 on success, or negative if the directory is not known.
+ */
+int pc_set_listed(struct path_cache* pc, const char* dir);
+
+/**
+ * @brief Lists a directory that was given to pc_set_listed(), without asking the cloud.
+ *
+ * @param pc The path cache.
+ *
+ * @param dir The remote directory.
+ *
+ * @param out A pointer to a string array that will contain the full path of every entry in the directory, in no particular order.<br>
+ * This string array will be set to NULL if the directory's entries are not all known or this function fails.<br>
+ * Each string and the array itself must be freed when no longer in use.
+ *
+ * @param out_len A pointer to an integer that will contain the length of the output array.
+ *
+ * @return 0 on success, positive if the directory's entries are not all known, or negative on failure.
+ */
+int pc_list(struct path_cache* pc, const char* dir, char*** out, size_t* out_len);
+
+/**
+ * @brief Records that a path does not exist.<br>
+ * This is only remembered if its parent is known to be a directory.
+ *
+ * @param pc The path cache.
+ *
+ * @param path The remote path.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int pc_set_absent(struct path_cache* pc, const char* path);
+
+/**
+ * @brief Forgets a path and everything under it.<br>
+ * This must be called whenever the path is changed, e.g. by an upload, rename, or removal.
+ *
+ * @param pc The path cache.
+ *
+ * @param path The remote path.
+ *
+ * @return void
+ */
+void pc_invalidate(struct path_cache* pc, const char* path);
+
+/**
+ * @brief Frees a path cache.
+ *
+ * @param pc The path cache to free.<br>
+ * This can be NULL, in which case this function does nothing.
+ *
+ * @return void
+ */
+void pc_free(struct path_cache* pc);
+
+#endif
@@ -0,0 +1,331 @@
+/** @file cloud/ratelimit.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "ratelimit.h"
+#include "../log.h"
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MINUTES_PER_DAY (24 * 60)
+
+struct rate_schedule{
+	struct rs_window{
+		/* minutes since midnight, and start > end if it wraps past midnight */
+		int start;
+		int end;
+		uint64_t rate;
+	}* windows;
+	size_t len;
+	/* the rate outside every window */
+	uint64_t rate;
+};
+
+struct token_bucket{
+	uint64_t rate;
+	/* what can be sent right now, which is at most a second's worth */
+	double tokens;
+	struct timespec last;
+	/* waiting callers with priority, which hold back everyone else */
+	size_t priority_waiting;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static const char* skip_space(const char* str){
+	while (isspace((unsigned char)*str)){
+		str++;
+	}
+	return str;
+}
+
+/* "HH:MM", where "24:00" is only allowed as the end of a window */
+static const char* parse_time(const char* str, int allow_24, int* out){
+	int hours;
+	int minutes;
+
+	if (!isdigit((unsigned char)str[0])){
+		return NULL;
+	}
+	hours = str[0] - '0';
+	str++;
+	if (isdigit((unsigned char)str[0])){
+		hours = hours * 10 + str[0] - '0';
+		str++;
+	}
+	if (str[0] != ':' || !isdigit((unsigned char)str[1]) || !isdigit((unsigned char)str[2])){
+		return NULL;
+	}
+	minutes = (str[1] - '0') * 10 + str[2] - '0';
+	if (minutes > 59 || hours > 24 || (hours == 24 && (minutes != 0 || !allow_24))){
+		return NULL;
+	}
+	*out = hours * 60 + minutes;
+	return str + 3;
+}
+
+/* a rate in bytes per second with an optional K/M/G suffix, up to end */
+static int parse_rate(const char* str, const char* end, uint64_t* out){
+	unsigned long val;
+	char* tmp;
+	int shift = 0;
+
+	str = skip_space(str);
+	while (end > str && isspace((unsigned char)end[-1])){
+		end--;
+	}
+	if ((size_t)(end - str) == strlen("none") && strncmp(str, "none", end - str) == 0){
+		*out = 0;
+		return 0;
+	}
+	if (!isdigit((unsigned char)*str)){
+		return -1;
+	}
+
+	errno = 0;
+	val = strtoul(str, &tmp, 10);
+	if (errno != 0){
+		return -1;
+	}
+	if (tmp < end){
+		switch (toupper((unsigned char)*tmp)){
+		case 'K':
+			shift = 10;
+			break;
+		case 'M':
+			shift = 20;
+			break;
+		case 'G':
+			shift = 30;
+			break;
+		default:
+			return -1;
+		}
+		tmp++;
+	}
+	if (tmp != end || ((uint64_t)val << shift) >> shift != (uint64_t)val){
+		return -1;
+	}
+	*out = (uint64_t)val << shift;
+	return 0;
+}
+
+/* one comma-separated item of a schedule */
+static int parse_item(struct rate_schedule* rs, const char* str, const char* end){
+	const char* eq;
+	struct rs_window w;
+	void* tmp;
+
+	str = skip_space(str);
+	eq = memchr(str, '=', end - str);
+	if (!eq){
+		return parse_rate(str, end, &rs->rate);
+	}
+
+	if (!(str = parse_time(str, 0, &w.start)) ||
+			*(str = skip_space(str)) != '-' ||
+			!(str = parse_time(skip_space(str + 1), 1, &w.end)) ||
+			skip_space(str) != eq ||
+			parse_rate(eq + 1, end, &w.rate) != 0){
+		return -1;
+	}
+
+	tmp = realloc(rs->windows, (rs->len + 1) * sizeof(*rs->windows));
+	if (!tmp){
+		log_enomem();
+		return -1;
+	}
+	rs->windows = tmp;
+	rs->windows[rs->len] = w;
+	rs->len++;
+	return 0;
+}
+
+int rs_parse(const char* str, struct rate_schedule** out){
+	struct rate_schedule* rs = NULL;
+	const char* end;
+
+	return_ifnull(str, -1);
+	return_ifnull(out, -1);
+
+	*out = NULL;
+
+	rs = calloc(1, sizeof(*rs));
+	if (!rs){
+		log_enomem();
+		return -1;
+	}
+
+	do{
+		end = strchr(str, ',');
+		end = end ? end : str + strlen(str);
+		if (parse_item(rs, str, end) != 0){
+			log_error_ex2("Invalid upload limit \"%.*s\"", (int)(end - str), str);
+			rs_free(rs);
+			return -1;
+		}
+		str = end + 1;
+	}while (*end);
+
+	*out = rs;
+	return 0;
+}
+
+uint64_t rs_rate_at(const struct rate_schedule* rs, time_t t){
+	struct tm tm;
+	int now;
+	size_t i;
+
+	return_ifnull(rs, 0);
+
+	if (!localtime_r(&t, &tm)){
+		log_warning("Failed to get the time of day for the upload limit");
+		return rs->rate;
+	}
+	now = tm.tm_hour * 60 + tm.tm_min;
+
+	for (i = 0; i < rs->len; ++i){
+		const struct rs_window* w = &rs->windows[i];
+
+		if (w->start == w->end % MINUTES_PER_DAY ||
+				(w->start < w->end && now >= w->start && now < w->end) ||
+				(w->start > w->end && (now >= w->start || now < w->end))){
+			return w->rate;
+		}
+	}
+	return rs->rate;
+}
+
+void rs_free(struct rate_schedule* rs){
+	if (!rs){
+		return;
+	}
+	free(rs->windows);
+	free(rs);
+}
+
+static void now_monotonic(struct timespec* out){
+	if (clock_gettime(CLOCK_MONOTONIC, out) != 0){
+		out->tv_sec = time(NULL);
+		out->tv_nsec = 0;
+	}
+}
+
+/* adds what has built up since the last refill, up to a second's worth */
+static void refill(struct token_bucket* tb){
+	struct timespec now;
+	double elapsed;
+
+	now_monotonic(&now);
+	elapsed = (double)(now.tv_sec - tb->last.tv_sec) + (now.tv_nsec - tb->last.tv_nsec) / 1e9;
+	tb->last = now;
+	if (elapsed <= 0){
+		return;
+	}
+	tb->tokens += elapsed * (double)tb->rate;
+	if (tb->tokens > (double)tb->rate){
+		tb->tokens = (double)tb->rate;
+	}
+}
+
+/* waits until woken or for a number of seconds, whichever comes first */
+static void wait_for(struct token_bucket* tb, double seconds){
+	struct timespec ts;
+	long nsec;
+
+	if (clock_gettime(CLOCK_REALTIME, &ts) != 0){
+		ts.tv_sec = time(NULL);
+		ts.tv_nsec = 0;
+	}
+	/* a rate change wakes everyone anyway, so this never needs to sleep long */
+	seconds = seconds > 1.0 ? 1.0 : seconds;
+	nsec = ts.tv_nsec + (long)(seconds * 1e9);
+	ts.tv_sec += nsec / 1000000000L;
+	ts.tv_nsec = nsec % 1000000000L;
+	pthread_cond_timedwait(&tb->cond, &tb->lock, &ts);
+}
+
+struct token_bucket* tb_new(uint64_t rate){
+	struct token_bucket* tb;
+
+	tb = calloc(1, sizeof(*tb));
+	if (!tb){
+		log_enomem();
+		return NULL;
+	}
+	tb->rate = rate;
+	tb->tokens = (double)rate;
+	now_monotonic(&tb->last);
+	pthread_mutex_init(&tb->lock, NULL);
+	pthread_cond_init(&tb->cond, NULL);
+	return tb;
+}
+
+void tb_set_rate(struct token_bucket* tb, uint64_t rate){
+	if (!tb){
+		return;
+	}
+	pthread_mutex_lock(&tb->lock);
+	if (tb->rate != rate){
+		refill(tb);
+		tb->rate = rate;
+		tb->tokens = tb->tokens > (double)rate ? (double)rate : tb->tokens;
+		pthread_cond_broadcast(&tb->cond);
+	}
+	pthread_mutex_unlock(&tb->lock);
+}
+
+size_t tb_take(struct token_bucket* tb, size_t bytes, int priority){
+	size_t ret = bytes;
+
+	if (!tb || bytes == 0){
+		return bytes;
+	}
+
+	pthread_mutex_lock(&tb->lock);
+	if (priority){
+		tb->priority_waiting++;
+	}
+	while (tb->rate != 0){
+		double slice = (double)tb->rate / RL_SLICES_PER_SECOND;
+		double want = (double)bytes;
+
+		want = want > slice ? slice : want;
+		want = want < 1.0 ? 1.0 : want;
+
+		refill(tb);
+		if (!priority && tb->priority_waiting > 0){
+			wait_for(tb, 1.0 / RL_SLICES_PER_SECOND);
+			continue;
+		}
+		if (tb->tokens >= want){
+			ret = (size_t)want;
+			tb->tokens -= (double)ret;
+			break;
+		}
+		wait_for(tb, (want - tb->tokens) / (double)tb->rate);
+	}
+	if (priority){
+		tb->priority_waiting--;
+		/* let everything held back by this try again */
+		pthread_cond_broadcast(&tb->cond);
+	}
+	pthread_mutex_unlock(&tb->lock);
+	return ret;
+}
+
+void tb_free(struct token_bucket* tb){
+	if (!tb){
+		return;
+	}
+	pthread_mutex_destroy(&tb->lock);
+	pthread_cond_destroy(&tb->cond);
+	free(tb);
+}
@@ -0,0 +1,129 @@
+/** @file cloud/ratelimit.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __CLOUD_RATELIMIT_H
+#define __CLOUD_RATELIMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifndef __GNUC__
+#define __attribute__(x)
+#endif
+
+/**
+ * @brief Uploads of at most this many bytes go ahead of larger ones when the upload rate is limited.<br>
+ * This keeps small files and the checksum manifest moving while large files share what is left.
+ */
+#ifndef RL_PRIORITY_SIZE
+#define RL_PRIORITY_SIZE (1024UL * 1024)
+#endif
+
+/**
+ * @brief The most of its rate that a token bucket hands out at once, as a fraction of a second.<br>
+ * A slow limit then still sends something often enough that the connection is not given up on as stalled.
+ */
+#define RL_SLICES_PER_SECOND (4)
+
+/**
+ * @brief The upload rates to use at different times of day.
+ */
+struct rate_schedule;
+
+/**
+ * @brief Parses an upload rate schedule.<br>
+ * A schedule is a comma-separated list of rates, each either "HH:MM-HH:MM=RATE" for that time of day, or just "RATE" for any other time.<br>
+ * A rate is in bytes per second with an optional K, M, or G suffix, and 0 or "none" means unlimited.<br>
+ * The first window that matches wins, and a window can wrap past midnight, e.g. "08:00-18:00=512K,22:00-06:00=0,2M".
+ *
+ * @param str The schedule to parse.
+ *
+ * @param out A pointer to a schedule that this function will fill.<br>
+ * This will be set to NULL if this function fails.<br>
+ * This must be freed with rs_free() when no longer in use.
+ *
+ * @return 0 on success, or negative if the schedule is not valid.
+ */
+int rs_parse(const char* str, struct rate_schedule** out);
+
+/**
+ * @brief Gets the upload rate a schedule allows at a time.
+ *
+ * @param rs The schedule.
+ *
+ * @param t The time, whose local time of day picks the window.
+ *
+ * @return The rate in bytes per second, or 0 for unlimited.
+ */
+uint64_t rs_rate_at(const struct rate_schedule* rs, time_t t);
+
+/**
+ * @brief Frees a schedule.
+ *
+ * @param rs The schedule to free.<br>
+ * This can be NULL, in which case this function does nothing.
+ *
+ * @return void
+ */
+void rs_free(struct rate_schedule* rs);
+
+/**
+ * @brief Shares one upload rate between every transfer, letting up to one second of it build up while nothing is sent.<br>
+ * A token bucket is safe to share between threads.
+ */
+struct token_bucket;
+
+/**
+ * @brief Creates a new token bucket.
+ *
+ * @param rate The rate in bytes per second, or 0 for unlimited.
+ *
+ * @return A new token bucket, or NULL on failure.<br>
+ * This must be freed with tb_free() when no longer in use.
+ */
+struct token_bucket* tb_new(uint64_t rate) __attribute__((malloc));
+
+/**
+ * @brief Changes the rate of a token bucket.<br>
+ * Anything waiting on it is woken up to wait for the new rate instead.
+ *
+ * @param tb The token bucket.
+ *
+ * @param rate The rate in bytes per second, or 0 for unlimited.
+ *
+ * @return void
+ */
+void tb_set_rate(struct token_bucket* tb, uint64_t rate);
+
+/**
+ * @brief Waits until some bytes can be sent.<br>
+ * While anything with priority is waiting, nothing without it is let through.
+ *
+ * @param tb The token bucket.
+ *
+ * @param bytes How many bytes are ready to be sent.
+ *
+ * @param priority Non-zero if the bytes belong to a transfer of at most RL_PRIORITY_SIZE bytes.
+ *
+ * @return How many of the bytes can be sent now, which is at most 1/RL_SLICES_PER_SECOND of a second's worth, but never 0 unless bytes is.
+ */
+size_t tb_take(struct token_bucket* tb, size_t bytes, int priority);
+
+/**
+ * @brief Frees a token bucket.<br>
+ * Nothing may be waiting on it.
+ *
+ * @param tb The token bucket to free.<br>
+ * This can be NULL, in which case this function does nothing.
+ *
+ * @return void
+ */
+void tb_free(struct token_bucket* tb);
+
+#endif
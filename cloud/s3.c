@@ -0,0 +1,2285 @@
+/** @file cloud/s3.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "s3.h"
+#include "ratelimit.h"
+#include "s3sign.h"
+#include "../log.h"
+#include "../progressbar.h"
+#include "../strings/stringhelper.h"
+#include <curl/curl.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+/* bigger receive buffers than curl's default 16KiB keep a fast link busy */
+#define S3_BUFFER_SIZE (512L * 1024)
+
+struct s3_handle{
+	char* access_key;
+	char* secret_key;
+	char* region;
+	/* e.g. "https://s3.us-east-1.amazonaws.com" */
+	char* endpoint;
+	/* the Host header, which is signed along with the request */
+	char* host;
+	/* every request shares one connection cache, so connections are reused between threads */
+	CURLSH* share;
+	pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+	/* idle easy handles, which keep their TLS sessions and buffers */
+	CURL* pool[S3_POOL_SIZE];
+	size_t pool_len;
+	pthread_mutex_t pool_lock;
+	/* every request body is sent through this, which is unlimited until S3set_upload_limit() */
+	struct token_bucket* tb;
+};
+
+struct s3_request{
+	const char* method;
+	/* NULL for the list of buckets */
+	const char* bucket;
+	/* NULL for the bucket itself */
+	const char* key;
+	/* encoded and sorted by name, or NULL */
+	const char* query;
+	const char* range;
+	/* encoded, for a copy within S3 */
+	const char* copy_source;
+	const char* copy_range;
+	/* the body comes from data if it is not NULL, or from in_fd if it is not negative */
+	const char* data;
+	int in_fd;
+	uint64_t in_offset;
+	uint64_t in_len;
+	/* a successful response's body goes to out_sink if it is not NULL, to out_fd if it is not negative, otherwise into memory */
+	int (*out_sink)(const void* data, size_t len, void* sink_data);
+	void* out_sink_data;
+	int out_fd;
+	uint64_t out_offset;
+};
+
+struct s3_response{
+	long status;
+	char* body;
+	size_t body_len;
+	/* how much of the body went to out_sink or out_fd */
+	uint64_t received;
+	/* out_sink refused the body, which asking again would not change */
+	int sink_failed;
+	char* etag;
+	uint64_t content_length;
+	time_t last_modified;
+	/* state for the callbacks */
+	const struct s3_request* req;
+	struct token_bucket* tb;
+	uint64_t sent;
+};
+
+enum s3_parts_kind{
+	PARTS_UPLOAD,
+	PARTS_COPY,
+	PARTS_DOWNLOAD
+};
+
+/* one file moved in ranges by several threads */
+struct s3_parts{
+	enum s3_parts_kind kind;
+	struct s3_handle* h;
+	const char* bucket;
+	const char* key;
+	/* the file being uploaded from or downloaded to */
+	int fd;
+	/* what is being copied for PARTS_COPY */
+	const char* copy_source;
+	/* encoded, if this is a multipart upload */
+	char* upload_id;
+	uint64_t size;
+	uint64_t part_size;
+	unsigned long n_parts;
+	char** etags;
+	unsigned long next;
+	int failed;
+	struct progress* p;
+	pthread_mutex_t lock;
+};
+
+static pthread_once_t curl_once = PTHREAD_ONCE_INIT;
+static CURLcode curl_init_res;
+
+static void curl_init(void){
+	curl_init_res = curl_global_init(CURL_GLOBAL_DEFAULT);
+}
+
+static void share_lock(CURL* curl, curl_lock_data data, curl_lock_access access, void* userptr){
+	struct s3_handle* h = userptr;
+	(void)curl;
+	(void)access;
+	pthread_mutex_lock(&h->share_locks[data]);
+}
+
+static void share_unlock(CURL* curl, curl_lock_data data, void* userptr){
+	struct s3_handle* h = userptr;
+	(void)curl;
+	pthread_mutex_unlock(&h->share_locks[data]);
+}
+
+static CURL* get_curl(struct s3_handle* h){
+	CURL* curl = NULL;
+
+	pthread_mutex_lock(&h->pool_lock);
+	if (h->pool_len > 0){
+		curl = h->pool[--h->pool_len];
+	}
+	pthread_mutex_unlock(&h->pool_lock);
+
+	if (!curl && !(curl = curl_easy_init())){
+		log_error("S3: Failed to create a connection handle");
+	}
+	return curl;
+}
+
+static void put_curl(struct s3_handle* h, CURL* curl){
+	curl_easy_reset(curl);
+
+	pthread_mutex_lock(&h->pool_lock);
+	if (h->pool_len < S3_POOL_SIZE){
+		h->pool[h->pool_len++] = curl;
+		curl = NULL;
+	}
+	pthread_mutex_unlock(&h->pool_lock);
+
+	if (curl){
+		curl_easy_cleanup(curl);
+	}
+}
+
+/* finds needle within [start, end) */
+static const char* mem_find(const char* start, const char* end, const char* needle){
+	size_t len = strlen(needle);
+
+	for (; start + len <= end; ++start){
+		if (memcmp(start, needle, len) == 0){
+			return start;
+		}
+	}
+	return NULL;
+}
+
+/* finds the next <tag>...</tag> within [start, end), returning where its text starts and setting *text_end to where it ends */
+static const char* xml_find(const char* start, const char* end, const char* tag, const char** text_end){
+	char open[64];
+	char close[64];
+	const char* text;
+
+	sprintf(open, "<%.60s>", tag);
+	sprintf(close, "</%.60s>", tag);
+	if (!(text = mem_find(start, end, open))){
+		return NULL;
+	}
+	text += strlen(open);
+	if (!(*text_end = mem_find(text, end, close))){
+		return NULL;
+	}
+	return text;
+}
+
+/* the text of [start, end) with its entities decoded */
+static char* xml_text(const char* start, const char* end){
+	const char* entities[][2] = {
+		{"&amp;", "&"},
+		{"&lt;", "<"},
+		{"&gt;", ">"},
+		{"&quot;", "\""},
+		{"&apos;", "'"}
+	};
+	char* ret;
+	size_t len = 0;
+
+	ret = malloc(end - start + 1);
+	if (!ret){
+		log_enomem();
+		return NULL;
+	}
+	while (start < end){
+		size_t i;
+
+		for (i = 0; i < sizeof(entities) / sizeof(entities[0]); ++i){
+			size_t e_len = strlen(entities[i][0]);
+			if ((size_t)(end - start) >= e_len && memcmp(start, entities[i][0], e_len) == 0){
+				ret[len++] = entities[i][1][0];
+				start += e_len;
+				break;
+			}
+		}
+		if (i == sizeof(entities) / sizeof(entities[0])){
+			ret[len++] = *start++;
+		}
+	}
+	ret[len] = '\0';
+	return ret;
+}
+
+/* the text of the first <tag> in a response body, or NULL if there is none */
+static char* xml_get(const struct s3_response* resp, const char* tag){
+	const char* text;
+	const char* text_end;
+
+	if (!resp->body || !(text = xml_find(resp->body, resp->body + resp->body_len, tag, &text_end))){
+		return NULL;
+	}
+	return xml_text(text, text_end);
+}
+
+/* days since the epoch from the proleptic Gregorian calendar, so the time zone does not matter */
+static time_t utc_time(int y, int month, int d, int hh, int mm, int ss){
+	long era;
+	long yoe;
+	long doy;
+	long days;
+
+	y -= month <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	days = era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+	return (time_t)days * 86400 + hh * 3600 + mm * 60 + ss;
+}
+
+static time_t parse_http_date(const char* str){
+	const char* months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	const char* m;
+	char mon[4];
+	int d;
+	int y;
+	int hh;
+	int mm;
+	int ss;
+
+	/* e.g. "Wed, 12 Oct 2009 17:50:00 GMT" */
+	if (sscanf(str, "%*3s, %d %3s %d %d:%d:%d", &d, mon, &y, &hh, &mm, &ss) != 6 ||
+			!(m = strstr(months, mon)) || (m - months) % 3 != 0){
+		return 0;
+	}
+	return utc_time(y, (m - months) / 3 + 1, d, hh, mm, ss);
+}
+
+/* the dates in a listing, e.g. "2009-10-12T17:50:30.000Z" */
+static time_t parse_iso_date(const char* str){
+	int month;
+	int d;
+	int y;
+	int hh;
+	int mm;
+	int ss;
+
+	if (sscanf(str, "%d-%d-%dT%d:%d:%d", &y, &month, &d, &hh, &mm, &ss) != 6){
+		return 0;
+	}
+	return utc_time(y, month, d, hh, mm, ss);
+}
+
+static size_t read_cb(char* buf, size_t size, size_t nmemb, void* userp){
+	struct s3_response* resp = userp;
+	const struct s3_request* req = resp->req;
+	uint64_t left = req->in_len - resp->sent;
+	size_t len = size * nmemb < left ? size * nmemb : (size_t)left;
+
+	if (len == 0){
+		return 0;
+	}
+	/* small uploads, like the checksum file, go ahead of the parts of large ones */
+	len = tb_take(resp->tb, len, req->in_len <= RL_PRIORITY_SIZE);
+	if (req->data){
+		memcpy(buf, req->data + resp->sent, len);
+	}
+	else{
+		ssize_t res = pread(req->in_fd, buf, len, req->in_offset + resp->sent);
+		if (res <= 0){
+			log_warning_ex("S3: Failed to read the file being uploaded (%s)", strerror(errno));
+			return CURL_READFUNC_ABORT;
+		}
+		len = res;
+	}
+	resp->sent += len;
+	progress_board_add(STAGE_UPLOAD, len);
+	return len;
+}
+
+static size_t write_cb(char* buf, size_t size, size_t nmemb, void* userp){
+	struct s3_response* resp = userp;
+	const struct s3_request* req = resp->req;
+	size_t len = size * nmemb;
+	size_t written = 0;
+	char* tmp;
+
+	/* an error's body is XML describing it, not the file */
+	if (req->out_sink && resp->status / 100 == 2){
+		/* a server that ignored the range would hand the sink what it already has */
+		if (req->range && resp->status != 206){
+			log_warning("S3: The server did not resume the download where it stopped");
+			resp->sink_failed = 1;
+			return 0;
+		}
+		if (req->out_sink(buf, len, req->out_sink_data) != 0){
+			resp->sink_failed = 1;
+			return 0;
+		}
+		resp->received += len;
+		return len;
+	}
+	if (req->out_fd >= 0 && resp->status / 100 == 2){
+		while (written < len){
+			ssize_t res = pwrite(req->out_fd, buf + written, len - written, req->out_offset + resp->received);
+			if (res <= 0){
+				log_warning_ex("S3: Failed to write the file being downloaded (%s)", strerror(errno));
+				return 0;
+			}
+			written += res;
+			resp->received += res;
+		}
+		return len;
+	}
+
+	tmp = realloc(resp->body, resp->body_len + len + 1);
+	if (!tmp){
+		log_enomem();
+		return 0;
+	}
+	resp->body = tmp;
+	memcpy(resp->body + resp->body_len, buf, len);
+	resp->body_len += len;
+	resp->body[resp->body_len] = '\0';
+	return len;
+}
+
+static size_t header_cb(char* buf, size_t size, size_t nmemb, void* userp){
+	struct s3_response* resp = userp;
+	size_t len = size * nmemb;
+	char line[512];
+	char* value;
+
+	if (len >= sizeof(line)){
+		return len;
+	}
+	memcpy(line, buf, len);
+	line[len] = '\0';
+	line[strcspn(line, "\r\n")] = '\0';
+
+	/* a new status line starts a new response, e.g. after a redirect */
+	if (strncmp(line, "HTTP/", 5) == 0){
+		const char* status = strchr(line, ' ');
+		resp->status = status ? strtol(status, NULL, 10) : 0;
+		return len;
+	}
+	if (!(value = strchr(line, ':'))){
+		return len;
+	}
+	*value++ = '\0';
+	value += strspn(value, " \t");
+
+	if (strcasecmp(line, "ETag") == 0){
+		free(resp->etag);
+		resp->etag = sh_dup(value);
+	}
+	else if (strcasecmp(line, "Content-Length") == 0){
+		resp->content_length = strtoul(value, NULL, 10);
+	}
+	else if (strcasecmp(line, "Last-Modified") == 0){
+		resp->last_modified = parse_http_date(value);
+	}
+	return len;
+}
+
+static struct curl_slist* add_header(struct curl_slist* list, const char* name, const char* value, int* failed){
+	struct curl_slist* tmp;
+	char* header;
+
+	if (*failed || !value){
+		return list;
+	}
+	if (!(header = sh_sprintf("%s: %s", name, value)) || !(tmp = curl_slist_append(list, header))){
+		log_enomem();
+		*failed = 1;
+		free(header);
+		return list;
+	}
+	free(header);
+	return tmp;
+}
+
+static void response_reset(struct s3_response* resp, const struct s3_request* req){
+	free(resp->body);
+	free(resp->etag);
+	memset(resp, 0, sizeof(*resp));
+	resp->req = req;
+}
+
+static void response_free(struct s3_response* resp){
+	free(resp->body);
+	free(resp->etag);
+	memset(resp, 0, sizeof(*resp));
+}
+
+/* sends a request once, returning 0 if a response came back no matter its status */
+static int perform_once(struct s3_handle* h, CURL* curl, const struct s3_request* req, struct s3_response* resp){
+	struct s3_header headers[6];
+	struct s3_request_sig sig;
+	struct curl_slist* list = NULL;
+	char amz_date[17];
+	char* enc_bucket = NULL;
+	char* enc_key = NULL;
+	char* path = NULL;
+	char* url = NULL;
+	char* auth = NULL;
+	CURLcode res;
+	int failed = 0;
+	int ret = 0;
+
+	enc_bucket = req->bucket ? s3_uri_encode(req->bucket, 0) : sh_new();
+	enc_key = req->key ? s3_uri_encode(req->key, 1) : sh_new();
+	if (!enc_bucket || !enc_key){
+		ret = -1;
+		goto cleanup;
+	}
+	path = req->key ? sh_sprintf("/%s/%s", enc_bucket, enc_key) : sh_sprintf("/%s", enc_bucket);
+	url = path ? sh_sprintf("%s%s%s%s", h->endpoint, path, req->query ? "?" : "", req->query ? req->query : "") : NULL;
+	if (!url || s3_amz_date(time(NULL), amz_date) != 0){
+		log_error("S3: Failed to create the request");
+		ret = -1;
+		goto cleanup;
+	}
+
+	/* these have to be in order of name */
+	sig.n_headers = 0;
+	headers[sig.n_headers].name = "host";
+	headers[sig.n_headers++].value = h->host;
+	if (req->range){
+		headers[sig.n_headers].name = "range";
+		headers[sig.n_headers++].value = req->range;
+	}
+	headers[sig.n_headers].name = "x-amz-content-sha256";
+	headers[sig.n_headers++].value = S3_UNSIGNED_PAYLOAD;
+	if (req->copy_source){
+		headers[sig.n_headers].name = "x-amz-copy-source";
+		headers[sig.n_headers++].value = req->copy_source;
+	}
+	if (req->copy_range){
+		headers[sig.n_headers].name = "x-amz-copy-source-range";
+		headers[sig.n_headers++].value = req->copy_range;
+	}
+	headers[sig.n_headers].name = "x-amz-date";
+	headers[sig.n_headers++].value = amz_date;
+
+	sig.method = req->method;
+	sig.path = path;
+	sig.query = req->query;
+	sig.headers = headers;
+	sig.payload_hash = S3_UNSIGNED_PAYLOAD;
+	sig.amz_date = amz_date;
+	if (!(auth = s3_authorization(h->access_key, h->secret_key, h->region, &sig))){
+		ret = -1;
+		goto cleanup;
+	}
+
+	list = add_header(list, "Host", h->host, &failed);
+	list = add_header(list, "Range", req->range, &failed);
+	list = add_header(list, "x-amz-content-sha256", S3_UNSIGNED_PAYLOAD, &failed);
+	list = add_header(list, "x-amz-copy-source", req->copy_source, &failed);
+	list = add_header(list, "x-amz-copy-source-range", req->copy_range, &failed);
+	list = add_header(list, "x-amz-date", amz_date, &failed);
+	list = add_header(list, "Authorization", auth, &failed);
+	/* waiting for "100 Continue" costs a round trip per part */
+	list = add_header(list, "Expect", "", &failed);
+	list = add_header(list, "Content-Type", req->data && strcmp(req->method, "POST") == 0 ? "application/xml" : NULL, &failed);
+	if (failed){
+		ret = -1;
+		goto cleanup;
+	}
+
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
+	curl_easy_setopt(curl, CURLOPT_SHARE, h->share);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(curl, CURLOPT_BUFFERSIZE, S3_BUFFER_SIZE);
+	curl_easy_setopt(curl, CURLOPT_UPLOAD_BUFFERSIZE, 2L * 1024 * 1024);
+	/* a stalled connection is given up on instead of hanging the backup */
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 60L);
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_cb);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, resp);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_cb);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, resp);
+	curl_easy_setopt(curl, CURLOPT_READFUNCTION, read_cb);
+	curl_easy_setopt(curl, CURLOPT_READDATA, resp);
+	resp->tb = h->tb;
+
+	if (strcmp(req->method, "HEAD") == 0){
+		curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+	}
+	else if (strcmp(req->method, "PUT") == 0){
+		curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
+		curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)req->in_len);
+	}
+	else if (strcmp(req->method, "POST") == 0){
+		curl_easy_setopt(curl, CURLOPT_POST, 1L);
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)req->in_len);
+	}
+	else if (strcmp(req->method, "GET") != 0){
+		curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, req->method);
+	}
+
+	if ((res = curl_easy_perform(curl)) != CURLE_OK){
+		log_warning_ex2("S3: %s request failed (%s)", req->method, curl_easy_strerror(res));
+		ret = -1;
+		goto cleanup;
+	}
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &resp->status);
+
+cleanup:
+	curl_slist_free_all(list);
+	free(enc_bucket);
+	free(enc_key);
+	free(path);
+	free(url);
+	free(auth);
+	return ret;
+}
+
+/* sends a request until the server answers it, returning 0 if it did no matter its status */
+static int perform(struct s3_handle* h, const struct s3_request* req, struct s3_response* resp){
+	int attempt;
+	int ret = -1;
+
+	for (attempt = 0; attempt < S3_REQUEST_RETRIES; ++attempt){
+		CURL* curl;
+
+		if (attempt > 0){
+			sleep(1U << attempt);
+		}
+		response_reset(resp, req);
+		if (!(curl = get_curl(h))){
+			return -1;
+		}
+		ret = perform_once(h, curl, req, resp);
+		put_curl(h, curl);
+
+		/* only a busy or failing server is worth asking again */
+		if (ret == 0 && resp->status < 500 && resp->status != 429){
+			break;
+		}
+	}
+	return ret;
+}
+
+/* 0 if a response succeeded, otherwise logs why it did not */
+static int check_response(const char* what, const char* path, const struct s3_response* resp){
+	char* code;
+	char* message;
+
+	/* a copy can fail after it already answered 200 */
+	if (resp->status / 100 == 2 && !(resp->body && strstr(resp->body, "<Error>"))){
+		return 0;
+	}
+	code = xml_get(resp, "Code");
+	message = xml_get(resp, "Message");
+	log_error_ex2("S3: Failed to %s %s", what, path);
+	log_error_ex2("S3: HTTP %ld (%s)", resp->status, message ? message : code ? code : "no reason given");
+	free(code);
+	free(message);
+	return -1;
+}
+
+/* splits "/bucket/key" into its bucket and key, either of which is NULL if it is not there */
+static int split_path(const char* path, char** bucket, char** key){
+	size_t len;
+
+	*bucket = NULL;
+	*key = NULL;
+
+	path += strspn(path, "/");
+	len = strcspn(path, "/");
+	if (len == 0){
+		return 0;
+	}
+	if (!(*bucket = malloc(len + 1))){
+		log_enomem();
+		return -1;
+	}
+	memcpy(*bucket, path, len);
+	(*bucket)[len] = '\0';
+
+	path += len;
+	path += strspn(path, "/");
+	len = strlen(path);
+	while (len > 0 && path[len - 1] == '/'){
+		len--;
+	}
+	if (len == 0){
+		return 0;
+	}
+	if (!(*key = malloc(len + 1))){
+		log_enomem();
+		free(*bucket);
+		*bucket = NULL;
+		return -1;
+	}
+	memcpy(*key, path, len);
+	(*key)[len] = '\0';
+	return 0;
+}
+
+/* called for every key or common prefix listed, stopping the listing if it returns non-zero
+ * a common prefix has no size or modification time */
+typedef int (*list_fn)(const char* key, int is_prefix, uint64_t size, time_t mtime, void* data);
+
+static int list_objects(struct s3_handle* h, const char* bucket, const char* prefix, int delimit, unsigned long max_keys, list_fn fn, void* data){
+	struct s3_request req;
+	struct s3_response resp;
+	char* enc_prefix = NULL;
+	char* enc_token = NULL;
+	char* max = NULL;
+	char* query = NULL;
+	int ret = 0;
+
+	memset(&req, 0, sizeof(req));
+	memset(&resp, 0, sizeof(resp));
+	req.method = "GET";
+	req.bucket = bucket;
+	req.in_fd = -1;
+	req.out_fd = -1;
+
+	if (!(enc_prefix = s3_uri_encode(prefix, 0)) || !(max = max_keys ? sh_sprintf("&max-keys=%lu", max_keys) : sh_new())){
+		ret = -1;
+		goto cleanup;
+	}
+
+	do{
+		const char* cur;
+		const char* end;
+		const char* text;
+		const char* text_end;
+		char* truncated;
+
+		free(query);
+		/* these have to be in order of name */
+		query = sh_sprintf("%s%s%s%slist-type=2%s&prefix=%s",
+				enc_token ? "continuation-token=" : "", enc_token ? enc_token : "", enc_token ? "&" : "",
+				delimit ? "delimiter=%2F&" : "", max, enc_prefix);
+		if (!query){
+			ret = -1;
+			goto cleanup;
+		}
+		req.query = query;
+
+		if (perform(h, &req, &resp) != 0 || check_response("list", bucket, &resp) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+
+		end = resp.body ? resp.body + resp.body_len : NULL;
+		for (cur = resp.body; cur && (text = xml_find(cur, end, "Contents", &text_end)) != NULL; cur = text_end){
+			const char* k;
+			const char* k_end;
+			const char* s;
+			const char* s_end;
+			const char* t;
+			const char* t_end;
+			char* key;
+
+			if (!(k = xml_find(text, text_end, "Key", &k_end)) || !(key = xml_text(k, k_end))){
+				continue;
+			}
+			s = xml_find(text, text_end, "Size", &s_end);
+			t = xml_find(text, text_end, "LastModified", &t_end);
+			ret = fn(key, 0, s ? strtoul(s, NULL, 10) : 0, t ? parse_iso_date(t) : 0, data);
+			free(key);
+			if (ret != 0){
+				goto cleanup;
+			}
+		}
+		for (cur = resp.body; cur && (text = xml_find(cur, end, "CommonPrefixes", &text_end)) != NULL; cur = text_end){
+			const char* p;
+			const char* p_end;
+			char* key;
+
+			if (!(p = xml_find(text, text_end, "Prefix", &p_end)) || !(key = xml_text(p, p_end))){
+				continue;
+			}
+			ret = fn(key, 1, 0, 0, data);
+			free(key);
+			if (ret != 0){
+				goto cleanup;
+			}
+		}
+
+		free(enc_token);
+		enc_token = NULL;
+		truncated = xml_get(&resp, "IsTruncated");
+		if (!max_keys && truncated && strcmp(truncated, "true") == 0){
+			char* token = xml_get(&resp, "NextContinuationToken");
+			enc_token = token ? s3_uri_encode(token, 0) : NULL;
+			free(token);
+		}
+		free(truncated);
+	}while (enc_token);
+
+cleanup:
+	response_free(&resp);
+	free(enc_prefix);
+	free(enc_token);
+	free(max);
+	free(query);
+	return ret;
+}
+
+static int list_any(const char* key, int is_prefix, uint64_t size, time_t mtime, void* data){
+	(void)key;
+	(void)is_prefix;
+	(void)size;
+	(void)mtime;
+	*(int*)data = 1;
+	return 0;
+}
+
+/* 1 if anything is under key, 0 if not, or negative on failure */
+static int has_children(struct s3_handle* h, const char* bucket, const char* key){
+	char* prefix;
+	int found = 0;
+	int res;
+
+	if (!(prefix = sh_sprintf("%s/", key))){
+		log_enomem();
+		return -1;
+	}
+	res = list_objects(h, bucket, prefix, 1, 1, list_any, &found);
+	free(prefix);
+	return res != 0 ? -1 : found;
+}
+
+static void fill_stat(struct stat* st, int is_dir, uint64_t size, time_t mtime){
+	memset(st, 0, sizeof(*st));
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	st->st_mode = is_dir ? S_IFDIR | 0755 : S_IFREG | 0444;
+	st->st_nlink = 1;
+	st->st_size = is_dir ? 4096 : size;
+	st->st_mtime = mtime;
+	st->st_ctime = mtime;
+}
+
+static int stat_path(struct s3_handle* h, const char* bucket, const char* key, struct stat* st){
+	struct s3_request req;
+	struct s3_response resp;
+	int ret = 0;
+
+	if (!bucket){
+		fill_stat(st, 1, 0, 0);
+		return 0;
+	}
+
+	memset(&req, 0, sizeof(req));
+	memset(&resp, 0, sizeof(resp));
+	req.method = "HEAD";
+	req.bucket = bucket;
+	req.key = key;
+	req.in_fd = -1;
+	req.out_fd = -1;
+
+	if (perform(h, &req, &resp) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+	if (resp.status / 100 == 2){
+		fill_stat(st, !key, resp.content_length, resp.last_modified);
+	}
+	else if (resp.status == 404){
+		int res = key ? has_children(h, bucket, key) : 0;
+
+		if (res > 0){
+			fill_stat(st, 1, 0, 0);
+		}
+		ret = res > 0 ? 0 : res < 0 ? -1 : 1;
+	}
+	else{
+		ret = check_response("stat", key ? key : bucket, &resp);
+	}
+
+cleanup:
+	response_free(&resp);
+	return ret;
+}
+
+/* sends a request that has nothing to send or receive besides its status */
+static int simple_request(struct s3_handle* h, const char* method, const char* bucket, const char* key, const char* query, const char* data, const char* what){
+	struct s3_request req;
+	struct s3_response resp;
+	int ret;
+
+	memset(&req, 0, sizeof(req));
+	memset(&resp, 0, sizeof(resp));
+	req.method = method;
+	req.bucket = bucket;
+	req.key = key;
+	req.query = query;
+	req.data = data;
+	req.in_len = data ? strlen(data) : 0;
+	req.in_fd = -1;
+	req.out_fd = -1;
+
+	ret = perform(h, &req, &resp) != 0 || check_response(what, key ? key : bucket, &resp) != 0 ? -1 : 0;
+	response_free(&resp);
+	return ret;
+}
+
+static char* copy_source(const char* bucket, const char* key){
+	char* enc_bucket = s3_uri_encode(bucket, 0);
+	char* enc_key = s3_uri_encode(key, 1);
+	char* ret = enc_bucket && enc_key ? sh_sprintf("/%s/%s", enc_bucket, enc_key) : NULL;
+
+	free(enc_bucket);
+	free(enc_key);
+	return ret;
+}
+
+static void parts_inc_progress(struct s3_parts* sp, uint64_t count){
+	if (!sp->p){
+		return;
+	}
+	pthread_mutex_lock(&sp->lock);
+	inc_progress(sp->p, count);
+	pthread_mutex_unlock(&sp->lock);
+}
+
+static int part_transfer(struct s3_parts* sp, unsigned long part){
+	struct s3_request req;
+	struct s3_response resp;
+	uint64_t offset = part * sp->part_size;
+	uint64_t len = sp->size - offset < sp->part_size ? sp->size - offset : sp->part_size;
+	char* query = NULL;
+	char* range = NULL;
+	int ret = 0;
+
+	memset(&req, 0, sizeof(req));
+	memset(&resp, 0, sizeof(resp));
+	req.bucket = sp->bucket;
+	req.key = sp->key;
+	req.in_fd = -1;
+	req.out_fd = -1;
+
+	range = sh_sprintf("bytes=%lu-%lu", (unsigned long)offset, (unsigned long)(offset + len - 1));
+	query = sp->upload_id ? sh_sprintf("partNumber=%lu&uploadId=%s", part + 1, sp->upload_id) : sh_new();
+	if (!range || !query){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+
+	switch (sp->kind){
+	case PARTS_UPLOAD:
+		req.method = "PUT";
+		req.query = query;
+		req.in_fd = sp->fd;
+		req.in_offset = offset;
+		req.in_len = len;
+		break;
+	case PARTS_COPY:
+		req.method = "PUT";
+		req.query = query;
+		req.copy_source = sp->copy_source;
+		req.copy_range = range;
+		break;
+	case PARTS_DOWNLOAD:
+		req.method = "GET";
+		req.range = range;
+		req.out_fd = sp->fd;
+		req.out_offset = offset;
+		break;
+	}
+
+	if (perform(sp->h, &req, &resp) != 0 || check_response(sp->kind == PARTS_DOWNLOAD ? "download" : "upload", sp->key, &resp) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+	if (sp->kind == PARTS_DOWNLOAD && (resp.status != 206 || resp.received != len)){
+		log_error_ex("S3: Received the wrong range of %s", sp->key);
+		ret = -1;
+		goto cleanup;
+	}
+	if (sp->kind != PARTS_DOWNLOAD){
+		/* a copied part's tag is in its body instead of its headers */
+		char* etag = sp->kind == PARTS_COPY ? xml_get(&resp, "ETag") : sh_dup(resp.etag);
+		if (!etag){
+			log_error_ex("S3: No ETag was returned for part of %s", sp->key);
+			ret = -1;
+			goto cleanup;
+		}
+		sp->etags[part] = etag;
+	}
+	parts_inc_progress(sp, len);
+
+cleanup:
+	response_free(&resp);
+	free(query);
+	free(range);
+	return ret;
+}
+
+static void* parts_worker(void* arg){
+	struct s3_parts* sp = arg;
+
+	for (;;){
+		unsigned long part;
+
+		pthread_mutex_lock(&sp->lock);
+		if (sp->failed || sp->next >= sp->n_parts){
+			pthread_mutex_unlock(&sp->lock);
+			break;
+		}
+		part = sp->next++;
+		pthread_mutex_unlock(&sp->lock);
+
+		if (part_transfer(sp, part) != 0){
+			pthread_mutex_lock(&sp->lock);
+			sp->failed = 1;
+			pthread_mutex_unlock(&sp->lock);
+		}
+	}
+	return NULL;
+}
+
+/* moves every part, S3_PARALLEL at a time */
+static int parts_run(struct s3_parts* sp){
+	pthread_t threads[S3_PARALLEL];
+	size_t n_threads = 0;
+	size_t i;
+
+	/* this thread is one of the workers */
+	while (n_threads + 1 < S3_PARALLEL && n_threads + 1 < sp->n_parts){
+		if (pthread_create(&threads[n_threads], NULL, parts_worker, sp) != 0){
+			log_warning("S3: Failed to start a transfer thread");
+			break;
+		}
+		n_threads++;
+	}
+	parts_worker(sp);
+	for (i = 0; i < n_threads; ++i){
+		pthread_join(threads[i], NULL);
+	}
+	return sp->failed ? -1 : 0;
+}
+
+/* sp has to be given to parts_free() even if this fails */
+static int parts_init(struct s3_parts* sp, enum s3_parts_kind kind, struct s3_handle* h, const char* bucket, const char* key, uint64_t size){
+	memset(sp, 0, sizeof(*sp));
+	pthread_mutex_init(&sp->lock, NULL);
+	sp->kind = kind;
+	sp->h = h;
+	sp->bucket = bucket;
+	sp->key = key;
+	sp->fd = -1;
+	sp->size = size;
+	/* S3 only takes so many parts, so a huge file needs bigger ones */
+	sp->part_size = S3_PART_SIZE;
+	if (size / sp->part_size >= S3_MAX_PARTS){
+		sp->part_size = size / S3_MAX_PARTS + 1;
+	}
+	sp->n_parts = size / sp->part_size + (size % sp->part_size != 0);
+	if (kind != PARTS_DOWNLOAD && !(sp->etags = calloc(sp->n_parts, sizeof(*sp->etags)))){
+		log_enomem();
+		return -1;
+	}
+	return 0;
+}
+
+static void parts_free(struct s3_parts* sp){
+	unsigned long i;
+
+	for (i = 0; sp->etags && i < sp->n_parts; ++i){
+		free(sp->etags[i]);
+	}
+	free(sp->etags);
+	free(sp->upload_id);
+	pthread_mutex_destroy(&sp->lock);
+}
+
+/* uploads or copies sp's parts as one multipart upload */
+static int multipart(struct s3_parts* sp){
+	struct s3_request req;
+	struct s3_response resp;
+	char* upload_id = NULL;
+	char* query = NULL;
+	char* xml = NULL;
+	unsigned long i;
+	int ret = 0;
+
+	memset(&req, 0, sizeof(req));
+	memset(&resp, 0, sizeof(resp));
+	req.method = "POST";
+	req.bucket = sp->bucket;
+	req.key = sp->key;
+	req.query = "uploads=";
+	req.in_fd = -1;
+	req.out_fd = -1;
+
+	if (perform(sp->h, &req, &resp) != 0 || check_response("start uploading", sp->key, &resp) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+	if (!(upload_id = xml_get(&resp, "UploadId")) || !(sp->upload_id = s3_uri_encode(upload_id, 0))){
+		log_error_ex("S3: No upload id was returned for %s", sp->key);
+		ret = -1;
+		goto cleanup;
+	}
+	if (!(query = sh_sprintf("uploadId=%s", sp->upload_id))){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (parts_run(sp) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+
+	xml = sh_dup("<CompleteMultipartUpload>");
+	for (i = 0; i < sp->n_parts && xml; ++i){
+		char* part = sh_sprintf("<Part><PartNumber>%lu</PartNumber><ETag>%s</ETag></Part>", i + 1, sp->etags[i]);
+		xml = part ? sh_concat(xml, part) : (free(xml), NULL);
+		free(part);
+	}
+	xml = sh_concat(xml, "</CompleteMultipartUpload>");
+	if (!xml){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+	ret = simple_request(sp->h, "POST", sp->bucket, sp->key, query, xml, "finish uploading");
+
+cleanup:
+	/* the parts that did make it are billed until the upload is aborted */
+	if (ret != 0 && query){
+		simple_request(sp->h, "DELETE", sp->bucket, sp->key, query, NULL, "abort uploading");
+	}
+	response_free(&resp);
+	free(upload_id);
+	free(query);
+	free(xml);
+	return ret;
+}
+
+static int copy_object(struct s3_handle* h, const char* src_bucket, const char* src_key, uint64_t size, const char* dst_bucket, const char* dst_key){
+	struct s3_request req;
+	struct s3_response resp;
+	struct s3_parts sp;
+	char* src = NULL;
+	int ret = 0;
+
+	memset(&resp, 0, sizeof(resp));
+	if (!(src = copy_source(src_bucket, src_key))){
+		return -1;
+	}
+
+	if (size > S3_COPY_MAX){
+		if ((ret = parts_init(&sp, PARTS_COPY, h, dst_bucket, dst_key, size)) == 0){
+			sp.copy_source = src;
+			ret = multipart(&sp);
+		}
+		parts_free(&sp);
+		goto cleanup;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.method = "PUT";
+	req.bucket = dst_bucket;
+	req.key = dst_key;
+	req.copy_source = src;
+	req.in_fd = -1;
+	req.out_fd = -1;
+	ret = perform(h, &req, &resp) != 0 || check_response("copy", src_key, &resp) != 0 ? -1 : 0;
+
+cleanup:
+	response_free(&resp);
+	free(src);
+	return ret;
+}
+
+/* the keys under a prefix, along with their sizes */
+struct key_list{
+	char** keys;
+	uint64_t* sizes;
+	size_t len;
+};
+
+static int list_collect(const char* key, int is_prefix, uint64_t size, time_t mtime, void* data){
+	struct key_list* kl = data;
+	char** keys;
+	uint64_t* sizes;
+
+	(void)is_prefix;
+	(void)mtime;
+
+	keys = realloc(kl->keys, sizeof(*keys) * (kl->len + 1));
+	if (keys){
+		kl->keys = keys;
+	}
+	sizes = realloc(kl->sizes, sizeof(*sizes) * (kl->len + 1));
+	if (sizes){
+		kl->sizes = sizes;
+	}
+	if (!keys || !sizes || !(kl->keys[kl->len] = sh_dup(key))){
+		log_enomem();
+		return -1;
+	}
+	kl->sizes[kl->len++] = size;
+	return 0;
+}
+
+static void key_list_free(struct key_list* kl){
+	size_t i;
+
+	for (i = 0; i < kl->len; ++i){
+		free(kl->keys[i]);
+	}
+	free(kl->keys);
+	free(kl->sizes);
+}
+
+/* every object under key, which includes the empty object marking it as a directory */
+static int list_all(struct s3_handle* h, const char* bucket, const char* key, struct key_list* kl){
+	char* prefix;
+	int res;
+
+	memset(kl, 0, sizeof(*kl));
+	if (!(prefix = sh_sprintf("%s/", key))){
+		log_enomem();
+		return -1;
+	}
+	res = list_objects(h, bucket, prefix, 0, 0, list_collect, kl);
+	free(prefix);
+	return res;
+}
+
+static int open_session(struct s3_handle* h){
+	if (pthread_once(&curl_once, curl_init) != 0 || curl_init_res != CURLE_OK){
+		log_error("S3: Failed to initialize libcurl");
+		return -1;
+	}
+	if (!(h->share = curl_share_init())){
+		log_error("S3: Failed to create the connection cache");
+		return -1;
+	}
+	curl_share_setopt(h->share, CURLSHOPT_LOCKFUNC, share_lock);
+	curl_share_setopt(h->share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+	curl_share_setopt(h->share, CURLSHOPT_USERDATA, h);
+	curl_share_setopt(h->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(h->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	curl_share_setopt(h->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+	return 0;
+}
+
+int S3login(const char* username, const char* password, S3handle** out){
+	struct s3_handle* h;
+	const char* endpoint = getenv("EZBACKUP_S3_ENDPOINT");
+	const char* region = getenv("EZBACKUP_S3_REGION");
+	const char* host;
+	size_t host_len;
+	int i;
+
+	return_ifnull(username, -1);
+	return_ifnull(password, -1);
+	return_ifnull(out, -1);
+	*out = NULL;
+
+	region = region ? region : getenv("AWS_REGION");
+	region = region ? region : getenv("AWS_DEFAULT_REGION");
+	region = region ? region : "us-east-1";
+
+	h = calloc(1, sizeof(*h));
+	if (!h){
+		log_enomem();
+		return -1;
+	}
+	for (i = 0; i < CURL_LOCK_DATA_LAST; ++i){
+		pthread_mutex_init(&h->share_locks[i], NULL);
+	}
+	pthread_mutex_init(&h->pool_lock, NULL);
+
+	h->access_key = sh_dup(username);
+	h->secret_key = sh_dup(password);
+	h->region = sh_dup(region);
+	if (!endpoint){
+		h->endpoint = sh_sprintf("https://s3.%s.amazonaws.com", region);
+	}
+	else{
+		h->endpoint = strstr(endpoint, "://") ? sh_dup(endpoint) : sh_sprintf("https://%s", endpoint);
+	}
+	if (!h->access_key || !h->secret_key || !h->region || !h->endpoint){
+		log_enomem();
+		S3logout(h);
+		return -1;
+	}
+	while (h->endpoint[strlen(h->endpoint) - 1] == '/'){
+		h->endpoint[strlen(h->endpoint) - 1] = '\0';
+	}
+
+	/* the host is signed, so it has to be what is sent */
+	host = strstr(h->endpoint, "://") + 3;
+	host_len = strcspn(host, "/");
+	if (!(h->host = malloc(host_len + 1))){
+		log_enomem();
+		S3logout(h);
+		return -1;
+	}
+	memcpy(h->host, host, host_len);
+	h->host[host_len] = '\0';
+	if (host[host_len] == '/'){
+		log_warning_ex("S3: Ignoring the path in endpoint %s", h->endpoint);
+		h->endpoint[host - h->endpoint + host_len] = '\0';
+	}
+
+	if (!(h->tb = tb_new(0)) || open_session(h) != 0){
+		S3logout(h);
+		return -1;
+	}
+
+	log_info_ex2("S3: Using %s in %s", h->endpoint, h->region);
+	*out = h;
+	return 0;
+}
+
+int S3mkdir(const char* dir, S3handle* sh){
+	struct s3_handle* h = sh;
+	struct stat st;
+	char* bucket = NULL;
+	char* key = NULL;
+	char* marker = NULL;
+	char* config = NULL;
+	int res;
+	int ret = 0;
+
+	return_ifnull(dir, -1);
+	return_ifnull(sh, -1);
+
+	if (split_path(dir, &bucket, &key) != 0){
+		return -1;
+	}
+	if (!bucket){
+		return 1;
+	}
+
+	if ((res = stat_path(h, bucket, key, &st)) <= 0){
+		if (res == 0 && !S_ISDIR(st.st_mode)){
+			log_error_ex("S3: %s is a file", dir);
+			res = -1;
+		}
+		ret = res == 0 ? 1 : -1;
+		goto cleanup;
+	}
+
+	if (!key){
+		/* us-east-1 is the default and has to be left out */
+		if (strcmp(h->region, "us-east-1") != 0 &&
+				!(config = sh_sprintf("<CreateBucketConfiguration><LocationConstraint>%s</LocationConstraint></CreateBucketConfiguration>", h->region))){
+			log_enomem();
+			ret = -1;
+			goto cleanup;
+		}
+		ret = simple_request(h, "PUT", bucket, NULL, NULL, config, "create bucket");
+		goto cleanup;
+	}
+
+	if (!(marker = sh_sprintf("%s/", key))){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+	ret = simple_request(h, "PUT", bucket, marker, NULL, NULL, "create directory");
+
+cleanup:
+	free(bucket);
+	free(key);
+	free(marker);
+	free(config);
+	return ret;
+}
+
+struct readdir_data{
+	const char* dir;
+	size_t prefix_len;
+	char** arr;
+	struct stat* st;
+	size_t len;
+};
+
+static int readdir_add(const char* key, int is_prefix, uint64_t size, time_t mtime, void* data){
+	struct readdir_data* rd = data;
+	struct stat* st;
+	char* name;
+	char** tmp;
+	size_t len;
+
+	key += rd->prefix_len;
+	len = strlen(key);
+	if (len > 0 && key[len - 1] == '/'){
+		len--;
+	}
+	/* the directory's own marker */
+	if (len == 0){
+		return 0;
+	}
+
+	if (!(name = malloc(len + 1))){
+		log_enomem();
+		return -1;
+	}
+	memcpy(name, key, len);
+	name[len] = '\0';
+
+	st = realloc(rd->st, sizeof(*rd->st) * (rd->len + 1));
+	if (st){
+		rd->st = st;
+	}
+	tmp = realloc(rd->arr, sizeof(*rd->arr) * (rd->len + 1));
+	if (tmp){
+		rd->arr = tmp;
+	}
+	if (!st || !tmp || !(tmp[rd->len] = sh_concat_path(sh_dup(rd->dir), name))){
+		log_enomem();
+		free(name);
+		return -1;
+	}
+	/* the listing says what each entry is, so none of them have to be looked up again */
+	fill_stat(&rd->st[rd->len], is_prefix, size, mtime);
+	rd->len++;
+	free(name);
+	return 0;
+}
+
+static int list_buckets(struct s3_handle* h, struct readdir_data* rd){
+	struct s3_request req;
+	struct s3_response resp;
+	const char* cur;
+	const char* text;
+	const char* text_end;
+	int ret = 0;
+
+	memset(&req, 0, sizeof(req));
+	memset(&resp, 0, sizeof(resp));
+	req.method = "GET";
+	req.in_fd = -1;
+	req.out_fd = -1;
+
+	if (perform(h, &req, &resp) != 0 || check_response("list", "buckets", &resp) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+	for (cur = resp.body; cur && (text = xml_find(cur, resp.body + resp.body_len, "Name", &text_end)) != NULL; cur = text_end){
+		char* name = xml_text(text, text_end);
+
+		if (!name || readdir_add(name, 1, 0, 0, rd) != 0){
+			free(name);
+			ret = -1;
+			goto cleanup;
+		}
+		free(name);
+	}
+
+cleanup:
+	response_free(&resp);
+	return ret;
+}
+
+int S3readdir(const char* dir, char*** out, struct stat** out_st, size_t* out_len, S3handle* sh){
+	struct readdir_data rd;
+	char* bucket = NULL;
+	char* key = NULL;
+	char* prefix = NULL;
+	size_t i;
+	int ret = 0;
+
+	return_ifnull(dir, -1);
+	return_ifnull(out, -1);
+	return_ifnull(out_len, -1);
+	return_ifnull(sh, -1);
+
+	*out = NULL;
+	if (out_st){
+		*out_st = NULL;
+	}
+	*out_len = 0;
+	memset(&rd, 0, sizeof(rd));
+	rd.dir = dir;
+
+	if (split_path(dir, &bucket, &key) != 0){
+		return -1;
+	}
+	if (!bucket){
+		ret = list_buckets(sh, &rd);
+		goto cleanup;
+	}
+
+	if (!(prefix = key ? sh_sprintf("%s/", key) : sh_new())){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+	rd.prefix_len = strlen(prefix);
+	ret = list_objects(sh, bucket, prefix, 1, 0, readdir_add, &rd);
+
+cleanup:
+	if (ret == 0){
+		*out = rd.arr;
+		*out_len = rd.len;
+		if (out_st){
+			*out_st = rd.st;
+			rd.st = NULL;
+		}
+	}
+	else{
+		for (i = 0; i < rd.len; ++i){
+			free(rd.arr[i]);
+		}
+		free(rd.arr);
+	}
+	free(rd.st);
+	free(bucket);
+	free(key);
+	free(prefix);
+	return ret;
+}
+
+int S3stat(const char* file_path, struct stat* out, S3handle* sh){
+	struct stat st;
+	char* bucket = NULL;
+	char* key = NULL;
+	int ret;
+
+	return_ifnull(file_path, -1);
+	return_ifnull(sh, -1);
+
+	if (split_path(file_path, &bucket, &key) != 0){
+		return -1;
+	}
+	ret = stat_path(sh, bucket, key, out ? out : &st);
+	if (ret > 0){
+		log_debug_ex("S3: File/directory %s not found", file_path);
+	}
+
+	free(bucket);
+	free(key);
+	return ret;
+}
+
+int S3rename(const char* old_path, const char* new_path, S3handle* sh){
+	struct s3_handle* h = sh;
+	struct key_list kl;
+	struct stat st;
+	char* old_bucket = NULL;
+	char* old_key = NULL;
+	char* new_bucket = NULL;
+	char* new_key = NULL;
+	size_t i;
+	int res;
+	int ret = 0;
+
+	return_ifnull(old_path, -1);
+	return_ifnull(new_path, -1);
+	return_ifnull(sh, -1);
+
+	memset(&kl, 0, sizeof(kl));
+	if (split_path(old_path, &old_bucket, &old_key) != 0 || split_path(new_path, &new_bucket, &new_key) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+	if (!old_key || !new_key){
+		log_error("S3: Buckets cannot be renamed");
+		ret = -1;
+		goto cleanup;
+	}
+
+	if ((res = stat_path(h, old_bucket, old_key, &st)) != 0){
+		if (res > 0){
+			log_error_ex("S3: %s does not exist", old_path);
+		}
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (!S_ISDIR(st.st_mode)){
+		ret = copy_object(h, old_bucket, old_key, st.st_size, new_bucket, new_key) != 0 ||
+			simple_request(h, "DELETE", old_bucket, old_key, NULL, NULL, "remove") != 0 ? -1 : 0;
+		goto cleanup;
+	}
+
+	/* a directory is everything under it, one object at a time */
+	if (list_all(h, old_bucket, old_key, &kl) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+	for (i = 0; i < kl.len; ++i){
+		char* dst = sh_sprintf("%s%s", new_key, kl.keys[i] + strlen(old_key));
+
+		if (!dst || copy_object(h, old_bucket, kl.keys[i], kl.sizes[i], new_bucket, dst) != 0 ||
+				simple_request(h, "DELETE", old_bucket, kl.keys[i], NULL, NULL, "remove") != 0){
+			free(dst);
+			ret = -1;
+			goto cleanup;
+		}
+		free(dst);
+	}
+
+cleanup:
+	key_list_free(&kl);
+	free(old_bucket);
+	free(old_key);
+	free(new_bucket);
+	free(new_key);
+	return ret;
+}
+
+int S3download(const char* download_path, const char* out_path, const char* progress_msg, S3handle* sh){
+	struct s3_handle* h = sh;
+	struct s3_parts sp;
+	struct stat st;
+	char* bucket = NULL;
+	char* key = NULL;
+	int have_parts = 0;
+	int fd = -1;
+	int res;
+	int ret = 0;
+
+	return_ifnull(download_path, -1);
+	return_ifnull(out_path, -1);
+	return_ifnull(sh, -1);
+
+	if (split_path(download_path, &bucket, &key) != 0){
+		return -1;
+	}
+	if ((res = stat_path(h, bucket, key, &st)) != 0 || S_ISDIR(st.st_mode)){
+		log_error_ex("S3: %s is not a file", download_path);
+		ret = -1;
+		goto cleanup;
+	}
+
+	if ((fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0){
+		log_efopen(out_path);
+		ret = -1;
+		goto cleanup;
+	}
+	have_parts = 1;
+	if (parts_init(&sp, PARTS_DOWNLOAD, h, bucket, key, st.st_size) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+	sp.fd = fd;
+	sp.p = progress_msg ? start_progress(progress_msg, st.st_size) : NULL;
+
+	if (sp.n_parts <= 1){
+		struct s3_request req;
+		struct s3_response resp;
+
+		memset(&req, 0, sizeof(req));
+		memset(&resp, 0, sizeof(resp));
+		req.method = "GET";
+		req.bucket = bucket;
+		req.key = key;
+		req.in_fd = -1;
+		req.out_fd = fd;
+		ret = perform(h, &req, &resp) != 0 || check_response("download", download_path, &resp) != 0 ? -1 : 0;
+		if (ret == 0 && resp.received != resp.content_length){
+			log_error_ex("S3: Download of %s was cut short", download_path);
+			ret = -1;
+		}
+		parts_inc_progress(&sp, resp.received);
+		response_free(&resp);
+	}
+	else{
+		/* the ranges land in place, so the file has to be its full size first */
+		if (ftruncate(fd, st.st_size) != 0){
+			log_warning_ex("S3: Failed to preallocate %s", out_path);
+		}
+		ret = parts_run(&sp);
+	}
+
+cleanup:
+	if (have_parts && sp.p){
+		ret == 0 ? finish_progress(sp.p) : finish_progress_fail(sp.p);
+	}
+	if (fd >= 0 && close(fd) != 0){
+		log_efclose(out_path);
+		ret = -1;
+	}
+	have_parts ? parts_free(&sp) : (void)0;
+	free(bucket);
+	free(key);
+	return ret;
+}
+
+int S3download_stream(const char* download_path, int (*sink)(const void* data, size_t len, void* sink_data), void* sink_data, S3handle* sh){
+	struct s3_handle* h = sh;
+	struct s3_request req;
+	struct s3_response resp;
+	struct stat st;
+	char* bucket = NULL;
+	char* key = NULL;
+	char* range = NULL;
+	uint64_t delivered = 0;
+	int attempt;
+	int ret = -1;
+
+	return_ifnull(download_path, -1);
+	return_ifnull(sink, -1);
+	return_ifnull(sh, -1);
+
+	memset(&resp, 0, sizeof(resp));
+	if (split_path(download_path, &bucket, &key) != 0){
+		return -1;
+	}
+	if (stat_path(h, bucket, key, &st) != 0 || S_ISDIR(st.st_mode)){
+		log_error_ex("S3: %s is not a file", download_path);
+		goto cleanup;
+	}
+
+	/* the sink has to get every byte once and in order, so a request cut short is picked up where it stopped instead of starting over */
+	for (attempt = 0; attempt < S3_REQUEST_RETRIES; ++attempt){
+		CURL* curl;
+		int res;
+
+		if (attempt > 0){
+			sleep(1U << attempt);
+		}
+		free(range);
+		range = NULL;
+		if (delivered > 0 && !(range = sh_sprintf("bytes=%lu-", (unsigned long)delivered))){
+			log_enomem();
+			goto cleanup;
+		}
+
+		memset(&req, 0, sizeof(req));
+		req.method = "GET";
+		req.bucket = bucket;
+		req.key = key;
+		req.range = range;
+		req.in_fd = -1;
+		req.out_fd = -1;
+		req.out_sink = sink;
+		req.out_sink_data = sink_data;
+		response_reset(&resp, &req);
+		if (!(curl = get_curl(h))){
+			goto cleanup;
+		}
+		res = perform_once(h, curl, &req, &resp);
+		put_curl(h, curl);
+		delivered += resp.received;
+
+		if (resp.sink_failed){
+			log_error_ex("S3: Failed to download %s in order", download_path);
+			goto cleanup;
+		}
+		/* a connection that drops after the last byte still delivered all of it */
+		if (delivered >= (uint64_t)st.st_size && (resp.received > 0 || (res == 0 && resp.status / 100 == 2))){
+			ret = 0;
+			break;
+		}
+		/* only a busy or failing server or a dropped connection is worth asking again */
+		if (res == 0 && resp.status < 500 && resp.status != 429 && resp.status / 100 != 2){
+			check_response("download", download_path, &resp);
+			goto cleanup;
+		}
+	}
+	if (ret != 0){
+		log_error_ex("S3: Download of %s was cut short", download_path);
+	}
+
+cleanup:
+	response_free(&resp);
+	free(range);
+	free(bucket);
+	free(key);
+	return ret;
+}
+
+int S3upload(const char* in_file, const char* upload_path, const char* progress_msg, S3handle* sh){
+	struct s3_handle* h = sh;
+	struct s3_parts sp;
+	struct stat st;
+	char* bucket = NULL;
+	char* key = NULL;
+	int have_parts = 0;
+	int fd = -1;
+	int res;
+	int ret = 0;
+
+	return_ifnull(in_file, -1);
+	return_ifnull(upload_path, -1);
+	return_ifnull(sh, -1);
+
+	if (split_path(upload_path, &bucket, &key) != 0){
+		return -1;
+	}
+	if (!bucket){
+		log_error("S3: Files have to be uploaded into a bucket");
+		ret = -1;
+		goto cleanup;
+	}
+	/* a directory gets the file under its own name */
+	if (!key || (res = has_children(h, bucket, key)) > 0){
+		key = key ? sh_concat_path(key, sh_filename(in_file)) : sh_dup(sh_filename(in_file));
+		if (!key){
+			log_enomem();
+			ret = -1;
+			goto cleanup;
+		}
+	}
+	else if (res < 0){
+		ret = -1;
+		goto cleanup;
+	}
+
+	if ((fd = open(in_file, O_RDONLY)) < 0){
+		log_efopen(in_file);
+		ret = -1;
+		goto cleanup;
+	}
+	if (fstat(fd, &st) != 0){
+		log_estat(in_file);
+		ret = -1;
+		goto cleanup;
+	}
+
+	have_parts = 1;
+	if (parts_init(&sp, PARTS_UPLOAD, h, bucket, key, st.st_size) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+	sp.fd = fd;
+	sp.p = progress_msg ? start_progress(progress_msg, st.st_size) : NULL;
+
+	if (sp.n_parts <= 1){
+		struct s3_request req;
+		struct s3_response resp;
+
+		memset(&req, 0, sizeof(req));
+		memset(&resp, 0, sizeof(resp));
+		req.method = "PUT";
+		req.bucket = bucket;
+		req.key = key;
+		req.in_fd = fd;
+		req.in_len = st.st_size;
+		req.out_fd = -1;
+		ret = perform(h, &req, &resp) != 0 || check_response("upload", in_file, &resp) != 0 ? -1 : 0;
+		parts_inc_progress(&sp, st.st_size);
+		response_free(&resp);
+	}
+	else{
+		ret = multipart(&sp);
+	}
+
+cleanup:
+	if (have_parts && sp.p){
+		ret == 0 ? finish_progress(sp.p) : finish_progress_fail(sp.p);
+	}
+	fd >= 0 ? close(fd) : 0;
+	have_parts ? parts_free(&sp) : (void)0;
+	free(bucket);
+	free(key);
+	return ret;
+}
+
+enum s3_async_op{
+	ASYNC_DOWNLOAD = 0,
+	ASYNC_UPLOAD = 1,
+	ASYNC_RENAME = 2,
+	ASYNC_DOWNLOAD_STREAM = 3
+};
+
+struct s3_async{
+	struct s3_handle* h;
+	enum s3_async_op op;
+	char* src;
+	char* dst;
+	/* where a streamed download goes */
+	int (*sink)(const void* data, size_t len, void* sink_data);
+	void* sink_data;
+	S3transfer_done done;
+	void* data;
+};
+
+static void* async_transfer(void* arg){
+	struct s3_async* sa = arg;
+	int res;
+
+	switch (sa->op){
+	case ASYNC_UPLOAD:
+		res = S3upload(sa->src, sa->dst, NULL, sa->h);
+		break;
+	case ASYNC_RENAME:
+		res = S3rename(sa->src, sa->dst, sa->h);
+		break;
+	case ASYNC_DOWNLOAD_STREAM:
+		res = S3download_stream(sa->src, sa->sink, sa->sink_data, sa->h);
+		break;
+	default:
+		res = S3download(sa->src, sa->dst, NULL, sa->h);
+		break;
+	}
+	sa->done(res, sa->data);
+
+	free(sa->src);
+	free(sa->dst);
+	free(sa);
+	return NULL;
+}
+
+/* sink is only used by ASYNC_DOWNLOAD_STREAM, which has dst the same as src */
+static int async_start(enum s3_async_op op, const char* src, const char* dst, int (*sink)(const void* data, size_t len, void* sink_data), void* sink_data, S3transfer_done done, void* data, S3handle* sh){
+	struct s3_async* sa;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int res;
+
+	return_ifnull(src, -1);
+	return_ifnull(dst, -1);
+	return_ifnull(done, -1);
+	return_ifnull(sh, -1);
+
+	sa = calloc(1, sizeof(*sa));
+	if (!sa || !(sa->src = sh_dup(src)) || !(sa->dst = sh_dup(dst))){
+		log_enomem();
+		sa ? free(sa->src) : (void)0;
+		free(sa);
+		return -1;
+	}
+	sa->h = sh;
+	sa->op = op;
+	sa->sink = sink;
+	sa->sink_data = sink_data;
+	sa->done = done;
+	sa->data = data;
+
+	/* nothing waits for the thread, done says when it is over */
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	res = pthread_create(&thread, &attr, async_transfer, sa);
+	pthread_attr_destroy(&attr);
+	if (res != 0){
+		log_error("S3: Failed to start a transfer thread");
+		free(sa->src);
+		free(sa->dst);
+		free(sa);
+		return -1;
+	}
+	return 0;
+}
+
+int S3upload_start(const char* in_file, const char* upload_path, S3transfer_done done, void* data, S3handle* sh){
+	return async_start(ASYNC_UPLOAD, in_file, upload_path, NULL, NULL, done, data, sh);
+}
+
+int S3download_start(const char* download_path, const char* out_path, S3transfer_done done, void* data, S3handle* sh){
+	return async_start(ASYNC_DOWNLOAD, download_path, out_path, NULL, NULL, done, data, sh);
+}
+
+int S3rename_start(const char* old_path, const char* new_path, S3transfer_done done, void* data, S3handle* sh){
+	return async_start(ASYNC_RENAME, old_path, new_path, NULL, NULL, done, data, sh);
+}
+
+int S3download_stream_start(const char* download_path, int (*sink)(const void* data, size_t len, void* sink_data), void* sink_data, S3transfer_done done, void* data, S3handle* sh){
+	return_ifnull(sink, -1);
+	return async_start(ASYNC_DOWNLOAD_STREAM, download_path, download_path, sink, sink_data, done, data, sh);
+}
+
+/* a buffer of a stream that is being filled, or uploaded as a part on its own thread */
+struct s3_stream_part{
+	struct s3_stream* ss;
+	unsigned long number;
+	char* buf;
+	size_t len;
+	size_t size;
+	char* etag;
+	pthread_t thread;
+	int running;
+	int res;
+};
+
+struct s3_stream{
+	struct s3_handle* h;
+	char* bucket;
+	char* key;
+	/* encoded, or NULL until the first part is full */
+	char* upload_id;
+	struct s3_stream_part parts[S3_STREAM_BUFFERS];
+	/* the part being filled */
+	size_t cur;
+	unsigned long n_parts;
+	char** etags;
+	int failed;
+};
+
+static void* stream_part_thread(void* arg){
+	struct s3_stream_part* part = arg;
+	struct s3_stream* ss = part->ss;
+	struct s3_request req;
+	struct s3_response resp;
+	char* query;
+
+	memset(&req, 0, sizeof(req));
+	memset(&resp, 0, sizeof(resp));
+	part->res = -1;
+
+	if (!(query = sh_sprintf("partNumber=%lu&uploadId=%s", part->number, ss->upload_id))){
+		log_enomem();
+		return NULL;
+	}
+	req.method = "PUT";
+	req.bucket = ss->bucket;
+	req.key = ss->key;
+	req.query = query;
+	req.data = part->buf;
+	req.in_len = part->len;
+	req.in_fd = -1;
+	req.out_fd = -1;
+
+	if (perform(ss->h, &req, &resp) == 0 && check_response("upload", ss->key, &resp) == 0){
+		if ((part->etag = sh_dup(resp.etag)) != NULL){
+			part->res = 0;
+		}
+		else{
+			log_error_ex("S3: No ETag was returned for part of %s", ss->key);
+		}
+	}
+	response_free(&resp);
+	free(query);
+	return NULL;
+}
+
+/* waits for a part to finish uploading, keeping its tag */
+static int stream_part_join(struct s3_stream* ss, struct s3_stream_part* part){
+	if (!part->running){
+		return 0;
+	}
+	pthread_join(part->thread, NULL);
+	part->running = 0;
+	part->len = 0;
+	if (part->res != 0){
+		ss->failed = 1;
+		return -1;
+	}
+	ss->etags[part->number - 1] = part->etag;
+	part->etag = NULL;
+	return 0;
+}
+
+/* sends the part being filled on its own thread, and moves on to the next buffer once it is free */
+static int stream_part_submit(struct s3_stream* ss){
+	struct s3_stream_part* part = &ss->parts[ss->cur];
+	char** etags;
+
+	if (!ss->upload_id){
+		struct s3_request req;
+		struct s3_response resp;
+		char* upload_id;
+
+		memset(&req, 0, sizeof(req));
+		memset(&resp, 0, sizeof(resp));
+		req.method = "POST";
+		req.bucket = ss->bucket;
+		req.key = ss->key;
+		req.query = "uploads=";
+		req.in_fd = -1;
+		req.out_fd = -1;
+
+		upload_id = perform(ss->h, &req, &resp) == 0 && check_response("start uploading", ss->key, &resp) == 0 ? xml_get(&resp, "UploadId") : NULL;
+		ss->upload_id = upload_id ? s3_uri_encode(upload_id, 0) : NULL;
+		free(upload_id);
+		response_free(&resp);
+		if (!ss->upload_id){
+			log_error_ex("S3: No upload id was returned for %s", ss->key);
+			return -1;
+		}
+	}
+
+	if (ss->n_parts >= S3_MAX_PARTS){
+		log_error_ex("S3: %s is too big for one upload", ss->key);
+		return -1;
+	}
+	etags = realloc(ss->etags, sizeof(*etags) * (ss->n_parts + 1));
+	if (!etags){
+		log_enomem();
+		return -1;
+	}
+	ss->etags = etags;
+	ss->etags[ss->n_parts] = NULL;
+
+	part->ss = ss;
+	part->number = ++ss->n_parts;
+	if (pthread_create(&part->thread, NULL, stream_part_thread, part) != 0){
+		log_error("S3: Failed to start a transfer thread");
+		return -1;
+	}
+	part->running = 1;
+
+	ss->cur = (ss->cur + 1) % S3_STREAM_BUFFERS;
+	return stream_part_join(ss, &ss->parts[ss->cur]);
+}
+
+/* the size of the next part, which grows every 1000 parts since the total size is not known */
+static size_t stream_part_size(const struct s3_stream* ss){
+	return S3_STREAM_PART_SIZE << (ss->n_parts / 1000);
+}
+
+int S3upload_stream_open(const char* upload_path, void** out, S3handle* sh){
+	struct s3_stream* ss;
+
+	return_ifnull(upload_path, -1);
+	return_ifnull(out, -1);
+	return_ifnull(sh, -1);
+
+	*out = NULL;
+	ss = calloc(1, sizeof(*ss));
+	if (!ss){
+		log_enomem();
+		return -1;
+	}
+	ss->h = sh;
+	if (split_path(upload_path, &ss->bucket, &ss->key) != 0 || !ss->key){
+		log_error_ex("S3: %s is not a file path", upload_path);
+		S3upload_stream_close(ss, 1);
+		return -1;
+	}
+	*out = ss;
+	return 0;
+}
+
+int S3upload_stream_write(void* stream, const void* data, size_t len){
+	struct s3_stream* ss = stream;
+
+	return_ifnull(stream, -1);
+	return_ifnull(data, -1);
+
+	while (len > 0 && !ss->failed){
+		struct s3_stream_part* part = &ss->parts[ss->cur];
+		size_t part_size = stream_part_size(ss);
+		size_t n;
+
+		if (part->size < part_size){
+			char* buf = realloc(part->buf, part_size);
+			if (!buf){
+				log_enomem();
+				ss->failed = 1;
+				break;
+			}
+			part->buf = buf;
+			part->size = part_size;
+		}
+
+		n = part_size - part->len < len ? part_size - part->len : len;
+		memcpy(part->buf + part->len, data, n);
+		part->len += n;
+		data = (const char*)data + n;
+		len -= n;
+
+		if (part->len == part_size && stream_part_submit(ss) != 0){
+			ss->failed = 1;
+		}
+	}
+	return ss->failed ? -1 : 0;
+}
+
+int S3upload_stream_close(void* stream, int discard){
+	struct s3_stream* ss = stream;
+	struct s3_stream_part* last;
+	char* query = NULL;
+	char* xml = NULL;
+	unsigned long i;
+	int ret = 0;
+
+	if (!ss){
+		return 0;
+	}
+	last = &ss->parts[ss->cur];
+	if (discard){
+		ss->failed = 1;
+	}
+
+	/* a stream that fits in one part never started a multipart upload */
+	if (!ss->failed && !ss->upload_id){
+		struct s3_request req;
+		struct s3_response resp;
+
+		memset(&req, 0, sizeof(req));
+		memset(&resp, 0, sizeof(resp));
+		req.method = "PUT";
+		req.bucket = ss->bucket;
+		req.key = ss->key;
+		req.data = last->buf ? last->buf : "";
+		req.in_len = last->len;
+		req.in_fd = -1;
+		req.out_fd = -1;
+		ret = perform(ss->h, &req, &resp) != 0 || check_response("upload", ss->key, &resp) != 0 ? -1 : 0;
+		response_free(&resp);
+		goto cleanup;
+	}
+
+	if (!ss->failed && last->len > 0 && stream_part_submit(ss) != 0){
+		ss->failed = 1;
+	}
+	for (i = 0; i < S3_STREAM_BUFFERS; ++i){
+		stream_part_join(ss, &ss->parts[i]);
+	}
+	if (!ss->upload_id){
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (!(query = sh_sprintf("uploadId=%s", ss->upload_id))){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+	if (ss->failed){
+		/* the parts that did make it are billed until the upload is aborted */
+		simple_request(ss->h, "DELETE", ss->bucket, ss->key, query, NULL, "abort uploading");
+		ret = -1;
+		goto cleanup;
+	}
+
+	xml = sh_dup("<CompleteMultipartUpload>");
+	for (i = 0; i < ss->n_parts && xml; ++i){
+		char* part = sh_sprintf("<Part><PartNumber>%lu</PartNumber><ETag>%s</ETag></Part>", i + 1, ss->etags[i]);
+		xml = part ? sh_concat(xml, part) : (free(xml), NULL);
+		free(part);
+	}
+	xml = sh_concat(xml, "</CompleteMultipartUpload>");
+	if (!xml){
+		log_enomem();
+		simple_request(ss->h, "DELETE", ss->bucket, ss->key, query, NULL, "abort uploading");
+		ret = -1;
+		goto cleanup;
+	}
+	if ((ret = simple_request(ss->h, "POST", ss->bucket, ss->key, query, xml, "finish uploading")) != 0){
+		simple_request(ss->h, "DELETE", ss->bucket, ss->key, query, NULL, "abort uploading");
+	}
+
+cleanup:
+	for (i = 0; i < S3_STREAM_BUFFERS; ++i){
+		stream_part_join(ss, &ss->parts[i]);
+		free(ss->parts[i].buf);
+		free(ss->parts[i].etag);
+	}
+	for (i = 0; i < ss->n_parts; ++i){
+		free(ss->etags[i]);
+	}
+	free(ss->etags);
+	free(ss->upload_id);
+	free(ss->bucket);
+	free(ss->key);
+	free(ss);
+	free(query);
+	free(xml);
+	return ret;
+}
+
+int S3rm(const char* path, S3handle* sh){
+	struct s3_handle* h = sh;
+	struct key_list kl;
+	struct stat st;
+	char* bucket = NULL;
+	char* key = NULL;
+	size_t i;
+	int res;
+	int ret = 0;
+
+	return_ifnull(path, -1);
+	return_ifnull(sh, -1);
+
+	memset(&kl, 0, sizeof(kl));
+	if (split_path(path, &bucket, &key) != 0){
+		return -1;
+	}
+	if (!key){
+		log_error("S3: Buckets are never removed");
+		ret = -1;
+		goto cleanup;
+	}
+
+	if ((res = stat_path(h, bucket, key, &st)) != 0){
+		if (res > 0){
+			log_error_ex("S3: %s does not exist", path);
+		}
+		ret = -1;
+		goto cleanup;
+	}
+	if (!S_ISDIR(st.st_mode)){
+		ret = simple_request(h, "DELETE", bucket, key, NULL, NULL, "remove");
+		goto cleanup;
+	}
+
+	if (list_all(h, bucket, key, &kl) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+	for (i = 0; i < kl.len; ++i){
+		if (simple_request(h, "DELETE", bucket, kl.keys[i], NULL, NULL, "remove") != 0){
+			ret = -1;
+		}
+	}
+
+cleanup:
+	key_list_free(&kl);
+	free(bucket);
+	free(key);
+	return ret;
+}
+
+void S3set_upload_limit(uint64_t bytes_per_sec, S3handle* sh){
+	struct s3_handle* h = sh;
+
+	if (!h){
+		return;
+	}
+	tb_set_rate(h->tb, bytes_per_sec);
+}
+
+int S3logout(S3handle* sh){
+	struct s3_handle* h = sh;
+	size_t i;
+
+	if (!h){
+		return 0;
+	}
+
+	for (i = 0; i < h->pool_len; ++i){
+		curl_easy_cleanup(h->pool[i]);
+	}
+	/* the connections live in the share, so it goes after every handle using it */
+	h->share ? curl_share_cleanup(h->share) : (CURLSHcode)0;
+	for (i = 0; i < CURL_LOCK_DATA_LAST; ++i){
+		pthread_mutex_destroy(&h->share_locks[i]);
+	}
+	pthread_mutex_destroy(&h->pool_lock);
+	tb_free(h->tb);
+
+	if (h->secret_key){
+		memset(h->secret_key, 0, strlen(h->secret_key));
+	}
+	free(h->access_key);
+	free(h->secret_key);
+	free(h->region);
+	free(h->endpoint);
+	free(h->host);
+	free(h);
+	return 0;
+}
@@ -0,0 +1,366 @@
+/** @file cloud/s3.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __S3_H
+#define __S3_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/**
+ * @brief The size of each part of a multipart upload or ranged download.<br>
+ * Files up to this size are sent in one request.<br>
+ * This grows for files too large to fit in S3_MAX_PARTS parts.
+ */
+#ifndef S3_PART_SIZE
+#define S3_PART_SIZE (64UL * 1024 * 1024)
+#endif
+
+/**
+ * @brief How many parts of one file are transferred at once.
+ */
+#ifndef S3_PARALLEL
+#define S3_PARALLEL (8)
+#endif
+
+/**
+ * @brief The most parts S3 allows in a multipart upload.
+ */
+#define S3_MAX_PARTS (10000UL)
+
+/**
+ * @brief The largest object S3 copies in one request.<br>
+ * Larger objects are renamed by copying them in parts.
+ */
+#define S3_COPY_MAX (5UL * 1024 * 1024 * 1024)
+
+/**
+ * @brief The size of each part of a streamed upload, which is held in memory until it is sent.<br>
+ * This doubles every 1000 parts, since the size of a stream is not known in advance.
+ */
+#ifndef S3_STREAM_PART_SIZE
+#define S3_STREAM_PART_SIZE (16UL * 1024 * 1024)
+#endif
+
+/**
+ * @brief How many parts of a streamed upload are held in memory at once.<br>
+ * One is filled while the others are sent.
+ */
+#ifndef S3_STREAM_BUFFERS
+#define S3_STREAM_BUFFERS (3)
+#endif
+
+/**
+ * @brief How many times a request is sent before giving up if the connection fails or the server is busy.
+ */
+#ifndef S3_REQUEST_RETRIES
+#define S3_REQUEST_RETRIES (3)
+#endif
+
+/**
+ * @brief How many idle connection handles are kept for reuse.
+ */
+#ifndef S3_POOL_SIZE
+#define S3_POOL_SIZE (32)
+#endif
+
+/**< An S3 connection that's been typecasted to void for compatibility with the other providers */
+typedef void S3handle;
+
+/**< Called when a transfer started by S3upload_start() or S3download_start() finishes, with 0 on success or negative on failure */
+typedef void (*S3transfer_done)(int res, void* data);
+
+/**
+ * @brief Connects to an S3-compatible service, e.g. AWS, MinIO, or Ceph RGW.<br>
+ * The first component of every path is the bucket, so "/backups/host" is the "host" prefix of the "backups" bucket.<br>
+ * The service is https://s3.REGION.amazonaws.com unless $EZBACKUP_S3_ENDPOINT is set, e.g. to "http://localhost:9000".<br>
+ * The region is $EZBACKUP_S3_REGION, $AWS_REGION, or $AWS_DEFAULT_REGION, or "us-east-1" if none are set.<br>
+ * The credentials are not checked until the first request.
+ *
+ * @param username The access key id.<br>
+ * This cannot be NULL.
+ *
+ * @param password The secret access key.<br>
+ * This cannot be NULL.
+ *
+ * @param out A pointer to a handle that this function will fill.<br>
+ * The handle will be set to NULL if this function fails.<br>
+ * This handle must be freed with S3logout() when no longer in use.
+ *
+ * @return 0 on success, or negative on failure.
+ * @see S3logout()
+ */
+int S3login(const char* username, const char* password, S3handle** out);
+
+/**
+ * @brief Makes a directory within S3.<br>
+ * A bucket is created if it does not exist. Anything under it is a zero-length object ending in '/', which is how other S3 tools show empty directories.
+ *
+ * @param dir The directory to create.
+ *
+ * @param sh A handle returned by S3login().
+ *
+ * @return 0 on success, positive if the directory already exists, negative on failure.
+ */
+int S3mkdir(const char* dir, S3handle* sh);
+
+/**
+ * @brief Reads the contents of a directory within S3.<br>
+ * Reading "/" lists the buckets.
+ *
+ * @param dir The directory to read.
+ *
+ * @param out A pointer to a string array that will contain the entries in the directory.<br>
+ * This string array will be set to NULL if the function fails.
+ *
+ * @param out_st A pointer to an array that will contain the metadata of each entry, which comes with the listing.<br>
+ * This array will be set to NULL if the function fails, and must be freed when no longer in use.<br>
+ * This can be NULL, in which case it is not returned.
+ *
+ * @param out_len A pointer to an integer that will contain the length of the output arrays.<br>
+ * This will be set to 0 if this function fails.
+ *
+ * @param sh A handle returned by S3login().
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int S3readdir(const char* dir, char*** out, struct stat** out_st, size_t* out_len, S3handle* sh);
+
+/**
+ * @brief Gets information about a file or directory within S3.<br>
+ * A path is a directory if anything has it as a prefix.
+ *
+ * @param file_path The path to stat.
+ *
+ * @param out The stat structure to fill.<br>
+ * This can be NULL, in which case only whether it exists is checked.
+ *
+ * @param sh A handle returned by S3login().
+ *
+ * @return 0 on success, positive if the file does not exist, negative on failure.
+ */
+int S3stat(const char* file_path, struct stat* out, S3handle* sh);
+
+/**
+ * @brief Moves a file or directory within S3.<br>
+ * S3 cannot rename, so everything is copied within the service and the originals removed.
+ *
+ * @param old_path The path to move.
+ *
+ * @param new_path Its new path.
+ *
+ * @param sh A handle returned by S3login().
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int S3rename(const char* old_path, const char* new_path, S3handle* sh);
+
+/**
+ * @brief Downloads a file from S3.<br>
+ * Files larger than S3_PART_SIZE are downloaded as S3_PARALLEL ranges at once.
+ *
+ * @param download_path The file to download.
+ *
+ * @param out_path Where to write it.
+ *
+ * @param progress_msg The message of the progress bar, or NULL to not show one.
+ *
+ * @param sh A handle returned by S3login().
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int S3download(const char* download_path, const char* out_path, const char* progress_msg, S3handle* sh);
+
+/**
+ * @brief Downloads a file from S3, handing it to a callback in order as it arrives instead of writing it anywhere.<br>
+ * The file is downloaded in one request. If the connection drops, the rest is asked for with a range, so nothing is handed off twice.
+ *
+ * @param download_path The file to download.
+ *
+ * @param sink A function that receives each block of the file.<br>
+ * It must return 0 on success or non-zero to abort.
+ *
+ * @param sink_data An argument to pass to sink.
+ *
+ * @param sh A handle returned by S3login().
+ *
+ * @return 0 on success, or negative on failure.<br>
+ * On failure, the sink may already have received part of the file.
+ */
+int S3download_stream(const char* download_path, int (*sink)(const void* data, size_t len, void* sink_data), void* sink_data, S3handle* sh);
+
+/**
+ * @brief Uploads a file to S3.<br>
+ * Files larger than S3_PART_SIZE are sent as a multipart upload with S3_PARALLEL parts at once.
+ *
+ * @param in_file The file to upload.
+ *
+ * @param upload_path The directory to upload it to, or the path to upload it as.
+ *
+ * @param progress_msg The message of the progress bar, or NULL to not show one.
+ *
+ * @param sh A handle returned by S3login().
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int S3upload(const char* in_file, const char* upload_path, const char* progress_msg, S3handle* sh);
+
+/**
+ * @brief Starts uploading a file to S3 in the background.
+ *
+ * @param in_file The file to upload.
+ *
+ * @param upload_path The directory to upload it to, or the path to upload it as.
+ *
+ * @param done Called from another thread once the upload finishes.<br>
+ * This is not called if this function fails.
+ *
+ * @param data Passed to done.
+ *
+ * @param sh A handle returned by S3login().
+ *
+ * @return 0 if the upload was started, or negative on failure.
+ */
+int S3upload_start(const char* in_file, const char* upload_path, S3transfer_done done, void* data, S3handle* sh);
+
+/**
+ * @brief Starts downloading a file from S3 in the background.
+ *
+ * @param download_path The file to download.
+ *
+ * @param out_path Where to write it.
+ *
+ * @param done Called from another thread once the download finishes.<br>
+ * This is not called if this function fails.
+ *
+ * @param data Passed to done.
+ *
+ * @param sh A handle returned by S3login().
+ *
+ * @return 0 if the download was started, or negative on failure.
+ */
+int S3download_start(const char* download_path, const char* out_path, S3transfer_done done, void* data, S3handle* sh);
+
+/**
+ * @brief Starts moving a file or directory within S3 in the background, like S3rename().
+ *
+ * @param old_path The path to move.
+ *
+ * @param new_path Its new path.
+ *
+ * @param done Called from another thread once the move finishes.<br>
+ * This is not called if this function fails.
+ *
+ * @param data Passed to done.
+ *
+ * @param sh A handle returned by S3login().
+ *
+ * @return 0 if the move was started, or negative on failure.
+ */
+int S3rename_start(const char* old_path, const char* new_path, S3transfer_done done, void* data, S3handle* sh);
+
+/**
+ * @brief Starts downloading a file from S3 in the background, like S3download_stream().
+ *
+ * @param download_path The file to download.
+ *
+ * @param sink A function that receives each block of the file, from another thread.
+ *
+ * @param sink_data An argument to pass to sink.
+ *
+ * @param done Called from the same thread once the download finishes.<br>
+ * This is not called if this function fails.
+ *
+ * @param data Passed to done.
+ *
+ * @param sh A handle returned by S3login().
+ *
+ * @return 0 if the download was started, or negative on failure.
+ */
+int S3download_stream_start(const char* download_path, int (*sink)(const void* data, size_t len, void* sink_data), void* sink_data, S3transfer_done done, void* data, S3handle* sh);
+
+/**
+ * @brief Starts uploading a stream to S3 without it being in a file first.<br>
+ * The data is sent in parts of S3_STREAM_PART_SIZE as they fill up. A stream smaller than one part is sent in one request when it is closed.
+ *
+ * @param upload_path The path to upload it as.
+ *
+ * @param out A pointer to a stream that this function will fill.<br>
+ * This will be set to NULL if this function fails.<br>
+ * The stream must be closed with S3upload_stream_close() even if writing to it fails.
+ *
+ * @param sh A handle returned by S3login().
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int S3upload_stream_open(const char* upload_path, void** out, S3handle* sh);
+
+/**
+ * @brief Writes to a stream started by S3upload_stream_open().
+ *
+ * @param stream The stream to write to.
+ *
+ * @param data The data to write.
+ *
+ * @param len The length of the data.
+ *
+ * @return 0 on success, or negative on failure.<br>
+ * Once this fails, every later write fails too.
+ */
+int S3upload_stream_write(void* stream, const void* data, size_t len);
+
+/**
+ * @brief Finishes or aborts a stream started by S3upload_stream_open() and frees it.<br>
+ * Nothing is left in S3 if the upload was aborted or failed.
+ *
+ * @param stream The stream to close.<br>
+ * This can be NULL, in which case this function does nothing.
+ *
+ * @param discard Non-zero to throw away what was written instead of finishing the upload.
+ *
+ * @return 0 if the upload finished, or negative if it failed or was aborted.
+ */
+int S3upload_stream_close(void* stream, int discard);
+
+/**
+ * @brief Limits how fast S3 uploads, sharing the limit between every request of every transfer.<br>
+ * While the limit is reached, requests with bodies of at most RL_PRIORITY_SIZE bytes are sent before larger ones.<br>
+ * This takes effect for requests already in flight as well.
+ *
+ * @param bytes_per_sec The most bytes to upload per second, or 0 for unlimited.
+ *
+ * @param sh A handle returned by S3login().
+ *
+ * @return void
+ */
+void S3set_upload_limit(uint64_t bytes_per_sec, S3handle* sh);
+
+/**
+ * @brief Removes a file or directory from S3.<br>
+ * Buckets are never removed.
+ *
+ * @param path The path to remove.
+ *
+ * @param sh A handle returned by S3login().
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int S3rm(const char* path, S3handle* sh);
+
+/**
+ * @brief Closes every connection to S3 and frees the handle.
+ *
+ * @param sh A handle returned by S3login().<br>
+ * This can be NULL, in which case this function does nothing.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int S3logout(S3handle* sh);
+
+#endif
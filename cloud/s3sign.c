@@ -0,0 +1,154 @@
+/** @file cloud/s3sign.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "s3sign.h"
+#include "../crypt/crypt.h"
+#include "../log.h"
+#include "../strings/stringhelper.h"
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void to_hex(const unsigned char* data, size_t len, char* out){
+	const char* digits = "0123456789abcdef";
+	size_t i;
+
+	for (i = 0; i < len; ++i){
+		out[i * 2] = digits[data[i] >> 4];
+		out[i * 2 + 1] = digits[data[i] & 0xF];
+	}
+	out[len * 2] = '\0';
+}
+
+static int hmac_sha256(const void* key, size_t key_len, const char* data, unsigned char out[SHA256_DIGEST_LENGTH]){
+	unsigned int out_len = SHA256_DIGEST_LENGTH;
+
+	if (!HMAC(EVP_sha256(), key, (int)key_len, (const unsigned char*)data, strlen(data), out, &out_len)){
+		log_error("Failed to calculate HMAC-SHA256");
+		return -1;
+	}
+	return 0;
+}
+
+char* s3_uri_encode(const char* str, int keep_slash){
+	const char* digits = "0123456789ABCDEF";
+	char* ret;
+	size_t i;
+	size_t j;
+
+	return_ifnull(str, NULL);
+
+	ret = malloc(strlen(str) * 3 + 1);
+	if (!ret){
+		log_enomem();
+		return NULL;
+	}
+	for (i = 0, j = 0; str[i]; ++i){
+		unsigned char c = str[i];
+
+		if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') ||
+				c == '-' || c == '.' || c == '_' || c == '~' || (c == '/' && keep_slash)){
+			ret[j++] = c;
+		}
+		else{
+			ret[j++] = '%';
+			ret[j++] = digits[c >> 4];
+			ret[j++] = digits[c & 0xF];
+		}
+	}
+	ret[j] = '\0';
+	return ret;
+}
+
+int s3_amz_date(time_t t, char out[17]){
+	struct tm tm;
+
+	if (!gmtime_r(&t, &tm) || strftime(out, 17, "%Y%m%dT%H%M%SZ", &tm) != 16){
+		log_error("Failed to format the request date");
+		return -1;
+	}
+	return 0;
+}
+
+char* s3_authorization(const char* access_key, const char* secret_key, const char* region, const struct s3_request_sig* sig){
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+	unsigned char key[SHA256_DIGEST_LENGTH];
+	char hash_hex[SHA256_DIGEST_LENGTH * 2 + 1];
+	char date[9];
+	char* signed_headers = NULL;
+	char* canonical = NULL;
+	char* to_sign = NULL;
+	char* secret = NULL;
+	char* ret = NULL;
+	size_t i;
+
+	return_ifnull(access_key, NULL);
+	return_ifnull(secret_key, NULL);
+	return_ifnull(region, NULL);
+	return_ifnull(sig, NULL);
+
+	/* the scope only has the day */
+	memcpy(date, sig->amz_date, 8);
+	date[8] = '\0';
+
+	signed_headers = sh_new();
+	canonical = sh_sprintf("%s\n%s\n%s\n", sig->method, sig->path, sig->query ? sig->query : "");
+	for (i = 0; i < sig->n_headers && canonical; ++i){
+		canonical = sh_concat(canonical, sig->headers[i].name);
+		canonical = sh_concat(canonical, ":");
+		canonical = sh_concat(canonical, sig->headers[i].value);
+		canonical = sh_concat(canonical, "\n");
+		signed_headers = i > 0 ? sh_concat(signed_headers, ";") : signed_headers;
+		signed_headers = sh_concat(signed_headers, sig->headers[i].name);
+	}
+	canonical = sh_concat(canonical, "\n");
+	canonical = sh_concat(canonical, signed_headers);
+	canonical = sh_concat(canonical, "\n");
+	canonical = sh_concat(canonical, sig->payload_hash);
+	if (!canonical || !signed_headers){
+		log_error("Failed to create the canonical request");
+		goto cleanup;
+	}
+
+	SHA256((const unsigned char*)canonical, strlen(canonical), hash);
+	to_hex(hash, sizeof(hash), hash_hex);
+	to_sign = sh_sprintf("AWS4-HMAC-SHA256\n%s\n%s/%s/s3/aws4_request\n%s", sig->amz_date, date, region, hash_hex);
+	secret = sh_sprintf("AWS4%s", secret_key);
+	if (!to_sign || !secret){
+		log_error("Failed to create the string to sign");
+		goto cleanup;
+	}
+
+	/* the signing key is derived from the secret one scope at a time */
+	if (hmac_sha256(secret, strlen(secret), date, key) != 0 ||
+			hmac_sha256(key, sizeof(key), region, key) != 0 ||
+			hmac_sha256(key, sizeof(key), "s3", key) != 0 ||
+			hmac_sha256(key, sizeof(key), "aws4_request", key) != 0 ||
+			hmac_sha256(key, sizeof(key), to_sign, hash) != 0){
+		goto cleanup;
+	}
+	to_hex(hash, sizeof(hash), hash_hex);
+
+	ret = sh_sprintf("AWS4-HMAC-SHA256 Credential=%s/%s/%s/s3/aws4_request, SignedHeaders=%s, Signature=%s", access_key, date, region, signed_headers, hash_hex);
+	if (!ret){
+		log_error("Failed to create the Authorization header");
+	}
+
+cleanup:
+	crypt_scrub(key, sizeof(key));
+	if (secret){
+		crypt_scrub(secret, strlen(secret));
+		free(secret);
+	}
+	free(signed_headers);
+	free(canonical);
+	free(to_sign);
+	return ret;
+}
@@ -0,0 +1,96 @@
+/** @file cloud/s3sign.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __CLOUD_S3SIGN_H
+#define __CLOUD_S3SIGN_H
+
+#include <stddef.h>
+#include <time.h>
+
+#ifndef __GNUC__
+#define __attribute__(x)
+#endif
+
+/**
+ * @brief The payload hash sent for requests whose body is not hashed.<br>
+ * Hashing a 64MiB part before sending it would read it twice, and TLS already protects it in transit.
+ */
+#define S3_UNSIGNED_PAYLOAD "UNSIGNED-PAYLOAD"
+
+/**
+ * @brief A header that is part of a request's signature.
+ */
+struct s3_header{
+	/** @brief The header's name in lowercase, e.g. "x-amz-date". */
+	const char* name;
+	/** @brief The header's value, without leading or trailing whitespace. */
+	const char* value;
+};
+
+/**
+ * @brief The parts of a request that an AWS Signature Version 4 covers.
+ */
+struct s3_request_sig{
+	/** @brief The request's method, e.g. "GET". */
+	const char* method;
+	/** @brief The request's path, already encoded with s3_uri_encode(), e.g. "/bucket/my%20file.txt". */
+	const char* path;
+	/** @brief The request's query string with its parameters encoded and sorted by name, or NULL if it has none. */
+	const char* query;
+	/** @brief The signed headers sorted by name.<br>
+	 * These must include "host", "x-amz-content-sha256", and "x-amz-date". */
+	const struct s3_header* headers;
+	/** @brief The number of signed headers. */
+	size_t n_headers;
+	/** @brief The value of the x-amz-content-sha256 header. */
+	const char* payload_hash;
+	/** @brief The value of the x-amz-date header, as written by s3_amz_date(). */
+	const char* amz_date;
+};
+
+/**
+ * @brief Percent-encodes a string the way S3 expects it in a path or query string.<br>
+ * Everything except A-Z, a-z, 0-9, '-', '.', '_', and '~' is encoded.
+ *
+ * @param str The string to encode.
+ *
+ * @param keep_slash Non-zero to leave '/' as is, which is what a path needs.
+ *
+ * @return The encoded string, or NULL on failure.<br>
+ * This string must be freed when no longer in use.
+ */
+char* s3_uri_encode(const char* str, int keep_slash) __attribute__((malloc));
+
+/**
+ * @brief Writes a time in the format of the x-amz-date header, e.g. "20130524T000000Z".
+ *
+ * @param t The time to write.
+ *
+ * @param out Where to write it.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int s3_amz_date(time_t t, char out[17]);
+
+/**
+ * @brief Creates the Authorization header value for a request to S3.
+ *
+ * @param access_key The access key id.
+ *
+ * @param secret_key The secret access key.
+ *
+ * @param region The bucket's region, e.g. "us-east-1".
+ *
+ * @param sig The parts of the request to sign.
+ *
+ * @return The Authorization header value, or NULL on failure.<br>
+ * This string must be freed when no longer in use.
+ */
+char* s3_authorization(const char* access_key, const char* secret_key, const char* region, const struct s3_request_sig* sig) __attribute__((malloc));
+
+#endif
@@ -0,0 +1,568 @@
+/** @file cloudsync.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "cloudsync.h"
+#include "checksum.h"
+#include "filehelper.h"
+#include "log.h"
+#include "manifest.h"
+#include "pipeline.h"
+#include "strings/stringhelper.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* compares the decrypted manifest against the local checksum file as it comes out */
+struct sync_compare{
+	FILE* fp_local;
+	int differs;
+};
+
+static int compare_sink(const void* data, size_t len, void* sink_data){
+	struct sync_compare* sc = sink_data;
+	unsigned char buf[BUFFER_LEN];
+
+	while (len > 0 && !sc->differs){
+		size_t n = len < sizeof(buf) ? len : sizeof(buf);
+
+		if (fread(buf, 1, n, sc->fp_local) != n || memcmp(buf, data, n) != 0){
+			sc->differs = 1;
+		}
+		data = (const unsigned char*)data + n;
+		len -= n;
+	}
+	/* once it differs, the rest does not matter */
+	return sc->differs;
+}
+
+/* one piece of the manifest in the cloud, read in order: the manifest itself or one of its segments */
+struct sync_source{
+	/* the segment as it was downloaded, or NULL for the manifest, which the caller downloads */
+	struct TMPFILE* tfp_download;
+	/* what a manifest that is not encrypted decompresses to */
+	struct TMPFILE* tfp_plain;
+	FILE* fp;
+	struct checksum_reader* cr;
+	struct manifest* m;
+	const struct element* e;
+	int res;
+};
+
+static int sync_source_next(struct sync_source* src){
+	src->res = src->m ? manifest_next(src->m, &src->e) : checksum_reader_next(src->cr, &src->e);
+	return src->res < 0 ? -1 : 0;
+}
+
+/* returns 0 on success, positive if the file cannot be read with these options or this password, or negative on error */
+static int sync_source_open(struct sync_source* src, const char* file, const struct options* opt, const char* password){
+	if (opt->enc_algorithm && password){
+		return manifest_open(file, password, &src->m) != 0 ? 1 : 0;
+	}
+
+	if (!(src->tfp_plain = temp_fopen())){
+		log_error("Failed to create temporary file for the cloud manifest.");
+		return -1;
+	}
+	if (pipeline_restore_file(file, src->tfp_plain->name, opt, password) != 0){
+		return 1;
+	}
+	if (!(src->fp = fopen(src->tfp_plain->name, "rb"))){
+		log_efopen(src->tfp_plain->name);
+		return -1;
+	}
+	return (src->cr = checksum_reader_new(src->fp, 0)) != NULL ? 0 : -1;
+}
+
+static void sync_source_close(struct sync_source* src){
+	checksum_reader_free(src->cr);
+	src->fp ? fclose(src->fp) : 0;
+	src->tfp_plain ? temp_fclose(src->tfp_plain) : (void)0;
+	src->tfp_download ? temp_fclose(src->tfp_download) : (void)0;
+	src->m ? manifest_close(src->m) : (void)0;
+}
+
+static int element_differs(const struct element* e1, const struct element* e2){
+	return strcmp(e1->file, e2->file) != 0 || strcmp(e1->checksum, e2->checksum) != 0 ||
+		!e1->meta != !e2->meta ||
+		(e1->meta && memcmp(e1->meta, e2->meta, sizeof(*e1->meta)) != 0);
+}
+
+/* compares the manifest and its segments against the local checksum file, merging them as they are read
+ * a segment's record replaces the one for the same path before it, and one with an empty checksum removes it
+ * returns 0 if they match, positive if they do not, or negative on error */
+static int compare_sources(struct sync_source* src, size_t n_src, const char* checksum_file){
+	struct checksum_reader* cr = NULL;
+	unsigned char* matched = NULL;
+	FILE* fp_local;
+	size_t i;
+	int ret = 0;
+
+	if (!(fp_local = fopen(checksum_file, "rb"))){
+		log_efopen(checksum_file);
+		return -1;
+	}
+	if (!(matched = malloc(n_src))){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+	if (!(cr = checksum_reader_new(fp_local, 0))){
+		ret = -1;
+		goto cleanup;
+	}
+	for (i = 0; i < n_src; ++i){
+		if (sync_source_next(&src[i]) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+	}
+
+	for (;;){
+		const struct element* e_local;
+		const struct element* e_cloud = NULL;
+		int res_local;
+
+		/* the smallest path comes next, from the last piece that has it */
+		for (i = 0; i < n_src; ++i){
+			if (src[i].res == 0 && (!e_cloud || strcmp(src[i].e->file, e_cloud->file) <= 0)){
+				e_cloud = src[i].e;
+			}
+		}
+		/* every piece that has it moves past it, which is only safe once they are all found */
+		for (i = 0; e_cloud && i < n_src; ++i){
+			matched[i] = src[i].res == 0 && strcmp(src[i].e->file, e_cloud->file) == 0;
+		}
+
+		if (!e_cloud || e_cloud->checksum[0] != '\0'){
+			if ((res_local = checksum_reader_next(cr, &e_local)) < 0){
+				ret = -1;
+				break;
+			}
+			if (res_local > 0 || !e_cloud){
+				ret = res_local > 0 && !e_cloud ? 0 : 1;
+				break;
+			}
+			if (element_differs(e_local, e_cloud)){
+				ret = 1;
+				break;
+			}
+		}
+
+		for (i = 0; i < n_src; ++i){
+			if (matched[i] && sync_source_next(&src[i]) != 0){
+				ret = -1;
+				goto cleanup;
+			}
+		}
+	}
+
+cleanup:
+	checksum_reader_free(cr);
+	free(matched);
+	fclose(fp_local);
+	return ret;
+}
+
+/* the manifest if name is CLOUD_MANIFEST_NAME and segment is 0, or one of its segments or the marker */
+static char* sync_path(const char* cloud_directory, const char* name, unsigned segment){
+	char* base = sh_concat_path(sh_dup(cloud_directory), name);
+	char* ret = base;
+
+	if (base && segment > 0){
+		ret = sh_sprintf("%s.%u", base, segment);
+		free(base);
+	}
+	if (!ret){
+		log_error("Failed to create cloud manifest path.");
+	}
+	return ret;
+}
+
+/* finds how big the manifest is, and how many segments follow it and how big they are altogether
+ * the segments are numbered from 1 with no gaps, so the first one that is missing is the end
+ * returns 0 on success, positive if there is no manifest, or negative on error */
+static int stat_manifest(const char* cloud_directory, struct cloud_data* cd, uint64_t* manifest_len, unsigned* n_segments, uint64_t* segments_len){
+	unsigned i;
+
+	*manifest_len = 0;
+	*n_segments = 0;
+	*segments_len = 0;
+	for (i = 0; ; ++i){
+		struct stat st;
+		char* cloud_path;
+		int res;
+
+		if (!(cloud_path = sync_path(cloud_directory, CLOUD_MANIFEST_NAME, i))){
+			return -1;
+		}
+		res = cloud_stat(cloud_path, &st, cd);
+		free(cloud_path);
+		if (res < 0){
+			return -1;
+		}
+		if (res > 0){
+			return i == 0 ? 1 : 0;
+		}
+
+		if (i == 0){
+			*manifest_len = st.st_size;
+		}
+		else{
+			*n_segments = i;
+			*segments_len += st.st_size;
+		}
+	}
+}
+
+static int remove_if_exists(const char* cloud_path, struct cloud_data* cd){
+	int res = cloud_stat(cloud_path, NULL, cd);
+
+	if (res == 0){
+		return cloud_remove(cloud_path, cd);
+	}
+	return res < 0 ? -1 : 0;
+}
+
+/* compresses and encrypts a sorted checksum file the way the manifest and its segments are kept in the cloud */
+static int encode_manifest(const char* checksum_file, const char* out_file, const struct options* opt, const char* password){
+	/* an encrypted manifest is made of blocks that can be decrypted on their own */
+	if (opt->enc_algorithm && password){
+		if (manifest_write(checksum_file, out_file, opt->enc_algorithm, password) != 0){
+			log_error("Failed to encrypt the cloud manifest.");
+			return -1;
+		}
+		return 0;
+	}
+	if (pipeline_backup_file(checksum_file, out_file, opt, password, 0, NULL) != 0){
+		log_error("Failed to compress/encrypt the cloud manifest.");
+		return -1;
+	}
+	return 0;
+}
+
+/* downloads the segments after the manifest and compares all of them against the local checksum file */
+static int compare_segments(const char* manifest_file, unsigned n_segments, const char* checksum_file, const char* cloud_directory, const struct options* opt, const char* password, struct cloud_data* cd){
+	struct sync_source* src;
+	size_t n_src = n_segments + 1;
+	size_t i;
+	int ret = 0;
+
+	if (!(src = calloc(n_src, sizeof(*src)))){
+		log_enomem();
+		return -1;
+	}
+
+	for (i = 0; i < n_src; ++i){
+		const char* file = manifest_file;
+		int res;
+
+		if (i > 0){
+			char* cloud_path;
+			char* out_file;
+
+			if (!(src[i].tfp_download = temp_fopen())){
+				log_error("Failed to create temporary file for the cloud manifest.");
+				ret = -1;
+				goto cleanup;
+			}
+			if (!(cloud_path = sync_path(cloud_directory, CLOUD_MANIFEST_NAME, i))){
+				ret = -1;
+				goto cleanup;
+			}
+			out_file = src[i].tfp_download->name;
+			res = cloud_download(cloud_path, &out_file, cd);
+			free(cloud_path);
+			if (res != 0){
+				log_warning("Failed to download a cloud manifest segment.");
+				ret = -1;
+				goto cleanup;
+			}
+			file = src[i].tfp_download->name;
+		}
+
+		/* a manifest from other options or another password cannot be read, which means it is not this backup's */
+		if ((res = sync_source_open(&src[i], file, opt, password)) != 0){
+			if (res > 0){
+				log_info("Could not read the cloud manifest.");
+			}
+			ret = res;
+			goto cleanup;
+		}
+	}
+
+	ret = compare_sources(src, n_src, checksum_file);
+
+cleanup:
+	for (i = 0; i < n_src; ++i){
+		sync_source_close(&src[i]);
+	}
+	free(src);
+	return ret;
+}
+
+int cloud_sync_check(const char* checksum_file, const char* cloud_directory, const struct options* opt, const char* password, struct cloud_data* cd){
+	struct sync_compare sc;
+	struct TMPFILE* tfp_manifest = NULL;
+	char* cloud_path = NULL;
+	char* out_file = NULL;
+	uint64_t manifest_len;
+	uint64_t segments_len;
+	unsigned n_segments;
+	int res;
+	int ret = 0;
+
+	return_ifnull(checksum_file, -1);
+	return_ifnull(cloud_directory, -1);
+	return_ifnull(opt, -1);
+	return_ifnull(cd, -1);
+
+	sc.fp_local = NULL;
+	sc.differs = 0;
+
+	if ((res = stat_manifest(cloud_directory, cd, &manifest_len, &n_segments, &segments_len)) != 0){
+		ret = res;
+		goto cleanup;
+	}
+	/* something changed in the cloud after the manifest was last committed */
+	if (!(cloud_path = sync_path(cloud_directory, CLOUD_MANIFEST_DIRTY_NAME, 0))){
+		ret = -1;
+		goto cleanup;
+	}
+	if ((res = cloud_stat(cloud_path, NULL, cd)) <= 0){
+		ret = res < 0 ? -1 : 1;
+		goto cleanup;
+	}
+	free(cloud_path);
+
+	if (!(cloud_path = sync_path(cloud_directory, CLOUD_MANIFEST_NAME, 0))){
+		ret = -1;
+		goto cleanup;
+	}
+	if (!(tfp_manifest = temp_fopen())){
+		log_error("Failed to create temporary file for the cloud manifest.");
+		ret = -1;
+		goto cleanup;
+	}
+	out_file = tfp_manifest->name;
+	if (cloud_download(cloud_path, &out_file, cd) != 0){
+		log_warning("Failed to download the cloud manifest.");
+		ret = -1;
+		goto cleanup;
+	}
+
+	/* the records have to be merged, or can only be decrypted one block at a time */
+	if (n_segments > 0 || (opt->enc_algorithm && password)){
+		ret = compare_segments(tfp_manifest->name, n_segments, checksum_file, cloud_directory, opt, password, cd);
+		goto cleanup;
+	}
+
+	if (!(sc.fp_local = fopen(checksum_file, "rb"))){
+		log_efopen(checksum_file);
+		ret = -1;
+		goto cleanup;
+	}
+	/* a manifest from other options or another password cannot be read, which means it is not this backup's */
+	if (pipeline_restore_stream(tfp_manifest->name, opt, password, compare_sink, &sc) != 0 && !sc.differs){
+		log_info("Could not read the cloud manifest.");
+		ret = 1;
+		goto cleanup;
+	}
+	if (sc.differs || fgetc(sc.fp_local) != EOF){
+		ret = 1;
+		goto cleanup;
+	}
+
+cleanup:
+	sc.fp_local ? fclose(sc.fp_local) : 0;
+	tfp_manifest ? temp_fclose(tfp_manifest) : (void)0;
+	free(cloud_path);
+	return ret;
+}
+
+/* uploads the changes since the last commit as the next segment
+ * returns 0 on success, positive if the manifest should be compacted instead, or negative on error */
+static int commit_segment(const char* checksum_file, FILE* prev_checksums, const char* cloud_directory, const struct options* opt, const char* password, struct cloud_data* cd){
+	struct TMPFILE* tfp_delta = NULL;
+	struct TMPFILE* tfp_segment = NULL;
+	char* cloud_path = NULL;
+	uint64_t manifest_len;
+	uint64_t segments_len;
+	unsigned n_segments;
+	struct stat st;
+	int res;
+	int ret = 0;
+
+	if ((res = stat_manifest(cloud_directory, cd, &manifest_len, &n_segments, &segments_len)) != 0){
+		ret = res;
+		goto cleanup;
+	}
+	if (n_segments >= CLOUD_MANIFEST_MAX_SEGMENTS){
+		ret = 1;
+		goto cleanup;
+	}
+
+	if (!(tfp_delta = temp_fopen()) || !(tfp_segment = temp_fopen())){
+		log_error("Failed to create temporary file for the cloud manifest.");
+		ret = -1;
+		goto cleanup;
+	}
+	if ((res = create_checksum_delta(prev_checksums, checksum_file, tfp_delta->name)) != 0){
+		/* nothing changed, so the manifest in the cloud is already right */
+		ret = res > 0 ? 0 : -1;
+		goto cleanup;
+	}
+	if (encode_manifest(tfp_delta->name, tfp_segment->name, opt, password) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+
+	/* once the segments are half the size of the manifest, reading them costs more than rewriting it */
+	if (stat(tfp_segment->name, &st) != 0){
+		log_estat(tfp_segment->name);
+		ret = -1;
+		goto cleanup;
+	}
+	if ((segments_len + st.st_size) * 2 > manifest_len){
+		ret = 1;
+		goto cleanup;
+	}
+
+	if (!(cloud_path = sync_path(cloud_directory, CLOUD_MANIFEST_NAME, n_segments + 1))){
+		ret = -1;
+		goto cleanup;
+	}
+	if (cloud_upload(tfp_segment->name, cloud_path, cd) != 0){
+		log_error("Failed to upload the cloud manifest segment.");
+		ret = -1;
+		goto cleanup;
+	}
+
+cleanup:
+	tfp_delta ? temp_fclose(tfp_delta) : (void)0;
+	tfp_segment ? temp_fclose(tfp_segment) : (void)0;
+	free(cloud_path);
+	return ret;
+}
+
+/* replaces the manifest with the whole checksum file and removes the segments it now holds */
+static int commit_manifest(const char* checksum_file, const char* cloud_directory, const struct options* opt, const char* password, struct cloud_data* cd){
+	struct TMPFILE* tfp_manifest = NULL;
+	char* cloud_path = NULL;
+	uint64_t manifest_len;
+	uint64_t segments_len;
+	unsigned n_segments = 0;
+	int ret = 0;
+
+	if (!(cloud_path = sync_path(cloud_directory, CLOUD_MANIFEST_NAME, 0))){
+		ret = -1;
+		goto cleanup;
+	}
+	if (stat_manifest(cloud_directory, cd, &manifest_len, &n_segments, &segments_len) < 0){
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (!(tfp_manifest = temp_fopen())){
+		log_error("Failed to create temporary file for the cloud manifest.");
+		ret = -1;
+		goto cleanup;
+	}
+	if (encode_manifest(checksum_file, tfp_manifest->name, opt, password) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+	if (cloud_mkdir(cloud_directory, cd) < 0 || cloud_upload(tfp_manifest->name, cloud_path, cd) != 0){
+		log_error("Failed to upload the cloud manifest.");
+		ret = -1;
+		goto cleanup;
+	}
+
+	/* the last segment goes first, so the ones left are still numbered without gaps if one fails */
+	for (; n_segments > 0; --n_segments){
+		free(cloud_path);
+		if (!(cloud_path = sync_path(cloud_directory, CLOUD_MANIFEST_NAME, n_segments))){
+			ret = -1;
+			goto cleanup;
+		}
+		if (cloud_remove(cloud_path, cd) != 0){
+			log_error("Failed to remove an old cloud manifest segment.");
+			ret = -1;
+			goto cleanup;
+		}
+	}
+
+cleanup:
+	tfp_manifest ? temp_fclose(tfp_manifest) : (void)0;
+	free(cloud_path);
+	return ret;
+}
+
+int cloud_sync_commit(const char* checksum_file, FILE* prev_checksums, const char* cloud_directory, const struct options* opt, const char* password, struct cloud_data* cd){
+	char* cloud_path = NULL;
+	int res = 1;
+	int ret = 0;
+
+	return_ifnull(checksum_file, -1);
+	return_ifnull(cloud_directory, -1);
+	return_ifnull(opt, -1);
+	return_ifnull(cd, -1);
+
+	if (prev_checksums && (res = commit_segment(checksum_file, prev_checksums, cloud_directory, opt, password, cd)) < 0){
+		ret = -1;
+		goto cleanup;
+	}
+	if (res > 0 && commit_manifest(checksum_file, cloud_directory, opt, password, cd) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (!(cloud_path = sync_path(cloud_directory, CLOUD_MANIFEST_DIRTY_NAME, 0))){
+		ret = -1;
+		goto cleanup;
+	}
+	if (remove_if_exists(cloud_path, cd) != 0){
+		log_error("Failed to remove the cloud manifest's out of date marker.");
+		ret = -1;
+		goto cleanup;
+	}
+
+cleanup:
+	free(cloud_path);
+	return ret;
+}
+
+int cloud_sync_invalidate(const char* cloud_directory, struct cloud_data* cd){
+	struct TMPFILE* tfp_marker = NULL;
+	char* cloud_path = NULL;
+	int ret = 0;
+
+	return_ifnull(cloud_directory, -1);
+	return_ifnull(cd, -1);
+
+	if (!(cloud_path = sync_path(cloud_directory, CLOUD_MANIFEST_DIRTY_NAME, 0))){
+		return -1;
+	}
+	/* the marker is empty, so it is cheaper to upload than the manifest is to upload again */
+	if ((tfp_marker = temp_fopen()) != NULL && fflush(tfp_marker->fp) == 0 && cloud_upload(tfp_marker->name, cloud_path, cd) == 0){
+		goto cleanup;
+	}
+	log_warning("Failed to mark the cloud manifest as out of date. Removing it instead.");
+
+	free(cloud_path);
+	if (!(cloud_path = sync_path(cloud_directory, CLOUD_MANIFEST_NAME, 0))){
+		ret = -1;
+		goto cleanup;
+	}
+	ret = remove_if_exists(cloud_path, cd);
+
+cleanup:
+	tfp_marker ? temp_fclose(tfp_marker) : (void)0;
+	free(cloud_path);
+	return ret;
+}
@@ -0,0 +1,91 @@
+/** @file cloudsync.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __CLOUDSYNC_H
+#define __CLOUDSYNC_H
+
+#include "options/options.h"
+#include "cloud/base.h"
+#include <stdio.h>
+
+/**
+ * @brief The name of the manifest within the cloud upload directory.<br>
+ * It is the checksum file of the last backup that finished uploading everything.<br>
+ * With encryption, it is a manifest whose blocks are each encrypted and authenticated on their own, so it can be read without decrypting all of it. Otherwise, it is compressed like the files it describes.
+ * @see manifest_write()
+ */
+#define CLOUD_MANIFEST_NAME "checksums.txt"
+
+/**
+ * @brief The most segments that can follow the manifest before it is compacted.<br>
+ * Each commit whose checksum file differs from the last one's uploads only what changed, as CLOUD_MANIFEST_NAME ".1", ".2", and so on.<br>
+ * Once there are this many, or they are half the size of the manifest, the next commit uploads the whole checksum file as the manifest and removes them.
+ */
+#define CLOUD_MANIFEST_MAX_SEGMENTS 16
+
+/**
+ * @brief The name of the empty file that marks the manifest in the cloud as out of date.
+ * @see cloud_sync_invalidate()
+ */
+#define CLOUD_MANIFEST_DIRTY_NAME "checksums.txt.dirty"
+
+/**
+ * @brief Checks whether the cloud still holds what the last backup left in it.<br>
+ * The manifest in the cloud and the segments after it are downloaded, merged, and compared against the local checksum file.<br>
+ * If they match, the output directory and the cloud upload directory have the same files, so the cloud does not have to be asked whether a file is there.
+ *
+ * @param checksum_file The local checksum file of the last backup.
+ *
+ * @param cloud_directory The cloud upload directory.
+ *
+ * @param opt The options the manifest was written with.
+ *
+ * @param password The encryption password, or NULL if opt->enc_algorithm is NULL.
+ *
+ * @param cd A cloud data structure returned by cloud_login().
+ *
+ * @return 0 if the cloud is in sync, positive if it is not, there is no manifest, or it is marked out of date, or negative on failure.
+ */
+int cloud_sync_check(const char* checksum_file, const char* cloud_directory, const struct options* opt, const char* password, struct cloud_data* cd);
+
+/**
+ * @brief Brings the manifest in the cloud up to date with a checksum file.<br>
+ * If the manifest matched prev_checksums, only the records that changed are uploaded, as a new segment. Otherwise, or once there are too many segments, the whole checksum file replaces the manifest and the segments are removed.<br>
+ * This must only be called once everything in the checksum file has been uploaded.
+ *
+ * @param checksum_file The local checksum file of the backup that just finished.
+ *
+ * @param prev_checksums The checksum file of the last backup, if cloud_sync_check() found the cloud in sync with it, or NULL to upload the whole checksum file.
+ *
+ * @param cloud_directory The cloud upload directory.
+ *
+ * @param opt The options to compress and encrypt the manifest with.<br>
+ * An encrypted manifest uses opt->enc_algorithm if it authenticates what it encrypts, or AES-256-GCM if not.
+ *
+ * @param password The encryption password, or NULL if opt->enc_algorithm is NULL.
+ *
+ * @param cd A cloud data structure returned by cloud_login().
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int cloud_sync_commit(const char* checksum_file, FILE* prev_checksums, const char* cloud_directory, const struct options* opt, const char* password, struct cloud_data* cd);
+
+/**
+ * @brief Marks the manifest in the cloud as out of date, so the next backup does not trust it.<br>
+ * If the marker cannot be uploaded, the manifest is removed instead.<br>
+ * This must be called before anything in the cloud upload directory is changed without the manifest being committed after.
+ *
+ * @param cloud_directory The cloud upload directory.
+ *
+ * @param cd A cloud data structure returned by cloud_login().
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int cloud_sync_invalidate(const char* cloud_directory, struct cloud_data* cd);
+
+#endif
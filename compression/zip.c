@@ -9,6 +9,7 @@
 #define __ZIP_INTERNAL
 #include "zip.h"
 #include "zip_file.h"
+#include "zip_seek.h"
 #include "../log.h"
 #include "../filehelper.h"
 #include "../strings/stringhelper.h"
@@ -16,18 +17,27 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #ifndef NO_GZIP_SUPPORT
 #include <zlib.h>
+#include "zip_pgzip.h"
 #endif
 #ifndef NO_BZIP2_SUPPORT
 #include <bzlib.h>
+#include "zip_pbzip2.h"
 #endif
 #ifndef NO_XZ_SUPPORT
 #include <lzma.h>
 #endif
 #ifndef NO_LZ4_SUPPORT
+#include <lz4.h>
 #include "zip_lz4.h"
+#include "zip_plz4.h"
+#endif
+#ifndef NO_ZSTD_SUPPORT
+#include "zip_zstd.h"
 #endif
 
 #ifndef __GNUC__
@@ -82,8 +92,9 @@ __attribute__((malloc)) static struct ZIP_FILE* gzip_open(const char* file, cons
 			}
 		}
 
-		ret->fp = fopen(file, "wb");
-		if (!ret->fp){
+		/* no file means the output goes to a sink (see zip_stream_new()) */
+		ret->fp = file ? fopen(file, "wb") : NULL;
+		if (file && !ret->fp){
 			log_efopen(file);
 			free(ret);
 			return NULL;
@@ -99,8 +110,9 @@ __attribute__((malloc)) static struct ZIP_FILE* gzip_open(const char* file, cons
 		ret->strm.zstrm.next_in = Z_NULL;
 		ret->strm.zstrm.avail_in = 0;
 
-		ret->fp = fopen(file, "rb");
-		if (!ret->fp){
+		/* no file means the input comes from zip_stream_write() (see zip_decompress_stream_new()) */
+		ret->fp = file ? fopen(file, "rb") : NULL;
+		if (file && !ret->fp){
 			log_efopen(file);
 			free(ret);
 			return NULL;
@@ -143,8 +155,9 @@ __attribute__((malloc)) static struct ZIP_FILE* bzip2_open(const char* file, con
 			}
 		}
 
-		ret->fp = fopen(file, "wb");
-		if (!ret->fp){
+		/* no file means the output goes to a sink (see zip_stream_new()) */
+		ret->fp = file ? fopen(file, "wb") : NULL;
+		if (file && !ret->fp){
 			log_efopen(file);
 			free(ret);
 			return NULL;
@@ -160,8 +173,9 @@ __attribute__((malloc)) static struct ZIP_FILE* bzip2_open(const char* file, con
 		ret->strm.bzstrm.next_in = NULL;
 		ret->strm.zstrm.avail_in = 0;
 
-		ret->fp = fopen(file, "rb");
-		if (!ret->fp){
+		/* no file means the input comes from zip_stream_write() (see zip_decompress_stream_new()) */
+		ret->fp = file ? fopen(file, "rb") : NULL;
+		if (file && !ret->fp){
 			log_efopen(file);
 			free(ret);
 			return NULL;
@@ -178,9 +192,53 @@ __attribute__((malloc)) static struct ZIP_FILE* bzip2_open(const char* file, con
 #endif
 
 #ifndef NO_XZ_SUPPORT
-__attribute__((malloc)) static struct ZIP_FILE* xz_open(const char* file, const char* mode){
+/* the encoder splits its output into blocks that are compressed at the same time, and records their sizes so the decoder can do the same */
+static lzma_ret xz_encoder_mt(lzma_stream* strm, uint32_t preset, unsigned flags){
+	lzma_mt mt;
+
+	memset(&mt, 0, sizeof(mt));
+	mt.threads = ZIP_GET_WORKERS(flags) > 0 ? ZIP_GET_WORKERS(flags) : 1;
+	/* 0 lets liblzma pick three times the dictionary size */
+	mt.block_size = (uint64_t)XZ_GET_BLOCK_MIB(flags) << 20;
+	mt.preset = preset;
+	mt.check = LZMA_CHECK_CRC64;
+	return lzma_stream_encoder_mt(strm, &mt);
+}
+
+/* initializing an encoder on a stream that already had one reuses its memory wherever the settings allow */
+static lzma_ret xz_encoder(lzma_stream* strm, uint32_t preset, unsigned flags){
+	if (ZIP_GET_WORKERS(flags) > 1 || XZ_GET_BLOCK_MIB(flags) > 0){
+		return xz_encoder_mt(strm, preset, flags);
+	}
+	return lzma_easy_encoder(strm, preset, LZMA_CHECK_CRC64);
+}
+
+static lzma_ret xz_decoder(lzma_stream* strm, unsigned flags){
+#if LZMA_VERSION >= UINT32_C(50040002)
+	lzma_mt mt;
+
+	/* only files with more than one block can be decoded on more than one thread, which older liblzma cannot do at all */
+	if (ZIP_GET_WORKERS(flags) > 1){
+		memset(&mt, 0, sizeof(mt));
+		mt.threads = ZIP_GET_WORKERS(flags);
+		/* the same limit xz itself uses, past which it decodes on one thread instead of failing */
+		mt.memlimit_threading = lzma_physmem() / 4;
+		if (mt.memlimit_threading == 0){
+			mt.memlimit_threading = UINT64_MAX;
+		}
+		mt.memlimit_stop = UINT64_MAX;
+		return lzma_stream_decoder_mt(strm, &mt);
+	}
+#else
+	(void)flags;
+#endif
+	return lzma_stream_decoder(strm, UINT64_MAX, 0);
+}
+
+__attribute__((malloc)) static struct ZIP_FILE* xz_open(const char* file, const char* mode, unsigned flags){
 	struct ZIP_FILE* ret = NULL;
 	lzma_stream xstrm = LZMA_STREAM_INIT;
+	lzma_ret res;
 
 	ret = malloc(sizeof(*ret));
 	if (!ret){
@@ -207,28 +265,31 @@ __attribute__((malloc)) static struct ZIP_FILE* xz_open(const char* file, const
 			compression_level |= LZMA_PRESET_EXTREME;
 		}
 
-		ret->fp = fopen(file, "wb");
-		if (!ret->fp){
+		/* no file means the output goes to a sink (see zip_stream_new()) */
+		ret->fp = file ? fopen(file, "wb") : NULL;
+		if (file && !ret->fp){
 			log_efopen(file);
 			free(ret);
 			return NULL;
 		}
 
-		if (lzma_easy_encoder(&(ret->strm.xzstrm), compression_level, LZMA_CHECK_CRC64) != LZMA_OK){
-			log_error("Error initializing LZMA compression operation");
+		res = xz_encoder(&(ret->strm.xzstrm), compression_level, flags);
+		if (res != LZMA_OK){
+			log_error_ex("Error initializing LZMA compression operation (%d)", res);
 			free(ret);
 			return NULL;
 		}
 	}
 	else{
-		ret->fp = fopen(file, "rb");
-		if (!ret->fp){
+		/* no file means the input comes from zip_stream_write() (see zip_decompress_stream_new()) */
+		ret->fp = file ? fopen(file, "rb") : NULL;
+		if (file && !ret->fp){
 			log_efopen(file);
 			free(ret);
 			return NULL;
 		}
 
-		if (lzma_stream_decoder(&(ret->strm.xzstrm), UINT64_MAX, 0) != LZMA_OK){
+		if (xz_decoder(&(ret->strm.xzstrm), flags) != LZMA_OK){
 			log_error("Failed to initialize decompression operation");
 			free(ret);
 			return NULL;
@@ -239,6 +300,7 @@ __attribute__((malloc)) static struct ZIP_FILE* xz_open(const char* file, const
 #endif
 
 __attribute__((malloc)) static struct ZIP_FILE* zip_open(const char* file, int write, enum compressor c_type, int compression_level, unsigned flags){
+	struct ZIP_FILE* zfp = NULL;
 	char truemode[16];
 	int modeptr = 2;
 
@@ -291,20 +353,35 @@ __attribute__((malloc)) static struct ZIP_FILE* zip_open(const char* file, int w
 	switch (c_type){
 #ifndef NO_GZIP_SUPPORT
 	case COMPRESSOR_GZIP:
-		return gzip_open(file, truemode);
+		zfp = gzip_open(file, truemode);
+		break;
 #endif
 #ifndef NO_BZIP2_SUPPORT
 	case COMPRESSOR_BZIP2:
-		return bzip2_open(file, truemode);
+		zfp = bzip2_open(file, truemode);
+		break;
 #endif
 #ifndef NO_XZ_SUPPORT
 	case COMPRESSOR_XZ:
-		return xz_open(file, truemode);
+		zfp = xz_open(file, truemode, flags);
+		break;
 #endif
 	default:
 		log_error("not supported");
 		return NULL;
 	}
+
+	if (zfp){
+		zfp->sink = NULL;
+		zfp->sink_data = NULL;
+		zfp->finished = 0;
+		zfp->parallel = 0;
+		zfp->seekstrm = NULL;
+		zfp->dict = NULL;
+		zfp->head_len = 0;
+		zfp->sniffed = 0;
+	}
+	return zfp;
 }
 
 static int zip_close(struct ZIP_FILE* zfp){
@@ -355,47 +432,36 @@ static int zip_close(struct ZIP_FILE* zfp){
 		}
 	}
 
-	if (fclose(zfp->fp) != 0){
+	if (zfp->fp && fclose(zfp->fp) != 0){
 		log_efclose("file");
 	}
 	free(zfp);
 	return 0;
 }
 
-static int zip_compress_write(FILE* fp_in, struct ZIP_FILE* zfp){
-	unsigned char inbuf[BUFFER_LEN];
+/* runs the compressor until all of the input is consumed, or until the stream ends if finish is set */
+static int zip_stream_code(struct ZIP_FILE* zfp, const unsigned char* in, size_t len, int finish){
 	unsigned char outbuf[BUFFER_LEN];
-	int avail_in = 0;
-	int avail_out = 0;
-	int action;
-	int res = 0;
+	int done = 0;
+	int res;
 
 	switch (zfp->c_type){
 #ifndef NO_GZIP_SUPPORT
 	case COMPRESSOR_GZIP:
-		zfp->strm.zstrm.next_in = NULL;
-		zfp->strm.zstrm.avail_in = 0;
-		zfp->strm.zstrm.next_out = outbuf;
-		zfp->strm.zstrm.avail_out = sizeof(outbuf);
-		action = Z_NO_FLUSH;
+		zfp->strm.zstrm.next_in = (unsigned char*)in;
+		zfp->strm.zstrm.avail_in = len;
 		break;
 #endif
 #ifndef NO_BZIP2_SUPPORT
 	case COMPRESSOR_BZIP2:
-		zfp->strm.bzstrm.next_in = NULL;
-		zfp->strm.bzstrm.avail_in = 0;
-		zfp->strm.bzstrm.next_out = (char*)outbuf;
-		zfp->strm.bzstrm.avail_out = sizeof(outbuf);
-		action = BZ_RUN;
+		zfp->strm.bzstrm.next_in = (char*)in;
+		zfp->strm.bzstrm.avail_in = len;
 		break;
 #endif
 #ifndef NO_XZ_SUPPORT
 	case COMPRESSOR_XZ:
-		zfp->strm.xzstrm.next_in = NULL;
-		zfp->strm.xzstrm.avail_in = 0;
-		zfp->strm.xzstrm.next_out = outbuf;
-		zfp->strm.xzstrm.avail_out = sizeof(outbuf);
-		action = LZMA_RUN;
+		zfp->strm.xzstrm.next_in = in;
+		zfp->strm.xzstrm.avail_in = len;
 		break;
 #endif
 	default:
@@ -403,76 +469,49 @@ static int zip_compress_write(FILE* fp_in, struct ZIP_FILE* zfp){
 		return -1;
 	}
 
-	do{
+	while (!done){
 		size_t write_len;
 
-		avail_in = read_file(fp_in, inbuf, sizeof(inbuf));
-		if (avail_in == 0 || feof(fp_in)){
-			switch (zfp->c_type){
-#ifndef NO_GZIP_SUPPORT
-			case COMPRESSOR_GZIP:
-				action = Z_FINISH;
-				break;
-#endif
-#ifndef NO_BZIP2_SUPPORT
-			case COMPRESSOR_BZIP2:
-				if (res == BZ_STREAM_END){
-					return 0;
-				}
-				action = BZ_FINISH;
-				break;
-#endif
-#ifndef NO_XZ_SUPPORT
-			case COMPRESSOR_XZ:
-				action = LZMA_FINISH;
-				break;
-#endif
-			default:
-				;
-			}
-		}
-
 		switch (zfp->c_type){
 #ifndef NO_GZIP_SUPPORT
 		case COMPRESSOR_GZIP:
-			zfp->strm.zstrm.next_in = inbuf;
-			zfp->strm.zstrm.avail_in = avail_in;
 			zfp->strm.zstrm.next_out = outbuf;
 			zfp->strm.zstrm.avail_out = sizeof(outbuf);
-			res = deflate(&(zfp->strm.zstrm), action);
-			if (res != Z_OK && res != Z_STREAM_END){
+			res = deflate(&(zfp->strm.zstrm), finish ? Z_FINISH : Z_NO_FLUSH);
+			/* Z_BUF_ERROR only means no progress was possible */
+			if (res != Z_OK && res != Z_STREAM_END && res != Z_BUF_ERROR){
 				log_error_ex("gzip write error (%d)", res);
 				return -1;
 			}
-			avail_out = zfp->strm.zstrm.avail_out;
+			write_len = sizeof(outbuf) - zfp->strm.zstrm.avail_out;
+			done = finish ? res == Z_STREAM_END : (zfp->strm.zstrm.avail_in == 0 && zfp->strm.zstrm.avail_out != 0);
 			break;
 #endif
 #ifndef NO_BZIP2_SUPPORT
 		case COMPRESSOR_BZIP2:
-			zfp->strm.bzstrm.next_in = (char*)inbuf;
-			zfp->strm.bzstrm.avail_in = avail_in;
 			zfp->strm.bzstrm.next_out = (char*)outbuf;
 			zfp->strm.bzstrm.avail_out = sizeof(outbuf);
-			res = BZ2_bzCompress(&(zfp->strm.bzstrm), action);
-			if (res != BZ_OK && res != BZ_RUN_OK && res != BZ_FLUSH_OK && res != BZ_FINISH_OK && res != BZ_STREAM_END){
+			res = BZ2_bzCompress(&(zfp->strm.bzstrm), finish ? BZ_FINISH : BZ_RUN);
+			if (res != BZ_RUN_OK && res != BZ_FINISH_OK && res != BZ_STREAM_END){
 				log_error_ex("bzip2 write error (%d)", res);
 				return -1;
 			}
-			avail_out = zfp->strm.bzstrm.avail_out;
+			write_len = sizeof(outbuf) - zfp->strm.bzstrm.avail_out;
+			done = finish ? res == BZ_STREAM_END : zfp->strm.bzstrm.avail_in == 0;
 			break;
 #endif
 #ifndef NO_XZ_SUPPORT
 		case COMPRESSOR_XZ:
-			zfp->strm.xzstrm.next_in = inbuf;
-			zfp->strm.xzstrm.avail_in = avail_in;
 			zfp->strm.xzstrm.next_out = outbuf;
 			zfp->strm.xzstrm.avail_out = sizeof(outbuf);
-			res = lzma_code(&(zfp->strm.xzstrm), action);
-			if (res != LZMA_OK && res != LZMA_STREAM_END){
+			res = lzma_code(&(zfp->strm.xzstrm), finish ? LZMA_FINISH : LZMA_RUN);
+			/* LZMA_BUF_ERROR only means no progress was possible */
+			if (res != LZMA_OK && res != LZMA_STREAM_END && res != LZMA_BUF_ERROR){
 				log_error_ex("xz write error (%d)", res);
 				return -1;
 			}
-			avail_out = zfp->strm.xzstrm.avail_out;
+			write_len = sizeof(outbuf) - zfp->strm.xzstrm.avail_out;
+			done = finish ? res == LZMA_STREAM_END : (zfp->strm.xzstrm.avail_in == 0 && zfp->strm.xzstrm.avail_out != 0);
 			break;
 #endif
 		default:
@@ -480,23 +519,110 @@ static int zip_compress_write(FILE* fp_in, struct ZIP_FILE* zfp){
 			return -1;
 		}
 
-		write_len = sizeof(outbuf) - avail_out;
-		if (fwrite(outbuf, 1, write_len, zfp->fp) != write_len){
-			log_efwrite("file");
+		if (write_len > 0 && zfp->sink(outbuf, write_len, zfp->sink_data) != 0){
+			log_error("Failed to write compressed data");
 			return -1;
 		}
-	}while (avail_in != 0);
+	}
+	return 0;
+}
+
+int zip_fp_sink(const void* data, size_t len, void* fp){
+	if (fwrite(data, 1, len, fp) != len){
+		log_efwrite("file");
+		return -1;
+	}
 	return 0;
 }
 
+/* a file goes through the same loop as a stream, which keeps the compressor going until each piece of input is used up */
+static int zip_compress_write(FILE* fp_in, struct ZIP_FILE* zfp){
+	unsigned char inbuf[BUFFER_LEN];
+	size_t len;
+
+	zfp->sink = zip_fp_sink;
+	zfp->sink_data = zfp->fp;
+
+	while ((len = read_file(fp_in, inbuf, sizeof(inbuf))) > 0){
+		if (zip_stream_code(zfp, inbuf, len, 0) != 0){
+			return -1;
+		}
+	}
+	if (ferror(fp_in)){
+		log_efread("input file");
+		return -1;
+	}
+	return zip_stream_code(zfp, NULL, 0, 1);
+}
+
+#ifndef NO_LZ4_SUPPORT
+/* for compressors that only have a stream to split the work up with */
+static int zip_file_stream(const char* infile, const char* outfile, int write, enum compressor c_type, int compression_level, unsigned flags){
+	FILE* fp_in = NULL;
+	FILE* fp_out = NULL;
+	int ret = 0;
+
+	fp_in = fopen(infile, "rb");
+	if (!fp_in){
+		log_efopen(infile);
+		ret = -1;
+		goto cleanup;
+	}
+	fp_out = fopen(outfile, "wb");
+	if (!fp_out){
+		log_efopen(outfile);
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (write){
+		ret = zip_compress_stream(c_type, compression_level, flags, zip_fp_source, fp_in, zip_fp_sink, fp_out);
+	}
+	else{
+		ret = zip_decompress_stream(c_type, flags, zip_fp_source, fp_in, zip_fp_sink, fp_out);
+	}
+
+cleanup:
+	fp_in ? fclose(fp_in) : 0;
+	if (fp_out && fclose(fp_out) != 0){
+		log_efclose(outfile);
+		ret = -1;
+	}
+	if (ret != 0 && fp_out){
+		remove(outfile);
+	}
+	return ret;
+}
+#endif
+
 int zip_compress(const char* infile, const char* outfile, enum compressor c_type, int compression_level, unsigned flags){
 	struct ZIP_FILE* zfp = NULL;
 	FILE* fp_in = NULL;
 	int ret = 0;
 
+#ifndef NO_LZ4_SUPPORT
+	if (c_type == COMPRESSOR_LZ4 && ZIP_GET_WORKERS(flags) > 1){
+		return zip_file_stream(infile, outfile, 1, c_type, compression_level, flags);
+	}
+#endif
 	if (c_type == COMPRESSOR_LZ4){
 		return lz4_compress(infile, outfile, compression_level, flags);
 	}
+#ifndef NO_ZSTD_SUPPORT
+	if (c_type == COMPRESSOR_ZSTD){
+		return zstd_compress(infile, outfile, compression_level, flags);
+	}
+#endif
+#ifndef NO_GZIP_SUPPORT
+	if (c_type == COMPRESSOR_GZIP && ZIP_GET_WORKERS(flags) > 1){
+		return pgzip_compress(infile, outfile, compression_level, flags);
+	}
+#endif
+#ifndef NO_BZIP2_SUPPORT
+	if (c_type == COMPRESSOR_BZIP2 && ZIP_GET_WORKERS(flags) > 1){
+		return zip_file_stream(infile, outfile, 1, c_type, compression_level, flags);
+	}
+#endif
 
 	if (c_type == COMPRESSOR_NONE){
 		return copy_file(infile, outfile);
@@ -535,105 +661,1190 @@ cleanup:
 	return ret;
 }
 
-static int zip_decompress_read(struct ZIP_FILE* zfp, FILE* fp_out){
-	unsigned char inbuf[BUFFER_LEN];
-	unsigned char outbuf[BUFFER_LEN];
-	int avail_in = 0;
-	int avail_out = 0;
-	int action;
-	size_t write_len = 0;
-	int res = 0;
-	int res_stream_end = 0;
+static void zip_stream_destroy(struct ZIP_FILE* zfp){
+	if (!zfp){
+		return;
+	}
+	/* a seekable compression stream only has a stream of its own for each block */
+	if (zfp->seekstrm){
+		seek_stream_free(zfp->seekstrm);
+		zfp->seekstrm = NULL;
+		if (zfp->write){
+			free(zfp);
+			return;
+		}
+	}
 
 	switch (zfp->c_type){
-#ifndef NO_GZIP_SUPPORT
-	case COMPRESSOR_GZIP:
-		res_stream_end = Z_STREAM_END;
-		zfp->strm.zstrm.next_in = NULL;
-		zfp->strm.zstrm.avail_in = 0;
-		zfp->strm.zstrm.next_out = outbuf;
-		zfp->strm.zstrm.avail_out = sizeof(outbuf);
-		action = Z_NO_FLUSH;
+	case COMPRESSOR_NONE:
+		free(zfp);
 		break;
-#endif
-#ifndef NO_BZIP2_SUPPORT
-	case COMPRESSOR_BZIP2:
-		res_stream_end = BZ_STREAM_END;
-		zfp->strm.bzstrm.next_in = NULL;
-		zfp->strm.bzstrm.avail_in = 0;
-		zfp->strm.bzstrm.next_out = (char*)outbuf;
-		zfp->strm.bzstrm.avail_out = sizeof(outbuf);
-		action = BZ_RUN;
+#ifndef NO_LZ4_SUPPORT
+	case COMPRESSOR_LZ4:
+		if (zfp->parallel){
+			plz4_stream_free(zfp->strm.plz4strm);
+		}
+		else{
+			lz4_stream_free(zfp->strm.lz4strm);
+		}
+		free(zfp);
 		break;
 #endif
-#ifndef NO_XZ_SUPPORT
-	case COMPRESSOR_XZ:
-		res_stream_end = LZMA_STREAM_END;
-		zfp->strm.xzstrm.next_in = NULL;
-		zfp->strm.xzstrm.avail_in = 0;
-		zfp->strm.xzstrm.next_out = outbuf;
-		zfp->strm.xzstrm.avail_out = sizeof(outbuf);
-		action = LZMA_RUN;
+#ifndef NO_ZSTD_SUPPORT
+	case COMPRESSOR_ZSTD:
+		zstd_stream_free(zfp->strm.zstdstrm);
+		free(zfp);
 		break;
 #endif
 	default:
-		log_error("unsupported");
-		return -1;
-	}
-
-	do{
-		if (avail_in == 0){
-			avail_in = read_file(zfp->fp, inbuf, sizeof(inbuf));
-			if (avail_in == 0 || feof(zfp->fp)){
-				switch (zfp->c_type){
 #ifndef NO_GZIP_SUPPORT
-				case COMPRESSOR_GZIP:
-					action = Z_FINISH;
-					break;
+		if (zfp->parallel && zfp->c_type == COMPRESSOR_GZIP){
+			pgzip_stream_free(zfp->strm.pgzstrm);
+			free(zfp);
+			break;
+		}
 #endif
 #ifndef NO_BZIP2_SUPPORT
-				case COMPRESSOR_BZIP2:
-					action = BZ_FINISH;
-					break;
+		if (zfp->parallel && zfp->c_type == COMPRESSOR_BZIP2){
+			pbzip2_stream_free(zfp->strm.pbz2strm);
+			free(zfp);
+			break;
+		}
+#endif
+		zip_close(zfp);
+	}
+}
+
+/* the last compression stream each thread finished, kept for the next zip_stream_new() with the same settings
+ * starting a stream can cost more than compressing a small file, especially xz's match finder or a parallel gzip stream's threads */
+static pthread_key_t stream_cache_key;
+static pthread_once_t stream_cache_once = PTHREAD_ONCE_INIT;
+static int stream_cache_ok = 0;
+
+/* runs when a thread exits */
+static void stream_cache_destroy(void* zfp){
+	zip_stream_destroy(zfp);
+}
+
+static void stream_cache_create(void){
+	stream_cache_ok = pthread_key_create(&stream_cache_key, stream_cache_destroy) == 0;
+}
+
+static int stream_cache_init(void){
+	pthread_once(&stream_cache_once, stream_cache_create);
+	return stream_cache_ok ? 0 : -1;
+}
+
+/* serial bzip2 has no way to start over without freeing everything, and there is nothing to save for COMPRESSOR_NONE */
+static int zip_stream_reusable(const struct ZIP_FILE* zfp){
+	if (!zfp->write || !zfp->finished || zfp->fp || zfp->seekstrm){
+		return 0;
+	}
+	switch (zfp->c_type){
+#ifndef NO_GZIP_SUPPORT
+	case COMPRESSOR_GZIP:
 #endif
 #ifndef NO_XZ_SUPPORT
-				case COMPRESSOR_XZ:
-					action = LZMA_FINISH;
-					break;
+	case COMPRESSOR_XZ:
 #endif
-				default:
-					;
-				}
-			}
+#ifndef NO_LZ4_SUPPORT
+	case COMPRESSOR_LZ4:
+#endif
+#ifndef NO_ZSTD_SUPPORT
+	case COMPRESSOR_ZSTD:
+#endif
+		return 1;
+#ifndef NO_BZIP2_SUPPORT
+	case COMPRESSOR_BZIP2:
+		return zfp->parallel;
+#endif
+	default:
+		return 0;
+	}
+}
 
-			switch (zfp->c_type){
+/* takes this thread's cached stream if it was started with the same settings, and gets it ready for another file */
+static struct ZIP_FILE* zip_stream_reuse(enum compressor c_type, int compression_level, unsigned flags){
+	struct ZIP_FILE* zfp;
+	int res = -1;
+
+	if (stream_cache_init() != 0 || !(zfp = pthread_getspecific(stream_cache_key))){
+		return NULL;
+	}
+	if (zfp->c_type != c_type || zfp->level != compression_level || zfp->flags != flags){
+		return NULL;
+	}
+	pthread_setspecific(stream_cache_key, NULL);
+
+	switch (c_type){
 #ifndef NO_GZIP_SUPPORT
-			case COMPRESSOR_GZIP:
-				zfp->strm.zstrm.next_in = inbuf;
-				zfp->strm.zstrm.avail_in = avail_in;
-				break;
+	case COMPRESSOR_GZIP:
+		if (zfp->parallel){
+			pgzip_stream_reset(zfp->strm.pgzstrm);
+			res = 0;
+		}
+		else{
+			res = deflateReset(&(zfp->strm.zstrm)) == Z_OK ? 0 : -1;
+		}
+		break;
 #endif
 #ifndef NO_BZIP2_SUPPORT
-			case COMPRESSOR_BZIP2:
-				zfp->strm.bzstrm.next_in = (char*)inbuf;
-				zfp->strm.bzstrm.avail_in = avail_in;
-				break;
+	case COMPRESSOR_BZIP2:
+		pbzip2_stream_reset(zfp->strm.pbz2strm);
+		res = 0;
+		break;
 #endif
 #ifndef NO_XZ_SUPPORT
-			case COMPRESSOR_XZ:
-				zfp->strm.xzstrm.next_in = inbuf;
-				zfp->strm.xzstrm.avail_in = avail_in;
-				break;
-#endif
-			default:
-				log_fatal("unsupported");
-				return -1;
-			}
-		}
+	case COMPRESSOR_XZ:{
+		/* the same preset xz_open() picks */
+		uint32_t preset = compression_level >= 1 && compression_level <= 9 ? (uint32_t)compression_level : 3;
 
-		switch (zfp->c_type){
-#ifndef NO_GZIP_SUPPORT
-		case COMPRESSOR_GZIP:
+		if (flags & XZ_EXTREME){
+			preset |= LZMA_PRESET_EXTREME;
+		}
+		res = xz_encoder(&(zfp->strm.xzstrm), preset, flags) == LZMA_OK ? 0 : -1;
+		break;
+	}
+#endif
+#ifndef NO_LZ4_SUPPORT
+	case COMPRESSOR_LZ4:
+		if (zfp->parallel){
+			plz4_stream_reset(zfp->strm.plz4strm);
+		}
+		else{
+			lz4_stream_reset(zfp->strm.lz4strm);
+		}
+		res = 0;
+		break;
+#endif
+#ifndef NO_ZSTD_SUPPORT
+	case COMPRESSOR_ZSTD:
+		res = zstd_stream_reset(zfp->strm.zstdstrm);
+		break;
+#endif
+	default:
+		;
+	}
+
+	if (res != 0){
+		log_debug("Failed to reset a cached compression stream. Starting a new one instead.");
+		zip_stream_destroy(zfp);
+		return NULL;
+	}
+	zfp->finished = 0;
+	return zfp;
+}
+
+struct ZIP_FILE* zip_stream_new(enum compressor c_type, int compression_level, unsigned flags, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	struct ZIP_FILE* zfp = NULL;
+
+	return_ifnull(sink, NULL);
+
+	/* each block gets a stream of its own, which is where the other flags go */
+	if (ZIP_GET_SEEKABLE_MIB(flags) > 0 && c_type != COMPRESSOR_NONE){
+		zfp = calloc(1, sizeof(*zfp));
+		if (!zfp){
+			log_enomem();
+			return NULL;
+		}
+		zfp->c_type = c_type;
+		zfp->write = 1;
+		if (!(zfp->seekstrm = seek_stream_new(c_type, compression_level, flags))){
+			free(zfp);
+			return NULL;
+		}
+		zfp->sink = sink;
+		zfp->sink_data = sink_data;
+		zfp->level = compression_level;
+		zfp->flags = flags;
+		return zfp;
+	}
+
+	if ((zfp = zip_stream_reuse(c_type, compression_level, flags)) != NULL){
+		zfp->sink = sink;
+		zfp->sink_data = sink_data;
+		return zfp;
+	}
+
+	switch (c_type){
+#ifndef NO_LZ4_SUPPORT
+	case COMPRESSOR_LZ4:
+#endif
+#ifndef NO_ZSTD_SUPPORT
+	case COMPRESSOR_ZSTD:
+#endif
+	case COMPRESSOR_NONE:
+		zfp = calloc(1, sizeof(*zfp));
+		if (!zfp){
+			log_enomem();
+			return NULL;
+		}
+		zfp->c_type = c_type;
+		zfp->write = 1;
+#ifndef NO_LZ4_SUPPORT
+		/* independent blocks cost a little compression, so only when there is more than one thread to give them to */
+		if (c_type == COMPRESSOR_LZ4 && ZIP_GET_WORKERS(flags) > 1){
+			zfp->parallel = 1;
+			if (!(zfp->strm.plz4strm = plz4_stream_new(compression_level, flags))){
+				log_error("Failed to start parallel lz4 stream");
+				free(zfp);
+				return NULL;
+			}
+		}
+		else if (c_type == COMPRESSOR_LZ4 && !(zfp->strm.lz4strm = lz4_stream_new(compression_level))){
+			log_error("Failed to start lz4 stream");
+			free(zfp);
+			return NULL;
+		}
+#endif
+#ifndef NO_ZSTD_SUPPORT
+		if (c_type == COMPRESSOR_ZSTD && !(zfp->strm.zstdstrm = zstd_stream_new(compression_level, flags))){
+			log_error("Failed to start zstd stream");
+			free(zfp);
+			return NULL;
+		}
+#endif
+		break;
+	default:
+#ifndef NO_GZIP_SUPPORT
+		if (c_type == COMPRESSOR_GZIP && ZIP_GET_WORKERS(flags) > 1){
+			zfp = calloc(1, sizeof(*zfp));
+			if (!zfp){
+				log_enomem();
+				return NULL;
+			}
+			zfp->c_type = c_type;
+			zfp->write = 1;
+			zfp->parallel = 1;
+			if (!(zfp->strm.pgzstrm = pgzip_stream_new(compression_level, flags))){
+				log_error("Failed to start parallel gzip stream");
+				free(zfp);
+				return NULL;
+			}
+			break;
+		}
+#endif
+#ifndef NO_BZIP2_SUPPORT
+		if (c_type == COMPRESSOR_BZIP2 && ZIP_GET_WORKERS(flags) > 1){
+			zfp = calloc(1, sizeof(*zfp));
+			if (!zfp){
+				log_enomem();
+				return NULL;
+			}
+			zfp->c_type = c_type;
+			zfp->write = 1;
+			zfp->parallel = 1;
+			if (!(zfp->strm.pbz2strm = pbzip2_stream_new(compression_level, flags))){
+				log_error("Failed to start parallel bzip2 stream");
+				free(zfp);
+				return NULL;
+			}
+			break;
+		}
+#endif
+		zfp = zip_open(NULL, 1, c_type, compression_level == 0 ? -1 : compression_level, flags);
+		if (!zfp){
+			log_error("Failed to start compression stream");
+			return NULL;
+		}
+	}
+
+	zfp->sink = sink;
+	zfp->sink_data = sink_data;
+	zfp->level = compression_level;
+	zfp->flags = flags;
+	return zfp;
+}
+
+struct ZIP_FILE* zip_decompress_stream_new(enum compressor c_type, unsigned flags, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	struct ZIP_FILE* zfp = NULL;
+
+	return_ifnull(sink, NULL);
+
+	switch (c_type){
+#ifndef NO_LZ4_SUPPORT
+	case COMPRESSOR_LZ4:
+#endif
+#ifndef NO_ZSTD_SUPPORT
+	case COMPRESSOR_ZSTD:
+#endif
+	case COMPRESSOR_NONE:
+		zfp = calloc(1, sizeof(*zfp));
+		if (!zfp){
+			log_enomem();
+			return NULL;
+		}
+		zfp->c_type = c_type;
+		zfp->write = 0;
+#ifndef NO_LZ4_SUPPORT
+		if (c_type == COMPRESSOR_LZ4 && ZIP_GET_WORKERS(flags) > 1){
+			zfp->parallel = 1;
+			if (!(zfp->strm.plz4strm = plz4_decompress_stream_new(flags))){
+				log_error("Failed to start parallel lz4 stream");
+				free(zfp);
+				return NULL;
+			}
+		}
+		else if (c_type == COMPRESSOR_LZ4 && !(zfp->strm.lz4strm = lz4_decompress_stream_new())){
+			log_error("Failed to start lz4 stream");
+			free(zfp);
+			return NULL;
+		}
+#endif
+#ifndef NO_ZSTD_SUPPORT
+		if (c_type == COMPRESSOR_ZSTD && !(zfp->strm.zstdstrm = zstd_decompress_stream_new())){
+			log_error("Failed to start zstd stream");
+			free(zfp);
+			return NULL;
+		}
+#endif
+		break;
+	default:
+#ifndef NO_BZIP2_SUPPORT
+		/* blocks are found by their magic numbers, so no extra framing is needed to split the work */
+		if (c_type == COMPRESSOR_BZIP2 && ZIP_GET_WORKERS(flags) > 1){
+			zfp = calloc(1, sizeof(*zfp));
+			if (!zfp){
+				log_enomem();
+				return NULL;
+			}
+			zfp->c_type = c_type;
+			zfp->write = 0;
+			zfp->parallel = 1;
+			if (!(zfp->strm.pbz2strm = pbzip2_decompress_stream_new(flags))){
+				log_error("Failed to start parallel bzip2 stream");
+				free(zfp);
+				return NULL;
+			}
+			break;
+		}
+#endif
+		zfp = zip_open(NULL, 0, c_type, 0, flags);
+		if (!zfp){
+			log_error("Failed to start decompression stream");
+			return NULL;
+		}
+	}
+
+	zfp->sink = sink;
+	zfp->sink_data = sink_data;
+	zfp->flags = flags;
+	/* nothing is compressed in the seekable layout without a compressor */
+	zfp->sniffed = c_type == COMPRESSOR_NONE;
+	return zfp;
+}
+
+/* runs the decompressor until all of the input is consumed, or until the compressed data ends */
+static int zip_stream_decode(struct ZIP_FILE* zfp, const unsigned char* in, size_t len){
+	unsigned char outbuf[BUFFER_LEN];
+	int res;
+
+	switch (zfp->c_type){
+#ifndef NO_GZIP_SUPPORT
+	case COMPRESSOR_GZIP:
+		zfp->strm.zstrm.next_in = (unsigned char*)in;
+		zfp->strm.zstrm.avail_in = len;
+		break;
+#endif
+#ifndef NO_BZIP2_SUPPORT
+	case COMPRESSOR_BZIP2:
+		zfp->strm.bzstrm.next_in = (char*)in;
+		zfp->strm.bzstrm.avail_in = len;
+		break;
+#endif
+#ifndef NO_XZ_SUPPORT
+	case COMPRESSOR_XZ:
+		zfp->strm.xzstrm.next_in = in;
+		zfp->strm.xzstrm.avail_in = len;
+		break;
+#endif
+	default:
+		log_error("unsupported");
+		return -1;
+	}
+
+	/* anything after the end of the compressed data is ignored, like zip_decompress() does */
+	while (!zfp->finished){
+		size_t write_len;
+		int starved;
+
+		switch (zfp->c_type){
+#ifndef NO_GZIP_SUPPORT
+		case COMPRESSOR_GZIP:
+			zfp->strm.zstrm.next_out = outbuf;
+			zfp->strm.zstrm.avail_out = sizeof(outbuf);
+			res = inflate(&(zfp->strm.zstrm), Z_NO_FLUSH);
+			/* Z_BUF_ERROR only means no progress was possible */
+			if (res != Z_OK && res != Z_STREAM_END && res != Z_BUF_ERROR){
+				log_error_ex("gzip read error (%d)", res);
+				return -1;
+			}
+			zfp->finished = res == Z_STREAM_END;
+			write_len = sizeof(outbuf) - zfp->strm.zstrm.avail_out;
+			starved = zfp->strm.zstrm.avail_in == 0 && zfp->strm.zstrm.avail_out != 0;
+			break;
+#endif
+#ifndef NO_BZIP2_SUPPORT
+		case COMPRESSOR_BZIP2:
+			zfp->strm.bzstrm.next_out = (char*)outbuf;
+			zfp->strm.bzstrm.avail_out = sizeof(outbuf);
+			res = BZ2_bzDecompress(&(zfp->strm.bzstrm));
+			if (res != BZ_OK && res != BZ_STREAM_END){
+				log_error_ex("bzip2 read error (%d)", res);
+				return -1;
+			}
+			zfp->finished = res == BZ_STREAM_END;
+			write_len = sizeof(outbuf) - zfp->strm.bzstrm.avail_out;
+			starved = zfp->strm.bzstrm.avail_in == 0 && zfp->strm.bzstrm.avail_out != 0;
+			break;
+#endif
+#ifndef NO_XZ_SUPPORT
+		case COMPRESSOR_XZ:
+			zfp->strm.xzstrm.next_out = outbuf;
+			zfp->strm.xzstrm.avail_out = sizeof(outbuf);
+			res = lzma_code(&(zfp->strm.xzstrm), LZMA_RUN);
+			/* LZMA_BUF_ERROR only means no progress was possible */
+			if (res != LZMA_OK && res != LZMA_STREAM_END && res != LZMA_BUF_ERROR){
+				log_error_ex("xz read error (%d)", res);
+				return -1;
+			}
+			zfp->finished = res == LZMA_STREAM_END;
+			write_len = sizeof(outbuf) - zfp->strm.xzstrm.avail_out;
+			starved = zfp->strm.xzstrm.avail_in == 0 && zfp->strm.xzstrm.avail_out != 0;
+			break;
+#endif
+		default:
+			log_fatal("unsupported");
+			return -1;
+		}
+
+		if (write_len > 0 && zfp->sink(outbuf, write_len, zfp->sink_data) != 0){
+			log_error("Failed to write decompressed data");
+			return -1;
+		}
+		if (starved){
+			break;
+		}
+	}
+	return 0;
+}
+
+/* once the start of a decompression stream's data is in, starts reading the seekable layout if that is what it is, then passes on what was held back */
+static int zip_stream_sniffed(struct ZIP_FILE* zfp){
+	zfp->sniffed = 1;
+	if (zfp->head_len == SEEK_MAGIC_LEN && memcmp(zfp->head, SEEK_MAGIC, SEEK_MAGIC_LEN) == 0){
+		if (!(zfp->seekstrm = seek_decompress_stream_new(zfp->c_type, zfp->flags))){
+			return -1;
+		}
+		if (zfp->dict){
+			seek_stream_use_dict(zfp->seekstrm, zfp->dict);
+		}
+	}
+	return zfp->head_len > 0 ? zip_stream_write(zfp, zfp->head, zfp->head_len) : 0;
+}
+
+static int zip_stream_sniff(struct ZIP_FILE* zfp, const unsigned char* data, size_t len){
+	size_t n = SEEK_MAGIC_LEN - zfp->head_len;
+
+	if (n > len){
+		n = len;
+	}
+	memcpy(zfp->head + zfp->head_len, data, n);
+	zfp->head_len += n;
+	if (zfp->head_len < SEEK_MAGIC_LEN){
+		return 0;
+	}
+	if (zip_stream_sniffed(zfp) != 0){
+		return -1;
+	}
+	return len > n ? zip_stream_write(zfp, data + n, len - n) : 0;
+}
+
+int zip_stream_write(struct ZIP_FILE* zfp, const void* data, size_t len){
+	return_ifnull(zfp, -1);
+	return_ifnull(zfp->sink, -1);
+
+	if (len == 0){
+		return 0;
+	}
+	if (zfp->seekstrm){
+		return zfp->write ? seek_stream_write(zfp->seekstrm, data, len, zfp->sink, zfp->sink_data) : seek_decompress_stream_write(zfp->seekstrm, data, len, zfp->sink, zfp->sink_data);
+	}
+	if (!zfp->write && !zfp->sniffed){
+		return zip_stream_sniff(zfp, data, len);
+	}
+
+	switch (zfp->c_type){
+	case COMPRESSOR_NONE:
+		return zfp->sink(data, len, zfp->sink_data) == 0 ? 0 : -1;
+#ifndef NO_LZ4_SUPPORT
+	case COMPRESSOR_LZ4:
+		if (zfp->parallel){
+			return zfp->write ? plz4_stream_write(zfp->strm.plz4strm, data, len, zfp->sink, zfp->sink_data) : plz4_decompress_stream_write(zfp->strm.plz4strm, data, len, zfp->sink, zfp->sink_data);
+		}
+		if (!zfp->write){
+			return lz4_decompress_stream_write(zfp->strm.lz4strm, data, len, zfp->sink, zfp->sink_data);
+		}
+		return lz4_stream_write(zfp->strm.lz4strm, data, len, zfp->sink, zfp->sink_data);
+#endif
+#ifndef NO_ZSTD_SUPPORT
+	case COMPRESSOR_ZSTD:
+		if (!zfp->write){
+			return zstd_decompress_stream_write(zfp->strm.zstdstrm, data, len, zfp->sink, zfp->sink_data);
+		}
+		return zstd_stream_write(zfp->strm.zstdstrm, data, len, zfp->sink, zfp->sink_data);
+#endif
+	default:
+#ifndef NO_BZIP2_SUPPORT
+		if (zfp->parallel && zfp->c_type == COMPRESSOR_BZIP2){
+			return zfp->write ? pbzip2_stream_write(zfp->strm.pbz2strm, data, len, zfp->sink, zfp->sink_data) : pbzip2_decompress_stream_write(zfp->strm.pbz2strm, data, len, zfp->sink, zfp->sink_data);
+		}
+#endif
+		if (!zfp->write){
+			return zip_stream_decode(zfp, data, len);
+		}
+#ifndef NO_GZIP_SUPPORT
+		if (zfp->parallel){
+			return pgzip_stream_write(zfp->strm.pgzstrm, data, len, zfp->sink, zfp->sink_data);
+		}
+#endif
+		return zip_stream_code(zfp, data, len, 0);
+	}
+}
+
+int zip_stream_finish(struct ZIP_FILE* zfp){
+	int res;
+
+	return_ifnull(zfp, -1);
+	return_ifnull(zfp->sink, -1);
+
+	/* data too short to tell still has to go to the decompressor */
+	if (!zfp->write && !zfp->sniffed && zip_stream_sniffed(zfp) != 0){
+		return -1;
+	}
+	if (zfp->seekstrm){
+		if (!zfp->write){
+			return seek_decompress_stream_end(zfp->seekstrm);
+		}
+		res = seek_stream_end(zfp->seekstrm, zfp->sink, zfp->sink_data);
+		zfp->finished = res == 0;
+		return res;
+	}
+
+	switch (zfp->c_type){
+	case COMPRESSOR_NONE:
+		return 0;
+#ifndef NO_LZ4_SUPPORT
+	case COMPRESSOR_LZ4:
+		if (zfp->parallel){
+			if (!zfp->write){
+				return plz4_decompress_stream_end(zfp->strm.plz4strm);
+			}
+			res = plz4_stream_end(zfp->strm.plz4strm, zfp->sink, zfp->sink_data);
+			break;
+		}
+		if (!zfp->write){
+			return lz4_decompress_stream_end(zfp->strm.lz4strm);
+		}
+		res = lz4_stream_end(zfp->strm.lz4strm, zfp->sink, zfp->sink_data);
+		break;
+#endif
+#ifndef NO_ZSTD_SUPPORT
+	case COMPRESSOR_ZSTD:
+		if (!zfp->write){
+			return zstd_decompress_stream_end(zfp->strm.zstdstrm, zfp->sink, zfp->sink_data);
+		}
+		res = zstd_stream_end(zfp->strm.zstdstrm, zfp->sink, zfp->sink_data);
+		break;
+#endif
+	default:
+#ifndef NO_BZIP2_SUPPORT
+		if (zfp->parallel && zfp->c_type == COMPRESSOR_BZIP2){
+			if (!zfp->write){
+				return pbzip2_decompress_stream_end(zfp->strm.pbz2strm);
+			}
+			res = pbzip2_stream_end(zfp->strm.pbz2strm, zfp->sink, zfp->sink_data);
+			break;
+		}
+#endif
+		if (!zfp->write){
+			if (!zfp->finished){
+				log_error("Compressed data ended unexpectedly");
+				return -1;
+			}
+			return 0;
+		}
+#ifndef NO_GZIP_SUPPORT
+		if (zfp->parallel){
+			res = pgzip_stream_end(zfp->strm.pgzstrm, zfp->sink, zfp->sink_data);
+			break;
+		}
+#endif
+		res = zip_stream_code(zfp, NULL, 0, 1);
+	}
+
+	/* only a stream that ended cleanly can be reset for another file */
+	zfp->finished = res == 0;
+	return res;
+}
+
+void zip_stream_free(struct ZIP_FILE* zfp){
+	struct ZIP_FILE* old;
+
+	if (!zfp){
+		return;
+	}
+	if (!zip_stream_reusable(zfp) || stream_cache_init() != 0){
+		zip_stream_destroy(zfp);
+		return;
+	}
+
+	/* the newest one replaces the old one, since the next file most likely uses the same settings */
+	old = pthread_getspecific(stream_cache_key);
+	if (pthread_setspecific(stream_cache_key, zfp) != 0){
+		zip_stream_destroy(zfp);
+		return;
+	}
+	zip_stream_destroy(old);
+}
+
+/* feeds everything the source has to a stream from zip_stream_new() or zip_decompress_stream_new(), then finishes it */
+static int zip_stream_run(struct ZIP_FILE* zfp, int(*source)(void* buf, size_t len, size_t* out_len, void* source_data), void* source_data){
+	unsigned char buf[BUFFER_LEN];
+	size_t len;
+	int ret = 0;
+
+	while ((ret = source(buf, sizeof(buf), &len, source_data)) == 0 && len > 0){
+		if (zip_stream_write(zfp, buf, len) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+	}
+	if (ret != 0){
+		log_error("Failed to read input");
+		ret = -1;
+		goto cleanup;
+	}
+	if (zip_stream_finish(zfp) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+
+cleanup:
+	zip_stream_free(zfp);
+	return ret;
+}
+
+int zip_compress_stream(enum compressor c_type, int compression_level, unsigned flags, int(*source)(void* buf, size_t len, size_t* out_len, void* source_data), void* source_data, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	struct ZIP_FILE* zfp;
+
+	return_ifnull(source, -1);
+	return_ifnull(sink, -1);
+
+	if (!(zfp = zip_stream_new(c_type, compression_level, flags, sink, sink_data))){
+		return -1;
+	}
+	return zip_stream_run(zfp, source, source_data);
+}
+
+int zip_decompress_stream(enum compressor c_type, unsigned flags, int(*source)(void* buf, size_t len, size_t* out_len, void* source_data), void* source_data, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	struct ZIP_FILE* zfp;
+
+	return_ifnull(source, -1);
+	return_ifnull(sink, -1);
+
+	if (!(zfp = zip_decompress_stream_new(c_type, flags, sink, sink_data))){
+		return -1;
+	}
+	return zip_stream_run(zfp, source, source_data);
+}
+
+int zip_fp_source(void* buf, size_t len, size_t* out_len, void* fp){
+	*out_len = fread(buf, 1, len, fp);
+	if (ferror((FILE*)fp)){
+		log_efread("input");
+		return -1;
+	}
+	return 0;
+}
+
+int zip_fd_source(void* buf, size_t len, size_t* out_len, void* fd){
+	ssize_t res;
+
+	do{
+		res = read(*(int*)fd, buf, len);
+	}while (res < 0 && errno == EINTR);
+	if (res < 0){
+		log_error_ex("Failed to read input (%s)", strerror(errno));
+		return -1;
+	}
+	*out_len = res;
+	return 0;
+}
+
+int zip_fd_sink(const void* data, size_t len, void* fd){
+	const unsigned char* ptr = data;
+
+	while (len > 0){
+		ssize_t res = write(*(int*)fd, ptr, len);
+
+		if (res < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			log_error_ex("Failed to write output (%s)", strerror(errno));
+			return -1;
+		}
+		ptr += res;
+		len -= res;
+	}
+	return 0;
+}
+
+int zip_buffer_source(void* buf, size_t len, size_t* out_len, void* zb){
+	struct zip_buffer* b = zb;
+
+	*out_len = b->len - b->pos < len ? b->len - b->pos : len;
+	if (*out_len > 0){
+		memcpy(buf, b->data + b->pos, *out_len);
+		b->pos += *out_len;
+	}
+	return 0;
+}
+
+int zip_buffer_sink(const void* data, size_t len, void* zb){
+	struct zip_buffer* b = zb;
+
+	if (len == 0){
+		return 0;
+	}
+	if (len > b->size - b->len){
+		size_t size = b->size > 0 ? b->size : BUFFER_LEN;
+		unsigned char* tmp;
+
+		while (size - b->len < len){
+			size *= 2;
+		}
+		tmp = realloc(b->data, size);
+		if (!tmp){
+			log_enomem();
+			return -1;
+		}
+		b->data = tmp;
+		b->size = size;
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+	return 0;
+}
+
+int zip_has_magic(enum compressor c_type, const void* data, size_t len){
+	const char* magic;
+	size_t magic_len;
+
+	switch (c_type){
+#ifndef NO_GZIP_SUPPORT
+	case COMPRESSOR_GZIP:
+		/* both gzip_open() and the parallel compressor only ever write deflate */
+		magic = "\x1F\x8B\x08";
+		magic_len = 3;
+		break;
+#endif
+#ifndef NO_BZIP2_SUPPORT
+	case COMPRESSOR_BZIP2:
+		magic = "BZh";
+		magic_len = 3;
+		break;
+#endif
+#ifndef NO_XZ_SUPPORT
+	case COMPRESSOR_XZ:
+		magic = "\xFD" "7zXZ\0";
+		magic_len = 6;
+		break;
+#endif
+#ifndef NO_LZ4_SUPPORT
+	case COMPRESSOR_LZ4:
+		magic = "\x04\x22\x4D\x18";
+		magic_len = 4;
+		break;
+#endif
+#ifndef NO_ZSTD_SUPPORT
+	case COMPRESSOR_ZSTD:
+		magic = "\x28\xB5\x2F\xFD";
+		magic_len = 4;
+		break;
+#endif
+	default:
+		return 1;
+	}
+
+	/* anything that could still turn out to be the magic number counts as it, and so does the seekable layout's */
+	return memcmp(data, magic, len < magic_len ? len : magic_len) == 0 ||
+		memcmp(data, SEEK_MAGIC, len < SEEK_MAGIC_LEN ? len : SEEK_MAGIC_LEN) == 0;
+}
+
+/* formats that are already compressed, so the probe does not have to look at them */
+static const char* const incompressible_extensions[] = {
+	".7z", ".avi", ".bz2", ".docx", ".flac", ".gif", ".gz", ".heic", ".jpeg", ".jpg", ".lz4", ".mkv", ".mov", ".mp3", ".mp4",
+	".odt", ".ogg", ".opus", ".png", ".rar", ".tbz", ".tgz", ".txz", ".webm", ".webp", ".xlsx", ".xz", ".zip", ".zst"
+};
+
+int zip_incompressible_name(const char* file){
+	const char* ext;
+	size_t i;
+
+	return_ifnull(file, 0);
+
+	ext = strrchr(file, '.');
+	if (!ext || strchr(ext, '/')){
+		return 0;
+	}
+	for (i = 0; i < sizeof(incompressible_extensions) / sizeof(incompressible_extensions[0]); ++i){
+		if (sh_ncasecmp(ext, incompressible_extensions[i]) == 0){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int zip_is_incompressible(const void* data, size_t len){
+#if !defined(NO_LZ4_SUPPORT) || !defined(NO_GZIP_SUPPORT)
+	unsigned char* out;
+	size_t out_len;
+	int ret = 0;
+
+	return_ifnull(data, 0);
+
+	if (len == 0 || len > (size_t)1 << 30){
+		return 0;
+	}
+
+	/* a bare block without any container, so tiny samples are not thrown off by the header
+	 * lz4 is the fastest compressor there is, and still finds anything the others would make much of */
+#ifndef NO_LZ4_SUPPORT
+	out_len = LZ4_compressBound((int)len);
+#else
+	out_len = compressBound(len);
+#endif
+	out = malloc(out_len);
+	if (!out){
+		log_enomem();
+		return 0;
+	}
+#ifndef NO_LZ4_SUPPORT
+	out_len = LZ4_compress_default(data, (char*)out, (int)len, (int)out_len);
+#else
+	{
+		uLongf z_len = out_len;
+		out_len = compress2(out, &z_len, data, len, 1) == Z_OK ? z_len : 0;
+	}
+#endif
+	/* under 3% saved, which the extra work of the real compressor would not be worth */
+	if (out_len > 0){
+		ret = out_len >= len - len / 32;
+	}
+	free(out);
+	return ret;
+#else
+	(void)data;
+	(void)len;
+	return 0;
+#endif
+}
+
+/* only zstd can use one so far, since lz4's LZ4F_createCDict() is still in the static-linking section of lz4frame.h */
+struct zip_dict{
+	enum compressor c_type;
+	unsigned char* data;
+	size_t len;
+#ifndef NO_ZSTD_SUPPORT
+	struct zstd_dict* zstd;
+#endif
+};
+
+uint64_t zip_encoder_memory(enum compressor c_type, int compression_level, unsigned flags){
+	/* the parallel streams keep two blocks per worker, so one is filled while the other is compressed */
+	uint64_t n_blocks = ZIP_GET_WORKERS(flags) > 1 ? (uint64_t)ZIP_GET_WORKERS(flags) * 2 : 1;
+
+	/* a seekable stream holds each block's output until it knows how long it is, which is about as long as the block at worst */
+	if (ZIP_GET_SEEKABLE_MIB(flags) > 0 && c_type != COMPRESSOR_NONE){
+		return zip_encoder_memory(c_type, compression_level, flags & ~ZIP_SEEKABLE_MIB(0xFF)) + ((uint64_t)ZIP_GET_SEEKABLE_MIB(flags) << 20);
+	}
+
+	switch (c_type){
+#ifndef NO_GZIP_SUPPORT
+	case COMPRESSOR_GZIP:{
+		/* deflate's window and hash chains, at the memLevel zip_open() uses */
+		uint64_t deflate_len = ((uint64_t)1 << 17) + ((uint64_t)1 << ((flags & GZIP_LOWMEM ? 3 : 9) + 9));
+
+		/* and zip_pgzip.c's 128KiB blocks in and out */
+		return n_blocks > 1 ? n_blocks * (deflate_len + ((uint64_t)1 << 18)) : deflate_len;
+	}
+#endif
+#ifndef NO_BZIP2_SUPPORT
+	case COMPRESSOR_BZIP2:{
+		/* the level is the block size in 100k, and the sort takes 8 bytes per byte of block */
+		uint64_t block_len = (uint64_t)100000 * (compression_level >= 1 && compression_level <= 9 ? compression_level : 9);
+
+		/* and zip_pbzip2.c's blocks in and out, which are a little smaller than a block */
+		return n_blocks > 1 ? n_blocks * (400000 + 10 * block_len) : 400000 + 8 * block_len;
+	}
+#endif
+#ifndef NO_XZ_SUPPORT
+	case COMPRESSOR_XZ:{
+		uint32_t preset = compression_level >= 1 && compression_level <= 9 ? (uint32_t)compression_level : 3;
+		uint64_t ret;
+
+		if (flags & XZ_EXTREME){
+			preset |= LZMA_PRESET_EXTREME;
+		}
+		/* the same choice xz_encoder() makes */
+		if (ZIP_GET_WORKERS(flags) > 1 || XZ_GET_BLOCK_MIB(flags) > 0){
+			lzma_mt mt;
+
+			memset(&mt, 0, sizeof(mt));
+			mt.threads = ZIP_GET_WORKERS(flags) > 0 ? ZIP_GET_WORKERS(flags) : 1;
+			mt.block_size = (uint64_t)XZ_GET_BLOCK_MIB(flags) << 20;
+			mt.preset = preset;
+			mt.check = LZMA_CHECK_CRC64;
+			ret = lzma_stream_encoder_mt_memusage(&mt);
+		}
+		else{
+			ret = lzma_easy_encoder_memusage(preset);
+		}
+		return ret != UINT64_MAX ? ret : 0;
+	}
+#endif
+#ifndef NO_LZ4_SUPPORT
+	case COMPRESSOR_LZ4:
+		/* lz4frame's linked 256KiB blocks and their history, or zip_plz4.c's 1MiB blocks in and out */
+		return n_blocks > 1 ? n_blocks * ((uint64_t)1 << 21) : (uint64_t)1 << 20;
+#endif
+#ifndef NO_ZSTD_SUPPORT
+	case COMPRESSOR_ZSTD:
+		return zstd_stream_memory(compression_level, flags);
+#endif
+	case COMPRESSOR_NONE:
+		return 0;
+	default:
+		return 0;
+	}
+}
+
+int zip_dict_supported(enum compressor c_type){
+#ifndef NO_ZSTD_SUPPORT
+	return c_type == COMPRESSOR_ZSTD;
+#else
+	(void)c_type;
+	return 0;
+#endif
+}
+
+struct zip_dict* zip_dict_new(enum compressor c_type, int compression_level, const void* data, size_t len){
+	struct zip_dict* zd;
+
+	return_ifnull(data, NULL);
+
+	if (!zip_dict_supported(c_type)){
+		log_error_ex("%s cannot use a dictionary", compressor_tostring(c_type));
+		return NULL;
+	}
+
+	zd = calloc(1, sizeof(*zd));
+	if (!zd || !(zd->data = malloc(len > 0 ? len : 1))){
+		log_enomem();
+		free(zd);
+		return NULL;
+	}
+	memcpy(zd->data, data, len);
+	zd->len = len;
+	zd->c_type = c_type;
+
+#ifndef NO_ZSTD_SUPPORT
+	if (!(zd->zstd = zstd_dict_new(data, len, compression_level))){
+		zip_dict_free(zd);
+		return NULL;
+	}
+#else
+	(void)compression_level;
+#endif
+	return zd;
+}
+
+struct zip_dict* zip_dict_train(enum compressor c_type, int compression_level, const void* samples, const size_t* sample_lens, size_t n_samples){
+	struct zip_dict* ret = NULL;
+	unsigned char* buf;
+	size_t len = 0;
+
+	return_ifnull(samples, NULL);
+	return_ifnull(sample_lens, NULL);
+
+	if (!zip_dict_supported(c_type)){
+		log_error_ex("%s cannot use a dictionary", compressor_tostring(c_type));
+		return NULL;
+	}
+
+	buf = malloc(ZIP_DICT_LEN);
+	if (!buf){
+		log_enomem();
+		return NULL;
+	}
+#ifndef NO_ZSTD_SUPPORT
+	len = zstd_dict_train(buf, ZIP_DICT_LEN, samples, sample_lens, n_samples);
+#endif
+	if (len > 0){
+		ret = zip_dict_new(c_type, compression_level, buf, len);
+	}
+	free(buf);
+	return ret;
+}
+
+const void* zip_dict_data(const struct zip_dict* zd, size_t* out_len){
+	return_ifnull(zd, NULL);
+	return_ifnull(out_len, NULL);
+
+	*out_len = zd->len;
+	return zd->data;
+}
+
+int zip_stream_use_dict(struct ZIP_FILE* zfp, const struct zip_dict* zd){
+	return_ifnull(zfp, -1);
+	return_ifnull(zd, -1);
+
+	if (zd->c_type != zfp->c_type){
+		log_error("The dictionary was made for a different compressor");
+		return -1;
+	}
+	if (!zip_dict_supported(zfp->c_type)){
+		log_einval_u(zfp->c_type);
+		return -1;
+	}
+
+	/* every block of a seekable stream is primed with it on its own */
+	if (zfp->seekstrm){
+		seek_stream_use_dict(zfp->seekstrm, zd);
+		zfp->dict = zd;
+		return 0;
+	}
+#ifndef NO_ZSTD_SUPPORT
+	if (zstd_stream_use_dict(zfp->strm.zstdstrm, zd->zstd) != 0){
+		return -1;
+	}
+#endif
+	zfp->dict = zd;
+	return 0;
+}
+
+void zip_dict_free(struct zip_dict* zd){
+	if (!zd){
+		return;
+	}
+#ifndef NO_ZSTD_SUPPORT
+	zstd_dict_free(zd->zstd);
+#endif
+	free(zd->data);
+	free(zd);
+}
+
+static int zip_decompress_read(struct ZIP_FILE* zfp, FILE* fp_out){
+	unsigned char inbuf[BUFFER_LEN];
+	unsigned char outbuf[BUFFER_LEN];
+	int avail_in = 0;
+	int avail_out = 0;
+	int action;
+	size_t write_len = 0;
+	int res = 0;
+	int res_stream_end = 0;
+
+	switch (zfp->c_type){
+#ifndef NO_GZIP_SUPPORT
+	case COMPRESSOR_GZIP:
+		res_stream_end = Z_STREAM_END;
+		zfp->strm.zstrm.next_in = NULL;
+		zfp->strm.zstrm.avail_in = 0;
+		zfp->strm.zstrm.next_out = outbuf;
+		zfp->strm.zstrm.avail_out = sizeof(outbuf);
+		action = Z_NO_FLUSH;
+		break;
+#endif
+#ifndef NO_BZIP2_SUPPORT
+	case COMPRESSOR_BZIP2:
+		res_stream_end = BZ_STREAM_END;
+		zfp->strm.bzstrm.next_in = NULL;
+		zfp->strm.bzstrm.avail_in = 0;
+		zfp->strm.bzstrm.next_out = (char*)outbuf;
+		zfp->strm.bzstrm.avail_out = sizeof(outbuf);
+		action = BZ_RUN;
+		break;
+#endif
+#ifndef NO_XZ_SUPPORT
+	case COMPRESSOR_XZ:
+		res_stream_end = LZMA_STREAM_END;
+		zfp->strm.xzstrm.next_in = NULL;
+		zfp->strm.xzstrm.avail_in = 0;
+		zfp->strm.xzstrm.next_out = outbuf;
+		zfp->strm.xzstrm.avail_out = sizeof(outbuf);
+		action = LZMA_RUN;
+		break;
+#endif
+	default:
+		log_error("unsupported");
+		return -1;
+	}
+
+	do{
+		if (avail_in == 0){
+			avail_in = read_file(zfp->fp, inbuf, sizeof(inbuf));
+			if (avail_in == 0 || feof(zfp->fp)){
+				switch (zfp->c_type){
+#ifndef NO_GZIP_SUPPORT
+				case COMPRESSOR_GZIP:
+					action = Z_FINISH;
+					break;
+#endif
+#ifndef NO_BZIP2_SUPPORT
+				case COMPRESSOR_BZIP2:
+					action = BZ_FINISH;
+					break;
+#endif
+#ifndef NO_XZ_SUPPORT
+				case COMPRESSOR_XZ:
+					action = LZMA_FINISH;
+					break;
+#endif
+				default:
+					;
+				}
+			}
+
+			switch (zfp->c_type){
+#ifndef NO_GZIP_SUPPORT
+			case COMPRESSOR_GZIP:
+				zfp->strm.zstrm.next_in = inbuf;
+				zfp->strm.zstrm.avail_in = avail_in;
+				break;
+#endif
+#ifndef NO_BZIP2_SUPPORT
+			case COMPRESSOR_BZIP2:
+				zfp->strm.bzstrm.next_in = (char*)inbuf;
+				zfp->strm.bzstrm.avail_in = avail_in;
+				break;
+#endif
+#ifndef NO_XZ_SUPPORT
+			case COMPRESSOR_XZ:
+				zfp->strm.xzstrm.next_in = inbuf;
+				zfp->strm.xzstrm.avail_in = avail_in;
+				break;
+#endif
+			default:
+				log_fatal("unsupported");
+				return -1;
+			}
+		}
+
+		switch (zfp->c_type){
+#ifndef NO_GZIP_SUPPORT
+		case COMPRESSOR_GZIP:
 			zfp->strm.zstrm.next_out = outbuf;
 			zfp->strm.zstrm.avail_out = sizeof(outbuf);
 			res = inflate(&(zfp->strm.zstrm), action);
@@ -690,9 +1901,24 @@ int zip_decompress(const char* infile, const char* outfile, enum compressor c_ty
 	FILE* fp_out = NULL;
 	int ret = 0;
 
+#ifndef NO_LZ4_SUPPORT
+	if (c_type == COMPRESSOR_LZ4 && ZIP_GET_WORKERS(flags) > 1){
+		return zip_file_stream(infile, outfile, 0, c_type, 0, flags);
+	}
+#endif
+#ifndef NO_BZIP2_SUPPORT
+	if (c_type == COMPRESSOR_BZIP2 && ZIP_GET_WORKERS(flags) > 1){
+		return zip_file_stream(infile, outfile, 0, c_type, 0, flags);
+	}
+#endif
 	if (c_type == COMPRESSOR_LZ4){
 		return lz4_decompress(infile, outfile, flags);
 	}
+#ifndef NO_ZSTD_SUPPORT
+	if (c_type == COMPRESSOR_ZSTD){
+		return zstd_decompress(infile, outfile, flags);
+	}
+#endif
 
 	if (c_type == COMPRESSOR_NONE){
 		return copy_file(infile, outfile);
@@ -744,6 +1970,10 @@ const char* get_compression_extension(enum compressor comp){
 #ifndef NO_LZ4_SUPPORT
 	case COMPRESSOR_LZ4:
 		return ".lz4";
+#endif
+#ifndef NO_ZSTD_SUPPORT
+	case COMPRESSOR_ZSTD:
+		return ".zst";
 #endif
 	case COMPRESSOR_NONE:
 		return "";
@@ -772,6 +2002,12 @@ enum compressor get_compressor_byname(const char* name){
 	if (sh_ncasecmp(name, "lz4") == 0){
 		return COMPRESSOR_LZ4;
 	}
+#ifndef NO_ZSTD_SUPPORT
+	if (sh_ncasecmp(name, "zstd") == 0 ||
+			sh_ncasecmp(name, "zst") == 0){
+		return COMPRESSOR_ZSTD;
+	}
+#endif
 	if (sh_ncasecmp(name, "none") == 0 ||
 			sh_ncasecmp(name, "off") == 0 ||
 			sh_ncasecmp(name, "no") == 0){
@@ -790,6 +2026,10 @@ const char* compressor_tostring(enum compressor c_type){
 		return "xz";
 	case COMPRESSOR_LZ4:
 		return "lz4";
+#ifndef NO_ZSTD_SUPPORT
+	case COMPRESSOR_ZSTD:
+		return "zstd";
+#endif
 	case COMPRESSOR_NONE:
 		return "none";
 	default:
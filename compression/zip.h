@@ -9,6 +9,14 @@
 #ifndef __COMPRESSION_ZIP_H
 #define __COMPRESSION_ZIP_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef __GNUC__
+#define __attribute__(x)
+#endif
+
 /**
  * @brief An enumeration that holds the possible compression algorithms
  */
@@ -58,25 +66,55 @@ enum compressor{
 	 * Compression/decompression simply copies the file.
 	 */
 	COMPRESSOR_NONE
+	/* saved options store the raw value, so new compressors go after COMPRESSOR_NONE to keep the old values
+	 * the comma is in front so the list still ends without one when a compressor is left out */
+#ifndef NO_ZSTD_SUPPORT
+	/**
+	 * @brief zstd.<br>
+	 * This algorithm offers compression ratios at or above gzip's while compressing nearly as fast as lz4, and decompresses faster than any of the others except lz4.<br>
+	 * It can also compress a single file on several threads at once. @see ZIP_WORKERS()<br>
+	 * <br>
+	 * This is included by default on most recent Linux distros. OSX users may need to install zstd, while Windows users will need to download 7zip-ZS.
+	 */
+	, COMPRESSOR_ZSTD
+#endif
 };
 
-/* gzip options */
+/* options for any compressor that can split one file across threads (gzip, bzip2, xz, lz4 and zstd)
+ * the worker bits stay clear of every compressor's own flags, since the same flags are kept when the compressor is changed */
+#define ZIP_WORKERS(n) (((unsigned)(n) & 0xFF) << 8) /**< Compress on n worker threads (up to 255), or decompress bzip2, xz and lz4 on n threads. Without this, the calling thread does all the work. */
+#define ZIP_GET_WORKERS(flags) (((unsigned)(flags) >> 8) & 0xFF) /**< The number of worker threads set by ZIP_WORKERS(). */
+#define ZIP_SEEKABLE_MIB(n) (((unsigned)(n) & 0xFF) << 24) /**< Have zip_stream_new() split its output into independent blocks of n MiB of original data (up to 255), followed by an index of them, so zip_decompress_range() only decompresses the blocks a range falls in. A decompression stream tells this layout apart on its own. zip_compress() and COMPRESSOR_NONE ignore this. */
+#define ZIP_GET_SEEKABLE_MIB(flags) (((unsigned)(flags) >> 24) & 0xFF) /**< The block size set by ZIP_SEEKABLE_MIB(). */
+
+/* gzip options
+ * with ZIP_WORKERS(), the input is split into blocks that are compressed separately, which costs a little compression but still makes one standard gzip stream */
 #define GZIP_NORMAL       (0)      /**< Do not use any special options. This flag is only valid by itself. */
 #define GZIP_HUFFMAN_ONLY (1 << 0) /**< Force Huffman enconding only (no string match). This flag is not valid with GZIP_FILTERED or GZIP_RLE */
 #define GZIP_FILTERED     (1 << 1) /**< Input data is filtered (many small values that are somewhat random). This flag is not valid with GZIP_HUFFMAN_ONLY or GZIP_RLE. */
 #define GZIP_RLE          (1 << 2) /**< Force run-length-encoding. This works best on PNG files. This flag is not valid with GZIP_HUFFMAN_ONLY or GZIP_FILTERED. */
 #define GZIP_LOWMEM       (1 << 3) /**< Decrease memory usage. This unfortunately decreases compression ratios as well. */
 
-/* gzip options */
+/* bzip2 options
+ * with ZIP_WORKERS(), the input is split into blocks that are compressed separately and spliced back together, which still makes one standard bzip2 stream */
 #define BZIP2_NORMAL (0)           /**< Do not use any special options. This flag is only valid by itself. */
 
 /* xz options */
 #define XZ_NORMAL  (0)             /**< Do not use any special options. This flag is only valid by itself. */
 #define XZ_EXTREME (1 << 0)        /**< Use extreme compression mode. This slightly increases compression ratios, but significantly increases time and memory usage. */
+#define XZ_BLOCK_MIB(n) (((unsigned)(n) & 0xFF) << 16) /**< Split the output into independent blocks of n MiB (up to 255). Smaller blocks give ZIP_WORKERS() more to split up at some cost to the ratio. Without this, blocks are three times the dictionary size. */
+#define XZ_GET_BLOCK_MIB(flags) (((unsigned)(flags) >> 16) & 0xFF) /**< The block size set by XZ_BLOCK_MIB(). */
 
-/* lz4 options */
+/* lz4 options
+ * with ZIP_WORKERS(), the input is split into independent blocks, which costs a little compression but still makes one standard lz4 frame */
 #define LZ4_NORMAL (0)            /**< Do not use any special options. This flag is only valid by itself. */
 
+/* zstd options
+ * these stay clear of the gzip bits, since the same flags are kept when the compressor is changed
+ * levels 1-9 are spread over zstd's levels 1-19, and ZIP_WORKERS() does not change the output */
+#define ZSTD_NORMAL (0)            /**< Do not use any special options. This flag is only valid by itself. */
+#define ZSTD_LONG   (1 << 4)       /**< Use long distance matching. This finds repeats up to 128MiB apart, which helps large files with repeated sections, at the cost of more memory. */
+
 /**
  * @brief Compresses a file.
  *
@@ -110,7 +148,7 @@ int zip_compress(const char* infile, const char* outfile, enum compressor c_type
  * @param c_type The compression algorithm to use.
  *
  * @param flags Special flags to give to the decompression algorithm.<br>
- * At the moment, decompression does not have any flags available to it.
+ * Only ZIP_WORKERS() does anything here, and only for xz files with more than one block or lz4 files with independent blocks and no checksums.
  *
  * @return 0 on success, or negative on failure.<br>
  * On failure, the output file is automatically deleted.
@@ -144,4 +182,383 @@ enum compressor get_compressor_byname(const char* name);
  */
 const char* compressor_tostring(enum compressor c_type);
 
+/**
+ * @brief A compression stream.<br>
+ * Analogous to FILE* for regular files.
+ */
+struct ZIP_FILE;
+
+/**
+ * @brief Starts a compression stream that hands its output to a callback instead of a file.<br>
+ * This allows compressed data to be passed to another stage (e.g. encryption) without staging it on disk.<br>
+ * If this thread last freed a finished stream with the same settings, that stream is reset and handed back instead of starting a new one.
+ *
+ * @param c_type The compression algorithm to use.<br>
+ * COMPRESSOR_NONE passes the data through unchanged.
+ *
+ * @param compression_level A value from 0-9 indicating how much the data should be compressed.<br>
+ * A level of 0 uses the default value.
+ *
+ * @param flags Special flags to give to the compression algorithm.
+ *
+ * @param sink A function that receives each block of compressed output.<br>
+ * It must return 0 on success or non-zero to abort the stream.
+ *
+ * @param sink_data An argument to pass to sink.
+ *
+ * @return A compression stream, or NULL on failure.<br>
+ * This stream must be freed with zip_stream_free() when no longer in use.
+ * @see zip_stream_free()
+ */
+struct ZIP_FILE* zip_stream_new(enum compressor c_type, int compression_level, unsigned flags, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data) __attribute__((malloc));
+
+/**
+ * @brief Starts a decompression stream that takes compressed data through zip_stream_write() and hands the original data to a callback.<br>
+ * This reverses zip_stream_new(), and allows data to be decompressed straight from another stage (e.g. decryption) without staging it on disk.
+ *
+ * @param c_type The compression algorithm the data was compressed with.<br>
+ * COMPRESSOR_NONE passes the data through unchanged.
+ *
+ * @param flags Special flags to give to the decompression algorithm.
+ *
+ * @param sink A function that receives each block of decompressed output.<br>
+ * It must return 0 on success or non-zero to abort the stream.
+ *
+ * @param sink_data An argument to pass to sink.
+ *
+ * @return A decompression stream, or NULL on failure.<br>
+ * This stream must be freed with zip_stream_free() when no longer in use.
+ * @see zip_stream_free()
+ */
+struct ZIP_FILE* zip_decompress_stream_new(enum compressor c_type, unsigned flags, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data) __attribute__((malloc));
+
+/**
+ * @brief Compresses or decompresses a block of data, depending on how the stream was started.<br>
+ * The output may be buffered by the compressor and handed to the sink on a later call.
+ *
+ * @param zfp A stream returned by zip_stream_new() or zip_decompress_stream_new().
+ *
+ * @param data The data to compress.
+ *
+ * @param len The length of the data in bytes.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int zip_stream_write(struct ZIP_FILE* zfp, const void* data, size_t len);
+
+/**
+ * @brief Flushes all remaining output to the sink and writes the stream's trailer.<br>
+ * For a decompression stream, this checks that the compressed data was complete.<br>
+ * No more data can be written to the stream after this function is called.
+ *
+ * @param zfp A stream returned by zip_stream_new() or zip_decompress_stream_new().
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int zip_stream_finish(struct ZIP_FILE* zfp);
+
+/**
+ * @brief Frees all memory associated with a compression or decompression stream.<br>
+ * This does not flush any buffered output. Call zip_stream_finish() first if the output should be complete.<br>
+ * A compression stream that was finished successfully is kept for the next zip_stream_new() on the same thread instead, and is only freed once it is replaced or the thread exits.
+ *
+ * @param zfp The stream to free.<br>
+ * This can be NULL, in which case this function does nothing.
+ *
+ * @return void
+ */
+void zip_stream_free(struct ZIP_FILE* zfp);
+
+/**
+ * @brief A growable block of memory that can be used as a source or a sink.
+ * @see zip_buffer_source()
+ * @see zip_buffer_sink()
+ */
+struct zip_buffer{
+	unsigned char* data; /**< @brief The data. This must be freed with free() when no longer in use. */
+	size_t len;          /**< @brief The length of the data in bytes. */
+	size_t size;         /**< @brief How many bytes are allocated for the data. */
+	size_t pos;          /**< @brief How much of the data zip_buffer_source() has already handed out. */
+};
+
+/**
+ * @brief Compresses everything a source produces, handing the output to a sink.<br>
+ * This goes through zip_stream_new(), so nothing is staged on disk and the output is the same as zip_compress() would write.
+ *
+ * @param c_type The compression algorithm to use.<br>
+ * COMPRESSOR_NONE passes the data through unchanged.
+ *
+ * @param compression_level A value from 0-9 indicating how much the data should be compressed.<br>
+ * A level of 0 uses the default value.
+ *
+ * @param flags Special flags to give to the compression algorithm.
+ *
+ * @param source A function that fills buf with up to len bytes and sets *out_len to how many it wrote.<br>
+ * It must return 0 on success or non-zero on failure. Setting *out_len to 0 means there is no more input.<br>
+ * zip_fp_source(), zip_fd_source() and zip_buffer_source() read from a FILE*, a file descriptor and a struct zip_buffer respectively.
+ *
+ * @param source_data An argument to pass to source.
+ *
+ * @param sink A function that receives each block of compressed output.<br>
+ * It must return 0 on success or non-zero to abort.<br>
+ * zip_fp_sink(), zip_fd_sink() and zip_buffer_sink() write to a FILE*, a file descriptor and a struct zip_buffer respectively.
+ *
+ * @param sink_data An argument to pass to sink.
+ *
+ * @return 0 on success, or negative on failure.<br>
+ * On failure, the sink may already have received part of the output.
+ */
+int zip_compress_stream(enum compressor c_type, int compression_level, unsigned flags, int(*source)(void* buf, size_t len, size_t* out_len, void* source_data), void* source_data, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data);
+
+/**
+ * @brief Decompresses everything a source produces, handing the original data to a sink.<br>
+ * This reverses zip_compress_stream().
+ *
+ * @param c_type The compression algorithm the data was compressed with.<br>
+ * COMPRESSOR_NONE passes the data through unchanged.
+ *
+ * @param flags Special flags to give to the decompression algorithm.
+ *
+ * @param source A function that produces the compressed data. @see zip_compress_stream()
+ *
+ * @param source_data An argument to pass to source.
+ *
+ * @param sink A function that receives each block of decompressed output. @see zip_compress_stream()
+ *
+ * @param sink_data An argument to pass to sink.
+ *
+ * @return 0 on success, or negative on failure, including if the compressed data was cut short.
+ */
+int zip_decompress_stream(enum compressor c_type, unsigned flags, int(*source)(void* buf, size_t len, size_t* out_len, void* source_data), void* source_data, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data);
+
+/**
+ * @brief A source that reads from a FILE*.
+ *
+ * @param fp The FILE* to read from, passed as source_data. This must be opened in reading mode.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int zip_fp_source(void* buf, size_t len, size_t* out_len, void* fp);
+
+/**
+ * @brief A sink that writes to a FILE*.
+ *
+ * @param fp The FILE* to write to, passed as sink_data. This must be opened in writing mode.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int zip_fp_sink(const void* data, size_t len, void* fp);
+
+/**
+ * @brief A source that reads from a file descriptor.
+ *
+ * @param fd A pointer to the file descriptor, passed as source_data.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int zip_fd_source(void* buf, size_t len, size_t* out_len, void* fd);
+
+/**
+ * @brief A sink that writes to a file descriptor.<br>
+ * This keeps writing until everything is written, so pipes and sockets can be used too.
+ *
+ * @param fd A pointer to the file descriptor, passed as sink_data.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int zip_fd_sink(const void* data, size_t len, void* fd);
+
+/**
+ * @brief A source that reads the part of a struct zip_buffer that has not been read yet.
+ *
+ * @param zb A pointer to the struct zip_buffer, passed as source_data. Its pos should be 0 to start at the beginning.
+ *
+ * @return 0
+ */
+int zip_buffer_source(void* buf, size_t len, size_t* out_len, void* zb);
+
+/**
+ * @brief A sink that appends to a struct zip_buffer, growing it as needed.
+ *
+ * @param zb A pointer to the struct zip_buffer, passed as sink_data. This should be zeroed to start with an empty buffer.
+ *
+ * @return 0 on success, or negative if there is not enough memory.
+ */
+int zip_buffer_sink(const void* data, size_t len, void* zb);
+
+/**
+ * @brief The most bytes zip_has_magic() looks at.
+ */
+#define ZIP_MAGIC_LEN 6
+
+/**
+ * @brief Checks if data starts like the output of a compressor.<br>
+ * Everything a compressor writes starts with its magic number, or with the seekable layout's if ZIP_SEEKABLE_MIB() was given, so data that does not was not made by it.
+ *
+ * @param c_type The compression algorithm.<br>
+ * Anything matches COMPRESSOR_NONE.
+ *
+ * @param data The start of the data.
+ *
+ * @param len The length of the data in bytes. Only the first ZIP_MAGIC_LEN bytes are looked at.<br>
+ * Data shorter than the magic number matches if it could be the start of it.
+ *
+ * @return Non-zero if it does, or 0 if it does not.
+ */
+int zip_has_magic(enum compressor c_type, const void* data, size_t len);
+
+/**
+ * @brief Checks if a file's extension belongs to a format that is already compressed (e.g. .jpg, .mp4 or .gz).
+ *
+ * @param file The path to the file.
+ *
+ * @return Non-zero if it does, or 0 if it does not.
+ */
+int zip_incompressible_name(const char* file);
+
+/**
+ * @brief Trial-compresses a sample of data with the fastest compressor available, to see if compressing it is worth the time.<br>
+ * The first block of a file is a good enough sample for almost every format.
+ *
+ * @param data The sample.
+ *
+ * @param len The length of the sample in bytes.
+ *
+ * @return Non-zero if the sample would shrink by less than 3%, or 0 if it would shrink by more or there is nothing to try it with.
+ */
+int zip_is_incompressible(const void* data, size_t len);
+
+/**
+ * @brief Estimates how much memory a compression stream takes up, including the buffers of its worker threads.<br>
+ * This is what zip_stream_new() allocates for those settings, give or take the stream's own small buffers.
+ *
+ * @param c_type The compression algorithm.
+ *
+ * @param compression_level The compression level, as given to zip_stream_new().
+ *
+ * @param flags The compression flags, as given to zip_stream_new().
+ *
+ * @return The estimate in bytes, or 0 if the compressor is not supported.
+ */
+uint64_t zip_encoder_memory(enum compressor c_type, int compression_level, unsigned flags);
+
+/**
+ * @brief The most a trained dictionary holds, which is the same as zstd --train.<br>
+ * Training works best on around 100 times this much sample data.
+ */
+#define ZIP_DICT_LEN (110 << 10)
+
+/**
+ * @brief A dictionary that primes the compressor for a set of small files that look alike.<br>
+ * Small files do not have enough data of their own to find many repeats in, so this can raise their compression ratio and speed considerably.<br>
+ * A dictionary can be shared between any number of streams and threads at once.
+ */
+struct zip_dict;
+
+/**
+ * @brief Checks if a compression algorithm can use a dictionary.<br>
+ * Only zstd can right now.
+ *
+ * @param c_type The compression algorithm.
+ *
+ * @return Non-zero if it can, or 0 if it cannot.
+ */
+int zip_dict_supported(enum compressor c_type);
+
+/**
+ * @brief Trains a dictionary from a set of sample files.
+ *
+ * @param c_type The compression algorithm the dictionary is for. @see zip_dict_supported()
+ *
+ * @param compression_level The compression level the dictionary is used with, from 0-9.
+ *
+ * @param samples Every sample, one after the other.
+ *
+ * @param sample_lens The length of each sample in bytes.
+ *
+ * @param n_samples The number of samples.
+ *
+ * @return A new dictionary, or NULL if the compressor cannot use one or there was not enough sample data to train one.<br>
+ * This dictionary must be freed with zip_dict_free() when no longer in use.
+ */
+struct zip_dict* zip_dict_train(enum compressor c_type, int compression_level, const void* samples, const size_t* sample_lens, size_t n_samples) __attribute__((malloc));
+
+/**
+ * @brief Creates a dictionary from data returned by zip_dict_data().
+ *
+ * @param c_type The compression algorithm the dictionary is for. @see zip_dict_supported()
+ *
+ * @param compression_level The compression level the dictionary is used with, from 0-9.
+ *
+ * @param data The dictionary's data. This is copied, so it does not have to stay around.
+ *
+ * @param len The length of the data in bytes.
+ *
+ * @return A new dictionary, or NULL on failure.<br>
+ * This dictionary must be freed with zip_dict_free() when no longer in use.
+ */
+struct zip_dict* zip_dict_new(enum compressor c_type, int compression_level, const void* data, size_t len) __attribute__((malloc));
+
+/**
+ * @brief Gets a dictionary's data, so it can be stored and loaded again with zip_dict_new().
+ *
+ * @param zd The dictionary.
+ *
+ * @param out_len Set to the length of the data in bytes.
+ *
+ * @return The dictionary's data, or NULL on failure.<br>
+ * This belongs to the dictionary and must not be freed.
+ */
+const void* zip_dict_data(const struct zip_dict* zd, size_t* out_len);
+
+/**
+ * @brief Uses a dictionary for a stream.<br>
+ * This must be called before anything is written to the stream, and the dictionary must outlive the stream.<br>
+ * A decompression stream only uses the dictionary if the compressed data was made with it, so data compressed without one still decompresses.
+ *
+ * @param zfp A stream returned by zip_stream_new() or zip_decompress_stream_new() with the dictionary's compression algorithm.
+ *
+ * @param zd The dictionary to use.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int zip_stream_use_dict(struct ZIP_FILE* zfp, const struct zip_dict* zd);
+
+/**
+ * @brief Frees a dictionary.
+ *
+ * @param zd The dictionary to free.<br>
+ * This can be NULL, in which case this function does nothing.
+ *
+ * @return void
+ */
+void zip_dict_free(struct zip_dict* zd);
+
+/**
+ * @brief Decompresses part of the output of a zip_stream_new() that was started with ZIP_SEEKABLE_MIB().<br>
+ * Only the blocks the part falls in are read and decompressed.
+ *
+ * @param fp The compressed data, which must be seekable.<br>
+ * It is read from its current position to its end, and is left at an unspecified position.
+ *
+ * @param c_type The compression algorithm the data was compressed with.
+ *
+ * @param flags Special flags to give to the decompression algorithm.
+ *
+ * @param zd The dictionary the data was compressed with, or NULL if there is none.
+ *
+ * @param offset Where the part starts in the original data.
+ *
+ * @param len How long the part is.<br>
+ * Anything past the end of the original data is left out.
+ *
+ * @param sink A function that receives each block of the part.<br>
+ * It must return 0 on success or non-zero to abort.
+ *
+ * @param sink_data An argument to pass to sink.
+ *
+ * @return 0 on success, positive if the data is not in the seekable layout, in which case fp is back where it was, or negative on failure.
+ */
+int zip_decompress_range(FILE* fp, enum compressor c_type, unsigned flags, const struct zip_dict* zd, uint64_t offset, uint64_t len, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data);
+
 #endif
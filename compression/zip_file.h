@@ -14,6 +14,7 @@
 #endif
 
 #include "zip.h"
+#include "zip_seek.h"
 #include <stdio.h>
 
 #ifndef NO_GZIP_SUPPORT
@@ -25,20 +26,58 @@
 #ifndef NO_XZ_SUPPORT
 #include <lzma.h>
 #endif
+#ifndef NO_LZ4_SUPPORT
+struct lz4_stream;
+struct plz4_stream;
+#endif
+#ifndef NO_ZSTD_SUPPORT
+struct zstd_stream;
+#endif
+#ifndef NO_GZIP_SUPPORT
+struct pgzip_stream;
+#endif
+#ifndef NO_BZIP2_SUPPORT
+struct pbzip2_stream;
+#endif
+struct seek_stream;
 
 /**
  * @brief A structure containing information for compressing/decompressing a file.
  * Analogous to FILE* for regular files.
  */
 struct ZIP_FILE{
-	FILE* fp;               /**< @brief The file that's being compressed/decompressed. */
+	FILE* fp;               /**< @brief The file that's being compressed/decompressed. This is NULL if the output goes to a sink instead. */
+	int(*sink)(const void* data, size_t len, void* sink_data); /**< @brief Receives the compressed output if fp is NULL. @see zip_stream_new() */
+	void* sink_data;        /**< @brief The argument passed to sink. */
 	unsigned write;         /**< @brief A boolean value that's true if the ZIP_FILE is compressing. */
+	unsigned finished;      /**< @brief A boolean value that's true once a decompression stream has seen the end of the compressed data, or once a compression stream has been finished. */
+	unsigned parallel;      /**< @brief A boolean value that's true if a gzip, bzip2 or lz4 stream splits its data into blocks that are (de)compressed on several threads. */
 	enum compressor c_type; /**< @brief An enumeration that shows which compression algorithm is being used. */
+	int level;              /**< @brief The compression level a compression stream was started with. @see zip_stream_new() */
+	unsigned flags;         /**< @brief The flags a compression stream was started with, so a finished one is only reused for the same settings. */
 	union tag_strm{         /**< @brief A stream (de)compression structure that depends on which compression algorithm is being used. */
 		z_stream zstrm;     /**< @brief gzip (de)compression stream. */
 		bz_stream bzstrm;   /**< @brief bzip2 (de)compression stream. */
 		lzma_stream xzstrm; /**< @brief xz (de)compression stream. */
+#ifndef NO_LZ4_SUPPORT
+		struct lz4_stream* lz4strm; /**< @brief lz4 (de)compression stream. Only used by zip_stream_new() and zip_decompress_stream_new(). */
+		struct plz4_stream* plz4strm; /**< @brief Parallel lz4 (de)compression stream. Only used by zip_stream_new() and zip_decompress_stream_new() when parallel is set. */
+#endif
+#ifndef NO_ZSTD_SUPPORT
+		struct zstd_stream* zstdstrm; /**< @brief zstd (de)compression stream. Only used by zip_stream_new() and zip_decompress_stream_new(). */
+#endif
+#ifndef NO_GZIP_SUPPORT
+		struct pgzip_stream* pgzstrm; /**< @brief Parallel gzip compression stream. Only used by zip_stream_new() when parallel is set. */
+#endif
+#ifndef NO_BZIP2_SUPPORT
+		struct pbzip2_stream* pbz2strm; /**< @brief Parallel bzip2 (de)compression stream. Only used by zip_stream_new() and zip_decompress_stream_new() when parallel is set. */
+#endif
 	}strm;
+	struct seek_stream* seekstrm; /**< @brief The seekable layout's blocks and index, or NULL if the stream is not in the seekable layout. Set by zip_stream_new() when ZIP_SEEKABLE_MIB() is given, or once a decompression stream sees the layout's magic number, after which strm is not used. */
+	const struct zip_dict* dict; /**< @brief The dictionary given to zip_stream_use_dict(), so a seekable decompression stream can give it to each block. */
+	unsigned char head[SEEK_MAGIC_LEN]; /**< @brief The start of a decompression stream's data, which is held back until there is enough to tell if it is in the seekable layout. */
+	size_t head_len;        /**< @brief How much of head is filled. */
+	unsigned sniffed;       /**< @brief A boolean value that's true once a decompression stream knows if its data is in the seekable layout. */
 };
 
 #endif
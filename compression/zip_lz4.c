@@ -290,4 +290,206 @@ cleanup:
 	return ret;
 }
 
+/* incremental (de)compressor used by zip_stream_new() and zip_decompress_stream_new() */
+struct lz4_stream{
+	LZ4F_compressionContext_t ctx;
+	LZ4F_preferences_t prefs;
+	unsigned char* outbuf;
+	size_t outbuf_len;
+	int header_written;
+	/* only set when decompressing */
+	LZ4F_dctx* dctx;
+	int finished;
+};
+
+struct lz4_stream* lz4_stream_new(int compression_level){
+	struct lz4_stream* ls;
+	size_t err;
+
+	ls = calloc(1, sizeof(*ls));
+	if (!ls){
+		log_enomem();
+		return NULL;
+	}
+
+	ls->prefs.frameInfo.blockSizeID = LZ4F_max256KB;
+	ls->prefs.frameInfo.blockMode = LZ4F_blockLinked;
+	ls->prefs.frameInfo.contentChecksumFlag = LZ4F_noContentChecksum;
+	ls->prefs.frameInfo.frameType = LZ4F_frame;
+	if (compression_level >= 1 && compression_level <= 9){
+		ls->prefs.compressionLevel = compression_level + 3;
+	}
+
+	err = LZ4F_createCompressionContext(&ls->ctx, LZ4F_VERSION);
+	if (LZ4F_isError(err)){
+		log_error("Failed to create LZ4 compression context");
+		free(ls);
+		return NULL;
+	}
+
+	/* input is always fed in BUFFER_LEN chunks, so this is enough for any single call */
+	ls->outbuf_len = LZ4F_compressBound(BUFFER_LEN, &ls->prefs);
+	ls->outbuf = malloc(ls->outbuf_len);
+	if (!ls->outbuf){
+		log_enomem();
+		lz4_stream_free(ls);
+		return NULL;
+	}
+
+	return ls;
+}
+
+static int lz4_stream_header(struct lz4_stream* ls, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	size_t len;
+
+	if (ls->header_written){
+		return 0;
+	}
+
+	len = LZ4F_compressBegin(ls->ctx, ls->outbuf, ls->outbuf_len, &ls->prefs);
+	if (LZ4F_isError(len)){
+		log_error_ex("Failed to write LZ4 header (%s)", LZ4F_getErrorName(len));
+		return -1;
+	}
+	if (sink(ls->outbuf, len, sink_data) != 0){
+		log_error("Failed to write LZ4 header");
+		return -1;
+	}
+
+	ls->header_written = 1;
+	return 0;
+}
+
+int lz4_stream_write(struct lz4_stream* ls, const void* data, size_t len, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	const unsigned char* ptr = data;
+
+	if (lz4_stream_header(ls, sink, sink_data) != 0){
+		return -1;
+	}
+
+	while (len > 0){
+		size_t len_in = len < BUFFER_LEN ? len : BUFFER_LEN;
+		size_t len_out;
+
+		len_out = LZ4F_compressUpdate(ls->ctx, ls->outbuf, ls->outbuf_len, ptr, len_in, NULL);
+		if (LZ4F_isError(len_out)){
+			log_error_ex("LZ4 compression error (%s)", LZ4F_getErrorName(len_out));
+			return -1;
+		}
+		if (len_out > 0 && sink(ls->outbuf, len_out, sink_data) != 0){
+			log_error("Failed to write lz4 output");
+			return -1;
+		}
+
+		ptr += len_in;
+		len -= len_in;
+	}
+	return 0;
+}
+
+int lz4_stream_end(struct lz4_stream* ls, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	size_t len_out;
+
+	if (lz4_stream_header(ls, sink, sink_data) != 0){
+		return -1;
+	}
+
+	len_out = LZ4F_compressEnd(ls->ctx, ls->outbuf, ls->outbuf_len, NULL);
+	if (LZ4F_isError(len_out)){
+		log_error("Failed to finish lz4 output");
+		return -1;
+	}
+	if (sink(ls->outbuf, len_out, sink_data) != 0){
+		log_error("Failed to write lz4 output");
+		return -1;
+	}
+	return 0;
+}
+
+/* LZ4F_compressBegin() starts over on a context that already finished a frame */
+void lz4_stream_reset(struct lz4_stream* ls){
+	ls->header_written = 0;
+}
+
+struct lz4_stream* lz4_decompress_stream_new(void){
+	struct lz4_stream* ls;
+	size_t err;
+
+	ls = calloc(1, sizeof(*ls));
+	if (!ls){
+		log_enomem();
+		return NULL;
+	}
+
+	err = LZ4F_createDecompressionContext(&ls->dctx, LZ4F_VERSION);
+	if (LZ4F_isError(err)){
+		log_error("Failed to create LZ4 decompression context");
+		free(ls);
+		return NULL;
+	}
+
+	/* LZ4F_decompress() keeps its own block buffer, so the output can be drained in pieces of any size */
+	ls->outbuf_len = BUFFER_LEN;
+	ls->outbuf = malloc(ls->outbuf_len);
+	if (!ls->outbuf){
+		log_enomem();
+		lz4_stream_free(ls);
+		return NULL;
+	}
+
+	return ls;
+}
+
+int lz4_decompress_stream_write(struct lz4_stream* ls, const void* data, size_t len, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	const unsigned char* ptr = data;
+	size_t out_len;
+
+	/* keep calling until the input is used up and no more output is pending */
+	do{
+		size_t in_len = len;
+		size_t res;
+
+		if (ls->finished){
+			break;
+		}
+
+		out_len = ls->outbuf_len;
+		res = LZ4F_decompress(ls->dctx, ls->outbuf, &out_len, ptr, &in_len, NULL);
+		if (LZ4F_isError(res)){
+			log_error_ex("LZ4 decompression error (%s)", LZ4F_getErrorName(res));
+			return -1;
+		}
+		ls->finished = res == 0;
+
+		if (out_len > 0 && sink(ls->outbuf, out_len, sink_data) != 0){
+			log_error("Failed to write decompressed data");
+			return -1;
+		}
+
+		ptr += in_len;
+		len -= in_len;
+	}while (len > 0 || out_len == ls->outbuf_len);
+	return 0;
+}
+
+int lz4_decompress_stream_end(struct lz4_stream* ls){
+	if (!ls->finished){
+		log_error("Compressed data ended unexpectedly");
+		return -1;
+	}
+	return 0;
+}
+
+void lz4_stream_free(struct lz4_stream* ls){
+	if (!ls){
+		return;
+	}
+	LZ4F_freeCompressionContext(ls->ctx);
+	if (ls->dctx){
+		LZ4F_freeDecompressionContext(ls->dctx);
+	}
+	free(ls->outbuf);
+	free(ls);
+}
+
 #endif
@@ -18,4 +18,14 @@
 int lz4_compress(const char* infile, const char* outfile, int compression_level, unsigned flags);
 int lz4_decompress(const char* infile, const char* outfile, unsigned flags);
 
+struct lz4_stream;
+struct lz4_stream* lz4_stream_new(int compression_level);
+int lz4_stream_write(struct lz4_stream* ls, const void* data, size_t len, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data);
+int lz4_stream_end(struct lz4_stream* ls, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data);
+void lz4_stream_reset(struct lz4_stream* ls);
+struct lz4_stream* lz4_decompress_stream_new(void);
+int lz4_decompress_stream_write(struct lz4_stream* ls, const void* data, size_t len, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data);
+int lz4_decompress_stream_end(struct lz4_stream* ls);
+void lz4_stream_free(struct lz4_stream* ls);
+
 #endif
@@ -0,0 +1,622 @@
+/** @file compression/zip_pbzip2.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef NO_BZIP2_SUPPORT
+
+#define __ZIP_INTERNAL
+#include "zip_pbzip2.h"
+#include "zip.h"
+#include "../log.h"
+#include "../blockring.h"
+#include <bzlib.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* bzip2 blocks are not byte aligned, so every block is found by one of these 48-bit magic numbers */
+#define PBZIP2_BLOCK_MAGIC UINT64_C(0x314159265359)
+#define PBZIP2_EOS_MAGIC UINT64_C(0x177245385090)
+#define PBZIP2_MAGIC_MASK UINT64_C(0xFFFFFFFFFFFF)
+/* "BZh" and the level */
+#define PBZIP2_HEADER_BITS 32
+/* the magic number and the block's crc */
+#define PBZIP2_BLOCK_HEADER_BITS 80
+
+/* a level's blocks hold 100000 * level - 19 bytes after bzip2's first run-length pass, which can make its input a quarter longer
+ * so no more than this ever fits in exactly one block */
+#define PBZIP2_BLOCK_LEN(level) ((size_t)(level) * 80000 - 20)
+/* what BZ2_bzBuffToBuffCompress() needs at most */
+#define PBZIP2_OUT_LEN(in_len) ((in_len) + (in_len) / 100 + 600)
+
+/* a growing buffer written a bit at a time, most significant bit first like bzip2 itself */
+struct pbzip2_bits{
+	unsigned char* buf;
+	size_t cap;
+	uint64_t n_bits;
+};
+
+/* one block, compressed or decompressed on a worker thread
+ * in is the uncompressed data when compressing, or a one-block bzip2 stream put together around the block's bits when decompressing */
+struct pbzip2_block{
+	struct pbzip2_bits in;
+	unsigned char* out;
+	size_t out_len;
+	size_t out_cap;
+	/* how long the block's own bits are, starting right after the stream header of out when compressing or of in when decompressing */
+	uint64_t bit_len;
+	unsigned long crc;
+	int level;
+	int ret;
+};
+
+enum pbzip2_state{
+	PBZIP2_HEADER,
+	PBZIP2_BLOCKS,
+	PBZIP2_TRAILER,
+	PBZIP2_DONE
+};
+
+/* incremental compressor or decompressor used by zip_stream_new() and zip_decompress_stream_new() */
+struct pbzip2_stream{
+	struct block_ring ring;
+	struct pbzip2_block* blocks;
+	/* where the blocks are flushed to, which is whatever the call that flushes them was given */
+	int(*sink)(const void* data, size_t len, void* sink_data);
+	void* sink_data;
+	int level;
+	int write;
+	/* the stream's crc, made from every block's crc in order */
+	unsigned long crc;
+	/* the output when compressing, which keeps the last partial byte between flushes */
+	struct pbzip2_bits out;
+	int header_written;
+
+	/* the compressed input when decompressing, from the start of the block being looked at */
+	struct pbzip2_bits in;
+	enum pbzip2_state state;
+	/* the next bit of in to look at, and the 48 bits before it once window_len gets there */
+	uint64_t scan;
+	uint64_t window;
+	unsigned window_len;
+	/* where in in the block being looked at starts, if have_block is set, or where the end of stream marker is once it is found */
+	uint64_t block_start;
+	int have_block;
+	/* the bits of a block that turned out to be cut short by something that only looked like a magic number */
+	struct pbzip2_bits carry;
+	/* where merged blocks are put together */
+	struct pbzip2_bits scratch;
+};
+
+static int bits_reserve(struct pbzip2_bits* w, uint64_t n_bits){
+	size_t need = (size_t)((w->n_bits + n_bits + 7) / 8) + 1;
+	unsigned char* tmp;
+	size_t cap;
+
+	if (need <= w->cap){
+		return 0;
+	}
+	cap = w->cap > 0 ? w->cap : 4096;
+	while (cap < need){
+		cap *= 2;
+	}
+	tmp = realloc(w->buf, cap);
+	if (!tmp){
+		log_enomem();
+		return -1;
+	}
+	w->buf = tmp;
+	w->cap = cap;
+	return 0;
+}
+
+static uint64_t bits_get(const unsigned char* p, uint64_t pos, unsigned n){
+	uint64_t val = 0;
+	unsigned i;
+
+	for (i = 0; i < n; ++i, ++pos){
+		val = (val << 1) | ((p[pos / 8] >> (7 - pos % 8)) & 1);
+	}
+	return val;
+}
+
+static int bits_put(struct pbzip2_bits* w, uint64_t val, unsigned n){
+	if (bits_reserve(w, n) != 0){
+		return -1;
+	}
+	while (n > 0){
+		size_t i = (size_t)(w->n_bits / 8);
+		unsigned sh = (unsigned)(w->n_bits % 8);
+
+		n--;
+		if (sh == 0){
+			w->buf[i] = 0;
+		}
+		w->buf[i] |= (unsigned char)(((val >> n) & 1) << (7 - sh));
+		w->n_bits++;
+	}
+	return 0;
+}
+
+/* appends n bits of src starting at bit pos, a byte at a time whatever either side's alignment */
+static int bits_copy(struct pbzip2_bits* w, const unsigned char* src, uint64_t pos, uint64_t n){
+	const unsigned char* p = src + pos / 8;
+	unsigned src_sh = (unsigned)(pos % 8);
+
+	if (bits_reserve(w, n) != 0){
+		return -1;
+	}
+	while (n >= 8){
+		unsigned byte = src_sh ? ((p[0] << src_sh) | (p[1] >> (8 - src_sh))) & 0xFF : p[0];
+		size_t i = (size_t)(w->n_bits / 8);
+		unsigned sh = (unsigned)(w->n_bits % 8);
+
+		if (sh == 0){
+			w->buf[i] = (unsigned char)byte;
+		}
+		else{
+			w->buf[i] |= (unsigned char)(byte >> sh);
+			w->buf[i + 1] = (unsigned char)(byte << (8 - sh));
+		}
+		w->n_bits += 8;
+		p++;
+		n -= 8;
+	}
+	return n > 0 ? bits_put(w, bits_get(p, src_sh, (unsigned)n), (unsigned)n) : 0;
+}
+
+/* the end of stream marker and the stream's crc, then zeroes up to the next byte */
+static int bits_put_trailer(struct pbzip2_bits* w, unsigned long crc){
+	if (bits_put(w, PBZIP2_EOS_MAGIC, 48) != 0 || bits_put(w, crc, 32) != 0){
+		return -1;
+	}
+	w->n_bits = (w->n_bits + 7) / 8 * 8;
+	return 0;
+}
+
+static int bits_put_header(struct pbzip2_bits* w, int level){
+	return bits_put(w, ((uint64_t)'B' << 24) | ((uint64_t)'Z' << 16) | ((uint64_t)'h' << 8) | (uint64_t)('0' + level), PBZIP2_HEADER_BITS);
+}
+
+static unsigned long combine_crc(unsigned long crc, unsigned long block_crc){
+	return (((crc << 1) | (crc >> 31)) ^ block_crc) & 0xFFFFFFFFUL;
+}
+
+/* finds the one block in a stream from BZ2_bzBuffToBuffCompress(), checking that the crc after it matches the block's own */
+static int find_block(const unsigned char* p, size_t len, uint64_t* bit_len, unsigned long* crc){
+	unsigned pad;
+
+	/* the stream is padded out to a byte with up to 7 zeroes */
+	for (pad = 0; pad < 8; ++pad){
+		uint64_t eos;
+
+		if ((uint64_t)len * 8 < PBZIP2_HEADER_BITS + PBZIP2_BLOCK_HEADER_BITS + 80 + pad){
+			break;
+		}
+		eos = (uint64_t)len * 8 - pad - 80;
+		if (bits_get(p, eos, 48) == PBZIP2_EOS_MAGIC &&
+				bits_get(p, PBZIP2_HEADER_BITS, 48) == PBZIP2_BLOCK_MAGIC &&
+				bits_get(p, eos + 48, 32) == bits_get(p, PBZIP2_HEADER_BITS + 48, 32)){
+			*bit_len = eos - PBZIP2_HEADER_BITS;
+			*crc = (unsigned long)bits_get(p, eos + 48, 32);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static void compress_block(void* arg){
+	struct pbzip2_block* b = arg;
+	unsigned out_len = (unsigned)b->out_cap;
+	int res;
+
+	b->ret = -1;
+	res = BZ2_bzBuffToBuffCompress((char*)b->out, &out_len, (char*)b->in.buf, (unsigned)(b->in.n_bits / 8), b->level, 0, 0);
+	if (res != BZ_OK){
+		log_error_ex("bzip2 write error (%d)", res);
+		return;
+	}
+	if (find_block(b->out, out_len, &b->bit_len, &b->crc) != 0){
+		log_error("bzip2 did not make exactly one block");
+		return;
+	}
+	b->out_len = out_len;
+	b->ret = 0;
+}
+
+/* failing here is not logged, since a block cut short by a false magic number is expected to fail and is retried */
+static void decompress_block(void* arg){
+	struct pbzip2_block* b = arg;
+	bz_stream strm;
+	int res;
+
+	b->ret = -1;
+	b->out_len = 0;
+
+	memset(&strm, 0, sizeof(strm));
+	if (BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK){
+		return;
+	}
+	strm.next_in = (char*)b->in.buf;
+	strm.avail_in = (unsigned)((b->in.n_bits + 7) / 8);
+
+	do{
+		if (b->out_len == b->out_cap){
+			size_t cap = b->out_cap > 0 ? b->out_cap * 2 : (size_t)b->level * 100000;
+			unsigned char* tmp = realloc(b->out, cap);
+
+			if (!tmp){
+				BZ2_bzDecompressEnd(&strm);
+				return;
+			}
+			b->out = tmp;
+			b->out_cap = cap;
+		}
+		strm.next_out = (char*)b->out + b->out_len;
+		strm.avail_out = (unsigned)(b->out_cap - b->out_len);
+		res = BZ2_bzDecompress(&strm);
+		b->out_len = b->out_cap - strm.avail_out;
+		/* out of input with room to spare means the block never ended */
+		if (res == BZ_OK && strm.avail_in == 0 && strm.avail_out != 0){
+			res = BZ_UNEXPECTED_EOF;
+		}
+	}while (res == BZ_OK);
+
+	BZ2_bzDecompressEnd(&strm);
+	b->ret = res == BZ_STREAM_END ? 0 : -1;
+}
+
+static int pbzip2_flush(size_t n_queued, void* flush_data);
+static int pbzip2_decompress_flush(size_t n_queued, void* flush_data);
+
+static struct pbzip2_stream* pbzip2_new(int compression_level, unsigned flags, int write){
+	struct pbzip2_stream* ps;
+	size_t i;
+
+	ps = calloc(1, sizeof(*ps));
+	if (!ps){
+		log_enomem();
+		return NULL;
+	}
+	ps->level = compression_level >= 1 && compression_level <= 9 ? compression_level : 9;
+	ps->write = write;
+
+	br_init(&ps->ring, ZIP_GET_WORKERS(flags), write ? pbzip2_flush : pbzip2_decompress_flush, ps);
+	ps->blocks = calloc(ps->ring.n_blocks, sizeof(*ps->blocks));
+	if (!ps->blocks){
+		log_enomem();
+		pbzip2_stream_free(ps);
+		return NULL;
+	}
+	/* decompression buffers grow to fit whatever blocks show up */
+	for (i = 0; write && i < ps->ring.n_blocks; ++i){
+		struct pbzip2_block* b = &ps->blocks[i];
+
+		b->level = ps->level;
+		b->in.cap = PBZIP2_BLOCK_LEN(ps->level);
+		b->out_cap = PBZIP2_OUT_LEN(b->in.cap);
+		b->in.buf = malloc(b->in.cap);
+		b->out = malloc(b->out_cap);
+		if (!b->in.buf || !b->out){
+			log_enomem();
+			pbzip2_stream_free(ps);
+			return NULL;
+		}
+	}
+	return ps;
+}
+
+struct pbzip2_stream* pbzip2_stream_new(int compression_level, unsigned flags){
+	return pbzip2_new(compression_level, flags, 1);
+}
+
+struct pbzip2_stream* pbzip2_decompress_stream_new(unsigned flags){
+	return pbzip2_new(0, flags, 0);
+}
+
+/* splices the finished blocks' bits into the output in order */
+static int pbzip2_flush(size_t n_queued, void* flush_data){
+	struct pbzip2_stream* ps = flush_data;
+	size_t i;
+
+	if (!ps->header_written){
+		if (bits_put_header(&ps->out, ps->level) != 0){
+			return -1;
+		}
+		ps->header_written = 1;
+	}
+
+	for (i = 0; i < n_queued; ++i){
+		struct pbzip2_block* b = &ps->blocks[i];
+
+		if (b->ret != 0){
+			log_error("Failed to compress a bzip2 block");
+			return -1;
+		}
+		if (bits_copy(&ps->out, b->out, PBZIP2_HEADER_BITS, b->bit_len) != 0){
+			return -1;
+		}
+		ps->crc = combine_crc(ps->crc, b->crc);
+	}
+
+	/* the last partial byte stays behind for the next block's bits */
+	if (ps->out.n_bits >= 8){
+		size_t len = (size_t)(ps->out.n_bits / 8);
+
+		if (ps->sink(ps->out.buf, len, ps->sink_data) != 0){
+			log_error("Failed to write bzip2 output");
+			return -1;
+		}
+		ps->out.buf[0] = ps->out.buf[len];
+		ps->out.n_bits %= 8;
+	}
+	return 0;
+}
+
+/* decompresses the blocks in order, merging any that turn out to be one block cut in two by a false magic number
+ * the end of stream marker has been found by the last flush, so nothing more can come to be merged with then */
+static int pbzip2_decompress_flush(size_t n_queued, void* flush_data){
+	struct pbzip2_stream* ps = flush_data;
+	int last = ps->state == PBZIP2_TRAILER;
+	size_t i;
+
+	for (i = 0; i < n_queued; ++i){
+		struct pbzip2_block* b = &ps->blocks[i];
+
+		while (b->ret != 0){
+			struct pbzip2_block tmp;
+			size_t j;
+
+			if (i + 1 == n_queued){
+				if (last){
+					log_error("Failed to decompress a bzip2 block");
+					return -1;
+				}
+				/* the rest of it is still to come, so it goes in front of the next block */
+				ps->carry.n_bits = 0;
+				if (bits_copy(&ps->carry, b->in.buf, PBZIP2_HEADER_BITS, b->bit_len) != 0){
+					return -1;
+				}
+				n_queued = i;
+				break;
+			}
+
+			ps->scratch.n_bits = 0;
+			if (bits_put_header(&ps->scratch, b->level) != 0 ||
+					bits_copy(&ps->scratch, b->in.buf, PBZIP2_HEADER_BITS, b->bit_len) != 0 ||
+					bits_copy(&ps->scratch, ps->blocks[i + 1].in.buf, PBZIP2_HEADER_BITS, ps->blocks[i + 1].bit_len) != 0 ||
+					bits_put_trailer(&ps->scratch, b->crc) != 0){
+				return -1;
+			}
+			b->bit_len += ps->blocks[i + 1].bit_len;
+			tmp.in = b->in;
+			b->in = ps->scratch;
+			ps->scratch = tmp.in;
+
+			/* the block that was merged in moves to the end, so its buffers are kept */
+			tmp = ps->blocks[i + 1];
+			for (j = i + 1; j + 1 < n_queued; ++j){
+				ps->blocks[j] = ps->blocks[j + 1];
+			}
+			ps->blocks[n_queued - 1] = tmp;
+			n_queued--;
+
+			decompress_block(b);
+		}
+		if (i == n_queued){
+			break;
+		}
+
+		if (b->out_len > 0 && ps->sink(b->out, b->out_len, ps->sink_data) != 0){
+			log_error("Failed to write bzip2 output");
+			return -1;
+		}
+		ps->crc = combine_crc(ps->crc, b->crc);
+	}
+	return 0;
+}
+
+/* starts (de)compressing the block being filled */
+static int pbzip2_submit(struct pbzip2_stream* ps, int last){
+	return br_submit(&ps->ring, ps->write ? compress_block : decompress_block, &ps->blocks[ps->ring.n_queued], last);
+}
+
+int pbzip2_stream_write(struct pbzip2_stream* ps, const void* data, size_t len, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	const unsigned char* ptr = data;
+	size_t block_len = PBZIP2_BLOCK_LEN(ps->level);
+
+	ps->sink = sink;
+	ps->sink_data = sink_data;
+	while (len > 0){
+		struct pbzip2_block* b = &ps->blocks[ps->ring.n_queued];
+		size_t in_len = (size_t)(b->in.n_bits / 8);
+		size_t n = block_len - in_len;
+
+		if (n > len){
+			n = len;
+		}
+		memcpy(b->in.buf + in_len, ptr, n);
+		b->in.n_bits += (uint64_t)n * 8;
+		ptr += n;
+		len -= n;
+
+		if (in_len + n == block_len){
+			if (pbzip2_submit(ps, 0) != 0){
+				return -1;
+			}
+			ps->blocks[ps->ring.n_queued].in.n_bits = 0;
+		}
+	}
+	return 0;
+}
+
+int pbzip2_stream_end(struct pbzip2_stream* ps, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	ps->sink = sink;
+	ps->sink_data = sink_data;
+	/* an empty stream is only the header and the trailer */
+	if (ps->blocks[ps->ring.n_queued].in.n_bits > 0 && pbzip2_submit(ps, 1) != 0){
+		return -1;
+	}
+	if (br_flush(&ps->ring) != 0 || bits_put_trailer(&ps->out, ps->crc) != 0){
+		return -1;
+	}
+	if (sink(ps->out.buf, (size_t)(ps->out.n_bits / 8), sink_data) != 0){
+		log_error("Failed to write bzip2 trailer");
+		return -1;
+	}
+	ps->out.n_bits = 0;
+	return 0;
+}
+
+/* only called after pbzip2_stream_end(), so every block is already flushed and every worker is idle */
+void pbzip2_stream_reset(struct pbzip2_stream* ps){
+	br_reset(&ps->ring);
+	ps->crc = 0;
+	ps->header_written = 0;
+	ps->out.n_bits = 0;
+	ps->blocks[0].in.n_bits = 0;
+}
+
+/* sends the block from block_start up to end off to be decompressed */
+static int pbzip2_cut(struct pbzip2_stream* ps, uint64_t end){
+	struct pbzip2_block* b = &ps->blocks[ps->ring.n_queued];
+	uint64_t len = end - ps->block_start;
+
+	b->level = ps->level;
+	b->in.n_bits = 0;
+	if (bits_put_header(&b->in, ps->level) != 0 ||
+			(ps->carry.n_bits > 0 && bits_copy(&b->in, ps->carry.buf, 0, ps->carry.n_bits) != 0) ||
+			bits_copy(&b->in, ps->in.buf, ps->block_start, len) != 0){
+		return -1;
+	}
+	b->bit_len = ps->carry.n_bits + len;
+	b->crc = (unsigned long)bits_get(b->in.buf, PBZIP2_HEADER_BITS + 48, 32);
+	ps->carry.n_bits = 0;
+	/* one block with the stream's crc set to its own is a whole stream, which bzip2 checks like any other */
+	if (bits_put_trailer(&b->in, b->crc) != 0){
+		return -1;
+	}
+	return pbzip2_submit(ps, 0);
+}
+
+/* drops the input no block needs anymore */
+static void pbzip2_compact(struct pbzip2_stream* ps){
+	/* the bits in the window are kept too, since a magic number found there starts the next block */
+	uint64_t keep = ps->have_block || ps->state == PBZIP2_TRAILER ? ps->block_start : ps->scan - ps->window_len;
+	size_t drop = (size_t)(keep / 8);
+	size_t len = (size_t)((ps->in.n_bits - (uint64_t)drop * 8) / 8);
+
+	if (drop == 0){
+		return;
+	}
+	memmove(ps->in.buf, ps->in.buf + drop, len);
+	ps->in.n_bits -= (uint64_t)drop * 8;
+	ps->scan -= (uint64_t)drop * 8;
+	ps->block_start -= (uint64_t)drop * 8;
+}
+
+int pbzip2_decompress_stream_write(struct pbzip2_stream* ps, const void* data, size_t len, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	/* like BZ2_bzDecompress(), anything after the end of the stream is ignored */
+	if (ps->state == PBZIP2_DONE){
+		return 0;
+	}
+	ps->sink = sink;
+	ps->sink_data = sink_data;
+	if (bits_reserve(&ps->in, (uint64_t)len * 8) != 0){
+		return -1;
+	}
+	memcpy(ps->in.buf + ps->in.n_bits / 8, data, len);
+	ps->in.n_bits += (uint64_t)len * 8;
+
+	if (ps->state == PBZIP2_HEADER){
+		if (ps->in.n_bits < PBZIP2_HEADER_BITS){
+			return 0;
+		}
+		if (memcmp(ps->in.buf, "BZh", 3) != 0 || ps->in.buf[3] < '1' || ps->in.buf[3] > '9'){
+			log_error_ex("bzip2 read error (%d)", BZ_DATA_ERROR_MAGIC);
+			return -1;
+		}
+		ps->level = ps->in.buf[3] - '0';
+		ps->scan = PBZIP2_HEADER_BITS;
+		ps->state = PBZIP2_BLOCKS;
+	}
+
+	while (ps->state == PBZIP2_BLOCKS && ps->scan < ps->in.n_bits){
+		uint64_t pos;
+
+		ps->window = ((ps->window << 1) | ((ps->in.buf[ps->scan / 8] >> (7 - ps->scan % 8)) & 1)) & PBZIP2_MAGIC_MASK;
+		ps->scan++;
+		if (ps->window_len < 48){
+			ps->window_len++;
+		}
+		if (ps->window_len < 48 || (ps->window != PBZIP2_BLOCK_MAGIC && ps->window != PBZIP2_EOS_MAGIC)){
+			continue;
+		}
+
+		pos = ps->scan - 48;
+		if (ps->have_block && pbzip2_cut(ps, pos) != 0){
+			return -1;
+		}
+		ps->block_start = pos;
+		ps->have_block = ps->window == PBZIP2_BLOCK_MAGIC;
+		if (!ps->have_block){
+			ps->state = PBZIP2_TRAILER;
+		}
+	}
+
+	if (ps->state == PBZIP2_TRAILER && ps->in.n_bits >= ps->block_start + 80){
+		unsigned long crc = (unsigned long)bits_get(ps->in.buf, ps->block_start + 48, 32);
+
+		if (ps->ring.n_queued > 0 && br_flush(&ps->ring) != 0){
+			return -1;
+		}
+		/* the last block did not decompress even with nothing left to merge it with */
+		if (ps->carry.n_bits > 0){
+			log_error("Failed to decompress a bzip2 block");
+			return -1;
+		}
+		if (crc != ps->crc){
+			log_error_ex("bzip2 read error (%d)", BZ_DATA_ERROR);
+			return -1;
+		}
+		ps->state = PBZIP2_DONE;
+		return 0;
+	}
+
+	pbzip2_compact(ps);
+	return 0;
+}
+
+int pbzip2_decompress_stream_end(struct pbzip2_stream* ps){
+	if (ps->state != PBZIP2_DONE){
+		log_error("Compressed data ended unexpectedly");
+		return -1;
+	}
+	return 0;
+}
+
+void pbzip2_stream_free(struct pbzip2_stream* ps){
+	size_t i;
+
+	if (!ps){
+		return;
+	}
+	/* waits for anything still working before its buffers go away */
+	br_free(&ps->ring);
+	for (i = 0; ps->blocks && i < ps->ring.n_blocks; ++i){
+		free(ps->blocks[i].in.buf);
+		free(ps->blocks[i].out);
+	}
+	free(ps->blocks);
+	free(ps->out.buf);
+	free(ps->in.buf);
+	free(ps->carry.buf);
+	free(ps->scratch.buf);
+	free(ps);
+}
+
+#endif
@@ -0,0 +1,28 @@
+/** @file compression/zip_pbzip2.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __COMPRESSION_ZIP_PBZIP2_H
+#define __COMPRESSION_ZIP_PBZIP2_H
+
+#ifndef __ZIP_INTERNAL
+#error "Include zip.h, not zip_pbzip2.h"
+#endif
+
+#include "zip.h"
+
+struct pbzip2_stream;
+struct pbzip2_stream* pbzip2_stream_new(int compression_level, unsigned flags);
+int pbzip2_stream_write(struct pbzip2_stream* ps, const void* data, size_t len, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data);
+int pbzip2_stream_end(struct pbzip2_stream* ps, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data);
+void pbzip2_stream_reset(struct pbzip2_stream* ps);
+struct pbzip2_stream* pbzip2_decompress_stream_new(unsigned flags);
+int pbzip2_decompress_stream_write(struct pbzip2_stream* ps, const void* data, size_t len, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data);
+int pbzip2_decompress_stream_end(struct pbzip2_stream* ps);
+void pbzip2_stream_free(struct pbzip2_stream* ps);
+
+#endif
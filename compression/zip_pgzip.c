@@ -0,0 +1,336 @@
+/** @file compression/zip_pgzip.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef NO_GZIP_SUPPORT
+
+#define __ZIP_INTERNAL
+#include "zip_pgzip.h"
+#include "zip.h"
+#include "../log.h"
+#include "../filehelper.h"
+#include "../blockring.h"
+#include <zlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PGZIP_BLOCK_LEN (1 << 17) /* 128KiB, the same as pigz */
+/* deflate cannot look back any further than this anyway */
+#define PGZIP_DICT_LEN (1 << 15)
+/* deflateBound() for any settings, plus room for the sync flush at the end of every block */
+#define PGZIP_OUT_LEN (PGZIP_BLOCK_LEN + PGZIP_BLOCK_LEN / 8 + PGZIP_BLOCK_LEN / 64 + 64)
+
+/* one block of input, compressed on a worker thread into a piece of raw deflate data */
+struct pgzip_block{
+	unsigned char* in;
+	size_t in_len;
+	/* the end of the previous block, so matches can still reach back across the boundary */
+	unsigned char dict[PGZIP_DICT_LEN];
+	size_t dict_len;
+	unsigned char* out;
+	size_t out_len;
+	uLong crc;
+	int last;
+	int level;
+	int mem_level;
+	int strategy;
+	int ret;
+};
+
+/* incremental compressor used by zip_stream_new() and underneath pgzip_compress() */
+struct pgzip_stream{
+	struct block_ring ring;
+	struct pgzip_block* blocks;
+	/* where the blocks are flushed to, which is whatever the call that flushes them was given */
+	int(*sink)(const void* data, size_t len, void* sink_data);
+	void* sink_data;
+	uLong crc;
+	unsigned long total_len;
+	int header_written;
+};
+
+static void deflate_block(void* arg){
+	struct pgzip_block* b = arg;
+	z_stream strm;
+	int res;
+
+	b->ret = -1;
+	b->crc = crc32(crc32(0L, Z_NULL, 0), b->in, b->in_len);
+
+	memset(&strm, 0, sizeof(strm));
+	/* raw deflate, since the only gzip header is the one pgzip_flush() writes */
+	if (deflateInit2(&strm, b->level, Z_DEFLATED, -15, b->mem_level, b->strategy) != Z_OK){
+		log_error("Failed to initialize compression operation");
+		return;
+	}
+	if (b->dict_len > 0 && deflateSetDictionary(&strm, b->dict, b->dict_len) != Z_OK){
+		log_error("Failed to set gzip dictionary");
+		deflateEnd(&strm);
+		return;
+	}
+
+	strm.next_in = b->in;
+	strm.avail_in = b->in_len;
+	strm.next_out = b->out;
+	strm.avail_out = PGZIP_OUT_LEN;
+	/* a sync flush ends on a byte boundary without ending the deflate stream, so the next block's output can simply follow it */
+	res = deflate(&strm, b->last ? Z_FINISH : Z_SYNC_FLUSH);
+	if (b->last ? res != Z_STREAM_END : (res != Z_OK || strm.avail_in != 0 || strm.avail_out == 0)){
+		log_error_ex("gzip write error (%d)", res);
+		deflateEnd(&strm);
+		return;
+	}
+
+	b->out_len = PGZIP_OUT_LEN - strm.avail_out;
+	b->ret = 0;
+	deflateEnd(&strm);
+}
+
+static void pgzip_put_u32(unsigned char* p, unsigned long val){
+	int i;
+	for (i = 0; i < 4; ++i){
+		p[i] = (unsigned char)(val >> (i * 8));
+	}
+}
+
+/* hands the finished blocks' output to the sink in order */
+static int pgzip_flush(size_t n_queued, void* flush_data){
+	struct pgzip_stream* ps = flush_data;
+	size_t i;
+
+	if (!ps->header_written){
+		/* no file name or modification time, exactly like gzip -n */
+		unsigned char header[10] = { 0x1F, 0x8B, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 3 };
+
+		header[8] = ps->blocks[0].level == 9 ? 2 : ps->blocks[0].level == 1 ? 4 : 0;
+		if (ps->sink(header, sizeof(header), ps->sink_data) != 0){
+			log_error("Failed to write gzip header");
+			return -1;
+		}
+		ps->header_written = 1;
+	}
+
+	for (i = 0; i < n_queued; ++i){
+		struct pgzip_block* b = &ps->blocks[i];
+
+		if (b->ret != 0){
+			log_error("Failed to compress a gzip block");
+			return -1;
+		}
+		if (b->out_len > 0 && ps->sink(b->out, b->out_len, ps->sink_data) != 0){
+			log_error("Failed to write gzip output");
+			return -1;
+		}
+		ps->crc = crc32_combine(ps->crc, b->crc, (z_off_t)b->in_len);
+	}
+	return 0;
+}
+
+/* starts compressing the block being filled, then gets the next one ready */
+static int pgzip_submit(struct pgzip_stream* ps, int last){
+	struct pgzip_block* b = &ps->blocks[ps->ring.n_queued];
+	struct pgzip_block* next;
+
+	b->last = last;
+	if (br_submit(&ps->ring, deflate_block, b, last) != 0){
+		return -1;
+	}
+	if (last){
+		return 0;
+	}
+
+	/* the block that was just submitted is only read from here on, so taking its tail is safe while it compresses */
+	next = &ps->blocks[ps->ring.n_queued];
+	next->dict_len = b->in_len < PGZIP_DICT_LEN ? b->in_len : PGZIP_DICT_LEN;
+	memcpy(next->dict, b->in + b->in_len - next->dict_len, next->dict_len);
+	next->in_len = 0;
+	return 0;
+}
+
+struct pgzip_stream* pgzip_stream_new(int compression_level, unsigned flags){
+	struct pgzip_stream* ps;
+	size_t n_workers = ZIP_GET_WORKERS(flags);
+	size_t i;
+
+	ps = calloc(1, sizeof(*ps));
+	if (!ps){
+		log_enomem();
+		return NULL;
+	}
+	ps->crc = crc32(0L, Z_NULL, 0);
+
+	br_init(&ps->ring, n_workers, pgzip_flush, ps);
+	ps->blocks = calloc(ps->ring.n_blocks, sizeof(*ps->blocks));
+	if (!ps->blocks){
+		log_enomem();
+		pgzip_stream_free(ps);
+		return NULL;
+	}
+	for (i = 0; i < ps->ring.n_blocks; ++i){
+		struct pgzip_block* b = &ps->blocks[i];
+
+		b->level = compression_level >= 1 && compression_level <= 9 ? compression_level : Z_DEFAULT_COMPRESSION;
+		/* the same settings gzip_open() would use */
+		b->mem_level = flags & GZIP_LOWMEM ? 3 : 9;
+		b->strategy = flags & GZIP_HUFFMAN_ONLY ? Z_HUFFMAN_ONLY : flags & GZIP_FILTERED ? Z_FILTERED : flags & GZIP_RLE ? Z_RLE : Z_DEFAULT_STRATEGY;
+		b->in = malloc(PGZIP_BLOCK_LEN);
+		b->out = malloc(PGZIP_OUT_LEN);
+		if (!b->in || !b->out){
+			log_enomem();
+			pgzip_stream_free(ps);
+			return NULL;
+		}
+	}
+	return ps;
+}
+
+int pgzip_stream_write(struct pgzip_stream* ps, const void* data, size_t len, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	const unsigned char* ptr = data;
+
+	ps->sink = sink;
+	ps->sink_data = sink_data;
+	while (len > 0){
+		struct pgzip_block* b = &ps->blocks[ps->ring.n_queued];
+		size_t n;
+
+		/* a full block is only sent off once more data shows up, since the last one has to be marked as such */
+		if (b->in_len == PGZIP_BLOCK_LEN){
+			if (pgzip_submit(ps, 0) != 0){
+				return -1;
+			}
+			continue;
+		}
+
+		n = PGZIP_BLOCK_LEN - b->in_len;
+		if (n > len){
+			n = len;
+		}
+		memcpy(b->in + b->in_len, ptr, n);
+		b->in_len += n;
+		ps->total_len += n;
+		ptr += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int pgzip_stream_end(struct pgzip_stream* ps, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	unsigned char trailer[8];
+
+	ps->sink = sink;
+	ps->sink_data = sink_data;
+	if (pgzip_submit(ps, 1) != 0 ||
+			(ps->ring.n_queued > 0 && br_flush(&ps->ring) != 0)){
+		return -1;
+	}
+
+	pgzip_put_u32(trailer, ps->crc);
+	pgzip_put_u32(trailer + 4, ps->total_len & 0xFFFFFFFFUL);
+	if (sink(trailer, sizeof(trailer), sink_data) != 0){
+		log_error("Failed to write gzip trailer");
+		return -1;
+	}
+	return 0;
+}
+
+/* only called after pgzip_stream_end(), so every block is already flushed and every worker is idle */
+void pgzip_stream_reset(struct pgzip_stream* ps){
+	br_reset(&ps->ring);
+	ps->crc = crc32(0L, Z_NULL, 0);
+	ps->total_len = 0;
+	ps->header_written = 0;
+	ps->blocks[0].in_len = 0;
+	ps->blocks[0].dict_len = 0;
+}
+
+void pgzip_stream_free(struct pgzip_stream* ps){
+	size_t i;
+
+	if (!ps){
+		return;
+	}
+	/* waits for anything still compressing before its buffers go away */
+	br_free(&ps->ring);
+	for (i = 0; ps->blocks && i < ps->ring.n_blocks; ++i){
+		free(ps->blocks[i].in);
+		free(ps->blocks[i].out);
+	}
+	free(ps->blocks);
+	free(ps);
+}
+
+static int file_sink(const void* data, size_t len, void* fp){
+	if (fwrite(data, 1, len, fp) != len){
+		log_efwrite("gzip output");
+		return -1;
+	}
+	return 0;
+}
+
+int pgzip_compress(const char* infile, const char* outfile, int compression_level, unsigned flags){
+	unsigned char inbuf[BUFFER_LEN];
+	struct pgzip_stream* ps = NULL;
+	FILE* fp_in = NULL;
+	FILE* fp_out = NULL;
+	size_t len;
+	int ret = 0;
+
+	ps = pgzip_stream_new(compression_level, flags);
+	if (!ps){
+		log_error("Failed to start parallel gzip stream");
+		ret = -1;
+		goto cleanup;
+	}
+
+	fp_in = fopen(infile, "rb");
+	if (!fp_in){
+		log_efopen(infile);
+		ret = -1;
+		goto cleanup;
+	}
+
+	fp_out = fopen(outfile, "wb");
+	if (!fp_out){
+		log_efopen(outfile);
+		ret = -1;
+		goto cleanup;
+	}
+
+	while ((len = fread(inbuf, 1, sizeof(inbuf), fp_in)) > 0){
+		if (pgzip_stream_write(ps, inbuf, len, file_sink, fp_out) != 0){
+			log_error("Error compressing file");
+			ret = -1;
+			goto cleanup;
+		}
+	}
+	if (ferror(fp_in)){
+		log_efread(infile);
+		ret = -1;
+		goto cleanup;
+	}
+	if (pgzip_stream_end(ps, file_sink, fp_out) != 0){
+		log_error("Error compressing file");
+		ret = -1;
+		goto cleanup;
+	}
+
+cleanup:
+	pgzip_stream_free(ps);
+	fp_in ? fclose(fp_in) : 0;
+	if (fp_out && fclose(fp_out) != 0){
+		log_efclose(outfile);
+		ret = -1;
+	}
+	if (ret != 0 && fp_out){
+		remove(outfile);
+	}
+	return ret;
+}
+
+#endif
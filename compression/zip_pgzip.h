@@ -0,0 +1,27 @@
+/** @file compression/zip_pgzip.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __COMPRESSION_ZIP_PGZIP_H
+#define __COMPRESSION_ZIP_PGZIP_H
+
+#ifndef __ZIP_INTERNAL
+#error "Include zip.h, not zip_pgzip.h"
+#endif
+
+#include "zip.h"
+
+int pgzip_compress(const char* infile, const char* outfile, int compression_level, unsigned flags);
+
+struct pgzip_stream;
+struct pgzip_stream* pgzip_stream_new(int compression_level, unsigned flags);
+int pgzip_stream_write(struct pgzip_stream* ps, const void* data, size_t len, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data);
+int pgzip_stream_end(struct pgzip_stream* ps, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data);
+void pgzip_stream_reset(struct pgzip_stream* ps);
+void pgzip_stream_free(struct pgzip_stream* ps);
+
+#endif
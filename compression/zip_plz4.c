@@ -0,0 +1,477 @@
+/** @file compression/zip_plz4.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef NO_LZ4_SUPPORT
+
+#define __ZIP_INTERNAL
+#include "zip_plz4.h"
+#include "zip_lz4.h"
+#include "zip.h"
+#include "../log.h"
+#include "../blockring.h"
+#include <lz4.h>
+#include <lz4hc.h>
+#include <lz4frame.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PLZ4_BLOCK_LEN (1 << 20) /* LZ4F_max1MB */
+/* the magic number and FLG, which tell how long the rest of the header is */
+#define PLZ4_HEADER_START 5
+/* the magic number, FLG, BD, an 8 byte content size, a 4 byte dictionary ID and the header checksum */
+#define PLZ4_HEADER_MAX 19
+#define PLZ4_FLG_VERSION      0xC0
+#define PLZ4_FLG_INDEPENDENT  0x20
+#define PLZ4_FLG_BLOCK_CHECK  0x10
+#define PLZ4_FLG_CONTENT_SIZE 0x08
+#define PLZ4_FLG_CONTENT_CHECK 0x04
+#define PLZ4_FLG_DICT_ID      0x01
+/* the high bit of a block's size means it was stored as it is */
+#define PLZ4_STORED 0x80000000UL
+
+/* one block, (de)compressed on a worker thread without looking at any other block */
+struct plz4_block{
+	unsigned char* in;
+	size_t in_len;
+	/* the block's size followed by its data when compressing, the original data when decompressing */
+	unsigned char* out;
+	size_t out_len;
+	/* how much out can hold when decompressing */
+	size_t out_cap;
+	int stored;
+	/* LZ4_compress_HC_extStateHC() level, or 0 for LZ4_compress_fast_extState() */
+	int level;
+	/* the compressor's state, kept from block to block instead of being allocated every time */
+	void* state;
+	int ret;
+};
+
+enum plz4_state{
+	PLZ4_HEADER,
+	PLZ4_BLOCK_SIZE,
+	PLZ4_BLOCK_DATA,
+	PLZ4_DONE
+};
+
+/* incremental (de)compressor used by zip_stream_new() and zip_decompress_stream_new() when more than one worker is asked for */
+struct plz4_stream{
+	struct block_ring ring;
+	struct plz4_block* blocks;
+	/* where the blocks are flushed to, which is whatever the call that flushes them was given */
+	int(*sink)(const void* data, size_t len, void* sink_data);
+	void* sink_data;
+	/* the frame header, which is written before the first block when compressing */
+	unsigned char head[PLZ4_HEADER_MAX];
+	size_t head_len;
+	int header_written;
+	/* only used when decompressing */
+	enum plz4_state state;
+	size_t head_needed;
+	unsigned char size_buf[4];
+	size_t size_len;
+	size_t block_len;
+	size_t block_needed;
+	/* frames this cannot split up (linked blocks, checksums or dictionaries) go to the regular decompressor instead */
+	struct lz4_stream* serial;
+};
+
+static void put_u32(unsigned char* p, unsigned long val){
+	int i;
+	for (i = 0; i < 4; ++i){
+		p[i] = (unsigned char)(val >> (i * 8));
+	}
+}
+
+static unsigned long get_u32(const unsigned char* p){
+	return (unsigned long)p[0] | ((unsigned long)p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+static void compress_block(void* arg){
+	struct plz4_block* b = arg;
+	int len;
+
+	/* anything that does not come out smaller is not worth the decompressor's time */
+	if (b->level > 0){
+		len = LZ4_compress_HC_extStateHC(b->state, (const char*)b->in, (char*)b->out + 4, (int)b->in_len, (int)b->in_len - 1, b->level);
+	}
+	else{
+		len = LZ4_compress_fast_extState(b->state, (const char*)b->in, (char*)b->out + 4, (int)b->in_len, (int)b->in_len - 1, 1);
+	}
+
+	if (len <= 0){
+		put_u32(b->out, b->in_len | PLZ4_STORED);
+		memcpy(b->out + 4, b->in, b->in_len);
+		b->out_len = b->in_len + 4;
+	}
+	else{
+		put_u32(b->out, len);
+		b->out_len = len + 4;
+	}
+	b->ret = 0;
+}
+
+static void decompress_block(void* arg){
+	struct plz4_block* b = arg;
+	int len;
+
+	b->ret = -1;
+	if (b->stored){
+		memcpy(b->out, b->in, b->in_len);
+		b->out_len = b->in_len;
+		b->ret = 0;
+		return;
+	}
+
+	len = LZ4_decompress_safe((const char*)b->in, (char*)b->out, (int)b->in_len, (int)b->out_cap);
+	if (len < 0){
+		log_error("LZ4 decompression error (corrupt block)");
+		return;
+	}
+	b->out_len = len;
+	b->ret = 0;
+}
+
+/* hands the finished blocks' output to the sink in order */
+static int plz4_flush(size_t n_queued, void* flush_data){
+	struct plz4_stream* ps = flush_data;
+	size_t i;
+
+	if (!ps->header_written){
+		if (ps->sink(ps->head, ps->head_len, ps->sink_data) != 0){
+			log_error("Failed to write LZ4 header");
+			return -1;
+		}
+		ps->header_written = 1;
+	}
+
+	for (i = 0; i < n_queued; ++i){
+		struct plz4_block* b = &ps->blocks[i];
+
+		if (b->ret != 0){
+			log_error("Failed to (de)compress an lz4 block");
+			return -1;
+		}
+		if (b->out_len > 0 && ps->sink(b->out, b->out_len, ps->sink_data) != 0){
+			log_error("Failed to write lz4 output");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* starts on the block being filled, then gets the next one ready */
+static int plz4_submit(struct plz4_stream* ps, void(*func)(void*), int last){
+	struct plz4_block* b = &ps->blocks[ps->ring.n_queued];
+
+	b->ret = -1;
+	if (br_submit(&ps->ring, func, b, last) != 0){
+		return -1;
+	}
+	ps->blocks[ps->ring.n_queued].in_len = 0;
+	return 0;
+}
+
+static struct plz4_stream* plz4_alloc(unsigned flags){
+	struct plz4_stream* ps;
+
+	ps = calloc(1, sizeof(*ps));
+	if (!ps){
+		log_enomem();
+		return NULL;
+	}
+
+	br_init(&ps->ring, ZIP_GET_WORKERS(flags), plz4_flush, ps);
+	ps->blocks = calloc(ps->ring.n_blocks, sizeof(*ps->blocks));
+	if (!ps->blocks){
+		log_enomem();
+		plz4_stream_free(ps);
+		return NULL;
+	}
+	return ps;
+}
+
+struct plz4_stream* plz4_stream_new(int compression_level, unsigned flags){
+	struct plz4_stream* ps;
+	LZ4F_compressionContext_t ctx = NULL;
+	LZ4F_preferences_t prefs;
+	size_t state_len;
+	size_t res;
+	size_t i;
+
+	if (!(ps = plz4_alloc(flags))){
+		return NULL;
+	}
+
+	/* LZ4F writes the header, checksum included, while the blocks themselves are plain LZ4 blocks */
+	memset(&prefs, 0, sizeof(prefs));
+	prefs.frameInfo.blockSizeID = LZ4F_max1MB;
+	prefs.frameInfo.blockMode = LZ4F_blockIndependent;
+	prefs.frameInfo.contentChecksumFlag = LZ4F_noContentChecksum;
+	prefs.frameInfo.frameType = LZ4F_frame;
+	res = LZ4F_createCompressionContext(&ctx, LZ4F_VERSION);
+	if (LZ4F_isError(res)){
+		log_error("Failed to create LZ4 compression context");
+		plz4_stream_free(ps);
+		return NULL;
+	}
+	res = LZ4F_compressBegin(ctx, ps->head, sizeof(ps->head), &prefs);
+	LZ4F_freeCompressionContext(ctx);
+	if (LZ4F_isError(res)){
+		log_error_ex("Failed to write LZ4 header (%s)", LZ4F_getErrorName(res));
+		plz4_stream_free(ps);
+		return NULL;
+	}
+	ps->head_len = res;
+
+	state_len = LZ4_sizeofStateHC() > LZ4_sizeofState() ? LZ4_sizeofStateHC() : LZ4_sizeofState();
+	for (i = 0; i < ps->ring.n_blocks; ++i){
+		struct plz4_block* b = &ps->blocks[i];
+
+		/* the same levels lz4_stream_new() uses */
+		b->level = compression_level >= 1 && compression_level <= 9 ? compression_level + 3 : 0;
+		b->in = malloc(PLZ4_BLOCK_LEN);
+		b->out = malloc(PLZ4_BLOCK_LEN + 4);
+		b->state = malloc(state_len);
+		if (!b->in || !b->out || !b->state){
+			log_enomem();
+			plz4_stream_free(ps);
+			return NULL;
+		}
+	}
+	return ps;
+}
+
+int plz4_stream_write(struct plz4_stream* ps, const void* data, size_t len, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	const unsigned char* ptr = data;
+
+	ps->sink = sink;
+	ps->sink_data = sink_data;
+	while (len > 0){
+		struct plz4_block* b = &ps->blocks[ps->ring.n_queued];
+		size_t n = PLZ4_BLOCK_LEN - b->in_len;
+
+		if (n > len){
+			n = len;
+		}
+		memcpy(b->in + b->in_len, ptr, n);
+		b->in_len += n;
+		ptr += n;
+		len -= n;
+
+		if (b->in_len == PLZ4_BLOCK_LEN && plz4_submit(ps, compress_block, 0) != 0){
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int plz4_stream_end(struct plz4_stream* ps, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	static const unsigned char end_mark[4] = { 0, 0, 0, 0 };
+
+	ps->sink = sink;
+	ps->sink_data = sink_data;
+	if (ps->blocks[ps->ring.n_queued].in_len > 0 && plz4_submit(ps, compress_block, 1) != 0){
+		return -1;
+	}
+	if (br_flush(&ps->ring) != 0){
+		return -1;
+	}
+	if (sink(end_mark, sizeof(end_mark), sink_data) != 0){
+		log_error("Failed to write lz4 output");
+		return -1;
+	}
+	return 0;
+}
+
+/* only called after plz4_stream_end(), so every block is already written and every worker is idle */
+void plz4_stream_reset(struct plz4_stream* ps){
+	br_reset(&ps->ring);
+	ps->header_written = 0;
+	ps->blocks[0].in_len = 0;
+}
+
+struct plz4_stream* plz4_decompress_stream_new(unsigned flags){
+	struct plz4_stream* ps;
+
+	if (!(ps = plz4_alloc(flags))){
+		return NULL;
+	}
+	ps->head_needed = PLZ4_HEADER_START;
+	/* the output starts with the first block */
+	ps->header_written = 1;
+	return ps;
+}
+
+/* hands everything seen so far to the regular decompressor, which takes over from here */
+static int plz4_use_serial(struct plz4_stream* ps, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	if (!(ps->serial = lz4_decompress_stream_new())){
+		return -1;
+	}
+	return lz4_decompress_stream_write(ps->serial, ps->head, ps->head_len, sink, sink_data);
+}
+
+/* called once the whole header is in, which LZ4F checks before any block is allocated */
+static int plz4_start_frame(struct plz4_stream* ps){
+	LZ4F_dctx* dctx = NULL;
+	LZ4F_frameInfo_t info;
+	size_t len = ps->head_len;
+	size_t res;
+	size_t i;
+
+	res = LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
+	if (LZ4F_isError(res)){
+		log_error("Failed to create LZ4 decompression context");
+		return -1;
+	}
+	memset(&info, 0, sizeof(info));
+	res = LZ4F_getFrameInfo(dctx, &info, ps->head, &len);
+	LZ4F_freeDecompressionContext(dctx);
+	if (LZ4F_isError(res)){
+		log_error_ex("LZ4 decompression error (%s)", LZ4F_getErrorName(res));
+		return -1;
+	}
+
+	ps->block_len = info.blockSizeID >= LZ4F_max64KB && info.blockSizeID <= LZ4F_max4MB ? (size_t)1 << (8 + 2 * info.blockSizeID) : (size_t)1 << 16;
+	for (i = 0; i < ps->ring.n_blocks; ++i){
+		struct plz4_block* b = &ps->blocks[i];
+
+		b->in = malloc(ps->block_len);
+		b->out = malloc(ps->block_len);
+		b->out_cap = ps->block_len;
+		if (!b->in || !b->out){
+			log_enomem();
+			return -1;
+		}
+	}
+	ps->state = PLZ4_BLOCK_SIZE;
+	return 0;
+}
+
+int plz4_decompress_stream_write(struct plz4_stream* ps, const void* data, size_t len, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	const unsigned char* ptr = data;
+
+	ps->sink = sink;
+	ps->sink_data = sink_data;
+	while (len > 0 && ps->state != PLZ4_DONE){
+		struct plz4_block* b = &ps->blocks[ps->ring.n_queued];
+		size_t n;
+
+		if (ps->serial){
+			return lz4_decompress_stream_write(ps->serial, ptr, len, sink, sink_data);
+		}
+
+		switch (ps->state){
+		case PLZ4_HEADER:
+			n = ps->head_needed - ps->head_len < len ? ps->head_needed - ps->head_len : len;
+			memcpy(ps->head + ps->head_len, ptr, n);
+			ps->head_len += n;
+			ptr += n;
+			len -= n;
+			if (ps->head_len < ps->head_needed){
+				break;
+			}
+
+			if (ps->head_needed == PLZ4_HEADER_START){
+				unsigned flg = ps->head[4];
+
+				/* anything else (e.g. a skippable frame) is left to LZ4F */
+				if (get_u32(ps->head) != 0x184D2204UL || (flg & PLZ4_FLG_VERSION) != 0x40 || !(flg & PLZ4_FLG_INDEPENDENT) ||
+						(flg & (PLZ4_FLG_BLOCK_CHECK | PLZ4_FLG_CONTENT_CHECK | PLZ4_FLG_DICT_ID))){
+					if (plz4_use_serial(ps, sink, sink_data) != 0){
+						return -1;
+					}
+					break;
+				}
+				/* BD and the header checksum, plus the content size if there is one */
+				ps->head_needed = PLZ4_HEADER_START + 2 + (flg & PLZ4_FLG_CONTENT_SIZE ? 8 : 0);
+				break;
+			}
+			if (plz4_start_frame(ps) != 0){
+				return -1;
+			}
+			break;
+		case PLZ4_BLOCK_SIZE:
+			n = sizeof(ps->size_buf) - ps->size_len < len ? sizeof(ps->size_buf) - ps->size_len : len;
+			memcpy(ps->size_buf + ps->size_len, ptr, n);
+			ps->size_len += n;
+			ptr += n;
+			len -= n;
+			if (ps->size_len < sizeof(ps->size_buf)){
+				break;
+			}
+			ps->size_len = 0;
+
+			/* a size of 0 marks the end of the frame */
+			if (get_u32(ps->size_buf) == 0){
+				if (br_flush(&ps->ring) != 0){
+					return -1;
+				}
+				ps->state = PLZ4_DONE;
+				break;
+			}
+			b->stored = (get_u32(ps->size_buf) & PLZ4_STORED) != 0;
+			ps->block_needed = get_u32(ps->size_buf) & ~PLZ4_STORED;
+			if (ps->block_needed > ps->block_len){
+				log_error("LZ4 decompression error (block is larger than the frame allows)");
+				return -1;
+			}
+			b->in_len = 0;
+			ps->state = PLZ4_BLOCK_DATA;
+			break;
+		case PLZ4_BLOCK_DATA:
+			n = ps->block_needed < len ? ps->block_needed : len;
+			memcpy(b->in + b->in_len, ptr, n);
+			b->in_len += n;
+			ps->block_needed -= n;
+			ptr += n;
+			len -= n;
+			if (ps->block_needed > 0){
+				break;
+			}
+			if (plz4_submit(ps, decompress_block, 0) != 0){
+				return -1;
+			}
+			ps->state = PLZ4_BLOCK_SIZE;
+			break;
+		default:
+			;
+		}
+	}
+	return 0;
+}
+
+int plz4_decompress_stream_end(struct plz4_stream* ps){
+	if (ps->serial){
+		return lz4_decompress_stream_end(ps->serial);
+	}
+	if (ps->state != PLZ4_DONE){
+		log_error("Compressed data ended unexpectedly");
+		return -1;
+	}
+	return 0;
+}
+
+void plz4_stream_free(struct plz4_stream* ps){
+	size_t i;
+
+	if (!ps){
+		return;
+	}
+	/* waits for anything still (de)compressing before its buffers go away */
+	br_free(&ps->ring);
+	for (i = 0; ps->blocks && i < ps->ring.n_blocks; ++i){
+		free(ps->blocks[i].in);
+		free(ps->blocks[i].out);
+		free(ps->blocks[i].state);
+	}
+	free(ps->blocks);
+	lz4_stream_free(ps->serial);
+	free(ps);
+}
+
+#endif
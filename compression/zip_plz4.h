@@ -0,0 +1,28 @@
+/** @file compression/zip_plz4.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __COMPRESSION_ZIP_PLZ4_H
+#define __COMPRESSION_ZIP_PLZ4_H
+
+#ifndef __ZIP_INTERNAL
+#error "Include zip.h, not zip_plz4.h"
+#endif
+
+#include "zip.h"
+
+struct plz4_stream;
+struct plz4_stream* plz4_stream_new(int compression_level, unsigned flags);
+int plz4_stream_write(struct plz4_stream* ps, const void* data, size_t len, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data);
+int plz4_stream_end(struct plz4_stream* ps, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data);
+void plz4_stream_reset(struct plz4_stream* ps);
+struct plz4_stream* plz4_decompress_stream_new(unsigned flags);
+int plz4_decompress_stream_write(struct plz4_stream* ps, const void* data, size_t len, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data);
+int plz4_decompress_stream_end(struct plz4_stream* ps);
+void plz4_stream_free(struct plz4_stream* ps);
+
+#endif
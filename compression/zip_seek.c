@@ -0,0 +1,560 @@
+/** @file compression/zip_seek.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#define __ZIP_INTERNAL
+#include "zip_seek.h"
+#include "zip.h"
+#include "../log.h"
+#include "../filehelper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* what ZIP_SEEKABLE_MIB() counts in */
+#define SEEK_UNIT (1UL << 20)
+#define SEEK_VERSION 1
+/* the magic number, the version, the compressor and the block size */
+#define SEEK_HEADER_LEN 8
+/* every block is preceded by its compressed length, and a length of 0 ends them */
+#define SEEK_SIZE_LEN 4
+/* the compressed and original length of each block */
+#define SEEK_ENTRY_LEN 8
+/* the original length of everything, the number of blocks, and SEEK_FOOTER_MAGIC */
+#define SEEK_FOOTER_LEN 16
+#define SEEK_FOOTER_MAGIC "EZSX"
+
+/*
+ * The layout is:
+ *   the header
+ *   for each block: its compressed length, then the block, which is a whole stream of the compressor
+ *   a compressed length of 0
+ *   the index: each block's compressed and original length, in order
+ *   the footer
+ * Every number is little-endian.
+ * A decompression stream reads it front to back and ignores the index, and zip_decompress_range() reads the footer and index first.
+ */
+
+enum seek_state{
+	SEEK_HEADER,
+	SEEK_BLOCK_SIZE,
+	SEEK_BLOCK_DATA,
+	SEEK_DONE
+};
+
+/* incremental (de)compressor used by zip_stream_new() when ZIP_SEEKABLE_MIB() is set, and by a decompression stream once it sees SEEK_MAGIC */
+struct seek_stream{
+	enum compressor c_type;
+	int level;
+	/* without the seekable bits, which are given to each block's stream */
+	unsigned flags;
+	const struct zip_dict* zd;
+	/* the stream of the block being (de)compressed, or NULL between blocks */
+	struct ZIP_FILE* block;
+	/* only used when compressing */
+	size_t block_len;
+	size_t block_in;
+	/* the compressed block, which is held back since its length goes first */
+	unsigned char* out;
+	size_t out_len;
+	size_t out_size;
+	/* two entries per block: the compressed and the original length */
+	unsigned long* index;
+	size_t n_blocks;
+	size_t index_size;
+	uint64_t total_len;
+	int header_written;
+	/* only used when decompressing */
+	enum seek_state state;
+	unsigned char head[SEEK_HEADER_LEN];
+	size_t head_len;
+	unsigned long remaining;
+	int(*sink)(const void* data, size_t len, void* sink_data);
+	void* sink_data;
+};
+
+static void put_u32(unsigned char* p, unsigned long val){
+	p[0] = val & 0xFF;
+	p[1] = (val >> 8) & 0xFF;
+	p[2] = (val >> 16) & 0xFF;
+	p[3] = (val >> 24) & 0xFF;
+}
+
+static void put_u64(unsigned char* p, uint64_t val){
+	put_u32(p, (unsigned long)(val & 0xFFFFFFFFUL));
+	put_u32(p + 4, (unsigned long)(val >> 32));
+}
+
+static unsigned long get_u32(const unsigned char* p){
+	return p[0] | ((unsigned long)p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+static uint64_t get_u64(const unsigned char* p){
+	return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+static unsigned seek_block_flags(unsigned flags){
+	return flags & ~ZIP_SEEKABLE_MIB(0xFF);
+}
+
+struct seek_stream* seek_stream_new(enum compressor c_type, int compression_level, unsigned flags){
+	struct seek_stream* ss;
+
+	if (!(ss = calloc(1, sizeof(*ss)))){
+		log_enomem();
+		return NULL;
+	}
+	ss->c_type = c_type;
+	ss->level = compression_level;
+	ss->flags = seek_block_flags(flags);
+	ss->block_len = ZIP_GET_SEEKABLE_MIB(flags) * SEEK_UNIT;
+	return ss;
+}
+
+void seek_stream_use_dict(struct seek_stream* ss, const struct zip_dict* zd){
+	ss->zd = zd;
+}
+
+/* collects a block's compressed output until the block is done */
+static int seek_block_sink(const void* data, size_t len, void* sink_data){
+	struct seek_stream* ss = sink_data;
+
+	if (ss->out_len + len > ss->out_size){
+		size_t size = ss->out_size ? ss->out_size : BUFFER_LEN;
+		unsigned char* tmp;
+
+		while (size < ss->out_len + len){
+			size *= 2;
+		}
+		if (!(tmp = realloc(ss->out, size))){
+			log_enomem();
+			return -1;
+		}
+		ss->out = tmp;
+		ss->out_size = size;
+	}
+	memcpy(ss->out + ss->out_len, data, len);
+	ss->out_len += len;
+	return 0;
+}
+
+static int seek_block_start(struct seek_stream* ss){
+	if (!(ss->block = zip_stream_new(ss->c_type, ss->level, ss->flags, seek_block_sink, ss))){
+		return -1;
+	}
+	if (ss->zd && zip_stream_use_dict(ss->block, ss->zd) != 0){
+		zip_stream_free(ss->block);
+		ss->block = NULL;
+		return -1;
+	}
+	ss->block_in = 0;
+	ss->out_len = 0;
+	return 0;
+}
+
+/* finishes the block and hands it to the sink behind its length */
+static int seek_block_end(struct seek_stream* ss, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	unsigned char size[SEEK_SIZE_LEN];
+	int res;
+
+	res = zip_stream_finish(ss->block);
+	/* a finished stream is kept for the next block */
+	zip_stream_free(ss->block);
+	ss->block = NULL;
+	if (res != 0){
+		return -1;
+	}
+
+	if (ss->n_blocks * 2 + 2 > ss->index_size){
+		size_t size = ss->index_size ? ss->index_size * 2 : 64;
+		unsigned long* tmp = realloc(ss->index, size * sizeof(*tmp));
+
+		if (!tmp){
+			log_enomem();
+			return -1;
+		}
+		ss->index = tmp;
+		ss->index_size = size;
+	}
+	ss->index[ss->n_blocks * 2] = (unsigned long)ss->out_len;
+	ss->index[ss->n_blocks * 2 + 1] = (unsigned long)ss->block_in;
+	ss->n_blocks++;
+
+	put_u32(size, (unsigned long)ss->out_len);
+	if (sink(size, sizeof(size), sink_data) != 0 || sink(ss->out, ss->out_len, sink_data) != 0){
+		return -1;
+	}
+	return 0;
+}
+
+static int seek_write_header(struct seek_stream* ss, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	unsigned char header[SEEK_HEADER_LEN];
+
+	memcpy(header, SEEK_MAGIC, SEEK_MAGIC_LEN);
+	header[5] = SEEK_VERSION;
+	header[6] = (unsigned char)ss->c_type;
+	header[7] = (unsigned char)(ss->block_len / SEEK_UNIT);
+	ss->header_written = 1;
+	return sink(header, sizeof(header), sink_data);
+}
+
+int seek_stream_write(struct seek_stream* ss, const void* data, size_t len, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	const unsigned char* ptr = data;
+
+	if (!ss->header_written && seek_write_header(ss, sink, sink_data) != 0){
+		return -1;
+	}
+	while (len > 0){
+		size_t n;
+
+		if (!ss->block && seek_block_start(ss) != 0){
+			return -1;
+		}
+		n = ss->block_len - ss->block_in;
+		if (n > len){
+			n = len;
+		}
+		if (zip_stream_write(ss->block, ptr, n) != 0){
+			return -1;
+		}
+		ss->block_in += n;
+		ss->total_len += n;
+		ptr += n;
+		len -= n;
+		if (ss->block_in == ss->block_len && seek_block_end(ss, sink, sink_data) != 0){
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int seek_stream_end(struct seek_stream* ss, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	unsigned char buf[SEEK_FOOTER_LEN];
+	size_t i;
+
+	if (!ss->header_written && seek_write_header(ss, sink, sink_data) != 0){
+		return -1;
+	}
+	if (ss->block && seek_block_end(ss, sink, sink_data) != 0){
+		return -1;
+	}
+
+	put_u32(buf, 0);
+	if (sink(buf, SEEK_SIZE_LEN, sink_data) != 0){
+		return -1;
+	}
+	for (i = 0; i < ss->n_blocks; ++i){
+		put_u32(buf, ss->index[i * 2]);
+		put_u32(buf + 4, ss->index[i * 2 + 1]);
+		if (sink(buf, SEEK_ENTRY_LEN, sink_data) != 0){
+			return -1;
+		}
+	}
+	put_u64(buf, ss->total_len);
+	put_u32(buf + 8, (unsigned long)ss->n_blocks);
+	memcpy(buf + 12, SEEK_FOOTER_MAGIC, 4);
+	return sink(buf, SEEK_FOOTER_LEN, sink_data);
+}
+
+struct seek_stream* seek_decompress_stream_new(enum compressor c_type, unsigned flags){
+	struct seek_stream* ss;
+
+	if (!(ss = calloc(1, sizeof(*ss)))){
+		log_enomem();
+		return NULL;
+	}
+	ss->c_type = c_type;
+	ss->flags = seek_block_flags(flags);
+	ss->state = SEEK_HEADER;
+	return ss;
+}
+
+/* the header says which compressor made the blocks, which has to be the one the stream was started for */
+static int seek_check_header(const struct seek_stream* ss, const unsigned char* header){
+	if (memcmp(header, SEEK_MAGIC, SEEK_MAGIC_LEN) != 0){
+		log_error("Seekable data does not start with its magic number");
+		return -1;
+	}
+	if (header[5] > SEEK_VERSION){
+		log_error_ex("Seekable data version %d is newer than this version of ezbackup supports", header[5]);
+		return -1;
+	}
+	if (header[6] != (unsigned char)ss->c_type){
+		log_error("Seekable data was made with a different compressor");
+		return -1;
+	}
+	return 0;
+}
+
+static int seek_decompress_block_start(struct seek_stream* ss){
+	if (!(ss->block = zip_decompress_stream_new(ss->c_type, ss->flags, ss->sink, ss->sink_data))){
+		return -1;
+	}
+	if (ss->zd && zip_stream_use_dict(ss->block, ss->zd) != 0){
+		zip_stream_free(ss->block);
+		ss->block = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+int seek_decompress_stream_write(struct seek_stream* ss, const void* data, size_t len, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	const unsigned char* ptr = data;
+
+	ss->sink = sink;
+	ss->sink_data = sink_data;
+	while (len > 0){
+		size_t n;
+
+		switch (ss->state){
+		case SEEK_HEADER:
+		case SEEK_BLOCK_SIZE:{
+			size_t need = ss->state == SEEK_HEADER ? SEEK_HEADER_LEN : SEEK_SIZE_LEN;
+
+			n = need - ss->head_len;
+			if (n > len){
+				n = len;
+			}
+			memcpy(ss->head + ss->head_len, ptr, n);
+			ss->head_len += n;
+			if (ss->head_len < need){
+				break;
+			}
+			ss->head_len = 0;
+			if (ss->state == SEEK_HEADER){
+				if (seek_check_header(ss, ss->head) != 0){
+					return -1;
+				}
+				ss->state = SEEK_BLOCK_SIZE;
+				break;
+			}
+			/* the index after the last block is only for zip_decompress_range() */
+			if ((ss->remaining = get_u32(ss->head)) == 0){
+				ss->state = SEEK_DONE;
+				break;
+			}
+			if (seek_decompress_block_start(ss) != 0){
+				return -1;
+			}
+			ss->state = SEEK_BLOCK_DATA;
+			break;
+		}
+		case SEEK_BLOCK_DATA:{
+			int res;
+
+			n = ss->remaining < len ? ss->remaining : len;
+			if (zip_stream_write(ss->block, ptr, n) != 0){
+				return -1;
+			}
+			ss->remaining -= n;
+			if (ss->remaining > 0){
+				break;
+			}
+			res = zip_stream_finish(ss->block);
+			zip_stream_free(ss->block);
+			ss->block = NULL;
+			if (res != 0){
+				return -1;
+			}
+			ss->state = SEEK_BLOCK_SIZE;
+			break;
+		}
+		default:
+			n = len;
+		}
+		ptr += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int seek_decompress_stream_end(struct seek_stream* ss){
+	if (ss->state != SEEK_DONE){
+		log_error("Compressed data ended unexpectedly");
+		return -1;
+	}
+	return 0;
+}
+
+void seek_stream_free(struct seek_stream* ss){
+	if (!ss){
+		return;
+	}
+	zip_stream_free(ss->block);
+	free(ss->out);
+	free(ss->index);
+	free(ss);
+}
+
+/* hands only the part of a block's output that falls in the range to the real sink */
+struct range_sink{
+	uint64_t skip;
+	uint64_t left;
+	int(*sink)(const void* data, size_t len, void* sink_data);
+	void* sink_data;
+};
+
+static int range_sink_write(const void* data, size_t len, void* sink_data){
+	struct range_sink* rs = sink_data;
+	const unsigned char* ptr = data;
+
+	if (rs->skip >= len){
+		rs->skip -= len;
+		return 0;
+	}
+	ptr += rs->skip;
+	len -= (size_t)rs->skip;
+	rs->skip = 0;
+	if (len > rs->left){
+		len = (size_t)rs->left;
+	}
+	rs->left -= len;
+	return len > 0 ? rs->sink(ptr, len, rs->sink_data) : 0;
+}
+
+int zip_decompress_range(FILE* fp, enum compressor c_type, unsigned flags, const struct zip_dict* zd, uint64_t offset, uint64_t len, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	struct seek_stream* ss = NULL;
+	unsigned char header[SEEK_HEADER_LEN];
+	unsigned char footer[SEEK_FOOTER_LEN];
+	unsigned char* index = NULL;
+	unsigned char* block = NULL;
+	size_t block_size = 0;
+	struct range_sink rs;
+	long base;
+	long end;
+	uint64_t total_len;
+	uint64_t pos = 0;
+	uint64_t at;
+	unsigned long n_blocks;
+	unsigned long i;
+	int ret = 0;
+
+	return_ifnull(fp, -1);
+	return_ifnull(sink, -1);
+
+	if ((base = ftell(fp)) < 0){
+		log_error("Failed to find where the seekable data starts");
+		return -1;
+	}
+	if (fread(header, 1, sizeof(header), fp) != sizeof(header) || memcmp(header, SEEK_MAGIC, SEEK_MAGIC_LEN) != 0){
+		if (ferror(fp)){
+			log_efread("compressed file");
+			return -1;
+		}
+		return fseek(fp, base, SEEK_SET) == 0 ? 1 : -1;
+	}
+
+	if (!(ss = seek_decompress_stream_new(c_type, flags))){
+		return -1;
+	}
+	if (seek_check_header(ss, header) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+	if (fseek(fp, 0, SEEK_END) != 0 || (end = ftell(fp)) < 0 ||
+			end - base < SEEK_HEADER_LEN + SEEK_SIZE_LEN + SEEK_FOOTER_LEN ||
+			fseek(fp, end - SEEK_FOOTER_LEN, SEEK_SET) != 0 ||
+			fread(footer, 1, sizeof(footer), fp) != sizeof(footer) ||
+			memcmp(footer + 12, SEEK_FOOTER_MAGIC, 4) != 0){
+		log_error("Seekable data does not end with its index");
+		ret = -1;
+		goto cleanup;
+	}
+	total_len = get_u64(footer);
+	n_blocks = get_u32(footer + 8);
+	if ((uint64_t)n_blocks * SEEK_ENTRY_LEN > (uint64_t)(end - base - SEEK_HEADER_LEN - SEEK_SIZE_LEN - SEEK_FOOTER_LEN)){
+		log_error("Seekable data has a damaged index");
+		ret = -1;
+		goto cleanup;
+	}
+	if (n_blocks > 0 && !(index = malloc(n_blocks * SEEK_ENTRY_LEN))){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+	if (n_blocks > 0 && (fseek(fp, end - SEEK_FOOTER_LEN - (long)(n_blocks * SEEK_ENTRY_LEN), SEEK_SET) != 0 ||
+			fread(index, SEEK_ENTRY_LEN, n_blocks, fp) != n_blocks)){
+		log_efread("compressed file");
+		ret = -1;
+		goto cleanup;
+	}
+
+	/* nothing past the end of the data to hand out */
+	if (offset >= total_len){
+		goto cleanup;
+	}
+	if (len > total_len - offset){
+		len = total_len - offset;
+	}
+
+	ss->zd = zd;
+	ss->sink = range_sink_write;
+	ss->sink_data = &rs;
+	rs.sink = sink;
+	rs.sink_data = sink_data;
+	rs.left = len;
+
+	at = (uint64_t)base + SEEK_HEADER_LEN;
+	for (i = 0; i < n_blocks && rs.left > 0; ++i){
+		unsigned long comp_len = get_u32(index + i * SEEK_ENTRY_LEN);
+		unsigned long orig_len = get_u32(index + i * SEEK_ENTRY_LEN + 4);
+		int res;
+
+		/* only the blocks the range falls in are read at all */
+		if (pos + orig_len <= offset){
+			pos += orig_len;
+			at += SEEK_SIZE_LEN + comp_len;
+			continue;
+		}
+		if (at + SEEK_SIZE_LEN + comp_len > (uint64_t)end){
+			log_error("Seekable data has a damaged index");
+			ret = -1;
+			goto cleanup;
+		}
+		if (comp_len > block_size){
+			unsigned char* tmp = realloc(block, comp_len);
+
+			if (!tmp){
+				log_enomem();
+				ret = -1;
+				goto cleanup;
+			}
+			block = tmp;
+			block_size = comp_len;
+		}
+		if (fseek(fp, (long)(at + SEEK_SIZE_LEN), SEEK_SET) != 0 || fread(block, 1, comp_len, fp) != comp_len){
+			log_efread("compressed file");
+			ret = -1;
+			goto cleanup;
+		}
+
+		rs.skip = offset > pos ? offset - pos : 0;
+		if (seek_decompress_block_start(ss) != 0 || zip_stream_write(ss->block, block, comp_len) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+		res = zip_stream_finish(ss->block);
+		zip_stream_free(ss->block);
+		ss->block = NULL;
+		if (res != 0){
+			ret = -1;
+			goto cleanup;
+		}
+		pos += orig_len;
+		at += SEEK_SIZE_LEN + comp_len;
+	}
+	if (rs.left > 0){
+		log_error("Seekable data has a damaged index");
+		ret = -1;
+	}
+
+cleanup:
+	seek_stream_free(ss);
+	free(index);
+	free(block);
+	return ret;
+}
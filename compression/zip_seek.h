@@ -0,0 +1,32 @@
+/** @file compression/zip_seek.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __COMPRESSION_ZIP_SEEK_H
+#define __COMPRESSION_ZIP_SEEK_H
+
+#ifndef __ZIP_INTERNAL
+#error "Include zip.h, not zip_seek.h"
+#endif
+
+#include "zip.h"
+
+/* what the seekable layout starts with; the high bit keeps it from being text, and no compressor starts with it */
+#define SEEK_MAGIC "\x8F" "EZSK"
+#define SEEK_MAGIC_LEN 5
+
+struct seek_stream;
+struct seek_stream* seek_stream_new(enum compressor c_type, int compression_level, unsigned flags);
+int seek_stream_write(struct seek_stream* ss, const void* data, size_t len, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data);
+int seek_stream_end(struct seek_stream* ss, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data);
+struct seek_stream* seek_decompress_stream_new(enum compressor c_type, unsigned flags);
+int seek_decompress_stream_write(struct seek_stream* ss, const void* data, size_t len, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data);
+int seek_decompress_stream_end(struct seek_stream* ss);
+void seek_stream_use_dict(struct seek_stream* ss, const struct zip_dict* zd);
+void seek_stream_free(struct seek_stream* ss);
+
+#endif
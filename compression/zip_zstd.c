@@ -0,0 +1,442 @@
+/** @file compression/zip_zstd.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef NO_ZSTD_SUPPORT
+
+#define __ZIP_INTERNAL
+#include "zip_zstd.h"
+#include "zip.h"
+#include "../log.h"
+#include "../filehelper.h"
+/* for ZSTD_estimateCStreamSize_usingCCtxParams() */
+#define ZSTD_STATIC_LINKING_ONLY
+#include <zstd.h>
+#include <zdict.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* the longest a frame header can be (ZSTD_FRAMEHEADERSIZE_MAX, which is only in the static-linking section of zstd.h) */
+#define ZSTD_HEADER_LEN 18
+
+/* incremental (de)compressor used by zip_stream_new() and zip_decompress_stream_new(), and underneath zstd_compress()/zstd_decompress() */
+struct zstd_stream{
+	ZSTD_CCtx* cctx;
+	/* only set when decompressing */
+	ZSTD_DCtx* dctx;
+	unsigned char* outbuf;
+	size_t outbuf_len;
+	int finished;
+	/* a dictionary that is only used if the frame header asks for it, which is held back until it is known */
+	const ZSTD_DDict* ddict;
+	unsigned char head[ZSTD_HEADER_LEN];
+	size_t head_len;
+};
+
+/* a trained dictionary, digested once for every stream that uses it */
+struct zstd_dict{
+	ZSTD_CDict* cdict;
+	ZSTD_DDict* ddict;
+};
+
+/* spreads 1-9 over zstd's 1-19, the levels that do not need extra memory to decompress */
+static int zstd_level(int compression_level){
+	if (compression_level < 1 || compression_level > 9){
+		return ZSTD_CLEVEL_DEFAULT;
+	}
+	return 1 + (compression_level - 1) * 9 / 4;
+}
+
+struct zstd_stream* zstd_stream_new(int compression_level, unsigned flags){
+	struct zstd_stream* zs;
+	size_t res;
+
+	zs = calloc(1, sizeof(*zs));
+	if (!zs){
+		log_enomem();
+		return NULL;
+	}
+
+	zs->cctx = ZSTD_createCCtx();
+	if (!zs->cctx){
+		log_error("Failed to create zstd compression context");
+		free(zs);
+		return NULL;
+	}
+
+	res = ZSTD_CCtx_setParameter(zs->cctx, ZSTD_c_compressionLevel, zstd_level(compression_level));
+	if (ZSTD_isError(res)){
+		log_error_ex("Failed to set zstd compression level (%s)", ZSTD_getErrorName(res));
+		zstd_stream_free(zs);
+		return NULL;
+	}
+	/* long mode uses a 128MiB window, which is the most a decompressor accepts without being told otherwise */
+	if ((flags & ZSTD_LONG) && ZSTD_isError(res = ZSTD_CCtx_setParameter(zs->cctx, ZSTD_c_enableLongDistanceMatching, 1))){
+		log_error_ex("Failed to enable zstd long distance matching (%s)", ZSTD_getErrorName(res));
+		zstd_stream_free(zs);
+		return NULL;
+	}
+	/* the output is the same either way, so a libzstd built without threads is only slower */
+	if (ZIP_GET_WORKERS(flags) > 0 && ZSTD_isError(res = ZSTD_CCtx_setParameter(zs->cctx, ZSTD_c_nbWorkers, (int)ZIP_GET_WORKERS(flags)))){
+		log_warning_ex("Failed to start zstd worker threads (%s). Compressing on this thread instead.", ZSTD_getErrorName(res));
+	}
+
+	/* enough for one full block, so every call makes progress */
+	zs->outbuf_len = ZSTD_CStreamOutSize();
+	zs->outbuf = malloc(zs->outbuf_len);
+	if (!zs->outbuf){
+		log_enomem();
+		zstd_stream_free(zs);
+		return NULL;
+	}
+
+	return zs;
+}
+
+size_t zstd_stream_memory(int compression_level, unsigned flags){
+	ZSTD_CCtx_params* params;
+	size_t ret;
+
+	params = ZSTD_createCCtxParams();
+	if (!params){
+		log_enomem();
+		return 0;
+	}
+	/* the same parameters zstd_stream_new() sets, except the workers, which libzstd cannot estimate */
+	ZSTD_CCtxParams_init(params, zstd_level(compression_level));
+	if (flags & ZSTD_LONG){
+		ZSTD_CCtxParams_setParameter(params, ZSTD_c_enableLongDistanceMatching, 1);
+	}
+	ret = ZSTD_estimateCStreamSize_usingCCtxParams(params);
+	ZSTD_freeCCtxParams(params);
+	if (ZSTD_isError(ret)){
+		return 0;
+	}
+	/* every worker has a context of its own, on top of the one that hands out the jobs */
+	return ZIP_GET_WORKERS(flags) > 0 ? ret * (ZIP_GET_WORKERS(flags) + 1) : ret;
+}
+
+static int zstd_stream_code(struct zstd_stream* zs, const void* data, size_t len, ZSTD_EndDirective mode, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	size_t remaining;
+
+	in.src = data;
+	in.size = len;
+	in.pos = 0;
+
+	/* ZSTD_e_end is done once nothing remains to be flushed, everything else once the input is used up */
+	do{
+		out.dst = zs->outbuf;
+		out.size = zs->outbuf_len;
+		out.pos = 0;
+
+		remaining = ZSTD_compressStream2(zs->cctx, &out, &in, mode);
+		if (ZSTD_isError(remaining)){
+			log_error_ex("zstd compression error (%s)", ZSTD_getErrorName(remaining));
+			return -1;
+		}
+		if (out.pos > 0 && sink(zs->outbuf, out.pos, sink_data) != 0){
+			log_error("Failed to write zstd output");
+			return -1;
+		}
+	}while (mode == ZSTD_e_end ? remaining != 0 : in.pos < in.size);
+	return 0;
+}
+
+int zstd_stream_write(struct zstd_stream* zs, const void* data, size_t len, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	return zstd_stream_code(zs, data, len, ZSTD_e_continue, sink, sink_data);
+}
+
+int zstd_stream_end(struct zstd_stream* zs, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	return zstd_stream_code(zs, NULL, 0, ZSTD_e_end, sink, sink_data);
+}
+
+int zstd_stream_reset(struct zstd_stream* zs){
+	size_t res;
+
+	/* the level and worker threads stay, but the next file may not want the dictionary */
+	if (ZSTD_isError(res = ZSTD_CCtx_reset(zs->cctx, ZSTD_reset_session_only)) || ZSTD_isError(res = ZSTD_CCtx_refCDict(zs->cctx, NULL))){
+		log_error_ex("Failed to reset zstd compression context (%s)", ZSTD_getErrorName(res));
+		return -1;
+	}
+	return 0;
+}
+
+struct zstd_stream* zstd_decompress_stream_new(void){
+	struct zstd_stream* zs;
+
+	zs = calloc(1, sizeof(*zs));
+	if (!zs){
+		log_enomem();
+		return NULL;
+	}
+
+	zs->dctx = ZSTD_createDCtx();
+	if (!zs->dctx){
+		log_error("Failed to create zstd decompression context");
+		free(zs);
+		return NULL;
+	}
+
+	zs->outbuf_len = ZSTD_DStreamOutSize();
+	zs->outbuf = malloc(zs->outbuf_len);
+	if (!zs->outbuf){
+		log_enomem();
+		zstd_stream_free(zs);
+		return NULL;
+	}
+
+	return zs;
+}
+
+static int zstd_decode(struct zstd_stream* zs, const void* data, size_t len, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	size_t res;
+
+	in.src = data;
+	in.size = len;
+	in.pos = 0;
+
+	/* keep calling until the input is used up and no more output is pending
+	 * another call after the end of a frame would start waiting for the next one */
+	do{
+		out.dst = zs->outbuf;
+		out.size = zs->outbuf_len;
+		out.pos = 0;
+
+		res = ZSTD_decompressStream(zs->dctx, &out, &in);
+		if (ZSTD_isError(res)){
+			log_error_ex("zstd decompression error (%s)", ZSTD_getErrorName(res));
+			return -1;
+		}
+		/* more data after this can only be another frame */
+		zs->finished = res == 0;
+
+		if (out.pos > 0 && sink(zs->outbuf, out.pos, sink_data) != 0){
+			log_error("Failed to write decompressed data");
+			return -1;
+		}
+	}while (in.pos < in.size || (res != 0 && out.pos == out.size));
+	return 0;
+}
+
+/* files written before there was a dictionary have no dictionary ID, and decoding those with one loaded would corrupt them */
+static int zstd_start_frame(struct zstd_stream* zs, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	unsigned dict_id = ZSTD_getDictID_fromFrame(zs->head, zs->head_len);
+	size_t res;
+
+	if (dict_id != 0 && dict_id == ZSTD_getDictID_fromDDict(zs->ddict) && ZSTD_isError(res = ZSTD_DCtx_refDDict(zs->dctx, zs->ddict))){
+		log_error_ex("Failed to load zstd dictionary (%s)", ZSTD_getErrorName(res));
+		return -1;
+	}
+	zs->ddict = NULL;
+	return zstd_decode(zs, zs->head, zs->head_len, sink, sink_data);
+}
+
+int zstd_decompress_stream_write(struct zstd_stream* zs, const void* data, size_t len, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	if (zs->ddict){
+		size_t n = ZSTD_HEADER_LEN - zs->head_len;
+
+		if (n > len){
+			n = len;
+		}
+		memcpy(zs->head + zs->head_len, data, n);
+		zs->head_len += n;
+		if (zs->head_len < ZSTD_HEADER_LEN){
+			return 0;
+		}
+		if (zstd_start_frame(zs, sink, sink_data) != 0){
+			return -1;
+		}
+		data = (const unsigned char*)data + n;
+		len -= n;
+	}
+	return len > 0 ? zstd_decode(zs, data, len, sink, sink_data) : 0;
+}
+
+int zstd_decompress_stream_end(struct zstd_stream* zs, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	/* a frame shorter than the longest header is still waiting on it */
+	if (zs->ddict && zs->head_len > 0 && zstd_start_frame(zs, sink, sink_data) != 0){
+		return -1;
+	}
+	if (!zs->finished){
+		log_error("Compressed data ended unexpectedly");
+		return -1;
+	}
+	return 0;
+}
+
+int zstd_stream_use_dict(struct zstd_stream* zs, const struct zstd_dict* zd){
+	size_t res;
+
+	if (zs->dctx){
+		zs->ddict = zd->ddict;
+		return 0;
+	}
+	if (ZSTD_isError(res = ZSTD_CCtx_refCDict(zs->cctx, zd->cdict))){
+		log_error_ex("Failed to load zstd dictionary (%s)", ZSTD_getErrorName(res));
+		return -1;
+	}
+	return 0;
+}
+
+size_t zstd_dict_train(void* dict, size_t dict_capacity, const void* samples, const size_t* sample_lens, size_t n_samples){
+	size_t res;
+
+	res = ZDICT_trainFromBuffer(dict, dict_capacity, samples, sample_lens, n_samples > 0xFFFFFFFFU ? 0xFFFFFFFFU : (unsigned)n_samples);
+	if (ZDICT_isError(res)){
+		log_warning_ex("Failed to train zstd dictionary (%s)", ZDICT_getErrorName(res));
+		return 0;
+	}
+	return res;
+}
+
+struct zstd_dict* zstd_dict_new(const void* data, size_t len, int compression_level){
+	struct zstd_dict* zd;
+
+	/* zstd would take anything as a dictionary of raw content, including what a wrong password decrypts to */
+	if (ZDICT_getDictID(data, len) == 0){
+		log_error("Not a trained zstd dictionary");
+		return NULL;
+	}
+
+	zd = calloc(1, sizeof(*zd));
+	if (!zd){
+		log_enomem();
+		return NULL;
+	}
+	/* both copy the dictionary, so the caller keeps its own */
+	zd->cdict = ZSTD_createCDict(data, len, zstd_level(compression_level));
+	zd->ddict = ZSTD_createDDict(data, len);
+	if (!zd->cdict || !zd->ddict){
+		log_error("Failed to create zstd dictionary");
+		zstd_dict_free(zd);
+		return NULL;
+	}
+	return zd;
+}
+
+void zstd_dict_free(struct zstd_dict* zd){
+	if (!zd){
+		return;
+	}
+	ZSTD_freeCDict(zd->cdict);
+	ZSTD_freeDDict(zd->ddict);
+	free(zd);
+}
+
+void zstd_stream_free(struct zstd_stream* zs){
+	if (!zs){
+		return;
+	}
+	ZSTD_freeCCtx(zs->cctx);
+	ZSTD_freeDCtx(zs->dctx);
+	free(zs->outbuf);
+	free(zs);
+}
+
+static int file_sink(const void* data, size_t len, void* fp){
+	if (fwrite(data, 1, len, fp) != len){
+		log_efwrite("zstd output");
+		return -1;
+	}
+	return 0;
+}
+
+/* runs a whole file through a stream, so the file and stream interfaces cannot disagree on the format */
+static int zstd_file(const char* infile, const char* outfile, struct zstd_stream* zs){
+	unsigned char inbuf[BUFFER_LEN];
+	FILE* fp_in = NULL;
+	FILE* fp_out = NULL;
+	size_t len;
+	int ret = 0;
+
+	fp_in = fopen(infile, "rb");
+	if (!fp_in){
+		log_efopen(infile);
+		ret = -1;
+		goto cleanup;
+	}
+
+	fp_out = fopen(outfile, "wb");
+	if (!fp_out){
+		log_efopen(outfile);
+		ret = -1;
+		goto cleanup;
+	}
+
+	while ((len = fread(inbuf, 1, sizeof(inbuf), fp_in)) > 0){
+		if ((zs->dctx ? zstd_decompress_stream_write(zs, inbuf, len, file_sink, fp_out) : zstd_stream_write(zs, inbuf, len, file_sink, fp_out)) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+	}
+	if (ferror(fp_in)){
+		log_efread(infile);
+		ret = -1;
+		goto cleanup;
+	}
+	if ((zs->dctx ? zstd_decompress_stream_end(zs, file_sink, fp_out) : zstd_stream_end(zs, file_sink, fp_out)) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+
+cleanup:
+	fp_in ? fclose(fp_in) : 0;
+	if (fp_out && fclose(fp_out) != 0){
+		log_efclose(outfile);
+		ret = -1;
+	}
+	if (ret != 0 && fp_out){
+		remove(outfile);
+	}
+	return ret;
+}
+
+int zstd_compress(const char* infile, const char* outfile, int compression_level, unsigned flags){
+	struct zstd_stream* zs;
+	int ret;
+
+	zs = zstd_stream_new(compression_level, flags);
+	if (!zs){
+		log_error("Failed to start zstd stream");
+		return -1;
+	}
+
+	ret = zstd_file(infile, outfile, zs);
+	if (ret != 0){
+		log_error("Error compressing file");
+	}
+	zstd_stream_free(zs);
+	return ret;
+}
+
+int zstd_decompress(const char* infile, const char* outfile, unsigned flags){
+	struct zstd_stream* zs;
+	int ret;
+
+	(void)flags;
+
+	zs = zstd_decompress_stream_new();
+	if (!zs){
+		log_error("Failed to start zstd stream");
+		return -1;
+	}
+
+	ret = zstd_file(infile, outfile, zs);
+	if (ret != 0){
+		log_error("Error decompressing file");
+	}
+	zstd_stream_free(zs);
+	return ret;
+}
+
+#endif
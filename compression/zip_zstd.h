@@ -0,0 +1,38 @@
+/** @file compression/zip_zstd.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __COMPRESSION_ZIP_ZSTD_H
+#define __COMPRESSION_ZIP_ZSTD_H
+
+#ifndef __ZIP_INTERNAL
+#error "Include zip.h, not zip_zstd.h"
+#endif
+
+#include "zip.h"
+
+int zstd_compress(const char* infile, const char* outfile, int compression_level, unsigned flags);
+int zstd_decompress(const char* infile, const char* outfile, unsigned flags);
+
+struct zstd_stream;
+struct zstd_stream* zstd_stream_new(int compression_level, unsigned flags);
+int zstd_stream_write(struct zstd_stream* zs, const void* data, size_t len, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data);
+int zstd_stream_end(struct zstd_stream* zs, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data);
+int zstd_stream_reset(struct zstd_stream* zs);
+struct zstd_stream* zstd_decompress_stream_new(void);
+int zstd_decompress_stream_write(struct zstd_stream* zs, const void* data, size_t len, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data);
+int zstd_decompress_stream_end(struct zstd_stream* zs, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data);
+void zstd_stream_free(struct zstd_stream* zs);
+size_t zstd_stream_memory(int compression_level, unsigned flags);
+
+struct zstd_dict;
+size_t zstd_dict_train(void* dict, size_t dict_capacity, const void* samples, const size_t* sample_lens, size_t n_samples);
+struct zstd_dict* zstd_dict_new(const void* data, size_t len, int compression_level);
+int zstd_stream_use_dict(struct zstd_stream* zs, const struct zstd_dict* zd);
+void zstd_dict_free(struct zstd_dict* zd);
+
+#endif
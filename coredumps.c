@@ -12,14 +12,24 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/resource.h>
+#include <pthread.h>
+
+static pthread_mutex_t coredump_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static int __coredumps(int enable){
 	static struct rlimit rl_prev;
 	static int previously_disabled = 0;
+	/* number of callers that still need core dumps off */
+	static unsigned n_disabled = 0;
 	struct rlimit rl;
 	int ret = 0;
 
+	pthread_mutex_lock(&coredump_mutex);
 	if (!enable){
+		if (n_disabled++ > 0){
+			pthread_mutex_unlock(&coredump_mutex);
+			return 0;
+		}
 		if (getrlimit(RLIMIT_CORE, &rl_prev) != 0){
 			log_warning_ex("Failed to get previous core dump limits (%s)", strerror(errno));
 			ret = -1;
@@ -33,7 +43,11 @@ static int __coredumps(int enable){
 		previously_disabled = 1;
 	}
 	else{
-		if (!previously_disabled){
+		if (n_disabled > 0){
+			n_disabled--;
+		}
+		if (!previously_disabled || n_disabled > 0){
+			pthread_mutex_unlock(&coredump_mutex);
 			return 0;
 		}
 		if (setrlimit(RLIMIT_CORE, &rl_prev) != 0){
@@ -42,6 +56,7 @@ static int __coredumps(int enable){
 		}
 		previously_disabled = 0;
 	}
+	pthread_mutex_unlock(&coredump_mutex);
 	return ret;
 }
 
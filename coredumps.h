@@ -12,7 +12,8 @@
 /**
  * @brief Disables core dumps on the system.
  *
- * This prevents fragments of a password or other sensitive information from showing up in core dumps.
+ * This prevents fragments of a password or other sensitive information from showing up in core dumps.<br>
+ * Calls nest, so core dumps stay disabled until every call has been matched by enable_core_dumps().
  * @see crypt_getpassword()
  *
  * @return 0 on success, or negative on failure.
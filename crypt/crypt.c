@@ -6,7 +6,9 @@
  * of the MIT license.  See the LICENSE file for details.
  */
 
+#define __CRYPT_INTERNAL
 #include "crypt.h"
+#include "crypt_aead.h"
 #include "../filehelper.h"
 #include "../log.h"
 #include <errno.h>
@@ -34,9 +36,12 @@ struct crypt_keys{
 	int iv_length;                   /**< The length of the initialization vector in bytes. */
 	unsigned char salt[8];           /**< Holds a 64-bit salt to make sure the same data does not encrypt to the same value. The salt must be 64-bit to preserve compatibillity with the openssl command line utility. */
 	const EVP_CIPHER* encryption;    /**< The encryption algorithm to use. */
+	unsigned n_workers;              /**< How many threads process the chunks of an AEAD cipher. */
+	unsigned char nonce[CRYPT_NONCE_LEN]; /**< Holds the per-file nonce a session key was derived with. */
 	unsigned flag_encryption_set: 1; /**< 0 if the encryption algorithm was not set, 1 if it was. DO NOT EDIT MANUALLY. */
 	unsigned flag_keys_set: 1;       /**< 0 if the keys were not generated, 1 if they were. DO NOT EDIT MANUALLY. */
 	unsigned flag_salt_extracted: 1; /**< 0 if the salt was not extracted from the file. 1 if it was. DO NOT EDIT MANUALLY. */
+	unsigned flag_session: 1;        /**< 0 if the keys come from the salt, 1 if they come from a session key and the nonce. DO NOT EDIT MANUALLY. */
 };
 
 struct crypt_keys* crypt_new(void){
@@ -130,6 +135,70 @@ int crypt_set_salt(const unsigned char salt[8], struct crypt_keys* fk){
 	return 0;
 }
 
+int crypt_set_session(const unsigned char salt[8], const unsigned char nonce[CRYPT_NONCE_LEN], struct crypt_keys* fk){
+	return_ifnull(salt, -1);
+	return_ifnull(nonce, -1);
+	return_ifnull(fk, -1);
+
+	crypt_set_salt(salt, fk);
+	memcpy(fk->nonce, nonce, CRYPT_NONCE_LEN);
+	fk->flag_session = 1;
+	return 0;
+}
+
+int crypt_get_session(const struct crypt_keys* fk, unsigned char salt[8], unsigned char nonce[CRYPT_NONCE_LEN]){
+	return_ifnull(fk, -1);
+
+	if (!fk->flag_session){
+		return 1;
+	}
+	if (salt){
+		memcpy(salt, fk->salt, sizeof(fk->salt));
+	}
+	if (nonce){
+		memcpy(nonce, fk->nonce, CRYPT_NONCE_LEN);
+	}
+	return 0;
+}
+
+int crypt_set_keys(const unsigned char* key, const unsigned char* iv, struct crypt_keys* fk){
+	return_ifnull(key, -1);
+	return_ifnull(fk, -1);
+
+	if (fk->flag_encryption_set == 0){
+		log_error("Encryption type was not set (call crypt_set_encryption())");
+		return -1;
+	}
+	if (fk->flag_keys_set){
+		log_error("Keys were already set for this crypt keys structure");
+		return -1;
+	}
+
+	fk->key_length = EVP_CIPHER_key_length(fk->encryption);
+	fk->iv_length = EVP_CIPHER_iv_length(fk->encryption);
+	fk->key = malloc(fk->key_length);
+	fk->iv = malloc(fk->iv_length);
+	if (!fk->key || !fk->iv){
+		log_enomem();
+		free(fk->key);
+		free(fk->iv);
+		fk->key = NULL;
+		fk->iv = NULL;
+		return -1;
+	}
+	memcpy(fk->key, key, fk->key_length);
+	/* ciphers like ECB do not have one */
+	if (iv){
+		memcpy(fk->iv, iv, fk->iv_length);
+	}
+	else{
+		memset(fk->iv, 0, fk->iv_length);
+	}
+
+	fk->flag_keys_set = 1;
+	return 0;
+}
+
 const EVP_CIPHER* crypt_get_cipher(const char* encryption_name){
 	const EVP_CIPHER* ret = NULL;
 	const EVP_CIPHER* enc_null = EVP_enc_null();
@@ -147,6 +216,14 @@ const EVP_CIPHER* crypt_get_cipher(const char* encryption_name){
 	return ret;
 }
 
+int crypt_is_aead(const EVP_CIPHER* cipher){
+	if (!cipher){
+		return 0;
+	}
+	/* CCM and OCB are also AEAD modes, but CCM needs the length of each chunk up front and OCB is not built everywhere */
+	return EVP_CIPHER_mode(cipher) == EVP_CIPH_GCM_MODE || EVP_CIPHER_nid(cipher) == NID_chacha20_poly1305;
+}
+
 /* sets encryption type, this must be the first function called
  * returns 0 on success or 1 if cipher is not recognized */
 int crypt_set_encryption(const EVP_CIPHER* encryption, struct crypt_keys* fk){
@@ -168,6 +245,13 @@ int crypt_set_encryption(const EVP_CIPHER* encryption, struct crypt_keys* fk){
 	return 0;
 }
 
+int crypt_set_workers(struct crypt_keys* fk, unsigned n_workers){
+	return_ifnull(fk, -1);
+
+	fk->n_workers = n_workers;
+	return 0;
+}
+
 /* generates a key and iv based on data
  * returns 0 on success or err on error */
 int crypt_gen_keys(const void* data, int data_len, const EVP_MD* md, int iterations, struct crypt_keys* fk){
@@ -236,11 +320,69 @@ void crypt_reset(struct crypt_keys* fk){
 	memset(fk, 0, sizeof(*fk));
 }
 
+static int crypt_fp_sink(const void* data, size_t len, void* fp){
+	if (fwrite(data, 1, len, fp) != len){
+		return -1;
+	}
+	return 0;
+}
+
+/* "Salted__" and the salt, like the openssl command line utility, or "Session_", the salt, and the nonce for keys from a session */
+static int crypt_write_header(const struct crypt_keys* fk, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	/* do not want null terminator */
+	const char salt_prefix[8] = { 'S', 'a', 'l', 't', 'e', 'd', '_', '_' };
+	const char session_prefix[8] = { 'S', 'e', 's', 's', 'i', 'o', 'n', '_' };
+
+	if (sink(fk->flag_session ? session_prefix : salt_prefix, 8, sink_data) != 0 ||
+			sink(fk->salt, sizeof(fk->salt), sink_data) != 0 ||
+			(fk->flag_session && sink(fk->nonce, sizeof(fk->nonce), sink_data) != 0)){
+		return -1;
+	}
+	return 0;
+}
+
+/* the rest of crypt_encrypt_ex() and crypt_decrypt_ex() for an AEAD cipher, once the salt is taken care of */
+static int crypt_aead_file(FILE* fp_in, struct crypt_keys* fk, int encrypt, FILE* fp_out, const char* out, struct progress* p){
+	unsigned char inbuffer[BUFFER_LEN];
+	struct aead_stream* as;
+	int inlen;
+	int ret = 0;
+
+	as = aead_stream_new(fk->encryption, fk->key, fk->iv, encrypt, fk->n_workers, crypt_fp_sink, fp_out);
+	if (!as){
+		log_efwrite(out);
+		return -1;
+	}
+
+	while ((inlen = read_file(fp_in, inbuffer, sizeof(inbuffer))) > 0){
+		if (aead_stream_write(as, inbuffer, inlen) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+		if (p){
+			inc_progress(p, inlen);
+		}
+	}
+	finish_progress(p);
+
+	if (aead_stream_finish(as) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+	if (ferror(fp_out)){
+		log_efwrite(out);
+		ret = -1;
+	}
+
+cleanup:
+	aead_stream_free(as);
+	crypt_scrub(inbuffer, sizeof(inbuffer));
+	return ret;
+}
+
 /* encrypts the file
  * returns 0 on success or err on error */
 int crypt_encrypt_ex(const char* in, struct crypt_keys* fk, const char* out, int verbose, const char* progress_msg){
-	/* do not want null terminator */
-	const char salt_prefix[8] = { 'S', 'a', 'l', 't', 'e', 'd', '_', '_'};
 	EVP_CIPHER_CTX* ctx = NULL;
 	unsigned char inbuffer[BUFFER_LEN];
 	unsigned char* outbuffer = NULL;
@@ -278,13 +420,11 @@ int crypt_encrypt_ex(const char* in, struct crypt_keys* fk, const char* out, int
 	}
 
 	/* write the salt prefix + salt to the file */
-	fwrite(salt_prefix, 1, sizeof(salt_prefix), fp_out);
-	if (ferror(fp_out)){
+	if (crypt_write_header(fk, crypt_fp_sink, fp_out) != 0){
 		log_efwrite(out);
 		ret = -1;
 		goto cleanup;
 	}
-	fwrite(fk->salt, 1, 8, fp_out);
 
 	/* preparing progress bar */
 	if (verbose){
@@ -313,6 +453,11 @@ int crypt_encrypt_ex(const char* in, struct crypt_keys* fk, const char* out, int
 		goto cleanup;
 	}
 
+	if (crypt_is_aead(fk->encryption)){
+		ret = crypt_aead_file(fp_in, fk, 1, fp_out, out, p);
+		goto cleanup;
+	}
+
 	/* initializing encryption thingy */
 	ctx = EVP_CIPHER_CTX_new();
 	if (!ctx){
@@ -375,41 +520,190 @@ cleanup:
 	return ret;
 }
 
+struct crypt_stream{
+	/* set instead of ctx for an AEAD cipher */
+	struct aead_stream* as;
+	EVP_CIPHER_CTX* ctx;
+	unsigned char* outbuffer;
+	int(*sink)(const void* data, size_t len, void* sink_data);
+	void* sink_data;
+	int encrypt;
+};
+
+/* sets up everything both directions have in common */
+static struct crypt_stream* crypt_stream_init(struct crypt_keys* fk, int encrypt, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	struct crypt_stream* cs;
+
+	cs = calloc(1, sizeof(*cs));
+	if (!cs){
+		log_enomem();
+		return NULL;
+	}
+	cs->sink = sink;
+	cs->sink_data = sink_data;
+	cs->encrypt = encrypt;
+
+	if (crypt_is_aead(fk->encryption)){
+		if (!(cs->as = aead_stream_new(fk->encryption, fk->key, fk->iv, encrypt, fk->n_workers, sink, sink_data))){
+			crypt_stream_free(cs);
+			return NULL;
+		}
+		return cs;
+	}
+
+	cs->outbuffer = malloc(BUFFER_LEN + EVP_CIPHER_block_size(fk->encryption));
+	if (!cs->outbuffer){
+		log_enomem();
+		crypt_stream_free(cs);
+		return NULL;
+	}
+
+	cs->ctx = EVP_CIPHER_CTX_new();
+	if (!cs->ctx){
+		log_error("Failed to initialize EVP_CIPHER_CTX");
+		ERR_print_errors_fp(stderr);
+		crypt_stream_free(cs);
+		return NULL;
+	}
+	if (EVP_CipherInit_ex(cs->ctx, fk->encryption, NULL, fk->key, fk->iv, encrypt) != 1){
+		log_error_ex("Failed to initialize %s", encrypt ? "encryption" : "decryption");
+		ERR_print_errors_fp(stderr);
+		crypt_stream_free(cs);
+		return NULL;
+	}
+
+	return cs;
+}
+
+struct crypt_stream* crypt_stream_new(struct crypt_keys* fk, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	return_ifnull(fk, NULL);
+	return_ifnull(sink, NULL);
+
+	/* checking if keys were actually generated */
+	if (fk->flag_keys_set == 0){
+		log_error("Encryption keys were not generated (call crypt_gen_keys())");
+		return NULL;
+	}
+
+	/* same header as crypt_encrypt_ex(), which has to come before anything an AEAD stream writes */
+	if (crypt_write_header(fk, sink, sink_data) != 0){
+		log_error("Failed to write salt");
+		return NULL;
+	}
+
+	return crypt_stream_init(fk, 1, sink, sink_data);
+}
+
+struct crypt_stream* crypt_decrypt_stream_new(struct crypt_keys* fk, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	return_ifnull(fk, NULL);
+	return_ifnull(sink, NULL);
+
+	/* checking if keys were actually generated */
+	if (fk->flag_keys_set == 0){
+		log_error("Decryption keys were not generated (call crypt_gen_keys())");
+		return NULL;
+	}
+
+	/* checking if salt was extracted */
+	if (fk->flag_salt_extracted == 0){
+		log_error("Salt was not extracted from the file (call crypt_read_salt())");
+		return NULL;
+	}
+
+	return crypt_stream_init(fk, 0, sink, sink_data);
+}
+
+int crypt_stream_write(struct crypt_stream* cs, const void* data, size_t len){
+	const unsigned char* ptr = data;
+
+	return_ifnull(cs, -1);
+
+	if (cs->as){
+		return aead_stream_write(cs->as, data, len);
+	}
+
+	/* outbuffer only has room for BUFFER_LEN bytes + one block */
+	while (len > 0){
+		int inlen = len < BUFFER_LEN ? (int)len : BUFFER_LEN;
+		int outlen;
+
+		if (EVP_CipherUpdate(cs->ctx, cs->outbuffer, &outlen, ptr, inlen) != 1){
+			log_error_ex("Failed to %s data completely", cs->encrypt ? "encrypt" : "decrypt");
+			ERR_print_errors_fp(stderr);
+			return -1;
+		}
+		if (outlen > 0 && cs->sink(cs->outbuffer, outlen, cs->sink_data) != 0){
+			log_error_ex("Failed to write %s data", cs->encrypt ? "encrypted" : "decrypted");
+			return -1;
+		}
+
+		ptr += inlen;
+		len -= inlen;
+	}
+	return 0;
+}
+
+int crypt_stream_finish(struct crypt_stream* cs){
+	int outlen;
+
+	return_ifnull(cs, -1);
+
+	if (cs->as){
+		return aead_stream_finish(cs->as);
+	}
+
+	/* when decrypting, this is where a wrong password or truncated data is caught */
+	if (EVP_CipherFinal_ex(cs->ctx, cs->outbuffer, &outlen) != 1){
+		log_error(cs->encrypt ? "Failed to write padding data" : "Failed to read padding data (wrong password or corrupted data)");
+		ERR_print_errors_fp(stderr);
+		return -1;
+	}
+	if (outlen > 0 && cs->sink(cs->outbuffer, outlen, cs->sink_data) != 0){
+		log_error_ex("Failed to write %s data", cs->encrypt ? "encrypted" : "decrypted");
+		return -1;
+	}
+	return 0;
+}
+
+void crypt_stream_free(struct crypt_stream* cs){
+	if (!cs){
+		return;
+	}
+	aead_stream_free(cs->as);
+	if (cs->ctx){
+		EVP_CIPHER_CTX_free(cs->ctx);
+	}
+	free(cs->outbuffer);
+	free(cs);
+}
+
 /* simpler wrapper for crypt_encrypt_ex if progressbar is not needed */
 int crypt_encrypt(const char* in, struct crypt_keys* fk, const char* fp_out){
 	return crypt_encrypt_ex(in, fk, fp_out, 0, NULL);
 }
 
-/* extracts salt from encrypted file */
-int crypt_extract_salt(const char* in, struct crypt_keys* fk){
+int crypt_read_salt(FILE* fp_in, struct crypt_keys* fk){
 	const char salt_prefix[8] = { 'S', 'a', 'l', 't', 'e', 'd', '_', '_' };
+	const char session_prefix[8] = { 'S', 'e', 's', 's', 'i', 'o', 'n', '_' };
 	char salt_buffer[8];
 	char buffer[8];
-	FILE* fp_in = NULL;
 	unsigned i;
 
 	/* checking null arguments */
-	return_ifnull(in, -1);
+	return_ifnull(fp_in, -1);
 	return_ifnull(fk, -1);
 
-	fp_in = fopen(in, "rb");
-	if (!fp_in){
-		log_efopen(in);
-		return -1;
-	}
-
 	/* check that fread works properly. also advances the file
 	 * pointer to the beginning of the salt */
 	if (fread(salt_buffer, 1, sizeof(salt_prefix), fp_in) != sizeof(salt_prefix)){
 		log_error("Failed to read salt prefix from file");
-		fclose(fp_in);
 		return -1;
 	}
 
 	/* check that the prefix we read matches the salt prefix */
-	if (memcmp(salt_buffer, salt_prefix, sizeof(salt_prefix)) != 0){
+	if (memcmp(salt_buffer, salt_prefix, sizeof(salt_prefix)) != 0 &&
+			memcmp(salt_buffer, session_prefix, sizeof(session_prefix)) != 0){
 		log_error("File is not of the correct format");
-		fclose(fp_in);
 		return -1;
 	}
 
@@ -417,7 +711,6 @@ int crypt_extract_salt(const char* in, struct crypt_keys* fk){
 	 * amount of bytes were read */
 	if (fread(buffer, 1, sizeof(buffer), fp_in) != sizeof(buffer)){
 		log_error("Failed to read salt from file");
-		fclose(fp_in);
 		return -1;
 	}
 
@@ -427,11 +720,39 @@ int crypt_extract_salt(const char* in, struct crypt_keys* fk){
 		fk->salt[i] = buffer[i];
 	}
 
+	/* the nonce the file's key was derived with comes right after the salt */
+	if (memcmp(salt_buffer, session_prefix, sizeof(session_prefix)) == 0){
+		if (fread(fk->nonce, 1, sizeof(fk->nonce), fp_in) != sizeof(fk->nonce)){
+			log_error("Failed to read nonce from file");
+			return -1;
+		}
+		fk->flag_session = 1;
+	}
+
 	fk->flag_salt_extracted = 1;
-	fclose(fp_in);
 	return 0;
 }
 
+/* extracts salt from encrypted file */
+int crypt_extract_salt(const char* in, struct crypt_keys* fk){
+	FILE* fp_in = NULL;
+	int ret;
+
+	/* checking null arguments */
+	return_ifnull(in, -1);
+	return_ifnull(fk, -1);
+
+	fp_in = fopen(in, "rb");
+	if (!fp_in){
+		log_efopen(in);
+		return -1;
+	}
+
+	ret = crypt_read_salt(fp_in, fk);
+	fclose(fp_in);
+	return ret;
+}
+
 /* decrypts the file
  * returns 0 on success or err on error */
 int crypt_decrypt_ex(const char* in, struct crypt_keys* fk, const char* out, int verbose, const char* progress_msg){
@@ -524,7 +845,12 @@ int crypt_decrypt_ex(const char* in, struct crypt_keys* fk, const char* out, int
 	}
 
 	/* advance file pointer beyond salt */
-	fseek(fp_in, 8 + sizeof(fk->salt), SEEK_SET);
+	fseek(fp_in, 8 + sizeof(fk->salt) + (fk->flag_session ? sizeof(fk->nonce) : 0), SEEK_SET);
+
+	if (crypt_is_aead(fk->encryption)){
+		ret = crypt_aead_file(fp_in, fk, 0, fp_out, out, p);
+		goto cleanup;
+	}
 
 	/* while there is data in the input file */
 	while ((inlen = read_file(fp_in, inbuffer, sizeof(inbuffer))) > 0){
@@ -569,6 +895,210 @@ cleanup:
 	return ret;
 }
 
+/* "Salted__" or "Session_", the salt, and the nonce if there is one */
+static size_t crypt_header_len(const struct crypt_keys* fk){
+	return 8 + sizeof(fk->salt) + (fk->flag_session ? sizeof(fk->nonce) : 0);
+}
+
+size_t crypt_encrypted_len(const struct crypt_keys* fk, size_t len){
+	size_t block_size;
+
+	return_ifnull(fk, 0);
+
+	if (crypt_is_aead(fk->encryption)){
+		/* the chunk length, and a tag for every chunk including the last one, which can be empty */
+		return crypt_header_len(fk) + 4 + (len / CRYPT_CHUNK_LEN + 1) * CRYPT_TAG_LEN + len;
+	}
+	/* padding adds anywhere from 1 byte to a whole block */
+	block_size = fk->encryption ? (size_t)EVP_CIPHER_block_size(fk->encryption) : 1;
+	return crypt_header_len(fk) + len + block_size;
+}
+
+/* collects a stream's output in caller-provided memory */
+struct crypt_buffer{
+	unsigned char* data;
+	size_t size;
+	size_t len;
+};
+
+static int crypt_buffer_sink(const void* data, size_t len, void* sink_data){
+	struct crypt_buffer* cb = sink_data;
+
+	if (len > cb->size - cb->len){
+		log_error("Output buffer is too small");
+		return -1;
+	}
+	memcpy(cb->data + cb->len, data, len);
+	cb->len += len;
+	return 0;
+}
+
+/* runs in through a stream that was already started */
+static int crypt_stream_all(struct crypt_stream* cs, const void* in, size_t in_len){
+	if (!cs){
+		return -1;
+	}
+	if (crypt_stream_write(cs, in, in_len) != 0 || crypt_stream_finish(cs) != 0){
+		crypt_stream_free(cs);
+		return -1;
+	}
+	crypt_stream_free(cs);
+	return 0;
+}
+
+int crypt_encrypt_buf(const void* in, size_t in_len, struct crypt_keys* fk, void* out, size_t out_size, size_t* out_len){
+	struct crypt_buffer cb;
+
+	return_ifnull(in, -1);
+	return_ifnull(fk, -1);
+	return_ifnull(out, -1);
+
+	cb.data = out;
+	cb.size = out_size;
+	cb.len = 0;
+	if (crypt_stream_all(crypt_stream_new(fk, crypt_buffer_sink, &cb), in, in_len) != 0){
+		log_error("Failed to encrypt buffer");
+		return -1;
+	}
+	if (out_len){
+		*out_len = cb.len;
+	}
+	return 0;
+}
+
+int crypt_read_salt_buf(const void* in, size_t in_len, struct crypt_keys* fk){
+	const char salt_prefix[8] = { 'S', 'a', 'l', 't', 'e', 'd', '_', '_' };
+	const char session_prefix[8] = { 'S', 'e', 's', 's', 'i', 'o', 'n', '_' };
+	const unsigned char* ptr = in;
+	int session;
+
+	return_ifnull(in, -1);
+	return_ifnull(fk, -1);
+
+	if (in_len < 8 + sizeof(fk->salt)){
+		log_error("Buffer is too short to have a salt");
+		return -1;
+	}
+	session = memcmp(ptr, session_prefix, sizeof(session_prefix)) == 0;
+	if (!session && memcmp(ptr, salt_prefix, sizeof(salt_prefix)) != 0){
+		log_error("Buffer is not of the correct format");
+		return -1;
+	}
+	if (session && in_len < 8 + sizeof(fk->salt) + sizeof(fk->nonce)){
+		log_error("Buffer is too short to have a nonce");
+		return -1;
+	}
+
+	memcpy(fk->salt, ptr + 8, sizeof(fk->salt));
+	if (session){
+		memcpy(fk->nonce, ptr + 8 + sizeof(fk->salt), sizeof(fk->nonce));
+	}
+	fk->flag_session = session;
+	fk->flag_salt_extracted = 1;
+	return 0;
+}
+
+int crypt_decrypt_buf(const void* in, size_t in_len, struct crypt_keys* fk, void* out, size_t out_size, size_t* out_len){
+	struct crypt_buffer cb;
+	size_t header_len;
+
+	return_ifnull(in, -1);
+	return_ifnull(fk, -1);
+	return_ifnull(out, -1);
+
+	header_len = crypt_header_len(fk);
+	if (in_len < header_len){
+		log_error("Buffer is too short to have a salt");
+		return -1;
+	}
+
+	cb.data = out;
+	cb.size = out_size;
+	cb.len = 0;
+	if (crypt_stream_all(crypt_decrypt_stream_new(fk, crypt_buffer_sink, &cb), (const unsigned char*)in + header_len, in_len - header_len) != 0){
+		log_error("Failed to decrypt buffer");
+		/* half-decrypted data should not be left around */
+		crypt_scrub(out, (int)cb.len);
+		return -1;
+	}
+	if (out_len){
+		*out_len = cb.len;
+	}
+	return 0;
+}
+
+/* feeds the rest of fp_in through a stream that was already started */
+static int crypt_stream_fp(struct crypt_stream* cs, FILE* fp_in){
+	unsigned char buffer[BUFFER_LEN];
+	int len;
+	int ret = 0;
+
+	if (!cs){
+		return -1;
+	}
+	while ((len = read_file(fp_in, buffer, sizeof(buffer))) > 0){
+		if (crypt_stream_write(cs, buffer, len) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+	}
+	if (ferror(fp_in)){
+		log_efread("input file");
+		ret = -1;
+		goto cleanup;
+	}
+	if (crypt_stream_finish(cs) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+
+cleanup:
+	crypt_stream_free(cs);
+	crypt_scrub(buffer, sizeof(buffer));
+	return ret;
+}
+
+int crypt_encrypt_fp(FILE* fp_in, struct crypt_keys* fk, FILE* fp_out){
+	return_ifnull(fp_in, -1);
+	return_ifnull(fk, -1);
+	return_ifnull(fp_out, -1);
+
+	if (crypt_stream_fp(crypt_stream_new(fk, crypt_fp_sink, fp_out), fp_in) != 0 || ferror(fp_out)){
+		log_error("Failed to encrypt file");
+		return -1;
+	}
+	return 0;
+}
+
+int crypt_decrypt_fp(FILE* fp_in, struct crypt_keys* fk, FILE* fp_out){
+	return_ifnull(fp_in, -1);
+	return_ifnull(fk, -1);
+	return_ifnull(fp_out, -1);
+
+	if (crypt_stream_fp(crypt_decrypt_stream_new(fk, crypt_fp_sink, fp_out), fp_in) != 0 || ferror(fp_out)){
+		log_error("Failed to decrypt file");
+		return -1;
+	}
+	return 0;
+}
+
+int crypt_decrypt_chunk(struct crypt_keys* fk, unsigned long index, int last, const void* in, size_t in_len, void* out, size_t* out_len){
+	return_ifnull(fk, -1);
+	return_ifnull(in, -1);
+	return_ifnull(out, -1);
+	return_ifnull(out_len, -1);
+
+	if (fk->flag_keys_set == 0){
+		log_error("Decryption keys were not generated (call crypt_gen_keys())");
+		return -1;
+	}
+	if (!crypt_is_aead(fk->encryption)){
+		log_error_ex("%s cannot decrypt one chunk at a time", EVP_CIPHER_name(fk->encryption));
+		return -1;
+	}
+	return aead_open_chunk(fk->encryption, fk->key, fk->iv, index, last, in, in_len, out, out_len);
+}
+
 int crypt_decrypt(const char* in, struct crypt_keys* fk, const char* fp_out){
 	return crypt_decrypt_ex(in, fk, fp_out, 0, NULL);
 }
@@ -10,11 +10,30 @@
 #define __CRYPT_CRYPT_H
 
 #include <openssl/evp.h>
+#include <stddef.h>
+#include <stdio.h>
 
 #ifndef __GNUC__
 #define __attribute__(x)
 #endif
 
+/**
+ * @brief How much plaintext goes in each chunk of a file encrypted with an AEAD cipher.
+ * @see crypt_is_aead()
+ */
+#define CRYPT_CHUNK_LEN (1 << 16)
+
+/**
+ * @brief The length of the per-file nonce that follows the salt in a file encrypted with keys from a session.
+ * @see crypt_session_new()
+ */
+#define CRYPT_NONCE_LEN 16
+
+/**
+ * @brief The length of the authentication tag after each chunk of a file encrypted with an AEAD cipher.
+ */
+#define CRYPT_TAG_LEN 16
+
 /**
  * @brief Holds encryption keys and data.
  */
@@ -69,6 +88,18 @@ unsigned char crypt_randc(void);
  */
 const EVP_CIPHER* crypt_get_cipher(const char* encryption_name);
 
+/**
+ * @brief Checks if a cipher authenticates what it encrypts (AES-GCM or ChaCha20-Poly1305).<br>
+ * Files encrypted with one of these are split into chunks of CRYPT_CHUNK_LEN bytes, each sealed with its own nonce and tag.<br>
+ * This catches tampering, truncation and reordered chunks, lets the chunks be encrypted in parallel, and lets one chunk be decrypted without the rest.
+ * @see crypt_decrypt_chunk()
+ *
+ * @param cipher The cipher to check.
+ *
+ * @return Non-zero if the cipher is an AEAD cipher, 0 if not.
+ */
+int crypt_is_aead(const EVP_CIPHER* cipher);
+
 /**
  * @brief Sets the encryption type.<br>
  * This function must be called after crypt_new()
@@ -83,6 +114,20 @@ const EVP_CIPHER* crypt_get_cipher(const char* encryption_name);
  */
 int crypt_set_encryption(const EVP_CIPHER* encryption, struct crypt_keys* fk);
 
+/**
+ * @brief Sets how many threads encrypt or decrypt the chunks of an AEAD cipher.<br>
+ * This has no effect on other ciphers, which can only be processed in order.
+ * @see crypt_is_aead()
+ *
+ * @param fk A crypt keys structure returned by crypt_new()
+ * @see crypt_new()
+ *
+ * @param n_workers The number of threads, or 0 or 1 to use the calling thread only.
+ *
+ * @return 0 on success, negative on failure.
+ */
+int crypt_set_workers(struct crypt_keys* fk, unsigned n_workers);
+
 /**
  * @brief Generates a random salt.
  *
@@ -106,6 +151,53 @@ int crypt_gen_salt(struct crypt_keys* fk);
  */
 int crypt_set_salt(const unsigned char salt[8], struct crypt_keys* fk);
 
+/**
+ * @brief Marks a crypt keys structure as using keys derived from a session key instead of from the salt.<br>
+ * Files encrypted with it start with "Session_", the salt, and the nonce instead of "Salted__" and the salt, so the same keys can be derived again when decrypting.<br>
+ * This must be followed by crypt_set_keys().
+ * @see crypt_session_encryption_keys()
+ *
+ * @param salt The salt the session key was derived with.
+ *
+ * @param nonce The nonce the file's keys were derived with.
+ *
+ * @param fk A crypt keys structure returned by crypt_new()
+ * @see crypt_new()
+ *
+ * @return 0 on success, negative on failure.
+ */
+int crypt_set_session(const unsigned char salt[8], const unsigned char nonce[CRYPT_NONCE_LEN], struct crypt_keys* fk);
+
+/**
+ * @brief Gets the salt and nonce of a file encrypted with keys from a session.<br>
+ * This is only known after crypt_set_session() or crypt_read_salt().
+ *
+ * @param fk A crypt keys structure.
+ *
+ * @param salt Set to the salt the session key was derived with. This can be NULL.
+ *
+ * @param nonce Set to the nonce the file's keys were derived with. This can be NULL.
+ *
+ * @return 0 on success, positive if the keys come from the salt instead, or negative on failure.
+ */
+int crypt_get_session(const struct crypt_keys* fk, unsigned char salt[8], unsigned char nonce[CRYPT_NONCE_LEN]);
+
+/**
+ * @brief Sets the encryption key and initialization vector directly instead of generating them from a password.<br>
+ * This function must be called after crypt_set_encryption(), and replaces crypt_gen_keys().
+ * @see crypt_gen_keys()
+ *
+ * @param key The key. This must be EVP_CIPHER_key_length() bytes long.
+ *
+ * @param iv The initialization vector. This must be EVP_CIPHER_iv_length() bytes long, or NULL for a cipher that does not have one.
+ *
+ * @param fk A crypt keys structure with its encryption set.
+ * @see crypt_set_encryption()
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int crypt_set_keys(const unsigned char* key, const unsigned char* iv, struct crypt_keys* fk);
+
 /**
  * @brief Generates encryption keys based on a password.<br>
  * This function must be called after crypt_set_encryption().<br>
@@ -172,6 +264,86 @@ int crypt_encrypt(const char* in, struct crypt_keys* fk, const char* out);
  */
 int crypt_encrypt_ex(const char* in, struct crypt_keys* fk, const char* out, int verbose, const char* progress_msg);
 
+/**
+ * @brief An encryption stream that hands its output to a callback instead of a file.
+ */
+struct crypt_stream;
+
+/**
+ * @brief Starts an encryption stream using a crypt keys structure.<br>
+ * The output has the same format as crypt_encrypt(), so it can be decrypted with crypt_decrypt().<br>
+ * This function must be called after crypt_gen_keys().
+ * @see crypt_gen_keys()
+ *
+ * @param fk The crypt keys structure to encrypt with.<br>
+ * This must stay valid until the stream is freed.
+ *
+ * @param sink A function that receives each block of encrypted output.<br>
+ * It must return 0 on success or non-zero to abort the stream.
+ *
+ * @param sink_data An argument to pass to sink.
+ *
+ * @return An encryption stream, or NULL on failure.<br>
+ * This stream must be freed with crypt_stream_free() when no longer in use.
+ * @see crypt_stream_free()
+ */
+struct crypt_stream* crypt_stream_new(struct crypt_keys* fk, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data) __attribute__((malloc));
+
+/**
+ * @brief Starts a decryption stream using a crypt keys structure.<br>
+ * The stream takes the data that follows the salt in a file written by crypt_encrypt() or crypt_stream_new(), and hands the decrypted data to a callback.<br>
+ * This function must be called after crypt_read_salt() and crypt_gen_keys(), in that order.
+ * @see crypt_read_salt()
+ * @see crypt_gen_keys()
+ *
+ * @param fk The crypt keys structure to decrypt with.<br>
+ * This must stay valid until the stream is freed.
+ *
+ * @param sink A function that receives each block of decrypted output.<br>
+ * It must return 0 on success or non-zero to abort the stream.
+ *
+ * @param sink_data An argument to pass to sink.
+ *
+ * @return A decryption stream, or NULL on failure.<br>
+ * This stream must be freed with crypt_stream_free() when no longer in use.
+ * @see crypt_stream_free()
+ */
+struct crypt_stream* crypt_decrypt_stream_new(struct crypt_keys* fk, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data) __attribute__((malloc));
+
+/**
+ * @brief Encrypts or decrypts a block of data, depending on how the stream was started.
+ *
+ * @param cs A stream returned by crypt_stream_new() or crypt_decrypt_stream_new().
+ *
+ * @param data The data to encrypt.
+ *
+ * @param len The length of the data in bytes.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int crypt_stream_write(struct crypt_stream* cs, const void* data, size_t len);
+
+/**
+ * @brief Writes any padding data to the sink.<br>
+ * For a decryption stream, this checks and strips the padding, which fails if the password was wrong or the data was truncated.<br>
+ * No more data can be written to the stream after this function is called.
+ *
+ * @param cs A stream returned by crypt_stream_new() or crypt_decrypt_stream_new().
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int crypt_stream_finish(struct crypt_stream* cs);
+
+/**
+ * @brief Frees all memory associated with an encryption or decryption stream.
+ *
+ * @param cs The stream to free.<br>
+ * This can be NULL, in which case this function does nothing.
+ *
+ * @return void
+ */
+void crypt_stream_free(struct crypt_stream* cs);
+
 /**
  * @brief Decrypts a file using a crypt keys structure.<br>
  * This function must be called after crypt_gen_keys() and crypt_extract_salt()<br>
@@ -213,6 +385,110 @@ int crypt_decrypt(const char* in, struct crypt_keys* fk, const char* out);
  */
 int crypt_decrypt_ex(const char* in, struct crypt_keys* fk, const char* out, int verbose, const char* progress_msg);
 
+/**
+ * @brief Gets how big a buffer crypt_encrypt_buf() needs for some data.
+ *
+ * @param fk The crypt keys structure that will encrypt the data.
+ *
+ * @param len The length of the data in bytes.
+ *
+ * @return The most bytes the encrypted data can take, including its header.
+ */
+size_t crypt_encrypted_len(const struct crypt_keys* fk, size_t len);
+
+/**
+ * @brief Encrypts data in memory, without touching the filesystem.<br>
+ * The output is the same as crypt_encrypt() would write to a file, so it can be decrypted with either crypt_decrypt() or crypt_decrypt_buf().<br>
+ * This function must be called after crypt_gen_keys().
+ * @see crypt_gen_keys()
+ *
+ * @param in The data to encrypt.
+ *
+ * @param in_len The length of the data in bytes.
+ *
+ * @param fk The crypt keys structure to encrypt with.
+ *
+ * @param out The buffer to write the encrypted data to.
+ *
+ * @param out_size The size of out in bytes. This function fails if it is smaller than needed.
+ * @see crypt_encrypted_len()
+ *
+ * @param out_len Set to the length of the encrypted data. This can be NULL.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int crypt_encrypt_buf(const void* in, size_t in_len, struct crypt_keys* fk, void* out, size_t out_size, size_t* out_len);
+
+/**
+ * @brief Reads the salt from the start of encrypted data in memory.
+ * @see crypt_read_salt()
+ *
+ * @param in Encrypted data, starting at its first byte.
+ *
+ * @param in_len The length of the encrypted data in bytes.
+ *
+ * @param fk A crypt keys structure returned by crypt_new()
+ * @see crypt_new()
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int crypt_read_salt_buf(const void* in, size_t in_len, struct crypt_keys* fk);
+
+/**
+ * @brief Decrypts data in memory, without touching the filesystem.<br>
+ * This function must be called after crypt_read_salt_buf() and crypt_gen_keys(), in that order.
+ * @see crypt_read_salt_buf()
+ * @see crypt_gen_keys()
+ *
+ * @param in Data from crypt_encrypt_buf() or the contents of a file from crypt_encrypt(), including its header.
+ *
+ * @param in_len The length of the encrypted data in bytes.
+ *
+ * @param fk The crypt keys structure to decrypt with.
+ *
+ * @param out The buffer to write the decrypted data to.<br>
+ * The decrypted data is never longer than in_len.<br>
+ * If this function fails, anything already written here is scrubbed.
+ *
+ * @param out_size The size of out in bytes.
+ *
+ * @param out_len Set to the length of the decrypted data. This can be NULL.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int crypt_decrypt_buf(const void* in, size_t in_len, struct crypt_keys* fk, void* out, size_t out_size, size_t* out_len);
+
+/**
+ * @brief Encrypts the rest of an open file into another open file.<br>
+ * Unlike crypt_encrypt(), this does not open, remove, or rename anything.<br>
+ * This function must be called after crypt_gen_keys().
+ * @see crypt_gen_keys()
+ *
+ * @param fp_in The file to encrypt, opened for reading.
+ *
+ * @param fk The crypt keys structure to encrypt with.
+ *
+ * @param fp_out The file to write the header and encrypted data to, opened for writing.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int crypt_encrypt_fp(FILE* fp_in, struct crypt_keys* fk, FILE* fp_out);
+
+/**
+ * @brief Decrypts the rest of an open file into another open file.<br>
+ * This function must be called after crypt_read_salt() and crypt_gen_keys(), in that order, which leaves fp_in at the start of the encrypted data.
+ * @see crypt_read_salt()
+ *
+ * @param fp_in The file to decrypt, opened for reading just past its header.
+ *
+ * @param fk The crypt keys structure to decrypt with.
+ *
+ * @param fp_out The file to write the decrypted data to, opened for writing.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int crypt_decrypt_fp(FILE* fp_in, struct crypt_keys* fk, FILE* fp_out);
+
 /**
  * @brief Extracts the salt from an encrypted file.
  *
@@ -225,6 +501,53 @@ int crypt_decrypt_ex(const char* in, struct crypt_keys* fk, const char* out, int
  */
 int crypt_extract_salt(const char* in, struct crypt_keys* fk);
 
+/**
+ * @brief Reads the salt from the start of an open encrypted file.<br>
+ * On success, the file pointer is left at the first byte of the encrypted data, so the rest of the file can be fed to crypt_decrypt_stream_new().<br>
+ * For a file encrypted with keys from a session, this also reads the nonce, after which crypt_get_session() returns 0.
+ * @see crypt_extract_salt()
+ *
+ * @param fp_in An encrypted file opened for reading, positioned at its first byte.
+ *
+ * @param fk A crypt keys structure returned by crypt_new()
+ * @see crypt_new()
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int crypt_read_salt(FILE* fp_in, struct crypt_keys* fk);
+
+/**
+ * @brief Decrypts a single chunk of a file encrypted with an AEAD cipher, without reading the rest of the file.<br>
+ * Chunk index starts CRYPT_AEAD_OFFSET(chunk_len, index) bytes into the file, where chunk_len is the chunk length stored in the file's header.<br>
+ * This function must be called after crypt_gen_keys() and crypt_extract_salt()
+ * @see crypt_is_aead()
+ *
+ * @param fk The crypt keys structure to decrypt with.
+ *
+ * @param index The index of the chunk, starting at 0.
+ *
+ * @param last Non-zero if this is the last chunk of the file, 0 if not.<br>
+ * This is authenticated, so getting it wrong fails the same way tampered data does.
+ *
+ * @param in The encrypted chunk, including its tag.
+ *
+ * @param in_len The length of the encrypted chunk in bytes.
+ *
+ * @param out Set to the decrypted chunk. This must have room for in_len - CRYPT_TAG_LEN bytes.
+ *
+ * @param out_len Set to the length of the decrypted chunk.
+ *
+ * @return 0 on success, or negative if the chunk could not be authenticated.
+ */
+int crypt_decrypt_chunk(struct crypt_keys* fk, unsigned long index, int last, const void* in, size_t in_len, void* out, size_t* out_len);
+
+/**
+ * @brief Where chunk index of a file encrypted with an AEAD cipher starts.<br>
+ * That is the salt header, the 4-byte chunk length, and every chunk before it.<br>
+ * A file encrypted with keys from a session has CRYPT_NONCE_LEN more bytes before every chunk.
+ */
+#define CRYPT_AEAD_OFFSET(chunk_len, index) (16 + 4 + (unsigned long)(index) * ((chunk_len) + CRYPT_TAG_LEN))
+
 /**
  * @brief Frees all memory associated with a crypt keys structure.<br>
  * This also scrubs sensitive data like encryption keys and the initialization vector.
@@ -0,0 +1,314 @@
+/** @file crypt/crypt_aead.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#define __CRYPT_INTERNAL
+#include "crypt_aead.h"
+#include "../log.h"
+#include "../blockring.h"
+#include <openssl/err.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* index (8 bytes) + the last chunk flag, authenticated with every chunk so chunks cannot be reordered, dropped or cut off */
+#define AEAD_AAD_LEN 9
+/* the chunk length is the only thing between the salt and the first chunk */
+#define AEAD_HEADER_LEN 4
+/* anything bigger than this in a header is corruption, not a real chunk length */
+#define AEAD_MAX_CHUNK_LEN ((size_t)1 << 24)
+
+/* one chunk, sealed or opened on a worker thread with its own context */
+struct aead_block{
+	struct aead_stream* as;
+	EVP_CIPHER_CTX* ctx;
+	unsigned char* in;
+	size_t in_len;
+	unsigned char* out;
+	size_t out_len;
+	uint64_t index;
+	int last;
+	int ret;
+};
+
+struct aead_stream{
+	const EVP_CIPHER* cipher;
+	unsigned char key[EVP_MAX_KEY_LENGTH];
+	unsigned char iv[EVP_MAX_IV_LENGTH];
+	int encrypt;
+	/* 0 until a decryption stream has read the header */
+	size_t chunk_len;
+	unsigned char header[AEAD_HEADER_LEN];
+	size_t header_len;
+	/* its workers are only started once a file turns out to have more than one chunk */
+	struct block_ring ring;
+	struct aead_block* blocks;
+	uint64_t next_index;
+	int(*sink)(const void* data, size_t len, void* sink_data);
+	void* sink_data;
+};
+
+/* the base iv with the chunk index in its last 8 bytes, so no two chunks under the same key share a nonce */
+static void aead_nonce(const unsigned char* iv, int iv_len, uint64_t index, unsigned char* out){
+	int i;
+
+	memcpy(out, iv, iv_len);
+	for (i = 0; i < 8; ++i){
+		out[iv_len - 1 - i] ^= (unsigned char)(index >> (i * 8));
+	}
+}
+
+static void aead_aad(uint64_t index, int last, unsigned char* out){
+	int i;
+
+	for (i = 0; i < 8; ++i){
+		out[7 - i] = (unsigned char)(index >> (i * 8));
+	}
+	out[8] = last ? 1 : 0;
+}
+
+/* seals in into out followed by its tag, or checks and strips the tag from in, depending on encrypt */
+static int aead_chunk(EVP_CIPHER_CTX* ctx, const EVP_CIPHER* cipher, const unsigned char* key, const unsigned char* iv, int encrypt, uint64_t index, int last, const unsigned char* in, size_t in_len, unsigned char* out, size_t* out_len){
+	unsigned char nonce[EVP_MAX_IV_LENGTH];
+	unsigned char aad[AEAD_AAD_LEN];
+	size_t data_len;
+	int len;
+	int final_len;
+
+	if (!encrypt && in_len < CRYPT_TAG_LEN){
+		log_error("Encrypted chunk is too short (the data was truncated)");
+		return -1;
+	}
+	data_len = encrypt ? in_len : in_len - CRYPT_TAG_LEN;
+
+	aead_nonce(iv, EVP_CIPHER_iv_length(cipher), index, nonce);
+	aead_aad(index, last, aad);
+
+	/* the key schedule is only worked out the first time a context is used */
+	if (EVP_CipherInit_ex(ctx, key ? cipher : NULL, NULL, key, nonce, encrypt) != 1 ||
+			(!encrypt && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, CRYPT_TAG_LEN, (void*)(in + data_len)) != 1) ||
+			EVP_CipherUpdate(ctx, NULL, &len, aad, sizeof(aad)) != 1 ||
+			EVP_CipherUpdate(ctx, out, &len, in, (int)data_len) != 1){
+		log_error_ex("Failed to %s chunk", encrypt ? "encrypt" : "decrypt");
+		ERR_print_errors_fp(stderr);
+		return -1;
+	}
+	if (EVP_CipherFinal_ex(ctx, out + len, &final_len) != 1){
+		/* a wrong password shows up here, on the very first chunk */
+		log_error_ex(encrypt ? "Failed to encrypt chunk %lu" : "Chunk %lu failed authentication (wrong password or corrupted data)", (unsigned long)index);
+		return -1;
+	}
+	if (encrypt && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, CRYPT_TAG_LEN, out + data_len) != 1){
+		log_error("Failed to get the chunk's authentication tag");
+		ERR_print_errors_fp(stderr);
+		return -1;
+	}
+
+	*out_len = encrypt ? data_len + CRYPT_TAG_LEN : data_len;
+	return 0;
+}
+
+static void aead_block_run(void* arg){
+	struct aead_block* b = arg;
+	struct aead_stream* as = b->as;
+
+	b->ret = aead_chunk(b->ctx, as->cipher, NULL, as->iv, as->encrypt, b->index, b->last, b->in, b->in_len, b->out, &b->out_len);
+}
+
+/* every chunk but the last is exactly chunk_len long, plus the tag when it is encrypted */
+static size_t aead_in_len(const struct aead_stream* as){
+	return as->encrypt ? as->chunk_len : as->chunk_len + CRYPT_TAG_LEN;
+}
+
+static int aead_alloc_blocks(struct aead_stream* as){
+	size_t i;
+
+	as->blocks = calloc(as->ring.n_blocks, sizeof(*as->blocks));
+	if (!as->blocks){
+		log_enomem();
+		return -1;
+	}
+	for (i = 0; i < as->ring.n_blocks; ++i){
+		struct aead_block* b = &as->blocks[i];
+
+		b->as = as;
+		b->in = malloc(as->chunk_len + CRYPT_TAG_LEN);
+		b->out = malloc(as->chunk_len + CRYPT_TAG_LEN);
+		b->ctx = EVP_CIPHER_CTX_new();
+		if (!b->in || !b->out || !b->ctx){
+			log_enomem();
+			return -1;
+		}
+		if (EVP_CipherInit_ex(b->ctx, as->cipher, NULL, as->key, NULL, as->encrypt) != 1){
+			log_error_ex("Failed to initialize %s", as->encrypt ? "encryption" : "decryption");
+			ERR_print_errors_fp(stderr);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* hands the finished chunks to the sink in order */
+static int aead_flush(size_t n_queued, void* flush_data){
+	struct aead_stream* as = flush_data;
+	size_t i;
+
+	for (i = 0; i < n_queued; ++i){
+		struct aead_block* b = &as->blocks[i];
+
+		if (b->ret != 0){
+			return -1;
+		}
+		if (b->out_len > 0 && as->sink(b->out, b->out_len, as->sink_data) != 0){
+			log_error_ex("Failed to write %s data", as->encrypt ? "encrypted" : "decrypted");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int aead_submit(struct aead_stream* as, int last){
+	struct aead_block* b = &as->blocks[as->ring.n_queued];
+
+	b->index = as->next_index++;
+	b->last = last;
+	b->ret = -1;
+	if (br_submit(&as->ring, aead_block_run, b, last) != 0){
+		return -1;
+	}
+	as->blocks[as->ring.n_queued].in_len = 0;
+	return 0;
+}
+
+struct aead_stream* aead_stream_new(const EVP_CIPHER* cipher, const unsigned char* key, const unsigned char* iv, int encrypt, size_t n_workers, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	struct aead_stream* as;
+
+	as = calloc(1, sizeof(*as));
+	if (!as){
+		log_enomem();
+		return NULL;
+	}
+	as->cipher = cipher;
+	memcpy(as->key, key, EVP_CIPHER_key_length(cipher));
+	memcpy(as->iv, iv, EVP_CIPHER_iv_length(cipher));
+	as->encrypt = encrypt;
+	br_init(&as->ring, n_workers, aead_flush, as);
+	as->sink = sink;
+	as->sink_data = sink_data;
+
+	if (!encrypt){
+		return as;
+	}
+
+	as->chunk_len = CRYPT_CHUNK_LEN;
+	as->header[0] = (unsigned char)(as->chunk_len >> 24);
+	as->header[1] = (unsigned char)(as->chunk_len >> 16);
+	as->header[2] = (unsigned char)(as->chunk_len >> 8);
+	as->header[3] = (unsigned char)as->chunk_len;
+	if (aead_alloc_blocks(as) != 0 || sink(as->header, sizeof(as->header), sink_data) != 0){
+		log_error("Failed to start encrypted chunk stream");
+		aead_stream_free(as);
+		return NULL;
+	}
+	return as;
+}
+
+int aead_stream_write(struct aead_stream* as, const void* data, size_t len){
+	const unsigned char* ptr = data;
+
+	/* the chunk length comes first, and nothing can be decrypted before it is known */
+	while (!as->chunk_len && len > 0){
+		as->header[as->header_len++] = *ptr++;
+		len--;
+		if (as->header_len == sizeof(as->header)){
+			as->chunk_len = ((size_t)as->header[0] << 24) | ((size_t)as->header[1] << 16) | ((size_t)as->header[2] << 8) | as->header[3];
+			if (as->chunk_len == 0 || as->chunk_len > AEAD_MAX_CHUNK_LEN){
+				log_error("Encrypted file has an invalid chunk length");
+				as->chunk_len = 0;
+				return -1;
+			}
+			if (aead_alloc_blocks(as) != 0){
+				return -1;
+			}
+		}
+	}
+
+	while (len > 0){
+		struct aead_block* b = &as->blocks[as->ring.n_queued];
+		size_t n;
+
+		/* a full chunk is only sent off once more data shows up, since the last one has to be marked as such */
+		if (b->in_len == aead_in_len(as)){
+			if (aead_submit(as, 0) != 0){
+				return -1;
+			}
+			continue;
+		}
+
+		n = aead_in_len(as) - b->in_len;
+		if (n > len){
+			n = len;
+		}
+		memcpy(b->in + b->in_len, ptr, n);
+		b->in_len += n;
+		ptr += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int aead_stream_finish(struct aead_stream* as){
+	if (!as->chunk_len){
+		log_error("Encrypted file is missing its header (the data was truncated)");
+		return -1;
+	}
+	if (aead_submit(as, 1) != 0 || (as->ring.n_queued > 0 && br_flush(&as->ring) != 0)){
+		return -1;
+	}
+	return 0;
+}
+
+void aead_stream_free(struct aead_stream* as){
+	size_t i;
+
+	if (!as){
+		return;
+	}
+	/* waits for anything still running before its buffers go away */
+	br_free(&as->ring);
+	for (i = 0; as->blocks && i < as->ring.n_blocks; ++i){
+		if (as->blocks[i].ctx){
+			EVP_CIPHER_CTX_free(as->blocks[i].ctx);
+		}
+		if (as->blocks[i].in){
+			crypt_scrub(as->blocks[i].in, (int)(as->chunk_len + CRYPT_TAG_LEN));
+		}
+		if (as->blocks[i].out){
+			crypt_scrub(as->blocks[i].out, (int)(as->chunk_len + CRYPT_TAG_LEN));
+		}
+		free(as->blocks[i].in);
+		free(as->blocks[i].out);
+	}
+	free(as->blocks);
+	crypt_scrub(as->key, sizeof(as->key));
+	crypt_scrub(as->iv, sizeof(as->iv));
+	free(as);
+}
+
+int aead_open_chunk(const EVP_CIPHER* cipher, const unsigned char* key, const unsigned char* iv, uint64_t index, int last, const void* in, size_t in_len, void* out, size_t* out_len){
+	EVP_CIPHER_CTX* ctx;
+	int ret;
+
+	ctx = EVP_CIPHER_CTX_new();
+	if (!ctx){
+		log_error("Failed to initialize EVP_CIPHER_CTX");
+		ERR_print_errors_fp(stderr);
+		return -1;
+	}
+	ret = aead_chunk(ctx, cipher, key, iv, 0, index, last, in, in_len, out, out_len);
+	EVP_CIPHER_CTX_free(ctx);
+	return ret;
+}
@@ -0,0 +1,26 @@
+/** @file crypt/crypt_aead.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __CRYPT_CRYPT_AEAD_H
+#define __CRYPT_CRYPT_AEAD_H
+
+#ifndef __CRYPT_INTERNAL
+#error "Include crypt.h, not crypt_aead.h"
+#endif
+
+#include "crypt.h"
+#include <stdint.h>
+
+struct aead_stream;
+struct aead_stream* aead_stream_new(const EVP_CIPHER* cipher, const unsigned char* key, const unsigned char* iv, int encrypt, size_t n_workers, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data);
+int aead_stream_write(struct aead_stream* as, const void* data, size_t len);
+int aead_stream_finish(struct aead_stream* as);
+void aead_stream_free(struct aead_stream* as);
+int aead_open_chunk(const EVP_CIPHER* cipher, const unsigned char* key, const unsigned char* iv, uint64_t index, int last, const void* in, size_t in_len, void* out, size_t* out_len);
+
+#endif
@@ -9,32 +9,35 @@
 #include "crypt_easy.h"
 #include "crypt.h"
 #include "crypt_getpassword.h"
+#include "crypt_session.h"
 #include "../log.h"
 #include "../coredumps.h"
 #include "../filehelper.h"
 #include "../strings/stringhelper.h"
+#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 
-int easy_encrypt(const char* in, const char* out, const char* enc_algorithm, int verbose, const char* password){
+/* files up to this size are encrypted or decrypted in place in memory, instead of going through a temporary file */
+#define EASY_INPLACE_MEM_LEN ((uint64_t)1 << 20)
+
+int easy_encryption_keys(const char* enc_algorithm, const char* password, struct crypt_keys** out){
 	const EVP_CIPHER* cipher = crypt_get_cipher(enc_algorithm);
 	struct crypt_keys* fk = NULL;
 	char prompt[128];
 	char verify_prompt[128];
 	char* passwd = NULL;
-	char* verbose_msg = NULL;
 	int ret = 0;
 
+	return_ifnull(out, -1);
+	*out = NULL;
+
 	if (!cipher){
 		log_error("Could not load proper encryption algorithm.");
 		ret = -1;
 		goto cleanup;
 	}
 
-	/* disable core dumps if possible */
-	if (disable_core_dumps() != 0){
-		log_warning("Core dumps could not be disabled\n");
-	}
-
 	if ((fk = crypt_new()) == NULL){
 		log_debug("Failed to generate new struct crypt_keys");
 		ret = -1;
@@ -62,19 +65,187 @@ int easy_encrypt(const char* in, const char* out, const char* enc_algorithm, int
 		}
 		if (ret < 0){
 			log_debug("crypt_getpassword() failed");
-			crypt_scrub(passwd, strlen(passwd));
 			ret = -1;
 			goto cleanup;
 		}
 	}
 
 	if ((crypt_gen_keys(password ? (unsigned char*)password : (unsigned char*)passwd, password ? strlen(password) : strlen(passwd), NULL, 1, fk)) != 0){
-		crypt_scrub(passwd, strlen(passwd));
 		log_debug("crypt_gen_keys() failed");
 		ret = -1;
 		goto cleanup;
 	}
 
+	*out = fk;
+
+cleanup:
+	if (ret != 0){
+		/* shreds keys as well */
+		fk ? crypt_free(fk) : (void)0;
+	}
+	passwd ? crypt_freepassword(passwd) : (void)0;
+	return ret;
+}
+
+/* generates the keys for a file whose salt was already read */
+static int easy_decryption_gen_keys(const EVP_CIPHER* cipher, const char* password, struct crypt_keys* fk){
+	struct crypt_session* cs;
+
+	if (crypt_get_session(fk, NULL, NULL) != 0){
+		if (crypt_gen_keys((const unsigned char*)password, strlen(password), NULL, 1, fk) != 0){
+			log_debug("crypt_gen_keys() failed");
+			return -1;
+		}
+		return 0;
+	}
+
+	/* written with keys from a session, so the session key has to be derived for this one file */
+	cs = crypt_session_new(cipher, password);
+	if (!cs || crypt_session_set_keys(cs, fk) != 0){
+		log_debug("crypt_session_set_keys() failed");
+		crypt_session_free(cs);
+		return -1;
+	}
+	crypt_session_free(cs);
+	return 0;
+}
+
+int easy_decryption_keys(const char* enc_algorithm, FILE* fp_in, const char* password, struct crypt_keys** out){
+	const EVP_CIPHER* cipher = crypt_get_cipher(enc_algorithm);
+	struct crypt_keys* fk = NULL;
+	char prompt[128];
+	char* passwd = NULL;
+	int ret = 0;
+
+	return_ifnull(fp_in, -1);
+	return_ifnull(out, -1);
+	*out = NULL;
+
+	if (!cipher){
+		log_error("Could not load proper encryption algorithm.");
+		ret = -1;
+		goto cleanup;
+	}
+
+	if ((fk = crypt_new()) == NULL){
+		log_debug("Failed to generate new struct crypt_keys");
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (crypt_set_encryption(cipher, fk) != 0){
+		log_debug("Could not set encryption type");
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (crypt_read_salt(fp_in, fk) != 0){
+		log_debug("crypt_read_salt() failed");
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (!password){
+		sprintf(prompt, "Enter %s decryption password:", enc_algorithm);
+		if (crypt_getpassword(prompt, NULL, &passwd) != 0){
+			log_debug("crypt_getpassword() failed");
+			ret = -1;
+			goto cleanup;
+		}
+	}
+
+	if (easy_decryption_gen_keys(cipher, password ? password : passwd, fk) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+
+	*out = fk;
+
+cleanup:
+	if (ret != 0){
+		/* shreds keys as well */
+		fk ? crypt_free(fk) : (void)0;
+	}
+	passwd ? crypt_freepassword(passwd) : (void)0;
+	return ret;
+}
+
+int easy_decryption_keys_buf(const char* enc_algorithm, const void* in, size_t in_len, const char* password, struct crypt_keys** out){
+	const EVP_CIPHER* cipher = crypt_get_cipher(enc_algorithm);
+	struct crypt_keys* fk = NULL;
+	char prompt[128];
+	char* passwd = NULL;
+	int ret = 0;
+
+	return_ifnull(in, -1);
+	return_ifnull(out, -1);
+	*out = NULL;
+
+	if (!cipher){
+		log_error("Could not load proper encryption algorithm.");
+		ret = -1;
+		goto cleanup;
+	}
+
+	if ((fk = crypt_new()) == NULL){
+		log_debug("Failed to generate new struct crypt_keys");
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (crypt_set_encryption(cipher, fk) != 0){
+		log_debug("Could not set encryption type");
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (crypt_read_salt_buf(in, in_len, fk) != 0){
+		log_debug("crypt_read_salt_buf() failed");
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (!password){
+		sprintf(prompt, "Enter %s decryption password:", enc_algorithm);
+		if (crypt_getpassword(prompt, NULL, &passwd) != 0){
+			log_debug("crypt_getpassword() failed");
+			ret = -1;
+			goto cleanup;
+		}
+	}
+
+	if (easy_decryption_gen_keys(cipher, password ? password : passwd, fk) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+
+	*out = fk;
+
+cleanup:
+	if (ret != 0){
+		/* shreds keys as well */
+		fk ? crypt_free(fk) : (void)0;
+	}
+	passwd ? crypt_freepassword(passwd) : (void)0;
+	return ret;
+}
+
+int easy_encrypt(const char* in, const char* out, const char* enc_algorithm, int verbose, const char* password){
+	struct crypt_keys* fk = NULL;
+	char* verbose_msg = NULL;
+	int ret = 0;
+
+	/* disable core dumps if possible */
+	if (disable_core_dumps() != 0){
+		log_warning("Core dumps could not be disabled\n");
+	}
+
+	if (easy_encryption_keys(enc_algorithm, password, &fk) != 0){
+		log_debug("Could not generate encryption keys");
+		ret = -1;
+		goto cleanup;
+	}
+
 	if (verbose){
 		verbose_msg = sh_concat(sh_concat(sh_dup("Encrypting "), out), "...");
 		if (!verbose_msg){
@@ -90,12 +261,11 @@ int easy_encrypt(const char* in, const char* out, const char* enc_algorithm, int
 cleanup:
 	/* shreds keys as well */
 	fk ? crypt_free(fk) : (void)0;
-	passwd ? crypt_freepassword(passwd) : (void)0;
 	free(verbose_msg);
 	if (enable_core_dumps() != 0){
 		log_debug("enable_core_dumps() failed");
 	}
-	return 0;
+	return ret;
 }
 
 int easy_decrypt(const char* in, const char* out, const char* enc_algorithm, int verbose, const char* password){
@@ -142,9 +312,7 @@ int easy_decrypt(const char* in, const char* out, const char* enc_algorithm, int
 		}
 	}
 
-	if ((crypt_gen_keys(password ? (unsigned char*)password : (unsigned char*)passwd, password ? strlen(password) : strlen(passwd), NULL, 1, fk)) != 0){
-		crypt_scrub(passwd, strlen(passwd));
-		log_debug("crypt_gen_keys() failed");
+	if (easy_decryption_gen_keys(cipher, password ? password : passwd, fk) != 0){
 		ret = -1;
 		goto cleanup;
 	}
@@ -171,70 +339,142 @@ cleanup:
 	return ret;
 }
 
-int easy_encrypt_inplace(const char* in_out, const char* enc_algorithm, int verbose, const char* password){
-	struct TMPFILE* tfp_tmp = NULL;
+/* reads all of in_out, turns it into its encrypted or decrypted form in memory, and writes it back */
+static int easy_crypt_inplace_mem(const char* in_out, const char* enc_algorithm, const char* password, int encrypt){
+	struct crypt_keys* fk = NULL;
+	unsigned char* data = NULL;
+	unsigned char* out = NULL;
+	size_t len;
+	size_t out_size;
+	size_t out_len = 0;
+	FILE* fp = NULL;
+	struct ATOMICFILE* af = NULL;
 	int ret = 0;
 
-	tfp_tmp = temp_fopen();
-	if (!tfp_tmp){
-		log_error("Failed to make temporary file");
+	fp = fopen(in_out, "rb");
+	if (!fp){
+		log_efopen(in_out);
 		ret = -1;
 		goto cleanup;
 	}
+	len = (size_t)get_file_size_fp(fp);
 
-	if (rename_file(in_out, tfp_tmp->name) != 0){
-		log_error("Failed to move file to temporary location");
+	/* reading the salt moves past the header, so the whole file is read after it */
+	if ((encrypt ? easy_encryption_keys(enc_algorithm, password, &fk) : easy_decryption_keys(enc_algorithm, fp, password, &fk)) != 0){
+		log_debug("Could not generate keys");
 		ret = -1;
 		goto cleanup;
 	}
-	temp_fflush(tfp_tmp);
+	rewind(fp);
 
-	if (easy_encrypt(tfp_tmp->name, in_out, enc_algorithm, verbose, password) != 0){
-		log_error("easy_encrypt() failed");
+	out_size = encrypt ? crypt_encrypted_len(fk, len) : len;
+	data = malloc(len + 1);
+	out = malloc(out_size + 1);
+	if (!data || !out){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+	if ((size_t)read_file(fp, data, len) != len){
+		log_efread(in_out);
 		ret = -1;
 		goto cleanup;
 	}
+	fclose(fp);
+	fp = NULL;
 
-cleanup:
-	if (ret != 0 && tfp_tmp){
-		rename_file(tfp_tmp->name, in_out);
+	if ((encrypt ? crypt_encrypt_buf(data, len, fk, out, out_size, &out_len) : crypt_decrypt_buf(data, len, fk, out, out_size, &out_len)) != 0){
+		ret = -1;
+		goto cleanup;
 	}
-	tfp_tmp ? remove(tfp_tmp->name) : 0;
-	tfp_tmp ? temp_fclose(tfp_tmp) : (void)0;
 
-	return 0;
+	/* the original stays where it is until the whole result replaces it */
+	if (!(af = atomic_fopen(in_out))){
+		ret = -1;
+		goto cleanup;
+	}
+	if (fwrite(out, 1, out_len, af->fp) != out_len){
+		log_efwrite(in_out);
+		ret = -1;
+		goto cleanup;
+	}
+	if (atomic_fcommit(af) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+
+cleanup:
+	fp ? fclose(fp) : 0;
+	atomic_fclose(af);
+	/* whichever one has the plaintext */
+	if (data){
+		crypt_scrub(data, (int)len);
+	}
+	if (out){
+		crypt_scrub(out, (int)out_size);
+	}
+	free(data);
+	free(out);
+	fk ? crypt_free(fk) : (void)0;
+	return ret;
 }
 
-int easy_decrypt_inplace(const char* in_out, const char* enc_algorithm, int verbose, const char* password){
-	struct TMPFILE* tfp_tmp = NULL;
+/* streams a file too big for memory into its replacement, which is published over it once it is complete */
+static int easy_crypt_inplace_file(const char* in_out, const char* enc_algorithm, const char* password, int encrypt){
+	struct crypt_keys* fk = NULL;
+	struct ATOMICFILE* af = NULL;
+	FILE* fp = NULL;
 	int ret = 0;
 
-	tfp_tmp = temp_fopen();
-	if (!tfp_tmp){
-		log_error("Failed to generate temporary file");
+	fp = fopen(in_out, "rb");
+	if (!fp){
+		log_efopen(in_out);
 		ret = -1;
 		goto cleanup;
 	}
 
-	if (rename_file(in_out, tfp_tmp->name) != 0){
-		log_error("Failed to move file to temporary location");
+	/* reading the salt leaves fp at the start of the encrypted data, which is where crypt_decrypt_fp() wants it */
+	if ((encrypt ? easy_encryption_keys(enc_algorithm, password, &fk) : easy_decryption_keys(enc_algorithm, fp, password, &fk)) != 0){
+		log_debug("Could not generate keys");
 		ret = -1;
 		goto cleanup;
 	}
-	temp_fflush(tfp_tmp);
 
-	if (easy_decrypt(tfp_tmp->name, in_out, enc_algorithm, verbose, password) != 0){
-		log_error("easy_decrypt failed");
+	if (!(af = atomic_fopen(in_out))){
+		ret = -1;
+		goto cleanup;
+	}
+	if ((encrypt ? crypt_encrypt_fp(fp, fk, af->fp) : crypt_decrypt_fp(fp, fk, af->fp)) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+	if (atomic_fcommit(af) != 0){
 		ret = -1;
 		goto cleanup;
 	}
 
 cleanup:
-	if (ret != 0 && tfp_tmp){
-		rename_file(tfp_tmp->name, in_out);
+	fp ? fclose(fp) : 0;
+	atomic_fclose(af);
+	fk ? crypt_free(fk) : (void)0;
+	return ret;
+}
+
+int easy_encrypt_inplace(const char* in_out, const char* enc_algorithm, int verbose, const char* password){
+	(void)verbose;
+
+	/* too small to be worth streaming */
+	if (get_file_size(in_out) <= EASY_INPLACE_MEM_LEN){
+		return easy_crypt_inplace_mem(in_out, enc_algorithm, password, 1);
 	}
-	tfp_tmp ? remove(tfp_tmp->name) : 0;
-	tfp_tmp ? temp_fclose(tfp_tmp) : (void)0;
+	return easy_crypt_inplace_file(in_out, enc_algorithm, password, 1);
+}
 
-	return ret;
+int easy_decrypt_inplace(const char* in_out, const char* enc_algorithm, int verbose, const char* password){
+	(void)verbose;
+
+	if (get_file_size(in_out) <= EASY_INPLACE_MEM_LEN){
+		return easy_crypt_inplace_mem(in_out, enc_algorithm, password, 0);
+	}
+	return easy_crypt_inplace_file(in_out, enc_algorithm, password, 0);
 }
@@ -9,6 +9,69 @@
 #ifndef __CRYPT_CRYPT_EASY_H
 #define __CRYPT_CRYPT_EASY_H
 
+#include "crypt.h"
+
+/**
+ * @brief Generates a fresh salt and encryption keys from a password.<br>
+ * The keys can be used with crypt_encrypt() or crypt_stream_new().
+ * @see crypt_stream_new()
+ *
+ * @param enc_algorithm The encryption algorithm to use (e.g. "AES-256-CBC")
+ *
+ * @param password The password to use.<br>
+ * If this is NULL, the user is asked for a password.
+ *
+ * @param out A pointer to the crypt keys structure to fill.<br>
+ * This will be set to NULL on failure.<br>
+ * This structure must be freed with crypt_free() when no longer in use.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int easy_encryption_keys(const char* enc_algorithm, const char* password, struct crypt_keys** out);
+
+/**
+ * @brief Reads the salt from the start of an open encrypted file and generates its decryption keys from a password.<br>
+ * The keys can be used with crypt_decrypt_stream_new(), which should be fed the rest of the file.
+ * @see crypt_decrypt_stream_new()
+ *
+ * @param enc_algorithm The encryption algorithm the file was encrypted with (e.g. "AES-256-CBC")
+ *
+ * @param fp_in The encrypted file, positioned at its first byte.<br>
+ * On success, it is left at the first byte after the salt.
+ *
+ * @param password The password to use.<br>
+ * If this is NULL, the user is asked for a password.
+ *
+ * @param out A pointer to the crypt keys structure to fill.<br>
+ * This will be set to NULL on failure.<br>
+ * This structure must be freed with crypt_free() when no longer in use.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int easy_decryption_keys(const char* enc_algorithm, FILE* fp_in, const char* password, struct crypt_keys** out);
+
+/**
+ * @brief Reads the salt from the start of encrypted data in memory and generates its decryption keys from a password, like easy_decryption_keys() does for a file.
+ * @see easy_decryption_keys()
+ *
+ * @param enc_algorithm The encryption algorithm the data was encrypted with (e.g. "AES-256-CBC")
+ *
+ * @param in The start of the encrypted data, which has to hold its whole header.
+ * @see crypt_read_salt_buf()
+ *
+ * @param in_len The length of in in bytes.
+ *
+ * @param password The password to use.<br>
+ * If this is NULL, the user is asked for a password.
+ *
+ * @param out A pointer to the crypt keys structure to fill.<br>
+ * This will be set to NULL on failure.<br>
+ * This structure must be freed with crypt_free() when no longer in use.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int easy_decryption_keys_buf(const char* enc_algorithm, const void* in, size_t in_len, const char* password, struct crypt_keys** out);
+
 /**
  * @brief Encrypts a file.
  *
@@ -48,14 +111,16 @@ int easy_encrypt(const char* in, const char* out, const char* enc_algorithm, int
 int easy_decrypt(const char* in, const char* out, const char* enc_algorithm, int verbose, const char* password);
 
 /**
- * @brief Encrypts a file in place.
+ * @brief Encrypts a file in place.<br>
+ * The result is written next to the file and replaces it in one step, so the file is never half encrypted.<br>
+ * A file of up to 1 MiB is read into memory first instead of being streamed.
  *
  * @param in_out Path to a file to encrypt.<br>
  * If this function fails, the file is unchanged.
  *
  * @param enc_algorithm The encryption algorithm to use (e.g. "AES-256-CBC")
  *
- * @param verbose Any value besides 0 shows a progress bar.
+ * @param verbose Unused. The file is streamed without a progress bar.
  *
  * @param password The password to use.<br>
  * If this is NULL, the user is asked for a password.
@@ -65,14 +130,16 @@ int easy_decrypt(const char* in, const char* out, const char* enc_algorithm, int
 int easy_encrypt_inplace(const char* in_out, const char* enc_algorithm, int verbose, const char* password);
 
 /**
- * @brief Decrypts a file in place.
+ * @brief Decrypts a file in place.<br>
+ * The result is written next to the file and replaces it in one step, so the file is never half decrypted.<br>
+ * A file of up to 1 MiB is read into memory first instead of being streamed.
  *
  * @param in_out Path to a file to decrypt.<br>
  * If this function fails, the file is unchanged.
  *
  * @param enc_algorithm The decryption algorithm to use (e.g. "AES-256-CBC")
  *
- * @param verbose Any value besides 0 shows a progress bar.
+ * @param verbose Unused. The file is streamed without a progress bar.
  *
  * @param password The password to use.<br>
  * If this is NULL, the user is asked for a password.
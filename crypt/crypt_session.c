@@ -0,0 +1,329 @@
+/** @file crypt/crypt_session.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "crypt_session.h"
+#include "../coredumps.h"
+#include "../log.h"
+#include <openssl/err.h>
+#include <openssl/hmac.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* the length of an HMAC-SHA256, which is also how long a session key is */
+#define SESSION_KEY_LEN 32
+
+/* so the keys derived here cannot collide with anything else the session key might be used for */
+static const char file_info[] = "ezbackup file key";
+
+struct session_key{
+	unsigned char salt[8];
+	unsigned char key[SESSION_KEY_LEN];
+};
+
+struct crypt_session{
+	const EVP_CIPHER* cipher;
+	char* password;
+	/* the salt new files are encrypted under */
+	unsigned char salt[8];
+	/* every session key derived so far; a restore can go through files from many backups */
+	struct session_key* keys;
+	size_t n_keys;
+	pthread_mutex_t mutex;
+};
+
+struct crypt_session* crypt_session_new(const EVP_CIPHER* cipher, const char* password){
+	struct crypt_session* cs;
+
+	return_ifnull(cipher, NULL);
+	return_ifnull(password, NULL);
+
+	cs = calloc(1, sizeof(*cs));
+	if (!cs){
+		log_enomem();
+		return NULL;
+	}
+	cs->cipher = cipher;
+	cs->password = malloc(strlen(password) + 1);
+	if (!cs->password){
+		log_enomem();
+		free(cs);
+		return NULL;
+	}
+	strcpy(cs->password, password);
+
+	if (gen_csrand(cs->salt, sizeof(cs->salt)) < 0){
+		log_error("Failed to generate session salt");
+		crypt_scrub(cs->password, strlen(cs->password));
+		free(cs->password);
+		free(cs);
+		return NULL;
+	}
+	pthread_mutex_init(&cs->mutex, NULL);
+
+	/* the keys live in memory until the session is freed */
+	if (disable_core_dumps() != 0){
+		log_warning("Core dumps could not be disabled");
+	}
+	return cs;
+}
+
+/* finds or derives the session key for a salt; cs->mutex must be held */
+static const unsigned char* session_key(struct crypt_session* cs, const unsigned char salt[8]){
+	struct session_key* tmp;
+	size_t i;
+
+	for (i = 0; i < cs->n_keys; ++i){
+		if (memcmp(cs->keys[i].salt, salt, 8) == 0){
+			return cs->keys[i].key;
+		}
+	}
+
+	/* not realloc(), since that would leave the old keys behind unscrubbed */
+	tmp = malloc((cs->n_keys + 1) * sizeof(*tmp));
+	if (!tmp){
+		log_enomem();
+		return NULL;
+	}
+	if (cs->n_keys > 0){
+		memcpy(tmp, cs->keys, cs->n_keys * sizeof(*tmp));
+		crypt_scrub(cs->keys, cs->n_keys * sizeof(*cs->keys));
+	}
+	free(cs->keys);
+	cs->keys = tmp;
+
+	memcpy(cs->keys[cs->n_keys].salt, salt, 8);
+	if (PKCS5_PBKDF2_HMAC(cs->password, strlen(cs->password), salt, 8, CRYPT_SESSION_ITERATIONS, EVP_sha256(), SESSION_KEY_LEN, cs->keys[cs->n_keys].key) != 1){
+		log_error("Failed to derive session key");
+		ERR_print_errors_fp(stderr);
+		return NULL;
+	}
+	return cs->keys[cs->n_keys++].key;
+}
+
+/* HKDF-Expand (RFC 5869) with the session key as the pseudorandom key and the nonce in the info */
+static int session_expand(const unsigned char* key, const unsigned char nonce[CRYPT_NONCE_LEN], unsigned char* out, size_t out_len){
+	unsigned char block[SESSION_KEY_LEN];
+	unsigned char msg[SESSION_KEY_LEN + sizeof(file_info) + CRYPT_NONCE_LEN + 1];
+	unsigned block_len = 0;
+	unsigned char counter;
+	size_t pos = 0;
+	int ret = 0;
+
+	for (counter = 1; pos < out_len; ++counter){
+		size_t msg_len = 0;
+		size_t n;
+
+		memcpy(msg, block, block_len);
+		msg_len += block_len;
+		memcpy(msg + msg_len, file_info, sizeof(file_info));
+		msg_len += sizeof(file_info);
+		memcpy(msg + msg_len, nonce, CRYPT_NONCE_LEN);
+		msg_len += CRYPT_NONCE_LEN;
+		msg[msg_len++] = counter;
+
+		if (!HMAC(EVP_sha256(), key, SESSION_KEY_LEN, msg, msg_len, block, &block_len)){
+			log_error("Failed to derive file keys");
+			ERR_print_errors_fp(stderr);
+			ret = -1;
+			goto cleanup;
+		}
+		n = out_len - pos < block_len ? out_len - pos : block_len;
+		memcpy(out + pos, block, n);
+		pos += n;
+	}
+
+cleanup:
+	crypt_scrub(block, sizeof(block));
+	crypt_scrub(msg, sizeof(msg));
+	return ret;
+}
+
+/* sets fk's key and iv from the session key of salt and a file's nonce */
+static int session_file_keys(struct crypt_session* cs, const unsigned char salt[8], const unsigned char nonce[CRYPT_NONCE_LEN], struct crypt_keys* fk){
+	unsigned char key_iv[EVP_MAX_KEY_LENGTH + EVP_MAX_IV_LENGTH];
+	const unsigned char* key;
+	int key_len = EVP_CIPHER_key_length(cs->cipher);
+	int iv_len = EVP_CIPHER_iv_length(cs->cipher);
+	int ret = 0;
+
+	pthread_mutex_lock(&cs->mutex);
+	key = session_key(cs, salt);
+	if (!key || session_expand(key, nonce, key_iv, key_len + iv_len) != 0){
+		pthread_mutex_unlock(&cs->mutex);
+		ret = -1;
+		goto cleanup;
+	}
+	pthread_mutex_unlock(&cs->mutex);
+
+	if (crypt_set_keys(key_iv, iv_len > 0 ? key_iv + key_len : NULL, fk) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+
+cleanup:
+	crypt_scrub(key_iv, sizeof(key_iv));
+	return ret;
+}
+
+int crypt_session_encryption_keys(struct crypt_session* cs, struct crypt_keys** out){
+	struct crypt_keys* fk = NULL;
+	unsigned char nonce[CRYPT_NONCE_LEN];
+	int ret = 0;
+
+	return_ifnull(cs, -1);
+	return_ifnull(out, -1);
+	*out = NULL;
+
+	if ((fk = crypt_new()) == NULL){
+		log_debug("Failed to generate new struct crypt_keys");
+		ret = -1;
+		goto cleanup;
+	}
+	if (crypt_set_encryption(cs->cipher, fk) != 0){
+		log_debug("Could not set encryption type");
+		ret = -1;
+		goto cleanup;
+	}
+	if (gen_csrand(nonce, sizeof(nonce)) < 0){
+		log_error("Failed to generate file nonce");
+		ret = -1;
+		goto cleanup;
+	}
+	if (crypt_set_session(cs->salt, nonce, fk) != 0 || session_file_keys(cs, cs->salt, nonce, fk) != 0){
+		log_debug("Could not derive the file's keys");
+		ret = -1;
+		goto cleanup;
+	}
+
+	*out = fk;
+
+cleanup:
+	if (ret != 0){
+		/* shreds keys as well */
+		fk ? crypt_free(fk) : (void)0;
+	}
+	return ret;
+}
+
+int crypt_session_set_keys(struct crypt_session* cs, struct crypt_keys* fk){
+	unsigned char salt[8];
+	unsigned char nonce[CRYPT_NONCE_LEN];
+
+	return_ifnull(cs, -1);
+	return_ifnull(fk, -1);
+
+	/* a file encrypted without a session still needs the slow way */
+	if (crypt_get_session(fk, salt, nonce) != 0){
+		if (crypt_gen_keys((const unsigned char*)cs->password, strlen(cs->password), NULL, 1, fk) != 0){
+			log_debug("crypt_gen_keys() failed");
+			return -1;
+		}
+		return 0;
+	}
+	if (session_file_keys(cs, salt, nonce, fk) != 0){
+		log_debug("Could not derive the file's keys");
+		return -1;
+	}
+	return 0;
+}
+
+int crypt_session_decryption_keys(struct crypt_session* cs, FILE* fp_in, struct crypt_keys** out){
+	struct crypt_keys* fk = NULL;
+	int ret = 0;
+
+	return_ifnull(cs, -1);
+	return_ifnull(fp_in, -1);
+	return_ifnull(out, -1);
+	*out = NULL;
+
+	if ((fk = crypt_new()) == NULL){
+		log_debug("Failed to generate new struct crypt_keys");
+		ret = -1;
+		goto cleanup;
+	}
+	if (crypt_set_encryption(cs->cipher, fk) != 0){
+		log_debug("Could not set encryption type");
+		ret = -1;
+		goto cleanup;
+	}
+	if (crypt_read_salt(fp_in, fk) != 0){
+		log_debug("crypt_read_salt() failed");
+		ret = -1;
+		goto cleanup;
+	}
+	if (crypt_session_set_keys(cs, fk) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+
+	*out = fk;
+
+cleanup:
+	if (ret != 0){
+		/* shreds keys as well */
+		fk ? crypt_free(fk) : (void)0;
+	}
+	return ret;
+}
+
+int crypt_session_decryption_keys_buf(struct crypt_session* cs, const void* in, size_t in_len, struct crypt_keys** out){
+	struct crypt_keys* fk = NULL;
+	int ret = 0;
+
+	return_ifnull(cs, -1);
+	return_ifnull(in, -1);
+	return_ifnull(out, -1);
+	*out = NULL;
+
+	if ((fk = crypt_new()) == NULL){
+		log_debug("Failed to generate new struct crypt_keys");
+		ret = -1;
+		goto cleanup;
+	}
+	if (crypt_set_encryption(cs->cipher, fk) != 0){
+		log_debug("Could not set encryption type");
+		ret = -1;
+		goto cleanup;
+	}
+	if (crypt_read_salt_buf(in, in_len, fk) != 0){
+		log_debug("crypt_read_salt_buf() failed");
+		ret = -1;
+		goto cleanup;
+	}
+	if (crypt_session_set_keys(cs, fk) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+
+	*out = fk;
+
+cleanup:
+	if (ret != 0){
+		/* shreds keys as well */
+		fk ? crypt_free(fk) : (void)0;
+	}
+	return ret;
+}
+
+void crypt_session_free(struct crypt_session* cs){
+	if (!cs){
+		return;
+	}
+	crypt_scrub(cs->password, strlen(cs->password));
+	free(cs->password);
+	if (cs->n_keys > 0){
+		crypt_scrub(cs->keys, cs->n_keys * sizeof(*cs->keys));
+	}
+	free(cs->keys);
+	pthread_mutex_destroy(&cs->mutex);
+	free(cs);
+	if (enable_core_dumps() != 0){
+		log_debug("enable_core_dumps() failed");
+	}
+}
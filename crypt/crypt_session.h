@@ -0,0 +1,117 @@
+/** @file crypt/crypt_session.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __CRYPT_CRYPT_SESSION_H
+#define __CRYPT_CRYPT_SESSION_H
+
+#include "crypt.h"
+
+/**
+ * @brief How many rounds of PBKDF2 a session key takes to derive from a password.<br>
+ * This only happens once per session, so it can be far more than a per-file key could afford.
+ */
+#define CRYPT_SESSION_ITERATIONS 200000
+
+/**
+ * @brief A password turned into a session key once, from which each file gets its own keys cheaply.
+ */
+struct crypt_session;
+
+/**
+ * @brief Starts a session for a password.<br>
+ * The session key is derived from the password and a fresh salt the first time it is needed.<br>
+ * Core dumps are disabled until the session is freed, since it keeps the password and keys in memory.
+ *
+ * @param cipher The cipher each file is encrypted with.
+ *
+ * @param password The password.<br>
+ * A copy of it is kept, so files from other sessions and files encrypted without a session can still be decrypted.
+ *
+ * @return A session, or NULL on failure.<br>
+ * This must be freed with crypt_session_free() when no longer in use.
+ * @see crypt_session_free()
+ */
+struct crypt_session* crypt_session_new(const EVP_CIPHER* cipher, const char* password) __attribute__((malloc));
+
+/**
+ * @brief Makes the keys for one file.<br>
+ * Each file gets a fresh nonce, and its key and initialization vector are derived from the session key and that nonce with HKDF-SHA256.<br>
+ * This is safe to call from several threads at once.
+ *
+ * @param cs The session.
+ *
+ * @param out Set to keys that can be used with crypt_encrypt() or crypt_stream_new().<br>
+ * This will be set to NULL on failure.<br>
+ * This structure must be freed with crypt_free() when no longer in use.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int crypt_session_encryption_keys(struct crypt_session* cs, struct crypt_keys** out);
+
+/**
+ * @brief Reads the header of an encrypted file and makes the keys to decrypt it.<br>
+ * Files from any session with the same password can be decrypted, as can files encrypted with keys derived from the salt alone.<br>
+ * Each session key is only derived once, however many files use it.<br>
+ * This is safe to call from several threads at once.
+ *
+ * @param cs The session.
+ *
+ * @param fp_in An encrypted file opened for reading, positioned at its first byte.<br>
+ * On success, it is left at the first byte of the encrypted data.
+ *
+ * @param out Set to keys that can be used with crypt_decrypt_stream_new().<br>
+ * This will be set to NULL on failure.<br>
+ * This structure must be freed with crypt_free() when no longer in use.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int crypt_session_decryption_keys(struct crypt_session* cs, FILE* fp_in, struct crypt_keys** out);
+
+/**
+ * @brief Makes the keys to decrypt data in memory from its header, like crypt_session_decryption_keys() does for a file.
+ * @see crypt_session_decryption_keys()
+ *
+ * @param cs The session.
+ *
+ * @param in The start of the encrypted data, which has to hold its whole header.
+ * @see crypt_read_salt_buf()
+ *
+ * @param in_len The length of in in bytes.
+ *
+ * @param out Set to keys that can be used with crypt_decrypt_stream_new(), which should be fed the data after the header.<br>
+ * This will be set to NULL on failure.<br>
+ * This structure must be freed with crypt_free() when no longer in use.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int crypt_session_decryption_keys_buf(struct crypt_session* cs, const void* in, size_t in_len, struct crypt_keys** out);
+
+/**
+ * @brief Generates the keys for a file whose header was already read with crypt_read_salt().<br>
+ * This is what crypt_session_decryption_keys() does after reading the header.
+ * @see crypt_session_decryption_keys()
+ *
+ * @param cs The session.
+ *
+ * @param fk A crypt keys structure with its encryption set and its salt read.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int crypt_session_set_keys(struct crypt_session* cs, struct crypt_keys* fk);
+
+/**
+ * @brief Frees a session, scrubbing the password and every session key.
+ *
+ * @param cs The session to free.<br>
+ * This can be NULL, in which case this function does nothing.
+ *
+ * @return void
+ */
+void crypt_session_free(struct crypt_session* cs);
+
+#endif
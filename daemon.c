@@ -0,0 +1,299 @@
+/** @file daemon.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "daemon.h"
+#include "backup.h"
+#include "log.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/* how long the daemon sleeps at most, so a clock that jumps does not leave it waiting for days */
+#define DAEMON_MAX_WAIT 60
+
+static volatile sig_atomic_t daemon_stop = 0;
+
+static void on_stop_signal(int sig){
+	(void)sig;
+	daemon_stop = 1;
+}
+
+struct daemon_state{
+	const struct options* opt;
+	struct backup_session* bs;
+	unsigned long n_runs;
+	time_t last_run;
+	int last_ret;
+	/* 0 if only the socket starts backups */
+	time_t next_run;
+};
+
+static int make_address(const char* socket_file, struct sockaddr_un* out){
+	memset(out, 0, sizeof(*out));
+	out->sun_family = AF_UNIX;
+	if (strlen(socket_file) >= sizeof(out->sun_path)){
+		log_error_ex("The socket path %s is too long", socket_file);
+		return -1;
+	}
+	strcpy(out->sun_path, socket_file);
+	return 0;
+}
+
+static int daemon_listen(const char* socket_file){
+	struct sockaddr_un addr;
+	mode_t old_mask;
+	int fd;
+
+	if (make_address(socket_file, &addr) != 0){
+		return -1;
+	}
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0){
+		log_error_ex("Failed to create a socket (%s)", strerror(errno));
+		return -1;
+	}
+	/* a socket left behind by a daemon that died can be replaced, but not one that a daemon still answers on */
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0){
+		log_error_ex("Another daemon is already listening on %s", socket_file);
+		close(fd);
+		return -1;
+	}
+	remove(socket_file);
+
+	/* only the user that started the daemon can ask it for anything */
+	old_mask = umask(077);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 4) != 0){
+		log_error_ex2("Failed to listen on %s (%s)", socket_file, strerror(errno));
+		umask(old_mask);
+		close(fd);
+		return -1;
+	}
+	umask(old_mask);
+	return fd;
+}
+
+static void run_backup(struct daemon_state* ds){
+	time_t start = time(NULL);
+
+	ds->last_ret = backup_session_run(ds->opt, ds->bs);
+	ds->last_run = time(NULL);
+	ds->n_runs++;
+	if (ds->last_ret != 0){
+		log_error("Backup failed");
+	}
+	printf("Backup %lu %s after %lu seconds\n", ds->n_runs, ds->last_ret == 0 ? "finished" : "failed", (unsigned long)(ds->last_run - start));
+	fflush(stdout);
+
+	/* the schedule counts from the last backup, however it was started */
+	ds->next_run = ds->opt->interval > 0 ? ds->last_run + (time_t)ds->opt->interval : 0;
+}
+
+/* reads one command from a client, or returns negative if it sends none in time */
+static int read_command(int fd, char* buf, size_t len){
+	size_t n = 0;
+
+	while (n < len - 1){
+		struct pollfd pfd;
+		ssize_t res;
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, DAEMON_CLIENT_TIMEOUT * 1000) <= 0){
+			return -1;
+		}
+		if ((res = read(fd, buf + n, len - 1 - n)) <= 0){
+			break;
+		}
+		n += res;
+		if (memchr(buf, '\n', n)){
+			break;
+		}
+	}
+	buf[n] = '\0';
+	buf[strcspn(buf, "\r\n")] = '\0';
+	return 0;
+}
+
+static void write_all(int fd, const char* str){
+	size_t len = strlen(str);
+	size_t n = 0;
+
+	while (n < len){
+		ssize_t res = write(fd, str + n, len - n);
+
+		if (res <= 0){
+			return;
+		}
+		n += res;
+	}
+}
+
+static void serve_client(int listen_fd, struct daemon_state* ds){
+	char command[DAEMON_MAX_COMMAND];
+	char reply[128];
+	int fd;
+
+	if ((fd = accept(listen_fd, NULL, NULL)) < 0){
+		if (errno != EINTR){
+			log_warning_ex("Failed to accept a client (%s)", strerror(errno));
+		}
+		return;
+	}
+	if (read_command(fd, command, sizeof(command)) != 0){
+		close(fd);
+		return;
+	}
+
+	if (!strcmp(command, "backup")){
+		run_backup(ds);
+		strcpy(reply, ds->last_ret == 0 ? "ok\n" : "failed\n");
+	}
+	else if (!strcmp(command, "status")){
+		sprintf(reply, "runs=%lu last=%lu result=%s next=%lu\n", ds->n_runs, (unsigned long)ds->last_run, ds->n_runs == 0 ? "none" : ds->last_ret == 0 ? "ok" : "failed", (unsigned long)ds->next_run);
+	}
+	else if (!strcmp(command, "stop")){
+		strcpy(reply, "stopping\n");
+		daemon_stop = 1;
+	}
+	else{
+		strcpy(reply, "unknown command\n");
+	}
+	write_all(fd, reply);
+	close(fd);
+}
+
+int daemon_run(const struct options* opt){
+	struct daemon_state ds;
+	struct sigaction sa;
+	struct sigaction sa_pipe;
+	int fd = -1;
+	int ret = 0;
+
+	return_ifnull(opt, -1);
+	if (!opt->socket_file && opt->interval == 0){
+		log_error("The daemon needs a schedule (--interval) or a socket to be asked for backups on (--socket)");
+		return -1;
+	}
+
+	memset(&ds, 0, sizeof(ds));
+	ds.opt = opt;
+	if (!(ds.bs = backup_session_new())){
+		return -1;
+	}
+	if (opt->socket_file && (fd = daemon_listen(opt->socket_file)) < 0){
+		ret = -1;
+		goto cleanup;
+	}
+
+	daemon_stop = 0;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_stop_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	/* a client that hangs up before its reply must not take the daemon with it */
+	memset(&sa_pipe, 0, sizeof(sa_pipe));
+	sa_pipe.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa_pipe, NULL);
+
+	run_backup(&ds);
+	while (!daemon_stop){
+		struct pollfd pfd;
+		time_t now = time(NULL);
+		long wait_s = DAEMON_MAX_WAIT;
+		int res;
+
+		if (ds.next_run != 0 && now >= ds.next_run){
+			run_backup(&ds);
+			continue;
+		}
+		if (ds.next_run != 0 && ds.next_run - now < wait_s){
+			wait_s = ds.next_run - now;
+		}
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		res = poll(&pfd, fd >= 0 ? 1 : 0, (int)wait_s * 1000);
+		if (res < 0 && errno != EINTR){
+			log_error_ex("Failed to wait for a client (%s)", strerror(errno));
+			ret = -1;
+			break;
+		}
+		if (res > 0 && (pfd.revents & POLLIN)){
+			serve_client(fd, &ds);
+		}
+	}
+
+	sa.sa_handler = SIG_DFL;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGPIPE, &sa, NULL);
+
+cleanup:
+	if (fd >= 0){
+		close(fd);
+		remove(opt->socket_file);
+	}
+	backup_session_free(ds.bs);
+	return ret;
+}
+
+int daemon_request(const char* socket_file, const char* command, FILE* out){
+	struct sockaddr_un addr;
+	char buf[256];
+	ssize_t res;
+	int failed = 0;
+	int first = 1;
+	int fd;
+
+	return_ifnull(socket_file, -1);
+	return_ifnull(command, -1);
+	return_ifnull(out, -1);
+
+	if (make_address(socket_file, &addr) != 0){
+		return -1;
+	}
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0){
+		log_error_ex("Failed to create a socket (%s)", strerror(errno));
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0){
+		log_error_ex2("Failed to reach the daemon at %s (%s)", socket_file, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	write_all(fd, command);
+	write_all(fd, "\n");
+	/* a backup can take as long as it takes, so this waits for the daemon to hang up */
+	while ((res = read(fd, buf, sizeof(buf))) > 0){
+		if (first && (size_t)res >= strlen("failed") && !memcmp(buf, "failed", strlen("failed"))){
+			failed = 1;
+		}
+		first = 0;
+		fwrite(buf, 1, res, out);
+	}
+	close(fd);
+
+	if (res < 0){
+		log_error_ex("Failed to read the daemon's reply (%s)", strerror(errno));
+		return -1;
+	}
+	if (first){
+		log_error("The daemon hung up without replying");
+		return -1;
+	}
+	return failed;
+}
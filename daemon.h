@@ -0,0 +1,59 @@
+/** @file daemon.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ *
+ * Runs backups from one long-lived process, on a schedule or when asked through a local socket.<br>
+ * The process stays logged in to the clouds and keeps the encryption password between backups, so only the first one pays for starting up.<br>
+ * The change journal is already kept by a separate watch process, which the backups read like any other. @see cj_watch()<br>
+ * <br>
+ * A client sends one line to the socket and gets one line back. The commands are the following:<br>
+ * "backup" runs a backup right away, and replies "ok" or "failed" once it is done.<br>
+ * "status" replies with the number of backups run, the time and result of the last one, and the time of the next scheduled one.<br>
+ * "stop" replies "stopping" and stops the daemon once the reply is sent.
+ */
+
+#ifndef __DAEMON_H
+#define __DAEMON_H
+
+#include "options/options.h"
+#include <stdio.h>
+
+/**
+ * @brief The longest command a client can send, including its newline.
+ */
+#define DAEMON_MAX_COMMAND 64
+
+/**
+ * @brief How long, in seconds, the daemon waits for a client to send its command before hanging up on it.
+ */
+#define DAEMON_CLIENT_TIMEOUT 5
+
+/**
+ * @brief Runs backups until SIGINT or SIGTERM is received, or a client sends "stop".<br>
+ * The first backup runs right away, so anything it has to ask for is asked while whoever started the daemon is still there to answer.
+ *
+ * @param opt The options to back up with.<br>
+ * opt->interval says how many seconds apart the scheduled backups are, and opt->socket_file where to listen for commands. At least one of them has to be given.
+ *
+ * @return 0 once stopped, or negative on failure.<br>
+ * A backup that fails does not stop the daemon.
+ */
+int daemon_run(const struct options* opt);
+
+/**
+ * @brief Sends a command to a running daemon and writes its reply.
+ *
+ * @param socket_file The daemon's socket.
+ *
+ * @param command The command, without a newline.
+ *
+ * @param out Where to write the reply.
+ *
+ * @return 0 on success, positive if the daemon replied "failed", or negative if it could not be reached.
+ */
+int daemon_request(const char* socket_file, const char* command, FILE* out);
+
+#endif
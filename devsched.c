@@ -0,0 +1,289 @@
+/** @file devsched.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "devsched.h"
+#include "threadpool.h"
+#include "log.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+struct dev_job{
+	void(*func)(void*);
+	void* arg;
+};
+
+struct dev_lane{
+	/* circular buffer of jobs waiting for a worker */
+	struct dev_job* queue;
+	size_t queue_head;
+	size_t queue_count;
+	size_t n_running;
+};
+
+struct dev_sched{
+	pthread_t* threads;
+	size_t n_threads;
+
+	struct dev_lane* lanes;
+	size_t n_lanes;
+	size_t lane_threads;
+	size_t queue_len;
+	/* where the search for a lane starts, so lanes that are tied take turns */
+	size_t next_lane;
+	/* the most jobs from every lane together that run at once, or 0 for as many as there are threads */
+	size_t limit;
+	size_t n_running;
+	int stop;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond_job;
+	pthread_cond_t cond_space;
+};
+
+size_t dev_sched_group(const char* const* paths, size_t n_paths, size_t* out_lanes){
+	dev_t* devs;
+	size_t n_lanes = 0;
+	size_t i;
+
+	/* without the memory to tell them apart, they all share one lane like they would without this */
+	if (!(devs = malloc((n_paths ? n_paths : 1) * sizeof(*devs)))){
+		log_enomem();
+		memset(out_lanes, 0, n_paths * sizeof(*out_lanes));
+		return 1;
+	}
+	for (i = 0; i < n_paths; ++i){
+		struct stat st;
+		size_t j;
+
+		if (stat(paths[i], &st) != 0){
+			log_debug_ex2("Failed to stat %s (%s)", paths[i], strerror(errno));
+			out_lanes[i] = 0;
+			continue;
+		}
+		for (j = 0; j < n_lanes; ++j){
+			if (devs[j] == st.st_dev){
+				break;
+			}
+		}
+		if (j == n_lanes){
+			devs[n_lanes++] = st.st_dev;
+		}
+		out_lanes[i] = j;
+	}
+	free(devs);
+	return n_lanes ? n_lanes : 1;
+}
+
+/* the lane with the fewest jobs running that has one waiting and is not at its limit, or n_lanes if there is none
+ * the caller holds the mutex */
+static size_t pick_lane(struct dev_sched* ds){
+	size_t best = ds->n_lanes;
+	size_t i;
+
+	for (i = 0; i < ds->n_lanes; ++i){
+		size_t lane = (ds->next_lane + i) % ds->n_lanes;
+		const struct dev_lane* dl = &ds->lanes[lane];
+
+		if (dl->queue_count == 0 || (ds->lane_threads && dl->n_running >= ds->lane_threads)){
+			continue;
+		}
+		if (best == ds->n_lanes || dl->n_running < ds->lanes[best].n_running){
+			best = lane;
+		}
+	}
+	return best;
+}
+
+/* the caller holds the mutex */
+static int all_empty(const struct dev_sched* ds){
+	size_t i;
+
+	for (i = 0; i < ds->n_lanes; ++i){
+		if (ds->lanes[i].queue_count > 0){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void* dev_worker(void* arg){
+	struct dev_sched* ds = arg;
+
+	pthread_mutex_lock(&ds->mutex);
+	for (;;){
+		struct dev_lane* dl;
+		struct dev_job j;
+		size_t lane;
+
+		if ((ds->limit && ds->n_running >= ds->limit) || (lane = pick_lane(ds)) == ds->n_lanes){
+			/* only stop once every lane has been drained */
+			if (ds->stop && all_empty(ds)){
+				break;
+			}
+			pthread_cond_wait(&ds->cond_job, &ds->mutex);
+			continue;
+		}
+
+		dl = &ds->lanes[lane];
+		j = dl->queue[dl->queue_head];
+		dl->queue_head = (dl->queue_head + 1) % ds->queue_len;
+		dl->queue_count--;
+		dl->n_running++;
+		ds->n_running++;
+		ds->next_lane = (lane + 1) % ds->n_lanes;
+		/* whoever is waiting may be feeding another lane, so they all have to look */
+		pthread_cond_broadcast(&ds->cond_space);
+		pthread_mutex_unlock(&ds->mutex);
+
+		j.func(j.arg);
+
+		pthread_mutex_lock(&ds->mutex);
+		dl->n_running--;
+		ds->n_running--;
+		/* a worker waiting on a lane that was at its limit can take from it now */
+		if (ds->lane_threads || ds->limit){
+			pthread_cond_broadcast(&ds->cond_job);
+		}
+	}
+	/* the others may be waiting for work that will never come */
+	pthread_cond_broadcast(&ds->cond_job);
+	pthread_mutex_unlock(&ds->mutex);
+	return NULL;
+}
+
+struct dev_sched* dev_sched_new(size_t n_threads, size_t n_lanes, size_t lane_threads, size_t queue_len){
+	struct dev_sched* ds;
+	struct dev_job* queues;
+	size_t i;
+	int res;
+
+	if (n_lanes == 0){
+		log_einval_u(n_lanes);
+		return NULL;
+	}
+	if (n_threads == 0){
+		n_threads = tp_cpu_count();
+	}
+	if (queue_len == 0){
+		queue_len = n_threads * 2;
+	}
+
+	if (!(ds = calloc(1, sizeof(*ds)))){
+		log_enomem();
+		return NULL;
+	}
+	ds->threads = malloc(n_threads * sizeof(*ds->threads));
+	ds->lanes = calloc(n_lanes, sizeof(*ds->lanes));
+	queues = malloc(n_lanes * queue_len * sizeof(*queues));
+	if (!ds->threads || !ds->lanes || !queues){
+		log_enomem();
+		free(ds->threads);
+		free(ds->lanes);
+		free(queues);
+		free(ds);
+		return NULL;
+	}
+	for (i = 0; i < n_lanes; ++i){
+		ds->lanes[i].queue = queues + i * queue_len;
+	}
+	ds->n_lanes = n_lanes;
+	ds->lane_threads = lane_threads;
+	ds->queue_len = queue_len;
+
+	pthread_mutex_init(&ds->mutex, NULL);
+	pthread_cond_init(&ds->cond_job, NULL);
+	pthread_cond_init(&ds->cond_space, NULL);
+
+	for (i = 0; i < n_threads; ++i){
+		if ((res = pthread_create(&ds->threads[i], NULL, dev_worker, ds)) != 0){
+			log_error_ex("Failed to start worker thread (%s)", strerror(res));
+			break;
+		}
+		ds->n_threads++;
+	}
+
+	if (ds->n_threads == 0){
+		dev_sched_free(ds);
+		return NULL;
+	}
+	return ds;
+}
+
+int dev_sched_submit(struct dev_sched* ds, size_t lane, void(*func)(void*), void* arg){
+	struct dev_lane* dl;
+
+	return_ifnull(ds, -1);
+	return_ifnull(func, -1);
+	if (lane >= ds->n_lanes){
+		log_einval_u(lane);
+		return -1;
+	}
+	dl = &ds->lanes[lane];
+
+	pthread_mutex_lock(&ds->mutex);
+	while (dl->queue_count == ds->queue_len && !ds->stop){
+		pthread_cond_wait(&ds->cond_space, &ds->mutex);
+	}
+	if (ds->stop){
+		pthread_mutex_unlock(&ds->mutex);
+		log_error("Cannot submit a job to a scheduler that is shutting down");
+		return -1;
+	}
+
+	dl->queue[(dl->queue_head + dl->queue_count) % ds->queue_len].func = func;
+	dl->queue[(dl->queue_head + dl->queue_count) % ds->queue_len].arg = arg;
+	dl->queue_count++;
+	pthread_cond_signal(&ds->cond_job);
+	pthread_mutex_unlock(&ds->mutex);
+	return 0;
+}
+
+void dev_sched_set_limit(struct dev_sched* ds, size_t limit){
+	if (!ds){
+		return;
+	}
+	pthread_mutex_lock(&ds->mutex);
+	ds->limit = limit;
+	/* the workers held back by the old limit may be able to run now */
+	pthread_cond_broadcast(&ds->cond_job);
+	pthread_mutex_unlock(&ds->mutex);
+}
+
+size_t dev_sched_threads(const struct dev_sched* ds){
+	return ds ? ds->n_threads : 0;
+}
+
+void dev_sched_free(struct dev_sched* ds){
+	size_t i;
+
+	if (!ds){
+		return;
+	}
+
+	pthread_mutex_lock(&ds->mutex);
+	ds->stop = 1;
+	pthread_cond_broadcast(&ds->cond_job);
+	pthread_cond_broadcast(&ds->cond_space);
+	pthread_mutex_unlock(&ds->mutex);
+
+	for (i = 0; i < ds->n_threads; ++i){
+		pthread_join(ds->threads[i], NULL);
+	}
+
+	pthread_mutex_destroy(&ds->mutex);
+	pthread_cond_destroy(&ds->cond_job);
+	pthread_cond_destroy(&ds->cond_space);
+	free(ds->threads);
+	/* every lane's queue is part of the first one's */
+	free(ds->lanes[0].queue);
+	free(ds->lanes);
+	free(ds);
+}
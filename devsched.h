@@ -0,0 +1,110 @@
+/** @file devsched.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ *
+ * A pool of worker threads shared by several lanes of jobs, one for each device the files being backed up are on.<br>
+ * A free worker takes the next job from whichever lane has the fewest jobs running, so every device with work left is kept busy at once instead of one after another.<br>
+ * Each lane can also be held to a number of jobs at once, so a device that slows down under too many readers, like a spinning disk seeking between them, is not given more.
+ */
+
+#ifndef __DEVSCHED_H
+#define __DEVSCHED_H
+
+#include <stddef.h>
+
+#ifndef __GNUC__
+#define __attribute__(x)
+#endif
+
+/**
+ * @brief A pool of worker threads fed by a bounded queue per lane.
+ */
+struct dev_sched;
+
+/**
+ * @brief Groups paths by the device they are on.
+ *
+ * @param paths The paths.
+ *
+ * @param n_paths The number of paths.
+ *
+ * @param out_lanes Set to the lane of each path, which is n_paths long.<br>
+ * Paths on the same device get the same lane, and lanes are numbered from 0 in the order their first path is in.<br>
+ * A path that cannot be looked up is put in lane 0.
+ *
+ * @return The number of lanes, which is at least 1.
+ */
+size_t dev_sched_group(const char* const* paths, size_t n_paths, size_t* out_lanes);
+
+/**
+ * @brief Starts a new scheduler.
+ *
+ * @param n_threads The number of worker threads shared by all of the lanes.<br>
+ * If this is 0, one thread per online processor is started.
+ *
+ * @param n_lanes The number of lanes. This must be at least 1.
+ *
+ * @param lane_threads The most jobs from any one lane that run at once.<br>
+ * If this is 0, a lane can use every worker that the others do not.
+ *
+ * @param queue_len The most jobs that can be waiting in any one lane.<br>
+ * If this is 0, each lane holds twice as many jobs as there are threads.
+ *
+ * @return A scheduler, or NULL on failure.<br>
+ * This must be freed with dev_sched_free() when no longer in use.
+ */
+struct dev_sched* dev_sched_new(size_t n_threads, size_t n_lanes, size_t lane_threads, size_t queue_len) __attribute__((malloc));
+
+/**
+ * @brief Queues a job in a lane.<br>
+ * If the lane's queue is full, this blocks until a worker takes a job off of it. The other lanes can still be submitted to in the meantime, so each lane can have a thread of its own feeding it.
+ *
+ * @param ds The scheduler.
+ *
+ * @param lane The lane, which must be less than the n_lanes it was started with.
+ *
+ * @param func The function to run on the worker thread.
+ *
+ * @param arg The argument to pass to func.<br>
+ * This must stay valid until func returns.
+ *
+ * @return 0 on success, or negative on failure.<br>
+ * If this does not return 0, func will not be called with arg.
+ */
+int dev_sched_submit(struct dev_sched* ds, size_t lane, void(*func)(void*), void* arg);
+
+/**
+ * @brief Changes how many jobs from every lane together run at once.<br>
+ * Jobs already running are left to finish, so lowering this takes effect as they do.
+ *
+ * @param ds The scheduler.
+ *
+ * @param limit The most jobs that run at once.<br>
+ * If this is 0, every worker thread can run one.
+ *
+ * @return void
+ */
+void dev_sched_set_limit(struct dev_sched* ds, size_t limit);
+
+/**
+ * @brief Returns the number of worker threads in a scheduler.
+ *
+ * @param ds The scheduler.
+ *
+ * @return The number of worker threads, or 0 if ds is NULL.
+ */
+size_t dev_sched_threads(const struct dev_sched* ds);
+
+/**
+ * @brief Finishes every queued job, stops the worker threads, and frees a scheduler.
+ *
+ * @param ds The scheduler. This can be NULL.
+ *
+ * @return void
+ */
+void dev_sched_free(struct dev_sched* ds);
+
+#endif
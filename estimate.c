@@ -0,0 +1,327 @@
+/** @file estimate.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "estimate.h"
+#include "checksum.h"
+#include "checksumsort.h"
+#include "exclude.h"
+#include "filehelper.h"
+#include "fileiterator.h"
+#include "log.h"
+#include "stats.h"
+#include "threadpool.h"
+#include "zipauto.h"
+#include "cloud/ratelimit.h"
+#include "strings/stringhelper.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define MIB (1024.0 * 1024.0)
+
+struct est_file{
+	char* file;
+	struct file_meta meta;
+	/* what file_meta_from_stat() returned for it */
+	int res;
+};
+
+struct est_list{
+	struct est_file* files;
+	size_t len;
+	size_t size;
+};
+
+static int est_list_add(struct est_list* list, const char* file, const struct stat* st){
+	struct est_file* ef;
+
+	if (list->len == list->size){
+		size_t size = list->size ? list->size * 2 : 1024;
+		struct est_file* tmp = realloc(list->files, size * sizeof(*tmp));
+
+		if (!tmp){
+			log_enomem();
+			return -1;
+		}
+		list->files = tmp;
+		list->size = size;
+	}
+	ef = &list->files[list->len];
+	if (!(ef->file = sh_dup(file))){
+		log_enomem();
+		return -1;
+	}
+	ef->res = file_meta_from_stat(st, &ef->meta);
+	list->len++;
+	return 0;
+}
+
+static void est_list_free(struct est_list* list){
+	size_t i;
+
+	for (i = 0; i < list->len; ++i){
+		free(list->files[i].file);
+	}
+	free(list->files);
+}
+
+static int est_file_cmp(const void* f1, const void* f2){
+	return strcmp(((const struct est_file*)f1)->file, ((const struct est_file*)f2)->file);
+}
+
+/* the same walk copy_files() makes, without snapshots or a change journal */
+static int walk_directories(const struct options* opt, struct est_list* list){
+	struct exclude_trie* ex;
+	size_t i;
+	int ret = 0;
+
+	if (!(ex = exclude_new(opt->exclude))){
+		return -1;
+	}
+	for (i = 0; i < opt->directories->len && ret == 0; ++i){
+		const char* dir = opt->directories->strings[i];
+		struct fi_stack* fis;
+		const char* tmp;
+		struct stat st;
+
+		if (exclude_match(ex, dir)){
+			continue;
+		}
+		if (!(fis = fi_start_ex(dir, exclude_skip, ex))){
+			log_warning_ex("Failed to fi_start in directory %s", dir);
+			continue;
+		}
+		while ((tmp = fi_next_stat(fis, &st)) != NULL){
+			if (est_list_add(list, tmp, &st) != 0){
+				ret = -1;
+				break;
+			}
+		}
+		fi_end(fis);
+	}
+	exclude_free(ex);
+	return ret;
+}
+
+/* marks the files a backup would read in read[], which is list->len long
+ * a file is skipped under the same conditions copy_files() skips it */
+static void match_checksums(const struct options* opt, const struct est_list* list, unsigned char* read){
+	char* checksum_path;
+	FILE* fp = NULL;
+	struct checksum_reader* cr = NULL;
+	const struct element* cursor = NULL;
+	size_t i;
+
+	memset(read, 1, list->len);
+	if (opt->flags.bits.flag_paranoid){
+		return;
+	}
+	if (!(checksum_path = sh_concat_path(sh_dup(opt->output_directory), "checksums.txt"))){
+		log_enomem();
+		return;
+	}
+	/* the first backup reads everything */
+	if (!file_exists(checksum_path)){
+		free(checksum_path);
+		return;
+	}
+	if (!(fp = fopen(checksum_path, "rb")) || !(cr = checksum_reader_new(fp, 0)) || checksum_reader_next(cr, &cursor) < 0){
+		log_warning_ex("Failed to read %s. Every file is counted as changed.", checksum_path);
+		goto cleanup;
+	}
+
+	for (i = 0; i < list->len && cursor; ++i){
+		const struct est_file* ef = &list->files[i];
+
+		while (cursor && strcmp(cursor->file, ef->file) < 0){
+			if (checksum_reader_next(cr, &cursor) != 0){
+				cursor = NULL;
+			}
+		}
+		if (cursor && strcmp(cursor->file, ef->file) == 0){
+			read[i] = !(ef->res == 0 && cursor->meta && file_meta_cmp(&ef->meta, cursor->meta) == 0);
+		}
+	}
+
+cleanup:
+	checksum_reader_free(cr);
+	fp ? fclose(fp) : 0;
+	free(checksum_path);
+}
+
+/* reads the start of files spread evenly by size across the ones that would be read, so a few huge files count for as much as they weigh
+ * returns how many bytes were read into sample, and sets out_wall to how long that took */
+static size_t read_sample(const struct est_list* list, const unsigned char* read, uint64_t bytes_read, unsigned char* sample, double* out_wall){
+	uint64_t step = bytes_read / (ESTIMATE_SAMPLE_LEN / ESTIMATE_SAMPLE_FILE_LEN);
+	uint64_t passed = 0;
+	uint64_t next = 0;
+	size_t sample_len = 0;
+	struct stats_time start;
+	struct stats_time end;
+	size_t i;
+
+	stats_time_now(&start);
+	for (i = 0; i < list->len && sample_len < ESTIMATE_SAMPLE_LEN; ++i){
+		const struct est_file* ef = &list->files[i];
+		size_t len = ESTIMATE_SAMPLE_LEN - sample_len < ESTIMATE_SAMPLE_FILE_LEN ? ESTIMATE_SAMPLE_LEN - sample_len : ESTIMATE_SAMPLE_FILE_LEN;
+		FILE* fp;
+
+		if (!read[i] || ef->res < 0){
+			continue;
+		}
+		passed += ef->meta.size;
+		if (passed < next || ef->meta.size == 0){
+			continue;
+		}
+		next = passed + step;
+		if ((fp = fopen(ef->file, "rb")) != NULL){
+			sample_len += fread(sample + sample_len, 1, len, fp);
+			fclose(fp);
+		}
+	}
+	stats_time_now(&end);
+	*out_wall = end.wall - start.wall;
+	return sample_len;
+}
+
+/* the upload rate the last backup measured, or the upload limit if that is lower, or 0 if neither is known */
+static double upload_rate(const struct options* opt){
+	struct stats_entry se;
+	struct rate_schedule* rs = NULL;
+	double rate = 0;
+
+	if (opt->stats_file && stats_read(opt->stats_file, STAGE_UPLOAD, &se) == 0 && se.time.wall > 0){
+		rate = se.bytes_in / se.time.wall;
+	}
+	if (opt->cloud_options->upload_limit && rs_parse(opt->cloud_options->upload_limit, &rs) == 0){
+		uint64_t limit = rs_rate_at(rs, time(NULL));
+
+		if (limit != 0 && (rate == 0 || (double)limit < rate)){
+			rate = (double)limit;
+		}
+		rs_free(rs);
+	}
+	return rate;
+}
+
+int backup_estimate(const struct options* opt, struct backup_estimate* out){
+	struct est_list list;
+	unsigned char* read = NULL;
+	unsigned char* sample = NULL;
+	size_t sample_len;
+	size_t sample_out = 0;
+	double read_wall = 0;
+	double speed;
+	size_t n_threads;
+	size_t i;
+	int ret = 0;
+
+	return_ifnull(opt, -1);
+	return_ifnull(out, -1);
+
+	memset(out, 0, sizeof(*out));
+	memset(&list, 0, sizeof(list));
+
+	if (walk_directories(opt, &list) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+	/* the checksum file is sorted, so the files are matched to it in one pass */
+	qsort(list.files, list.len, sizeof(*list.files), est_file_cmp);
+	if (!(read = malloc(list.len + 1)) || !(sample = malloc(ESTIMATE_SAMPLE_LEN))){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+	match_checksums(opt, &list, read);
+
+	for (i = 0; i < list.len; ++i){
+		uint64_t size = list.files[i].res >= 0 ? list.files[i].meta.size : 0;
+
+		out->files_found++;
+		out->bytes_found += size;
+		if (read[i]){
+			out->files_read++;
+			out->bytes_read += size;
+		}
+	}
+
+	sample_len = read_sample(&list, read, out->bytes_read, sample, &read_wall);
+	out->sample_in = sample_len;
+	out->read_rate = read_wall > 0 ? sample_len / read_wall : 0;
+
+	/* the compressor a backup would use, which the output directory may already be fixed to */
+	out->c_type = opt->c_type;
+	out->c_level = opt->c_level;
+	if (opt->c_target > 0 || opt->flags.bits.flag_auto_compressor){
+		if (opt->flags.bits.flag_auto_compressor){
+			out->c_type = COMPRESSOR_INVALID;
+		}
+		if (zip_auto_load(opt->output_directory, &out->c_type) < 0){
+			log_warning("Failed to read which compressor the last backup used.");
+		}
+		if (sample_len == 0){
+			out->c_type = out->c_type != COMPRESSOR_INVALID ? out->c_type : COMPRESSOR_GZIP;
+			out->c_level = 0;
+		}
+		else if (zip_pick(sample, sample_len, opt->c_target ? opt->c_target : ZIP_AUTO_TARGET, opt->c_flags, opt->n_threads, &out->c_type, &out->c_level) != 0){
+			log_error("Failed to pick a compressor.");
+			ret = -1;
+			goto cleanup;
+		}
+	}
+	if (sample_len > 0){
+		if ((speed = zip_speed(out->c_type, out->c_level, opt->c_flags, sample, sample_len, &sample_out)) < 0){
+			ret = -1;
+			goto cleanup;
+		}
+		out->sample_out = sample_out;
+		out->compress_rate = speed * MIB;
+	}
+
+	/* the files that were not sampled are assumed to compress like the ones that were */
+	out->bytes_out = sample_len > 0 ? (uint64_t)((double)out->bytes_read * sample_out / sample_len) : out->bytes_read;
+	out->cpu_seconds = out->compress_rate > 0 ? out->bytes_read / out->compress_rate : 0;
+	n_threads = opt->n_threads ? opt->n_threads : tp_cpu_count();
+	out->wall_seconds = out->cpu_seconds / (n_threads ? n_threads : 1);
+	if (out->read_rate > 0 && out->bytes_read / out->read_rate > out->wall_seconds){
+		out->wall_seconds = out->bytes_read / out->read_rate;
+	}
+	if (opt->cloud_options->cp != CLOUD_NONE || opt->mirrors->len > 0){
+		out->uploads = 1;
+		out->upload_rate = upload_rate(opt);
+		out->upload_seconds = out->upload_rate > 0 ? out->bytes_out / out->upload_rate : 0;
+	}
+
+cleanup:
+	est_list_free(&list);
+	free(read);
+	free(sample);
+	return ret;
+}
+
+void backup_estimate_print(const struct backup_estimate* be, FILE* fp){
+	fprintf(fp, "Files found:      %lu (%.1f MiB)\n", be->files_found, be->bytes_found / MIB);
+	fprintf(fp, "Files to read:    %lu (%.1f MiB)\n", be->files_read, be->bytes_read / MIB);
+	if (be->sample_in > 0){
+		fprintf(fp, "Sample:           %.1f MiB read at %.1f MiB/s, compressed to %.1f MiB with %s level %d at %.1f MiB/s per thread\n", be->sample_in / MIB, be->read_rate / MIB, be->sample_out / MIB, compressor_tostring(be->c_type), be->c_level, be->compress_rate / MIB);
+	}
+	fprintf(fp, "Projected output: %.1f MiB\n", be->bytes_out / MIB);
+	fprintf(fp, "Projected CPU:    %.0f seconds compressing\n", be->cpu_seconds);
+	fprintf(fp, "Projected time:   %.0f seconds reading and compressing\n", be->wall_seconds);
+	if (!be->uploads){
+		return;
+	}
+	if (be->upload_rate > 0){
+		fprintf(fp, "Projected upload: %.0f seconds at %.1f MiB/s\n", be->upload_seconds, be->upload_rate / MIB);
+	}
+	else{
+		fprintf(fp, "Projected upload: unknown without --stats from an earlier backup or an upload limit\n");
+	}
+}
@@ -0,0 +1,72 @@
+/** @file estimate.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ *
+ * Estimates what a backup would cost without making it.<br>
+ * The directories are walked and matched against the last checksum file the same way a backup does, so files whose metadata did not change are not counted as read.<br>
+ * A sample spread across the files that would be read is then read and compressed with the configured compressor, and the output size, CPU time and duration are projected from how fast that went.<br>
+ * Nothing is written to the output directory or uploaded.
+ */
+
+#ifndef __ESTIMATE_H
+#define __ESTIMATE_H
+
+#include "options/options.h"
+#include <stdint.h>
+#include <stdio.h>
+
+#define ESTIMATE_SAMPLE_LEN ((size_t)1 << 26)      /**< @brief The most bytes read and compressed to measure the compressor (64MiB). */
+#define ESTIMATE_SAMPLE_FILE_LEN ((size_t)1 << 20) /**< @brief The most bytes of any one file in the sample (1MiB), so it spreads over many files. */
+
+/**
+ * @brief What a backup would cost.<br>
+ * Rates are in bytes per second, and are 0 if they could not be measured.
+ */
+struct backup_estimate{
+	unsigned long files_found;  /**< @brief Files in the directories being backed up. */
+	uint64_t bytes_found;       /**< @brief The total size of those files. */
+	unsigned long files_read;   /**< @brief Files that are new or changed, and so would be read. */
+	uint64_t bytes_read;        /**< @brief The total size of those files. */
+
+	uint64_t sample_in;         /**< @brief How many bytes of them were sampled. */
+	uint64_t sample_out;        /**< @brief How long the sample was once compressed. */
+	enum compressor c_type;     /**< @brief The compressor the sample was compressed with, which is the one a backup would pick. */
+	int c_level;                /**< @brief The level the sample was compressed with. */
+
+	double read_rate;           /**< @brief How fast the sample was read from disk. */
+	double compress_rate;       /**< @brief How fast one thread compressed the sample. */
+	double upload_rate;         /**< @brief How fast the last backup uploaded according to its statistics file, or the upload limit if that is lower. */
+	int uploads;                /**< @brief Non-zero if the backup would upload to a cloud. */
+
+	uint64_t bytes_out;         /**< @brief How many bytes the files that would be read are projected to compress to. */
+	double cpu_seconds;         /**< @brief How much CPU time compressing them is projected to take, over every thread. */
+	double wall_seconds;        /**< @brief How long reading and compressing them is projected to take, whichever is slower. */
+	double upload_seconds;      /**< @brief How long uploading the output is projected to take, or 0 if there is no cloud or no upload rate. */
+};
+
+/**
+ * @brief Estimates what a backup with a set of options would cost.
+ *
+ * @param opt The options the backup would be made with.
+ *
+ * @param out Set to the estimate.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int backup_estimate(const struct options* opt, struct backup_estimate* out);
+
+/**
+ * @brief Prints an estimate in a form meant to be read by a person.
+ *
+ * @param be The estimate.
+ *
+ * @param fp Where to print it, e.g. stdout.
+ *
+ * @return void
+ */
+void backup_estimate_print(const struct backup_estimate* be, FILE* fp);
+
+#endif
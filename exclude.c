@@ -0,0 +1,227 @@
+/** @file exclude.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "exclude.h"
+#include "log.h"
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct exclude_node{
+	/* one component of an excluded path, which is a glob if is_glob is set */
+	char* name;
+	int is_glob;
+	/* an excluded path ends here, so everything under this node is excluded too */
+	int terminal;
+	/* literal names sorted so they can be binary searched, then globs in the order they were added */
+	struct exclude_node* children;
+	size_t n_literal;
+	size_t n_children;
+	size_t size;
+};
+
+struct exclude_trie{
+	/* absolute and relative paths */
+	struct exclude_node root[2];
+};
+
+/* the next component of *path, skipping any slashes before it, and advances *path past it
+ * returns its length, or 0 if there are no more */
+static size_t next_component(const char** path, const char** out){
+	size_t len;
+
+	while (**path == '/'){
+		(*path)++;
+	}
+	*out = *path;
+	len = strcspn(*path, "/");
+	*path += len;
+	return len;
+}
+
+/* the index of the literal child named name, or where it would be inserted, with *found set if it exists */
+static size_t find_literal(const struct exclude_node* node, const char* name, size_t len, int* found){
+	size_t lo = 0;
+	size_t hi = node->n_literal;
+
+	*found = 0;
+	while (lo < hi){
+		size_t mid = lo + (hi - lo) / 2;
+		int res = strncmp(node->children[mid].name, name, len);
+
+		if (res == 0 && node->children[mid].name[len] != '\0'){
+			res = 1;
+		}
+		if (res == 0){
+			*found = 1;
+			return mid;
+		}
+		if (res < 0){
+			lo = mid + 1;
+		}
+		else{
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/* the child named name, which is added if it is not there yet */
+static struct exclude_node* get_child(struct exclude_node* node, const char* name, size_t len){
+	struct exclude_node* child;
+	int is_glob = memchr(name, '*', len) || memchr(name, '?', len) || memchr(name, '[', len);
+	size_t index;
+	int found;
+
+	if (is_glob){
+		for (index = node->n_literal; index < node->n_children; ++index){
+			if (strncmp(node->children[index].name, name, len) == 0 && node->children[index].name[len] == '\0'){
+				return &node->children[index];
+			}
+		}
+	}
+	else{
+		index = find_literal(node, name, len, &found);
+		if (found){
+			return &node->children[index];
+		}
+	}
+
+	if (node->n_children >= node->size){
+		size_t new_size = node->size ? node->size * 2 : 4;
+		struct exclude_node* tmp = realloc(node->children, new_size * sizeof(*node->children));
+
+		if (!tmp){
+			log_enomem();
+			return NULL;
+		}
+		node->children = tmp;
+		node->size = new_size;
+	}
+	memmove(&node->children[index + 1], &node->children[index], (node->n_children - index) * sizeof(*node->children));
+
+	child = &node->children[index];
+	memset(child, 0, sizeof(*child));
+	child->name = malloc(len + 1);
+	if (!child->name){
+		log_enomem();
+		memmove(&node->children[index], &node->children[index + 1], (node->n_children - index) * sizeof(*node->children));
+		return NULL;
+	}
+	memcpy(child->name, name, len);
+	child->name[len] = '\0';
+	child->is_glob = is_glob;
+	node->n_children++;
+	if (!is_glob){
+		node->n_literal++;
+	}
+	return child;
+}
+
+static int add_path(struct exclude_trie* et, const char* path){
+	struct exclude_node* node = &et->root[path[0] == '/'];
+	const char* name;
+	size_t len;
+
+	while ((len = next_component(&path, &name)) > 0){
+		/* something above this is already excluded as a whole */
+		if (node->terminal){
+			return 0;
+		}
+		if (!(node = get_child(node, name, len))){
+			return -1;
+		}
+	}
+	node->terminal = 1;
+	return 0;
+}
+
+static int match_node(const struct exclude_node* node, const char* path){
+	const char* name;
+	char component[256];
+	size_t len;
+	size_t i;
+	int found;
+
+	if (node->terminal){
+		return 1;
+	}
+	if ((len = next_component(&path, &name)) == 0){
+		return 0;
+	}
+
+	i = find_literal(node, name, len, &found);
+	if (found && match_node(&node->children[i], path)){
+		return 1;
+	}
+	if (node->n_children == node->n_literal){
+		return 0;
+	}
+
+	/* fnmatch() needs the component terminated, and names longer than this are not globbed */
+	if (len >= sizeof(component)){
+		return 0;
+	}
+	memcpy(component, name, len);
+	component[len] = '\0';
+	for (i = node->n_literal; i < node->n_children; ++i){
+		if (fnmatch(node->children[i].name, component, 0) == 0 && match_node(&node->children[i], path)){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void free_node(struct exclude_node* node){
+	size_t i;
+
+	for (i = 0; i < node->n_children; ++i){
+		free_node(&node->children[i]);
+	}
+	free(node->children);
+	free(node->name);
+}
+
+struct exclude_trie* exclude_new(const struct string_array* exclude){
+	struct exclude_trie* et;
+	size_t i;
+
+	et = calloc(1, sizeof(*et));
+	if (!et){
+		log_enomem();
+		return NULL;
+	}
+
+	for (i = 0; exclude && i < exclude->len; ++i){
+		if (add_path(et, exclude->strings[i]) != 0){
+			exclude_free(et);
+			return NULL;
+		}
+	}
+	return et;
+}
+
+int exclude_match(const struct exclude_trie* et, const char* path){
+	return_ifnull(et, 0);
+	return_ifnull(path, 0);
+
+	return match_node(&et->root[path[0] == '/'], path);
+}
+
+int exclude_skip(const char* path, void* data){
+	return exclude_match(data, path);
+}
+
+void exclude_free(struct exclude_trie* et){
+	if (!et){
+		return;
+	}
+	free_node(&et->root[0]);
+	free_node(&et->root[1]);
+	free(et);
+}
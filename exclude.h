@@ -0,0 +1,68 @@
+/** @file exclude.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __EXCLUDE_H
+#define __EXCLUDE_H
+
+#include "strings/stringarray.h"
+
+#ifndef __GNUC__
+#define __attribute__(x)
+#endif
+
+/**
+ * @brief Compiles a list of excluded paths into a trie of path components.<br>
+ * <br>
+ * A path is excluded if its leading components are the same as one of the excluded paths, so "/data/tmp" excludes "/data/tmp" and "/data/tmp/file", but not "/data/tmpfoo".<br>
+ * A component containing '*', '?' or '[' is a glob matched with fnmatch() against one component of the path, so a component of just "*" stands for any one directory.<br>
+ * Repeated and trailing slashes are ignored. Absolute and relative paths never match each other.<br>
+ * <br>
+ * Checking a path costs a binary search per component, plus an fnmatch() per glob that is next to it in the trie, no matter how many paths are excluded.
+ *
+ * @param exclude The paths to exclude.<br>
+ * This can be NULL, in which case nothing is excluded.
+ *
+ * @return A new exclude trie, or NULL on failure.<br>
+ * This must be freed with exclude_free() when no longer in use.
+ */
+struct exclude_trie* exclude_new(const struct string_array* exclude) __attribute__((malloc));
+
+/**
+ * @brief Checks if a path is excluded.<br>
+ * This function is thread-safe.
+ *
+ * @param et The exclude trie returned by exclude_new().
+ *
+ * @param path The path to check.
+ *
+ * @return Non-zero if the path is excluded, or 0 if it is not.
+ */
+int exclude_match(const struct exclude_trie* et, const char* path);
+
+/**
+ * @brief exclude_match() in the form fi_start_ex() and fi_walk_start() take, so excluded directories are never opened.
+ *
+ * @param path The path to check.
+ *
+ * @param data The exclude trie returned by exclude_new().
+ *
+ * @return Non-zero if the path is excluded, or 0 if it is not.
+ */
+int exclude_skip(const char* path, void* data);
+
+/**
+ * @brief Frees an exclude trie.
+ *
+ * @param et The exclude trie to free.<br>
+ * This can be NULL, in which case this function does nothing.
+ *
+ * @return void
+ */
+void exclude_free(struct exclude_trie* et);
+
+#endif
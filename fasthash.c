@@ -0,0 +1,202 @@
+/** @file fasthash.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+/* custom digests are only available through the EVP_MD_meth API, which OpenSSL 3 marks deprecated */
+#define OPENSSL_SUPPRESS_DEPRECATED
+
+#include "fasthash.h"
+#include "log.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#define XXH64_DIGEST_LEN 8
+#define XXH64_STRIPE_LEN 32
+
+/* c89 has no 64-bit integer constants */
+#define U64(hi, lo) (((uint64_t)(hi) << 32) | (uint64_t)(lo))
+#define PRIME64_1 U64(0x9E3779B1, 0x85EBCA87)
+#define PRIME64_2 U64(0xC2B2AE3D, 0x27D4EB4F)
+#define PRIME64_3 U64(0x165667B1, 0x9E3779F9)
+#define PRIME64_4 U64(0x85EBCA77, 0xC2B2AE63)
+#define PRIME64_5 U64(0x27D4EB2F, 0x165667C5)
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+struct xxh64_state{
+	uint64_t total_len;
+	uint64_t v[4];
+	unsigned char mem[XXH64_STRIPE_LEN];
+	size_t mem_len;
+};
+
+static uint64_t read64_le(const unsigned char* p){
+	return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+		((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static uint64_t read32_le(const unsigned char* p){
+	return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24);
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input){
+	acc += input * PRIME64_2;
+	acc = ROTL64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t val){
+	acc ^= xxh64_round(0, val);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+/* the four lanes are independent, so the compiler can keep all of them in flight at once */
+static void xxh64_stripe(uint64_t* v, const unsigned char* p){
+	v[0] = xxh64_round(v[0], read64_le(p));
+	v[1] = xxh64_round(v[1], read64_le(p + 8));
+	v[2] = xxh64_round(v[2], read64_le(p + 16));
+	v[3] = xxh64_round(v[3], read64_le(p + 24));
+}
+
+static int xxh64_init(EVP_MD_CTX* ctx){
+	struct xxh64_state* st = EVP_MD_CTX_md_data(ctx);
+
+	memset(st, 0, sizeof(*st));
+	st->v[0] = PRIME64_1 + PRIME64_2;
+	st->v[1] = PRIME64_2;
+	st->v[2] = 0;
+	st->v[3] = (uint64_t)0 - PRIME64_1;
+	return 1;
+}
+
+static int xxh64_update(EVP_MD_CTX* ctx, const void* data, size_t len){
+	struct xxh64_state* st = EVP_MD_CTX_md_data(ctx);
+	const unsigned char* p = data;
+
+	st->total_len += len;
+
+	/* not enough for a whole stripe yet */
+	if (st->mem_len + len < XXH64_STRIPE_LEN){
+		memcpy(st->mem + st->mem_len, p, len);
+		st->mem_len += len;
+		return 1;
+	}
+
+	if (st->mem_len > 0){
+		size_t fill = XXH64_STRIPE_LEN - st->mem_len;
+
+		memcpy(st->mem + st->mem_len, p, fill);
+		xxh64_stripe(st->v, st->mem);
+		p += fill;
+		len -= fill;
+		st->mem_len = 0;
+	}
+
+	while (len >= XXH64_STRIPE_LEN){
+		xxh64_stripe(st->v, p);
+		p += XXH64_STRIPE_LEN;
+		len -= XXH64_STRIPE_LEN;
+	}
+
+	memcpy(st->mem, p, len);
+	st->mem_len = len;
+	return 1;
+}
+
+static int xxh64_final(EVP_MD_CTX* ctx, unsigned char* md){
+	struct xxh64_state* st = EVP_MD_CTX_md_data(ctx);
+	const unsigned char* p = st->mem;
+	const unsigned char* end = st->mem + st->mem_len;
+	uint64_t h;
+	int i;
+
+	if (st->total_len >= XXH64_STRIPE_LEN){
+		h = ROTL64(st->v[0], 1) + ROTL64(st->v[1], 7) + ROTL64(st->v[2], 12) + ROTL64(st->v[3], 18);
+		for (i = 0; i < 4; ++i){
+			h = xxh64_merge(h, st->v[i]);
+		}
+	}
+	else{
+		h = PRIME64_5;
+	}
+	h += st->total_len;
+
+	for (; p + 8 <= end; p += 8){
+		h ^= xxh64_round(0, read64_le(p));
+		h = ROTL64(h, 27) * PRIME64_1 + PRIME64_4;
+	}
+	if (p + 4 <= end){
+		h ^= read32_le(p) * PRIME64_1;
+		h = ROTL64(h, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+	}
+	for (; p < end; ++p){
+		h ^= *p * PRIME64_5;
+		h = ROTL64(h, 11) * PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+
+	/* canonical form is big-endian */
+	for (i = XXH64_DIGEST_LEN - 1; i >= 0; --i){
+		md[i] = (unsigned char)(h & 0xFF);
+		h >>= 8;
+	}
+	return 1;
+}
+
+static EVP_MD* md_xxh64 = NULL;
+static pthread_once_t md_xxh64_once = PTHREAD_ONCE_INIT;
+
+static void make_xxh64(void){
+	EVP_MD* md;
+
+	md = EVP_MD_meth_new(NID_undef, NID_undef);
+	if (!md){
+		log_error("Failed to create the xxh64 digest");
+		return;
+	}
+	if (EVP_MD_meth_set_result_size(md, XXH64_DIGEST_LEN) != 1 ||
+			EVP_MD_meth_set_input_blocksize(md, XXH64_STRIPE_LEN) != 1 ||
+			EVP_MD_meth_set_app_datasize(md, sizeof(struct xxh64_state)) != 1 ||
+			EVP_MD_meth_set_init(md, xxh64_init) != 1 ||
+			EVP_MD_meth_set_update(md, xxh64_update) != 1 ||
+			EVP_MD_meth_set_final(md, xxh64_final) != 1){
+		log_error("Failed to set up the xxh64 digest");
+		EVP_MD_meth_free(md);
+		return;
+	}
+	md_xxh64 = md;
+}
+
+const EVP_MD* fasthash_xxh64(void){
+	pthread_once(&md_xxh64_once, make_xxh64);
+	return md_xxh64;
+}
+
+const EVP_MD* fasthash_get(const char* name){
+	if (!name){
+		return NULL;
+	}
+	if (strcasecmp(name, "xxh64") == 0){
+		return fasthash_xxh64();
+	}
+	return NULL;
+}
+
+const char* fasthash_name(const EVP_MD* md){
+	if (md && md == fasthash_xxh64()){
+		return "xxh64";
+	}
+	return NULL;
+}
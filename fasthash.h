@@ -0,0 +1,42 @@
+/** @file fasthash.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __FASTHASH_H
+#define __FASTHASH_H
+
+#include <openssl/evp.h>
+
+/**
+ * @brief Returns a digest that computes the 64-bit xxHash (XXH64) of its input.<br>
+ * This is many times faster than any cryptographic digest, but it is only good for detecting changes, not for resisting deliberate collisions.<br>
+ * The digest is returned in canonical (big-endian) form, so its hexadecimal string matches the output of xxh64sum.<br>
+ * It can be used anywhere an EVP_MD* from OpenSSL can.
+ *
+ * @return The XXH64 digest, or NULL if it could not be created.
+ */
+const EVP_MD* fasthash_xxh64(void);
+
+/**
+ * @brief Returns a built-in digest by name.
+ *
+ * @param name The name of the digest (e.g. "xxh64"). This is case-insensitive.
+ *
+ * @return The corresponding digest, or NULL if there is no built-in digest with that name.
+ */
+const EVP_MD* fasthash_get(const char* name);
+
+/**
+ * @brief Returns the name of a built-in digest.
+ *
+ * @param md The digest.
+ *
+ * @return The digest's name, or NULL if it is not a built-in digest.
+ */
+const char* fasthash_name(const EVP_MD* md);
+
+#endif
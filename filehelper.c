@@ -6,12 +6,19 @@
  * of the MIT license.  See the LICENSE file for details.
  */
 
+/* madvise() */
+#define _DEFAULT_SOURCE
+/* syscall() */
+#define _GNU_SOURCE
+
 /* prototypes */
 #include "filehelper.h"
 
 #include "strings/stringhelper.h"
 
 #include "strings/stringarray.h"
+/* source files can be read through io_uring */
+#include "uring.h"
 /* error handling */
 #include "log.h"
 #include <errno.h>
@@ -28,8 +35,22 @@
 #include <fcntl.h>
 
 #include <sys/file.h>
+/* read_file_blocks() */
+#include <sys/mman.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+/* copy_file() lets the kernel copy when it can */
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif
 
 #define TEMP_DIRECTORY "/var/tmp"
+/* the most copy_file_range() or sendfile() is asked to copy at once, which stays below what either can do in one call */
+#define KERNEL_COPY_LEN ((size_t)1 << 30)
 
 /* reads length bytes from fp */
 /* returns the number of bytes sucessfully read */
@@ -46,6 +67,805 @@ int read_file(FILE* fp, unsigned char* dest, size_t length){
 	return ret;
 }
 
+static int read_blocks(FILE* fp, int(*func)(const void* block, size_t len, void* data), void* data){
+	unsigned char buffer[BUFFER_LEN];
+	int len;
+
+	while ((len = read_file(fp, buffer, sizeof(buffer))) > 0){
+		if (func(buffer, len, data) != 0){
+			return -1;
+		}
+	}
+	return ferror(fp) ? -1 : 0;
+}
+
+/* touching a mapped page past the end of a file that shrank raises SIGBUS instead of returning an error,
+ * so each thread reading a map registers where to jump back to */
+static pthread_key_t sigbus_key;
+static pthread_once_t sigbus_once = PTHREAD_ONCE_INIT;
+static int sigbus_ready = 0;
+/* how much of a file map_blocks() maps at once */
+static size_t map_window = MAP_FILE_WINDOW;
+/* how large a file has to be for its pages to be dropped as it is read */
+static uint64_t source_drop_behind = SOURCE_DROP_BEHIND;
+
+static void sigbus_handler(int sig){
+	sigjmp_buf* jb = pthread_getspecific(sigbus_key);
+
+	if (!jb){
+		/* not ours, so crash like we would have anyway */
+		signal(sig, SIG_DFL);
+		raise(sig);
+		return;
+	}
+	siglongjmp(*jb, 1);
+}
+
+static void sigbus_init(void){
+	struct sigaction sa;
+
+	if (pthread_key_create(&sigbus_key, NULL) != 0){
+		log_debug("Failed to create SIGBUS key");
+		return;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigbus_handler;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGBUS, &sa, NULL) != 0){
+		log_debug("Failed to install SIGBUS handler");
+		return;
+	}
+	sigbus_ready = 1;
+}
+
+static int map_blocks(FILE* fp, uint64_t size, int(*func)(const void* block, size_t len, void* data), void* data){
+	sigjmp_buf jb;
+	/* still needed after a jump back */
+	void* volatile map = NULL;
+	volatile size_t map_len = 0;
+	uint64_t offset = 0;
+	int ret = 0;
+
+	if (sigsetjmp(jb, 1) != 0){
+		pthread_setspecific(sigbus_key, NULL);
+		munmap(map, map_len);
+		log_warning("File shrank while it was being read");
+		return -1;
+	}
+	pthread_setspecific(sigbus_key, &jb);
+
+	while (offset < size){
+		size_t len = size - offset > map_window ? map_window : size - offset;
+		void* p;
+
+		p = mmap(NULL, len, PROT_READ, MAP_SHARED, fileno(fp), offset);
+		if (p == MAP_FAILED){
+			/* read the rest the normal way */
+			log_debug_ex("Failed to map file (%s)", strerror(errno));
+			pthread_setspecific(sigbus_key, NULL);
+			if (fseek(fp, offset, SEEK_SET) != 0){
+				log_error_ex("Failed to seek in file (%s)", strerror(errno));
+				return -1;
+			}
+			return read_blocks(fp, func, data);
+		}
+		map_len = len;
+		map = p;
+		if (madvise(p, len, MADV_SEQUENTIAL) != 0){
+			log_debug("madvise() failed");
+		}
+
+		if (func(p, len, data) != 0){
+			ret = -1;
+			break;
+		}
+
+		map = NULL;
+		munmap(p, len);
+#ifdef POSIX_FADV_DONTNEED
+		/* the same as source_open() does for a file this big */
+		if (size >= source_drop_behind){
+			posix_fadvise(fileno(fp), offset, len, POSIX_FADV_DONTNEED);
+		}
+#endif
+		offset += len;
+	}
+
+	pthread_setspecific(sigbus_key, NULL);
+	if (map){
+		munmap(map, map_len);
+	}
+	return ret;
+}
+
+void read_file_set_window(size_t window){
+	size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+	if (window == 0){
+		window = MAP_FILE_WINDOW;
+	}
+	map_window = (window + page_size - 1) / page_size * page_size;
+}
+
+int read_file_blocks(FILE* fp, int(*func)(const void* block, size_t len, void* data), void* data){
+	struct stat st;
+
+	return_ifnull(fp, -1);
+	return_ifnull(func, -1);
+
+	pthread_once(&sigbus_once, sigbus_init);
+	if (!sigbus_ready || fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode) || (uint64_t)st.st_size < MAP_FILE_THRESHOLD){
+		return read_blocks(fp, func, data);
+	}
+	return map_blocks(fp, st.st_size, func, data);
+}
+
+static int is_zeros(const unsigned char* p, size_t len){
+	return len > 0 && p[0] == 0 && memcmp(p, p + 1, len - 1) == 0;
+}
+
+int write_sparse(FILE* fp, const void* data, size_t len){
+	const unsigned char* p = data;
+
+	return_ifnull(fp, -1);
+	return_ifnull(data, -1);
+
+	while (len > 0){
+		size_t run = len < SPARSE_BLOCK_LEN ? len : SPARSE_BLOCK_LEN;
+		/* a block cut short is always written */
+		int zeros = run == SPARSE_BLOCK_LEN && is_zeros(p, run);
+
+		/* every seek flushes fp, so blocks of the same kind go together */
+		while (run < len){
+			size_t next = len - run < SPARSE_BLOCK_LEN ? len - run : SPARSE_BLOCK_LEN;
+
+			if ((next == SPARSE_BLOCK_LEN && is_zeros(p + run, next)) != zeros){
+				break;
+			}
+			run += next;
+		}
+		if (zeros ? fseeko(fp, (off_t)run, SEEK_CUR) != 0 : fwrite(p, 1, run, fp) != run){
+			return -1;
+		}
+		p += run;
+		len -= run;
+	}
+	return 0;
+}
+
+int finish_sparse(FILE* fp){
+	off_t pos;
+
+	return_ifnull(fp, -1);
+
+	if (fflush(fp) != 0 || (pos = ftello(fp)) < 0 || ftruncate(fileno(fp), pos) != 0){
+		return -1;
+	}
+	return 0;
+}
+
+#ifdef HAVE_URING
+/* a read through io_uring, whose slot's buffer cannot be reused until source_read() is done with it */
+struct source_slot{
+	uint64_t offset;
+	int res;
+	int done;
+};
+
+/* each thread keeps one ring with its buffers already registered, so setting them up is paid for once instead of for every file */
+struct source_ring{
+	struct uring* ring;
+	unsigned char* bufs;
+	struct iovec* iovs;
+	struct source_slot* slots;
+	size_t len;
+	unsigned depth;
+	/* the buffers are pinned, so reads use IORING_OP_READ_FIXED instead of IORING_OP_READV */
+	int fixed;
+	/* a source file is using the ring, so another one opened on the same thread is read normally */
+	int busy;
+};
+#endif
+
+struct source_file{
+	int fd;
+	char* path;
+	uint64_t size;
+	/* how much of the file source_read() has been given, and how much before that has been dropped from the page cache */
+	uint64_t offset;
+	uint64_t dropped;
+	unsigned char* buf;
+	size_t buf_len;
+	/* what source_read() copies from next, which is buf unless the file is read through io_uring */
+	const unsigned char* block;
+	size_t block_pos;
+	size_t block_fill;
+	int direct;
+	/* the file takes up less space than its size, so it is read around its holes
+	 * [hole_start, hole_end) is the next hole, both are UINT64_MAX once there are no more, and neither is known yet if offset >= hole_end */
+	int sparse;
+	uint64_t hole_start;
+	uint64_t hole_end;
+#ifdef HAVE_URING
+	/* NULL unless the file is read through io_uring */
+	struct source_ring* sr;
+	/* where the next read is submitted at */
+	uint64_t next_read;
+	/* reads are numbered in the order they are submitted, and each one uses slot number % depth */
+	unsigned long n_submitted;
+	unsigned long n_consumed;
+	/* how many submitted reads the kernel has not completed */
+	unsigned in_flight;
+	/* block is the buffer of read n_consumed, which is still being copied from */
+	int holding;
+	int eof;
+#endif
+};
+
+/* what source_read() copies from in a hole */
+static const unsigned char source_zeros[1 << 16];
+
+static size_t source_read_len = SOURCE_READ_LEN;
+static int source_direct = 0;
+static unsigned source_uring_depth = 0;
+static void (*source_throttle)(size_t len, void* data) = NULL;
+static void* source_throttle_data = NULL;
+
+void source_set_options(size_t read_len, int direct, unsigned uring_depth){
+	if (read_len == 0){
+		read_len = SOURCE_READ_LEN;
+	}
+	source_read_len = (read_len + SOURCE_ALIGN - 1) / SOURCE_ALIGN * SOURCE_ALIGN;
+	source_direct = direct;
+	source_uring_depth = uring_depth;
+}
+
+void source_set_drop_behind(uint64_t len){
+	source_drop_behind = len ? len : SOURCE_DROP_BEHIND;
+}
+
+void source_set_throttle(void (*throttle)(size_t len, void* data), void* data){
+	source_throttle = throttle;
+	source_throttle_data = data;
+}
+
+/* O_DIRECT refused a read, most likely because it is not aligned, so the file is read normally from now on */
+static int source_clear_direct(struct source_file* sf){
+#ifdef O_DIRECT
+	int flags = fcntl(sf->fd, F_GETFL);
+
+	if (flags != -1 && fcntl(sf->fd, F_SETFL, flags & ~O_DIRECT) == 0){
+		sf->direct = 0;
+		return 0;
+	}
+#endif
+	return -1;
+}
+
+/* counts n more bytes as read, dropping what is behind them from the page cache */
+static void source_advance(struct source_file* sf, size_t n){
+	sf->offset += n;
+	if (source_throttle){
+		source_throttle(n, source_throttle_data);
+	}
+
+#ifdef POSIX_FADV_DONTNEED
+	/* a few MB at a time is plenty, and keeps it from being a syscall per read */
+	if (!sf->direct && sf->size >= source_drop_behind && sf->offset - sf->dropped >= source_drop_behind / 8){
+		posix_fadvise(sf->fd, sf->dropped, sf->offset - sf->dropped, POSIX_FADV_DONTNEED);
+		sf->dropped = sf->offset;
+	}
+#endif
+}
+
+#ifdef SEEK_DATA
+/* finds the next hole from where the file is read, and leaves the descriptor where it was */
+static int source_find_hole(struct source_file* sf){
+	off_t data;
+	off_t hole;
+
+	sf->hole_start = UINT64_MAX;
+	sf->hole_end = UINT64_MAX;
+	if (sf->offset >= sf->size){
+		return 0;
+	}
+
+	if ((data = lseek(sf->fd, sf->offset, SEEK_DATA)) < 0 && errno != ENXIO){
+		return -1;
+	}
+	if (data < 0){
+		/* nothing but a hole to the end */
+		sf->hole_start = sf->offset;
+		sf->hole_end = sf->size;
+	}
+	else if ((uint64_t)data > sf->offset){
+		sf->hole_start = sf->offset;
+		sf->hole_end = (uint64_t)data < sf->size ? (uint64_t)data : sf->size;
+	}
+	else if ((hole = lseek(sf->fd, sf->offset, SEEK_HOLE)) < 0){
+		return -1;
+	}
+	/* the end of the file counts as a hole, but there is nothing to skip there */
+	else if ((uint64_t)hole < sf->size){
+		sf->hole_start = hole;
+		data = lseek(sf->fd, hole, SEEK_DATA);
+		if (data < 0 && errno != ENXIO){
+			return -1;
+		}
+		sf->hole_end = data >= 0 && (uint64_t)data < sf->size ? (uint64_t)data : sf->size;
+	}
+
+	return lseek(sf->fd, sf->offset, SEEK_SET) == (off_t)-1 ? -1 : 0;
+}
+#endif
+
+#ifdef HAVE_URING
+static pthread_key_t source_ring_key;
+static pthread_once_t source_ring_once = PTHREAD_ONCE_INIT;
+static int source_ring_ready = 0;
+/* io_uring could not be set up once, so it is not tried for every file after that */
+static int source_ring_failed = 0;
+
+static void source_ring_free(void* arg){
+	struct source_ring* sr = arg;
+
+	if (!sr){
+		return;
+	}
+	/* the ring goes first, since the kernel could still be reading into the buffers */
+	uring_free(sr->ring);
+	free(sr->bufs);
+	free(sr->iovs);
+	free(sr->slots);
+	free(sr);
+}
+
+static void source_ring_init(void){
+	if (pthread_key_create(&source_ring_key, source_ring_free) != 0){
+		log_debug("Failed to create the io_uring key");
+		return;
+	}
+	source_ring_ready = 1;
+}
+
+/* returns this thread's ring, setting it up for the current options if it has to
+ * returns NULL if the file should be read normally */
+static struct source_ring* source_ring_get(void){
+	struct source_ring* sr;
+	void* bufs;
+	unsigned i;
+
+	pthread_once(&source_ring_once, source_ring_init);
+	if (!source_ring_ready || __atomic_load_n(&source_ring_failed, __ATOMIC_RELAXED)){
+		return NULL;
+	}
+
+	sr = pthread_getspecific(source_ring_key);
+	if (sr && sr->busy){
+		return NULL;
+	}
+	if (sr && sr->len == source_read_len && sr->depth == source_uring_depth){
+		return sr;
+	}
+	/* the options changed since it was set up */
+	source_ring_free(sr);
+	pthread_setspecific(source_ring_key, NULL);
+
+	sr = calloc(1, sizeof(*sr));
+	if (!sr){
+		log_enomem();
+		return NULL;
+	}
+	sr->len = source_read_len;
+	sr->depth = source_uring_depth;
+	sr->iovs = malloc(sr->depth * sizeof(*sr->iovs));
+	sr->slots = calloc(sr->depth, sizeof(*sr->slots));
+	/* O_DIRECT reads need aligned buffers, and nothing else minds them */
+	if (!sr->iovs || !sr->slots || posix_memalign(&bufs, SOURCE_ALIGN, sr->len * sr->depth) != 0){
+		log_enomem();
+		source_ring_free(sr);
+		return NULL;
+	}
+	sr->bufs = bufs;
+
+	if (!(sr->ring = uring_new(sr->depth))){
+		log_debug("Files will be read with one blocking read() at a time.");
+		__atomic_store_n(&source_ring_failed, 1, __ATOMIC_RELAXED);
+		source_ring_free(sr);
+		return NULL;
+	}
+	for (i = 0; i < sr->depth; ++i){
+		sr->iovs[i].iov_base = sr->bufs + i * sr->len;
+		sr->iovs[i].iov_len = sr->len;
+	}
+	/* a low RLIMIT_MEMLOCK refuses to pin them, which only costs the kernel mapping them for every read */
+	sr->fixed = uring_register_buffers(sr->ring, sr->iovs, sr->depth) == 0;
+
+	if (pthread_setspecific(source_ring_key, sr) != 0){
+		log_debug("Failed to keep this thread's io_uring");
+		source_ring_free(sr);
+		return NULL;
+	}
+	return sr;
+}
+
+/* keeps a read in flight for every slot that is not being copied from
+ * nothing is read past where the file ended when it was opened, unless that is the only way to find out whether it grew */
+static int source_ring_submit(struct source_file* sf){
+	struct source_ring* sr = sf->sr;
+	unsigned queued = 0;
+
+	while (!sf->eof && sf->n_submitted - sf->n_consumed < sr->depth && (sf->next_read <= sf->size || sf->n_submitted == sf->n_consumed)){
+		unsigned slot = sf->n_submitted % sr->depth;
+		struct io_uring_sqe* sqe = uring_get_sqe(sr->ring);
+
+		if (!sqe){
+			break;
+		}
+		if (sr->fixed){
+			sqe->opcode = IORING_OP_READ_FIXED;
+			sqe->addr = (unsigned long)sr->iovs[slot].iov_base;
+			sqe->len = sr->len;
+			sqe->buf_index = slot;
+		}
+		else{
+			sqe->opcode = IORING_OP_READV;
+			sqe->addr = (unsigned long)&sr->iovs[slot];
+			sqe->len = 1;
+		}
+		sqe->fd = sf->fd;
+		sqe->off = sf->next_read;
+		sqe->user_data = sf->n_submitted;
+		sr->slots[slot].offset = sf->next_read;
+		sr->slots[slot].done = 0;
+		sf->next_read += sr->len;
+		sf->n_submitted++;
+		queued++;
+	}
+	if (queued == 0){
+		return 0;
+	}
+	sf->in_flight += queued;
+	return uring_enter(sr->ring, 0);
+}
+
+/* collects completions until read number n is done, or until none are in flight if all is set */
+static int source_ring_wait(struct source_file* sf, unsigned long n, int all){
+	struct source_ring* sr = sf->sr;
+
+	for (;;){
+		const struct io_uring_cqe* cqe;
+
+		while ((cqe = uring_peek(sr->ring)) != NULL){
+			struct source_slot* slot = &sr->slots[cqe->user_data % sr->depth];
+
+			slot->res = cqe->res;
+			slot->done = 1;
+			uring_seen(sr->ring);
+			sf->in_flight--;
+		}
+		if (all ? sf->in_flight == 0 : sr->slots[n % sr->depth].done){
+			return 0;
+		}
+		if (uring_enter(sr->ring, 1) != 0){
+			return -1;
+		}
+	}
+}
+
+/* throws away every read after the first keep ones that have not been consumed, and reads from offset after them instead */
+static int source_ring_rewind(struct source_file* sf, unsigned long keep, uint64_t offset){
+	/* none of their buffers can be reused until the kernel is done with them */
+	if (source_ring_wait(sf, 0, 1) != 0){
+		return -1;
+	}
+	sf->n_submitted = sf->n_consumed + keep;
+	sf->next_read = offset;
+	return 0;
+}
+
+/* makes the next block read through io_uring the one source_read() copies from
+ * returns its length, 0 at the end of the file, or negative on error */
+static ssize_t source_ring_next(struct source_file* sf){
+	struct source_ring* sr = sf->sr;
+
+	for (;;){
+		struct source_slot* slot;
+		unsigned index;
+
+		if (sf->holding){
+			sf->n_consumed++;
+			sf->holding = 0;
+		}
+		if (source_ring_submit(sf) != 0){
+			return -1;
+		}
+		if (sf->n_consumed == sf->n_submitted){
+			return 0;
+		}
+		if (source_ring_wait(sf, sf->n_consumed, 0) != 0){
+			return -1;
+		}
+
+		index = sf->n_consumed % sr->depth;
+		slot = &sr->slots[index];
+		if (slot->res < 0){
+			int err = -slot->res;
+
+			/* the reads after this one are thrown away and tried again from here */
+			if (err == EINTR || err == EAGAIN || (err == EINVAL && sf->direct && source_clear_direct(sf) == 0)){
+				if (source_ring_rewind(sf, 0, slot->offset) != 0){
+					return -1;
+				}
+				continue;
+			}
+			log_error_ex2("Error reading from %s (%s)", sf->path, strerror(err));
+			return -1;
+		}
+		if (slot->res == 0){
+			sf->eof = 1;
+			return source_ring_rewind(sf, 0, slot->offset) == 0 ? 0 : -1;
+		}
+		/* the end of the file, or it shrank or grew, so the reads after this one started in the wrong place */
+		if ((size_t)slot->res < sr->len && source_ring_rewind(sf, 1, slot->offset + slot->res) != 0){
+			return -1;
+		}
+
+		sf->holding = 1;
+		sf->block = sr->bufs + index * sr->len;
+		sf->block_pos = 0;
+		sf->block_fill = slot->res;
+		source_advance(sf, slot->res);
+		return slot->res;
+	}
+}
+#endif
+
+struct source_file* source_open(const char* path, uint64_t offset){
+	struct source_file* sf;
+	struct stat st;
+	void* buf;
+
+	return_ifnull(path, NULL);
+
+	sf = calloc(1, sizeof(*sf));
+	if (!sf || !(sf->path = sh_dup(path))){
+		log_enomem();
+		free(sf);
+		return NULL;
+	}
+	sf->fd = -1;
+	sf->offset = offset;
+	sf->dropped = offset;
+
+#ifdef O_DIRECT
+	/* tmpfs and some network filesystems refuse it */
+	if (source_direct && (sf->fd = open(path, O_RDONLY | O_DIRECT)) >= 0){
+		sf->direct = 1;
+	}
+#endif
+	if (sf->fd < 0 && (sf->fd = open(path, O_RDONLY)) < 0){
+		log_efopen(path);
+		source_close(sf);
+		return NULL;
+	}
+
+	if (fstat(sf->fd, &st) == 0 && S_ISREG(st.st_mode)){
+		sf->size = st.st_size;
+#ifdef SEEK_DATA
+		/* st_blocks is always in 512 byte units */
+		sf->sparse = (uint64_t)st.st_blocks * 512 < sf->size;
+#endif
+	}
+
+#ifdef HAVE_URING
+	/* a file that fits in one read gains nothing from having several in flight, and a sparse one has to be read around its holes */
+	if (!sf->sparse && source_uring_depth > 1 && sf->size > offset && sf->size - offset > source_read_len && (sf->sr = source_ring_get()) != NULL){
+		sf->sr->busy = 1;
+		sf->next_read = offset;
+	}
+	else
+#endif
+	{
+		/* a small file only needs enough to see where it ends, which keeps opening one cheap
+		 * O_DIRECT reads need an aligned buffer, and nothing else minds one */
+		sf->buf_len = source_read_len;
+		if (sf->size > 0 && sf->size >= offset && sf->size - offset < sf->buf_len){
+			sf->buf_len = (size_t)(sf->size - offset + SOURCE_ALIGN) / SOURCE_ALIGN * SOURCE_ALIGN;
+		}
+		if (posix_memalign(&buf, SOURCE_ALIGN, sf->buf_len) != 0){
+			log_enomem();
+			source_close(sf);
+			return NULL;
+		}
+		sf->buf = buf;
+		if (offset > 0 && lseek(sf->fd, offset, SEEK_SET) == (off_t)-1){
+			log_error_ex2("Failed to seek in %s (%s)", path, strerror(errno));
+			source_close(sf);
+			return NULL;
+		}
+	}
+
+#ifdef SEEK_DATA
+	/* a filesystem that cannot find holes gets the file read normally */
+	if (sf->sparse && source_find_hole(sf) != 0){
+		sf->sparse = 0;
+	}
+#endif
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	if (!sf->direct){
+		posix_fadvise(sf->fd, offset, 0, POSIX_FADV_SEQUENTIAL);
+	}
+#endif
+	return sf;
+}
+
+/* reads the next block from the file with a blocking read() */
+static ssize_t source_read_block(struct source_file* sf, void* target, size_t len){
+	ssize_t n;
+
+	while ((n = read(sf->fd, target, len)) < 0){
+		if (errno == EINTR){
+			continue;
+		}
+		/* the last read came up short before the end, so this one is no longer aligned */
+		if (errno == EINVAL && sf->direct && source_clear_direct(sf) == 0){
+			continue;
+		}
+		log_error_ex2("Error reading from %s (%s)", sf->path, strerror(errno));
+		return -1;
+	}
+	source_advance(sf, n);
+	return n;
+}
+
+int source_read(struct source_file* sf, void* dest, size_t length){
+	unsigned char* out = dest;
+	size_t done = 0;
+
+	return_ifnull(sf, -1);
+	return_ifnull(dest, -1);
+
+	while (done < length){
+		size_t avail = sf->block_fill - sf->block_pos;
+		/* how far it is to the next hole */
+		uint64_t data_left = UINT64_MAX;
+		ssize_t n;
+
+		if (avail > 0){
+			size_t len = avail < length - done ? avail : length - done;
+
+			memcpy(out + done, sf->block + sf->block_pos, len);
+			sf->block_pos += len;
+			done += len;
+			continue;
+		}
+
+#ifdef SEEK_DATA
+		if (sf->sparse && sf->offset >= sf->hole_end && source_find_hole(sf) != 0){
+			log_error_ex2("Failed to find the holes in %s (%s)", sf->path, strerror(errno));
+			return -1;
+		}
+		/* a hole is zeros without asking the disk for them */
+		if (sf->sparse && sf->offset >= sf->hole_start){
+			sf->block = source_zeros;
+			sf->block_pos = 0;
+			sf->block_fill = sf->hole_end - sf->offset < sizeof(source_zeros) ? (size_t)(sf->hole_end - sf->offset) : sizeof(source_zeros);
+			sf->offset += sf->block_fill;
+			if (sf->offset == sf->hole_end && lseek(sf->fd, sf->offset, SEEK_SET) == (off_t)-1){
+				log_error_ex2("Failed to seek in %s (%s)", sf->path, strerror(errno));
+				return -1;
+			}
+			continue;
+		}
+		/* and a read stops where the next one starts */
+		if (sf->sparse && sf->hole_start - sf->offset < data_left){
+			data_left = sf->hole_start - sf->offset;
+		}
+#endif
+
+#ifdef HAVE_URING
+		if (sf->sr){
+			if ((n = source_ring_next(sf)) < 0){
+				return -1;
+			}
+		}
+		else
+#endif
+		/* a read at least as big as the buffer does not need to go through it, unless O_DIRECT needs it aligned */
+		if (!sf->direct && length - done >= sf->buf_len && data_left >= sf->buf_len){
+			if ((n = source_read_block(sf, out + done, data_left < length - done ? (size_t)data_left : length - done)) < 0){
+				return -1;
+			}
+			done += n;
+		}
+		else{
+			if ((n = source_read_block(sf, sf->buf, data_left < sf->buf_len ? (size_t)data_left : sf->buf_len)) < 0){
+				return -1;
+			}
+			sf->block = sf->buf;
+			sf->block_pos = 0;
+			sf->block_fill = n;
+		}
+		if (n == 0){
+			break;
+		}
+	}
+	return (int)done;
+}
+
+uint64_t source_hole(const struct source_file* sf){
+	if (!sf || !sf->sparse){
+		return 0;
+	}
+	if (sf->block == source_zeros && sf->block_pos < sf->block_fill){
+		return (sf->block_fill - sf->block_pos) + (sf->hole_end - sf->offset);
+	}
+	if (sf->block_pos == sf->block_fill && sf->offset >= sf->hole_start && sf->offset < sf->hole_end){
+		return sf->hole_end - sf->offset;
+	}
+	return 0;
+}
+
+uint64_t source_size(const struct source_file* sf){
+	return sf ? sf->size : 0;
+}
+
+void source_close(struct source_file* sf){
+	if (!sf){
+		return;
+	}
+#ifdef HAVE_URING
+	/* the next file on this thread cannot use the ring until the kernel is done reading this one into it */
+	if (sf->sr){
+		if (source_ring_wait(sf, 0, 1) == 0){
+			sf->sr->busy = 0;
+		}
+		else{
+			log_warning("Failed to wait for reads in flight. This thread's files are read normally from now on.");
+		}
+	}
+#endif
+#ifdef POSIX_FADV_DONTNEED
+	/* nothing reads a source file after it is backed up, so whatever is left of it in the page cache can go */
+	if (sf->fd >= 0 && !sf->direct && sf->offset > sf->dropped){
+		posix_fadvise(sf->fd, sf->dropped, sf->offset - sf->dropped, POSIX_FADV_DONTNEED);
+	}
+#endif
+	sf->fd >= 0 ? close(sf->fd) : 0;
+	free(sf->buf);
+	free(sf->path);
+	free(sf);
+}
+
+int source_prefetch(const char* path){
+	struct stat st;
+	int fd;
+
+	return_ifnull(path, -1);
+
+	/* O_DIRECT reads never look in the page cache */
+	if (source_direct){
+		return 0;
+	}
+	/* O_NONBLOCK keeps a FIFO that replaced the file from holding up the caller */
+	if ((fd = open(path, O_RDONLY | O_NONBLOCK)) < 0){
+		log_debug_ex2("Failed to open %s for prefetching (%s)", path, strerror(errno));
+		return -1;
+	}
+#ifdef POSIX_FADV_WILLNEED
+	/* only the start of a large file, since the reader's own readahead takes over from there */
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+		posix_fadvise(fd, 0, (uint64_t)st.st_size < SOURCE_PREFETCH_LEN ? st.st_size : (off_t)SOURCE_PREFETCH_LEN, POSIX_FADV_WILLNEED);
+	}
+#else
+	(void)st;
+#endif
+	close(fd);
+	return 0;
+}
+
 struct TMPFILE* temp_fopen(void){
 	int fd;
 	struct TMPFILE* tfp;
@@ -102,6 +922,196 @@ void temp_fclose(struct TMPFILE* tfp){
 	free(tfp);
 }
 
+/* the directory a path is in, which is "." for a bare filename */
+static char* dir_of(const char* path){
+	const char* slash = strrchr(path, '/');
+	char* ret;
+
+	if (!slash){
+		return sh_dup(".");
+	}
+	if (slash == path){
+		return sh_dup("/");
+	}
+	ret = malloc(slash - path + 1);
+	if (!ret){
+		log_enomem();
+		return NULL;
+	}
+	memcpy(ret, path, slash - path);
+	ret[slash - path] = '\0';
+	return ret;
+}
+
+struct ATOMICFILE* atomic_fopen(const char* path){
+	struct ATOMICFILE* af;
+	int fd = -1;
+
+	return_ifnull(path, NULL);
+
+	af = calloc(1, sizeof(*af));
+	if (!af || !(af->name = sh_dup(path))){
+		log_enomem();
+		free(af);
+		return NULL;
+	}
+
+#ifdef O_TMPFILE
+	{
+		char* dir = dir_of(path);
+
+		/* EOPNOTSUPP or EISDIR if the filesystem or the kernel cannot, which is what the named file is for */
+		if (dir){
+			fd = open(dir, O_TMPFILE | O_RDWR, 0666);
+			free(dir);
+		}
+	}
+#endif
+
+	if (fd < 0){
+		if (!(af->tmp_name = sh_concat(sh_dup(path), ".tmp_XXXXXX"))){
+			log_enomem();
+			atomic_fclose(af);
+			return NULL;
+		}
+		fd = mkstemp(af->tmp_name);
+		if (fd < 0){
+			log_error_ex2("Failed to create a temporary file next to %s (%s)", path, strerror(errno));
+			free(af->tmp_name);
+			af->tmp_name = NULL;
+			atomic_fclose(af);
+			return NULL;
+		}
+	}
+
+	af->fp = fdopen(fd, "w+b");
+	if (!af->fp){
+		log_efopen(path);
+		close(fd);
+		atomic_fclose(af);
+		return NULL;
+	}
+	return af;
+}
+
+#ifdef O_TMPFILE
+/* gives an unnamed file a name, which only works if nothing has it yet */
+static int link_fd(int fd, const char* path){
+	char proc_path[64];
+
+	/* needs CAP_DAC_READ_SEARCH, but does not need /proc */
+	if (linkat(fd, "", AT_FDCWD, path, AT_EMPTY_PATH) == 0){
+		return 0;
+	}
+	if (errno == EEXIST){
+		return -1;
+	}
+	sprintf(proc_path, "/proc/self/fd/%d", fd);
+	return linkat(AT_FDCWD, proc_path, AT_FDCWD, path, AT_SYMLINK_FOLLOW);
+}
+#endif
+
+int atomic_fcommit(struct ATOMICFILE* af){
+	return_ifnull(af, -1);
+	return_ifnull(af->fp, -1);
+
+	if (fflush(af->fp) != 0){
+		log_efwrite(af->name);
+		return -1;
+	}
+
+#ifdef O_TMPFILE
+	if (!af->tmp_name){
+		unsigned i;
+
+		if (link_fd(fileno(af->fp), af->name) == 0){
+			return 0;
+		}
+		if (errno != EEXIST){
+			log_error_ex2("Failed to create %s (%s)", af->name, strerror(errno));
+			return -1;
+		}
+		/* linkat() cannot replace a file, but rename() can, so it gets a name of its own first
+		 * that name only exists for as long as the rename takes */
+		for (i = 0; i < 100; ++i){
+			char* tmp_name = sh_sprintf("%s.tmp_%lu_%u", af->name, (unsigned long)getpid(), i);
+
+			if (!tmp_name){
+				log_enomem();
+				return -1;
+			}
+			if (link_fd(fileno(af->fp), tmp_name) == 0){
+				af->tmp_name = tmp_name;
+				break;
+			}
+			free(tmp_name);
+			if (errno != EEXIST){
+				log_error_ex2("Failed to create a temporary file next to %s (%s)", af->name, strerror(errno));
+				return -1;
+			}
+		}
+		if (!af->tmp_name){
+			log_error_ex("Failed to find a free temporary name next to %s", af->name);
+			return -1;
+		}
+	}
+#endif
+
+	if (rename(af->tmp_name, af->name) != 0){
+		log_error_ex2("Failed to move a temporary file to %s (%s)", af->name, strerror(errno));
+		return -1;
+	}
+	free(af->tmp_name);
+	af->tmp_name = NULL;
+	return 0;
+}
+
+void atomic_fclose(struct ATOMICFILE* af){
+	if (!af){
+		return;
+	}
+	af->fp ? fclose(af->fp) : 0;
+	/* only still set if the file was never published */
+	af->tmp_name ? remove(af->tmp_name) : 0;
+	free(af->tmp_name);
+	free(af->name);
+	free(af);
+}
+
+void write_behind(FILE* fp){
+	if (!fp || fflush(fp) != 0){
+		return;
+	}
+#if defined(__linux__) && defined(SYNC_FILE_RANGE_WRITE)
+	/* only a hint, so a failure here just leaves it for the sync */
+	sync_file_range(fileno(fp), 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+}
+
+int sync_filesystem(const char* path){
+#ifdef __linux__
+	int fd;
+	int ret = 0;
+
+	return_ifnull(path, -1);
+
+	if ((fd = open(path, O_RDONLY)) < 0){
+		log_error_ex2("Failed to open %s (%s)", path, strerror(errno));
+		return -1;
+	}
+	if (syncfs(fd) != 0){
+		log_error_ex2("Failed to sync the filesystem of %s (%s)", path, strerror(errno));
+		ret = -1;
+	}
+	close(fd);
+	return ret;
+#else
+	return_ifnull(path, -1);
+	sync();
+	return 0;
+#endif
+}
+
 int file_opened_for_reading(FILE* fp){
 	int fd;
 	int flags;
@@ -147,11 +1157,71 @@ uint64_t get_file_size(const char* file){
 	return st.st_size;
 }
 
+#ifdef __linux__
+/* whether a kernel copy failed because it cannot copy between these files at all, rather than because of an I/O error */
+static int kernel_copy_unsupported(int err){
+	return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP || err == EBADF || err == EPERM || err == ETXTBSY;
+}
+#endif
+
+/* copies fd_in to fd_out without going through user space if the kernel can
+ * returns 0 if the whole file was copied, 1 if the rest has to be copied from where both offsets are now, or negative on error */
+static int copy_fd_kernel(int fd_in, int fd_out, uint64_t size, const char* _new){
+#ifdef __linux__
+	uint64_t copied = 0;
+	ssize_t n = 0;
+
+	/* procfs and the like say they are empty, so the length has to come from reading them */
+	if (size == 0){
+		return 1;
+	}
+
+#ifdef FICLONE
+	/* btrfs and XFS can share the blocks, so nothing is copied at all */
+	if (ioctl(fd_out, FICLONE, fd_in) == 0){
+		return 0;
+	}
+#endif
+
+#ifdef SYS_copy_file_range
+	/* within a filesystem this is a server-side or in-kernel copy */
+	while (copied < size && (n = syscall(SYS_copy_file_range, fd_in, NULL, fd_out, NULL, size - copied < KERNEL_COPY_LEN ? (size_t)(size - copied) : KERNEL_COPY_LEN, 0)) > 0){
+		copied += n;
+	}
+	if (n < 0 && (copied > 0 || !kernel_copy_unsupported(errno))){
+		log_error_ex2("Failed to copy to %s (%s)", _new, strerror(errno));
+		return -1;
+	}
+	if (n >= 0){
+		/* the file may have grown since it was stat()'d */
+		return 1;
+	}
+#endif
+
+	while (copied < size && (n = sendfile(fd_out, fd_in, NULL, size - copied < KERNEL_COPY_LEN ? (size_t)(size - copied) : KERNEL_COPY_LEN)) > 0){
+		copied += n;
+	}
+	if (n < 0 && (copied > 0 || !kernel_copy_unsupported(errno))){
+		log_error_ex2("Failed to copy to %s (%s)", _new, strerror(errno));
+		return -1;
+	}
+	return 1;
+#else
+	(void)fd_in;
+	(void)fd_out;
+	(void)size;
+	(void)_new;
+	return 1;
+#endif
+}
+
 int copy_file(const char* _old, const char* _new){
-	FILE* fp_old;
-	FILE* fp_new;
 	unsigned char buffer[BUFFER_LEN];
-	int len;
+	struct stat st;
+	int fd_old = -1;
+	int fd_new = -1;
+	ssize_t len;
+	int ret = 0;
 
 	return_ifnull(_old, -1);
 	return_ifnull(_new, -1);
@@ -160,37 +1230,63 @@ int copy_file(const char* _old, const char* _new){
 		return 0;
 	}
 
-	fp_old = fopen(_old, "rb");
-	if (!fp_old){
+	fd_old = open(_old, O_RDONLY);
+	if (fd_old < 0){
 		log_efopen(_old);
 		return -1;
 	}
+	if (fstat(fd_old, &st) != 0){
+		log_estat(_old);
+		close(fd_old);
+		return -1;
+	}
 
-	fp_new = fopen(_new, "wb");
-	if (!fp_new){
+	fd_new = open(_new, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd_new < 0){
 		log_efopen(_new);
-		fclose(fp_old);
+		close(fd_old);
 		return -1;
 	}
 
-	while ((len = read_file(fp_old, buffer, sizeof(buffer))) > 0){
-		fwrite(buffer, 1, len, fp_new);
-		if (ferror(fp_new)){
-			fclose(fp_old);
-			fclose(fp_new);
-			log_efwrite(_new);
-			return -1;
-		}
+	if ((ret = copy_fd_kernel(fd_old, fd_new, S_ISREG(st.st_mode) ? (uint64_t)st.st_size : 0, _new)) <= 0){
+		goto cleanup;
 	}
+	ret = 0;
 
-	fclose(fp_old);
+	/* whatever the kernel could not copy goes through a buffer */
+	while ((len = read(fd_old, buffer, sizeof(buffer))) != 0){
+		ssize_t written = 0;
 
-	if (fclose(fp_new) != 0){
-		log_efclose(_new);
-		return -1;
+		if (len < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			log_efread(_old);
+			ret = -1;
+			goto cleanup;
+		}
+		while (written < len){
+			ssize_t n = write(fd_new, buffer + written, len - written);
+
+			if (n < 0){
+				if (errno == EINTR){
+					continue;
+				}
+				log_efwrite(_new);
+				ret = -1;
+				goto cleanup;
+			}
+			written += n;
+		}
 	}
 
-	return 0;
+cleanup:
+	close(fd_old);
+	if (close(fd_new) != 0 && ret == 0){
+		log_efclose(_new);
+		ret = -1;
+	}
+	return ret;
 }
 
 int rename_file(const char* _old, const char* _new){
@@ -260,7 +1356,8 @@ int mkdir_recursive(const char* dir){
 	}
 	++i;
 	for (; i < (long)components->len; ++i){
-		if (mkdir(components->strings[i], 0755) != 0){
+		/* another thread may have created it in the meantime */
+		if (mkdir(components->strings[i], 0755) != 0 && errno != EEXIST){
 			log_error_ex2("Failed to make directory %s (%s)", components->strings[i], strerror(errno));
 			sa_free(components);
 			return -1;
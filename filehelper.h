@@ -27,6 +27,16 @@
 
 #endif
 
+#define MAP_FILE_THRESHOLD (1UL << 20) /**< Files at least this large are memory mapped by read_file_blocks() (1MB) */
+#define MAP_FILE_WINDOW (1UL << 26)    /**< How much of a file read_file_blocks() maps at once, unless read_file_set_window() says otherwise (64MB). This must be a multiple of the page size. */
+
+#define SOURCE_READ_LEN ((size_t)1 << 20)       /**< How much source_read() asks the kernel for at once, unless source_set_options() says otherwise (1MB) */
+#define SOURCE_DROP_BEHIND ((uint64_t)1 << 26)  /**< Source files at least this large have their pages dropped from the page cache as they are read, instead of once they are closed, unless source_set_drop_behind() says otherwise (64MB). */
+#define SOURCE_PREFETCH_LEN ((uint64_t)1 << 22) /**< How much of a file source_prefetch() asks the kernel to read ahead of time (4MB) */
+#define SOURCE_ALIGN ((size_t)4096)             /**< What the read size, buffers and offsets of O_DIRECT reads are a multiple of */
+#define SOURCE_URING_DEPTH (8)                  /**< How many reads backup() keeps in flight for each file it reads through io_uring */
+#define SPARSE_BLOCK_LEN ((size_t)4096)         /**< How many zeros in a row write_sparse() skips over instead of writing */
+
 /**
  * @brief Structure that holds a FILE* and filename of a temporary file.
  */
@@ -51,6 +61,59 @@ struct TMPFILE{
  */
 int read_file(FILE* fp, unsigned char* dest, size_t length);
 
+/**
+ * @brief Passes the rest of a file to a function one block at a time.<br>
+ * Regular files of at least MAP_FILE_THRESHOLD bytes are memory mapped, so each block comes straight from the page cache instead of being copied into a buffer, and the kernel is told to read ahead aggressively.<br>
+ * Anything else, or a file that cannot be mapped, is read normally in blocks of BUFFER_LEN bytes.
+ *
+ * @param fp The file to read. This must be opened in reading mode.<br>
+ * A memory mapped file is read from its start, so nothing should have been read from fp yet.
+ *
+ * @param func The function to call for each block.<br>
+ * It must return 0 to keep reading, or non-zero to stop.<br>
+ * If a mapped file shrinks while it is being read, func is interrupted wherever it happens to be, so it should not take locks or allocate memory.
+ *
+ * @param data An extra argument to pass to func.
+ *
+ * @return 0 on success, or negative if the file could not be read, it shrank while it was being read, or func returned non-zero.
+ */
+int read_file_blocks(FILE* fp, int(*func)(const void* block, size_t len, void* data), void* data);
+
+/**
+ * @brief Sets how much of a file read_file_blocks() maps at once from now on.<br>
+ * This is not thread-safe, so it should be called before any file is read.
+ *
+ * @param window How many bytes to map at once, or 0 for MAP_FILE_WINDOW.<br>
+ * It is rounded up to a multiple of the page size.
+ *
+ * @return void
+ */
+void read_file_set_window(size_t window);
+
+/**
+ * @brief Writes bytes to a file, leaving a hole wherever a whole block of them is zeros.<br>
+ * Blocks are SPARSE_BLOCK_LEN bytes, counted from data, so the filesystem's blocks are only left out if the writes are a multiple of that long.
+ *
+ * @param fp The file to write to. This must be a new file opened in writing mode, since the zeros are skipped over instead of written.
+ *
+ * @param data The bytes to write.
+ *
+ * @param len The number of bytes.
+ *
+ * @return 0 on success, or negative on failure.<br>
+ * finish_sparse() must be called once everything is written, since a file that ends in a hole is not yet that long.
+ */
+int write_sparse(FILE* fp, const void* data, size_t len);
+
+/**
+ * @brief Finishes a file written by write_sparse(), so it is as long as everything written to it.
+ *
+ * @param fp The file.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int finish_sparse(FILE* fp);
+
 /**
  * @brief Opens a temporary file.
  * @see struct TMPFILE
@@ -89,6 +152,191 @@ int temp_fflush(struct TMPFILE* tfp);
  */
 void temp_fclose(struct TMPFILE* tfp);
 
+/**
+ * @brief A file being backed up, read sequentially in large blocks.
+ * @see source_open()
+ */
+struct source_file;
+
+/**
+ * @brief Sets how source files are read from now on.<br>
+ * This is not thread-safe, so it should be called before any source file is opened.
+ *
+ * @param read_len How many bytes to ask the kernel for at once, or 0 for SOURCE_READ_LEN.<br>
+ * It is rounded up to a multiple of SOURCE_ALIGN.
+ *
+ * @param direct Non-zero to read with O_DIRECT, which bypasses the page cache entirely.<br>
+ * A filesystem that does not support it is read normally.
+ *
+ * @param uring_depth How many reads of read_len bytes to keep in flight through io_uring, or 0 (or 1) to read with one blocking read() at a time.<br>
+ * Each thread that reads source files keeps this many buffers, which are registered with the kernel so it does not have to map them for every read.<br>
+ * A kernel without io_uring, or a file that fits in one read, is read normally.
+ *
+ * @return void
+ */
+void source_set_options(size_t read_len, int direct, unsigned uring_depth);
+
+/**
+ * @brief Sets how large a source file has to be for its pages to be dropped from the page cache as it is read.<br>
+ * This applies to read_file_blocks() as well.<br>
+ * This is not thread-safe, so it should be called before any source file is opened.
+ *
+ * @param len The smallest file whose pages are dropped as it is read, or 0 for SOURCE_DROP_BEHIND.
+ *
+ * @return void
+ */
+void source_set_drop_behind(uint64_t len);
+
+/**
+ * @brief Sets a function that is told how many bytes of a source file were just read, which can hold the reader back to pace them.<br>
+ * This is not thread-safe, so it should be set before any source file is opened and cleared after the last one is closed.
+ *
+ * @param throttle The function, which is called on the thread that read them, or NULL for none.
+ *
+ * @param data An argument to pass to throttle.
+ *
+ * @return void
+ */
+void source_set_throttle(void (*throttle)(size_t len, void* data), void* data);
+
+/**
+ * @brief Opens a file that is about to be backed up.<br>
+ * The kernel is told the file will be read sequentially, so it reads ahead further, and the file is read in blocks of the size given to source_set_options().<br>
+ * If source_set_options() gave a queue depth, the next blocks are already being read through io_uring while the caller works on this one.<br>
+ * What was read is dropped from the page cache when the file is closed, or as it goes if the file is at least as large as source_set_drop_behind() says, so a backup does not evict everything else that is cached.
+ *
+ * @param path The file to open.
+ *
+ * @param offset Where to start reading.
+ *
+ * @return The opened file, or NULL on error.<br>
+ * This must be source_close()'d when no longer in use.
+ */
+struct source_file* source_open(const char* path, uint64_t offset) __attribute__((malloc));
+
+/**
+ * @brief Reads bytes from a source file.
+ *
+ * @param sf The file to read from.
+ *
+ * @param dest Where to write the bytes.
+ *
+ * @param length The most bytes to read. This must be less than INT_MAX.
+ *
+ * @return The number of bytes read, which is only less than length at the end of the file, 0 at the end of the file, or negative on error.
+ */
+int source_read(struct source_file* sf, void* dest, size_t length);
+
+/**
+ * @brief Gets how many of the bytes that the next source_read() returns are known to be zeros, because they are a hole in a sparse file.<br>
+ * A hole is read as zeros without asking the disk for it, and a file is only checked for holes if it takes up less space on disk than its size.
+ *
+ * @param sf The file.
+ *
+ * @return The number of bytes of the hole left from where the file is read next, or 0 if it is not in a hole.
+ */
+uint64_t source_hole(const struct source_file* sf);
+
+/**
+ * @brief Returns the size of a source file when it was opened.
+ *
+ * @param sf The file.
+ *
+ * @return Its size in bytes, or 0 if it is not a regular file.
+ */
+uint64_t source_size(const struct source_file* sf);
+
+/**
+ * @brief Closes a source file, and drops what was read of it from the page cache.
+ *
+ * @param sf The file to close. This can be NULL.
+ *
+ * @return void
+ */
+void source_close(struct source_file* sf);
+
+/**
+ * @brief Asks the kernel to start reading a file that is about to be backed up, without waiting for it.<br>
+ * Up to SOURCE_PREFETCH_LEN bytes from its start are read into the page cache in the background, so a small file is usually already in memory by the time it is read.<br>
+ * This does nothing if source_set_options() turned on O_DIRECT.
+ *
+ * @param path The file to prefetch.
+ *
+ * @return 0 on success, or negative if the file could not be opened.
+ */
+int source_prefetch(const char* path);
+
+/**
+ * @brief Structure that holds a file that is being written, and where it goes once it is complete.
+ * @see atomic_fopen()
+ */
+struct ATOMICFILE{
+	FILE* fp;       /**< The file's FILE*. Opened for both reading and writing. */
+	char* name;     /**< Where the file appears once atomic_fcommit() is called. */
+	char* tmp_name; /**< The file's name until then, or NULL if it does not have one. */
+};
+
+/**
+ * @brief Opens a file that only appears at its destination once it is complete.<br>
+ * Where O_TMPFILE is supported, the file is an unnamed file in the destination's directory, so nothing is left behind if the program dies before atomic_fcommit().<br>
+ * Otherwise it is a named temporary file in the same directory.<br>
+ * Either way it is on the destination's filesystem, so publishing it never copies any data.
+ * @see struct ATOMICFILE
+ *
+ * @param path Where the file goes.<br>
+ * Its directory must already exist. Anything already at this path stays there until atomic_fcommit() replaces it.
+ *
+ * @return A structure whose FILE* is ready to be written, or NULL on error.<br>
+ * This structure must be atomic_fclose()'d when no longer in use.
+ * @see atomic_fclose()
+ */
+struct ATOMICFILE* atomic_fopen(const char* path) __attribute__((malloc));
+
+/**
+ * @brief Publishes a file opened with atomic_fopen(), replacing anything at its destination in one step.<br>
+ * Another process sees either the old file or the whole new one, never part of it.<br>
+ * The data is not synced to disk, so fsync() the FILE*'s descriptor first if it has to survive a crash.
+ *
+ * @param af The file to publish.<br>
+ * It still has to be atomic_fclose()'d afterwards.
+ *
+ * @return 0 on success, or negative on failure.<br>
+ * On failure, the destination is unchanged.
+ */
+int atomic_fcommit(struct ATOMICFILE* af);
+
+/**
+ * @brief Closes a file opened with atomic_fopen() and frees all memory associated with it.<br>
+ * If it was not atomic_fcommit()'d, it is discarded.
+ *
+ * @param af The file to close.
+ *
+ * @return void
+ */
+void atomic_fclose(struct ATOMICFILE* af);
+
+/**
+ * @brief Starts writing a file's data to disk without waiting for it.<br>
+ * This makes a later sync_filesystem() shorter, since most of the data is already on its way. It does not make anything durable by itself.<br>
+ * This does nothing where the kernel cannot start writeback of one file.
+ *
+ * @param fp The file, which is flushed first.
+ *
+ * @return void
+ */
+void write_behind(FILE* fp);
+
+/**
+ * @brief Makes everything written to a filesystem so far durable, including files that are already closed and renames.<br>
+ * One call covers every file written since the last one, so it takes the place of an fsync() of each of them.<br>
+ * This syncs every filesystem where the kernel cannot sync only one.
+ *
+ * @param path Any file or directory on the filesystem.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int sync_filesystem(const char* path);
+
 /**
  * @brief Checks if a FILE* is opened for reading.
  *
@@ -6,186 +6,1036 @@
  * of the MIT license.  See the LICENSE file for details.
  */
 
+/* openat()/fstatat()/fdopendir() are POSIX.1-2008, and the DT_* constants are a BSD extension */
+#undef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+
 /* prototypes */
 #include "fileiterator.h"
 
 #include "log.h"
 /* enumerates files in directory */
 #include <dirent.h>
+/* openat */
+#include <fcntl.h>
 /* holds file permissions and checks if file is actually a directory */
 #include <sys/stat.h>
-/* strcmp/strcat */
+/* close */
+#include <unistd.h>
+/* strcmp/memcpy */
 #include <string.h>
 /* errno */
 #include <errno.h>
 /* malloc */
 #include <stdlib.h>
+/* the parallel walker's threads */
+#include <pthread.h>
+/* tp_cpu_count */
+#include "threadpool.h"
+/* lstat()s a directory's entries in batches */
+#include "statbatch.h"
+
+#ifndef O_DIRECTORY
+#define O_DIRECTORY 0
+#endif
+#ifndef O_NOFOLLOW
+#define O_NOFOLLOW 0
+#endif
 
 struct fi_stack{
 	struct directory{
 		DIR* dp;
-		char* name;
-		struct dirent* dnt;
-	}**dir_stack;
-
+		/* where this directory's entries start in path, past its trailing '/' */
+		size_t base_len;
+		/* the length of the directory's own name at the front of path */
+		size_t name_len;
+		/* entries already read and lstat()'ed together by fi_next_stat(), or NULL if there are none */
+		struct read_ahead* ahead;
+	}* dir_stack;
 	size_t dir_stack_len;
+	size_t dir_stack_size;
+
+	/* the path of the last entry returned, with every directory above it as a prefix */
+	char* path;
+	size_t path_size;
+
+	/* a terminated copy of the current directory's name for fi_directory_name() */
+	char* dir_name;
+	size_t dir_name_size;
+
+	int(*skip)(const char* path, void* data);
+	void* skip_data;
+
+	/* created by the first fi_next_stat() */
+	struct stat_batch* sb;
+
+	/* set by fi_start_sorted(), which reads each directory whole and returns its entries in order */
+	int sorted;
 };
 
-static void free_directory(struct directory* dir){
-	dir->dp ? closedir(dir->dp) : 0;
-	free(dir->name);
-	free(dir);
+/* the next entries of a directory, read before they are returned so all of their lstat()s can be in flight at once */
+struct read_ahead{
+	/* every name back to back with its '\0' */
+	char* names;
+	size_t names_len;
+	size_t names_size;
+	/* where each entry's name starts in names */
+	size_t* offsets;
+	struct stat* sts;
+	size_t len;
+	/* the next entry to return */
+	size_t pos;
+};
+
+static void read_ahead_free(struct read_ahead* ra){
+	if (!ra){
+		return;
+	}
+	free(ra->names);
+	free(ra->offsets);
+	free(ra->sts);
+	free(ra);
 }
 
-static int directory_pop(struct fi_stack* fis){
-	free_directory(fis->dir_stack[fis->dir_stack_len - 1]);
-	if (fis->dir_stack_len > 0){
-		fis->dir_stack_len--;
+/* makes room for at least len bytes in *buf, which only ever grows */
+static int buf_reserve(char** buf, size_t* size, size_t len){
+	size_t new_size;
+	char* tmp;
+
+	if (len <= *size){
+		return 0;
 	}
-	else{
-		log_info("Directory stack is empty");
+	new_size = *size ? *size : 256;
+	while (new_size < len){
+		new_size *= 2;
 	}
-	fis->dir_stack = realloc(fis->dir_stack, sizeof(*fis->dir_stack) * fis->dir_stack_len);
-	if (!fis->dir_stack && fis->dir_stack_len > 0){
+	tmp = realloc(*buf, new_size);
+	if (!tmp){
 		log_enomem();
 		return -1;
 	}
+	*buf = tmp;
+	*size = new_size;
 	return 0;
 }
 
-static int directory_push(const char* dir, struct fi_stack* fis){
-	fis->dir_stack_len++;
-	fis->dir_stack = realloc(fis->dir_stack, sizeof(*fis->dir_stack) * fis->dir_stack_len);
-	if (!fis->dir_stack){
-		log_enomem();
+/* points dir_name at the directory now on top of the stack */
+static int update_dir_name(struct fi_stack* fis){
+	struct directory* dir;
+
+	if (fis->dir_stack_len == 0){
+		return 0;
+	}
+	dir = &fis->dir_stack[fis->dir_stack_len - 1];
+	if (buf_reserve(&fis->dir_name, &fis->dir_name_size, dir->name_len + 1) != 0){
 		return -1;
 	}
+	memcpy(fis->dir_name, fis->path, dir->name_len);
+	fis->dir_name[dir->name_len] = '\0';
+	return 0;
+}
 
-	fis->dir_stack[fis->dir_stack_len - 1] = calloc(1, sizeof(**fis->dir_stack));
-	if (!fis->dir_stack[fis->dir_stack_len - 1]){
-		log_enomem();
-		return -1;
+static int directory_pop(struct fi_stack* fis){
+	if (fis->dir_stack_len == 0){
+		log_info("Directory stack is empty");
+		return 0;
 	}
+	closedir(fis->dir_stack[fis->dir_stack_len - 1].dp);
+	read_ahead_free(fis->dir_stack[fis->dir_stack_len - 1].ahead);
+	fis->dir_stack_len--;
+	return update_dir_name(fis);
+}
 
-	fis->dir_stack[fis->dir_stack_len - 1]->dp = opendir(dir);
-	if (!fis->dir_stack[fis->dir_stack_len - 1]->dp){
-		log_warning_ex2("Failed to open %s (%s)", dir, strerror(errno));
-		if (directory_pop(fis) != 0){
-			log_error("Failed to pop failed directory off stack");
+/* pushes the directory whose path is the first name_len bytes of fis->path, which must have room for 2 more
+ * name is its name within parent_fd, or parent_fd is -1 to open it by path */
+static int directory_push(struct fi_stack* fis, int parent_fd, const char* name, size_t name_len){
+	struct directory* dir;
+	size_t base_len = name_len;
+	int fd;
+
+	if (fis->dir_stack_len >= fis->dir_stack_size){
+		size_t new_size = fis->dir_stack_size ? fis->dir_stack_size * 2 : 16;
+		struct directory* tmp = realloc(fis->dir_stack, sizeof(*fis->dir_stack) * new_size);
+
+		if (!tmp){
+			log_enomem();
+			return -1;
 		}
-		return -1;
+		fis->dir_stack = tmp;
+		fis->dir_stack_size = new_size;
 	}
 
-	fis->dir_stack[fis->dir_stack_len - 1]->name = malloc(strlen(dir) + 1);
-	if (!fis->dir_stack[fis->dir_stack_len - 1]->name){
-		log_error_ex("Failed to allocate space for directory name (%s)", dir);
-		if (directory_pop(fis) != 0){
-			log_error("Failed to pop failed directory off stack");
-		}
+	/* relative to the parent, so the kernel does not walk the whole path again for each directory */
+	fd = parent_fd >= 0 ? openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW) : open(fis->path, O_RDONLY | O_DIRECTORY);
+	dir = &fis->dir_stack[fis->dir_stack_len];
+	if (fd < 0 || !(dir->dp = fdopendir(fd))){
+		fis->path[name_len] = '\0';
+		log_warning_ex2("Failed to open %s (%s)", fis->path, strerror(errno));
+		fd >= 0 ? close(fd) : 0;
 		return -1;
 	}
-	strcpy(fis->dir_stack[fis->dir_stack_len - 1]->name, dir);
 
-	fis->dir_stack[fis->dir_stack_len - 1]->dnt = NULL;
-	return 0;
+	/* the caller already made room for the '/' */
+	if (name_len == 0 || fis->path[name_len - 1] != '/'){
+		fis->path[base_len++] = '/';
+	}
+	dir->base_len = base_len;
+	dir->name_len = name_len;
+	dir->ahead = NULL;
+	fis->dir_stack_len++;
+	return update_dir_name(fis);
 }
 
-static struct directory* directory_peek(const struct fi_stack* fis){
-	if (!fis->dir_stack){
-		return NULL;
+/* lstat()s an entry relative to its directory, leaving st_mode 0 if that fails */
+static void entry_stat(DIR* dp, const struct dirent* dnt, struct stat* st){
+	if (fstatat(dirfd(dp), dnt->d_name, st, AT_SYMLINK_NOFOLLOW) != 0){
+		memset(st, 0, sizeof(*st));
 	}
-	return fis->dir_stack[fis->dir_stack_len - 1];
+}
+
+/* whether an entry is a directory, without following symlinks */
+static int entry_is_dir(DIR* dp, const struct dirent* dnt){
+	struct stat st;
+
+#if defined(DT_DIR) && defined(DT_UNKNOWN)
+	/* most filesystems say what an entry is without needing a stat */
+	if (dnt->d_type != DT_UNKNOWN){
+		return dnt->d_type == DT_DIR;
+	}
+#endif
+	entry_stat(dp, dnt, &st);
+	return S_ISDIR(st.st_mode);
 }
 
 struct fi_stack* fi_start(const char* dir){
+	return fi_start_ex(dir, NULL, NULL);
+}
+
+struct fi_stack* fi_start_sorted(const char* dir, int(*skip)(const char* path, void* data), void* skip_data){
+	struct fi_stack* fis = fi_start_ex(dir, skip, skip_data);
+
+	if (fis){
+		fis->sorted = 1;
+	}
+	return fis;
+}
+
+struct fi_stack* fi_start_ex(const char* dir, int(*skip)(const char* path, void* data), void* skip_data){
 	struct fi_stack* fis = NULL;
+	size_t len;
+
+	return_ifnull(dir, NULL);
 
 	fis = calloc(1, sizeof(*fis));
 	if (!fis){
 		log_enomem();
 		return NULL;
 	}
+	fis->skip = skip;
+	fis->skip_data = skip_data;
 
-	if (directory_push(dir, fis) != 0){
+	len = strlen(dir);
+	if (buf_reserve(&fis->path, &fis->path_size, len + 2) != 0){
+		fi_end(fis);
+		return NULL;
+	}
+	memcpy(fis->path, dir, len + 1);
+
+	if (directory_push(fis, -1, fis->path, len) != 0){
 		log_error("Failed to initialize fi_stack");
-		free(fis);
+		fi_end(fis);
 		return NULL;
 	}
 
 	return fis;
 }
 
-char* fi_next(struct fi_stack* fis){
-	char* path = NULL;
-	struct directory* dir = NULL;
-	struct stat st;
+/* puts an entry's name after its directory's path, returning its length or -1 on failure */
+static long entry_path(struct fi_stack* fis, const struct directory* dir, const char* name){
+	size_t name_len = strlen(name);
 
-	dir = directory_peek(fis);
-	if (!dir){
-		log_info("Directory stack is empty");
-		return NULL;
+	/* +2: '/' and '\0', in case it turns out to be a directory */
+	if (buf_reserve(&fis->path, &fis->path_size, dir->base_len + name_len + 2) != 0){
+		return -1;
 	}
+	memcpy(fis->path + dir->base_len, name, name_len + 1);
+	return (long)name_len;
+}
 
-	dir->dnt = readdir(dir->dp);
-	if (!dir->dnt){
-		log_info_ex("Out of directory entries in %s", dir->name);
-		directory_pop(fis);
-		return fi_next(fis);
+/* reads up to a batch of the top directory's entries and lstat()s them together
+ * returns 0 on success, 1 if the directory has no entries left, or negative on failure */
+static int read_ahead_fill(struct fi_stack* fis){
+	struct directory* dir = &fis->dir_stack[fis->dir_stack_len - 1];
+	struct read_ahead* ra = dir->ahead;
+	size_t depth = stat_batch_depth(fis->sb);
+	struct dirent* dnt;
+	size_t i;
+
+	if (!ra){
+		ra = calloc(1, sizeof(*ra));
+		if (!ra || !(ra->offsets = malloc(depth * sizeof(*ra->offsets))) || !(ra->sts = malloc(depth * sizeof(*ra->sts)))){
+			log_enomem();
+			read_ahead_free(ra);
+			return -1;
+		}
+		dir->ahead = ra;
 	}
+	ra->names_len = 0;
+	ra->len = 0;
+	ra->pos = 0;
 
-	if (!strcmp(dir->dnt->d_name, ".") || !strcmp(dir->dnt->d_name, "..")){
-		return fi_next(fis);
+	while (ra->len < depth && (dnt = readdir(dir->dp)) != NULL){
+		size_t name_len;
+
+		if (!strcmp(dnt->d_name, ".") || !strcmp(dnt->d_name, "..")){
+			continue;
+		}
+		if (entry_path(fis, dir, dnt->d_name) < 0){
+			return -1;
+		}
+		/* an excluded entry is never lstat()'ed */
+		if (fis->skip && fis->skip(fis->path, fis->skip_data)){
+			continue;
+		}
+		name_len = strlen(dnt->d_name);
+		if (buf_reserve(&ra->names, &ra->names_size, ra->names_len + name_len + 1) != 0){
+			return -1;
+		}
+		memcpy(ra->names + ra->names_len, dnt->d_name, name_len + 1);
+		ra->offsets[ra->len] = ra->names_len;
+		ra->names_len += name_len + 1;
+		ra->len++;
+	}
+	if (ra->len == 0){
+		return 1;
 	}
 
-	/* generate path to directory */
-	/* +3: +1 for each '\0', +1 for '/' */
-	path = malloc(strlen(dir->name) + strlen(dir->dnt->d_name) + 3);
-	if (!path){
+	/* names does not move once every name is in it */
+	for (i = 0; i < ra->len; ++i){
+		stat_batch_add(fis->sb, dirfd(dir->dp), ra->names + ra->offsets[i]);
+	}
+	if (stat_batch_run(fis->sb) != 0){
+		stat_batch_reset(fis->sb);
+		return -1;
+	}
+	for (i = 0; i < ra->len; ++i){
+		/* st_mode is left 0 on failure, like entry_stat() */
+		stat_batch_result(fis->sb, i, &ra->sts[i]);
+	}
+	stat_batch_reset(fis->sb);
+	return 0;
+}
+
+/* an entry of a directory being sorted */
+struct sorted_entry{
+	const char* name;
+	int is_dir;
+	/* where it was in the read_ahead */
+	size_t index;
+};
+
+/* the order strcmp() puts the entries' paths in
+ * a directory compares as if its name ended in '/', since every path under it does */
+static int sorted_entry_cmp(const void* p1, const void* p2){
+	const struct sorted_entry* e1 = p1;
+	const struct sorted_entry* e2 = p2;
+	const unsigned char* n1 = (const unsigned char*)e1->name;
+	const unsigned char* n2 = (const unsigned char*)e2->name;
+	int c1;
+	int c2;
+
+	while (*n1 && *n1 == *n2){
+		n1++;
+		n2++;
+	}
+	c1 = *n1 ? *n1 : e1->is_dir ? '/' : '\0';
+	c2 = *n2 ? *n2 : e2->is_dir ? '/' : '\0';
+	return c1 - c2;
+}
+
+/* lstat()s every entry in the read_ahead, a batch at a time */
+static int read_sorted_stat(struct fi_stack* fis, DIR* dp, struct read_ahead* ra){
+	size_t depth = stat_batch_depth(fis->sb);
+	size_t i;
+	size_t j;
+
+	for (i = 0; i < ra->len; i += depth){
+		size_t n = ra->len - i < depth ? ra->len - i : depth;
+
+		for (j = 0; j < n; ++j){
+			stat_batch_add(fis->sb, dirfd(dp), ra->names + ra->offsets[i + j]);
+		}
+		if (stat_batch_run(fis->sb) != 0){
+			stat_batch_reset(fis->sb);
+			return -1;
+		}
+		for (j = 0; j < n; ++j){
+			stat_batch_result(fis->sb, j, &ra->sts[i + j]);
+		}
+		stat_batch_reset(fis->sb);
+	}
+	return 0;
+}
+
+/* puts the entries in the read_ahead in sorted_entry_cmp() order */
+static int read_sorted_order(struct read_ahead* ra){
+	struct sorted_entry* se = NULL;
+	size_t* offsets = NULL;
+	struct stat* sts = NULL;
+	size_t i;
+
+	if (ra->len < 2){
+		return 0;
+	}
+	if (!(se = malloc(ra->len * sizeof(*se))) || !(offsets = malloc(ra->len * sizeof(*offsets))) || !(sts = malloc(ra->len * sizeof(*sts)))){
 		log_enomem();
-		return NULL;
+		free(se);
+		free(offsets);
+		return -1;
+	}
+	for (i = 0; i < ra->len; ++i){
+		se[i].name = ra->names + ra->offsets[i];
+		se[i].is_dir = S_ISDIR(ra->sts[i].st_mode);
+		se[i].index = i;
+	}
+	qsort(se, ra->len, sizeof(*se), sorted_entry_cmp);
+	for (i = 0; i < ra->len; ++i){
+		offsets[i] = ra->offsets[se[i].index];
+		sts[i] = ra->sts[se[i].index];
+	}
+	free(ra->offsets);
+	free(ra->sts);
+	ra->offsets = offsets;
+	ra->sts = sts;
+	free(se);
+	return 0;
+}
+
+/* reads all of the top directory's entries into its read_ahead, in the order fi_start_sorted() returns them
+ * without want_stat, an entry's st_mode only says whether it is a directory */
+static int read_sorted(struct fi_stack* fis, int want_stat){
+	struct directory* dir = &fis->dir_stack[fis->dir_stack_len - 1];
+	struct read_ahead* ra;
+	size_t size = 0;
+	struct dirent* dnt;
+
+	if (!(ra = calloc(1, sizeof(*ra)))){
+		log_enomem();
+		return -1;
+	}
+	dir->ahead = ra;
+
+	while ((dnt = readdir(dir->dp)) != NULL){
+		size_t name_len;
+
+		if (!strcmp(dnt->d_name, ".") || !strcmp(dnt->d_name, "..")){
+			continue;
+		}
+		if (entry_path(fis, dir, dnt->d_name) < 0){
+			return -1;
+		}
+		if (fis->skip && fis->skip(fis->path, fis->skip_data)){
+			continue;
+		}
+		if (ra->len == size){
+			size_t new_size = size ? size * 2 : 64;
+			size_t* tmp_offsets;
+			struct stat* tmp_sts;
+
+			if (!(tmp_offsets = realloc(ra->offsets, new_size * sizeof(*ra->offsets)))){
+				log_enomem();
+				return -1;
+			}
+			ra->offsets = tmp_offsets;
+			if (!(tmp_sts = realloc(ra->sts, new_size * sizeof(*ra->sts)))){
+				log_enomem();
+				return -1;
+			}
+			ra->sts = tmp_sts;
+			size = new_size;
+		}
+		name_len = strlen(dnt->d_name);
+		if (buf_reserve(&ra->names, &ra->names_size, ra->names_len + name_len + 1) != 0){
+			return -1;
+		}
+		memcpy(ra->names + ra->names_len, dnt->d_name, name_len + 1);
+		ra->offsets[ra->len] = ra->names_len;
+		ra->names_len += name_len + 1;
+
+		if (want_stat && !fis->sb){
+			entry_stat(dir->dp, dnt, &ra->sts[ra->len]);
+		}
+		else if (!want_stat){
+			memset(&ra->sts[ra->len], 0, sizeof(ra->sts[ra->len]));
+			ra->sts[ra->len].st_mode = entry_is_dir(dir->dp, dnt) ? S_IFDIR : S_IFREG;
+		}
+		ra->len++;
 	}
-	strcpy(path, dir->name);
-	/* append filename */
-	if (path[strlen(path) - 1] != '/'){
-		strcat(path, "/");
+
+	if (want_stat && fis->sb && read_sorted_stat(fis, dir->dp, ra) != 0){
+		return -1;
+	}
+	return read_sorted_order(ra);
+}
+
+/* fills st for the file returned if it is not NULL */
+static const char* next_entry(struct fi_stack* fis, struct stat* st){
+
+	while (fis->dir_stack_len > 0){
+		struct directory* dir = &fis->dir_stack[fis->dir_stack_len - 1];
+		struct read_ahead* ra = dir->ahead;
+		struct dirent* dnt;
+		long name_len;
+
+		/* what was read ahead comes first, even if stats are no longer wanted */
+		if (ra && ra->pos < ra->len){
+			const char* name = ra->names + ra->offsets[ra->pos];
+			const struct stat* ra_st = &ra->sts[ra->pos];
+
+			ra->pos++;
+			if ((name_len = entry_path(fis, dir, name)) < 0){
+				return NULL;
+			}
+			if (S_ISDIR(ra_st->st_mode)){
+				directory_push(fis, dirfd(dir->dp), name, dir->base_len + name_len);
+				continue;
+			}
+			if (st){
+				*st = *ra_st;
+			}
+			return fis->path;
+		}
+
+		/* everything was read the first time, so a read_ahead that is used up means the directory is done */
+		if (fis->sorted){
+			if (ra){
+				log_info_ex("Out of directory entries in %s", fis->dir_name);
+				directory_pop(fis);
+			}
+			else if (read_sorted(fis, st != NULL) != 0){
+				return NULL;
+			}
+			continue;
+		}
+
+		if (st && fis->sb){
+			int res = read_ahead_fill(fis);
+
+			if (res < 0){
+				return NULL;
+			}
+			if (res > 0){
+				log_info_ex("Out of directory entries in %s", fis->dir_name);
+				directory_pop(fis);
+			}
+			continue;
+		}
+
+		dnt = readdir(dir->dp);
+		if (!dnt){
+			log_info_ex("Out of directory entries in %s", fis->dir_name);
+			directory_pop(fis);
+			continue;
+		}
+
+		if (!strcmp(dnt->d_name, ".") || !strcmp(dnt->d_name, "..")){
+			continue;
+		}
+
+		if ((name_len = entry_path(fis, dir, dnt->d_name)) < 0){
+			return NULL;
+		}
+
+		/* checked before a directory is opened, so an excluded tree costs nothing past its own entry */
+		if (fis->skip && fis->skip(fis->path, fis->skip_data)){
+			continue;
+		}
+
+		if (entry_is_dir(dir->dp, dnt)){
+			/* a directory that cannot be opened is skipped, like it always was */
+			directory_push(fis, dirfd(dir->dp), dnt->d_name, dir->base_len + name_len);
+			continue;
+		}
+
+		if (st){
+			entry_stat(dir->dp, dnt, st);
+		}
+		return fis->path;
 	}
-	strcat(path, dir->dnt->d_name);
 
-	/* lstat does not follow symlinks unlike stat */
-	/* XOPEN extension */
-	lstat(path, &st);
-	/* check if file is actually a directory */
-	if (S_ISDIR(st.st_mode)){
-		/* if so, recursively enum files on that dir */
-		directory_push(path, fis);
-		free(path);
-		return fi_next(fis);
+	log_info("Directory stack is empty");
+	return NULL;
+}
+
+const char* fi_next_path(struct fi_stack* fis){
+	return_ifnull(fis, NULL);
+	return next_entry(fis, NULL);
+}
+
+const char* fi_next_stat(struct fi_stack* fis, struct stat* st){
+	return_ifnull(fis, NULL);
+	return_ifnull(st, NULL);
+	/* without a batch, every entry is lstat()'ed as it is read */
+	if (!fis->sb){
+		fis->sb = stat_batch_new(0);
 	}
+	return next_entry(fis, st);
+}
 
-	return path;
+char* fi_next(struct fi_stack* fis){
+	const char* path;
+	char* ret;
+
+	path = fi_next_path(fis);
+	if (!path){
+		return NULL;
+	}
+	ret = malloc(strlen(path) + 1);
+	if (!ret){
+		log_enomem();
+		return NULL;
+	}
+	strcpy(ret, path);
+	return ret;
 }
 
 int fi_skip_current_dir(struct fi_stack* fis){
-	log_info_ex("Skipping current dir (%s)", directory_peek(fis)->name);
+	return_ifnull(fis, -1);
+	log_info_ex("Skipping current dir (%s)", fis->dir_stack_len > 0 ? fis->dir_name : "");
 	return directory_pop(fis);
 }
 
 const char* fi_directory_name(const struct fi_stack* fis){
-	return fis && fis->dir_stack_len > 0 ? directory_peek(fis)->name : NULL;
+	return fis && fis->dir_stack_len > 0 ? fis->dir_name : NULL;
 }
 
-void fi_end(struct fi_stack* fis){
+/* a stack of directories only its own thread pushes to, which the others steal from the bottom of
+ * the owner takes the newest directory so its path is still cached, and a thief takes the oldest since it has the most underneath it */
+struct walk_deque{
+	char** dirs;
+	size_t start;
+	size_t len;
+	size_t size;
+	pthread_mutex_t lock;
+};
+
+/* a file found by the walker threads, with the lstat() they already did on it */
+struct walk_entry{
+	char* path;
+	struct stat st;
+};
+
+struct fi_walk{
+	struct walk_worker{
+		struct fi_walk* fw;
+		struct walk_deque dq;
+		pthread_t thread;
+		size_t index;
+	}* workers;
+	size_t n_workers;
+	/* how many of the workers have a thread to join */
+	size_t n_started;
+
+	int(*skip)(const char* path, void* data);
+	void* skip_data;
+
+	/* guards pending and queued, and work is signaled when either changes */
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	/* directories waiting in a deque or being read; the walk is over when this reaches 0 */
+	size_t pending;
+	/* directories waiting in a deque */
+	size_t queued;
+	/* set under both locks, so either one is enough to read it */
+	int stop;
+
+	/* the files found so far, waiting for fi_walk_next() */
+	struct walk_entry* queue;
+	size_t queue_size;
+	size_t queue_head;
+	size_t queue_len;
+	int queue_done;
+	pthread_mutex_t queue_lock;
+	pthread_cond_t queue_not_empty;
+	pthread_cond_t queue_not_full;
+};
+
+static int deque_push(struct walk_deque* dq, char* dir){
+	int ret = 0;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->len >= dq->size && dq->start > 0){
+		memmove(dq->dirs, dq->dirs + dq->start, (dq->len - dq->start) * sizeof(*dq->dirs));
+		dq->len -= dq->start;
+		dq->start = 0;
+	}
+	if (dq->len >= dq->size){
+		size_t new_size = dq->size ? dq->size * 2 : 64;
+		char** tmp = realloc(dq->dirs, new_size * sizeof(*dq->dirs));
+
+		if (!tmp){
+			log_enomem();
+			ret = -1;
+			goto cleanup;
+		}
+		dq->dirs = tmp;
+		dq->size = new_size;
+	}
+	dq->dirs[dq->len++] = dir;
+
+cleanup:
+	pthread_mutex_unlock(&dq->lock);
+	return ret;
+}
+
+/* takes the newest directory if steal is 0, or the oldest if it is not */
+static char* deque_take(struct walk_deque* dq, int steal){
+	char* ret = NULL;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->len > dq->start){
+		ret = steal ? dq->dirs[dq->start++] : dq->dirs[--dq->len];
+		if (dq->len == dq->start){
+			dq->start = dq->len = 0;
+		}
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return ret;
+}
+
+/* hands a directory to ww, or to the first worker if ww is NULL */
+static void walk_push_dir(struct fi_walk* fw, struct walk_worker* ww, char* dir){
+	pthread_mutex_lock(&fw->lock);
+	/* counted before it can be taken, so the walk cannot look finished in between */
+	fw->pending++;
+	fw->queued++;
+	pthread_cond_signal(&fw->work);
+	pthread_mutex_unlock(&fw->lock);
+
+	if (deque_push(ww ? &ww->dq : &fw->workers[0].dq, dir) != 0){
+		log_warning_ex("Failed to queue %s. It will not be walked.", dir);
+		free(dir);
+		pthread_mutex_lock(&fw->lock);
+		fw->pending--;
+		fw->queued--;
+		pthread_mutex_unlock(&fw->lock);
+	}
+}
+
+/* the next directory for ww to read, or NULL once the walk is over */
+static char* walk_take_dir(struct walk_worker* ww){
+	struct fi_walk* fw = ww->fw;
+
+	for (;;){
+		char* dir;
+		size_t i;
+
+		dir = deque_take(&ww->dq, 0);
+		for (i = 1; !dir && i < fw->n_workers; ++i){
+			dir = deque_take(&fw->workers[(ww->index + i) % fw->n_workers].dq, 1);
+		}
+
+		pthread_mutex_lock(&fw->lock);
+		if (dir){
+			fw->queued--;
+			pthread_mutex_unlock(&fw->lock);
+			return dir;
+		}
+		if (fw->stop || fw->pending == 0){
+			pthread_mutex_unlock(&fw->lock);
+			return NULL;
+		}
+		/* queued can be ahead of the deques for a moment, in which case this just looks again */
+		if (fw->queued == 0){
+			pthread_cond_wait(&fw->work, &fw->lock);
+		}
+		pthread_mutex_unlock(&fw->lock);
+	}
+}
+
+static void walk_dir_done(struct fi_walk* fw){
+	int done;
+
+	pthread_mutex_lock(&fw->lock);
+	done = --fw->pending == 0;
+	if (done){
+		pthread_cond_broadcast(&fw->work);
+	}
+	pthread_mutex_unlock(&fw->lock);
+
+	if (done){
+		pthread_mutex_lock(&fw->queue_lock);
+		fw->queue_done = 1;
+		pthread_cond_broadcast(&fw->queue_not_empty);
+		pthread_mutex_unlock(&fw->queue_lock);
+	}
+}
+
+/* waits for room in the queue, and returns negative if the walk was stopped instead */
+static int walk_emit(struct fi_walk* fw, char* file, const struct stat* st){
+	struct walk_entry* entry;
+
+	pthread_mutex_lock(&fw->queue_lock);
+	while (fw->queue_len >= fw->queue_size && !fw->stop){
+		pthread_cond_wait(&fw->queue_not_full, &fw->queue_lock);
+	}
+	if (fw->stop){
+		pthread_mutex_unlock(&fw->queue_lock);
+		free(file);
+		return -1;
+	}
+	entry = &fw->queue[(fw->queue_head + fw->queue_len++) % fw->queue_size];
+	entry->path = file;
+	entry->st = *st;
+	pthread_cond_signal(&fw->queue_not_empty);
+	pthread_mutex_unlock(&fw->queue_lock);
+	return 0;
+}
+
+/* reads one directory, queueing its subdirectories on ww and its files for fi_walk_next()
+ * files are lstat()ed here so fi_walk_next_stat() gets that for free, and so those calls are spread over the walker threads too
+ * *path is a buffer kept between calls so entries do not each need their own */
+static void walk_read_dir(struct walk_worker* ww, const char* dir, char** path, size_t* path_size){
+	struct fi_walk* fw = ww->fw;
+	struct dirent* dnt;
+	size_t base_len = strlen(dir);
+	DIR* dp;
+
+	dp = opendir(dir);
+	if (!dp){
+		log_warning_ex2("Failed to open %s (%s)", dir, strerror(errno));
+		return;
+	}
+	if (buf_reserve(path, path_size, base_len + 2) != 0){
+		closedir(dp);
+		return;
+	}
+	memcpy(*path, dir, base_len);
+	if (base_len == 0 || dir[base_len - 1] != '/'){
+		(*path)[base_len++] = '/';
+	}
+
+	while ((dnt = readdir(dp)) != NULL){
+		size_t name_len;
+		char* entry;
+		int is_dir;
+
+		if (!strcmp(dnt->d_name, ".") || !strcmp(dnt->d_name, "..")){
+			continue;
+		}
+		name_len = strlen(dnt->d_name);
+		if (buf_reserve(path, path_size, base_len + name_len + 1) != 0){
+			break;
+		}
+		memcpy(*path + base_len, dnt->d_name, name_len + 1);
+
+		is_dir = entry_is_dir(dp, dnt);
+		if (fw->skip && fw->skip(*path, fw->skip_data)){
+			continue;
+		}
+
+		entry = malloc(base_len + name_len + 1);
+		if (!entry){
+			log_enomem();
+			break;
+		}
+		memcpy(entry, *path, base_len + name_len + 1);
+
+		if (is_dir){
+			walk_push_dir(fw, ww, entry);
+		}
+		else{
+			struct stat st;
+
+			entry_stat(dp, dnt, &st);
+			if (walk_emit(fw, entry, &st) != 0){
+				break;
+			}
+		}
+	}
+
+	closedir(dp);
+}
+
+static void* walk_thread(void* arg){
+	struct walk_worker* ww = arg;
+	char* path = NULL;
+	size_t path_size = 0;
+	char* dir;
+
+	while ((dir = walk_take_dir(ww)) != NULL){
+		walk_read_dir(ww, dir, &path, &path_size);
+		free(dir);
+		walk_dir_done(ww->fw);
+	}
+
+	free(path);
+	return NULL;
+}
+
+struct fi_walk* fi_walk_start(const char* dir, size_t n_threads, size_t queue_len, int(*skip)(const char* path, void* data), void* skip_data){
+	struct fi_walk* fw = NULL;
+	char* root = NULL;
+	DIR* dp;
 	size_t i;
-	if (!fis){
+	int res;
+
+	return_ifnull(dir, NULL);
+
+	/* fails the same way fi_start() does if the directory cannot be read */
+	dp = opendir(dir);
+	if (!dp){
+		log_warning_ex2("Failed to open %s (%s)", dir, strerror(errno));
+		return NULL;
+	}
+	closedir(dp);
+
+	if (n_threads == 0){
+		n_threads = tp_cpu_count() * FI_WALK_THREADS_PER_CPU;
+	}
+	if (queue_len == 0){
+		queue_len = FI_WALK_QUEUE_LEN;
+	}
+
+	fw = calloc(1, sizeof(*fw));
+	if (!fw || !(fw->workers = calloc(n_threads, sizeof(*fw->workers))) || !(fw->queue = malloc(queue_len * sizeof(*fw->queue))) || !(root = malloc(strlen(dir) + 1))){
+		log_enomem();
+		if (fw){
+			free(fw->workers);
+			free(fw->queue);
+		}
+		free(fw);
+		free(root);
+		return NULL;
+	}
+	strcpy(root, dir);
+	fw->n_workers = n_threads;
+	fw->queue_size = queue_len;
+	fw->skip = skip;
+	fw->skip_data = skip_data;
+	pthread_mutex_init(&fw->lock, NULL);
+	pthread_cond_init(&fw->work, NULL);
+	pthread_mutex_init(&fw->queue_lock, NULL);
+	pthread_cond_init(&fw->queue_not_empty, NULL);
+	pthread_cond_init(&fw->queue_not_full, NULL);
+	for (i = 0; i < n_threads; ++i){
+		fw->workers[i].fw = fw;
+		fw->workers[i].index = i;
+		pthread_mutex_init(&fw->workers[i].dq.lock, NULL);
+	}
+
+	walk_push_dir(fw, NULL, root);
+
+	for (i = 0; i < n_threads; ++i){
+		if ((res = pthread_create(&fw->workers[i].thread, NULL, walk_thread, &fw->workers[i])) != 0){
+			log_error_ex("Failed to start walker thread (%s)", strerror(res));
+			break;
+		}
+		fw->n_started++;
+	}
+	/* a worker that never started has an empty deque, so the others simply never find anything to steal from it
+	 * the root is in the first worker's deque, so the walk still covers everything as long as that one started */
+	if (fw->n_started == 0){
+		fi_walk_end(fw);
+		return NULL;
+	}
+
+	return fw;
+}
+
+/* fills st for the file returned if it is not NULL */
+static char* walk_next_entry(struct fi_walk* fw, struct stat* st){
+	struct walk_entry* entry;
+	char* ret;
+
+	pthread_mutex_lock(&fw->queue_lock);
+	while (fw->queue_len == 0 && !fw->queue_done){
+		pthread_cond_wait(&fw->queue_not_empty, &fw->queue_lock);
+	}
+	if (fw->queue_len == 0){
+		pthread_mutex_unlock(&fw->queue_lock);
+		return NULL;
+	}
+	entry = &fw->queue[fw->queue_head];
+	ret = entry->path;
+	if (st){
+		*st = entry->st;
+	}
+	fw->queue_head = (fw->queue_head + 1) % fw->queue_size;
+	fw->queue_len--;
+	pthread_cond_signal(&fw->queue_not_full);
+	pthread_mutex_unlock(&fw->queue_lock);
+
+	return ret;
+}
+
+char* fi_walk_next(struct fi_walk* fw){
+	return_ifnull(fw, NULL);
+	return walk_next_entry(fw, NULL);
+}
+
+char* fi_walk_next_stat(struct fi_walk* fw, struct stat* st){
+	return_ifnull(fw, NULL);
+	return_ifnull(st, NULL);
+	return walk_next_entry(fw, st);
+}
+
+void fi_walk_end(struct fi_walk* fw){
+	size_t i;
+
+	if (!fw){
 		return;
 	}
-	if (!fis->dir_stack){
-		free(fis);
+
+	pthread_mutex_lock(&fw->lock);
+	pthread_mutex_lock(&fw->queue_lock);
+	fw->stop = 1;
+	pthread_cond_broadcast(&fw->work);
+	pthread_cond_broadcast(&fw->queue_not_full);
+	pthread_mutex_unlock(&fw->queue_lock);
+	pthread_mutex_unlock(&fw->lock);
+
+	for (i = 0; i < fw->n_started; ++i){
+		pthread_join(fw->workers[i].thread, NULL);
+	}
+
+	/* anything a stopped walk left behind */
+	for (i = 0; i < fw->queue_len; ++i){
+		free(fw->queue[(fw->queue_head + i) % fw->queue_size].path);
+	}
+	for (i = 0; i < fw->n_workers; ++i){
+		size_t j;
+
+		for (j = fw->workers[i].dq.start; j < fw->workers[i].dq.len; ++j){
+			free(fw->workers[i].dq.dirs[j]);
+		}
+		free(fw->workers[i].dq.dirs);
+		pthread_mutex_destroy(&fw->workers[i].dq.lock);
+	}
+
+	pthread_mutex_destroy(&fw->lock);
+	pthread_cond_destroy(&fw->work);
+	pthread_mutex_destroy(&fw->queue_lock);
+	pthread_cond_destroy(&fw->queue_not_empty);
+	pthread_cond_destroy(&fw->queue_not_full);
+	free(fw->workers);
+	free(fw->queue);
+	free(fw);
+}
+
+void fi_end(struct fi_stack* fis){
+	size_t i;
+	if (!fis){
 		return;
 	}
 	for (i = 0; i < fis->dir_stack_len; ++i){
-		free_directory(fis->dir_stack[i]);
+		closedir(fis->dir_stack[i].dp);
+		read_ahead_free(fis->dir_stack[i].ahead);
 	}
 	free(fis->dir_stack);
+	stat_batch_free(fis->sb);
+	free(fis->path);
+	free(fis->dir_name);
 	free(fis);
 }
@@ -9,6 +9,9 @@
 #ifndef __FILE_ITERATOR_H
 #define __FILE_ITERATOR_H
 
+#include <stddef.h>
+#include <sys/stat.h>
+
 #ifndef __GNUC__
 #define __attribute__(x)
 #endif
@@ -26,13 +29,80 @@
  */
 struct fi_stack* fi_start(const char* dir) __attribute__((malloc));
 
+/**
+ * @brief Starts iterating through files in a directory, leaving out the paths that skip says to.<br>
+ * This is fi_start(), except each entry is checked before it is returned or, if it is a directory, before it is opened, so a skipped directory costs no system calls at all.
+ *
+ * @param dir The directory to start iterating in.
+ *
+ * @param skip A function that returns non-zero for a path that should not be returned or, if it is a directory, descended into.<br>
+ * This can be NULL, in which case nothing is skipped.
+ * @see exclude_skip()
+ *
+ * @param skip_data The data to pass to skip.
+ *
+ * @return A structure needed for the other fileiterator functions.<br>
+ * This structure must be freed with fi_end() when no longer needed.
+ * @see fi_start()
+ */
+struct fi_stack* fi_start_ex(const char* dir, int(*skip)(const char* path, void* data), void* skip_data) __attribute__((malloc));
+
+/**
+ * @brief Starts iterating through files in a directory like fi_start_ex(), returning them in the order strcmp() sorts their paths in.<br>
+ * Each directory is read whole the first time the walk gets to it and sorted before any of its entries are returned, so the names of one directory per level of the tree are held in memory at once.<br>
+ * Since this is the order checksum files are sorted in, a list built from the walk is already sorted. @see sort_checksum_file()
+ *
+ * @param dir The directory to start iterating in.
+ *
+ * @param skip A function that returns non-zero for a path that should not be returned or, if it is a directory, descended into.<br>
+ * This can be NULL, in which case nothing is skipped.
+ *
+ * @param skip_data The data to pass to skip.
+ *
+ * @return A structure needed for the other fileiterator functions.<br>
+ * This structure must be freed with fi_end() when no longer needed.<br>
+ * It should be read with only fi_next_stat() or only fi_next_path()/fi_next() throughout, since a directory read for fi_next_path() is not lstat()'ed.
+ * @see fi_start_ex()
+ */
+struct fi_stack* fi_start_sorted(const char* dir, int(*skip)(const char* path, void* data), void* skip_data) __attribute__((malloc));
+
+/**
+ * @brief Returns the next filename in the fi_stack structure without allocating anything.<br>
+ * Directories are descended into rather than returned, and symlinks to directories are returned like files.
+ *
+ * @param fis A fi_stack* structure returned by fi_start()
+ * @see fi_start()
+ *
+ * @return The next filename in the fi_stack* structure, or NULL if there are not any left/there was an error.<br>
+ * This points into the structure, and is only valid until the next call to fi_next_path(), fi_next_stat(), fi_next(), or fi_end(). It must not be freed.
+ */
+const char* fi_next_path(struct fi_stack* fis);
+
+/**
+ * @brief Returns the next filename in the fi_stack structure along with its metadata.<br>
+ * This is fi_next_path(), except the entry is also lstat()ed relative to its directory, so callers that need its size, timestamps or type do not have to look the path up again.
+ *
+ * @param fis A fi_stack* structure returned by fi_start()
+ * @see fi_start()
+ *
+ * @param st Filled with the entry's lstat() metadata, so a symlink is described as a symlink.<br>
+ * If the entry could not be stat'ed, st_mode is 0.<br>
+ * This cannot be NULL.
+ *
+ * @return The next filename in the fi_stack* structure, or NULL if there are not any left/there was an error.<br>
+ * This points into the structure, and is only valid until the next call to fi_next_path(), fi_next_stat(), fi_next(), or fi_end(). It must not be freed.
+ */
+const char* fi_next_stat(struct fi_stack* fis, struct stat* st);
+
 /**
  * @brief Returns the next filename in the fi_stack structure.
  *
  * @param fis A fi_stack* structure returned by fi_start()
  * @see fi_start()
  *
- * @return The next filename in the fi_stack* structure, or NULL if there are not any left/there was an error.
+ * @return The next filename in the fi_stack* structure, or NULL if there are not any left/there was an error.<br>
+ * This string must be freed when no longer in use.
+ * @see fi_next_path()
  */
 char* fi_next(struct fi_stack* fis) __attribute__((malloc));
 
@@ -66,4 +136,82 @@ const char* fi_directory_name(const struct fi_stack* fis);
  */
 void fi_end(struct fi_stack* fis);
 
+/**
+ * @brief How many walker threads fi_walk_start() starts per online processor by default.<br>
+ * Walking is mostly waiting on readdir() and lstat(), so this is more than one.
+ */
+#define FI_WALK_THREADS_PER_CPU (4)
+
+/**
+ * @brief How many files fi_walk_start() queues by default before its threads wait for fi_walk_next() to catch up.
+ */
+#define FI_WALK_QUEUE_LEN (4096)
+
+/**
+ * @brief Starts walking a directory on several threads at once.<br>
+ * Each thread reads its own directories and steals directories from the others when it runs out, so a high-latency filesystem (e.g. NFS or Lustre) has many readdir() and lstat() calls in flight instead of one.<br>
+ * Files are returned in no particular order, unlike fi_start(), but each is returned exactly once.
+ *
+ * @param dir The directory to start walking in.
+ *
+ * @param n_threads The number of walker threads to use.<br>
+ * 0 uses FI_WALK_THREADS_PER_CPU per online processor.
+ *
+ * @param queue_len How many found files can wait for fi_walk_next() before the walker threads stop to wait for it.<br>
+ * 0 uses FI_WALK_QUEUE_LEN.
+ *
+ * @param skip A function that returns non-zero for a path that should not be returned or, if it is a directory, descended into.<br>
+ * It is called from the walker threads, so it must be safe to call from several threads at once.<br>
+ * This can be NULL, in which case nothing is skipped.
+ * @see exclude_skip()
+ *
+ * @param skip_data The data to pass to skip.
+ *
+ * @return A structure needed for the other fi_walk functions, or NULL if the directory could not be read or there was an error.<br>
+ * This structure must be freed with fi_walk_end() when no longer needed.
+ * @see fi_walk_next()
+ * @see fi_walk_end()
+ */
+struct fi_walk* fi_walk_start(const char* dir, size_t n_threads, size_t queue_len, int(*skip)(const char* path, void* data), void* skip_data) __attribute__((malloc));
+
+/**
+ * @brief Returns the next file found by the walker threads, waiting for one if none have been found yet.<br>
+ * Directories are descended into rather than returned, and symlinks to directories are returned like files.
+ *
+ * @param fw A fi_walk* structure returned by fi_walk_start()
+ * @see fi_walk_start()
+ *
+ * @return The next filename, or NULL if the walk is over.<br>
+ * This string must be freed when no longer in use.
+ */
+char* fi_walk_next(struct fi_walk* fw) __attribute__((malloc));
+
+/**
+ * @brief Returns the next file found by the walker threads along with its metadata.<br>
+ * The walker threads lstat() every file they find, so this costs nothing over fi_walk_next().
+ *
+ * @param fw A fi_walk* structure returned by fi_walk_start()
+ * @see fi_walk_start()
+ *
+ * @param st Filled with the file's lstat() metadata, so a symlink is described as a symlink.<br>
+ * If the file could not be stat'ed, st_mode is 0.<br>
+ * This cannot be NULL.
+ *
+ * @return The next filename, or NULL if the walk is over.<br>
+ * This string must be freed when no longer in use.
+ * @see fi_walk_next()
+ */
+char* fi_walk_next_stat(struct fi_walk* fw, struct stat* st) __attribute__((malloc));
+
+/**
+ * @brief Stops the walker threads and frees all memory associated with the structure.<br>
+ * This can be called before fi_walk_next() returns NULL, in which case the rest of the walk is abandoned.
+ *
+ * @param fw An fi_walk* structure to free.
+ * This can be NULL, in which case this function does nothing.
+ *
+ * @return void
+ */
+void fi_walk_end(struct fi_walk* fw);
+
 #endif
@@ -0,0 +1,230 @@
+/** @file hashbench.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "hashbench.h"
+#include "checksum.h"
+#include "stats.h"
+#include "log.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/err.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#define HAVE_CPUID
+#endif
+
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#define HAVE_AUXV
+/* from asm/hwcap.h, which older toolchains do not have all of */
+#define ARM_HWCAP_SHA1 (1UL << 5)
+#define ARM_HWCAP_SHA2 (1UL << 6)
+#define ARM_HWCAP_SHA512 (1UL << 21)
+#endif
+
+#define HASH_BENCH_BUFFER_LEN (1 << 20)
+#define HASH_BENCH_LEN ((size_t)1 << 28)  /* what --hash-benchmark hashes per digest (256MiB) */
+#define HASH_FASTEST_LEN ((size_t)1 << 25) /* what -C auto hashes per digest (32MiB) */
+
+/* md5 is left out on purpose, since it is neither fast nor safe */
+static const char* const candidates[] = {
+	"sha1",
+	"sha256",
+	"sha512",
+	"sha512-256",
+	"sha3-256",
+	"blake2b512",
+	"blake2s256",
+	"xxh64"
+};
+
+static const struct{
+	unsigned flag;
+	const char* name;
+}feature_names[] = {
+	{ CPU_X86_SHA, "sha" },
+	{ CPU_X86_AVX2, "avx2" },
+	{ CPU_X86_AVX512, "avx512f" },
+	{ CPU_ARM_SHA1, "sha1" },
+	{ CPU_ARM_SHA2, "sha2" },
+	{ CPU_ARM_SHA512, "sha512" }
+};
+
+unsigned cpu_features(void){
+	unsigned ret = 0;
+#ifdef HAVE_CPUID
+	unsigned a, b, c, d;
+
+	if (__get_cpuid_max(0, NULL) >= 7){
+		__cpuid_count(7, 0, a, b, c, d);
+		ret |= (b & (1U << 29)) ? CPU_X86_SHA : 0;
+		ret |= (b & (1U << 5)) ? CPU_X86_AVX2 : 0;
+		ret |= (b & (1U << 16)) ? CPU_X86_AVX512 : 0;
+	}
+	(void)a;
+	(void)c;
+	(void)d;
+#endif
+#ifdef HAVE_AUXV
+	unsigned long hwcap = getauxval(AT_HWCAP);
+
+	ret |= (hwcap & ARM_HWCAP_SHA1) ? CPU_ARM_SHA1 : 0;
+	ret |= (hwcap & ARM_HWCAP_SHA2) ? CPU_ARM_SHA2 : 0;
+	ret |= (hwcap & ARM_HWCAP_SHA512) ? CPU_ARM_SHA512 : 0;
+#endif
+	return ret;
+}
+
+double hash_speed(const EVP_MD* md, size_t len){
+	struct stats_time start;
+	struct stats_time end;
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned digest_len;
+	unsigned char* buffer = NULL;
+	EVP_MD_CTX* ctx = NULL;
+	size_t remaining = len;
+	double ret = -1.0;
+
+	return_ifnull(md, -1.0);
+
+	buffer = malloc(HASH_BENCH_BUFFER_LEN);
+	if (!buffer){
+		log_enomem();
+		goto cleanup;
+	}
+	/* not all zeros, in case something ever shortcuts those */
+	memset(buffer, 0xA5, HASH_BENCH_BUFFER_LEN);
+
+	if (!(ctx = EVP_MD_CTX_create()) || EVP_DigestInit_ex(ctx, md, NULL) != 1){
+		log_error("Failed to initialize digest algorithm");
+		ERR_print_errors_fp(stderr);
+		goto cleanup;
+	}
+
+	stats_time_now(&start);
+	while (remaining > 0){
+		size_t n = remaining > HASH_BENCH_BUFFER_LEN ? HASH_BENCH_BUFFER_LEN : remaining;
+
+		if (EVP_DigestUpdate(ctx, buffer, n) != 1){
+			log_error("Failed to calculate checksum");
+			ERR_print_errors_fp(stderr);
+			goto cleanup;
+		}
+		remaining -= n;
+	}
+	if (EVP_DigestFinal_ex(ctx, digest, &digest_len) != 1){
+		log_error("Failed to finalize checksum calculation");
+		ERR_print_errors_fp(stderr);
+		goto cleanup;
+	}
+	stats_time_now(&end);
+
+	/* only the digest was timed, so the context setup does not count against small lengths */
+	ret = stats_per_second((double)len / (1 << 20), end.wall - start.wall);
+
+cleanup:
+	ctx ? EVP_MD_CTX_destroy(ctx) : (void)0;
+	free(buffer);
+	return ret;
+}
+
+static const EVP_MD* fastest[2] = { NULL, NULL };
+static pthread_once_t fastest_once = PTHREAD_ONCE_INIT;
+
+static void find_fastest(void){
+	double best[2] = { 0.0, 0.0 };
+	size_t i;
+
+	OpenSSL_add_all_digests();
+	for (i = 0; i < sizeof(candidates) / sizeof(candidates[0]); ++i){
+		const EVP_MD* md = get_evp_md(candidates[i]);
+		double speed;
+
+		/* not every build of OpenSSL has every digest */
+		if (!md){
+			continue;
+		}
+		speed = hash_speed(md, HASH_FASTEST_LEN);
+		if (speed > best[0]){
+			best[0] = speed;
+			fastest[0] = md;
+		}
+		if (evp_md_is_cryptographic(md) && speed > best[1]){
+			best[1] = speed;
+			fastest[1] = md;
+		}
+	}
+
+	fastest[0] = fastest[0] ? fastest[0] : EVP_sha1();
+	fastest[1] = fastest[1] ? fastest[1] : EVP_sha1();
+	log_info_ex2("Fastest digests are %s (any) and %s (cryptographic)", get_evp_md_name(fastest[0]), get_evp_md_name(fastest[1]));
+}
+
+const EVP_MD* hash_fastest(int cryptographic){
+	pthread_once(&fastest_once, find_fastest);
+	return fastest[cryptographic ? 1 : 0];
+}
+
+int hash_benchmark(FILE* out){
+	const char* best_name[2] = { NULL, NULL };
+	double best[2] = { 0.0, 0.0 };
+	unsigned features;
+	size_t i;
+
+	return_ifnull(out, -1);
+
+	OpenSSL_add_all_digests();
+
+	features = cpu_features();
+	fprintf(out, "CPU features:");
+	for (i = 0; i < sizeof(feature_names) / sizeof(feature_names[0]); ++i){
+		if (features & feature_names[i].flag){
+			fprintf(out, " %s", feature_names[i].name);
+		}
+	}
+	fprintf(out, "%s\n", features ? "" : " none");
+
+	fprintf(out, "%-12s %10s\n", "Digest", "MiB/s");
+	for (i = 0; i < sizeof(candidates) / sizeof(candidates[0]); ++i){
+		const EVP_MD* md = get_evp_md(candidates[i]);
+		double speed;
+
+		if (!md){
+			fprintf(out, "%-12s %10s\n", candidates[i], "n/a");
+			continue;
+		}
+		speed = hash_speed(md, HASH_BENCH_LEN);
+		if (speed < 0){
+			fprintf(out, "%-12s %10s\n", candidates[i], "failed");
+			continue;
+		}
+		fprintf(out, "%-12s %10.1f%s\n", candidates[i], speed, evp_md_is_cryptographic(md) ? "" : " (not cryptographic)");
+
+		if (speed > best[0]){
+			best[0] = speed;
+			best_name[0] = candidates[i];
+		}
+		if (evp_md_is_cryptographic(md) && speed > best[1]){
+			best[1] = speed;
+			best_name[1] = candidates[i];
+		}
+	}
+
+	if (!best_name[0]){
+		log_error("Failed to measure any digest");
+		return -1;
+	}
+	fprintf(out, "Fastest: %s", best_name[0]);
+	if (best_name[1] && best_name[1] != best_name[0]){
+		fprintf(out, ", or %s if it must be cryptographic (-C %s)", best_name[1], HASH_AUTO_NAME);
+	}
+	fprintf(out, "\n");
+	return 0;
+}
@@ -0,0 +1,72 @@
+/** @file hashbench.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __HASHBENCH_H
+#define __HASHBENCH_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <openssl/evp.h>
+
+/**
+ * @brief CPU features that speed up hashing.
+ */
+enum cpu_feature{
+	CPU_X86_SHA     = 1 << 0, /**< @brief x86 SHA extensions (SHA-1 and SHA-256). */
+	CPU_X86_AVX2    = 1 << 1, /**< @brief x86 AVX2. */
+	CPU_X86_AVX512  = 1 << 2, /**< @brief x86 AVX-512 foundation. */
+	CPU_ARM_SHA1    = 1 << 3, /**< @brief ARMv8 SHA-1 instructions. */
+	CPU_ARM_SHA2    = 1 << 4, /**< @brief ARMv8 SHA-256 instructions. */
+	CPU_ARM_SHA512  = 1 << 5  /**< @brief ARMv8.2 SHA-512 instructions. */
+};
+
+/**
+ * @brief Name passed to -C to pick the fastest cryptographic digest on this machine.
+ * @see hash_fastest()
+ */
+#define HASH_AUTO_NAME "auto"
+
+/**
+ * @brief Detects the CPU features that speed up hashing.<br>
+ * OpenSSL already uses these on its own wherever it can. This only tells which of them apply.
+ *
+ * @return A combination of enum cpu_feature flags.
+ */
+unsigned cpu_features(void);
+
+/**
+ * @brief Measures how fast a digest is on this machine.
+ *
+ * @param md The digest to measure.
+ *
+ * @param len The number of bytes to hash.
+ *
+ * @return The speed in MiB per second, or negative on failure.
+ */
+double hash_speed(const EVP_MD* md, size_t len);
+
+/**
+ * @brief Returns the fastest digest on this machine.<br>
+ * Every candidate is measured the first time this is called, and the result is kept for the rest of the process.
+ *
+ * @param cryptographic Non-zero to only consider cryptographic digests. @see evp_md_is_cryptographic()
+ *
+ * @return The fastest digest. This is SHA-1 if nothing could be measured.
+ */
+const EVP_MD* hash_fastest(int cryptographic);
+
+/**
+ * @brief Prints the detected CPU features, followed by the speed of every candidate digest.
+ *
+ * @param out The stream to print to.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int hash_benchmark(FILE* out);
+
+#endif
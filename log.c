@@ -7,7 +7,11 @@
  */
 
 #include "log.h"
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
 const char* const COLOR_NORMAL  = "\033[0m";
 const char* const COLOR_RED     = "\033[31m";
@@ -17,40 +21,243 @@ const char* const COLOR_MAGENTA = "\033[35m";
 const char* const COLOR_CYAN    = "\033[36m";
 
 static enum LOG_LEVEL err_level = LEVEL_WARNING;
+static enum LOG_FORMAT err_format = LOG_FORMAT_TEXT;
+
+/* a bounded queue that any number of threads add whole lines to without a lock, and only the drain thread takes them from
+ * a cell is free to fill when its seq is the position being claimed, and ready to write when it is one past it */
+static struct log_cell{
+	unsigned long seq;
+	size_t len;
+	char line[LOG_LINE_MAX];
+}ring[LOG_RING_SLOTS];
+/* the next position to claim */
+static unsigned long ring_tail;
+/* every position before this has been written */
+static unsigned long ring_drained;
+/* read without a lock on every message */
+static int ring_on;
+/* messages between checking ring_on and being in the ring, which log_stop() waits for */
+static unsigned long ring_users;
+static int ring_stop;
+static pthread_t ring_thread;
 
 void log_setlevel(enum LOG_LEVEL level){
 	err_level = level;
 }
 
-void log_msg(const char* file, int line, enum LOG_LEVEL level, const char* format, ...){
-	va_list args;
-	va_start(args, format);
+void log_setformat(enum LOG_FORMAT format){
+	err_format = format;
+}
 
-	if (level > err_level){
-		return;
+/* appends str to a JSON string, escaping what has to be */
+static size_t json_escape(char* out, size_t pos, size_t size, const char* str){
+	const char* digits = "0123456789abcdef";
+
+	for (; *str && pos + 7 < size; ++str){
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\'){
+			out[pos++] = '\\';
+			out[pos++] = c;
+		}
+		else if (c == '\n'){
+			out[pos++] = '\\';
+			out[pos++] = 'n';
+		}
+		else if (c < 0x20){
+			memcpy(out + pos, "\\u00", 4);
+			out[pos + 4] = digits[c >> 4];
+			out[pos + 5] = digits[c & 0xF];
+			pos += 6;
+		}
+		else{
+			out[pos++] = c;
+		}
+	}
+	return pos;
+}
+
+/* formats a whole line, newline included, into out, cutting the message short if it does not fit */
+static size_t format_line(char* out, size_t size, const char* file, int line, enum LOG_LEVEL level, const char* format, va_list args){
+	static const char* const names[] = { "none", "fatal", "error", "warning", "debug", "info" };
+	char msg[LOG_LINE_MAX];
+	size_t len;
+	int res;
+
+	res = vsnprintf(msg, sizeof(msg), format, args);
+	if (res < 0){
+		msg[0] = '\0';
+	}
+
+	if (err_format == LOG_FORMAT_JSON){
+		char stamp[32] = "";
+		time_t now = time(NULL);
+		struct tm tm;
+
+		if (gmtime_r(&now, &tm)){
+			strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", &tm);
+		}
+		res = snprintf(out, size, "{\"time\":\"%s\",\"level\":\"%s\",\"file\":\"", stamp, names[level <= LEVEL_INFO ? level : 0]);
+		len = res > 0 ? (size_t)res : 0;
+		len = json_escape(out, len < size ? len : size - 1, size, file);
+		res = snprintf(out + len, size - len, "\",\"line\":%d,\"msg\":\"", line);
+		len += res > 0 ? (size_t)res : 0;
+		/* always leave room to close the object */
+		len = len < size - 3 ? len : size - 4;
+		len = json_escape(out, len, size - 3, msg);
+		memcpy(out + len, "\"}\n", 3);
+		return len + 3;
 	}
 
 	switch (level){
 	case LEVEL_FATAL:
-		fprintf(stderr, "[%sFATAL%s](%s:%d): ", COLOR_MAGENTA, COLOR_NORMAL, file, line);
+		res = snprintf(out, size, "[%sFATAL%s](%s:%d): ", COLOR_MAGENTA, COLOR_NORMAL, file, line);
 		break;
 	case LEVEL_ERROR:
-		fprintf(stderr, "[%sERROR%s](%s:%d): ", COLOR_RED, COLOR_NORMAL, file, line);
+		res = snprintf(out, size, "[%sERROR%s](%s:%d): ", COLOR_RED, COLOR_NORMAL, file, line);
 		break;
 	case LEVEL_WARNING:
-		fprintf(stderr, "[%sWARN %s](%s:%d): ", COLOR_YELLOW, COLOR_NORMAL, file, line);
+		res = snprintf(out, size, "[%sWARN %s](%s:%d): ", COLOR_YELLOW, COLOR_NORMAL, file, line);
 		break;
 	case LEVEL_DEBUG:
-		fprintf(stderr, "[%sDEBUG%s](%s:%d): ", COLOR_CYAN, COLOR_NORMAL, file, line);
+		res = snprintf(out, size, "[%sDEBUG%s](%s:%d): ", COLOR_CYAN, COLOR_NORMAL, file, line);
 		break;
 	case LEVEL_INFO:
-		fprintf(stderr, "[%sINFO %s](%s:%d): ", COLOR_GREEN, COLOR_NORMAL, file, line);
+		res = snprintf(out, size, "[%sINFO %s](%s:%d): ", COLOR_GREEN, COLOR_NORMAL, file, line);
 		break;
 	default:
+		res = 0;
 		break;
 	}
+	len = res > 0 && (size_t)res < size ? (size_t)res : 0;
+	res = snprintf(out + len, size - len - 1, "%s", msg);
+	len += res > 0 && (size_t)res < size - len - 1 ? (size_t)res : size - len - 2;
+	out[len++] = '\n';
+	return len;
+}
+
+/* claims a cell, waiting for the drain thread if the ring is full, and returns its position */
+static unsigned long ring_claim(void){
+	unsigned long pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+
+	for (;;){
+		struct log_cell* cell = &ring[pos % LOG_RING_SLOTS];
+		long diff = (long)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+
+		if (diff == 0){
+			if (__atomic_compare_exchange_n(&ring_tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+				return pos;
+			}
+		}
+		else if (diff < 0){
+			sched_yield();
+			pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+		}
+		else{
+			pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static void* ring_drain(void* arg){
+	unsigned long head = 0;
+
+	(void)arg;
+
+	for (;;){
+		struct log_cell* cell = &ring[head % LOG_RING_SLOTS];
 
-	vfprintf(stderr, format, args);
-	fprintf(stderr, "\n");
+		if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) == head + 1){
+			fwrite(cell->line, 1, cell->len, stderr);
+			__atomic_store_n(&cell->seq, head + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+			head++;
+			__atomic_store_n(&ring_drained, head, __ATOMIC_RELEASE);
+		}
+		/* log_stop() only sets this once nothing else can be added */
+		else if (__atomic_load_n(&ring_stop, __ATOMIC_ACQUIRE)){
+			break;
+		}
+		else{
+			struct timespec ts;
+
+			fflush(stderr);
+			ts.tv_sec = 0;
+			ts.tv_nsec = LOG_DRAIN_INTERVAL_MS * 1000000L;
+			nanosleep(&ts, NULL);
+		}
+	}
+	fflush(stderr);
+	return NULL;
+}
+
+int log_start(void){
+	unsigned long i;
+
+	if (__atomic_load_n(&ring_on, __ATOMIC_ACQUIRE)){
+		return 0;
+	}
+
+	for (i = 0; i < LOG_RING_SLOTS; ++i){
+		ring[i].seq = i;
+	}
+	ring_tail = 0;
+	ring_drained = 0;
+	ring_stop = 0;
+	if (pthread_create(&ring_thread, NULL, ring_drain, NULL) != 0){
+		log_warning("Failed to start the log thread. Logging on the calling thread instead.");
+		return -1;
+	}
+	__atomic_store_n(&ring_on, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void log_stop(void){
+	if (!__atomic_load_n(&ring_on, __ATOMIC_ACQUIRE)){
+		return;
+	}
+
+	/* new messages go straight to stderr, and the ones already on their way into the ring get there first */
+	__atomic_store_n(&ring_on, 0, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&ring_users, __ATOMIC_SEQ_CST) > 0){
+		sched_yield();
+	}
+	__atomic_store_n(&ring_stop, 1, __ATOMIC_RELEASE);
+	pthread_join(ring_thread, NULL);
+}
+
+void log_msg(const char* file, int line, enum LOG_LEVEL level, const char* format, ...){
+	va_list args;
+
+	/* nothing is formatted for a message that is not shown */
+	if (level > err_level){
+		return;
+	}
+
+	va_start(args, format);
+	__atomic_fetch_add(&ring_users, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring_on, __ATOMIC_SEQ_CST)){
+		unsigned long pos = ring_claim();
+		struct log_cell* cell = &ring[pos % LOG_RING_SLOTS];
+
+		cell->len = format_line(cell->line, sizeof(cell->line), file, line, level, format, args);
+		__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+		__atomic_fetch_sub(&ring_users, 1, __ATOMIC_SEQ_CST);
+
+		/* whatever comes after a fatal error, its message has to be out first */
+		if (level == LEVEL_FATAL){
+			while (__atomic_load_n(&ring_drained, __ATOMIC_ACQUIRE) <= pos && __atomic_load_n(&ring_on, __ATOMIC_ACQUIRE)){
+				sched_yield();
+			}
+		}
+	}
+	else{
+		char buf[LOG_LINE_MAX];
+		size_t len;
+
+		__atomic_fetch_sub(&ring_users, 1, __ATOMIC_SEQ_CST);
+		/* one write per line, so lines from different threads do not interleave */
+		len = format_line(buf, sizeof(buf), file, line, level, format, args);
+		fwrite(buf, 1, len, stderr);
+	}
 	va_end(args);
 }
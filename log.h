@@ -23,6 +23,36 @@ enum LOG_LEVEL{
 	LEVEL_INFO    = 5  /**< Use this for general information about the program's state. */
 };
 
+/**
+ * @brief How log messages are written.
+ */
+enum LOG_FORMAT{
+	LOG_FORMAT_TEXT = 0, /**< Human-readable lines, with the level in color. */
+	LOG_FORMAT_JSON = 1  /**< One JSON object per line, with "time", "level", "file", "line", and "msg" keys. */
+};
+
+/**
+ * @brief The longest a log line can be, including its prefix and newline.<br>
+ * Longer messages are cut short.
+ */
+#ifndef LOG_LINE_MAX
+#define LOG_LINE_MAX (1024)
+#endif
+
+/**
+ * @brief How many lines can be waiting to be written before logging threads have to wait for the log thread.
+ */
+#ifndef LOG_RING_SLOTS
+#define LOG_RING_SLOTS (256)
+#endif
+
+/**
+ * @brief How long the log thread sleeps when there is nothing to write.
+ */
+#ifndef LOG_DRAIN_INTERVAL_MS
+#define LOG_DRAIN_INTERVAL_MS (10)
+#endif
+
 /**
  * @brief Sets the current logging level.<br>
  * All messages greater than the current level are silenced.<br>
@@ -35,8 +65,38 @@ enum LOG_LEVEL{
  */
 void log_setlevel(enum LOG_LEVEL level);
 
+/**
+ * @brief Sets how log messages are written.<br>
+ * This function is not thread-safe.
+ * @see enum LOG_FORMAT
+ *
+ * @param format The format to use.
+ *
+ * @return void
+ */
+void log_setformat(enum LOG_FORMAT format);
+
+/**
+ * @brief Starts writing log messages from a background thread.<br>
+ * Until then, and after log_stop(), every message is written by the thread that logs it.<br>
+ * Either way, each message is written to stderr as one whole line.
+ *
+ * @return 0 on success, or negative if the log thread could not be started, in which case logging carries on as before.
+ */
+int log_start(void);
+
+/**
+ * @brief Writes every message still waiting and stops the log thread.<br>
+ * Messages logged while or after this runs are written by the thread that logs them.<br>
+ * If the log thread is not running, this function does nothing.
+ *
+ * @return void
+ */
+void log_stop(void);
+
 /**
  * @brief Logs a message to stderr.<br>
+ * Nothing is formatted if the level is silenced, and a LEVEL_FATAL message is written before this returns.<br>
  * Do not call this function directly. Use one of the macros provided by this library.
  *
  * @param file The file where the error takes place.
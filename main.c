@@ -10,6 +10,14 @@
 #include "options/options.h"
 #include "options/options_menu.h"
 #include "backup.h"
+#include "restore.h"
+#include "hashbench.h"
+#include "changejournal.h"
+#include "retention.h"
+#include "daemon.h"
+#include "estimate.h"
+#include <stdlib.h>
+#include <string.h>
 
 int main(int argc, char** argv){
 	struct options* opt = NULL;
@@ -17,6 +25,13 @@ int main(int argc, char** argv){
 	int ret = 0;
 
 	log_setlevel(LEVEL_WARNING);
+	if (getenv("EZBACKUP_LOG_FORMAT") && strcmp(getenv("EZBACKUP_LOG_FORMAT"), "json") == 0){
+		log_setformat(LOG_FORMAT_JSON);
+	}
+	/* exit() is called while parsing options, and anything still waiting has to be written first */
+	if (log_start() == 0){
+		atexit(log_stop);
+	}
 
 	if (argc > 1){
 		int res;
@@ -40,14 +55,66 @@ int main(int argc, char** argv){
 
 	switch (op){
 	case OP_BACKUP:
-		if (backup(opt) != 0){
+		/* a running daemon already has its clouds logged in, so it backs up faster than starting over here */
+		if (opt->socket_file){
+			if (daemon_request(opt->socket_file, "backup", stdout) != 0){
+				log_error("Backup failed");
+				ret = 1;
+			}
+		}
+		else if (backup(opt) != 0){
 			log_error("Backup failed");
+			ret = 1;
 		}
 		break;
 	case OP_RESTORE:
-		fprintf(stderr, "Restore not implemented yet\n");
-		ret = 1;
-		goto cleanup;
+		if (restore(opt) != 0){
+			log_error("Restore failed");
+			ret = 1;
+		}
+		break;
+	case OP_VERIFY:
+		if (verify(opt) != 0){
+			log_error("Verify failed");
+			ret = 1;
+		}
+		break;
+	case OP_WATCH:
+		if (cj_watch(opt) != 0){
+			log_error("Watching for changes failed");
+			ret = 1;
+		}
+		break;
+	case OP_DAEMON:
+		if (daemon_run(opt) != 0){
+			log_error("Running as a daemon failed");
+			ret = 1;
+		}
+		break;
+	case OP_PRUNE:
+		if (retention_prune(opt) != 0){
+			log_error("Pruning failed");
+			ret = 1;
+		}
+		break;
+	case OP_ESTIMATE:
+		{
+			struct backup_estimate be;
+
+			if (backup_estimate(opt, &be) != 0){
+				log_error("Estimating the backup failed");
+				ret = 1;
+			}
+			else{
+				backup_estimate_print(&be, stdout);
+			}
+		}
+		break;
+	case OP_HASH_BENCHMARK:
+		if (hash_benchmark(stdout) != 0){
+			log_error("Hash benchmark failed");
+			ret = 1;
+		}
 		break;
 	case OP_EXIT:
 		ret = 0;
@@ -61,5 +128,6 @@ int main(int argc, char** argv){
 
 cleanup:
 	options_free(opt);
+	log_stop();
 	return ret;
 }
@@ -0,0 +1,553 @@
+/** @file manifest.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "manifest.h"
+#include "crypt/crypt_session.h"
+#include "filehelper.h"
+#include "log.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* the offset, the encrypted length, the decrypted length, the position in the checksum file, the seal, and the length of the first path */
+#define INDEX_ENTRY_LEN (8 + 4 + 4 + 8 + MANIFEST_SEAL_LEN + 2)
+
+static void put_u16(unsigned char* p, unsigned val){
+	p[0] = val & 0xFF;
+	p[1] = (val >> 8) & 0xFF;
+}
+
+static void put_u32(unsigned char* p, unsigned long val){
+	put_u16(p, val & 0xFFFF);
+	put_u16(p + 2, (val >> 16) & 0xFFFF);
+}
+
+static void put_u64(unsigned char* p, uint64_t val){
+	put_u32(p, (unsigned long)(val & 0xFFFFFFFFUL));
+	put_u32(p + 4, (unsigned long)(val >> 32));
+}
+
+static unsigned get_u16(const unsigned char* p){
+	return p[0] | (p[1] << 8);
+}
+
+static unsigned long get_u32(const unsigned char* p){
+	return get_u16(p) | ((unsigned long)get_u16(p + 2) << 16);
+}
+
+static uint64_t get_u64(const unsigned char* p){
+	return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+/* makes sure a buffer can hold len bytes */
+static int buf_reserve(unsigned char** buf, size_t* size, size_t len){
+	unsigned char* tmp;
+	size_t new_size;
+
+	if (len <= *size){
+		return 0;
+	}
+	new_size = *size * 2 > len ? *size * 2 : len;
+	tmp = realloc(*buf, new_size);
+	if (!tmp){
+		log_enomem();
+		return -1;
+	}
+	*buf = tmp;
+	*size = new_size;
+	return 0;
+}
+
+struct manifest_block{
+	uint64_t offset;
+	unsigned long enc_len;
+	unsigned long plain_len;
+	/* where the records were in the checksum file */
+	uint64_t pos;
+	unsigned char seal[MANIFEST_SEAL_LEN];
+	/* points into the decrypted index */
+	const char* key;
+};
+
+struct manifest{
+	FILE* fp;
+	const EVP_CIPHER* cipher;
+	struct crypt_session* cs;
+	unsigned char* index;
+	struct manifest_block* blocks;
+	size_t n_blocks;
+	/* the block that was decrypted last, and the block manifest_next() reads after it */
+	struct checksum_reader* cr;
+	size_t cur;
+	size_t next;
+	unsigned char* enc;
+	size_t enc_size;
+	unsigned char* plain;
+	size_t plain_size;
+	unsigned long n_decrypted;
+};
+
+/* encrypts data with fresh keys from the session and writes it at the end of the manifest */
+static int write_block(struct crypt_session* cs, FILE* fp, const void* data, size_t len, unsigned char** enc, size_t* enc_size, unsigned long* out_len, unsigned char seal[MANIFEST_SEAL_LEN]){
+	struct crypt_keys* fk = NULL;
+	size_t enc_len;
+	int ret = 0;
+
+	if (crypt_session_encryption_keys(cs, &fk) != 0){
+		log_error("Failed to make the keys for a manifest block");
+		return -1;
+	}
+	if (buf_reserve(enc, enc_size, crypt_encrypted_len(fk, len)) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+	if (crypt_encrypt_buf(data, len, fk, *enc, *enc_size, &enc_len) != 0 || enc_len < MANIFEST_SEAL_LEN || enc_len > 0xFFFFFFFFUL){
+		log_error("Failed to encrypt a manifest block");
+		ret = -1;
+		goto cleanup;
+	}
+	if (fwrite(*enc, 1, enc_len, fp) != enc_len){
+		log_efwrite("manifest");
+		ret = -1;
+		goto cleanup;
+	}
+	*out_len = (unsigned long)enc_len;
+	if (seal){
+		memcpy(seal, *enc, MANIFEST_SEAL_LEN);
+	}
+
+cleanup:
+	crypt_free(fk);
+	return ret;
+}
+
+int manifest_write(const char* checksum_file, const char* out_file, const EVP_CIPHER* cipher, const char* password){
+	FILE* fp_in = NULL;
+	FILE* fp_out = NULL;
+	struct checksum_index* ci = NULL;
+	struct crypt_session* cs = NULL;
+	unsigned char header[MANIFEST_HEADER_LEN];
+	unsigned char footer[MANIFEST_FOOTER_LEN];
+	unsigned char* index = NULL;
+	size_t index_len = 4;
+	size_t index_size = 0;
+	unsigned char* plain = NULL;
+	size_t plain_size = 0;
+	unsigned char* enc = NULL;
+	size_t enc_size = 0;
+	unsigned long n_blocks = 0;
+	unsigned long enc_len;
+	long index_pos;
+	const char* key;
+	uint64_t start;
+	size_t i;
+	int res;
+	int ret = 0;
+
+	return_ifnull(checksum_file, -1);
+	return_ifnull(out_file, -1);
+	return_ifnull(password, -1);
+
+	/* a block that is not authenticated cannot be trusted without the rest of the file */
+	if (!cipher || !crypt_is_aead(cipher)){
+		cipher = EVP_aes_256_gcm();
+	}
+
+	if (!(fp_in = fopen(checksum_file, "rb"))){
+		log_efopen(checksum_file);
+		ret = -1;
+		goto cleanup;
+	}
+	if ((res = checksum_index_load(fp_in, &ci)) != 0){
+		if (res > 0){
+			log_error_ex("%s is not a sorted checksum file", checksum_file);
+		}
+		ret = -1;
+		goto cleanup;
+	}
+	memset(header, 0, sizeof(header));
+	if (fseek(fp_in, 0, SEEK_SET) != 0 || fread(header, 1, CHECKSUM_HEADER_LEN, fp_in) != CHECKSUM_HEADER_LEN){
+		log_efread(checksum_file);
+		ret = -1;
+		goto cleanup;
+	}
+	header[5] = header[4];
+	memcpy(header, MANIFEST_MAGIC, 4);
+	header[4] = MANIFEST_VERSION;
+	header[6] = header[7] = 0;
+	put_u32(header + 8, (unsigned long)EVP_CIPHER_nid(cipher));
+
+	if (!(cs = crypt_session_new(cipher, password))){
+		log_error("Failed to start an encryption session for the manifest");
+		ret = -1;
+		goto cleanup;
+	}
+	if (!(fp_out = fopen(out_file, "wb"))){
+		log_efopen(out_file);
+		ret = -1;
+		goto cleanup;
+	}
+	if (fwrite(header, 1, sizeof(header), fp_out) != sizeof(header)){
+		log_efwrite(out_file);
+		ret = -1;
+		goto cleanup;
+	}
+	if (buf_reserve(&index, &index_size, 4096) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+
+	for (i = 0; checksum_index_block(ci, i, &start, &key) == 0 && key; ++n_blocks){
+		unsigned char* entry;
+		const char* next_key;
+		uint64_t end;
+		size_t key_len = strlen(key);
+		size_t len;
+		long offset;
+
+		/* blocks of the checksum file are joined until there are enough records to be worth a block of their own */
+		do{
+			++i;
+			checksum_index_block(ci, i, &end, &next_key);
+		}while (next_key && end - start < MANIFEST_BLOCK_LEN);
+		len = (size_t)(end - start);
+
+		if (buf_reserve(&plain, &plain_size, len ? len : 1) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+		if (fseek(fp_in, start, SEEK_SET) != 0 || fread(plain, 1, len, fp_in) != len){
+			log_efread(checksum_file);
+			ret = -1;
+			goto cleanup;
+		}
+		if ((offset = ftell(fp_out)) < 0){
+			log_error_ex("Failed to determine position in manifest (%s)", strerror(errno));
+			ret = -1;
+			goto cleanup;
+		}
+		/* the key comes out of a checksum file's summary, which also keeps them under 64KB */
+		if (buf_reserve(&index, &index_size, index_len + INDEX_ENTRY_LEN + key_len + 1) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+		entry = index + index_len;
+		if (write_block(cs, fp_out, plain, len, &enc, &enc_size, &enc_len, entry + 24) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+		put_u64(entry, (uint64_t)offset);
+		put_u32(entry + 8, enc_len);
+		put_u32(entry + 12, (unsigned long)len);
+		put_u64(entry + 16, start);
+		put_u16(entry + 24 + MANIFEST_SEAL_LEN, (unsigned)key_len);
+		memcpy(entry + INDEX_ENTRY_LEN, key, key_len + 1);
+		index_len += INDEX_ENTRY_LEN + key_len + 1;
+	}
+	put_u32(index, n_blocks);
+
+	if ((index_pos = ftell(fp_out)) < 0){
+		log_error_ex("Failed to determine position in manifest (%s)", strerror(errno));
+		ret = -1;
+		goto cleanup;
+	}
+	if (write_block(cs, fp_out, index, index_len, &enc, &enc_size, &enc_len, NULL) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+	put_u64(footer, (uint64_t)index_pos);
+	put_u32(footer + 8, enc_len);
+	memcpy(footer + 12, MANIFEST_INDEX_MAGIC, 4);
+	if (fwrite(footer, 1, sizeof(footer), fp_out) != sizeof(footer)){
+		log_efwrite(out_file);
+		ret = -1;
+		goto cleanup;
+	}
+
+cleanup:
+	fp_in ? fclose(fp_in) : 0;
+	if (fp_out && fclose(fp_out) != 0 && ret == 0){
+		log_efclose(out_file);
+		ret = -1;
+	}
+	if (ret != 0 && fp_out){
+		remove(out_file);
+	}
+	checksum_index_free(ci);
+	cs ? crypt_session_free(cs) : (void)0;
+	free(index);
+	free(plain);
+	free(enc);
+	return ret;
+}
+
+/* reads and decrypts part of a manifest into m->plain
+ * the seal is checked against the start of the block if it is not NULL */
+static int decrypt_block(struct manifest* m, uint64_t offset, unsigned long enc_len, const unsigned char* seal, size_t* out_len){
+	struct crypt_keys* fk = NULL;
+	int ret = 0;
+
+	if (buf_reserve(&m->enc, &m->enc_size, enc_len) != 0 || buf_reserve(&m->plain, &m->plain_size, enc_len) != 0){
+		return -1;
+	}
+	if (fseek(m->fp, offset, SEEK_SET) != 0 || fread(m->enc, 1, enc_len, m->fp) != enc_len){
+		log_efread("manifest");
+		return -1;
+	}
+	if (seal && (enc_len < MANIFEST_SEAL_LEN || memcmp(m->enc, seal, MANIFEST_SEAL_LEN) != 0)){
+		log_error("A manifest block does not belong where the index says it is");
+		return -1;
+	}
+
+	if (!(fk = crypt_new()) || crypt_set_encryption(m->cipher, fk) != 0 ||
+			crypt_read_salt_buf(m->enc, enc_len, fk) != 0 || crypt_session_set_keys(m->cs, fk) != 0){
+		log_error("Failed to make the keys for a manifest block");
+		ret = -1;
+		goto cleanup;
+	}
+	if (crypt_decrypt_buf(m->enc, enc_len, fk, m->plain, m->plain_size, out_len) != 0){
+		log_error("Failed to decrypt a manifest block. The password is wrong or the manifest was tampered with.");
+		ret = -1;
+		goto cleanup;
+	}
+	m->n_decrypted++;
+
+cleanup:
+	fk ? crypt_free(fk) : (void)0;
+	return ret;
+}
+
+/* parses the decrypted index, whose paths stay where they are */
+static int parse_index(struct manifest* m, size_t len){
+	const unsigned char* p = m->index;
+	const unsigned char* end = m->index + len;
+	unsigned long n;
+	size_t i;
+
+	if (len < 4){
+		return -1;
+	}
+	n = get_u32(p);
+	p += 4;
+	/* every entry takes at least INDEX_ENTRY_LEN bytes, which bounds the count before it is trusted */
+	if (n > (len - 4) / INDEX_ENTRY_LEN){
+		return -1;
+	}
+	if (n > 0 && !(m->blocks = malloc(n * sizeof(*m->blocks)))){
+		log_enomem();
+		return -1;
+	}
+	for (i = 0; i < n; ++i){
+		struct manifest_block* b = &m->blocks[i];
+		size_t key_len;
+
+		if ((size_t)(end - p) < INDEX_ENTRY_LEN){
+			return -1;
+		}
+		b->offset = get_u64(p);
+		b->enc_len = get_u32(p + 8);
+		b->plain_len = get_u32(p + 12);
+		b->pos = get_u64(p + 16);
+		memcpy(b->seal, p + 24, MANIFEST_SEAL_LEN);
+		key_len = get_u16(p + 24 + MANIFEST_SEAL_LEN);
+		p += INDEX_ENTRY_LEN;
+		if ((size_t)(end - p) < key_len + 1 || p[key_len] != '\0' || b->pos < CHECKSUM_HEADER_LEN){
+			return -1;
+		}
+		b->key = (const char*)p;
+		p += key_len + 1;
+	}
+	m->n_blocks = n;
+	return 0;
+}
+
+int manifest_open(const char* file, const char* password, struct manifest** out){
+	struct manifest* m = NULL;
+	unsigned char header[MANIFEST_HEADER_LEN];
+	unsigned char footer[MANIFEST_FOOTER_LEN];
+	uint64_t size;
+	uint64_t index_pos;
+	unsigned long index_len;
+	size_t len;
+	int ret = 0;
+
+	return_ifnull(file, -1);
+	return_ifnull(password, -1);
+	return_ifnull(out, -1);
+	*out = NULL;
+
+	m = calloc(1, sizeof(*m));
+	if (!m){
+		log_enomem();
+		return -1;
+	}
+	if (!(m->fp = fopen(file, "rb"))){
+		log_efopen(file);
+		ret = -1;
+		goto cleanup;
+	}
+	if (fread(header, 1, sizeof(header), m->fp) != sizeof(header) || memcmp(header, MANIFEST_MAGIC, 4) != 0){
+		ret = ferror(m->fp) ? -1 : 1;
+		goto cleanup;
+	}
+	if (header[4] > MANIFEST_VERSION || header[5] > CHECKSUM_VERSION){
+		log_error_ex("Manifest version %d is newer than this version of ezbackup supports", header[4]);
+		ret = -1;
+		goto cleanup;
+	}
+	m->cipher = EVP_get_cipherbynid((int)get_u32(header + 8));
+	if (!m->cipher || !crypt_is_aead(m->cipher)){
+		log_error("The manifest's cipher is not supported");
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (checksum_read_footer(m->fp, MANIFEST_INDEX_MAGIC, MANIFEST_HEADER_LEN + MANIFEST_FOOTER_LEN, footer, sizeof(footer), &size) != 0){
+		log_error_ex("%s is truncated", file);
+		ret = -1;
+		goto cleanup;
+	}
+	index_pos = get_u64(footer);
+	index_len = get_u32(footer + 8);
+	if (index_pos < MANIFEST_HEADER_LEN || index_pos + index_len + MANIFEST_FOOTER_LEN != size){
+		log_error_ex("%s has a corrupt footer", file);
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (!(m->cs = crypt_session_new(m->cipher, password))){
+		log_error("Failed to start a decryption session for the manifest");
+		ret = -1;
+		goto cleanup;
+	}
+	if (decrypt_block(m, index_pos, index_len, NULL, &len) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+	/* the index keeps its buffer, and the blocks get a new one */
+	m->index = m->plain;
+	m->plain = NULL;
+	m->plain_size = 0;
+	if (parse_index(m, len) != 0){
+		log_error_ex("%s has a corrupt index", file);
+		ret = -1;
+		goto cleanup;
+	}
+
+cleanup:
+	if (ret != 0){
+		manifest_close(m);
+		return ret;
+	}
+	*out = m;
+	return 0;
+}
+
+/* decrypts a block and starts reading it from its first record */
+static int load_block(struct manifest* m, size_t i){
+	const struct manifest_block* b = &m->blocks[i];
+	size_t len;
+
+	/* reading the same block again, such as for lookups close to each other, does not decrypt it again */
+	if (m->cr && m->cur == i){
+		checksum_reader_seek(m->cr, b->pos);
+		m->next = i + 1;
+		return 0;
+	}
+	if (m->cr){
+		checksum_reader_free(m->cr);
+		m->cr = NULL;
+	}
+	if (decrypt_block(m, b->offset, b->enc_len, b->seal, &len) != 0){
+		return -1;
+	}
+	if (len != b->plain_len){
+		log_error("A manifest block is not as long as the index says");
+		return -1;
+	}
+	if (!(m->cr = checksum_reader_new_buf(m->plain, len, b->pos))){
+		return -1;
+	}
+	m->cur = i;
+	m->next = i + 1;
+	return 0;
+}
+
+int manifest_next(struct manifest* m, const struct element** out){
+	int res;
+
+	return_ifnull(m, -1);
+	return_ifnull(out, -1);
+	*out = NULL;
+
+	for (;;){
+		if (m->cr && (res = checksum_reader_next(m->cr, out)) <= 0){
+			return res < 0 ? -1 : 0;
+		}
+		if (m->next >= m->n_blocks){
+			return 1;
+		}
+		if (load_block(m, m->next) != 0){
+			return -1;
+		}
+	}
+}
+
+static const char* block_key(size_t i, const void* data){
+	return ((const struct manifest*)data)->blocks[i].key;
+}
+
+int manifest_search(struct manifest* m, const char* key, struct element** out){
+	const struct element* e;
+	size_t block;
+	int res;
+
+	return_ifnull(m, -1);
+	return_ifnull(key, -1);
+	return_ifnull(out, -1);
+	*out = NULL;
+
+	/* the blocks are split up the same way as the checksum file's */
+	if (checksum_find_block(key, m->n_blocks, block_key, m, &block) != 0){
+		return 1;
+	}
+	if (load_block(m, block) != 0){
+		return -1;
+	}
+	while ((res = checksum_reader_next(m->cr, &e)) == 0){
+		int cmp = strcmp(key, e->file);
+
+		if (cmp == 0){
+			*out = copy_element(e);
+			return *out ? 0 : -1;
+		}
+		if (cmp < 0){
+			return 1;
+		}
+	}
+	return res;
+}
+
+unsigned long manifest_blocks_decrypted(const struct manifest* m){
+	return m ? m->n_decrypted : 0;
+}
+
+void manifest_close(struct manifest* m){
+	if (!m){
+		return;
+	}
+	m->fp ? fclose(m->fp) : 0;
+	m->cs ? crypt_session_free(m->cs) : (void)0;
+	checksum_reader_free(m->cr);
+	free(m->index);
+	free(m->blocks);
+	free(m->enc);
+	free(m->plain);
+	free(m);
+}
@@ -0,0 +1,121 @@
+/** @file manifest.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ *
+ * Encrypts a sorted checksum file as a manifest that can still be searched and read in order without decrypting all of it.<br>
+ * The records are split into blocks that are each encrypted and authenticated on their own, and an encrypted index holds the first path of every block.
+ */
+
+#ifndef __MANIFEST_H
+#define __MANIFEST_H
+
+#include "checksumsort.h"
+#include "crypt/crypt.h"
+#include <openssl/evp.h>
+#include <stddef.h>
+
+/**
+ * @brief The first 4 bytes of a manifest.<br>
+ * Like CHECKSUM_MAGIC, the first byte can never start a path, so a manifest cannot be mistaken for a checksum file in the text format.
+ */
+#define MANIFEST_MAGIC "\x89" "EZM"
+#define MANIFEST_VERSION 1       /**< @brief The newest version of the manifest format, which this version reads and writes. */
+#define MANIFEST_HEADER_LEN 12   /**< @brief The length of the header: MANIFEST_MAGIC, the version, the version of the checksum file the records come from, 2 reserved bytes, and the NID of the cipher. */
+#define MANIFEST_INDEX_MAGIC "EZMI" /**< @brief Ends a manifest. */
+#define MANIFEST_FOOTER_LEN 16   /**< @brief The length of the footer: the offset and length of the encrypted index, then MANIFEST_INDEX_MAGIC. */
+#define MANIFEST_SEAL_LEN (16 + CRYPT_NONCE_LEN) /**< @brief The length of the header crypt_encrypt_buf() puts in front of a block encrypted with keys from a session ("Session_", the salt, and the nonce). The index holds a copy of every block's, so a block cannot be swapped for another one without it being noticed. */
+
+#define MANIFEST_BLOCK_LEN (1 << 16) /**< @brief Blocks of the checksum file are joined until a manifest block holds at least this many bytes of records (64KB), which is what a lookup decrypts. */
+
+/**
+ * @brief An open manifest, with its index decrypted and at most one block decrypted at a time.
+ */
+struct manifest;
+
+/**
+ * @brief Encrypts a sorted checksum file as a manifest.<br>
+ * Each block gets its own keys from one session, so the password is only stretched once.
+ * @see crypt_session_new()
+ *
+ * @param checksum_file A checksum file sorted by sort_checksum_file(), so it has a summary.
+ *
+ * @param out_file Where to write the manifest. If it exists, it is overwritten.<br>
+ * If this function fails, it is removed.
+ *
+ * @param cipher The cipher to encrypt it with.<br>
+ * A cipher that does not authenticate what it encrypts is replaced with AES-256-GCM, since the blocks have to be authenticated to be trusted on their own.
+ * @see crypt_is_aead()
+ *
+ * @param password The password to encrypt it with.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int manifest_write(const char* checksum_file, const char* out_file, const EVP_CIPHER* cipher, const char* password);
+
+/**
+ * @brief Opens a manifest and decrypts its index.<br>
+ * None of the blocks are decrypted until they are needed.
+ *
+ * @param file The manifest.
+ *
+ * @param password The password it was encrypted with.
+ *
+ * @param out Set to the open manifest, or NULL on failure.<br>
+ * This must be freed with manifest_close() when no longer in use.
+ *
+ * @return 0 on success, positive if the file is not a manifest, or negative on failure, including a wrong password or a manifest that was tampered with.
+ */
+int manifest_open(const char* file, const char* password, struct manifest** out);
+
+/**
+ * @brief Retrieves the next record of a manifest, decrypting the next block when the last one runs out.
+ *
+ * @param m The manifest.
+ *
+ * @param out Set to the record.<br>
+ * The element belongs to the manifest, and is only valid until the next call to manifest_next() or manifest_search(), or until the manifest is closed.
+ * @see copy_element()
+ *
+ * @return 0 on success, positive once there are no more records, or negative on failure.
+ */
+int manifest_next(struct manifest* m, const struct element** out);
+
+/**
+ * @brief Looks up a path in a manifest, decrypting only the block that could hold it.<br>
+ * Afterwards, manifest_next() continues from the record after where the search stopped.
+ *
+ * @param m The manifest.
+ *
+ * @param key The path to search for.
+ *
+ * @param out Set to a copy of the record, or NULL if it could not be found.<br>
+ * This must be freed with free_element() when no longer in use.
+ *
+ * @return 0 on success, positive if the path is not in the manifest, or negative on failure.
+ */
+int manifest_search(struct manifest* m, const char* key, struct element** out);
+
+/**
+ * @brief Gets how many blocks of a manifest were decrypted since it was opened.<br>
+ * A block that is read again right after it was decrypted is not decrypted again.
+ *
+ * @param m The manifest.
+ *
+ * @return The number of blocks decrypted.
+ */
+unsigned long manifest_blocks_decrypted(const struct manifest* m);
+
+/**
+ * @brief Closes a manifest.
+ *
+ * @param m The manifest.<br>
+ * This can be NULL, in which case this function does nothing.
+ *
+ * @return void
+ */
+void manifest_close(struct manifest* m);
+
+#endif
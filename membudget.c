@@ -0,0 +1,186 @@
+/** @file membudget.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "membudget.h"
+#include "checksumsort.h"
+#include "cloud/base.h"
+#include "compression/zip.h"
+#include "filehelper.h"
+#include "log.h"
+#include "threadpool.h"
+#include "zipauto.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MIB (1024.0 * 1024.0)
+
+/* how many clouds the backup logs in to, and what a file streamed to all of them at once takes
+ * the streams only count if every cloud can stream, since otherwise the file goes through the disk */
+static size_t count_clouds(const struct options* opt, uint64_t* out_streams){
+	size_t n = 0;
+	size_t i;
+	int all_stream = 1;
+
+	*out_streams = 0;
+	if (opt->cloud_options->cp != CLOUD_NONE && opt->cloud_options->cp != CLOUD_INVALID){
+		*out_streams += cloud_stream_memory(opt->cloud_options->cp);
+		all_stream = cloud_stream_memory(opt->cloud_options->cp) > 0;
+		n++;
+	}
+	for (i = 0; i < opt->mirrors->len; ++i){
+		struct cloud_options* co;
+
+		if (co_from_string(opt->mirrors->strings[i], &co) != 0){
+			continue;
+		}
+		*out_streams += cloud_stream_memory(co->cp);
+		all_stream = all_stream && cloud_stream_memory(co->cp) > 0;
+		co_free(co);
+		n++;
+	}
+	if (!all_stream){
+		*out_streams = 0;
+	}
+	return n;
+}
+
+static uint64_t reserve_memory(const struct options* opt){
+	uint64_t streams;
+
+	return MEM_BUDGET_RESERVE + count_clouds(opt, &streams) * MEM_BUDGET_CLOUD;
+}
+
+uint64_t mem_budget_sort(const struct options* opt){
+	uint64_t limit = (uint64_t)opt->memory_limit << 20;
+	uint64_t reserve = reserve_memory(opt);
+	uint64_t sort = checksum_sort_memory((uint64_t)opt->sort_memory << 20);
+	uint64_t avail;
+
+	if (limit == 0){
+		return (uint64_t)opt->sort_memory << 20;
+	}
+	/* merge_files() reads ahead of every run on top of the runs themselves */
+	avail = limit > reserve + CHECKSUM_MERGE_MEMORY ? limit - reserve - CHECKSUM_MERGE_MEMORY : 0;
+	if (sort > avail){
+		sort = avail;
+	}
+	/* any less and the sort only makes runs a few records long */
+	return sort > CHECKSUM_SORT_MIN_MEMORY ? sort : CHECKSUM_SORT_MIN_MEMORY;
+}
+
+uint64_t mem_budget_per_file(const struct options* opt, int compression_level){
+	uint64_t read_len = opt->read_size ? (uint64_t)opt->read_size << 10 : SOURCE_READ_LEN;
+	uint64_t streams = 0;
+
+	if (opt->flags.bits.flag_io_uring){
+		read_len *= SOURCE_URING_DEPTH;
+	}
+	if (opt->flags.bits.flag_cloud_only){
+		count_clouds(opt, &streams);
+	}
+	/* the encryption and output buffers are BUFFER_LEN each */
+	return zip_encoder_memory(opt->c_type, compression_level, opt->c_flags) + read_len + 2 * BUFFER_LEN + streams;
+}
+
+/* the next level that uses less memory, or the same one if there is none */
+static int lower_level(enum compressor c_type, int level){
+	int next = zip_level_step(c_type, level, 1);
+
+	if (next != level){
+		return next;
+	}
+	/* 0 is the default, which zip_level_step() does not know, and 1 is the lowest every compressor but lz4 has */
+	return c_type != COMPRESSOR_LZ4 && c_type != COMPRESSOR_NONE && level != 1 ? 1 : level;
+}
+
+int mem_budget_plan(const struct options* opt, struct options* out, struct mem_budget* mb){
+	uint64_t avail;
+	unsigned n;
+
+	return_ifnull(opt, -1);
+	return_ifnull(out, -1);
+	return_ifnull(mb, -1);
+
+	*out = *opt;
+	memset(mb, 0, sizeof(*mb));
+	mb->limit = (uint64_t)opt->memory_limit << 20;
+	mb->n_threads = opt->n_threads;
+	mb->fits = 1;
+	if (mb->limit == 0){
+		return 0;
+	}
+	if (opt->c_type == COMPRESSOR_INVALID){
+		log_error("The compressor has to be known to plan its memory");
+		return -1;
+	}
+
+	mb->reserve = reserve_memory(opt);
+	mb->sort = mem_budget_sort(opt);
+	out->sort_memory = (unsigned long)(mb->sort >> 20);
+	avail = mb->limit > mb->reserve ? mb->limit - mb->reserve : 0;
+
+	n = opt->n_threads ? opt->n_threads : (unsigned)tp_cpu_count();
+	n = n > 0 ? n : 1;
+	for (;;){
+		unsigned workers = ZIP_GET_WORKERS(out->c_flags);
+		int level;
+
+		mb->per_file = mem_budget_per_file(out, out->c_level);
+		if ((uint64_t)n * mb->per_file <= avail){
+			break;
+		}
+
+		/* a file's own workers multiply its compressor, and other files keep the cores busy anyway */
+		if (workers > 1){
+			out->c_flags = (out->c_flags & ~ZIP_WORKERS(0xFF)) | ZIP_WORKERS(workers / 2);
+		}
+		else if (n > 1){
+			/* this is less than n, since n of them did not fit */
+			n = avail / mb->per_file > 0 ? (unsigned)(avail / mb->per_file) : 1;
+		}
+		else if (out->c_type == COMPRESSOR_ZSTD && (out->c_flags & ZSTD_LONG)){
+			out->c_flags &= ~ZSTD_LONG;
+		}
+		else if (out->c_type == COMPRESSOR_XZ && (out->c_flags & XZ_EXTREME)){
+			out->c_flags &= ~XZ_EXTREME;
+		}
+		else if (out->read_size == 0 || out->read_size > MEM_BUDGET_MIN_READ || out->flags.bits.flag_io_uring){
+			out->read_size = MEM_BUDGET_MIN_READ;
+			out->flags.bits.flag_io_uring = 0;
+		}
+		else if ((level = lower_level(out->c_type, out->c_level)) != out->c_level){
+			out->c_level = level;
+		}
+		else{
+			mb->fits = 0;
+			break;
+		}
+	}
+
+	mb->n_threads = n;
+	out->n_threads = n;
+	return mb->fits ? 0 : 1;
+}
+
+int mem_budget_level_fits(const struct options* opt, int compression_level){
+	uint64_t limit = (uint64_t)opt->memory_limit << 20;
+	uint64_t reserve = reserve_memory(opt);
+	unsigned n = opt->n_threads ? opt->n_threads : (unsigned)tp_cpu_count();
+
+	if (limit == 0){
+		return 1;
+	}
+	return limit > reserve && (uint64_t)n * mem_budget_per_file(opt, compression_level) <= limit - reserve;
+}
+
+void mem_budget_print(const struct mem_budget* mb, FILE* fp){
+	if (mb->limit == 0){
+		return;
+	}
+	fprintf(fp, "Memory limit %.0f MiB: %.1f MiB sort, %u file(s) at once with %.1f MiB each, %.1f MiB reserved\n", mb->limit / MIB, mb->sort / MIB, mb->n_threads, mb->per_file / MIB, mb->reserve / MIB);
+}
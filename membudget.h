@@ -0,0 +1,96 @@
+/** @file membudget.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ *
+ * Divides a backup's memory limit among the checksum sort, the files compressed at once, and the rest of the program.<br>
+ * Nothing is refused memory once the backup is running. Instead, every setting that decides how much is used is lowered beforehand until the estimate fits.
+ */
+
+#ifndef __MEMBUDGET_H
+#define __MEMBUDGET_H
+
+#include "options/options.h"
+#include <stdint.h>
+#include <stdio.h>
+
+#define MEM_BUDGET_RESERVE ((uint64_t)64 << 20) /**< @brief Kept back for what does not depend on the settings, such as the list of files found, the compression sample, and the threads' stacks (64MiB). */
+#define MEM_BUDGET_CLOUD ((uint64_t)32 << 20)   /**< @brief Kept back for each cloud session, such as the account's nodes and the connections (32MiB). */
+#define MEM_BUDGET_MIN_READ 64                  /**< @brief The read size in KiB that the last resort lowers the read size to. @see options::read_size */
+
+/**
+ * @brief How a memory limit was divided.
+ */
+struct mem_budget{
+	uint64_t limit;     /**< @brief The limit in bytes, or 0 if there is none. */
+	uint64_t reserve;   /**< @brief What is kept back for the rest of the program and the cloud sessions. */
+	uint64_t sort;      /**< @brief What sorting the checksum files gets. It happens before and after the files are copied, never while they are, so it gets all of the rest. */
+	uint64_t per_file;  /**< @brief What copying one file takes: its compressor, its read buffers, and its upload streams. */
+	unsigned n_threads; /**< @brief How many files are copied at once. */
+	int fits;           /**< @brief Non-zero if the estimate fits, or 0 if it does not even with every setting as low as it goes. */
+};
+
+/**
+ * @brief Gets how much memory sorting the checksum files gets under a memory limit.<br>
+ * Unlike mem_budget_plan(), this does not need the compressor to be known.
+ *
+ * @param opt The options, whose memory_limit and sort_memory are used.
+ *
+ * @return The memory in bytes, or 0 to let checksum_sort_memory() pick it.
+ */
+uint64_t mem_budget_sort(const struct options* opt);
+
+/**
+ * @brief Estimates how much memory copying one file takes with a set of options.
+ *
+ * @param opt The options.<br>
+ * The compressor has to be known, so c_type cannot be COMPRESSOR_INVALID.
+ *
+ * @param compression_level The compression level to estimate for, in place of opt->c_level.
+ *
+ * @return The estimate in bytes.
+ * @see zip_encoder_memory()
+ */
+uint64_t mem_budget_per_file(const struct options* opt, int compression_level);
+
+/**
+ * @brief Lowers the settings of a backup until its estimated memory fits its memory limit.<br>
+ * Whatever costs the least is given up first: the worker threads of a single file, then files copied at once, then long distance matching and extreme mode, then the read size, and finally the compression level.
+ *
+ * @param opt The options.<br>
+ * The compressor has to be known, so c_type cannot be COMPRESSOR_INVALID.
+ *
+ * @param out Set to a copy of opt with the lowered settings, which shares opt's pointers.<br>
+ * The sort memory is set to what the sort gets, and n_threads is never 0 if there is a limit.
+ *
+ * @param mb Set to how the limit was divided.
+ *
+ * @return 0 if the estimate fits or there is no limit, positive if it does not fit even with every setting as low as it goes, or negative on failure.
+ */
+int mem_budget_plan(const struct options* opt, struct options* out, struct mem_budget* mb);
+
+/**
+ * @brief Checks if a compression level still fits the memory limit, so a level picked while the backup runs does not go over it.
+ *
+ * @param opt The options, as lowered by mem_budget_plan().
+ *
+ * @param compression_level The level.
+ *
+ * @return Non-zero if it fits or there is no limit, or 0 if not.
+ */
+int mem_budget_level_fits(const struct options* opt, int compression_level);
+
+/**
+ * @brief Prints how a memory limit was divided.
+ *
+ * @param mb The division, as filled by mem_budget_plan().
+ *
+ * @param fp The stream to print to.
+ *
+ * @return void
+ */
+void mem_budget_print(const struct mem_budget* mb, FILE* fp);
+
+#endif
@@ -0,0 +1,262 @@
+/** @file moveindex.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "moveindex.h"
+#include "checksumsort.h"
+#include "strings/stringhelper.h"
+#include "log.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MOVE_INDEX_BUCKETS 1024
+
+struct move_entry{
+	char* file;
+	char* checksum;
+	uint64_t size;
+	/* the file's output no longer holds these contents, or is about to not */
+	int stale;
+	struct move_entry* next_size;
+	struct move_entry* next_file;
+};
+
+/* every entry is in two tables, one to find contents by their size and one to find a file's entries by its path */
+struct move_index{
+	struct move_entry** by_size;
+	struct move_entry** by_file;
+	size_t n_buckets;
+	size_t n_entries;
+	pthread_mutex_t mutex;
+};
+
+static size_t hash_size(uint64_t size, size_t n_buckets){
+	/* sizes that are multiples of a block size would otherwise all land in the same few buckets */
+	uint32_t h = (uint32_t)(size ^ (size >> 32)) * 2654435761U;
+
+	return (size_t)((h ^ (h >> 16)) % n_buckets);
+}
+
+/* FNV-1a */
+static size_t hash_file(const char* file, size_t n_buckets){
+	uint32_t h = 2166136261U;
+
+	for (; *file; ++file){
+		h = (h ^ (unsigned char)*file) * 16777619U;
+	}
+	return (size_t)(h % n_buckets);
+}
+
+static struct move_entry** new_buckets(size_t n_buckets){
+	struct move_entry** buckets = calloc(n_buckets, sizeof(*buckets));
+
+	if (!buckets){
+		log_enomem();
+	}
+	return buckets;
+}
+
+struct move_index* move_index_new(void){
+	struct move_index* mi;
+
+	if (!(mi = calloc(1, sizeof(*mi)))){
+		log_enomem();
+		return NULL;
+	}
+	mi->n_buckets = MOVE_INDEX_BUCKETS;
+	if (!(mi->by_size = new_buckets(mi->n_buckets)) || !(mi->by_file = new_buckets(mi->n_buckets))){
+		free(mi->by_size);
+		free(mi);
+		return NULL;
+	}
+	pthread_mutex_init(&mi->mutex, NULL);
+	return mi;
+}
+
+/* doubles the buckets once there are twice as many entries, and keeps the old ones if there is no memory for more */
+static void grow(struct move_index* mi){
+	struct move_entry** by_size;
+	struct move_entry** by_file;
+	size_t n_buckets = mi->n_buckets * 2;
+	size_t i;
+
+	if (!(by_size = calloc(n_buckets, sizeof(*by_size))) || !(by_file = calloc(n_buckets, sizeof(*by_file)))){
+		free(by_size);
+		return;
+	}
+	/* every entry is in both tables, so walking one of them moves all of them */
+	for (i = 0; i < mi->n_buckets; ++i){
+		struct move_entry* e = mi->by_size[i];
+
+		while (e){
+			struct move_entry* next = e->next_size;
+			size_t b_size = hash_size(e->size, n_buckets);
+			size_t b_file = hash_file(e->file, n_buckets);
+
+			e->next_size = by_size[b_size];
+			by_size[b_size] = e;
+			e->next_file = by_file[b_file];
+			by_file[b_file] = e;
+			e = next;
+		}
+	}
+	free(mi->by_size);
+	free(mi->by_file);
+	mi->by_size = by_size;
+	mi->by_file = by_file;
+	mi->n_buckets = n_buckets;
+}
+
+/* the caller holds the mutex */
+static int add_entry(struct move_index* mi, const char* file, const char* checksum, uint64_t size){
+	struct move_entry* e;
+	size_t b;
+
+	if (!(e = calloc(1, sizeof(*e))) || !(e->file = sh_dup(file)) || !(e->checksum = sh_dup(checksum))){
+		log_enomem();
+		e ? free(e->file) : (void)0;
+		free(e);
+		return -1;
+	}
+	e->size = size;
+
+	b = hash_size(size, mi->n_buckets);
+	e->next_size = mi->by_size[b];
+	mi->by_size[b] = e;
+	b = hash_file(file, mi->n_buckets);
+	e->next_file = mi->by_file[b];
+	mi->by_file[b] = e;
+
+	if (++mi->n_entries > mi->n_buckets * 2){
+		grow(mi);
+	}
+	return 0;
+}
+
+int move_index_load(struct move_index* mi, FILE* fp_checksums, uint64_t min_size){
+	struct checksum_reader* cr;
+	const struct element* e;
+	int res;
+	int ret = 0;
+
+	return_ifnull(mi, -1);
+	return_ifnull(fp_checksums, -1);
+
+	if (min_size < MOVE_INDEX_MIN_SIZE){
+		min_size = MOVE_INDEX_MIN_SIZE;
+	}
+
+	rewind(fp_checksums);
+	if (!(cr = checksum_reader_new(fp_checksums, 0))){
+		return -1;
+	}
+	pthread_mutex_lock(&mi->mutex);
+	while ((res = checksum_reader_next(cr, &e)) == 0){
+		/* a file recorded without its metadata cannot be told apart by its size */
+		if (e->meta && e->meta->size >= min_size && add_entry(mi, e->file, e->checksum, e->meta->size) != 0){
+			ret = -1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&mi->mutex);
+	if (res < 0){
+		log_error("Failed to read the checksum file");
+		ret = -1;
+	}
+	checksum_reader_free(cr);
+	rewind(fp_checksums);
+	return ret;
+}
+
+int move_index_add(struct move_index* mi, const char* file, const char* checksum, uint64_t size){
+	int ret;
+
+	return_ifnull(mi, -1);
+	return_ifnull(file, -1);
+	return_ifnull(checksum, -1);
+
+	if (size < MOVE_INDEX_MIN_SIZE){
+		return 0;
+	}
+	pthread_mutex_lock(&mi->mutex);
+	ret = add_entry(mi, file, checksum, size);
+	pthread_mutex_unlock(&mi->mutex);
+	return ret;
+}
+
+void move_index_forget(struct move_index* mi, const char* file){
+	struct move_entry* e;
+
+	if (!mi || !file){
+		return;
+	}
+	pthread_mutex_lock(&mi->mutex);
+	for (e = mi->by_file[hash_file(file, mi->n_buckets)]; e; e = e->next_file){
+		if (!strcmp(e->file, file)){
+			e->stale = 1;
+		}
+	}
+	pthread_mutex_unlock(&mi->mutex);
+}
+
+int move_index_has_size(struct move_index* mi, uint64_t size){
+	struct move_entry* e;
+	int found = 0;
+
+	if (!mi || size < MOVE_INDEX_MIN_SIZE){
+		return 0;
+	}
+	pthread_mutex_lock(&mi->mutex);
+	for (e = mi->by_size[hash_size(size, mi->n_buckets)]; e && !found; e = e->next_size){
+		found = e->size == size && !e->stale;
+	}
+	pthread_mutex_unlock(&mi->mutex);
+	return found;
+}
+
+int move_index_use(struct move_index* mi, const char* checksum, uint64_t size, int (*func)(const char* file, void* data), void* data){
+	struct move_entry* e;
+	int ret = 1;
+
+	return_ifnull(mi, -1);
+	return_ifnull(checksum, -1);
+	return_ifnull(func, -1);
+
+	pthread_mutex_lock(&mi->mutex);
+	for (e = mi->by_size[hash_size(size, mi->n_buckets)]; e && ret != 0; e = e->next_size){
+		if (e->size == size && !e->stale && !strcmp(e->checksum, checksum) && func(e->file, data) == 0){
+			ret = 0;
+		}
+	}
+	pthread_mutex_unlock(&mi->mutex);
+	return ret;
+}
+
+void move_index_free(struct move_index* mi){
+	size_t i;
+
+	if (!mi){
+		return;
+	}
+	for (i = 0; i < mi->n_buckets; ++i){
+		struct move_entry* e = mi->by_size[i];
+
+		while (e){
+			struct move_entry* next = e->next_size;
+
+			free(e->file);
+			free(e->checksum);
+			free(e);
+			e = next;
+		}
+	}
+	free(mi->by_size);
+	free(mi->by_file);
+	pthread_mutex_destroy(&mi->mutex);
+	free(mi);
+}
@@ -0,0 +1,121 @@
+/** @file moveindex.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ *
+ * Finds the output of a file that has the same contents as one about to be backed up under a new path, such as a file that was moved, renamed, or hardlinked.<br>
+ * The output of the old path can then be linked to the new one, instead of the file being compressed, encrypted and written all over again.<br>
+ * <br>
+ * Only files of at least MOVE_INDEX_MIN_SIZE bytes are kept, with their path, size, and checksum, so a new file is only hashed ahead of copying it if there is an output of the same size to link to.
+ */
+
+#ifndef __MOVEINDEX_H
+#define __MOVEINDEX_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifndef __GNUC__
+#define __attribute__(x)
+#endif
+
+#define MOVE_INDEX_MIN_SIZE ((uint64_t)1 << 16) /**< @brief Files smaller than this are always copied, since hashing them first costs about as much (64KiB). */
+
+/**
+ * @brief The outputs known by their contents.
+ */
+struct move_index;
+
+/**
+ * @brief Creates an empty index.
+ *
+ * @return The index, or NULL on failure.<br>
+ * This must be freed with move_index_free() when no longer in use.
+ */
+struct move_index* move_index_new(void) __attribute__((malloc));
+
+/**
+ * @brief Adds every file in a checksum file that was recorded with its size.
+ *
+ * @param mi The index.
+ *
+ * @param fp_checksums The checksum file, which can be front-coded. It is read from its start, and rewound afterwards.
+ *
+ * @param min_size Files smaller than this are left out. It is raised to MOVE_INDEX_MIN_SIZE if it is less.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int move_index_load(struct move_index* mi, FILE* fp_checksums, uint64_t min_size);
+
+/**
+ * @brief Adds a file whose output now holds certain contents.<br>
+ * This is thread-safe.
+ *
+ * @param mi The index.
+ *
+ * @param file The path of the file, whose output is named after it.
+ *
+ * @param checksum The checksum of its contents.
+ *
+ * @param size Its size in bytes. Nothing is added if this is less than MOVE_INDEX_MIN_SIZE.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int move_index_add(struct move_index* mi, const char* file, const char* checksum, uint64_t size);
+
+/**
+ * @brief Forgets the contents of a file's output, which must be called before its output is replaced or moved.<br>
+ * This waits for anything being linked to the output to finish. It is thread-safe.
+ *
+ * @param mi The index.
+ *
+ * @param file The path of the file.
+ *
+ * @return void
+ */
+void move_index_forget(struct move_index* mi, const char* file);
+
+/**
+ * @brief Checks if any output of a certain size is known, so a file that has none does not need to be hashed before it is copied.<br>
+ * This is thread-safe.
+ *
+ * @param mi The index.
+ *
+ * @param size The size in bytes.
+ *
+ * @return Non-zero if there is one, or 0 if not.
+ */
+int move_index_has_size(struct move_index* mi, uint64_t size);
+
+/**
+ * @brief Calls a function on the outputs with certain contents until it succeeds on one.<br>
+ * The function is called with the index locked, so none of those outputs can be forgotten and replaced while it uses them. It is thread-safe.
+ *
+ * @param mi The index.
+ *
+ * @param checksum The checksum of the contents.
+ *
+ * @param size The size of the contents.
+ *
+ * @param func The function, which gets the path of a file whose output holds the contents.<br>
+ * It must return 0 if it used the output, or non-zero to try the next one.<br>
+ * It must not call any other move_index function.
+ *
+ * @param data An extra argument to pass to func.
+ *
+ * @return 0 if func used one, or positive if there is none it could use.
+ */
+int move_index_use(struct move_index* mi, const char* checksum, uint64_t size, int (*func)(const char* file, void* data), void* data);
+
+/**
+ * @brief Frees an index.
+ *
+ * @param mi The index. This can be NULL.
+ *
+ * @return void
+ */
+void move_index_free(struct move_index* mi);
+
+#endif
@@ -14,6 +14,9 @@
 #include "../filehelper.h"
 #include "../strings/stringhelper.h"
 #include "../compression/zip.h"
+#include "../checksum.h"
+#include "../zipauto.h"
+#include "../policy.h"
 #include "../readline_include.h"
 #include <errno.h>
 #include <stdio.h>
@@ -58,20 +61,62 @@ void version(void){
 void usage(const char* progname){
 	return_ifnull(progname, ;);
 
-	printf("Usage: %s (backup|restore|configure) [options]\n", progname);
+	printf("Usage: %s (backup|restore|verify|watch|prune|daemon|estimate|configure) [options]\n", progname);
 	printf("Options:\n");
-	printf("\t-c, --compressor <gz|bz2|...>\n");
-	printf("\t-C, --checksum <md5|sha1|...>\n");
+	printf("\t    --at <1500000000|...> (s since the epoch)\n");
+	printf("\t    --background\n");
+	printf("\t    --binary-deltas\n");
+	printf("\t-c, --compressor <gz|bz2|auto|...>\n");
+	printf("\t    --compress-target <0|50|200|...> (MiB/s, or Mbit/s with an mbit suffix)\n");
+	printf("\t    --compress-workers <0|1|2|...>\n");
+	printf("\t-C, --checksum <xxh64|sha1|auto|...>\n");
+	printf("\t    --change-journal </path/to/journal>\n");
 	printf("\t-d, --directories </dir1 /dir2 /...>\n");
+	printf("\t-D, --dedup\n");
+	printf("\t    --detect-moves\n");
+	printf("\t    --device-threads <0|1|4|...>\n");
+	printf("\t    --dictionary <0|4096|65536|...>\n");
+	printf("\t    --direct-io\n");
+	printf("\t    --durable\n");
 	printf("\t-e, --encryption <aes-256-cbc|seed-ctr|...>\n");
+	printf("\t-F, --front-code\n");
 	printf("\t-h, --help\n");
-	printf("\t-i, --cloud <mega|...>\n");
+	printf("\t    --hash-benchmark\n");
+	printf("\t-i, --cloud <mega|s3|...>\n");
+	printf("\t    --cloud-only\n");
 	printf("\t-I, --upload_directory </dir1/dir2/...>\n");
+	printf("\t    --interval <0|3600|86400|...> (s)\n");
+	printf("\t    --upload-limit <512K|08:00-18:00=1M,0|...> (bytes/s)\n");
+	printf("\t    --verify-artifacts\n");
+	printf("\t    --io-uring\n");
+	printf("\t-k, --pack <0|4096|65536|...>\n");
+	printf("\t    --keep-daily <0|7|30|...>\n");
+	printf("\t    --keep-last <0|1|10|...>\n");
+	printf("\t    --mirror <s3:/bucket/dir|mega:user@example.com:/dir|...>\n");
+	printf("\t-m, --sort-memory <0|256|4096|...> (MiB)\n");
+	printf("\t    --memory-limit <0|512|2048|...> (MiB)\n");
+	printf("\t    --metrics </path/to/ezbackup.prom>\n");
 	printf("\t-o, --output </out/dir>\n");
 	printf("\t-p, --password <password>\n");
+	printf("\t-P, --paranoid\n");
+	printf("\t    --parallel-walk\n");
+	printf("\t    --policy <'/var/lib/hot=lz4'|'/archive=xz:9'|'*.mp4=none,plain'|...>\n");
 	printf("\t-q, --quiet\n");
+	printf("\t-r, --restore_directory </restore/dir>\n");
+	printf("\t    --read-size <0|64|4096|...> (KiB)\n");
+	printf("\t    --snapshot <btrfs|zfs|none>\n");
+	printf("\t-s, --stats </path/to/stats.tsv>\n");
+	printf("\t    --seekable <0|1|16|...> (MiB)\n");
+	printf("\t    --socket </run/ezbackup.sock>\n");
+	printf("\t    --store-incompressible\n");
+	printf("\t-t, --threads <0|1|2|...>\n");
+	printf("\t-T, --tree-hash\n");
+	printf("\t    --trace </path/to/trace.json>\n");
 	printf("\t-u, --username <username>\n");
 	printf("\t-x, --exclude </dir1 /dir2 /...>\n");
+	printf("\t-X, --xattr-cache\n");
+	printf("\t    --xz-block <0|1|16|...> (MiB)\n");
+	printf("\t    --zstd-long\n");
 }
 
 static int get_default_backup_directory(char** out){
@@ -140,12 +185,28 @@ int parse_options_cmdline(int argc, char** argv, struct options** output, enum o
 			usage(argv[0]);
 			exit(0);
 		}
+		else if (!strcmp(argv[i], "--hash-benchmark")){
+			*out_op = OP_HASH_BENCHMARK;
+		}
 		/* compression */
 		else if (!strcmp(argv[i], "-c") ||
 				!strcmp(argv[i], "--compressor")){
 			/* check next argument */
 			++i;
+			if (i >= argc){
+				return i - 1;
+			}
+			/* the compressor is picked when the backup starts, from how fast each one is on its files */
+			if (sh_ncasecmp(argv[i], ZIP_AUTO_NAME) == 0){
+				out->flags.bits.flag_auto_compressor = 1;
+				out->c_target = out->c_target ? out->c_target : ZIP_AUTO_TARGET;
+				continue;
+			}
 			out->c_type = get_compressor_byname(argv[i]);
+			if (out->c_type == COMPRESSOR_INVALID){
+				return i;
+			}
+			out->flags.bits.flag_auto_compressor = 0;
 		}
 		/* checksum */
 		else if (!strcmp(argv[i], "-C") ||
@@ -153,7 +214,7 @@ int parse_options_cmdline(int argc, char** argv, struct options** output, enum o
 			/* check next argument */
 			++i;
 			OpenSSL_add_all_algorithms();
-			out->hash_algorithm = EVP_get_digestbyname(argv[i]);
+			out->hash_algorithm = get_evp_md(argv[i]);
 		}
 		/* encryption */
 		else if (!strcmp(argv[i], "-e") ||
@@ -168,6 +229,71 @@ int parse_options_cmdline(int argc, char** argv, struct options** output, enum o
 				!strcmp(argv[i], "--quiet")){
 			out->flags.bits.flag_verbose = 0;
 		}
+		/* dedup */
+		else if (!strcmp(argv[i], "-D") ||
+				!strcmp(argv[i], "--dedup")){
+			out->flags.bits.flag_dedup = 1;
+		}
+		/* paranoid */
+		else if (!strcmp(argv[i], "-P") ||
+				!strcmp(argv[i], "--paranoid")){
+			out->flags.bits.flag_paranoid = 1;
+		}
+		/* tree hash */
+		else if (!strcmp(argv[i], "-T") ||
+				!strcmp(argv[i], "--tree-hash")){
+			out->flags.bits.flag_tree_hash = 1;
+		}
+		/* checksum cache */
+		else if (!strcmp(argv[i], "-X") ||
+				!strcmp(argv[i], "--xattr-cache")){
+			out->flags.bits.flag_xattr_cache = 1;
+		}
+		/* front-coded checksum file */
+		else if (!strcmp(argv[i], "-F") ||
+				!strcmp(argv[i], "--front-code")){
+			out->flags.bits.flag_front_code = 1;
+		}
+		/* walk directories on several threads */
+		else if (!strcmp(argv[i], "--parallel-walk")){
+			out->flags.bits.flag_parallel_walk = 1;
+		}
+		/* read around the page cache */
+		else if (!strcmp(argv[i], "--direct-io")){
+			out->flags.bits.flag_direct_io = 1;
+		}
+		/* survive a power loss without redoing or losing recorded files */
+		else if (!strcmp(argv[i], "--durable")){
+			out->flags.bits.flag_durable = 1;
+		}
+		/* keep several reads in flight */
+		else if (!strcmp(argv[i], "--io-uring")){
+			out->flags.bits.flag_io_uring = 1;
+		}
+		/* upload without keeping a local copy */
+		else if (!strcmp(argv[i], "--cloud-only")){
+			out->flags.bits.flag_cloud_only = 1;
+		}
+		/* stay out of the way of everything else on the host */
+		else if (!strcmp(argv[i], "--background")){
+			out->flags.bits.flag_background = 1;
+		}
+		/* store replaced versions as deltas against their replacements */
+		else if (!strcmp(argv[i], "--binary-deltas")){
+			out->flags.bits.flag_binary_deltas = 1;
+		}
+		/* link moved files to their old output */
+		else if (!strcmp(argv[i], "--detect-moves")){
+			out->flags.bits.flag_detect_moves = 1;
+		}
+		/* verify the stored outputs without restoring them */
+		else if (!strcmp(argv[i], "--verify-artifacts")){
+			out->flags.bits.flag_verify_artifacts = 1;
+		}
+		/* skip compressing what will not shrink */
+		else if (!strcmp(argv[i], "--store-incompressible")){
+			out->flags.bits.flag_store_incompressible = 1;
+		}
 		/* outfile */
 		else if (!strcmp(argv[i], "-o") ||
 				!strcmp(argv[i], "--output")){
@@ -181,6 +307,115 @@ int parse_options_cmdline(int argc, char** argv, struct options** output, enum o
 			out->output_directory = malloc(strlen(argv[i]) + 1);
 			strcpy(out->output_directory, argv[i]);
 		}
+		/* restore directory */
+		else if (!strcmp(argv[i], "-r") ||
+				!strcmp(argv[i], "--restore_directory")){
+			++i;
+			if (i >= argc){
+				return i - 1;
+			}
+			free(out->restore_directory);
+			if (!(out->restore_directory = sh_dup(argv[i]))){
+				log_enomem();
+				return -1;
+			}
+		}
+		/* snapshot */
+		else if (!strcmp(argv[i], "--snapshot")){
+			++i;
+			if (i >= argc){
+				return i - 1;
+			}
+			out->snapshot = snapshot_type_from_string(argv[i]);
+			if (out->snapshot == SNAPSHOT_INVALID){
+				return i;
+			}
+		}
+		/* change journal */
+		else if (!strcmp(argv[i], "--change-journal")){
+			++i;
+			if (i >= argc){
+				return i - 1;
+			}
+			free(out->change_journal);
+			if (!(out->change_journal = sh_dup(argv[i]))){
+				log_enomem();
+				return -1;
+			}
+		}
+		/* daemon socket */
+		else if (!strcmp(argv[i], "--socket")){
+			++i;
+			if (i >= argc){
+				return i - 1;
+			}
+			free(out->socket_file);
+			if (!(out->socket_file = sh_dup(argv[i]))){
+				log_enomem();
+				return -1;
+			}
+		}
+		/* point in time to restore */
+		else if (!strcmp(argv[i], "--at")){
+			char* endptr;
+			++i;
+			if (i >= argc){
+				return i - 1;
+			}
+			out->restore_time = strtoul(argv[i], &endptr, 10);
+			if (*argv[i] == '\0' || *endptr != '\0'){
+				return i;
+			}
+		}
+		/* daemon interval */
+		else if (!strcmp(argv[i], "--interval")){
+			char* endptr;
+			++i;
+			if (i >= argc){
+				return i - 1;
+			}
+			out->interval = strtoul(argv[i], &endptr, 10);
+			if (*argv[i] == '\0' || *endptr != '\0'){
+				return i;
+			}
+		}
+		/* stats file */
+		else if (!strcmp(argv[i], "-s") ||
+				!strcmp(argv[i], "--stats")){
+			++i;
+			if (i >= argc){
+				return i - 1;
+			}
+			free(out->stats_file);
+			if (!(out->stats_file = sh_dup(argv[i]))){
+				log_enomem();
+				return -1;
+			}
+		}
+		/* trace file */
+		else if (!strcmp(argv[i], "--trace")){
+			++i;
+			if (i >= argc){
+				return i - 1;
+			}
+			free(out->trace_file);
+			if (!(out->trace_file = sh_dup(argv[i]))){
+				log_enomem();
+				return -1;
+			}
+		}
+		/* metrics file */
+		else if (!strcmp(argv[i], "--metrics")){
+			++i;
+			if (i >= argc){
+				return i - 1;
+			}
+			free(out->metrics_file);
+			if (!(out->metrics_file = sh_dup(argv[i]))){
+				log_enomem();
+				return -1;
+			}
+		}
 		/* exclude */
 		else if (!strcmp(argv[i], "-x") ||
 				!strcmp(argv[i], "--exclude")){
@@ -215,6 +450,183 @@ int parse_options_cmdline(int argc, char** argv, struct options** output, enum o
 				return -1;
 			}
 		}
+		/* compression flags */
+		else if (!strcmp(argv[i], "--zstd-long")){
+			out->c_flags |= ZSTD_LONG;
+		}
+		else if (!strcmp(argv[i], "--compress-workers")){
+			char* endptr;
+			unsigned long workers;
+			++i;
+			if (i >= argc){
+				return i - 1;
+			}
+			workers = strtoul(argv[i], &endptr, 10);
+			if (*argv[i] == '\0' || *endptr != '\0' || workers > ZIP_GET_WORKERS(~0U)){
+				return i;
+			}
+			out->c_flags = (out->c_flags & ~ZIP_WORKERS(0xFF)) | ZIP_WORKERS(workers);
+		}
+		else if (!strcmp(argv[i], "--compress-target")){
+			char* endptr;
+			unsigned long target;
+			++i;
+			if (i >= argc){
+				return i - 1;
+			}
+			target = strtoul(argv[i], &endptr, 10);
+			if (*argv[i] == '\0' || target > (~0UL >> 20)){
+				return i;
+			}
+			/* network links are rated in megabits, disks in megabytes */
+			if (sh_ncasecmp(endptr, "mbit") == 0){
+				out->c_target = target * 1000000UL / 8;
+			}
+			else if (*endptr == '\0'){
+				out->c_target = target << 20;
+			}
+			else{
+				return i;
+			}
+		}
+		else if (!strcmp(argv[i], "--xz-block")){
+			char* endptr;
+			unsigned long block_mib;
+			++i;
+			if (i >= argc){
+				return i - 1;
+			}
+			block_mib = strtoul(argv[i], &endptr, 10);
+			if (*argv[i] == '\0' || *endptr != '\0' || block_mib > XZ_GET_BLOCK_MIB(~0U)){
+				return i;
+			}
+			out->c_flags = (out->c_flags & ~XZ_BLOCK_MIB(0xFF)) | XZ_BLOCK_MIB(block_mib);
+		}
+		/* outputs that part of can be restored without the rest */
+		else if (!strcmp(argv[i], "--seekable")){
+			char* endptr;
+			unsigned long block_mib;
+			++i;
+			if (i >= argc){
+				return i - 1;
+			}
+			block_mib = strtoul(argv[i], &endptr, 10);
+			if (*argv[i] == '\0' || *endptr != '\0' || block_mib > ZIP_GET_SEEKABLE_MIB(~0U)){
+				return i;
+			}
+			out->c_flags = (out->c_flags & ~ZIP_SEEKABLE_MIB(0xFF)) | ZIP_SEEKABLE_MIB(block_mib);
+		}
+		/* threads */
+		else if (!strcmp(argv[i], "-t") ||
+				!strcmp(argv[i], "--threads")){
+			char* endptr;
+			++i;
+			if (i >= argc){
+				return i - 1;
+			}
+			out->n_threads = strtoul(argv[i], &endptr, 10);
+			if (*argv[i] == '\0' || *endptr != '\0'){
+				return i;
+			}
+		}
+		/* per-device threads */
+		else if (!strcmp(argv[i], "--device-threads")){
+			char* endptr;
+			++i;
+			if (i >= argc){
+				return i - 1;
+			}
+			out->device_threads = strtoul(argv[i], &endptr, 10);
+			if (*argv[i] == '\0' || *endptr != '\0'){
+				return i;
+			}
+		}
+		/* pack threshold */
+		else if (!strcmp(argv[i], "-k") ||
+				!strcmp(argv[i], "--pack")){
+			char* endptr;
+			++i;
+			if (i >= argc){
+				return i - 1;
+			}
+			out->pack_threshold = strtoul(argv[i], &endptr, 10);
+			if (*argv[i] == '\0' || *endptr != '\0'){
+				return i;
+			}
+		}
+		/* generations kept as they are when pruning */
+		else if (!strcmp(argv[i], "--keep-last")){
+			char* endptr;
+			++i;
+			if (i >= argc){
+				return i - 1;
+			}
+			out->keep_last = strtoul(argv[i], &endptr, 10);
+			if (*argv[i] == '\0' || *endptr != '\0'){
+				return i;
+			}
+		}
+		/* days kept when pruning */
+		else if (!strcmp(argv[i], "--keep-daily")){
+			char* endptr;
+			++i;
+			if (i >= argc){
+				return i - 1;
+			}
+			out->keep_daily = strtoul(argv[i], &endptr, 10);
+			if (*argv[i] == '\0' || *endptr != '\0'){
+				return i;
+			}
+		}
+		/* dictionary threshold */
+		else if (!strcmp(argv[i], "--dictionary")){
+			char* endptr;
+			++i;
+			if (i >= argc){
+				return i - 1;
+			}
+			out->dict_threshold = strtoul(argv[i], &endptr, 10);
+			if (*argv[i] == '\0' || *endptr != '\0'){
+				return i;
+			}
+		}
+		/* sort memory */
+		else if (!strcmp(argv[i], "-m") ||
+				!strcmp(argv[i], "--sort-memory")){
+			char* endptr;
+			++i;
+			if (i >= argc){
+				return i - 1;
+			}
+			out->sort_memory = strtoul(argv[i], &endptr, 10);
+			if (*argv[i] == '\0' || *endptr != '\0'){
+				return i;
+			}
+		}
+		/* memory limit */
+		else if (!strcmp(argv[i], "--memory-limit")){
+			char* endptr;
+			++i;
+			if (i >= argc){
+				return i - 1;
+			}
+			out->memory_limit = strtoul(argv[i], &endptr, 10);
+			if (*argv[i] == '\0' || *endptr != '\0'){
+				return i;
+			}
+		}
+		/* source read size */
+		else if (!strcmp(argv[i], "--read-size")){
+			char* endptr;
+			++i;
+			if (i >= argc){
+				return i - 1;
+			}
+			out->read_size = strtoul(argv[i], &endptr, 10);
+			if (*argv[i] == '\0' || *endptr != '\0'){
+				return i;
+			}
+		}
 		else if (!strcmp(argv[i], "-i") ||
 				!strcmp(argv[i], "--cloud")){
 			++i;
@@ -228,6 +640,48 @@ int parse_options_cmdline(int argc, char** argv, struct options** output, enum o
 				return -1;
 			}
 		}
+		/* upload rate schedule */
+		else if (!strcmp(argv[i], "--upload-limit")){
+			++i;
+			if (i >= argc){
+				return i - 1;
+			}
+			if (co_set_upload_limit(out->cloud_options, argv[i]) != 0){
+				return i;
+			}
+		}
+		/* another cloud destination */
+		else if (!strcmp(argv[i], "--mirror")){
+			struct cloud_options* co;
+			++i;
+			if (i >= argc){
+				return i - 1;
+			}
+			if (co_from_string(argv[i], &co) != 0){
+				return i;
+			}
+			co_free(co);
+			if (sa_add(out->mirrors, argv[i]) != 0){
+				log_enomem();
+				return -1;
+			}
+		}
+		/* a different compressor or no encryption for some files */
+		else if (!strcmp(argv[i], "--policy")){
+			struct policy_rule rule;
+			++i;
+			if (i >= argc){
+				return i - 1;
+			}
+			if (policy_parse(argv[i], &rule) != 0){
+				return i;
+			}
+			free(rule.pattern);
+			if (sa_add(out->policies, argv[i]) != 0){
+				log_enomem();
+				return -1;
+			}
+		}
 		/* operation */
 		else if (argv[i][0] != '-'){
 			if (!strcmp(argv[i], "backup")){
@@ -236,6 +690,21 @@ int parse_options_cmdline(int argc, char** argv, struct options** output, enum o
 			else if (!strcmp(argv[i], "restore")){
 				*out_op = OP_RESTORE;
 			}
+			else if (!strcmp(argv[i], "verify")){
+				*out_op = OP_VERIFY;
+			}
+			else if (!strcmp(argv[i], "watch")){
+				*out_op = OP_WATCH;
+			}
+			else if (!strcmp(argv[i], "prune")){
+				*out_op = OP_PRUNE;
+			}
+			else if (!strcmp(argv[i], "daemon")){
+				*out_op = OP_DAEMON;
+			}
+			else if (!strcmp(argv[i], "estimate")){
+				*out_op = OP_ESTIMATE;
+			}
 			else if (!strcmp(argv[i], "configure")){
 				*out_op = OP_CONFIGURE;
 			}
@@ -255,6 +724,7 @@ int parse_options_cmdline(int argc, char** argv, struct options** output, enum o
 		log_error("Could not determine output directory");
 		return -1;
 	}
+	*output = out;
 	return 0;
 }
 
@@ -266,17 +736,41 @@ struct options* options_new(void){
 	}
 	opt->directories = sa_new();
 	opt->exclude = sa_new();
+	opt->mirrors = sa_new();
+	opt->policies = sa_new();
+	opt->policy_marked = 0;
 	opt->hash_algorithm = EVP_sha1();
 	opt->enc_algorithm = EVP_aes_256_cbc();
 	opt->enc_password = NULL;
+	opt->enc_session = NULL;
 	opt->c_type = COMPRESSOR_GZIP;
 	opt->c_level = 0;
 	memset(&(opt->c_flags), 0, sizeof(opt->c_flags));
+	opt->c_target = 0;
 	if (get_default_backup_directory(&(opt->output_directory)) != 0){
 		log_debug("Failed to make backup directory");
 		return NULL;
 	}
 	opt->cloud_options = co_new();
+	opt->n_threads = 0;
+	opt->device_threads = 0;
+	opt->pack_threshold = 0;
+	opt->dict_threshold = 0;
+	opt->c_dict = NULL;
+	opt->sort_memory = 0;
+	opt->read_size = 0;
+	opt->memory_limit = 0;
+	opt->keep_last = 0;
+	opt->keep_daily = 0;
+	opt->restore_directory = NULL;
+	opt->restore_time = 0;
+	opt->stats_file = NULL;
+	opt->metrics_file = NULL;
+	opt->trace_file = NULL;
+	opt->snapshot = SNAPSHOT_NONE;
+	opt->change_journal = NULL;
+	opt->socket_file = NULL;
+	opt->interval = 0;
 	opt->flags.dword = 0;
 	opt->flags.bits.flag_verbose = 1;
 
@@ -363,7 +857,7 @@ int parse_options_fromfile(const char* file, struct options** output){
 
 	res = binsearch_opt_entries((const struct opt_entry* const*)entries, entries_len, "HASH_ALGORITHM");
 	if (res >= 0){
-		opt->hash_algorithm = EVP_get_digestbyname(entries[res]->value);
+		opt->hash_algorithm = get_evp_md(entries[res]->value);
 	}
 	else{
 		log_warning("Key HASH_ALGORITHM missing from file");
@@ -413,6 +907,11 @@ int parse_options_fromfile(const char* file, struct options** output){
 		opt->c_flags = *(unsigned*)entries[res]->value;
 	}
 
+	res = binsearch_opt_entries((const struct opt_entry* const*)entries, entries_len, "C_TARGET");
+	if (res >= 0){
+		opt->c_target = *(unsigned long*)entries[res]->value;
+	}
+
 	res = binsearch_opt_entries((const struct opt_entry* const*)entries, entries_len, "OUTPUT_DIRECTORY");
 	if (res >= 0){
 		free(opt->output_directory);
@@ -468,6 +967,81 @@ int parse_options_fromfile(const char* file, struct options** output){
 		log_warning("Key CO_UPLOAD_DIRECTORY missing from file");
 	}
 
+	/* older files have no upload limit */
+	res = binsearch_opt_entries((const struct opt_entry* const*)entries, entries_len, "CO_UPLOAD_LIMIT");
+	if (res >= 0 && co_set_upload_limit(opt->cloud_options, entries[res]->value) != 0){
+		log_warning("Failed to read CO_UPLOAD_LIMIT");
+	}
+
+	/* older files have no mirrors */
+	res = binsearch_opt_entries((const struct opt_entry* const*)entries, entries_len, "MIRRORS");
+	if (res >= 0){
+		const char* str = entries[res]->value;
+		size_t ptr;
+		for (ptr = 0; ptr < entries[res]->value_len; ptr += strlen(&(str[ptr])) + 1){
+			if (sa_add(opt->mirrors, &(str[ptr])) != 0){
+				log_warning("Failed to add string to mirrors array");
+			}
+		}
+	}
+
+	/* older files have no policies */
+	res = binsearch_opt_entries((const struct opt_entry* const*)entries, entries_len, "POLICIES");
+	if (res >= 0){
+		const char* str = entries[res]->value;
+		size_t ptr;
+		for (ptr = 0; ptr < entries[res]->value_len; ptr += strlen(&(str[ptr])) + 1){
+			if (sa_add(opt->policies, &(str[ptr])) != 0){
+				log_warning("Failed to add string to policies array");
+			}
+		}
+	}
+
+	res = binsearch_opt_entries((const struct opt_entry* const*)entries, entries_len, "N_THREADS");
+	if (res >= 0){
+		opt->n_threads = *(unsigned*)entries[res]->value;
+	}
+
+	res = binsearch_opt_entries((const struct opt_entry* const*)entries, entries_len, "DEVICE_THREADS");
+	if (res >= 0){
+		opt->device_threads = *(unsigned*)entries[res]->value;
+	}
+
+	res = binsearch_opt_entries((const struct opt_entry* const*)entries, entries_len, "PACK_THRESHOLD");
+	if (res >= 0){
+		opt->pack_threshold = *(unsigned long*)entries[res]->value;
+	}
+
+	res = binsearch_opt_entries((const struct opt_entry* const*)entries, entries_len, "DICT_THRESHOLD");
+	if (res >= 0){
+		opt->dict_threshold = *(unsigned long*)entries[res]->value;
+	}
+
+	res = binsearch_opt_entries((const struct opt_entry* const*)entries, entries_len, "SORT_MEMORY");
+	if (res >= 0){
+		opt->sort_memory = *(unsigned long*)entries[res]->value;
+	}
+
+	res = binsearch_opt_entries((const struct opt_entry* const*)entries, entries_len, "MEMORY_LIMIT");
+	if (res >= 0){
+		opt->memory_limit = *(unsigned long*)entries[res]->value;
+	}
+
+	res = binsearch_opt_entries((const struct opt_entry* const*)entries, entries_len, "READ_SIZE");
+	if (res >= 0){
+		opt->read_size = *(unsigned long*)entries[res]->value;
+	}
+
+	res = binsearch_opt_entries((const struct opt_entry* const*)entries, entries_len, "KEEP_LAST");
+	if (res >= 0){
+		opt->keep_last = *(unsigned*)entries[res]->value;
+	}
+
+	res = binsearch_opt_entries((const struct opt_entry* const*)entries, entries_len, "KEEP_DAILY");
+	if (res >= 0){
+		opt->keep_daily = *(unsigned*)entries[res]->value;
+	}
+
 	res = binsearch_opt_entries((const struct opt_entry* const*)entries, entries_len, "FLAGS");
 	if (res >= 0){
 		opt->flags.dword = *(unsigned*)entries[res]->value;
@@ -552,7 +1126,7 @@ int write_options_tofile(const char* file, const struct options* opt){
 	free(tmp);
 	tmp = NULL;
 
-	if (add_option_tofile(fp, "HASH_ALGORITHM", EVP_MD_name(opt->hash_algorithm), strlen(EVP_MD_name(opt->hash_algorithm)) + 1) != 0){
+	if (add_option_tofile(fp, "HASH_ALGORITHM", get_evp_md_name(opt->hash_algorithm), strlen(get_evp_md_name(opt->hash_algorithm)) + 1) != 0){
 		log_warning("Failed to add HASH_ALGORITHM to file");
 	}
 
@@ -585,6 +1159,10 @@ int write_options_tofile(const char* file, const struct options* opt){
 		log_warning("Failed to add C_FLAGS to file");
 	}
 
+	if (add_option_tofile(fp, "C_TARGET", &(opt->c_target), sizeof(opt->c_target)) != 0){
+		log_warning("Failed to add C_TARGET to file");
+	}
+
 	if (add_option_tofile(fp, "OUTPUT_DIRECTORY", opt->output_directory, strlen(opt->output_directory) + 1) != 0){
 		log_warning("Failed to add OUTPUT_DIRECTORY to file");
 	}
@@ -613,6 +1191,90 @@ int write_options_tofile(const char* file, const struct options* opt){
 		log_warning("Failed to add CO_UPLOAD_DIRECTORY to file");
 	}
 
+	if (add_option_tofile(fp, "CO_UPLOAD_LIMIT", opt->cloud_options->upload_limit, opt->cloud_options->upload_limit ? strlen(opt->cloud_options->upload_limit) + 1 : 0) != 0){
+		log_warning("Failed to add CO_UPLOAD_LIMIT to file");
+	}
+
+	tmp_len = 0;
+	for (i = 0; i < opt->mirrors->len; ++i){
+		tmp_len += strlen(opt->mirrors->strings[i]) + 1;
+	}
+	if (tmp_len > 0 && !(tmp = malloc(tmp_len))){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+	tmp_old = tmp;
+	for (i = 0; i < opt->mirrors->len; ++i){
+		memcpy(tmp, opt->mirrors->strings[i], strlen(opt->mirrors->strings[i]) + 1);
+		tmp += strlen(opt->mirrors->strings[i]) + 1;
+	}
+	tmp = tmp_old;
+	tmp_old = NULL;
+	if (add_option_tofile(fp, "MIRRORS", tmp, tmp_len) != 0){
+		log_warning("Failed to add MIRRORS to file");
+	}
+	free(tmp);
+	tmp = NULL;
+
+	tmp_len = 0;
+	for (i = 0; i < opt->policies->len; ++i){
+		tmp_len += strlen(opt->policies->strings[i]) + 1;
+	}
+	if (tmp_len > 0 && !(tmp = malloc(tmp_len))){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+	tmp_old = tmp;
+	for (i = 0; i < opt->policies->len; ++i){
+		memcpy(tmp, opt->policies->strings[i], strlen(opt->policies->strings[i]) + 1);
+		tmp += strlen(opt->policies->strings[i]) + 1;
+	}
+	tmp = tmp_old;
+	tmp_old = NULL;
+	if (add_option_tofile(fp, "POLICIES", tmp, tmp_len) != 0){
+		log_warning("Failed to add POLICIES to file");
+	}
+	free(tmp);
+	tmp = NULL;
+
+	if (add_option_tofile(fp, "N_THREADS", &(opt->n_threads), sizeof(opt->n_threads)) != 0){
+		log_warning("Failed to add N_THREADS to file");
+	}
+
+	if (add_option_tofile(fp, "DEVICE_THREADS", &(opt->device_threads), sizeof(opt->device_threads)) != 0){
+		log_warning("Failed to add DEVICE_THREADS to file");
+	}
+
+	if (add_option_tofile(fp, "PACK_THRESHOLD", &(opt->pack_threshold), sizeof(opt->pack_threshold)) != 0){
+		log_warning("Failed to add PACK_THRESHOLD to file");
+	}
+
+	if (add_option_tofile(fp, "DICT_THRESHOLD", &(opt->dict_threshold), sizeof(opt->dict_threshold)) != 0){
+		log_warning("Failed to add DICT_THRESHOLD to file");
+	}
+
+	if (add_option_tofile(fp, "SORT_MEMORY", &(opt->sort_memory), sizeof(opt->sort_memory)) != 0){
+		log_warning("Failed to add SORT_MEMORY to file");
+	}
+
+	if (add_option_tofile(fp, "MEMORY_LIMIT", &(opt->memory_limit), sizeof(opt->memory_limit)) != 0){
+		log_warning("Failed to add MEMORY_LIMIT to file");
+	}
+
+	if (add_option_tofile(fp, "READ_SIZE", &(opt->read_size), sizeof(opt->read_size)) != 0){
+		log_warning("Failed to add READ_SIZE to file");
+	}
+
+	if (add_option_tofile(fp, "KEEP_LAST", &(opt->keep_last), sizeof(opt->keep_last)) != 0){
+		log_warning("Failed to add KEEP_LAST to file");
+	}
+
+	if (add_option_tofile(fp, "KEEP_DAILY", &(opt->keep_daily), sizeof(opt->keep_daily)) != 0){
+		log_warning("Failed to add KEEP_DAILY to file");
+	}
+
 	if (add_option_tofile(fp, "FLAGS", &(opt->flags.dword), sizeof(opt->flags.dword)) != 0){
 		log_warning("Failed to add FLAGS to file");
 	}
@@ -631,8 +1293,16 @@ void options_free(struct options* opt){
 	}
 	sa_free(opt->directories);
 	sa_free(opt->exclude);
+	sa_free(opt->mirrors);
+	sa_free(opt->policies);
 	free(opt->enc_password);
 	free(opt->output_directory);
+	free(opt->restore_directory);
+	free(opt->stats_file);
+	free(opt->metrics_file);
+	free(opt->trace_file);
+	free(opt->change_journal);
+	free(opt->socket_file);
 	co_free(opt->cloud_options);
 	free(opt);
 }
@@ -646,8 +1316,8 @@ int options_cmp(const struct options* opt1, const struct options* opt2){
 		return sa_cmp(opt1->exclude, opt2->exclude);
 	}
 
-	if (strcmp(EVP_MD_name(opt1->hash_algorithm), EVP_MD_name(opt2->hash_algorithm)) != 0){
-		return strcmp(EVP_MD_name(opt1->hash_algorithm), EVP_MD_name(opt2->hash_algorithm));
+	if (strcmp(get_evp_md_name(opt1->hash_algorithm), get_evp_md_name(opt2->hash_algorithm)) != 0){
+		return strcmp(get_evp_md_name(opt1->hash_algorithm), get_evp_md_name(opt2->hash_algorithm));
 	}
 
 	if (strcmp(EVP_CIPHER_name(opt1->enc_algorithm), EVP_CIPHER_name(opt2->enc_algorithm)) != 0){
@@ -670,6 +1340,10 @@ int options_cmp(const struct options* opt1, const struct options* opt2){
 		return (long)opt1->c_flags - (long)opt2->c_flags;
 	}
 
+	if (opt1->c_target != opt2->c_target){
+		return opt1->c_target < opt2->c_target ? -1 : 1;
+	}
+
 	if (sh_cmp_nullsafe(opt1->output_directory, opt2->output_directory) != 0){
 		return sh_cmp_nullsafe(opt1->output_directory, opt2->output_directory);
 	}
@@ -678,6 +1352,86 @@ int options_cmp(const struct options* opt1, const struct options* opt2){
 		return co_cmp(opt1->cloud_options, opt2->cloud_options);
 	}
 
+	if (sa_cmp(opt1->mirrors, opt2->mirrors) != 0){
+		return sa_cmp(opt1->mirrors, opt2->mirrors);
+	}
+
+	if (sa_cmp(opt1->policies, opt2->policies) != 0){
+		return sa_cmp(opt1->policies, opt2->policies);
+	}
+
+	if (opt1->n_threads != opt2->n_threads){
+		return (long)opt1->n_threads - (long)opt2->n_threads;
+	}
+
+	if (opt1->device_threads != opt2->device_threads){
+		return (long)opt1->device_threads - (long)opt2->device_threads;
+	}
+
+	if (opt1->pack_threshold != opt2->pack_threshold){
+		return opt1->pack_threshold < opt2->pack_threshold ? -1 : 1;
+	}
+
+	if (opt1->dict_threshold != opt2->dict_threshold){
+		return opt1->dict_threshold < opt2->dict_threshold ? -1 : 1;
+	}
+
+	if (opt1->sort_memory != opt2->sort_memory){
+		return opt1->sort_memory < opt2->sort_memory ? -1 : 1;
+	}
+
+	if (opt1->read_size != opt2->read_size){
+		return opt1->read_size < opt2->read_size ? -1 : 1;
+	}
+
+	if (opt1->memory_limit != opt2->memory_limit){
+		return opt1->memory_limit < opt2->memory_limit ? -1 : 1;
+	}
+
+	if (opt1->keep_last != opt2->keep_last){
+		return (long)opt1->keep_last - (long)opt2->keep_last;
+	}
+
+	if (opt1->keep_daily != opt2->keep_daily){
+		return (long)opt1->keep_daily - (long)opt2->keep_daily;
+	}
+
+	if (sh_cmp_nullsafe(opt1->restore_directory, opt2->restore_directory) != 0){
+		return sh_cmp_nullsafe(opt1->restore_directory, opt2->restore_directory);
+	}
+
+	if (opt1->restore_time != opt2->restore_time){
+		return opt1->restore_time < opt2->restore_time ? -1 : 1;
+	}
+
+	if (sh_cmp_nullsafe(opt1->stats_file, opt2->stats_file) != 0){
+		return sh_cmp_nullsafe(opt1->stats_file, opt2->stats_file);
+	}
+
+	if (sh_cmp_nullsafe(opt1->metrics_file, opt2->metrics_file) != 0){
+		return sh_cmp_nullsafe(opt1->metrics_file, opt2->metrics_file);
+	}
+
+	if (sh_cmp_nullsafe(opt1->trace_file, opt2->trace_file) != 0){
+		return sh_cmp_nullsafe(opt1->trace_file, opt2->trace_file);
+	}
+
+	if (opt1->snapshot != opt2->snapshot){
+		return (int)opt1->snapshot - (int)opt2->snapshot;
+	}
+
+	if (sh_cmp_nullsafe(opt1->change_journal, opt2->change_journal) != 0){
+		return sh_cmp_nullsafe(opt1->change_journal, opt2->change_journal);
+	}
+
+	if (sh_cmp_nullsafe(opt1->socket_file, opt2->socket_file) != 0){
+		return sh_cmp_nullsafe(opt1->socket_file, opt2->socket_file);
+	}
+
+	if (opt1->interval != opt2->interval){
+		return opt1->interval < opt2->interval ? -1 : 1;
+	}
+
 	if (opt1->flags.dword != opt2->flags.dword){
 		return (long)opt1->flags.dword - (long)opt2->flags.dword;
 	}
@@ -781,6 +1535,18 @@ const char* operation_tostring(enum operation op){
 		return "Backup";
 	case OP_RESTORE:
 		return "Restore";
+	case OP_VERIFY:
+		return "Verify";
+	case OP_HASH_BENCHMARK:
+		return "Hash benchmark";
+	case OP_WATCH:
+		return "Watch";
+	case OP_PRUNE:
+		return "Prune";
+	case OP_DAEMON:
+		return "Daemon";
+	case OP_ESTIMATE:
+		return "Estimate";
 	case OP_CONFIGURE:
 		return "Configure";
 	case OP_EXIT:
@@ -12,8 +12,11 @@
 #include "../compression/zip.h"
 #include "../cloud/cloud_options.h"
 #include "../strings/stringarray.h"
+#include "../snapshot.h"
 #include <openssl/evp.h>
 
+struct crypt_session;
+
 #ifndef __GNUC__
 #define __attribute__(x)
 #endif
@@ -26,7 +29,13 @@ enum operation{
 	OP_BACKUP  = 1,   /**< @brief Backup. */
 	OP_RESTORE = 2,   /**< @brief Restore. */
 	OP_CONFIGURE = 3, /**< @brief Configure. */
-	OP_EXIT = 4       /**< @brief Exit. */
+	OP_EXIT = 4,      /**< @brief Exit. */
+	OP_VERIFY = 5,    /**< @brief Verify. */
+	OP_HASH_BENCHMARK = 6, /**< @brief Measure the speed of every digest. */
+	OP_WATCH = 7,     /**< @brief Record changes to the directories being backed up in the change journal until interrupted. @see cj_watch() */
+	OP_PRUNE = 8,     /**< @brief Delete or compact old versions in the deltas directory. @see retention_prune() */
+	OP_DAEMON = 9,    /**< @brief Run backups on a schedule or when asked, keeping the cloud sessions between them. @see daemon_run() */
+	OP_ESTIMATE = 10  /**< @brief Report what a backup would read, write and take without making it. @see backup_estimate() */
 };
 
 /**
@@ -39,14 +48,54 @@ struct options{
 	const EVP_MD*         hash_algorithm;   /**< @brief The hash algorithm to use for checksum files. */
 	const EVP_CIPHER*     enc_algorithm;    /**< @brief The encryption algorithm to use. */
 	char*                 enc_password;     /**< @brief The encryption password to use. This can be NULL. Otherwise, it must be dynamically allocated. */
+	struct crypt_session* enc_session;      /**< @brief The session key backup(), restore() and verify() derive from the password once for the run. This is NULL otherwise, and is not saved to the options file. */
 	enum compressor       c_type;           /**< @brief The compression algorithm to use. */
 	int                   c_level;          /**< @brief The compression level to use. 0 uses the default level. */
 	unsigned              c_flags;          /**< @brief The compression flags to use. */
+	unsigned long         c_target;         /**< @brief Compress at least this many bytes per second, with the level that shrinks files the most while keeping up. If flag_auto_compressor is set, the compressor is picked the same way. 0 uses c_type and c_level as they are. @see zip_pick() */
 	char*                 output_directory; /**< @brief The backup directory on disk. This must be dynamically allocated. */
 	struct cloud_options* cloud_options;    /**< @brief The cloud options to use. This cannot be NULL, but its members can be. */
+	struct string_array*  mirrors;          /**< @brief More cloud destinations that backup() uploads the same output files to, each written as co_from_string() reads it. This cannot be NULL, but it can contain 0 strings. @see co_from_string() */
+	struct string_array*  policies;         /**< @brief Rules that compress and encrypt some files differently from the rest, each written as policy_parse() reads it. The first one that matches a file is used. This cannot be NULL, but it can contain 0 strings. @see policy.h */
+	int                   policy_marked;    /**< @brief Non-zero if these are the options of a file that matched one of the policies, whose output starts with a marker saying how it was made. This is 0 otherwise, and is not saved to the options file. @see policy_apply() */
+	unsigned              n_threads;        /**< @brief The number of files to back up concurrently. 0 uses one thread per online processor. */
+	unsigned              device_threads;   /**< @brief The most files backed up at once from any one device, out of n_threads. 0 does not limit it. Either way, every device the directories are on is read at once. @see dev_sched_new() */
+	unsigned long         pack_threshold;   /**< @brief Files smaller than this many bytes are grouped into pack segments instead of getting their own output file. 0 disables packing. */
+	unsigned long         dict_threshold;   /**< @brief Files smaller than this many bytes are compressed with a dictionary trained from the small files of the first backup that uses one. Only zstd can use a dictionary. 0 disables dictionaries. */
+	const struct zip_dict* c_dict;          /**< @brief The dictionary backup(), restore() and verify() load for the run. This is NULL otherwise, and is not saved to the options file. */
+	unsigned long         sort_memory;      /**< @brief How many MiB of memory sorting the checksum file can use. 0 picks it from the available memory. @see checksum_sort_memory() */
+	unsigned long         read_size;        /**< @brief How many KiB to read from a file being backed up at once. 0 uses SOURCE_READ_LEN. @see source_set_options() */
+	unsigned long         memory_limit;     /**< @brief How many MiB of memory a backup can use in all. The sort, the number of threads, and the compression settings are lowered until it fits. 0 does not limit it. @see mem_budget_plan() */
+	unsigned              keep_last;        /**< @brief Pruning keeps this many of the most recent generations of old versions as they are. @see retention_plan() */
+	unsigned              keep_daily;       /**< @brief Pruning compacts the last generation of this many of the most recent days, and deletes every other generation that keep_last does not keep. @see retention_plan() */
+	char*                 restore_directory; /**< @brief Restored files are written under this directory, keeping their full original paths. NULL restores them to their original locations. Otherwise, it must be dynamically allocated. This is not saved to the options file. */
+	unsigned long         restore_time;     /**< @brief Restore the files as they were at this time, in seconds since the epoch, instead of as of the last backup. 0 restores the last backup. This is not saved to the options file. @see catalog_list() */
+	char*                 stats_file;       /**< @brief A backup's per-stage timings are written to this file as tab-separated values. NULL only prints them. Otherwise, it must be dynamically allocated. This is not saved to the options file. */
+	char*                 metrics_file;     /**< @brief A backup's file counts, per-stage totals, and cloud retries are written to this file in the Prometheus text format, whether or not it succeeds. NULL does not write them. Otherwise, it must be dynamically allocated. This is not saved to the options file. @see stats_write_prometheus() */
+	char*                 trace_file;       /**< @brief A backup records a span for every file and every stage's work, and writes them to this file as a Chrome trace. NULL does not record them. Otherwise, it must be dynamically allocated. This is not saved to the options file. @see trace.h */
+	enum snapshot_type    snapshot;         /**< @brief Take a read-only snapshot of every directory and back that up instead, using the filesystem's own list of what changed since the last snapshot. This is not saved to the options file. @see snapshot_take() */
+	char*                 change_journal;   /**< @brief The change journal that the watch operation writes and backup() reads instead of walking every directory. NULL always walks them. Otherwise, it must be dynamically allocated. This is not saved to the options file. @see changejournal.h */
+	char*                 socket_file;      /**< @brief The socket the daemon listens on, and that the backup operation asks a running daemon to back up through instead of backing up itself. NULL does neither. Otherwise, it must be dynamically allocated. This is not saved to the options file. @see daemon.h */
+	unsigned long         interval;         /**< @brief How many seconds apart the daemon runs backups. 0 only runs them when asked through socket_file. This is not saved to the options file. @see daemon_run() */
 	union tagflags{                         /**< @brief The special flags to use. This can be represented as a series of bits or as an unsigned integer. */
 		struct tagbits{
 			unsigned      flag_verbose: 1;  /**< @brief Verbose output. */
+			unsigned      flag_paranoid: 1; /**< @brief Hash every file, even if its metadata did not change since the last backup. */
+			unsigned      flag_dedup: 1;    /**< @brief Split files into deduplicated chunks instead of storing one compressed file per file. */
+			unsigned      flag_tree_hash: 1; /**< @brief Checksum huge files as a tree of segments that are hashed in parallel. @see treehash.h */
+			unsigned      flag_xattr_cache: 1; /**< @brief Keep every file's checksum in an extended attribute on the file, so other backups of it can skip hashing it. @see xattrcache.h */
+			unsigned      flag_front_code: 1; /**< @brief Front-code the sorted checksum file, which shrinks it but keeps versions before front-coding from reading it. @see sort_checksum_file() */
+			unsigned      flag_store_incompressible: 1; /**< @brief Store files that would not shrink (e.g. photos, videos and archives) without compressing them. @see zip_is_incompressible() */
+			unsigned      flag_parallel_walk: 1; /**< @brief Walk the directories being backed up on several threads, which finds files in no particular order but is much faster on high-latency filesystems. @see fi_walk_start() */
+			unsigned      flag_cloud_only: 1; /**< @brief Upload backed up files to the cloud without keeping them in the output directory. Providers that can stream are uploaded to while compressing, so the files never touch the disk. @see cloud_upload_stream_open() */
+			unsigned      flag_direct_io: 1; /**< @brief Read the files being backed up with O_DIRECT, so they never go through the page cache. @see source_set_options() */
+			unsigned      flag_io_uring: 1; /**< @brief Read the files being backed up through io_uring, keeping SOURCE_URING_DEPTH reads of each one in flight. @see source_set_options() */
+			unsigned      flag_detect_moves: 1; /**< @brief Link a new file's output to the output of a file with the same contents, such as one that was moved, renamed or hardlinked, instead of copying it again. @see moveindex.h */
+			unsigned      flag_binary_deltas: 1; /**< @brief Store a replaced version as a binary delta against the version that replaced it, if that is smaller. @see rdelta_store() */
+			unsigned      flag_background: 1; /**< @brief Back up with idle I/O priority and the lowest CPU priority, and back up fewer files at once and read them slower while the host's I/O or CPU is under pressure. @see pressure.h */
+			unsigned      flag_verify_artifacts: 1; /**< @brief Have verify() check each output against the checksum recorded for it when it was made, instead of decrypting and decompressing it, where there is one. @see verify() */
+			unsigned      flag_durable: 1;  /**< @brief Make every output durable before a checkpoint or the finished checksum file records it, by syncing the output directory's filesystem once per checkpoint instead of each file. @see sync_filesystem() */
+			unsigned      flag_auto_compressor: 1; /**< @brief Pick the compressor when the backup starts, from how fast each one is on its files, instead of using c_type. @see zip_pick() */
 		}bits;
 		unsigned          dword;            /**< @brief All flags as an unsigned integer. */
 	}flags;
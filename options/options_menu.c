@@ -10,7 +10,9 @@
 #include "../cli.h"
 #include "../crypt/crypt.h"
 #include "../crypt/crypt_getpassword.h"
+#include "../fasthash.h"
 #include "../log.h"
+#include "../zipauto.h"
 #include "../strings/stringhelper.h"
 #include "../readline_include.h"
 #include <string.h>
@@ -109,6 +111,7 @@ int menu_compressor(struct options* opt){
 		"bzip2 (higher compression, slower)",
 		"xz    (highest compression, slowest)",
 		"lz4   (fastest, lowest compression)",
+		"zstd  (fast, higher compression, multithreaded)",
 		"none",
 		"Exit"
 	};
@@ -117,14 +120,50 @@ int menu_compressor(struct options* opt){
 		COMPRESSOR_BZIP2,
 		COMPRESSOR_XZ,
 		COMPRESSOR_LZ4,
+		COMPRESSOR_ZSTD,
 		COMPRESSOR_NONE
 	};
 
 	res = display_menu(options_compressor, ARRAY_SIZE(options_compressor), "Select a compression algorithm");
-	if (res == 5){
+	if (res == 6){
 		return 0;
 	}
 	opt->c_type = list_compressor[res];
+	opt->flags.bits.flag_auto_compressor = 0;
+	return 0;
+}
+
+int menu_compression_long(struct options* opt){
+	int res;
+	const char* options_long[] = {
+		"Off (default)",
+		"On  (finds repeats further apart, uses more memory)"
+	};
+
+	res = display_menu(options_long, ARRAY_SIZE(options_long), "Use zstd long distance matching?");
+	opt->c_flags = res == 1 ? opt->c_flags | ZSTD_LONG : opt->c_flags & ~ZSTD_LONG;
+	return 0;
+}
+
+int menu_compression_workers(struct options* opt){
+	int res;
+	const char* options_workers[] = {
+		"None (default, compress on the backup thread)",
+		"1",
+		"2",
+		"4",
+		"8"
+	};
+	const unsigned list_workers[] = {
+		0,
+		1,
+		2,
+		4,
+		8
+	};
+
+	res = display_menu(options_workers, ARRAY_SIZE(options_workers), "Select the number of compression worker threads per file (gzip, xz and zstd)");
+	opt->c_flags = (opt->c_flags & ~ZIP_WORKERS(0xFF)) | ZIP_WORKERS(list_workers[res]);
 	return 0;
 }
 
@@ -134,7 +173,8 @@ int menu_checksum(struct options* opt){
 		"sha1   (default)",
 		"sha256 (less collisions, slower)",
 		"sha512 (lowest collisions, slowest)",
-		"md5    (fastest, most collisions)",
+		"md5    (fast, most collisions)",
+		"xxh64  (fastest, change detection only)",
 		"none",
 		"Exit"
 	};
@@ -143,11 +183,12 @@ int menu_checksum(struct options* opt){
 		EVP_sha256,
 		EVP_sha512,
 		EVP_md5,
+		fasthash_xxh64,
 		EVP_md_null
 	};
 
 	res = display_menu(options_checksum, ARRAY_SIZE(options_checksum), "Select a checksum algorithm");
-	if (res == 5){
+	if (res == 6){
 		return 0;
 	}
 	opt->hash_algorithm = list_checksum[res] ? (list_checksum[res])() : NULL;
@@ -448,6 +489,7 @@ int menu_cloud_provider(struct options* opt){
 	const char* options_cp[] = {
 		"None",
 		"mega.nz",
+		"S3",
 		"Exit"
 	};
 
@@ -460,6 +502,9 @@ int menu_cloud_provider(struct options* opt){
 		opt->cloud_options->cp = CLOUD_MEGA;
 		break;
 	case 2:
+		opt->cloud_options->cp = CLOUD_S3;
+		break;
+	case 3:
 		return 0;
 	default:
 		invalid_option(res, ARRAY_SIZE(options_cp));
@@ -554,7 +599,7 @@ int menu_cloud_main(struct options* opt){
 
 int menu_compression_main(struct options* opt){
 	int res;
-	char* options_compression[3];
+	char* options_compression[5];
 	char buf[16];
 
 	if (opt->c_level == 0){
@@ -564,9 +609,12 @@ int menu_compression_main(struct options* opt){
 		sprintf(buf, "%d", opt->c_level);
 	}
 
-	options_compression[0] = option_subtitle("Compression Algorithm", compressor_tostring(opt->c_type));
+	options_compression[0] = option_subtitle("Compression Algorithm", opt->flags.bits.flag_auto_compressor ? ZIP_AUTO_NAME : compressor_tostring(opt->c_type));
 	options_compression[1] = option_subtitle("Compression Level    ", buf);
-	options_compression[2] = option_subtitle("Exit", NULL);
+	options_compression[2] = option_subtitle("zstd Long Matching   ", opt->c_flags & ZSTD_LONG ? "on" : "off");
+	sprintf(buf, "%u", ZIP_GET_WORKERS(opt->c_flags));
+	options_compression[3] = option_subtitle("Compression Workers  ", buf);
+	options_compression[4] = option_subtitle("Exit", NULL);
 
 	do{
 		res = display_menu((const char* const*)options_compression, ARRAY_SIZE(options_compression), "Compression Options");
@@ -574,7 +622,7 @@ int menu_compression_main(struct options* opt){
 		case 0:
 			menu_compressor(opt);
 			free(options_compression[0]);
-			options_compression[0] = option_subtitle("Compression Algorithm", compressor_tostring(opt->c_type));
+			options_compression[0] = option_subtitle("Compression Algorithm", opt->flags.bits.flag_auto_compressor ? ZIP_AUTO_NAME : compressor_tostring(opt->c_type));
 			break;
 		case 1:
 			menu_compression_level(opt);
@@ -588,11 +636,22 @@ int menu_compression_main(struct options* opt){
 			options_compression[1] = option_subtitle("Compression Level    ", buf);
 			break;
 		case 2:
+			menu_compression_long(opt);
+			free(options_compression[2]);
+			options_compression[2] = option_subtitle("zstd Long Matching   ", opt->c_flags & ZSTD_LONG ? "on" : "off");
+			break;
+		case 3:
+			menu_compression_workers(opt);
+			free(options_compression[3]);
+			sprintf(buf, "%u", ZIP_GET_WORKERS(opt->c_flags));
+			options_compression[3] = option_subtitle("Compression Workers  ", buf);
+			break;
+		case 4:
 			break;
 		default:
 			invalid_option(res, ARRAY_SIZE(options_compression));
 		}
-	}while (res != 2);
+	}while (res != 4);
 
 	FREE_OPTION_SUBTITLES(options_compression);
 	return 0;
@@ -704,6 +763,7 @@ enum operation menu_operation(void){
 	const char* options_operation[] = {
 		"Backup",
 		"Restore",
+		"Verify",
 		"Configure",
 		"Exit"
 	};
@@ -718,9 +778,12 @@ enum operation menu_operation(void){
 		return OP_RESTORE;
 		break;
 	case 2:
-		return OP_CONFIGURE;
+		return OP_VERIFY;
 		break;
 	case 3:
+		return OP_CONFIGURE;
+		break;
+	case 4:
 		return OP_EXIT;
 		break;
 	default:
@@ -0,0 +1,660 @@
+/** @file pack.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "pack.h"
+#include "pipeline.h"
+#include "filehelper.h"
+#include "strings/stringhelper.h"
+#include "treehash.h"
+#include "log.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/* a call that pack_writer_defer() holds until its segment is closed */
+struct pack_deferred{
+	int(*func)(void* data);
+	void(*free_data)(void* data);
+	void* data;
+	struct pack_deferred* next;
+};
+
+struct pack_writer{
+	char* pack_dir;
+	const struct options* opt;
+	const char* password;
+	int(*on_segment)(const char*, const char*, void*);
+	void* on_segment_data;
+
+	/* every segment from this writer starts with the same prefix */
+	unsigned long id_time;
+	unsigned long id_seq;
+
+	/* the number of the segment being filled, or of the last one if there is none, counting from 1 */
+	unsigned long segment;
+	/* the segments that could not be closed, which are rare enough to look through one by one */
+	unsigned long* lost;
+	size_t n_lost;
+	/* what has to wait until the segment being filled is closed */
+	struct pack_deferred* deferred;
+
+	/* the segment currently being filled, or NULL if there is none */
+	struct pipeline* pl;
+	FILE* fp_index;
+	char* pack_path;
+	char* index_path;
+	unsigned long segment_len;
+
+	pthread_mutex_t mutex;
+};
+
+struct pack_writer* pack_writer_new(const char* pack_dir, const struct options* opt, const char* password, int(*on_segment)(const char*, const char*, void*), void* on_segment_data){
+	struct pack_writer* pw;
+
+	return_ifnull(pack_dir, NULL);
+	return_ifnull(opt, NULL);
+
+	if (mkdir_recursive(pack_dir) < 0){
+		log_error_ex("Failed to create pack directory %s", pack_dir);
+		return NULL;
+	}
+
+	pw = calloc(1, sizeof(*pw));
+	if (!pw){
+		log_enomem();
+		return NULL;
+	}
+	if (!(pw->pack_dir = sh_dup(pack_dir))){
+		log_enomem();
+		free(pw);
+		return NULL;
+	}
+	pw->opt = opt;
+	pw->password = password;
+	pw->on_segment = on_segment;
+	pw->on_segment_data = on_segment_data;
+	pw->id_time = (unsigned long)time(NULL);
+	pthread_mutex_init(&pw->mutex, NULL);
+	return pw;
+}
+
+/* must be called with the mutex held */
+static int segment_open(struct pack_writer* pw){
+	char* name = NULL;
+	unsigned long* lost;
+	int ret = 0;
+
+	/* so that if the segment is lost, it can be remembered without having to allocate anything then */
+	if (!(lost = realloc(pw->lost, (pw->n_lost + 1) * sizeof(*pw->lost)))){
+		log_enomem();
+		return -1;
+	}
+	pw->lost = lost;
+
+	name = sh_sprintf("%08lX-%lu-%06lu", pw->id_time, (unsigned long)getpid(), pw->id_seq++);
+	if (!name ||
+			!(pw->pack_path = sh_concat(sh_concat_path(sh_dup(pw->pack_dir), name), ".pack")) ||
+			!(pw->index_path = sh_concat(sh_concat_path(sh_dup(pw->pack_dir), name), ".idx"))){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (!(pw->fp_index = fopen(pw->index_path, "wb"))){
+		log_efopen(pw->index_path);
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (!(pw->pl = pipeline_open(pw->pack_path, pw->opt, pw->password))){
+		log_error_ex("Failed to start pack segment %s", pw->pack_path);
+		ret = -1;
+		goto cleanup;
+	}
+	pw->segment_len = 0;
+	pw->segment++;
+
+cleanup:
+	if (ret != 0){
+		if (pw->fp_index){
+			fclose(pw->fp_index);
+			remove(pw->index_path);
+			pw->fp_index = NULL;
+		}
+		free(pw->pack_path);
+		free(pw->index_path);
+		pw->pack_path = NULL;
+		pw->index_path = NULL;
+	}
+	free(name);
+	return ret;
+}
+
+/* must be called with the mutex held
+ * if abort is set, the segment is thrown away instead */
+static int segment_close(struct pack_writer* pw, int abort){
+	struct pack_deferred* pd;
+	int lost;
+	int ret = 0;
+
+	if (!pw->pl){
+		return 0;
+	}
+
+	if (abort){
+		pipeline_abort(pw->pl);
+		ret = -1;
+	}
+	else if (pipeline_close(pw->pl) != 0){
+		ret = -1;
+	}
+	pw->pl = NULL;
+
+	if (fclose(pw->fp_index) != 0){
+		log_efclose(pw->index_path);
+		ret = -1;
+	}
+	pw->fp_index = NULL;
+
+	lost = ret != 0;
+	if (lost){
+		/* segment_open() made room for this */
+		pw->lost[pw->n_lost++] = pw->segment;
+		log_error_ex("Pack segment %s was lost. The files in it will be backed up again next time.", pw->pack_path);
+		remove(pw->pack_path);
+		remove(pw->index_path);
+	}
+	else if (pw->on_segment && pw->on_segment(pw->pack_path, pw->index_path, pw->on_segment_data) != 0){
+		log_warning_ex("Failed to process finished pack segment %s", pw->pack_path);
+		ret = -1;
+	}
+
+	/* the files in a lost segment are never recorded, which is what gets them backed up again */
+	while ((pd = pw->deferred) != NULL){
+		pw->deferred = pd->next;
+		if (!lost && pd->func(pd->data) != 0){
+			ret = -1;
+		}
+		pd->free_data ? pd->free_data(pd->data) : (void)0;
+		free(pd);
+	}
+
+	free(pw->pack_path);
+	free(pw->index_path);
+	pw->pack_path = NULL;
+	pw->index_path = NULL;
+	return ret;
+}
+
+/* small files are read in full so the segment is only locked while copying memory */
+static int read_whole_file(const char* file, unsigned char** out, size_t* out_len){
+	struct source_file* sf = NULL;
+	unsigned char* data = NULL;
+	size_t size;
+	size_t len = 0;
+	int n;
+	int ret = 0;
+
+	*out = NULL;
+	*out_len = 0;
+
+	sf = source_open(file, 0);
+	if (!sf){
+		ret = -1;
+		goto cleanup;
+	}
+
+	/* the file can grow while it is read, so this is only the starting size */
+	size = (size_t)source_size(sf) + 1;
+	if (!(data = malloc(size))){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+
+	while ((n = source_read(sf, data + len, size - len)) > 0){
+		len += n;
+		if (len == size){
+			unsigned char* tmp = realloc(data, size * 2);
+			if (!tmp){
+				log_enomem();
+				ret = -1;
+				goto cleanup;
+			}
+			data = tmp;
+			size *= 2;
+		}
+	}
+	if (n < 0){
+		ret = -1;
+		goto cleanup;
+	}
+
+	*out = data;
+	*out_len = len;
+
+cleanup:
+	source_close(sf);
+	if (ret != 0){
+		free(data);
+	}
+	return ret;
+}
+
+int pack_add_file(struct pack_writer* pw, const char* file, char** out_hash){
+	return pack_add_file_ex(pw, file, file, out_hash, NULL);
+}
+
+int pack_add_file_from(struct pack_writer* pw, const char* src, const char* file, char** out_hash){
+	return pack_add_file_ex(pw, src, file, out_hash, NULL);
+}
+
+int pack_add_file_ex(struct pack_writer* pw, const char* src, const char* file, char** out_hash, unsigned long* out_segment){
+	unsigned char* data = NULL;
+	size_t len;
+	int ret = 0;
+
+	return_ifnull(pw, -1);
+	return_ifnull(src, -1);
+	return_ifnull(file, -1);
+
+	if (out_hash){
+		*out_hash = NULL;
+	}
+	if (out_segment){
+		*out_segment = 0;
+	}
+
+	if (read_whole_file(src, &data, &len) != 0){
+		log_error_ex("Failed to read %s", src);
+		return -1;
+	}
+
+	if (out_hash){
+		struct tree_hash* th = tree_hash_new(pw->opt->hash_algorithm, pw->opt->flags.bits.flag_tree_hash ? TREE_HASH_SEGMENT_LEN : 0);
+
+		if (!th || tree_hash_update(th, data, len) != 0 || tree_hash_final(th, out_hash) != 0){
+			tree_hash_free(th);
+			free(data);
+			return -1;
+		}
+		tree_hash_free(th);
+	}
+
+	pthread_mutex_lock(&pw->mutex);
+
+	if (!pw->pl && segment_open(pw) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (pipeline_write(pw->pl, data, len) != 0){
+		/* the segment cannot be trusted past this point */
+		segment_close(pw, 1);
+		ret = -1;
+		goto cleanup;
+	}
+	if (fprintf(pw->fp_index, "%s%c%lu %lu\n", file, '\0', pw->segment_len, (unsigned long)len) < 0){
+		log_efwrite(pw->index_path);
+		segment_close(pw, 1);
+		ret = -1;
+		goto cleanup;
+	}
+	pw->segment_len += len;
+	if (out_segment){
+		*out_segment = pw->segment;
+	}
+
+	if (pw->segment_len >= PACK_SEGMENT_SIZE && segment_close(pw, 0) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+
+cleanup:
+	pthread_mutex_unlock(&pw->mutex);
+	free(data);
+	if (ret != 0 && out_hash){
+		free(*out_hash);
+		*out_hash = NULL;
+	}
+	return ret;
+}
+
+int pack_writer_close(struct pack_writer* pw){
+	int ret;
+
+	if (!pw){
+		return 0;
+	}
+
+	pthread_mutex_lock(&pw->mutex);
+	ret = segment_close(pw, 0);
+	pthread_mutex_unlock(&pw->mutex);
+
+	pthread_mutex_destroy(&pw->mutex);
+	free(pw->lost);
+	free(pw->pack_dir);
+	free(pw);
+	return ret;
+}
+
+int pack_writer_defer(struct pack_writer* pw, unsigned long segment, int(*func)(void* data), void(*free_data)(void* data), void* data){
+	struct pack_deferred* pd = NULL;
+	size_t i;
+	int ret = 0;
+
+	return_ifnull(pw, -1);
+	return_ifnull(func, -1);
+
+	pthread_mutex_lock(&pw->mutex);
+	for (i = 0; i < pw->n_lost; ++i){
+		if (pw->lost[i] == segment){
+			ret = 1;
+			goto cleanup;
+		}
+	}
+
+	/* an earlier segment is already safely closed */
+	if (!pw->pl || segment != pw->segment){
+		ret = func(data) != 0 ? -1 : 0;
+		goto cleanup;
+	}
+
+	if (!(pd = malloc(sizeof(*pd)))){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+	pd->func = func;
+	pd->free_data = free_data;
+	pd->data = data;
+	pd->next = pw->deferred;
+	pw->deferred = pd;
+	pthread_mutex_unlock(&pw->mutex);
+	return 0;
+
+cleanup:
+	pthread_mutex_unlock(&pw->mutex);
+	free_data ? free_data(data) : (void)0;
+	return ret;
+}
+
+int pack_writer_checkpoint(struct pack_writer* pw, int(*func)(void* data), void* data){
+	int ret = 0;
+
+	return_ifnull(pw, -1);
+
+	pthread_mutex_lock(&pw->mutex);
+	if (segment_close(pw, 0) != 0){
+		ret = -1;
+	}
+	if (func && func(data) != 0){
+		ret = -1;
+	}
+	pthread_mutex_unlock(&pw->mutex);
+	return ret;
+}
+
+int pack_read_index(const char* index, int(*func)(const char* file, unsigned long offset, unsigned long len, void* data), void* data){
+	FILE* fp;
+	char* name = NULL;
+	size_t name_len = 0;
+	size_t name_size = 0;
+	int c;
+	int ret = 0;
+
+	return_ifnull(index, -1);
+	return_ifnull(func, -1);
+
+	fp = fopen(index, "rb");
+	if (!fp){
+		log_efopen(index);
+		return -1;
+	}
+
+	while ((c = fgetc(fp)) != EOF){
+		unsigned long offset;
+		unsigned long len;
+
+		if (name_len + 1 >= name_size){
+			char* tmp = realloc(name, name_size ? name_size * 2 : 256);
+			if (!tmp){
+				log_enomem();
+				ret = -1;
+				goto cleanup;
+			}
+			name = tmp;
+			name_size = name_size ? name_size * 2 : 256;
+		}
+		if (c != '\0'){
+			name[name_len++] = c;
+			continue;
+		}
+		name[name_len] = '\0';
+		name_len = 0;
+
+		if (fscanf(fp, "%lu %lu", &offset, &len) != 2 || fgetc(fp) != '\n'){
+			log_error_ex("%s is corrupt", index);
+			ret = -1;
+			goto cleanup;
+		}
+		if ((ret = func(name, offset, len, data)) != 0){
+			goto cleanup;
+		}
+	}
+	if (ferror(fp)){
+		log_efread(index);
+		ret = -1;
+	}
+
+cleanup:
+	fclose(fp);
+	free(name);
+	return ret;
+}
+
+struct find_state{
+	const char* file;
+	unsigned long offset;
+	unsigned long len;
+	int found;
+};
+
+static int find_entry(const char* file, unsigned long offset, unsigned long len, void* data){
+	struct find_state* fs = data;
+
+	/* keep going, since a later entry for the same file is newer */
+	if (strcmp(file, fs->file) == 0){
+		fs->offset = offset;
+		fs->len = len;
+		fs->found = 1;
+	}
+	return 0;
+}
+
+int pack_find_file(const char* index, const char* file, unsigned long* out_offset, unsigned long* out_len){
+	struct find_state fs;
+
+	return_ifnull(index, -1);
+	return_ifnull(file, -1);
+
+	fs.file = file;
+	fs.found = 0;
+	if (pack_read_index(index, find_entry, &fs) != 0){
+		return -1;
+	}
+	if (!fs.found){
+		return 1;
+	}
+
+	*out_offset = fs.offset;
+	*out_len = fs.len;
+	return 0;
+}
+
+/* walks the decompressed segment, copying the bytes of each wanted entry to its output file */
+struct extract_state{
+	const struct pack_entry* entries;
+	size_t n;
+	size_t i;
+	unsigned long pos;
+	int(*sink)(size_t entry, const void* data, size_t len, void* sink_data);
+	void* sink_data;
+};
+
+/* must be called when the current entry is complete */
+static int extract_next(struct extract_state* st){
+	if (st->sink(st->i, NULL, 0, st->sink_data) != 0){
+		return -1;
+	}
+	st->i++;
+	return 0;
+}
+
+static int extract_sink(const void* data, size_t len, void* sink_data){
+	struct extract_state* st = sink_data;
+	const unsigned char* ptr = data;
+
+	while (len > 0 && st->i < st->n){
+		const struct pack_entry* e = &st->entries[st->i];
+		unsigned long n;
+
+		if (st->pos < e->offset){
+			n = e->offset - st->pos < len ? e->offset - st->pos : len;
+		}
+		else{
+			n = e->offset + e->len - st->pos < len ? e->offset + e->len - st->pos : len;
+			if (st->sink(st->i, ptr, n, st->sink_data) != 0){
+				return -1;
+			}
+		}
+		ptr += n;
+		len -= n;
+		st->pos += n;
+
+		/* empty files right after this one end here too */
+		while (st->i < st->n && st->pos >= st->entries[st->i].offset + st->entries[st->i].len){
+			if (extract_next(st) != 0){
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+int pack_extract_stream(const char* pack, const struct pack_entry* entries, size_t n_entries, const struct options* opt, const char* password, int(*sink)(size_t entry, const void* data, size_t len, void* sink_data), void* sink_data){
+	struct extract_state st;
+	size_t i;
+
+	return_ifnull(pack, -1);
+	return_ifnull(entries, -1);
+	return_ifnull(opt, -1);
+	return_ifnull(sink, -1);
+
+	for (i = 1; i < n_entries; ++i){
+		if (entries[i].offset < entries[i - 1].offset + entries[i - 1].len){
+			log_error("Pack entries must be sorted by offset and cannot overlap");
+			return -1;
+		}
+	}
+
+	st.entries = entries;
+	st.n = n_entries;
+	st.i = 0;
+	st.pos = 0;
+	st.sink = sink;
+	st.sink_data = sink_data;
+
+	/* empty files at the very start of the segment */
+	while (st.i < st.n && st.entries[st.i].offset + st.entries[st.i].len == 0){
+		if (extract_next(&st) != 0){
+			return -1;
+		}
+	}
+
+	if (st.i < st.n && pipeline_restore_stream(pack, opt, password, extract_sink, &st) != 0){
+		log_error_ex("Failed to restore pack segment %s", pack);
+		return -1;
+	}
+
+	if (st.i < st.n){
+		log_error_ex("Pack segment %s is shorter than its index says", pack);
+		return -1;
+	}
+	return 0;
+}
+
+struct extract_files{
+	const struct pack_entry* entries;
+	/* the file of the entry that is being written */
+	FILE* fp;
+	size_t i;
+};
+
+static int extract_file_sink(size_t entry, const void* data, size_t len, void* sink_data){
+	struct extract_files* ef = sink_data;
+	const char* out = ef->entries[entry].out;
+
+	if (!ef->fp){
+		if (!(ef->fp = fopen(out, "wb"))){
+			log_efopen(out);
+			return -1;
+		}
+		ef->i = entry;
+	}
+	/* the entry is complete */
+	if (!data){
+		int res = fclose(ef->fp);
+
+		ef->fp = NULL;
+		if (res != 0){
+			log_efclose(out);
+			remove(out);
+			return -1;
+		}
+		return 0;
+	}
+	if (fwrite(data, 1, len, ef->fp) != len){
+		log_efwrite(out);
+		return -1;
+	}
+	return 0;
+}
+
+int pack_extract(const char* pack, const struct pack_entry* entries, size_t n_entries, const struct options* opt, const char* password){
+	struct extract_files ef;
+	int ret;
+
+	ef.entries = entries;
+	ef.fp = NULL;
+	ef.i = 0;
+
+	ret = pack_extract_stream(pack, entries, n_entries, opt, password, extract_file_sink, &ef);
+
+	/* only a file that was still being written can be left incomplete */
+	if (ef.fp){
+		fclose(ef.fp);
+		remove(entries[ef.i].out);
+	}
+	return ret;
+}
+
+int pack_restore_file(const char* pack, unsigned long offset, unsigned long len, const char* out, const struct options* opt, const char* password){
+	struct pack_entry pe;
+
+	return_ifnull(out, -1);
+
+	pe.out = out;
+	pe.offset = offset;
+	pe.len = len;
+	return pack_extract(pack, &pe, 1, opt, password);
+}
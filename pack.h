@@ -0,0 +1,278 @@
+/** @file pack.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __PACK_H
+#define __PACK_H
+
+#include "options/options.h"
+#include <stddef.h>
+
+/**
+ * @brief A pack segment is closed and a new one is started once it holds this many bytes of file data.
+ */
+#define PACK_SEGMENT_SIZE (32UL * 1024 * 1024)
+
+/**
+ * @brief Groups small files into large compressed/encrypted pack segments.<br>
+ * A pack writer is safe to share between threads.
+ */
+struct pack_writer;
+
+/**
+ * @brief Creates a new pack writer.<br>
+ * Each segment is written to pack_dir/NAME.pack, and its index to pack_dir/NAME.idx.<br>
+ * A segment has the same format as a file written by pipeline_backup_file(), and holds the contents of its files back to back.<br>
+ * The index is a text file with one entry for every file in the segment, in the following format:<br>
+ * /path/to/file\0OFFSET LENGTH\n<br>
+ * where OFFSET and LENGTH are the decimal position and size of the file within the decompressed segment.
+ * @see pack_add_file()
+ * @see pack_writer_close()
+ *
+ * @param pack_dir The directory to write pack segments to.<br>
+ * This directory is created if it does not exist.
+ *
+ * @param opt The options to use. The hash algorithm, compressor, compression level/flags, and encryption algorithm are read from this structure.<br>
+ * This structure must stay valid until the pack writer is closed.
+ *
+ * @param password The encryption password to use.<br>
+ * If this is NULL and the segments are encrypted, the user is asked for a password for every segment.<br>
+ * This string must stay valid until the pack writer is closed.
+ *
+ * @param on_segment A function to call after every segment is successfully closed, with the paths of the segment and its index.<br>
+ * It is called on the thread that filled the segment, while no other file can be added.<br>
+ * This can be NULL.
+ *
+ * @param on_segment_data An extra argument to pass to on_segment.
+ *
+ * @return A new pack writer, or NULL on failure.<br>
+ * This must be closed with pack_writer_close() when no longer in use.
+ */
+struct pack_writer* pack_writer_new(const char* pack_dir, const struct options* opt, const char* password, int(*on_segment)(const char* pack, const char* index, void* on_segment_data), void* on_segment_data);
+
+/**
+ * @brief Adds a file to the current pack segment.<br>
+ * The file is read into memory before it is added, so this should only be used for small files.
+ *
+ * @param pw The pack writer to add the file to.
+ *
+ * @param file Path to the file to add.
+ *
+ * @param out_hash A pointer to a string that will contain the hexadecimal digest of the file, computed with opt->hash_algorithm.<br>
+ * This can be NULL if the digest is not needed.<br>
+ * Otherwise, the string must be free()'d when no longer in use. It is set to NULL on failure.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int pack_add_file(struct pack_writer* pw, const char* file, char** out_hash);
+
+/**
+ * @brief Adds a file to the current pack segment, reading it from somewhere else than the path it is indexed under.<br>
+ * This is how a file is packed from a snapshot while keeping its original path.
+ * @see pack_add_file()
+ *
+ * @param pw The pack writer to add the file to.
+ *
+ * @param src Path to read the file from.
+ *
+ * @param file Path to index the file under.
+ *
+ * @param out_hash A pointer to a string that will contain the hexadecimal digest of the file, computed with opt->hash_algorithm.<br>
+ * This can be NULL if the digest is not needed.<br>
+ * Otherwise, the string must be free()'d when no longer in use. It is set to NULL on failure.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int pack_add_file_from(struct pack_writer* pw, const char* src, const char* file, char** out_hash);
+
+/**
+ * @brief Adds a file to the current pack segment, and says which segment it went to.<br>
+ * Until that segment is closed, the file is not safely on disk. A segment can still be lost when it is closed.
+ * @see pack_add_file_from()
+ * @see pack_writer_defer()
+ *
+ * @param pw The pack writer to add the file to.
+ *
+ * @param src Path to read the file from.
+ *
+ * @param file Path to index the file under.
+ *
+ * @param out_hash A pointer to a string that will contain the hexadecimal digest of the file, computed with opt->hash_algorithm.<br>
+ * This can be NULL if the digest is not needed.<br>
+ * Otherwise, the string must be free()'d when no longer in use. It is set to NULL on failure.
+ *
+ * @param out_segment Set to the number of the segment the file was added to, or 0 on failure.<br>
+ * Segments are numbered from 1 in the order they are started. This can be NULL.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int pack_add_file_ex(struct pack_writer* pw, const char* src, const char* file, char** out_hash, unsigned long* out_segment);
+
+/**
+ * @brief Calls a function once a segment has been closed successfully.<br>
+ * If the segment is already closed, the function is called right away. If it is still being filled, the function is called when it is closed, on the thread that closes it, while no other file can be added.<br>
+ * If the segment is lost, the function is never called.<br>
+ * This is how a file is recorded as backed up only once it really is.
+ * @see pack_add_file_ex()
+ *
+ * @param pw The pack writer.
+ *
+ * @param segment The segment number that pack_add_file_ex() returned.
+ *
+ * @param func The function to call.<br>
+ * If it returns non-zero, closing the segment fails.
+ *
+ * @param free_data A function that frees data once func has been called or will never be. This can be NULL.
+ *
+ * @param data An extra argument to pass to func and free_data.
+ *
+ * @return 0 if func was called or will be, positive if the segment was lost, or negative on failure.<br>
+ * In every case, free_data is called on data, if not now then later.
+ */
+int pack_writer_defer(struct pack_writer* pw, unsigned long segment, int(*func)(void* data), void(*free_data)(void* data), void* data);
+
+/**
+ * @brief Closes the current pack segment so that every file added so far is safely on disk.<br>
+ * The next file that is added starts a new segment.
+ *
+ * @param pw The pack writer.
+ *
+ * @param func A function to call after the segment is closed, before any other file can be added.<br>
+ * This can be NULL.
+ *
+ * @param data An extra argument to pass to func.
+ *
+ * @return 0 on success, or negative if the segment could not be closed or func failed.
+ */
+int pack_writer_checkpoint(struct pack_writer* pw, int(*func)(void* data), void* data);
+
+/**
+ * @brief Closes the current pack segment and frees a pack writer.<br>
+ * Any function pack_writer_defer() is holding for that segment is called first, or dropped if the segment is lost.
+ *
+ * @param pw The pack writer to close.<br>
+ * This can be NULL, in which case this function does nothing.
+ *
+ * @return 0 on success, or negative if the last segment could not be closed.
+ */
+int pack_writer_close(struct pack_writer* pw);
+
+/**
+ * @brief Reads every entry in a pack index, in the order the files were added.
+ * @see pack_writer_new()
+ *
+ * @param index Path to the pack index.
+ *
+ * @param func A function to call for each entry, with the original path of the file and its position within the decompressed segment.<br>
+ * If it returns non-zero, reading stops and that value is returned.
+ *
+ * @param data An extra argument to pass to func.
+ *
+ * @return 0 on success, negative on failure, or the value func returned if it stopped early.
+ */
+int pack_read_index(const char* index, int(*func)(const char* file, unsigned long offset, unsigned long len, void* data), void* data);
+
+/**
+ * @brief Looks up a file in a pack index.
+ *
+ * @param index Path to the pack index.
+ *
+ * @param file Path of the original file.
+ *
+ * @param out_offset Set to the offset of the file within the decompressed segment.
+ *
+ * @param out_len Set to the length of the file.
+ *
+ * @return 0 if the file was found, positive if it was not in the index, or negative on failure.<br>
+ * If a file was added to the segment more than once, the last entry is used.
+ */
+int pack_find_file(const char* index, const char* file, unsigned long* out_offset, unsigned long* out_len);
+
+/**
+ * @brief A file to extract from a pack segment.
+ * @see pack_extract()
+ */
+struct pack_entry{
+	const char* out;      /**< @brief Path to write the file to. If this file already exists, it will be overwritten. This is not used by pack_extract_stream(). */
+	unsigned long offset; /**< @brief The offset of the file within the decompressed segment. */
+	unsigned long len;    /**< @brief The length of the file. */
+};
+
+/**
+ * @brief Extracts any number of files from a pack segment in a single pass.<br>
+ * The segment is decrypted and decompressed once, and each file is written straight to its output path.
+ * @see pack_read_index()
+ *
+ * @param pack Path to the pack segment.
+ *
+ * @param entries The files to extract.<br>
+ * These must be sorted by offset, and cannot overlap.
+ *
+ * @param n_entries The number of files to extract.
+ *
+ * @param opt The options the segment was written with.
+ *
+ * @param password The decryption password to use.<br>
+ * If this is NULL and the segment is encrypted, the user is asked for a password.
+ *
+ * @return 0 on success, or negative on failure.<br>
+ * If this function fails, the file that was being written is removed. Files that were already extracted are kept.
+ */
+int pack_extract(const char* pack, const struct pack_entry* entries, size_t n_entries, const struct options* opt, const char* password);
+
+/**
+ * @brief Extracts any number of files from a pack segment in a single pass, handing their data to a callback instead of writing it to disk.
+ * @see pack_extract()
+ *
+ * @param pack Path to the pack segment.
+ *
+ * @param entries The files to extract.<br>
+ * These must be sorted by offset, and cannot overlap.
+ *
+ * @param n_entries The number of files to extract.
+ *
+ * @param opt The options the segment was written with.
+ *
+ * @param password The decryption password to use.<br>
+ * If this is NULL and the segment is encrypted, the user is asked for a password.
+ *
+ * @param sink A function that receives each block of each file, along with the file's index in entries.<br>
+ * Once a file is complete, it is called one more time with data set to NULL and len set to 0. This happens for empty files too.<br>
+ * It must return 0 on success or non-zero to abort.
+ *
+ * @param sink_data An argument to pass to sink.
+ *
+ * @return 0 on success, or negative on failure.<br>
+ * On failure, the sink may already have received part of the data.
+ */
+int pack_extract_stream(const char* pack, const struct pack_entry* entries, size_t n_entries, const struct options* opt, const char* password, int(*sink)(size_t entry, const void* data, size_t len, void* sink_data), void* sink_data);
+
+/**
+ * @brief Extracts a single file from a pack segment.
+ * @see pack_find_file()
+ * @see pack_extract()
+ *
+ * @param pack Path to the pack segment.
+ *
+ * @param offset The offset of the file within the decompressed segment.
+ *
+ * @param len The length of the file.
+ *
+ * @param out Path to write the file to.<br>
+ * If this file already exists, it will be overwritten.<br>
+ * If this function fails, the output file is removed.
+ *
+ * @param opt The options the segment was written with.
+ *
+ * @param password The decryption password to use.<br>
+ * If this is NULL and the segment is encrypted, the user is asked for a password.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int pack_restore_file(const char* pack, unsigned long offset, unsigned long len, const char* out, const struct options* opt, const char* password);
+
+#endif
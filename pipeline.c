@@ -0,0 +1,999 @@
+/** @file pipeline.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "pipeline.h"
+#include "compression/zip.h"
+#include "crypt/crypt.h"
+#include "crypt/crypt_easy.h"
+#include "crypt/crypt_session.h"
+#include "coredumps.h"
+#include "policy.h"
+#include "filehelper.h"
+#include "progressbar.h"
+#include "stats.h"
+#include "trace.h"
+#include "strings/stringhelper.h"
+#include "treehash.h"
+#include "log.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/evp.h>
+
+/* the final stage; everything else eventually ends up here */
+struct pipeline_out{
+	FILE* fp;
+	/* where the output goes instead of fp, or NULL */
+	int (*sink)(const void* data, size_t len, void* sink_data);
+	void* sink_data;
+	const char* path;
+	/* a restored file gets its holes back */
+	int sparse;
+	/* the output's checksum, or NULL if it is not needed */
+	struct tree_hash* artifact;
+	struct stats_time write_time;
+	uint64_t written;
+};
+
+static int file_sink(const void* data, size_t len, void* sink_data){
+	struct pipeline_out* po = sink_data;
+	struct stats_time mark;
+
+	stats_time_now(&mark);
+	if (po->sink){
+		if (po->sink(data, len, po->sink_data) != 0){
+			log_error_ex("Failed to hand off the output for %s", po->path);
+			return -1;
+		}
+	}
+	else if (po->sparse ? write_sparse(po->fp, data, len) != 0 : fwrite(data, 1, len, po->fp) != len){
+		log_efwrite(po->path);
+		return -1;
+	}
+	if (po->artifact && tree_hash_update(po->artifact, data, len) != 0){
+		return -1;
+	}
+	trace_lap(STAGE_WRITE, &po->write_time, &mark);
+	po->written += len;
+	return 0;
+}
+
+struct pipeline{
+	struct pipeline_out po;
+	char* path;
+	struct crypt_keys* fk;
+	struct crypt_stream* cs;
+	struct ZIP_FILE* zfp;
+	int core_dumps_disabled;
+	/* each stage's time includes the stages after it, since they run inside its sink */
+	struct stats_time zip_time;
+	struct stats_time crypt_time;
+	uint64_t zip_in;
+	uint64_t crypt_in;
+	/* the output is started on its way to disk as soon as it is done, so the next checkpoint's sync has less to wait for */
+	int write_behind;
+};
+
+static int crypt_sink(const void* data, size_t len, void* sink_data){
+	struct pipeline* pl = sink_data;
+	struct stats_time mark;
+	int ret;
+
+	stats_time_now(&mark);
+	ret = crypt_stream_write(pl->cs, data, len);
+	trace_lap(STAGE_ENCRYPT, &pl->crypt_time, &mark);
+	pl->crypt_in += len;
+	return ret;
+}
+
+static void pipeline_add_time(struct stats_time* total, const struct stats_time* t){
+	total->wall += t->wall;
+	total->cpu += t->cpu;
+}
+
+/* adds one file's worth of pipeline time to the totals, with each stage's time excluding the stages after it */
+static void pipeline_record_stats(const struct pipeline* pl){
+	const struct stats_time* after_zip = pl->cs ? &pl->crypt_time : &pl->po.write_time;
+	struct stats_time t;
+
+	t.wall = pl->zip_time.wall - after_zip->wall;
+	t.cpu = pl->zip_time.cpu - after_zip->cpu;
+	stats_add(STAGE_COMPRESS, &t, pl->zip_in, pl->cs ? pl->crypt_in : pl->po.written, 1);
+	if (pl->cs){
+		t.wall = pl->crypt_time.wall - pl->po.write_time.wall;
+		t.cpu = pl->crypt_time.cpu - pl->po.write_time.cpu;
+		stats_add(STAGE_ENCRYPT, &t, pl->crypt_in, pl->po.written, 1);
+	}
+	stats_add(STAGE_WRITE, &pl->po.write_time, pl->po.written, pl->po.written, 1);
+}
+
+/* frees everything without finishing the streams */
+static void pipeline_free(struct pipeline* pl){
+	zip_stream_free(pl->zfp);
+	crypt_stream_free(pl->cs);
+	/* shreds keys as well */
+	pl->fk ? crypt_free(pl->fk) : (void)0;
+	if (pl->core_dumps_disabled && enable_core_dumps() != 0){
+		log_debug("enable_core_dumps() failed");
+	}
+	free(pl->path);
+	free(pl);
+}
+
+void pipeline_abort(struct pipeline* pl){
+	if (!pl){
+		return;
+	}
+	if (pl->po.fp){
+		fclose(pl->po.fp);
+		remove(pl->path);
+	}
+	pipeline_free(pl);
+}
+
+/* dict is NULL unless the data is small enough to benefit from it
+ * if sink is not NULL, the output goes there instead of to a file, and out only names it in messages
+ * if artifact is not NULL, everything written is added to it, header and all */
+static struct pipeline* pipeline_start(const char* out, int (*sink)(const void* data, size_t len, void* sink_data), void* sink_data, const struct options* opt, const char* password, const struct zip_dict* dict, struct tree_hash* artifact){
+	struct pipeline* pl;
+
+	return_ifnull(out, NULL);
+	return_ifnull(opt, NULL);
+
+	pl = calloc(1, sizeof(*pl));
+	if (!pl){
+		log_enomem();
+		return NULL;
+	}
+	if (!(pl->path = sh_dup(out))){
+		log_enomem();
+		free(pl);
+		return NULL;
+	}
+	pl->po.path = pl->path;
+	pl->po.sink = sink;
+	pl->po.sink_data = sink_data;
+	pl->po.artifact = artifact;
+	pl->write_behind = opt->flags.bits.flag_durable;
+
+	if (!sink && !(pl->po.fp = fopen(out, "wb"))){
+		log_efopen(out);
+		goto cleanup_freeparams;
+	}
+
+	/* it goes in front of the encryption header, since it says whether there is one */
+	if (opt->policy_marked){
+		unsigned char marker[POLICY_MARKER_LEN];
+
+		policy_marker_make(opt, marker);
+		if (file_sink(marker, sizeof(marker), &pl->po) != 0){
+			goto cleanup_freeparams;
+		}
+	}
+
+	/* a session already has core dumps off, and makes each file's keys without going through the password again */
+	if (opt->enc_algorithm && opt->enc_session){
+		if (crypt_session_encryption_keys(opt->enc_session, &pl->fk) != 0){
+			log_error("Failed to generate encryption keys");
+			goto cleanup_freeparams;
+		}
+	}
+	else if (opt->enc_algorithm){
+		/* the keys live in memory until the pipeline is closed */
+		if (disable_core_dumps() != 0){
+			log_warning("Core dumps could not be disabled");
+		}
+		pl->core_dumps_disabled = 1;
+
+		if (easy_encryption_keys(EVP_CIPHER_name(opt->enc_algorithm), password, &pl->fk) != 0){
+			log_error("Failed to generate encryption keys");
+			goto cleanup_freeparams;
+		}
+	}
+	if (pl->fk){
+		/* the same workers that compress the blocks of a file encrypt its chunks */
+		crypt_set_workers(pl->fk, ZIP_GET_WORKERS(opt->c_flags));
+		if (!(pl->cs = crypt_stream_new(pl->fk, file_sink, &pl->po))){
+			log_error("Failed to start encryption");
+			goto cleanup_freeparams;
+		}
+		/* the header was written outside of zip's sink, but it belongs to the later stages like everything else */
+		pl->crypt_time = pl->po.write_time;
+		pl->zip_time = pl->po.write_time;
+	}
+
+	pl->zfp = pl->cs ? zip_stream_new(opt->c_type, opt->c_level, opt->c_flags, crypt_sink, pl) : zip_stream_new(opt->c_type, opt->c_level, opt->c_flags, file_sink, &pl->po);
+	if (!pl->zfp){
+		log_error("Failed to start compression");
+		goto cleanup_freeparams;
+	}
+	if (dict && zip_stream_use_dict(pl->zfp, dict) != 0){
+		log_error("Failed to use the compression dictionary");
+		goto cleanup_freeparams;
+	}
+
+	return pl;
+
+cleanup_freeparams:
+	pipeline_abort(pl);
+	return NULL;
+}
+
+struct pipeline* pipeline_open(const char* out, const struct options* opt, const char* password){
+	return pipeline_start(out, NULL, NULL, opt, password, NULL, NULL);
+}
+
+struct pipeline* pipeline_open_sink(const char* name, int (*sink)(const void* data, size_t len, void* sink_data), void* sink_data, const struct options* opt, const char* password){
+	return_ifnull(sink, NULL);
+	return pipeline_start(name, sink, sink_data, opt, password, NULL, NULL);
+}
+
+int pipeline_write(struct pipeline* pl, const void* data, size_t len){
+	struct stats_time mark;
+
+	return_ifnull(pl, -1);
+
+	stats_time_now(&mark);
+	if (zip_stream_write(pl->zfp, data, len) != 0){
+		log_error_ex("Failed to compress data for %s", pl->path);
+		return -1;
+	}
+	trace_lap(STAGE_COMPRESS, &pl->zip_time, &mark);
+	pl->zip_in += len;
+	return 0;
+}
+
+int pipeline_close(struct pipeline* pl){
+	struct stats_time mark;
+	int ret = 0;
+
+	return_ifnull(pl, -1);
+
+	stats_time_now(&mark);
+	if (zip_stream_finish(pl->zfp) != 0){
+		log_error("Failed to finish compression");
+		ret = -1;
+		goto cleanup;
+	}
+	trace_lap(STAGE_COMPRESS, &pl->zip_time, &mark);
+	if (pl->cs && crypt_stream_finish(pl->cs) != 0){
+		log_error("Failed to finish encryption");
+		ret = -1;
+		goto cleanup;
+	}
+	if (pl->cs){
+		struct stats_time finish_time = { 0, 0 };
+
+		/* called directly instead of through zip's sink, so it has to count towards both */
+		stats_time_lap(&finish_time, &mark);
+		pipeline_add_time(&pl->crypt_time, &finish_time);
+		pipeline_add_time(&pl->zip_time, &finish_time);
+	}
+	pipeline_record_stats(pl);
+
+cleanup:
+	if (pl->po.fp && ret == 0 && pl->write_behind){
+		write_behind(pl->po.fp);
+	}
+	if (pl->po.fp && fclose(pl->po.fp) != 0){
+		log_efclose(pl->path);
+		ret = -1;
+	}
+	/* a sink's output is not a file, and its path may well be the input */
+	if (ret != 0 && !pl->po.sink){
+		remove(pl->path);
+	}
+	pl->po.fp = NULL;
+	pipeline_free(pl);
+	return ret;
+}
+
+/* an uncompressed, unencrypted output is the file itself, so the kernel can copy it (or share its blocks) without it coming through here */
+static int backup_copy(const char* in, const char* out){
+	struct stats_time start;
+	uint64_t size;
+
+	stats_time_now(&start);
+	if (copy_file(in, out) != 0){
+		remove(out);
+		return -1;
+	}
+	size = get_file_size(out);
+	progress_board_add(STAGE_READ, size);
+	stats_record(STAGE_WRITE, &start, size, size, 1);
+	trace_since(stats_stage_tostring(STAGE_WRITE), &start, in);
+	return 0;
+}
+
+/* a file that starts with a policy marker would be taken for one made under a policy if it were stored as it is */
+static int file_has_marker(const char* in){
+	unsigned char head[POLICY_MARKER_LEN];
+	FILE* fp;
+	size_t len;
+
+	if (!(fp = fopen(in, "rb"))){
+		return 0;
+	}
+	len = fread(head, 1, sizeof(head), fp);
+	fclose(fp);
+	return policy_marker_read(head, len, NULL, NULL);
+}
+
+/* pipeline_backup_file() and pipeline_backup_stream(), which only differ in where the output goes */
+static int backup_to(const char* in, const char* out, int (*sink)(const void* data, size_t len, void* sink_data), void* sink_data, const struct options* opt, const char* password, int verbose, char** out_hash, char** out_artifact){
+	unsigned char buffer[BUFFER_LEN];
+	struct options opt_stored;
+	struct source_file* sf_in = NULL;
+	struct tree_hash* th = NULL;
+	struct tree_hash* th_artifact = NULL;
+	struct pipeline* pl = NULL;
+	struct progress* p = NULL;
+	char* progress_msg = NULL;
+	struct stats_time mark;
+	struct stats_time read_time = { 0, 0 };
+	struct stats_time hash_time = { 0, 0 };
+	uint64_t bytes_read = 0;
+	/* how many of the bytes read next are a hole, which the checksum gets as zeros without looking at them */
+	uint64_t hole;
+	int out_created = 0;
+	int len;
+	int ret = 0;
+
+	if (out_hash){
+		*out_hash = NULL;
+	}
+	if (out_artifact){
+		*out_artifact = NULL;
+	}
+
+	/* nothing has to see the data on its way through */
+	if (!sink && !out_hash && !out_artifact && !verbose && opt->c_type == COMPRESSOR_NONE && !opt->enc_algorithm && !opt->policy_marked && !file_has_marker(in)){
+		return backup_copy(in, out);
+	}
+
+	sf_in = source_open(in, 0);
+	if (!sf_in){
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (out_hash && !(th = tree_hash_new(opt->hash_algorithm, opt->flags.bits.flag_tree_hash ? TREE_HASH_SEGMENT_LEN : 0))){
+		ret = -1;
+		goto cleanup;
+	}
+	/* a plain digest, since the output is checked as a whole and a tree hash would only be faster on huge ones */
+	if (out_artifact && !(th_artifact = tree_hash_new(opt->hash_algorithm, 0))){
+		ret = -1;
+		goto cleanup;
+	}
+
+	stats_time_now(&mark);
+	hole = source_hole(sf_in);
+	len = source_read(sf_in, buffer, sizeof(buffer));
+	trace_lap(STAGE_READ, &read_time, &mark);
+
+	/* the first block decides if the file is worth compressing at all
+	 * a stored file starts with a marker saying so, the same one a policy's files have, so restoring never has to guess */
+	if (opt->flags.bits.flag_store_incompressible && opt->c_type != COMPRESSOR_NONE && len > 0 &&
+			(zip_incompressible_name(in) || zip_is_incompressible(buffer, len))){
+		log_info_ex("Storing %s without compressing it", in);
+		opt_stored = *opt;
+		opt_stored.c_type = COMPRESSOR_NONE;
+		opt_stored.c_dict = NULL;
+		opt_stored.policy_marked = 1;
+		opt = &opt_stored;
+	}
+	/* it is marked as stored instead, which restore() can tell apart */
+	if (opt->c_type == COMPRESSOR_NONE && !opt->enc_algorithm && !opt->policy_marked && policy_marker_read(buffer, len > 0 ? (size_t)len : 0, NULL, NULL)){
+		if (opt != &opt_stored){
+			opt_stored = *opt;
+			opt = &opt_stored;
+		}
+		opt_stored.policy_marked = 1;
+	}
+
+	/* a bigger file has enough repeats of its own, and a dictionary would only slow it down */
+	if (!(pl = pipeline_start(out, sink, sink_data, opt, password, opt->c_dict && source_size(sf_in) < opt->dict_threshold ? opt->c_dict : NULL, th_artifact))){
+		ret = -1;
+		goto cleanup;
+	}
+	out_created = !sink;
+
+	if (verbose){
+		progress_msg = sh_concat(sh_concat(sh_dup("Backing up "), in), "...");
+		p = start_progress(progress_msg ? progress_msg : "Backing up file...", source_size(sf_in));
+	}
+
+	while (len > 0){
+		bytes_read += len;
+		stats_time_now(&mark);
+		if (th){
+			if ((hole >= (uint64_t)len ? tree_hash_update_zeros(th, len) : tree_hash_update(th, buffer, len)) != 0){
+				ret = -1;
+				goto cleanup;
+			}
+			trace_lap(STAGE_HASH, &hash_time, &mark);
+		}
+		if (pipeline_write(pl, buffer, len) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+		inc_progress(p, len);
+		progress_board_add(STAGE_READ, len);
+		stats_time_now(&mark);
+		hole = source_hole(sf_in);
+		len = source_read(sf_in, buffer, sizeof(buffer));
+		trace_lap(STAGE_READ, &read_time, &mark);
+	}
+	stats_add(STAGE_READ, &read_time, bytes_read, bytes_read, 1);
+	th ? stats_add(STAGE_HASH, &hash_time, bytes_read, 0, 1) : (void)0;
+	if (len < 0){
+		ret = -1;
+		goto cleanup;
+	}
+
+	ret = pipeline_close(pl);
+	pl = NULL;
+	if (ret != 0){
+		goto cleanup;
+	}
+
+	if (th && tree_hash_final(th, out_hash) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+	if (th_artifact && tree_hash_final(th_artifact, out_artifact) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+
+cleanup:
+	ret == 0 ? finish_progress(p) : finish_progress_fail(p);
+	pipeline_abort(pl);
+	tree_hash_free(th);
+	tree_hash_free(th_artifact);
+	source_close(sf_in);
+	if (ret != 0){
+		/* the pipeline is already gone, but the output is still there if hashing failed */
+		out_created ? remove(out) : 0;
+		if (out_hash){
+			free(*out_hash);
+			*out_hash = NULL;
+		}
+		if (out_artifact){
+			free(*out_artifact);
+			*out_artifact = NULL;
+		}
+	}
+	free(progress_msg);
+	return ret;
+}
+
+int pipeline_backup_file(const char* in, const char* out, const struct options* opt, const char* password, int verbose, char** out_hash){
+	return pipeline_backup_file_ex(in, out, opt, password, verbose, out_hash, NULL);
+}
+
+int pipeline_backup_file_ex(const char* in, const char* out, const struct options* opt, const char* password, int verbose, char** out_hash, char** out_artifact){
+	return_ifnull(in, -1);
+	return_ifnull(out, -1);
+	return_ifnull(opt, -1);
+
+	return backup_to(in, out, NULL, NULL, opt, password, verbose, out_hash, out_artifact);
+}
+
+int pipeline_backup_stream(const char* in, int (*sink)(const void* data, size_t len, void* sink_data), void* sink_data, const struct options* opt, const char* password, int verbose, char** out_hash){
+	return pipeline_backup_stream_ex(in, sink, sink_data, opt, password, verbose, out_hash, NULL);
+}
+
+int pipeline_backup_stream_ex(const char* in, int (*sink)(const void* data, size_t len, void* sink_data), void* sink_data, const struct options* opt, const char* password, int verbose, char** out_hash, char** out_artifact){
+	return_ifnull(in, -1);
+	return_ifnull(sink, -1);
+	return_ifnull(opt, -1);
+
+	/* there is no output file, so messages name the input instead */
+	return backup_to(in, in, sink, sink_data, opt, password, verbose, out_hash, out_artifact);
+}
+
+static int zip_sink(const void* data, size_t len, void* sink_data){
+	return zip_stream_write(sink_data, data, len);
+}
+
+/* the longest header before the encrypted data: the "Salted__" or "Session_" prefix, the salt, and a session's nonce */
+#define RESTORE_HEADER_MAX (16 + CRYPT_NONCE_LEN)
+
+struct restore_pipeline{
+	const struct options* opt;
+	const char* password;
+	char* name;
+	/* the start of the file is collected here to see if it was made under a policy, which says how to restore it */
+	unsigned char marker[POLICY_MARKER_LEN];
+	size_t marker_len;
+	int marker_done;
+	/* the encryption header is collected here until it is whole, since the keys come from it */
+	unsigned char header[RESTORE_HEADER_MAX];
+	size_t header_len;
+	size_t header_need;
+	struct crypt_keys* fk;
+	struct crypt_stream* cs;
+	struct ZIP_FILE* zfp;
+	/* the compressor zfp decompresses, which a policy marker can change */
+	enum compressor c_type;
+	int(*sink)(const void* data, size_t len, void* sink_data);
+	void* sink_data;
+	int core_dumps_disabled;
+};
+
+static void restore_pipeline_free(struct restore_pipeline* rp){
+	crypt_stream_free(rp->cs);
+	zip_stream_free(rp->zfp);
+	/* shreds keys as well */
+	rp->fk ? crypt_free(rp->fk) : (void)0;
+	crypt_scrub(rp->header, sizeof(rp->header));
+	if (rp->core_dumps_disabled && enable_core_dumps() != 0){
+		log_debug("enable_core_dumps() failed");
+	}
+	free(rp->name);
+	free(rp);
+}
+
+struct restore_pipeline* pipeline_restore_open(const char* name, const struct options* opt, const char* password, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	struct restore_pipeline* rp;
+
+	return_ifnull(name, NULL);
+	return_ifnull(opt, NULL);
+	return_ifnull(sink, NULL);
+
+	rp = calloc(1, sizeof(*rp));
+	if (!rp){
+		log_enomem();
+		return NULL;
+	}
+	rp->opt = opt;
+	rp->password = password;
+	/* enough to tell a session's header from one that only has a salt */
+	rp->header_need = opt->enc_algorithm ? 16 : 0;
+	if (!(rp->name = sh_dup(name))){
+		log_enomem();
+		restore_pipeline_free(rp);
+		return NULL;
+	}
+
+	if (!(rp->zfp = zip_decompress_stream_new(opt->c_type, opt->c_flags, sink, sink_data))){
+		log_error("Failed to start decompression");
+		restore_pipeline_free(rp);
+		return NULL;
+	}
+	/* only used if this file was compressed with it */
+	if (opt->c_dict && zip_stream_use_dict(rp->zfp, opt->c_dict) != 0){
+		log_error("Failed to use the compression dictionary");
+		restore_pipeline_free(rp);
+		return NULL;
+	}
+	rp->c_type = opt->c_type;
+	rp->sink = sink;
+	rp->sink_data = sink_data;
+	return rp;
+}
+
+/* makes the keys once the whole header is in, after which everything goes through the cipher */
+static int restore_pipeline_keys(struct restore_pipeline* rp){
+	const struct options* opt = rp->opt;
+
+	if (opt->enc_session){
+		if (crypt_session_decryption_keys_buf(opt->enc_session, rp->header, rp->header_len, &rp->fk) != 0){
+			log_error_ex("Failed to generate decryption keys for %s", rp->name);
+			return -1;
+		}
+	}
+	else{
+		/* the keys live in memory until the file is restored */
+		if (disable_core_dumps() != 0){
+			log_warning("Core dumps could not be disabled");
+		}
+		rp->core_dumps_disabled = 1;
+
+		if (easy_decryption_keys_buf(EVP_CIPHER_name(opt->enc_algorithm), rp->header, rp->header_len, rp->password, &rp->fk) != 0){
+			log_error_ex("Failed to generate decryption keys for %s", rp->name);
+			return -1;
+		}
+	}
+	crypt_set_workers(rp->fk, ZIP_GET_WORKERS(opt->c_flags));
+
+	if (!(rp->cs = crypt_decrypt_stream_new(rp->fk, zip_sink, rp->zfp))){
+		log_error("Failed to start decryption");
+		return -1;
+	}
+	return 0;
+}
+
+/* everything after the policy marker, or from the start if there is none */
+static int restore_pipeline_feed(struct restore_pipeline* rp, const unsigned char* ptr, size_t len){
+	while (rp->header_len < rp->header_need && len > 0){
+		size_t n = rp->header_need - rp->header_len;
+
+		if (n > len){
+			n = len;
+		}
+		memcpy(rp->header + rp->header_len, ptr, n);
+		rp->header_len += n;
+		ptr += n;
+		len -= n;
+
+		if (rp->header_len == 16 && rp->header_need == 16 && memcmp(rp->header, "Session_", 8) == 0){
+			rp->header_need = RESTORE_HEADER_MAX;
+		}
+		else if (rp->header_len == rp->header_need && restore_pipeline_keys(rp) != 0){
+			return -1;
+		}
+	}
+	if (len == 0){
+		return 0;
+	}
+
+	if ((rp->cs ? crypt_stream_write(rp->cs, ptr, len) : zip_stream_write(rp->zfp, ptr, len)) != 0){
+		log_error_ex("Failed to restore data from %s", rp->name);
+		return -1;
+	}
+	return 0;
+}
+
+/* a file made under a policy gets the compressor and encryption it says, and any other file gets what was collected back */
+static int restore_pipeline_marker(struct restore_pipeline* rp){
+	enum compressor c_type;
+	int plain;
+
+	rp->marker_done = 1;
+	if (!policy_marker_read(rp->marker, rp->marker_len, &c_type, &plain)){
+		return rp->marker_len > 0 ? restore_pipeline_feed(rp, rp->marker, rp->marker_len) : 0;
+	}
+
+	if (plain){
+		rp->header_need = 0;
+	}
+	else if (!rp->opt->enc_algorithm){
+		log_error_ex("%s is encrypted, but no encryption algorithm is set", rp->name);
+		return -1;
+	}
+	/* only the base compressor can have been given the dictionary */
+	if (c_type != rp->c_type){
+		zip_stream_free(rp->zfp);
+		if (!(rp->zfp = zip_decompress_stream_new(c_type, rp->opt->c_flags, rp->sink, rp->sink_data))){
+			log_error("Failed to start decompression");
+			return -1;
+		}
+		rp->c_type = c_type;
+	}
+	return 0;
+}
+
+int pipeline_restore_write(const void* data, size_t len, void* restore_pipeline){
+	struct restore_pipeline* rp = restore_pipeline;
+	const unsigned char* ptr = data;
+
+	return_ifnull(rp, -1);
+	return_ifnull(data, -1);
+
+	if (!rp->marker_done){
+		size_t n = POLICY_MARKER_LEN - rp->marker_len;
+
+		if (n > len){
+			n = len;
+		}
+		memcpy(rp->marker + rp->marker_len, ptr, n);
+		rp->marker_len += n;
+		ptr += n;
+		len -= n;
+		if (rp->marker_len < POLICY_MARKER_LEN){
+			return 0;
+		}
+		if (restore_pipeline_marker(rp) != 0){
+			return -1;
+		}
+	}
+	return len > 0 ? restore_pipeline_feed(rp, ptr, len) : 0;
+}
+
+int pipeline_restore_close(struct restore_pipeline* rp){
+	int ret = 0;
+
+	return_ifnull(rp, -1);
+
+	/* a file shorter than the marker */
+	if (!rp->marker_done && restore_pipeline_marker(rp) != 0){
+		ret = -1;
+	}
+	else if (rp->header_len < rp->header_need){
+		log_error_ex("%s ends before its encryption header does", rp->name);
+		ret = -1;
+	}
+	else if (rp->cs && crypt_stream_finish(rp->cs) != 0){
+		log_error_ex("Failed to finish decrypting %s", rp->name);
+		ret = -1;
+	}
+	else if (zip_stream_finish(rp->zfp) != 0){
+		log_error_ex("Failed to finish decompressing %s", rp->name);
+		ret = -1;
+	}
+
+	restore_pipeline_free(rp);
+	return ret;
+}
+
+void pipeline_restore_abort(struct restore_pipeline* rp){
+	if (!rp){
+		return;
+	}
+	restore_pipeline_free(rp);
+}
+
+int pipeline_restore_stream(const char* in, const struct options* opt, const char* password, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	unsigned char buffer[BUFFER_LEN];
+	FILE* fp_in = NULL;
+	struct restore_pipeline* rp = NULL;
+	int len;
+	int ret = 0;
+
+	return_ifnull(in, -1);
+	return_ifnull(opt, -1);
+	return_ifnull(sink, -1);
+
+	fp_in = fopen(in, "rb");
+	if (!fp_in){
+		log_efopen(in);
+		ret = -1;
+		goto cleanup;
+	}
+	if (!(rp = pipeline_restore_open(in, opt, password, sink, sink_data))){
+		ret = -1;
+		goto cleanup;
+	}
+
+	/* reads the file once; each block is decrypted and decompressed straight into the sink */
+	while ((len = read_file(fp_in, buffer, sizeof(buffer))) > 0){
+		if (pipeline_restore_write(buffer, len, rp) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+	}
+	if (ferror(fp_in)){
+		log_efread(in);
+		ret = -1;
+		goto cleanup;
+	}
+
+	ret = pipeline_restore_close(rp);
+	rp = NULL;
+
+cleanup:
+	pipeline_restore_abort(rp);
+	fp_in ? fclose(fp_in) : 0;
+	return ret;
+}
+
+/* hands only the part of the original data that falls in the range to the real sink */
+struct range_sink{
+	uint64_t skip;
+	uint64_t left;
+	int(*sink)(const void* data, size_t len, void* sink_data);
+	void* sink_data;
+};
+
+static int range_sink_write(const void* data, size_t len, void* sink_data){
+	struct range_sink* rs = sink_data;
+	const unsigned char* ptr = data;
+
+	if (rs->skip >= len){
+		rs->skip -= len;
+		return 0;
+	}
+	ptr += rs->skip;
+	len -= (size_t)rs->skip;
+	rs->skip = 0;
+	if (len > rs->left){
+		len = (size_t)rs->left;
+	}
+	rs->left -= len;
+	return len > 0 ? rs->sink(ptr, len, rs->sink_data) : 0;
+}
+
+/* a file that was stored as it was is the original data, so the range is copied straight out of it */
+static int restore_range_stored(FILE* fp, long base, uint64_t offset, uint64_t len, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	unsigned char buffer[BUFFER_LEN];
+
+	if (fseek(fp, base + (long)offset, SEEK_SET) != 0){
+		return 0;
+	}
+	while (len > 0){
+		size_t n = read_file(fp, buffer, len < sizeof(buffer) ? (size_t)len : sizeof(buffer));
+
+		if (n == 0){
+			break;
+		}
+		if (sink(buffer, n, sink_data) != 0){
+			return -1;
+		}
+		len -= n;
+	}
+	if (ferror(fp)){
+		log_efread("stored file");
+		return -1;
+	}
+	return 0;
+}
+
+int pipeline_restore_range(const char* in, const struct options* opt, const char* password, uint64_t offset, uint64_t len, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	unsigned char head[POLICY_MARKER_LEN];
+	struct range_sink rs;
+	enum compressor c_type;
+	int plain;
+	long base = 0;
+	FILE* fp;
+	size_t n;
+	int res = 1;
+
+	return_ifnull(in, -1);
+	return_ifnull(opt, -1);
+	return_ifnull(sink, -1);
+
+	if (!(fp = fopen(in, "rb"))){
+		log_efopen(in);
+		return -1;
+	}
+	c_type = opt->c_type;
+	plain = !opt->enc_algorithm;
+	n = read_file(fp, head, POLICY_MARKER_LEN);
+	if (policy_marker_read(head, n, &c_type, &plain)){
+		base = POLICY_MARKER_LEN;
+	}
+
+	/* encrypted data can only be read from the start */
+	if (plain && fseek(fp, base, SEEK_SET) == 0){
+		if (c_type == COMPRESSOR_NONE){
+			res = restore_range_stored(fp, base, offset, len, sink, sink_data);
+		}
+		else{
+			/* only the base compressor can have been given the dictionary */
+			res = zip_decompress_range(fp, c_type, opt->c_flags, c_type == opt->c_type ? opt->c_dict : NULL, offset, len, sink, sink_data);
+		}
+	}
+	fclose(fp);
+	if (res <= 0){
+		if (res < 0){
+			log_error_ex("Failed to restore part of %s", in);
+		}
+		return res;
+	}
+
+	rs.skip = offset;
+	rs.left = len;
+	rs.sink = sink;
+	rs.sink_data = sink_data;
+	return pipeline_restore_stream(in, opt, password, range_sink_write, &rs);
+}
+
+int pipeline_restore_file(const char* in, const char* out, const struct options* opt, const char* password){
+	struct pipeline_out po;
+	int ret = 0;
+
+	return_ifnull(in, -1);
+	return_ifnull(out, -1);
+	return_ifnull(opt, -1);
+
+	memset(&po, 0, sizeof(po));
+	po.path = out;
+	po.sparse = 1;
+	po.fp = fopen(out, "wb");
+	if (!po.fp){
+		log_efopen(out);
+		return -1;
+	}
+
+	if (pipeline_restore_stream(in, opt, password, file_sink, &po) != 0){
+		ret = -1;
+	}
+	else if (finish_sparse(po.fp) != 0){
+		log_efwrite(out);
+		ret = -1;
+	}
+
+	if (fclose(po.fp) != 0){
+		log_efclose(out);
+		ret = -1;
+	}
+	if (ret != 0){
+		remove(out);
+	}
+	return ret;
+}
+
+/* the dictionary itself is made from the backed up files, so it is encrypted like them, but there is no point compressing it */
+static void dict_options(const struct options* opt, struct options* out){
+	*out = *opt;
+	out->c_type = COMPRESSOR_NONE;
+	out->c_dict = NULL;
+}
+
+int pipeline_save_dict(const char* out, const struct zip_dict* dict, const struct options* opt, const char* password){
+	struct options opt_dict;
+	struct pipeline* pl;
+	const void* data;
+	size_t len;
+
+	return_ifnull(out, -1);
+	return_ifnull(dict, -1);
+	return_ifnull(opt, -1);
+
+	if (!(data = zip_dict_data(dict, &len))){
+		return -1;
+	}
+
+	dict_options(opt, &opt_dict);
+	if (!(pl = pipeline_open(out, &opt_dict, password))){
+		return -1;
+	}
+	if (pipeline_write(pl, data, len) != 0){
+		pipeline_abort(pl);
+		return -1;
+	}
+	return pipeline_close(pl);
+}
+
+struct dict_buffer{
+	unsigned char data[ZIP_DICT_LEN];
+	size_t len;
+};
+
+static int dict_sink(const void* data, size_t len, void* sink_data){
+	struct dict_buffer* db = sink_data;
+
+	if (len > sizeof(db->data) - db->len){
+		log_error("The dictionary is too big");
+		return -1;
+	}
+	memcpy(db->data + db->len, data, len);
+	db->len += len;
+	return 0;
+}
+
+int pipeline_load_dict(const char* in, const struct options* opt, const char* password, struct zip_dict** out){
+	struct options opt_dict;
+	struct dict_buffer* db = NULL;
+	int ret = 0;
+
+	return_ifnull(out, -1);
+	*out = NULL;
+	return_ifnull(in, -1);
+	return_ifnull(opt, -1);
+
+	if (!file_exists(in)){
+		return 1;
+	}
+
+	db = malloc(sizeof(*db));
+	if (!db){
+		log_enomem();
+		return -1;
+	}
+	db->len = 0;
+
+	dict_options(opt, &opt_dict);
+	if (pipeline_restore_stream(in, &opt_dict, password, dict_sink, db) != 0){
+		log_error_ex("Failed to read the dictionary in %s", in);
+		ret = -1;
+		goto cleanup;
+	}
+	if (!(*out = zip_dict_new(opt->c_type, opt->c_level, db->data, db->len))){
+		ret = -1;
+		goto cleanup;
+	}
+
+cleanup:
+	free(db);
+	return ret;
+}
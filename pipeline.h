@@ -0,0 +1,370 @@
+/** @file pipeline.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __PIPELINE_H
+#define __PIPELINE_H
+
+#include "options/options.h"
+#include <stddef.h>
+
+/**
+ * @brief An open compression/encryption pipeline that writes to a single output file.
+ */
+struct pipeline;
+
+/**
+ * @brief Opens a pipeline that compresses and encrypts everything written to it into a file.<br>
+ * This is the building block of pipeline_backup_file(), and is useful when the data does not come from a single file.
+ * @see pipeline_write()
+ * @see pipeline_close()
+ *
+ * @param out Path to write the compressed/encrypted data to.<br>
+ * If this file already exists, it will be overwritten.
+ *
+ * @param opt The options to use. The compressor, compression level/flags, and encryption algorithm are read from this structure.<br>
+ * If opt->enc_algorithm is NULL, the output is not encrypted.
+ *
+ * @param password The encryption password to use.<br>
+ * If this is NULL and the output is encrypted, the user is asked for a password.
+ *
+ * @return A new pipeline, or NULL on failure.<br>
+ * This must be closed with pipeline_close() or pipeline_abort().
+ */
+struct pipeline* pipeline_open(const char* out, const struct options* opt, const char* password);
+
+/**
+ * @brief Opens a pipeline like pipeline_open(), handing the compressed/encrypted output to a callback instead of writing it to a file.
+ * @see pipeline_write()
+ * @see pipeline_close()
+ * @param name What the output is called in messages.
+ * @param sink A function that receives each block of the output.<br>
+ * It must return 0 on success or non-zero to abort.
+ * @param sink_data An argument to pass to sink.
+ * @param opt The options to use, the same as for pipeline_open().
+ * @param password The encryption password to use.<br>
+ * If this is NULL and the output is encrypted, the user is asked for a password.
+ * @return A new pipeline, or NULL on failure.<br>
+ * This must be closed with pipeline_close() or pipeline_abort().
+ */
+struct pipeline* pipeline_open_sink(const char* name, int (*sink)(const void* data, size_t len, void* sink_data), void* sink_data, const struct options* opt, const char* password);
+
+/**
+ * @brief Feeds data through a pipeline.
+ *
+ * @param pl The pipeline to write to.
+ *
+ * @param data The data to write.
+ *
+ * @param len The length of the data in bytes.
+ *
+ * @return 0 on success, or negative on failure.<br>
+ * On failure, the pipeline should be closed with pipeline_abort().
+ */
+int pipeline_write(struct pipeline* pl, const void* data, size_t len);
+
+/**
+ * @brief Flushes and closes a pipeline.<br>
+ * This frees the pipeline even if it fails.
+ *
+ * @param pl The pipeline to close.
+ *
+ * @return 0 on success, or negative on failure.<br>
+ * On failure, the output file is removed.
+ */
+int pipeline_close(struct pipeline* pl);
+
+/**
+ * @brief Closes a pipeline and removes its output file.
+ *
+ * @param pl The pipeline to abort.<br>
+ * This can be NULL, in which case this function does nothing.
+ *
+ * @return void
+ */
+void pipeline_abort(struct pipeline* pl);
+
+/**
+ * @brief Compresses and encrypts a file in a single pass.<br>
+ * The source file is read once, and each block is fed to the digest, the compressor, and the cipher in turn.<br>
+ * The output is written once and has the same format as zip_compress() followed by easy_encrypt_inplace().
+ * @see zip_stream_new()
+ * @see crypt_stream_new()
+ *
+ * @param in Path to the file to back up.
+ *
+ * @param out Path to write the compressed/encrypted file to.<br>
+ * If this file already exists, it will be overwritten.<br>
+ * If this function fails, the output file is removed.
+ *
+ * @param opt The options to use. The compressor, compression level/flags, and encryption algorithm are read from this structure.<br>
+ * If opt->enc_algorithm is NULL, the output is not encrypted.<br>
+ * If opt->c_dict is set and the file is smaller than opt->dict_threshold, it is compressed with that dictionary.
+ *
+ * @param password The encryption password to use.<br>
+ * If this is NULL and the output is encrypted, the user is asked for a password.
+ *
+ * @param verbose 0 if a progress bar should not be displayed. Any other value if it should.
+ *
+ * @param out_hash A pointer to a string that will contain the hexadecimal digest of the source file, computed with opt->hash_algorithm.<br>
+ * This can be NULL if the digest is not needed, in which case no hashing is done.<br>
+ * Otherwise, the string must be free()'d when no longer in use. It is set to NULL on failure.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int pipeline_backup_file(const char* in, const char* out, const struct options* opt, const char* password, int verbose, char** out_hash);
+
+/**
+ * @brief Compresses and encrypts a file in a single pass like pipeline_backup_file(), and also checksums the output as it is written.<br>
+ * The output's checksum lets it be checked later without decrypting or decompressing it.
+ *
+ * @param in Path to the file to back up.
+ *
+ * @param out Path to write the compressed/encrypted file to, the same as for pipeline_backup_file().
+ *
+ * @param opt The options to use, the same as for pipeline_backup_file().
+ *
+ * @param password The encryption password to use.<br>
+ * If this is NULL and the output is encrypted, the user is asked for a password.
+ *
+ * @param verbose 0 if a progress bar should not be displayed. Any other value if it should.
+ *
+ * @param out_hash A pointer to a string that will contain the hexadecimal digest of the source file, or NULL if it is not needed.<br>
+ * Otherwise, the string must be free()'d when no longer in use. It is set to NULL on failure.
+ *
+ * @param out_artifact A pointer to a string that will contain the hexadecimal digest of the output, computed with opt->hash_algorithm, or NULL if it is not needed.<br>
+ * Otherwise, the string must be free()'d when no longer in use. It is set to NULL on failure.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int pipeline_backup_file_ex(const char* in, const char* out, const struct options* opt, const char* password, int verbose, char** out_hash, char** out_artifact);
+
+/**
+ * @brief Compresses and encrypts a file in a single pass like pipeline_backup_file(), handing the output to a callback instead of writing it to disk.<br>
+ * This is how an output can go straight to the cloud without being staged in the output directory.
+ * @see cloud_upload_stream_write()
+ *
+ * @param in Path to the file to back up.
+ *
+ * @param sink A function that receives each block of the output.<br>
+ * It must return 0 on success or non-zero to abort.
+ *
+ * @param sink_data An argument to pass to sink.
+ *
+ * @param opt The options to use, the same as for pipeline_backup_file().
+ *
+ * @param password The encryption password to use.<br>
+ * If this is NULL and the output is encrypted, the user is asked for a password.
+ *
+ * @param verbose 0 if a progress bar should not be displayed. Any other value if it should.
+ *
+ * @param out_hash A pointer to a string that will contain the hexadecimal digest of the source file, or NULL if it is not needed.<br>
+ * Otherwise, the string must be free()'d when no longer in use. It is set to NULL on failure.
+ *
+ * @return 0 on success, or negative on failure.<br>
+ * On failure, the sink may already have received part of the output.
+ */
+int pipeline_backup_stream(const char* in, int (*sink)(const void* data, size_t len, void* sink_data), void* sink_data, const struct options* opt, const char* password, int verbose, char** out_hash);
+
+/**
+ * @brief pipeline_backup_stream() that also checksums the output as it is handed off, like pipeline_backup_file_ex().
+ *
+ * @param in Path to the file to back up.
+ *
+ * @param sink A function that receives each block of the output.<br>
+ * It must return 0 on success or non-zero to abort.
+ *
+ * @param sink_data An argument to pass to sink.
+ *
+ * @param opt The options to use, the same as for pipeline_backup_file().
+ *
+ * @param password The encryption password to use.<br>
+ * If this is NULL and the output is encrypted, the user is asked for a password.
+ *
+ * @param verbose 0 if a progress bar should not be displayed. Any other value if it should.
+ *
+ * @param out_hash A pointer to a string that will contain the hexadecimal digest of the source file, or NULL if it is not needed.
+ *
+ * @param out_artifact A pointer to a string that will contain the hexadecimal digest of the output, or NULL if it is not needed.
+ *
+ * @return 0 on success, or negative on failure.<br>
+ * On failure, the sink may already have received part of the output.
+ */
+int pipeline_backup_stream_ex(const char* in, int (*sink)(const void* data, size_t len, void* sink_data), void* sink_data, const struct options* opt, const char* password, int verbose, char** out_hash, char** out_artifact);
+
+/**
+ * @brief An open decryption/decompression pipeline that is fed the stored data as it arrives, such as from a download.
+ */
+struct restore_pipeline;
+
+/**
+ * @brief Opens a pipeline that reverses pipeline_backup_file() on data written to it, handing the original data to a callback.<br>
+ * This is the building block of pipeline_restore_stream(), and is useful when the stored data is not in a file.
+ * @see pipeline_restore_write()
+ * @see pipeline_restore_close()
+ *
+ * @param name What the data is called in messages, such as the path it was downloaded from.
+ *
+ * @param opt The options the data was written with.<br>
+ * If opt->c_dict is set, it is used if the data was compressed with it.<br>
+ * This must stay valid until the pipeline is closed.
+ *
+ * @param password The decryption password to use.<br>
+ * If this is NULL and the data is encrypted, the user is asked for a password once its header has been written.<br>
+ * This must stay valid until the pipeline is closed.
+ *
+ * @param sink A function that receives each block of the original data.<br>
+ * It must return 0 on success or non-zero to abort.
+ *
+ * @param sink_data An argument to pass to sink.
+ *
+ * @return A new pipeline, or NULL on failure.<br>
+ * This must be closed with pipeline_restore_close() or pipeline_restore_abort().
+ */
+struct restore_pipeline* pipeline_restore_open(const char* name, const struct options* opt, const char* password, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data);
+
+/**
+ * @brief Feeds the next part of the stored data through a pipeline returned by pipeline_restore_open().<br>
+ * The arguments are in this order so it can be the sink of a download.
+ *
+ * @param data The data to write. It can be split up anywhere, including inside the encryption header.
+ *
+ * @param len The length of the data in bytes.
+ *
+ * @param restore_pipeline The pipeline to write to.
+ *
+ * @return 0 on success, or negative on failure.<br>
+ * On failure, the pipeline should be closed with pipeline_restore_abort().
+ */
+int pipeline_restore_write(const void* data, size_t len, void* restore_pipeline);
+
+/**
+ * @brief Finishes decrypting and decompressing, checking that the data was whole, and frees the pipeline.<br>
+ * This frees the pipeline even if it fails.
+ *
+ * @param rp The pipeline to close.
+ *
+ * @return 0 on success, or negative on failure, in which case the sink may already have received part of the data.
+ */
+int pipeline_restore_close(struct restore_pipeline* rp);
+
+/**
+ * @brief Frees a pipeline returned by pipeline_restore_open() without finishing it.
+ *
+ * @param rp The pipeline to abort.<br>
+ * This can be NULL, in which case this function does nothing.
+ *
+ * @return void
+ */
+void pipeline_restore_abort(struct restore_pipeline* rp);
+
+/**
+ * @brief Decrypts and decompresses a file in a single pass, handing the original data to a callback.<br>
+ * The source file is read once, and each block is fed to the cipher and the decompressor in turn. Nothing is staged on disk.
+ * @see pipeline_restore_file()
+ *
+ * @param in Path to a file written by pipeline_backup_file() or pipeline_close().
+ *
+ * @param opt The options the file was written with.<br>
+ * If opt->c_dict is set, it is used if the file was compressed with it.
+ *
+ * @param password The decryption password to use.<br>
+ * If this is NULL and the file is encrypted, the user is asked for a password.
+ *
+ * @param sink A function that receives each block of the original data.<br>
+ * It must return 0 on success or non-zero to abort.
+ *
+ * @param sink_data An argument to pass to sink.
+ *
+ * @return 0 on success, or negative on failure.<br>
+ * On failure, the sink may already have received part of the data.
+ */
+int pipeline_restore_stream(const char* in, const struct options* opt, const char* password, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data);
+
+/**
+ * @brief Restores part of a file, handing only that part of the original data to a callback.<br>
+ * An unencrypted file that was stored as it was or compressed with ZIP_SEEKABLE_MIB() is read only where the part is.<br>
+ * Any other file is decrypted and decompressed from the start like pipeline_restore_stream() does, and only the part is handed on.
+ *
+ * @param in Path to a file written by pipeline_backup_file() or pipeline_close().
+ *
+ * @param opt The options the file was written with.
+ *
+ * @param password The decryption password to use.<br>
+ * If this is NULL and the file is encrypted, the user is asked for a password.
+ *
+ * @param offset Where the part starts in the original data.
+ *
+ * @param len How long the part is.<br>
+ * Anything past the end of the original data is left out.
+ *
+ * @param sink A function that receives each block of the part.<br>
+ * It must return 0 on success or non-zero to abort.
+ *
+ * @param sink_data An argument to pass to sink.
+ *
+ * @return 0 on success, or negative on failure.<br>
+ * On failure, the sink may already have received part of the data.
+ */
+int pipeline_restore_range(const char* in, const struct options* opt, const char* password, uint64_t offset, uint64_t len, int(*sink)(const void* data, size_t len, void* sink_data), void* sink_data);
+
+/**
+ * @brief Reverses pipeline_backup_file(), decrypting and decompressing a file.<br>
+ * The output is written straight to its destination without any temporary files.
+ *
+ * @param in Path to a file written by pipeline_backup_file() or pipeline_close().
+ *
+ * @param out Path to write the original data to.<br>
+ * If this file already exists, it will be overwritten.<br>
+ * If this function fails, the output file is removed.
+ *
+ * @param opt The options the file was written with.
+ *
+ * @param password The decryption password to use.<br>
+ * If this is NULL and the file is encrypted, the user is asked for a password.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int pipeline_restore_file(const char* in, const char* out, const struct options* opt, const char* password);
+
+/**
+ * @brief Stores a compression dictionary, encrypted like everything else but not compressed.
+ * @see pipeline_load_dict()
+ *
+ * @param out Path to write the dictionary to.<br>
+ * If this file already exists, it will be overwritten.<br>
+ * If this function fails, the output file is removed.
+ *
+ * @param dict The dictionary to store.
+ *
+ * @param opt The options to use. Only the encryption algorithm is read from this structure.
+ *
+ * @param password The encryption password to use.<br>
+ * If this is NULL and the output is encrypted, the user is asked for a password.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int pipeline_save_dict(const char* out, const struct zip_dict* dict, const struct options* opt, const char* password);
+
+/**
+ * @brief Loads a compression dictionary stored by pipeline_save_dict().
+ *
+ * @param in Path to the stored dictionary.
+ *
+ * @param opt The options the dictionary was stored with. The dictionary is made for opt->c_type and opt->c_level.
+ *
+ * @param password The decryption password to use.<br>
+ * If this is NULL and the file is encrypted, the user is asked for a password.
+ *
+ * @param out Set to the dictionary, which must be freed with zip_dict_free() when no longer in use.<br>
+ * This is set to NULL if it could not be loaded.
+ *
+ * @return 0 on success, positive if there is no stored dictionary, or negative on failure.
+ */
+int pipeline_load_dict(const char* in, const struct options* opt, const char* password, struct zip_dict** out);
+
+#endif
@@ -0,0 +1,215 @@
+/** @file policy.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "policy.h"
+#include "exclude.h"
+#include "log.h"
+#include "strings/stringhelper.h"
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* what an output starts with before its compressor and flags; the high bit keeps it from being text */
+static const unsigned char policy_magic[4] = { 0x89, 'E', 'Z', 'P' };
+
+#define POLICY_FLAG_PLAIN 0x01
+
+struct policy_entry{
+	struct policy_rule rule;
+	/* set if the pattern is a path, which matches everything under it */
+	struct exclude_trie* subtree;
+};
+
+struct policy_set{
+	struct policy_entry* entries;
+	size_t len;
+};
+
+int policy_parse(const char* str, struct policy_rule* out){
+	const char* eq;
+	char* value = NULL;
+	char* level;
+	char* plain;
+	long l = 0;
+
+	return_ifnull(str, -1);
+	return_ifnull(out, -1);
+
+	memset(out, 0, sizeof(*out));
+	/* the pattern can have an '=' in it, but the compressor cannot */
+	if (!(eq = strrchr(str, '=')) || eq == str){
+		log_error_ex("Policy \"%s\" is not PATTERN=COMPRESSOR[:LEVEL][,plain]", str);
+		return -1;
+	}
+	if (!(value = sh_dup(eq + 1))){
+		log_enomem();
+		return -1;
+	}
+
+	if ((plain = strchr(value, ',')) != NULL){
+		*plain = '\0';
+		if (strcmp(plain + 1, "plain") != 0){
+			log_error_ex("Policy \"%s\" can only end with \",plain\"", str);
+			goto cleanup_fail;
+		}
+		out->plain = 1;
+	}
+	if ((level = strchr(value, ':')) != NULL){
+		char* end;
+
+		*level = '\0';
+		l = strtol(level + 1, &end, 10);
+		if (end == level + 1 || *end != '\0' || l < 0 || l > INT_MAX){
+			log_error_ex("Policy \"%s\" does not have a valid level", str);
+			goto cleanup_fail;
+		}
+	}
+	out->c_level = (int)l;
+	if ((out->c_type = get_compressor_byname(value)) == COMPRESSOR_INVALID){
+		log_error_ex("Policy \"%s\" does not have a valid compressor", str);
+		goto cleanup_fail;
+	}
+
+	if (!(out->pattern = malloc(eq - str + 1))){
+		log_enomem();
+		goto cleanup_fail;
+	}
+	memcpy(out->pattern, str, eq - str);
+	out->pattern[eq - str] = '\0';
+	free(value);
+	return 0;
+
+cleanup_fail:
+	free(value);
+	return -1;
+}
+
+struct policy_set* policy_set_new(const struct string_array* rules){
+	struct policy_set* ps;
+	size_t i;
+
+	if (!(ps = calloc(1, sizeof(*ps)))){
+		log_enomem();
+		return NULL;
+	}
+	if (!rules || rules->len == 0){
+		return ps;
+	}
+	if (!(ps->entries = calloc(rules->len, sizeof(*ps->entries)))){
+		log_enomem();
+		free(ps);
+		return NULL;
+	}
+
+	for (i = 0; i < rules->len; ++i){
+		struct policy_entry* pe = &ps->entries[i];
+
+		if (policy_parse(rules->strings[i], &pe->rule) != 0){
+			policy_set_free(ps);
+			return NULL;
+		}
+		ps->len++;
+
+		if (pe->rule.pattern[0] == '/'){
+			struct string_array* path = sa_new();
+
+			if (!path || sa_add(path, pe->rule.pattern) != 0 || !(pe->subtree = exclude_new(path))){
+				path ? sa_free(path) : (void)0;
+				policy_set_free(ps);
+				return NULL;
+			}
+			sa_free(path);
+		}
+	}
+	return ps;
+}
+
+const struct policy_rule* policy_match(const struct policy_set* ps, const char* file){
+	const char* name;
+	size_t i;
+
+	if (!ps || !file){
+		return NULL;
+	}
+	name = strrchr(file, '/');
+	name = name ? name + 1 : file;
+
+	for (i = 0; i < ps->len; ++i){
+		const struct policy_entry* pe = &ps->entries[i];
+
+		if (pe->subtree ? exclude_match(pe->subtree, file) : fnmatch(pe->rule.pattern, name, 0) == 0){
+			return &pe->rule;
+		}
+	}
+	return NULL;
+}
+
+void policy_apply(const struct policy_rule* rule, const struct options* base, struct options* out){
+	*out = *base;
+	out->policy_marked = 1;
+	if (rule->c_type != base->c_type){
+		out->c_type = rule->c_type;
+		out->c_dict = NULL;
+	}
+	/* the rule's level is what it asked for, so it is not lowered to keep up */
+	out->c_level = rule->c_level;
+	out->c_target = 0;
+	if (rule->plain){
+		out->enc_algorithm = NULL;
+	}
+}
+
+void policy_marker_make(const struct options* opt, unsigned char* out){
+	memcpy(out, policy_magic, sizeof(policy_magic));
+	out[4] = opt->enc_algorithm ? 0 : POLICY_FLAG_PLAIN;
+	out[5] = (unsigned char)opt->c_type;
+	out[6] = 0;
+	out[7] = 0;
+}
+
+/* compressor_tostring() would complain about anything else */
+static int compressor_valid(unsigned c){
+#ifndef NO_ZSTD_SUPPORT
+	if (c == COMPRESSOR_ZSTD){
+		return 1;
+	}
+#endif
+	return c != COMPRESSOR_INVALID && c <= COMPRESSOR_NONE;
+}
+
+int policy_marker_read(const unsigned char* data, size_t len, enum compressor* out_c_type, int* out_plain){
+	if (len < POLICY_MARKER_LEN || memcmp(data, policy_magic, sizeof(policy_magic)) != 0){
+		return 0;
+	}
+	/* anything else was not made by policy_marker_make() */
+	if ((data[4] & ~POLICY_FLAG_PLAIN) != 0 || !compressor_valid(data[5]) || data[6] != 0 || data[7] != 0){
+		return 0;
+	}
+	if (out_c_type){
+		*out_c_type = (enum compressor)data[5];
+	}
+	if (out_plain){
+		*out_plain = data[4] & POLICY_FLAG_PLAIN;
+	}
+	return 1;
+}
+
+void policy_set_free(struct policy_set* ps){
+	size_t i;
+
+	if (!ps){
+		return;
+	}
+	for (i = 0; i < ps->len; ++i){
+		free(ps->entries[i].rule.pattern);
+		exclude_free(ps->entries[i].subtree);
+	}
+	free(ps->entries);
+	free(ps);
+}
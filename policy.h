@@ -0,0 +1,131 @@
+/** @file policy.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ *
+ * Compresses and encrypts some files differently from the rest.<br>
+ * A rule is written as "PATTERN=COMPRESSOR[:LEVEL][,plain]", e.g. "/var/lib/hot=lz4", "/archive=xz:9" or "*.mp4=none".<br>
+ * A pattern that starts with '/' matches that path and everything under it, the same way exclude_new() does, so its components can be globs.<br>
+ * Any other pattern is a glob matched with fnmatch() against the file's name without its directory.<br>
+ * The first rule that matches a file decides how it is backed up, and "plain" leaves it unencrypted.<br>
+ * <br>
+ * The output of a file backed up under a rule starts with a POLICY_MARKER_LEN marker saying which compressor it was made with and whether it is encrypted, so restoring it does not depend on the rules that are in force later.
+ */
+
+#ifndef __POLICY_H
+#define __POLICY_H
+
+#include "options/options.h"
+#include "compression/zip.h"
+#include "strings/stringarray.h"
+#include <stddef.h>
+
+#ifndef __GNUC__
+#define __attribute__(x)
+#endif
+
+#define POLICY_MARKER_LEN 8 /**< @brief How long the marker at the start of an output made under a rule is. */
+
+/**
+ * @brief One rule, as policy_parse() reads it.
+ */
+struct policy_rule{
+	char* pattern;          /**< @brief The path or name the rule matches. */
+	enum compressor c_type; /**< @brief The compressor files that match are compressed with. */
+	int c_level;            /**< @brief The level they are compressed with. 0 uses the default level. */
+	int plain;              /**< @brief Non-zero if they are not encrypted. */
+};
+
+/**
+ * @brief Reads a rule.
+ *
+ * @param str The rule, written as "PATTERN=COMPRESSOR[:LEVEL][,plain]".
+ *
+ * @param out Set to the rule.<br>
+ * Its pattern must be freed when no longer in use.
+ *
+ * @return 0 on success, or negative if the rule is not valid.
+ */
+int policy_parse(const char* str, struct policy_rule* out);
+
+/**
+ * @brief Compiles a list of rules, in the order they are tried.
+ *
+ * @param rules The rules, each written as policy_parse() reads it.<br>
+ * This can be NULL, in which case there are no rules.
+ *
+ * @return A new policy set, or NULL on failure.<br>
+ * This must be freed with policy_set_free() when no longer in use.
+ */
+struct policy_set* policy_set_new(const struct string_array* rules) __attribute__((malloc));
+
+/**
+ * @brief Finds the rule a file is backed up under.<br>
+ * This function is thread-safe.
+ *
+ * @param ps The policy set returned by policy_set_new().<br>
+ * This can be NULL, in which case nothing matches.
+ *
+ * @param file The full path of the file.
+ *
+ * @return The first rule that matches the file, or NULL if none do.
+ */
+const struct policy_rule* policy_match(const struct policy_set* ps, const char* file);
+
+/**
+ * @brief Makes the options a file is backed up with under a rule.<br>
+ * A compressor other than the base one does not use the base one's dictionary or compression target.
+ *
+ * @param rule The rule returned by policy_match().
+ *
+ * @param base The options everything else is backed up with.
+ *
+ * @param out Set to a copy of base with the rule applied.<br>
+ * It shares base's pointers, so it must not be freed and base must outlive it.
+ *
+ * @return void
+ */
+void policy_apply(const struct policy_rule* rule, const struct options* base, struct options* out);
+
+/**
+ * @brief Makes the marker that starts an output made under a rule.
+ *
+ * @param opt The options returned by policy_apply().
+ *
+ * @param out Set to the marker, which is POLICY_MARKER_LEN bytes long.
+ *
+ * @return void
+ */
+void policy_marker_make(const struct options* opt, unsigned char* out);
+
+/**
+ * @brief Checks if data starts with a marker from policy_marker_make().
+ *
+ * @param data The start of the output.
+ *
+ * @param len How long data is.<br>
+ * Anything shorter than POLICY_MARKER_LEN does not have a marker.
+ *
+ * @param out_c_type Set to the compressor the output was made with if it has a marker.<br>
+ * This can be NULL.
+ *
+ * @param out_plain Set to non-zero if the output is not encrypted and it has a marker.<br>
+ * This can be NULL.
+ *
+ * @return Positive if data starts with a marker, or 0 if it does not.
+ */
+int policy_marker_read(const unsigned char* data, size_t len, enum compressor* out_c_type, int* out_plain);
+
+/**
+ * @brief Frees a policy set.
+ *
+ * @param ps The policy set to free.<br>
+ * This can be NULL, in which case this function does nothing.
+ *
+ * @return void
+ */
+void policy_set_free(struct policy_set* ps);
+
+#endif
@@ -0,0 +1,254 @@
+/** @file pressure.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+/* syscall() is not in any standard */
+#define _GNU_SOURCE
+
+#include "pressure.h"
+#include "filehelper.h"
+#include "log.h"
+#include "cloud/ratelimit.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/* from linux/ioprio.h, which is not always installed */
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+struct pressure_governor{
+	struct pressure_level level;
+	void(*set_workers)(size_t n_workers, void* data);
+	void* data;
+	struct token_bucket* tb;
+	/* every byte read since the governor started, which the readers add to */
+	uint64_t bytes_read;
+
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int stop;
+};
+
+int pressure_read(const char* path, struct pressure* out){
+	FILE* fp;
+	char line[256];
+	int found = 0;
+
+	out->some_avg10 = 0;
+	out->full_avg10 = 0;
+
+	if (!(fp = fopen(path, "r"))){
+		if (errno == ENOENT){
+			return 1;
+		}
+		log_debug_ex2("Failed to open %s (%s)", path, strerror(errno));
+		return -1;
+	}
+	/* some avg10=1.23 avg60=0.45 avg300=0.06 total=123456 */
+	while (fgets(line, sizeof(line), fp)){
+		double avg10;
+
+		if (sscanf(line, "some avg10=%lf", &avg10) == 1){
+			out->some_avg10 = avg10;
+			found = 1;
+		}
+		else if (sscanf(line, "full avg10=%lf", &avg10) == 1){
+			out->full_avg10 = avg10;
+		}
+	}
+	fclose(fp);
+
+	if (!found){
+		log_debug_ex("%s is not in the format expected", path);
+		return -1;
+	}
+	return 0;
+}
+
+int pressure_adjust(struct pressure_level* pl, const struct pressure* io, const struct pressure* cpu, uint64_t rate_read){
+	double stalled = io->some_avg10 > cpu->some_avg10 ? io->some_avg10 : cpu->some_avg10;
+	size_t workers = pl->workers;
+	uint64_t read_rate = pl->read_rate;
+
+	if (stalled >= PRESSURE_HIGH){
+		workers = workers > 1 ? workers / 2 : 1;
+		/* without a limit yet, half of what is being read is the first one */
+		if (read_rate == 0){
+			read_rate = rate_read;
+		}
+		if (read_rate != 0){
+			read_rate /= 2;
+			read_rate = read_rate < PRESSURE_MIN_RATE ? PRESSURE_MIN_RATE : read_rate;
+		}
+	}
+	else if (stalled <= PRESSURE_LOW){
+		workers = workers < pl->max_workers ? workers + 1 : pl->max_workers;
+		if (read_rate != 0){
+			read_rate *= 2;
+			/* it is no longer what holds the backup back */
+			if (read_rate > rate_read * 4){
+				read_rate = 0;
+			}
+		}
+	}
+
+	if (workers == pl->workers && read_rate == pl->read_rate){
+		return 0;
+	}
+	pl->workers = workers;
+	pl->read_rate = read_rate;
+	return 1;
+}
+
+int background_enter(void){
+	int ret = 0;
+
+#ifdef SYS_ioprio_set
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0){
+		log_warning_ex("Failed to set idle I/O priority (%s)", strerror(errno));
+		ret--;
+	}
+#else
+	log_warning("Idle I/O priority is not supported on this platform");
+	ret--;
+#endif
+
+	errno = 0;
+	if (setpriority(PRIO_PROCESS, 0, 19) != 0){
+		log_warning_ex("Failed to lower CPU priority (%s)", strerror(errno));
+		ret--;
+	}
+	return ret == -2 ? -1 : 0;
+}
+
+static void governor_throttle(size_t len, void* data){
+	struct pressure_governor* pg = data;
+
+	__atomic_add_fetch(&pg->bytes_read, len, __ATOMIC_RELAXED);
+	while (len > 0){
+		len -= tb_take(pg->tb, len, 0);
+	}
+}
+
+static double now_seconds(void){
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0){
+		return (double)time(NULL);
+	}
+	return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void* governor_run(void* arg){
+	struct pressure_governor* pg = arg;
+	uint64_t last_bytes = 0;
+	double last = now_seconds();
+
+	pthread_mutex_lock(&pg->mutex);
+	while (!pg->stop){
+		struct pressure io;
+		struct pressure cpu;
+		struct timespec ts;
+		uint64_t bytes;
+		uint64_t rate_read;
+		size_t workers_prev;
+		double now;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += PRESSURE_INTERVAL;
+		pthread_cond_timedwait(&pg->cond, &pg->mutex, &ts);
+		if (pg->stop){
+			break;
+		}
+		pthread_mutex_unlock(&pg->mutex);
+
+		/* a kernel without one just does not count it as stalled */
+		pressure_read(PRESSURE_IO_FILE, &io);
+		pressure_read(PRESSURE_CPU_FILE, &cpu);
+
+		now = now_seconds();
+		bytes = __atomic_load_n(&pg->bytes_read, __ATOMIC_RELAXED);
+		rate_read = now > last ? (uint64_t)((bytes - last_bytes) / (now - last)) : 0;
+		last_bytes = bytes;
+		last = now;
+
+		workers_prev = pg->level.workers;
+		if (pressure_adjust(&pg->level, &io, &cpu, rate_read)){
+			if (pg->level.workers != workers_prev){
+				pg->set_workers(pg->level.workers, pg->data);
+			}
+			tb_set_rate(pg->tb, pg->level.read_rate);
+			log_info_ex2("I/O pressure %.1f%%, backing up %lu files at once", io.some_avg10, (unsigned long)pg->level.workers);
+			log_debug_ex2("CPU pressure %.1f%%, reading at most %lu KiB/s (0 for no limit)", cpu.some_avg10, (unsigned long)(pg->level.read_rate / 1024));
+		}
+
+		pthread_mutex_lock(&pg->mutex);
+	}
+	pthread_mutex_unlock(&pg->mutex);
+	return NULL;
+}
+
+struct pressure_governor* pressure_governor_start(size_t max_workers, void(*set_workers)(size_t n_workers, void* data), void* data){
+	struct pressure_governor* pg;
+	int res;
+
+	return_ifnull(set_workers, NULL);
+
+	if (!(pg = calloc(1, sizeof(*pg)))){
+		log_enomem();
+		return NULL;
+	}
+	pg->level.workers = max_workers ? max_workers : 1;
+	pg->level.max_workers = pg->level.workers;
+	pg->level.read_rate = 0;
+	pg->set_workers = set_workers;
+	pg->data = data;
+	if (!(pg->tb = tb_new(0))){
+		free(pg);
+		return NULL;
+	}
+	pthread_mutex_init(&pg->mutex, NULL);
+	pthread_cond_init(&pg->cond, NULL);
+
+	if ((res = pthread_create(&pg->thread, NULL, governor_run, pg)) != 0){
+		log_error_ex("Failed to start the pressure governor (%s)", strerror(res));
+		pthread_mutex_destroy(&pg->mutex);
+		pthread_cond_destroy(&pg->cond);
+		tb_free(pg->tb);
+		free(pg);
+		return NULL;
+	}
+	source_set_throttle(governor_throttle, pg);
+	return pg;
+}
+
+void pressure_governor_stop(struct pressure_governor* pg){
+	if (!pg){
+		return;
+	}
+	source_set_throttle(NULL, NULL);
+
+	pthread_mutex_lock(&pg->mutex);
+	pg->stop = 1;
+	pthread_cond_signal(&pg->cond);
+	pthread_mutex_unlock(&pg->mutex);
+	pthread_join(pg->thread, NULL);
+
+	pthread_mutex_destroy(&pg->mutex);
+	pthread_cond_destroy(&pg->cond);
+	tb_free(pg->tb);
+	free(pg);
+}
@@ -0,0 +1,118 @@
+/** @file pressure.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ *
+ * Runs a backup in the background of a busy host.<br>
+ * The backup is given idle I/O priority and the lowest CPU priority, and a governor reads the kernel's pressure stall information (PSI) every few seconds.<br>
+ * While tasks on the host are stalled waiting for I/O or a CPU, the governor lowers how many files are backed up at once and how fast they are read, and raises them again once the host is idle.<br>
+ * Without PSI (Linux before 4.20, or a kernel built without it), only the priorities are lowered.
+ */
+
+#ifndef __PRESSURE_H
+#define __PRESSURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef __GNUC__
+#define __attribute__(x)
+#endif
+
+#define PRESSURE_IO_FILE "/proc/pressure/io"   /**< @brief Where the kernel reports how long tasks waited for I/O. */
+#define PRESSURE_CPU_FILE "/proc/pressure/cpu" /**< @brief Where the kernel reports how long tasks waited for a CPU. */
+
+#define PRESSURE_HIGH 10.0 /**< @brief The percent of the last 10 seconds that some task was stalled, above which the backup slows down. */
+#define PRESSURE_LOW 2.0   /**< @brief The percent of the last 10 seconds that some task was stalled, below which the backup speeds back up. */
+
+#define PRESSURE_INTERVAL 2 /**< @brief How many seconds apart the governor looks at the pressure. */
+#define PRESSURE_MIN_RATE ((uint64_t)1 << 20) /**< @brief The slowest the files being backed up are read, so a backup under constant pressure still finishes (1MiB/s). */
+
+/**
+ * @brief How much tasks were stalled, from one of the kernel's pressure files.
+ */
+struct pressure{
+	double some_avg10; /**< @brief The percent of the last 10 seconds that at least one task was stalled. */
+	double full_avg10; /**< @brief The percent of the last 10 seconds that every task was stalled, which is 0 for the CPU. */
+};
+
+/**
+ * @brief How fast a backup in the background can go, which pressure_adjust() moves up and down.
+ */
+struct pressure_level{
+	size_t workers;     /**< @brief How many files are backed up at once. */
+	size_t max_workers; /**< @brief The most files that can be backed up at once, which workers goes back up to. */
+	uint64_t read_rate; /**< @brief How many bytes per second the files are read at, or 0 for as fast as they can be. */
+};
+
+/**
+ * @brief Reads one of the kernel's pressure files.
+ *
+ * @param path The file, usually PRESSURE_IO_FILE or PRESSURE_CPU_FILE.
+ *
+ * @param out Set to what it says.
+ *
+ * @return 0 on success, positive if the file does not exist, or negative if it could not be read.
+ */
+int pressure_read(const char* path, struct pressure* out);
+
+/**
+ * @brief Moves a level down if the host is under pressure, or back up if it is idle.<br>
+ * Under pressure, half as many files are backed up at once and they are read at half the rate they were.<br>
+ * Once idle, one more file is backed up at once and the rate doubles each time, until it is lifted once it is well above what is being read.
+ *
+ * @param pl The level.
+ *
+ * @param io The I/O pressure.
+ *
+ * @param cpu The CPU pressure.
+ *
+ * @param rate_read How many bytes per second were read since the last adjustment.
+ *
+ * @return Non-zero if the level changed, or 0 if not.
+ */
+int pressure_adjust(struct pressure_level* pl, const struct pressure* io, const struct pressure* cpu, uint64_t rate_read);
+
+/**
+ * @brief Gives the calling thread idle I/O priority and the lowest CPU priority.<br>
+ * Threads started by it afterwards inherit them, so this should be called before any are.
+ *
+ * @return 0 on success, or negative if neither could be lowered.
+ */
+int background_enter(void);
+
+/**
+ * @brief Watches the pressure on the host and slows a backup down to match.
+ */
+struct pressure_governor;
+
+/**
+ * @brief Starts watching the pressure.<br>
+ * Until it is stopped, every file read through source_read() is held to the governor's read rate.
+ * @see source_set_throttle()
+ *
+ * @param max_workers The most files that can be backed up at once, which is also how many are to start with.
+ *
+ * @param set_workers A function that changes how many files are backed up at once.<br>
+ * It is called on the governor's own thread.
+ *
+ * @param data An argument to pass to set_workers.
+ *
+ * @return A governor, or NULL on failure.<br>
+ * This must be stopped with pressure_governor_stop().
+ */
+struct pressure_governor* pressure_governor_start(size_t max_workers, void(*set_workers)(size_t n_workers, void* data), void* data) __attribute__((malloc));
+
+/**
+ * @brief Stops watching the pressure, and lifts the read rate.<br>
+ * No files may be read while this runs.
+ *
+ * @param pg The governor. This can be NULL.
+ *
+ * @return void
+ */
+void pressure_governor_stop(struct pressure_governor* pg);
+
+#endif
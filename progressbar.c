@@ -20,42 +20,158 @@
 #include <stdlib.h>
 /* strlen */
 #include <string.h>
+/* the board's renderer */
+#include <pthread.h>
+/* struct timespec */
+#include <time.h>
+
+/* each thread's counters get a cache line of their own, so adding to them does not slow down the others */
+#define PROGRESS_SLOT_BYTES (128)
+
+union progress_slot{
+	struct progress_counters{
+		uint64_t stage_bytes[STAGE_COUNT];
+		uint64_t files_found;
+		uint64_t bytes_found;
+		uint64_t files_done;
+		uint64_t bytes_done;
+	}c;
+	unsigned char pad[PROGRESS_SLOT_BYTES];
+};
+
+static union progress_slot slots[PROGRESS_BOARD_SLOTS];
+/* read without the lock by everything that adds to the board */
+static int board_on;
+static unsigned next_slot;
+static pthread_key_t slot_key;
+static pthread_once_t slot_once = PTHREAD_ONCE_INIT;
+
+/* everything below is only touched by the renderer, or with board_mutex held */
+static pthread_mutex_t board_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t board_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t board_thread;
+static int board_stop;
+static int board_tty;
+static double board_start;
+static double board_last;
+static uint64_t board_last_bytes[STAGE_COUNT];
+static double board_rates[STAGE_COUNT];
+/* the line as it was last drawn, which is drawn again below anything printed through it */
+static char board_line[512];
 
 static int get_width(void){
 	struct winsize w;
-	ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
 
+	/* not a terminal, so nothing wraps */
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) != 0 || w.ws_col == 0){
+		return 80;
+	}
 	return w.ws_col;
 }
 
-static void display_progress(struct progress* p){
-	/* -2 for end brackets */
-	int num_blank = get_width() - 3 - strlen("(000.00%)");
-	long double pct = (long double)p->count / p->max;
-	int num_pound = (uint64_t)(num_blank * pct);
-	int num_space = num_blank - num_pound;
+static void format_bytes(double bytes, char out[16]){
+	const char* units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+	size_t i;
+
+	for (i = 0; bytes >= 1024.0 && i < sizeof(units) / sizeof(units[0]) - 1; ++i){
+		bytes /= 1024.0;
+	}
+	sprintf(out, i == 0 ? "%.0f %s" : "%.1f %s", bytes, units[i]);
+}
+
+static void format_duration(unsigned long secs, char out[24]){
+	sprintf(out, "%lu:%02lu:%02lu", secs / 3600, secs / 60 % 60, secs % 60);
+}
+
+static double now_seconds(void){
+	struct stats_time now;
+
+	stats_time_now(&now);
+	return now.wall;
+}
+
+/* state is "running", "done", or "failed", and only changes what a line in the log says */
+static void display_progress(struct progress* p, int force, const char* state){
 	time_t time_tmp = time(NULL);
-	int i;
+	double now;
+	double avg;
+	double eta = -1;
+	long double pct = p->max ? (long double)p->count / p->max : 1.0;
 
-	/* only want to print once per second,
+	/* the board is already showing this */
+	if (p->hidden){
+		return;
+	}
+
+	/* only want to print once per second (or every PROGRESS_LOG_INTERVAL seconds into a log),
 	 * because printf is kind of slow */
-	if (time_tmp <= p->time_prev){
+	if (!force && time_tmp < p->time_prev + (p->tty ? 1 : PROGRESS_LOG_INTERVAL)){
 		return;
 	}
-	else{
-		p->time_prev = time_tmp;
+	p->time_prev = time_tmp;
+
+	/* the current rate is smoothed over the last few updates, so a stall shows up within seconds */
+	now = now_seconds();
+	if (now > p->time_rate){
+		double rate = (p->count - p->count_rate) / (now - p->time_rate);
+
+		p->rate = p->rate > 0 ? p->rate * 0.5 + rate * 0.5 : rate;
+		p->time_rate = now;
+		p->count_rate = p->count;
+	}
+	avg = now > p->time_start ? p->count / (now - p->time_start) : 0;
+	/* the average is steadier than the current rate, and a straggler shows up in the current rate anyway */
+	if (avg > 0 && p->count < p->max){
+		eta = (p->max - p->count) / avg;
 	}
 
-	/* \r returns to beginning of line */
-	printf("\r[");
-	for (i = 0; i < num_pound; ++i){
-		printf("%c", '#');
+	if (p->tty){
+		char cur_str[16];
+		char avg_str[16];
+		char eta_str[24];
+		char suffix[96];
+		int num_blank;
+		int num_pound;
+		int i;
+
+		format_bytes(p->rate, cur_str);
+		format_bytes(avg, avg_str);
+		if (eta >= 0){
+			format_duration((unsigned long)eta, eta_str);
+		}
+		else{
+			format_duration((unsigned long)(now - p->time_start), eta_str);
+		}
+		sprintf(suffix, "(%6.2Lf%%) %s/s (avg %s/s) %s %s", pct * 100.0, cur_str, avg_str, eta >= 0 ? "ETA" : "in", eta_str);
+
+		/* -2 for end brackets, -1 so the line does not wrap */
+		num_blank = get_width() - 3 - (int)strlen(suffix);
+		num_blank = num_blank > 0 ? num_blank : 0;
+		num_pound = (int)(num_blank * pct);
+
+		/* \r returns to beginning of line */
+		printf("\r[");
+		for (i = 0; i < num_pound; ++i){
+			printf("%c", '#');
+		}
+		for (i = num_pound; i < num_blank; ++i){
+			printf("%c", ' ');
+		}
+		printf("]%s\033[K", suffix);
 	}
-	for (i = 0; i < num_space; ++i){
-		printf("%c", ' ');
+	else{
+		/* one tab-separated line each time, which a log can be searched or parsed for */
+		printf("progress\t%s\t%.0f\t%lu\t%lu\t%.2Lf\t%.0f\t%.0f\t%.0f\t%s\n",
+				state,
+				now - p->time_start,
+				(unsigned long)p->count,
+				(unsigned long)p->max,
+				pct * 100.0,
+				p->rate,
+				avg,
+				eta,
+				p->text ? p->text : "");
 	}
-	printf("]");
-	printf("(%6.2Lf%%)", pct * 100.0);
 	/* needed to actually display chars */
 	fflush(stdout);
 }
@@ -69,18 +185,23 @@ struct progress* start_progress(const char* text, uint64_t max){
 	p->text = text;
 	p->max = max;
 	p->count = 0;
-	/* -1 to display progress immediately instead of after
-	 * 1 second */
-	p->time_prev = time(NULL) - 1;
+	p->time_prev = time(NULL);
+	p->time_start = now_seconds();
+	p->time_rate = p->time_start;
+	p->count_rate = 0;
+	p->rate = 0;
+	p->tty = isatty(STDOUT_FILENO);
+	p->hidden = __atomic_load_n(&board_on, __ATOMIC_ACQUIRE);
 
-	if (text){
-		/* remove terminal cursor blinking */
-		printf("%s\033[?25l\n", p->text);
+	if (p->hidden){
+		return p;
 	}
-	else{
-		printf("\033[?25l\n");
+	/* off a terminal, the text is part of every line instead */
+	if (p->tty){
+		/* remove terminal cursor blinking */
+		printf("%s\033[?25l\n", text ? text : "");
 	}
-	display_progress(p);
+	display_progress(p, 1, "running");
 	return p;
 }
 
@@ -89,7 +210,7 @@ void inc_progress(struct progress* p, uint64_t count){
 		return;
 	}
 	p->count += count;
-	display_progress(p);
+	display_progress(p, 0, "running");
 }
 
 void set_progress(struct progress* p, uint64_t count){
@@ -97,7 +218,7 @@ void set_progress(struct progress* p, uint64_t count){
 		return;
 	}
 	p->count = count;
-	display_progress(p);
+	display_progress(p, 0, "running");
 }
 
 void finish_progress(struct progress* p){
@@ -106,12 +227,10 @@ void finish_progress(struct progress* p){
 	}
 	/* 100% progress */
 	p->count = p->max;
-	/* make sure it displays */
-	p->time_prev--;
 	/* display final progress */
-	display_progress(p);
+	display_progress(p, 1, "done");
 	/* restore terminal cursor blinking */
-	printf("\033[?25h\n");
+	p->hidden || !p->tty ? 0 : printf("\033[?25h\n");
 	free(p);
 }
 
@@ -119,11 +238,269 @@ void finish_progress_fail(struct progress* p){
 	if (!p){
 		return;
 	}
-	/* make sure it displays */
-	p->time_prev--;
 	/* display final progress */
-	display_progress(p);
+	display_progress(p, 1, "failed");
 	/* restore terminal cursor blinking */
-	printf("\033[?25h\n");
+	p->hidden || !p->tty ? 0 : printf("\033[?25h\n");
 	free(p);
 }
+
+static void make_slot_key(void){
+	pthread_key_create(&slot_key, NULL);
+}
+
+/* the calling thread's counters, which it keeps from then on */
+static struct progress_counters* my_counters(void){
+	union progress_slot* slot;
+
+	pthread_once(&slot_once, make_slot_key);
+	slot = pthread_getspecific(slot_key);
+	if (!slot){
+		slot = &slots[__atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED) % PROGRESS_BOARD_SLOTS];
+		pthread_setspecific(slot_key, slot);
+	}
+	return &slot->c;
+}
+
+static void sum_counters(struct progress_counters* out){
+	size_t i;
+	size_t j;
+
+	memset(out, 0, sizeof(*out));
+	for (i = 0; i < PROGRESS_BOARD_SLOTS; ++i){
+		const struct progress_counters* c = &slots[i].c;
+
+		for (j = 0; j < STAGE_COUNT; ++j){
+			out->stage_bytes[j] += __atomic_load_n(&c->stage_bytes[j], __ATOMIC_RELAXED);
+		}
+		out->files_found += __atomic_load_n(&c->files_found, __ATOMIC_RELAXED);
+		out->bytes_found += __atomic_load_n(&c->bytes_found, __ATOMIC_RELAXED);
+		out->files_done += __atomic_load_n(&c->files_done, __ATOMIC_RELAXED);
+		out->bytes_done += __atomic_load_n(&c->bytes_done, __ATOMIC_RELAXED);
+	}
+}
+
+/* writes the board's line into board_line, with each stage's rate since the last time if final is 0, or over the whole run if it is not */
+static void board_format(int final){
+	struct progress_counters c;
+	double rates[STAGE_COUNT];
+	double now = now_seconds();
+	double dt = now - board_last;
+	double elapsed = now - board_start;
+	double eta = -1;
+	const char* sep;
+	size_t len;
+	size_t i;
+
+	sum_counters(&c);
+	for (i = 0; i < STAGE_COUNT; ++i){
+		if (final){
+			rates[i] = elapsed > 0 ? c.stage_bytes[i] / elapsed : 0;
+		}
+		else if (dt > 0){
+			/* smoothed so a stage that works in bursts does not flicker */
+			rates[i] = (c.stage_bytes[i] - board_last_bytes[i]) / dt;
+			rates[i] = board_rates[i] > 0 ? board_rates[i] * 0.7 + rates[i] * 0.3 : rates[i];
+		}
+		else{
+			rates[i] = board_rates[i];
+		}
+		board_rates[i] = rates[i];
+		board_last_bytes[i] = c.stage_bytes[i];
+	}
+	board_last = now;
+
+	/* what is left at the rate files have been finishing so far */
+	if (!final && c.bytes_done > 0 && c.bytes_found > c.bytes_done && elapsed > 0){
+		eta = (c.bytes_found - c.bytes_done) / (c.bytes_done / elapsed);
+	}
+
+	if (!board_tty){
+		/* the same tab-separated format as a progress bar's, with every stage that moved as name=bytes/s at the end */
+		len = sprintf(board_line, "board\t%s\t%.0f\t%lu\t%lu\t%lu\t%lu\t%.0f\t",
+				final ? "done" : "running",
+				elapsed,
+				(unsigned long)c.files_done,
+				(unsigned long)c.files_found,
+				(unsigned long)c.bytes_done,
+				(unsigned long)c.bytes_found,
+				eta);
+		for (i = 0, sep = ""; i < STAGE_COUNT; ++i){
+			if (c.stage_bytes[i] > 0 && len < sizeof(board_line) - 64){
+				len += sprintf(board_line + len, "%s%s=%.0f", sep, stats_stage_tostring(i), rates[i]);
+				sep = ",";
+			}
+		}
+		return;
+	}
+
+	{
+		char done[16];
+		char found[16];
+		char rate[16];
+		char duration[24];
+
+		format_bytes((double)c.bytes_done, done);
+		format_bytes((double)c.bytes_found, found);
+		len = sprintf(board_line, "%lu/%lu files, %s/%s", (unsigned long)c.files_done, (unsigned long)c.files_found, done, found);
+		if (c.bytes_found > 0){
+			len += sprintf(board_line + len, " (%.1f%%)", 100.0 * c.bytes_done / c.bytes_found);
+		}
+		for (i = 0, sep = " |"; i < STAGE_COUNT; ++i){
+			if (c.stage_bytes[i] > 0 && len < sizeof(board_line) - 64){
+				format_bytes(rates[i], rate);
+				len += sprintf(board_line + len, "%s %s %s/s", sep, stats_stage_tostring(i), rate);
+				sep = ",";
+			}
+		}
+		if (eta >= 0){
+			format_duration((unsigned long)eta, duration);
+			sprintf(board_line + len, " | ETA %s", duration);
+		}
+		else if (final){
+			format_duration((unsigned long)elapsed, duration);
+			sprintf(board_line + len, " | %s", duration);
+		}
+	}
+}
+
+/* draws board_line with board_mutex held */
+static void board_draw(void){
+	int width = get_width();
+
+	if (!board_tty){
+		printf("%s\n", board_line);
+	}
+	/* a line wider than the terminal wraps, and \r only goes back to the start of the last row */
+	else if ((size_t)width <= strlen(board_line)){
+		printf("\r%.*s\033[K", width - 1, board_line);
+	}
+	else{
+		printf("\r%s\033[K", board_line);
+	}
+	fflush(stdout);
+}
+
+static void* board_render(void* arg){
+	/* a log only needs a line every so often */
+	long interval_ms = board_tty ? PROGRESS_BOARD_INTERVAL_MS : PROGRESS_LOG_INTERVAL * 1000L;
+	int first = 1;
+
+	(void)arg;
+
+	pthread_mutex_lock(&board_mutex);
+	while (!board_stop){
+		struct timespec ts;
+		long nsec;
+
+		/* the log gets its first line once there is something to say */
+		if (board_tty || !first){
+			board_format(0);
+			board_draw();
+		}
+		first = 0;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		nsec = ts.tv_nsec + (interval_ms % 1000) * 1000000L;
+		ts.tv_sec += interval_ms / 1000 + nsec / 1000000000L;
+		ts.tv_nsec = nsec % 1000000000L;
+		pthread_cond_timedwait(&board_cond, &board_mutex, &ts);
+	}
+	pthread_mutex_unlock(&board_mutex);
+	return NULL;
+}
+
+int progress_board_start(const char* text){
+	if (__atomic_load_n(&board_on, __ATOMIC_ACQUIRE)){
+		log_error("The progress board is already showing");
+		return -1;
+	}
+
+	memset(slots, 0, sizeof(slots));
+	memset(board_last_bytes, 0, sizeof(board_last_bytes));
+	memset(board_rates, 0, sizeof(board_rates));
+	board_line[0] = '\0';
+	board_stop = 0;
+	board_tty = isatty(STDOUT_FILENO);
+	board_start = board_last = now_seconds();
+
+	if (board_tty){
+		/* remove terminal cursor blinking */
+		printf("%s\033[?25l\n", text ? text : "");
+	}
+	else if (text){
+		printf("%s\n", text);
+	}
+	fflush(stdout);
+	if (pthread_create(&board_thread, NULL, board_render, NULL) != 0){
+		log_error("Failed to start the progress board");
+		board_tty ? printf("\033[?25h") : 0;
+		return -1;
+	}
+	__atomic_store_n(&board_on, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void progress_board_found(uint64_t bytes){
+	struct progress_counters* c;
+
+	if (!__atomic_load_n(&board_on, __ATOMIC_RELAXED)){
+		return;
+	}
+	c = my_counters();
+	__atomic_fetch_add(&c->files_found, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&c->bytes_found, bytes, __ATOMIC_RELAXED);
+}
+
+void progress_board_add(enum stats_stage stage, uint64_t bytes){
+	if ((unsigned)stage >= STAGE_COUNT || !__atomic_load_n(&board_on, __ATOMIC_RELAXED)){
+		return;
+	}
+	__atomic_fetch_add(&my_counters()->stage_bytes[stage], bytes, __ATOMIC_RELAXED);
+}
+
+void progress_board_done(uint64_t bytes){
+	struct progress_counters* c;
+
+	if (!__atomic_load_n(&board_on, __ATOMIC_RELAXED)){
+		return;
+	}
+	c = my_counters();
+	__atomic_fetch_add(&c->files_done, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&c->bytes_done, bytes, __ATOMIC_RELAXED);
+}
+
+void progress_board_puts(const char* line){
+	if (!__atomic_load_n(&board_on, __ATOMIC_ACQUIRE)){
+		puts(line);
+		return;
+	}
+	pthread_mutex_lock(&board_mutex);
+	if (board_tty){
+		printf("\r%s\033[K\n", line);
+		board_draw();
+	}
+	else{
+		puts(line);
+	}
+	pthread_mutex_unlock(&board_mutex);
+}
+
+void progress_board_finish(void){
+	if (!__atomic_load_n(&board_on, __ATOMIC_ACQUIRE)){
+		return;
+	}
+
+	pthread_mutex_lock(&board_mutex);
+	board_stop = 1;
+	pthread_cond_signal(&board_cond);
+	pthread_mutex_unlock(&board_mutex);
+	pthread_join(board_thread, NULL);
+
+	board_format(1);
+	board_draw();
+	/* restore terminal cursor blinking */
+	board_tty ? printf("\033[?25h\n") : 0;
+	fflush(stdout);
+	__atomic_store_n(&board_on, 0, __ATOMIC_RELEASE);
+}
@@ -9,6 +9,7 @@
 #ifndef __PROGRESSBAR_H
 #define __PROGRESSBAR_H
 
+#include "stats.h"
 #include <stdint.h>
 #include <time.h>
 
@@ -23,12 +24,43 @@ struct progress{
 	const char* text;      /**< @brief The message to display above the progress bar. */
 	uint64_t    count;     /**< @brief The current progress level. */
 	uint64_t    max;       /**< @brief The maximum progress level. */
-	time_t      time_prev; /**< @brief The current time. This is used to make sure the progressbar only updates once per second. */
+	time_t      time_prev;  /**< @brief The current time. This is used to make sure the progressbar only updates once per second. */
+	int         hidden;     /**< @brief Non-zero if the progress board was showing when this started, in which case this bar is not drawn. */
+	int         tty;        /**< @brief Non-zero if stdout is a terminal. Otherwise a line is logged every PROGRESS_LOG_INTERVAL seconds instead of drawing a bar. */
+	double      time_start; /**< @brief When the progress bar started, in seconds. */
+	double      time_rate;  /**< @brief When the current rate was last measured, in seconds. */
+	uint64_t    count_rate; /**< @brief The progress level when the current rate was last measured. */
+	double      rate;       /**< @brief The current rate in units per second, smoothed over the last few updates. */
 };
 
+/**
+ * @brief How often a progress bar or the progress board logs a line when stdout is not a terminal, in seconds.
+ */
+#ifndef PROGRESS_LOG_INTERVAL
+#define PROGRESS_LOG_INTERVAL (10)
+#endif
+
+/**
+ * @brief How often the progress board is redrawn, in milliseconds.
+ */
+#ifndef PROGRESS_BOARD_INTERVAL_MS
+#define PROGRESS_BOARD_INTERVAL_MS (500)
+#endif
+
+/**
+ * @brief How many threads get counters of their own on the progress board.<br>
+ * Any more share them, which is still correct, just slower.
+ */
+#ifndef PROGRESS_BOARD_SLOTS
+#define PROGRESS_BOARD_SLOTS (64)
+#endif
+
 /**
  * @brief Starts a progress bar on stdout.<br>
- *
+ * The bar shows the percentage done, the current and average rate in bytes per second, and the time left at the average rate.<br>
+ * If stdout is not a terminal, a tab-separated line is printed instead when the bar starts and ends, and every PROGRESS_LOG_INTERVAL seconds in between:<br>
+ * "progress", state ("running", "done", or "failed"), seconds elapsed, count, max, percent, current bytes/s, average bytes/s, seconds left (or -1 if not known), text<br>
+ * <br>
  * This progress bar is not thread-safe if other threads write to stdout.
  *
  * @param text The message of the progress bar.
@@ -82,4 +114,70 @@ void finish_progress(struct progress* p);
  */
 void finish_progress_fail(struct progress* p);
 
+/**
+ * @brief Starts the progress board, which shows the progress of every thread at once on a single line of stdout.<br>
+ * The line has the files and bytes done out of those found so far, the current rate of each stage that is moving, and an estimate of the time left.<br>
+ * It is drawn by a thread of its own, so the counters are only ever added to, never locked, by the threads doing the work.<br>
+ * Progress bars started while it is showing are not drawn, so they do not tear the line.<br>
+ * If stdout is not a terminal, a tab-separated line is printed every PROGRESS_LOG_INTERVAL seconds and when the board is finished instead:<br>
+ * "board", state ("running" or "done"), seconds elapsed, files done, files found, bytes done, bytes found, seconds left (or -1 if not known), and each stage that moved as name=bytes/s separated by commas
+ *
+ * @param text The message to display above the board, or NULL for none.
+ *
+ * @return 0 on success, or negative on failure.<br>
+ * The board must be stopped with progress_board_finish() once the work is done.
+ * @see progress_board_finish()
+ */
+int progress_board_start(const char* text);
+
+/**
+ * @brief Adds a file that was found to the progress board's totals.<br>
+ * This function is thread-safe, and does nothing if the board is not showing.
+ *
+ * @param bytes The size of the file.
+ *
+ * @return void
+ */
+void progress_board_found(uint64_t bytes);
+
+/**
+ * @brief Adds bytes that went through a stage to the progress board, which shows the rate of each stage.<br>
+ * This function is thread-safe, and does nothing if the board is not showing.
+ *
+ * @param stage The stage the bytes went through, e.g. STAGE_READ or STAGE_UPLOAD.
+ *
+ * @param bytes The number of bytes.
+ *
+ * @return void
+ */
+void progress_board_add(enum stats_stage stage, uint64_t bytes);
+
+/**
+ * @brief Marks a file found with progress_board_found() as done.<br>
+ * This function is thread-safe, and does nothing if the board is not showing.
+ *
+ * @param bytes The size of the file, the same as was passed to progress_board_found().
+ *
+ * @return void
+ */
+void progress_board_done(uint64_t bytes);
+
+/**
+ * @brief Prints a line to stdout above the progress board instead of through it.<br>
+ * This function is thread-safe, and is the same as puts() if the board is not showing.
+ *
+ * @param line The line to print, without a trailing newline.
+ *
+ * @return void
+ */
+void progress_board_puts(const char* line);
+
+/**
+ * @brief Stops the progress board and draws it one last time.<br>
+ * This must be called from the thread that called progress_board_start(), after everything that adds to it is done.
+ *
+ * @return void
+ */
+void progress_board_finish(void);
+
 #endif
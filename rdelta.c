@@ -0,0 +1,765 @@
+/** @file rdelta.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "rdelta.h"
+#include "filehelper.h"
+#include "pipeline.h"
+#include "log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* a literal is handed off once it is this long, so the old version never has to fit in memory */
+#define RDELTA_MAX_LITERAL (1 << 16)
+/* a copy is cut before its length no longer fits in its field */
+#define RDELTA_MAX_COPY 0x40000000UL
+#define RDELTA_NONE 0xFFFFFFFFUL
+
+#define OP_COPY 'C'
+#define OP_LITERAL 'L'
+#define OP_END 'E'
+#define OP_COPY_LEN 13
+#define OP_LITERAL_LEN 5
+#define OP_END_LEN 9
+
+static void put_u32(unsigned char* p, unsigned long val){
+	p[0] = val & 0xFF;
+	p[1] = (val >> 8) & 0xFF;
+	p[2] = (val >> 16) & 0xFF;
+	p[3] = (val >> 24) & 0xFF;
+}
+
+static void put_u64(unsigned char* p, uint64_t val){
+	put_u32(p, (unsigned long)(val & 0xFFFFFFFFUL));
+	put_u32(p + 4, (unsigned long)(val >> 32));
+}
+
+static unsigned long get_u32(const unsigned char* p){
+	return p[0] | ((unsigned long)p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+static uint64_t get_u64(const unsigned char* p){
+	return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+/* rsync's rolling checksum, which is split into its two sums so one byte can be rolled out and another in */
+static void weak_sums(const unsigned char* data, size_t len, uint32_t* a, uint32_t* b){
+	size_t i;
+
+	*a = 0;
+	*b = 0;
+	for (i = 0; i < len; ++i){
+		*a += data[i];
+		*b += (uint32_t)(len - i) * data[i];
+	}
+}
+
+static uint32_t weak_of(uint32_t a, uint32_t b){
+	return (a & 0xFFFF) | ((b & 0xFFFF) << 16);
+}
+
+/* FNV-1a, so a weak match only costs a read of the newer version if this matches too */
+static uint32_t strong_of(const unsigned char* data, size_t len){
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < len; ++i){
+		h = (h ^ data[i]) * 16777619U;
+	}
+	return h;
+}
+
+struct rdelta_block{
+	uint32_t weak;
+	uint32_t strong;
+	uint32_t next;
+};
+
+struct rdelta_writer{
+	int fd;
+	size_t block_len;
+	uint32_t n_blocks;
+	struct rdelta_block* blocks;
+	uint32_t* buckets;
+	unsigned bucket_bits;
+	/* the block of the newer version that a match is checked against */
+	unsigned char* cmp;
+
+	/* the old version that is not in the delta yet, from lit_start to end
+	 * pos is where the window being matched starts, and everything between lit_start and pos is a literal */
+	unsigned char* buf;
+	size_t buf_size;
+	size_t lit_start;
+	size_t pos;
+	size_t end;
+	uint32_t a;
+	uint32_t b;
+	int rolling;
+	/* the window at pos did not match, and has to be rolled once there is another byte */
+	int roll_pending;
+
+	/* consecutive blocks are sent as one copy */
+	uint64_t copy_off;
+	unsigned long copy_len;
+	uint64_t target_len;
+
+	int (*sink)(const void* data, size_t len, void* sink_data);
+	void* sink_data;
+	int failed;
+};
+
+static uint32_t bucket_of(const struct rdelta_writer* rw, uint32_t weak){
+	return (uint32_t)((weak * 2654435761U) >> (32 - rw->bucket_bits));
+}
+
+/* about the square root of the size, so neither the blocks nor the number of them get out of hand */
+static size_t block_len_for(uint64_t size){
+	size_t len = RDELTA_MIN_BLOCK;
+
+	while (len < RDELTA_MAX_BLOCK && (uint64_t)len * len < size){
+		len *= 2;
+	}
+	return len;
+}
+
+/* reads every whole block of the newer version
+ * a block that is already there under the same sums is left out, so a file full of zeros does not make one long chain */
+static int read_signature(struct rdelta_writer* rw, uint64_t size){
+	uint32_t n_buckets;
+	uint32_t i;
+
+	rw->block_len = block_len_for(size);
+	if (size / rw->block_len >= RDELTA_NONE){
+		log_error("The newer version has too many blocks to make a delta against");
+		return -1;
+	}
+	rw->n_blocks = (uint32_t)(size / rw->block_len);
+	rw->bucket_bits = 4;
+	while (rw->bucket_bits < 31 && ((uint32_t)1 << rw->bucket_bits) < rw->n_blocks){
+		rw->bucket_bits++;
+	}
+	n_buckets = (uint32_t)1 << rw->bucket_bits;
+
+	if (!(rw->cmp = malloc(rw->block_len)) ||
+			!(rw->buckets = malloc(n_buckets * sizeof(*rw->buckets))) ||
+			(rw->n_blocks > 0 && !(rw->blocks = malloc(rw->n_blocks * sizeof(*rw->blocks))))){
+		log_enomem();
+		return -1;
+	}
+	for (i = 0; i < n_buckets; ++i){
+		rw->buckets[i] = RDELTA_NONE;
+	}
+
+	for (i = 0; i < rw->n_blocks; ++i){
+		struct rdelta_block* blk = rw->blocks + i;
+		size_t n = 0;
+		uint32_t a;
+		uint32_t b;
+		uint32_t j;
+
+		while (n < rw->block_len){
+			ssize_t res = read(rw->fd, rw->cmp + n, rw->block_len - n);
+
+			if (res <= 0){
+				log_error_ex("Failed to read the newer version (%s)", res < 0 ? strerror(errno) : "it shrank");
+				return -1;
+			}
+			n += res;
+		}
+		weak_sums(rw->cmp, rw->block_len, &a, &b);
+		blk->weak = weak_of(a, b);
+		blk->strong = strong_of(rw->cmp, rw->block_len);
+		blk->next = RDELTA_NONE;
+
+		for (j = rw->buckets[bucket_of(rw, blk->weak)]; j != RDELTA_NONE; j = rw->blocks[j].next){
+			if (rw->blocks[j].weak == blk->weak && rw->blocks[j].strong == blk->strong){
+				break;
+			}
+		}
+		if (j == RDELTA_NONE){
+			blk->next = rw->buckets[bucket_of(rw, blk->weak)];
+			rw->buckets[bucket_of(rw, blk->weak)] = i;
+		}
+	}
+	return 0;
+}
+
+struct rdelta_writer* rdelta_writer_new(const char* base, int (*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	struct rdelta_writer* rw;
+	struct stat st;
+
+	return_ifnull(base, NULL);
+	return_ifnull(sink, NULL);
+
+	if (!(rw = calloc(1, sizeof(*rw)))){
+		log_enomem();
+		return NULL;
+	}
+	rw->sink = sink;
+	rw->sink_data = sink_data;
+	if ((rw->fd = open(base, O_RDONLY)) < 0){
+		log_efopen(base);
+		free(rw);
+		return NULL;
+	}
+	if (fstat(rw->fd, &st) != 0){
+		log_estat(base);
+		goto cleanup;
+	}
+	if (read_signature(rw, (uint64_t)st.st_size) != 0){
+		goto cleanup;
+	}
+
+	/* the window and a whole literal behind it always fit, with room to take more in */
+	rw->buf_size = RDELTA_MAX_LITERAL + 2 * rw->block_len + RDELTA_MAX_LITERAL;
+	if (!(rw->buf = malloc(rw->buf_size))){
+		log_enomem();
+		goto cleanup;
+	}
+	return rw;
+
+cleanup:
+	rdelta_writer_abort(rw);
+	return NULL;
+}
+
+static int emit(struct rdelta_writer* rw, const void* data, size_t len){
+	if (rw->failed || rw->sink(data, len, rw->sink_data) != 0){
+		rw->failed = 1;
+		return -1;
+	}
+	return 0;
+}
+
+static int flush_copy(struct rdelta_writer* rw){
+	unsigned char op[OP_COPY_LEN];
+
+	if (rw->copy_len == 0){
+		return 0;
+	}
+	op[0] = OP_COPY;
+	put_u64(op + 1, rw->copy_off);
+	put_u32(op + 9, rw->copy_len);
+	rw->copy_len = 0;
+	return emit(rw, op, sizeof(op));
+}
+
+/* everything from lit_start to pos */
+static int flush_literal(struct rdelta_writer* rw){
+	unsigned char op[OP_LITERAL_LEN];
+	size_t len = rw->pos - rw->lit_start;
+
+	if (len == 0){
+		return 0;
+	}
+	if (flush_copy(rw) != 0){
+		return -1;
+	}
+	op[0] = OP_LITERAL;
+	put_u32(op + 1, (unsigned long)len);
+	if (emit(rw, op, sizeof(op)) != 0 || emit(rw, rw->buf + rw->lit_start, len) != 0){
+		return -1;
+	}
+	rw->lit_start = rw->pos;
+	return 0;
+}
+
+static int add_copy(struct rdelta_writer* rw, uint32_t block){
+	uint64_t off = (uint64_t)block * rw->block_len;
+
+	if (rw->copy_len > 0 && (rw->copy_off + rw->copy_len != off || rw->copy_len + rw->block_len > RDELTA_MAX_COPY) && flush_copy(rw) != 0){
+		return -1;
+	}
+	if (rw->copy_len == 0){
+		rw->copy_off = off;
+	}
+	rw->copy_len += (unsigned long)rw->block_len;
+	return 0;
+}
+
+/* the weak and strong sums are only a hint, so a match is always checked against the newer version itself */
+static int block_matches(struct rdelta_writer* rw, uint32_t block, uint32_t weak, uint32_t* strong, const unsigned char* window){
+	const struct rdelta_block* blk = rw->blocks + block;
+	size_t n = 0;
+
+	if (blk->weak != weak){
+		return 0;
+	}
+	if (*strong == 0){
+		/* only worked out once a weak sum matches, and 0 stands for not yet */
+		*strong = strong_of(window, rw->block_len) | 1;
+	}
+	if ((blk->strong | 1) != *strong){
+		return 0;
+	}
+	while (n < rw->block_len){
+		ssize_t res = pread(rw->fd, rw->cmp + n, rw->block_len - n, (off_t)((uint64_t)block * rw->block_len + n));
+
+		if (res <= 0){
+			return 0;
+		}
+		n += res;
+	}
+	return memcmp(rw->cmp, window, rw->block_len) == 0;
+}
+
+/* the block of the newer version the window at pos is, or RDELTA_NONE */
+static uint32_t find_block(struct rdelta_writer* rw){
+	const unsigned char* window = rw->buf + rw->pos;
+	uint32_t weak = weak_of(rw->a, rw->b);
+	uint32_t strong = 0;
+	uint32_t i;
+
+	/* the block after the last one matched is the most likely, and keeps the copy going */
+	if (rw->copy_len > 0 && rw->lit_start == rw->pos && (rw->copy_off + rw->copy_len) % rw->block_len == 0){
+		uint64_t next = (rw->copy_off + rw->copy_len) / rw->block_len;
+
+		if (next < rw->n_blocks && block_matches(rw, (uint32_t)next, weak, &strong, window)){
+			return (uint32_t)next;
+		}
+	}
+	for (i = rw->buckets[bucket_of(rw, weak)]; i != RDELTA_NONE; i = rw->blocks[i].next){
+		if (block_matches(rw, i, weak, &strong, window)){
+			return i;
+		}
+	}
+	return RDELTA_NONE;
+}
+
+static int scan(struct rdelta_writer* rw){
+	size_t len = rw->block_len;
+
+	if (rw->n_blocks == 0){
+		rw->pos = rw->end;
+		return rw->pos - rw->lit_start >= RDELTA_MAX_LITERAL ? flush_literal(rw) : 0;
+	}
+	while (rw->end - rw->pos >= len){
+		uint32_t block;
+
+		if (rw->roll_pending){
+			unsigned char out;
+
+			if (rw->end - rw->pos == len){
+				break;
+			}
+			out = rw->buf[rw->pos];
+			rw->a += rw->buf[rw->pos + len] - (uint32_t)out;
+			rw->b += rw->a - (uint32_t)len * out;
+			rw->pos++;
+			rw->roll_pending = 0;
+			if (rw->pos - rw->lit_start >= RDELTA_MAX_LITERAL && flush_literal(rw) != 0){
+				return -1;
+			}
+		}
+		if (!rw->rolling){
+			weak_sums(rw->buf + rw->pos, len, &rw->a, &rw->b);
+			rw->rolling = 1;
+		}
+
+		if ((block = find_block(rw)) != RDELTA_NONE){
+			if (flush_literal(rw) != 0 || add_copy(rw, block) != 0){
+				return -1;
+			}
+			rw->pos += len;
+			rw->lit_start = rw->pos;
+			rw->rolling = 0;
+			continue;
+		}
+		rw->roll_pending = 1;
+	}
+	return 0;
+}
+
+int rdelta_writer_write(const void* data, size_t len, void* rdelta_writer){
+	struct rdelta_writer* rw = rdelta_writer;
+	const unsigned char* p = data;
+
+	return_ifnull(rw, -1);
+	return_ifnull(data, -1);
+
+	rw->target_len += len;
+	while (len > 0){
+		size_t n;
+
+		/* what is already in the delta is dropped to make room */
+		if (rw->end == rw->buf_size){
+			memmove(rw->buf, rw->buf + rw->lit_start, rw->end - rw->lit_start);
+			rw->pos -= rw->lit_start;
+			rw->end -= rw->lit_start;
+			rw->lit_start = 0;
+		}
+		n = rw->buf_size - rw->end < len ? rw->buf_size - rw->end : len;
+		memcpy(rw->buf + rw->end, p, n);
+		rw->end += n;
+		p += n;
+		len -= n;
+		if (scan(rw) != 0){
+			return -1;
+		}
+	}
+	return rw->failed ? -1 : 0;
+}
+
+static void writer_free(struct rdelta_writer* rw){
+	if (rw->fd >= 0){
+		close(rw->fd);
+	}
+	free(rw->blocks);
+	free(rw->buckets);
+	free(rw->cmp);
+	free(rw->buf);
+	free(rw);
+}
+
+int rdelta_writer_close(struct rdelta_writer* rw){
+	unsigned char op[OP_END_LEN];
+	int ret = 0;
+
+	return_ifnull(rw, -1);
+
+	/* the tail is shorter than a block, so it can only be a literal */
+	rw->pos = rw->end;
+	op[0] = OP_END;
+	put_u64(op + 1, rw->target_len);
+	if (rw->failed || flush_literal(rw) != 0 || flush_copy(rw) != 0 || emit(rw, op, sizeof(op)) != 0){
+		log_error("Failed to finish the delta");
+		ret = -1;
+	}
+	writer_free(rw);
+	return ret;
+}
+
+void rdelta_writer_abort(struct rdelta_writer* rw){
+	if (rw){
+		writer_free(rw);
+	}
+}
+
+struct rdelta_reader{
+	int fd;
+	uint64_t base_size;
+	/* the operation being read, and how much of it has come in */
+	unsigned char op[OP_COPY_LEN];
+	size_t op_have;
+	/* what is left of the literal being passed through */
+	unsigned long literal_left;
+	unsigned char* copy_buf;
+	uint64_t written;
+	int done;
+	int (*sink)(const void* data, size_t len, void* sink_data);
+	void* sink_data;
+};
+
+#define RDELTA_COPY_BUF (1 << 16)
+
+struct rdelta_reader* rdelta_reader_new(const char* base, int (*sink)(const void* data, size_t len, void* sink_data), void* sink_data){
+	struct rdelta_reader* rr;
+	struct stat st;
+
+	return_ifnull(base, NULL);
+	return_ifnull(sink, NULL);
+
+	if (!(rr = calloc(1, sizeof(*rr))) || !(rr->copy_buf = malloc(RDELTA_COPY_BUF))){
+		log_enomem();
+		free(rr);
+		return NULL;
+	}
+	rr->sink = sink;
+	rr->sink_data = sink_data;
+	if ((rr->fd = open(base, O_RDONLY)) < 0){
+		log_efopen(base);
+		free(rr->copy_buf);
+		free(rr);
+		return NULL;
+	}
+	if (fstat(rr->fd, &st) != 0){
+		log_estat(base);
+		rdelta_reader_abort(rr);
+		return NULL;
+	}
+	rr->base_size = (uint64_t)st.st_size;
+	return rr;
+}
+
+static size_t op_len(unsigned char op){
+	switch (op){
+	case OP_COPY:
+		return OP_COPY_LEN;
+	case OP_LITERAL:
+		return OP_LITERAL_LEN;
+	case OP_END:
+		return OP_END_LEN;
+	default:
+		return 0;
+	}
+}
+
+static int run_copy(struct rdelta_reader* rr, uint64_t off, unsigned long len){
+	if (off > rr->base_size || len > rr->base_size - off){
+		log_error("The delta copies from past the end of the newer version");
+		return -1;
+	}
+	while (len > 0){
+		size_t n = len < RDELTA_COPY_BUF ? len : RDELTA_COPY_BUF;
+		ssize_t res = pread(rr->fd, rr->copy_buf, n, (off_t)off);
+
+		if (res <= 0){
+			log_error_ex("Failed to read the newer version (%s)", res < 0 ? strerror(errno) : "it shrank");
+			return -1;
+		}
+		if (rr->sink(rr->copy_buf, res, rr->sink_data) != 0){
+			return -1;
+		}
+		rr->written += res;
+		off += res;
+		len -= res;
+	}
+	return 0;
+}
+
+int rdelta_reader_write(const void* data, size_t len, void* rdelta_reader){
+	struct rdelta_reader* rr = rdelta_reader;
+	const unsigned char* p = data;
+
+	return_ifnull(rr, -1);
+	return_ifnull(data, -1);
+
+	while (len > 0){
+		size_t need;
+		size_t n;
+
+		if (rr->done){
+			log_error("The delta goes on after its end");
+			return -1;
+		}
+		if (rr->literal_left > 0){
+			n = len < rr->literal_left ? len : rr->literal_left;
+			if (rr->sink(p, n, rr->sink_data) != 0){
+				return -1;
+			}
+			rr->written += n;
+			rr->literal_left -= (unsigned long)n;
+			p += n;
+			len -= n;
+			continue;
+		}
+
+		if (rr->op_have == 0){
+			rr->op[rr->op_have++] = *p++;
+			len--;
+			if (op_len(rr->op[0]) == 0){
+				log_error("The delta is corrupt");
+				return -1;
+			}
+		}
+		need = op_len(rr->op[0]) - rr->op_have;
+		n = len < need ? len : need;
+		memcpy(rr->op + rr->op_have, p, n);
+		rr->op_have += n;
+		p += n;
+		len -= n;
+		if (rr->op_have < op_len(rr->op[0])){
+			continue;
+		}
+
+		rr->op_have = 0;
+		switch (rr->op[0]){
+		case OP_COPY:
+			if (run_copy(rr, get_u64(rr->op + 1), get_u32(rr->op + 9)) != 0){
+				return -1;
+			}
+			break;
+		case OP_LITERAL:
+			rr->literal_left = get_u32(rr->op + 1);
+			break;
+		default:
+			if (get_u64(rr->op + 1) != rr->written){
+				log_error("The delta does not rebuild the version it was made from");
+				return -1;
+			}
+			rr->done = 1;
+			break;
+		}
+	}
+	return 0;
+}
+
+void rdelta_reader_abort(struct rdelta_reader* rr){
+	if (!rr){
+		return;
+	}
+	close(rr->fd);
+	free(rr->copy_buf);
+	free(rr);
+}
+
+int rdelta_reader_close(struct rdelta_reader* rr){
+	int ret = 0;
+
+	return_ifnull(rr, -1);
+	if (!rr->done){
+		log_error("The delta ended early");
+		ret = -1;
+	}
+	rdelta_reader_abort(rr);
+	return ret;
+}
+
+static int fwrite_sink(const void* data, size_t len, void* fp){
+	return fwrite(data, 1, len, fp) == len ? 0 : -1;
+}
+
+static int pipeline_sink(const void* data, size_t len, void* pl){
+	return pipeline_write(pl, data, len);
+}
+
+int rdelta_store(const char* base, const char* stored, const struct options* opt, const char* password){
+	unsigned char header[RDELTA_HEADER_LEN];
+	struct ATOMICFILE* af = NULL;
+	struct pipeline* pl = NULL;
+	struct rdelta_writer* rw = NULL;
+	int ret = -1;
+
+	return_ifnull(base, -1);
+	return_ifnull(stored, -1);
+	return_ifnull(opt, -1);
+
+	/* a delta against a delta would need both to get either back */
+	if (rdelta_is_delta(stored)){
+		return 1;
+	}
+
+	if (!(af = atomic_fopen(stored))){
+		return -1;
+	}
+	memset(header, 0, sizeof(header));
+	memcpy(header, RDELTA_MAGIC, 4);
+	header[4] = RDELTA_VERSION;
+	if (fwrite(header, 1, sizeof(header), af->fp) != sizeof(header)){
+		log_efwrite(stored);
+		goto cleanup;
+	}
+	if (!(pl = pipeline_open_sink(stored, fwrite_sink, af->fp, opt, password)) ||
+			!(rw = rdelta_writer_new(base, pipeline_sink, pl))){
+		goto cleanup;
+	}
+	if (pipeline_restore_stream(stored, opt, password, rdelta_writer_write, rw) != 0){
+		log_error_ex("Failed to read %s to make a delta of it", stored);
+		goto cleanup;
+	}
+	ret = rdelta_writer_close(rw);
+	rw = NULL;
+	if (pipeline_close(pl) != 0){
+		ret = -1;
+	}
+	pl = NULL;
+	if (ret != 0 || fflush(af->fp) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+
+	if ((uint64_t)ftello(af->fp) >= get_file_size(stored)){
+		ret = 1;
+	}
+	else if (atomic_fcommit(af) != 0){
+		log_error_ex("Failed to replace %s with its delta", stored);
+		ret = -1;
+	}
+
+cleanup:
+	rdelta_writer_abort(rw);
+	pipeline_abort(pl);
+	atomic_fclose(af);
+	return ret;
+}
+
+int rdelta_is_delta(const char* stored){
+	unsigned char header[RDELTA_HEADER_LEN];
+	FILE* fp;
+	int ret;
+
+	if (!stored || !(fp = fopen(stored, "rb"))){
+		return 0;
+	}
+	ret = fread(header, 1, sizeof(header), fp) == sizeof(header) && memcmp(header, RDELTA_MAGIC, 4) == 0;
+	fclose(fp);
+	return ret;
+}
+
+int rdelta_restore(const char* base, const char* stored, const char* out, const struct options* opt, const char* password){
+	unsigned char header[RDELTA_HEADER_LEN];
+	unsigned char* buf = NULL;
+	struct restore_pipeline* rp = NULL;
+	struct rdelta_reader* rr = NULL;
+	FILE* fp_in = NULL;
+	FILE* fp_out = NULL;
+	size_t n;
+	int ret = -1;
+
+	return_ifnull(base, -1);
+	return_ifnull(stored, -1);
+	return_ifnull(out, -1);
+	return_ifnull(opt, -1);
+
+	if (!(fp_in = fopen(stored, "rb"))){
+		log_efopen(stored);
+		return -1;
+	}
+	if (fread(header, 1, sizeof(header), fp_in) != sizeof(header) || memcmp(header, RDELTA_MAGIC, 4) != 0){
+		log_error_ex("%s is not a delta", stored);
+		goto cleanup;
+	}
+	if (header[4] > RDELTA_VERSION){
+		log_error_ex("%s was made by a newer version of this program", stored);
+		goto cleanup;
+	}
+	if (!(buf = malloc(BUFFER_LEN))){
+		log_enomem();
+		goto cleanup;
+	}
+	if (!(fp_out = fopen(out, "wb"))){
+		log_efopen(out);
+		goto cleanup;
+	}
+	if (!(rr = rdelta_reader_new(base, fwrite_sink, fp_out)) ||
+			!(rp = pipeline_restore_open(stored, opt, password, rdelta_reader_write, rr))){
+		goto cleanup;
+	}
+	while ((n = fread(buf, 1, BUFFER_LEN, fp_in)) > 0){
+		if (pipeline_restore_write(buf, n, rp) != 0){
+			goto cleanup;
+		}
+	}
+	if (ferror(fp_in)){
+		log_efread(stored);
+		goto cleanup;
+	}
+	ret = pipeline_restore_close(rp);
+	rp = NULL;
+	if (rdelta_reader_close(rr) != 0){
+		ret = -1;
+	}
+	rr = NULL;
+
+cleanup:
+	pipeline_restore_abort(rp);
+	rdelta_reader_abort(rr);
+	fp_in ? fclose(fp_in) : 0;
+	if (fp_out && fclose(fp_out) != 0){
+		log_efclose(out);
+		ret = -1;
+	}
+	if (ret != 0 && fp_out){
+		remove(out);
+	}
+	free(buf);
+	return ret;
+}
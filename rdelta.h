@@ -0,0 +1,194 @@
+/** @file rdelta.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ *
+ * Stores an old version of a file as a binary delta against the version that replaced it, the way rsync sends a file.<br>
+ * The newer version is split into blocks, each with a rolling checksum, and the old version is scanned for those blocks at every offset. What matches is stored as a copy out of the newer version, and everything else as it is, so a small edit to a big file leaves a delta about the size of the edit.<br>
+ * <br>
+ * The delta is a list of operations, each one byte followed by little-endian fields:<br>
+ * 'C' OFFSET(8) LENGTH(4) copies LENGTH bytes from OFFSET in the newer version.<br>
+ * 'L' LENGTH(4) DATA(LENGTH) is data that is in the old version only.<br>
+ * 'E' LENGTH(8) ends the delta, with the length of the old version.<br>
+ * <br>
+ * A stored delta is RDELTA_MAGIC, the version, and 3 reserved bytes, followed by the delta compressed and encrypted like any other output.<br>
+ * The header is not encrypted, so a delta can be told apart from a whole version without the password.
+ */
+
+#ifndef __RDELTA_H
+#define __RDELTA_H
+
+#include "options/options.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief The first 4 bytes of a stored delta.
+ */
+#define RDELTA_MAGIC "\x89" "EZD"
+#define RDELTA_VERSION 1     /**< @brief The newest version of the delta format, which this version reads and writes. */
+#define RDELTA_HEADER_LEN 8  /**< @brief The length of the header: RDELTA_MAGIC, the version, and 3 reserved bytes. */
+
+#define RDELTA_MIN_BLOCK 512     /**< @brief The smallest block the newer version is split into. */
+#define RDELTA_MAX_BLOCK 65536   /**< @brief The largest block the newer version is split into. Blocks are about the square root of its size in between. */
+
+#define RDELTA_MIN_SIZE ((uint64_t)1 << 16) /**< @brief Outputs smaller than this are kept whole, since a delta would not save enough to pay for decoding both versions (64KiB). */
+
+/**
+ * @brief Makes a delta out of an old version that is written to it, against a newer version on disk.
+ */
+struct rdelta_writer;
+
+/**
+ * @brief Reads the blocks of the newer version, and starts a delta.
+ *
+ * @param base Path to the newer version, in its original form.<br>
+ * It must not change until the writer is closed.
+ *
+ * @param sink A function that receives each block of the delta.<br>
+ * It must return 0 on success or non-zero to abort.
+ *
+ * @param sink_data An argument to pass to sink.
+ *
+ * @return A new writer, or NULL on failure.<br>
+ * This must be closed with rdelta_writer_close() or rdelta_writer_abort().
+ */
+struct rdelta_writer* rdelta_writer_new(const char* base, int (*sink)(const void* data, size_t len, void* sink_data), void* sink_data);
+
+/**
+ * @brief Feeds the next part of the old version to a writer.<br>
+ * The arguments are in this order so it can be the sink of pipeline_restore_stream().
+ *
+ * @param data The data. It can be split up anywhere.
+ *
+ * @param len The length of the data in bytes.
+ *
+ * @param rdelta_writer The writer.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int rdelta_writer_write(const void* data, size_t len, void* rdelta_writer);
+
+/**
+ * @brief Finishes a delta and frees its writer.<br>
+ * This frees the writer even if it fails.
+ *
+ * @param rw The writer.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int rdelta_writer_close(struct rdelta_writer* rw);
+
+/**
+ * @brief Frees a writer without finishing its delta.
+ *
+ * @param rw The writer. This can be NULL.
+ *
+ * @return void
+ */
+void rdelta_writer_abort(struct rdelta_writer* rw);
+
+/**
+ * @brief Rebuilds an old version out of a delta that is written to it and the newer version on disk.
+ */
+struct rdelta_reader;
+
+/**
+ * @brief Starts rebuilding an old version.
+ *
+ * @param base Path to the newer version the delta was made against, in its original form.
+ *
+ * @param sink A function that receives each block of the old version.<br>
+ * It must return 0 on success or non-zero to abort.
+ *
+ * @param sink_data An argument to pass to sink.
+ *
+ * @return A new reader, or NULL on failure.<br>
+ * This must be closed with rdelta_reader_close() or rdelta_reader_abort().
+ */
+struct rdelta_reader* rdelta_reader_new(const char* base, int (*sink)(const void* data, size_t len, void* sink_data), void* sink_data);
+
+/**
+ * @brief Feeds the next part of a delta to a reader.<br>
+ * The arguments are in this order so it can be the sink of pipeline_restore_open().
+ *
+ * @param data The data. It can be split up anywhere, including inside an operation.
+ *
+ * @param len The length of the data in bytes.
+ *
+ * @param rdelta_reader The reader.
+ *
+ * @return 0 on success, or negative if the delta is corrupt, does not fit the newer version, or the sink failed.
+ */
+int rdelta_reader_write(const void* data, size_t len, void* rdelta_reader);
+
+/**
+ * @brief Checks that a delta was whole, and frees its reader.<br>
+ * This frees the reader even if it fails.
+ *
+ * @param rr The reader.
+ *
+ * @return 0 on success, or negative if the delta ended early or the old version did not come out as long as it says.
+ */
+int rdelta_reader_close(struct rdelta_reader* rr);
+
+/**
+ * @brief Frees a reader without checking its delta.
+ *
+ * @param rr The reader. This can be NULL.
+ *
+ * @return void
+ */
+void rdelta_reader_abort(struct rdelta_reader* rr);
+
+/**
+ * @brief Replaces a stored old version with a delta against the newer version, if the delta is smaller.<br>
+ * The old version is decrypted and decompressed straight into the delta, and the delta is compressed and encrypted as it is made, so neither is staged on disk.
+ *
+ * @param base Path to the newer version, in its original form.
+ *
+ * @param stored Path to the old version, as pipeline_backup_file() wrote it.<br>
+ * It is replaced in one step once the delta is done, so it is never seen half-written.
+ *
+ * @param opt The options the old version was written with, which the delta is written with as well.
+ *
+ * @param password The encryption password to use.<br>
+ * If this is NULL and the output is encrypted, the user is asked for a password.
+ *
+ * @return 0 if the old version was replaced, positive if the delta would not have been smaller, or negative on failure.<br>
+ * Either way, stored holds the old version in one form or the other.
+ */
+int rdelta_store(const char* base, const char* stored, const struct options* opt, const char* password);
+
+/**
+ * @brief Checks if a stored file is a delta written by rdelta_store().
+ *
+ * @param stored Path to the file.
+ *
+ * @return 1 if it is a delta, or 0 if it is not or could not be read.
+ */
+int rdelta_is_delta(const char* stored);
+
+/**
+ * @brief Rebuilds an old version out of a delta written by rdelta_store().
+ *
+ * @param base Path to the newer version the delta was made against, in its original form.
+ *
+ * @param stored Path to the delta.
+ *
+ * @param out Path to write the old version to.<br>
+ * If this file already exists, it will be overwritten.<br>
+ * If this function fails, the output file is removed.
+ *
+ * @param opt The options the delta was written with.
+ *
+ * @param password The decryption password to use.<br>
+ * If this is NULL and the delta is encrypted, the user is asked for a password.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int rdelta_restore(const char* base, const char* stored, const char* out, const struct options* opt, const char* password);
+
+#endif
@@ -0,0 +1,1496 @@
+/** @file restore.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "restore.h"
+#include "backup.h"
+#include "catalog.h"
+#include "checksumsort.h"
+#include "chunkstore.h"
+#include "pack.h"
+#include "pipeline.h"
+#include "retention.h"
+#include "filehelper.h"
+#include "fileiterator.h"
+#include "exclude.h"
+#include "threadpool.h"
+#include "treehash.h"
+#include "zipauto.h"
+#include "log.h"
+#include "crypt/crypt_getpassword.h"
+#include "crypt/crypt_session.h"
+#include "cloud/base.h"
+#include "compression/zip.h"
+#include "strings/stringhelper.h"
+#include "strings/stringarray.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+/* state shared by every file restored during restore() */
+struct restore_context{
+	const struct options* opt;
+	const char* password;
+	const char* chunk_directory;
+	/* NULL unless missing files can be downloaded */
+	struct cloud_data* cd;
+	const char* cloud_directory;
+	pthread_mutex_t cloud_mutex;
+
+	/* guarded by stats_mutex */
+	pthread_mutex_t stats_mutex;
+	unsigned long n_restored;
+	unsigned long n_failed;
+	double bytes_restored;
+};
+
+static void record_result(struct restore_context* ctx, int ok, double bytes){
+	pthread_mutex_lock(&ctx->stats_mutex);
+	if (ok){
+		ctx->n_restored++;
+		ctx->bytes_restored += bytes;
+	}
+	else{
+		ctx->n_failed++;
+	}
+	pthread_mutex_unlock(&ctx->stats_mutex);
+}
+
+/* a file that has its own output file (or chunk manifest) in files/ */
+struct file_job{
+	struct restore_context* ctx;
+	char* file;
+	char* stored;
+	char* target;
+};
+
+/* fetches files/FILE from the cloud copy of the backup */
+static int download_file(struct restore_context* ctx, const char* file, char* stored){
+	char* cloud_path = NULL;
+	char* stored_parent = NULL;
+	int ret = 0;
+
+	if (!(cloud_path = sh_concat_path(sh_concat_path(sh_dup(ctx->cloud_directory), "/files"), file)) ||
+			!(stored_parent = sh_parent_dir(stored))){
+		log_error("Failed to create cloud path.");
+		ret = -1;
+		goto cleanup;
+	}
+	if (mkdir_recursive(stored_parent) < 0){
+		log_error_ex("Failed to create directory %s", stored_parent);
+		ret = -1;
+		goto cleanup;
+	}
+
+	pthread_mutex_lock(&ctx->cloud_mutex);
+	ret = cloud_download(cloud_path, &stored, ctx->cd);
+	pthread_mutex_unlock(&ctx->cloud_mutex);
+	if (ret != 0){
+		log_error_ex("Failed to download %s from the cloud", cloud_path);
+	}
+
+cleanup:
+	free(cloud_path);
+	free(stored_parent);
+	return ret;
+}
+
+/* runs on a worker thread when more than one thread is used */
+static void restore_file(void* arg){
+	struct file_job* job = arg;
+	struct restore_context* ctx = job->ctx;
+	int res = 0;
+
+	if (!file_exists(job->stored) && download_file(ctx, job->file, job->stored) != 0){
+		res = -1;
+	}
+	else if (is_chunk_manifest(job->stored)){
+		res = chunk_restore_file(job->stored, ctx->chunk_directory, job->target, ctx->opt, ctx->password);
+	}
+	/* decrypts and decompresses straight into the target */
+	else{
+		res = pipeline_restore_file(job->stored, job->target, ctx->opt, ctx->password);
+	}
+
+	if (res != 0){
+		log_error_ex("Failed to restore %s", job->file);
+	}
+	record_result(ctx, res == 0, res == 0 ? (double)get_file_size(job->target) : 0);
+
+	free(job->file);
+	free(job->stored);
+	free(job->target);
+	free(job);
+}
+
+/* a file that is only in the cloud, which is decrypted and decompressed into its target as it downloads instead of being saved first */
+struct stream_job{
+	struct restore_context* ctx;
+	char* file;
+	/* where the file is kept if it turns out to be a chunk manifest, which has to be whole before its chunks can be found */
+	char* stored;
+	char* target;
+	/* the first bytes, which say whether it is a chunk manifest */
+	unsigned char head[sizeof(CHUNK_MANIFEST_HEADER)];
+	size_t head_len;
+	int decided;
+	/* only one of these is ever opened */
+	struct restore_pipeline* rp;
+	FILE* fp_manifest;
+	FILE* fp_target;
+};
+
+static int target_sink(const void* data, size_t len, void* sink_data){
+	struct stream_job* job = sink_data;
+
+	if (write_sparse(job->fp_target, data, len) != 0){
+		log_efwrite(job->target);
+		return -1;
+	}
+	return 0;
+}
+
+/* opens whatever the rest of the download goes to, and gives it the bytes that were held back to decide */
+static int stream_decide(struct stream_job* job){
+	struct restore_context* ctx = job->ctx;
+	char* stored_parent = NULL;
+
+	job->decided = 1;
+	if (job->head_len == sizeof(job->head) && memcmp(job->head, CHUNK_MANIFEST_HEADER "\n", sizeof(job->head)) == 0){
+		if (!(stored_parent = sh_parent_dir(job->stored)) || mkdir_recursive(stored_parent) < 0){
+			log_error_ex("Failed to create the directory for %s", job->stored);
+			free(stored_parent);
+			return -1;
+		}
+		free(stored_parent);
+		if (!(job->fp_manifest = fopen(job->stored, "wb"))){
+			log_efopen(job->stored);
+			return -1;
+		}
+		if (fwrite(job->head, 1, job->head_len, job->fp_manifest) != job->head_len){
+			log_efwrite(job->stored);
+			return -1;
+		}
+		return 0;
+	}
+
+	if (!(job->fp_target = fopen(job->target, "wb"))){
+		log_efopen(job->target);
+		return -1;
+	}
+	if (!(job->rp = pipeline_restore_open(job->file, ctx->opt, ctx->password, target_sink, job))){
+		return -1;
+	}
+	return job->head_len > 0 ? pipeline_restore_write(job->head, job->head_len, job->rp) : 0;
+}
+
+/* runs on a transfer's thread, in order */
+static int stream_sink(const void* data, size_t len, void* sink_data){
+	struct stream_job* job = sink_data;
+
+	if (!job->decided){
+		size_t n = sizeof(job->head) - job->head_len;
+
+		if (n > len){
+			n = len;
+		}
+		memcpy(job->head + job->head_len, data, n);
+		job->head_len += n;
+		if (job->head_len < sizeof(job->head)){
+			return 0;
+		}
+		if (stream_decide(job) != 0){
+			return -1;
+		}
+		data = (const unsigned char*)data + n;
+		len -= n;
+	}
+	if (len == 0){
+		return 0;
+	}
+	if (job->fp_manifest){
+		if (fwrite(data, 1, len, job->fp_manifest) != len){
+			log_efwrite(job->stored);
+			return -1;
+		}
+		return 0;
+	}
+	return pipeline_restore_write(data, len, job->rp);
+}
+
+static void stream_finished(int res, void* data){
+	struct stream_job* job = data;
+	struct restore_context* ctx = job->ctx;
+
+	/* a file shorter than the manifest header */
+	if (res == 0 && !job->decided && stream_decide(job) != 0){
+		res = -1;
+	}
+	if (job->fp_manifest){
+		if (fclose(job->fp_manifest) != 0){
+			log_efclose(job->stored);
+			res = -1;
+		}
+		if (res != 0){
+			remove(job->stored);
+		}
+		else{
+			res = chunk_restore_file(job->stored, ctx->chunk_directory, job->target, ctx->opt, ctx->password);
+		}
+	}
+	if (job->rp){
+		/* the pipeline is freed either way, but only a whole download can be finished */
+		if (res == 0){
+			res = pipeline_restore_close(job->rp);
+		}
+		else{
+			pipeline_restore_abort(job->rp);
+		}
+	}
+	if (job->fp_target){
+		if (res == 0 && finish_sparse(job->fp_target) != 0){
+			log_efwrite(job->target);
+			res = -1;
+		}
+		if (fclose(job->fp_target) != 0){
+			log_efclose(job->target);
+			res = -1;
+		}
+		if (res != 0){
+			remove(job->target);
+		}
+	}
+
+	if (res != 0){
+		log_error_ex("Failed to restore %s", job->file);
+	}
+	record_result(ctx, res == 0, res == 0 ? (double)get_file_size(job->target) : 0);
+
+	free(job->file);
+	free(job->stored);
+	free(job->target);
+	free(job);
+}
+
+/* takes ownership of file, stored, and target */
+static void submit_stream(struct cloud_transfers* ct, struct restore_context* ctx, char* file, char* stored, char* target){
+	struct stream_job* job;
+	char* cloud_path = NULL;
+
+	job = calloc(1, sizeof(*job));
+	if (!job || !(cloud_path = sh_concat_path(sh_concat_path(sh_dup(ctx->cloud_directory), "/files"), file))){
+		log_enomem();
+		free(job);
+		free(file);
+		free(stored);
+		free(target);
+		record_result(ctx, 0, 0);
+		return;
+	}
+	job->ctx = ctx;
+	job->file = file;
+	job->stored = stored;
+	job->target = target;
+
+	/* stream_finished() takes ownership of the job once the download starts */
+	if (cloud_download_stream_submit(ct, cloud_path, stream_sink, job, stream_finished, job) != 0){
+		log_error_ex("Failed to start downloading %s from the cloud", cloud_path);
+		stream_finished(-1, job);
+	}
+	free(cloud_path);
+}
+
+/* every file that is restored from the same pack segment */
+struct segment_job{
+	struct restore_context* ctx;
+	const char* pack;
+	struct pack_entry* entries;
+	size_t n_entries;
+};
+
+static void restore_segment(void* arg){
+	struct segment_job* job = arg;
+	struct restore_context* ctx = job->ctx;
+	double bytes = 0;
+	size_t i;
+
+	/* the segment is only decrypted and decompressed once, no matter how many files are in it */
+	if (pack_extract(job->pack, job->entries, job->n_entries, ctx->opt, ctx->password) != 0){
+		log_error_ex("Failed to restore files from pack segment %s", job->pack);
+		pthread_mutex_lock(&ctx->stats_mutex);
+		ctx->n_failed += job->n_entries;
+		pthread_mutex_unlock(&ctx->stats_mutex);
+	}
+	else{
+		for (i = 0; i < job->n_entries; ++i){
+			bytes += job->entries[i].len;
+		}
+		pthread_mutex_lock(&ctx->stats_mutex);
+		ctx->n_restored += job->n_entries;
+		ctx->bytes_restored += bytes;
+		pthread_mutex_unlock(&ctx->stats_mutex);
+	}
+
+	free(job->entries);
+	free(job);
+}
+
+/* the newest copy of a file that lives in a pack segment */
+struct packed_file{
+	char* file;
+	size_t segment;
+	unsigned long offset;
+	unsigned long len;
+	/* NULL unless the file is restored from its segment */
+	char* target;
+	/* NULL unless the file is verified from its segment */
+	char* checksum;
+};
+
+struct packed_list{
+	struct packed_file* files;
+	size_t len;
+	size_t size;
+	/* the segment whose index is being read */
+	size_t segment;
+};
+
+static int add_packed_file(const char* file, unsigned long offset, unsigned long len, void* data){
+	struct packed_list* pl = data;
+	struct packed_file* pf;
+
+	if (pl->len >= pl->size){
+		size_t size = pl->size ? pl->size * 2 : 256;
+		struct packed_file* tmp = realloc(pl->files, size * sizeof(*tmp));
+		if (!tmp){
+			log_enomem();
+			return -1;
+		}
+		pl->files = tmp;
+		pl->size = size;
+	}
+
+	pf = &pl->files[pl->len];
+	if (!(pf->file = sh_dup(file))){
+		log_enomem();
+		return -1;
+	}
+	pf->segment = pl->segment;
+	pf->offset = offset;
+	pf->len = len;
+	pf->target = NULL;
+	pf->checksum = NULL;
+	pl->len++;
+	return 0;
+}
+
+/* sorts by file, then oldest segment first */
+static int cmp_packed_file(const void* p1, const void* p2){
+	const struct packed_file* pf1 = p1;
+	const struct packed_file* pf2 = p2;
+	int res = strcmp(pf1->file, pf2->file);
+
+	if (res != 0){
+		return res;
+	}
+	return pf1->segment < pf2->segment ? -1 : pf1->segment > pf2->segment;
+}
+
+/* sorts by segment, then by position within the segment */
+static int cmp_packed_position(const void* p1, const void* p2){
+	const struct packed_file* pf1 = p1;
+	const struct packed_file* pf2 = p2;
+
+	if (pf1->segment != pf2->segment){
+		return pf1->segment < pf2->segment ? -1 : 1;
+	}
+	return pf1->offset < pf2->offset ? -1 : pf1->offset > pf2->offset;
+}
+
+static void free_packed_list(struct packed_list* pl){
+	size_t i;
+
+	for (i = 0; i < pl->len; ++i){
+		free(pl->files[i].file);
+		free(pl->files[i].target);
+		free(pl->files[i].checksum);
+	}
+	free(pl->files);
+}
+
+/* reads every pack index into a list sorted by file, keeping only the newest entry for each file
+ * segments is filled with the path of each segment, oldest first */
+static int read_pack_indices(const char* pack_directory, struct packed_list* pl, struct string_array* segments){
+	struct string_array* indices = NULL;
+	struct fi_stack* fis = NULL;
+	const char* tmp;
+	size_t i;
+	size_t j;
+	int ret = 0;
+
+	if (!directory_exists(pack_directory)){
+		return 0;
+	}
+
+	if (!(indices = sa_new()) || !(fis = fi_start(pack_directory))){
+		log_error_ex("Failed to read pack directory %s", pack_directory);
+		ret = -1;
+		goto cleanup;
+	}
+	while ((tmp = fi_next_path(fis)) != NULL){
+		if (strcmp(sh_file_ext(tmp), "idx") == 0 && sa_add(indices, tmp) != 0){
+			log_enomem();
+			ret = -1;
+			goto cleanup;
+		}
+	}
+	/* segment names start with the time they were made */
+	sa_sort(indices);
+
+	for (i = 0; i < indices->len; ++i){
+		char* pack = sh_dup(indices->strings[i]);
+
+		/* NAME.idx -> NAME.pack */
+		if (pack){
+			pack[strlen(pack) - strlen("idx")] = '\0';
+			pack = sh_concat(pack, "pack");
+		}
+		if (!pack){
+			log_enomem();
+			ret = -1;
+			goto cleanup;
+		}
+		if (!file_exists(pack)){
+			log_warning_ex("Pack segment %s is missing", pack);
+			free(pack);
+			continue;
+		}
+
+		pl->segment = segments->len;
+		if (sa_add(segments, pack) != 0){
+			log_enomem();
+			free(pack);
+			ret = -1;
+			goto cleanup;
+		}
+		free(pack);
+
+		if (pack_read_index(indices->strings[i], add_packed_file, pl) != 0){
+			log_error_ex("Failed to read pack index %s", indices->strings[i]);
+			ret = -1;
+			goto cleanup;
+		}
+	}
+
+	/* a file that was packed more than once only counts in its newest segment */
+	qsort(pl->files, pl->len, sizeof(*pl->files), cmp_packed_file);
+	for (i = 0, j = 0; i < pl->len; ++i){
+		if (i + 1 < pl->len && strcmp(pl->files[i].file, pl->files[i + 1].file) == 0){
+			free(pl->files[i].file);
+			continue;
+		}
+		pl->files[j++] = pl->files[i];
+	}
+	pl->len = j;
+
+cleanup:
+	fi_end(fis);
+	indices ? sa_free(indices) : (void)0;
+	return ret;
+}
+
+/* hands every packed file that was chosen to be restored to a job for its segment */
+static void submit_segments(struct threadpool* tp, struct restore_context* ctx, struct packed_list* pl, const struct string_array* segments){
+	size_t i;
+	size_t j;
+
+	qsort(pl->files, pl->len, sizeof(*pl->files), cmp_packed_position);
+
+	for (i = 0; i < pl->len; i = j){
+		struct segment_job* job;
+		size_t n = 0;
+
+		for (j = i; j < pl->len && pl->files[j].segment == pl->files[i].segment; ++j){
+			n += pl->files[j].target != NULL;
+		}
+		if (n == 0){
+			continue;
+		}
+
+		job = malloc(sizeof(*job));
+		if (!job || !(job->entries = malloc(n * sizeof(*job->entries)))){
+			log_enomem();
+			free(job);
+			pthread_mutex_lock(&ctx->stats_mutex);
+			ctx->n_failed += n;
+			pthread_mutex_unlock(&ctx->stats_mutex);
+			continue;
+		}
+		job->ctx = ctx;
+		job->pack = segments->strings[pl->files[i].segment];
+		job->n_entries = 0;
+		for (; i < j; ++i){
+			if (pl->files[i].target){
+				job->entries[job->n_entries].out = pl->files[i].target;
+				job->entries[job->n_entries].offset = pl->files[i].offset;
+				job->entries[job->n_entries].len = pl->files[i].len;
+				job->n_entries++;
+			}
+		}
+
+		/* restore_segment() takes ownership of the job */
+		if (!tp || tp_submit(tp, restore_segment, job) != 0){
+			restore_segment(job);
+		}
+	}
+}
+
+/* takes ownership of file, stored, and target */
+static void submit_file(struct threadpool* tp, struct restore_context* ctx, char* file, char* stored, char* target){
+	struct file_job* job;
+
+	job = malloc(sizeof(*job));
+	if (!job){
+		log_enomem();
+		free(file);
+		free(stored);
+		free(target);
+		record_result(ctx, 0, 0);
+		return;
+	}
+	job->ctx = ctx;
+	job->file = file;
+	job->stored = stored;
+	job->target = target;
+
+	/* restore_file() takes ownership of the job */
+	if (!tp || tp_submit(tp, restore_file, job) != 0){
+		restore_file(job);
+	}
+}
+
+/* the small files of a backup made with a dictionary cannot be decompressed without it */
+static struct zip_dict* load_dictionary(const struct options* opt, const char* password){
+	struct zip_dict* dict = NULL;
+	char* dict_path;
+
+	if (!zip_dict_supported(opt->c_type)){
+		return NULL;
+	}
+	if (!(dict_path = sh_concat_path(sh_dup(opt->output_directory), "dictionary"))){
+		log_enomem();
+		return NULL;
+	}
+	if (pipeline_load_dict(dict_path, opt, password, &dict) < 0){
+		log_warning("Failed to load the compression dictionary. Files compressed with it will fail.");
+	}
+	free(dict_path);
+	return dict;
+}
+
+/* ex is opt->exclude compiled by exclude_new() */
+static int is_wanted(const struct options* opt, const struct exclude_trie* ex, const char* file){
+	size_t i;
+
+	if (exclude_match(ex, file)){
+		return 0;
+	}
+	for (i = 0; i < opt->directories->len; ++i){
+		if (sh_starts_with(file, opt->directories->strings[i])){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* files are listed in the same order as the checksum file, so the parent directory is usually the same as last time */
+static int make_target_parent(const char* target, char** prev_parent){
+	char* parent = sh_parent_dir(target);
+
+	if (!parent){
+		log_enomem();
+		return -1;
+	}
+	if (*prev_parent && strcmp(parent, *prev_parent) == 0){
+		free(parent);
+		return 0;
+	}
+	if (mkdir_recursive(parent) < 0){
+		log_error_ex("Failed to create directory %s", parent);
+		free(parent);
+		return -1;
+	}
+	free(*prev_parent);
+	*prev_parent = parent;
+	return 0;
+}
+
+/* what catalog_list() is given while restoring the versions that were replaced since the time being restored */
+struct old_versions{
+	struct restore_context* ctx;
+	const struct exclude_trie* ex;
+	char** prev_parent;
+	/* files whose version was not in deltas/, which may be ones that were removed */
+	struct string_array* missing;
+};
+
+/* a file whose version at the time being restored was replaced since, so it is rebuilt from deltas/ */
+static int restore_old_version(const char* file, const struct catalog_version* version, void* data){
+	struct old_versions* ov = data;
+	const struct options* opt = ov->ctx->opt;
+	char* target;
+	int res;
+
+	/* the current version is restored from the checksum file like any other */
+	if (version->end == 0 || !is_wanted(opt, ov->ex, file)){
+		return 0;
+	}
+
+	target = opt->restore_directory ? sh_concat_path(sh_dup(opt->restore_directory), file) : sh_dup(file);
+	if (!target || make_target_parent(target, ov->prev_parent) != 0){
+		log_error_ex("Failed to prepare %s for restoring", file);
+		record_result(ov->ctx, 0, 0);
+		free(target);
+		return 0;
+	}
+
+	res = retention_restore(opt, ov->ctx->password, file, version->end, target);
+	/* a removed file stays in files/ instead of moving to deltas/, which can only be checked once the catalog is not being listed */
+	if (res > 0 && sa_add(ov->missing, file) == 0){
+		free(target);
+		return 0;
+	}
+	if (res != 0){
+		log_error_ex2("Failed to restore %s from the versions replaced at %lu", file, version->end);
+	}
+	record_result(ov->ctx, res == 0, res == 0 ? (double)get_file_size(target) : 0);
+	free(target);
+	return 0;
+}
+
+static double elapsed_seconds(const struct timeval* start){
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+int restore(const struct options* opt){
+	char* checksum_path = NULL;
+	char* files_directory = NULL;
+	char* chunk_directory = NULL;
+	char* pack_directory = NULL;
+	char* password = NULL;
+	struct options opt_dict;
+	struct zip_dict* dict = NULL;
+	struct crypt_session* session = NULL;
+	char* prev_parent = NULL;
+	FILE* fp_checksum = NULL;
+	struct cloud_options* co_true = NULL;
+	struct exclude_trie* ex = NULL;
+	struct string_array* segments = NULL;
+	struct packed_list pl;
+	struct restore_context ctx;
+	struct threadpool* tp = NULL;
+	struct cloud_transfers* ct = NULL;
+	struct checksum_reader* cr = NULL;
+	struct catalog* catalog = NULL;
+	struct catalog_version version;
+	struct old_versions ov;
+	size_t i;
+	const struct element* next;
+	struct element* e;
+	struct timeval start;
+	size_t cursor = 0;
+	double seconds;
+	int res;
+	int ret = 0;
+
+	gettimeofday(&start, NULL);
+
+	memset(&pl, 0, sizeof(pl));
+	memset(&ctx, 0, sizeof(ctx));
+	pthread_mutex_init(&ctx.cloud_mutex, NULL);
+	pthread_mutex_init(&ctx.stats_mutex, NULL);
+	ctx.opt = opt;
+
+	checksum_path = sh_concat_path(sh_dup(opt->output_directory), "checksums.txt");
+	files_directory = sh_concat_path(sh_dup(opt->output_directory), "/files");
+	chunk_directory = sh_concat_path(sh_dup(opt->output_directory), "/chunks");
+	pack_directory = sh_concat_path(sh_dup(opt->output_directory), "/packs");
+	memset(&ov, 0, sizeof(ov));
+	if (!checksum_path || !files_directory || !chunk_directory || !pack_directory || !(segments = sa_new()) || !(ov.missing = sa_new())){
+		log_error("Failed to determine backup paths.");
+		ret = -1;
+		goto cleanup;
+	}
+	ctx.chunk_directory = chunk_directory;
+
+	fp_checksum = fopen(checksum_path, "rb");
+	if (!fp_checksum){
+		log_error_ex("No finished backup was found in %s", opt->output_directory);
+		ret = -1;
+		goto cleanup;
+	}
+	/* the checksum file may be front-coded, which only a checksum_reader can read */
+	if (!(cr = checksum_reader_new(fp_checksum, 0))){
+		log_error("Failed to start reading the checksum file.");
+		ret = -1;
+		goto cleanup;
+	}
+
+	/* the catalog knows which version of every file was current at any time */
+	if (opt->restore_time != 0){
+		if ((res = catalog_open(opt->output_directory, &catalog)) != 0){
+			if (res > 0){
+				log_error_ex("%s has no catalog of old versions to restore from", opt->output_directory);
+			}
+			else{
+				log_error("Failed to open the catalog of old versions.");
+			}
+			ret = -1;
+			goto cleanup;
+		}
+		/* nothing was replaced since then, so that is the last backup */
+		if (opt->restore_time >= catalog_last(catalog)){
+			catalog_close(catalog);
+			catalog = NULL;
+		}
+	}
+
+	/* asked for once, instead of once per file */
+	if (opt->enc_algorithm && !opt->enc_password){
+		if (crypt_getpassword("Enter decryption password:", NULL, &password) != 0){
+			log_error("Failed to read decryption password from terminal");
+			ret = -1;
+			goto cleanup;
+		}
+	}
+	ctx.password = password ? password : opt->enc_password;
+	/* the compressor the backup recorded wins over the one in the options */
+	opt_dict = *opt;
+	if (zip_auto_load(opt->output_directory, &opt_dict.c_type) < 0){
+		log_warning("Failed to read which compressor the backup used. Using the one given instead.");
+	}
+	/* every file's keys come from the same password, so it only goes through the key derivation once per backup it came from */
+	if (opt->enc_algorithm && ctx.password && !(session = crypt_session_new(opt->enc_algorithm, ctx.password))){
+		log_warning("Failed to start an encryption session. Each file's keys will be derived from the password instead.");
+	}
+	opt_dict.enc_session = session;
+	ctx.opt = &opt_dict;
+	if ((dict = load_dictionary(&opt_dict, ctx.password)) != NULL){
+		opt_dict.c_dict = dict;
+	}
+
+	if (opt->cloud_options->cp != CLOUD_NONE){
+		if ((co_true = generate_filled_co(opt->cloud_options)) == NULL){
+			log_error("Failed to generate cloud options structure.");
+			ret = -1;
+			goto cleanup;
+		}
+		if (co_true->cp != CLOUD_NONE && cloud_login(co_true, &ctx.cd) != 0){
+			log_warning("Could not connect to the cloud. Only files in the local backup will be restored.");
+			ctx.cd = NULL;
+		}
+		ctx.cloud_directory = co_true->upload_directory;
+		/* several files are downloaded at once, each decrypted and decompressed on its transfer's thread */
+		if (ctx.cd && !(ct = cloud_transfers_new(ctx.cd, 0))){
+			log_warning("Failed to start streaming downloads. Files only in the cloud will be downloaded before they are restored.");
+		}
+	}
+
+	if (read_pack_indices(pack_directory, &pl, segments) != 0){
+		log_error("Failed to read pack segments.");
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (!(ex = exclude_new(opt->exclude))){
+		log_error("Failed to compile the exclude list.");
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (opt->n_threads != 1){
+		tp = tp_new(opt->n_threads, 0);
+		if (!tp){
+			log_warning("Failed to start worker threads. Restoring files on this thread instead.");
+		}
+	}
+
+	/* the checksum file lists every file in the backup, sorted the same way as the packed files */
+	while ((res = checksum_reader_next(cr, &next)) == 0){
+		struct packed_file* pf = NULL;
+		char* stored = NULL;
+		char* target = NULL;
+
+		if (!is_wanted(opt, ex, next->file)){
+			continue;
+		}
+		/* a file that did not exist then is left out, and one that changed since is rebuilt from deltas/ afterwards */
+		if (catalog){
+			int found = catalog_resolve(catalog, next->file, opt->restore_time, &version);
+
+			if (found < 0){
+				log_error_ex("Failed to look up %s in the catalog", next->file);
+				record_result(&ctx, 0, 0);
+			}
+			if (found != 0 || version.end != 0){
+				continue;
+			}
+		}
+		if (!(e = copy_element(next))){
+			record_result(&ctx, 0, 0);
+			continue;
+		}
+
+		while (cursor < pl.len && strcmp(pl.files[cursor].file, e->file) < 0){
+			cursor++;
+		}
+		if (cursor < pl.len && strcmp(pl.files[cursor].file, e->file) == 0){
+			pf = &pl.files[cursor];
+		}
+
+		stored = sh_concat_path(sh_dup(files_directory), e->file);
+		target = opt->restore_directory ? sh_concat_path(sh_dup(opt->restore_directory), e->file) : sh_dup(e->file);
+		if (!stored || !target || make_target_parent(target, &prev_parent) != 0){
+			log_error_ex("Failed to prepare %s for restoring", e->file);
+			record_result(&ctx, 0, 0);
+			free(stored);
+			free(target);
+			free_element(e);
+			continue;
+		}
+
+		/* a file that grew too big to pack has its own output file, which is newer than the packed copy */
+		if (file_exists(stored) || (!pf && ctx.cd && !ct)){
+			submit_file(tp, &ctx, e->file, stored, target);
+			e->file = NULL;
+		}
+		else if (!pf && ct){
+			submit_stream(ct, &ctx, e->file, stored, target);
+			e->file = NULL;
+		}
+		else if (pf){
+			pf->target = target;
+			free(stored);
+		}
+		else{
+			log_error_ex("No copy of %s was found in the backup", e->file);
+			record_result(&ctx, 0, 0);
+			free(stored);
+			free(target);
+		}
+		free_element(e);
+	}
+
+	if (res < 0){
+		log_error("Failed to read the checksum file.");
+		ret = -1;
+	}
+
+	/* the versions that were current then but have been replaced or removed since */
+	if (catalog){
+		ov.ctx = &ctx;
+		ov.ex = ex;
+		ov.prev_parent = &prev_parent;
+		if (catalog_list(catalog, opt->restore_time, restore_old_version, &ov) < 0){
+			log_error("Failed to list the catalog.");
+			ret = -1;
+		}
+	}
+	for (i = 0; i < ov.missing->len; ++i){
+		const char* file = ov.missing->strings[i];
+		char* copy = NULL;
+		char* stored = NULL;
+		char* target = NULL;
+		int found;
+
+		/* only a file that is gone now still has that version in files/, since anything else there is newer */
+		if ((found = catalog_resolve(catalog, file, catalog_last(catalog), &version)) <= 0){
+			if (found < 0){
+				log_error_ex("Failed to look up %s in the catalog", file);
+			}
+			else{
+				log_error_ex("The version of %s from then was pruned", file);
+			}
+			record_result(&ctx, 0, 0);
+			continue;
+		}
+		copy = sh_dup(file);
+		stored = sh_concat_path(sh_dup(files_directory), file);
+		target = opt->restore_directory ? sh_concat_path(sh_dup(opt->restore_directory), file) : sh_dup(file);
+		if (!copy || !stored || !target || !file_exists(stored) || make_target_parent(target, &prev_parent) != 0){
+			log_error_ex("No copy of %s was found in the backup", file);
+			record_result(&ctx, 0, 0);
+			free(copy);
+			free(stored);
+			free(target);
+			continue;
+		}
+		submit_file(tp, &ctx, copy, stored, target);
+	}
+
+	submit_segments(tp, &ctx, &pl, segments);
+
+	/* every failure was already counted by stream_finished() */
+	if (ct){
+		cloud_transfers_wait(ct);
+	}
+	if (tp && tp_wait(tp) != 0){
+		log_warning("Failed to wait for worker threads");
+	}
+	tp_free(tp);
+	tp = NULL;
+
+	seconds = elapsed_seconds(&start);
+	printf("Restored %lu files (%.1f MiB) in %.2f seconds (%.1f MiB/s)\n", ctx.n_restored, ctx.bytes_restored / (1024.0 * 1024.0), seconds, seconds > 0 ? ctx.bytes_restored / (1024.0 * 1024.0) / seconds : 0.0);
+	if (ctx.n_failed > 0){
+		log_error_ex("%lu files could not be restored", ctx.n_failed);
+		ret = -1;
+	}
+
+cleanup:
+	cloud_transfers_free(ct);
+	tp_free(tp);
+	exclude_free(ex);
+	checksum_reader_free(cr);
+	fp_checksum ? fclose(fp_checksum) : 0;
+	catalog_close(catalog);
+	cloud_logout(ctx.cd);
+	co_true ? co_free(co_true) : (void)0;
+	free_packed_list(&pl);
+	segments ? sa_free(segments) : (void)0;
+	ov.missing ? sa_free(ov.missing) : (void)0;
+	password ? crypt_freepassword(password) : (void)0;
+	zip_dict_free(dict);
+	crypt_session_free(session);
+	pthread_mutex_destroy(&ctx.cloud_mutex);
+	pthread_mutex_destroy(&ctx.stats_mutex);
+	free(checksum_path);
+	free(files_directory);
+	free(chunk_directory);
+	free(pack_directory);
+	free(prev_parent);
+	return ret;
+}
+
+/* state shared by every file checked during verify() */
+struct verify_context{
+	const struct options* opt;
+	const char* password;
+	const char* chunk_directory;
+	/* NULL unless files missing from the local backup can be looked up in the cloud */
+	struct cloud_data* cd;
+	const char* cloud_directory;
+	pthread_mutex_t cloud_mutex;
+
+	/* guarded by stats_mutex */
+	pthread_mutex_t stats_mutex;
+	unsigned long n_verified;
+	unsigned long n_mismatched;
+	unsigned long n_failed;
+	unsigned long n_remote;
+	double bytes_verified;
+};
+
+enum verify_result{
+	VERIFY_OK,
+	VERIFY_MISMATCH,
+	VERIFY_FAILED,
+	VERIFY_REMOTE
+};
+
+static void record_verify_result(struct verify_context* ctx, enum verify_result res, double bytes){
+	pthread_mutex_lock(&ctx->stats_mutex);
+	switch (res){
+	case VERIFY_OK:
+		ctx->n_verified++;
+		ctx->bytes_verified += bytes;
+		break;
+	case VERIFY_MISMATCH:
+		ctx->n_mismatched++;
+		break;
+	case VERIFY_REMOTE:
+		ctx->n_remote++;
+		break;
+	default:
+		ctx->n_failed++;
+	}
+	pthread_mutex_unlock(&ctx->stats_mutex);
+}
+
+/* the original data of one file, hashed as it comes out of the decompressor */
+struct verify_hash{
+	struct tree_hash* th;
+	double bytes;
+};
+
+static int verify_hash_start(struct verify_hash* vh, const struct options* opt, const char* expected){
+	/* the checksum says how it was made, so files from before and after switching to tree hashes can both be checked */
+	vh->th = tree_hash_new(opt->hash_algorithm, strncmp(expected, TREE_HASH_PREFIX, strlen(TREE_HASH_PREFIX)) == 0 ? TREE_HASH_SEGMENT_LEN : 0);
+	vh->bytes = 0;
+	return vh->th ? 0 : -1;
+}
+
+static int verify_hash_sink(const void* data, size_t len, void* sink_data){
+	struct verify_hash* vh = sink_data;
+
+	vh->bytes += len;
+	return tree_hash_update(vh->th, data, len);
+}
+
+/* finishes the hash and frees it */
+static enum verify_result verify_hash_end(struct verify_hash* vh, const char* file, const char* expected){
+	char* hash = NULL;
+	enum verify_result res = VERIFY_FAILED;
+
+	if (tree_hash_final(vh->th, &hash) != 0){
+		log_error_ex("Failed to calculate the checksum of %s", file);
+	}
+	else if (strcmp(hash, expected) != 0){
+		log_error_ex("%s does not match its checksum", file);
+		res = VERIFY_MISMATCH;
+	}
+	else{
+		res = VERIFY_OK;
+	}
+	free(hash);
+	tree_hash_free(vh->th);
+	vh->th = NULL;
+	return res;
+}
+
+/* a file that has its own output file (or chunk manifest) in files/ */
+struct verify_file_job{
+	struct verify_context* ctx;
+	char* file;
+	char* stored;
+	char* checksum;
+	/* the checksum of the output itself, or NULL if it has none */
+	char* artifact;
+};
+
+/* without a local copy, all that can be checked is that the cloud still has the file */
+static enum verify_result verify_remote(struct verify_context* ctx, const char* file){
+	char* cloud_path;
+	int res;
+
+	if (!(cloud_path = sh_concat_path(sh_concat_path(sh_dup(ctx->cloud_directory), "/files"), file))){
+		log_error("Failed to create cloud path.");
+		return VERIFY_FAILED;
+	}
+	pthread_mutex_lock(&ctx->cloud_mutex);
+	res = cloud_stat(cloud_path, NULL, ctx->cd);
+	pthread_mutex_unlock(&ctx->cloud_mutex);
+
+	if (res != 0){
+		log_error_ex("No copy of %s was found in the backup or the cloud", file);
+	}
+	free(cloud_path);
+	return res == 0 ? VERIFY_REMOTE : VERIFY_FAILED;
+}
+
+/* runs on a worker thread when more than one thread is used */
+static void verify_file(void* arg){
+	struct verify_file_job* job = arg;
+	struct verify_context* ctx = job->ctx;
+	struct verify_hash vh;
+	enum verify_result res;
+
+	/* only submitted without a local copy if there is a cloud to look in */
+	if (!file_exists(job->stored)){
+		record_verify_result(ctx, verify_remote(ctx, job->file), 0);
+		goto cleanup;
+	}
+
+	/* the output is read as it is, so nothing has to be decrypted or decompressed */
+	if (ctx->opt->flags.bits.flag_verify_artifacts && job->artifact && !is_chunk_manifest(job->stored)){
+		char* hash = NULL;
+
+		if (tree_hash_file(job->stored, ctx->opt->hash_algorithm, 0, 1, &hash) != 0){
+			log_error_ex("Failed to calculate the checksum of the backup of %s", job->file);
+			record_verify_result(ctx, VERIFY_FAILED, 0);
+		}
+		else if (strcmp(hash, job->artifact) != 0){
+			log_error_ex("The backup of %s does not match its checksum", job->file);
+			record_verify_result(ctx, VERIFY_MISMATCH, 0);
+		}
+		else{
+			record_verify_result(ctx, VERIFY_OK, (double)get_file_size(job->stored));
+		}
+		free(hash);
+		goto cleanup;
+	}
+
+	if (verify_hash_start(&vh, ctx->opt, job->checksum) != 0){
+		record_verify_result(ctx, VERIFY_FAILED, 0);
+		goto cleanup;
+	}
+	if ((is_chunk_manifest(job->stored) ?
+				chunk_restore_stream(job->stored, ctx->chunk_directory, ctx->opt, ctx->password, verify_hash_sink, &vh) :
+				pipeline_restore_stream(job->stored, ctx->opt, ctx->password, verify_hash_sink, &vh)) != 0){
+		log_error_ex("Failed to read the backup of %s", job->file);
+		tree_hash_free(vh.th);
+		record_verify_result(ctx, VERIFY_FAILED, 0);
+		goto cleanup;
+	}
+	res = verify_hash_end(&vh, job->file, job->checksum);
+	record_verify_result(ctx, res, vh.bytes);
+
+cleanup:
+	free(job->file);
+	free(job->stored);
+	free(job->checksum);
+	free(job->artifact);
+	free(job);
+}
+
+/* takes ownership of file, stored, checksum, and artifact */
+static void submit_verify_file(struct threadpool* tp, struct verify_context* ctx, char* file, char* stored, char* checksum, char* artifact){
+	struct verify_file_job* job;
+
+	job = malloc(sizeof(*job));
+	if (!job){
+		log_enomem();
+		free(file);
+		free(stored);
+		free(checksum);
+		free(artifact);
+		record_verify_result(ctx, VERIFY_FAILED, 0);
+		return;
+	}
+	job->ctx = ctx;
+	job->file = file;
+	job->stored = stored;
+	job->checksum = checksum;
+	job->artifact = artifact;
+
+	/* verify_file() takes ownership of the job */
+	if (!tp || tp_submit(tp, verify_file, job) != 0){
+		verify_file(job);
+	}
+}
+
+/* every file that is checked from the same pack segment */
+struct verify_segment_job{
+	struct verify_context* ctx;
+	const char* pack;
+	struct pack_entry* entries;
+	/* the packed file each entry belongs to */
+	const struct packed_file** files;
+	size_t n_entries;
+	/* the entry being hashed */
+	struct verify_hash vh;
+	size_t current;
+};
+
+static int verify_segment_sink(size_t entry, const void* data, size_t len, void* sink_data){
+	struct verify_segment_job* job = sink_data;
+	const struct packed_file* pf = job->files[entry];
+
+	if (!job->vh.th){
+		if (verify_hash_start(&job->vh, job->ctx->opt, pf->checksum) != 0){
+			return -1;
+		}
+		job->current = entry;
+	}
+	/* the entry is complete */
+	if (!data){
+		enum verify_result res = verify_hash_end(&job->vh, pf->file, pf->checksum);
+
+		record_verify_result(job->ctx, res, res == VERIFY_OK ? job->vh.bytes : 0);
+		job->current = entry + 1;
+		return 0;
+	}
+	return verify_hash_sink(data, len, &job->vh);
+}
+
+static void verify_segment(void* arg){
+	struct verify_segment_job* job = arg;
+
+	job->vh.th = NULL;
+	job->current = 0;
+
+	/* the segment is only decrypted and decompressed once, no matter how many files are in it */
+	if (pack_extract_stream(job->pack, job->entries, job->n_entries, job->ctx->opt, job->ctx->password, verify_segment_sink, job) != 0){
+		log_error_ex("Failed to read pack segment %s", job->pack);
+		tree_hash_free(job->vh.th);
+		/* every file that was not finished yet */
+		for (; job->current < job->n_entries; ++job->current){
+			record_verify_result(job->ctx, VERIFY_FAILED, 0);
+		}
+	}
+
+	free(job->entries);
+	free(job->files);
+	free(job);
+}
+
+/* hands every packed file that was chosen to be verified to a job for its segment */
+static void submit_verify_segments(struct threadpool* tp, struct verify_context* ctx, struct packed_list* pl, const struct string_array* segments){
+	size_t i;
+	size_t j;
+
+	qsort(pl->files, pl->len, sizeof(*pl->files), cmp_packed_position);
+
+	for (i = 0; i < pl->len; i = j){
+		struct verify_segment_job* job;
+		size_t n = 0;
+
+		for (j = i; j < pl->len && pl->files[j].segment == pl->files[i].segment; ++j){
+			n += pl->files[j].checksum != NULL;
+		}
+		if (n == 0){
+			continue;
+		}
+
+		job = malloc(sizeof(*job));
+		if (!job || !(job->entries = malloc(n * sizeof(*job->entries)))){
+			log_enomem();
+			free(job);
+			job = NULL;
+		}
+		else if (!(job->files = malloc(n * sizeof(*job->files)))){
+			log_enomem();
+			free(job->entries);
+			free(job);
+			job = NULL;
+		}
+		if (!job){
+			pthread_mutex_lock(&ctx->stats_mutex);
+			ctx->n_failed += n;
+			pthread_mutex_unlock(&ctx->stats_mutex);
+			continue;
+		}
+		job->ctx = ctx;
+		job->pack = segments->strings[pl->files[i].segment];
+		job->n_entries = 0;
+		for (; i < j; ++i){
+			if (pl->files[i].checksum){
+				job->entries[job->n_entries].out = NULL;
+				job->entries[job->n_entries].offset = pl->files[i].offset;
+				job->entries[job->n_entries].len = pl->files[i].len;
+				job->files[job->n_entries] = &pl->files[i];
+				job->n_entries++;
+			}
+		}
+
+		/* verify_segment() takes ownership of the job */
+		if (!tp || tp_submit(tp, verify_segment, job) != 0){
+			verify_segment(job);
+		}
+	}
+}
+
+int verify(const struct options* opt){
+	char* checksum_path = NULL;
+	char* files_directory = NULL;
+	char* chunk_directory = NULL;
+	char* pack_directory = NULL;
+	char* password = NULL;
+	struct options opt_dict;
+	struct zip_dict* dict = NULL;
+	struct crypt_session* session = NULL;
+	FILE* fp_checksum = NULL;
+	struct cloud_options* co_true = NULL;
+	struct exclude_trie* ex = NULL;
+	struct string_array* segments = NULL;
+	struct packed_list pl;
+	struct verify_context ctx;
+	struct threadpool* tp = NULL;
+	struct checksum_reader* cr = NULL;
+	const struct element* next;
+	struct element* e;
+	struct timeval start;
+	size_t cursor = 0;
+	double seconds;
+	int res;
+	int ret = 0;
+
+	gettimeofday(&start, NULL);
+
+	memset(&pl, 0, sizeof(pl));
+	memset(&ctx, 0, sizeof(ctx));
+	pthread_mutex_init(&ctx.cloud_mutex, NULL);
+	pthread_mutex_init(&ctx.stats_mutex, NULL);
+	ctx.opt = opt;
+
+	checksum_path = sh_concat_path(sh_dup(opt->output_directory), "checksums.txt");
+	files_directory = sh_concat_path(sh_dup(opt->output_directory), "/files");
+	chunk_directory = sh_concat_path(sh_dup(opt->output_directory), "/chunks");
+	pack_directory = sh_concat_path(sh_dup(opt->output_directory), "/packs");
+	if (!checksum_path || !files_directory || !chunk_directory || !pack_directory || !(segments = sa_new())){
+		log_error("Failed to determine backup paths.");
+		ret = -1;
+		goto cleanup;
+	}
+	ctx.chunk_directory = chunk_directory;
+
+	fp_checksum = fopen(checksum_path, "rb");
+	if (!fp_checksum){
+		log_error_ex("No finished backup was found in %s", opt->output_directory);
+		ret = -1;
+		goto cleanup;
+	}
+	/* the checksum file may be front-coded, which only a checksum_reader can read */
+	if (!(cr = checksum_reader_new(fp_checksum, 0))){
+		log_error("Failed to start reading the checksum file.");
+		ret = -1;
+		goto cleanup;
+	}
+
+	/* asked for once, instead of once per file */
+	if (opt->enc_algorithm && !opt->enc_password){
+		if (crypt_getpassword("Enter decryption password:", NULL, &password) != 0){
+			log_error("Failed to read decryption password from terminal");
+			ret = -1;
+			goto cleanup;
+		}
+	}
+	ctx.password = password ? password : opt->enc_password;
+	/* the compressor the backup recorded wins over the one in the options */
+	opt_dict = *opt;
+	if (zip_auto_load(opt->output_directory, &opt_dict.c_type) < 0){
+		log_warning("Failed to read which compressor the backup used. Using the one given instead.");
+	}
+	/* every file's keys come from the same password, so it only goes through the key derivation once per backup it came from */
+	if (opt->enc_algorithm && ctx.password && !(session = crypt_session_new(opt->enc_algorithm, ctx.password))){
+		log_warning("Failed to start an encryption session. Each file's keys will be derived from the password instead.");
+	}
+	opt_dict.enc_session = session;
+	ctx.opt = &opt_dict;
+	if ((dict = load_dictionary(&opt_dict, ctx.password)) != NULL){
+		opt_dict.c_dict = dict;
+	}
+
+	if (opt->cloud_options->cp != CLOUD_NONE){
+		if ((co_true = generate_filled_co(opt->cloud_options)) == NULL){
+			log_error("Failed to generate cloud options structure.");
+			ret = -1;
+			goto cleanup;
+		}
+		if (co_true->cp != CLOUD_NONE && cloud_login(co_true, &ctx.cd) != 0){
+			log_warning("Could not connect to the cloud. Only files in the local backup will be verified.");
+			ctx.cd = NULL;
+		}
+		ctx.cloud_directory = co_true->upload_directory;
+	}
+
+	if (read_pack_indices(pack_directory, &pl, segments) != 0){
+		log_error("Failed to read pack segments.");
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (!(ex = exclude_new(opt->exclude))){
+		log_error("Failed to compile the exclude list.");
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (opt->n_threads != 1){
+		tp = tp_new(opt->n_threads, 0);
+		if (!tp){
+			log_warning("Failed to start worker threads. Verifying files on this thread instead.");
+		}
+	}
+
+	/* the same walk as restore(), except every file is hashed instead of written out */
+	while ((res = checksum_reader_next(cr, &next)) == 0){
+		struct packed_file* pf = NULL;
+		char* stored = NULL;
+
+		if (!is_wanted(opt, ex, next->file)){
+			continue;
+		}
+		if (!(e = copy_element(next))){
+			record_verify_result(&ctx, VERIFY_FAILED, 0);
+			continue;
+		}
+
+		while (cursor < pl.len && strcmp(pl.files[cursor].file, e->file) < 0){
+			cursor++;
+		}
+		if (cursor < pl.len && strcmp(pl.files[cursor].file, e->file) == 0){
+			pf = &pl.files[cursor];
+		}
+
+		if (!(stored = sh_concat_path(sh_dup(files_directory), e->file))){
+			log_enomem();
+			record_verify_result(&ctx, VERIFY_FAILED, 0);
+		}
+		/* a file that grew too big to pack has its own output file, which is newer than the packed copy */
+		else if (file_exists(stored) || (!pf && ctx.cd)){
+			submit_verify_file(tp, &ctx, e->file, stored, e->checksum, e->artifact);
+			e->file = NULL;
+			e->checksum = NULL;
+			e->artifact = NULL;
+		}
+		else if (pf){
+			pf->checksum = e->checksum;
+			e->checksum = NULL;
+			free(stored);
+		}
+		else{
+			log_error_ex("No copy of %s was found in the backup", e->file);
+			record_verify_result(&ctx, VERIFY_FAILED, 0);
+			free(stored);
+		}
+		free_element(e);
+	}
+
+	if (res < 0){
+		log_error("Failed to read the checksum file.");
+		ret = -1;
+	}
+
+	submit_verify_segments(tp, &ctx, &pl, segments);
+
+	if (tp && tp_wait(tp) != 0){
+		log_warning("Failed to wait for worker threads");
+	}
+	tp_free(tp);
+	tp = NULL;
+
+	seconds = elapsed_seconds(&start);
+	printf("Verified %lu files (%.1f MiB) in %.2f seconds (%.1f MiB/s)\n", ctx.n_verified, ctx.bytes_verified / (1024.0 * 1024.0), seconds, seconds > 0 ? ctx.bytes_verified / (1024.0 * 1024.0) / seconds : 0.0);
+	if (ctx.n_remote > 0){
+		printf("%lu files are only in the cloud, and were checked to exist there\n", ctx.n_remote);
+	}
+	if (ctx.n_mismatched > 0){
+		log_error_ex("%lu files do not match their checksums", ctx.n_mismatched);
+		ret = -1;
+	}
+	if (ctx.n_failed > 0){
+		log_error_ex("%lu files could not be verified", ctx.n_failed);
+		ret = -1;
+	}
+
+cleanup:
+	tp_free(tp);
+	exclude_free(ex);
+	checksum_reader_free(cr);
+	fp_checksum ? fclose(fp_checksum) : 0;
+	cloud_logout(ctx.cd);
+	co_true ? co_free(co_true) : (void)0;
+	free_packed_list(&pl);
+	segments ? sa_free(segments) : (void)0;
+	password ? crypt_freepassword(password) : (void)0;
+	zip_dict_free(dict);
+	crypt_session_free(session);
+	pthread_mutex_destroy(&ctx.cloud_mutex);
+	pthread_mutex_destroy(&ctx.stats_mutex);
+	free(checksum_path);
+	free(files_directory);
+	free(chunk_directory);
+	free(pack_directory);
+	return ret;
+}
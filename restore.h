@@ -0,0 +1,47 @@
+/** @file restore.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __RESTORE_H
+#define __RESTORE_H
+
+#include "options/options.h"
+
+/**
+ * @brief Restores the files of a backup made by backup().<br>
+ * Every file listed in the backup's checksum file is decrypted and decompressed straight to its target path, with several files restored at once.<br>
+ * A restore throughput report is printed when it finishes.
+ *
+ * @param opt The options the backup was made with.<br>
+ * The backup is read from opt->output_directory.<br>
+ * Only files inside opt->directories and outside opt->exclude are restored.<br>
+ * Files are restored under opt->restore_directory, or to their original paths if it is NULL. Existing files are overwritten.<br>
+ * If opt->restore_time is set, the files are restored as they were then. The backup's catalog says which version of each file that was, and a version that has been replaced since is rebuilt from the deltas directory with retention_restore().<br>
+ * Files missing from opt->output_directory are downloaded from the cloud based on opt->cloud_options.<br>
+ * opt->n_threads files are restored at once.
+ *
+ * @return 0 on success, or negative if any file could not be restored.
+ */
+int restore(const struct options* opt);
+
+/**
+ * @brief Checks that every file of a backup made by backup() can be restored intact.<br>
+ * Every file listed in the backup's checksum file is decrypted and decompressed in memory, and its checksum is compared to the one in the checksum file. Nothing is written to disk.<br>
+ * Several files are checked at once, and a report with the throughput and any mismatches is printed when it finishes.
+ *
+ * @param opt The options the backup was made with.<br>
+ * The backup is read from opt->output_directory.<br>
+ * Only files inside opt->directories and outside opt->exclude are checked.<br>
+ * Files missing from opt->output_directory are looked up in the cloud based on opt->cloud_options. Since they are not downloaded, only their existence is checked.<br>
+ * opt->n_threads files are checked at once.<br>
+ * If opt->flags.bits.flag_verify_artifacts is set, an output with a checksum of its own in the checksum file is only hashed as it is stored and compared to that, which is much faster but only shows that the output has not changed since it was made.
+ *
+ * @return 0 on success, or negative if any file does not match its checksum or could not be checked.
+ */
+int verify(const struct options* opt);
+
+#endif
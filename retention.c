@@ -0,0 +1,1111 @@
+/** @file retention.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "retention.h"
+#include "backup.h"
+#include "catalog.h"
+#include "pack.h"
+#include "pipeline.h"
+#include "rdelta.h"
+#include "chunkstore.h"
+#include "filehelper.h"
+#include "fileiterator.h"
+#include "threadpool.h"
+#include "log.h"
+#include "cloud/base.h"
+#include "compression/zip.h"
+#include "strings/stringhelper.h"
+#include "strings/stringarray.h"
+#include <dirent.h>
+#include <errno.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+long retention_parse_generation(const char* delta_path, unsigned long* out){
+	const char* dot;
+	const char* c;
+	char* endptr;
+
+	return_ifnull(delta_path, -1);
+
+	dot = strrchr(delta_path, '.');
+	if (!dot || dot[1] == '\0' || strchr(dot, '/')){
+		return -1;
+	}
+	for (c = dot + 1; *c; ++c){
+		if (*c < '0' || *c > '9'){
+			return -1;
+		}
+	}
+	errno = 0;
+	*out = strtoul(dot + 1, &endptr, 10);
+	if (errno == ERANGE){
+		return -1;
+	}
+	return (long)(dot - delta_path);
+}
+
+/* newest first */
+static int gen_cmp(const void* a, const void* b){
+	const struct retention_generation* g1 = a;
+	const struct retention_generation* g2 = b;
+
+	return g1->time == g2->time ? 0 : g1->time > g2->time ? -1 : 1;
+}
+
+static long day_of(unsigned long t){
+	time_t tt = (time_t)t;
+	struct tm* tm = localtime(&tt);
+
+	return tm ? (long)tm->tm_year * 400 + tm->tm_yday : (long)(t / 86400);
+}
+
+void retention_plan(struct retention_generation* gens, size_t len, unsigned keep_last, unsigned keep_daily){
+	unsigned days = 0;
+	long last_day = 0;
+	size_t i;
+
+	if (!gens || len == 0){
+		return;
+	}
+	qsort(gens, len, sizeof(*gens), gen_cmp);
+
+	for (i = 0; i < len; ++i){
+		long day = day_of(gens[i].time);
+		/* newest first, so the first generation seen on a day is its last */
+		int first_of_day = i == 0 || day != last_day;
+
+		last_day = day;
+		if (first_of_day){
+			days++;
+		}
+		if (i < keep_last){
+			gens[i].action = RETENTION_KEEP;
+		}
+		else if (first_of_day && days <= keep_daily){
+			gens[i].action = RETENTION_COMPACT;
+		}
+		else{
+			gens[i].action = RETENTION_DELETE;
+		}
+	}
+}
+
+/* gens is sorted newest first */
+static struct retention_generation* find_generation(struct retention_generation* gens, size_t len, unsigned long t){
+	struct retention_generation key;
+
+	if (len == 0){
+		return NULL;
+	}
+	key.time = t;
+	return bsearch(&key, gens, len, sizeof(*gens), gen_cmp);
+}
+
+/* the generations found so far, kept sorted so every version in a huge deltas directory is found by bisection */
+struct generation_list{
+	struct retention_generation* gens;
+	size_t len;
+	size_t size;
+};
+
+static struct retention_generation* add_generation(struct generation_list* gl, unsigned long t){
+	struct retention_generation* g = find_generation(gl->gens, gl->len, t);
+	size_t pos = 0;
+
+	if (g){
+		return g;
+	}
+	if (gl->len >= gl->size){
+		size_t size = gl->size ? gl->size * 2 : 64;
+		struct retention_generation* tmp = realloc(gl->gens, size * sizeof(*tmp));
+
+		if (!tmp){
+			log_enomem();
+			return NULL;
+		}
+		gl->gens = tmp;
+		gl->size = size;
+	}
+	while (pos < gl->len && gl->gens[pos].time > t){
+		pos++;
+	}
+	memmove(gl->gens + pos + 1, gl->gens + pos, (gl->len - pos) * sizeof(*gl->gens));
+	memset(gl->gens + pos, 0, sizeof(*gl->gens));
+	gl->gens[pos].time = t;
+	gl->len++;
+	return gl->gens + pos;
+}
+
+/* counts the loose versions of every generation in deltas/, and every generation already in delta_packs/ */
+static int list_generations(const char* deltas_dir, const char* packs_dir, struct generation_list* out){
+	struct fi_stack* fis;
+	const char* path;
+	struct stat st;
+	DIR* dp;
+	struct dirent* de;
+
+	if (directory_exists(deltas_dir)){
+		if (!(fis = fi_start(deltas_dir))){
+			log_error_ex("Failed to walk %s", deltas_dir);
+			return -1;
+		}
+		while ((path = fi_next_stat(fis, &st)) != NULL){
+			struct retention_generation* g;
+			unsigned long t;
+
+			if (retention_parse_generation(path, &t) < 0){
+				log_debug_ex("%s is not a version, so it is left alone", path);
+				continue;
+			}
+			if (!(g = add_generation(out, t))){
+				fi_end(fis);
+				return -1;
+			}
+			g->n_files++;
+			g->n_bytes += (uint64_t)st.st_size;
+		}
+		fi_end(fis);
+	}
+
+	if (!(dp = opendir(packs_dir))){
+		return 0;
+	}
+	while ((de = readdir(dp)) != NULL){
+		struct retention_generation* g;
+		char* endptr;
+		unsigned long t;
+
+		t = strtoul(de->d_name, &endptr, 10);
+		if (de->d_name[0] < '0' || de->d_name[0] > '9' || *endptr != '\0'){
+			continue;
+		}
+		if (!(g = add_generation(out, t))){
+			closedir(dp);
+			return -1;
+		}
+		g->packed = 1;
+	}
+	closedir(dp);
+	return 0;
+}
+
+static char* generation_pack_dir(const char* base, unsigned long t){
+	char name[32];
+
+	sprintf(name, "%lu", t);
+	return sh_concat_path(sh_concat_path(sh_dup(base), RETENTION_PACK_DIR), name);
+}
+
+/* base/deltas/file.t, locally or in the cloud */
+static char* delta_path(const char* base, const char* file, unsigned long t){
+	char ext[32];
+
+	sprintf(ext, ".%lu", t);
+	return sh_concat(sh_concat_path(sh_concat_path(sh_dup(base), "deltas"), file), ext);
+}
+
+struct prune_context;
+
+/* a generation that is being compacted, which is given to its pack writer's on_segment */
+struct prune_pack{
+	struct prune_context* ctx;
+	unsigned long time;
+	struct pack_writer* pw;
+};
+
+struct prune_context{
+	const struct options* opt;
+	/* segments hold versions as backup() wrote them, so they are not compressed or encrypted again */
+	struct options pack_opt;
+	char* deltas_dir;
+	size_t deltas_len;
+	struct retention_generation* gens;
+	size_t n_gens;
+	struct prune_pack* packs;
+	struct cloud_data* cd;
+	struct cloud_transfers* ct;
+	const char* cloud_directory;
+	/* the indices of every closed segment, whose loose versions leave the cloud once the segments are there */
+	struct string_array* indices;
+	/* versions that a kept delta is made against, which are kept even if their generation is not, sorted */
+	struct string_array* bases;
+	pthread_mutex_t mutex;
+	unsigned long n_deleted;
+	uint64_t bytes_deleted;
+	unsigned long n_compacted;
+	unsigned long n_segments;
+	unsigned long n_failed;
+};
+
+struct prune_job{
+	struct prune_context* ctx;
+	char* path;
+	/* the length of path without its ".TIME" */
+	size_t file_end;
+	uint64_t size;
+	struct retention_generation* gen;
+};
+
+static void count_failure(int res, void* data){
+	struct prune_context* ctx = data;
+
+	if (res != 0){
+		pthread_mutex_lock(&ctx->mutex);
+		ctx->n_failed++;
+		pthread_mutex_unlock(&ctx->mutex);
+	}
+}
+
+static void remove_from_cloud(struct prune_context* ctx, const char* file, unsigned long t){
+	char* cloud_path;
+
+	if (!ctx->ct){
+		return;
+	}
+	if (!(cloud_path = delta_path(ctx->cloud_directory, file, t)) ||
+			cloud_remove_submit(ctx->ct, cloud_path, count_failure, ctx) != 0){
+		log_warning_ex("Failed to remove %s from the cloud", file);
+		count_failure(-1, ctx);
+	}
+	free(cloud_path);
+}
+
+static void run_prune_job(void* arg){
+	struct prune_job* job = arg;
+	struct prune_context* ctx = job->ctx;
+	size_t file_len = job->file_end - ctx->deltas_len;
+	/* the original path, which the version is indexed and removed from the cloud under */
+	char* file = malloc(file_len + 1);
+
+	if (!file){
+		log_enomem();
+		count_failure(-1, ctx);
+		goto cleanup;
+	}
+	memcpy(file, job->path + ctx->deltas_len, file_len);
+	file[file_len] = '\0';
+
+	if (job->gen->action == RETENTION_COMPACT){
+		/* removing it is up to on_segment, once the segment holding it is on disk */
+		if (pack_add_file_from(ctx->packs[job->gen - ctx->gens].pw, job->path, file, NULL) != 0){
+			log_warning_ex("Failed to compact %s, so it is kept as it is", job->path);
+			count_failure(-1, ctx);
+		}
+		goto cleanup;
+	}
+
+	if (remove(job->path) != 0){
+		log_warning_ex2("Failed to remove %s (%s)", job->path, strerror(errno));
+		count_failure(-1, ctx);
+		goto cleanup;
+	}
+	remove_from_cloud(ctx, file, job->gen->time);
+
+	pthread_mutex_lock(&ctx->mutex);
+	ctx->n_deleted++;
+	ctx->bytes_deleted += job->size;
+	pthread_mutex_unlock(&ctx->mutex);
+
+cleanup:
+	free(file);
+	free(job->path);
+	free(job);
+}
+
+struct index_walk{
+	struct prune_context* ctx;
+	unsigned long time;
+	int cloud;
+};
+
+/* removes the loose copy of a version that is now in a segment */
+static int remove_packed_version(const char* file, unsigned long offset, unsigned long len, void* data){
+	struct index_walk* iw = data;
+	char* loose;
+
+	(void)offset;
+	(void)len;
+
+	if (iw->cloud){
+		remove_from_cloud(iw->ctx, file, iw->time);
+		return 0;
+	}
+	if (!(loose = delta_path(iw->ctx->opt->output_directory, file, iw->time))){
+		return -1;
+	}
+	if (remove(loose) != 0 && errno != ENOENT){
+		log_warning_ex2("Failed to remove %s (%s)", loose, strerror(errno));
+		count_failure(-1, iw->ctx);
+	}
+	else{
+		pthread_mutex_lock(&iw->ctx->mutex);
+		iw->ctx->n_compacted++;
+		pthread_mutex_unlock(&iw->ctx->mutex);
+	}
+	free(loose);
+	return 0;
+}
+
+static int upload_segment_file(struct prune_context* ctx, const char* path, unsigned long t){
+	char* cloud_dir = generation_pack_dir(ctx->cloud_directory, t);
+	char* cloud_path = NULL;
+	int ret = 0;
+
+	if (!cloud_dir || cloud_mkdir(cloud_dir, ctx->cd) < 0 ||
+			!(cloud_path = sh_concat_path(sh_dup(cloud_dir), sh_filename(path))) ||
+			cloud_upload_submit(ctx->ct, path, cloud_path, count_failure, ctx) != 0){
+		log_warning_ex("Failed to upload %s to the cloud", path);
+		ret = -1;
+	}
+	free(cloud_dir);
+	free(cloud_path);
+	return ret;
+}
+
+/* runs once a segment is safely on disk, with no other version being added to its generation */
+static int on_segment(const char* pack, const char* index, void* data){
+	struct prune_pack* pp = data;
+	struct prune_context* ctx = pp->ctx;
+	struct index_walk iw;
+
+	if (ctx->ct && (upload_segment_file(ctx, pack, pp->time) != 0 || upload_segment_file(ctx, index, pp->time) != 0)){
+		return -1;
+	}
+
+	iw.ctx = ctx;
+	iw.time = pp->time;
+	iw.cloud = 0;
+	if (pack_read_index(index, remove_packed_version, &iw) != 0){
+		log_warning_ex("Failed to read %s", index);
+		return -1;
+	}
+
+	pthread_mutex_lock(&ctx->mutex);
+	ctx->n_segments++;
+	if (ctx->ct && sa_add(ctx->indices, index) != 0){
+		pthread_mutex_unlock(&ctx->mutex);
+		return -1;
+	}
+	pthread_mutex_unlock(&ctx->mutex);
+	return 0;
+}
+
+static int remove_entry(const char* path, const struct stat* st, int type, struct FTW* ftw){
+	(void)st;
+	(void)type;
+	(void)ftw;
+
+	remove(path);
+	return 0;
+}
+
+/* the directories that only held pruned versions, which removing every file in them leaves behind */
+static int remove_empty_dir(const char* path, const struct stat* st, int type, struct FTW* ftw){
+	(void)st;
+
+	if (type == FTW_DP && ftw->level > 0){
+		rmdir(path);
+	}
+	return 0;
+}
+
+/* sends every version in deltas/ that is not kept to a worker */
+/* a loose version, for finding which versions the kept deltas need */
+struct loose_version{
+	char* path;
+	size_t file_end;
+	unsigned long time;
+	enum retention_action action;
+};
+
+/* by file, oldest first */
+static int loose_cmp(const void* a, const void* b){
+	const struct loose_version* v1 = a;
+	const struct loose_version* v2 = b;
+	size_t len = v1->file_end < v2->file_end ? v1->file_end : v2->file_end;
+	int res = memcmp(v1->path, v2->path, len);
+
+	if (res != 0){
+		return res;
+	}
+	if (v1->file_end != v2->file_end){
+		return v1->file_end < v2->file_end ? -1 : 1;
+	}
+	return v1->time == v2->time ? 0 : v1->time < v2->time ? -1 : 1;
+}
+
+static int str_cmp(const void* a, const void* b){
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/* a delta is made against the version that replaced it, so that version has to stay as long as the delta does, and so on up the chain
+ * deltas are never compacted, so only the loose versions have to be looked at */
+static int find_delta_bases(struct prune_context* ctx){
+	struct loose_version* versions = NULL;
+	size_t len = 0;
+	size_t size = 0;
+	struct fi_stack* fis;
+	const char* path;
+	size_t i;
+	int ret = 0;
+
+	for (i = 0; i < ctx->n_gens; ++i){
+		if (ctx->gens[i].action == RETENTION_DELETE){
+			break;
+		}
+	}
+	if (i == ctx->n_gens || !directory_exists(ctx->deltas_dir)){
+		return 0;
+	}
+	if (!(ctx->bases = sa_new())){
+		return -1;
+	}
+	if (!(fis = fi_start(ctx->deltas_dir))){
+		log_error_ex("Failed to walk %s", ctx->deltas_dir);
+		return -1;
+	}
+	while ((path = fi_next_path(fis)) != NULL){
+		struct retention_generation* g;
+		unsigned long t;
+		long file_end;
+
+		if ((file_end = retention_parse_generation(path, &t)) < 0 || !(g = find_generation(ctx->gens, ctx->n_gens, t))){
+			continue;
+		}
+		if (len >= size){
+			size_t new_size = size ? size * 2 : 256;
+			struct loose_version* tmp = realloc(versions, new_size * sizeof(*tmp));
+
+			if (!tmp){
+				log_enomem();
+				ret = -1;
+				break;
+			}
+			versions = tmp;
+			size = new_size;
+		}
+		if (!(versions[len].path = sh_dup(path))){
+			log_enomem();
+			ret = -1;
+			break;
+		}
+		versions[len].file_end = (size_t)file_end;
+		versions[len].time = t;
+		versions[len].action = g->action;
+		len++;
+	}
+	fi_end(fis);
+
+	if (ret == 0 && len > 0){
+		qsort(versions, len, sizeof(*versions), loose_cmp);
+	}
+	for (i = 0; ret == 0 && i < len; ){
+		size_t end = i + 1;
+		size_t k;
+		int needed = 0;
+		int any_deleted = versions[i].action == RETENTION_DELETE;
+
+		while (end < len && versions[end].file_end == versions[i].file_end && memcmp(versions[end].path, versions[i].path, versions[i].file_end) == 0){
+			any_deleted = any_deleted || versions[end].action == RETENTION_DELETE;
+			end++;
+		}
+		for (k = i; any_deleted && k < end; ++k){
+			if (versions[k].action == RETENTION_DELETE && !needed){
+				continue;
+			}
+			if (versions[k].action == RETENTION_DELETE && sa_add(ctx->bases, versions[k].path) != 0){
+				ret = -1;
+				break;
+			}
+			needed = rdelta_is_delta(versions[k].path);
+		}
+		i = end;
+	}
+
+	for (i = 0; i < len; ++i){
+		free(versions[i].path);
+	}
+	free(versions);
+	if (ret == 0 && ctx->bases->len > 0){
+		qsort(ctx->bases->strings, ctx->bases->len, sizeof(*ctx->bases->strings), str_cmp);
+		log_info_ex("%lu versions are kept since deltas that are kept are made against them", (unsigned long)ctx->bases->len);
+	}
+	return ret;
+}
+
+static int is_delta_base(const struct prune_context* ctx, const char* path){
+	return ctx->bases && ctx->bases->len > 0 && bsearch(&path, ctx->bases->strings, ctx->bases->len, sizeof(*ctx->bases->strings), str_cmp) != NULL;
+}
+
+static int dispatch_versions(struct prune_context* ctx, struct threadpool* tp){
+	struct fi_stack* fis;
+	const char* path;
+	struct stat st;
+
+	if (!directory_exists(ctx->deltas_dir)){
+		return 0;
+	}
+	if (!(fis = fi_start(ctx->deltas_dir))){
+		log_error_ex("Failed to walk %s", ctx->deltas_dir);
+		return -1;
+	}
+	while ((path = fi_next_stat(fis, &st)) != NULL){
+		struct retention_generation* g;
+		struct prune_job* job;
+		unsigned long t;
+		long file_end;
+
+		if ((file_end = retention_parse_generation(path, &t)) < 0 ||
+				!(g = find_generation(ctx->gens, ctx->n_gens, t)) ||
+				g->action == RETENTION_KEEP ||
+				(g->action == RETENTION_COMPACT && (uint64_t)st.st_size > RETENTION_PACK_MAX) ||
+				(g->action == RETENTION_DELETE && is_delta_base(ctx, path))){
+			continue;
+		}
+		/* a delta stays loose, so find_delta_bases() can see what it needs */
+		if (g->action == RETENTION_COMPACT && rdelta_is_delta(path)){
+			continue;
+		}
+
+		if (!(job = malloc(sizeof(*job))) || !(job->path = sh_dup(path))){
+			log_enomem();
+			free(job);
+			fi_end(fis);
+			return -1;
+		}
+		job->ctx = ctx;
+		job->file_end = (size_t)file_end;
+		job->size = (uint64_t)st.st_size;
+		job->gen = g;
+		if (!tp || tp_submit(tp, run_prune_job, job) != 0){
+			run_prune_job(job);
+		}
+	}
+	fi_end(fis);
+	return 0;
+}
+
+static double elapsed_seconds(const struct timeval* start){
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+int retention_prune(const struct options* opt){
+	struct prune_context ctx;
+	struct generation_list gl;
+	struct threadpool* tp = NULL;
+	struct cloud_options* co_true = NULL;
+	char* packs_dir = NULL;
+	struct timeval start;
+	double seconds;
+	size_t i;
+	int ret = 0;
+
+	return_ifnull(opt, -1);
+
+	if (opt->keep_last == 0 && opt->keep_daily == 0){
+		log_error("Pruning needs --keep-last or --keep-daily, or every old version would be deleted");
+		return -1;
+	}
+
+	memset(&ctx, 0, sizeof(ctx));
+	memset(&gl, 0, sizeof(gl));
+	pthread_mutex_init(&ctx.mutex, NULL);
+	gettimeofday(&start, NULL);
+
+	ctx.opt = opt;
+	ctx.pack_opt = *opt;
+	ctx.pack_opt.c_type = COMPRESSOR_NONE;
+	ctx.pack_opt.enc_algorithm = NULL;
+	ctx.pack_opt.enc_session = NULL;
+	ctx.pack_opt.c_dict = NULL;
+	if (!(ctx.deltas_dir = sh_concat_path(sh_dup(opt->output_directory), "deltas")) ||
+			!(packs_dir = sh_concat_path(sh_dup(opt->output_directory), RETENTION_PACK_DIR))){
+		ret = -1;
+		goto cleanup;
+	}
+	ctx.deltas_len = strlen(ctx.deltas_dir);
+
+	if (list_generations(ctx.deltas_dir, packs_dir, &gl) != 0){
+		ret = -1;
+		goto cleanup;
+	}
+	ctx.gens = gl.gens;
+	ctx.n_gens = gl.len;
+	retention_plan(ctx.gens, ctx.n_gens, opt->keep_last, opt->keep_daily);
+
+	if (opt->cloud_options->cp != CLOUD_NONE){
+		if ((co_true = generate_filled_co(opt->cloud_options)) == NULL){
+			log_error("Failed to generate cloud options structure.");
+			ret = -1;
+			goto cleanup;
+		}
+		if (cloud_login(co_true, &ctx.cd) != 0){
+			log_error("Failed to log into the cloud");
+			ret = -1;
+			goto cleanup;
+		}
+		ctx.cloud_directory = co_true->upload_directory;
+		if (!(ctx.ct = cloud_transfers_new(ctx.cd, 0)) || !(ctx.indices = sa_new())){
+			ret = -1;
+			goto cleanup;
+		}
+	}
+
+	if (!(ctx.packs = calloc(ctx.n_gens ? ctx.n_gens : 1, sizeof(*ctx.packs)))){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+	for (i = 0; i < ctx.n_gens; ++i){
+		char* dir;
+
+		if (ctx.gens[i].action != RETENTION_COMPACT || ctx.gens[i].n_files == 0){
+			continue;
+		}
+		ctx.packs[i].ctx = &ctx;
+		ctx.packs[i].time = ctx.gens[i].time;
+		dir = generation_pack_dir(opt->output_directory, ctx.gens[i].time);
+		if (!dir || !(ctx.packs[i].pw = pack_writer_new(dir, &ctx.pack_opt, NULL, on_segment, &ctx.packs[i]))){
+			log_error_ex("Failed to start compacting generation %lu", ctx.gens[i].time);
+			free(dir);
+			ret = -1;
+			goto cleanup;
+		}
+		free(dir);
+	}
+
+	if (opt->n_threads != 1){
+		tp = tp_new(opt->n_threads, 0);
+		if (!tp){
+			log_warning("Failed to start worker threads. Pruning on this thread instead.");
+		}
+	}
+	if (find_delta_bases(&ctx) != 0 || dispatch_versions(&ctx, tp) != 0){
+		ret = -1;
+	}
+	tp ? tp_wait(tp) : 0;
+
+	for (i = 0; i < ctx.n_gens; ++i){
+		if (pack_writer_close(ctx.packs[i].pw) != 0){
+			log_error_ex("Failed to finish compacting generation %lu", ctx.gens[i].time);
+			ret = -1;
+		}
+		ctx.packs[i].pw = NULL;
+
+		if (ctx.gens[i].action == RETENTION_DELETE && ctx.gens[i].packed){
+			char* dir = generation_pack_dir(opt->output_directory, ctx.gens[i].time);
+
+			if (dir){
+				nftw(dir, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+			}
+			free(dir);
+			dir = ctx.cd ? generation_pack_dir(ctx.cloud_directory, ctx.gens[i].time) : NULL;
+			if (dir && cloud_remove_submit(ctx.ct, dir, count_failure, &ctx) != 0){
+				count_failure(-1, &ctx);
+			}
+			free(dir);
+		}
+	}
+
+	/* the loose versions stay in the cloud until the segments that replace them are there */
+	if (ctx.ct){
+		if (cloud_transfers_wait(ctx.ct) != 0){
+			log_error("Some compacted versions could not be uploaded, so they are kept in the cloud as they are");
+			ret = -1;
+		}
+		else{
+			for (i = 0; i < ctx.indices->len; ++i){
+				const char* index = ctx.indices->strings[i];
+				char* parent = sh_parent_dir(index);
+				struct index_walk iw;
+
+				/* delta_packs/TIME/NAME.idx */
+				iw.ctx = &ctx;
+				iw.time = parent ? strtoul(sh_filename(parent), NULL, 10) : 0;
+				iw.cloud = 1;
+				if (!parent || pack_read_index(index, remove_packed_version, &iw) != 0){
+					log_warning_ex("Failed to read %s", index);
+					ret = -1;
+				}
+				free(parent);
+			}
+			if (cloud_transfers_wait(ctx.ct) != 0){
+				ret = -1;
+			}
+		}
+	}
+
+	if (directory_exists(ctx.deltas_dir)){
+		nftw(ctx.deltas_dir, remove_empty_dir, 64, FTW_DEPTH | FTW_PHYS);
+	}
+
+	/* the catalog must not point at versions that are gone */
+	if (ctx.n_gens > 0){
+		unsigned long* deleted = malloc(ctx.n_gens * sizeof(*deleted));
+		size_t n_deleted = 0;
+
+		if (!deleted){
+			log_enomem();
+			ret = -1;
+		}
+		else{
+			for (i = 0; i < ctx.n_gens; ++i){
+				if (ctx.gens[i].action == RETENTION_DELETE){
+					deleted[n_deleted++] = ctx.gens[i].time;
+				}
+			}
+			if (n_deleted > 0 && catalog_forget(opt->output_directory, deleted, n_deleted) < 0){
+				log_error("Failed to remove the pruned versions from the catalog");
+				ret = -1;
+			}
+			free(deleted);
+		}
+	}
+
+	seconds = elapsed_seconds(&start);
+	printf("Pruned %lu versions (%.1f MiB) and compacted %lu into %lu pack segments in %.2f seconds\n", ctx.n_deleted, ctx.bytes_deleted / (1024.0 * 1024.0), ctx.n_compacted, ctx.n_segments, seconds);
+	if (ctx.n_failed > 0){
+		log_error_ex("%lu versions could not be pruned", ctx.n_failed);
+		ret = -1;
+	}
+
+cleanup:
+	tp ? tp_free(tp) : (void)0;
+	if (ctx.packs){
+		for (i = 0; i < ctx.n_gens; ++i){
+			pack_writer_close(ctx.packs[i].pw);
+		}
+	}
+	free(ctx.packs);
+	ctx.ct ? cloud_transfers_free(ctx.ct) : (void)0;
+	ctx.cd ? cloud_logout(ctx.cd) : 0;
+	co_true ? co_free(co_true) : (void)0;
+	ctx.indices ? sa_free(ctx.indices) : (void)0;
+	ctx.bases ? sa_free(ctx.bases) : (void)0;
+	free(gl.gens);
+	free(ctx.deltas_dir);
+	free(packs_dir);
+	pthread_mutex_destroy(&ctx.mutex);
+	return ret;
+}
+
+struct find_pack{
+	const char* file;
+	char* index;
+	unsigned long offset;
+	unsigned long len;
+};
+
+int retention_find(const char* output_directory, const char* file, unsigned long time, struct retention_location* out){
+	char* loose = NULL;
+	char* dir = NULL;
+	DIR* dp = NULL;
+	struct dirent* de;
+	struct stat st;
+	int ret = 1;
+
+	return_ifnull(output_directory, -1);
+	return_ifnull(file, -1);
+	return_ifnull(out, -1);
+
+	memset(out, 0, sizeof(*out));
+	if (!(loose = delta_path(output_directory, file, time))){
+		return -1;
+	}
+	if (stat(loose, &st) == 0){
+		out->path = loose;
+		out->len = (unsigned long)st.st_size;
+		return 0;
+	}
+	free(loose);
+
+	if (!(dir = generation_pack_dir(output_directory, time))){
+		return -1;
+	}
+	if (!(dp = opendir(dir))){
+		free(dir);
+		return 1;
+	}
+	while (ret > 0 && (de = readdir(dp)) != NULL){
+		size_t name_len = strlen(de->d_name);
+		char* index;
+		int res;
+
+		if (name_len <= sizeof(".idx") - 1 || strcmp(de->d_name + name_len - (sizeof(".idx") - 1), ".idx") != 0){
+			continue;
+		}
+		if (!(index = sh_concat_path(sh_dup(dir), de->d_name))){
+			ret = -1;
+			break;
+		}
+		res = pack_find_file(index, file, &out->offset, &out->len);
+		if (res == 0){
+			/* NAME.idx is next to NAME.pack */
+			index[strlen(index) - (sizeof(".idx") - 1)] = '\0';
+			if (!(out->path = sh_concat(index, ".pack"))){
+				ret = -1;
+				break;
+			}
+			out->packed = 1;
+			ret = 0;
+		}
+		else{
+			free(index);
+			ret = res < 0 ? -1 : 1;
+		}
+	}
+	closedir(dp);
+	free(dir);
+	return ret;
+}
+
+int retention_extract(const char* output_directory, const char* file, unsigned long time, const char* out){
+	struct retention_location loc;
+	struct options* opt;
+	int res;
+
+	return_ifnull(out, -1);
+
+	if ((res = retention_find(output_directory, file, time, &loc)) != 0){
+		return res;
+	}
+	if (!loc.packed){
+		res = copy_file(loc.path, out);
+		free(loc.path);
+		return res == 0 ? 0 : -1;
+	}
+
+	/* segments were written without compression or encryption, whatever the backup used */
+	if (!(opt = options_new())){
+		free(loc.path);
+		return -1;
+	}
+	opt->c_type = COMPRESSOR_NONE;
+	opt->enc_algorithm = NULL;
+	res = pack_restore_file(loc.path, loc.offset, loc.len, out, opt, NULL);
+	options_free(opt);
+	free(loc.path);
+	return res == 0 ? 0 : -1;
+}
+
+/* every generation after time that can have a version of file: the loose versions next to it, and every compacted generation, oldest first */
+static int later_generations(const char* output_directory, const char* file, unsigned long time, unsigned long** out, size_t* out_len){
+	char* loose = NULL;
+	char* parent = NULL;
+	const char* name;
+	size_t name_len;
+	size_t size = 0;
+	DIR* dp;
+	struct dirent* de;
+	int pass;
+
+	*out = NULL;
+	*out_len = 0;
+	if (!(loose = sh_concat_path(sh_concat_path(sh_dup(output_directory), "deltas"), file)) || !(parent = sh_parent_dir(loose))){
+		free(loose);
+		return -1;
+	}
+	name = sh_filename(loose);
+	name_len = strlen(name);
+
+	for (pass = 0; pass < 2; ++pass){
+		char* dir = pass == 0 ? sh_dup(parent) : sh_concat_path(sh_dup(output_directory), RETENTION_PACK_DIR);
+
+		if (!dir || !(dp = opendir(dir))){
+			free(dir);
+			continue;
+		}
+		while ((de = readdir(dp)) != NULL){
+			unsigned long t;
+			char* endptr;
+
+			if (pass == 0){
+				if (retention_parse_generation(de->d_name, &t) != (long)name_len || strncmp(de->d_name, name, name_len) != 0){
+					continue;
+				}
+			}
+			else{
+				t = strtoul(de->d_name, &endptr, 10);
+				if (de->d_name[0] < '0' || de->d_name[0] > '9' || *endptr != '\0'){
+					continue;
+				}
+			}
+			if (t <= time){
+				continue;
+			}
+			if (*out_len >= size){
+				unsigned long* tmp;
+
+				size = size ? size * 2 : 16;
+				if (!(tmp = realloc(*out, size * sizeof(*tmp)))){
+					log_enomem();
+					closedir(dp);
+					free(dir);
+					free(loose);
+					free(parent);
+					return -1;
+				}
+				*out = tmp;
+			}
+			(*out)[(*out_len)++] = t;
+		}
+		closedir(dp);
+		free(dir);
+	}
+	free(loose);
+	free(parent);
+	return 0;
+}
+
+static int time_cmp(const void* a, const void* b){
+	unsigned long t1 = *(const unsigned long*)a;
+	unsigned long t2 = *(const unsigned long*)b;
+
+	return t1 == t2 ? 0 : t1 < t2 ? -1 : 1;
+}
+
+/* reverses whatever backup() stored a whole version as */
+static int restore_stored(const struct options* opt, const char* password, const char* stored, const char* out){
+	char* chunk_dir;
+	int res;
+
+	if (!is_chunk_manifest(stored)){
+		return pipeline_restore_file(stored, out, opt, password);
+	}
+	if (!(chunk_dir = sh_concat_path(sh_dup(opt->output_directory), "/chunks"))){
+		return -1;
+	}
+	res = chunk_restore_file(stored, chunk_dir, out, opt, password);
+	free(chunk_dir);
+	return res;
+}
+
+/* a version that is not a delta, whether loose or compacted */
+static int restore_whole(const struct options* opt, const char* password, const struct retention_location* loc, const char* file, unsigned long time, const char* out){
+	struct TMPFILE* tmp;
+	int res;
+
+	if (!loc->packed){
+		return restore_stored(opt, password, loc->path, out);
+	}
+	if (!(tmp = temp_fopen())){
+		return -1;
+	}
+	res = retention_extract(opt->output_directory, file, time, tmp->name) == 0 ? restore_stored(opt, password, tmp->name, out) : -1;
+	temp_fclose(tmp);
+	return res;
+}
+
+int retention_restore(const struct options* opt, const char* password, const char* file, unsigned long time, const char* out){
+	struct retention_location loc;
+	struct string_array* chain = NULL;
+	struct TMPFILE* tmp[2] = { NULL, NULL };
+	unsigned long* times = NULL;
+	size_t n_times = 0;
+	size_t next = 0;
+	unsigned long t = time;
+	int current = 0;
+	int cur = 0;
+	int res;
+	int ret = -1;
+
+	return_ifnull(opt, -1);
+	return_ifnull(file, -1);
+	return_ifnull(out, -1);
+
+	if ((res = retention_find(opt->output_directory, file, time, &loc)) != 0){
+		return res;
+	}
+	if (!(chain = sa_new())){
+		free(loc.path);
+		return -1;
+	}
+
+	/* follows the deltas up to a whole version, or to the one in files/ */
+	while (!loc.packed && rdelta_is_delta(loc.path)){
+		res = sa_add(chain, loc.path);
+		free(loc.path);
+		loc.path = NULL;
+		if (res != 0){
+			goto cleanup;
+		}
+		if (!times){
+			if (later_generations(opt->output_directory, file, time, &times, &n_times) != 0){
+				goto cleanup;
+			}
+			qsort(times, n_times, sizeof(*times), time_cmp);
+		}
+		res = 1;
+		for (; next < n_times && res > 0; ++next){
+			if (times[next] > t && (res = retention_find(opt->output_directory, file, times[next], &loc)) == 0){
+				t = times[next];
+			}
+		}
+		if (res < 0){
+			goto cleanup;
+		}
+		if (res > 0){
+			current = 1;
+			break;
+		}
+	}
+
+	if (chain->len == 0){
+		ret = restore_whole(opt, password, &loc, file, t, out);
+		goto cleanup;
+	}
+
+	if (!(tmp[0] = temp_fopen()) || !(tmp[1] = temp_fopen())){
+		goto cleanup;
+	}
+	if (current){
+		char* stored = sh_concat_path(sh_concat_path(sh_dup(opt->output_directory), "files"), file);
+
+		res = stored ? restore_stored(opt, password, stored, tmp[0]->name) : -1;
+		free(stored);
+	}
+	else{
+		res = restore_whole(opt, password, &loc, file, t, tmp[0]->name);
+	}
+	if (res != 0){
+		log_error_ex("Failed to restore the version that the deltas of %s are made against", file);
+		goto cleanup;
+	}
+
+	/* newest first, each one made against the one after it */
+	while (chain->len > 0){
+		const char* target = chain->len == 1 ? out : tmp[1 - cur]->name;
+
+		if (rdelta_restore(tmp[cur]->name, chain->strings[chain->len - 1], target, opt, password) != 0){
+			log_error_ex("Failed to rebuild %s from its delta", chain->strings[chain->len - 1]);
+			goto cleanup;
+		}
+		sa_remove(chain, chain->len - 1);
+		cur = 1 - cur;
+	}
+	ret = 0;
+
+cleanup:
+	free(loc.path);
+	free(times);
+	chain ? sa_free(chain) : (void)0;
+	tmp[0] ? temp_fclose(tmp[0]) : (void)0;
+	tmp[1] ? temp_fclose(tmp[1]) : (void)0;
+	return ret;
+}
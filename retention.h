@@ -0,0 +1,156 @@
+/** @file retention.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ *
+ * Prunes old versions of files out of the deltas directory.<br>
+ * Every backup moves the versions it replaces to deltas/path/to/file.TIME, where TIME is when that backup started. All of the versions with the same TIME are one generation.<br>
+ * A generation is kept as it is, compacted into pack segments under delta_packs/TIME, or deleted, depending on how recent it is.
+ * A version stored as a delta is never compacted, and the versions it is made against are kept as long as it is.
+ */
+
+#ifndef __RETENTION_H
+#define __RETENTION_H
+
+#include "options/options.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief The directory under the output directory that compacted generations are kept in, one subdirectory per generation.
+ */
+#define RETENTION_PACK_DIR "delta_packs"
+
+/**
+ * @brief Versions larger than this many bytes are kept as they are when their generation is compacted, since pack_add_file_from() reads a whole file into memory.
+ */
+#define RETENTION_PACK_MAX (1UL << 20)
+
+/**
+ * @brief What happens to a generation.
+ */
+enum retention_action{
+	RETENTION_KEEP = 0,    /**< @brief It is one of the most recent generations, and is left as it is. */
+	RETENTION_COMPACT = 1, /**< @brief It is the last generation of a day that is kept, and its versions are moved into pack segments. */
+	RETENTION_DELETE = 2   /**< @brief It is no longer kept. */
+};
+
+/**
+ * @brief One generation of versions in the deltas directory.
+ */
+struct retention_generation{
+	unsigned long time;           /**< @brief When the backup that replaced these versions started. */
+	unsigned long n_files;        /**< @brief How many versions are loose files in the deltas directory. */
+	uint64_t n_bytes;             /**< @brief How many bytes those versions take up. */
+	int packed;                   /**< @brief Non-zero if part of this generation is already in pack segments. */
+	enum retention_action action; /**< @brief What retention_plan() decided to do with it. */
+};
+
+/**
+ * @brief Reads the generation out of a path in the deltas directory.
+ *
+ * @param delta_path The path of a version, such as "/home/user/Backups/deltas/home/user/file.txt.1500000000".
+ *
+ * @param out Set to the generation's time.
+ *
+ * @return The length of the path without the ".TIME" suffix, or negative if it has none.
+ */
+long retention_parse_generation(const char* delta_path, unsigned long* out);
+
+/**
+ * @brief Decides what happens to every generation.<br>
+ * The keep_last most recent generations are kept. Of the rest, the last generation of each of the keep_daily most recent days is compacted, and every other one is deleted.<br>
+ * Days are counted in local time, and a day only counts if it has a generation.
+ *
+ * @param gens The generations, in any order. Each one's action is filled in.<br>
+ * These are sorted from newest to oldest.
+ *
+ * @param len The number of generations.
+ *
+ * @param keep_last How many of the most recent generations to keep as they are.
+ *
+ * @param keep_daily How many days to keep a generation from.
+ *
+ * @return void
+ */
+void retention_plan(struct retention_generation* gens, size_t len, unsigned keep_last, unsigned keep_daily);
+
+/**
+ * @brief Prunes the deltas directory of opt->output_directory with opt->keep_last and opt->keep_daily.<br>
+ * Versions are deleted and compacted on opt->n_threads threads. If a cloud provider is set, the same versions are removed from the cloud, and the new pack segments are uploaded to it.<br>
+ * A compacted version is only removed once the pack segment holding it is closed, so an interrupted prune loses nothing.
+ * @see retention_plan()
+ *
+ * @param opt The options to use.<br>
+ * At least one of opt->keep_last and opt->keep_daily must be non-zero, so a prune never deletes every version.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int retention_prune(const struct options* opt);
+
+/**
+ * @brief Where a version of a file is.
+ * @see retention_find()
+ */
+struct retention_location{
+	char* path;           /**< @brief The loose version, or the pack segment holding it. This must be free()'d when no longer in use. */
+	int packed;           /**< @brief Non-zero if path is a pack segment. */
+	unsigned long offset; /**< @brief The offset of the version within the decompressed segment, if it is packed. */
+	unsigned long len;    /**< @brief The length of the version, if it is packed. */
+};
+
+/**
+ * @brief Finds a version of a file, whether it is still loose or was compacted.<br>
+ * The loose version is looked for first, so this costs one stat() unless the generation was compacted, and then one index lookup per segment of that generation.
+ *
+ * @param output_directory The backup directory.
+ *
+ * @param file The original path of the file.
+ *
+ * @param time The generation to look in.
+ *
+ * @param out Filled in with where the version is.
+ *
+ * @return 0 if the version was found, positive if that generation does not have it, or negative on failure.
+ */
+int retention_find(const char* output_directory, const char* file, unsigned long time, struct retention_location* out);
+
+/**
+ * @brief Copies a version of a file out of the deltas directory, whether it is still loose or was compacted.<br>
+ * The copy is exactly what backup() wrote, so it can be restored like any other backed up file.
+ * @see retention_find()
+ *
+ * @param output_directory The backup directory.
+ *
+ * @param file The original path of the file.
+ *
+ * @param time The generation to copy it from.
+ *
+ * @param out Where to write the copy. If it exists, it is overwritten.
+ *
+ * @return 0 on success, positive if that generation does not have the file, or negative on failure.
+ */
+int retention_extract(const char* output_directory, const char* file, unsigned long time, const char* out);
+
+/**
+ * @brief Restores a version of a file to its original contents, whether it is loose, compacted, or a delta.<br>
+ * A delta is made against the version that replaced it, which may be a delta itself, so the versions after it are rebuilt newest first until it is. Only two of them are on disk at once. @see rdelta_store()
+ *
+ * @param opt The options the versions were stored with. The backup is read from opt->output_directory.
+ *
+ * @param password The decryption password to use.<br>
+ * If this is NULL and the versions are encrypted, the user is asked for a password.
+ *
+ * @param file The original path of the file.
+ *
+ * @param time The generation to restore it from.
+ *
+ * @param out Where to write the file. If it exists, it is overwritten.
+ *
+ * @return 0 on success, positive if that generation does not have the file, or negative on failure.
+ */
+int retention_restore(const struct options* opt, const char* password, const char* file, unsigned long time, const char* out);
+
+#endif
@@ -0,0 +1,739 @@
+/** @file snapshot.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+/* realpath() with a NULL buffer */
+#undef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
+
+#include "snapshot.h"
+#include "changejournal.h"
+#include "filehelper.h"
+#include "log.h"
+#include "strings/stringhelper.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+struct snapshot{
+	/* the directory being backed up, as it was given */
+	char* dir;
+	/* the same directory inside the snapshot */
+	char* frozen;
+	/* the directory without symlinks, which is how zfs diff names the paths under it */
+	char* real;
+	/* what btrfs or zfs calls the snapshot: its path, or dataset@name */
+	char* id;
+	/* the last backup's snapshot of the same directory, or NULL if there is none */
+	const char* prev_id;
+};
+
+struct snapshot_set{
+	enum snapshot_type type;
+	struct snapshot* snaps;
+	size_t len;
+	/* "dir", "id" pairs read from the state file */
+	struct string_array* prev;
+	struct change_journal* cj;
+	int committed;
+};
+
+enum snapshot_type snapshot_type_from_string(const char* str){
+	return_ifnull(str, SNAPSHOT_INVALID);
+
+	if (!strcmp(str, "btrfs")){
+		return SNAPSHOT_BTRFS;
+	}
+	if (!strcmp(str, "zfs")){
+		return SNAPSHOT_ZFS;
+	}
+	if (!strcmp(str, "none") || !strcmp(str, "off")){
+		return SNAPSHOT_NONE;
+	}
+	return SNAPSHOT_INVALID;
+}
+
+const char* snapshot_type_tostring(enum snapshot_type type){
+	switch (type){
+	case SNAPSHOT_NONE:
+		return "none";
+	case SNAPSHOT_BTRFS:
+		return "btrfs";
+	case SNAPSHOT_ZFS:
+		return "zfs";
+	default:
+		return "invalid";
+	}
+}
+
+/* runs a program without a shell, so no path needs quoting
+ * its standard output is read into *out if out is not NULL
+ * returns 0 if it exited successfully, positive if it failed, or negative if it could not be run */
+static int run_command(char* const argv[], char** out){
+	char* buf = NULL;
+	size_t len = 0;
+	size_t size = 0;
+	int fds[2] = { -1, -1 };
+	int status;
+	pid_t pid;
+
+	if (out){
+		*out = NULL;
+		if (pipe(fds) != 0){
+			log_error_ex("Failed to create pipe (%s)", strerror(errno));
+			return -1;
+		}
+	}
+
+	pid = fork();
+	if (pid < 0){
+		log_error_ex("Failed to fork (%s)", strerror(errno));
+		fds[0] >= 0 ? close(fds[0]) : 0;
+		fds[1] >= 0 ? close(fds[1]) : 0;
+		return -1;
+	}
+	if (pid == 0){
+		if (out){
+			close(fds[0]);
+			dup2(fds[1], STDOUT_FILENO);
+			close(fds[1]);
+		}
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+
+	if (out){
+		ssize_t n;
+
+		close(fds[1]);
+		for (;;){
+			if (len + 1 >= size){
+				size_t new_size = size ? size * 2 : 4096;
+				char* tmp = realloc(buf, new_size);
+
+				if (!tmp){
+					log_enomem();
+					break;
+				}
+				buf = tmp;
+				size = new_size;
+			}
+			n = read(fds[0], buf + len, size - len - 1);
+			if (n < 0 && errno == EINTR){
+				continue;
+			}
+			if (n <= 0){
+				break;
+			}
+			len += n;
+		}
+		close(fds[0]);
+	}
+	while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0){
+		log_debug_ex2("%s exited with status %d", argv[0], WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+		free(buf);
+		return WIFEXITED(status) && WEXITSTATUS(status) == 127 ? -1 : 1;
+	}
+	if (out){
+		if (!buf){
+			return -1;
+		}
+		buf[len] = '\0';
+		*out = buf;
+	}
+	return 0;
+}
+
+/* the part of path after prefix, or NULL if path is not prefix or under it */
+static const char* after_prefix(const char* path, const char* prefix){
+	size_t len = strlen(prefix);
+
+	while (len > 1 && prefix[len - 1] == '/'){
+		len--;
+	}
+	if (strncmp(path, prefix, len) != 0 || (path[len] != '\0' && path[len] != '/' && prefix[len - 1] != '/')){
+		return NULL;
+	}
+	path += len;
+	while (*path == '/'){
+		path++;
+	}
+	return path;
+}
+
+/* the directory it was under followed by rest, which can be empty */
+static char* join(const char* dir, const char* rest){
+	return *rest ? sh_concat_path(sh_dup(dir), rest) : sh_dup(dir);
+}
+
+static int destroy_snapshot(enum snapshot_type type, const char* id){
+	char* argv_btrfs[] = { "btrfs", "subvolume", "delete", NULL, NULL };
+	char* argv_zfs[] = { "zfs", "destroy", NULL, NULL };
+	char** argv;
+
+	/* never anything but a snapshot this made, since zfs destroy would take a whole dataset */
+	if (type == SNAPSHOT_BTRFS && strstr(id, "/" SNAPSHOT_BTRFS_DIR "/")){
+		argv = argv_btrfs;
+		argv[3] = (char*)id;
+	}
+	else if (type == SNAPSHOT_ZFS && strchr(id, '@')){
+		argv = argv_zfs;
+		argv[2] = (char*)id;
+	}
+	else{
+		log_warning_ex("Refusing to destroy %s, which is not a snapshot", id);
+		return -1;
+	}
+
+	if (run_command(argv, NULL) != 0){
+		log_warning_ex("Failed to destroy snapshot %s", id);
+		return -1;
+	}
+	return 0;
+}
+
+static int take_btrfs(struct snapshot* s, const char* name){
+	char* argv[] = { "btrfs", "subvolume", "snapshot", "-r", NULL, NULL, NULL };
+	char* snap_dir;
+
+	if (!(snap_dir = sh_concat_path(sh_dup(s->dir), SNAPSHOT_BTRFS_DIR))){
+		log_enomem();
+		return -1;
+	}
+	if (mkdir(snap_dir, 0700) != 0 && errno != EEXIST){
+		log_error_ex2("Failed to create %s (%s)", snap_dir, strerror(errno));
+		free(snap_dir);
+		return -1;
+	}
+	s->id = sh_concat_path(snap_dir, name);
+	if (!s->id || !(s->frozen = sh_dup(s->id))){
+		log_enomem();
+		return -1;
+	}
+
+	argv[4] = s->dir;
+	argv[5] = s->id;
+	if (run_command(argv, NULL) != 0){
+		log_error_ex("Failed to snapshot %s. It has to be the top of a btrfs subvolume.", s->dir);
+		/* only goes away if no earlier backup left a snapshot in it */
+		*strrchr(s->id, '/') = '\0';
+		rmdir(s->id);
+		free(s->id);
+		s->id = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static int take_zfs(struct snapshot* s, const char* name){
+	char* argv_list[] = { "zfs", "list", "-H", "-o", "name,mountpoint", NULL, NULL };
+	char* argv_snap[] = { "zfs", "snapshot", NULL, NULL };
+	char* out = NULL;
+	char* mountpoint;
+	const char* rest;
+	char* frozen_root = NULL;
+	int ret = 0;
+
+	argv_list[5] = s->dir;
+	if (run_command(argv_list, &out) != 0 || !(mountpoint = strchr(out, '\t'))){
+		log_error_ex("Failed to find the ZFS dataset %s is in", s->dir);
+		ret = -1;
+		goto cleanup;
+	}
+	*mountpoint++ = '\0';
+	mountpoint[strcspn(mountpoint, "\n")] = '\0';
+	if (mountpoint[0] != '/' || !(rest = after_prefix(s->real, mountpoint))){
+		log_error_ex2("The ZFS dataset %s is not mounted at %s", out, s->dir);
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (!(frozen_root = sh_sprintf("%s/.zfs/snapshot/%s", strcmp(mountpoint, "/") ? mountpoint : "", name)) ||
+			!(s->frozen = join(frozen_root, rest)) ||
+			!(s->id = sh_sprintf("%s@%s", out, name))){
+		log_enomem();
+		ret = -1;
+		goto cleanup;
+	}
+
+	argv_snap[2] = s->id;
+	if (run_command(argv_snap, NULL) != 0){
+		log_error_ex("Failed to snapshot %s", s->id);
+		free(s->id);
+		s->id = NULL;
+		ret = -1;
+		goto cleanup;
+	}
+
+cleanup:
+	free(out);
+	free(frozen_root);
+	return ret;
+}
+
+/* undoes the escaping btrfs receive --dump puts on a path, in place, stopping at the first unescaped space
+ * returns what follows the path */
+static char* unescape_btrfs(char* str){
+	static const char controls[] = "a\ab\be\033f\fn\nr\rt\tv\v";
+	char* in = str;
+	char* out = str;
+
+	while (*in && *in != ' ' && *in != '\n'){
+		const char* ctl;
+
+		if (*in != '\\' || !in[1]){
+			*out++ = *in++;
+			continue;
+		}
+		in++;
+		if (in[0] >= '0' && in[0] <= '7' && in[1] >= '0' && in[1] <= '7' && in[2] >= '0' && in[2] <= '7'){
+			*out++ = (char)((in[0] - '0') * 64 + (in[1] - '0') * 8 + (in[2] - '0'));
+			in += 3;
+		}
+		else if ((ctl = strchr(controls, *in)) != NULL && (ctl - controls) % 2 == 0){
+			*out++ = ctl[1];
+			in++;
+		}
+		else{
+			*out++ = *in++;
+		}
+	}
+	/* the terminator can land on the space, so what follows it is found first */
+	str = *in ? in + 1 : in;
+	*out = '\0';
+	return str;
+}
+
+/* undoes the \0ooo escaping zfs diff puts on a path, in place */
+static void unescape_zfs(char* str){
+	char* in = str;
+	char* out = str;
+
+	while (*in){
+		if (in[0] == '\\' && in[1] >= '0' && in[1] <= '7' && in[2] >= '0' && in[2] <= '7' && in[3] >= '0' && in[3] <= '7' && in[4] >= '0' && in[4] <= '7'){
+			*out++ = (char)((in[2] - '0') * 64 + (in[3] - '0') * 8 + (in[4] - '0'));
+			in += 5;
+		}
+		else{
+			*out++ = *in++;
+		}
+	}
+	*out = '\0';
+}
+
+/* adds a path btrfs receive --dump gave, which starts with ./SNAPSHOT_NAME */
+static int add_btrfs_path(const struct snapshot* s, const char* path, struct string_array* out){
+	char* live;
+	int ret;
+
+	if (strncmp(path, "./", 2) != 0){
+		return 0;
+	}
+	path += 2;
+	path += strcspn(path, "/");
+	while (*path == '/'){
+		path++;
+	}
+	if (!(live = join(s->dir, path))){
+		log_enomem();
+		return -1;
+	}
+	/* the snapshots inside the subvolume are never backed up */
+	ret = strstr(live, "/" SNAPSHOT_BTRFS_DIR) ? 0 : sa_add(out, live);
+	free(live);
+	return ret;
+}
+
+static int diff_btrfs(const struct snapshot* s, struct string_array* out){
+	char* argv_send[] = { "btrfs", "send", "--no-data", "-q", "-p", NULL, "-f", NULL, NULL, NULL };
+	char* argv_dump[] = { "btrfs", "receive", "--dump", "-f", NULL, NULL };
+	struct TMPFILE* tfp = NULL;
+	char* dump = NULL;
+	char* line;
+	char* next;
+	int ret = 0;
+
+	if (!(tfp = temp_fopen())){
+		log_etmpfopen();
+		return -1;
+	}
+	argv_send[5] = (char*)s->prev_id;
+	argv_send[7] = tfp->name;
+	argv_send[8] = s->id;
+	argv_dump[4] = tfp->name;
+	/* the stream only has metadata, so it is about as big as the list of changes */
+	if (run_command(argv_send, NULL) != 0 || run_command(argv_dump, &dump) != 0){
+		log_warning_ex2("Failed to compare %s with %s", s->id, s->prev_id);
+		ret = -1;
+		goto cleanup;
+	}
+
+	/* "command  ./snap/path key=value ...", where rename and link also name a second path with dest= */
+	for (line = dump; line && *line; line = next){
+		char* path;
+		char* end;
+		int has_dest;
+
+		next = strchr(line, '\n');
+		next ? *next++ = '\0' : 0;
+
+		path = line + strcspn(line, " ");
+		has_dest = !strncmp(line, "rename ", 7) || !strncmp(line, "link ", 5);
+		if (!strncmp(line, "snapshot ", 9) || !strncmp(line, "subvol ", 7) || !*path){
+			continue;
+		}
+		while (*path == ' '){
+			path++;
+		}
+		end = unescape_btrfs(path);
+		if (add_btrfs_path(s, path, out) != 0){
+			ret = -1;
+			goto cleanup;
+		}
+		if (has_dest && (end = strstr(end, "dest=")) != NULL){
+			path = end + 5;
+			unescape_btrfs(path);
+			if (add_btrfs_path(s, path, out) != 0){
+				ret = -1;
+				goto cleanup;
+			}
+		}
+	}
+
+cleanup:
+	free(dump);
+	temp_fclose(tfp);
+	return ret;
+}
+
+static int diff_zfs(const struct snapshot* s, struct string_array* out){
+	char* argv[] = { "zfs", "diff", "-H", NULL, NULL, NULL };
+	char* diff = NULL;
+	char* line;
+	char* next;
+	int ret = 0;
+
+	argv[3] = (char*)s->prev_id;
+	argv[4] = s->id;
+	if (run_command(argv, &diff) != 0){
+		log_warning_ex2("Failed to compare %s with %s", s->id, s->prev_id);
+		return -1;
+	}
+
+	/* "M\t/path", or "R\t/old\t/new" for a rename */
+	for (line = diff; line && *line; line = next){
+		char* field;
+
+		next = strchr(line, '\n');
+		next ? *next++ = '\0' : 0;
+
+		field = strchr(line, '\t');
+		while (field){
+			char* path = field + 1;
+			const char* rest;
+
+			if ((field = strchr(path, '\t')) != NULL){
+				*field = '\0';
+			}
+			unescape_zfs(path);
+			if ((rest = after_prefix(path, s->real)) != NULL){
+				char* live = join(s->dir, rest);
+
+				if (!live || sa_add(out, live) != 0){
+					free(live);
+					ret = -1;
+					goto cleanup;
+				}
+				free(live);
+			}
+		}
+	}
+
+cleanup:
+	free(diff);
+	return ret;
+}
+
+/* "dir\0id\0" for every directory the last backup took a snapshot of */
+static struct string_array* read_state(const char* state_file){
+	struct string_array* arr;
+	FILE* fp;
+	char* buf = NULL;
+	size_t len = 0;
+	size_t size = 0;
+	size_t i;
+
+	if (!(arr = sa_new())){
+		return NULL;
+	}
+	if (!(fp = fopen(state_file, "rb"))){
+		return arr;
+	}
+	for (;;){
+		size_t n;
+
+		if (len + 1 >= size){
+			char* tmp = realloc(buf, size ? size * 2 : 4096);
+
+			if (!tmp){
+				log_enomem();
+				free(buf);
+				fclose(fp);
+				sa_free(arr);
+				return NULL;
+			}
+			buf = tmp;
+			size = size ? size * 2 : 4096;
+		}
+		if ((n = fread(buf + len, 1, size - len - 1, fp)) == 0){
+			break;
+		}
+		len += n;
+	}
+	fclose(fp);
+	buf[len] = '\0';
+
+	for (i = 0; i < len; i += strlen(buf + i) + 1){
+		if (sa_add(arr, buf + i) != 0){
+			free(buf);
+			sa_free(arr);
+			return NULL;
+		}
+	}
+	/* a torn pair is not a snapshot */
+	if (arr->len % 2 != 0){
+		sa_remove(arr, arr->len - 1);
+	}
+	free(buf);
+	return arr;
+}
+
+struct snapshot_set* snapshot_take(enum snapshot_type type, const struct string_array* directories, const char* name, const char* state_file){
+	struct snapshot_set* ss;
+	size_t i;
+	size_t j;
+
+	return_ifnull(directories, NULL);
+	return_ifnull(name, NULL);
+	return_ifnull(state_file, NULL);
+	if (type != SNAPSHOT_BTRFS && type != SNAPSHOT_ZFS){
+		log_einval(type);
+		return NULL;
+	}
+
+	if (!(ss = calloc(1, sizeof(*ss))) || !(ss->snaps = calloc(directories->len + 1, sizeof(*ss->snaps)))){
+		log_enomem();
+		free(ss);
+		return NULL;
+	}
+	ss->type = type;
+	if (!(ss->prev = read_state(state_file))){
+		goto fail;
+	}
+
+	for (i = 0; i < directories->len; ++i){
+		struct snapshot* s = &ss->snaps[i];
+
+		ss->len++;
+		if (!(s->dir = sh_dup(directories->strings[i])) || !(s->real = realpath(s->dir, NULL))){
+			log_error_ex2("Failed to resolve %s (%s)", directories->strings[i], strerror(errno));
+			goto fail;
+		}
+		if ((type == SNAPSHOT_BTRFS ? take_btrfs(s, name) : take_zfs(s, name)) != 0){
+			goto fail;
+		}
+		for (j = 0; j + 1 < ss->prev->len; j += 2){
+			if (!strcmp(ss->prev->strings[j], s->dir)){
+				s->prev_id = ss->prev->strings[j + 1];
+			}
+		}
+		printf("Took snapshot %s\n", s->id);
+	}
+
+	if (!(ss->cj = calloc(1, sizeof(*ss->cj))) || !(ss->cj->paths = sa_new())){
+		log_enomem();
+		goto fail;
+	}
+	for (i = 0; i < ss->len; ++i){
+		struct snapshot* s = &ss->snaps[i];
+		size_t len_before = ss->cj->paths->len;
+		int res = -1;
+
+		if (s->prev_id){
+			res = type == SNAPSHOT_BTRFS ? diff_btrfs(s, ss->cj->paths) : diff_zfs(s, ss->cj->paths);
+		}
+		/* without something to compare to, everything under the directory may have changed */
+		if (res != 0){
+			while (ss->cj->paths->len > len_before){
+				sa_remove(ss->cj->paths, ss->cj->paths->len - 1);
+			}
+			if (sa_add(ss->cj->paths, s->dir) != 0){
+				goto fail;
+			}
+		}
+	}
+	sa_sort(ss->cj->paths);
+	for (i = 0, j = 0; i < ss->cj->paths->len; ++i){
+		if (j > 0 && strcmp(ss->cj->paths->strings[j - 1], ss->cj->paths->strings[i]) == 0){
+			free(ss->cj->paths->strings[i]);
+			continue;
+		}
+		ss->cj->paths->strings[j++] = ss->cj->paths->strings[i];
+	}
+	ss->cj->paths->len = j;
+	return ss;
+
+fail:
+	snapshot_free(ss);
+	return NULL;
+}
+
+const struct change_journal* snapshot_changes(const struct snapshot_set* ss){
+	return_ifnull(ss, NULL);
+	return ss->cj;
+}
+
+char* snapshot_path(const struct snapshot_set* ss, const char* path){
+	size_t i;
+
+	return_ifnull(ss, NULL);
+	return_ifnull(path, NULL);
+
+	for (i = 0; i < ss->len; ++i){
+		const char* rest = after_prefix(path, ss->snaps[i].dir);
+
+		if (rest){
+			return join(ss->snaps[i].frozen, rest);
+		}
+	}
+	return sh_dup(path);
+}
+
+char* snapshot_live_path(const struct snapshot_set* ss, const char* path){
+	size_t i;
+
+	return_ifnull(ss, NULL);
+	return_ifnull(path, NULL);
+
+	for (i = 0; i < ss->len; ++i){
+		const char* rest = after_prefix(path, ss->snaps[i].frozen);
+
+		if (rest){
+			return join(ss->snaps[i].dir, rest);
+		}
+	}
+	return sh_dup(path);
+}
+
+struct string_array* snapshot_exclude(const struct snapshot_set* ss, const struct string_array* exclude){
+	struct string_array* arr;
+	size_t i;
+	size_t j;
+
+	return_ifnull(ss, NULL);
+	if (!(arr = sa_new())){
+		return NULL;
+	}
+	for (i = 0; exclude && i < exclude->len; ++i){
+		if (sa_add(arr, exclude->strings[i]) != 0){
+			sa_free(arr);
+			return NULL;
+		}
+		for (j = 0; j < ss->len; ++j){
+			const char* rest = after_prefix(exclude->strings[i], ss->snaps[j].dir);
+			char* frozen;
+
+			if (!rest){
+				continue;
+			}
+			if (!(frozen = join(ss->snaps[j].frozen, rest)) || sa_add(arr, frozen) != 0){
+				free(frozen);
+				sa_free(arr);
+				return NULL;
+			}
+			free(frozen);
+		}
+	}
+	return arr;
+}
+
+int snapshot_commit(struct snapshot_set* ss, const char* state_file){
+	char* tmp_file;
+	FILE* fp;
+	size_t i;
+	int ret = 0;
+
+	return_ifnull(ss, -1);
+	return_ifnull(state_file, -1);
+
+	/* written next to the state file and renamed over it, so it never names only some of the snapshots */
+	if (!(tmp_file = sh_concat(sh_dup(state_file), ".tmp"))){
+		log_enomem();
+		return -1;
+	}
+	if (!(fp = fopen(tmp_file, "wb"))){
+		log_efopen(tmp_file);
+		free(tmp_file);
+		return -1;
+	}
+	for (i = 0; i < ss->len; ++i){
+		if (fprintf(fp, "%s%c%s%c", ss->snaps[i].dir, '\0', ss->snaps[i].id, '\0') < 0){
+			log_efwrite(tmp_file);
+			ret = -1;
+		}
+	}
+	if (fclose(fp) != 0){
+		log_efclose(tmp_file);
+		ret = -1;
+	}
+	if (ret == 0 && rename(tmp_file, state_file) != 0){
+		log_error_ex2("Failed to replace %s (%s)", state_file, strerror(errno));
+		ret = -1;
+	}
+	if (ret != 0){
+		remove(tmp_file);
+		free(tmp_file);
+		return -1;
+	}
+	free(tmp_file);
+	ss->committed = 1;
+
+	/* the next backup compares against these instead, including for directories that are no longer backed up */
+	for (i = 0; i + 1 < ss->prev->len; i += 2){
+		destroy_snapshot(ss->type, ss->prev->strings[i + 1]);
+	}
+	return 0;
+}
+
+void snapshot_free(struct snapshot_set* ss){
+	size_t i;
+
+	if (!ss){
+		return;
+	}
+	for (i = 0; i < ss->len; ++i){
+		if (ss->snaps[i].id && !ss->committed){
+			destroy_snapshot(ss->type, ss->snaps[i].id);
+		}
+		free(ss->snaps[i].dir);
+		free(ss->snaps[i].frozen);
+		free(ss->snaps[i].real);
+		free(ss->snaps[i].id);
+	}
+	free(ss->snaps);
+	ss->prev ? sa_free(ss->prev) : (void)0;
+	cj_free(ss->cj);
+	free(ss);
+}
@@ -0,0 +1,146 @@
+/** @file snapshot.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+#include "strings/stringarray.h"
+
+struct change_journal;
+
+#ifndef __GNUC__
+#define __attribute__(x)
+#endif
+
+/**
+ * @brief The filesystems a backup can take snapshots of.
+ */
+enum snapshot_type{
+	SNAPSHOT_NONE = 0,   /**< @brief Read the directories as they are. */
+	SNAPSHOT_BTRFS = 1,  /**< @brief Every directory is a btrfs subvolume. */
+	SNAPSHOT_ZFS = 2,    /**< @brief Every directory is in a mounted ZFS dataset. */
+	SNAPSHOT_INVALID = 3 /**< @brief Not a snapshot type. */
+};
+
+/**
+ * @brief btrfs snapshots of a subvolume are kept in this directory inside it, where they show up as empty directories in every later snapshot.
+ */
+#define SNAPSHOT_BTRFS_DIR ".ezbackup-snapshots"
+
+/**
+ * @brief The read-only snapshots a backup reads its directories from, and what changed in them since the last backup's snapshots.
+ */
+struct snapshot_set;
+
+/**
+ * @brief Returns the snapshot type for a string.
+ *
+ * @param str "btrfs", "zfs" or "none".
+ *
+ * @return The corresponding snapshot type, or SNAPSHOT_INVALID if there is none.
+ */
+enum snapshot_type snapshot_type_from_string(const char* str);
+
+/**
+ * @brief Returns the name of a snapshot type.
+ *
+ * @param type The snapshot type.
+ *
+ * @return Its name, e.g. "btrfs". This string is statically allocated and must not be freed.
+ */
+const char* snapshot_type_tostring(enum snapshot_type type);
+
+/**
+ * @brief Takes a read-only snapshot of every directory, and asks the filesystem what changed since the snapshots recorded in the state file.<br>
+ * <br>
+ * btrfs snapshots go in SNAPSHOT_BTRFS_DIR inside each subvolume, and are compared with `btrfs send --no-data -p` and `btrfs receive --dump`.<br>
+ * ZFS snapshots are taken of the dataset each directory is in, read through its .zfs/snapshot directory, and compared with `zfs diff`.<br>
+ * Both need the privileges to create and destroy snapshots.
+ *
+ * @param type The filesystem the directories are on.
+ *
+ * @param directories The directories being backed up.
+ *
+ * @param name The name the new snapshots get, which must be unique to this backup.
+ *
+ * @param state_file Where snapshot_commit() recorded the last backup's snapshots.
+ *
+ * @return The new snapshots, or NULL on failure, in which case none are left behind.<br>
+ * These must be freed with snapshot_free() when no longer in use.
+ */
+struct snapshot_set* snapshot_take(enum snapshot_type type, const struct string_array* directories, const char* name, const char* state_file) __attribute__((malloc));
+
+/**
+ * @brief Returns what changed between the last backup's snapshots and these.<br>
+ * A directory without a previous snapshot to compare to is listed itself, meaning everything under it may have changed.
+ *
+ * @param ss The snapshots returned by snapshot_take().
+ *
+ * @return The changes with their paths as they are outside the snapshots, which can be given to cj_changed(), or NULL if every directory has to be walked.
+ */
+const struct change_journal* snapshot_changes(const struct snapshot_set* ss);
+
+/**
+ * @brief Returns where a path is inside the snapshots.
+ *
+ * @param ss The snapshots returned by snapshot_take().
+ *
+ * @param path A path under one of the directories being backed up.
+ *
+ * @return The same path inside the snapshot of its directory, or a copy of it if it is not under one, or NULL on failure.<br>
+ * This string must be free()'d when no longer in use.
+ */
+char* snapshot_path(const struct snapshot_set* ss, const char* path);
+
+/**
+ * @brief The inverse of snapshot_path().
+ *
+ * @param ss The snapshots returned by snapshot_take().
+ *
+ * @param path A path inside one of the snapshots.
+ *
+ * @return The same path outside the snapshot, or a copy of it if it is not in one, or NULL on failure.<br>
+ * This string must be free()'d when no longer in use.
+ */
+char* snapshot_live_path(const struct snapshot_set* ss, const char* path);
+
+/**
+ * @brief Adds every excluded path under a directory again as it is inside the snapshot of that directory, so the snapshots can be walked with the same exclusions.
+ *
+ * @param ss The snapshots returned by snapshot_take().
+ *
+ * @param exclude The paths to exclude.
+ *
+ * @return The excluded paths both inside and outside of the snapshots, or NULL on failure.<br>
+ * This must be freed with sa_free() when no longer in use.
+ */
+struct string_array* snapshot_exclude(const struct snapshot_set* ss, const struct string_array* exclude) __attribute__((malloc));
+
+/**
+ * @brief Records these snapshots in the state file for the next backup to compare with, and destroys the ones recorded there before.<br>
+ * This should only be called once everything in the snapshots has been backed up.
+ *
+ * @param ss The snapshots returned by snapshot_take().
+ *
+ * @param state_file The state file given to snapshot_take().
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int snapshot_commit(struct snapshot_set* ss, const char* state_file);
+
+/**
+ * @brief Frees a snapshot set, destroying its snapshots unless snapshot_commit() recorded them.
+ *
+ * @param ss The snapshots to free.<br>
+ * This can be NULL, in which case this function does nothing.
+ *
+ * @return void
+ */
+void snapshot_free(struct snapshot_set* ss);
+
+#endif
@@ -0,0 +1,248 @@
+/** @file statbatch.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+/* fstatat() is POSIX.1-2008, and struct statx is a Linux extension */
+#undef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
+
+#include "statbatch.h"
+#include "log.h"
+#include "uring.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* IORING_OP_STATX first shipped in 5.6 */
+#if defined(HAVE_URING) && LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+#define SB_URING
+#include <sys/sysmacros.h>
+#endif
+
+struct stat_batch{
+	size_t depth;
+	size_t len;
+	/* what stat_batch_add() was given */
+	int* dirfds;
+	const char** paths;
+	/* 0 or an errno for each path */
+	int* errs;
+	struct stat* sts;
+
+#ifdef SB_URING
+	/* NULL if io_uring is not available */
+	struct uring* ring;
+	struct statx* stxs;
+#endif
+};
+
+#ifdef SB_URING
+static void statx_to_stat(const struct statx* stx, struct stat* st){
+	memset(st, 0, sizeof(*st));
+	st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	st->st_ino = stx->stx_ino;
+	st->st_mode = stx->stx_mode;
+	st->st_nlink = stx->stx_nlink;
+	st->st_uid = stx->stx_uid;
+	st->st_gid = stx->stx_gid;
+	st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+	st->st_size = stx->stx_size;
+	st->st_blksize = stx->stx_blksize;
+	st->st_blocks = stx->stx_blocks;
+	st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+	st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+/* every path is queued as soon as there is room for it, and the completions are collected as they arrive
+ * returns 0 on success, positive if the kernel does not support IORING_OP_STATX, or negative on failure */
+static int ring_run(struct stat_batch* sb){
+	size_t submitted = 0;
+	size_t completed = 0;
+
+	while (completed < sb->len){
+		const struct io_uring_cqe* cqe;
+		struct io_uring_sqe* sqe;
+
+		/* the completion ring is never allowed to overflow, so no more than it holds is in flight */
+		while (submitted < sb->len && submitted - completed < uring_cq_entries(sb->ring) && (sqe = uring_get_sqe(sb->ring)) != NULL){
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = sb->dirfds[submitted];
+			sqe->addr = (unsigned long)sb->paths[submitted];
+			sqe->len = STATX_BASIC_STATS;
+			sqe->off = (unsigned long)&sb->stxs[submitted];
+			sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+			sqe->user_data = submitted;
+			submitted++;
+		}
+
+		if (uring_enter(sb->ring, 1) != 0){
+			return -1;
+		}
+
+		while ((cqe = uring_peek(sb->ring)) != NULL){
+			size_t i = (size_t)cqe->user_data;
+
+			/* a kernel with io_uring but without statx says so for every request */
+			if (cqe->res == -EINVAL){
+				uring_seen(sb->ring);
+				return 1;
+			}
+			if (i < sb->len){
+				sb->errs[i] = cqe->res < 0 ? -cqe->res : 0;
+				if (cqe->res >= 0){
+					statx_to_stat(&sb->stxs[i], &sb->sts[i]);
+				}
+				else{
+					memset(&sb->sts[i], 0, sizeof(sb->sts[i]));
+				}
+			}
+			uring_seen(sb->ring);
+			completed++;
+		}
+	}
+	return 0;
+}
+#endif
+
+struct stat_batch* stat_batch_new(size_t depth){
+	struct stat_batch* sb;
+
+	if (depth == 0){
+		depth = STAT_BATCH_DEPTH;
+	}
+
+	sb = calloc(1, sizeof(*sb));
+	if (!sb){
+		log_enomem();
+		return NULL;
+	}
+	sb->depth = depth;
+#ifdef SB_URING
+	sb->stxs = malloc(depth * sizeof(*sb->stxs));
+#endif
+	sb->dirfds = malloc(depth * sizeof(*sb->dirfds));
+	sb->paths = malloc(depth * sizeof(*sb->paths));
+	sb->errs = malloc(depth * sizeof(*sb->errs));
+	sb->sts = malloc(depth * sizeof(*sb->sts));
+	if (!sb->dirfds || !sb->paths || !sb->errs || !sb->sts
+#ifdef SB_URING
+			|| !sb->stxs
+#endif
+			){
+		log_enomem();
+		stat_batch_free(sb);
+		return NULL;
+	}
+
+#ifdef SB_URING
+	if (!(sb->ring = uring_new((unsigned)depth))){
+		log_debug("Every lstat() gets its own system call.");
+	}
+#endif
+	return sb;
+}
+
+size_t stat_batch_depth(const struct stat_batch* sb){
+	return sb ? sb->depth : 0;
+}
+
+int stat_batch_uses_uring(const struct stat_batch* sb){
+#ifdef SB_URING
+	return sb && sb->ring;
+#else
+	(void)sb;
+	return 0;
+#endif
+}
+
+long stat_batch_add(struct stat_batch* sb, int dirfd, const char* path){
+	return_ifnull(sb, -1);
+	return_ifnull(path, -1);
+
+	if (sb->len >= sb->depth){
+		return -1;
+	}
+	sb->dirfds[sb->len] = dirfd == STAT_BATCH_CWD ? AT_FDCWD : dirfd;
+	sb->paths[sb->len] = path;
+	return (long)sb->len++;
+}
+
+size_t stat_batch_len(const struct stat_batch* sb){
+	return sb ? sb->len : 0;
+}
+
+int stat_batch_run(struct stat_batch* sb){
+	size_t i;
+
+	return_ifnull(sb, -1);
+
+#ifdef SB_URING
+	if (sb->ring){
+		int res = ring_run(sb);
+
+		if (res == 0){
+			return 0;
+		}
+		/* the ring is left in an unknown state either way, and the batch is redone without it */
+		log_debug("IORING_OP_STATX is not supported. Every lstat() gets its own system call.");
+		uring_free(sb->ring);
+		sb->ring = NULL;
+	}
+#endif
+
+	for (i = 0; i < sb->len; ++i){
+		if (fstatat(sb->dirfds[i], sb->paths[i], &sb->sts[i], AT_SYMLINK_NOFOLLOW) != 0){
+			sb->errs[i] = errno;
+			memset(&sb->sts[i], 0, sizeof(sb->sts[i]));
+		}
+		else{
+			sb->errs[i] = 0;
+		}
+	}
+	return 0;
+}
+
+int stat_batch_result(const struct stat_batch* sb, size_t index, struct stat* st){
+	return_ifnull(sb, EINVAL);
+
+	if (index >= sb->len){
+		return EINVAL;
+	}
+	if (st){
+		*st = sb->sts[index];
+	}
+	return sb->errs[index];
+}
+
+void stat_batch_reset(struct stat_batch* sb){
+	if (sb){
+		sb->len = 0;
+	}
+}
+
+void stat_batch_free(struct stat_batch* sb){
+	if (!sb){
+		return;
+	}
+#ifdef SB_URING
+	uring_free(sb->ring);
+	free(sb->stxs);
+#endif
+	free(sb->dirfds);
+	free(sb->paths);
+	free(sb->errs);
+	free(sb->sts);
+	free(sb);
+}
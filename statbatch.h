@@ -0,0 +1,134 @@
+/** @file statbatch.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __STATBATCH_H
+#define __STATBATCH_H
+
+#include <stddef.h>
+
+#ifndef __GNUC__
+#define __attribute__(x)
+#endif
+
+struct stat;
+
+/**
+ * @brief How many lstat()s a stat batch holds by default, which is also how many are kept in flight at once with io_uring.
+ */
+#define STAT_BATCH_DEPTH (256)
+
+/**
+ * @brief Given to stat_batch_add() as the directory, a relative path is relative to the working directory.<br>
+ * This is AT_FDCWD for callers that do not have it.
+ */
+#define STAT_BATCH_CWD (-100)
+
+/**
+ * @brief lstat()s many paths with as few system calls as possible.<br>
+ * With io_uring, every path in the batch is submitted as an IORING_OP_STATX at once, so a filesystem with high latency works on all of them concurrently.<br>
+ * Without it (a kernel before 5.6, or a sandbox that blocks it), each path gets its own fstatat().<br>
+ * A stat batch is not safe to share between threads.
+ */
+struct stat_batch;
+
+/**
+ * @brief Creates a new stat batch.
+ *
+ * @param depth The most paths the batch can hold. 0 uses STAT_BATCH_DEPTH.
+ *
+ * @return A new stat batch, or NULL on failure.<br>
+ * This must be freed with stat_batch_free() when no longer in use.
+ */
+struct stat_batch* stat_batch_new(size_t depth) __attribute__((malloc));
+
+/**
+ * @brief Returns the most paths a stat batch can hold.
+ *
+ * @param sb The stat batch.
+ *
+ * @return Its depth.
+ */
+size_t stat_batch_depth(const struct stat_batch* sb);
+
+/**
+ * @brief Returns whether a stat batch goes through io_uring.<br>
+ * This can change from true to false if the kernel turns out not to support IORING_OP_STATX.
+ *
+ * @param sb The stat batch.
+ *
+ * @return Non-zero if it does, or 0 if every path gets its own system call.
+ */
+int stat_batch_uses_uring(const struct stat_batch* sb);
+
+/**
+ * @brief Adds a path to be lstat()'ed by the next stat_batch_run().
+ *
+ * @param sb The stat batch.
+ *
+ * @param dirfd The directory a relative path is relative to, or STAT_BATCH_CWD.
+ *
+ * @param path The path to lstat().<br>
+ * This string is not copied, so it must stay valid until stat_batch_run() returns.
+ *
+ * @return The index of the path's result, or negative if the batch is full.
+ */
+long stat_batch_add(struct stat_batch* sb, int dirfd, const char* path);
+
+/**
+ * @brief Returns how many paths are in the batch.
+ *
+ * @param sb The stat batch.
+ *
+ * @return The number of paths added since the last stat_batch_reset().
+ */
+size_t stat_batch_len(const struct stat_batch* sb);
+
+/**
+ * @brief lstat()s every path in the batch, and waits for all of them to finish.
+ *
+ * @param sb The stat batch.
+ *
+ * @return 0 on success, or negative if the results could not be collected.<br>
+ * A path that could not be lstat()'ed is not a failure; its own result says so.
+ */
+int stat_batch_run(struct stat_batch* sb);
+
+/**
+ * @brief Returns the result of one path after stat_batch_run().
+ *
+ * @param sb The stat batch.
+ *
+ * @param index The index stat_batch_add() returned.
+ *
+ * @param st Where to put the path's metadata.<br>
+ * This is zeroed if the lstat() failed.
+ *
+ * @return 0 on success, or the errno the lstat() failed with.
+ */
+int stat_batch_result(const struct stat_batch* sb, size_t index, struct stat* st);
+
+/**
+ * @brief Empties the batch so new paths can be added.
+ *
+ * @param sb The stat batch.
+ *
+ * @return void
+ */
+void stat_batch_reset(struct stat_batch* sb);
+
+/**
+ * @brief Frees a stat batch.
+ *
+ * @param sb The stat batch to free.<br>
+ * This can be NULL, in which case this function does nothing.
+ *
+ * @return void
+ */
+void stat_batch_free(struct stat_batch* sb);
+
+#endif
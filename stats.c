@@ -0,0 +1,384 @@
+/** @file stats.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "stats.h"
+#include "log.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#define MIB (1024.0 * 1024.0)
+
+static const char* const stage_names[STAGE_COUNT] = {
+	"scan",
+	"read",
+	"hash",
+	"compress",
+	"encrypt",
+	"write",
+	"upload",
+	"sort",
+	"cloud_remove"
+};
+
+static const char* const counter_names[COUNTER_COUNT] = {
+	"changed",
+	"skipped",
+	"failed",
+	"moved",
+	"retries"
+};
+
+static struct stats_entry entries[STAGE_COUNT];
+static unsigned long counters[COUNTER_COUNT];
+static struct stats_time run_start;
+static double run_start_cpu;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static double timespec_seconds(const struct timespec* ts){
+	return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+static double process_cpu_seconds(void){
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0){
+		return 0;
+	}
+	return timespec_seconds(&ts);
+}
+
+void stats_time_now(struct stats_time* out){
+	struct timespec ts;
+
+	out->wall = clock_gettime(CLOCK_MONOTONIC, &ts) == 0 ? timespec_seconds(&ts) : 0;
+	out->cpu = clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0 ? timespec_seconds(&ts) : 0;
+}
+
+void stats_time_lap(struct stats_time* total, struct stats_time* mark){
+	struct stats_time now;
+
+	stats_time_now(&now);
+	total->wall += now.wall - mark->wall;
+	total->cpu += now.cpu - mark->cpu;
+	*mark = now;
+}
+
+double stats_per_second(double amount, double seconds){
+	/* a clock too coarse to see the difference gets the benefit of the doubt */
+	return seconds > 0 ? amount / seconds : amount * 1e6;
+}
+
+void stats_add(enum stats_stage stage, const struct stats_time* time, uint64_t bytes_in, uint64_t bytes_out, unsigned long files){
+	if ((unsigned)stage >= STAGE_COUNT){
+		log_debug("Invalid stats stage");
+		return;
+	}
+
+	pthread_mutex_lock(&stats_mutex);
+	if (time){
+		entries[stage].time.wall += time->wall;
+		entries[stage].time.cpu += time->cpu;
+	}
+	entries[stage].bytes_in += bytes_in;
+	entries[stage].bytes_out += bytes_out;
+	entries[stage].files += files;
+	pthread_mutex_unlock(&stats_mutex);
+}
+
+void stats_record(enum stats_stage stage, const struct stats_time* start, uint64_t bytes_in, uint64_t bytes_out, unsigned long files){
+	struct stats_time elapsed;
+	struct stats_time mark = *start;
+
+	memset(&elapsed, 0, sizeof(elapsed));
+	stats_time_lap(&elapsed, &mark);
+	stats_add(stage, &elapsed, bytes_in, bytes_out, files);
+}
+
+void stats_count(enum stats_counter counter, unsigned long n){
+	if ((unsigned)counter >= COUNTER_COUNT){
+		log_debug("Invalid stats counter");
+		return;
+	}
+
+	pthread_mutex_lock(&stats_mutex);
+	counters[counter] += n;
+	pthread_mutex_unlock(&stats_mutex);
+}
+
+unsigned long stats_get_count(enum stats_counter counter){
+	unsigned long ret;
+
+	if ((unsigned)counter >= COUNTER_COUNT){
+		return 0;
+	}
+
+	pthread_mutex_lock(&stats_mutex);
+	ret = counters[counter];
+	pthread_mutex_unlock(&stats_mutex);
+	return ret;
+}
+
+void stats_reset(void){
+	pthread_mutex_lock(&stats_mutex);
+	memset(entries, 0, sizeof(entries));
+	memset(counters, 0, sizeof(counters));
+	stats_time_now(&run_start);
+	run_start_cpu = process_cpu_seconds();
+	pthread_mutex_unlock(&stats_mutex);
+}
+
+void stats_get(enum stats_stage stage, struct stats_entry* out){
+	if ((unsigned)stage >= STAGE_COUNT){
+		memset(out, 0, sizeof(*out));
+		return;
+	}
+
+	pthread_mutex_lock(&stats_mutex);
+	*out = entries[stage];
+	pthread_mutex_unlock(&stats_mutex);
+}
+
+const char* stats_stage_tostring(enum stats_stage stage){
+	if ((unsigned)stage >= STAGE_COUNT){
+		return NULL;
+	}
+	return stage_names[stage];
+}
+
+/* wall-clock and process CPU time since stats_reset() */
+static void run_time(struct stats_time* out){
+	struct stats_time now;
+
+	stats_time_now(&now);
+	pthread_mutex_lock(&stats_mutex);
+	out->wall = now.wall - run_start.wall;
+	out->cpu = process_cpu_seconds() - run_start_cpu;
+	pthread_mutex_unlock(&stats_mutex);
+}
+
+uint64_t stats_peak_memory(void){
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) != 0){
+		return 0;
+	}
+	/* linux gives this in KiB */
+	return (uint64_t)ru.ru_maxrss << 10;
+}
+
+void stats_print(FILE* fp){
+	struct stats_time run;
+	int i;
+
+	run_time(&run);
+
+	fprintf(fp, "%-14s%10s%10s%12s%12s%10s%10s\n", "Stage", "Wall(s)", "CPU(s)", "In(MiB)", "Out(MiB)", "Files", "MiB/s");
+	for (i = 0; i < STAGE_COUNT; ++i){
+		struct stats_entry e;
+
+		stats_get(i, &e);
+		if (e.files == 0 && e.bytes_in == 0 && e.time.wall <= 0){
+			continue;
+		}
+		fprintf(fp, "%-14s%10.2f%10.2f%12.1f%12.1f%10lu", stage_names[i], e.time.wall, e.time.cpu, e.bytes_in / MIB, e.bytes_out / MIB, e.files);
+		/* the wall time is summed over every thread, so this is the rate of a single thread */
+		if (e.bytes_in > 0 && e.time.wall > 0){
+			fprintf(fp, "%10.1f\n", e.bytes_in / MIB / e.time.wall);
+		}
+		else{
+			fprintf(fp, "%10s\n", "-");
+		}
+	}
+	fprintf(fp, "%-14s%10.2f%10.2f\n", "Total", run.wall, run.cpu);
+	fprintf(fp, "Peak memory: %.1f MiB\n", stats_peak_memory() / MIB);
+}
+
+int stats_write(const char* file){
+	FILE* fp;
+	struct stats_time run;
+	int i;
+
+	return_ifnull(file, -1);
+
+	fp = fopen(file, "w");
+	if (!fp){
+		log_efopen(file);
+		return -1;
+	}
+
+	run_time(&run);
+
+	fprintf(fp, "stage\twall_seconds\tcpu_seconds\tbytes_in\tbytes_out\tfiles\n");
+	for (i = 0; i < STAGE_COUNT; ++i){
+		struct stats_entry e;
+
+		stats_get(i, &e);
+		/* a double holds any realistic byte count exactly, and C89 has no way to print a uint64_t */
+		fprintf(fp, "%s\t%.6f\t%.6f\t%.0f\t%.0f\t%lu\n", stage_names[i], e.time.wall, e.time.cpu, (double)e.bytes_in, (double)e.bytes_out, e.files);
+	}
+	fprintf(fp, "total\t%.6f\t%.6f\t0\t0\t0\n", run.wall, run.cpu);
+
+	if (ferror(fp)){
+		log_efwrite(file);
+		fclose(fp);
+		return -1;
+	}
+	if (fclose(fp) != 0){
+		log_efclose(file);
+		return -1;
+	}
+	return 0;
+}
+
+int stats_read(const char* file, enum stats_stage stage, struct stats_entry* out){
+	FILE* fp;
+	char line[256];
+	size_t name_len = strlen(stage_names[stage]);
+	int ret = 1;
+
+	return_ifnull(file, -1);
+	return_ifnull(out, -1);
+
+	memset(out, 0, sizeof(*out));
+	if (!(fp = fopen(file, "r"))){
+		if (errno == ENOENT){
+			return 1;
+		}
+		log_efopen(file);
+		return -1;
+	}
+	while (ret > 0 && fgets(line, sizeof(line), fp)){
+		double bytes_in;
+		double bytes_out;
+
+		if (strncmp(line, stage_names[stage], name_len) != 0 || line[name_len] != '\t'){
+			continue;
+		}
+		if (sscanf(line + name_len, "%lf %lf %lf %lf %lu", &out->time.wall, &out->time.cpu, &bytes_in, &bytes_out, &out->files) != 5){
+			log_warning_ex("%s is not a statistics file", file);
+			ret = -1;
+			break;
+		}
+		out->bytes_in = (uint64_t)bytes_in;
+		out->bytes_out = (uint64_t)bytes_out;
+		ret = 0;
+	}
+	fclose(fp);
+	return ret;
+}
+
+/* one line per stage for a metric that is labeled by stage */
+static void prometheus_stages(FILE* fp, const char* name, const char* help, int field){
+	int i;
+
+	fprintf(fp, "# HELP ezbackup_%s %s\n# TYPE ezbackup_%s gauge\n", name, help, name);
+	for (i = 0; i < STAGE_COUNT; ++i){
+		struct stats_entry e;
+		double val;
+
+		stats_get(i, &e);
+		switch (field){
+		case 0:
+			val = e.time.wall;
+			break;
+		case 1:
+			val = e.time.cpu;
+			break;
+		case 2:
+			val = (double)e.bytes_in;
+			break;
+		case 3:
+			val = (double)e.bytes_out;
+			break;
+		default:
+			val = (double)e.files;
+			break;
+		}
+		fprintf(fp, "ezbackup_%s{stage=\"%s\"} %.6g\n", name, stage_names[i], val);
+	}
+}
+
+int stats_write_prometheus(const char* file, int success){
+	FILE* fp;
+	char* tmp;
+	struct stats_time run;
+	struct stats_entry scan;
+	int i;
+
+	return_ifnull(file, -1);
+
+	/* the collector only reads files ending in .prom, so this is never picked up half-written */
+	tmp = malloc(strlen(file) + sizeof(".tmp"));
+	if (!tmp){
+		log_enomem();
+		return -1;
+	}
+	sprintf(tmp, "%s.tmp", file);
+
+	fp = fopen(tmp, "w");
+	if (!fp){
+		log_efopen(tmp);
+		free(tmp);
+		return -1;
+	}
+
+	run_time(&run);
+	stats_get(STAGE_SCAN, &scan);
+
+	fprintf(fp, "# HELP ezbackup_last_run_timestamp_seconds When the last backup finished.\n# TYPE ezbackup_last_run_timestamp_seconds gauge\n");
+	fprintf(fp, "ezbackup_last_run_timestamp_seconds %lu\n", (unsigned long)time(NULL));
+	fprintf(fp, "# HELP ezbackup_last_run_success 1 if the last backup succeeded, 0 if it failed.\n# TYPE ezbackup_last_run_success gauge\n");
+	fprintf(fp, "ezbackup_last_run_success %d\n", success ? 1 : 0);
+	fprintf(fp, "# HELP ezbackup_run_seconds Wall-clock seconds the last backup took.\n# TYPE ezbackup_run_seconds gauge\n");
+	fprintf(fp, "ezbackup_run_seconds %.6f\n", run.wall);
+	fprintf(fp, "# HELP ezbackup_run_cpu_seconds CPU seconds the last backup used.\n# TYPE ezbackup_run_cpu_seconds gauge\n");
+	fprintf(fp, "ezbackup_run_cpu_seconds %.6f\n", run.cpu);
+	fprintf(fp, "# HELP ezbackup_peak_memory_bytes The most memory the last backup had resident at once.\n# TYPE ezbackup_peak_memory_bytes gauge\n");
+	fprintf(fp, "ezbackup_peak_memory_bytes %.0f\n", (double)stats_peak_memory());
+
+	fprintf(fp, "# HELP ezbackup_files Files the last backup found, and what became of them.\n# TYPE ezbackup_files gauge\n");
+	fprintf(fp, "ezbackup_files{result=\"scanned\"} %lu\n", scan.files);
+	for (i = 0; i < COUNTER_CLOUD_RETRIES; ++i){
+		fprintf(fp, "ezbackup_files{result=\"%s\"} %lu\n", counter_names[i], stats_get_count(i));
+	}
+	fprintf(fp, "# HELP ezbackup_cloud_retries Cloud transfers the last backup had to try again.\n# TYPE ezbackup_cloud_retries gauge\n");
+	fprintf(fp, "ezbackup_cloud_retries %lu\n", stats_get_count(COUNTER_CLOUD_RETRIES));
+
+	/* the bytes read, compressed, and uploaded are the read, compress, and upload stages' bytes */
+	prometheus_stages(fp, "stage_seconds", "Wall-clock seconds spent in each stage, summed over every thread.", 0);
+	prometheus_stages(fp, "stage_cpu_seconds", "CPU seconds spent in each stage.", 1);
+	prometheus_stages(fp, "stage_bytes_in", "Bytes that went into each stage.", 2);
+	prometheus_stages(fp, "stage_bytes_out", "Bytes that came out of each stage.", 3);
+	prometheus_stages(fp, "stage_files", "Files that went through each stage.", 4);
+
+	if (ferror(fp)){
+		log_efwrite(tmp);
+		fclose(fp);
+		remove(tmp);
+		free(tmp);
+		return -1;
+	}
+	if (fclose(fp) != 0){
+		log_efclose(tmp);
+		remove(tmp);
+		free(tmp);
+		return -1;
+	}
+	if (rename(tmp, file) != 0){
+		log_error_ex2("Failed to move %s into place (%s)", tmp, strerror(errno));
+		remove(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	return 0;
+}
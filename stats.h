@@ -0,0 +1,237 @@
+/** @file stats.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * @brief A stage of a backup that is timed separately.
+ */
+enum stats_stage{
+	STAGE_SCAN = 0,         /**< @brief Walking the directories to back up. */
+	STAGE_READ = 1,         /**< @brief Reading source files from disk. */
+	STAGE_HASH = 2,         /**< @brief Computing file checksums. */
+	STAGE_COMPRESS = 3,     /**< @brief Compressing file data. */
+	STAGE_ENCRYPT = 4,      /**< @brief Encrypting compressed data. */
+	STAGE_WRITE = 5,        /**< @brief Writing output files to disk. */
+	STAGE_UPLOAD = 6,       /**< @brief Uploading output files to the cloud. */
+	STAGE_SORT = 7,         /**< @brief Sorting checksum files. */
+	STAGE_CLOUD_REMOVE = 8, /**< @brief Moving deleted files out of the cloud backup. */
+	STAGE_COUNT = 9         /**< @brief The number of stages. This is not a stage. */
+};
+
+/**
+ * @brief Something counted over a whole backup that does not belong to one stage.
+ */
+enum stats_counter{
+	COUNTER_FILES_CHANGED = 0, /**< @brief Files that were new or changed, and so were copied. */
+	COUNTER_FILES_SKIPPED = 1, /**< @brief Files that were unchanged, and so were not copied. */
+	COUNTER_FILES_FAILED = 2,  /**< @brief Files that could not be checksummed or copied. */
+	COUNTER_FILES_MOVED = 3,   /**< @brief New files whose contents were already backed up under another path, and so were linked to that output instead of copied. */
+	COUNTER_CLOUD_RETRIES = 4, /**< @brief Cloud transfers that failed and were tried again. */
+	COUNTER_COUNT = 5          /**< @brief The number of counters. This is not a counter. */
+};
+
+/**
+ * @brief A point in time, or an amount of time.
+ */
+struct stats_time{
+	double wall; /**< @brief Wall-clock seconds. */
+	double cpu;  /**< @brief CPU seconds used by the calling thread. */
+};
+
+/**
+ * @brief Everything recorded for a single stage.
+ */
+struct stats_entry{
+	struct stats_time time; /**< @brief Time spent in the stage, summed over every thread. */
+	uint64_t bytes_in;      /**< @brief Bytes that went into the stage. */
+	uint64_t bytes_out;     /**< @brief Bytes that came out of the stage. */
+	unsigned long files;    /**< @brief Files that went through the stage. */
+};
+
+/**
+ * @brief Gets the current time.
+ *
+ * @param out Set to the current wall-clock time, and the CPU time used so far by the calling thread.
+ *
+ * @return void
+ */
+void stats_time_now(struct stats_time* out);
+
+/**
+ * @brief Adds the time that passed since a mark to a running total, and moves the mark to the current time.<br>
+ * This makes it cheap to time a series of steps back to back.
+ *
+ * @param total The running total to add to.
+ *
+ * @param mark A time returned by stats_time_now() on the same thread.<br>
+ * This is set to the current time.
+ *
+ * @return void
+ */
+void stats_time_lap(struct stats_time* total, struct stats_time* mark);
+
+/**
+ * @brief Turns an amount of work and the time it took into a rate.
+ *
+ * @param amount The amount of work, such as bytes.
+ *
+ * @param seconds How long it took.<br>
+ * A time too short for the clock to measure is treated as a microsecond.
+ *
+ * @return The amount per second.
+ */
+double stats_per_second(double amount, double seconds);
+
+/**
+ * @brief Adds to the totals of a stage.<br>
+ * This function is thread-safe.
+ *
+ * @param stage The stage to add to.
+ *
+ * @param time The time spent in the stage.<br>
+ * This can be NULL if no time should be added.
+ *
+ * @param bytes_in The number of bytes that went into the stage.
+ *
+ * @param bytes_out The number of bytes that came out of the stage.
+ *
+ * @param files The number of files that went through the stage.
+ *
+ * @return void
+ */
+void stats_add(enum stats_stage stage, const struct stats_time* time, uint64_t bytes_in, uint64_t bytes_out, unsigned long files);
+
+/**
+ * @brief Adds the time since start to the totals of a stage.
+ * @see stats_add()
+ *
+ * @param stage The stage to add to.
+ *
+ * @param start A time returned by stats_time_now() on the same thread.
+ *
+ * @param bytes_in The number of bytes that went into the stage.
+ *
+ * @param bytes_out The number of bytes that came out of the stage.
+ *
+ * @param files The number of files that went through the stage.
+ *
+ * @return void
+ */
+void stats_record(enum stats_stage stage, const struct stats_time* start, uint64_t bytes_in, uint64_t bytes_out, unsigned long files);
+
+/**
+ * @brief Adds to a counter.<br>
+ * This function is thread-safe.
+ *
+ * @param counter The counter to add to.
+ *
+ * @param n The amount to add.
+ *
+ * @return void
+ */
+void stats_count(enum stats_counter counter, unsigned long n);
+
+/**
+ * @brief Gets the value of a counter.
+ *
+ * @param counter The counter.
+ *
+ * @return The counter's value, or 0 if the counter is invalid.
+ */
+unsigned long stats_get_count(enum stats_counter counter);
+
+/**
+ * @brief Clears the totals of every stage and every counter, and starts timing a new run.
+ *
+ * @return void
+ */
+void stats_reset(void);
+
+/**
+ * @brief Gets the totals of a stage.
+ *
+ * @param stage The stage.
+ *
+ * @param out Set to the totals of the stage.
+ *
+ * @return void
+ */
+void stats_get(enum stats_stage stage, struct stats_entry* out);
+
+/**
+ * @brief Converts an enum stats_stage to its string equivalent.
+ *
+ * @param stage The stage.
+ *
+ * @return The stage's name, or NULL if the stage is invalid.
+ */
+const char* stats_stage_tostring(enum stats_stage stage);
+
+/**
+ * @brief Gets the most memory the process has had resident at once.<br>
+ * This is never reset, so it covers everything the process did before the current run too.
+ *
+ * @return The peak resident set size in bytes, or 0 if it could not be determined.
+ */
+uint64_t stats_peak_memory(void);
+
+/**
+ * @brief Prints a table of every stage's time, throughput, and file count, followed by the peak memory.
+ *
+ * @param fp The stream to print to.
+ *
+ * @return void
+ */
+void stats_print(FILE* fp);
+
+/**
+ * @brief Writes every stage's totals to a tab-separated file.<br>
+ * The first line holds the column names, which are the following:<br>
+ * stage, wall_seconds, cpu_seconds, bytes_in, bytes_out, files<br>
+ * Each stage then gets one line, followed by a "total" line with the wall-clock and process CPU time of the whole run.
+ *
+ * @param file Path to the file to write.<br>
+ * If this file already exists, it will be overwritten.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int stats_write(const char* file);
+
+/**
+ * @brief Reads one stage's totals back from a file written by stats_write(), such as the last backup's.
+ *
+ * @param file The file.
+ *
+ * @param stage The stage.
+ *
+ * @param out Set to the stage's totals.
+ *
+ * @return 0 on success, positive if the file or its line for the stage does not exist, or negative if it could not be read.
+ */
+int stats_read(const char* file, enum stats_stage stage, struct stats_entry* out);
+
+/**
+ * @brief Writes every stage's totals and every counter in the Prometheus text format, for the node_exporter textfile collector.<br>
+ * The file is written under a temporary name and renamed into place, so the collector never reads half of it.<br>
+ * Every metric starts with "ezbackup_". The stages are told apart by a "stage" label, and the file counts by a "result" label.
+ *
+ * @param file Path to the file to write, which should end in ".prom".<br>
+ * If this file already exists, it will be replaced.
+ *
+ * @param success Non-zero if the run succeeded, which is written as ezbackup_last_run_success.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int stats_write_prometheus(const char* file, int success);
+
+#endif
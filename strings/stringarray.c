@@ -15,28 +15,139 @@
 #include <sys/stat.h>
 #include <errno.h>
 
-int sa_add(struct string_array* array, const char* str){
+/* an open-addressed hash set of positions in the array, where 0 is an empty slot and anything else is the position plus one */
+struct sa_index{
+	size_t* slots;
+	/* always a power of two, and at least twice the array's length */
+	size_t size;
+	/* the array's length when the index was last brought up to date, which catches the most common direct changes */
+	size_t len;
+	/* set by anything that moves strings around, so the next lookup rebuilds the index */
+	int stale;
+};
+
+/* FNV-1a */
+static size_t sa_hash(const char* str){
+	size_t hash = 2166136261UL;
+
+	for (; *str; ++str){
+		hash ^= (unsigned char)*str;
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+static void index_put(struct sa_index* idx, const struct string_array* array, size_t pos){
+	size_t i;
+
+	if (!array->strings[pos]){
+		return;
+	}
+	for (i = sa_hash(array->strings[pos]) & (idx->size - 1); idx->slots[i] != 0; i = (i + 1) & (idx->size - 1));
+	idx->slots[i] = pos + 1;
+}
+
+/* rebuilds the index from scratch, big enough for at least min_len strings */
+static int index_rebuild(struct string_array* array, size_t min_len){
+	struct sa_index* idx = array->index;
+	size_t size = 16;
+	size_t i;
+
+	while (size < min_len * 2 || size < array->len * 2){
+		size *= 2;
+	}
+	if (size != idx->size){
+		void* tmp = realloc(idx->slots, size * sizeof(*idx->slots));
+		if (!tmp){
+			log_enomem();
+			idx->stale = 1;
+			return -1;
+		}
+		idx->slots = tmp;
+		idx->size = size;
+	}
+	memset(idx->slots, 0, idx->size * sizeof(*idx->slots));
+	for (i = 0; i < array->len; ++i){
+		index_put(idx, array, i);
+	}
+	idx->len = array->len;
+	idx->stale = 0;
+	return 0;
+}
+
+/* keeps the index up to date after strings were appended at old_len and onwards */
+static void index_appended(struct string_array* array, size_t old_len){
+	struct sa_index* idx = array->index;
+
+	if (!idx){
+		return;
+	}
+	if (idx->stale || idx->len != old_len){
+		idx->stale = 1;
+		return;
+	}
+	if (array->len * 2 > idx->size){
+		index_rebuild(array, array->len);
+		return;
+	}
+	for (; old_len < array->len; ++old_len){
+		index_put(idx, array, old_len);
+	}
+	idx->len = array->len;
+}
+
+static void index_invalidate(struct string_array* array){
+	if (array->index){
+		array->index->stale = 1;
+	}
+}
+
+static void index_free(struct string_array* array){
+	if (array->index){
+		free(array->index->slots);
+		free(array->index);
+		array->index = NULL;
+	}
+}
+
+/* makes room for at least len strings, growing by half again each time so adding n strings takes O(n) time in total */
+static int sa_reserve(struct string_array* array, size_t len){
+	size_t size;
 	void* tmp;
-	return_ifnull(array, -1);
 
-	array->len++;
-	tmp = realloc(array->strings, array->len * sizeof(*array->strings));
+	if (len <= array->size){
+		return 0;
+	}
+	size = array->size + array->size / 2;
+	size = size < 8 ? 8 : size;
+	size = size < len ? len : size;
+	tmp = realloc(array->strings, size * sizeof(*array->strings));
 	if (!tmp){
 		log_enomem();
 		return -1;
 	}
 	array->strings = tmp;
+	array->size = size;
+	return 0;
+}
 
-	array->strings[array->len - 1] = str ? sh_dup(str) : NULL;
+int sa_add(struct string_array* array, const char* str){
+	char* dup = NULL;
+
+	return_ifnull(array, -1);
+
+	if (sa_reserve(array, array->len + 1) != 0 || (str && !(dup = sh_dup(str)))){
+		return -1;
+	}
+	array->strings[array->len] = dup;
+	array->len++;
+	index_appended(array, array->len - 1);
 
 	return 0;
 }
 
 int sa_insert(struct string_array* array, const char* str, size_t index){
-	size_t i;
-	char* tmp_old;
-	char* tmp_cur;
-	void* tmp;
+	char* dup = NULL;
 
 	return_ifnull(array, -1);
 
@@ -45,29 +156,22 @@ int sa_insert(struct string_array* array, const char* str, size_t index){
 		return -1;
 	}
 
-	array->len++;
-	tmp = realloc(array->strings, array->len * sizeof(*array->strings));
-	if (!tmp){
-		log_enomem();
+	if (sa_reserve(array, array->len + 1) != 0 || (str && !(dup = sh_dup(str)))){
 		return -1;
 	}
-	array->strings = tmp;
-
-	tmp_old = array->strings[index];
-	for (i = index + 1; i < array->len; ++i){
-		tmp_cur = array->strings[i];
-		array->strings[i] = tmp_old;
-		tmp_old = tmp_cur;
+	memmove(array->strings + index + 1, array->strings + index, (array->len - index) * sizeof(*array->strings));
+	array->strings[index] = dup;
+	array->len++;
+	if (index == array->len - 1){
+		index_appended(array, index);
+	}
+	else{
+		index_invalidate(array);
 	}
-
-	array->strings[index] = str ? sh_dup(str) : NULL;
 	return 0;
 }
 
 int sa_remove(struct string_array* array, size_t index){
-	size_t i;
-	void* tmp;
-
 	return_ifnull(array, -1);
 
 	if (index >= array->len){
@@ -76,27 +180,50 @@ int sa_remove(struct string_array* array, size_t index){
 	}
 
 	free(array->strings[index]);
-
-	for (i = index; i < array->len - 1; ++i){
-		array->strings[i] = array->strings[i + 1];
-	}
+	memmove(array->strings + index, array->strings + index + 1, (array->len - index - 1) * sizeof(*array->strings));
 	array->len--;
+	index_invalidate(array);
+	return 0;
+}
+
+int sa_index(struct string_array* array){
+	return_ifnull(array, -1);
 
-	tmp = realloc(array->strings, array->len * sizeof(*array->strings));
-	if (!tmp && array->len != 0){
+	if (!array->index && !(array->index = calloc(1, sizeof(*array->index)))){
 		log_enomem();
 		return -1;
 	}
-	array->strings = tmp;
+	if (index_rebuild(array, array->len) != 0){
+		index_free(array);
+		return -1;
+	}
 	return 0;
 }
 
 int sa_contains(const struct string_array* array, const char* str){
+	struct sa_index* idx;
 	size_t i;
 
 	return_ifnull(array, -1);
+
+	idx = array->index;
+	/* the index belongs to the array, so bringing it up to date does not change what the array holds */
+	if (idx && (idx->stale || idx->len != array->len)){
+		index_rebuild((struct string_array*)array, array->len);
+	}
+	if (idx && !idx->stale){
+		for (i = sa_hash(str) & (idx->size - 1); idx->slots[i] != 0; i = (i + 1) & (idx->size - 1)){
+			const char* cur = array->strings[idx->slots[i] - 1];
+
+			if (cur && strcmp(cur, str) == 0){
+				return 1;
+			}
+		}
+		return 0;
+	}
+
 	for (i = 0; i < array->len; ++i){
-		if (strcmp(array->strings[i], str) == 0){
+		if (array->strings[i] && strcmp(array->strings[i], str) == 0){
 			return 1;
 		}
 	}
@@ -110,6 +237,7 @@ static int cmp(const void* str1, const void* str2){
 void sa_sort(struct string_array* array){
 	return_ifnull(array, ;);
 	qsort(array->strings, array->len, sizeof(*(array->strings)), cmp);
+	index_invalidate(array);
 }
 
 void sa_reset(struct string_array* array){
@@ -124,6 +252,8 @@ void sa_reset(struct string_array* array){
 	free(array->strings);
 	array->strings = NULL;
 	array->len = 0;
+	array->size = 0;
+	index_invalidate(array);
 }
 
 void sa_free(struct string_array* array){
@@ -136,6 +266,7 @@ void sa_free(struct string_array* array){
 		free(array->strings[i]);
 	}
 	free(array->strings);
+	index_free(array);
 	free(array);
 }
 
@@ -148,6 +279,8 @@ struct string_array* sa_new(void){
 	}
 	ret->strings = NULL;
 	ret->len = 0;
+	ret->size = 0;
+	ret->index = NULL;
 	return ret;
 }
 
@@ -207,12 +340,12 @@ cleanup:
 void sa_to_raw_array(struct string_array* arr, char*** out, size_t* out_len){
 	*out = arr->strings;
 	*out_len = arr->len;
+	index_free(arr);
 	free(arr);
 }
 
 int sa_merge(struct string_array* dst, struct string_array* src){
 	size_t dst_len_old;
-	void* tmp;
 
 	return_ifnull(dst, -1);
 	if (!src){
@@ -220,48 +353,92 @@ int sa_merge(struct string_array* dst, struct string_array* src){
 	}
 
 	dst_len_old = dst->len;
-	dst->len += src->len;
-
-	tmp = realloc(dst->strings, dst->len * sizeof(*dst->strings));
-	if (!tmp){
-		log_enomem();
+	if (sa_reserve(dst, dst->len + src->len) != 0){
 		return -1;
 	}
-	dst->strings = tmp;
 
 	memcpy(dst->strings + dst_len_old, src->strings, src->len * sizeof(*src->strings));
+	dst->len += src->len;
+	index_appended(dst, dst_len_old);
 	free(src->strings);
+	index_free(src);
 	free(src);
 	return 0;
 }
 
+static int cmp_ptr(const void* p1, const void* p2){
+	int ret = strcmp(**(char* const* const*)p1, **(char* const* const*)p2);
+
+	/* equal strings stay in their original order, so the first one is the one kept */
+	if (ret == 0){
+		return *(char* const* const*)p1 < *(char* const* const*)p2 ? -1 : 1;
+	}
+	return ret;
+}
+
 size_t sa_sanitize_directories(struct string_array* array){
+	char*** sorted = NULL;
 	size_t n_removed = 0;
 	size_t i;
+	size_t j;
 
 	return_ifnull(array, 0);
 
+	/* freed strings are set to NULL here, and everything left is moved down once at the end */
 	for (i = 0; i < array->len; ++i){
 		if (!directory_exists(array->strings[i])){
-			sa_remove(array, i);
-			i--;
-			n_removed++;
-			continue;
+			free(array->strings[i]);
+			array->strings[i] = NULL;
 		}
-		if (array->strings[i][strlen(array->strings[i]) - 1] != '/' &&
+		/* sh_concat() frees the string if it fails */
+		else if (array->strings[i][strlen(array->strings[i]) - 1] != '/' &&
 				(array->strings[i] = sh_concat(array->strings[i], "/")) == NULL){
 			log_warning("Failed to concatenate trailing slash to string.");
-			sa_remove(array, i);
-			i--;
+		}
+	}
+
+	/* sorting pointers to the entries puts every copy of a directory next to the first one, which takes O(n log n) instead of comparing every pair */
+	sorted = malloc((array->len + 1) * sizeof(*sorted));
+	if (!sorted){
+		log_warning("Failed to allocate memory to find duplicate directories. They will be kept.");
+	}
+	for (i = 0, j = 0; sorted && i < array->len; ++i){
+		if (array->strings[i]){
+			sorted[j++] = &array->strings[i];
+		}
+	}
+	if (sorted){
+		qsort(sorted, j, sizeof(*sorted), cmp_ptr);
+		for (i = 1; i < j; ++i){
+			if (strcmp(*sorted[i - 1], *sorted[i]) == 0){
+				/* the one before is kept, and is what the next one has to be compared with */
+				char* dup = *sorted[i];
+
+				*sorted[i] = NULL;
+				sorted[i] = sorted[i - 1];
+				free(dup);
+			}
+		}
+		free(sorted);
+	}
+
+	for (i = 0, j = 0; i < array->len; ++i){
+		if (array->strings[i]){
+			array->strings[j++] = array->strings[i];
+		}
+		else{
 			n_removed++;
 		}
 	}
+	array->len = j;
+	index_invalidate(array);
 	return n_removed;
 }
 
 struct string_array* sa_get_parent_dirs(const char* directory){
 	char* dir = NULL;
 	char* dir_tok = NULL;
+	char* dir_save = NULL;
 	struct string_array* arr = NULL;
 
 	dir = sh_dup(directory);
@@ -276,7 +453,8 @@ struct string_array* sa_get_parent_dirs(const char* directory){
 		goto cleanup_freeout;
 	}
 
-	dir_tok = strtok(dir, "/");
+	/* strtok_r() because backup workers call this concurrently */
+	dir_tok = strtok_r(dir, "/", &dir_save);
 	while (dir_tok != NULL && strlen(dir_tok) > 0){
 		char* tmp;
 		if (arr->len == 0){
@@ -296,7 +474,7 @@ struct string_array* sa_get_parent_dirs(const char* directory){
 			goto cleanup_freeout;
 		}
 		free(tmp);
-		dir_tok = strtok(NULL, "/");
+		dir_tok = strtok_r(NULL, "/", &dir_save);
 	}
 
 	free(dir);
@@ -20,8 +20,10 @@
  * The length is automatically managed.
  */
 struct string_array{
-	char** strings; /**< @brief The strings in the array. */
-	size_t len;     /**< @brief The length of the array. */
+	char** strings;        /**< @brief The strings in the array. */
+	size_t len;            /**< @brief The length of the array. */
+	size_t size;           /**< @brief How many strings fit before the array has to grow. This should not be changed directly. */
+	struct sa_index* index; /**< @brief The hashed index made by sa_index(), or NULL if there is none. This should not be changed directly. */
 };
 
 /**
@@ -73,6 +75,18 @@ int sa_insert(struct string_array* array, const char* str, size_t index);
  */
 int sa_remove(struct string_array* array, size_t index);
 
+/**
+ * @brief Makes sa_contains() on an array take constant time instead of looking at every string.<br>
+ * The index is kept up to date by every sa_*() function, and is worth it for arrays of more than a few dozen strings that are searched often.<br>
+ * Code that changes an array's strings or length directly must call this again afterwards.
+ *
+ * @param array The array to index.
+ *
+ * @return 0 on success, or negative on failure.<br>
+ * On failure, sa_contains() still works, just without the index.
+ */
+int sa_index(struct string_array* array);
+
 /**
  * @brief Returns true if the array contains the string and false if it doesn't.
  *
@@ -156,8 +170,9 @@ void sa_to_raw_array(struct string_array* arr, char*** out, size_t* out_len);
 int sa_merge(struct string_array* dst, struct string_array* src);
 
 /**
- * @brief Removes all entries from a string array that do not correspond to a valid directory.<br>
- * Also concatenates trailing slashes to all strings if they don't already have one.
+ * @brief Removes all entries from a string array that do not correspond to a valid directory, as well as any directory that is listed more than once.<br>
+ * Also concatenates trailing slashes to all strings if they don't already have one.<br>
+ * The directories that are kept stay in the same order.
  *
  * @param array The array to sanitize.
  *
@@ -260,3 +260,97 @@ char* sh_sprintf(const char* format, ...){
 	va_end(ap);
 	return ret;
 }
+
+/* makes room for a string of len characters, doubling so the buffer soon stops growing */
+static int pb_reserve(struct path_builder* pb, size_t len){
+	size_t size = pb->size ? pb->size : 64;
+	void* tmp;
+
+	if (len < pb->size){
+		return 0;
+	}
+	while (size <= len){
+		size *= 2;
+	}
+	tmp = realloc(pb->str, size);
+	if (!tmp){
+		log_enomem();
+		return -1;
+	}
+	pb->str = tmp;
+	pb->size = size;
+	return 0;
+}
+
+/* replaces everything after the first start characters with len characters of str */
+static int pb_put(struct path_builder* pb, size_t start, const char* str, size_t len){
+	if (pb_reserve(pb, start + len) != 0){
+		return -1;
+	}
+	memmove(pb->str + start, str, len);
+	pb->len = start + len;
+	pb->str[pb->len] = '\0';
+	return 0;
+}
+
+int pb_set(struct path_builder* pb, const char* str){
+	return_ifnull(pb, -1);
+	return_ifnull(str, -1);
+
+	return pb_put(pb, 0, str, strlen(str));
+}
+
+int pb_append(struct path_builder* pb, const char* str){
+	return_ifnull(pb, -1);
+	return_ifnull(str, -1);
+
+	return pb_put(pb, pb->len, str, strlen(str));
+}
+
+int pb_append_path(struct path_builder* pb, const char* path){
+	size_t len;
+
+	return_ifnull(pb, -1);
+	return_ifnull(path, -1);
+
+	if (pb->len == 0){
+		log_debug("Cannot append a path to an empty string");
+		return -1;
+	}
+
+	if (path[0] == '/'){
+		path++;
+	}
+	len = strlen(path);
+	if (pb->str[pb->len - 1] == '/'){
+		return pb_put(pb, pb->len, path, len);
+	}
+	if (pb_reserve(pb, pb->len + 1 + len) != 0){
+		return -1;
+	}
+	pb->str[pb->len] = '/';
+	return pb_put(pb, pb->len + 1, path, len);
+}
+
+int pb_set_parent(struct path_builder* pb, const char* path){
+	const char* filename;
+
+	return_ifnull(pb, -1);
+	return_ifnull(path, -1);
+
+	filename = sh_filename(path);
+	if (strlen(path) <= 1 || filename == path){
+		return -1;
+	}
+	return pb_put(pb, 0, path, filename - path - 1);
+}
+
+void pb_free(struct path_builder* pb){
+	if (!pb){
+		return;
+	}
+	free(pb->str);
+	pb->str = NULL;
+	pb->len = 0;
+	pb->size = 0;
+}
@@ -185,6 +185,84 @@ int sh_cmp_nullsafe(const char* str1, const char* str2);
  */
 int sh_ncasecmp(const char* str1, const char* str2);
 
+/**
+ * @brief A string that is built up piece by piece in a buffer that is reused, so building a path does not allocate once the buffer is big enough.<br>
+ * A path builder should be zero-initialized (e.g. `struct path_builder pb = PB_INIT;`), and freed with pb_free() when no longer in use.<br>
+ * A path builder is not thread-safe, so each thread needs its own.
+ */
+struct path_builder{
+	char* str;   /**< @brief The string built so far, or NULL if nothing has been built yet. This is invalidated by the next pb_*() call on the builder. */
+	size_t len;  /**< @brief The length of the string. */
+	size_t size; /**< @brief How many bytes the buffer holds. */
+};
+
+/**
+ * @brief Initializes an empty path builder.
+ */
+#define PB_INIT { NULL, 0, 0 }
+
+/**
+ * @brief Sets a path builder's string.
+ *
+ * @param pb The path builder.
+ *
+ * @param str The string to set it to.
+ *
+ * @return 0 on success, or negative on failure.<br>
+ * On failure, the builder's string is unchanged.
+ */
+int pb_set(struct path_builder* pb, const char* str);
+
+/**
+ * @brief Appends a string to a path builder's string, like sh_concat().
+ * @see sh_concat()
+ *
+ * @param pb The path builder.
+ *
+ * @param str The string to append.
+ *
+ * @return 0 on success, or negative on failure.<br>
+ * On failure, the builder's string is unchanged.
+ */
+int pb_append(struct path_builder* pb, const char* str);
+
+/**
+ * @brief Appends a path to a path builder's string, with exactly one '/' between them, like sh_concat_path().
+ * @see sh_concat_path()
+ *
+ * @param pb The path builder.<br>
+ * This must already have a non-empty string.
+ *
+ * @param path The path to append.
+ *
+ * @return 0 on success, or negative on failure.<br>
+ * On failure, the builder's string is unchanged.
+ */
+int pb_append_path(struct path_builder* pb, const char* path);
+
+/**
+ * @brief Sets a path builder's string to the parent directory of a path, like sh_parent_dir().
+ * @see sh_parent_dir()
+ *
+ * @param pb The path builder.
+ *
+ * @param path The path.<br>
+ * This must not be the builder's own string.
+ *
+ * @return 0 on success, or negative if the path has no parent directory or there was an error.<br>
+ * On failure, the builder's string is unchanged.
+ */
+int pb_set_parent(struct path_builder* pb, const char* path);
+
+/**
+ * @brief Frees a path builder's buffer, leaving it as if it were just initialized with PB_INIT.
+ *
+ * @param pb The path builder.
+ *
+ * @return void
+ */
+void pb_free(struct path_builder* pb);
+
 /**
  * @brief Creates a string out of a printf statement.<br>
  * This function is like sprintf(), but it allocates the destination string instead of requiring a static buffer.
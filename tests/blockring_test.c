@@ -0,0 +1,113 @@
+/** @file tests/blockring_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "blockring_test.h"
+#include "../blockring.h"
+#include <stdlib.h>
+#include <unistd.h>
+
+const struct unit_test blockring_tests[] = {
+	MAKE_TEST(test_br_order),
+	MAKE_TEST(test_br_single_block)
+};
+MAKE_PKG(blockring_tests, blockring_pkg);
+
+struct order_block{
+	int in;
+	int out;
+};
+
+struct order_ring{
+	struct order_block* blocks;
+	/* the next value flush expects, so anything out of order shows up */
+	int next;
+	int n_flushes;
+};
+
+static void order_run(void* arg){
+	struct order_block* b = arg;
+
+	/* later blocks finish first now and then */
+	if (b->in % 3 == 0){
+		usleep(1000);
+	}
+	b->out = b->in * 2;
+}
+
+static int order_flush(size_t n_queued, void* flush_data){
+	struct order_ring* od = flush_data;
+	size_t i;
+
+	od->n_flushes++;
+	for (i = 0; i < n_queued; ++i){
+		if (od->blocks[i].out != od->next * 2){
+			return -1;
+		}
+		od->next++;
+	}
+	return 0;
+}
+
+void test_br_order(enum TEST_STATUS* status){
+	struct block_ring br;
+	struct order_ring od;
+	int i;
+
+	od.next = 0;
+	od.n_flushes = 0;
+	br_init(&br, 3, order_flush, &od);
+	TEST_ASSERT(br.n_blocks == 6);
+	od.blocks = calloc(br.n_blocks, sizeof(*od.blocks));
+	TEST_ASSERT(od.blocks);
+
+	for (i = 0; i < 100; ++i){
+		struct order_block* b = &od.blocks[br.n_queued];
+
+		b->in = i;
+		TEST_ASSERT(br_submit(&br, order_run, b, i == 99) == 0);
+	}
+	TEST_ASSERT(br.tp != NULL);
+	TEST_ASSERT(br_flush(&br) == 0);
+	TEST_ASSERT(od.next == 100);
+	/* every time the ring was full, and once more for the rest */
+	TEST_ASSERT(od.n_flushes == 100 / 6 + 1);
+
+cleanup:
+	br_free(&br);
+	free(od.blocks);
+}
+
+void test_br_single_block(enum TEST_STATUS* status){
+	struct block_ring br;
+	struct order_ring od;
+	struct order_block blocks[2];
+
+	od.blocks = blocks;
+	od.next = 0;
+	od.n_flushes = 0;
+	br_init(&br, 4, order_flush, &od);
+
+	/* a stream that is only one block is done without starting any threads */
+	blocks[0].in = 0;
+	TEST_ASSERT(br_submit(&br, order_run, &blocks[0], 1) == 0);
+	TEST_ASSERT(br.tp == NULL);
+	TEST_ASSERT(br_flush(&br) == 0);
+	TEST_ASSERT(od.next == 1);
+
+	/* but the next stream's first block is not necessarily its last */
+	br_reset(&br);
+	od.next = 0;
+	blocks[0].in = 0;
+	TEST_ASSERT(br_submit(&br, order_run, &blocks[0], 0) == 0);
+	TEST_ASSERT(br.tp != NULL);
+	TEST_ASSERT(br_flush(&br) == 0);
+	TEST_ASSERT(od.next == 1);
+
+cleanup:
+	br_free(&br);
+}
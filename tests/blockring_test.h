@@ -0,0 +1,18 @@
+/** @file tests/blockring_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __BLOCKRING_TEST_H
+#define __BLOCKRING_TEST_H
+
+#include "test_framework.h"
+
+void test_br_order(enum TEST_STATUS* status);
+void test_br_single_block(enum TEST_STATUS* status);
+
+EXPORT_PKG(blockring_pkg);
+#endif
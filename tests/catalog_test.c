@@ -0,0 +1,233 @@
+/** @file tests/catalog_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "catalog_test.h"
+#include "../catalog.h"
+#include "../checksum.h"
+#include "../checksumsort.h"
+#include "../filehelper.h"
+#include "../strings/stringhelper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const struct unit_test catalog_tests[] = {
+	MAKE_TEST(test_catalog_update),
+	MAKE_TEST(test_catalog_rebuild),
+	MAKE_TEST(test_catalog_forget)
+};
+MAKE_PKG(catalog_tests, catalog_pkg);
+
+#define TEST_DIR "TEST_CATALOG"
+/* unchanged files around the ones that change, so the catalog has several blocks */
+#define N_FILLER 400
+
+/* the files of one backup, as "path=checksum" */
+static const char* backups[3][4] = {
+	{"/home/a=A1", "/home/b=B1", "/home/c=C1", NULL},
+	{"/home/a=A1", "/home/b=B2", "/home/d=D1", NULL},
+	{"/home/a=A2", "/home/b=B2", "/home/d=D1", NULL}
+};
+static const unsigned long times[3] = {1000, 2000, 3000};
+
+static int add_element(FILE* fp, const char* file, const char* checksum){
+	struct element e;
+	char* f = sh_dup(file);
+	char* c = sh_dup(checksum);
+	int ret;
+
+	e.file = f;
+	e.checksum = c;
+	e.meta = NULL;
+	e.artifact = NULL;
+	ret = f && c ? write_element_to_file(fp, &e) : -1;
+	free(f);
+	free(c);
+	return ret;
+}
+
+/* does what a backup does to the checksum files: keeps the old one as checksums.txt.TIME and sorts the new one into place */
+static int run_backup(size_t i){
+	char* checksum_file = sh_concat_path(sh_dup(TEST_DIR), "checksums.txt");
+	char* prev_file = sh_sprintf("%s.%lu", checksum_file, times[i]);
+	FILE* fp = NULL;
+	size_t j;
+	int ret = -1;
+
+	if (!checksum_file || !prev_file){
+		goto cleanup;
+	}
+	if (file_exists(checksum_file) && rename(checksum_file, prev_file) != 0){
+		goto cleanup;
+	}
+	if (!(fp = fopen(checksum_file, "wb"))){
+		goto cleanup;
+	}
+	for (j = 0; j < N_FILLER; ++j){
+		char file[64];
+
+		sprintf(file, "/filler/%04lu", (unsigned long)j);
+		if (add_element(fp, file, "F") != 0){
+			goto cleanup;
+		}
+	}
+	for (j = 0; backups[i][j]; ++j){
+		char* tmp = sh_dup(backups[i][j]);
+		char* eq = tmp ? strchr(tmp, '=') : NULL;
+
+		if (!eq){
+			free(tmp);
+			goto cleanup;
+		}
+		*eq = '\0';
+		if (add_element(fp, tmp, eq + 1) != 0){
+			free(tmp);
+			goto cleanup;
+		}
+		free(tmp);
+	}
+	fclose(fp);
+	fp = NULL;
+	if (sort_checksum_file(checksum_file, 0, 1) != 0){
+		goto cleanup;
+	}
+	ret = catalog_update(TEST_DIR, times[i]);
+
+cleanup:
+	fp ? fclose(fp) : 0;
+	free(checksum_file);
+	free(prev_file);
+	return ret;
+}
+
+static int setup_backups(void){
+	size_t i;
+
+	cleanup_test_environment(TEST_DIR, NULL);
+	if (mkdir_recursive(TEST_DIR) < 0){
+		return -1;
+	}
+	for (i = 0; i < 3; ++i){
+		if (run_backup(i) != 0){
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int resolves_to(struct catalog* c, const char* file, unsigned long time, unsigned long start, unsigned long end){
+	struct catalog_version v;
+
+	return catalog_resolve(c, file, time, &v) == 0 && v.start == start && v.end == end;
+}
+
+struct listing{
+	unsigned long n;
+	int has_c;
+	int has_d;
+};
+
+static int count_files(const char* file, const struct catalog_version* version, void* data){
+	struct listing* l = data;
+
+	(void)version;
+	l->n++;
+	l->has_c |= !strcmp(file, "/home/c");
+	l->has_d |= !strcmp(file, "/home/d");
+	return 0;
+}
+
+void test_catalog_update(enum TEST_STATUS* status){
+	struct catalog* c = NULL;
+	struct catalog_version v;
+	struct listing l;
+
+	TEST_ASSERT(setup_backups() == 0);
+	TEST_ASSERT(catalog_open(TEST_DIR, &c) == 0);
+	TEST_ASSERT(catalog_last(c) == 3000);
+
+	/* a changed twice, so its first version is in deltas/ under the second backup */
+	TEST_ASSERT(resolves_to(c, "/home/a", 1500, 1000, 3000));
+	TEST_ASSERT(resolves_to(c, "/home/a", 2500, 1000, 3000));
+	TEST_ASSERT(resolves_to(c, "/home/a", 3500, 3000, 0));
+	TEST_ASSERT(resolves_to(c, "/home/b", 1500, 1000, 2000));
+	TEST_ASSERT(resolves_to(c, "/home/b", 3500, 2000, 0));
+	/* c was removed by the second backup, and d was added by it */
+	TEST_ASSERT(resolves_to(c, "/home/c", 1999, 1000, 2000));
+	TEST_ASSERT(catalog_resolve(c, "/home/c", 2000, &v) > 0);
+	TEST_ASSERT(catalog_resolve(c, "/home/d", 1500, &v) > 0);
+	TEST_ASSERT(resolves_to(c, "/home/d", 2000, 2000, 0));
+	/* nothing was backed up yet */
+	TEST_ASSERT(catalog_resolve(c, "/home/a", 999, &v) > 0);
+	TEST_ASSERT(catalog_resolve(c, "/nonexistent", 3500, &v) > 0);
+	TEST_ASSERT(resolves_to(c, "/filler/0000", 1500, 1000, 0));
+	TEST_ASSERT(resolves_to(c, "/filler/0399", 3500, 1000, 0));
+
+	memset(&l, 0, sizeof(l));
+	TEST_ASSERT(catalog_list(c, 1500, count_files, &l) == 0);
+	TEST_ASSERT(l.n == N_FILLER + 3 && l.has_c && !l.has_d);
+	memset(&l, 0, sizeof(l));
+	TEST_ASSERT(catalog_list(c, 3500, count_files, &l) == 0);
+	TEST_ASSERT(l.n == N_FILLER + 3 && !l.has_c && l.has_d);
+
+	/* updating again without a new backup changes nothing */
+	catalog_close(c);
+	c = NULL;
+	TEST_ASSERT(catalog_update(TEST_DIR, 4000) == 0);
+	TEST_ASSERT(catalog_open(TEST_DIR, &c) == 0);
+	TEST_ASSERT(catalog_last(c) == 3000);
+	TEST_ASSERT(resolves_to(c, "/home/a", 3500, 3000, 0));
+
+cleanup:
+	catalog_close(c);
+	cleanup_test_environment(TEST_DIR, NULL);
+}
+
+void test_catalog_rebuild(enum TEST_STATUS* status){
+	struct catalog* c = NULL;
+	char* file = NULL;
+
+	TEST_ASSERT(setup_backups() == 0);
+	file = sh_concat_path(sh_dup(TEST_DIR), CATALOG_NAME);
+	TEST_ASSERT(file);
+	remove(file);
+	TEST_ASSERT(catalog_open(TEST_DIR, &c) > 0);
+
+	/* without the catalog, the first backup's time is not known anymore */
+	TEST_ASSERT(catalog_update(TEST_DIR, 4000) == 0);
+	TEST_ASSERT(catalog_open(TEST_DIR, &c) == 0);
+	TEST_ASSERT(resolves_to(c, "/home/a", 1500, 0, 3000));
+	TEST_ASSERT(resolves_to(c, "/home/b", 3500, 2000, 0));
+	TEST_ASSERT(resolves_to(c, "/home/c", 500, 0, 2000));
+	TEST_ASSERT(resolves_to(c, "/home/d", 2500, 2000, 0));
+
+cleanup:
+	free(file);
+	catalog_close(c);
+	cleanup_test_environment(TEST_DIR, NULL);
+}
+
+void test_catalog_forget(enum TEST_STATUS* status){
+	struct catalog* c = NULL;
+	struct catalog_version v;
+	const unsigned long pruned[] = {2000};
+
+	TEST_ASSERT(setup_backups() == 0);
+	TEST_ASSERT(catalog_forget(TEST_DIR, pruned, 1) == 0);
+	TEST_ASSERT(catalog_open(TEST_DIR, &c) == 0);
+
+	/* the versions replaced by the second backup are gone */
+	TEST_ASSERT(catalog_resolve(c, "/home/b", 1500, &v) > 0);
+	TEST_ASSERT(catalog_resolve(c, "/home/c", 1500, &v) > 0);
+	TEST_ASSERT(resolves_to(c, "/home/a", 1500, 1000, 3000));
+	TEST_ASSERT(resolves_to(c, "/home/b", 2500, 2000, 0));
+
+cleanup:
+	catalog_close(c);
+	cleanup_test_environment(TEST_DIR, NULL);
+}
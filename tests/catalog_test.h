@@ -0,0 +1,19 @@
+/** @file tests/catalog_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __CATALOG_TEST_H
+#define __CATALOG_TEST_H
+
+#include "test_framework.h"
+
+void test_catalog_update(enum TEST_STATUS* status);
+void test_catalog_rebuild(enum TEST_STATUS* status);
+void test_catalog_forget(enum TEST_STATUS* status);
+
+EXPORT_PKG(catalog_pkg);
+#endif
@@ -0,0 +1,214 @@
+/** @file tests/changejournal_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "changejournal_test.h"
+#include "../changejournal.h"
+#include "../options/options.h"
+#include "../strings/stringarray.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+const struct unit_test changejournal_tests[] = {
+	MAKE_TEST(test_cj_consume),
+	MAKE_TEST(test_cj_changed),
+	MAKE_TEST(test_cj_watch)
+};
+MAKE_PKG(changejournal_tests, changejournal_pkg);
+
+/* writes a journal the way the watcher does, with this process as the watcher */
+static void write_journal(const char* file, const char* session, const char* records, size_t records_len){
+	char header[64];
+	size_t len;
+	FILE* fp;
+
+	len = sprintf(header, "EZCJ1%c%lu%c%s", '\0', (unsigned long)getpid(), '\0', session) + 1;
+	fp = fopen(file, "wb");
+	if (!fp){
+		return;
+	}
+	fwrite(header, 1, len, fp);
+	fwrite(records, 1, records_len, fp);
+	fclose(fp);
+}
+
+void test_cj_consume(enum TEST_STATUS* status){
+	const char* journal = "TEST_CJ_JOURNAL";
+	const char* state = "TEST_CJ_STATE";
+	const char records[] = "Pb/2\0Pa/1\0Pb/2\0";
+	const char overflow[] = "Pa/1\0O\0";
+	struct change_journal* cj = NULL;
+
+	remove(state);
+
+	/* no journal at all */
+	TEST_ASSERT(cj_consume(journal, state, &cj) > 0);
+	TEST_ASSERT(cj == NULL);
+
+	/* no backup has recorded this session yet */
+	write_journal(journal, "s1", records, sizeof(records) - 1);
+	TEST_ASSERT(cj_consume(journal, state, &cj) > 0);
+	TEST_ASSERT(cj);
+	TEST_ASSERT(cj->paths == NULL);
+	TEST_ASSERT(strcmp(cj->session, "s1") == 0);
+	TEST_ASSERT(!does_file_exist(journal));
+	TEST_ASSERT(cj_commit(state, cj) == 0);
+	TEST_FREE(cj, cj_free);
+
+	/* the same watcher since the last backup */
+	write_journal(journal, "s1", records, sizeof(records) - 1);
+	TEST_ASSERT(cj_consume(journal, state, &cj) == 0);
+	TEST_ASSERT(cj);
+	TEST_ASSERT(cj->paths);
+	TEST_ASSERT(cj->paths->len == 2);
+	TEST_ASSERT(strcmp(cj->paths->strings[0], "a/1") == 0);
+	TEST_ASSERT(strcmp(cj->paths->strings[1], "b/2") == 0);
+	TEST_ASSERT(cj->runs == 1);
+	/* nothing is trusted until the backup finishes */
+	TEST_ASSERT(!does_file_exist(state));
+	TEST_ASSERT(cj_commit(state, cj) == 0);
+	TEST_FREE(cj, cj_free);
+
+	/* the watcher missed something */
+	write_journal(journal, "s1", overflow, sizeof(overflow) - 1);
+	TEST_ASSERT(cj_consume(journal, state, &cj) > 0);
+	TEST_ASSERT(cj);
+	TEST_ASSERT(cj->paths == NULL);
+	TEST_ASSERT(cj->runs == 0);
+	TEST_ASSERT(cj_commit(state, cj) == 0);
+	TEST_FREE(cj, cj_free);
+
+	/* a restarted watcher */
+	write_journal(journal, "s2", records, sizeof(records) - 1);
+	TEST_ASSERT(cj_consume(journal, state, &cj) > 0);
+	TEST_ASSERT(cj);
+	TEST_ASSERT(cj->paths == NULL);
+	TEST_FREE(cj, cj_free);
+
+	/* the last backup failed, so it never committed */
+	write_journal(journal, "s2", records, sizeof(records) - 1);
+	TEST_ASSERT(cj_consume(journal, state, &cj) > 0);
+	TEST_ASSERT(cj);
+	TEST_ASSERT(cj->paths == NULL);
+
+cleanup:
+	cj_free(cj);
+	remove(journal);
+	remove(state);
+}
+
+void test_cj_changed(enum TEST_STATUS* status){
+	const char* journal = "TEST_CJ_JOURNAL";
+	const char* state = "TEST_CJ_STATE";
+	const char records[] = "P/data/dir\0P/data/file\0";
+	struct change_journal* cj = NULL;
+
+	/* a commit without a journal is all the next consume needs to trust one */
+	remove(state);
+	write_journal(journal, "s1", "", 0);
+	TEST_ASSERT(cj_consume(journal, state, &cj) > 0);
+	TEST_ASSERT(cj_commit(state, cj) == 0);
+	TEST_FREE(cj, cj_free);
+
+	write_journal(journal, "s1", records, sizeof(records) - 1);
+	TEST_ASSERT(cj_consume(journal, state, &cj) == 0);
+	TEST_ASSERT(cj && cj->paths);
+
+	TEST_ASSERT(cj_changed(cj, "/data/file"));
+	TEST_ASSERT(cj_changed(cj, "/data/dir"));
+	TEST_ASSERT(cj_changed(cj, "/data/dir/a/b"));
+	TEST_ASSERT(!cj_changed(cj, "/data/dirt"));
+	TEST_ASSERT(!cj_changed(cj, "/data/file2"));
+	TEST_ASSERT(!cj_changed(cj, "/data"));
+	TEST_ASSERT(!cj_changed(cj, "/other/file"));
+
+cleanup:
+	cj_free(cj);
+	remove(journal);
+	remove(state);
+}
+
+/* waits for the watcher's next flush */
+static int wait_for_file(const char* file){
+	int i;
+
+	for (i = 0; i < 10 * (CJ_FLUSH_INTERVAL + 1); ++i){
+		if (does_file_exist(file)){
+			return 1;
+		}
+		usleep(100000);
+	}
+	return 0;
+}
+
+void test_cj_watch(enum TEST_STATUS* status){
+	const char* path = "TEST_CJ_DIR";
+	const char* journal = "TEST_CJ_JOURNAL";
+	const char* state = "TEST_CJ_STATE";
+	struct options* opt = NULL;
+	struct change_journal* cj = NULL;
+	char** files = NULL;
+	size_t files_len = 0;
+	pid_t pid = -1;
+
+	setup_test_environment_basic(path, &files, &files_len);
+	remove(journal);
+	remove(state);
+
+	opt = options_new();
+	TEST_ASSERT(opt);
+	TEST_ASSERT(sa_add(opt->directories, path) == 0);
+	opt->change_journal = malloc(strlen(journal) + 1);
+	TEST_ASSERT(opt->change_journal);
+	strcpy(opt->change_journal, journal);
+
+	pid = fork();
+	TEST_ASSERT(pid >= 0);
+	if (pid == 0){
+		_exit(cj_watch(opt) == 0 ? 0 : 1);
+	}
+
+	/* the first journal cannot be trusted, since anything could have changed before the watcher started */
+	TEST_ASSERT(wait_for_file(journal));
+	TEST_ASSERT(cj_consume(journal, state, &cj) > 0);
+	TEST_ASSERT(cj);
+	TEST_ASSERT(cj_commit(state, cj) == 0);
+	TEST_FREE(cj, cj_free);
+
+	create_file("TEST_CJ_DIR/new_file", "new", 3);
+	mkdir("TEST_CJ_DIR/new_dir", 0755);
+	/* the watcher has to see the new directory before anything in it */
+	usleep(200000);
+	create_file("TEST_CJ_DIR/new_dir/nested", "nested", 6);
+
+	TEST_ASSERT(wait_for_file(journal));
+	sleep(CJ_FLUSH_INTERVAL + 1);
+	TEST_ASSERT(cj_consume(journal, state, &cj) == 0);
+	TEST_ASSERT(cj && cj->paths);
+	TEST_ASSERT(cj_changed(cj, "TEST_CJ_DIR/new_file"));
+	TEST_ASSERT(cj_changed(cj, "TEST_CJ_DIR/new_dir/nested"));
+
+cleanup:
+	if (pid > 0){
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+	}
+	cj_free(cj);
+	options_free(opt);
+	remove(journal);
+	remove(state);
+	remove("TEST_CJ_DIR/new_dir/nested");
+	rmdir("TEST_CJ_DIR/new_dir");
+	remove("TEST_CJ_DIR/new_file");
+	cleanup_test_environment(path, files);
+}
@@ -0,0 +1,19 @@
+/** @file tests/changejournal_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __CHANGEJOURNAL_TEST_H
+#define __CHANGEJOURNAL_TEST_H
+
+#include "test_framework.h"
+
+void test_cj_consume(enum TEST_STATUS* status);
+void test_cj_changed(enum TEST_STATUS* status);
+void test_cj_watch(enum TEST_STATUS* status);
+
+EXPORT_PKG(changejournal_pkg);
+#endif
@@ -9,7 +9,9 @@
 #include "checksum_test.h"
 #include "../checksum.h"
 #include "../checksumsort.h"
+#include "../treehash.h"
 #include "../log.h"
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -23,7 +25,21 @@ const struct unit_test checksum_tests[] = {
 	MAKE_TEST(test_checksum),
 	MAKE_TEST(test_sort_checksum_file),
 	MAKE_TEST(test_search_for_checksum),
-	MAKE_TEST(test_create_removed_list)
+	MAKE_TEST(test_checksum_file_meta),
+	MAKE_TEST(test_checksum_file_binary),
+	MAKE_TEST(test_checksum_file_text),
+	MAKE_TEST(test_checksum_reader),
+	MAKE_TEST(test_checksum_index),
+	MAKE_TEST(test_create_initial_runs),
+	MAKE_TEST(test_sort_checksum_file_memory),
+	MAKE_TEST(test_sort_checksum_file_front_code),
+	MAKE_TEST(test_copy_sorted),
+	MAKE_TEST(test_checksum_file_artifact),
+	MAKE_TEST(test_multikey_sort_elements),
+	MAKE_TEST(test_adaptive_sort_elements),
+	MAKE_TEST(test_create_removed_list),
+	MAKE_TEST(test_create_checksum_delta),
+	MAKE_TEST(test_sync_checksum_file)
 };
 MAKE_PKG(checksum_tests, checksum_pkg);
 
@@ -56,7 +72,7 @@ cleanup:
 }
 
 /* add_checksum_to_file()
- * sort_checksum_file()
+ * sort_checksum_file(, 0)
  * add_checksum_to_file() with previous file */
 void test_sort_checksum_file(enum TEST_STATUS* status){
 	FILE* fp1 = NULL;
@@ -83,7 +99,7 @@ void test_sort_checksum_file(enum TEST_STATUS* status){
 	 * this is so we can be sure that sort_checksum_file() actually did something */
 	for (i = 1; i < files_len; i += 2){
 		int res;
-		res = add_checksum_to_file(files[i], EVP_sha1(), fp1, NULL);
+		res = add_checksum_to_file(files[i], EVP_sha1(), fp1, NULL, NULL);
 		TEST_ASSERT(res >= 0);
 		if (res == 1){
 			printf("Old element: %s\n", files[i]);
@@ -91,7 +107,7 @@ void test_sort_checksum_file(enum TEST_STATUS* status){
 	}
 	for (i = 0; i < files_len; i += 2){
 		int res;
-		res = add_checksum_to_file(files[i], EVP_sha1(), fp1, NULL);
+		res = add_checksum_to_file(files[i], EVP_sha1(), fp1, NULL, NULL);
 		TEST_ASSERT(res >= 0);
 		if (res == 1){
 			printf("Old element: %s\n", files[i]);
@@ -99,7 +115,7 @@ void test_sort_checksum_file(enum TEST_STATUS* status){
 	}
 	TEST_ASSERT_FREE(fp1, fclose);
 
-	TEST_ASSERT(sort_checksum_file(fp1str) == 0);
+	TEST_ASSERT(sort_checksum_file(fp1str, 0, 0) == 0);
 	rename(fp1str, fp2str);
 
 	/* checking that the file is properly sorted */
@@ -138,7 +154,7 @@ void test_sort_checksum_file(enum TEST_STATUS* status){
 	/* check if add_checksum_to_file() skips the unchanged files like it should */
 	for (i = 0; i < files_len; ++i){
 		int res;
-		res = add_checksum_to_file(files[i], EVP_sha1(), fp2, fp1);
+		res = add_checksum_to_file(files[i], EVP_sha1(), fp2, fp1, NULL);
 		/* less than zero means an error occured */
 		TEST_ASSERT(res >= 0);
 		/* if file was unchanged */
@@ -187,7 +203,7 @@ void test_search_for_checksum(enum TEST_STATUS* status){
 	 * this is so we can be sure that sort_checksum_file() actually did something */
 	for (i = 1; i < files_len; i += 2){
 		int res;
-		res = add_checksum_to_file(files[i], EVP_sha1(), fp1, NULL);
+		res = add_checksum_to_file(files[i], EVP_sha1(), fp1, NULL, NULL);
 		TEST_ASSERT(res >= 0);
 		if (res == 1){
 			printf("Old element: %s\n", files[i]);
@@ -195,7 +211,7 @@ void test_search_for_checksum(enum TEST_STATUS* status){
 	}
 	for (i = 0; i < files_len; i += 2){
 		int res;
-		res = add_checksum_to_file(files[i], EVP_sha1(), fp1, NULL);
+		res = add_checksum_to_file(files[i], EVP_sha1(), fp1, NULL, NULL);
 		TEST_ASSERT(res >= 0);
 		if (res == 1){
 			printf("Old element: %s\n", files[i]);
@@ -204,11 +220,11 @@ void test_search_for_checksum(enum TEST_STATUS* status){
 	/* add our file to search for right at the end,
 	 * since binsearch starts at the middle, we don't want to give it an unfair advantage */
 	create_file(sample_file, sample_data, sizeof(sample_data));
-	add_checksum_to_file(sample_file, EVP_sha1(), fp1, NULL);
+	add_checksum_to_file(sample_file, EVP_sha1(), fp1, NULL, NULL);
 
 	TEST_ASSERT_FREE(fp1, fclose);
 
-	TEST_ASSERT(sort_checksum_file(fp1str) == 0);
+	TEST_ASSERT(sort_checksum_file(fp1str, 0, 0) == 0);
 	rename(fp1str, fp2str);
 
 	/* checking that the file was properly sorted
@@ -245,6 +261,702 @@ cleanup:
 	remove(fp2str);
 }
 
+void test_checksum_file_binary(enum TEST_STATUS* status){
+	const char* fpstr = "checksum_binary.txt";
+	const char* tree_sum = TREE_HASH_PREFIX "A94A8FE5CCB19BA61C4C0873D391E987982FBBD3";
+	/* lowercase does not survive a round trip through raw bytes, so it is kept as a string */
+	const char* odd_sum = "not hex, a94a8f";
+	const int n_elements = 500;
+	FILE* fp = NULL;
+	struct element* e = NULL;
+	unsigned char magic[4];
+	char path[64];
+	int i;
+
+	fp = fopen(fpstr, "wb");
+	TEST_ASSERT(fp);
+	/* backwards, so that sorting has to move every element */
+	for (i = n_elements - 1; i >= 0; --i){
+		sprintf(path, "/dir/file%05d", i);
+		TEST_ASSERT(add_hash_to_file(path, i % 2 ? sample_sha1_str : tree_sum, NULL, fp, NULL) == 0);
+	}
+	TEST_ASSERT(add_hash_to_file("/odd", odd_sum, NULL, fp, NULL) == 0);
+	TEST_ASSERT_FREE(fp, fclose);
+
+	/* raw digests are half the size of hex ones */
+	TEST_ASSERT(get_file_size(fpstr) < (uint64_t)n_elements * (strlen("/dir/file00000") + strlen(sample_sha1_str)));
+
+	TEST_ASSERT(sort_checksum_file(fpstr, 0, 0) == 0);
+
+	fp = fopen(fpstr, "rb");
+	TEST_ASSERT(fp);
+	TEST_ASSERT(fread(magic, 1, sizeof(magic), fp) == sizeof(magic));
+	TEST_ASSERT(memcmp(magic, CHECKSUM_MAGIC, 4) == 0);
+
+	/* the records span many blocks, so this goes through the block index */
+	for (i = 0; i < n_elements; i += 7){
+		sprintf(path, "/dir/file%05d", i);
+		TEST_ASSERT(search_for_element(fp, path, &e) == 0);
+		TEST_ASSERT(strcmp(e->file, path) == 0);
+		TEST_ASSERT(strcmp(e->checksum, i % 2 ? sample_sha1_str : tree_sum) == 0);
+		TEST_FREE(e, free_element);
+	}
+	TEST_ASSERT(search_for_element(fp, "/odd", &e) == 0);
+	TEST_ASSERT(strcmp(e->checksum, odd_sum) == 0);
+	TEST_FREE(e, free_element);
+
+	TEST_ASSERT(search_for_element(fp, "/a", &e) > 0);
+	TEST_ASSERT(search_for_element(fp, "/dir/file00001a", &e) > 0);
+	TEST_ASSERT(search_for_element(fp, "/zzz", &e) > 0);
+	TEST_ASSERT(e == NULL);
+
+	/* reading sequentially stops at the block index */
+	rewind(fp);
+	for (i = 0; i < n_elements + 1; ++i){
+		e = get_next_checksum_element(fp);
+		TEST_ASSERT(e);
+		TEST_FREE(e, free_element);
+	}
+	TEST_ASSERT(get_next_checksum_element(fp) == NULL);
+
+cleanup:
+	e ? free_element(e) : (void)0;
+	fp ? fclose(fp) : 0;
+	remove(fpstr);
+}
+
+void test_checksum_file_text(enum TEST_STATUS* status){
+	const char* fpstr = "checksum_text.txt";
+	const char* meta_hex = "0000000000000539" "0000000059682F00" "0000000059682F01" "DEADBEEFCAFEBABE";
+	FILE* fp = NULL;
+	struct element* e = NULL;
+	char path[64];
+	int i;
+
+	/* a sorted checksum file written by an older version */
+	fp = fopen(fpstr, "wb");
+	TEST_ASSERT(fp);
+	for (i = 0; i < 100; ++i){
+		sprintf(path, "/dir/file%05d", i);
+		fprintf(fp, "%s%c%s", path, '\0', sample_sha1_str);
+		if (i == 42){
+			fprintf(fp, "%c%s", '\0', meta_hex);
+		}
+		fputc('\n', fp);
+	}
+	TEST_ASSERT_FREE(fp, fclose);
+
+	fp = fopen(fpstr, "rb");
+	TEST_ASSERT(fp);
+	TEST_ASSERT(search_for_element(fp, "/dir/file00042", &e) == 0);
+	TEST_ASSERT(strcmp(e->checksum, sample_sha1_str) == 0);
+	TEST_ASSERT(e->meta);
+	TEST_ASSERT(e->meta->size == 1337);
+	TEST_FREE(e, free_element);
+	TEST_ASSERT(search_for_element(fp, "/dir/file00099", &e) == 0);
+	TEST_ASSERT(e->meta == NULL);
+	TEST_FREE(e, free_element);
+	TEST_ASSERT(search_for_element(fp, "/dir/noexist", &e) > 0);
+	TEST_ASSERT_FREE(fp, fclose);
+
+	/* records in the new format can be appended to it, and sorting converts all of it */
+	fp = fopen(fpstr, "ab");
+	TEST_ASSERT(fp);
+	TEST_ASSERT(add_hash_to_file("/a/new", sample_sha1_str, NULL, fp, NULL) == 0);
+	TEST_ASSERT_FREE(fp, fclose);
+	TEST_ASSERT(sort_checksum_file(fpstr, 0, 0) == 0);
+
+	fp = fopen(fpstr, "rb");
+	TEST_ASSERT(fp);
+	TEST_ASSERT(search_for_element(fp, "/a/new", &e) == 0);
+	TEST_FREE(e, free_element);
+	TEST_ASSERT(search_for_element(fp, "/dir/file00042", &e) == 0);
+	TEST_ASSERT(e->meta && e->meta->ino == (((uint64_t)0xDEADBEEFUL << 32) | 0xCAFEBABEUL));
+	TEST_FREE(e, free_element);
+
+cleanup:
+	e ? free_element(e) : (void)0;
+	fp ? fclose(fp) : 0;
+	remove(fpstr);
+}
+
+void test_checksum_reader(enum TEST_STATUS* status){
+	const char* fpstr = "checksum_reader.txt";
+	FILE* fp = NULL;
+	struct checksum_reader* cr = NULL;
+	const struct element* view;
+	struct element* second = NULL;
+	struct file_meta meta;
+	char path[300];
+	int i;
+
+	meta.size = 1;
+	meta.mtime = 2;
+	meta.ctime = 3;
+	meta.ino = 4;
+
+	/* an old text record followed by binary ones, some longer than the reader's buffer */
+	fp = fopen(fpstr, "wb");
+	TEST_ASSERT(fp);
+	fprintf(fp, "/text%c%s\n", '\0', sample_sha1_str);
+	for (i = 0; i < 50; ++i){
+		memset(path, 'a' + i % 26, i * 5 + 1);
+		path[i * 5 + 1] = '\0';
+		path[0] = '/';
+		TEST_ASSERT(add_hash_to_file(path, sample_sha1_str, i % 3 ? &meta : NULL, fp, NULL) == 0);
+	}
+	TEST_ASSERT_FREE(fp, fclose);
+
+	/* the reader has to give the same records as get_next_checksum_element() */
+	fp = fopen(fpstr, "rb");
+	TEST_ASSERT(fp);
+	cr = checksum_reader_new(fp, 16);
+	TEST_ASSERT(cr);
+	for (i = 0; i < 51; ++i){
+		long pos;
+
+		TEST_ASSERT(checksum_reader_next(cr, &view) == 0);
+		/* moving the FILE* behind the reader's back must not change what it reads next */
+		pos = ftell(fp);
+		fseek(fp, 0, SEEK_SET);
+		TEST_ASSERT(view->file && view->checksum);
+		TEST_ASSERT(strcmp(view->checksum, sample_sha1_str) == 0);
+		TEST_ASSERT(i == 0 ? strcmp(view->file, "/text") == 0 : strlen(view->file) == (size_t)(i - 1) * 5 + 1);
+		TEST_ASSERT((view->meta != NULL) == (i > 0 && (i - 1) % 3 != 0));
+		TEST_ASSERT(!view->meta || file_meta_cmp(view->meta, &meta) == 0);
+		fseek(fp, pos, SEEK_SET);
+		if (i == 1){
+			second = copy_element(view);
+			TEST_ASSERT(second);
+		}
+	}
+	TEST_ASSERT(checksum_reader_next(cr, &view) > 0);
+	TEST_ASSERT(view == NULL);
+
+	/* copies outlive the reader's buffer */
+	TEST_ASSERT(strcmp(second->file, "/") == 0);
+	TEST_ASSERT(second->meta == NULL);
+
+	/* seeking to the start goes through the header again */
+	checksum_reader_seek(cr, 0);
+	TEST_ASSERT(checksum_reader_next(cr, &view) == 0);
+	TEST_ASSERT(strcmp(view->file, "/text") == 0);
+
+cleanup:
+	checksum_reader_free(cr);
+	second ? free_element(second) : (void)0;
+	fp ? fclose(fp) : 0;
+	remove(fpstr);
+}
+
+/* checksum_index_load()
+ * checksum_index_may_contain()
+ * checksum_index_search() */
+void test_checksum_index(enum TEST_STATUS* status){
+	const char* fpstr = "checksum_index.txt";
+	const int n_elements = 1000;
+	struct checksum_index* ci = NULL;
+	FILE* fp = NULL;
+	struct element* e = NULL;
+	char path[64];
+	int n_false_positives = 0;
+	int i;
+
+	fp = fopen(fpstr, "wb");
+	TEST_ASSERT(fp);
+	/* only the even ones, so the odd ones can be looked for and not found */
+	for (i = n_elements - 2; i >= 0; i -= 2){
+		sprintf(path, "/dir/file%05d", i);
+		TEST_ASSERT(add_hash_to_file(path, sample_sha1_str, NULL, fp, NULL) == 0);
+	}
+	TEST_ASSERT_FREE(fp, fclose);
+
+	/* an unsorted file has no summary */
+	fp = fopen(fpstr, "rb");
+	TEST_ASSERT(fp);
+	TEST_ASSERT(checksum_index_load(fp, &ci) > 0);
+	TEST_ASSERT(ci == NULL);
+	TEST_ASSERT_FREE(fp, fclose);
+
+	TEST_ASSERT(sort_checksum_file(fpstr, 0, 0) == 0);
+
+	fp = fopen(fpstr, "rb");
+	TEST_ASSERT(fp);
+	TEST_ASSERT(checksum_index_load(fp, &ci) == 0);
+
+	for (i = 0; i < n_elements; ++i){
+		int res;
+
+		sprintf(path, "/dir/file%05d", i);
+		res = checksum_index_search(ci, fp, path, &e);
+		if (i % 2 == 0){
+			TEST_ASSERT(res == 0);
+			TEST_ASSERT(strcmp(e->file, path) == 0);
+			TEST_ASSERT(strcmp(e->checksum, sample_sha1_str) == 0);
+			TEST_FREE(e, free_element);
+		}
+		else{
+			TEST_ASSERT(res > 0);
+			TEST_ASSERT(e == NULL);
+			n_false_positives += checksum_index_may_contain(ci, path) != 0;
+		}
+	}
+	/* before and after every key */
+	TEST_ASSERT(checksum_index_search(ci, fp, "/a", &e) > 0);
+	TEST_ASSERT(checksum_index_search(ci, fp, "/z", &e) > 0);
+	/* about 1% are expected with 10 bits per key */
+	TEST_ASSERT(n_false_positives < n_elements / 2 / 20);
+
+	/* search_file_element() goes through the same summary */
+	TEST_ASSERT(search_file_element(fp, "/dir/file00500", &e) == 0);
+	TEST_FREE(e, free_element);
+	TEST_ASSERT(search_file_element(fp, "/dir/file00501", &e) > 0);
+
+cleanup:
+	checksum_index_free(ci);
+	fp ? fclose(fp) : 0;
+	free_element(e);
+	remove(fpstr);
+}
+
+void test_create_initial_runs(enum TEST_STATUS* status){
+	const char* fpstr = "checksum_runs.txt";
+	const int n_elements = 500;
+	struct TMPFILE** runs = NULL;
+	size_t n_runs = 0;
+	struct file_meta meta;
+	struct checksum_reader* cr = NULL;
+	const struct element* rec;
+	struct element* e = NULL;
+	FILE* fp = NULL;
+	char path[64];
+	char prev[64];
+	size_t i;
+	int res;
+	int n_read = 0;
+
+	fp = fopen(fpstr, "wb");
+	TEST_ASSERT(fp);
+	/* out of order, and only some of them have metadata */
+	for (i = 0; i < (size_t)n_elements; ++i){
+		sprintf(path, "/dir/file%05lu", (unsigned long)((i * 7919) % n_elements));
+		meta.size = i;
+		meta.mtime = i * 2;
+		meta.ctime = i * 3;
+		meta.ino = i * 4;
+		TEST_ASSERT(add_hash_to_file(path, sample_sha1_str, i % 3 ? &meta : NULL, fp, NULL) == 0);
+	}
+	TEST_ASSERT_FREE(fp, fclose);
+
+	fp = fopen(fpstr, "rb");
+	TEST_ASSERT(fp);
+	TEST_ASSERT(create_initial_runs(fp, 2048, &runs, &n_runs) == 0);
+	/* more runs than sorting threads, so the jobs get reused */
+	TEST_ASSERT(n_runs > CHECKSUM_SORT_THREADS);
+
+	for (i = 0; i < n_runs; ++i){
+		/* closed to save file descriptors until the merge */
+		TEST_ASSERT(runs[i]->fp == NULL);
+		TEST_ASSERT((runs[i]->fp = fopen(runs[i]->name, "rb")) != NULL);
+
+		/* runs are front-coded, so they have to be read with a checksum_reader */
+		TEST_ASSERT((cr = checksum_reader_new(runs[i]->fp, 0)) != NULL);
+		prev[0] = '\0';
+		while ((res = checksum_reader_next(cr, &rec)) == 0){
+			TEST_ASSERT(strcmp(prev, rec->file) < 0);
+			TEST_ASSERT(strcmp(rec->checksum, sample_sha1_str) == 0);
+			/* the metadata has to come along with the record it belongs to */
+			if (rec->meta){
+				TEST_ASSERT(rec->meta->mtime == rec->meta->size * 2);
+				TEST_ASSERT(rec->meta->ino == rec->meta->size * 4);
+				TEST_ASSERT(rec->meta->size % 3 != 0);
+			}
+			strcpy(prev, rec->file);
+			n_read++;
+		}
+		TEST_ASSERT(res > 0);
+		TEST_FREE(cr, checksum_reader_free);
+	}
+	TEST_ASSERT(n_read == n_elements);
+
+	/* more runs than the fan-in, so this takes more than one pass */
+	checksum_set_max_fan_in(3);
+	TEST_ASSERT(checksum_merge_fan_in() >= 2 && checksum_merge_fan_in() <= 3);
+	TEST_ASSERT(n_runs > checksum_merge_fan_in() * checksum_merge_fan_in());
+	TEST_ASSERT_FREE(fp, fclose);
+	fp = fopen(fpstr, "wb");
+	TEST_ASSERT(fp);
+	TEST_ASSERT(merge_files(runs, n_runs, fp, 0) == 0);
+	TEST_ASSERT_FREE(fp, fclose);
+
+	fp = fopen(fpstr, "rb");
+	TEST_ASSERT(fp);
+	prev[0] = '\0';
+	n_read = 0;
+	while ((e = get_next_checksum_element(fp)) != NULL){
+		TEST_ASSERT(strcmp(prev, e->file) < 0);
+		strcpy(prev, e->file);
+		n_read++;
+		TEST_FREE(e, free_element);
+	}
+	TEST_ASSERT(n_read == n_elements);
+	TEST_ASSERT(search_file_element(fp, "/dir/file00250", &e) == 0);
+
+cleanup:
+	checksum_set_max_fan_in(0);
+	checksum_reader_free(cr);
+	for (i = 0; i < n_runs; ++i){
+		temp_fclose(runs[i]);
+	}
+	free(runs);
+	fp ? fclose(fp) : 0;
+	free_element(e);
+	remove(fpstr);
+}
+
+void test_sort_checksum_file_memory(enum TEST_STATUS* status){
+	const char* fp_memory_str = "checksum_memory.txt";
+	const char* fp_runs_str = "checksum_runs.txt";
+	struct file_meta meta;
+	FILE* fp = NULL;
+	char path[64];
+	int i;
+
+	fp = fopen(fp_memory_str, "wb");
+	TEST_ASSERT(fp);
+	for (i = 0; i < 500; ++i){
+		sprintf(path, "/dir/file%05d", (i * 7919) % 500);
+		meta.size = i;
+		meta.mtime = meta.ctime = meta.ino = 0;
+		TEST_ASSERT(add_hash_to_file(path, sample_sha1_str, i % 2 ? &meta : NULL, fp, NULL) == 0);
+	}
+	TEST_ASSERT_FREE(fp, fclose);
+	TEST_ASSERT(copy_file(fp_memory_str, fp_runs_str) == 0);
+
+	/* a picked budget is never too small for this, while 2KB takes many runs */
+	TEST_ASSERT(checksum_sort_memory(0) >= CHECKSUM_SORT_MIN_MEMORY);
+	TEST_ASSERT(checksum_sort_memory(2048) == 2048);
+	TEST_ASSERT(sort_checksum_file(fp_memory_str, 0, 0) == 0);
+	TEST_ASSERT(sort_checksum_file(fp_runs_str, 2048, 0) == 0);
+
+	/* either way has to come out the same */
+	TEST_ASSERT(memcmp_file_file(fp_memory_str, fp_runs_str) == 0);
+
+cleanup:
+	fp ? fclose(fp) : 0;
+	remove(fp_memory_str);
+	remove(fp_runs_str);
+}
+
+void test_copy_sorted(enum TEST_STATUS* status){
+	const char* fp_sorted_str = "checksum_sorted.txt";
+	const char* fp_shuffled_str = "checksum_shuffled.txt";
+	const char* fp_out_str = "checksum_out.txt";
+	struct file_meta meta;
+	FILE* fp_sorted = NULL;
+	FILE* fp_shuffled = NULL;
+	FILE* fp_out = NULL;
+	char path[64];
+	int i;
+
+	fp_sorted = fopen(fp_sorted_str, "wb");
+	fp_shuffled = fopen(fp_shuffled_str, "wb");
+	TEST_ASSERT(fp_sorted && fp_shuffled);
+	meta.mtime = meta.ctime = meta.ino = 0;
+	for (i = 0; i < 500; ++i){
+		meta.size = i;
+		sprintf(path, "/dir/file%05d", i);
+		TEST_ASSERT(add_hash_to_file(path, sample_sha1_str, &meta, fp_sorted, NULL) == 0);
+		meta.size = (i * 7919) % 500;
+		sprintf(path, "/dir/file%05d", (i * 7919) % 500);
+		TEST_ASSERT(add_hash_to_file(path, sample_sha1_str, &meta, fp_shuffled, NULL) == 0);
+	}
+	TEST_ASSERT_FREE(fp_sorted, fclose);
+	TEST_ASSERT_FREE(fp_shuffled, fclose);
+
+	/* an unsorted list leaves nothing behind for the real sort */
+	fp_shuffled = fopen(fp_shuffled_str, "rb");
+	fp_out = fopen(fp_out_str, "w+b");
+	TEST_ASSERT(fp_shuffled && fp_out);
+	TEST_ASSERT(copy_sorted(fp_shuffled, fp_out, 1) > 0);
+	TEST_ASSERT(ftell(fp_out) == 0);
+	TEST_ASSERT_FREE(fp_shuffled, fclose);
+	TEST_ASSERT_FREE(fp_out, fclose);
+	TEST_ASSERT(get_file_size(fp_out_str) == 0);
+
+	/* a sorted one comes out the same as if it had been sorted */
+	fp_sorted = fopen(fp_sorted_str, "rb");
+	fp_out = fopen(fp_out_str, "wb");
+	TEST_ASSERT(fp_sorted && fp_out);
+	TEST_ASSERT(copy_sorted(fp_sorted, fp_out, 1) == 0);
+	TEST_ASSERT_FREE(fp_sorted, fclose);
+	TEST_ASSERT_FREE(fp_out, fclose);
+	TEST_ASSERT(sort_checksum_file(fp_shuffled_str, 2048, 1) == 0);
+	TEST_ASSERT(memcmp_file_file(fp_out_str, fp_shuffled_str) == 0);
+
+	/* and so does sorting what is already sorted */
+	TEST_ASSERT(sort_checksum_file(fp_sorted_str, 2048, 1) == 0);
+	TEST_ASSERT(memcmp_file_file(fp_sorted_str, fp_shuffled_str) == 0);
+	TEST_ASSERT(sort_checksum_file(fp_sorted_str, 0, 1) == 0);
+	TEST_ASSERT(memcmp_file_file(fp_sorted_str, fp_shuffled_str) == 0);
+
+cleanup:
+	fp_sorted ? fclose(fp_sorted) : 0;
+	fp_shuffled ? fclose(fp_shuffled) : 0;
+	fp_out ? fclose(fp_out) : 0;
+	remove(fp_sorted_str);
+	remove(fp_shuffled_str);
+	remove(fp_out_str);
+}
+
+void test_sort_checksum_file_front_code(enum TEST_STATUS* status){
+	const char* fp_plain_str = "checksum_plain.txt";
+	const char* fp_front_str = "checksum_front.txt";
+	const char* fp_front_runs_str = "checksum_front_runs.txt";
+	struct checksum_reader* cr_plain = NULL;
+	struct checksum_reader* cr_front = NULL;
+	const struct element* e_plain;
+	const struct element* e_front;
+	struct element* e = NULL;
+	struct file_meta meta;
+	FILE* fp_plain = NULL;
+	FILE* fp_front = NULL;
+	char path[128];
+	int res_plain;
+	int res_front;
+	int i;
+
+	fp_plain = fopen(fp_plain_str, "wb");
+	TEST_ASSERT(fp_plain);
+	for (i = 0; i < 500; ++i){
+		int n = (i * 7919) % 500;
+
+		sprintf(path, "/home/user/projects/ezbackup/%s/file%05d", n % 3 ? "src" : "tests", n);
+		meta.size = i;
+		meta.mtime = meta.ctime = meta.ino = 0;
+		TEST_ASSERT(add_hash_to_file(path, sample_sha1_str, i % 2 ? &meta : NULL, fp_plain, NULL) == 0);
+	}
+	TEST_ASSERT_FREE(fp_plain, fclose);
+	TEST_ASSERT(copy_file(fp_plain_str, fp_front_str) == 0);
+	TEST_ASSERT(copy_file(fp_plain_str, fp_front_runs_str) == 0);
+
+	TEST_ASSERT(sort_checksum_file(fp_plain_str, 0, 0) == 0);
+	TEST_ASSERT(sort_checksum_file(fp_front_str, 0, 1) == 0);
+	TEST_ASSERT(sort_checksum_file(fp_front_runs_str, 2048, 1) == 0);
+	TEST_ASSERT(memcmp_file_file(fp_front_str, fp_front_runs_str) == 0);
+	TEST_ASSERT(get_file_size(fp_front_str) < get_file_size(fp_plain_str));
+
+	/* the same records come out of both */
+	fp_plain = fopen(fp_plain_str, "rb");
+	fp_front = fopen(fp_front_str, "rb");
+	TEST_ASSERT(fp_plain && fp_front);
+	cr_plain = checksum_reader_new(fp_plain, 0);
+	cr_front = checksum_reader_new(fp_front, 0);
+	TEST_ASSERT(cr_plain && cr_front);
+	do{
+		res_plain = checksum_reader_next(cr_plain, &e_plain);
+		res_front = checksum_reader_next(cr_front, &e_front);
+		TEST_ASSERT(res_plain >= 0 && res_plain == res_front);
+		if (res_plain == 0){
+			TEST_ASSERT(strcmp(e_plain->file, e_front->file) == 0);
+			TEST_ASSERT(strcmp(e_plain->checksum, e_front->checksum) == 0);
+			TEST_ASSERT(!e_plain->meta == !e_front->meta);
+			TEST_ASSERT(!e_plain->meta || file_meta_cmp(e_plain->meta, e_front->meta) == 0);
+		}
+	}while (res_plain == 0);
+
+	/* every block starts with a whole path, so lookups work the same */
+	for (i = 0; i < 500; i += 7){
+		sprintf(path, "/home/user/projects/ezbackup/%s/file%05d", i % 3 ? "src" : "tests", i);
+		TEST_ASSERT(search_file_element(fp_front, path, &e) == 0);
+		TEST_ASSERT(strcmp(e->file, path) == 0);
+		TEST_FREE(e, free_element);
+	}
+	TEST_ASSERT(search_file_element(fp_front, "/home/user/projects/ezbackup/src/file00000", &e) > 0);
+
+cleanup:
+	checksum_reader_free(cr_plain);
+	checksum_reader_free(cr_front);
+	fp_plain ? fclose(fp_plain) : 0;
+	fp_front ? fclose(fp_front) : 0;
+	free_element(e);
+	remove(fp_plain_str);
+	remove(fp_front_str);
+	remove(fp_front_runs_str);
+}
+
+void test_checksum_file_artifact(enum TEST_STATUS* status){
+	const char* fp_str = "checksum_artifact.txt";
+	const char* artifact = "0123456789ABCDEF0123456789ABCDEF01234567";
+	struct checksum_reader* cr = NULL;
+	const struct element* next;
+	struct element* e = NULL;
+	FILE* fp = NULL;
+	unsigned char header[CHECKSUM_HEADER_LEN];
+	char path[64];
+	int n = 0;
+	int i;
+
+	fp = fopen(fp_str, "wb");
+	TEST_ASSERT(fp);
+	for (i = 0; i < 100; ++i){
+		sprintf(path, "/srv/file%03d", (i * 37) % 100);
+		TEST_ASSERT(add_hash_to_file_ex(path, sample_sha1_str, i % 2 ? artifact : NULL, NULL, fp, NULL) == 0);
+	}
+	TEST_ASSERT_FREE(fp, fclose);
+
+	TEST_ASSERT(sort_checksum_file(fp_str, 0, 1) == 0);
+
+	/* older versions cannot skip an artifact checksum, so they have to refuse the file */
+	fp = fopen(fp_str, "rb");
+	TEST_ASSERT(fp);
+	TEST_ASSERT(fread(header, 1, sizeof(header), fp) == sizeof(header));
+	TEST_ASSERT(header[4] == CHECKSUM_VERSION);
+
+	TEST_ASSERT(fseek(fp, 0, SEEK_SET) == 0);
+	cr = checksum_reader_new(fp, 0);
+	TEST_ASSERT(cr);
+	while (checksum_reader_next(cr, &next) == 0){
+		int odd;
+
+		TEST_ASSERT(sscanf(next->file, "/srv/file%03d", &i) == 1);
+		/* multiplying by 37 mod 100 keeps a number odd or even, so the odd files are the ones written with an artifact checksum */
+		odd = i % 2;
+		TEST_ASSERT(strcmp(next->checksum, sample_sha1_str) == 0);
+		TEST_ASSERT(odd ? next->artifact && strcmp(next->artifact, artifact) == 0 : !next->artifact);
+		n++;
+	}
+	TEST_ASSERT(n == 100);
+
+	TEST_ASSERT(search_file_element(fp, "/srv/file041", &e) == 0);
+	TEST_ASSERT(e->artifact && strcmp(e->artifact, artifact) == 0);
+	TEST_FREE(e, free_element);
+	TEST_ASSERT(search_file_element(fp, "/srv/file042", &e) == 0);
+	TEST_ASSERT(!e->artifact);
+
+cleanup:
+	checksum_reader_free(cr);
+	fp ? fclose(fp) : 0;
+	free_element(e);
+	remove(fp_str);
+}
+
+void test_multikey_sort_elements(enum TEST_STATUS* status){
+	/* prefixes of each other, duplicates, bytes above 0x7F, and paths that only differ past the first 8 bytes */
+	const char* const samples[] = {
+		"/srv/data/a",
+		"/srv/data/a/b",
+		"/srv/data/a",
+		"/srv/data",
+		"/srv/datb",
+		"/srv/data/\xC3\xA9t\xC3\xA9",
+		"/srv/data/zzz",
+		"/",
+		"/srv/data/projects/12345678",
+		"/srv/data/projects/12345677",
+		"/srv/data/projects/1234567"
+	};
+	const size_t n_elements = 1000;
+	struct element* elements = NULL;
+	struct element** sorted = NULL;
+	struct element** expected = NULL;
+	char path[64];
+	size_t i;
+
+	elements = calloc(n_elements, sizeof(*elements));
+	sorted = malloc(n_elements * sizeof(*sorted));
+	expected = malloc(n_elements * sizeof(*expected));
+	TEST_ASSERT(elements && sorted && expected);
+
+	for (i = 0; i < n_elements; ++i){
+		if (i < sizeof(samples) / sizeof(samples[0])){
+			strcpy(path, samples[i]);
+		}
+		else{
+			sprintf(path, "/srv/data/projects/%03lu/file%lu", (unsigned long)((i * 31) % 97), (unsigned long)((i * 7919) % 251));
+		}
+		elements[i].file = malloc(strlen(path) + 1);
+		TEST_ASSERT(elements[i].file);
+		strcpy(elements[i].file, path);
+		sorted[i] = expected[i] = &elements[i];
+	}
+
+	quicksort_elements(expected, 0, (int)n_elements - 1);
+	multikey_sort_elements(sorted, n_elements);
+	for (i = 0; i < n_elements; ++i){
+		TEST_ASSERT(strcmp(sorted[i]->file, expected[i]->file) == 0);
+	}
+
+cleanup:
+	for (i = 0; elements && i < n_elements; ++i){
+		free(elements[i].file);
+	}
+	free(elements);
+	free(sorted);
+	free(expected);
+}
+
+void test_adaptive_sort_elements(enum TEST_STATUS* status){
+	const size_t n_elements = 2000;
+	struct element* elements = NULL;
+	struct element** sorted = NULL;
+	struct element** expected = NULL;
+	char path[64];
+	size_t i;
+	int layout;
+
+	elements = calloc(n_elements, sizeof(*elements));
+	sorted = malloc(n_elements * sizeof(*sorted));
+	expected = malloc(n_elements * sizeof(*expected));
+	TEST_ASSERT(elements && sorted && expected);
+
+	/* already sorted, a few sorted pieces out of order, nearly sorted, backwards, and shuffled */
+	for (layout = 0; layout < 5; ++layout){
+		for (i = 0; i < n_elements; ++i){
+			size_t key;
+
+			switch (layout){
+			case 0:
+				key = i;
+				break;
+			case 1:
+				key = (i + n_elements / 3) % n_elements;
+				break;
+			case 2:
+				key = i % 100 == 0 ? n_elements - i : i;
+				break;
+			case 3:
+				key = n_elements - i;
+				break;
+			default:
+				key = (i * 7919) % n_elements;
+				break;
+			}
+			/* duplicates too */
+			sprintf(path, "/srv/data/%05lu", (unsigned long)(key / 2));
+			free(elements[i].file);
+			elements[i].file = malloc(strlen(path) + 1);
+			TEST_ASSERT(elements[i].file);
+			strcpy(elements[i].file, path);
+			sorted[i] = expected[i] = &elements[i];
+		}
+
+		quicksort_elements(expected, 0, (int)n_elements - 1);
+		adaptive_sort_elements(sorted, n_elements);
+		for (i = 0; i < n_elements; ++i){
+			TEST_ASSERT(strcmp(sorted[i]->file, expected[i]->file) == 0);
+		}
+	}
+
+cleanup:
+	for (i = 0; elements && i < n_elements; ++i){
+		free(elements[i].file);
+	}
+	free(elements);
+	free(sorted);
+	free(expected);
+}
+
 void test_create_removed_list(enum TEST_STATUS* status){
 	FILE* fp1 = NULL;
 	const char* fp1str = "checksum1.txt";
@@ -269,7 +981,7 @@ void test_create_removed_list(enum TEST_STATUS* status){
 	/* do the same shuffle as above */
 	for (i = 1; i < files_len; i += 2){
 		int res;
-		res = add_checksum_to_file(files[i], EVP_sha1(), fp1, NULL);
+		res = add_checksum_to_file(files[i], EVP_sha1(), fp1, NULL, NULL);
 		TEST_ASSERT(res >= 0);
 		if (res == 1){
 			printf("Old element: %s\n", files[i]);
@@ -277,7 +989,7 @@ void test_create_removed_list(enum TEST_STATUS* status){
 	}
 	for (i = 0; i < files_len; i += 2){
 		int res;
-		res = add_checksum_to_file(files[i], EVP_sha1(), fp1, NULL);
+		res = add_checksum_to_file(files[i], EVP_sha1(), fp1, NULL, NULL);
 		TEST_ASSERT(res >= 0);
 		if (res == 1){
 			printf("Old element: %s\n", files[i]);
@@ -311,3 +1023,211 @@ cleanup:
 	remove(fp1str);
 	remove(fp2str);
 }
+
+void test_checksum_file_meta(enum TEST_STATUS* status){
+	const char* fpstr = "checksum_meta.txt";
+	FILE* fp = NULL;
+	struct file_meta meta;
+	struct element* e = NULL;
+
+	meta.size = 1337;
+	meta.mtime = 1500000000;
+	meta.ctime = 1500000001;
+	/* make sure both 32-bit halves survive */
+	meta.ino = ((uint64_t)0xDEADBEEFUL << 32) | 0xCAFEBABEUL;
+
+	fp = fopen(fpstr, "wb");
+	TEST_ASSERT(fp);
+	TEST_ASSERT(add_hash_to_file("/a/with_meta", sample_sha1_str, &meta, fp, NULL) == 0);
+	TEST_ASSERT(add_hash_to_file("/a/without_meta", sample_sha1_str, NULL, fp, NULL) == 0);
+	TEST_ASSERT_FREE(fp, fclose);
+
+	/* the metadata has to survive sorting */
+	TEST_ASSERT(sort_checksum_file(fpstr, 0, 0) == 0);
+
+	fp = fopen(fpstr, "rb");
+	TEST_ASSERT(fp);
+
+	TEST_ASSERT(search_for_element(fp, "/a/with_meta", &e) == 0);
+	TEST_ASSERT(strcmp(e->checksum, sample_sha1_str) == 0);
+	TEST_ASSERT(e->meta);
+	TEST_ASSERT(file_meta_cmp(e->meta, &meta) == 0);
+	TEST_FREE(e, free_element);
+
+	TEST_ASSERT(search_for_element(fp, "/a/without_meta", &e) == 0);
+	TEST_ASSERT(strcmp(e->checksum, sample_sha1_str) == 0);
+	TEST_ASSERT(e->meta == NULL);
+	TEST_FREE(e, free_element);
+
+	TEST_ASSERT(search_for_element(fp, "/a/noexist", &e) > 0);
+	TEST_ASSERT(e == NULL);
+
+cleanup:
+	e ? free_element(e) : (void)0;
+	fp ? fclose(fp) : 0;
+	remove(fpstr);
+}
+
+void test_create_checksum_delta(enum TEST_STATUS* status){
+	const char* fp_prev_str = "checksum_prev.txt";
+	const char* fp_next_str = "checksum_next.txt";
+	const char* fp_delta_str = "checksum_delta.txt";
+	struct checksum_reader* cr = NULL;
+	const struct element* e;
+	struct file_meta meta;
+	FILE* fp_prev = NULL;
+	FILE* fp_next = NULL;
+	FILE* fp_delta = NULL;
+	size_t n_removed = 0;
+	size_t n_changed = 0;
+	size_t n_new = 0;
+	char path[64];
+	int res;
+	int i;
+
+	fp_prev = fopen(fp_prev_str, "wb");
+	fp_next = fopen(fp_next_str, "wb");
+	TEST_ASSERT(fp_prev && fp_next);
+	meta.mtime = meta.ctime = meta.ino = 0;
+	for (i = 0; i < 200; ++i){
+		sprintf(path, "/dir/file%04d", i);
+		meta.size = i;
+		TEST_ASSERT(add_hash_to_file(path, sample_sha1_str, &meta, fp_prev, NULL) == 0);
+		/* every 5th one is removed, and every 7th one that is left is modified */
+		if (i % 5 == 0){
+			continue;
+		}
+		meta.size = i % 7 == 0 ? i + 1 : i;
+		TEST_ASSERT(add_hash_to_file(path, sample_sha1_str, &meta, fp_next, NULL) == 0);
+	}
+	for (i = 0; i < 10; ++i){
+		sprintf(path, "/dir/new%04d", i);
+		TEST_ASSERT(add_hash_to_file(path, sample_sha1_str, NULL, fp_next, NULL) == 0);
+	}
+	TEST_ASSERT_FREE(fp_prev, fclose);
+	TEST_ASSERT_FREE(fp_next, fclose);
+	TEST_ASSERT(sort_checksum_file(fp_prev_str, 0, 1) == 0);
+	TEST_ASSERT(sort_checksum_file(fp_next_str, 0, 0) == 0);
+
+	/* nothing changed between a file and itself */
+	fp_prev = fopen(fp_prev_str, "rb");
+	TEST_ASSERT(fp_prev);
+	TEST_ASSERT(create_checksum_delta(fp_prev, fp_prev_str, fp_delta_str) > 0);
+	TEST_ASSERT(get_file_size(fp_delta_str) == 0);
+
+	/* wherever the file was left, it is read from the start */
+	TEST_ASSERT(fseek(fp_prev, 10, SEEK_SET) == 0);
+	TEST_ASSERT(create_checksum_delta(fp_prev, fp_next_str, fp_delta_str) == 0);
+
+	fp_delta = fopen(fp_delta_str, "rb");
+	TEST_ASSERT(fp_delta);
+	cr = checksum_reader_new(fp_delta, 0);
+	TEST_ASSERT(cr);
+	while ((res = checksum_reader_next(cr, &e)) == 0){
+		if (strncmp(e->file, "/dir/new", strlen("/dir/new")) == 0){
+			TEST_ASSERT(strcmp(e->checksum, sample_sha1_str) == 0);
+			n_new++;
+			continue;
+		}
+		TEST_ASSERT(sscanf(e->file, "/dir/file%04d", &i) == 1);
+		if (i % 5 == 0){
+			TEST_ASSERT(strcmp(e->checksum, "") == 0);
+			n_removed++;
+		}
+		else{
+			TEST_ASSERT(i % 7 == 0);
+			TEST_ASSERT(e->meta && e->meta->size == (uint64_t)i + 1);
+			n_changed++;
+		}
+	}
+	TEST_ASSERT(res > 0);
+	TEST_ASSERT(n_removed == 40);
+	TEST_ASSERT(n_changed == 23);
+	TEST_ASSERT(n_new == 10);
+
+cleanup:
+	checksum_reader_free(cr);
+	fp_prev ? fclose(fp_prev) : 0;
+	fp_next ? fclose(fp_next) : 0;
+	fp_delta ? fclose(fp_delta) : 0;
+	remove(fp_prev_str);
+	remove(fp_next_str);
+	remove(fp_delta_str);
+}
+
+struct sync_writer{
+	FILE* fp;
+	int id;
+	int failed;
+};
+
+static void* sync_writer_run(void* arg){
+	struct sync_writer* sw = arg;
+	char path[64];
+	int i;
+
+	for (i = 0; i < 500; ++i){
+		sprintf(path, "/dir/writer%d/file%04d", sw->id, i);
+		if (add_hash_to_file(path, sample_sha1_str, NULL, sw->fp, NULL) < 0){
+			sw->failed = 1;
+		}
+	}
+	return NULL;
+}
+
+/* sync_checksum_file() */
+void test_sync_checksum_file(enum TEST_STATUS* status){
+	const char* fp_str = "checksum_sync.txt";
+	struct sync_writer sw[4];
+	pthread_t threads[4];
+	size_t n_threads = 0;
+	long lens[64];
+	size_t n_lens = 0;
+	unsigned char* data = NULL;
+	FILE* fp = NULL;
+	size_t i;
+
+	fp = fopen(fp_str, "wb");
+	TEST_ASSERT(fp);
+	for (n_threads = 0; n_threads < sizeof(sw) / sizeof(sw[0]); ++n_threads){
+		sw[n_threads].fp = fp;
+		sw[n_threads].id = (int)n_threads;
+		sw[n_threads].failed = 0;
+		TEST_ASSERT(pthread_create(&threads[n_threads], NULL, sync_writer_run, &sw[n_threads]) == 0);
+	}
+	/* taken while the writers are still going */
+	for (n_lens = 0; n_lens < sizeof(lens) / sizeof(lens[0]); ++n_lens){
+		TEST_ASSERT((lens[n_lens] = sync_checksum_file(fp)) >= 0);
+	}
+	for (; n_threads > 0; --n_threads){
+		pthread_join(threads[n_threads - 1], NULL);
+		TEST_ASSERT(!sw[n_threads - 1].failed);
+	}
+	TEST_ASSERT(sync_checksum_file(fp) == (long)get_file_size(fp_str));
+	TEST_ASSERT_FREE(fp, fclose);
+
+	TEST_ASSERT(data = malloc(get_file_size(fp_str)));
+	fp = fopen(fp_str, "rb");
+	TEST_ASSERT(fp);
+	TEST_ASSERT(fread(data, 1, get_file_size(fp_str), fp) == get_file_size(fp_str));
+
+	/* every length ends on a whole record, so the records before it read back without error */
+	for (i = 0; i < n_lens; ++i){
+		struct checksum_reader* cr = checksum_reader_new_buf(data, lens[i], 0);
+		const struct element* e;
+		int res;
+
+		TEST_ASSERT(cr);
+		while ((res = checksum_reader_next(cr, &e)) == 0);
+		checksum_reader_free(cr);
+		TEST_ASSERT(res > 0);
+	}
+
+cleanup:
+	for (; n_threads > 0; --n_threads){
+		pthread_join(threads[n_threads - 1], NULL);
+	}
+	fp ? fclose(fp) : 0;
+	free(data);
+	remove(fp_str);
+}
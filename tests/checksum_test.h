@@ -15,7 +15,21 @@ void test_bytes_to_hex(enum TEST_STATUS* status);
 void test_checksum(enum TEST_STATUS* status);
 void test_sort_checksum_file(enum TEST_STATUS* status);
 void test_search_for_checksum(enum TEST_STATUS* status);
+void test_checksum_file_meta(enum TEST_STATUS* status);
+void test_checksum_file_binary(enum TEST_STATUS* status);
+void test_checksum_file_text(enum TEST_STATUS* status);
+void test_checksum_reader(enum TEST_STATUS* status);
+void test_checksum_index(enum TEST_STATUS* status);
+void test_create_initial_runs(enum TEST_STATUS* status);
+void test_sort_checksum_file_memory(enum TEST_STATUS* status);
+void test_sort_checksum_file_front_code(enum TEST_STATUS* status);
+void test_copy_sorted(enum TEST_STATUS* status);
+void test_checksum_file_artifact(enum TEST_STATUS* status);
+void test_multikey_sort_elements(enum TEST_STATUS* status);
+void test_adaptive_sort_elements(enum TEST_STATUS* status);
 void test_create_removed_list(enum TEST_STATUS* status);
+void test_create_checksum_delta(enum TEST_STATUS* status);
+void test_sync_checksum_file(enum TEST_STATUS* status);
 
 EXPORT_PKG(checksum_pkg);
 #endif
@@ -0,0 +1,165 @@
+/** @file tests/chunkstore_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "chunkstore_test.h"
+#include "../chunkstore.h"
+#include "../checksum.h"
+#include "../filehelper.h"
+#include "../options/options.h"
+#include "../log.h"
+#include <stdlib.h>
+#include <string.h>
+
+const struct unit_test chunkstore_tests[] = {
+	MAKE_TEST(test_chunk_boundary),
+	MAKE_TEST(test_chunk_store_file),
+	MAKE_TEST(test_chunk_store_file_shifted)
+};
+MAKE_PKG(chunkstore_tests, chunkstore_pkg);
+
+/* fill_sample_data() repeats itself, so it would never hit a content-defined boundary */
+static void fill_random_data(unsigned char* data, size_t len){
+	unsigned long x = 1337;
+	size_t i;
+
+	for (i = 0; i < len; ++i){
+		x = (x * 1103515245UL + 12345UL) & 0xFFFFFFFFUL;
+		data[i] = (unsigned char)(x >> 16);
+	}
+}
+
+void test_chunk_boundary(enum TEST_STATUS* status){
+	const size_t data_len = 4 * CHUNK_MAX_SIZE;
+	unsigned char* data = NULL;
+	size_t pos;
+	size_t n_chunks = 0;
+
+	data = malloc(data_len);
+	TEST_ASSERT(data);
+	fill_random_data(data, data_len);
+
+	for (pos = 0; pos < data_len; ){
+		size_t len = chunk_boundary(data + pos, data_len - pos);
+		TEST_ASSERT(len > 0);
+		TEST_ASSERT(len <= CHUNK_MAX_SIZE);
+		TEST_ASSERT(len >= CHUNK_MIN_SIZE || pos + len == data_len);
+		/* the same input always gives the same boundary */
+		TEST_ASSERT(chunk_boundary(data + pos, data_len - pos) == len);
+		pos += len;
+		n_chunks++;
+	}
+	TEST_ASSERT(n_chunks > 4);
+
+	TEST_ASSERT(chunk_boundary(data, 100) == 100);
+	TEST_ASSERT(chunk_boundary(data, 0) == 0);
+
+cleanup:
+	free(data);
+}
+
+void test_chunk_store_file(enum TEST_STATUS* status){
+	const char* file = "file.txt";
+	const char* manifest = "file.txt.manifest";
+	const char* file_restore = "file_restore.txt";
+	const char* chunk_dir = "chunks";
+	const size_t data_len = 3 * CHUNK_MAX_SIZE + 1337;
+	unsigned char* data = NULL;
+	struct options* opt = NULL;
+	struct string_array* new_chunks = NULL;
+	char* hash = NULL;
+	char* hash_expected = NULL;
+	size_t i;
+
+	data = malloc(data_len);
+	TEST_ASSERT(data);
+	fill_random_data(data, data_len);
+	create_file(file, data, data_len);
+
+	opt = options_new();
+	TEST_ASSERT(opt);
+	opt->c_type = COMPRESSOR_GZIP;
+	opt->enc_algorithm = EVP_aes_256_cbc();
+	opt->hash_algorithm = EVP_sha256();
+
+	TEST_ASSERT(chunk_store_file(file, manifest, chunk_dir, opt, "hunter2", &hash, &new_chunks) == 0);
+	TEST_ASSERT(hash);
+	TEST_ASSERT(checksum_bytestring(file, EVP_sha256(), &hash_expected) == 0);
+	TEST_ASSERT(strcmp(hash, hash_expected) == 0);
+	TEST_ASSERT(new_chunks && new_chunks->len > 1);
+	for (i = 0; i < new_chunks->len; ++i){
+		TEST_ASSERT(file_exists(new_chunks->strings[i]));
+	}
+	TEST_ASSERT(is_chunk_manifest(manifest));
+	TEST_ASSERT(!is_chunk_manifest(file));
+
+	TEST_ASSERT(chunk_restore_file(manifest, chunk_dir, file_restore, opt, "hunter2") == 0);
+	TEST_ASSERT(memcmp_file_file(file, file_restore) == 0);
+
+	/* everything is already in the store the second time around */
+	TEST_FREE(new_chunks, sa_free);
+	TEST_ASSERT(chunk_store_file(file, manifest, chunk_dir, opt, "hunter2", NULL, &new_chunks) == 0);
+	TEST_ASSERT(new_chunks && new_chunks->len == 0);
+
+cleanup:
+	new_chunks ? sa_free(new_chunks) : (void)0;
+	opt ? options_free(opt) : (void)0;
+	free(data);
+	free(hash);
+	free(hash_expected);
+	remove(file);
+	remove(manifest);
+	remove(file_restore);
+	cleanup_test_environment(chunk_dir, NULL);
+}
+
+void test_chunk_store_file_shifted(enum TEST_STATUS* status){
+	const char* file1 = "file1.txt";
+	const char* file2 = "file2.txt";
+	const char* manifest1 = "file1.txt.manifest";
+	const char* manifest2 = "file2.txt.manifest";
+	const char* file_restore = "file_restore.txt";
+	const char* chunk_dir = "chunks";
+	const size_t data_len = 4 * CHUNK_MAX_SIZE;
+	unsigned char* data = NULL;
+	struct options* opt = NULL;
+	struct string_array* new_chunks1 = NULL;
+	struct string_array* new_chunks2 = NULL;
+
+	data = malloc(data_len);
+	TEST_ASSERT(data);
+	fill_random_data(data, data_len);
+	create_file(file1, data + 100, data_len - 100);
+	/* the same data with 100 extra bytes in front */
+	create_file(file2, data, data_len);
+
+	opt = options_new();
+	TEST_ASSERT(opt);
+	opt->c_type = COMPRESSOR_NONE;
+	opt->enc_algorithm = NULL;
+
+	TEST_ASSERT(chunk_store_file(file1, manifest1, chunk_dir, opt, NULL, NULL, &new_chunks1) == 0);
+	TEST_ASSERT(chunk_store_file(file2, manifest2, chunk_dir, opt, NULL, NULL, &new_chunks2) == 0);
+	/* only the chunk around the insertion should differ */
+	TEST_ASSERT(new_chunks1->len > 2);
+	TEST_ASSERT(new_chunks2->len < new_chunks1->len);
+
+	TEST_ASSERT(chunk_restore_file(manifest2, chunk_dir, file_restore, opt, NULL) == 0);
+	TEST_ASSERT(memcmp_file_file(file2, file_restore) == 0);
+
+cleanup:
+	new_chunks1 ? sa_free(new_chunks1) : (void)0;
+	new_chunks2 ? sa_free(new_chunks2) : (void)0;
+	opt ? options_free(opt) : (void)0;
+	free(data);
+	remove(file1);
+	remove(file2);
+	remove(manifest1);
+	remove(manifest2);
+	remove(file_restore);
+	cleanup_test_environment(chunk_dir, NULL);
+}
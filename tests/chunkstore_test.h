@@ -0,0 +1,19 @@
+/** @file tests/chunkstore_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __CHUNKSTORE_TEST_H
+#define __CHUNKSTORE_TEST_H
+
+#include "test_framework.h"
+
+void test_chunk_boundary(enum TEST_STATUS* status);
+void test_chunk_store_file(enum TEST_STATUS* status);
+void test_chunk_store_file_shifted(enum TEST_STATUS* status);
+
+EXPORT_PKG(chunkstore_pkg);
+#endif
@@ -10,12 +10,14 @@
 #include "../../cloud/base.h"
 #include "../../cloud/keys.h"
 #include "../../log.h"
+#include "../../strings/stringhelper.h"
 #include <stdlib.h>
 #include <string.h>
 
 const struct unit_test cloud_base_tests[] = {
 	MAKE_TEST_RU(test_cloud_ui),
-	MAKE_TEST(test_cloud)
+	MAKE_TEST(test_cloud),
+	MAKE_TEST(test_cloud_transfers)
 };
 MAKE_PKG(cloud_base_tests, cloud_base_pkg);
 
@@ -107,3 +109,118 @@ cleanup:
 	cd ? cloud_logout(cd) : 0;
 	co_free(co);
 }
+
+static void count_done(int res, void* data){
+	int* results = data;
+	/* each transfer has its own slot, so no two callbacks write the same one */
+	*results = res == 0 ? 1 : -1;
+}
+
+/* where a streamed download goes, which is bigger than what is uploaded so a duplicated part would show */
+struct stream_buffer{
+	unsigned char data[4096];
+	size_t len;
+};
+
+static int stream_buffer_sink(const void* data, size_t len, void* sink_data){
+	struct stream_buffer* sb = sink_data;
+
+	if (len > sizeof(sb->data) - sb->len){
+		return -1;
+	}
+	memcpy(sb->data + sb->len, data, len);
+	sb->len += len;
+	return 0;
+}
+
+void test_cloud_transfers(enum TEST_STATUS* status){
+	struct cloud_options* co = get_co_options();
+	struct cloud_data* cd = NULL;
+	struct cloud_transfers* ct = NULL;
+	const char* upload_dir = "/test_transfers";
+	char* files[12] = { NULL };
+	char* cloud_paths[12] = { NULL };
+	int results[12] = { 0 };
+	struct stream_buffer* streams = NULL;
+	unsigned char data[1337];
+	size_t n = sizeof(files) / sizeof(files[0]);
+	size_t i;
+
+	fill_sample_data(data, sizeof(data));
+
+	TEST_ASSERT(co);
+	TEST_ASSERT(cloud_login(co, &cd) == 0);
+	TEST_ASSERT(cloud_mkdir(upload_dir, cd) >= 0);
+	/* fewer slots than files, so submitting has to wait for some to finish */
+	ct = cloud_transfers_new(cd, 4);
+	TEST_ASSERT(ct);
+
+	for (i = 0; i < n; ++i){
+		files[i] = sh_sprintf("transfer_%lu.txt", (unsigned long)i);
+		cloud_paths[i] = sh_sprintf("%s/transfer_%lu.txt", upload_dir, (unsigned long)i);
+		TEST_ASSERT(files[i] && cloud_paths[i]);
+		create_file(files[i], data, sizeof(data));
+		TEST_ASSERT(cloud_upload_submit(ct, files[i], cloud_paths[i], count_done, &results[i]) == 0);
+	}
+	TEST_ASSERT(cloud_transfers_wait(ct) == 0);
+	for (i = 0; i < n; ++i){
+		TEST_ASSERT(results[i] == 1);
+		remove(files[i]);
+		results[i] = 0;
+	}
+
+	for (i = 0; i < n; ++i){
+		TEST_ASSERT(cloud_download_submit(ct, cloud_paths[i], files[i], count_done, &results[i]) == 0);
+	}
+	TEST_ASSERT(cloud_transfers_wait(ct) == 0);
+	for (i = 0; i < n; ++i){
+		TEST_ASSERT(results[i] == 1);
+		TEST_ASSERT(memcmp_file_data(files[i], data, sizeof(data)) == 0);
+		results[i] = 0;
+	}
+
+	/* nothing is written to disk that the test can see, whether or not the provider can stream */
+	streams = calloc(n, sizeof(*streams));
+	TEST_ASSERT(streams);
+	for (i = 0; i < n; ++i){
+		TEST_ASSERT(cloud_download_stream_submit(ct, cloud_paths[i], stream_buffer_sink, &streams[i], count_done, &results[i]) == 0);
+	}
+	TEST_ASSERT(cloud_transfers_wait(ct) == 0);
+	for (i = 0; i < n; ++i){
+		TEST_ASSERT(results[i] == 1);
+		TEST_ASSERT(streams[i].len == sizeof(data) && memcmp(streams[i].data, data, sizeof(data)) == 0);
+	}
+
+	TEST_ASSERT(cloud_mkdir("/test_transfers/moved", cd) >= 0);
+	for (i = 0; i < n; ++i){
+		remove(files[i]);
+		free(files[i]);
+		files[i] = sh_sprintf("%s/moved/transfer_%lu.txt", upload_dir, (unsigned long)i);
+		TEST_ASSERT(files[i]);
+		results[i] = 0;
+		TEST_ASSERT(cloud_rename_submit(ct, cloud_paths[i], files[i], count_done, &results[i]) == 0);
+	}
+	TEST_ASSERT(cloud_transfers_wait(ct) == 0);
+	for (i = 0; i < n; ++i){
+		TEST_ASSERT(results[i] == 1);
+		TEST_ASSERT(cloud_stat(files[i], NULL, cd) == 0);
+		TEST_ASSERT(cloud_stat(cloud_paths[i], NULL, cd) > 0);
+		free(files[i]);
+		files[i] = NULL;
+	}
+
+	TEST_ASSERT(cloud_download_submit(ct, "/test_transfers/noexist.txt", "noexist.txt", count_done, &results[0]) < 0);
+	TEST_ASSERT(cloud_rename_submit(ct, "/test_transfers/noexist.txt", "/test_transfers/moved/noexist.txt", count_done, &results[0]) < 0);
+	TEST_ASSERT(cloud_remove(upload_dir, cd) == 0);
+
+cleanup:
+	cloud_transfers_free(ct);
+	free(streams);
+	for (i = 0; i < sizeof(files) / sizeof(files[0]); ++i){
+		files[i] ? remove(files[i]) : 0;
+		free(files[i]);
+		free(cloud_paths[i]);
+	}
+	cd ? cloud_logout(cd) : 0;
+	co_free(co);
+}
@@ -13,6 +13,7 @@
 
 void test_cloud_ui(enum TEST_STATUS* status);
 void test_cloud(enum TEST_STATUS* status);
+void test_cloud_transfers(enum TEST_STATUS* status);
 
 EXPORT_PKG(cloud_base_pkg);
 #endif
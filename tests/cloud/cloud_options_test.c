@@ -12,7 +12,8 @@
 #include <string.h>
 
 const struct unit_test cloud_options_tests[] = {
-	MAKE_TEST(test_co)
+	MAKE_TEST(test_co),
+	MAKE_TEST(test_co_from_string)
 };
 MAKE_PKG(cloud_options_tests, cloud_options_pkg);
 
@@ -47,3 +48,33 @@ void test_co(enum TEST_STATUS* status){
 cleanup:
 	co ? co_free(co) : (void)0;
 }
+
+void test_co_from_string(enum TEST_STATUS* status){
+	struct cloud_options* co = NULL;
+
+	TEST_ASSERT(co_from_string("s3:/bucket/Backups", &co) == 0);
+	TEST_ASSERT(co->cp == CLOUD_S3);
+	TEST_ASSERT(co->username == NULL);
+	TEST_ASSERT(co->password == NULL);
+	TEST_ASSERT(strcmp(co->upload_directory, "/bucket/Backups") == 0);
+	co_free(co);
+
+	/* everything between the provider and the last ':' is the username */
+	TEST_ASSERT(co_from_string("mega:john_doe@example.com:/Backups", &co) == 0);
+	TEST_ASSERT(co->cp == CLOUD_MEGA);
+	TEST_ASSERT(strcmp(co->username, "john_doe@example.com") == 0);
+	TEST_ASSERT(strcmp(co->upload_directory, "/Backups") == 0);
+	co_free(co);
+	co = NULL;
+
+	TEST_ASSERT(co_from_string("/Backups", &co) != 0);
+	TEST_ASSERT(co == NULL);
+	TEST_ASSERT(co_from_string(":/Backups", &co) != 0);
+	TEST_ASSERT(co_from_string("s3:", &co) != 0);
+	TEST_ASSERT(co_from_string("none:/Backups", &co) != 0);
+	TEST_ASSERT(co_from_string("dropbox:/Backups", &co) != 0);
+	TEST_ASSERT(co == NULL);
+
+cleanup:
+	co ? co_free(co) : (void)0;
+}
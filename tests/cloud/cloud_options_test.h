@@ -12,6 +12,7 @@
 #include "../test_framework.h"
 
 void test_co(enum TEST_STATUS* status);
+void test_co_from_string(enum TEST_STATUS* status);
 
 EXPORT_PKG(cloud_options_pkg);
 #endif
@@ -0,0 +1,210 @@
+/** @file tests/cloud/pathcache_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "pathcache_test.h"
+#include "../../cloud/pathcache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const struct unit_test cloud_pathcache_tests[] = {
+	MAKE_TEST(test_pc_lookup),
+	MAKE_TEST(test_pc_invalidate),
+	MAKE_TEST(test_pc_listed),
+	MAKE_TEST(test_pc_list),
+	MAKE_TEST(test_pc_many)
+};
+MAKE_PKG(cloud_pathcache_tests, cloud_pathcache_pkg);
+
+void test_pc_lookup(enum TEST_STATUS* status){
+	struct path_cache* pc = NULL;
+	struct stat st;
+	struct stat st_out;
+
+	memset(&st, 0, sizeof(st));
+	st.st_mode = S_IFREG | 0444;
+	st.st_size = 1337;
+
+	pc = pc_new();
+	TEST_ASSERT(pc);
+	TEST_ASSERT(pc_lookup(pc, "/a/b/file.txt", NULL) == PC_UNKNOWN);
+
+	TEST_ASSERT(pc_set_stat(pc, "/a/b/file.txt", &st) == 0);
+	TEST_ASSERT(pc_lookup(pc, "/a/b/file.txt", &st_out) == PC_FILE);
+	TEST_ASSERT(st_out.st_size == 1337);
+	/* the parents have to exist too, but their metadata is not known */
+	TEST_ASSERT(pc_lookup(pc, "/a/b/", NULL) == PC_DIR);
+	TEST_ASSERT(pc_lookup(pc, "/a", NULL) == PC_DIR);
+	TEST_ASSERT(pc_lookup(pc, "/", NULL) == PC_DIR);
+	TEST_ASSERT(pc_lookup(pc, "/a", &st_out) == PC_UNKNOWN);
+
+	TEST_ASSERT(pc_set_absent(pc, "/a/b/noexist.txt") == 0);
+	TEST_ASSERT(pc_lookup(pc, "/a/b/noexist.txt", NULL) == PC_ABSENT);
+	/* an unknown parent means it is not remembered */
+	TEST_ASSERT(pc_set_absent(pc, "/c/noexist.txt") == 0);
+	TEST_ASSERT(pc_lookup(pc, "/c/noexist.txt", NULL) == PC_UNKNOWN);
+
+cleanup:
+	pc_free(pc);
+}
+
+void test_pc_invalidate(enum TEST_STATUS* status){
+	struct path_cache* pc = NULL;
+	struct stat st;
+
+	memset(&st, 0, sizeof(st));
+	st.st_mode = S_IFREG | 0444;
+
+	pc = pc_new();
+	TEST_ASSERT(pc);
+	TEST_ASSERT(pc_set_stat(pc, "/a/b/file1.txt", &st) == 0);
+	TEST_ASSERT(pc_set_stat(pc, "/a/b/file2.txt", &st) == 0);
+	TEST_ASSERT(pc_set_dir(pc, "/a/c") == 0);
+	TEST_ASSERT(pc_set_dir(pc, "/ab") == 0);
+
+	/* a file goes alone */
+	pc_invalidate(pc, "/a/b/file1.txt");
+	TEST_ASSERT(pc_lookup(pc, "/a/b/file1.txt", NULL) == PC_UNKNOWN);
+	TEST_ASSERT(pc_lookup(pc, "/a/b/file2.txt", NULL) == PC_FILE);
+
+	/* a directory takes everything under it, but not its siblings with the same prefix */
+	pc_invalidate(pc, "/a/");
+	TEST_ASSERT(pc_lookup(pc, "/a", NULL) == PC_UNKNOWN);
+	TEST_ASSERT(pc_lookup(pc, "/a/b", NULL) == PC_UNKNOWN);
+	TEST_ASSERT(pc_lookup(pc, "/a/b/file2.txt", NULL) == PC_UNKNOWN);
+	TEST_ASSERT(pc_lookup(pc, "/a/c", NULL) == PC_UNKNOWN);
+	TEST_ASSERT(pc_lookup(pc, "/ab", NULL) == PC_DIR);
+	TEST_ASSERT(pc_lookup(pc, "/", NULL) == PC_DIR);
+
+cleanup:
+	pc_free(pc);
+}
+
+void test_pc_listed(enum TEST_STATUS* status){
+	struct path_cache* pc = NULL;
+	struct stat st;
+
+	memset(&st, 0, sizeof(st));
+	st.st_mode = S_IFREG | 0444;
+
+	pc = pc_new();
+	TEST_ASSERT(pc);
+	TEST_ASSERT(pc_set_file(pc, "/a/b/file1.txt") == 0);
+	TEST_ASSERT(pc_lookup(pc, "/a/b/file1.txt", NULL) == PC_FILE);
+	/* existing is not the same as having metadata */
+	TEST_ASSERT(pc_lookup(pc, "/a/b/file1.txt", &st) == PC_UNKNOWN);
+	TEST_ASSERT(pc_lookup(pc, "/a/b", NULL) == PC_DIR);
+
+	/* only a directory can be listed */
+	TEST_ASSERT(pc_set_listed(pc, "/a/b/file1.txt") != 0);
+	TEST_ASSERT(pc_set_listed(pc, "/c") != 0);
+	TEST_ASSERT(pc_lookup(pc, "/a/b/file2.txt", NULL) == PC_UNKNOWN);
+	TEST_ASSERT(pc_set_listed(pc, "/a/b") == 0);
+	TEST_ASSERT(pc_lookup(pc, "/a/b/file2.txt", NULL) == PC_ABSENT);
+	TEST_ASSERT(pc_lookup(pc, "/a/b/file1.txt", NULL) == PC_FILE);
+	/* recording something new keeps it listed */
+	TEST_ASSERT(pc_set_stat(pc, "/a/b/file3.txt", &st) == 0);
+	TEST_ASSERT(pc_lookup(pc, "/a/b/file2.txt", NULL) == PC_ABSENT);
+	TEST_ASSERT(pc_lookup(pc, "/a/b/file3.txt", NULL) == PC_FILE);
+	/* nothing under it is listed along with it */
+	TEST_ASSERT(pc_lookup(pc, "/a/b/d/file4.txt", NULL) == PC_UNKNOWN);
+
+	/* forgetting anything in it means it could be anything */
+	pc_invalidate(pc, "/a/b/file1.txt");
+	TEST_ASSERT(pc_lookup(pc, "/a/b/file1.txt", NULL) == PC_UNKNOWN);
+	TEST_ASSERT(pc_lookup(pc, "/a/b/file2.txt", NULL) == PC_UNKNOWN);
+	TEST_ASSERT(pc_lookup(pc, "/a/b/file3.txt", NULL) == PC_FILE);
+
+cleanup:
+	pc_free(pc);
+}
+
+static int list_has(char** arr, size_t len, const char* path){
+	size_t i;
+
+	for (i = 0; i < len; ++i){
+		if (strcmp(arr[i], path) == 0){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void list_free(char** arr, size_t len){
+	size_t i;
+
+	for (i = 0; i < len; ++i){
+		free(arr[i]);
+	}
+	free(arr);
+}
+
+void test_pc_list(enum TEST_STATUS* status){
+	struct path_cache* pc = NULL;
+	char** arr = NULL;
+	size_t len = 0;
+
+	pc = pc_new();
+	TEST_ASSERT(pc);
+	TEST_ASSERT(pc_set_file(pc, "/a/b/file1.txt") == 0);
+	TEST_ASSERT(pc_set_dir(pc, "/a/b/d") == 0);
+	TEST_ASSERT(pc_set_file(pc, "/a/b/d/file2.txt") == 0);
+
+	/* only a directory whose entries are all known can be listed */
+	TEST_ASSERT(pc_list(pc, "/a/b", &arr, &len) > 0);
+	TEST_ASSERT(arr == NULL && len == 0);
+
+	TEST_ASSERT(pc_set_listed(pc, "/a/b") == 0);
+	TEST_ASSERT(pc_set_absent(pc, "/a/b/file3.txt") == 0);
+	TEST_ASSERT(pc_list(pc, "/a/b/", &arr, &len) == 0);
+	/* what is not there and what is under a subdirectory are not entries */
+	TEST_ASSERT(len == 2);
+	TEST_ASSERT(list_has(arr, len, "/a/b/file1.txt"));
+	TEST_ASSERT(list_has(arr, len, "/a/b/d"));
+	list_free(arr, len);
+	arr = NULL;
+
+	TEST_ASSERT(pc_set_listed(pc, "/") == 0);
+	TEST_ASSERT(pc_list(pc, "/", &arr, &len) == 0);
+	TEST_ASSERT(len == 1);
+	TEST_ASSERT(list_has(arr, len, "/a"));
+	list_free(arr, len);
+	arr = NULL;
+
+	/* a change to anything in it has to be looked up again */
+	pc_invalidate(pc, "/a/b/file1.txt");
+	TEST_ASSERT(pc_list(pc, "/a/b", &arr, &len) > 0);
+
+cleanup:
+	list_free(arr, len);
+	pc_free(pc);
+}
+
+/* enough paths that the table has to grow a few times */
+void test_pc_many(enum TEST_STATUS* status){
+	struct path_cache* pc = NULL;
+	char path[64];
+	size_t i;
+
+	pc = pc_new();
+	TEST_ASSERT(pc);
+	for (i = 0; i < 5000; ++i){
+		sprintf(path, "/dir%lu/file%lu", (unsigned long)(i % 50), (unsigned long)i);
+		TEST_ASSERT(pc_set_dir(pc, path) == 0);
+	}
+	for (i = 0; i < 5000; ++i){
+		sprintf(path, "/dir%lu/file%lu", (unsigned long)(i % 50), (unsigned long)i);
+		TEST_ASSERT(pc_lookup(pc, path, NULL) == PC_DIR);
+	}
+	pc_invalidate(pc, "/dir7");
+	TEST_ASSERT(pc_lookup(pc, "/dir7/file7", NULL) == PC_UNKNOWN);
+	TEST_ASSERT(pc_lookup(pc, "/dir8/file8", NULL) == PC_DIR);
+
+cleanup:
+	pc_free(pc);
+}
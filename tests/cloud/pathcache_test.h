@@ -0,0 +1,21 @@
+/** @file tests/cloud/pathcache_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __CLOUD_PATHCACHE_TEST_H
+#define __CLOUD_PATHCACHE_TEST_H
+
+#include "../test_framework.h"
+
+void test_pc_lookup(enum TEST_STATUS* status);
+void test_pc_invalidate(enum TEST_STATUS* status);
+void test_pc_listed(enum TEST_STATUS* status);
+void test_pc_list(enum TEST_STATUS* status);
+void test_pc_many(enum TEST_STATUS* status);
+
+EXPORT_PKG(cloud_pathcache_pkg);
+#endif
@@ -0,0 +1,204 @@
+/** @file tests/cloud/ratelimit_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "ratelimit_test.h"
+#include "../../cloud/ratelimit.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+const struct unit_test cloud_ratelimit_tests[] = {
+	MAKE_TEST(test_rs_parse),
+	MAKE_TEST(test_rs_rate_at),
+	MAKE_TEST(test_tb_take),
+	MAKE_TEST(test_tb_priority)
+};
+MAKE_PKG(cloud_ratelimit_tests, cloud_ratelimit_pkg);
+
+/* today at a local time of day */
+static time_t at(int hour, int min){
+	time_t t = time(NULL);
+	struct tm tm;
+
+	localtime_r(&t, &tm);
+	tm.tm_hour = hour;
+	tm.tm_min = min;
+	tm.tm_sec = 0;
+	tm.tm_isdst = -1;
+	return mktime(&tm);
+}
+
+static double seconds_since(const struct timespec* start){
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)(now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void test_rs_parse(enum TEST_STATUS* status){
+	const char* valid[] = {
+		"0",
+		"none",
+		"512K",
+		"08:00-18:00=1M,2G",
+		" 22:00 - 06:30 = 100k , 9:15-9:45=none, 4096 ",
+		"00:00-24:00=1M"
+	};
+	const char* invalid[] = {
+		"",
+		"fast",
+		"1T",
+		"1MB",
+		"25:00-06:00=1M",
+		"08:60-09:00=1M",
+		"24:00-06:00=1M",
+		"08:00=1M",
+		"08:00-18:00=",
+		"1M,,2M"
+	};
+	struct rate_schedule* rs = NULL;
+	size_t i;
+
+	for (i = 0; i < sizeof(valid) / sizeof(valid[0]); ++i){
+		TEST_ASSERT_MSG(rs_parse(valid[i], &rs) == 0, valid[i]);
+		TEST_FREE(rs, rs_free);
+	}
+	for (i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i){
+		TEST_ASSERT_MSG(rs_parse(invalid[i], &rs) != 0, invalid[i]);
+		TEST_ASSERT(rs == NULL);
+	}
+
+cleanup:
+	rs_free(rs);
+}
+
+void test_rs_rate_at(enum TEST_STATUS* status){
+	struct rate_schedule* rs = NULL;
+
+	TEST_ASSERT(rs_parse("08:00-18:00=512K,22:00-06:00=0,12:00-13:00=1K,2M", &rs) == 0);
+
+	TEST_ASSERT(rs_rate_at(rs, at(8, 0)) == 512 * 1024);
+	TEST_ASSERT(rs_rate_at(rs, at(17, 59)) == 512 * 1024);
+	/* the first window that matches wins */
+	TEST_ASSERT(rs_rate_at(rs, at(12, 30)) == 512 * 1024);
+	/* windows end just before their end time */
+	TEST_ASSERT(rs_rate_at(rs, at(18, 0)) == 2 * 1024 * 1024);
+	TEST_ASSERT(rs_rate_at(rs, at(7, 59)) == 2 * 1024 * 1024);
+	/* and can wrap past midnight */
+	TEST_ASSERT(rs_rate_at(rs, at(23, 0)) == 0);
+	TEST_ASSERT(rs_rate_at(rs, at(0, 0)) == 0);
+	TEST_ASSERT(rs_rate_at(rs, at(5, 59)) == 0);
+	TEST_ASSERT(rs_rate_at(rs, at(6, 0)) == 2 * 1024 * 1024);
+	TEST_FREE(rs, rs_free);
+
+	/* without a default, everything else is unlimited */
+	TEST_ASSERT(rs_parse("00:00-24:00=1G", &rs) == 0);
+	TEST_ASSERT(rs_rate_at(rs, at(13, 37)) == 1024UL * 1024 * 1024);
+	TEST_FREE(rs, rs_free);
+	TEST_ASSERT(rs_parse("09:00-17:00=1G", &rs) == 0);
+	TEST_ASSERT(rs_rate_at(rs, at(20, 0)) == 0);
+
+cleanup:
+	rs_free(rs);
+}
+
+void test_tb_take(enum TEST_STATUS* status){
+	struct token_bucket* tb = NULL;
+	struct timespec start;
+	size_t sent;
+
+	/* unlimited hands out everything at once */
+	tb = tb_new(0);
+	TEST_ASSERT(tb);
+	TEST_ASSERT(tb_take(tb, 1 << 30, 0) == 1 << 30);
+	TEST_FREE(tb, tb_free);
+
+	tb = tb_new(100000);
+	TEST_ASSERT(tb);
+	/* never more than a slice at once */
+	TEST_ASSERT(tb_take(tb, 1 << 30, 0) == 100000 / RL_SLICES_PER_SECOND);
+	TEST_ASSERT(tb_take(tb, 10, 0) == 10);
+
+	/* the rest of the first second's worth is already there */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (sent = 100000 / RL_SLICES_PER_SECOND + 10; sent < 100000; ){
+		sent += tb_take(tb, 100000 - sent, 0);
+	}
+	TEST_ASSERT(seconds_since(&start) < 0.2);
+
+	/* but the next half second's has to build up */
+	for (sent = 0; sent < 50000; ){
+		sent += tb_take(tb, 50000 - sent, 0);
+	}
+	TEST_ASSERT(seconds_since(&start) >= 0.4);
+	TEST_ASSERT(seconds_since(&start) < 1.0);
+
+	/* a faster rate takes effect right away */
+	tb_set_rate(tb, 0);
+	TEST_ASSERT(tb_take(tb, 1 << 30, 0) == 1 << 30);
+
+cleanup:
+	tb_free(tb);
+}
+
+struct priority_order{
+	struct token_bucket* tb;
+	pthread_mutex_t lock;
+	int next;
+	int low_place;
+};
+
+static void* take_low(void* arg){
+	struct priority_order* po = arg;
+
+	tb_take(po->tb, 250, 0);
+	pthread_mutex_lock(&po->lock);
+	po->low_place = po->next++;
+	pthread_mutex_unlock(&po->lock);
+	return NULL;
+}
+
+void test_tb_priority(enum TEST_STATUS* status){
+	struct priority_order po;
+	pthread_t thrd;
+	int started = 0;
+	int high_place;
+
+	memset(&po, 0, sizeof(po));
+	pthread_mutex_init(&po.lock, NULL);
+	po.tb = tb_new(1000);
+	TEST_ASSERT(po.tb);
+	/* empty it so both have to wait */
+	TEST_ASSERT(tb_take(po.tb, 1000, 0) == 250);
+	TEST_ASSERT(tb_take(po.tb, 750, 0) == 250);
+	TEST_ASSERT(tb_take(po.tb, 500, 0) == 250);
+	TEST_ASSERT(tb_take(po.tb, 250, 0) == 250);
+
+	TEST_ASSERT(pthread_create(&thrd, NULL, take_low, &po) == 0);
+	started = 1;
+	usleep(50000);
+
+	/* this asked last but goes first */
+	tb_take(po.tb, 250, 1);
+	pthread_mutex_lock(&po.lock);
+	high_place = po.next++;
+	pthread_mutex_unlock(&po.lock);
+
+	pthread_join(thrd, NULL);
+	started = 0;
+	TEST_ASSERT(high_place == 0);
+	TEST_ASSERT(po.low_place == 1);
+
+cleanup:
+	if (started){
+		pthread_join(thrd, NULL);
+	}
+	tb_free(po.tb);
+	pthread_mutex_destroy(&po.lock);
+}
@@ -0,0 +1,20 @@
+/** @file tests/cloud/ratelimit_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __CLOUD_RATELIMIT_TEST_H
+#define __CLOUD_RATELIMIT_TEST_H
+
+#include "../test_framework.h"
+
+void test_rs_parse(enum TEST_STATUS* status);
+void test_rs_rate_at(enum TEST_STATUS* status);
+void test_tb_take(enum TEST_STATUS* status);
+void test_tb_priority(enum TEST_STATUS* status);
+
+EXPORT_PKG(cloud_ratelimit_pkg);
+#endif
@@ -0,0 +1,19 @@
+/** @file tests/cloud/s3sign_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __CLOUD_S3SIGN_TEST_H
+#define __CLOUD_S3SIGN_TEST_H
+
+#include "../test_framework.h"
+
+void test_s3_uri_encode(enum TEST_STATUS* status);
+void test_s3_amz_date(enum TEST_STATUS* status);
+void test_s3_authorization(enum TEST_STATUS* status);
+
+EXPORT_PKG(cloud_s3sign_pkg);
+#endif
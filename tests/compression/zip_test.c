@@ -11,16 +11,32 @@
 #include "../../log.h"
 #include "../../compression/zip.h"
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 const struct unit_test compression_zip_tests[] = {
 	MAKE_TEST(test_compress_gzip),
 	MAKE_TEST(test_compress_bzip2),
 	MAKE_TEST(test_compress_xz),
 	MAKE_TEST(test_compress_lz4),
+	MAKE_TEST(test_compress_zstd),
 	MAKE_TEST(test_decompress_gzip),
 	MAKE_TEST(test_decompress_bzip2),
 	MAKE_TEST(test_decompress_xz),
-	MAKE_TEST(test_decompress_lz4)
+	MAKE_TEST(test_decompress_lz4),
+	MAKE_TEST(test_decompress_zstd),
+	MAKE_TEST(test_zstd_flags),
+	MAKE_TEST(test_zip_parallel),
+	MAKE_TEST(test_xz_parallel),
+	MAKE_TEST(test_lz4_parallel),
+	MAKE_TEST(test_zip_stream),
+	MAKE_TEST(test_zip_decompress_stream),
+	MAKE_TEST(test_zip_dict),
+	MAKE_TEST(test_zip_incompressible),
+	MAKE_TEST(test_zip_stream_reuse),
+	MAKE_TEST(test_zip_compress_stream),
+	MAKE_TEST(test_zip_seekable)
 };
 MAKE_PKG(compression_zip_tests, compression_zip_pkg);
 
@@ -104,6 +120,26 @@ cleanup:
 	remove(arch);
 }
 
+void test_compress_zstd(enum TEST_STATUS* status){
+	const char* file = "file.txt";
+	const char* arch = "file.txt.zst";
+	unsigned char data[1337];
+	const char* system_cmd = "zstd -q -d --rm file.txt.zst";
+
+	fill_sample_data(data, sizeof(data));
+	create_file(file, data, sizeof(data));
+	TEST_ASSERT(zip_compress(file, arch, COMPRESSOR_ZSTD, 3, ZSTD_NORMAL) == 0);
+
+	remove(file);
+	printf("%s\n", system_cmd);
+	system(system_cmd);
+	TEST_ASSERT(memcmp_file_data(file, data, sizeof(data)) == 0);
+
+cleanup:
+	remove(file);
+	remove(arch);
+}
+
 void test_decompress_gzip(enum TEST_STATUS* status){
 	const char* file = "file.txt";
 	const char* arch = "file.txt.gz";
@@ -183,3 +219,711 @@ cleanup:
 	remove(file);
 	remove(arch);
 }
+
+void test_decompress_zstd(enum TEST_STATUS* status){
+	const char* file = "file.txt";
+	const char* arch = "file.txt.zst";
+	unsigned char data[1337];
+	const char* system_cmd = "zstd -q -6 --rm file.txt";
+
+	fill_sample_data(data, sizeof(data));
+	create_file(file, data, sizeof(data));
+	printf("%s\n", system_cmd);
+	system(system_cmd);
+
+	remove(file);
+	TEST_ASSERT(zip_decompress(arch, file, COMPRESSOR_ZSTD, ZSTD_NORMAL) == 0);
+	TEST_ASSERT(memcmp_file_data(file, data, sizeof(data)) == 0);
+
+cleanup:
+	remove(file);
+	remove(arch);
+}
+
+void test_zstd_flags(enum TEST_STATUS* status){
+	const char* file = "file.txt";
+	const char* arch = "file.txt.zst";
+	const unsigned flags[] = { ZSTD_LONG, ZIP_WORKERS(2), ZSTD_LONG | ZIP_WORKERS(3) };
+	unsigned char* data = NULL;
+	const size_t data_len = 3 << 20;
+	size_t i;
+
+	/* big enough that the workers get more than one job each */
+	data = malloc(data_len);
+	TEST_ASSERT(data);
+	fill_sample_data(data, data_len);
+	create_file(file, data, data_len);
+
+	for (i = 0; i < sizeof(flags) / sizeof(flags[0]); ++i){
+		TEST_ASSERT(zip_compress(file, arch, COMPRESSOR_ZSTD, 9, flags[i]) == 0);
+		remove(file);
+		TEST_ASSERT(zip_decompress(arch, file, COMPRESSOR_ZSTD, ZSTD_NORMAL) == 0);
+		TEST_ASSERT(memcmp_file_data(file, data, data_len) == 0);
+		remove(arch);
+	}
+
+cleanup:
+	free(data);
+	remove(file);
+	remove(arch);
+}
+
+void test_zip_parallel(enum TEST_STATUS* status){
+	/* the compressors that split the data into blocks and put them back together as one standard stream, and how much each puts in a block at the given level */
+	const struct{
+		enum compressor c_type;
+		unsigned flags;
+		int level;
+		size_t block_len;
+		const char* arch;
+		const char* system_cmd;
+	} codecs[] = {
+		{ COMPRESSOR_GZIP, GZIP_NORMAL, 6, (size_t)1 << 17, "file.txt.gz", "gzip -d -f file.txt.gz" },
+		{ COMPRESSOR_BZIP2, BZIP2_NORMAL, 1, 80000 - 20, "file.txt.bz2", "bzip2 -d -f file.txt.bz2" },
+		{ COMPRESSOR_LZ4, LZ4_NORMAL, 6, (size_t)1 << 20, "file.txt.lz4", "lz4 -d -f -q file.txt.lz4 file.txt" }
+	};
+	const char* file = "file.txt";
+	const char* arch = NULL;
+	size_t lengths[4];
+	unsigned char* data = NULL;
+	size_t data_len = 0;
+	struct zip_buffer in;
+	struct zip_buffer zipped;
+	struct zip_buffer out;
+	size_t zipped_len;
+	size_t i;
+	size_t j;
+	size_t k;
+
+	memset(&zipped, 0, sizeof(zipped));
+	memset(&out, 0, sizeof(out));
+
+	for (j = 0; j < sizeof(codecs) / sizeof(codecs[0]); ++j){
+		/* nothing, less than a block, exactly one batch of blocks, and several batches with a partial block */
+		lengths[0] = 0;
+		lengths[1] = 1000;
+		lengths[2] = codecs[j].block_len * 6;
+		lengths[3] = codecs[j].block_len * 19 + codecs[j].block_len / 2;
+		if (lengths[3] > data_len){
+			free(data);
+			data_len = lengths[3];
+			data = malloc(data_len);
+			TEST_ASSERT(data);
+			fill_sample_data(data, data_len);
+			/* something that does not compress to almost nothing, so the blocks are not all alike */
+			for (i = 0; i < data_len; i += 7){
+				data[i] = (unsigned char)(i * 31 / 7);
+			}
+		}
+
+		arch = codecs[j].arch;
+		for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); ++i){
+			create_file(file, data, lengths[i]);
+			TEST_ASSERT(zip_compress(file, arch, codecs[j].c_type, i % 2 ? 0 : codecs[j].level, codecs[j].flags | ZIP_WORKERS(3)) == 0);
+
+			/* one standard stream that the compressor's own tool can read */
+			remove(file);
+			printf("%s\n", codecs[j].system_cmd);
+			system(codecs[j].system_cmd);
+			TEST_ASSERT(memcmp_file_data(file, data, lengths[i]) == 0);
+
+			/* and so can the parallel decompressor, where there is one */
+			TEST_ASSERT(zip_compress(file, arch, codecs[j].c_type, codecs[j].level, codecs[j].flags | ZIP_WORKERS(3)) == 0);
+			remove(file);
+			TEST_ASSERT(zip_decompress(arch, file, codecs[j].c_type, ZIP_WORKERS(3)) == 0);
+			TEST_ASSERT(memcmp_file_data(file, data, lengths[i]) == 0);
+
+			/* and the regular one */
+			in.data = data;
+			in.len = lengths[i];
+			in.size = data_len;
+			in.pos = 0;
+			free(zipped.data);
+			memset(&zipped, 0, sizeof(zipped));
+			TEST_ASSERT(zip_compress_stream(codecs[j].c_type, codecs[j].level, ZIP_WORKERS(3), zip_buffer_source, &in, zip_buffer_sink, &zipped) == 0);
+			free(out.data);
+			memset(&out, 0, sizeof(out));
+			TEST_ASSERT(zip_decompress_stream(codecs[j].c_type, 0, zip_buffer_source, &zipped, zip_buffer_sink, &out) == 0);
+			TEST_ASSERT(out.len == lengths[i] && (out.len == 0 || memcmp(out.data, data, out.len) == 0));
+
+			/* cut short, in the trailer and then in the middle of the blocks */
+			zipped_len = zipped.len;
+			for (k = 0; k < 2; ++k){
+				zipped.pos = 0;
+				zipped.len = k == 0 ? zipped_len - 5 : zipped_len / 2;
+				TEST_ASSERT(zip_decompress_stream(codecs[j].c_type, ZIP_WORKERS(3), zip_buffer_source, &zipped, zip_buffer_sink, &out) != 0);
+			}
+			remove(arch);
+		}
+	}
+
+cleanup:
+	free(data);
+	free(zipped.data);
+	free(out.data);
+	remove(file);
+	arch ? remove(arch) : 0;
+}
+
+void test_xz_parallel(enum TEST_STATUS* status){
+	const char* file = "file.txt";
+	const char* arch = "file.txt.xz";
+	const char* system_cmd = "xz -d -f file.txt.xz";
+	unsigned char* data = NULL;
+	const size_t data_len = 3 << 20;
+
+	/* three blocks, so both sides have something to split up */
+	data = malloc(data_len);
+	TEST_ASSERT(data);
+	fill_sample_data(data, data_len);
+	create_file(file, data, data_len);
+
+	TEST_ASSERT(zip_compress(file, arch, COMPRESSOR_XZ, 1, XZ_NORMAL | ZIP_WORKERS(2) | XZ_BLOCK_MIB(1)) == 0);
+	remove(file);
+	TEST_ASSERT(zip_decompress(arch, file, COMPRESSOR_XZ, ZIP_WORKERS(2)) == 0);
+	TEST_ASSERT(memcmp_file_data(file, data, data_len) == 0);
+
+	/* still a standard xz file */
+	remove(file);
+	printf("%s\n", system_cmd);
+	system(system_cmd);
+	TEST_ASSERT(memcmp_file_data(file, data, data_len) == 0);
+
+cleanup:
+	free(data);
+	remove(file);
+	remove(arch);
+}
+
+void test_lz4_parallel(enum TEST_STATUS* status){
+	const char* file = "file.txt";
+	const char* arch = "file.txt.lz4";
+	/* both with and without a content checksum, which only the regular decompressor can check */
+	const char* system_cmds[] = { "lz4 -f -q -B4 file.txt file.txt.lz4", "lz4 -f -q -B4 --no-frame-crc file.txt file.txt.lz4" };
+	unsigned char data[20000];
+	size_t i;
+
+	fill_sample_data(data, sizeof(data));
+
+	/* lz4's own output, split up when it can be and handed to the regular decompressor when it cannot */
+	for (i = 0; i < sizeof(system_cmds) / sizeof(system_cmds[0]); ++i){
+		create_file(file, data, sizeof(data));
+		printf("%s\n", system_cmds[i]);
+		system(system_cmds[i]);
+		remove(file);
+		TEST_ASSERT(zip_decompress(arch, file, COMPRESSOR_LZ4, ZIP_WORKERS(3)) == 0);
+		TEST_ASSERT(memcmp_file_data(file, data, sizeof(data)) == 0);
+		remove(arch);
+	}
+
+cleanup:
+	remove(file);
+	remove(arch);
+}
+
+static int file_sink(const void* data, size_t len, void* fp){
+	return fwrite(data, 1, len, fp) == len ? 0 : -1;
+}
+
+void test_zip_stream(enum TEST_STATUS* status){
+	const char* file = "file.txt";
+	const char* arch = "file.txt.arch";
+	const enum compressor compressors[] = { COMPRESSOR_GZIP, COMPRESSOR_GZIP, COMPRESSOR_BZIP2, COMPRESSOR_XZ, COMPRESSOR_ZSTD, COMPRESSOR_NONE };
+	const unsigned flags[] = { 0, ZIP_WORKERS(2), 0, 0, 0, 0 };
+	unsigned char data[1337];
+	struct ZIP_FILE* zfp = NULL;
+	FILE* fp = NULL;
+	size_t i;
+
+	fill_sample_data(data, sizeof(data));
+
+	for (i = 0; i < sizeof(compressors) / sizeof(compressors[0]); ++i){
+		fp = fopen(arch, "wb");
+		TEST_ASSERT(fp);
+		zfp = zip_stream_new(compressors[i], 3, flags[i], file_sink, fp);
+		TEST_ASSERT(zfp);
+
+		/* feed it in uneven pieces */
+		TEST_ASSERT(zip_stream_write(zfp, data, 1000) == 0);
+		TEST_ASSERT(zip_stream_write(zfp, data + 1000, sizeof(data) - 1000) == 0);
+		TEST_ASSERT(zip_stream_finish(zfp) == 0);
+		zip_stream_free(zfp);
+		zfp = NULL;
+		TEST_ASSERT(fclose(fp) == 0);
+		fp = NULL;
+
+		TEST_ASSERT(zip_decompress(arch, file, compressors[i], 0) == 0);
+		TEST_ASSERT(memcmp_file_data(file, data, sizeof(data)) == 0);
+		remove(file);
+		remove(arch);
+	}
+
+cleanup:
+	zip_stream_free(zfp);
+	fp ? fclose(fp) : 0;
+	remove(file);
+	remove(arch);
+}
+
+void test_zip_decompress_stream(enum TEST_STATUS* status){
+	const char* file = "file.txt";
+	const char* arch = "file.txt.arch";
+	const enum compressor compressors[] = { COMPRESSOR_GZIP, COMPRESSOR_BZIP2, COMPRESSOR_XZ, COMPRESSOR_LZ4, COMPRESSOR_ZSTD, COMPRESSOR_NONE };
+	unsigned char data[1337];
+	unsigned char piece[7];
+	struct ZIP_FILE* zfp = NULL;
+	FILE* fp = NULL;
+	FILE* fp_arch = NULL;
+	size_t arch_len;
+	size_t n;
+	size_t i;
+
+	fill_sample_data(data, sizeof(data));
+
+	for (i = 0; i < sizeof(compressors) / sizeof(compressors[0]); ++i){
+		fp = fopen(arch, "wb");
+		TEST_ASSERT(fp);
+		zfp = zip_stream_new(compressors[i], 3, 0, file_sink, fp);
+		TEST_ASSERT(zfp);
+		TEST_ASSERT(zip_stream_write(zfp, data, sizeof(data)) == 0);
+		TEST_ASSERT(zip_stream_finish(zfp) == 0);
+		zip_stream_free(zfp);
+		zfp = NULL;
+		TEST_ASSERT(fclose(fp) == 0);
+		fp = NULL;
+
+		/* feed the compressed data back in pieces that do not line up with anything */
+		fp = fopen(file, "wb");
+		TEST_ASSERT(fp);
+		fp_arch = fopen(arch, "rb");
+		TEST_ASSERT(fp_arch);
+		zfp = zip_decompress_stream_new(compressors[i], 0, file_sink, fp);
+		TEST_ASSERT(zfp);
+		while ((n = fread(piece, 1, sizeof(piece), fp_arch)) > 0){
+			TEST_ASSERT(zip_stream_write(zfp, piece, n) == 0);
+		}
+		TEST_ASSERT(zip_stream_finish(zfp) == 0);
+		zip_stream_free(zfp);
+		zfp = NULL;
+		TEST_ASSERT(fclose(fp) == 0);
+		fp = NULL;
+		TEST_ASSERT(memcmp_file_data(file, data, sizeof(data)) == 0);
+
+		/* cutting off the end of the compressed data must be caught */
+		if (compressors[i] != COMPRESSOR_NONE){
+			arch_len = ftell(fp_arch);
+			rewind(fp_arch);
+			fp = fopen(file, "wb");
+			TEST_ASSERT(fp);
+			zfp = zip_decompress_stream_new(compressors[i], 0, file_sink, fp);
+			TEST_ASSERT(zfp);
+			for (n = 0; n + sizeof(piece) < arch_len - 10; n += sizeof(piece)){
+				TEST_ASSERT(fread(piece, 1, sizeof(piece), fp_arch) == sizeof(piece));
+				TEST_ASSERT(zip_stream_write(zfp, piece, sizeof(piece)) == 0);
+			}
+			TEST_ASSERT(zip_stream_finish(zfp) != 0);
+			zip_stream_free(zfp);
+			zfp = NULL;
+			TEST_ASSERT(fclose(fp) == 0);
+			fp = NULL;
+		}
+
+		fclose(fp_arch);
+		fp_arch = NULL;
+		remove(file);
+		remove(arch);
+	}
+
+cleanup:
+	zip_stream_free(zfp);
+	fp ? fclose(fp) : 0;
+	fp_arch ? fclose(fp_arch) : 0;
+	remove(file);
+	remove(arch);
+}
+
+struct mem_buffer{
+	unsigned char data[4096];
+	size_t len;
+};
+
+static int mem_sink(const void* data, size_t len, void* sink_data){
+	struct mem_buffer* mb = sink_data;
+
+	if (len > sizeof(mb->data) - mb->len){
+		return -1;
+	}
+	memcpy(mb->data + mb->len, data, len);
+	mb->len += len;
+	return 0;
+}
+
+/* small records that share most of their text, like a directory full of config files */
+static size_t make_record(char* out, unsigned i){
+	return sprintf(out, "{\n\t\"id\": %u,\n\t\"name\": \"user%u\",\n\t\"email\": \"user%u@example.com\",\n\t\"enabled\": %s,\n\t\"groups\": [\"staff\", \"backup\", \"%s\"]\n}\n",
+			i * 7919 % 100000, i, i * 31 % 1000, i % 3 ? "true" : "false", i % 2 ? "wheel" : "users");
+}
+
+static int zip_to_buffer(struct ZIP_FILE* zfp, const void* data, size_t len){
+	size_t i;
+
+	/* pieces shorter than a frame header */
+	for (i = 0; i < len; i += 7){
+		if (zip_stream_write(zfp, (const unsigned char*)data + i, len - i < 7 ? len - i : 7) != 0){
+			return -1;
+		}
+	}
+	return zip_stream_finish(zfp);
+}
+
+void test_zip_dict(enum TEST_STATUS* status){
+	const size_t n_samples = 1000;
+	char* samples = NULL;
+	size_t* sample_lens = NULL;
+	size_t samples_len = 0;
+	char record[256];
+	size_t record_len;
+	struct zip_dict* zd = NULL;
+	struct zip_dict* zd_loaded = NULL;
+	struct ZIP_FILE* zfp = NULL;
+	struct mem_buffer plain;
+	struct mem_buffer with_dict;
+	struct mem_buffer out;
+	const void* dict_data;
+	size_t dict_len;
+	size_t i;
+
+	TEST_ASSERT(!zip_dict_supported(COMPRESSOR_GZIP));
+	TEST_ASSERT(zip_dict_supported(COMPRESSOR_ZSTD));
+
+	samples = malloc(n_samples * sizeof(record));
+	sample_lens = malloc(n_samples * sizeof(*sample_lens));
+	TEST_ASSERT(samples && sample_lens);
+	for (i = 0; i < n_samples; ++i){
+		sample_lens[i] = make_record(samples + samples_len, i);
+		samples_len += sample_lens[i];
+	}
+
+	TEST_ASSERT(zip_dict_train(COMPRESSOR_GZIP, 3, samples, sample_lens, n_samples) == NULL);
+	zd = zip_dict_train(COMPRESSOR_ZSTD, 3, samples, sample_lens, n_samples);
+	TEST_ASSERT(zd);
+
+	/* a stored dictionary has to work the same once it is loaded again */
+	dict_data = zip_dict_data(zd, &dict_len);
+	TEST_ASSERT(dict_data && dict_len > 0 && dict_len <= ZIP_DICT_LEN);
+	zd_loaded = zip_dict_new(COMPRESSOR_ZSTD, 3, dict_data, dict_len);
+	TEST_ASSERT(zd_loaded);
+
+	/* a record that was not in the samples */
+	record_len = make_record(record, n_samples + 12345);
+
+	plain.len = 0;
+	zfp = zip_stream_new(COMPRESSOR_ZSTD, 3, 0, mem_sink, &plain);
+	TEST_ASSERT(zfp);
+	TEST_ASSERT(zip_to_buffer(zfp, record, record_len) == 0);
+	zip_stream_free(zfp);
+
+	with_dict.len = 0;
+	zfp = zip_stream_new(COMPRESSOR_ZSTD, 3, 0, mem_sink, &with_dict);
+	TEST_ASSERT(zfp);
+	TEST_ASSERT(zip_stream_use_dict(zfp, zd) == 0);
+	TEST_ASSERT(zip_to_buffer(zfp, record, record_len) == 0);
+	zip_stream_free(zfp);
+	zfp = NULL;
+	TEST_ASSERT(with_dict.len < plain.len);
+
+	out.len = 0;
+	zfp = zip_decompress_stream_new(COMPRESSOR_ZSTD, 0, mem_sink, &out);
+	TEST_ASSERT(zfp);
+	TEST_ASSERT(zip_stream_use_dict(zfp, zd_loaded) == 0);
+	TEST_ASSERT(zip_to_buffer(zfp, with_dict.data, with_dict.len) == 0);
+	zip_stream_free(zfp);
+	zfp = NULL;
+	TEST_ASSERT(out.len == record_len && memcmp(out.data, record, record_len) == 0);
+
+	/* data compressed before there was a dictionary still has to come back */
+	out.len = 0;
+	zfp = zip_decompress_stream_new(COMPRESSOR_ZSTD, 0, mem_sink, &out);
+	TEST_ASSERT(zfp);
+	TEST_ASSERT(zip_stream_use_dict(zfp, zd_loaded) == 0);
+	TEST_ASSERT(zip_to_buffer(zfp, plain.data, plain.len) == 0);
+	zip_stream_free(zfp);
+	zfp = NULL;
+	TEST_ASSERT(out.len == record_len && memcmp(out.data, record, record_len) == 0);
+
+	/* without the dictionary, the data cannot be decompressed */
+	out.len = 0;
+	zfp = zip_decompress_stream_new(COMPRESSOR_ZSTD, 0, mem_sink, &out);
+	TEST_ASSERT(zfp);
+	TEST_ASSERT(zip_to_buffer(zfp, with_dict.data, with_dict.len) != 0);
+
+cleanup:
+	zip_stream_free(zfp);
+	zip_dict_free(zd);
+	zip_dict_free(zd_loaded);
+	free(samples);
+	free(sample_lens);
+}
+
+void test_zip_incompressible(enum TEST_STATUS* status){
+	const enum compressor compressors[] = { COMPRESSOR_GZIP, COMPRESSOR_GZIP, COMPRESSOR_BZIP2, COMPRESSOR_XZ, COMPRESSOR_LZ4, COMPRESSOR_ZSTD };
+	const unsigned flags[] = { 0, ZIP_WORKERS(2), 0, 0, 0, 0 };
+	unsigned char data[4096];
+	unsigned char noise[4096];
+	struct mem_buffer mb;
+	struct ZIP_FILE* zfp = NULL;
+	size_t i;
+
+	fill_sample_data(data, sizeof(data));
+	srand(1337);
+	for (i = 0; i < sizeof(noise); ++i){
+		noise[i] = rand() & 0xFF;
+	}
+
+	/* restoring relies on every compressor's output starting with its magic number, and nothing else's */
+	for (i = 0; i < sizeof(compressors) / sizeof(compressors[0]); ++i){
+		mb.len = 0;
+		zfp = zip_stream_new(compressors[i], 3, flags[i], mem_sink, &mb);
+		TEST_ASSERT(zfp);
+		TEST_ASSERT(zip_stream_write(zfp, data, 100) == 0);
+		TEST_ASSERT(zip_stream_finish(zfp) == 0);
+		zip_stream_free(zfp);
+		zfp = NULL;
+
+		TEST_ASSERT(zip_has_magic(compressors[i], mb.data, mb.len));
+		TEST_ASSERT(zip_has_magic(compressors[i], mb.data, 2));
+		TEST_ASSERT(!zip_has_magic(compressors[i], data, sizeof(data)));
+		TEST_ASSERT(!zip_has_magic(compressors[i], noise, sizeof(noise)));
+	}
+	TEST_ASSERT(zip_has_magic(COMPRESSOR_NONE, noise, sizeof(noise)));
+
+	TEST_ASSERT(zip_is_incompressible(noise, sizeof(noise)));
+	TEST_ASSERT(!zip_is_incompressible(data, sizeof(data)));
+
+	TEST_ASSERT(zip_incompressible_name("/home/user/Pictures/IMG_0001.JPG"));
+	TEST_ASSERT(zip_incompressible_name("/var/log/syslog.2.gz"));
+	TEST_ASSERT(!zip_incompressible_name("/home/user/notes.txt"));
+	TEST_ASSERT(!zip_incompressible_name("/home/user.gz/notes"));
+	TEST_ASSERT(!zip_incompressible_name("/home/user/Makefile"));
+
+cleanup:
+	zip_stream_free(zfp);
+}
+
+void test_zip_stream_reuse(enum TEST_STATUS* status){
+	const enum compressor compressors[] = { COMPRESSOR_GZIP, COMPRESSOR_GZIP, COMPRESSOR_XZ, COMPRESSOR_LZ4, COMPRESSOR_ZSTD };
+	const unsigned flags[] = { 0, ZIP_WORKERS(2), 0, 0, 0 };
+	char record[2][256];
+	size_t record_len[2];
+	struct mem_buffer mb[2];
+	struct mem_buffer out;
+	struct ZIP_FILE* zfp = NULL;
+	struct ZIP_FILE* first;
+	struct ZIP_FILE* other = NULL;
+	size_t i;
+	size_t j;
+
+	record_len[0] = make_record(record[0], 1);
+	record_len[1] = make_record(record[1], 2);
+
+	for (i = 0; i < sizeof(compressors) / sizeof(compressors[0]); ++i){
+		first = NULL;
+		for (j = 0; j < 2; ++j){
+			mb[j].len = 0;
+			zfp = zip_stream_new(compressors[i], 5, flags[i], mem_sink, &mb[j]);
+			TEST_ASSERT(zfp);
+			/* the second file gets the stream the first one finished with */
+			TEST_ASSERT(j == 0 || zfp == first);
+			first = zfp;
+			TEST_ASSERT(zip_to_buffer(zfp, record[j], record_len[j]) == 0);
+			zip_stream_free(zfp);
+			zfp = NULL;
+		}
+
+		/* different settings need a stream of their own */
+		mb[0].len = 0;
+		other = zip_stream_new(compressors[i], 6, flags[i], mem_sink, &mb[0]);
+		TEST_ASSERT(other && other != first);
+		zip_stream_free(other);
+		other = NULL;
+
+		/* each file has to come out as its own complete stream */
+		out.len = 0;
+		zfp = zip_decompress_stream_new(compressors[i], 0, mem_sink, &out);
+		TEST_ASSERT(zfp);
+		TEST_ASSERT(zip_to_buffer(zfp, mb[1].data, mb[1].len) == 0);
+		zip_stream_free(zfp);
+		zfp = NULL;
+		TEST_ASSERT(out.len == record_len[1] && memcmp(out.data, record[1], record_len[1]) == 0);
+	}
+
+cleanup:
+	zip_stream_free(zfp);
+	zip_stream_free(other);
+}
+
+void test_zip_compress_stream(enum TEST_STATUS* status){
+	const char* file = "file.txt";
+	const char* arch = "file.txt.arch";
+	const enum compressor compressors[] = { COMPRESSOR_GZIP, COMPRESSOR_BZIP2, COMPRESSOR_XZ, COMPRESSOR_LZ4, COMPRESSOR_ZSTD, COMPRESSOR_NONE };
+	unsigned char data[1337];
+	struct zip_buffer in;
+	struct zip_buffer zipped;
+	FILE* fp = NULL;
+	int fd_in = -1;
+	int fd_out = -1;
+	size_t i;
+
+	memset(&zipped, 0, sizeof(zipped));
+	fill_sample_data(data, sizeof(data));
+	in.data = data;
+	in.len = sizeof(data);
+	in.size = sizeof(data);
+
+	for (i = 0; i < sizeof(compressors) / sizeof(compressors[0]); ++i){
+		/* memory to memory, then back out to a FILE* */
+		in.pos = 0;
+		free(zipped.data);
+		memset(&zipped, 0, sizeof(zipped));
+		TEST_ASSERT(zip_compress_stream(compressors[i], 3, 0, zip_buffer_source, &in, zip_buffer_sink, &zipped) == 0);
+
+		fp = fopen(file, "wb");
+		TEST_ASSERT(fp);
+		TEST_ASSERT(zip_decompress_stream(compressors[i], 0, zip_buffer_source, &zipped, zip_fp_sink, fp) == 0);
+		TEST_ASSERT(fclose(fp) == 0);
+		fp = NULL;
+		TEST_ASSERT(memcmp_file_data(file, data, sizeof(data)) == 0);
+
+		/* cut short, which only COMPRESSOR_NONE cannot tell */
+		if (compressors[i] != COMPRESSOR_NONE){
+			in.pos = 0;
+			zipped.pos = 0;
+			zipped.len /= 2;
+			fp = fopen(file, "wb");
+			TEST_ASSERT(fp);
+			TEST_ASSERT(zip_decompress_stream(compressors[i], 0, zip_buffer_source, &zipped, zip_fp_sink, fp) != 0);
+			TEST_ASSERT(fclose(fp) == 0);
+			fp = NULL;
+		}
+
+		/* file descriptor to file descriptor and back */
+		create_file(file, data, sizeof(data));
+		fd_in = open(file, O_RDONLY);
+		fd_out = open(arch, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		TEST_ASSERT(fd_in >= 0 && fd_out >= 0);
+		TEST_ASSERT(zip_compress_stream(compressors[i], 3, 0, zip_fd_source, &fd_in, zip_fd_sink, &fd_out) == 0);
+		close(fd_in);
+		close(fd_out);
+		remove(file);
+
+		fd_in = open(arch, O_RDONLY);
+		fd_out = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		TEST_ASSERT(fd_in >= 0 && fd_out >= 0);
+		TEST_ASSERT(zip_decompress_stream(compressors[i], 0, zip_fd_source, &fd_in, zip_fd_sink, &fd_out) == 0);
+		close(fd_in);
+		close(fd_out);
+		fd_in = -1;
+		fd_out = -1;
+		TEST_ASSERT(memcmp_file_data(file, data, sizeof(data)) == 0);
+		remove(file);
+		remove(arch);
+	}
+
+cleanup:
+	free(zipped.data);
+	fp ? fclose(fp) : 0;
+	fd_in >= 0 ? close(fd_in) : 0;
+	fd_out >= 0 ? close(fd_out) : 0;
+	remove(file);
+	remove(arch);
+}
+
+void test_zip_seekable(enum TEST_STATUS* status){
+	const char* file = "file.txt";
+	const char* arch = "file.txt.arch";
+	const enum compressor compressors[] = { COMPRESSOR_GZIP, COMPRESSOR_BZIP2, COMPRESSOR_XZ };
+	/* offset and length of each range in KiB, the last ones running past the end */
+	const size_t ranges[][2] = { { 0, 10 }, { 1000, 100 }, { 1500, 3000 }, { 5000, 1000 }, { 20000, 10 } };
+	/* several of the 1MiB blocks */
+	const size_t data_len = (size_t)5555 << 10;
+	unsigned char* data = NULL;
+	struct zip_buffer in;
+	struct zip_buffer zipped;
+	struct zip_buffer part;
+	size_t zipped_len;
+	FILE* fp = NULL;
+	size_t i;
+	size_t j;
+
+	memset(&zipped, 0, sizeof(zipped));
+	memset(&part, 0, sizeof(part));
+	data = malloc(data_len);
+	TEST_ASSERT(data);
+	fill_sample_data(data, data_len);
+	in.data = data;
+	in.len = data_len;
+	in.size = data_len;
+
+	for (i = 0; i < sizeof(compressors) / sizeof(compressors[0]); ++i){
+		in.pos = 0;
+		free(zipped.data);
+		memset(&zipped, 0, sizeof(zipped));
+		TEST_ASSERT(zip_compress_stream(compressors[i], 3, ZIP_SEEKABLE_MIB(1), zip_buffer_source, &in, zip_buffer_sink, &zipped) == 0);
+		TEST_ASSERT(zip_has_magic(compressors[i], zipped.data, zipped.len));
+
+		/* a plain decompression tells the layout apart by itself */
+		fp = fopen(file, "wb");
+		TEST_ASSERT(fp);
+		TEST_ASSERT(zip_decompress_stream(compressors[i], 0, zip_buffer_source, &zipped, zip_fp_sink, fp) == 0);
+		TEST_ASSERT(fclose(fp) == 0);
+		fp = NULL;
+		TEST_ASSERT(memcmp_file_data(file, data, data_len) == 0);
+
+		/* cut off in the middle of the blocks */
+		zipped.pos = 0;
+		zipped_len = zipped.len;
+		zipped.len /= 2;
+		fp = fopen(file, "wb");
+		TEST_ASSERT(fp);
+		TEST_ASSERT(zip_decompress_stream(compressors[i], 0, zip_buffer_source, &zipped, zip_fp_sink, fp) != 0);
+		TEST_ASSERT(fclose(fp) == 0);
+		fp = NULL;
+		zipped.len = zipped_len;
+
+		/* the data has to start where the file pointer is */
+		fp = fopen(arch, "w+b");
+		TEST_ASSERT(fp);
+		TEST_ASSERT(fwrite("junk", 1, 4, fp) == 4);
+		TEST_ASSERT(fwrite(zipped.data, 1, zipped.len, fp) == zipped.len);
+		for (j = 0; j < sizeof(ranges) / sizeof(ranges[0]); ++j){
+			size_t offset = ranges[j][0] << 10;
+			size_t len = ranges[j][1] << 10;
+			size_t expected = offset >= data_len ? 0 : data_len - offset;
+
+			if (expected > len){
+				expected = len;
+			}
+			part.len = 0;
+			TEST_ASSERT(fseek(fp, 4, SEEK_SET) == 0);
+			TEST_ASSERT(zip_decompress_range(fp, compressors[i], 0, NULL, offset, len, zip_buffer_sink, &part) == 0);
+			TEST_ASSERT(part.len == expected);
+			TEST_ASSERT(expected == 0 || memcmp(part.data, data + offset, expected) == 0);
+		}
+
+		/* anything else is left for a full decompression */
+		TEST_ASSERT(fseek(fp, 0, SEEK_SET) == 0);
+		TEST_ASSERT(zip_decompress_range(fp, compressors[i], 0, NULL, 0, 10, zip_buffer_sink, &part) > 0);
+		TEST_ASSERT(ftell(fp) == 0);
+		TEST_ASSERT(fclose(fp) == 0);
+		fp = NULL;
+		remove(arch);
+	}
+
+cleanup:
+	free(data);
+	free(zipped.data);
+	free(part.data);
+	fp ? fclose(fp) : 0;
+	remove(file);
+	remove(arch);
+}
@@ -15,10 +15,23 @@ void test_compress_gzip(enum TEST_STATUS* status);
 void test_compress_bzip2(enum TEST_STATUS* status);
 void test_compress_xz(enum TEST_STATUS* status);
 void test_compress_lz4(enum TEST_STATUS* status);
+void test_compress_zstd(enum TEST_STATUS* status);
 void test_decompress_gzip(enum TEST_STATUS* status);
 void test_decompress_bzip2(enum TEST_STATUS* status);
 void test_decompress_xz(enum TEST_STATUS* status);
 void test_decompress_lz4(enum TEST_STATUS* status);
+void test_decompress_zstd(enum TEST_STATUS* status);
+void test_zstd_flags(enum TEST_STATUS* status);
+void test_zip_parallel(enum TEST_STATUS* status);
+void test_xz_parallel(enum TEST_STATUS* status);
+void test_lz4_parallel(enum TEST_STATUS* status);
+void test_zip_stream(enum TEST_STATUS* status);
+void test_zip_decompress_stream(enum TEST_STATUS* status);
+void test_zip_dict(enum TEST_STATUS* status);
+void test_zip_incompressible(enum TEST_STATUS* status);
+void test_zip_stream_reuse(enum TEST_STATUS* status);
+void test_zip_compress_stream(enum TEST_STATUS* status);
+void test_zip_seekable(enum TEST_STATUS* status);
 
 EXPORT_PKG(compression_zip_pkg);
 #endif
@@ -45,7 +45,9 @@ void test_easy_encrypt_inplace(enum TEST_STATUS* status){
 	create_file(file, data, sizeof(data));
 
 	TEST_ASSERT(easy_encrypt_inplace(file, "AES-256-CBC", 1, "hunter2") == 0);
+	TEST_ASSERT(memcmp_file_data(file, data, sizeof(data)) != 0);
 	TEST_ASSERT(easy_decrypt_inplace(file, "AES-256-CBC", 1, "hunter2") == 0);
+	TEST_ASSERT(memcmp_file_data(file, data, sizeof(data)) == 0);
 
 cleanup:
 	remove(file);
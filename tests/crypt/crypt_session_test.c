@@ -0,0 +1,164 @@
+/** @file tests/crypt/crypt_session_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "crypt_session_test.h"
+#include "../../crypt/crypt_session.h"
+#include "../../crypt/crypt_easy.h"
+#include "../../log.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const char* const sample_file = "session.txt";
+static const char* const sample_file_crypt = "session.txt.enc";
+static const char* const sample_file_crypt2 = "session2.txt.enc";
+static const char* const sample_file_decrypt = "session_decrypt.txt";
+static const char* const password = "hunter2";
+
+const struct unit_test crypt_session_tests[] = {
+	MAKE_TEST(test_crypt_session),
+	MAKE_TEST(test_crypt_session_sessions),
+	MAKE_TEST(test_crypt_session_legacy)
+};
+MAKE_PKG(crypt_session_tests, crypt_session_pkg);
+
+static int session_encrypt(struct crypt_session* cs, const char* in, const char* out){
+	struct crypt_keys* fk;
+	int ret;
+
+	if (crypt_session_encryption_keys(cs, &fk) != 0){
+		return -1;
+	}
+	ret = crypt_encrypt(in, fk, out);
+	crypt_free(fk);
+	return ret;
+}
+
+static int session_decrypt(struct crypt_session* cs, const char* in, const char* out){
+	struct crypt_keys* fk;
+	FILE* fp;
+	int ret;
+
+	if (!(fp = fopen(in, "rb"))){
+		return -1;
+	}
+	ret = crypt_session_decryption_keys(cs, fp, &fk);
+	fclose(fp);
+	if (ret != 0){
+		return -1;
+	}
+	ret = crypt_decrypt(in, fk, out);
+	crypt_free(fk);
+	return ret;
+}
+
+void test_crypt_session(enum TEST_STATUS* status){
+	struct crypt_session* cs = NULL;
+	struct crypt_session* cs_wrong = NULL;
+	struct crypt_keys* fk = NULL;
+	unsigned char sample_data[1337];
+	unsigned char salt[8];
+	unsigned char nonce[CRYPT_NONCE_LEN];
+	unsigned char nonce2[CRYPT_NONCE_LEN];
+	FILE* fp = NULL;
+
+	fill_sample_data(sample_data, sizeof(sample_data));
+	create_file(sample_file, sample_data, sizeof(sample_data));
+
+	TEST_ASSERT((cs = crypt_session_new(EVP_aes_256_gcm(), password)) != NULL);
+	TEST_ASSERT(session_encrypt(cs, sample_file, sample_file_crypt) == 0);
+	TEST_ASSERT(session_encrypt(cs, sample_file, sample_file_crypt2) == 0);
+
+	/* the same session key, but every file gets its own nonce and therefore its own keys */
+	TEST_ASSERT((fp = fopen(sample_file_crypt, "rb")) != NULL);
+	TEST_ASSERT(crypt_session_decryption_keys(cs, fp, &fk) == 0);
+	TEST_ASSERT(crypt_get_session(fk, salt, nonce) == 0);
+	crypt_free(fk);
+	fk = NULL;
+	fclose(fp);
+	TEST_ASSERT((fp = fopen(sample_file_crypt2, "rb")) != NULL);
+	TEST_ASSERT(crypt_session_decryption_keys(cs, fp, &fk) == 0);
+	TEST_ASSERT(crypt_get_session(fk, NULL, nonce2) == 0);
+	fclose(fp);
+	fp = NULL;
+	TEST_ASSERT(memcmp(nonce, nonce2, sizeof(nonce)) != 0);
+	TEST_ASSERT(memcmp_file_file(sample_file_crypt, sample_file_crypt2) != 0);
+
+	TEST_ASSERT(session_decrypt(cs, sample_file_crypt, sample_file_decrypt) == 0);
+	TEST_ASSERT(memcmp_file_data(sample_file_decrypt, sample_data, sizeof(sample_data)) == 0);
+	remove(sample_file_decrypt);
+
+	/* easy_decrypt() has no session, so it has to derive this file's session key by itself */
+	TEST_ASSERT(easy_decrypt(sample_file_crypt2, sample_file_decrypt, "aes-256-gcm", 0, password) == 0);
+	TEST_ASSERT(memcmp_file_data(sample_file_decrypt, sample_data, sizeof(sample_data)) == 0);
+
+	TEST_ASSERT((cs_wrong = crypt_session_new(EVP_aes_256_gcm(), "hunter3")) != NULL);
+	TEST_ASSERT(session_decrypt(cs_wrong, sample_file_crypt, sample_file_decrypt) != 0);
+
+cleanup:
+	fp ? fclose(fp) : 0;
+	fk ? crypt_free(fk) : (void)0;
+	crypt_session_free(cs);
+	crypt_session_free(cs_wrong);
+	remove(sample_file);
+	remove(sample_file_crypt);
+	remove(sample_file_crypt2);
+	remove(sample_file_decrypt);
+}
+
+void test_crypt_session_sessions(enum TEST_STATUS* status){
+	struct crypt_session* cs = NULL;
+	struct crypt_session* cs2 = NULL;
+	struct crypt_session* cs_restore = NULL;
+	unsigned char sample_data[999];
+
+	fill_sample_data(sample_data, sizeof(sample_data));
+	create_file(sample_file, sample_data, sizeof(sample_data));
+
+	/* like two incremental backups made on different runs */
+	TEST_ASSERT((cs = crypt_session_new(EVP_aes_256_cbc(), password)) != NULL);
+	TEST_ASSERT((cs2 = crypt_session_new(EVP_aes_256_cbc(), password)) != NULL);
+	TEST_ASSERT(session_encrypt(cs, sample_file, sample_file_crypt) == 0);
+	TEST_ASSERT(session_encrypt(cs2, sample_file, sample_file_crypt2) == 0);
+
+	TEST_ASSERT((cs_restore = crypt_session_new(EVP_aes_256_cbc(), password)) != NULL);
+	TEST_ASSERT(session_decrypt(cs_restore, sample_file_crypt, sample_file_decrypt) == 0);
+	TEST_ASSERT(memcmp_file_data(sample_file_decrypt, sample_data, sizeof(sample_data)) == 0);
+	remove(sample_file_decrypt);
+	TEST_ASSERT(session_decrypt(cs_restore, sample_file_crypt2, sample_file_decrypt) == 0);
+	TEST_ASSERT(memcmp_file_data(sample_file_decrypt, sample_data, sizeof(sample_data)) == 0);
+
+cleanup:
+	crypt_session_free(cs);
+	crypt_session_free(cs2);
+	crypt_session_free(cs_restore);
+	remove(sample_file);
+	remove(sample_file_crypt);
+	remove(sample_file_crypt2);
+	remove(sample_file_decrypt);
+}
+
+void test_crypt_session_legacy(enum TEST_STATUS* status){
+	struct crypt_session* cs = NULL;
+	unsigned char sample_data[999];
+
+	fill_sample_data(sample_data, sizeof(sample_data));
+	create_file(sample_file, sample_data, sizeof(sample_data));
+
+	/* backups made before sessions have a plain "Salted__" header */
+	TEST_ASSERT(easy_encrypt(sample_file, sample_file_crypt, "aes-256-cbc", 0, password) == 0);
+
+	TEST_ASSERT((cs = crypt_session_new(EVP_aes_256_cbc(), password)) != NULL);
+	TEST_ASSERT(session_decrypt(cs, sample_file_crypt, sample_file_decrypt) == 0);
+	TEST_ASSERT(memcmp_file_data(sample_file_decrypt, sample_data, sizeof(sample_data)) == 0);
+
+cleanup:
+	crypt_session_free(cs);
+	remove(sample_file);
+	remove(sample_file_crypt);
+	remove(sample_file_decrypt);
+}
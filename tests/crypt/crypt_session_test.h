@@ -0,0 +1,19 @@
+/** @file tests/crypt/crypt_session_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __CRYPT_SESSION_TEST_H
+#define __CRYPT_SESSION_TEST_H
+
+#include "../test_framework.h"
+
+void test_crypt_session(enum TEST_STATUS* status);
+void test_crypt_session_sessions(enum TEST_STATUS* status);
+void test_crypt_session_legacy(enum TEST_STATUS* status);
+
+EXPORT_PKG(crypt_session_pkg);
+#endif
@@ -11,6 +11,7 @@
 #include "../../log.h"
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 static const char* const sample_file = "crypt.txt";
 static const char* const sample_file_crypt = "crypt.txt.aes";
@@ -22,7 +23,11 @@ static const unsigned char salt[8] = {0, 0, 0, 0, 0, 0, 0, 0};
 
 const struct unit_test crypt_tests[] = {
 	MAKE_TEST(test_crypt_encrypt),
-	MAKE_TEST(test_crypt_decrypt)
+	MAKE_TEST(test_crypt_decrypt),
+	MAKE_TEST(test_crypt_aead),
+	MAKE_TEST(test_crypt_aead_tamper),
+	MAKE_TEST(test_crypt_buf),
+	MAKE_TEST(test_crypt_fp)
 };
 MAKE_PKG(crypt_tests, crypt_pkg);
 
@@ -86,3 +91,243 @@ cleanup:
 	remove(sample_file_decrypt);
 	remove(sample_file_decrypt2);
 }
+
+static struct crypt_keys* aead_keys(const EVP_CIPHER* cipher, const char* salt_file, unsigned n_workers){
+	struct crypt_keys* fk;
+
+	if (!(fk = crypt_new()) ||
+			crypt_set_encryption(cipher, fk) != 0 ||
+			(salt_file ? crypt_extract_salt(salt_file, fk) : crypt_set_salt(salt, fk)) != 0 ||
+			crypt_gen_keys((const unsigned char*)password, strlen(password), NULL, 1, fk) != 0 ||
+			crypt_set_workers(fk, n_workers) != 0){
+		fk ? crypt_free(fk) : (void)0;
+		return NULL;
+	}
+	return fk;
+}
+
+static long file_len(const char* file){
+	FILE* fp;
+	long len;
+
+	if (!(fp = fopen(file, "rb"))){
+		return -1;
+	}
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	fclose(fp);
+	return len;
+}
+
+void test_crypt_aead(enum TEST_STATUS* status){
+	const char* const ciphers[] = { "aes-256-gcm", "chacha20-poly1305" };
+	/* empty, one short chunk, exactly five chunks, and five chunks plus a bit */
+	const size_t lens[] = { 0, 999, CRYPT_CHUNK_LEN * 5, CRYPT_CHUNK_LEN * 5 + 7 };
+	const unsigned workers[] = { 1, 4 };
+	struct crypt_keys* fk = NULL;
+	unsigned char* sample_data = NULL;
+	size_t i;
+	size_t j;
+	size_t k;
+
+	TEST_ASSERT(crypt_is_aead(EVP_aes_256_gcm()));
+	TEST_ASSERT(crypt_is_aead(EVP_chacha20_poly1305()));
+	TEST_ASSERT(!crypt_is_aead(EVP_aes_256_cbc()));
+	TEST_ASSERT(!crypt_is_aead(EVP_enc_null()));
+
+	TEST_ASSERT((sample_data = malloc(CRYPT_CHUNK_LEN * 5 + 7)) != NULL);
+	fill_sample_data(sample_data, CRYPT_CHUNK_LEN * 5 + 7);
+
+	for (i = 0; i < sizeof(ciphers) / sizeof(ciphers[0]); ++i){
+		for (j = 0; j < sizeof(lens) / sizeof(lens[0]); ++j){
+			for (k = 0; k < sizeof(workers) / sizeof(workers[0]); ++k){
+				/* there is always a last chunk, even if it is empty */
+				size_t n_chunks = lens[j] == 0 ? 1 : (lens[j] + CRYPT_CHUNK_LEN - 1) / CRYPT_CHUNK_LEN;
+
+				printf("%s, %lu bytes, %u workers\n", ciphers[i], (unsigned long)lens[j], workers[k]);
+				create_file(sample_file, sample_data, lens[j]);
+
+				TEST_ASSERT((fk = aead_keys(crypt_get_cipher(ciphers[i]), NULL, workers[k])) != NULL);
+				TEST_ASSERT(crypt_encrypt(sample_file, fk, sample_file_crypt) == 0);
+				crypt_free(fk);
+				fk = NULL;
+				TEST_ASSERT(file_len(sample_file_crypt) == (long)(CRYPT_AEAD_OFFSET(CRYPT_CHUNK_LEN, n_chunks) - n_chunks * CRYPT_CHUNK_LEN + lens[j]));
+
+				TEST_ASSERT((fk = aead_keys(crypt_get_cipher(ciphers[i]), sample_file_crypt, workers[1 - k])) != NULL);
+				TEST_ASSERT(crypt_decrypt(sample_file_crypt, fk, sample_file_decrypt) == 0);
+				crypt_free(fk);
+				fk = NULL;
+				TEST_ASSERT(memcmp_file_data(sample_file_decrypt, sample_data, lens[j]) == 0);
+			}
+		}
+	}
+
+cleanup:
+	fk ? crypt_free(fk) : (void)0;
+	free(sample_data);
+	remove(sample_file);
+	remove(sample_file_crypt);
+	remove(sample_file_decrypt);
+}
+
+void test_crypt_aead_tamper(enum TEST_STATUS* status){
+	struct crypt_keys* fk = NULL;
+	/* a few chunks of the real size are too big for the stack */
+	static unsigned char sample_data[CRYPT_CHUNK_LEN * 3 + 100];
+	static unsigned char chunk[CRYPT_CHUNK_LEN + CRYPT_TAG_LEN];
+	static unsigned char out[CRYPT_CHUNK_LEN];
+	size_t out_len;
+	FILE* fp = NULL;
+	int c;
+
+	fill_sample_data(sample_data, sizeof(sample_data));
+	create_file(sample_file, sample_data, sizeof(sample_data));
+
+	TEST_ASSERT((fk = aead_keys(EVP_aes_256_gcm(), NULL, 2)) != NULL);
+	TEST_ASSERT(crypt_encrypt(sample_file, fk, sample_file_crypt) == 0);
+
+	/* any one chunk can be read on its own, but only where it belongs */
+	TEST_ASSERT((fp = fopen(sample_file_crypt, "rb")) != NULL);
+	fseek(fp, CRYPT_AEAD_OFFSET(CRYPT_CHUNK_LEN, 1), SEEK_SET);
+	TEST_ASSERT(fread(chunk, 1, sizeof(chunk), fp) == sizeof(chunk));
+	TEST_ASSERT(crypt_decrypt_chunk(fk, 1, 0, chunk, sizeof(chunk), out, &out_len) == 0);
+	TEST_ASSERT(out_len == CRYPT_CHUNK_LEN);
+	TEST_ASSERT(memcmp(out, sample_data + CRYPT_CHUNK_LEN, CRYPT_CHUNK_LEN) == 0);
+	TEST_ASSERT(crypt_decrypt_chunk(fk, 2, 0, chunk, sizeof(chunk), out, &out_len) != 0);
+	TEST_ASSERT(crypt_decrypt_chunk(fk, 1, 1, chunk, sizeof(chunk), out, &out_len) != 0);
+	fclose(fp);
+	fp = NULL;
+
+	/* one flipped bit in the middle chunk */
+	TEST_ASSERT((fp = fopen(sample_file_crypt, "r+b")) != NULL);
+	fseek(fp, CRYPT_AEAD_OFFSET(CRYPT_CHUNK_LEN, 1) + 10, SEEK_SET);
+	c = fgetc(fp);
+	fseek(fp, CRYPT_AEAD_OFFSET(CRYPT_CHUNK_LEN, 1) + 10, SEEK_SET);
+	fputc(c ^ 1, fp);
+	fclose(fp);
+	fp = NULL;
+	TEST_ASSERT(crypt_decrypt(sample_file_crypt, fk, sample_file_decrypt) != 0);
+	TEST_ASSERT(!does_file_exist(sample_file_decrypt));
+
+	/* cut off after a whole chunk, which would look fine without the last chunk flag */
+	TEST_ASSERT(crypt_encrypt(sample_file, fk, sample_file_crypt) == 0);
+	TEST_ASSERT(truncate(sample_file_crypt, CRYPT_AEAD_OFFSET(CRYPT_CHUNK_LEN, 2)) == 0);
+	TEST_ASSERT(crypt_decrypt(sample_file_crypt, fk, sample_file_decrypt) != 0);
+
+	/* the wrong password */
+	TEST_ASSERT(crypt_encrypt(sample_file, fk, sample_file_crypt) == 0);
+	crypt_free(fk);
+	TEST_ASSERT((fk = crypt_new()) != NULL);
+	TEST_ASSERT(crypt_set_encryption(EVP_aes_256_gcm(), fk) == 0);
+	TEST_ASSERT(crypt_extract_salt(sample_file_crypt, fk) == 0);
+	TEST_ASSERT(crypt_gen_keys((const unsigned char*)"wrong", 5, NULL, 1, fk) == 0);
+	TEST_ASSERT(crypt_decrypt(sample_file_crypt, fk, sample_file_decrypt) != 0);
+
+cleanup:
+	fp ? fclose(fp) : 0;
+	fk ? crypt_free(fk) : (void)0;
+	remove(sample_file);
+	remove(sample_file_crypt);
+	remove(sample_file_decrypt);
+}
+
+void test_crypt_buf(enum TEST_STATUS* status){
+	const EVP_CIPHER* ciphers[2];
+	struct crypt_keys* fk = NULL;
+	static unsigned char sample_data[CRYPT_CHUNK_LEN * 2 + 999];
+	unsigned char* crypt_data = NULL;
+	unsigned char* decrypt_data = NULL;
+	size_t crypt_len;
+	size_t decrypt_len;
+	size_t i;
+
+	ciphers[0] = EVP_aes_256_cbc();
+	ciphers[1] = EVP_aes_256_gcm();
+	fill_sample_data(sample_data, sizeof(sample_data));
+	create_file(sample_file, sample_data, sizeof(sample_data));
+
+	for (i = 0; i < sizeof(ciphers) / sizeof(ciphers[0]); ++i){
+		TEST_ASSERT((fk = aead_keys(ciphers[i], NULL, 1)) != NULL);
+		TEST_ASSERT((crypt_data = malloc(crypt_encrypted_len(fk, sizeof(sample_data)))) != NULL);
+		TEST_ASSERT((decrypt_data = malloc(sizeof(sample_data))) != NULL);
+
+		/* too small for the padding or the tags */
+		TEST_ASSERT(crypt_encrypt_buf(sample_data, sizeof(sample_data), fk, crypt_data, sizeof(sample_data), &crypt_len) != 0);
+
+		/* the same bytes crypt_encrypt() writes to a file */
+		TEST_ASSERT(crypt_encrypt_buf(sample_data, sizeof(sample_data), fk, crypt_data, crypt_encrypted_len(fk, sizeof(sample_data)), &crypt_len) == 0);
+		TEST_ASSERT(crypt_encrypt(sample_file, fk, sample_file_crypt) == 0);
+		TEST_ASSERT(memcmp_file_data(sample_file_crypt, crypt_data, crypt_len) == 0);
+		crypt_free(fk);
+		fk = NULL;
+
+		TEST_ASSERT((fk = crypt_new()) != NULL);
+		TEST_ASSERT(crypt_set_encryption(ciphers[i], fk) == 0);
+		TEST_ASSERT(crypt_read_salt_buf(crypt_data, crypt_len, fk) == 0);
+		TEST_ASSERT(crypt_gen_keys((const unsigned char*)password, strlen(password), NULL, 1, fk) == 0);
+		TEST_ASSERT(crypt_decrypt_buf(crypt_data, crypt_len, fk, decrypt_data, sizeof(sample_data), &decrypt_len) == 0);
+		TEST_ASSERT(decrypt_len == sizeof(sample_data));
+		TEST_ASSERT(memcmp(decrypt_data, sample_data, sizeof(sample_data)) == 0);
+
+		/* a buffer cut short */
+		TEST_ASSERT(crypt_decrypt_buf(crypt_data, crypt_len - 1, fk, decrypt_data, sizeof(sample_data), &decrypt_len) != 0);
+
+		crypt_free(fk);
+		fk = NULL;
+		free(crypt_data);
+		crypt_data = NULL;
+		free(decrypt_data);
+		decrypt_data = NULL;
+	}
+
+	TEST_ASSERT((fk = crypt_new()) != NULL);
+	TEST_ASSERT(crypt_read_salt_buf("Salted_", 7, fk) != 0);
+	TEST_ASSERT(crypt_read_salt_buf("NotSalty12345678", 16, fk) != 0);
+
+cleanup:
+	fk ? crypt_free(fk) : (void)0;
+	free(crypt_data);
+	free(decrypt_data);
+	remove(sample_file);
+	remove(sample_file_crypt);
+}
+
+void test_crypt_fp(enum TEST_STATUS* status){
+	struct crypt_keys* fk = NULL;
+	unsigned char sample_data[5000];
+	FILE* fp_in = NULL;
+	FILE* fp_out = NULL;
+
+	fill_sample_data(sample_data, sizeof(sample_data));
+	create_file(sample_file, sample_data, sizeof(sample_data));
+
+	TEST_ASSERT((fk = aead_keys(EVP_chacha20_poly1305(), NULL, 1)) != NULL);
+	TEST_ASSERT((fp_in = fopen(sample_file, "rb")) != NULL);
+	TEST_ASSERT((fp_out = fopen(sample_file_crypt, "wb")) != NULL);
+	TEST_ASSERT(crypt_encrypt_fp(fp_in, fk, fp_out) == 0);
+	fclose(fp_in);
+	fp_in = NULL;
+	fclose(fp_out);
+	fp_out = NULL;
+	crypt_free(fk);
+	fk = NULL;
+
+	TEST_ASSERT((fk = crypt_new()) != NULL);
+	TEST_ASSERT(crypt_set_encryption(EVP_chacha20_poly1305(), fk) == 0);
+	TEST_ASSERT((fp_in = fopen(sample_file_crypt, "rb")) != NULL);
+	TEST_ASSERT(crypt_read_salt(fp_in, fk) == 0);
+	TEST_ASSERT(crypt_gen_keys((const unsigned char*)password, strlen(password), NULL, 1, fk) == 0);
+	TEST_ASSERT((fp_out = fopen(sample_file_decrypt, "wb")) != NULL);
+	TEST_ASSERT(crypt_decrypt_fp(fp_in, fk, fp_out) == 0);
+	fclose(fp_out);
+	fp_out = NULL;
+	TEST_ASSERT(memcmp_file_data(sample_file_decrypt, sample_data, sizeof(sample_data)) == 0);
+
+cleanup:
+	fp_in ? fclose(fp_in) : 0;
+	fp_out ? fclose(fp_out) : 0;
+	fk ? crypt_free(fk) : (void)0;
+	remove(sample_file);
+	remove(sample_file_crypt);
+	remove(sample_file_decrypt);
+}
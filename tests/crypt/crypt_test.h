@@ -13,6 +13,10 @@
 
 void test_crypt_encrypt(enum TEST_STATUS* status);
 void test_crypt_decrypt(enum TEST_STATUS* status);
+void test_crypt_aead(enum TEST_STATUS* status);
+void test_crypt_aead_tamper(enum TEST_STATUS* status);
+void test_crypt_buf(enum TEST_STATUS* status);
+void test_crypt_fp(enum TEST_STATUS* status);
 
 EXPORT_PKG(crypt_pkg);
 #endif
@@ -0,0 +1,124 @@
+/** @file tests/daemon_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "daemon_test.h"
+#include "../daemon.h"
+#include "../options/options.h"
+#include "../strings/stringarray.h"
+#include "../strings/stringhelper.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+const struct unit_test daemon_tests[] = {
+	MAKE_TEST(test_daemon_run),
+	MAKE_TEST(test_daemon_request_no_daemon)
+};
+MAKE_PKG(daemon_tests, daemon_pkg);
+
+#define TEST_DIR "TEST_DAEMON_DIR"
+#define TEST_OUT "TEST_DAEMON_OUT"
+#define TEST_SOCKET "TEST_DAEMON.sock"
+
+static int wait_for_socket(const char* file){
+	int i;
+
+	for (i = 0; i < 50; ++i){
+		if (does_file_exist(file)){
+			return 1;
+		}
+		usleep(100000);
+	}
+	return 0;
+}
+
+/* sends a command and checks the start of the reply */
+static int request_replies(const char* command, const char* expected){
+	FILE* fp = tmpfile();
+	char buf[128];
+	int ret = 0;
+
+	if (!fp){
+		return 0;
+	}
+	if (daemon_request(TEST_SOCKET, command, fp) >= 0){
+		rewind(fp);
+		ret = fgets(buf, sizeof(buf), fp) != NULL && strncmp(buf, expected, strlen(expected)) == 0;
+	}
+	fclose(fp);
+	return ret;
+}
+
+void test_daemon_run(enum TEST_STATUS* status){
+	struct options* opt = NULL;
+	char** files = NULL;
+	size_t files_len = 0;
+	pid_t pid = -1;
+	int wstatus;
+
+	setup_test_environment_basic(TEST_DIR, &files, &files_len);
+	remove(TEST_SOCKET);
+
+	opt = options_new();
+	TEST_ASSERT(opt);
+	TEST_ASSERT(sa_add(opt->directories, TEST_DIR) == 0);
+	free(opt->output_directory);
+	TEST_ASSERT((opt->output_directory = sh_dup(TEST_OUT)) != NULL);
+	opt->enc_algorithm = NULL;
+	TEST_ASSERT((opt->socket_file = sh_dup(TEST_SOCKET)) != NULL);
+
+	/* neither a schedule nor a socket leaves nothing to start a backup */
+	opt->interval = 0;
+	free(opt->socket_file);
+	opt->socket_file = NULL;
+	TEST_ASSERT(daemon_run(opt) < 0);
+	TEST_ASSERT((opt->socket_file = sh_dup(TEST_SOCKET)) != NULL);
+
+	pid = fork();
+	TEST_ASSERT(pid >= 0);
+	if (pid == 0){
+		_exit(daemon_run(opt) == 0 ? 0 : 1);
+	}
+
+	/* the first backup runs as soon as the daemon starts, and the command waits for it */
+	TEST_ASSERT(wait_for_socket(TEST_SOCKET));
+	TEST_ASSERT(request_replies("status", "runs=1 "));
+	TEST_ASSERT(request_replies("backup", "ok"));
+	TEST_ASSERT(request_replies("status", "runs=2 last="));
+	TEST_ASSERT(request_replies("nonsense", "unknown command"));
+
+	/* a second daemon cannot take over the socket */
+	TEST_ASSERT(daemon_run(opt) < 0);
+
+	TEST_ASSERT(request_replies("stop", "stopping"));
+	TEST_ASSERT(waitpid(pid, &wstatus, 0) == pid);
+	pid = -1;
+	TEST_ASSERT(WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0);
+	TEST_ASSERT(!does_file_exist(TEST_SOCKET));
+
+cleanup:
+	if (pid > 0){
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+	}
+	options_free(opt);
+	remove(TEST_SOCKET);
+	cleanup_test_environment(TEST_OUT, NULL);
+	cleanup_test_environment(TEST_DIR, files);
+}
+
+void test_daemon_request_no_daemon(enum TEST_STATUS* status){
+	remove(TEST_SOCKET);
+	TEST_ASSERT(daemon_request(TEST_SOCKET, "status", stdout) < 0);
+
+cleanup:
+	;
+}
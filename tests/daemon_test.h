@@ -0,0 +1,18 @@
+/** @file tests/daemon_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __DAEMON_TEST_H
+#define __DAEMON_TEST_H
+
+#include "test_framework.h"
+
+void test_daemon_run(enum TEST_STATUS* status);
+void test_daemon_request_no_daemon(enum TEST_STATUS* status);
+
+EXPORT_PKG(daemon_pkg);
+#endif
@@ -0,0 +1,182 @@
+/** @file tests/devsched_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "devsched_test.h"
+#include "../devsched.h"
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const struct unit_test devsched_tests[] = {
+	MAKE_TEST(test_dev_sched_group),
+	MAKE_TEST(test_dev_sched_lanes),
+	MAKE_TEST(test_dev_sched_limit),
+	MAKE_TEST(test_dev_sched_set_limit)
+};
+MAKE_PKG(devsched_tests, devsched_pkg);
+
+/* how many jobs of each lane are running, and the most that ever were */
+struct lane_counts{
+	pthread_mutex_t mutex;
+	int running[2];
+	int max_running[2];
+	/* set once jobs from both lanes were running at the same time */
+	int overlapped;
+	int done;
+};
+
+struct lane_job{
+	struct lane_counts* lc;
+	int lane;
+};
+
+static void slow_job(void* arg){
+	struct lane_job* lj = arg;
+	struct lane_counts* lc = lj->lc;
+
+	pthread_mutex_lock(&lc->mutex);
+	lc->running[lj->lane]++;
+	if (lc->running[lj->lane] > lc->max_running[lj->lane]){
+		lc->max_running[lj->lane] = lc->running[lj->lane];
+	}
+	if (lc->running[0] > 0 && lc->running[1] > 0){
+		lc->overlapped = 1;
+	}
+	pthread_mutex_unlock(&lc->mutex);
+
+	usleep(20000);
+
+	pthread_mutex_lock(&lc->mutex);
+	lc->running[lj->lane]--;
+	lc->done++;
+	pthread_mutex_unlock(&lc->mutex);
+}
+
+static void lane_counts_init(struct lane_counts* lc){
+	pthread_mutex_init(&lc->mutex, NULL);
+	lc->running[0] = lc->running[1] = 0;
+	lc->max_running[0] = lc->max_running[1] = 0;
+	lc->overlapped = 0;
+	lc->done = 0;
+}
+
+void test_dev_sched_group(enum TEST_STATUS* status){
+	const char* paths[] = { ".", "/proc", "/not/there", "." };
+	size_t lanes[4];
+	struct stat st_cwd;
+	struct stat st_proc;
+	size_t n;
+
+	TEST_ASSERT(stat(".", &st_cwd) == 0);
+	TEST_ASSERT(stat("/proc", &st_proc) == 0);
+
+	n = dev_sched_group(paths, 4, lanes);
+	/* the same device always gets the same lane, and the first one found is lane 0 */
+	TEST_ASSERT(lanes[0] == 0);
+	TEST_ASSERT(lanes[3] == 0);
+	TEST_ASSERT(lanes[2] == 0);
+	if (st_cwd.st_dev != st_proc.st_dev){
+		TEST_ASSERT(n == 2);
+		TEST_ASSERT(lanes[1] == 1);
+	}
+	else{
+		TEST_ASSERT(n == 1);
+		TEST_ASSERT(lanes[1] == 0);
+	}
+
+	TEST_ASSERT(dev_sched_group(paths + 2, 1, lanes) == 1);
+
+cleanup:
+	;
+}
+
+void test_dev_sched_lanes(enum TEST_STATUS* status){
+	struct dev_sched* ds = NULL;
+	struct lane_counts lc;
+	struct lane_job jobs[16];
+	int i;
+
+	lane_counts_init(&lc);
+	ds = dev_sched_new(4, 2, 0, 16);
+	TEST_ASSERT(ds);
+	TEST_ASSERT(dev_sched_threads(ds) == 4);
+
+	/* every job of the first lane is queued before any of the second's, like files sorted by path */
+	for (i = 0; i < 16; ++i){
+		jobs[i].lc = &lc;
+		jobs[i].lane = i < 8 ? 0 : 1;
+		TEST_ASSERT(dev_sched_submit(ds, jobs[i].lane, slow_job, &jobs[i]) == 0);
+	}
+	TEST_ASSERT(dev_sched_submit(ds, 2, slow_job, &jobs[0]) < 0);
+	dev_sched_free(ds);
+	ds = NULL;
+
+	TEST_ASSERT(lc.done == 16);
+	/* the second lane's jobs did not wait for the first's to finish */
+	TEST_ASSERT(lc.overlapped);
+
+cleanup:
+	dev_sched_free(ds);
+	pthread_mutex_destroy(&lc.mutex);
+}
+
+void test_dev_sched_limit(enum TEST_STATUS* status){
+	struct dev_sched* ds = NULL;
+	struct lane_counts lc;
+	struct lane_job jobs[12];
+	int i;
+
+	lane_counts_init(&lc);
+	ds = dev_sched_new(4, 2, 2, 0);
+	TEST_ASSERT(ds);
+
+	for (i = 0; i < 12; ++i){
+		jobs[i].lc = &lc;
+		jobs[i].lane = i % 3 == 0 ? 1 : 0;
+		TEST_ASSERT(dev_sched_submit(ds, jobs[i].lane, slow_job, &jobs[i]) == 0);
+	}
+	dev_sched_free(ds);
+	ds = NULL;
+
+	TEST_ASSERT(lc.done == 12);
+	TEST_ASSERT(lc.max_running[0] <= 2);
+	TEST_ASSERT(lc.max_running[1] <= 2);
+
+cleanup:
+	dev_sched_free(ds);
+	pthread_mutex_destroy(&lc.mutex);
+}
+
+void test_dev_sched_set_limit(enum TEST_STATUS* status){
+	struct dev_sched* ds = NULL;
+	struct lane_counts lc;
+	struct lane_job jobs[8];
+	int i;
+
+	lane_counts_init(&lc);
+	ds = dev_sched_new(4, 2, 0, 0);
+	TEST_ASSERT(ds);
+	dev_sched_set_limit(ds, 1);
+
+	for (i = 0; i < 8; ++i){
+		jobs[i].lc = &lc;
+		jobs[i].lane = i % 2;
+		TEST_ASSERT(dev_sched_submit(ds, jobs[i].lane, slow_job, &jobs[i]) == 0);
+	}
+	dev_sched_free(ds);
+	ds = NULL;
+
+	TEST_ASSERT(lc.done == 8);
+	TEST_ASSERT(!lc.overlapped);
+	TEST_ASSERT(lc.max_running[0] <= 1);
+	TEST_ASSERT(lc.max_running[1] <= 1);
+
+cleanup:
+	dev_sched_free(ds);
+	pthread_mutex_destroy(&lc.mutex);
+}
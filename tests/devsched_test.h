@@ -0,0 +1,20 @@
+/** @file tests/devsched_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __DEVSCHED_TEST_H
+#define __DEVSCHED_TEST_H
+
+#include "test_framework.h"
+
+void test_dev_sched_group(enum TEST_STATUS* status);
+void test_dev_sched_lanes(enum TEST_STATUS* status);
+void test_dev_sched_limit(enum TEST_STATUS* status);
+void test_dev_sched_set_limit(enum TEST_STATUS* status);
+
+EXPORT_PKG(devsched_pkg);
+#endif
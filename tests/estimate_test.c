@@ -0,0 +1,109 @@
+/** @file tests/estimate_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "estimate_test.h"
+#include "../estimate.h"
+#include "../checksum.h"
+#include "../checksumsort.h"
+#include "../filehelper.h"
+#include "../options/options.h"
+#include "../strings/stringarray.h"
+#include "../strings/stringhelper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const struct unit_test estimate_tests[] = {
+	MAKE_TEST(test_backup_estimate)
+};
+MAKE_PKG(estimate_tests, estimate_pkg);
+
+static int path_cmp(const void* p1, const void* p2){
+	return strcmp(*(char* const*)p1, *(char* const*)p2);
+}
+
+void test_backup_estimate(enum TEST_STATUS* status){
+	const char* dir = "TEST_ESTIMATE";
+	const char* out = "TEST_ESTIMATE_OUT";
+	char** files = NULL;
+	size_t n_files = 0;
+	struct options* opt = NULL;
+	struct backup_estimate be;
+	char* checksum_path = NULL;
+	FILE* fp = NULL;
+	unsigned long files_total;
+	uint64_t bytes_total;
+	size_t i;
+
+	setup_test_environment_basic(dir, &files, &n_files);
+	TEST_ASSERT(n_files >= 4);
+	TEST_ASSERT(mkdir_recursive(out) >= 0);
+
+	opt = options_new();
+	TEST_ASSERT(opt);
+	TEST_ASSERT(sa_add(opt->directories, dir) == 0);
+	free(opt->output_directory);
+	opt->output_directory = sh_dup(out);
+	opt->c_type = COMPRESSOR_GZIP;
+	opt->c_level = 6;
+
+	/* the first backup reads everything */
+	TEST_ASSERT(backup_estimate(opt, &be) == 0);
+	TEST_ASSERT(be.files_found == n_files);
+	TEST_ASSERT(be.files_read == n_files);
+	TEST_ASSERT(be.bytes_read == be.bytes_found);
+	TEST_ASSERT(be.sample_in > 0 && be.sample_in <= be.bytes_read);
+	TEST_ASSERT(be.c_type == COMPRESSOR_GZIP);
+	TEST_ASSERT(be.compress_rate > 0);
+	TEST_ASSERT(be.bytes_out > 0);
+	TEST_ASSERT(!be.uploads);
+	files_total = be.files_found;
+	bytes_total = be.bytes_found;
+
+	/* the last backup had the first half of them, which have not changed since */
+	qsort(files, n_files, sizeof(*files), path_cmp);
+	checksum_path = sh_concat_path(sh_dup(out), "checksums.txt");
+	TEST_ASSERT(checksum_path);
+	fp = fopen(checksum_path, "wb");
+	TEST_ASSERT(fp);
+	/* metadata from the last second is never trusted */
+	sleep(2);
+	for (i = 0; i < n_files / 2; ++i){
+		struct file_meta meta;
+		struct element e;
+
+		TEST_ASSERT(get_file_meta(files[i], &meta) == 0);
+		e.file = files[i];
+		e.checksum = "00";
+		e.meta = &meta;
+		e.artifact = NULL;
+		TEST_ASSERT(write_element_to_file(fp, &e) == 0);
+	}
+	TEST_ASSERT(fclose(fp) == 0);
+	fp = NULL;
+
+	TEST_ASSERT(backup_estimate(opt, &be) == 0);
+	TEST_ASSERT(be.files_found == files_total);
+	TEST_ASSERT(be.bytes_found == bytes_total);
+	TEST_ASSERT(be.files_read == n_files - n_files / 2);
+
+	/* paranoid hashes every file anyway */
+	opt->flags.bits.flag_paranoid = 1;
+	TEST_ASSERT(backup_estimate(opt, &be) == 0);
+	TEST_ASSERT(be.files_read == n_files);
+
+cleanup:
+	fp ? fclose(fp) : 0;
+	checksum_path ? remove(checksum_path) : 0;
+	free(checksum_path);
+	opt ? options_free(opt) : (void)0;
+	cleanup_test_environment(dir, files);
+	rmdir(out);
+}
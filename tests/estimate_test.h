@@ -0,0 +1,17 @@
+/** @file tests/estimate_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __ESTIMATE_TEST_H
+#define __ESTIMATE_TEST_H
+
+#include "test_framework.h"
+
+void test_backup_estimate(enum TEST_STATUS* status);
+
+EXPORT_PKG(estimate_pkg);
+#endif
@@ -0,0 +1,157 @@
+/** @file tests/exclude_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "exclude_test.h"
+#include "../exclude.h"
+#include "../fileiterator.h"
+#include "../strings/stringarray.h"
+#include <stdlib.h>
+#include <string.h>
+
+const struct unit_test exclude_tests[] = {
+	MAKE_TEST(test_exclude_match),
+	MAKE_TEST(test_exclude_glob),
+	MAKE_TEST(test_exclude_walk)
+};
+MAKE_PKG(exclude_tests, exclude_pkg);
+
+void test_exclude_match(enum TEST_STATUS* status){
+	struct string_array* arr = NULL;
+	struct exclude_trie* et = NULL;
+
+	arr = sa_new();
+	TEST_ASSERT(arr);
+	TEST_ASSERT(sa_add(arr, "/data/tmp") == 0);
+	TEST_ASSERT(sa_add(arr, "/var//cache/") == 0);
+	TEST_ASSERT(sa_add(arr, "/home/user/.local/share") == 0);
+	TEST_ASSERT(sa_add(arr, "/home/user/.local") == 0);
+	TEST_ASSERT(sa_add(arr, "rel/dir") == 0);
+
+	et = exclude_new(arr);
+	TEST_ASSERT(et);
+
+	TEST_ASSERT(exclude_match(et, "/data/tmp"));
+	TEST_ASSERT(exclude_match(et, "/data/tmp/"));
+	TEST_ASSERT(exclude_match(et, "/data/tmp/a/b"));
+	TEST_ASSERT(exclude_match(et, "//data/tmp/a"));
+	/* a raw prefix would have matched these */
+	TEST_ASSERT(!exclude_match(et, "/data/tmpfoo"));
+	TEST_ASSERT(!exclude_match(et, "/data/tmpfoo/a"));
+	TEST_ASSERT(!exclude_match(et, "/data"));
+	TEST_ASSERT(!exclude_match(et, "/data/other"));
+
+	TEST_ASSERT(exclude_match(et, "/var/cache/x"));
+	TEST_ASSERT(!exclude_match(et, "/var/caches"));
+
+	/* the shorter path excludes everything the longer one did */
+	TEST_ASSERT(exclude_match(et, "/home/user/.local/bin/x"));
+	TEST_ASSERT(exclude_match(et, "/home/user/.local/share/x"));
+	TEST_ASSERT(!exclude_match(et, "/home/user/.config"));
+
+	TEST_ASSERT(exclude_match(et, "rel/dir/file"));
+	TEST_ASSERT(!exclude_match(et, "/rel/dir/file"));
+	TEST_ASSERT(!exclude_match(et, "data/tmp/file"));
+
+	exclude_free(et);
+	et = exclude_new(NULL);
+	TEST_ASSERT(et);
+	TEST_ASSERT(!exclude_match(et, "/data/tmp"));
+
+cleanup:
+	exclude_free(et);
+	arr ? sa_free(arr) : (void)0;
+}
+
+void test_exclude_glob(enum TEST_STATUS* status){
+	struct string_array* arr = NULL;
+	struct exclude_trie* et = NULL;
+
+	arr = sa_new();
+	TEST_ASSERT(arr);
+	TEST_ASSERT(sa_add(arr, "/home/*/.cache") == 0);
+	TEST_ASSERT(sa_add(arr, "/home/admin/keep") == 0);
+	TEST_ASSERT(sa_add(arr, "/src/build-?") == 0);
+	TEST_ASSERT(sa_add(arr, "/logs/[ab]*.log") == 0);
+
+	et = exclude_new(arr);
+	TEST_ASSERT(et);
+
+	TEST_ASSERT(exclude_match(et, "/home/user/.cache/thumbs"));
+	TEST_ASSERT(exclude_match(et, "/home/admin/.cache"));
+	TEST_ASSERT(exclude_match(et, "/home/admin/keep/file"));
+	TEST_ASSERT(!exclude_match(et, "/home/admin/docs"));
+	TEST_ASSERT(!exclude_match(et, "/home/.cache"));
+	/* a glob only ever stands for one component */
+	TEST_ASSERT(!exclude_match(et, "/home/a/b/.cache"));
+
+	TEST_ASSERT(exclude_match(et, "/src/build-1/main.o"));
+	TEST_ASSERT(!exclude_match(et, "/src/build-10/main.o"));
+
+	TEST_ASSERT(exclude_match(et, "/logs/a1.log"));
+	TEST_ASSERT(exclude_match(et, "/logs/b.log"));
+	TEST_ASSERT(!exclude_match(et, "/logs/c.log"));
+
+cleanup:
+	exclude_free(et);
+	arr ? sa_free(arr) : (void)0;
+}
+
+void test_exclude_walk(enum TEST_STATUS* status){
+	const char* path = "TEST_EXCLUDE_DIR";
+	struct string_array* arr = NULL;
+	struct exclude_trie* et = NULL;
+	struct fi_stack* fis = NULL;
+	struct fi_walk* fw = NULL;
+	char** files = NULL;
+	size_t files_len = 0;
+	size_t n_expected = 0;
+	size_t n_found = 0;
+	const char* tmp;
+	char* walked = NULL;
+	size_t i;
+
+	setup_test_environment_full(path, &files, &files_len);
+	for (i = 0; i < files_len; ++i){
+		if (strncmp(files[i], "TEST_EXCLUDE_DIR/dir1/", strlen("TEST_EXCLUDE_DIR/dir1/")) != 0){
+			n_expected++;
+		}
+	}
+
+	arr = sa_new();
+	TEST_ASSERT(arr);
+	TEST_ASSERT(sa_add(arr, "TEST_EXCLUDE_DIR/dir1") == 0);
+	et = exclude_new(arr);
+	TEST_ASSERT(et);
+
+	fis = fi_start_ex(path, exclude_skip, et);
+	TEST_ASSERT(fis);
+	while ((tmp = fi_next_path(fis)) != NULL){
+		TEST_ASSERT(!exclude_match(et, tmp));
+		n_found++;
+	}
+	TEST_ASSERT(n_found == n_expected);
+	TEST_ASSERT(n_found < files_len);
+
+	n_found = 0;
+	fw = fi_walk_start(path, 0, 0, exclude_skip, et);
+	TEST_ASSERT(fw);
+	while ((walked = fi_walk_next(fw)) != NULL){
+		TEST_ASSERT(!exclude_match(et, walked));
+		n_found++;
+		TEST_FREE(walked, free);
+	}
+	TEST_ASSERT(n_found == n_expected);
+
+cleanup:
+	fis ? fi_end(fis) : (void)0;
+	fi_walk_end(fw);
+	free(walked);
+	exclude_free(et);
+	arr ? sa_free(arr) : (void)0;
+	cleanup_test_environment(path, files);
+}
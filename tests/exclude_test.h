@@ -0,0 +1,19 @@
+/** @file tests/exclude_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __EXCLUDE_TEST_H
+#define __EXCLUDE_TEST_H
+
+#include "test_framework.h"
+
+void test_exclude_match(enum TEST_STATUS* status);
+void test_exclude_glob(enum TEST_STATUS* status);
+void test_exclude_walk(enum TEST_STATUS* status);
+
+EXPORT_PKG(exclude_pkg);
+#endif
@@ -0,0 +1,133 @@
+/** @file tests/fasthash_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "fasthash_test.h"
+#include "../fasthash.h"
+#include "../checksum.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+const struct unit_test fasthash_tests[] = {
+	MAKE_TEST(test_fasthash_xxh64),
+	MAKE_TEST(test_fasthash_xxh64_stream),
+	MAKE_TEST(test_fasthash_names)
+};
+MAKE_PKG(fasthash_tests, fasthash_pkg);
+
+static int digest_hex(const void* data, size_t len, char* out){
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned digest_len;
+	unsigned i;
+
+	if (EVP_Digest(data, len, digest, &digest_len, fasthash_xxh64(), NULL) != 1){
+		return -1;
+	}
+	for (i = 0; i < digest_len; ++i){
+		sprintf(out + i * 2, "%02x", digest[i]);
+	}
+	return 0;
+}
+
+void test_fasthash_xxh64(enum TEST_STATUS* status){
+	const char* inputs[] = {
+		"",
+		"a",
+		"Nobody inspects the spammish repetition"
+	};
+	/* from the reference implementation */
+	const char* expected[] = {
+		"ef46db3751d8e999",
+		"d24ec4f1a98c6e5b",
+		"fbcea83c8a378bf1"
+	};
+	unsigned char data[1024];
+	char hex[EVP_MAX_MD_SIZE * 2 + 1];
+	size_t i;
+
+	TEST_ASSERT(fasthash_xxh64());
+	TEST_ASSERT(EVP_MD_size(fasthash_xxh64()) == 8);
+
+	for (i = 0; i < sizeof(inputs) / sizeof(inputs[0]); ++i){
+		TEST_ASSERT(digest_hex(inputs[i], strlen(inputs[i]), hex) == 0);
+		TEST_ASSERT(strcmp(hex, expected[i]) == 0);
+	}
+
+	/* long enough to go through every lane */
+	for (i = 0; i < sizeof(data); ++i){
+		data[i] = i & 0xFF;
+	}
+	TEST_ASSERT(digest_hex(data, sizeof(data), hex) == 0);
+	TEST_ASSERT(strcmp(hex, "6f3914f18fe4df57") == 0);
+
+cleanup:
+	;
+}
+
+void test_fasthash_xxh64_stream(enum TEST_STATUS* status){
+	unsigned char data[1337];
+	unsigned char digest_full[EVP_MAX_MD_SIZE];
+	unsigned char digest_split[EVP_MAX_MD_SIZE];
+	unsigned len_full;
+	unsigned len_split;
+	EVP_MD_CTX* ctx = NULL;
+	size_t split;
+
+	fill_sample_data(data, sizeof(data));
+	TEST_ASSERT(EVP_Digest(data, sizeof(data), digest_full, &len_full, fasthash_xxh64(), NULL) == 1);
+
+	ctx = EVP_MD_CTX_create();
+	TEST_ASSERT(ctx);
+	/* pieces that do not line up with the 32-byte stripes */
+	for (split = 0; split < sizeof(data); split += 97){
+		size_t pos;
+
+		TEST_ASSERT(EVP_DigestInit_ex(ctx, fasthash_xxh64(), NULL) == 1);
+		for (pos = 0; pos < sizeof(data); pos += split + 1){
+			size_t n = sizeof(data) - pos < split + 1 ? sizeof(data) - pos : split + 1;
+			TEST_ASSERT(EVP_DigestUpdate(ctx, data + pos, n) == 1);
+		}
+		TEST_ASSERT(EVP_DigestFinal_ex(ctx, digest_split, &len_split) == 1);
+		TEST_ASSERT(len_split == len_full);
+		TEST_ASSERT(memcmp(digest_full, digest_split, len_full) == 0);
+	}
+
+cleanup:
+	ctx ? EVP_MD_CTX_destroy(ctx) : (void)0;
+}
+
+void test_fasthash_names(enum TEST_STATUS* status){
+	const char* file = "file.txt";
+	unsigned char data[1337];
+	char hex[EVP_MAX_MD_SIZE * 2 + 1];
+	char* hash = NULL;
+
+	TEST_ASSERT(fasthash_get("xxh64") == fasthash_xxh64());
+	TEST_ASSERT(fasthash_get("XXH64") == fasthash_xxh64());
+	TEST_ASSERT(fasthash_get("sha1") == NULL);
+	TEST_ASSERT(fasthash_name(EVP_sha1()) == NULL);
+
+	/* built-in digests go everywhere OpenSSL's do */
+	TEST_ASSERT(get_evp_md("xxh64") == fasthash_xxh64());
+	TEST_ASSERT(get_evp_md("sha1") == EVP_sha1());
+	TEST_ASSERT(strcmp(get_evp_md_name(fasthash_xxh64()), "xxh64") == 0);
+	TEST_ASSERT(get_evp_md(get_evp_md_name(EVP_sha256())) == EVP_sha256());
+	TEST_ASSERT(!evp_md_is_cryptographic(fasthash_xxh64()));
+	TEST_ASSERT(evp_md_is_cryptographic(EVP_sha1()));
+
+	fill_sample_data(data, sizeof(data));
+	create_file(file, data, sizeof(data));
+	TEST_ASSERT(checksum_bytestring(file, fasthash_xxh64(), &hash) == 0);
+	TEST_ASSERT(digest_hex(data, sizeof(data), hex) == 0);
+	TEST_ASSERT(strcasecmp(hash, hex) == 0);
+
+cleanup:
+	free(hash);
+	remove(file);
+}
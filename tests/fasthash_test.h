@@ -0,0 +1,19 @@
+/** @file tests/fasthash_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __FASTHASH_TEST_H
+#define __FASTHASH_TEST_H
+
+#include "test_framework.h"
+
+void test_fasthash_xxh64(enum TEST_STATUS* status);
+void test_fasthash_xxh64_stream(enum TEST_STATUS* status);
+void test_fasthash_names(enum TEST_STATUS* status);
+
+EXPORT_PKG(fasthash_pkg);
+#endif
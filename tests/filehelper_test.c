@@ -13,14 +13,24 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <dirent.h>
 
 const struct unit_test filehelper_tests[] = {
 	MAKE_TEST(test_read_file),
 	MAKE_TEST(test_temp_fopen),
 	MAKE_TEST(test_file_opened_for_reading),
 	MAKE_TEST(test_file_opened_for_writing),
+	MAKE_TEST(test_read_file_blocks),
+	MAKE_TEST(test_read_file_blocks_shrink),
+	MAKE_TEST(test_source_read),
+	MAKE_TEST(test_source_read_sparse),
+	MAKE_TEST(test_source_prefetch),
 	MAKE_TEST(test_copy_file),
+	MAKE_TEST(test_copy_file_large),
+	MAKE_TEST(test_write_sparse),
 	MAKE_TEST(test_rename_file),
+	MAKE_TEST(test_atomic_file),
+	MAKE_TEST(test_sync_filesystem),
 	MAKE_TEST(test_exists)
 };
 MAKE_PKG(filehelper_tests, filehelper_pkg);
@@ -206,6 +216,324 @@ cleanup:
 	fp ? fclose(fp) : 0;
 }
 
+struct block_collector{
+	unsigned char* data;
+	size_t len;
+	size_t cap;
+	size_t n_blocks;
+	/* the callback fails once this many blocks have been passed to it, or never if 0 */
+	size_t fail_after;
+};
+
+static int collect_block(const void* block, size_t len, void* data){
+	struct block_collector* bc = data;
+
+	if (bc->fail_after && bc->n_blocks >= bc->fail_after){
+		return 1;
+	}
+	if (bc->len + len > bc->cap){
+		return 1;
+	}
+	memcpy(bc->data + bc->len, block, len);
+	bc->len += len;
+	bc->n_blocks++;
+	return 0;
+}
+
+/* small enough that a file just past MAP_FILE_THRESHOLD takes several windows */
+#define TEST_MAP_WINDOW ((size_t)1 << 16)
+
+void test_read_file_blocks(enum TEST_STATUS* status){
+	const char* sample_file = "file.txt";
+	/* big enough to be mapped in more than one window */
+	const size_t lens[] = { 0, 1337, MAP_FILE_THRESHOLD, MAP_FILE_THRESHOLD + TEST_MAP_WINDOW * 2 + 1337 };
+	unsigned char* sample_data = NULL;
+	struct block_collector bc;
+	FILE* fp = NULL;
+	size_t i;
+
+	memset(&bc, 0, sizeof(bc));
+	sample_data = malloc(lens[3]);
+	bc.data = malloc(lens[3]);
+	TEST_ASSERT(sample_data && bc.data);
+	bc.cap = lens[3];
+	read_file_set_window(TEST_MAP_WINDOW);
+
+	for (i = 0; i < sizeof(lens) / sizeof(lens[0]); ++i){
+		fill_sample_data(sample_data, lens[i]);
+		create_file(sample_file, sample_data, lens[i]);
+
+		bc.len = 0;
+		bc.n_blocks = 0;
+		bc.fail_after = 0;
+		fp = fopen(sample_file, "rb");
+		TEST_ASSERT(fp);
+		TEST_ASSERT(read_file_blocks(fp, collect_block, &bc) == 0);
+		TEST_ASSERT(bc.len == lens[i]);
+		TEST_ASSERT(memcmp(bc.data, sample_data, lens[i]) == 0);
+		fclose(fp);
+		fp = NULL;
+	}
+
+	/* stopping early is an error */
+	bc.len = 0;
+	bc.n_blocks = 0;
+	bc.fail_after = 1;
+	fp = fopen(sample_file, "rb");
+	TEST_ASSERT(fp);
+	TEST_ASSERT(read_file_blocks(fp, collect_block, &bc) < 0);
+	TEST_ASSERT(bc.n_blocks == 1);
+
+cleanup:
+	read_file_set_window(0);
+	fp ? fclose(fp) : 0;
+	free(sample_data);
+	free(bc.data);
+	remove(sample_file);
+}
+
+static int shrink_and_touch(const void* block, size_t len, void* data){
+	const volatile unsigned char* p = block;
+	size_t i;
+	unsigned sum = 0;
+
+	if (truncate(data, 0) != 0){
+		return 1;
+	}
+	/* the pages are gone now, so this has to be caught */
+	for (i = 0; i < len; ++i){
+		sum += p[i];
+	}
+	return sum == (unsigned)-1;
+}
+
+void test_read_file_blocks_shrink(enum TEST_STATUS* status){
+	const char* sample_file = "file.txt";
+	/* too big for the stack */
+	static unsigned char sample_data[MAP_FILE_THRESHOLD * 2];
+	FILE* fp = NULL;
+
+	fill_sample_data(sample_data, sizeof(sample_data));
+	create_file(sample_file, sample_data, sizeof(sample_data));
+
+	fp = fopen(sample_file, "rb");
+	TEST_ASSERT(fp);
+	TEST_ASSERT(read_file_blocks(fp, shrink_and_touch, (void*)sample_file) < 0);
+
+cleanup:
+	fp ? fclose(fp) : 0;
+	remove(sample_file);
+}
+
+/* small enough that the test files have their pages dropped as they are read */
+#define TEST_DROP_BEHIND ((size_t)1 << 14)
+
+void test_source_read(enum TEST_STATUS* status){
+	const char* sample_file = "file1.txt";
+	const char* sample_file2 = "file2.txt";
+	/* bigger than TEST_DROP_BEHIND, and not a multiple of anything */
+	const size_t len = TEST_DROP_BEHIND * 2 + 777;
+	const size_t read_lens[] = { 7, BUFFER_LEN, SOURCE_READ_LEN * 3 + 5 };
+	unsigned char* sample_data = NULL;
+	unsigned char* buf = NULL;
+	unsigned char* buf2 = NULL;
+	struct source_file* sf = NULL;
+	struct source_file* sf2 = NULL;
+	FILE* fp = NULL;
+	size_t i;
+	int mode;
+
+	sample_data = malloc(len + 100);
+	buf = malloc(len + 101);
+	buf2 = malloc(len);
+	TEST_ASSERT(sample_data && buf && buf2);
+	fill_sample_data(sample_data, len + 100);
+	create_file(sample_file, sample_data, len);
+	create_file(sample_file2, sample_data, len);
+	source_set_drop_behind(TEST_DROP_BEHIND);
+
+	/* O_DIRECT falls back to normal reads wherever the filesystem does not support it, and io_uring wherever the kernel does not */
+	for (mode = 0; mode < 4; ++mode){
+		int direct = mode & 1;
+		unsigned depth = mode & 2 ? 4 : 0;
+
+		/* many reads per file, so io_uring keeps some in flight */
+		source_set_options(SOURCE_ALIGN, direct, depth);
+		for (i = 0; i < sizeof(read_lens) / sizeof(read_lens[0]); ++i){
+			size_t done = 0;
+			int n;
+
+			TEST_ASSERT((sf = source_open(sample_file, 0)) != NULL);
+			TEST_ASSERT(source_size(sf) == len);
+			while ((n = source_read(sf, buf + done, done + read_lens[i] > len + 1 ? len + 1 - done : read_lens[i])) > 0){
+				done += n;
+			}
+			TEST_ASSERT(n == 0);
+			TEST_ASSERT(done == len);
+			TEST_ASSERT(memcmp(buf, sample_data, len) == 0);
+			TEST_FREE(sf, source_close);
+		}
+
+		/* starting in the middle, as tree hash segments do */
+		TEST_ASSERT((sf = source_open(sample_file, SOURCE_ALIGN + 3)) != NULL);
+		TEST_ASSERT(source_read(sf, buf, 100) == 100);
+		TEST_ASSERT(memcmp(buf, sample_data + SOURCE_ALIGN + 3, 100) == 0);
+		TEST_FREE(sf, source_close);
+
+		/* a second file open on the same thread cannot share the first one's io_uring */
+		TEST_ASSERT((sf = source_open(sample_file, 0)) != NULL);
+		TEST_ASSERT((sf2 = source_open(sample_file2, 0)) != NULL);
+		for (i = 0; i < len; i += 1000){
+			size_t n = len - i < 1000 ? len - i : 1000;
+
+			TEST_ASSERT(source_read(sf, buf + i, n) == (int)n);
+			TEST_ASSERT(source_read(sf2, buf2 + i, n) == (int)n);
+		}
+		TEST_ASSERT(memcmp(buf, sample_data, len) == 0);
+		TEST_ASSERT(memcmp(buf2, sample_data, len) == 0);
+		TEST_FREE(sf, source_close);
+		TEST_FREE(sf2, source_close);
+
+		/* what is appended after the file is opened is read too */
+		TEST_ASSERT((sf = source_open(sample_file, 0)) != NULL);
+		TEST_ASSERT(source_read(sf, buf, 10) == 10);
+		fp = fopen(sample_file, "ab");
+		TEST_ASSERT(fp);
+		TEST_ASSERT(fwrite(sample_data + len, 1, 100, fp) == 100);
+		TEST_FREE(fp, fclose);
+		TEST_ASSERT(source_read(sf, buf + 10, len + 101) == (int)(len + 90));
+		TEST_ASSERT(memcmp(buf, sample_data, len + 100) == 0);
+		TEST_FREE(sf, source_close);
+		create_file(sample_file, sample_data, len);
+	}
+
+	TEST_ASSERT(source_open("noexist.txt", 0) == NULL);
+
+cleanup:
+	source_set_options(0, 0, 0);
+	source_set_drop_behind(0);
+	source_close(sf);
+	source_close(sf2);
+	fp ? fclose(fp) : 0;
+	free(sample_data);
+	free(buf);
+	free(buf2);
+	remove(sample_file);
+	remove(sample_file2);
+}
+
+/* writes a file with data at the given offsets and holes everywhere else, and sets expected to what it reads as
+ * returns non-zero if the filesystem left the holes out, or negative on failure */
+static int create_sparse_file(const char* file, const size_t* data_offsets, size_t n_data, size_t data_len, unsigned char* expected, size_t len){
+	FILE* fp;
+	struct stat st;
+	size_t i;
+
+	memset(expected, 0, len);
+	if (!(fp = fopen(file, "wb"))){
+		return -1;
+	}
+	for (i = 0; i < n_data; ++i){
+		fill_sample_data(expected + data_offsets[i], data_len);
+		if (fseek(fp, data_offsets[i], SEEK_SET) != 0 || fwrite(expected + data_offsets[i], 1, data_len, fp) != data_len){
+			fclose(fp);
+			return -1;
+		}
+	}
+	if (fflush(fp) != 0 || ftruncate(fileno(fp), len) != 0 || fclose(fp) != 0 || stat(file, &st) != 0){
+		return -1;
+	}
+	return (uint64_t)st.st_blocks * 512 < len;
+}
+
+void test_source_read_sparse(enum TEST_STATUS* status){
+	const char* sample_file = "file.txt";
+	/* a hole at the start, holes between the data, and a hole at the end */
+	const size_t data_offsets[] = { SOURCE_ALIGN * 8, SOURCE_ALIGN * 10, SOURCE_ALIGN * 24 };
+	const size_t len = SOURCE_ALIGN * 40;
+	const size_t read_lens[] = { 7, BUFFER_LEN, SOURCE_READ_LEN * 3 + 5 };
+	unsigned char* expected = NULL;
+	unsigned char* buf = NULL;
+	struct source_file* sf = NULL;
+	size_t i;
+	int sparse;
+	int direct;
+
+	expected = malloc(len);
+	buf = malloc(len + 1);
+	TEST_ASSERT(expected && buf);
+	TEST_ASSERT((sparse = create_sparse_file(sample_file, data_offsets, sizeof(data_offsets) / sizeof(data_offsets[0]), SOURCE_ALIGN, expected, len)) >= 0);
+
+	for (direct = 0; direct < 2; ++direct){
+		source_set_options(direct ? SOURCE_ALIGN : 0, direct, 0);
+		for (i = 0; i < sizeof(read_lens) / sizeof(read_lens[0]); ++i){
+			size_t done = 0;
+			int n;
+
+			TEST_ASSERT((sf = source_open(sample_file, 0)) != NULL);
+			/* only a filesystem that made the file sparse has holes to skip */
+			if (sparse){
+				TEST_ASSERT(source_hole(sf) == data_offsets[0]);
+			}
+			while ((n = source_read(sf, buf + done, done + read_lens[i] > len + 1 ? len + 1 - done : read_lens[i])) > 0){
+				done += n;
+			}
+			TEST_ASSERT(n == 0);
+			TEST_ASSERT(done == len);
+			TEST_ASSERT(memcmp(buf, expected, len) == 0);
+			TEST_ASSERT(source_hole(sf) == 0);
+			TEST_FREE(sf, source_close);
+		}
+
+		/* starting in the middle of a hole */
+		TEST_ASSERT((sf = source_open(sample_file, SOURCE_ALIGN * 12 + 3)) != NULL);
+		TEST_ASSERT(source_read(sf, buf, len) == (int)(len - SOURCE_ALIGN * 12 - 3));
+		TEST_ASSERT(memcmp(buf, expected + SOURCE_ALIGN * 12 + 3, len - SOURCE_ALIGN * 12 - 3) == 0);
+		TEST_FREE(sf, source_close);
+	}
+
+cleanup:
+	source_set_options(0, 0, 0);
+	source_close(sf);
+	free(expected);
+	free(buf);
+	remove(sample_file);
+}
+
+void test_source_prefetch(enum TEST_STATUS* status){
+	const char* sample_file = "file1.txt";
+	/* more than source_prefetch() reads, so only the start of it is asked for */
+	const size_t len = (size_t)SOURCE_PREFETCH_LEN * 2 + 5;
+	unsigned char* sample_data = NULL;
+	unsigned char* buf = NULL;
+	struct source_file* sf = NULL;
+
+	sample_data = malloc(len);
+	buf = malloc(len);
+	TEST_ASSERT(sample_data && buf);
+	fill_sample_data(sample_data, len);
+	create_file(sample_file, sample_data, len);
+
+	TEST_ASSERT(source_prefetch(sample_file) == 0);
+	TEST_ASSERT((sf = source_open(sample_file, 0)) != NULL);
+	TEST_ASSERT(source_read(sf, buf, len) == (int)len);
+	TEST_ASSERT(memcmp(buf, sample_data, len) == 0);
+	TEST_FREE(sf, source_close);
+
+	/* O_DIRECT reads would not see what was prefetched, so nothing is even opened */
+	source_set_options(0, 1, 0);
+	TEST_ASSERT(source_prefetch("noexist.txt") == 0);
+	source_set_options(0, 0, 0);
+	TEST_ASSERT(source_prefetch("noexist.txt") < 0);
+
+cleanup:
+	source_set_options(0, 0, 0);
+	source_close(sf);
+	free(sample_data);
+	free(buf);
+	remove(sample_file);
+}
+
 void test_copy_file(enum TEST_STATUS* status){
 	const char* sample_file1 = "file1.txt";
 	const char* sample_file2 = "file2.txt";
@@ -223,6 +551,81 @@ cleanup:
 	remove(sample_file2);
 }
 
+void test_copy_file_large(enum TEST_STATUS* status){
+	const char* sample_file1 = "file1.txt";
+	const char* sample_file2 = "file2.txt";
+	/* more than one buffer's worth, and not a multiple of a block */
+	const size_t len = (1 << 20) + 1234;
+	unsigned char* sample_data = NULL;
+
+	sample_data = malloc(len);
+	TEST_ASSERT(sample_data);
+	fill_sample_data(sample_data, len);
+
+	/* the destination is longer than the source, so it has to be truncated */
+	create_file(sample_file2, sample_data, len);
+	create_file(sample_file1, sample_data + 1, len - 1);
+	TEST_ASSERT(copy_file(sample_file1, sample_file2) == 0);
+	TEST_ASSERT(memcmp_file_data(sample_file2, sample_data + 1, len - 1) == 0);
+
+	/* an empty file copies as an empty file */
+	create_file(sample_file1, sample_data, 0);
+	TEST_ASSERT(copy_file(sample_file1, sample_file2) == 0);
+	TEST_ASSERT(get_file_size(sample_file2) == 0);
+
+	TEST_ASSERT(copy_file("noexist.txt", sample_file2) != 0);
+
+cleanup:
+	free(sample_data);
+	remove(sample_file1);
+	remove(sample_file2);
+}
+
+void test_write_sparse(enum TEST_STATUS* status){
+	const char* sample_file = "file.txt";
+	/* data that is not on a block boundary, whole blocks of zeros, and zeros at the end */
+	const size_t data_offsets[] = { 100, SPARSE_BLOCK_LEN * 6 };
+	const size_t len = SPARSE_BLOCK_LEN * 12;
+	const size_t piece_lens[] = { 1000, SPARSE_BLOCK_LEN, SPARSE_BLOCK_LEN * 12 };
+	unsigned char* expected = NULL;
+	unsigned char* buf = NULL;
+	FILE* fp = NULL;
+	struct stat st;
+	size_t i;
+	int sparse;
+
+	expected = malloc(len);
+	buf = malloc(len);
+	TEST_ASSERT(expected && buf);
+	TEST_ASSERT((sparse = create_sparse_file(sample_file, data_offsets, sizeof(data_offsets) / sizeof(data_offsets[0]), 1000, expected, len)) >= 0);
+
+	for (i = 0; i < sizeof(piece_lens) / sizeof(piece_lens[0]); ++i){
+		size_t pos;
+
+		TEST_ASSERT((fp = fopen(sample_file, "wb")) != NULL);
+		for (pos = 0; pos < len; pos += piece_lens[i]){
+			TEST_ASSERT(write_sparse(fp, expected + pos, len - pos < piece_lens[i] ? len - pos : piece_lens[i]) == 0);
+		}
+		TEST_ASSERT(finish_sparse(fp) == 0);
+		TEST_FREE(fp, fclose);
+
+		TEST_ASSERT(stat(sample_file, &st) == 0);
+		TEST_ASSERT((size_t)st.st_size == len);
+		TEST_ASSERT((fp = fopen(sample_file, "rb")) != NULL);
+		TEST_ASSERT(fread(buf, 1, len, fp) == len);
+		TEST_FREE(fp, fclose);
+		TEST_ASSERT(memcmp(buf, expected, len) == 0);
+		/* the blocks of zeros are left out wherever the filesystem can do that at all, as long as they are written whole */
+		TEST_ASSERT(!sparse || piece_lens[i] < SPARSE_BLOCK_LEN || (uint64_t)st.st_blocks * 512 < len);
+	}
+
+cleanup:
+	fp ? fclose(fp) : 0;
+	free(expected);
+	free(buf);
+	remove(sample_file);
+}
+
 void test_rename_file(enum TEST_STATUS* status){
 	const char* sample_file1 = "file1.txt";
 	const char* sample_file2 = "file2.txt";
@@ -241,6 +644,92 @@ cleanup:
 	remove(sample_file2);
 }
 
+static int count_dir_entries(const char* dir){
+	DIR* dp = opendir(dir);
+	struct dirent* dnt;
+	int n = 0;
+
+	if (!dp){
+		return -1;
+	}
+	while ((dnt = readdir(dp)) != NULL){
+		if (strcmp(dnt->d_name, ".") != 0 && strcmp(dnt->d_name, "..") != 0){
+			n++;
+		}
+	}
+	closedir(dp);
+	return n;
+}
+
+void test_atomic_file(enum TEST_STATUS* status){
+	const char* dir = "atomic_dir";
+	const char* file = "atomic_dir/file.txt";
+	const unsigned char old_data[4] = { 'o', 'l', 'd', '!' };
+	unsigned char sample_data[4096];
+	struct ATOMICFILE* af = NULL;
+
+	fill_sample_data(sample_data, sizeof(sample_data));
+	TEST_ASSERT(mkdir(dir, 0755) == 0);
+
+	/* a new file only shows up once it is committed */
+	TEST_ASSERT((af = atomic_fopen(file)) != NULL);
+	TEST_ASSERT(fwrite(sample_data, 1, sizeof(sample_data), af->fp) == sizeof(sample_data));
+	TEST_ASSERT(!file_exists(file));
+	TEST_ASSERT(atomic_fcommit(af) == 0);
+	TEST_FREE(af, atomic_fclose);
+	TEST_ASSERT(memcmp_file_data(file, sample_data, sizeof(sample_data)) == 0);
+
+	/* an existing file is replaced */
+	create_file(file, old_data, sizeof(old_data));
+	TEST_ASSERT((af = atomic_fopen(file)) != NULL);
+	TEST_ASSERT(fwrite(sample_data, 1, sizeof(sample_data), af->fp) == sizeof(sample_data));
+	TEST_ASSERT(memcmp_file_data(file, old_data, sizeof(old_data)) == 0);
+	TEST_ASSERT(atomic_fcommit(af) == 0);
+	TEST_FREE(af, atomic_fclose);
+	TEST_ASSERT(memcmp_file_data(file, sample_data, sizeof(sample_data)) == 0);
+
+	/* one that is never committed leaves the old file alone */
+	create_file(file, old_data, sizeof(old_data));
+	TEST_ASSERT((af = atomic_fopen(file)) != NULL);
+	TEST_ASSERT(fwrite(sample_data, 1, sizeof(sample_data), af->fp) == sizeof(sample_data));
+	TEST_FREE(af, atomic_fclose);
+	TEST_ASSERT(memcmp_file_data(file, old_data, sizeof(old_data)) == 0);
+
+	/* and nothing else is left in the directory */
+	TEST_ASSERT(count_dir_entries(dir) == 1);
+
+cleanup:
+	atomic_fclose(af);
+	remove(file);
+	rmdir(dir);
+}
+
+void test_sync_filesystem(enum TEST_STATUS* status){
+	const char* file = "sync.txt";
+	unsigned char sample_data[4096];
+	FILE* fp = NULL;
+
+	fill_sample_data(sample_data, sizeof(sample_data));
+
+	/* starting writeback early leaves the file as it was written */
+	fp = fopen(file, "wb");
+	TEST_ASSERT(fp);
+	TEST_ASSERT(fwrite(sample_data, 1, sizeof(sample_data), fp) == sizeof(sample_data));
+	write_behind(fp);
+	TEST_ASSERT_FREE(fp, fclose);
+	TEST_ASSERT(memcmp_file_data(file, sample_data, sizeof(sample_data)) == 0);
+
+	TEST_ASSERT(sync_filesystem(file) == 0);
+	TEST_ASSERT(sync_filesystem(".") == 0);
+#ifdef __linux__
+	TEST_ASSERT(sync_filesystem("sync_does_not_exist") < 0);
+#endif
+
+cleanup:
+	fp ? fclose(fp) : 0;
+	remove(file);
+}
+
 void test_exists(enum TEST_STATUS* status){
 	const char* dir = "dir";
 	const char* file = "file";
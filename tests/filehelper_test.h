@@ -15,8 +15,17 @@ void test_read_file(enum TEST_STATUS* status);
 void test_temp_fopen(enum TEST_STATUS* status);
 void test_file_opened_for_reading(enum TEST_STATUS* status);
 void test_file_opened_for_writing(enum TEST_STATUS* status);
+void test_read_file_blocks(enum TEST_STATUS* status);
+void test_read_file_blocks_shrink(enum TEST_STATUS* status);
+void test_source_read(enum TEST_STATUS* status);
+void test_source_read_sparse(enum TEST_STATUS* status);
+void test_source_prefetch(enum TEST_STATUS* status);
 void test_copy_file(enum TEST_STATUS* status);
+void test_copy_file_large(enum TEST_STATUS* status);
+void test_write_sparse(enum TEST_STATUS* status);
 void test_rename_file(enum TEST_STATUS* status);
+void test_atomic_file(enum TEST_STATUS* status);
+void test_sync_filesystem(enum TEST_STATUS* status);
 void test_exists(enum TEST_STATUS* status);
 
 extern const struct test_pkg filehelper_pkg;
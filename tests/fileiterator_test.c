@@ -10,12 +10,21 @@
 #include "../fileiterator.h"
 #include "../log.h"
 #include "../readline_include.h"
+#include "../strings/stringarray.h"
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 const struct unit_test fileiterator_tests[] = {
 	MAKE_TEST_RU(test_fi_normal),
 	MAKE_TEST_RU(test_fi_skip_dir),
+	MAKE_TEST(test_fi_tree),
+	MAKE_TEST(test_fi_walk),
+	MAKE_TEST(test_fi_walk_skip),
+	MAKE_TEST(test_fi_stat),
+	MAKE_TEST(test_fi_sorted),
 	MAKE_TEST_RU(test_fi_fail)
 };
 MAKE_PKG(fileiterator_tests, fileiterator_pkg);
@@ -71,6 +80,230 @@ cleanup:
 	free(tmp);
 }
 
+void test_fi_tree(enum TEST_STATUS* status){
+	const char* path = "TEST_FI_DIR";
+	const char* link = "TEST_FI_DIR/link";
+	struct fi_stack* fis = NULL;
+	struct string_array* found = NULL;
+	char** files = NULL;
+	size_t files_len = 0;
+	const char* tmp;
+	size_t i;
+
+	setup_test_environment_full(path, &files, &files_len);
+	/* a symlink to a directory is returned like a file instead of being descended into */
+	TEST_ASSERT(symlink("dir1", link) == 0);
+
+	found = sa_new();
+	TEST_ASSERT(found);
+	fis = fi_start(path);
+	TEST_ASSERT(fis);
+	while ((tmp = fi_next_path(fis)) != NULL){
+		TEST_ASSERT(fi_directory_name(fis));
+		TEST_ASSERT(strncmp(tmp, fi_directory_name(fis), strlen(fi_directory_name(fis))) == 0);
+		TEST_ASSERT(sa_contains(found, tmp) == 0);
+		TEST_ASSERT(sa_add(found, tmp) == 0);
+	}
+	TEST_ASSERT(fi_directory_name(fis) == NULL);
+
+	TEST_ASSERT(found->len == files_len + 1);
+	TEST_ASSERT(sa_contains(found, link));
+	for (i = 0; i < files_len; ++i){
+		TEST_ASSERT(sa_contains(found, files[i]));
+	}
+
+cleanup:
+	fis ? fi_end(fis) : (void)0;
+	found ? sa_free(found) : (void)0;
+	remove(link);
+	cleanup_test_environment(path, files);
+}
+
+void test_fi_walk(enum TEST_STATUS* status){
+	const char* path = "TEST_FI_DIR";
+	const char* link = "TEST_FI_DIR/link";
+	struct fi_walk* fw = NULL;
+	struct string_array* found = NULL;
+	char** files = NULL;
+	size_t files_len = 0;
+	char* tmp = NULL;
+	size_t i;
+
+	setup_test_environment_full(path, &files, &files_len);
+	TEST_ASSERT(symlink("dir1", link) == 0);
+
+	found = sa_new();
+	TEST_ASSERT(found);
+	/* a tiny queue, so the walkers have to wait on the reader */
+	fw = fi_walk_start(path, 4, 2, NULL, NULL);
+	TEST_ASSERT(fw);
+	while ((tmp = fi_walk_next(fw)) != NULL){
+		TEST_ASSERT(sa_contains(found, tmp) == 0);
+		TEST_ASSERT(sa_add(found, tmp) == 0);
+		TEST_FREE(tmp, free);
+	}
+
+	TEST_ASSERT(found->len == files_len + 1);
+	TEST_ASSERT(sa_contains(found, link));
+	for (i = 0; i < files_len; ++i){
+		TEST_ASSERT(sa_contains(found, files[i]));
+	}
+
+	/* stopping partway through leaves nothing behind */
+	fi_walk_end(fw);
+	fw = fi_walk_start(path, 0, 1, NULL, NULL);
+	TEST_ASSERT(fw);
+	TEST_ASSERT((tmp = fi_walk_next(fw)) != NULL);
+	TEST_FREE(tmp, free);
+
+	TEST_ASSERT(fi_walk_start("/not/a/directory", 0, 0, NULL, NULL) == NULL);
+
+cleanup:
+	fi_walk_end(fw);
+	free(tmp);
+	found ? sa_free(found) : (void)0;
+	remove(link);
+	cleanup_test_environment(path, files);
+}
+
+static int skip_dir1(const char* path, void* data){
+	return strcmp(path, data) == 0;
+}
+
+void test_fi_walk_skip(enum TEST_STATUS* status){
+	const char* path = "TEST_FI_DIR";
+	char skipped[] = "TEST_FI_DIR/dir1";
+	struct fi_walk* fw = NULL;
+	char** files = NULL;
+	size_t files_len = 0;
+	size_t n_expected = 0;
+	size_t n_found = 0;
+	char* tmp = NULL;
+	size_t i;
+
+	setup_test_environment_full(path, &files, &files_len);
+	for (i = 0; i < files_len; ++i){
+		if (strncmp(files[i], skipped, strlen(skipped)) != 0 || files[i][strlen(skipped)] != '/'){
+			n_expected++;
+		}
+	}
+
+	fw = fi_walk_start(path, 0, 0, skip_dir1, skipped);
+	TEST_ASSERT(fw);
+	while ((tmp = fi_walk_next(fw)) != NULL){
+		TEST_ASSERT(strncmp(tmp, skipped, strlen(skipped)) != 0 || tmp[strlen(skipped)] != '/');
+		n_found++;
+		TEST_FREE(tmp, free);
+	}
+	TEST_ASSERT(n_found == n_expected);
+	TEST_ASSERT(n_found < files_len);
+
+cleanup:
+	fi_walk_end(fw);
+	free(tmp);
+	cleanup_test_environment(path, files);
+}
+
+void test_fi_stat(enum TEST_STATUS* status){
+	const char* path = "TEST_FI_DIR";
+	const char* link = "TEST_FI_DIR/link";
+	struct fi_stack* fis = NULL;
+	struct fi_walk* fw = NULL;
+	char** files = NULL;
+	size_t files_len = 0;
+	size_t n_found = 0;
+	const char* tmp;
+	char* walked = NULL;
+	struct stat st;
+	struct stat st_real;
+
+	setup_test_environment_full(path, &files, &files_len);
+	TEST_ASSERT(symlink("dir1", link) == 0);
+
+	fis = fi_start(path);
+	TEST_ASSERT(fis);
+	while ((tmp = fi_next_stat(fis, &st)) != NULL){
+		TEST_ASSERT(lstat(tmp, &st_real) == 0);
+		TEST_ASSERT(st.st_ino == st_real.st_ino);
+		TEST_ASSERT(st.st_size == st_real.st_size);
+		TEST_ASSERT(st.st_mode == st_real.st_mode);
+		/* the symlink is described as itself, not as the directory it points to */
+		TEST_ASSERT(strcmp(tmp, link) == 0 ? S_ISLNK(st.st_mode) : S_ISREG(st.st_mode));
+		n_found++;
+	}
+	TEST_ASSERT(n_found == files_len + 1);
+
+	n_found = 0;
+	fw = fi_walk_start(path, 0, 0, NULL, NULL);
+	TEST_ASSERT(fw);
+	while ((walked = fi_walk_next_stat(fw, &st)) != NULL){
+		TEST_ASSERT(lstat(walked, &st_real) == 0);
+		TEST_ASSERT(st.st_ino == st_real.st_ino);
+		TEST_ASSERT(st.st_size == st_real.st_size);
+		TEST_ASSERT(st.st_mode == st_real.st_mode);
+		n_found++;
+		TEST_FREE(walked, free);
+	}
+	TEST_ASSERT(n_found == files_len + 1);
+
+cleanup:
+	fis ? fi_end(fis) : (void)0;
+	fi_walk_end(fw);
+	free(walked);
+	remove(link);
+	cleanup_test_environment(path, files);
+}
+
+void test_fi_sorted(enum TEST_STATUS* status){
+	const char* path = "TEST_FI_DIR";
+	/* '.' and '-' sort before the '/' of the paths under "a", so they come first */
+	const char* dir_a = "TEST_FI_DIR/a";
+	const char* extra[] = { "TEST_FI_DIR/a/x", "TEST_FI_DIR/a.txt", "TEST_FI_DIR/a-b", "TEST_FI_DIR/a0" };
+	struct fi_stack* fis = NULL;
+	char** files = NULL;
+	size_t files_len = 0;
+	size_t n_found;
+	char* prev = NULL;
+	const char* tmp;
+	struct stat st;
+	size_t i;
+	int pass;
+
+	setup_test_environment_full(path, &files, &files_len);
+	TEST_ASSERT(mkdir(dir_a, 0755) == 0);
+	for (i = 0; i < sizeof(extra) / sizeof(extra[0]); ++i){
+		create_file(extra[i], (const unsigned char*)"x", 1);
+	}
+
+	/* once by path and once with stats */
+	for (pass = 0; pass < 2; ++pass){
+		n_found = 0;
+		fis = fi_start_sorted(path, NULL, NULL);
+		TEST_ASSERT(fis);
+		while ((tmp = pass ? fi_next_stat(fis, &st) : fi_next_path(fis)) != NULL){
+			TEST_ASSERT(!prev || strcmp(prev, tmp) < 0);
+			TEST_ASSERT(!pass || S_ISREG(st.st_mode));
+			free(prev);
+			prev = malloc(strlen(tmp) + 1);
+			TEST_ASSERT(prev);
+			strcpy(prev, tmp);
+			n_found++;
+		}
+		TEST_ASSERT(n_found == files_len + sizeof(extra) / sizeof(extra[0]));
+		TEST_FREE(fis, fi_end);
+		TEST_FREE(prev, free);
+	}
+
+cleanup:
+	fis ? fi_end(fis) : (void)0;
+	free(prev);
+	for (i = 0; i < sizeof(extra) / sizeof(extra[0]); ++i){
+		remove(extra[i]);
+	}
+	rmdir(dir_a);
+	cleanup_test_environment(path, files);
+}
+
 void test_fi_fail(enum TEST_STATUS* status){
 	struct fi_stack* fis;
 
@@ -13,6 +13,11 @@
 
 void test_fi_normal(enum TEST_STATUS* status);
 void test_fi_skip_dir(enum TEST_STATUS* status);
+void test_fi_tree(enum TEST_STATUS* status);
+void test_fi_walk(enum TEST_STATUS* status);
+void test_fi_walk_skip(enum TEST_STATUS* status);
+void test_fi_stat(enum TEST_STATUS* status);
+void test_fi_sorted(enum TEST_STATUS* status);
 void test_fi_fail(enum TEST_STATUS* status);
 
 extern const struct test_pkg fileiterator_pkg;
@@ -0,0 +1,79 @@
+/** @file tests/hashbench_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "hashbench_test.h"
+#include "../hashbench.h"
+#include "../checksum.h"
+#include "../fasthash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const struct unit_test hashbench_tests[] = {
+	MAKE_TEST(test_hash_speed),
+	MAKE_TEST(test_hash_fastest),
+	MAKE_TEST(test_hash_benchmark)
+};
+MAKE_PKG(hashbench_tests, hashbench_pkg);
+
+void test_hash_speed(enum TEST_STATUS* status){
+	TEST_ASSERT(hash_speed(EVP_sha1(), 1 << 20) > 0);
+	TEST_ASSERT(hash_speed(fasthash_xxh64(), 1 << 20) > 0);
+	/* anything shorter than the buffer works too */
+	TEST_ASSERT(hash_speed(EVP_sha256(), 1000) > 0);
+
+	/* not every feature can be on the same machine */
+	TEST_ASSERT(!((cpu_features() & (CPU_X86_SHA | CPU_X86_AVX2 | CPU_X86_AVX512)) && (cpu_features() & (CPU_ARM_SHA1 | CPU_ARM_SHA2 | CPU_ARM_SHA512))));
+
+cleanup:
+	;
+}
+
+void test_hash_fastest(enum TEST_STATUS* status){
+	const EVP_MD* any;
+	const EVP_MD* crypto;
+
+	any = hash_fastest(0);
+	crypto = hash_fastest(1);
+	TEST_ASSERT(any != NULL);
+	TEST_ASSERT(crypto != NULL);
+	TEST_ASSERT(evp_md_is_cryptographic(crypto));
+
+	/* measured once, so every caller agrees */
+	TEST_ASSERT(hash_fastest(1) == crypto);
+	TEST_ASSERT(get_evp_md(HASH_AUTO_NAME) == crypto);
+	/* the options file stores the resolved name, which must find the same digest again */
+	TEST_ASSERT(get_evp_md(get_evp_md_name(crypto)) == crypto);
+
+cleanup:
+	;
+}
+
+void test_hash_benchmark(enum TEST_STATUS* status){
+	const char* file = "hashbench.txt";
+	char line[256];
+	FILE* fp = NULL;
+	int found_sha1 = 0;
+	int found_fastest = 0;
+
+	fp = fopen(file, "w+");
+	TEST_ASSERT(fp);
+	TEST_ASSERT(hash_benchmark(fp) == 0);
+
+	rewind(fp);
+	while (fgets(line, sizeof(line), fp)){
+		found_sha1 |= strncmp(line, "sha1 ", 5) == 0;
+		found_fastest |= strncmp(line, "Fastest: ", 9) == 0;
+	}
+	TEST_ASSERT(found_sha1);
+	TEST_ASSERT(found_fastest);
+
+cleanup:
+	fp ? fclose(fp) : 0;
+	remove(file);
+}
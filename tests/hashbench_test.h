@@ -0,0 +1,19 @@
+/** @file tests/hashbench_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __HASHBENCH_TEST_H
+#define __HASHBENCH_TEST_H
+
+#include "test_framework.h"
+
+void test_hash_speed(enum TEST_STATUS* status);
+void test_hash_fastest(enum TEST_STATUS* status);
+void test_hash_benchmark(enum TEST_STATUS* status);
+
+EXPORT_PKG(hashbench_pkg);
+#endif
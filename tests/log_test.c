@@ -8,10 +8,17 @@
 
 #include "log_test.h"
 #include "../log.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 const struct unit_test log_tests[] = {
 	MAKE_TEST(test_return_ifnull),
-	MAKE_TEST_RU(test_log)
+	MAKE_TEST_RU(test_log),
+	MAKE_TEST(test_log_json),
+	MAKE_TEST(test_log_async)
 };
 MAKE_PKG(log_tests, log_pkg);
 
@@ -51,3 +58,147 @@ void test_log(enum TEST_STATUS* status){
 cleanup:
 	;
 }
+
+/* sends stderr to a temporary file until stderr_restore() */
+static FILE* stderr_capture(int* saved){
+	FILE* fp;
+
+	fflush(stderr);
+	if (!(fp = tmpfile())){
+		return NULL;
+	}
+	*saved = dup(STDERR_FILENO);
+	dup2(fileno(fp), STDERR_FILENO);
+	return fp;
+}
+
+/* restores stderr and reads back what was written to it */
+static char* stderr_restore(FILE* fp, int saved){
+	char* ret;
+	long len;
+
+	fflush(stderr);
+	dup2(saved, STDERR_FILENO);
+	close(saved);
+
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	rewind(fp);
+	ret = calloc(len + 1, 1);
+	if (ret && fread(ret, 1, len, fp) != (size_t)len){
+		free(ret);
+		ret = NULL;
+	}
+	fclose(fp);
+	return ret;
+}
+
+void test_log_json(enum TEST_STATUS* status){
+	FILE* fp = NULL;
+	int saved = -1;
+	char* out = NULL;
+	char buf[LOG_LINE_MAX * 2];
+
+	log_setlevel(LEVEL_WARNING);
+	log_setformat(LOG_FORMAT_JSON);
+	fp = stderr_capture(&saved);
+	TEST_ASSERT(fp);
+
+	log_error_ex("say \"%s\"", "a\\b\n\t");
+	/* silenced, so nothing is written */
+	log_info("Info");
+	memset(buf, 'x', sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+	log_warning_ex("%s", buf);
+
+	out = stderr_restore(fp, saved);
+	fp = NULL;
+	TEST_ASSERT(out);
+
+	TEST_ASSERT(strncmp(out, "{\"time\":\"", strlen("{\"time\":\"")) == 0);
+	TEST_ASSERT(strstr(out, "Z\",\"level\":\"error\",\"file\":\"") != NULL);
+	TEST_ASSERT(strstr(out, "\"msg\":\"say \\\"a\\\\b\\n\\u0009\\\"\"}\n{") != NULL);
+	TEST_ASSERT(strstr(out, "Info") == NULL);
+	/* a long message is cut short, but the line is still whole */
+	TEST_ASSERT(strstr(out, "\"level\":\"warning\"") != NULL);
+	TEST_ASSERT(strlen(strchr(out, '\n') + 1) <= LOG_LINE_MAX);
+	TEST_ASSERT(strcmp(out + strlen(out) - 4, "x\"}\n") == 0);
+
+cleanup:
+	if (fp){
+		free(stderr_restore(fp, saved));
+	}
+	log_setformat(LOG_FORMAT_TEXT);
+	free(out);
+}
+
+#define LOG_TEST_THREADS (8)
+#define LOG_TEST_LINES (2000)
+
+static void* log_lines(void* arg){
+	int i;
+
+	for (i = 0; i < LOG_TEST_LINES; ++i){
+		log_warning_ex2("thread %d line %d end", *(int*)arg, i);
+		/* never formatted */
+		log_debug_ex("%s", "skipped");
+	}
+	return NULL;
+}
+
+void test_log_async(enum TEST_STATUS* status){
+	FILE* fp = NULL;
+	int saved = -1;
+	char* out = NULL;
+	char* line;
+	pthread_t thrds[LOG_TEST_THREADS];
+	int ids[LOG_TEST_THREADS];
+	int next[LOG_TEST_THREADS];
+	size_t started = 0;
+	size_t i;
+
+	log_setlevel(LEVEL_WARNING);
+	fp = stderr_capture(&saved);
+	TEST_ASSERT(fp);
+	TEST_ASSERT(log_start() == 0);
+
+	for (started = 0; started < LOG_TEST_THREADS; ++started){
+		ids[started] = started;
+		next[started] = 0;
+		TEST_ASSERT(pthread_create(&thrds[started], NULL, log_lines, &ids[started]) == 0);
+	}
+	for (; started > 0; --started){
+		pthread_join(thrds[started - 1], NULL);
+	}
+	log_stop();
+
+	out = stderr_restore(fp, saved);
+	fp = NULL;
+	TEST_ASSERT(out);
+
+	/* every line is whole, and each thread's lines are in order */
+	for (line = strtok(out, "\n"); line; line = strtok(NULL, "\n")){
+		const char* msg = strstr(line, "): ");
+		int id;
+		int n;
+
+		TEST_ASSERT_MSG(msg && sscanf(msg + 3, "thread %d line %d end", &id, &n) == 2, line);
+		TEST_ASSERT(strcmp(line + strlen(line) - 3, "end") == 0);
+		TEST_ASSERT(id >= 0 && id < LOG_TEST_THREADS);
+		TEST_ASSERT(n == next[id]);
+		next[id]++;
+	}
+	for (i = 0; i < LOG_TEST_THREADS; ++i){
+		TEST_ASSERT(next[i] == LOG_TEST_LINES);
+	}
+
+cleanup:
+	for (; started > 0; --started){
+		pthread_join(thrds[started - 1], NULL);
+	}
+	log_stop();
+	if (fp){
+		free(stderr_restore(fp, saved));
+	}
+	free(out);
+}
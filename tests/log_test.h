@@ -13,6 +13,8 @@
 
 void test_return_ifnull(enum TEST_STATUS* status);
 void test_log(enum TEST_STATUS* status);
+void test_log_json(enum TEST_STATUS* status);
+void test_log_async(enum TEST_STATUS* status);
 
 extern const struct test_pkg log_pkg;
 #endif
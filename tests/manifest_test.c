@@ -0,0 +1,191 @@
+/** @file tests/manifest_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "manifest_test.h"
+#include "../manifest.h"
+#include "../checksum.h"
+#include "../checksumsort.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const struct unit_test manifest_tests[] = {
+	MAKE_TEST(test_manifest_next),
+	MAKE_TEST(test_manifest_search),
+	MAKE_TEST(test_manifest_tamper)
+};
+MAKE_PKG(manifest_tests, manifest_pkg);
+
+/* enough for several blocks */
+#define N_RECORDS 8000
+
+static void record_path(char* out, unsigned i){
+	sprintf(out, "/home/user/dir%02u/file%05u.txt", i % 7, i * 7919 % 100000);
+}
+
+/* writes N_RECORDS records out of order, then sorts them with front-coding */
+static int make_checksum_file(const char* file){
+	struct file_meta meta;
+	struct element e;
+	char path[64];
+	char checksum[41];
+	FILE* fp;
+	unsigned i;
+
+	if (!(fp = fopen(file, "wb"))){
+		return -1;
+	}
+	for (i = 0; i < N_RECORDS; ++i){
+		record_path(path, i);
+		sprintf(checksum, "%08X%032X", i, 0);
+		memset(&meta, 0, sizeof(meta));
+		meta.size = i;
+		meta.ino = i * 3;
+		e.file = path;
+		e.checksum = checksum;
+		e.meta = i % 2 ? &meta : NULL;
+		e.artifact = NULL;
+		if (write_element_to_file(fp, &e) != 0){
+			fclose(fp);
+			return -1;
+		}
+	}
+	fclose(fp);
+	return sort_checksum_file(file, 0, 1);
+}
+
+void test_manifest_next(enum TEST_STATUS* status){
+	const char* checksum_file = "TEST_MANIFEST.txt";
+	const char* manifest_file = "TEST_MANIFEST.ezm";
+	struct manifest* m = NULL;
+	struct checksum_reader* cr = NULL;
+	FILE* fp = NULL;
+	const struct element* e_local;
+	const struct element* e_manifest;
+	size_t n = 0;
+	int res;
+
+	TEST_ASSERT(make_checksum_file(checksum_file) == 0);
+	TEST_ASSERT(manifest_write(checksum_file, manifest_file, EVP_aes_256_gcm(), "password") == 0);
+	TEST_ASSERT(manifest_open(manifest_file, "password", &m) == 0);
+	/* nothing but the index is decrypted up front */
+	TEST_ASSERT(manifest_blocks_decrypted(m) == 1);
+
+	fp = fopen(checksum_file, "rb");
+	TEST_ASSERT(fp);
+	cr = checksum_reader_new(fp, 0);
+	TEST_ASSERT(cr);
+	while ((res = checksum_reader_next(cr, &e_local)) == 0){
+		TEST_ASSERT(manifest_next(m, &e_manifest) == 0);
+		TEST_ASSERT(strcmp(e_local->file, e_manifest->file) == 0);
+		TEST_ASSERT(strcmp(e_local->checksum, e_manifest->checksum) == 0);
+		TEST_ASSERT(!e_local->meta == !e_manifest->meta);
+		TEST_ASSERT(!e_local->meta || memcmp(e_local->meta, e_manifest->meta, sizeof(*e_local->meta)) == 0);
+		n++;
+	}
+	TEST_ASSERT(res > 0);
+	TEST_ASSERT(manifest_next(m, &e_manifest) > 0);
+	TEST_ASSERT(n == N_RECORDS);
+	/* the records span several blocks, each decrypted once */
+	TEST_ASSERT(manifest_blocks_decrypted(m) > 2);
+
+cleanup:
+	checksum_reader_free(cr);
+	fp ? fclose(fp) : 0;
+	m ? manifest_close(m) : (void)0;
+	remove(checksum_file);
+	remove(manifest_file);
+}
+
+void test_manifest_search(enum TEST_STATUS* status){
+	const char* checksum_file = "TEST_MANIFEST.txt";
+	const char* manifest_file = "TEST_MANIFEST.ezm";
+	struct manifest* m = NULL;
+	struct element* e = NULL;
+	char path[64];
+	char checksum[41];
+	unsigned long decrypted;
+	unsigned i;
+
+	TEST_ASSERT(make_checksum_file(checksum_file) == 0);
+	/* a cipher that does not authenticate is replaced */
+	TEST_ASSERT(manifest_write(checksum_file, manifest_file, EVP_aes_256_cbc(), "password") == 0);
+	TEST_ASSERT(manifest_open(manifest_file, "password", &m) == 0);
+
+	for (i = 0; i < N_RECORDS; ++i){
+		decrypted = manifest_blocks_decrypted(m);
+		record_path(path, i);
+		sprintf(checksum, "%08X%032X", i, 0);
+		TEST_ASSERT(manifest_search(m, path, &e) == 0);
+		TEST_ASSERT(strcmp(e->checksum, checksum) == 0);
+		TEST_ASSERT((e->meta != NULL) == (i % 2));
+		/* a lookup decrypts at most the one block that could hold it */
+		TEST_ASSERT(manifest_blocks_decrypted(m) - decrypted <= 1);
+		free_element(e);
+		e = NULL;
+	}
+
+	decrypted = manifest_blocks_decrypted(m);
+	TEST_ASSERT(manifest_search(m, "/", &e) > 0);
+	TEST_ASSERT(manifest_search(m, "/home/user/dir03/nonexistent", &e) > 0);
+	TEST_ASSERT(manifest_search(m, "/zzz", &e) > 0);
+	TEST_ASSERT(e == NULL);
+	TEST_ASSERT(manifest_blocks_decrypted(m) - decrypted <= 2);
+
+cleanup:
+	e ? free_element(e) : (void)0;
+	m ? manifest_close(m) : (void)0;
+	remove(checksum_file);
+	remove(manifest_file);
+}
+
+static int flip_byte(const char* file, long offset){
+	FILE* fp = fopen(file, "r+b");
+	int c;
+
+	if (!fp){
+		return -1;
+	}
+	if (fseek(fp, offset, SEEK_SET) != 0 || (c = fgetc(fp)) == EOF || fseek(fp, offset, SEEK_SET) != 0){
+		fclose(fp);
+		return -1;
+	}
+	fputc(c ^ 0x01, fp);
+	return fclose(fp);
+}
+
+void test_manifest_tamper(enum TEST_STATUS* status){
+	const char* checksum_file = "TEST_MANIFEST.txt";
+	const char* manifest_file = "TEST_MANIFEST.ezm";
+	struct manifest* m = NULL;
+	struct element* e = NULL;
+	const struct element* e_next;
+	int res;
+
+	TEST_ASSERT(make_checksum_file(checksum_file) == 0);
+	TEST_ASSERT(manifest_write(checksum_file, manifest_file, EVP_aes_256_gcm(), "password") == 0);
+
+	/* the wrong password cannot read the index */
+	TEST_ASSERT(manifest_open(manifest_file, "wrong", &m) < 0);
+	TEST_ASSERT(m == NULL);
+	/* a checksum file is not a manifest */
+	TEST_ASSERT(manifest_open(checksum_file, "password", &m) > 0);
+
+	/* a change inside the first block is only noticed once that block is read */
+	TEST_ASSERT(flip_byte(manifest_file, MANIFEST_HEADER_LEN + MANIFEST_SEAL_LEN + 40) == 0);
+	TEST_ASSERT(manifest_open(manifest_file, "password", &m) == 0);
+	TEST_ASSERT(manifest_search(m, "/", &e) > 0);
+	while ((res = manifest_next(m, &e_next)) == 0);
+	TEST_ASSERT(res < 0);
+
+cleanup:
+	e ? free_element(e) : (void)0;
+	m ? manifest_close(m) : (void)0;
+	remove(checksum_file);
+	remove(manifest_file);
+}
@@ -0,0 +1,19 @@
+/** @file tests/manifest_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __MANIFEST_TEST_H
+#define __MANIFEST_TEST_H
+
+#include "test_framework.h"
+
+void test_manifest_next(enum TEST_STATUS* status);
+void test_manifest_search(enum TEST_STATUS* status);
+void test_manifest_tamper(enum TEST_STATUS* status);
+
+EXPORT_PKG(manifest_pkg);
+#endif
@@ -0,0 +1,107 @@
+/** @file tests/membudget_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "membudget_test.h"
+#include "../membudget.h"
+#include "../checksumsort.h"
+#include "../compression/zip.h"
+#include "../options/options.h"
+#include <stdlib.h>
+#include <string.h>
+
+const struct unit_test membudget_tests[] = {
+	MAKE_TEST(test_mem_budget_unlimited),
+	MAKE_TEST(test_mem_budget_plan),
+	MAKE_TEST(test_mem_budget_too_small)
+};
+MAKE_PKG(membudget_tests, membudget_pkg);
+
+/* gzip on every core of a big machine, with each file split over 16 more threads */
+static struct options* greedy_options(unsigned long memory_limit){
+	struct options* opt = options_new();
+
+	if (!opt){
+		return NULL;
+	}
+	opt->c_type = COMPRESSOR_GZIP;
+	opt->c_level = 9;
+	opt->c_flags = ZIP_WORKERS(16);
+	opt->n_threads = 8;
+	opt->memory_limit = memory_limit;
+	return opt;
+}
+
+void test_mem_budget_unlimited(enum TEST_STATUS* status){
+	struct options* opt = greedy_options(0);
+	struct options out;
+	struct mem_budget mb;
+
+	TEST_ASSERT(opt != NULL);
+	TEST_ASSERT(mem_budget_plan(opt, &out, &mb) == 0);
+	TEST_ASSERT(options_cmp(&out, opt) == 0);
+	TEST_ASSERT(mb.fits);
+	TEST_ASSERT(mem_budget_sort(opt) == 0);
+	TEST_ASSERT(mem_budget_level_fits(opt, 9));
+
+cleanup:
+	options_free(opt);
+}
+
+void test_mem_budget_plan(enum TEST_STATUS* status){
+	struct options* opt = greedy_options(160);
+	struct options out;
+	struct mem_budget mb;
+
+	TEST_ASSERT(opt != NULL);
+	TEST_ASSERT(mem_budget_plan(opt, &out, &mb) == 0);
+	TEST_ASSERT(mb.fits);
+	TEST_ASSERT(mb.limit == (uint64_t)160 << 20);
+	TEST_ASSERT((uint64_t)out.n_threads * mb.per_file <= mb.limit - mb.reserve);
+	TEST_ASSERT(mb.per_file == mem_budget_per_file(&out, out.c_level));
+
+	/* the per-file workers go first, and nothing else has to */
+	TEST_ASSERT(ZIP_GET_WORKERS(out.c_flags) < 16);
+	TEST_ASSERT(out.n_threads == 8);
+	TEST_ASSERT(out.c_level == 9);
+
+	/* the sort does not run alongside the files, so it gets everything but the reserve and the merge's buffers */
+	TEST_ASSERT(mb.sort >= CHECKSUM_SORT_MIN_MEMORY);
+	TEST_ASSERT(mb.sort + mb.reserve + CHECKSUM_MERGE_MEMORY <= mb.limit);
+	TEST_ASSERT((uint64_t)out.sort_memory << 20 == mb.sort);
+
+	TEST_ASSERT(mem_budget_level_fits(&out, out.c_level));
+
+cleanup:
+	options_free(opt);
+}
+
+void test_mem_budget_too_small(enum TEST_STATUS* status){
+	struct options* opt = greedy_options(1);
+	struct options out;
+	struct mem_budget mb;
+
+	TEST_ASSERT(opt != NULL);
+	opt->flags.bits.flag_io_uring = 1;
+	TEST_ASSERT(mem_budget_plan(opt, &out, &mb) > 0);
+	TEST_ASSERT(!mb.fits);
+
+	/* every setting is as low as it goes */
+	TEST_ASSERT(out.n_threads == 1);
+	TEST_ASSERT(ZIP_GET_WORKERS(out.c_flags) <= 1);
+	TEST_ASSERT(out.read_size == MEM_BUDGET_MIN_READ);
+	TEST_ASSERT(!out.flags.bits.flag_io_uring);
+	TEST_ASSERT(out.c_level == 1);
+	TEST_ASSERT(!mem_budget_level_fits(&out, 9));
+
+	/* the options given are left alone */
+	TEST_ASSERT(opt->n_threads == 8);
+	TEST_ASSERT(opt->c_level == 9);
+
+cleanup:
+	options_free(opt);
+}
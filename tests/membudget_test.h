@@ -0,0 +1,19 @@
+/** @file tests/membudget_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __MEMBUDGET_TEST_H
+#define __MEMBUDGET_TEST_H
+
+#include "test_framework.h"
+
+void test_mem_budget_unlimited(enum TEST_STATUS* status);
+void test_mem_budget_plan(enum TEST_STATUS* status);
+void test_mem_budget_too_small(enum TEST_STATUS* status);
+
+EXPORT_PKG(membudget_pkg);
+#endif
@@ -0,0 +1,172 @@
+/** @file tests/moveindex_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "moveindex_test.h"
+#include "../moveindex.h"
+#include "../checksum.h"
+#include "../checksumsort.h"
+#include <stdlib.h>
+#include <string.h>
+
+const struct unit_test moveindex_tests[] = {
+	MAKE_TEST(test_move_index_use),
+	MAKE_TEST(test_move_index_forget),
+	MAKE_TEST(test_move_index_load)
+};
+MAKE_PKG(moveindex_tests, moveindex_pkg);
+
+/* every size is past the smallest file the index keeps */
+#define SIZE(n) (MOVE_INDEX_MIN_SIZE + (n))
+
+static const char* const sum_a = "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa";
+static const char* const sum_b = "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb";
+
+/* remembers the file it was given, and only takes the one it is told to */
+struct use_state{
+	const char* want;
+	char got[64];
+	int n_calls;
+};
+
+static int take_file(const char* file, void* data){
+	struct use_state* us = data;
+
+	us->n_calls++;
+	if (us->want && strcmp(file, us->want) != 0){
+		return 1;
+	}
+	strcpy(us->got, file);
+	return 0;
+}
+
+void test_move_index_use(enum TEST_STATUS* status){
+	struct move_index* mi = move_index_new();
+	struct use_state us;
+	char path[64];
+	int i;
+
+	TEST_ASSERT(mi);
+	TEST_ASSERT(!move_index_has_size(mi, SIZE(1000)));
+	TEST_ASSERT(move_index_add(mi, "/old/a", sum_a, SIZE(1000)) == 0);
+	TEST_ASSERT(move_index_add(mi, "/old/b", sum_b, SIZE(1000)) == 0);
+	/* too small to be worth it */
+	TEST_ASSERT(move_index_add(mi, "/tiny", sum_a, MOVE_INDEX_MIN_SIZE - 1) == 0);
+	TEST_ASSERT(!move_index_has_size(mi, MOVE_INDEX_MIN_SIZE - 1));
+
+	/* enough to make the tables grow a few times */
+	for (i = 0; i < 5000; ++i){
+		sprintf(path, "/other/%d", i);
+		TEST_ASSERT(move_index_add(mi, path, sum_b, SIZE(2000 + i)) == 0);
+	}
+	TEST_ASSERT(move_index_has_size(mi, SIZE(1000)));
+	TEST_ASSERT(move_index_has_size(mi, SIZE(6999)));
+	TEST_ASSERT(!move_index_has_size(mi, SIZE(7000)));
+
+	memset(&us, 0, sizeof(us));
+	TEST_ASSERT(move_index_use(mi, sum_a, SIZE(1000), take_file, &us) == 0);
+	TEST_ASSERT(strcmp(us.got, "/old/a") == 0);
+	TEST_ASSERT(us.n_calls == 1);
+
+	/* the same contents with another size are not the same file */
+	memset(&us, 0, sizeof(us));
+	TEST_ASSERT(move_index_use(mi, sum_a, SIZE(2000), take_file, &us) > 0);
+	TEST_ASSERT(us.n_calls == 0);
+
+	/* every output with the contents is tried until one can be used */
+	TEST_ASSERT(move_index_add(mi, "/copy/a", sum_a, SIZE(1000)) == 0);
+	memset(&us, 0, sizeof(us));
+	us.want = "/old/a";
+	TEST_ASSERT(move_index_use(mi, sum_a, SIZE(1000), take_file, &us) == 0);
+	TEST_ASSERT(strcmp(us.got, "/old/a") == 0);
+	memset(&us, 0, sizeof(us));
+	us.want = "/nowhere";
+	TEST_ASSERT(move_index_use(mi, sum_a, SIZE(1000), take_file, &us) > 0);
+	TEST_ASSERT(us.n_calls == 2);
+
+	sprintf(path, "/other/%d", 4321);
+	memset(&us, 0, sizeof(us));
+	TEST_ASSERT(move_index_use(mi, sum_b, SIZE(2000 + 4321), take_file, &us) == 0);
+	TEST_ASSERT(strcmp(us.got, path) == 0);
+
+cleanup:
+	move_index_free(mi);
+}
+
+void test_move_index_forget(enum TEST_STATUS* status){
+	struct move_index* mi = move_index_new();
+	struct use_state us;
+
+	TEST_ASSERT(mi);
+	TEST_ASSERT(move_index_add(mi, "/a", sum_a, SIZE(1000)) == 0);
+	TEST_ASSERT(move_index_add(mi, "/b", sum_a, SIZE(1000)) == 0);
+
+	/* an output that is about to be replaced must not be linked to anything */
+	move_index_forget(mi, "/a");
+	move_index_forget(mi, "/not/there");
+	move_index_forget(NULL, "/a");
+	memset(&us, 0, sizeof(us));
+	TEST_ASSERT(move_index_use(mi, sum_a, SIZE(1000), take_file, &us) == 0);
+	TEST_ASSERT(strcmp(us.got, "/b") == 0);
+	TEST_ASSERT(us.n_calls == 1);
+
+	move_index_forget(mi, "/b");
+	TEST_ASSERT(!move_index_has_size(mi, SIZE(1000)));
+	memset(&us, 0, sizeof(us));
+	TEST_ASSERT(move_index_use(mi, sum_a, SIZE(1000), take_file, &us) > 0);
+
+	/* the new output of a forgotten file can be added again */
+	TEST_ASSERT(move_index_add(mi, "/b", sum_b, SIZE(1000)) == 0);
+	memset(&us, 0, sizeof(us));
+	TEST_ASSERT(move_index_use(mi, sum_b, SIZE(1000), take_file, &us) == 0);
+	TEST_ASSERT(strcmp(us.got, "/b") == 0);
+
+cleanup:
+	move_index_free(mi);
+}
+
+void test_move_index_load(enum TEST_STATUS* status){
+	const char* fpstr = "moveindex_checksums.txt";
+	struct move_index* mi = NULL;
+	struct file_meta meta;
+	struct use_state us;
+	FILE* fp = NULL;
+
+	memset(&meta, 0, sizeof(meta));
+	fp = fopen(fpstr, "w+b");
+	TEST_ASSERT(fp);
+	meta.size = SIZE(1000);
+	TEST_ASSERT(add_hash_to_file("/big", sum_a, &meta, fp, NULL) == 0);
+	/* nothing can be told about a file without its size */
+	TEST_ASSERT(add_hash_to_file("/nometa", sum_b, NULL, fp, NULL) == 0);
+	meta.size = 100;
+	TEST_ASSERT(add_hash_to_file("/small", sum_b, &meta, fp, NULL) == 0);
+	meta.size = SIZE(5000);
+	TEST_ASSERT(add_hash_to_file("/bigger", sum_b, &meta, fp, NULL) == 0);
+
+	mi = move_index_new();
+	TEST_ASSERT(mi);
+	TEST_ASSERT(move_index_load(mi, fp, SIZE(500)) == 0);
+	/* the backup reads the checksum file from the start afterwards */
+	TEST_ASSERT(ftell(fp) == 0);
+
+	TEST_ASSERT(move_index_has_size(mi, SIZE(1000)));
+	TEST_ASSERT(move_index_has_size(mi, SIZE(5000)));
+	TEST_ASSERT(!move_index_has_size(mi, 100));
+
+	memset(&us, 0, sizeof(us));
+	TEST_ASSERT(move_index_use(mi, sum_b, SIZE(5000), take_file, &us) == 0);
+	TEST_ASSERT(strcmp(us.got, "/bigger") == 0);
+	memset(&us, 0, sizeof(us));
+	TEST_ASSERT(move_index_use(mi, sum_a, SIZE(1000), take_file, &us) == 0);
+	TEST_ASSERT(strcmp(us.got, "/big") == 0);
+
+cleanup:
+	fp ? fclose(fp) : 0;
+	remove(fpstr);
+	move_index_free(mi);
+}
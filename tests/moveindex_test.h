@@ -0,0 +1,19 @@
+/** @file tests/moveindex_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __MOVEINDEX_TEST_H
+#define __MOVEINDEX_TEST_H
+
+#include "test_framework.h"
+
+void test_move_index_use(enum TEST_STATUS* status);
+void test_move_index_forget(enum TEST_STATUS* status);
+void test_move_index_load(enum TEST_STATUS* status);
+
+EXPORT_PKG(moveindex_pkg);
+#endif
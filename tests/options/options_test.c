@@ -15,6 +15,8 @@
 
 const struct unit_test options_tests[] = {
 	MAKE_TEST(test_parse_options_cmdline),
+	MAKE_TEST(test_parse_options_compressor),
+	MAKE_TEST(test_parse_options_restore_time),
 	MAKE_TEST(test_parse_options_fromfile),
 };
 MAKE_PKG(options_tests, options_pkg);
@@ -35,6 +37,14 @@ static struct options* sample_options(void){
 	sa_add(opt->directories, "/dev/null");
 	sa_add(opt->directories, "/home/azurediamond/passwords/hunter2");
 	sa_add(opt->exclude, "/winblows/system32");
+	sa_add(opt->mirrors, "s3:AKIAEXAMPLE:/bucket/Backups");
+	sa_add(opt->mirrors, "mega:/Backups");
+	opt->n_threads = 3;
+	opt->pack_threshold = 4096;
+	opt->sort_memory = 512;
+	opt->read_size = 4096;
+	opt->memory_limit = 1024;
+	opt->c_target = 50UL << 20;
 
 	return opt;
 }
@@ -108,6 +118,52 @@ cleanup:
 	opt ? options_free(opt) : (void)0;
 }
 
+void test_parse_options_compressor(enum TEST_STATUS* status){
+	struct options* opt = NULL;
+	enum operation op;
+	char* argv_auto[] = { "PROG_NAME", "backup", "-c", "auto" };
+	char* argv_named[] = { "PROG_NAME", "backup", "-c", "auto", "-c", "xz" };
+	char* argv_typo[] = { "PROG_NAME", "backup", "-c", "gzp" };
+
+	TEST_ASSERT(parse_options_cmdline(4, argv_auto, &opt, &op) == 0);
+	TEST_ASSERT(opt->flags.bits.flag_auto_compressor);
+	TEST_ASSERT(opt->c_target > 0);
+	options_free(opt);
+	opt = NULL;
+
+	TEST_ASSERT(parse_options_cmdline(6, argv_named, &opt, &op) == 0);
+	TEST_ASSERT(!opt->flags.bits.flag_auto_compressor);
+	TEST_ASSERT(opt->c_type == COMPRESSOR_XZ);
+	options_free(opt);
+	opt = NULL;
+
+	/* a misspelled compressor is an error, not a request to pick one */
+	TEST_ASSERT(parse_options_cmdline(4, argv_typo, &opt, &op) == 3);
+
+cleanup:
+	opt ? options_free(opt) : (void)0;
+}
+
+void test_parse_options_restore_time(enum TEST_STATUS* status){
+	struct options* opt = NULL;
+	enum operation op;
+	char* argv_at[] = { "PROG_NAME", "restore", "--at", "1500000000" };
+	char* argv_bad[] = { "PROG_NAME", "restore", "--at", "yesterday" };
+	char* argv_missing[] = { "PROG_NAME", "restore", "--at" };
+
+	TEST_ASSERT(parse_options_cmdline(4, argv_at, &opt, &op) == 0);
+	TEST_ASSERT(op == OP_RESTORE);
+	TEST_ASSERT(opt->restore_time == 1500000000UL);
+	options_free(opt);
+	opt = NULL;
+
+	TEST_ASSERT(parse_options_cmdline(4, argv_bad, &opt, &op) == 3);
+	TEST_ASSERT(parse_options_cmdline(3, argv_missing, &opt, &op) == 2);
+
+cleanup:
+	opt ? options_free(opt) : (void)0;
+}
+
 void test_parse_options_fromfile(enum TEST_STATUS* status){
 	struct options* opt = NULL;
 	struct options* opt_read = NULL;
@@ -12,6 +12,8 @@
 #include "../test_framework.h"
 
 void test_parse_options_cmdline(enum TEST_STATUS* status);
+void test_parse_options_compressor(enum TEST_STATUS* status);
+void test_parse_options_restore_time(enum TEST_STATUS* status);
 void test_parse_options_fromfile(enum TEST_STATUS* status);
 
 EXPORT_PKG(options_pkg);
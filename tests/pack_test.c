@@ -0,0 +1,227 @@
+/** @file tests/pack_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "pack_test.h"
+#include "../pack.h"
+#include "../checksum.h"
+#include "../filehelper.h"
+#include "../options/options.h"
+#include "../strings/stringhelper.h"
+#include "../log.h"
+#include <stdlib.h>
+#include <string.h>
+
+const struct unit_test pack_tests[] = {
+	MAKE_TEST(test_pack_add_file),
+	MAKE_TEST(test_pack_writer_defer)
+};
+MAKE_PKG(pack_tests, pack_pkg);
+
+struct segment_list{
+	char* pack;
+	char* index;
+	int n_segments;
+};
+
+/* the number of bytes of each entry, and how many of them are complete */
+struct stream_counts{
+	unsigned long lens[3];
+	size_t n_complete;
+};
+
+static int count_sink(size_t entry, const void* data, size_t len, void* sink_data){
+	struct stream_counts* sc = sink_data;
+
+	if (!data){
+		/* entries are completed in order */
+		return entry == sc->n_complete++ ? 0 : -1;
+	}
+	sc->lens[entry] += len;
+	return 0;
+}
+
+static int on_segment(const char* pack, const char* index, void* data){
+	struct segment_list* sl = data;
+
+	free(sl->pack);
+	free(sl->index);
+	sl->pack = sh_dup(pack);
+	sl->index = sh_dup(index);
+	sl->n_segments++;
+	return 0;
+}
+
+void test_pack_add_file(enum TEST_STATUS* status){
+	const char* files[] = {
+		"file1.txt",
+		"file2.txt",
+		"file3.txt"
+	};
+	const size_t lens[] = {
+		1337,
+		0,
+		4096
+	};
+	const char* file_restore = "file_restore.txt";
+	const char* files_restore[] = {
+		"file1_restore.txt",
+		"file2_restore.txt",
+		"file3_restore.txt"
+	};
+	const char* pack_dir = "packs";
+	struct pack_entry entries[3];
+	unsigned char data[4096];
+	struct pack_writer* pw = NULL;
+	struct options* opt = NULL;
+	struct segment_list sl;
+	struct stream_counts sc;
+	unsigned long offset;
+	unsigned long len;
+	size_t i;
+
+	memset(&sl, 0, sizeof(sl));
+	fill_sample_data(data, sizeof(data));
+	for (i = 0; i < sizeof(files) / sizeof(files[0]); ++i){
+		create_file(files[i], data, lens[i]);
+	}
+
+	opt = options_new();
+	TEST_ASSERT(opt);
+	opt->c_type = COMPRESSOR_GZIP;
+	opt->enc_algorithm = EVP_aes_256_cbc();
+	opt->hash_algorithm = EVP_sha256();
+
+	pw = pack_writer_new(pack_dir, opt, "hunter2", on_segment, &sl);
+	TEST_ASSERT(pw);
+	for (i = 0; i < sizeof(files) / sizeof(files[0]); ++i){
+		char* hash = NULL;
+		char* hash_expected = NULL;
+		int res;
+
+		res = pack_add_file(pw, files[i], &hash) == 0 && checksum_bytestring(files[i], EVP_sha256(), &hash_expected) == 0 && strcmp(hash, hash_expected) == 0;
+		free(hash);
+		free(hash_expected);
+		TEST_ASSERT(res);
+	}
+	TEST_ASSERT(pack_add_file(pw, "noexist.txt", NULL) < 0);
+	TEST_ASSERT(sl.n_segments == 0);
+	TEST_ASSERT(pack_writer_close(pw) == 0);
+	pw = NULL;
+	TEST_ASSERT(sl.n_segments == 1);
+
+	for (i = 0; i < sizeof(files) / sizeof(files[0]); ++i){
+		TEST_ASSERT(pack_find_file(sl.index, files[i], &offset, &len) == 0);
+		TEST_ASSERT(len == lens[i]);
+		TEST_ASSERT(pack_restore_file(sl.pack, offset, len, file_restore, opt, "hunter2") == 0);
+		TEST_ASSERT(memcmp_file_file(files[i], file_restore) == 0);
+	}
+	TEST_ASSERT(pack_find_file(sl.index, "noexist.txt", &offset, &len) > 0);
+
+	/* every file at once, in one pass over the segment */
+	for (i = 0; i < sizeof(files) / sizeof(files[0]); ++i){
+		entries[i].out = files_restore[i];
+		TEST_ASSERT(pack_find_file(sl.index, files[i], &entries[i].offset, &entries[i].len) == 0);
+	}
+	TEST_ASSERT(pack_extract(sl.pack, entries, sizeof(entries) / sizeof(entries[0]), opt, "hunter2") == 0);
+	for (i = 0; i < sizeof(files) / sizeof(files[0]); ++i){
+		TEST_ASSERT(memcmp_file_file(files[i], files_restore[i]) == 0);
+	}
+
+	/* the same pass without writing anything */
+	memset(&sc, 0, sizeof(sc));
+	TEST_ASSERT(pack_extract_stream(sl.pack, entries, sizeof(entries) / sizeof(entries[0]), opt, "hunter2", count_sink, &sc) == 0);
+	TEST_ASSERT(sc.n_complete == sizeof(entries) / sizeof(entries[0]));
+	for (i = 0; i < sizeof(files) / sizeof(files[0]); ++i){
+		TEST_ASSERT(sc.lens[i] == lens[i]);
+	}
+
+	/* out of order entries are refused */
+	entries[0] = entries[2];
+	TEST_ASSERT(pack_extract(sl.pack, entries, sizeof(entries) / sizeof(entries[0]), opt, "hunter2") < 0);
+
+cleanup:
+	pw ? pack_writer_close(pw) : 0;
+	opt ? options_free(opt) : (void)0;
+	for (i = 0; i < sizeof(files) / sizeof(files[0]); ++i){
+		remove(files[i]);
+		remove(files_restore[i]);
+	}
+	remove(file_restore);
+	free(sl.pack);
+	free(sl.index);
+	cleanup_test_environment(pack_dir, NULL);
+}
+
+struct defer_counts{
+	int n_calls;
+	int n_frees;
+};
+
+static int count_call(void* data){
+	((struct defer_counts*)data)->n_calls++;
+	return 0;
+}
+
+static void count_free(void* data){
+	((struct defer_counts*)data)->n_frees++;
+}
+
+void test_pack_writer_defer(enum TEST_STATUS* status){
+	const char* file = "file1.txt";
+	const char* pack_dir = "packs";
+	unsigned char data[1337];
+	struct pack_writer* pw = NULL;
+	struct options* opt = NULL;
+	struct segment_list sl;
+	unsigned long segment;
+	unsigned long segment_next;
+	struct defer_counts dc;
+
+	memset(&sl, 0, sizeof(sl));
+	memset(&dc, 0, sizeof(dc));
+	fill_sample_data(data, sizeof(data));
+	create_file(file, data, sizeof(data));
+
+	opt = options_new();
+	TEST_ASSERT(opt);
+	opt->c_type = COMPRESSOR_GZIP;
+	opt->enc_algorithm = NULL;
+
+	pw = pack_writer_new(pack_dir, opt, NULL, on_segment, &sl);
+	TEST_ASSERT(pw);
+	TEST_ASSERT(pack_add_file_ex(pw, file, file, NULL, &segment) == 0);
+	TEST_ASSERT(segment > 0);
+
+	/* the segment is still open, so the call waits for it to be closed */
+	TEST_ASSERT(pack_writer_defer(pw, segment, count_call, count_free, &dc) == 0);
+	TEST_ASSERT(dc.n_calls == 0 && dc.n_frees == 0);
+	TEST_ASSERT(pack_writer_checkpoint(pw, NULL, NULL) == 0);
+	TEST_ASSERT(sl.n_segments == 1);
+	TEST_ASSERT(dc.n_calls == 1 && dc.n_frees == 1);
+
+	/* a closed segment is already on disk */
+	TEST_ASSERT(pack_writer_defer(pw, segment, count_call, count_free, &dc) == 0);
+	TEST_ASSERT(dc.n_calls == 2 && dc.n_frees == 2);
+
+	/* the next file starts a new segment, which closing the writer finishes */
+	TEST_ASSERT(pack_add_file_ex(pw, file, file, NULL, &segment_next) == 0);
+	TEST_ASSERT(segment_next > segment);
+	TEST_ASSERT(pack_writer_defer(pw, segment_next, count_call, count_free, &dc) == 0);
+	TEST_ASSERT(dc.n_calls == 2);
+	TEST_ASSERT(pack_writer_close(pw) == 0);
+	pw = NULL;
+	TEST_ASSERT(dc.n_calls == 3 && dc.n_frees == 3);
+
+cleanup:
+	pw ? pack_writer_close(pw) : 0;
+	opt ? options_free(opt) : (void)0;
+	remove(file);
+	free(sl.pack);
+	free(sl.index);
+	cleanup_test_environment(pack_dir, NULL);
+}
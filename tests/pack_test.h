@@ -0,0 +1,18 @@
+/** @file tests/pack_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __PACK_TEST_H
+#define __PACK_TEST_H
+
+#include "test_framework.h"
+
+void test_pack_add_file(enum TEST_STATUS* status);
+void test_pack_writer_defer(enum TEST_STATUS* status);
+
+EXPORT_PKG(pack_pkg);
+#endif
@@ -0,0 +1,428 @@
+/** @file tests/pipeline_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "pipeline_test.h"
+#include "../pipeline.h"
+#include "../checksum.h"
+#include "../compression/zip.h"
+#include "../crypt/crypt_easy.h"
+#include "../crypt/crypt_session.h"
+#include "../filehelper.h"
+#include "../options/options.h"
+#include "../policy.h"
+#include "../log.h"
+#include <stdlib.h>
+#include <string.h>
+
+const struct unit_test pipeline_tests[] = {
+	MAKE_TEST(test_pipeline_backup_file),
+	MAKE_TEST(test_pipeline_backup_file_plain),
+	MAKE_TEST(test_pipeline_restore_file),
+	MAKE_TEST(test_pipeline_restore_write),
+	MAKE_TEST(test_pipeline_dict),
+	MAKE_TEST(test_pipeline_store_incompressible),
+	MAKE_TEST(test_pipeline_restore_range)
+};
+MAKE_PKG(pipeline_tests, pipeline_pkg);
+
+void test_pipeline_backup_file(enum TEST_STATUS* status){
+	const char* file = "file.txt";
+	const char* file_out = "file.txt.gz.crypt";
+	const char* file_decrypt = "file_decrypt.txt.gz";
+	const char* file_decompress = "file_decompress.txt";
+	unsigned char data[1337];
+	struct options* opt = NULL;
+	char* hash = NULL;
+	char* hash_expected = NULL;
+
+	fill_sample_data(data, sizeof(data));
+	create_file(file, data, sizeof(data));
+
+	opt = options_new();
+	TEST_ASSERT(opt);
+	opt->c_type = COMPRESSOR_GZIP;
+	opt->enc_algorithm = EVP_aes_256_cbc();
+	opt->hash_algorithm = EVP_sha256();
+
+	TEST_ASSERT(pipeline_backup_file(file, file_out, opt, "hunter2", 0, &hash) == 0);
+	TEST_ASSERT(hash);
+	TEST_ASSERT(checksum_bytestring(file, EVP_sha256(), &hash_expected) == 0);
+	TEST_ASSERT(strcmp(hash, hash_expected) == 0);
+
+	/* the output must be readable by the regular multi-pass restore path */
+	TEST_ASSERT(easy_decrypt(file_out, file_decrypt, "AES-256-CBC", 0, "hunter2") == 0);
+	TEST_ASSERT(zip_decompress(file_decrypt, file_decompress, COMPRESSOR_GZIP, 0) == 0);
+	TEST_ASSERT(memcmp_file_file(file, file_decompress) == 0);
+
+cleanup:
+	opt ? options_free(opt) : (void)0;
+	free(hash);
+	free(hash_expected);
+	remove(file);
+	remove(file_out);
+	remove(file_decrypt);
+	remove(file_decompress);
+}
+
+void test_pipeline_backup_file_plain(enum TEST_STATUS* status){
+	const char* file = "file.txt";
+	const char* file_out = "file_out.txt";
+	unsigned char data[1337];
+	struct options* opt = NULL;
+
+	fill_sample_data(data, sizeof(data));
+	create_file(file, data, sizeof(data));
+
+	opt = options_new();
+	TEST_ASSERT(opt);
+	opt->c_type = COMPRESSOR_NONE;
+	opt->enc_algorithm = NULL;
+
+	TEST_ASSERT(pipeline_backup_file(file, file_out, opt, NULL, 0, NULL) == 0);
+	TEST_ASSERT(memcmp_file_file(file, file_out) == 0);
+
+cleanup:
+	opt ? options_free(opt) : (void)0;
+	remove(file);
+	remove(file_out);
+}
+
+void test_pipeline_restore_file(enum TEST_STATUS* status){
+	const char* file = "file.txt";
+	const char* file_out = "file_out.txt";
+	const char* file_restore = "file_restore.txt";
+	const enum compressor compressors[] = { COMPRESSOR_GZIP, COMPRESSOR_BZIP2, COMPRESSOR_XZ, COMPRESSOR_LZ4, COMPRESSOR_ZSTD, COMPRESSOR_NONE };
+	unsigned char data[1337];
+	struct options* opt = NULL;
+	size_t i;
+
+	fill_sample_data(data, sizeof(data));
+	create_file(file, data, sizeof(data));
+
+	opt = options_new();
+	TEST_ASSERT(opt);
+	opt->enc_algorithm = EVP_aes_256_cbc();
+
+	for (i = 0; i < sizeof(compressors) / sizeof(compressors[0]); ++i){
+		opt->c_type = compressors[i];
+		TEST_ASSERT(pipeline_backup_file(file, file_out, opt, "hunter2", 0, NULL) == 0);
+		TEST_ASSERT(pipeline_restore_file(file_out, file_restore, opt, "hunter2") == 0);
+		TEST_ASSERT(memcmp_file_file(file, file_restore) == 0);
+		remove(file_restore);
+	}
+
+	/* a wrong password must not leave a half-restored file behind */
+	opt->c_type = COMPRESSOR_GZIP;
+	TEST_ASSERT(pipeline_backup_file(file, file_out, opt, "hunter2", 0, NULL) == 0);
+	TEST_ASSERT(pipeline_restore_file(file_out, file_restore, opt, "hunter3") != 0);
+	TEST_ASSERT(!file_exists(file_restore));
+
+cleanup:
+	opt ? options_free(opt) : (void)0;
+	remove(file);
+	remove(file_out);
+	remove(file_restore);
+}
+
+struct restore_buffer{
+	unsigned char data[4096];
+	size_t len;
+};
+
+static int restore_buffer_sink(const void* data, size_t len, void* sink_data){
+	struct restore_buffer* rb = sink_data;
+
+	if (len > sizeof(rb->data) - rb->len){
+		return -1;
+	}
+	memcpy(rb->data + rb->len, data, len);
+	rb->len += len;
+	return 0;
+}
+
+/* feeds a file to pipeline_restore_write() in pieces of piece_len like a download would, leaving off the last cut bytes */
+static int restore_in_pieces(const char* in, const struct options* opt, const char* password, size_t piece_len, size_t cut, struct restore_buffer* rb){
+	struct restore_pipeline* rp;
+	unsigned char stored[4096];
+	size_t stored_len = 0;
+	size_t i;
+	FILE* fp;
+
+	if ((fp = fopen(in, "rb")) != NULL){
+		stored_len = fread(stored, 1, sizeof(stored), fp);
+		fclose(fp);
+	}
+	stored_len = stored_len > cut ? stored_len - cut : 0;
+	rb->len = 0;
+	if (!(rp = pipeline_restore_open(in, opt, password, restore_buffer_sink, rb))){
+		return -1;
+	}
+	for (i = 0; i < stored_len; i += piece_len){
+		if (pipeline_restore_write(stored + i, stored_len - i < piece_len ? stored_len - i : piece_len, rp) != 0){
+			pipeline_restore_abort(rp);
+			return -1;
+		}
+	}
+	return pipeline_restore_close(rp);
+}
+
+void test_pipeline_restore_write(enum TEST_STATUS* status){
+	const char* file = "file.txt";
+	const char* file_out = "file_out.txt";
+	const size_t pieces[] = { 1, 7, 16, 31, 4096 };
+	unsigned char data[1337];
+	struct restore_buffer* rb = NULL;
+	struct options* opt = NULL;
+	struct crypt_session* session = NULL;
+	struct restore_pipeline* rp = NULL;
+	size_t i;
+
+	fill_sample_data(data, sizeof(data));
+	create_file(file, data, sizeof(data));
+
+	rb = malloc(sizeof(*rb));
+	opt = options_new();
+	TEST_ASSERT(rb && opt);
+	opt->c_type = COMPRESSOR_ZSTD;
+	opt->enc_algorithm = EVP_aes_256_gcm();
+
+	/* the header can be split anywhere, including between the salt and a session's nonce */
+	TEST_ASSERT(pipeline_backup_file(file, file_out, opt, "hunter2", 0, NULL) == 0);
+	for (i = 0; i < sizeof(pieces) / sizeof(pieces[0]); ++i){
+		TEST_ASSERT(restore_in_pieces(file_out, opt, "hunter2", pieces[i], 0, rb) == 0);
+		TEST_ASSERT(rb->len == sizeof(data) && memcmp(rb->data, data, sizeof(data)) == 0);
+	}
+	session = crypt_session_new(opt->enc_algorithm, "hunter2");
+	TEST_ASSERT(session);
+	opt->enc_session = session;
+	TEST_ASSERT(pipeline_backup_file(file, file_out, opt, "hunter2", 0, NULL) == 0);
+	for (i = 0; i < sizeof(pieces) / sizeof(pieces[0]); ++i){
+		TEST_ASSERT(restore_in_pieces(file_out, opt, "hunter2", pieces[i], 0, rb) == 0);
+		TEST_ASSERT(rb->len == sizeof(data) && memcmp(rb->data, data, sizeof(data)) == 0);
+	}
+
+	/* cut off inside the header, or before the end of the data */
+	rp = pipeline_restore_open(file_out, opt, "hunter2", restore_buffer_sink, rb);
+	TEST_ASSERT(rp);
+	TEST_ASSERT(pipeline_restore_write("Session_", 8, rp) == 0);
+	TEST_ASSERT(pipeline_restore_close(rp) != 0);
+	rp = NULL;
+	TEST_ASSERT(restore_in_pieces(file_out, opt, "hunter2", 4096, 1, rb) != 0);
+
+	opt->enc_session = NULL;
+	opt->enc_algorithm = NULL;
+	opt->c_type = COMPRESSOR_NONE;
+	TEST_ASSERT(pipeline_backup_file(file, file_out, opt, NULL, 0, NULL) == 0);
+	TEST_ASSERT(restore_in_pieces(file_out, opt, NULL, 7, 0, rb) == 0);
+	TEST_ASSERT(rb->len == sizeof(data) && memcmp(rb->data, data, sizeof(data)) == 0);
+
+cleanup:
+	pipeline_restore_abort(rp);
+	opt ? options_free(opt) : (void)0;
+	crypt_session_free(session);
+	free(rb);
+	remove(file);
+	remove(file_out);
+}
+
+void test_pipeline_dict(enum TEST_STATUS* status){
+	const char* file = "file.txt";
+	const char* file_out = "file_out.txt";
+	const char* file_restore = "file_restore.txt";
+	const char* file_dict = "dictionary";
+	const size_t n_samples = 1000;
+	char* samples = NULL;
+	size_t* sample_lens = NULL;
+	size_t samples_len = 0;
+	char record[128];
+	struct options* opt = NULL;
+	struct zip_dict* zd = NULL;
+	struct zip_dict* zd_loaded = NULL;
+	const void* data;
+	const void* data_loaded;
+	size_t len;
+	size_t len_loaded;
+	size_t i;
+
+	samples = malloc(n_samples * sizeof(record));
+	sample_lens = malloc(n_samples * sizeof(*sample_lens));
+	TEST_ASSERT(samples && sample_lens);
+	for (i = 0; i < n_samples; ++i){
+		sample_lens[i] = sprintf(samples + samples_len, "[host%lu]\naddress = 10.0.%lu.%lu\nport = %lu\nenabled = %s\n", (unsigned long)i, (unsigned long)i % 256, (unsigned long)i * 7 % 256, 1024 + (unsigned long)i * 13 % 4000, i % 3 ? "yes" : "no");
+		samples_len += sample_lens[i];
+	}
+	/* not one of the samples */
+	sprintf(record, "[host99999]\naddress = 10.0.1.2\nport = 2048\nenabled = yes\n");
+	create_file(file, record, strlen(record));
+
+	opt = options_new();
+	TEST_ASSERT(opt);
+	opt->c_type = COMPRESSOR_ZSTD;
+	opt->enc_algorithm = EVP_aes_256_cbc();
+	opt->dict_threshold = 4096;
+
+	zd = zip_dict_train(opt->c_type, opt->c_level, samples, sample_lens, n_samples);
+	TEST_ASSERT(zd);
+
+	/* a missing dictionary is not an error */
+	TEST_ASSERT(pipeline_load_dict(file_dict, opt, "hunter2", &zd_loaded) > 0);
+	TEST_ASSERT(pipeline_save_dict(file_dict, zd, opt, "hunter2") == 0);
+	TEST_ASSERT(pipeline_load_dict(file_dict, opt, "hunter3", &zd_loaded) < 0);
+	TEST_ASSERT(pipeline_load_dict(file_dict, opt, "hunter2", &zd_loaded) == 0);
+	data = zip_dict_data(zd, &len);
+	data_loaded = zip_dict_data(zd_loaded, &len_loaded);
+	TEST_ASSERT(len == len_loaded && memcmp(data, data_loaded, len) == 0);
+
+	opt->c_dict = zd;
+	TEST_ASSERT(pipeline_backup_file(file, file_out, opt, "hunter2", 0, NULL) == 0);
+	opt->c_dict = zd_loaded;
+	TEST_ASSERT(pipeline_restore_file(file_out, file_restore, opt, "hunter2") == 0);
+	TEST_ASSERT(memcmp_file_file(file, file_restore) == 0);
+
+	/* the small file really was compressed with it */
+	opt->c_dict = NULL;
+	TEST_ASSERT(pipeline_restore_file(file_out, file_restore, opt, "hunter2") != 0);
+
+cleanup:
+	opt ? options_free(opt) : (void)0;
+	zip_dict_free(zd);
+	zip_dict_free(zd_loaded);
+	free(samples);
+	free(sample_lens);
+	remove(file);
+	remove(file_out);
+	remove(file_restore);
+	remove(file_dict);
+}
+
+void test_pipeline_store_incompressible(enum TEST_STATUS* status){
+	const char* file = "file.txt";
+	const char* file_out = "file_out.txt";
+	const char* file_restore = "file_restore.txt";
+	unsigned char noise[1337];
+	unsigned char stored[POLICY_MARKER_LEN + sizeof(noise)];
+	enum compressor c_type;
+	int plain;
+	struct options* opt = NULL;
+	FILE* fp = NULL;
+	size_t i;
+
+	srand(1337);
+	for (i = 0; i < sizeof(noise); ++i){
+		noise[i] = rand() & 0xFF;
+	}
+	create_file(file, noise, sizeof(noise));
+
+	opt = options_new();
+	TEST_ASSERT(opt);
+	opt->c_type = COMPRESSOR_XZ;
+	opt->enc_algorithm = NULL;
+	opt->flags.bits.flag_store_incompressible = 1;
+
+	/* stored as it was behind a marker saying so, even when it starts like an xz file */
+	for (i = 0; i < 2; ++i){
+		if (i == 1){
+			memcpy(noise, "\xFD" "7zXZ\0", 6);
+			create_file(file, noise, sizeof(noise));
+		}
+		TEST_ASSERT(pipeline_backup_file(file, file_out, opt, NULL, 0, NULL) == 0);
+		TEST_ASSERT((fp = fopen(file_out, "rb")) != NULL);
+		TEST_ASSERT(fread(stored, 1, sizeof(stored), fp) == sizeof(stored));
+		TEST_ASSERT(fgetc(fp) == EOF);
+		fclose(fp);
+		fp = NULL;
+		TEST_ASSERT(policy_marker_read(stored, sizeof(stored), &c_type, &plain) == 1);
+		TEST_ASSERT(c_type == COMPRESSOR_NONE && plain);
+		TEST_ASSERT(memcmp(stored + POLICY_MARKER_LEN, noise, sizeof(noise)) == 0);
+		TEST_ASSERT(pipeline_restore_file(file_out, file_restore, opt, NULL) == 0);
+		TEST_ASSERT(memcmp_file_file(file, file_restore) == 0);
+		remove(file_restore);
+	}
+
+	/* data that is not compressed and has no marker is not taken as stored */
+	create_file(file_out, noise + 6, sizeof(noise) - 6);
+	TEST_ASSERT(pipeline_restore_file(file_out, file_restore, opt, NULL) != 0);
+	remove(file_restore);
+
+	/* encrypted the same way, and files too short to be worth compressing */
+	opt->enc_algorithm = EVP_aes_256_cbc();
+	for (i = 1; i <= 3; ++i){
+		create_file(file, "ab", i - 1);
+		TEST_ASSERT(pipeline_backup_file(file, file_out, opt, "hunter2", 0, NULL) == 0);
+		TEST_ASSERT(pipeline_restore_file(file_out, file_restore, opt, "hunter2") == 0);
+		TEST_ASSERT(memcmp_file_file(file, file_restore) == 0);
+		remove(file_restore);
+	}
+
+cleanup:
+	fp ? fclose(fp) : 0;
+	opt ? options_free(opt) : (void)0;
+	remove(file);
+	remove(file_out);
+	remove(file_restore);
+}
+
+void test_pipeline_restore_range(enum TEST_STATUS* status){
+	const char* file = "file.txt";
+	const char* file_out = "file_out.txt";
+	const char* file_restore = "file_restore.txt";
+	const char* passwords[] = { NULL, "hunter2" };
+	/* several of the 1MiB blocks */
+	const size_t data_len = (size_t)5555 << 10;
+	unsigned char* data = NULL;
+	struct zip_buffer part;
+	struct options* opt = NULL;
+	size_t i;
+
+	memset(&part, 0, sizeof(part));
+	data = malloc(data_len);
+	TEST_ASSERT(data);
+	fill_sample_data(data, data_len);
+	create_file(file, data, data_len);
+
+	opt = options_new();
+	TEST_ASSERT(opt);
+	opt->c_type = COMPRESSOR_GZIP;
+	opt->c_flags |= ZIP_SEEKABLE_MIB(1);
+
+	/* plain data skips to its blocks, while encrypted data is decrypted from the start */
+	for (i = 0; i < sizeof(passwords) / sizeof(passwords[0]); ++i){
+		opt->enc_algorithm = passwords[i] ? EVP_aes_256_cbc() : NULL;
+		TEST_ASSERT(pipeline_backup_file(file, file_out, opt, passwords[i], 0, NULL) == 0);
+		TEST_ASSERT(pipeline_restore_file(file_out, file_restore, opt, passwords[i]) == 0);
+		TEST_ASSERT(memcmp_file_file(file, file_restore) == 0);
+		remove(file_restore);
+
+		part.len = 0;
+		TEST_ASSERT(pipeline_restore_range(file_out, opt, passwords[i], 2000 << 10, 1500 << 10, zip_buffer_sink, &part) == 0);
+		TEST_ASSERT(part.len == 1500 << 10);
+		TEST_ASSERT(memcmp(part.data, data + (2000 << 10), 1500 << 10) == 0);
+
+		part.len = 0;
+		TEST_ASSERT(pipeline_restore_range(file_out, opt, passwords[i], 5000 << 10, 1000 << 10, zip_buffer_sink, &part) == 0);
+		TEST_ASSERT(part.len == data_len - (5000 << 10));
+		TEST_ASSERT(memcmp(part.data, data + (5000 << 10), data_len - (5000 << 10)) == 0);
+	}
+
+	/* stored data is read straight from the file */
+	opt->c_type = COMPRESSOR_NONE;
+	opt->enc_algorithm = NULL;
+	TEST_ASSERT(pipeline_backup_file(file, file_out, opt, NULL, 0, NULL) == 0);
+	part.len = 0;
+	TEST_ASSERT(pipeline_restore_range(file_out, opt, NULL, 100, 200, zip_buffer_sink, &part) == 0);
+	TEST_ASSERT(part.len == 200);
+	TEST_ASSERT(memcmp(part.data, data + 100, 200) == 0);
+
+cleanup:
+	opt ? options_free(opt) : (void)0;
+	free(data);
+	free(part.data);
+	remove(file);
+	remove(file_out);
+	remove(file_restore);
+}
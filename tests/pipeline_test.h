@@ -0,0 +1,23 @@
+/** @file tests/pipeline_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __PIPELINE_TEST_H
+#define __PIPELINE_TEST_H
+
+#include "test_framework.h"
+
+void test_pipeline_backup_file(enum TEST_STATUS* status);
+void test_pipeline_backup_file_plain(enum TEST_STATUS* status);
+void test_pipeline_restore_file(enum TEST_STATUS* status);
+void test_pipeline_restore_write(enum TEST_STATUS* status);
+void test_pipeline_dict(enum TEST_STATUS* status);
+void test_pipeline_store_incompressible(enum TEST_STATUS* status);
+void test_pipeline_restore_range(enum TEST_STATUS* status);
+
+EXPORT_PKG(pipeline_pkg);
+#endif
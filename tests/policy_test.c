@@ -0,0 +1,170 @@
+/** @file tests/policy_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "policy_test.h"
+#include "../policy.h"
+#include "../pipeline.h"
+#include "../filehelper.h"
+#include <openssl/evp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const struct unit_test policy_tests[] = {
+	MAKE_TEST(test_policy_parse),
+	MAKE_TEST(test_policy_match),
+	MAKE_TEST(test_policy_restore)
+};
+MAKE_PKG(policy_tests, policy_pkg);
+
+void test_policy_parse(enum TEST_STATUS* status){
+	struct policy_rule rule;
+
+	memset(&rule, 0, sizeof(rule));
+
+	TEST_ASSERT(policy_parse("/archive=xz:9", &rule) == 0);
+	TEST_ASSERT(strcmp(rule.pattern, "/archive") == 0);
+	TEST_ASSERT(rule.c_type == COMPRESSOR_XZ);
+	TEST_ASSERT(rule.c_level == 9);
+	TEST_ASSERT(!rule.plain);
+	TEST_FREE(rule.pattern, free);
+
+	/* the last '=' splits it, so the pattern can have one */
+	TEST_ASSERT(policy_parse("a=b.mp4=none,plain", &rule) == 0);
+	TEST_ASSERT(strcmp(rule.pattern, "a=b.mp4") == 0);
+	TEST_ASSERT(rule.c_type == COMPRESSOR_NONE);
+	TEST_ASSERT(rule.c_level == 0);
+	TEST_ASSERT(rule.plain);
+	TEST_FREE(rule.pattern, free);
+
+	TEST_ASSERT(policy_parse("/archive", &rule) != 0);
+	TEST_ASSERT(policy_parse("=gzip", &rule) != 0);
+	TEST_ASSERT(policy_parse("/archive=nope", &rule) != 0);
+	TEST_ASSERT(policy_parse("/archive=xz:high", &rule) != 0);
+	TEST_ASSERT(policy_parse("/archive=xz,fast", &rule) != 0);
+
+cleanup:
+	free(rule.pattern);
+}
+
+void test_policy_match(enum TEST_STATUS* status){
+	const char* rules[] = { "/var/lib/hot=lz4", "/archive=xz:9", "*.mp4=none", "/data/*/cache=gzip:1,plain" };
+	struct string_array* sa = NULL;
+	struct policy_set* ps = NULL;
+	const struct policy_rule* rule;
+	struct options* base = NULL;
+	struct options opt;
+	size_t i;
+
+	sa = sa_new();
+	TEST_ASSERT(sa);
+	for (i = 0; i < sizeof(rules) / sizeof(rules[0]); ++i){
+		TEST_ASSERT(sa_add(sa, rules[i]) == 0);
+	}
+	ps = policy_set_new(sa);
+	TEST_ASSERT(ps);
+
+	TEST_ASSERT((rule = policy_match(ps, "/var/lib/hot/db/table")) != NULL);
+	TEST_ASSERT(rule->c_type == COMPRESSOR_LZ4);
+	TEST_ASSERT(policy_match(ps, "/var/lib/hotter/table") == NULL);
+	/* the first rule that matches wins */
+	TEST_ASSERT((rule = policy_match(ps, "/archive/2017/video.mp4")) != NULL);
+	TEST_ASSERT(rule->c_type == COMPRESSOR_XZ);
+	TEST_ASSERT((rule = policy_match(ps, "/home/user/video.mp4")) != NULL);
+	TEST_ASSERT(rule->c_type == COMPRESSOR_NONE);
+	TEST_ASSERT(policy_match(ps, "/home/user/video.mp4.txt") == NULL);
+	TEST_ASSERT((rule = policy_match(ps, "/data/web/cache/index")) != NULL);
+	TEST_ASSERT(rule->plain);
+	TEST_ASSERT(policy_match(NULL, "/archive/file") == NULL);
+
+	base = options_new();
+	TEST_ASSERT(base);
+	base->c_type = COMPRESSOR_ZSTD;
+	base->c_target = 100;
+	policy_apply(rule, base, &opt);
+	TEST_ASSERT(opt.c_type == COMPRESSOR_GZIP);
+	TEST_ASSERT(opt.c_level == 1);
+	TEST_ASSERT(opt.c_target == 0);
+	TEST_ASSERT(opt.enc_algorithm == NULL);
+	TEST_ASSERT(opt.policy_marked);
+	TEST_ASSERT(base->enc_algorithm != NULL);
+
+	/* a rule that is not valid keeps the whole set from being made */
+	TEST_ASSERT(sa_add(sa, "/tmp=nope") == 0);
+	TEST_ASSERT(policy_set_new(sa) == NULL);
+
+cleanup:
+	base ? options_free(base) : (void)0;
+	policy_set_free(ps);
+	sa ? sa_free(sa) : (void)0;
+}
+
+void test_policy_restore(enum TEST_STATUS* status){
+	const char* file = "policy.txt";
+	const char* file_out = "policy_out.txt";
+	const char* file_restore = "policy_restore.txt";
+	const char* rules[] = { "*=bzip2", "*=xz:9", "*=none", "*=none,plain", "*=gzip:1,plain" };
+	unsigned char data[1337];
+	unsigned char marker[POLICY_MARKER_LEN];
+	struct options* opt = NULL;
+	struct options opt_rule;
+	struct policy_rule rule;
+	enum compressor c_type;
+	int plain;
+	size_t i;
+
+	memset(&rule, 0, sizeof(rule));
+	fill_sample_data(data, sizeof(data));
+	create_file(file, data, sizeof(data));
+
+	opt = options_new();
+	TEST_ASSERT(opt);
+	opt->c_type = COMPRESSOR_GZIP;
+	opt->enc_algorithm = EVP_aes_256_cbc();
+
+	/* the base options restore every one of them, whatever the rule was */
+	for (i = 0; i < sizeof(rules) / sizeof(rules[0]); ++i){
+		TEST_ASSERT(policy_parse(rules[i], &rule) == 0);
+		policy_apply(&rule, opt, &opt_rule);
+		TEST_FREE(rule.pattern, free);
+
+		TEST_ASSERT(pipeline_backup_file(file, file_out, &opt_rule, "hunter2", 0, NULL) == 0);
+		TEST_ASSERT(pipeline_restore_file(file_out, file_restore, opt, "hunter2") == 0);
+		TEST_ASSERT(memcmp_file_file(file, file_restore) == 0);
+		remove(file_restore);
+	}
+
+	/* a file that starts like a marker is marked itself when it is stored as it is */
+	opt->c_type = COMPRESSOR_NONE;
+	opt->enc_algorithm = NULL;
+	opt_rule = *opt;
+	opt_rule.c_type = COMPRESSOR_XZ;
+	policy_marker_make(&opt_rule, marker);
+	TEST_ASSERT(policy_marker_read(marker, sizeof(marker), &c_type, &plain) > 0);
+	TEST_ASSERT(c_type == COMPRESSOR_XZ);
+	TEST_ASSERT(plain);
+	TEST_ASSERT(policy_marker_read(marker, sizeof(marker) - 1, NULL, NULL) == 0);
+	memcpy(data, marker, sizeof(marker));
+	create_file(file, data, sizeof(data));
+	TEST_ASSERT(pipeline_backup_file(file, file_out, opt, NULL, 0, NULL) == 0);
+	TEST_ASSERT(pipeline_restore_file(file_out, file_restore, opt, NULL) == 0);
+	TEST_ASSERT(memcmp_file_file(file, file_restore) == 0);
+
+	/* and one shorter than a marker is restored as it is */
+	create_file(file, "abc", 3);
+	TEST_ASSERT(pipeline_backup_file(file, file_out, opt, NULL, 0, NULL) == 0);
+	TEST_ASSERT(pipeline_restore_file(file_out, file_restore, opt, NULL) == 0);
+	TEST_ASSERT(memcmp_file_file(file, file_restore) == 0);
+
+cleanup:
+	free(rule.pattern);
+	opt ? options_free(opt) : (void)0;
+	remove(file);
+	remove(file_out);
+	remove(file_restore);
+}
@@ -0,0 +1,19 @@
+/** @file tests/policy_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __POLICY_TEST_H
+#define __POLICY_TEST_H
+
+#include "test_framework.h"
+
+void test_policy_parse(enum TEST_STATUS* status);
+void test_policy_match(enum TEST_STATUS* status);
+void test_policy_restore(enum TEST_STATUS* status);
+
+EXPORT_PKG(policy_pkg);
+#endif
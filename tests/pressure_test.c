@@ -0,0 +1,97 @@
+/** @file tests/pressure_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "pressure_test.h"
+#include "../pressure.h"
+#include <stdio.h>
+#include <string.h>
+
+const struct unit_test pressure_tests[] = {
+	MAKE_TEST(test_pressure_read),
+	MAKE_TEST(test_pressure_adjust)
+};
+MAKE_PKG(pressure_tests, pressure_pkg);
+
+void test_pressure_read(enum TEST_STATUS* status){
+	const char* file = "pressure.txt";
+	const char* io = "some avg10=12.50 avg60=3.00 avg300=0.75 total=123456\nfull avg10=4.25 avg60=1.00 avg300=0.25 total=65432\n";
+	const char* cpu = "some avg10=0.50 avg60=0.10 avg300=0.00 total=999\n";
+	struct pressure p;
+
+	create_file(file, io, (int)strlen(io));
+	TEST_ASSERT(pressure_read(file, &p) == 0);
+	TEST_ASSERT(p.some_avg10 > 12.49 && p.some_avg10 < 12.51);
+	TEST_ASSERT(p.full_avg10 > 4.24 && p.full_avg10 < 4.26);
+
+	/* the CPU has no full line on older kernels */
+	create_file(file, cpu, (int)strlen(cpu));
+	TEST_ASSERT(pressure_read(file, &p) == 0);
+	TEST_ASSERT(p.some_avg10 > 0.49 && p.some_avg10 < 0.51);
+	TEST_ASSERT(p.full_avg10 == 0);
+
+	create_file(file, "nonsense\n", 9);
+	TEST_ASSERT(pressure_read(file, &p) < 0);
+
+	remove(file);
+	TEST_ASSERT(pressure_read(file, &p) > 0);
+
+cleanup:
+	remove(file);
+}
+
+void test_pressure_adjust(enum TEST_STATUS* status){
+	struct pressure busy;
+	struct pressure idle;
+	struct pressure_level pl;
+	const uint64_t mib = (uint64_t)1 << 20;
+
+	busy.some_avg10 = PRESSURE_HIGH + 5;
+	busy.full_avg10 = 0;
+	idle.some_avg10 = 0;
+	idle.full_avg10 = 0;
+
+	pl.workers = 8;
+	pl.max_workers = 8;
+	pl.read_rate = 0;
+
+	/* either kind of pressure is enough */
+	TEST_ASSERT(pressure_adjust(&pl, &idle, &busy, 100 * mib));
+	TEST_ASSERT(pl.workers == 4);
+	TEST_ASSERT(pl.read_rate == 50 * mib);
+	TEST_ASSERT(pressure_adjust(&pl, &busy, &idle, 50 * mib));
+	TEST_ASSERT(pl.workers == 2);
+	TEST_ASSERT(pl.read_rate == 25 * mib);
+
+	/* it never stops the backup altogether */
+	pl.read_rate = 3 * mib / 2;
+	TEST_ASSERT(pressure_adjust(&pl, &busy, &busy, mib));
+	TEST_ASSERT(pl.workers == 1);
+	TEST_ASSERT(pl.read_rate == PRESSURE_MIN_RATE);
+	TEST_ASSERT(pressure_adjust(&pl, &busy, &busy, mib) == 0);
+
+	/* somewhere in between leaves it where it is */
+	busy.some_avg10 = (PRESSURE_HIGH + PRESSURE_LOW) / 2;
+	TEST_ASSERT(pressure_adjust(&pl, &busy, &idle, mib) == 0);
+
+	/* the rate is lifted once the backup does not read anywhere near it */
+	TEST_ASSERT(pressure_adjust(&pl, &idle, &idle, mib));
+	TEST_ASSERT(pl.workers == 2);
+	TEST_ASSERT(pl.read_rate == 2 * mib);
+	TEST_ASSERT(pressure_adjust(&pl, &idle, &idle, 2 * mib));
+	TEST_ASSERT(pl.workers == 3);
+	TEST_ASSERT(pl.read_rate == 4 * mib);
+	TEST_ASSERT(pressure_adjust(&pl, &idle, &idle, mib / 2));
+	TEST_ASSERT(pl.read_rate == 0);
+
+	pl.workers = 8;
+	TEST_ASSERT(pressure_adjust(&pl, &idle, &idle, mib) == 0);
+	TEST_ASSERT(pl.workers == 8);
+
+cleanup:
+	;
+}
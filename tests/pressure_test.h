@@ -0,0 +1,18 @@
+/** @file tests/pressure_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __PRESSURE_TEST_H
+#define __PRESSURE_TEST_H
+
+#include "test_framework.h"
+
+void test_pressure_read(enum TEST_STATUS* status);
+void test_pressure_adjust(enum TEST_STATUS* status);
+
+EXPORT_PKG(pressure_pkg);
+#endif
@@ -9,11 +9,13 @@
 #include "progressbar_test.h"
 #include "../progressbar.h"
 #include "../log.h"
+#include <pthread.h>
 #include <unistd.h>
 #include <stdlib.h>
 
 const struct unit_test progressbar_tests[] = {
-	MAKE_TEST_RU(test_progress)
+	MAKE_TEST_RU(test_progress),
+	MAKE_TEST(test_progress_board)
 };
 MAKE_PKG(progressbar_tests, progressbar_pkg);
 
@@ -31,3 +33,55 @@ void test_progress(enum TEST_STATUS* status){
 cleanup:
 	p ? finish_progress(p) : (void)0;
 }
+
+static void* board_worker(void* arg){
+	unsigned seed = *(unsigned*)arg;
+	int i;
+
+	for (i = 0; i < 20; ++i){
+		uint64_t size = rand_r(&seed) % (1 << 20);
+
+		progress_board_found(size);
+		progress_board_add(STAGE_READ, size);
+		usleep(rand_r(&seed) % 20000 + 1000);
+		progress_board_add(STAGE_UPLOAD, size / 2);
+		progress_board_done(size);
+	}
+	return NULL;
+}
+
+void test_progress_board(enum TEST_STATUS* status){
+	pthread_t threads[8];
+	unsigned seeds[8];
+	struct progress* p = NULL;
+	size_t n_started = 0;
+	int started = 0;
+	size_t i;
+
+	TEST_ASSERT(progress_board_start("Test progress board") == 0);
+	started = 1;
+	/* only one board at a time */
+	TEST_ASSERT(progress_board_start("Test progress board") != 0);
+
+	/* a bar started under the board is not drawn, but still works */
+	p = start_progress("Hidden progress", 100);
+	TEST_ASSERT(p);
+	TEST_ASSERT(p->hidden);
+	inc_progress(p, 50);
+	TEST_ASSERT(p->count == 50);
+	TEST_FREE(p, finish_progress);
+
+	for (i = 0; i < sizeof(threads) / sizeof(threads[0]); ++i){
+		seeds[i] = i;
+		TEST_ASSERT(pthread_create(&threads[i], NULL, board_worker, &seeds[i]) == 0);
+		n_started++;
+	}
+	progress_board_puts("A line printed above the board");
+
+cleanup:
+	for (i = 0; i < n_started; ++i){
+		pthread_join(threads[i], NULL);
+	}
+	p ? finish_progress(p) : (void)0;
+	started ? progress_board_finish() : (void)0;
+}
@@ -12,6 +12,7 @@
 #include "test_framework.h"
 
 void test_progress(enum TEST_STATUS* status);
+void test_progress_board(enum TEST_STATUS* status);
 
 EXPORT_PKG(progressbar_pkg);
 #endif
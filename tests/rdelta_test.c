@@ -0,0 +1,257 @@
+/** @file tests/rdelta_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "rdelta_test.h"
+#include "../rdelta.h"
+#include "../pipeline.h"
+#include "../compression/zip.h"
+#include "../filehelper.h"
+#include "../options/options.h"
+#include <openssl/evp.h>
+#include <stdlib.h>
+#include <string.h>
+
+const struct unit_test rdelta_tests[] = {
+	MAKE_TEST(test_rdelta_roundtrip),
+	MAKE_TEST(test_rdelta_unrelated),
+	MAKE_TEST(test_rdelta_store)
+};
+MAKE_PKG(rdelta_tests, rdelta_pkg);
+
+/* data that does not repeat, unlike fill_sample_data(), so nothing matches by accident */
+static void fill_random(unsigned char* data, size_t len, unsigned long seed){
+	size_t i;
+
+	for (i = 0; i < len; ++i){
+		seed = seed * 1103515245UL + 12345UL;
+		data[i] = (unsigned char)(seed >> 16);
+	}
+}
+
+struct mem_sink{
+	unsigned char* data;
+	size_t len;
+	size_t size;
+};
+
+static int mem_write(const void* data, size_t len, void* sink_data){
+	struct mem_sink* ms = sink_data;
+
+	if (ms->len + len > ms->size){
+		size_t size = (ms->len + len) * 2;
+		unsigned char* tmp = realloc(ms->data, size);
+
+		if (!tmp){
+			return -1;
+		}
+		ms->data = tmp;
+		ms->size = size;
+	}
+	memcpy(ms->data + ms->len, data, len);
+	ms->len += len;
+	return 0;
+}
+
+/* makes a delta of target against base, and checks that it gives target back
+ * both are fed in odd pieces, so operations and windows are split up everywhere */
+static int roundtrip(const char* base_file, const unsigned char* target, size_t target_len, size_t* out_delta_len){
+	struct rdelta_writer* rw = NULL;
+	struct rdelta_reader* rr = NULL;
+	struct mem_sink delta;
+	struct mem_sink rebuilt;
+	size_t i;
+	int ret = -1;
+
+	memset(&delta, 0, sizeof(delta));
+	memset(&rebuilt, 0, sizeof(rebuilt));
+
+	if (!(rw = rdelta_writer_new(base_file, mem_write, &delta))){
+		goto cleanup;
+	}
+	for (i = 0; i < target_len; i += 777){
+		if (rdelta_writer_write(target + i, target_len - i < 777 ? target_len - i : 777, rw) != 0){
+			goto cleanup;
+		}
+	}
+	if (rdelta_writer_close(rw) != 0){
+		rw = NULL;
+		goto cleanup;
+	}
+	rw = NULL;
+
+	if (!(rr = rdelta_reader_new(base_file, mem_write, &rebuilt))){
+		goto cleanup;
+	}
+	for (i = 0; i < delta.len; i += 5){
+		if (rdelta_reader_write(delta.data + i, delta.len - i < 5 ? delta.len - i : 5, rr) != 0){
+			goto cleanup;
+		}
+	}
+	if (rdelta_reader_close(rr) != 0){
+		rr = NULL;
+		goto cleanup;
+	}
+	rr = NULL;
+
+	if (rebuilt.len == target_len && (target_len == 0 || memcmp(rebuilt.data, target, target_len) == 0)){
+		*out_delta_len = delta.len;
+		ret = 0;
+	}
+
+cleanup:
+	rdelta_writer_abort(rw);
+	rdelta_reader_abort(rr);
+	free(delta.data);
+	free(rebuilt.data);
+	return ret;
+}
+
+void test_rdelta_roundtrip(enum TEST_STATUS* status){
+	const char* base_file = "rdelta_base.bin";
+	const size_t len = 200000;
+	unsigned char* base = NULL;
+	unsigned char* target = NULL;
+	size_t target_len;
+	size_t delta_len;
+
+	base = malloc(len);
+	target = malloc(len + 1000);
+	TEST_ASSERT(base && target);
+	fill_random(base, len, 1);
+	create_file(base_file, base, (int)len);
+
+	/* the same file is one copy, and a tail shorter than a block */
+	TEST_ASSERT(roundtrip(base_file, base, len, &delta_len) == 0);
+	TEST_ASSERT(delta_len < 1024);
+
+	/* an insertion, an overwrite, a deletion, and something on the end */
+	memcpy(target, base, 5000);
+	fill_random(target + 5000, 100, 2);
+	memcpy(target + 5100, base + 5000, 145000);
+	fill_random(target + 100000, 50, 3);
+	memcpy(target + 150100, base + 153000, len - 153000);
+	target_len = 150100 + len - 153000;
+	fill_random(target + target_len, 333, 4);
+	target_len += 333;
+	TEST_ASSERT(roundtrip(base_file, target, target_len, &delta_len) == 0);
+	/* each edit costs about a block of literals, not the whole file */
+	TEST_ASSERT(delta_len < 8 * 1024);
+
+	/* nothing at all */
+	TEST_ASSERT(roundtrip(base_file, target, 0, &delta_len) == 0);
+
+	/* a target shorter than a block cannot match anything */
+	TEST_ASSERT(roundtrip(base_file, base, 100, &delta_len) == 0);
+
+cleanup:
+	free(base);
+	free(target);
+	remove(base_file);
+}
+
+void test_rdelta_unrelated(enum TEST_STATUS* status){
+	const char* base_file = "rdelta_base.bin";
+	unsigned char* data = NULL;
+	size_t delta_len;
+	struct rdelta_reader* rr = NULL;
+	struct mem_sink rebuilt;
+	/* copies 10 bytes from past the end of the base */
+	const unsigned char bad[] = { 'C', 0xFF, 0xFF, 0, 0, 0, 0, 0, 0, 10, 0, 0, 0 };
+
+	memset(&rebuilt, 0, sizeof(rebuilt));
+	data = malloc(100000);
+	TEST_ASSERT(data);
+
+	/* a tiny base has no whole blocks to match */
+	fill_random(data, 100000, 5);
+	create_file(base_file, data, 100);
+	fill_random(data, 100000, 6);
+	TEST_ASSERT(roundtrip(base_file, data, 100000, &delta_len) == 0);
+	TEST_ASSERT(delta_len > 100000);
+
+	/* an empty base has none either */
+	create_file(base_file, data, 0);
+	TEST_ASSERT(roundtrip(base_file, data, 100000, &delta_len) == 0);
+
+	/* a delta that does not fit its base is refused */
+	rr = rdelta_reader_new(base_file, mem_write, &rebuilt);
+	TEST_ASSERT(rr);
+	TEST_ASSERT(rdelta_reader_write(bad, sizeof(bad), rr) != 0);
+	rdelta_reader_abort(rr);
+	rr = NULL;
+
+	/* and so is one that ends early */
+	rr = rdelta_reader_new(base_file, mem_write, &rebuilt);
+	TEST_ASSERT(rr);
+	TEST_ASSERT(rdelta_reader_write("L\x05\x00\x00\x00" "ab", 7, rr) == 0);
+	TEST_ASSERT(rdelta_reader_close(rr) != 0);
+	rr = NULL;
+
+cleanup:
+	rdelta_reader_abort(rr);
+	free(rebuilt.data);
+	free(data);
+	remove(base_file);
+}
+
+void test_rdelta_store(enum TEST_STATUS* status){
+	const char* old_file = "rdelta_old.bin";
+	const char* new_file = "rdelta_new.bin";
+	const char* stored = "rdelta_old.bin.stored";
+	const char* restored = "rdelta_old.bin.restored";
+	const size_t len = 150000;
+	unsigned char* data = NULL;
+	struct options* opt = NULL;
+	uint64_t whole_len;
+
+	data = malloc(len);
+	TEST_ASSERT(data);
+	fill_random(data, len, 7);
+	create_file(new_file, data, (int)len);
+	/* the old version only differs in the middle */
+	fill_random(data + 70000, 200, 8);
+	create_file(old_file, data, (int)len);
+
+	opt = options_new();
+	TEST_ASSERT(opt);
+	opt->c_type = COMPRESSOR_GZIP;
+	opt->enc_algorithm = EVP_aes_256_cbc();
+
+	TEST_ASSERT(pipeline_backup_file(old_file, stored, opt, "hunter2", 0, NULL) == 0);
+	TEST_ASSERT(!rdelta_is_delta(stored));
+	whole_len = get_file_size(stored);
+
+	TEST_ASSERT(rdelta_store(new_file, stored, opt, "hunter2") == 0);
+	TEST_ASSERT(rdelta_is_delta(stored));
+	TEST_ASSERT(get_file_size(stored) < whole_len / 10);
+	/* a delta is not made of a delta */
+	TEST_ASSERT(rdelta_store(new_file, stored, opt, "hunter2") > 0);
+
+	TEST_ASSERT(rdelta_restore(new_file, stored, restored, opt, "hunter2") == 0);
+	TEST_ASSERT(memcmp_file_file(restored, old_file) == 0);
+	/* the wrong password does not get anything */
+	TEST_ASSERT(rdelta_restore(new_file, stored, restored, opt, "hunter3") != 0);
+	TEST_ASSERT(!does_file_exist(restored));
+
+	/* against something unrelated the delta is no smaller, so the whole version stays */
+	TEST_ASSERT(pipeline_backup_file(old_file, stored, opt, "hunter2", 0, NULL) == 0);
+	fill_random(data, len, 9);
+	create_file(new_file, data, (int)len);
+	TEST_ASSERT(rdelta_store(new_file, stored, opt, "hunter2") > 0);
+	TEST_ASSERT(!rdelta_is_delta(stored));
+	TEST_ASSERT(pipeline_restore_file(stored, restored, opt, "hunter2") == 0);
+	TEST_ASSERT(memcmp_file_file(restored, old_file) == 0);
+
+cleanup:
+	opt ? options_free(opt) : (void)0;
+	free(data);
+	remove(old_file);
+	remove(new_file);
+	remove(stored);
+	remove(restored);
+}
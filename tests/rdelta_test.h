@@ -0,0 +1,19 @@
+/** @file tests/rdelta_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __RDELTA_TEST_H
+#define __RDELTA_TEST_H
+
+#include "test_framework.h"
+
+void test_rdelta_roundtrip(enum TEST_STATUS* status);
+void test_rdelta_unrelated(enum TEST_STATUS* status);
+void test_rdelta_store(enum TEST_STATUS* status);
+
+EXPORT_PKG(rdelta_pkg);
+#endif
@@ -0,0 +1,326 @@
+/** @file tests/retention_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "retention_test.h"
+#include "../retention.h"
+#include "../filehelper.h"
+#include "../pipeline.h"
+#include "../rdelta.h"
+#include "../options/options.h"
+#include "../strings/stringhelper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+const struct unit_test retention_tests[] = {
+	MAKE_TEST(test_retention_parse_generation),
+	MAKE_TEST(test_retention_plan),
+	MAKE_TEST(test_retention_prune),
+	MAKE_TEST(test_retention_deltas)
+};
+MAKE_PKG(retention_tests, retention_pkg);
+
+/* noon local time on a day of June 2017, plus a number of hours */
+static unsigned long day_time(int day, int hours){
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = 117;
+	tm.tm_mon = 5;
+	tm.tm_mday = day;
+	tm.tm_hour = 12 + hours;
+	tm.tm_isdst = -1;
+	return (unsigned long)mktime(&tm);
+}
+
+void test_retention_parse_generation(enum TEST_STATUS* status){
+	unsigned long t = 0;
+
+	TEST_ASSERT(retention_parse_generation("/out/deltas/home/file.txt.1500000000", &t) == (long)strlen("/out/deltas/home/file.txt"));
+	TEST_ASSERT(t == 1500000000UL);
+	TEST_ASSERT(retention_parse_generation("/out/deltas/home/file.txt", &t) < 0);
+	TEST_ASSERT(retention_parse_generation("/out/deltas/home/file.", &t) < 0);
+	TEST_ASSERT(retention_parse_generation("/out/deltas/home.1500000000/file", &t) < 0);
+	TEST_ASSERT(retention_parse_generation("/out/deltas/home/file.15000x", &t) < 0);
+
+cleanup:
+	;
+}
+
+void test_retention_plan(enum TEST_STATUS* status){
+	struct retention_generation gens[5];
+	size_t i;
+
+	memset(gens, 0, sizeof(gens));
+	/* out of order, with two generations on the first day */
+	gens[0].time = day_time(1, 0);
+	gens[1].time = day_time(3, 0);
+	gens[2].time = day_time(1, 1);
+	gens[3].time = day_time(4, 0);
+	gens[4].time = day_time(2, 0);
+
+	retention_plan(gens, 5, 1, 2);
+	for (i = 1; i < 5; ++i){
+		TEST_ASSERT(gens[i - 1].time > gens[i].time);
+	}
+	TEST_ASSERT(gens[0].action == RETENTION_KEEP);
+	TEST_ASSERT(gens[1].action == RETENTION_COMPACT);
+	TEST_ASSERT(gens[2].action == RETENTION_DELETE);
+	TEST_ASSERT(gens[3].action == RETENTION_DELETE);
+	TEST_ASSERT(gens[4].action == RETENTION_DELETE);
+
+	/* only the last generation of the first day is kept */
+	retention_plan(gens, 5, 2, 4);
+	TEST_ASSERT(gens[0].action == RETENTION_KEEP);
+	TEST_ASSERT(gens[1].action == RETENTION_KEEP);
+	TEST_ASSERT(gens[2].action == RETENTION_COMPACT);
+	TEST_ASSERT(gens[3].action == RETENTION_COMPACT);
+	TEST_ASSERT(gens[4].action == RETENTION_DELETE);
+
+	/* keeping more than there is keeps everything */
+	retention_plan(gens, 5, 10, 0);
+	for (i = 0; i < 5; ++i){
+		TEST_ASSERT(gens[i].action == RETENTION_KEEP);
+	}
+
+cleanup:
+	;
+}
+
+static char* version_path(const char* out, const char* file, unsigned long t){
+	char ext[32];
+
+	sprintf(ext, ".%lu", t);
+	return sh_concat(sh_concat_path(sh_concat_path(sh_dup(out), "deltas"), file), ext);
+}
+
+void test_retention_prune(enum TEST_STATUS* status){
+	const char* out = "TEST_RETENTION";
+	const char* files[] = {
+		"/home/user/a.txt",
+		"/home/user/docs/b.txt",
+		"/home/user/docs/deep/c.txt"
+	};
+	const char* big = "/home/user/big.bin";
+	const char* extracted = "TEST_RETENTION_EXTRACTED";
+	unsigned long times[4];
+	unsigned char* data = NULL;
+	struct options* opt = NULL;
+	struct retention_location loc;
+	char* path = NULL;
+	size_t i;
+	size_t j;
+
+	memset(&loc, 0, sizeof(loc));
+	cleanup_test_environment(out, NULL);
+	times[0] = day_time(1, 0);
+	times[1] = day_time(2, 0);
+	times[2] = day_time(3, 0);
+	times[3] = day_time(3, 1);
+
+	data = malloc(RETENTION_PACK_MAX + 1);
+	TEST_ASSERT(data);
+	fill_sample_data(data, RETENTION_PACK_MAX + 1);
+	for (i = 0; i < 4; ++i){
+		for (j = 0; j < sizeof(files) / sizeof(files[0]); ++j){
+			char* parent;
+
+			path = version_path(out, files[j], times[i]);
+			parent = sh_parent_dir(path);
+			TEST_ASSERT(parent && mkdir_recursive(parent) >= 0);
+			free(parent);
+			/* every version is different */
+			create_file(path, data + i * 7 + j, (int)(100 * (i + 1) + j));
+			free(path);
+			path = NULL;
+		}
+	}
+	path = version_path(out, big, times[1]);
+	create_file(path, data, RETENTION_PACK_MAX + 1);
+	free(path);
+	path = sh_concat_path(sh_dup(out), "deltas/home/notes");
+	create_file(path, "notes", 5);
+	free(path);
+	path = NULL;
+
+	opt = options_new();
+	TEST_ASSERT(opt);
+	free(opt->output_directory);
+	opt->output_directory = sh_dup(out);
+	opt->n_threads = 2;
+
+	/* refuses to delete everything */
+	TEST_ASSERT(retention_prune(opt) < 0);
+
+	opt->keep_last = 1;
+	opt->keep_daily = 2;
+	TEST_ASSERT(retention_prune(opt) == 0);
+
+	for (j = 0; j < sizeof(files) / sizeof(files[0]); ++j){
+		/* the newest generation is kept as it is */
+		TEST_ASSERT(retention_find(out, files[j], times[3], &loc) == 0);
+		TEST_ASSERT(!loc.packed);
+		free(loc.path);
+		loc.path = NULL;
+
+		/* the last of day 3 is kept by keep_last, so day 2 is compacted and day 1 goes */
+		TEST_ASSERT(retention_find(out, files[j], times[2], &loc) > 0);
+		TEST_ASSERT(retention_find(out, files[j], times[0], &loc) > 0);
+
+		TEST_ASSERT(retention_find(out, files[j], times[1], &loc) == 0);
+		TEST_ASSERT(loc.packed);
+		TEST_ASSERT(loc.len == 200 + j);
+		free(loc.path);
+		loc.path = NULL;
+		path = version_path(out, files[j], times[1]);
+		TEST_ASSERT(!does_file_exist(path));
+		free(path);
+		path = NULL;
+
+		TEST_ASSERT(retention_extract(out, files[j], times[1], extracted) == 0);
+		TEST_ASSERT(memcmp_file_data(extracted, data + 7 + j, (int)(200 + j)) == 0);
+		remove(extracted);
+	}
+
+	/* too big to pack, so it stays loose in a compacted generation */
+	TEST_ASSERT(retention_find(out, big, times[1], &loc) == 0);
+	TEST_ASSERT(!loc.packed);
+	free(loc.path);
+	loc.path = NULL;
+
+	/* anything that is not a version is left alone */
+	path = sh_concat_path(sh_dup(out), "deltas/home/notes");
+	TEST_ASSERT(does_file_exist(path));
+	free(path);
+	path = NULL;
+
+	/* pruning again with a smaller policy deletes the packed generation too */
+	opt->keep_daily = 0;
+	TEST_ASSERT(retention_prune(opt) == 0);
+	TEST_ASSERT(retention_find(out, files[0], times[1], &loc) > 0);
+	TEST_ASSERT(retention_find(out, files[0], times[3], &loc) == 0);
+	free(loc.path);
+	loc.path = NULL;
+	path = sh_sprintf("%s/%s/%lu", out, RETENTION_PACK_DIR, times[1]);
+	TEST_ASSERT(!directory_exists(path));
+	free(path);
+	path = NULL;
+
+cleanup:
+	free(loc.path);
+	free(path);
+	free(data);
+	opt ? options_free(opt) : (void)0;
+	remove(extracted);
+	cleanup_test_environment(out, NULL);
+}
+
+/* a different version of the same big file for every generation, each with a few bytes changed */
+static void make_version(unsigned char* data, size_t len, int version){
+	size_t i;
+
+	for (i = 0; i < len; ++i){
+		data[i] = (unsigned char)((i * 7919) ^ (i >> 9));
+	}
+	memset(data + 1000 * version, 'a' + version, 50);
+}
+
+void test_retention_deltas(enum TEST_STATUS* status){
+	const char* out = "TEST_RETENTION_DELTAS";
+	const char* file = "/home/user/disk.img";
+	const char* plain[3] = { "TEST_RETENTION_V0", "TEST_RETENTION_V1", "TEST_RETENTION_V2" };
+	const char* restored = "TEST_RETENTION_RESTORED";
+	const size_t len = 100000;
+	unsigned long times[3];
+	unsigned char* data = NULL;
+	struct options* opt = NULL;
+	char* path = NULL;
+	char* parent = NULL;
+	int i;
+
+	cleanup_test_environment(out, NULL);
+	/* day 1 is compacted, the first backup of day 2 is deleted, and the last is kept */
+	times[0] = day_time(1, 0);
+	times[1] = day_time(2, 0);
+	times[2] = day_time(2, 1);
+
+	data = malloc(len);
+	opt = options_new();
+	TEST_ASSERT(data && opt);
+	free(opt->output_directory);
+	opt->output_directory = sh_dup(out);
+	opt->c_type = COMPRESSOR_GZIP;
+	opt->enc_algorithm = NULL;
+	opt->n_threads = 1;
+
+	for (i = 0; i < 3; ++i){
+		make_version(data, len, i);
+		create_file(plain[i], data, (int)len);
+	}
+	/* the version replaced at times[i] is version i, and each one but the newest is a delta against the one after it */
+	for (i = 0; i < 3; ++i){
+		path = version_path(out, file, times[i]);
+		parent = sh_parent_dir(path);
+		TEST_ASSERT(parent && mkdir_recursive(parent) >= 0);
+		TEST_ASSERT(pipeline_backup_file(plain[i], path, opt, NULL, 0, NULL) == 0);
+		if (i < 2){
+			TEST_ASSERT(rdelta_store(plain[i + 1], path, opt, NULL) == 0);
+		}
+		free(parent);
+		parent = NULL;
+		free(path);
+		path = NULL;
+	}
+
+	for (i = 0; i < 3; ++i){
+		TEST_ASSERT(retention_restore(opt, NULL, file, times[i], restored) == 0);
+		TEST_ASSERT(memcmp_file_file(restored, plain[i]) == 0);
+		remove(restored);
+	}
+	TEST_ASSERT(retention_restore(opt, NULL, "/not/there", times[0], restored) > 0);
+
+	opt->keep_last = 1;
+	opt->keep_daily = 2;
+	TEST_ASSERT(retention_prune(opt) == 0);
+
+	/* the delta was not compacted, and the version it is made against was not deleted */
+	path = version_path(out, file, times[0]);
+	TEST_ASSERT(does_file_exist(path));
+	TEST_ASSERT(rdelta_is_delta(path));
+	free(path);
+	path = version_path(out, file, times[1]);
+	TEST_ASSERT(does_file_exist(path));
+	free(path);
+	path = NULL;
+	TEST_ASSERT(retention_restore(opt, NULL, file, times[0], restored) == 0);
+	TEST_ASSERT(memcmp_file_file(restored, plain[0]) == 0);
+	remove(restored);
+
+	/* once the delta goes, so does what it needed */
+	opt->keep_daily = 1;
+	TEST_ASSERT(retention_prune(opt) == 0);
+	path = version_path(out, file, times[0]);
+	TEST_ASSERT(!does_file_exist(path));
+	free(path);
+	path = version_path(out, file, times[1]);
+	TEST_ASSERT(!does_file_exist(path));
+	free(path);
+	path = NULL;
+
+cleanup:
+	free(path);
+	free(parent);
+	free(data);
+	opt ? options_free(opt) : (void)0;
+	for (i = 0; i < 3; ++i){
+		remove(plain[i]);
+	}
+	remove(restored);
+	cleanup_test_environment(out, NULL);
+}
@@ -0,0 +1,20 @@
+/** @file tests/retention_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __RETENTION_TEST_H
+#define __RETENTION_TEST_H
+
+#include "test_framework.h"
+
+void test_retention_parse_generation(enum TEST_STATUS* status);
+void test_retention_plan(enum TEST_STATUS* status);
+void test_retention_prune(enum TEST_STATUS* status);
+void test_retention_deltas(enum TEST_STATUS* status);
+
+EXPORT_PKG(retention_pkg);
+#endif
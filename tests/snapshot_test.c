@@ -0,0 +1,62 @@
+/** @file tests/snapshot_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "snapshot_test.h"
+#include "../snapshot.h"
+#include "../strings/stringarray.h"
+#include <stdlib.h>
+#include <string.h>
+
+const struct unit_test snapshot_tests[] = {
+	MAKE_TEST(test_snapshot_type),
+	MAKE_TEST(test_snapshot_take_fail)
+};
+MAKE_PKG(snapshot_tests, snapshot_pkg);
+
+void test_snapshot_type(enum TEST_STATUS* status){
+	TEST_ASSERT(snapshot_type_from_string("btrfs") == SNAPSHOT_BTRFS);
+	TEST_ASSERT(snapshot_type_from_string("zfs") == SNAPSHOT_ZFS);
+	TEST_ASSERT(snapshot_type_from_string("none") == SNAPSHOT_NONE);
+	TEST_ASSERT(snapshot_type_from_string("ext4") == SNAPSHOT_INVALID);
+	TEST_ASSERT(strcmp(snapshot_type_tostring(SNAPSHOT_BTRFS), "btrfs") == 0);
+	TEST_ASSERT(strcmp(snapshot_type_tostring(SNAPSHOT_ZFS), "zfs") == 0);
+
+cleanup:
+	;
+}
+
+/* a plain directory is not a subvolume or a dataset, which has to fail without leaving anything behind */
+void test_snapshot_take_fail(enum TEST_STATUS* status){
+	const char* path = "TEST_SNAPSHOT_DIR";
+	const char* state = "TEST_SNAPSHOT_STATE";
+	struct string_array* arr = NULL;
+	struct snapshot_set* ss = NULL;
+	char** files = NULL;
+	size_t files_len = 0;
+
+	setup_test_environment_basic(path, &files, &files_len);
+	arr = sa_new();
+	TEST_ASSERT(arr);
+	TEST_ASSERT(sa_add(arr, path) == 0);
+
+	ss = snapshot_take(SNAPSHOT_BTRFS, arr, "ezbackup-test", state);
+	TEST_ASSERT(ss == NULL);
+	TEST_ASSERT(!does_file_exist("TEST_SNAPSHOT_DIR/" SNAPSHOT_BTRFS_DIR));
+	TEST_ASSERT(!does_file_exist(state));
+
+	ss = snapshot_take(SNAPSHOT_ZFS, arr, "ezbackup-test", state);
+	TEST_ASSERT(ss == NULL);
+	TEST_ASSERT(!does_file_exist(state));
+
+	TEST_ASSERT(snapshot_take(SNAPSHOT_NONE, arr, "ezbackup-test", state) == NULL);
+
+cleanup:
+	snapshot_free(ss);
+	arr ? sa_free(arr) : (void)0;
+	cleanup_test_environment(path, files);
+}
@@ -0,0 +1,18 @@
+/** @file tests/snapshot_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __SNAPSHOT_TEST_H
+#define __SNAPSHOT_TEST_H
+
+#include "test_framework.h"
+
+void test_snapshot_type(enum TEST_STATUS* status);
+void test_snapshot_take_fail(enum TEST_STATUS* status);
+
+EXPORT_PKG(snapshot_pkg);
+#endif
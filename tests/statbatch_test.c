@@ -0,0 +1,90 @@
+/** @file tests/statbatch_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "statbatch_test.h"
+#include "../statbatch.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+const struct unit_test statbatch_tests[] = {
+	MAKE_TEST(test_stat_batch_run),
+	MAKE_TEST(test_stat_batch_full)
+};
+MAKE_PKG(statbatch_tests, statbatch_pkg);
+
+/* whether it goes through io_uring or not, every result has to match lstat() */
+void test_stat_batch_run(enum TEST_STATUS* status){
+	const char* path = "TEST_STATBATCH_DIR";
+	const char* missing = "TEST_STATBATCH_DIR/noexist";
+	struct stat_batch* sb = NULL;
+	char** files = NULL;
+	size_t files_len = 0;
+	size_t i;
+
+	setup_test_environment_basic(path, &files, &files_len);
+	sb = stat_batch_new(0);
+	TEST_ASSERT(sb);
+
+	/* twice, to make sure the batch can be reused */
+	for (i = 0; i < 2; ++i){
+		size_t j;
+
+		for (j = 0; j < files_len; ++j){
+			TEST_ASSERT(stat_batch_add(sb, STAT_BATCH_CWD, files[j]) == (long)j);
+		}
+		TEST_ASSERT(stat_batch_add(sb, STAT_BATCH_CWD, missing) == (long)files_len);
+		TEST_ASSERT(stat_batch_len(sb) == files_len + 1);
+		TEST_ASSERT(stat_batch_run(sb) == 0);
+
+		for (j = 0; j < files_len; ++j){
+			struct stat st_batch;
+			struct stat st_real;
+
+			TEST_ASSERT(lstat(files[j], &st_real) == 0);
+			TEST_ASSERT(stat_batch_result(sb, j, &st_batch) == 0);
+			TEST_ASSERT(st_batch.st_ino == st_real.st_ino);
+			TEST_ASSERT(st_batch.st_dev == st_real.st_dev);
+			TEST_ASSERT(st_batch.st_size == st_real.st_size);
+			TEST_ASSERT(st_batch.st_mode == st_real.st_mode);
+			TEST_ASSERT(st_batch.st_mtime == st_real.st_mtime);
+		}
+		TEST_ASSERT(stat_batch_result(sb, files_len, NULL) == ENOENT);
+		TEST_ASSERT(stat_batch_result(sb, files_len + 1, NULL) == EINVAL);
+		stat_batch_reset(sb);
+		TEST_ASSERT(stat_batch_len(sb) == 0);
+	}
+
+cleanup:
+	stat_batch_free(sb);
+	cleanup_test_environment(path, files);
+}
+
+void test_stat_batch_full(enum TEST_STATUS* status){
+	struct stat_batch* sb = NULL;
+	struct stat st;
+	size_t i;
+
+	sb = stat_batch_new(4);
+	TEST_ASSERT(sb);
+	TEST_ASSERT(stat_batch_depth(sb) == 4);
+
+	for (i = 0; i < 4; ++i){
+		TEST_ASSERT(stat_batch_add(sb, STAT_BATCH_CWD, ".") == (long)i);
+	}
+	TEST_ASSERT(stat_batch_add(sb, STAT_BATCH_CWD, ".") < 0);
+	TEST_ASSERT(stat_batch_run(sb) == 0);
+	for (i = 0; i < 4; ++i){
+		TEST_ASSERT(stat_batch_result(sb, i, &st) == 0);
+		TEST_ASSERT(S_ISDIR(st.st_mode));
+	}
+
+cleanup:
+	stat_batch_free(sb);
+}
@@ -0,0 +1,18 @@
+/** @file tests/statbatch_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __STATBATCH_TEST_H
+#define __STATBATCH_TEST_H
+
+#include "test_framework.h"
+
+void test_stat_batch_run(enum TEST_STATUS* status);
+void test_stat_batch_full(enum TEST_STATUS* status);
+
+EXPORT_PKG(statbatch_pkg);
+#endif
@@ -0,0 +1,194 @@
+/** @file tests/stats_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "stats_test.h"
+#include "../stats.h"
+#include "../pipeline.h"
+#include "../filehelper.h"
+#include "../options/options.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+const struct unit_test stats_tests[] = {
+	MAKE_TEST(test_stats_add),
+	MAKE_TEST(test_stats_pipeline),
+	MAKE_TEST(test_stats_write),
+	MAKE_TEST(test_stats_prometheus)
+};
+MAKE_PKG(stats_tests, stats_pkg);
+
+void test_stats_add(enum TEST_STATUS* status){
+	struct stats_time start;
+	struct stats_time t;
+	struct stats_entry e;
+
+	stats_reset();
+	stats_get(STAGE_HASH, &e);
+	TEST_ASSERT(e.bytes_in == 0 && e.bytes_out == 0 && e.files == 0);
+	TEST_ASSERT(e.time.wall == 0 && e.time.cpu == 0);
+
+	t.wall = 1.5;
+	t.cpu = 0.5;
+	stats_add(STAGE_HASH, &t, 100, 0, 1);
+	stats_add(STAGE_HASH, &t, 200, 0, 2);
+	stats_add(STAGE_HASH, NULL, 1, 0, 0);
+	stats_get(STAGE_HASH, &e);
+	TEST_ASSERT(e.bytes_in == 301 && e.bytes_out == 0 && e.files == 3);
+	TEST_ASSERT(e.time.wall == 3.0 && e.time.cpu == 1.0);
+
+	stats_time_now(&start);
+	stats_record(STAGE_SORT, &start, 5, 5, 1);
+	stats_get(STAGE_SORT, &e);
+	TEST_ASSERT(e.bytes_in == 5 && e.files == 1);
+	TEST_ASSERT(e.time.wall >= 0 && e.time.cpu >= 0);
+
+	/* the other stages are untouched */
+	stats_get(STAGE_UPLOAD, &e);
+	TEST_ASSERT(e.files == 0);
+
+	TEST_ASSERT(strcmp(stats_stage_tostring(STAGE_COMPRESS), "compress") == 0);
+	TEST_ASSERT(stats_stage_tostring(STAGE_COUNT) == NULL);
+
+	stats_reset();
+	stats_get(STAGE_HASH, &e);
+	TEST_ASSERT(e.files == 0);
+
+cleanup:
+	;
+}
+
+void test_stats_pipeline(enum TEST_STATUS* status){
+	const char* file = "file.txt";
+	const char* file_out = "file_out.txt";
+	unsigned char data[1337];
+	struct options* opt = NULL;
+	struct stats_entry e;
+	char* hash = NULL;
+
+	fill_sample_data(data, sizeof(data));
+	create_file(file, data, sizeof(data));
+
+	opt = options_new();
+	TEST_ASSERT(opt);
+	opt->c_type = COMPRESSOR_GZIP;
+	opt->enc_algorithm = EVP_aes_256_cbc();
+
+	stats_reset();
+	TEST_ASSERT(pipeline_backup_file(file, file_out, opt, "hunter2", 0, &hash) == 0);
+
+	stats_get(STAGE_READ, &e);
+	TEST_ASSERT(e.bytes_in == sizeof(data) && e.files == 1);
+	stats_get(STAGE_HASH, &e);
+	TEST_ASSERT(e.bytes_in == sizeof(data) && e.files == 1);
+	stats_get(STAGE_COMPRESS, &e);
+	TEST_ASSERT(e.bytes_in == sizeof(data) && e.files == 1);
+	stats_get(STAGE_ENCRYPT, &e);
+	TEST_ASSERT(e.files == 1);
+	stats_get(STAGE_WRITE, &e);
+	TEST_ASSERT(e.bytes_out == get_file_size(file_out) && e.files == 1);
+
+	/* nothing is encrypted without an encryption algorithm */
+	opt->enc_algorithm = NULL;
+	stats_reset();
+	TEST_ASSERT(pipeline_backup_file(file, file_out, opt, NULL, 0, NULL) == 0);
+	stats_get(STAGE_ENCRYPT, &e);
+	TEST_ASSERT(e.files == 0);
+	stats_get(STAGE_COMPRESS, &e);
+	TEST_ASSERT(e.bytes_out == get_file_size(file_out));
+	stats_get(STAGE_HASH, &e);
+	TEST_ASSERT(e.files == 0);
+
+cleanup:
+	free(hash);
+	opt ? options_free(opt) : (void)0;
+	remove(file);
+	remove(file_out);
+	stats_reset();
+}
+
+void test_stats_write(enum TEST_STATUS* status){
+	const char* file = "stats.tsv";
+	char line[256];
+	FILE* fp = NULL;
+	struct stats_entry e;
+	int n_lines = 0;
+
+	stats_reset();
+	stats_add(STAGE_UPLOAD, NULL, 4096, 4096, 2);
+	TEST_ASSERT(stats_write(file) == 0);
+
+	fp = fopen(file, "r");
+	TEST_ASSERT(fp);
+	TEST_ASSERT(fgets(line, sizeof(line), fp));
+	TEST_ASSERT(strcmp(line, "stage\twall_seconds\tcpu_seconds\tbytes_in\tbytes_out\tfiles\n") == 0);
+	while (fgets(line, sizeof(line), fp)){
+		if (strncmp(line, "upload\t", 7) == 0){
+			TEST_ASSERT(strstr(line, "\t4096\t4096\t2\n"));
+		}
+		n_lines++;
+	}
+	/* one line per stage, and the total */
+	TEST_ASSERT(n_lines == STAGE_COUNT + 1);
+
+	TEST_ASSERT(stats_read(file, STAGE_UPLOAD, &e) == 0);
+	TEST_ASSERT(e.bytes_in == 4096);
+	TEST_ASSERT(e.bytes_out == 4096);
+	TEST_ASSERT(e.files == 2);
+	remove(file);
+	TEST_ASSERT(stats_read(file, STAGE_UPLOAD, &e) > 0);
+
+cleanup:
+	fp ? fclose(fp) : 0;
+	remove(file);
+	stats_reset();
+}
+
+void test_stats_prometheus(enum TEST_STATUS* status){
+	const char* file = "ezbackup.prom";
+	char line[256];
+	FILE* fp = NULL;
+	int found = 0;
+
+	stats_reset();
+	stats_add(STAGE_SCAN, NULL, 0, 0, 10);
+	stats_add(STAGE_UPLOAD, NULL, 4096, 4096, 2);
+	stats_count(COUNTER_FILES_CHANGED, 3);
+	stats_count(COUNTER_FILES_SKIPPED, 6);
+	stats_count(COUNTER_FILES_FAILED, 1);
+	stats_count(COUNTER_CLOUD_RETRIES, 2);
+	TEST_ASSERT(stats_get_count(COUNTER_FILES_SKIPPED) == 6);
+	TEST_ASSERT(stats_write_prometheus(file, 0) == 0);
+
+	fp = fopen(file, "r");
+	TEST_ASSERT(fp);
+	while (fgets(line, sizeof(line), fp)){
+		/* every line is a comment or a metric and its value */
+		TEST_ASSERT_MSG(line[0] == '#' || (strncmp(line, "ezbackup_", 9) == 0 && strchr(line, ' ')), line);
+		found += strcmp(line, "ezbackup_last_run_success 0\n") == 0;
+		found += strcmp(line, "ezbackup_files{result=\"scanned\"} 10\n") == 0;
+		found += strcmp(line, "ezbackup_files{result=\"changed\"} 3\n") == 0;
+		found += strcmp(line, "ezbackup_files{result=\"skipped\"} 6\n") == 0;
+		found += strcmp(line, "ezbackup_files{result=\"failed\"} 1\n") == 0;
+		found += strcmp(line, "ezbackup_cloud_retries 2\n") == 0;
+		found += strcmp(line, "ezbackup_stage_bytes_in{stage=\"upload\"} 4096\n") == 0;
+	}
+	TEST_ASSERT(found == 7);
+	/* the temporary file was renamed into place */
+	TEST_ASSERT(access("ezbackup.prom.tmp", F_OK) != 0);
+
+	/* and a reset clears the counters too */
+	stats_reset();
+	TEST_ASSERT(stats_get_count(COUNTER_FILES_CHANGED) == 0);
+
+cleanup:
+	fp ? fclose(fp) : 0;
+	remove(file);
+	stats_reset();
+}
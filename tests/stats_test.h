@@ -0,0 +1,20 @@
+/** @file tests/stats_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __STATS_TEST_H
+#define __STATS_TEST_H
+
+#include "test_framework.h"
+
+void test_stats_add(enum TEST_STATUS* status);
+void test_stats_pipeline(enum TEST_STATUS* status);
+void test_stats_write(enum TEST_STATUS* status);
+void test_stats_prometheus(enum TEST_STATUS* status);
+
+EXPORT_PKG(stats_pkg);
+#endif
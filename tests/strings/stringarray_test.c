@@ -10,6 +10,7 @@
 #include "../../strings/stringarray.h"
 #include "../../strings/stringhelper.h"
 #include "../../log.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -20,7 +21,9 @@ const struct unit_test stringarray_tests[] = {
 	MAKE_TEST(test_sa_add),
 	MAKE_TEST(test_sa_insert),
 	MAKE_TEST(test_sa_contains),
+	MAKE_TEST(test_sa_index),
 	MAKE_TEST(test_sa_sanitize_directories),
+	MAKE_TEST(test_sa_sanitize_duplicates),
 	MAKE_TEST(test_sa_sort),
 	MAKE_TEST(test_sa_cmp),
 	MAKE_TEST(test_sa_get_parent_dirs),
@@ -82,6 +85,61 @@ cleanup:
 	sa ? sa_free(sa) : (void)0;
 }
 
+void test_sa_index(enum TEST_STATUS* status){
+	struct string_array* sa = NULL;
+	struct string_array* sa2 = NULL;
+	char buf[32];
+	size_t i;
+
+	sa = sa_new();
+	TEST_ASSERT(sa);
+	TEST_ASSERT(sa_add(sa, "first") == 0);
+	TEST_ASSERT(sa_index(sa) == 0);
+
+	/* enough to grow the array and the index several times */
+	for (i = 0; i < 5000; ++i){
+		sprintf(buf, "string %lu", (unsigned long)i);
+		TEST_ASSERT(sa_add(sa, buf) == 0);
+	}
+	TEST_ASSERT(sa->len == 5001);
+	TEST_ASSERT(sa->size >= sa->len);
+	TEST_ASSERT(sa_contains(sa, "first"));
+	TEST_ASSERT(sa_contains(sa, "string 0"));
+	TEST_ASSERT(sa_contains(sa, "string 4999"));
+	TEST_ASSERT(!sa_contains(sa, "string 5000"));
+
+	/* the index follows anything that moves strings around */
+	TEST_ASSERT(sa_remove(sa, 0) == 0);
+	TEST_ASSERT(!sa_contains(sa, "first"));
+	TEST_ASSERT(sa_insert(sa, "inserted", 10) == 0);
+	TEST_ASSERT(sa_contains(sa, "inserted"));
+	TEST_ASSERT(strcmp(sa->strings[10], "inserted") == 0);
+	sa_sort(sa);
+	TEST_ASSERT(sa_contains(sa, "inserted"));
+	TEST_ASSERT(sa_contains(sa, "string 1234"));
+
+	sa2 = sa_new();
+	TEST_ASSERT(sa2);
+	TEST_ASSERT(sa_add(sa2, "merged") == 0);
+	TEST_ASSERT(sa_merge(sa, sa2) == 0);
+	sa2 = NULL;
+	TEST_ASSERT(sa_contains(sa, "merged"));
+
+	/* and a direct change to the length */
+	free(sa->strings[sa->len - 1]);
+	sa->len--;
+	TEST_ASSERT(!sa_contains(sa, "merged"));
+
+	sa_reset(sa);
+	TEST_ASSERT(!sa_contains(sa, "inserted"));
+	TEST_ASSERT(sa_add(sa, "again") == 0);
+	TEST_ASSERT(sa_contains(sa, "again"));
+
+cleanup:
+	sa ? sa_free(sa) : (void)0;
+	sa2 ? sa_free(sa2) : (void)0;
+}
+
 void test_sa_sanitize_directories(enum TEST_STATUS* status){
 	struct string_array* sa = NULL;
 	char* cwd = NULL;
@@ -122,6 +180,29 @@ cleanup:
 	sa ? sa_free(sa) : (void)0;
 }
 
+void test_sa_sanitize_duplicates(enum TEST_STATUS* status){
+	struct string_array* sa = NULL;
+
+	sa = sa_new();
+	TEST_ASSERT(sa);
+
+	TEST_ASSERT(sa_add(sa, "/tmp") == 0);
+	TEST_ASSERT(sa_add(sa, "/dev/") == 0);
+	TEST_ASSERT(sa_add(sa, "/home/equifax/passwords.txt") == 0);
+	TEST_ASSERT(sa_add(sa, "/tmp/") == 0);
+	TEST_ASSERT(sa_add(sa, "/dev") == 0);
+	TEST_ASSERT(sa_add(sa, "/tmp") == 0);
+
+	/* every copy after the first is removed, and the rest keep their order */
+	TEST_ASSERT(sa_sanitize_directories(sa) == 4);
+	TEST_ASSERT(sa->len == 2);
+	TEST_ASSERT(strcmp(sa->strings[0], "/tmp/") == 0);
+	TEST_ASSERT(strcmp(sa->strings[1], "/dev/") == 0);
+
+cleanup:
+	sa ? sa_free(sa) : (void)0;
+}
+
 void test_sa_sort(enum TEST_STATUS* status){
 	struct string_array* sa = NULL;
 
@@ -22,7 +22,8 @@ const struct unit_test stringhelper_tests[] = {
 	MAKE_TEST(test_sh_starts_with),
 	MAKE_TEST(test_sh_getcwd),
 	MAKE_TEST(test_sh_cmp_nullsafe),
-	MAKE_TEST(test_sh_sprintf)
+	MAKE_TEST(test_sh_sprintf),
+	MAKE_TEST(test_pb_path)
 };
 MAKE_PKG(stringhelper_tests, stringhelper_pkg);
 
@@ -185,3 +186,56 @@ void test_sh_sprintf(enum TEST_STATUS* status){
 cleanup:
 	free(buf);
 }
+
+void test_pb_path(enum TEST_STATUS* status){
+	struct path_builder pb = PB_INIT;
+	struct path_builder parent = PB_INIT;
+	char* buf;
+	size_t i;
+
+	TEST_ASSERT(pb_append_path(&pb, "files") != 0);
+
+	TEST_ASSERT(pb_set(&pb, "/home/equifax") == 0);
+	TEST_ASSERT(pb_append_path(&pb, "/files") == 0);
+	TEST_ASSERT(strcmp(pb.str, "/home/equifax/files") == 0);
+	TEST_ASSERT(pb_append_path(&pb, "/passwords.txt") == 0);
+	TEST_ASSERT(pb_append(&pb, ".bak") == 0);
+	TEST_ASSERT(strcmp(pb.str, "/home/equifax/files/passwords.txt.bak") == 0);
+	TEST_ASSERT(pb.len == strlen(pb.str));
+
+	/* matches sh_concat_path() when there is already a trailing slash */
+	TEST_ASSERT(pb_set(&pb, "/") == 0);
+	TEST_ASSERT(pb_append_path(&pb, "/etc") == 0);
+	TEST_ASSERT(strcmp(pb.str, "/etc") == 0);
+
+	/* matches sh_parent_dir() */
+	TEST_ASSERT(pb_set_parent(&parent, "/home/equifax/passwords.txt") == 0);
+	TEST_ASSERT(strcmp(parent.str, "/home/equifax") == 0);
+	TEST_ASSERT(pb_set_parent(&parent, "/home") == 0);
+	TEST_ASSERT(strcmp(parent.str, "") == 0);
+	TEST_ASSERT(pb_set_parent(&parent, "home") != 0);
+
+	/* a long path grows the buffer, and a short one reuses it */
+	buf = malloc(1000);
+	TEST_ASSERT(buf);
+	for (i = 0; i < 999; ++i){
+		buf[i] = 'a';
+	}
+	buf[999] = '\0';
+	TEST_ASSERT(pb_set(&pb, buf) == 0);
+	TEST_ASSERT(pb.size > 999 && pb.len == 999);
+	i = pb.size;
+	TEST_ASSERT(pb_set(&pb, "/tmp") == 0);
+	TEST_ASSERT(pb.size == i);
+	TEST_ASSERT(strcmp(pb.str, "/tmp") == 0);
+
+	/* the builder's own string can be used as the input */
+	TEST_ASSERT(pb_set(&pb, "/a/b/c") == 0);
+	TEST_ASSERT(pb_set_parent(&pb, pb.str) == 0);
+	TEST_ASSERT(strcmp(pb.str, "/a/b") == 0);
+
+cleanup:
+	free(buf);
+	pb_free(&pb);
+	pb_free(&parent);
+}
@@ -20,6 +20,7 @@ void test_sh_starts_with(enum TEST_STATUS* status);
 void test_sh_getcwd(enum TEST_STATUS* status);
 void test_sh_cmp_nullsafe(enum TEST_STATUS* status);
 void test_sh_sprintf(enum TEST_STATUS* status);
+void test_pb_path(enum TEST_STATUS* status);
 
 EXPORT_PKG(stringhelper_pkg);
 #endif
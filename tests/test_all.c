@@ -13,13 +13,45 @@
 #include "coredumps_test.h"
 #include "filehelper_test.h"
 #include "fileiterator_test.h"
+#include "exclude_test.h"
+#include "changejournal_test.h"
+#include "snapshot_test.h"
+#include "statbatch_test.h"
+#include "uring_test.h"
 #include "log_test.h"
 #include "progressbar_test.h"
+#include "threadpool_test.h"
+#include "blockring_test.h"
+#include "pipeline_test.h"
+#include "chunkstore_test.h"
+#include "pack_test.h"
+#include "retention_test.h"
+#include "manifest_test.h"
+#include "catalog_test.h"
+#include "membudget_test.h"
+#include "daemon_test.h"
+#include "stats_test.h"
+#include "trace_test.h"
+#include "fasthash_test.h"
+#include "treehash_test.h"
+#include "xattrcache_test.h"
+#include "hashbench_test.h"
+#include "zipauto_test.h"
+#include "moveindex_test.h"
+#include "rdelta_test.h"
+#include "devsched_test.h"
+#include "pressure_test.h"
+#include "estimate_test.h"
+#include "policy_test.h"
 #include "cloud/base_test.h"
 #include "cloud/cloud_options_test.h"
+#include "cloud/pathcache_test.h"
+#include "cloud/ratelimit_test.h"
+#include "cloud/s3sign_test.h"
 #include "compression/zip_test.h"
 #include "crypt/crypt_test.h"
 #include "crypt/crypt_easy_test.h"
+#include "crypt/crypt_session_test.h"
 #include "crypt/crypt_getpassword_test.h"
 #include "options/options_test.h"
 #include "options/options_file_test.h"
@@ -50,13 +82,45 @@ void register_all_packages(const struct test_pkg*** pkg_arr, size_t* pkgs_len){
 	register_package(&coredumps_pkg, pkg_arr, pkgs_len);
 	register_package(&filehelper_pkg, pkg_arr, pkgs_len);
 	register_package(&fileiterator_pkg, pkg_arr, pkgs_len);
+	register_package(&exclude_pkg, pkg_arr, pkgs_len);
+	register_package(&changejournal_pkg, pkg_arr, pkgs_len);
+	register_package(&snapshot_pkg, pkg_arr, pkgs_len);
+	register_package(&statbatch_pkg, pkg_arr, pkgs_len);
+	register_package(&uring_pkg, pkg_arr, pkgs_len);
 	register_package(&log_pkg, pkg_arr, pkgs_len);
 	register_package(&progressbar_pkg, pkg_arr, pkgs_len);
+	register_package(&threadpool_pkg, pkg_arr, pkgs_len);
+	register_package(&blockring_pkg, pkg_arr, pkgs_len);
+	register_package(&pipeline_pkg, pkg_arr, pkgs_len);
+	register_package(&chunkstore_pkg, pkg_arr, pkgs_len);
+	register_package(&pack_pkg, pkg_arr, pkgs_len);
+	register_package(&retention_pkg, pkg_arr, pkgs_len);
+	register_package(&manifest_pkg, pkg_arr, pkgs_len);
+	register_package(&catalog_pkg, pkg_arr, pkgs_len);
+	register_package(&membudget_pkg, pkg_arr, pkgs_len);
+	register_package(&daemon_pkg, pkg_arr, pkgs_len);
+	register_package(&stats_pkg, pkg_arr, pkgs_len);
+	register_package(&trace_pkg, pkg_arr, pkgs_len);
+	register_package(&fasthash_pkg, pkg_arr, pkgs_len);
+	register_package(&treehash_pkg, pkg_arr, pkgs_len);
+	register_package(&xattrcache_pkg, pkg_arr, pkgs_len);
+	register_package(&hashbench_pkg, pkg_arr, pkgs_len);
+	register_package(&zipauto_pkg, pkg_arr, pkgs_len);
+	register_package(&moveindex_pkg, pkg_arr, pkgs_len);
+	register_package(&rdelta_pkg, pkg_arr, pkgs_len);
+	register_package(&devsched_pkg, pkg_arr, pkgs_len);
+	register_package(&pressure_pkg, pkg_arr, pkgs_len);
+	register_package(&estimate_pkg, pkg_arr, pkgs_len);
+	register_package(&policy_pkg, pkg_arr, pkgs_len);
 	register_package(&cloud_base_pkg, pkg_arr, pkgs_len);
 	register_package(&cloud_options_pkg, pkg_arr, pkgs_len);
+	register_package(&cloud_pathcache_pkg, pkg_arr, pkgs_len);
+	register_package(&cloud_ratelimit_pkg, pkg_arr, pkgs_len);
+	register_package(&cloud_s3sign_pkg, pkg_arr, pkgs_len);
 	register_package(&compression_zip_pkg, pkg_arr, pkgs_len);
 	register_package(&crypt_pkg, pkg_arr, pkgs_len);
 	register_package(&crypt_easy_pkg, pkg_arr, pkgs_len);
+	register_package(&crypt_session_pkg, pkg_arr, pkgs_len);
 	register_package(&crypt_getpassword_pkg, pkg_arr, pkgs_len);
 	register_package(&options_pkg, pkg_arr, pkgs_len);
 	register_package(&options_file_pkg, pkg_arr, pkgs_len);
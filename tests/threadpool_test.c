@@ -0,0 +1,155 @@
+/** @file tests/threadpool_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "threadpool_test.h"
+#include "../threadpool.h"
+#include <pthread.h>
+
+const struct unit_test threadpool_tests[] = {
+	MAKE_TEST(test_tp_submit),
+	MAKE_TEST(test_tp_full_queue),
+	MAKE_TEST(test_tp_try_submit)
+};
+MAKE_PKG(threadpool_tests, threadpool_pkg);
+
+struct counter{
+	pthread_mutex_t mutex;
+	int count;
+};
+
+static void inc_counter(void* arg){
+	struct counter* c = arg;
+	pthread_mutex_lock(&c->mutex);
+	c->count++;
+	pthread_mutex_unlock(&c->mutex);
+}
+
+void test_tp_submit(enum TEST_STATUS* status){
+	struct threadpool* tp = NULL;
+	struct counter c;
+	int i;
+
+	pthread_mutex_init(&c.mutex, NULL);
+	c.count = 0;
+
+	tp = tp_new(4, 0);
+	TEST_ASSERT(tp);
+	TEST_ASSERT(tp_threads(tp) == 4);
+
+	for (i = 0; i < 1000; ++i){
+		TEST_ASSERT(tp_submit(tp, inc_counter, &c) == 0);
+	}
+	TEST_ASSERT(tp_wait(tp) == 0);
+	TEST_ASSERT(c.count == 1000);
+
+	/* the pool should still be usable after waiting */
+	TEST_ASSERT(tp_submit(tp, inc_counter, &c) == 0);
+	TEST_ASSERT(tp_wait(tp) == 0);
+	TEST_ASSERT(c.count == 1001);
+
+cleanup:
+	tp_free(tp);
+	pthread_mutex_destroy(&c.mutex);
+}
+
+void test_tp_full_queue(enum TEST_STATUS* status){
+	struct threadpool* tp = NULL;
+	struct counter c;
+	int i;
+
+	pthread_mutex_init(&c.mutex, NULL);
+	c.count = 0;
+
+	/* a single slot forces tp_submit() to block on almost every call */
+	tp = tp_new(2, 1);
+	TEST_ASSERT(tp);
+
+	for (i = 0; i < 200; ++i){
+		TEST_ASSERT(tp_submit(tp, inc_counter, &c) == 0);
+	}
+
+	/* tp_free() must finish everything that is still queued */
+	tp_free(tp);
+	tp = NULL;
+	TEST_ASSERT(c.count == 200);
+
+cleanup:
+	tp_free(tp);
+	pthread_mutex_destroy(&c.mutex);
+}
+
+struct gate{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int open;
+	int entered;
+};
+
+/* holds its worker until the gate is opened */
+static void wait_gate(void* arg){
+	struct gate* g = arg;
+	pthread_mutex_lock(&g->mutex);
+	g->entered = 1;
+	pthread_cond_broadcast(&g->cond);
+	while (!g->open){
+		pthread_cond_wait(&g->cond, &g->mutex);
+	}
+	pthread_mutex_unlock(&g->mutex);
+}
+
+void test_tp_try_submit(enum TEST_STATUS* status){
+	struct threadpool* tp = NULL;
+	struct counter c;
+	struct gate g;
+
+	pthread_mutex_init(&c.mutex, NULL);
+	c.count = 0;
+	pthread_mutex_init(&g.mutex, NULL);
+	pthread_cond_init(&g.cond, NULL);
+	g.open = 0;
+	g.entered = 0;
+
+	tp = tp_new(1, 2);
+	TEST_ASSERT(tp);
+
+	/* the only worker is busy, so the queue fills up */
+	TEST_ASSERT(tp_submit(tp, wait_gate, &g) == 0);
+	pthread_mutex_lock(&g.mutex);
+	while (!g.entered){
+		pthread_cond_wait(&g.cond, &g.mutex);
+	}
+	pthread_mutex_unlock(&g.mutex);
+
+	TEST_ASSERT(tp_try_submit(tp, inc_counter, &c) == 0);
+	TEST_ASSERT(tp_try_submit(tp, inc_counter, &c) == 0);
+	TEST_ASSERT(tp_try_submit(tp, inc_counter, &c) > 0);
+
+	pthread_mutex_lock(&g.mutex);
+	g.open = 1;
+	pthread_cond_broadcast(&g.cond);
+	pthread_mutex_unlock(&g.mutex);
+
+	TEST_ASSERT(tp_wait(tp) == 0);
+	TEST_ASSERT(c.count == 2);
+
+	/* there is room again once the queue drains */
+	TEST_ASSERT(tp_try_submit(tp, inc_counter, &c) == 0);
+	TEST_ASSERT(tp_wait(tp) == 0);
+	TEST_ASSERT(c.count == 3);
+
+cleanup:
+	/* a failed assert must not leave the worker stuck behind the gate */
+	pthread_mutex_lock(&g.mutex);
+	g.open = 1;
+	pthread_cond_broadcast(&g.cond);
+	pthread_mutex_unlock(&g.mutex);
+	tp_free(tp);
+	pthread_mutex_destroy(&c.mutex);
+	pthread_mutex_destroy(&g.mutex);
+	pthread_cond_destroy(&g.cond);
+}
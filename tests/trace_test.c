@@ -0,0 +1,142 @@
+/** @file tests/trace_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "trace_test.h"
+#include "../trace.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const struct unit_test trace_tests[] = {
+	MAKE_TEST(test_trace_spans),
+	MAKE_TEST(test_trace_threads)
+};
+MAKE_PKG(trace_tests, trace_pkg);
+
+static char* read_all(const char* file){
+	FILE* fp;
+	char* ret;
+	long len;
+
+	if (!(fp = fopen(file, "rb"))){
+		return NULL;
+	}
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	rewind(fp);
+	ret = calloc(len + 1, 1);
+	if (ret && fread(ret, 1, len, fp) != (size_t)len){
+		free(ret);
+		ret = NULL;
+	}
+	fclose(fp);
+	return ret;
+}
+
+static size_t count(const char* haystack, const char* needle){
+	size_t n = 0;
+
+	while ((haystack = strstr(haystack, needle)) != NULL){
+		n++;
+		haystack++;
+	}
+	return n;
+}
+
+void test_trace_spans(enum TEST_STATUS* status){
+	const char* file = "trace.json";
+	struct stats_time start;
+	struct stats_time total = { 0, 0 };
+	struct stats_time mark;
+	char* out = NULL;
+
+	/* nothing is recorded before the trace starts */
+	stats_time_now(&start);
+	trace_since("before", &start, NULL);
+
+	trace_start();
+	stats_time_now(&start);
+	mark = start;
+	trace_lap(STAGE_READ, &total, &mark);
+	TEST_ASSERT(total.wall >= 0 && total.wall == mark.wall - start.wall);
+	trace_since("file", &start, "dir/\"quoted\"\\name\n");
+	TEST_ASSERT(trace_stop(file) == 0);
+
+	/* or after it stops */
+	trace_since("after", &start, NULL);
+
+	out = read_all(file);
+	TEST_ASSERT(out);
+	TEST_ASSERT(strncmp(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", strlen("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[")) == 0);
+	TEST_ASSERT(strcmp(out + strlen(out) - 4, "\n]}\n") == 0);
+	TEST_ASSERT(count(out, "\"ph\":\"X\"") == 2);
+	TEST_ASSERT(count(out, "\"ph\":\"M\"") == 1);
+	TEST_ASSERT(strstr(out, "{\"name\":\"read\",\"cat\":\"ezbackup\",\"ph\":\"X\",\"ts\":"));
+	TEST_ASSERT(strstr(out, "\"args\":{\"file\":\"dir/\\\"quoted\\\"\\\\name\\u000a\"}}"));
+	TEST_ASSERT(!strstr(out, "before") && !strstr(out, "after"));
+	free(out);
+	out = NULL;
+
+	/* a new trace starts empty */
+	trace_start();
+	TEST_ASSERT(trace_stop(file) == 0);
+	out = read_all(file);
+	TEST_ASSERT(out);
+	TEST_ASSERT(strcmp(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n]}\n") == 0);
+
+cleanup:
+	trace_stop(NULL);
+	free(out);
+	remove(file);
+}
+
+#define TRACE_TEST_THREADS (8)
+#define TRACE_TEST_SPANS (1000)
+
+static void* record_spans(void* arg){
+	struct stats_time start;
+	int i;
+
+	(void)arg;
+	for (i = 0; i < TRACE_TEST_SPANS; ++i){
+		stats_time_now(&start);
+		trace_since("span", &start, NULL);
+	}
+	return NULL;
+}
+
+void test_trace_threads(enum TEST_STATUS* status){
+	const char* file = "trace.json";
+	pthread_t thrds[TRACE_TEST_THREADS];
+	size_t started;
+	char* out = NULL;
+
+	trace_start();
+	for (started = 0; started < TRACE_TEST_THREADS; ++started){
+		TEST_ASSERT(pthread_create(&thrds[started], NULL, record_spans, NULL) == 0);
+	}
+	for (; started > 0; --started){
+		pthread_join(thrds[started - 1], NULL);
+	}
+	TEST_ASSERT(trace_stop(file) == 0);
+
+	/* every span is kept, and each thread is named once */
+	out = read_all(file);
+	TEST_ASSERT(out);
+	TEST_ASSERT(count(out, "{\"name\":\"span\"") == TRACE_TEST_THREADS * TRACE_TEST_SPANS);
+	TEST_ASSERT(count(out, "\"ph\":\"M\"") == TRACE_TEST_THREADS);
+
+cleanup:
+	for (; started > 0; --started){
+		pthread_join(thrds[started - 1], NULL);
+	}
+	trace_stop(NULL);
+	free(out);
+	remove(file);
+}
@@ -0,0 +1,18 @@
+/** @file tests/trace_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __TRACE_TEST_H
+#define __TRACE_TEST_H
+
+#include "test_framework.h"
+
+void test_trace_spans(enum TEST_STATUS* status);
+void test_trace_threads(enum TEST_STATUS* status);
+
+EXPORT_PKG(trace_pkg);
+#endif
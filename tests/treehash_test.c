@@ -0,0 +1,262 @@
+/** @file tests/treehash_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "treehash_test.h"
+#include "../treehash.h"
+#include "../checksum.h"
+#include "../filehelper.h"
+#include "../crypt/base16.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const struct unit_test treehash_tests[] = {
+	MAKE_TEST(test_tree_hash_small),
+	MAKE_TEST(test_tree_hash_segments),
+	MAKE_TEST(test_tree_hash_file),
+	MAKE_TEST(test_tree_hash_zeros)
+};
+MAKE_PKG(treehash_tests, treehash_pkg);
+
+/* small enough that a file of a few segments is quick to make, but still a whole number of filesystem blocks, so a sparse file can have a segment-sized hole */
+#define SEGMENT_LEN ((size_t)1 << 16)
+
+/* feeds data to a tree hash in pieces of piece_len bytes */
+static int stream_hash(const void* data, size_t len, int tree, size_t piece_len, char** out){
+	const unsigned char* p = data;
+	struct tree_hash* th;
+	size_t pos;
+
+	*out = NULL;
+	th = tree_hash_new(EVP_sha1(), tree ? SEGMENT_LEN : 0);
+	if (!th){
+		return -1;
+	}
+	for (pos = 0; pos < len; pos += piece_len){
+		if (tree_hash_update(th, p + pos, len - pos < piece_len ? len - pos : piece_len) != 0){
+			tree_hash_free(th);
+			return -1;
+		}
+	}
+	if (tree_hash_final(th, out) != 0){
+		tree_hash_free(th);
+		return -1;
+	}
+	tree_hash_free(th);
+	return 0;
+}
+
+static int plain_hash(const void* data, size_t len, char** out){
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned digest_len;
+
+	*out = NULL;
+	if (EVP_Digest(data, len, digest, &digest_len, EVP_sha1(), NULL) != 1){
+		return -1;
+	}
+	return to_base16(digest, digest_len, out);
+}
+
+void test_tree_hash_small(enum TEST_STATUS* status){
+	unsigned char data[SEGMENT_LEN];
+	char* plain = NULL;
+	char* tree = NULL;
+	char* flat = NULL;
+
+	fill_sample_data(data, sizeof(data));
+	TEST_ASSERT(plain_hash(data, sizeof(data), &plain) == 0);
+
+	/* one whole segment is hashed like any other file */
+	TEST_ASSERT(stream_hash(data, sizeof(data), 1, 1000, &tree) == 0);
+	TEST_ASSERT(stream_hash(data, sizeof(data), 0, 1000, &flat) == 0);
+	TEST_ASSERT(strcmp(tree, plain) == 0);
+	TEST_ASSERT(strcmp(flat, plain) == 0);
+
+cleanup:
+	free(plain);
+	free(tree);
+	free(flat);
+}
+
+void test_tree_hash_segments(enum TEST_STATUS* status){
+	const size_t len = SEGMENT_LEN * 3 + 1337;
+	unsigned char* data = NULL;
+	unsigned char segments[4 * EVP_MAX_MD_SIZE];
+	unsigned segments_len = 0;
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned digest_len;
+	char* hex = NULL;
+	char* expected = NULL;
+	char* plain = NULL;
+	char* hash = NULL;
+	size_t piece_lens[] = { 1, 999, SEGMENT_LEN, SEGMENT_LEN * 4 };
+	size_t i;
+
+	data = malloc(len);
+	TEST_ASSERT(data);
+	fill_sample_data(data, len);
+
+	/* digest of the four segment digests back to back */
+	for (i = 0; i < 4; ++i){
+		size_t seg_len = i < 3 ? SEGMENT_LEN : 1337;
+		TEST_ASSERT(EVP_Digest(data + i * SEGMENT_LEN, seg_len, segments + segments_len, &digest_len, EVP_sha1(), NULL) == 1);
+		segments_len += digest_len;
+	}
+	TEST_ASSERT(EVP_Digest(segments, segments_len, digest, &digest_len, EVP_sha1(), NULL) == 1);
+	TEST_ASSERT(to_base16(digest, digest_len, &hex) == 0);
+	expected = malloc(strlen(TREE_HASH_PREFIX) + strlen(hex) + 1);
+	TEST_ASSERT(expected);
+	strcpy(expected, TREE_HASH_PREFIX);
+	strcat(expected, hex);
+
+	for (i = 0; i < sizeof(piece_lens) / sizeof(piece_lens[0]); ++i){
+		TEST_ASSERT(stream_hash(data, len, 1, piece_lens[i], &hash) == 0);
+		TEST_ASSERT(strcmp(hash, expected) == 0);
+		free(hash);
+		hash = NULL;
+	}
+
+	/* without tree mode, the same data gets its plain digest */
+	TEST_ASSERT(plain_hash(data, len, &plain) == 0);
+	TEST_ASSERT(stream_hash(data, len, 0, 999, &hash) == 0);
+	TEST_ASSERT(strcmp(hash, plain) == 0);
+
+cleanup:
+	free(data);
+	free(hex);
+	free(expected);
+	free(plain);
+	free(hash);
+}
+
+void test_tree_hash_file(enum TEST_STATUS* status){
+	const char* file = "file.txt";
+	/* exactly on a segment boundary, so the last segment is a full one */
+	const size_t len = SEGMENT_LEN * 5;
+	unsigned char* data = NULL;
+	char* expected = NULL;
+	char* plain = NULL;
+	char* hash = NULL;
+	unsigned n_threads;
+
+	data = malloc(len);
+	TEST_ASSERT(data);
+	fill_sample_data(data, len);
+	create_file(file, data, len);
+
+	TEST_ASSERT(stream_hash(data, len, 1, 1000, &expected) == 0);
+	TEST_ASSERT(strncmp(expected, TREE_HASH_PREFIX, strlen(TREE_HASH_PREFIX)) == 0);
+
+	for (n_threads = 0; n_threads <= 8; n_threads += 4){
+		TEST_ASSERT(tree_hash_file(file, EVP_sha1(), SEGMENT_LEN, n_threads, &hash) == 0);
+		TEST_ASSERT(strcmp(hash, expected) == 0);
+		free(hash);
+		hash = NULL;
+	}
+	TEST_ASSERT(tree_hash_file(file, EVP_sha1(), SEGMENT_LEN, 1, &hash) == 0);
+	TEST_ASSERT(strcmp(hash, expected) == 0);
+	free(hash);
+	hash = NULL;
+
+	/* plain mode has to match checksum_bytestring() exactly */
+	TEST_ASSERT(checksum_bytestring(file, EVP_sha1(), &plain) == 0);
+	TEST_ASSERT(tree_hash_file(file, EVP_sha1(), 0, 4, &hash) == 0);
+	TEST_ASSERT(strcmp(hash, plain) == 0);
+	free(hash);
+	hash = NULL;
+
+	TEST_ASSERT(tree_hash_file("noexist.txt", EVP_sha1(), SEGMENT_LEN, 4, &hash) != 0);
+	TEST_ASSERT(hash == NULL);
+
+cleanup:
+	free(data);
+	free(expected);
+	free(plain);
+	free(hash);
+	remove(file);
+}
+
+/* passes the zeros in data through tree_hash_update_zeros() and the rest through tree_hash_update() */
+static int stream_hash_zeros(const unsigned char* data, size_t len, int tree, char** out){
+	struct tree_hash* th;
+	size_t pos = 0;
+
+	*out = NULL;
+	th = tree_hash_new(EVP_sha1(), tree ? SEGMENT_LEN : 0);
+	if (!th){
+		return -1;
+	}
+	while (pos < len){
+		size_t n = 1;
+		int zero = data[pos] == 0;
+
+		while (pos + n < len && (data[pos + n] == 0) == zero){
+			n++;
+		}
+		if ((zero ? tree_hash_update_zeros(th, n) : tree_hash_update(th, data + pos, n)) != 0){
+			tree_hash_free(th);
+			return -1;
+		}
+		pos += n;
+	}
+	if (tree_hash_final(th, out) != 0){
+		tree_hash_free(th);
+		return -1;
+	}
+	tree_hash_free(th);
+	return 0;
+}
+
+void test_tree_hash_zeros(enum TEST_STATUS* status){
+	const char* file = "file.txt";
+	/* whole segments of zeros, zeros that end and start segments, and zeros at the end */
+	const size_t len = SEGMENT_LEN * 6 + 100;
+	unsigned char* data = NULL;
+	char* expected = NULL;
+	char* hash = NULL;
+	FILE* fp = NULL;
+	int tree;
+
+	data = calloc(len, 1);
+	TEST_ASSERT(data);
+	fill_sample_data(data + SEGMENT_LEN * 2 - 50, 100);
+	fill_sample_data(data + SEGMENT_LEN * 4, 10);
+
+	for (tree = 0; tree < 2; ++tree){
+		TEST_ASSERT(stream_hash(data, len, tree, 999, &expected) == 0);
+		TEST_ASSERT(stream_hash_zeros(data, len, tree, &hash) == 0);
+		TEST_ASSERT(strcmp(hash, expected) == 0);
+		free(expected);
+		free(hash);
+		expected = hash = NULL;
+	}
+
+	/* one segment of nothing but zeros is its plain digest */
+	TEST_ASSERT(stream_hash(data, SEGMENT_LEN, 1, 999, &expected) == 0);
+	TEST_ASSERT(stream_hash_zeros(data, SEGMENT_LEN, 1, &hash) == 0);
+	TEST_ASSERT(strcmp(hash, expected) == 0);
+	free(expected);
+	free(hash);
+	expected = hash = NULL;
+
+	/* the same data as a sparse file, whose holes are never read */
+	TEST_ASSERT(stream_hash(data, len, 1, 999, &expected) == 0);
+	TEST_ASSERT((fp = fopen(file, "wb")) != NULL);
+	TEST_ASSERT(write_sparse(fp, data, len) == 0);
+	TEST_ASSERT(finish_sparse(fp) == 0);
+	TEST_FREE(fp, fclose);
+	TEST_ASSERT(tree_hash_file(file, EVP_sha1(), SEGMENT_LEN, 4, &hash) == 0);
+	TEST_ASSERT(strcmp(hash, expected) == 0);
+
+cleanup:
+	fp ? fclose(fp) : 0;
+	free(data);
+	free(expected);
+	free(hash);
+	remove(file);
+}
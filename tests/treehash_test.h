@@ -0,0 +1,20 @@
+/** @file tests/treehash_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __TREEHASH_TEST_H
+#define __TREEHASH_TEST_H
+
+#include "test_framework.h"
+
+void test_tree_hash_small(enum TEST_STATUS* status);
+void test_tree_hash_segments(enum TEST_STATUS* status);
+void test_tree_hash_file(enum TEST_STATUS* status);
+void test_tree_hash_zeros(enum TEST_STATUS* status);
+
+EXPORT_PKG(treehash_pkg);
+#endif
@@ -0,0 +1,112 @@
+/** @file tests/uring_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "uring_test.h"
+#include "../uring.h"
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+const struct unit_test uring_tests[] = {
+	MAKE_TEST(test_uring_nop),
+	MAKE_TEST(test_uring_read_fixed)
+};
+MAKE_PKG(uring_tests, uring_pkg);
+
+/* a kernel or sandbox without io_uring passes these, since everything that uses it falls back */
+void test_uring_nop(enum TEST_STATUS* status){
+#ifdef HAVE_URING
+	struct uring* ring = NULL;
+	const struct io_uring_cqe* cqe;
+	struct io_uring_sqe* sqe;
+	int seen[4];
+	unsigned i;
+
+	if (!(ring = uring_new(4))){
+		goto cleanup;
+	}
+	TEST_ASSERT(uring_cq_entries(ring) >= 4);
+
+	/* the submission ring holds exactly 4 */
+	for (i = 0; i < 4; ++i){
+		TEST_ASSERT((sqe = uring_get_sqe(ring)) != NULL);
+		sqe->opcode = IORING_OP_NOP;
+		sqe->user_data = i;
+		seen[i] = 0;
+	}
+	TEST_ASSERT(uring_get_sqe(ring) == NULL);
+	TEST_ASSERT(uring_enter(ring, 4) == 0);
+
+	for (i = 0; i < 4; ++i){
+		TEST_ASSERT((cqe = uring_peek(ring)) != NULL);
+		TEST_ASSERT(cqe->res == 0);
+		TEST_ASSERT(cqe->user_data < 4);
+		seen[cqe->user_data]++;
+		uring_seen(ring);
+	}
+	TEST_ASSERT(uring_peek(ring) == NULL);
+	for (i = 0; i < 4; ++i){
+		TEST_ASSERT(seen[i] == 1);
+	}
+
+	/* there is room again once they were submitted */
+	TEST_ASSERT(uring_get_sqe(ring) != NULL);
+
+cleanup:
+	uring_free(ring);
+#else
+	(void)status;
+#endif
+}
+
+void test_uring_read_fixed(enum TEST_STATUS* status){
+#ifdef HAVE_URING
+	const char* sample_file = "file1.txt";
+	const char sample_data[] = "the quick brown fox jumps over the lazy dog";
+	struct uring* ring = NULL;
+	const struct io_uring_cqe* cqe;
+	struct io_uring_sqe* sqe;
+	char buf[64];
+	struct iovec iov;
+	int fd = -1;
+
+	create_file(sample_file, sample_data, sizeof(sample_data) - 1);
+	if (!(ring = uring_new(2))){
+		goto cleanup;
+	}
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf);
+	/* RLIMIT_MEMLOCK is allowed to refuse this */
+	if (uring_register_buffers(ring, &iov, 1) != 0){
+		goto cleanup;
+	}
+
+	fd = open(sample_file, O_RDONLY);
+	TEST_ASSERT(fd >= 0);
+	TEST_ASSERT((sqe = uring_get_sqe(ring)) != NULL);
+	sqe->opcode = IORING_OP_READ_FIXED;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = sizeof(buf);
+	sqe->off = 4;
+	sqe->buf_index = 0;
+	TEST_ASSERT(uring_enter(ring, 1) == 0);
+
+	TEST_ASSERT((cqe = uring_peek(ring)) != NULL);
+	TEST_ASSERT(cqe->res == (int)sizeof(sample_data) - 1 - 4);
+	TEST_ASSERT(memcmp(buf, sample_data + 4, cqe->res) == 0);
+	uring_seen(ring);
+
+cleanup:
+	uring_free(ring);
+	fd >= 0 ? close(fd) : 0;
+	remove(sample_file);
+#else
+	(void)status;
+#endif
+}
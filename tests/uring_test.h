@@ -0,0 +1,18 @@
+/** @file tests/uring_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __URING_TEST_H
+#define __URING_TEST_H
+
+#include "test_framework.h"
+
+void test_uring_nop(enum TEST_STATUS* status);
+void test_uring_read_fixed(enum TEST_STATUS* status);
+
+EXPORT_PKG(uring_pkg);
+#endif
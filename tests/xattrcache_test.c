@@ -0,0 +1,102 @@
+/** @file tests/xattrcache_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "xattrcache_test.h"
+#include "../xattrcache.h"
+#include "../checksum.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char* const sample_file = "xattr_test.txt";
+static const unsigned char sample_data[] = {'t', 'e', 's', 't'};
+static const char sample_sha1_str[] = "A94A8FE5CCB19BA61C4C0873D391E987982FBBD3";
+
+const struct unit_test xattrcache_tests[] = {
+	MAKE_TEST(test_xattr_cache),
+	MAKE_TEST(test_xattr_cache_checksum)
+};
+MAKE_PKG(xattrcache_tests, xattrcache_pkg);
+
+/* xattr_cache_set()
+ * xattr_cache_get() */
+void test_xattr_cache(enum TEST_STATUS* status){
+	struct file_meta meta;
+	struct file_meta meta_changed;
+	char* out = NULL;
+	int res;
+
+	create_file(sample_file, sample_data, sizeof(sample_data));
+	TEST_ASSERT(get_file_meta(sample_file, &meta) >= 0);
+
+	TEST_ASSERT(xattr_cache_get(sample_file, EVP_sha1(), 0, &meta, &out) > 0);
+	TEST_ASSERT(out == NULL);
+
+	res = xattr_cache_set(sample_file, EVP_sha1(), 0, &meta, sample_sha1_str);
+	TEST_ASSERT(res >= 0);
+	if (res > 0){
+		printf("Extended attributes are not supported here\n");
+		goto cleanup;
+	}
+
+	TEST_ASSERT(xattr_cache_get(sample_file, EVP_sha1(), 0, &meta, &out) == 0);
+	TEST_ASSERT(strcmp(out, sample_sha1_str) == 0);
+	TEST_FREE(out, free);
+
+	/* every algorithm and mode has its own entry */
+	TEST_ASSERT(xattr_cache_get(sample_file, EVP_sha256(), 0, &meta, &out) > 0);
+	TEST_ASSERT(xattr_cache_get(sample_file, EVP_sha1(), 1, &meta, &out) > 0);
+
+	/* the file changed since it was hashed */
+	meta_changed = meta;
+	meta_changed.mtime++;
+	TEST_ASSERT(xattr_cache_get(sample_file, EVP_sha1(), 0, &meta_changed, &out) > 0);
+	meta_changed = meta;
+	meta_changed.size++;
+	TEST_ASSERT(xattr_cache_get(sample_file, EVP_sha1(), 0, &meta_changed, &out) > 0);
+	TEST_ASSERT(out == NULL);
+
+cleanup:
+	free(out);
+	remove(sample_file);
+}
+
+/* xattr_cache_checksum() */
+void test_xattr_cache_checksum(enum TEST_STATUS* status){
+	const char* fake_sum = "0123456789ABCDEF0123456789ABCDEF01234567";
+	struct file_meta meta;
+	char* out = NULL;
+
+	create_file(sample_file, sample_data, sizeof(sample_data));
+	TEST_ASSERT(get_file_meta(sample_file, &meta) >= 0);
+
+	/* a miss hashes the file and caches the result */
+	TEST_ASSERT(xattr_cache_checksum(sample_file, EVP_sha1(), 0, 1, &meta, &out) == 0);
+	TEST_ASSERT(strcmp(out, sample_sha1_str) == 0);
+	TEST_FREE(out, free);
+	if (xattr_cache_get(sample_file, EVP_sha1(), 0, &meta, &out) != 0){
+		printf("Extended attributes are not supported here\n");
+		goto cleanup;
+	}
+	TEST_ASSERT(strcmp(out, sample_sha1_str) == 0);
+	TEST_FREE(out, free);
+
+	/* a hit does not read the file, which a wrong cached checksum shows */
+	TEST_ASSERT(xattr_cache_set(sample_file, EVP_sha1(), 0, &meta, fake_sum) == 0);
+	TEST_ASSERT(xattr_cache_checksum(sample_file, EVP_sha1(), 0, 1, &meta, &out) == 0);
+	TEST_ASSERT(strcmp(out, fake_sum) == 0);
+	TEST_FREE(out, free);
+
+	/* without metadata the cache is not used */
+	TEST_ASSERT(xattr_cache_checksum(sample_file, EVP_sha1(), 0, 1, NULL, &out) == 0);
+	TEST_ASSERT(strcmp(out, sample_sha1_str) == 0);
+
+cleanup:
+	free(out);
+	remove(sample_file);
+}
@@ -0,0 +1,18 @@
+/** @file tests/xattrcache_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __XATTRCACHE_TEST_H
+#define __XATTRCACHE_TEST_H
+
+#include "test_framework.h"
+
+void test_xattr_cache(enum TEST_STATUS* status);
+void test_xattr_cache_checksum(enum TEST_STATUS* status);
+
+EXPORT_PKG(xattrcache_pkg);
+#endif
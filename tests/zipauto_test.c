@@ -0,0 +1,119 @@
+/** @file tests/zipauto_test.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "zipauto_test.h"
+#include "../zipauto.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const struct unit_test zipauto_tests[] = {
+	MAKE_TEST(test_zip_speed),
+	MAKE_TEST(test_zip_pick),
+	MAKE_TEST(test_zip_level_step),
+	MAKE_TEST(test_zip_auto_record)
+};
+MAKE_PKG(zipauto_tests, zipauto_pkg);
+
+#define SAMPLE_LEN (1 << 16)
+
+/* text-like data, so every compressor has something to find */
+static unsigned char* make_sample(void){
+	unsigned char* sample = malloc(SAMPLE_LEN);
+	size_t i;
+
+	if (!sample){
+		return NULL;
+	}
+	for (i = 0; i < SAMPLE_LEN; ++i){
+		sample[i] = "the quick brown fox jumps over the lazy dog "[(i * 7 + i / 64) % 44];
+	}
+	return sample;
+}
+
+void test_zip_speed(enum TEST_STATUS* status){
+	unsigned char* sample = NULL;
+	size_t out_len = 0;
+
+	sample = make_sample();
+	TEST_ASSERT(sample);
+
+	TEST_ASSERT(zip_speed(COMPRESSOR_GZIP, 6, 0, sample, SAMPLE_LEN, &out_len) > 0);
+	TEST_ASSERT(out_len > 0 && out_len < SAMPLE_LEN);
+	/* nothing to compress still works */
+	TEST_ASSERT(zip_speed(COMPRESSOR_ZSTD, 1, 0, sample, 0, NULL) >= 0);
+
+cleanup:
+	free(sample);
+}
+
+void test_zip_pick(enum TEST_STATUS* status){
+	unsigned char* sample = NULL;
+	enum compressor c_type;
+	int level = -1;
+
+	sample = make_sample();
+	TEST_ASSERT(sample);
+
+	c_type = COMPRESSOR_INVALID;
+	TEST_ASSERT(zip_pick(sample, SAMPLE_LEN, 1, 0, 1, &c_type, &level) == 0);
+	TEST_ASSERT(c_type != COMPRESSOR_INVALID && c_type != COMPRESSOR_NONE);
+
+	/* a fixed compressor only gets its level picked */
+	c_type = COMPRESSOR_GZIP;
+	TEST_ASSERT(zip_pick(sample, SAMPLE_LEN, 1, 0, 1, &c_type, &level) == 0);
+	TEST_ASSERT(c_type == COMPRESSOR_GZIP);
+	TEST_ASSERT(level >= 1 && level <= 9);
+
+	/* nothing can keep up with this, so the fastest level wins */
+	c_type = COMPRESSOR_GZIP;
+	TEST_ASSERT(zip_pick(sample, SAMPLE_LEN, ~0UL, 0, 1, &c_type, &level) == 0);
+	TEST_ASSERT(c_type == COMPRESSOR_GZIP);
+	TEST_ASSERT(level == 1);
+
+cleanup:
+	free(sample);
+}
+
+void test_zip_level_step(enum TEST_STATUS* status){
+	TEST_ASSERT(zip_level_step(COMPRESSOR_GZIP, 6, 1) == 1);
+	TEST_ASSERT(zip_level_step(COMPRESSOR_GZIP, 6, 0) == 9);
+	/* nothing past either end */
+	TEST_ASSERT(zip_level_step(COMPRESSOR_GZIP, 1, 1) == 1);
+	TEST_ASSERT(zip_level_step(COMPRESSOR_GZIP, 9, 0) == 9);
+	/* a level that is not a candidate stays where it is */
+	TEST_ASSERT(zip_level_step(COMPRESSOR_GZIP, 4, 1) == 4);
+	TEST_ASSERT(zip_level_step(COMPRESSOR_ZSTD, 1, 0) == 2);
+
+cleanup:
+	;
+}
+
+void test_zip_auto_record(enum TEST_STATUS* status){
+	const char* dir = "zipauto_dir";
+	enum compressor c_type = COMPRESSOR_INVALID;
+
+	TEST_ASSERT(mkdir(dir, 0755) == 0);
+	TEST_ASSERT(zip_auto_load(dir, &c_type) > 0);
+	TEST_ASSERT(c_type == COMPRESSOR_INVALID);
+
+	TEST_ASSERT(zip_auto_save(dir, COMPRESSOR_ZSTD) == 0);
+	TEST_ASSERT(zip_auto_load(dir, &c_type) == 0);
+	TEST_ASSERT(c_type == COMPRESSOR_ZSTD);
+
+	/* the next backup can record another one */
+	TEST_ASSERT(zip_auto_save(dir, COMPRESSOR_LZ4) == 0);
+	TEST_ASSERT(zip_auto_load(dir, &c_type) == 0);
+	TEST_ASSERT(c_type == COMPRESSOR_LZ4);
+
+cleanup:
+	remove("zipauto_dir/compressor");
+	rmdir(dir);
+}
@@ -0,0 +1,20 @@
+/** @file tests/zipauto_test.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __ZIPAUTO_TEST_H
+#define __ZIPAUTO_TEST_H
+
+#include "test_framework.h"
+
+void test_zip_speed(enum TEST_STATUS* status);
+void test_zip_pick(enum TEST_STATUS* status);
+void test_zip_level_step(enum TEST_STATUS* status);
+void test_zip_auto_record(enum TEST_STATUS* status);
+
+EXPORT_PKG(zipauto_pkg);
+#endif
@@ -0,0 +1,209 @@
+/** @file threadpool.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+/* prototypes */
+#include "threadpool.h"
+/* error handling */
+#include "log.h"
+#include <errno.h>
+#include <string.h>
+/* malloc */
+#include <stdlib.h>
+/* threads */
+#include <pthread.h>
+/* sysconf */
+#include <unistd.h>
+
+struct job{
+	void(*func)(void*);
+	void* arg;
+};
+
+struct threadpool{
+	pthread_t* threads;
+	size_t n_threads;
+
+	/* circular buffer of jobs waiting for a worker */
+	struct job* queue;
+	size_t queue_len;
+	size_t queue_head;
+	size_t queue_count;
+
+	/* jobs that were taken off the queue but have not finished yet */
+	size_t n_running;
+	int stop;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond_job;
+	pthread_cond_t cond_space;
+	pthread_cond_t cond_done;
+};
+
+size_t tp_cpu_count(void){
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (size_t)n : 1;
+}
+
+static void* tp_worker(void* arg){
+	struct threadpool* tp = arg;
+
+	pthread_mutex_lock(&tp->mutex);
+	for (;;){
+		struct job j;
+
+		while (tp->queue_count == 0 && !tp->stop){
+			pthread_cond_wait(&tp->cond_job, &tp->mutex);
+		}
+		/* only stop once the queue has been drained */
+		if (tp->queue_count == 0){
+			break;
+		}
+
+		j = tp->queue[tp->queue_head];
+		tp->queue_head = (tp->queue_head + 1) % tp->queue_len;
+		tp->queue_count--;
+		tp->n_running++;
+		pthread_cond_signal(&tp->cond_space);
+		pthread_mutex_unlock(&tp->mutex);
+
+		j.func(j.arg);
+
+		pthread_mutex_lock(&tp->mutex);
+		tp->n_running--;
+		if (tp->queue_count == 0 && tp->n_running == 0){
+			pthread_cond_broadcast(&tp->cond_done);
+		}
+	}
+	pthread_mutex_unlock(&tp->mutex);
+	return NULL;
+}
+
+struct threadpool* tp_new(size_t n_threads, size_t queue_len){
+	struct threadpool* tp;
+	size_t i;
+	int res;
+
+	if (n_threads == 0){
+		n_threads = tp_cpu_count();
+	}
+	if (queue_len == 0){
+		queue_len = n_threads * 2;
+	}
+
+	tp = calloc(1, sizeof(*tp));
+	if (!tp){
+		log_enomem();
+		return NULL;
+	}
+
+	tp->queue = malloc(queue_len * sizeof(*tp->queue));
+	tp->threads = malloc(n_threads * sizeof(*tp->threads));
+	if (!tp->queue || !tp->threads){
+		log_enomem();
+		free(tp->queue);
+		free(tp->threads);
+		free(tp);
+		return NULL;
+	}
+	tp->queue_len = queue_len;
+
+	pthread_mutex_init(&tp->mutex, NULL);
+	pthread_cond_init(&tp->cond_job, NULL);
+	pthread_cond_init(&tp->cond_space, NULL);
+	pthread_cond_init(&tp->cond_done, NULL);
+
+	for (i = 0; i < n_threads; ++i){
+		if ((res = pthread_create(&tp->threads[i], NULL, tp_worker, tp)) != 0){
+			log_error_ex("Failed to start worker thread (%s)", strerror(res));
+			break;
+		}
+		tp->n_threads++;
+	}
+
+	if (tp->n_threads == 0){
+		tp_free(tp);
+		return NULL;
+	}
+	return tp;
+}
+
+/* queues a job, blocking for space if wait is set, and returns positive instead if not */
+static int tp_enqueue(struct threadpool* tp, void(*func)(void*), void* arg, int wait){
+	return_ifnull(tp, -1);
+	return_ifnull(func, -1);
+
+	pthread_mutex_lock(&tp->mutex);
+	while (wait && tp->queue_count == tp->queue_len && !tp->stop){
+		pthread_cond_wait(&tp->cond_space, &tp->mutex);
+	}
+	if (tp->stop){
+		pthread_mutex_unlock(&tp->mutex);
+		log_error("Cannot submit a job to a thread pool that is shutting down");
+		return -1;
+	}
+	if (tp->queue_count == tp->queue_len){
+		pthread_mutex_unlock(&tp->mutex);
+		return 1;
+	}
+
+	tp->queue[(tp->queue_head + tp->queue_count) % tp->queue_len].func = func;
+	tp->queue[(tp->queue_head + tp->queue_count) % tp->queue_len].arg = arg;
+	tp->queue_count++;
+	pthread_cond_signal(&tp->cond_job);
+	pthread_mutex_unlock(&tp->mutex);
+	return 0;
+}
+
+int tp_submit(struct threadpool* tp, void(*func)(void*), void* arg){
+	return tp_enqueue(tp, func, arg, 1);
+}
+
+int tp_try_submit(struct threadpool* tp, void(*func)(void*), void* arg){
+	return tp_enqueue(tp, func, arg, 0);
+}
+
+int tp_wait(struct threadpool* tp){
+	return_ifnull(tp, -1);
+
+	pthread_mutex_lock(&tp->mutex);
+	while (tp->queue_count > 0 || tp->n_running > 0){
+		pthread_cond_wait(&tp->cond_done, &tp->mutex);
+	}
+	pthread_mutex_unlock(&tp->mutex);
+	return 0;
+}
+
+size_t tp_threads(const struct threadpool* tp){
+	return tp ? tp->n_threads : 0;
+}
+
+void tp_free(struct threadpool* tp){
+	size_t i;
+
+	if (!tp){
+		return;
+	}
+
+	pthread_mutex_lock(&tp->mutex);
+	tp->stop = 1;
+	pthread_cond_broadcast(&tp->cond_job);
+	pthread_cond_broadcast(&tp->cond_space);
+	pthread_mutex_unlock(&tp->mutex);
+
+	for (i = 0; i < tp->n_threads; ++i){
+		pthread_join(tp->threads[i], NULL);
+	}
+
+	pthread_mutex_destroy(&tp->mutex);
+	pthread_cond_destroy(&tp->cond_job);
+	pthread_cond_destroy(&tp->cond_space);
+	pthread_cond_destroy(&tp->cond_done);
+	free(tp->threads);
+	free(tp->queue);
+	free(tp);
+}
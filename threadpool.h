@@ -0,0 +1,108 @@
+/** @file threadpool.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __THREADPOOL_H
+#define __THREADPOOL_H
+
+#include <stddef.h>
+
+#ifndef __GNUC__
+#define __attribute__(x)
+#endif
+
+/**
+ * @brief A fixed-size pool of worker threads fed by a bounded job queue.
+ */
+struct threadpool;
+
+/**
+ * @brief Returns the number of processors currently online.
+ *
+ * @return The number of online processors, or 1 if it could not be determined.
+ */
+size_t tp_cpu_count(void);
+
+/**
+ * @brief Starts a new thread pool.
+ *
+ * @param n_threads The number of worker threads to start.<br>
+ * If this is 0, one thread per online processor is started.
+ * @see tp_cpu_count()
+ *
+ * @param queue_len The maximum number of jobs that can be waiting for a worker.<br>
+ * If this is 0, the queue holds twice as many jobs as there are threads.
+ *
+ * @return A thread pool, or NULL on failure.<br>
+ * This structure must be freed with tp_free() when no longer in use.
+ * @see tp_free()
+ */
+struct threadpool* tp_new(size_t n_threads, size_t queue_len) __attribute__((malloc));
+
+/**
+ * @brief Queues a job for the next available worker.<br>
+ * If the queue is full, this function blocks until a worker takes a job off of it.
+ *
+ * @param tp A thread pool returned by tp_new().
+ * @see tp_new()
+ *
+ * @param func The function to run on the worker thread.
+ *
+ * @param arg The argument to pass to func.<br>
+ * This must stay valid until func returns.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int tp_submit(struct threadpool* tp, void(*func)(void*), void* arg);
+
+/**
+ * @brief Queues a job for the next available worker, unless the queue is full.<br>
+ * Unlike tp_submit(), this function never blocks, so it suits jobs that are only worth running if a worker gets to them soon.
+ *
+ * @param tp A thread pool returned by tp_new().
+ * @see tp_new()
+ *
+ * @param func The function to run on the worker thread.
+ *
+ * @param arg The argument to pass to func.<br>
+ * This must stay valid until func returns.
+ *
+ * @return 0 on success, positive if the queue was full, or negative on failure.<br>
+ * If this does not return 0, func will not be called with arg.
+ */
+int tp_try_submit(struct threadpool* tp, void(*func)(void*), void* arg);
+
+/**
+ * @brief Blocks until every job submitted so far has finished.
+ *
+ * @param tp A thread pool returned by tp_new().
+ * @see tp_new()
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int tp_wait(struct threadpool* tp);
+
+/**
+ * @brief Returns the number of worker threads in a thread pool.
+ *
+ * @param tp A thread pool returned by tp_new().
+ *
+ * @return The number of worker threads.
+ */
+size_t tp_threads(const struct threadpool* tp);
+
+/**
+ * @brief Finishes all queued jobs, stops the worker threads, and frees all memory associated with a thread pool.
+ *
+ * @param tp The thread pool to free.<br>
+ * This can be NULL, in which case this function does nothing.
+ *
+ * @return void
+ */
+void tp_free(struct threadpool* tp);
+
+#endif
@@ -0,0 +1,238 @@
+/** @file trace.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "trace.h"
+#include "log.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct trace_event{
+	const char* name;
+	char* arg;
+	double start;
+	double end;
+};
+
+/* one per thread that ever recorded a span, kept for the life of the process so its thread can always find it */
+struct trace_thread{
+	struct trace_event* events;
+	size_t len;
+	size_t size;
+	unsigned tid;
+	/* only ever contended by trace_stop() */
+	pthread_mutex_t lock;
+	struct trace_thread* next;
+};
+
+static int trace_on;
+static double trace_origin;
+static struct trace_thread* threads;
+static unsigned n_threads;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_key;
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+
+static void make_thread_key(void){
+	pthread_key_create(&thread_key, NULL);
+}
+
+static struct trace_thread* this_thread(void){
+	struct trace_thread* tt;
+
+	pthread_once(&thread_once, make_thread_key);
+	tt = pthread_getspecific(thread_key);
+	if (tt){
+		return tt;
+	}
+
+	tt = calloc(1, sizeof(*tt));
+	if (!tt){
+		log_enomem();
+		return NULL;
+	}
+	pthread_mutex_init(&tt->lock, NULL);
+	pthread_mutex_lock(&threads_lock);
+	tt->tid = ++n_threads;
+	tt->next = threads;
+	threads = tt;
+	pthread_mutex_unlock(&threads_lock);
+	pthread_setspecific(thread_key, tt);
+	return tt;
+}
+
+/* throws away a thread's spans, with its lock held */
+static void clear_thread(struct trace_thread* tt){
+	size_t i;
+
+	for (i = 0; i < tt->len; ++i){
+		free(tt->events[i].arg);
+	}
+	free(tt->events);
+	tt->events = NULL;
+	tt->len = 0;
+	tt->size = 0;
+}
+
+void trace_start(void){
+	struct stats_time now;
+	struct trace_thread* tt;
+
+	pthread_mutex_lock(&threads_lock);
+	for (tt = threads; tt; tt = tt->next){
+		pthread_mutex_lock(&tt->lock);
+		clear_thread(tt);
+		pthread_mutex_unlock(&tt->lock);
+	}
+	pthread_mutex_unlock(&threads_lock);
+
+	stats_time_now(&now);
+	trace_origin = now.wall;
+	__atomic_store_n(&trace_on, 1, __ATOMIC_RELEASE);
+}
+
+void trace_span(const char* name, double start, double end, const char* arg){
+	struct trace_thread* tt;
+	struct trace_event* e;
+
+	if (!__atomic_load_n(&trace_on, __ATOMIC_ACQUIRE) || !(tt = this_thread())){
+		return;
+	}
+
+	pthread_mutex_lock(&tt->lock);
+	if (tt->len >= tt->size){
+		size_t size = tt->size ? tt->size * 2 : 256;
+		void* tmp = realloc(tt->events, size * sizeof(*tt->events));
+
+		/* losing a span is better than failing the backup over it */
+		if (!tmp){
+			log_enomem();
+			pthread_mutex_unlock(&tt->lock);
+			return;
+		}
+		tt->events = tmp;
+		tt->size = size;
+	}
+	e = &tt->events[tt->len];
+	e->name = name;
+	e->arg = NULL;
+	e->start = start;
+	e->end = end;
+	if (arg && !(e->arg = malloc(strlen(arg) + 1))){
+		log_enomem();
+	}
+	else if (arg){
+		strcpy(e->arg, arg);
+	}
+	tt->len++;
+	pthread_mutex_unlock(&tt->lock);
+}
+
+void trace_since(const char* name, const struct stats_time* start, const char* arg){
+	struct stats_time now;
+
+	if (!__atomic_load_n(&trace_on, __ATOMIC_ACQUIRE)){
+		return;
+	}
+	stats_time_now(&now);
+	trace_span(name, start->wall, now.wall, arg);
+}
+
+void trace_lap(enum stats_stage stage, struct stats_time* total, struct stats_time* mark){
+	double start = mark->wall;
+
+	stats_time_lap(total, mark);
+	trace_span(stats_stage_tostring(stage), start, mark->wall, NULL);
+}
+
+static void write_json_string(FILE* fp, const char* str){
+	fputc('"', fp);
+	for (; *str; ++str){
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\'){
+			fputc('\\', fp);
+			fputc(c, fp);
+		}
+		else if (c < 0x20){
+			fprintf(fp, "\\u%04x", c);
+		}
+		else{
+			fputc(c, fp);
+		}
+	}
+	fputc('"', fp);
+}
+
+/* microseconds since trace_start(), which is what chrome://tracing expects */
+static double trace_us(double t){
+	return (t - trace_origin) * 1e6;
+}
+
+static void write_thread(FILE* fp, const struct trace_thread* tt, int pid, int* first){
+	size_t i;
+
+	fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}", *first ? "" : ",", pid, tt->tid, tt->tid);
+	*first = 0;
+	for (i = 0; i < tt->len; ++i){
+		const struct trace_event* e = &tt->events[i];
+
+		fprintf(fp, ",\n{\"name\":");
+		write_json_string(fp, e->name);
+		fprintf(fp, ",\"cat\":\"ezbackup\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u", trace_us(e->start), (e->end - e->start) * 1e6, pid, tt->tid);
+		if (e->arg){
+			fprintf(fp, ",\"args\":{\"file\":");
+			write_json_string(fp, e->arg);
+			fputc('}', fp);
+		}
+		fputc('}', fp);
+	}
+}
+
+int trace_stop(const char* file){
+	struct trace_thread* tt;
+	FILE* fp = NULL;
+	int first = 1;
+	int ret = 0;
+
+	__atomic_store_n(&trace_on, 0, __ATOMIC_RELEASE);
+
+	if (file && !(fp = fopen(file, "w"))){
+		log_efopen(file);
+		ret = -1;
+	}
+	fp ? fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[") : 0;
+
+	pthread_mutex_lock(&threads_lock);
+	for (tt = threads; tt; tt = tt->next){
+		pthread_mutex_lock(&tt->lock);
+		if (fp && tt->len > 0){
+			write_thread(fp, tt, (int)getpid(), &first);
+		}
+		clear_thread(tt);
+		pthread_mutex_unlock(&tt->lock);
+	}
+	pthread_mutex_unlock(&threads_lock);
+
+	if (!fp){
+		return ret;
+	}
+	fprintf(fp, "\n]}\n");
+	if (ferror(fp)){
+		log_efwrite(file);
+		ret = -1;
+	}
+	if (fclose(fp) != 0){
+		log_efclose(file);
+		ret = -1;
+	}
+	return ret;
+}
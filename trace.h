@@ -0,0 +1,82 @@
+/** @file trace.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include "stats.h"
+
+/**
+ * @brief Starts recording spans.<br>
+ * Until this is called, and after trace_stop(), recording a span does nothing but check that tracing is off.<br>
+ * Any spans left from an earlier trace are thrown away.
+ *
+ * @return void
+ */
+void trace_start(void);
+
+/**
+ * @brief Stops recording spans and writes every span recorded since trace_start() as a Chrome trace, which chrome://tracing and Perfetto can open.
+ *
+ * @param file Path to the JSON file to write.<br>
+ * If this file already exists, it will be overwritten.<br>
+ * This can be NULL to throw the spans away.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int trace_stop(const char* file);
+
+/**
+ * @brief Records a span.<br>
+ * Each thread records into a buffer of its own, so this function is thread-safe without waiting on other threads.<br>
+ * A span that starts and ends inside another span on the same thread is shown nested inside it.
+ *
+ * @param name What the span is, e.g. "read" or "file".<br>
+ * This must stay valid until trace_stop(), so it should be a string literal or a stats_stage_tostring().
+ *
+ * @param start When the span started, as the wall-clock time of a struct stats_time.
+ *
+ * @param end When the span ended, in the same way.
+ *
+ * @param arg What the span worked on, e.g. a file name.<br>
+ * This is copied, and can be NULL.
+ *
+ * @return void
+ */
+void trace_span(const char* name, double start, double end, const char* arg);
+
+/**
+ * @brief Adds the time since a mark to a running total like stats_time_lap(), and records it as a span of a stage.
+ * @see stats_time_lap()
+ *
+ * @param stage The stage the span belongs to.
+ *
+ * @param total The running total to add to.
+ *
+ * @param mark A time returned by stats_time_now() on the same thread.<br>
+ * This is set to the current time.
+ *
+ * @return void
+ */
+void trace_lap(enum stats_stage stage, struct stats_time* total, struct stats_time* mark);
+
+/**
+ * @brief Records a span that ends now.
+ * @see trace_span()
+ *
+ * @param name What the span is.
+ *
+ * @param start A time returned by stats_time_now().
+ *
+ * @param arg What the span worked on, or NULL.
+ *
+ * @return void
+ */
+void trace_since(const char* name, const struct stats_time* start, const char* arg);
+
+#endif
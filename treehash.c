@@ -0,0 +1,463 @@
+/** @file treehash.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "treehash.h"
+#include "checksum.h"
+#include "crypt/base16.h"
+#include "filehelper.h"
+#include "stats.h"
+#include "trace.h"
+#include "strings/stringhelper.h"
+#include "threadpool.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <openssl/err.h>
+
+/* how many digest algorithms have their segment of zeros remembered */
+#define ZERO_DIGEST_MAX 4
+
+static const unsigned char zeros[1 << 16];
+
+/* the digest of a whole segment of zeros, which every segment in a hole of a sparse file has */
+struct zero_digest{
+	int md_type;
+	size_t segment_len;
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned digest_len;
+};
+
+static struct zero_digest zero_digests[ZERO_DIGEST_MAX];
+static size_t n_zero_digests = 0;
+static pthread_mutex_t zero_digest_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int hash_zeros(EVP_MD_CTX* ctx, uint64_t len){
+	while (len > 0){
+		size_t n = len < sizeof(zeros) ? (size_t)len : sizeof(zeros);
+
+		if (EVP_DigestUpdate(ctx, zeros, n) != 1){
+			log_error("Failed to calculate checksum");
+			ERR_print_errors_fp(stderr);
+			return -1;
+		}
+		len -= n;
+	}
+	return 0;
+}
+
+/* works out the digest of a segment of zeros the first time an algorithm needs it */
+static int zero_segment_digest(const EVP_MD* md, size_t segment_len, unsigned char* out, unsigned* out_len){
+	EVP_MD_CTX* ctx = NULL;
+	size_t i;
+	int ret = 0;
+
+	pthread_mutex_lock(&zero_digest_mutex);
+	for (i = 0; i < n_zero_digests; ++i){
+		if (zero_digests[i].md_type == EVP_MD_type(md) && zero_digests[i].segment_len == segment_len){
+			memcpy(out, zero_digests[i].digest, zero_digests[i].digest_len);
+			*out_len = zero_digests[i].digest_len;
+			goto cleanup;
+		}
+	}
+
+	if (!(ctx = EVP_MD_CTX_create()) || EVP_DigestInit_ex(ctx, md, NULL) != 1){
+		log_error("Failed to initialize digest algorithm");
+		ERR_print_errors_fp(stderr);
+		ret = -1;
+		goto cleanup;
+	}
+	if (hash_zeros(ctx, segment_len) != 0 || EVP_DigestFinal_ex(ctx, out, out_len) != 1){
+		log_error("Failed to calculate checksum");
+		ret = -1;
+		goto cleanup;
+	}
+	if (n_zero_digests < ZERO_DIGEST_MAX){
+		zero_digests[n_zero_digests].md_type = EVP_MD_type(md);
+		zero_digests[n_zero_digests].segment_len = segment_len;
+		memcpy(zero_digests[n_zero_digests].digest, out, *out_len);
+		zero_digests[n_zero_digests].digest_len = *out_len;
+		n_zero_digests++;
+	}
+
+cleanup:
+	pthread_mutex_unlock(&zero_digest_mutex);
+	ctx ? EVP_MD_CTX_destroy(ctx) : (void)0;
+	return ret;
+}
+
+struct tree_hash{
+	const EVP_MD* md;
+	/* 0 for a plain digest */
+	size_t segment_len;
+	/* the current segment, or everything for a plain digest */
+	EVP_MD_CTX* segment_ctx;
+	/* the digest of every finished segment's digest */
+	EVP_MD_CTX* root_ctx;
+	size_t segment_fill;
+	/* how many zeros at the end of the current segment are not hashed yet, since a segment of nothing else has a known digest */
+	uint64_t zeros;
+	unsigned long n_segments;
+};
+
+struct tree_hash* tree_hash_new(const EVP_MD* md, size_t segment_len){
+	struct tree_hash* th;
+
+	th = calloc(1, sizeof(*th));
+	if (!th){
+		log_enomem();
+		return NULL;
+	}
+	th->md = md ? md : EVP_sha1();
+	th->segment_len = segment_len;
+
+	if (!(th->segment_ctx = EVP_MD_CTX_create()) ||
+			!(th->root_ctx = EVP_MD_CTX_create())){
+		log_error("Failed to initialize EVP_MD_CTX");
+		tree_hash_free(th);
+		return NULL;
+	}
+	if (EVP_DigestInit_ex(th->segment_ctx, th->md, NULL) != 1 ||
+			EVP_DigestInit_ex(th->root_ctx, th->md, NULL) != 1){
+		log_error("Failed to initialize digest algorithm");
+		ERR_print_errors_fp(stderr);
+		tree_hash_free(th);
+		return NULL;
+	}
+	return th;
+}
+
+static int flush_zeros(struct tree_hash* th){
+	uint64_t len = th->zeros;
+
+	th->zeros = 0;
+	return hash_zeros(th->segment_ctx, len);
+}
+
+/* finishes the current segment's digest, which segment_ctx has to be initialized again after */
+static int segment_digest(struct tree_hash* th, unsigned char* out, unsigned* out_len){
+	if (th->segment_len > 0 && th->zeros == th->segment_len){
+		th->zeros = 0;
+		return zero_segment_digest(th->md, th->segment_len, out, out_len);
+	}
+	if (flush_zeros(th) != 0){
+		return -1;
+	}
+	return EVP_DigestFinal_ex(th->segment_ctx, out, out_len) == 1 ? 0 : -1;
+}
+
+/* only called once more data arrives, so the last segment is never empty
+ * and data that fits in one segment never gets here */
+static int next_segment(struct tree_hash* th){
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned digest_len;
+
+	if (segment_digest(th, digest, &digest_len) != 0 ||
+			EVP_DigestUpdate(th->root_ctx, digest, digest_len) != 1 ||
+			EVP_DigestInit_ex(th->segment_ctx, th->md, NULL) != 1){
+		log_error("Failed to finish tree hash segment");
+		ERR_print_errors_fp(stderr);
+		return -1;
+	}
+	th->segment_fill = 0;
+	th->n_segments++;
+	return 0;
+}
+
+int tree_hash_update(struct tree_hash* th, const void* data, size_t len){
+	const unsigned char* p = data;
+
+	return_ifnull(th, -1);
+
+	if (th->segment_len == 0){
+		if (EVP_DigestUpdate(th->segment_ctx, data, len) != 1){
+			log_error("Failed to calculate checksum");
+			ERR_print_errors_fp(stderr);
+			return -1;
+		}
+		return 0;
+	}
+
+	while (len > 0){
+		size_t n;
+
+		if (th->segment_fill == th->segment_len && next_segment(th) != 0){
+			return -1;
+		}
+		n = th->segment_len - th->segment_fill;
+		if (n > len){
+			n = len;
+		}
+		/* the zeros came first */
+		if (th->zeros > 0 && flush_zeros(th) != 0){
+			return -1;
+		}
+		if (EVP_DigestUpdate(th->segment_ctx, p, n) != 1){
+			log_error("Failed to calculate checksum");
+			ERR_print_errors_fp(stderr);
+			return -1;
+		}
+		th->segment_fill += n;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int tree_hash_update_zeros(struct tree_hash* th, uint64_t len){
+	return_ifnull(th, -1);
+
+	if (th->segment_len == 0){
+		return hash_zeros(th->segment_ctx, len);
+	}
+
+	while (len > 0){
+		size_t n;
+
+		if (th->segment_fill == th->segment_len && next_segment(th) != 0){
+			return -1;
+		}
+		n = th->segment_len - th->segment_fill;
+		if (n > len){
+			n = (size_t)len;
+		}
+		th->zeros += n;
+		th->segment_fill += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* turns the digest of the segment digests into a tree hash string */
+static int make_tree_string(const unsigned char* digest, unsigned digest_len, char** out){
+	char* hex = NULL;
+
+	if (to_base16(digest, digest_len, &hex) != 0){
+		log_error("Failed to convert checksum bytes to string");
+		*out = NULL;
+		return -1;
+	}
+	*out = sh_concat(sh_dup(TREE_HASH_PREFIX), hex);
+	free(hex);
+	if (!*out){
+		log_enomem();
+		return -1;
+	}
+	return 0;
+}
+
+int tree_hash_final(struct tree_hash* th, char** out){
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned digest_len;
+
+	return_ifnull(out, -1);
+	*out = NULL;
+	return_ifnull(th, -1);
+
+	if (th->segment_len > 0 && th->n_segments > 0){
+		if (next_segment(th) != 0){
+			return -1;
+		}
+		if (EVP_DigestFinal_ex(th->root_ctx, digest, &digest_len) != 1){
+			log_error("Failed to finalize checksum calculation");
+			ERR_print_errors_fp(stderr);
+			return -1;
+		}
+		return make_tree_string(digest, digest_len, out);
+	}
+
+	/* one segment at most, which is hashed like any other file */
+	if (segment_digest(th, digest, &digest_len) != 0){
+		log_error("Failed to finalize checksum calculation");
+		ERR_print_errors_fp(stderr);
+		return -1;
+	}
+	if (to_base16(digest, digest_len, out) != 0){
+		log_error("Failed to convert checksum bytes to string");
+		*out = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+void tree_hash_free(struct tree_hash* th){
+	if (!th){
+		return;
+	}
+	th->segment_ctx ? EVP_MD_CTX_destroy(th->segment_ctx) : (void)0;
+	th->root_ctx ? EVP_MD_CTX_destroy(th->root_ctx) : (void)0;
+	free(th);
+}
+
+/* one segment of a file, hashed on a worker thread */
+struct segment_job{
+	const char* file;
+	const EVP_MD* md;
+	size_t segment_len;
+	uint64_t offset;
+	uint64_t len;
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned digest_len;
+	int ret;
+};
+
+static void hash_segment(void* arg){
+	struct segment_job* job = arg;
+	unsigned char buffer[BUFFER_LEN];
+	struct stats_time start;
+	EVP_MD_CTX* ctx = NULL;
+	struct source_file* sf = NULL;
+	uint64_t remaining = job->len;
+
+	job->ret = -1;
+	stats_time_now(&start);
+
+	/* every segment gets its own descriptor so the workers never wait on each other's position */
+	sf = source_open(job->file, job->offset);
+	if (!sf){
+		goto cleanup;
+	}
+	/* a whole segment of a hole is never read */
+	if (job->len == job->segment_len && source_hole(sf) >= job->len){
+		job->ret = zero_segment_digest(job->md, job->segment_len, job->digest, &job->digest_len);
+		remaining = 0;
+		goto cleanup;
+	}
+	if (!(ctx = EVP_MD_CTX_create()) || EVP_DigestInit_ex(ctx, job->md, NULL) != 1){
+		log_error("Failed to initialize digest algorithm");
+		ERR_print_errors_fp(stderr);
+		goto cleanup;
+	}
+
+	while (remaining > 0){
+		size_t n = remaining > sizeof(buffer) ? sizeof(buffer) : remaining;
+
+		int res = source_read(sf, buffer, n);
+
+		if (res < 0){
+			goto cleanup;
+		}
+		if ((size_t)res != n){
+			log_warning_ex("%s shrank while it was being read", job->file);
+			goto cleanup;
+		}
+		if (EVP_DigestUpdate(ctx, buffer, n) != 1){
+			log_error("Failed to calculate checksum");
+			ERR_print_errors_fp(stderr);
+			goto cleanup;
+		}
+		remaining -= n;
+	}
+
+	if (EVP_DigestFinal_ex(ctx, job->digest, &job->digest_len) != 1){
+		log_error("Failed to finalize checksum calculation");
+		goto cleanup;
+	}
+	job->ret = 0;
+
+cleanup:
+	/* reading and hashing happen together here, so it all counts as hashing */
+	stats_record(STAGE_HASH, &start, job->len - remaining, 0, 0);
+	trace_since(stats_stage_tostring(STAGE_HASH), &start, job->file);
+	ctx ? EVP_MD_CTX_destroy(ctx) : (void)0;
+	source_close(sf);
+}
+
+int tree_hash_file(const char* file, const EVP_MD* md, size_t segment_len, unsigned n_threads, char** out){
+	struct segment_job* jobs = NULL;
+	struct threadpool* tp = NULL;
+	EVP_MD_CTX* root_ctx = NULL;
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned digest_len;
+	uint64_t size;
+	size_t n_segments;
+	size_t i;
+	int ret = 0;
+
+	return_ifnull(file, -1);
+	return_ifnull(out, -1);
+	*out = NULL;
+
+	if (!md){
+		md = EVP_sha1();
+	}
+
+	size = get_file_size(file);
+	if (size == (uint64_t)-1){
+		log_error_ex("Failed to get the size of %s", file);
+		return -1;
+	}
+	if (segment_len == 0 || size <= segment_len){
+		return checksum_bytestring(file, md, out);
+	}
+
+	n_segments = (size + segment_len - 1) / segment_len;
+	jobs = calloc(n_segments, sizeof(*jobs));
+	if (!jobs){
+		log_enomem();
+		return -1;
+	}
+	for (i = 0; i < n_segments; ++i){
+		jobs[i].file = file;
+		jobs[i].md = md;
+		jobs[i].segment_len = segment_len;
+		jobs[i].offset = (uint64_t)i * segment_len;
+		jobs[i].len = i + 1 < n_segments ? segment_len : size - jobs[i].offset;
+		jobs[i].ret = -1;
+	}
+
+	if (n_threads == 0){
+		n_threads = tp_cpu_count();
+	}
+	if (n_threads > n_segments){
+		n_threads = n_segments;
+	}
+	if (n_threads > 1 && !(tp = tp_new(n_threads, 0))){
+		log_warning("Failed to start tree hash threads. Hashing on this thread instead.");
+	}
+	for (i = 0; i < n_segments; ++i){
+		if (!tp || tp_submit(tp, hash_segment, &jobs[i]) != 0){
+			hash_segment(&jobs[i]);
+		}
+	}
+	/* waits for every segment */
+	tp_free(tp);
+
+	if (!(root_ctx = EVP_MD_CTX_create()) || EVP_DigestInit_ex(root_ctx, md, NULL) != 1){
+		log_error("Failed to initialize digest algorithm");
+		ERR_print_errors_fp(stderr);
+		ret = -1;
+		goto cleanup;
+	}
+	for (i = 0; i < n_segments; ++i){
+		if (jobs[i].ret != 0){
+			log_error_ex("Failed to hash a segment of %s", file);
+			ret = -1;
+			goto cleanup;
+		}
+		if (EVP_DigestUpdate(root_ctx, jobs[i].digest, jobs[i].digest_len) != 1){
+			log_error("Failed to calculate checksum");
+			ERR_print_errors_fp(stderr);
+			ret = -1;
+			goto cleanup;
+		}
+	}
+	if (EVP_DigestFinal_ex(root_ctx, digest, &digest_len) != 1){
+		log_error("Failed to finalize checksum calculation");
+		ret = -1;
+		goto cleanup;
+	}
+	stats_add(STAGE_HASH, NULL, 0, 0, 1);
+	ret = make_tree_string(digest, digest_len, out);
+
+cleanup:
+	root_ctx ? EVP_MD_CTX_destroy(root_ctx) : (void)0;
+	free(jobs);
+	return ret;
+}
@@ -0,0 +1,124 @@
+/** @file treehash.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __TREEHASH_H
+#define __TREEHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/evp.h>
+
+#ifndef __GNUC__
+#define __attribute__(x)
+#endif
+
+#define TREE_HASH_SEGMENT_LEN ((size_t)1 << 26) /**< @brief The length of every segment of the tree hashes recorded in checksum files, except the last (64MB). */
+
+/**
+ * @brief Starts every tree hash, so that it can never be mistaken for a plain digest.<br>
+ * The number is the version of the format, and changes if the segment length or layout ever does.
+ */
+#define TREE_HASH_PREFIX "tree1:"
+
+/**
+ * @brief Computes the checksum of a stream of data, as either a plain digest or a tree hash.<br>
+ * <br>
+ * A tree hash splits the data into segments of the same length, the last of which can be shorter. Checksum files only ever record tree hashes with segments of TREE_HASH_SEGMENT_LEN bytes.<br>
+ * Each segment is hashed on its own, and the tree hash is the digest of every segment's raw digest back to back, as a hexadecimal string following TREE_HASH_PREFIX.<br>
+ * Data that fits in a single segment gets its plain digest instead, so small files have the same checksum either way.<br>
+ * <br>
+ * Since every segment is independent, the segments of a file can be hashed at the same time, and a segment that lies in a hole of a sparse file is not read at all.
+ * @see tree_hash_file()
+ */
+struct tree_hash;
+
+/**
+ * @brief Starts a new checksum.
+ *
+ * @param md The digest algorithm to use.<br>
+ * If this is NULL, SHA-1 is used.
+ *
+ * @param segment_len The length of the segments of a tree hash, or 0 for a plain digest.<br>
+ * Anything but TREE_HASH_SEGMENT_LEN gives a tree hash that differs from the ones in checksum files.
+ *
+ * @return A new checksum context, or NULL on failure.<br>
+ * This must be freed with tree_hash_free() when no longer in use.
+ */
+struct tree_hash* tree_hash_new(const EVP_MD* md, size_t segment_len) __attribute__((malloc));
+
+/**
+ * @brief Adds data to a checksum.
+ *
+ * @param th The checksum context.
+ *
+ * @param data The data to add.
+ *
+ * @param len The length of the data.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int tree_hash_update(struct tree_hash* th, const void* data, size_t len);
+
+/**
+ * @brief Adds zeros to a checksum, such as a hole in a sparse file.<br>
+ * The checksum is the same as passing the zeros to tree_hash_update(), but a tree hash segment that is nothing but zeros is not hashed again, since its digest is always the same.
+ *
+ * @param th The checksum context.
+ *
+ * @param len The number of zeros.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int tree_hash_update_zeros(struct tree_hash* th, uint64_t len);
+
+/**
+ * @brief Finishes a checksum.
+ *
+ * @param th The checksum context.<br>
+ * No more data can be added after this function is called.
+ *
+ * @param out A pointer to a string that will contain the checksum.<br>
+ * This string must be free()'d when no longer in use. It is set to NULL on failure.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int tree_hash_final(struct tree_hash* th, char** out);
+
+/**
+ * @brief Frees a checksum context.
+ *
+ * @param th The checksum context.<br>
+ * This can be NULL, in which case this function does nothing.
+ *
+ * @return void
+ */
+void tree_hash_free(struct tree_hash* th);
+
+/**
+ * @brief Computes the checksum of a file, hashing its segments in parallel.<br>
+ * The result is the same as passing the whole file through tree_hash_update().
+ *
+ * @param file Path to the file.
+ *
+ * @param md The digest algorithm to use.<br>
+ * If this is NULL, SHA-1 is used.
+ *
+ * @param segment_len The length of the segments of a tree hash, or 0 for a plain digest. @see tree_hash_new()<br>
+ * A plain digest cannot be parallelized, so it is computed with checksum_bytestring().
+ *
+ * @param n_threads The maximum number of segments to hash at once.<br>
+ * If this is 0, one thread per online processor is used.
+ *
+ * @param out A pointer to a string that will contain the checksum.<br>
+ * This string must be free()'d when no longer in use. It is set to NULL on failure.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int tree_hash_file(const char* file, const EVP_MD* md, size_t segment_len, unsigned n_threads, char** out);
+
+#endif
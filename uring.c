@@ -0,0 +1,197 @@
+/** @file uring.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+/* syscall() and MAP_POPULATE are not in any standard */
+#define _GNU_SOURCE
+
+#include "uring.h"
+#include "log.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+struct uring{
+	int fd;
+	void* sq_ptr;
+	size_t sq_map_len;
+	void* cq_ptr;
+	size_t cq_map_len;
+	struct io_uring_sqe* sqes;
+	size_t sqes_map_len;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned sq_entries;
+	/* entries handed out by uring_get_sqe() that the kernel has not been told about */
+	unsigned sq_pending;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_cqe* cqes;
+	unsigned cq_entries;
+};
+
+struct uring* uring_new(unsigned entries){
+	struct uring* ring;
+	struct io_uring_params p;
+	char* sq;
+	char* cq;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring){
+		log_enomem();
+		return NULL;
+	}
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0){
+		log_debug_ex("io_uring is not available (%s)", strerror(errno));
+		free(ring);
+		return NULL;
+	}
+
+	ring->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	/* newer kernels map both rings at once */
+	if (p.features & IORING_FEAT_SINGLE_MMAP){
+		ring->sq_map_len = ring->sq_map_len > ring->cq_map_len ? ring->sq_map_len : ring->cq_map_len;
+	}
+	ring->sq_ptr = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED){
+		ring->sq_ptr = NULL;
+		goto fail;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP){
+		ring->cq_ptr = ring->sq_ptr;
+	}
+	else if ((ring->cq_ptr = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING)) == MAP_FAILED){
+		ring->cq_ptr = NULL;
+		goto fail;
+	}
+	ring->sqes_map_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED){
+		ring->sqes = NULL;
+		goto fail;
+	}
+
+	sq = ring->sq_ptr;
+	cq = ring->cq_ptr;
+	ring->sq_head = (unsigned*)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+	ring->sq_entries = p.sq_entries;
+	ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+	ring->cq_entries = p.cq_entries;
+	return ring;
+
+fail:
+	log_debug_ex("Failed to map the io_uring rings (%s)", strerror(errno));
+	uring_free(ring);
+	return NULL;
+}
+
+unsigned uring_cq_entries(const struct uring* ring){
+	return ring ? ring->cq_entries : 0;
+}
+
+int uring_register_buffers(struct uring* ring, const struct iovec* iov, unsigned n){
+	return_ifnull(ring, -1);
+	return_ifnull(iov, -1);
+
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, n) != 0){
+		log_debug_ex("Failed to register io_uring buffers (%s)", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+struct io_uring_sqe* uring_get_sqe(struct uring* ring){
+	unsigned tail;
+	unsigned index;
+
+	return_ifnull(ring, NULL);
+
+	tail = *ring->sq_tail + ring->sq_pending;
+	if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries){
+		return NULL;
+	}
+	index = tail & *ring->sq_mask;
+	ring->sq_array[index] = index;
+	ring->sq_pending++;
+	memset(&ring->sqes[index], 0, sizeof(ring->sqes[index]));
+	return &ring->sqes[index];
+}
+
+int uring_enter(struct uring* ring, unsigned wait_nr){
+	unsigned to_submit;
+
+	return_ifnull(ring, -1);
+
+	to_submit = ring->sq_pending;
+	/* the kernel only looks at the entries once the tail says they are there */
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + to_submit, __ATOMIC_RELEASE);
+	ring->sq_pending = 0;
+
+	if (syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0 && errno != EINTR){
+		log_warning_ex("io_uring_enter failed (%s)", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+const struct io_uring_cqe* uring_peek(const struct uring* ring){
+	unsigned head;
+
+	return_ifnull(ring, NULL);
+
+	head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)){
+		return NULL;
+	}
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_seen(struct uring* ring){
+	if (ring){
+		__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+	}
+}
+
+void uring_free(struct uring* ring){
+	if (!ring){
+		return;
+	}
+	if (ring->sqes){
+		munmap(ring->sqes, ring->sqes_map_len);
+	}
+	if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr){
+		munmap(ring->cq_ptr, ring->cq_map_len);
+	}
+	if (ring->sq_ptr){
+		munmap(ring->sq_ptr, ring->sq_map_len);
+	}
+	if (ring->fd >= 0){
+		close(ring->fd);
+	}
+	free(ring);
+}
+
+#endif
@@ -0,0 +1,122 @@
+/** @file uring.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __URING_H
+#define __URING_H
+
+#ifdef __linux__
+#include <linux/version.h>
+#endif
+
+/* registered buffers and every opcode used here first shipped in 5.1, and older headers do not have them */
+#if defined(__linux__) && defined(LINUX_VERSION_CODE) && LINUX_VERSION_CODE >= KERNEL_VERSION(5, 1, 0)
+/**
+ * @brief Defined if this system's headers have io_uring.<br>
+ * Everything else in this file is only declared if it is.
+ */
+#define HAVE_URING
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+#ifndef __GNUC__
+#define __attribute__(x)
+#endif
+
+/**
+ * @brief An io_uring instance, set up with plain system calls so liburing is not needed.<br>
+ * It is not safe to share between threads.
+ */
+struct uring;
+
+/**
+ * @brief Sets up an io_uring instance.
+ *
+ * @param entries How many requests can be queued at once. The kernel rounds this up to a power of 2.
+ *
+ * @return The new instance, or NULL if io_uring is not available (a kernel before 5.1, or a sandbox that blocks it).<br>
+ * This must be uring_free()'d when no longer in use.
+ */
+struct uring* uring_new(unsigned entries) __attribute__((malloc));
+
+/**
+ * @brief Returns how many completions the instance can hold.<br>
+ * No more than this many requests should be in flight at once, or completions are lost.
+ *
+ * @param ring The instance.
+ *
+ * @return The size of its completion ring.
+ */
+unsigned uring_cq_entries(const struct uring* ring);
+
+/**
+ * @brief Pins buffers in memory so IORING_OP_READ_FIXED and IORING_OP_WRITE_FIXED can use them without the kernel mapping them for every request.
+ *
+ * @param ring The instance.
+ *
+ * @param iov The buffers. sqe->buf_index is an index into this array.
+ *
+ * @param n How many buffers there are.
+ *
+ * @return 0 on success, or negative if they could not be registered, usually because RLIMIT_MEMLOCK is too low.
+ */
+int uring_register_buffers(struct uring* ring, const struct iovec* iov, unsigned n);
+
+/**
+ * @brief Returns the next free submission entry, zeroed.<br>
+ * It is not seen by the kernel until the next uring_enter().
+ *
+ * @param ring The instance.
+ *
+ * @return The entry, or NULL if the submission ring is full.
+ */
+struct io_uring_sqe* uring_get_sqe(struct uring* ring);
+
+/**
+ * @brief Submits every entry queued since the last call, and waits for completions.
+ *
+ * @param ring The instance.
+ *
+ * @param wait_nr How many completions to wait for, or 0 to only submit.
+ *
+ * @return 0 on success, or negative on failure.<br>
+ * Being interrupted by a signal is not a failure, so fewer than wait_nr completions may be ready.
+ */
+int uring_enter(struct uring* ring, unsigned wait_nr);
+
+/**
+ * @brief Returns the oldest completion that has not been uring_seen().
+ *
+ * @param ring The instance.
+ *
+ * @return The completion, or NULL if there is none yet.
+ */
+const struct io_uring_cqe* uring_peek(const struct uring* ring);
+
+/**
+ * @brief Hands the completion returned by uring_peek() back to the kernel.
+ *
+ * @param ring The instance.
+ *
+ * @return void
+ */
+void uring_seen(struct uring* ring);
+
+/**
+ * @brief Frees an io_uring instance.<br>
+ * Requests that are still in flight are cancelled by the kernel.
+ *
+ * @param ring The instance. This can be NULL.
+ *
+ * @return void
+ */
+void uring_free(struct uring* ring);
+
+#endif
+
+#endif
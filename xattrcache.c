@@ -0,0 +1,168 @@
+/** @file xattrcache.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "xattrcache.h"
+#include "checksum.h"
+#include "treehash.h"
+#include "log.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/xattr.h>
+
+/* the modification time and size, then the checksum string without its terminator */
+#define XATTR_META_LEN 16
+#define XATTR_VALUE_LEN (XATTR_META_LEN + CHECKSUM_MAX_DIGEST_LEN * 2 + sizeof(TREE_HASH_PREFIX))
+
+static void put_u64(unsigned char* p, uint64_t val){
+	int i;
+	for (i = 0; i < 8; ++i){
+		p[i] = (unsigned char)(val >> (i * 8));
+	}
+}
+
+static uint64_t get_u64(const unsigned char* p){
+	uint64_t val = 0;
+	int i;
+	for (i = 7; i >= 0; --i){
+		val = (val << 8) | p[i];
+	}
+	return val;
+}
+
+/* e.g. "user.ezbackup.sha256.tree" */
+static int make_name(const EVP_MD* md, int tree, char* out, size_t out_len){
+	const char* md_name = get_evp_md_name(md ? md : EVP_sha1());
+	size_t len;
+	size_t i;
+
+	if (!md_name){
+		log_error("Failed to determine the name of the digest algorithm");
+		return -1;
+	}
+	len = sizeof(XATTR_CACHE_PREFIX) - 1 + strlen(md_name) + sizeof(".tree");
+	if (len > out_len){
+		log_error_ex("Digest name %s is too long for the checksum cache", md_name);
+		return -1;
+	}
+	sprintf(out, "%s%s%s", XATTR_CACHE_PREFIX, md_name, tree ? ".tree" : "");
+	/* OpenSSL and the built-in digests do not agree on case */
+	for (i = sizeof(XATTR_CACHE_PREFIX) - 1; out[i]; ++i){
+		out[i] = tolower((unsigned char)out[i]);
+	}
+	return 0;
+}
+
+/* the file cannot hold the cache, as opposed to something going wrong */
+static int unsupported(int err){
+	return err == ENOTSUP || err == EOPNOTSUPP || err == EPERM || err == EACCES || err == EROFS || err == ENOSPC || err == E2BIG;
+}
+
+int xattr_cache_get(const char* file, const EVP_MD* md, int tree, const struct file_meta* meta, char** out){
+	unsigned char value[XATTR_VALUE_LEN];
+	char name[64];
+	ssize_t len;
+
+	return_ifnull(out, -1);
+	*out = NULL;
+	return_ifnull(file, -1);
+	return_ifnull(meta, -1);
+
+	if (make_name(md, tree, name, sizeof(name)) != 0){
+		return -1;
+	}
+
+	len = getxattr(file, name, value, sizeof(value));
+	if (len < 0){
+		if (errno == ENODATA || errno == ERANGE || unsupported(errno)){
+			return 1;
+		}
+		log_debug_ex2("Failed to read the checksum cache of %s (%s)", file, strerror(errno));
+		return -1;
+	}
+	if (len <= XATTR_META_LEN){
+		log_debug_ex("Checksum cache of %s is corrupt", file);
+		return 1;
+	}
+	if (get_u64(value) != meta->mtime || get_u64(value + 8) != meta->size){
+		return 1;
+	}
+
+	*out = malloc(len - XATTR_META_LEN + 1);
+	if (!*out){
+		log_enomem();
+		return -1;
+	}
+	memcpy(*out, value + XATTR_META_LEN, len - XATTR_META_LEN);
+	(*out)[len - XATTR_META_LEN] = '\0';
+	return 0;
+}
+
+int xattr_cache_set(const char* file, const EVP_MD* md, int tree, const struct file_meta* meta, const char* checksum){
+	unsigned char value[XATTR_VALUE_LEN];
+	char name[64];
+	size_t checksum_len;
+
+	return_ifnull(file, -1);
+	return_ifnull(meta, -1);
+	return_ifnull(checksum, -1);
+
+	checksum_len = strlen(checksum);
+	if (checksum_len > sizeof(value) - XATTR_META_LEN){
+		log_debug_ex("Checksum of %s is too long to cache", file);
+		return 1;
+	}
+	if (make_name(md, tree, name, sizeof(name)) != 0){
+		return -1;
+	}
+
+	put_u64(value, meta->mtime);
+	put_u64(value + 8, meta->size);
+	memcpy(value + XATTR_META_LEN, checksum, checksum_len);
+
+	if (setxattr(file, name, value, XATTR_META_LEN + checksum_len, 0) != 0){
+		if (unsupported(errno)){
+			log_debug_ex2("Cannot cache the checksum of %s (%s)", file, strerror(errno));
+			return 1;
+		}
+		log_warning_ex2("Failed to cache the checksum of %s (%s)", file, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int xattr_cache_checksum(const char* file, const EVP_MD* md, int tree, unsigned n_threads, struct file_meta* meta, char** out){
+	struct file_meta meta_after;
+	int res;
+
+	return_ifnull(file, -1);
+	return_ifnull(out, -1);
+	*out = NULL;
+
+	if (meta && xattr_cache_get(file, md, tree, meta, out) == 0){
+		log_info_ex("Using the cached checksum of %s", file);
+		return 0;
+	}
+
+	if (tree_hash_file(file, md, tree ? TREE_HASH_SEGMENT_LEN : 0, n_threads, out) != 0){
+		return -1;
+	}
+	if (!meta || xattr_cache_set(file, md, tree, meta, *out) != 0){
+		return 0;
+	}
+
+	/* setting the attribute changed the status change time, which would make the next backup think the file changed
+	 * anything else that changed the file in the meantime changed its modification time too, so the old metadata stays in that case */
+	res = get_file_meta(file, &meta_after);
+	if (res >= 0 && meta_after.mtime == meta->mtime && meta_after.size == meta->size && meta_after.ino == meta->ino){
+		*meta = meta_after;
+	}
+	return 0;
+}
@@ -0,0 +1,86 @@
+/** @file xattrcache.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __XATTRCACHE_H
+#define __XATTRCACHE_H
+
+#include "checksumsort.h"
+#include <openssl/evp.h>
+
+/**
+ * @brief Starts the name of every extended attribute the checksum cache uses.<br>
+ * The rest of the name is the digest algorithm, followed by ".tree" for tree hashes, e.g. "user.ezbackup.sha1.tree".
+ */
+#define XATTR_CACHE_PREFIX "user.ezbackup."
+
+/**
+ * @brief Looks up a file's cached checksum.<br>
+ * <br>
+ * The checksum cache keeps a file's checksum in an extended attribute on the file itself, along with its modification time and size when it was hashed.<br>
+ * The checksum is only returned if both still match, so every backup of the file can skip reading it until it changes, no matter which output directory it goes to.
+ *
+ * @param file Path to the file.
+ *
+ * @param md The digest algorithm of the checksum.<br>
+ * If this is NULL, SHA-1 is used.
+ *
+ * @param tree Non-zero for a tree hash, or 0 for a plain digest. @see treehash.h
+ *
+ * @param meta The file's current metadata.
+ *
+ * @param out A pointer to a string that will contain the checksum.<br>
+ * This string must be free()'d when no longer in use. It is set to NULL if there is no checksum.
+ *
+ * @return 0 if the checksum was found, positive if there is no cached checksum or it is out of date, or negative on error.
+ */
+int xattr_cache_get(const char* file, const EVP_MD* md, int tree, const struct file_meta* meta, char** out);
+
+/**
+ * @brief Stores a file's checksum in the checksum cache.
+ * @see xattr_cache_get()
+ *
+ * @param file Path to the file.
+ *
+ * @param md The digest algorithm of the checksum.<br>
+ * If this is NULL, SHA-1 is used.
+ *
+ * @param tree Non-zero for a tree hash, or 0 for a plain digest.
+ *
+ * @param meta The file's metadata from before it was hashed.
+ *
+ * @param checksum The checksum.
+ *
+ * @return 0 on success, positive if the file cannot have extended attributes (e.g. its filesystem does not support them or it is read-only), or negative on error.
+ */
+int xattr_cache_set(const char* file, const EVP_MD* md, int tree, const struct file_meta* meta, const char* checksum);
+
+/**
+ * @brief Computes the checksum of a file, using the checksum cache if possible.<br>
+ * On a miss, the file is hashed with tree_hash_file() and the result is cached.
+ *
+ * @param file Path to the file.
+ *
+ * @param md The digest algorithm to use.<br>
+ * If this is NULL, SHA-1 is used.
+ *
+ * @param tree Non-zero to compute a tree hash, or 0 for a plain digest.
+ *
+ * @param n_threads The maximum number of segments to hash at once. @see tree_hash_file()
+ *
+ * @param meta The file's metadata from before it was hashed.<br>
+ * Storing a checksum changes the file's status change time, so this is updated to match if the file did not change otherwise.<br>
+ * If this is NULL, the cache is not used.
+ *
+ * @param out A pointer to a string that will contain the checksum.<br>
+ * This string must be free()'d when no longer in use. It is set to NULL on failure.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int xattr_cache_checksum(const char* file, const EVP_MD* md, int tree, unsigned n_threads, struct file_meta* meta, char** out);
+
+#endif
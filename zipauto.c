@@ -0,0 +1,245 @@
+/** @file zipauto.c
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "zipauto.h"
+#include "stats.h"
+#include "log.h"
+#include "strings/stringhelper.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* what is kept next to the checksum file, since every file in a backup directory has to be restored with the same compressor */
+#define ZIP_AUTO_FILE "compressor"
+
+/* each compressor's levels go from fastest to slowest, which zip_pick() and zip_level_step() both depend on */
+static const struct{
+	enum compressor c_type;
+	int level;
+}candidates[] = {
+#ifndef NO_LZ4_SUPPORT
+	{ COMPRESSOR_LZ4, 0 },
+	{ COMPRESSOR_LZ4, 1 },
+	{ COMPRESSOR_LZ4, 6 },
+#endif
+#ifndef NO_ZSTD_SUPPORT
+	{ COMPRESSOR_ZSTD, 1 },
+	{ COMPRESSOR_ZSTD, 2 },
+	{ COMPRESSOR_ZSTD, 3 },
+	{ COMPRESSOR_ZSTD, 5 },
+	{ COMPRESSOR_ZSTD, 7 },
+#endif
+#ifndef NO_GZIP_SUPPORT
+	{ COMPRESSOR_GZIP, 1 },
+	{ COMPRESSOR_GZIP, 6 },
+	{ COMPRESSOR_GZIP, 9 },
+#endif
+#ifndef NO_BZIP2_SUPPORT
+	{ COMPRESSOR_BZIP2, 9 },
+#endif
+#ifndef NO_XZ_SUPPORT
+	{ COMPRESSOR_XZ, 1 },
+	{ COMPRESSOR_XZ, 6 },
+#endif
+	{ COMPRESSOR_NONE, 0 }
+};
+/* the last entry only keeps the list from being empty */
+#define N_CANDIDATES (sizeof(candidates) / sizeof(candidates[0]) - 1)
+
+static int count_sink(const void* data, size_t len, void* out_len){
+	(void)data;
+	*(size_t*)out_len += len;
+	return 0;
+}
+
+double zip_speed(enum compressor c_type, int compression_level, unsigned flags, const void* sample, size_t len, size_t* out_len){
+	struct stats_time start;
+	struct stats_time end;
+	struct zip_buffer zb;
+	size_t written = 0;
+
+	return_ifnull(sample, -1.0);
+
+	/* only read from, so the const can go */
+	zb.data = (unsigned char*)sample;
+	zb.len = len;
+	zb.size = len;
+	zb.pos = 0;
+
+	stats_time_now(&start);
+	if (zip_compress_stream(c_type, compression_level, flags, zip_buffer_source, &zb, count_sink, &written) != 0){
+		log_error_ex("Failed to measure %s", compressor_tostring(c_type));
+		return -1.0;
+	}
+	stats_time_now(&end);
+
+	if (out_len){
+		*out_len = written;
+	}
+	/* measured on the uncompressed side, so levels are compared over the same input */
+	return stats_per_second((double)len / (1 << 20), end.wall - start.wall);
+}
+
+int zip_pick(const void* sample, size_t len, unsigned long target, unsigned flags, unsigned n_streams, enum compressor* c_type, int* out_level){
+	enum compressor skip = COMPRESSOR_INVALID;
+	long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	double best_speed = -1.0;
+	double fastest_speed = -1.0;
+	size_t best = N_CANDIDATES;
+	size_t fastest = N_CANDIDATES;
+	size_t best_len = 0;
+	size_t i;
+
+	return_ifnull(sample, -1);
+	return_ifnull(c_type, -1);
+	return_ifnull(out_level, -1);
+
+	/* more streams than processors do not get any faster */
+	if (n_streams == 0 || (n_cpus > 0 && n_streams > (unsigned long)n_cpus)){
+		n_streams = n_cpus > 0 ? (unsigned)n_cpus : 1;
+	}
+
+	for (i = 0; i < N_CANDIDATES; ++i){
+		size_t c_len;
+		double speed;
+
+		if ((*c_type != COMPRESSOR_INVALID && candidates[i].c_type != *c_type) || candidates[i].c_type == skip){
+			continue;
+		}
+		speed = zip_speed(candidates[i].c_type, candidates[i].level, flags, sample, len, &c_len);
+		if (speed < 0){
+			continue;
+		}
+		log_debug_ex2("%s: %.1f MiB/s", compressor_tostring(candidates[i].c_type), speed);
+
+		if (speed > fastest_speed){
+			fastest_speed = speed;
+			fastest = i;
+		}
+		/* the slower levels of the same compressor would miss it too */
+		if (speed * (1 << 20) * n_streams < (double)target){
+			skip = candidates[i].c_type;
+			continue;
+		}
+		if (best == N_CANDIDATES || c_len < best_len || (c_len == best_len && speed > best_speed)){
+			best = i;
+			best_len = c_len;
+			best_speed = speed;
+		}
+	}
+
+	if (best == N_CANDIDATES){
+		if (fastest == N_CANDIDATES){
+			log_error("Failed to measure any compressor");
+			return -1;
+		}
+		log_info("No compressor keeps up with the target, so the fastest one is used");
+		best = fastest;
+	}
+	*c_type = candidates[best].c_type;
+	*out_level = candidates[best].level;
+	return 0;
+}
+
+int zip_level_step(enum compressor c_type, int compression_level, int faster){
+	size_t i;
+	size_t j;
+
+	for (i = 0; i < N_CANDIDATES; ++i){
+		if (candidates[i].c_type == c_type && candidates[i].level == compression_level){
+			break;
+		}
+	}
+	if (i == N_CANDIDATES){
+		return compression_level;
+	}
+
+	/* the candidates of one compressor are next to each other */
+	j = faster ? i - 1 : i + 1;
+	if ((faster && i == 0) || j >= N_CANDIDATES || candidates[j].c_type != c_type){
+		return compression_level;
+	}
+	return candidates[j].level;
+}
+
+int zip_auto_load(const char* output_directory, enum compressor* out){
+	char* path;
+	FILE* fp;
+	char buf[64];
+	char* newline;
+	enum compressor c_type;
+
+	return_ifnull(output_directory, -1);
+	return_ifnull(out, -1);
+
+	if (!(path = sh_concat_path(sh_dup(output_directory), ZIP_AUTO_FILE))){
+		log_enomem();
+		return -1;
+	}
+	fp = fopen(path, "rb");
+	if (!fp){
+		free(path);
+		return 1;
+	}
+	if (!fgets(buf, sizeof(buf), fp)){
+		log_warning_ex("%s is empty", path);
+		fclose(fp);
+		free(path);
+		return -1;
+	}
+	fclose(fp);
+	if ((newline = strchr(buf, '\n')) != NULL){
+		*newline = '\0';
+	}
+
+	c_type = get_compressor_byname(buf);
+	if (c_type == COMPRESSOR_INVALID){
+		log_warning_ex2("%s names an unknown compressor (%s)", path, buf);
+		free(path);
+		return -1;
+	}
+	free(path);
+	*out = c_type;
+	return 0;
+}
+
+int zip_auto_save(const char* output_directory, enum compressor c_type){
+	const char* name = compressor_tostring(c_type);
+	char* path;
+	FILE* fp;
+	int ret = 0;
+
+	return_ifnull(output_directory, -1);
+	return_ifnull(name, -1);
+
+	if (!(path = sh_concat_path(sh_dup(output_directory), ZIP_AUTO_FILE))){
+		log_enomem();
+		return -1;
+	}
+	fp = fopen(path, "wb");
+	if (!fp){
+		log_efopen(path);
+		ret = -1;
+		goto cleanup;
+	}
+	if (fprintf(fp, "%s\n", name) < 0){
+		log_efwrite(path);
+		ret = -1;
+		goto cleanup;
+	}
+
+cleanup:
+	if (fp && fclose(fp) != 0){
+		log_efclose(path);
+		ret = -1;
+	}
+	free(path);
+	return ret;
+}
@@ -0,0 +1,107 @@
+/** @file zipauto.h
+ *
+ * Copyright (c) 2018 Jonathan Lemos
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef __ZIPAUTO_H
+#define __ZIPAUTO_H
+
+#include "compression/zip.h"
+#include <stddef.h>
+
+/**
+ * @brief Name passed to -c to pick the compressor and level from a throughput target.
+ * @see zip_pick()
+ */
+#define ZIP_AUTO_NAME "auto"
+
+/**
+ * @brief The throughput target -c auto uses when --compress-target is not given, in bytes per second.<br>
+ * This is about what a single hard drive can read.
+ */
+#define ZIP_AUTO_TARGET (200UL << 20)
+
+/**
+ * @brief Measures how fast a compressor is on a sample of data.
+ *
+ * @param c_type The compressor to measure.
+ *
+ * @param compression_level The compression level to measure.
+ *
+ * @param flags The compression flags to use, including ZIP_WORKERS().
+ *
+ * @param sample The data to compress.
+ *
+ * @param len The length of the sample in bytes.
+ *
+ * @param out_len Set to how long the compressed sample was. This can be NULL.
+ *
+ * @return The speed in MiB of input per second, or negative on failure.
+ */
+double zip_speed(enum compressor c_type, int compression_level, unsigned flags, const void* sample, size_t len, size_t* out_len);
+
+/**
+ * @brief Picks the compressor and level that shrink a sample the most while still keeping up with a throughput target.<br>
+ * Candidates are measured from fastest to slowest, and a compressor's slower levels are skipped once one of its levels misses the target.
+ *
+ * @param sample A sample of the data that will be compressed.
+ *
+ * @param len The length of the sample in bytes.
+ *
+ * @param target The throughput to keep up with, in bytes of input per second.
+ *
+ * @param flags The compression flags to use, including ZIP_WORKERS().
+ *
+ * @param n_streams How many files are compressed at the same time. Each candidate's speed is multiplied by this, up to the number of online processors.
+ *
+ * @param c_type The compressor to use.<br>
+ * If this is COMPRESSOR_INVALID, every compressor is considered and this is set to the one picked.<br>
+ * Otherwise, only the levels of this compressor are considered.
+ *
+ * @param out_level Set to the compression level picked.
+ *
+ * @return 0 on success, or negative on failure.<br>
+ * If no candidate keeps up with the target, the fastest one is picked.
+ */
+int zip_pick(const void* sample, size_t len, unsigned long target, unsigned flags, unsigned n_streams, enum compressor* c_type, int* out_level);
+
+/**
+ * @brief Gets the next faster or slower level zip_pick() would consider for a compressor.<br>
+ * This lets a level picked at the start be adjusted as the real throughput becomes known.
+ *
+ * @param c_type The compressor.
+ *
+ * @param compression_level The current level.
+ *
+ * @param faster Non-zero for the next faster level, or 0 for the next slower one.
+ *
+ * @return The next level, or compression_level if there is none in that direction.
+ */
+int zip_level_step(enum compressor c_type, int compression_level, int faster);
+
+/**
+ * @brief Reads the compressor a backup directory was made with.
+ *
+ * @param output_directory The backup directory.
+ *
+ * @param out Set to the recorded compressor.
+ *
+ * @return 0 on success, positive if there is no record, or negative if the record could not be read.
+ */
+int zip_auto_load(const char* output_directory, enum compressor* out);
+
+/**
+ * @brief Records the compressor a backup directory is made with, so restore() and the next backup use the same one.
+ *
+ * @param output_directory The backup directory.
+ *
+ * @param c_type The compressor.
+ *
+ * @return 0 on success, or negative on failure.
+ */
+int zip_auto_save(const char* output_directory, enum compressor c_type);
+
+#endif